@@ -0,0 +1,243 @@
+/* upstart
+ *
+ * test_file_bridge.c - test suite for extra/upstart-file-bridge.c
+ *
+ * Copyright © 2013 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <limits.h>
+
+#include <nih/test.h>
+#include <nih-dbus/test_dbus.h>
+
+/* The bridge's own main() is kept out of the way of the test suite's */
+#define main file_bridge_main
+#include "upstart-file-bridge.c"
+#undef main
+
+
+/**
+ * dispatch_until_sent:
+ * @connection: client connection.
+ *
+ * Dispatch messages received on @connection until a handler has queued
+ * a method call of its own, then send it.
+ **/
+static void
+dispatch_until_sent (DBusConnection *connection)
+{
+	do {
+		dbus_connection_read_write_dispatch (connection, -1);
+	} while (! dbus_connection_has_messages_to_send (connection));
+
+	dbus_connection_flush (connection);
+}
+
+/**
+ * expect_emit_event:
+ * @connection: server connection,
+ * @path: expected value of FILE.
+ *
+ * Receive the next method call on @connection, check that it is an
+ * EmitEvent call for a file create event on @path and acknowledge it.
+ **/
+static void
+expect_emit_event (DBusConnection *connection,
+		   const char     *path)
+{
+	DBusMessage *method_call;
+	DBusMessage *reply;
+	const char  *name_value;
+	char **      args_value;
+	int          args_elements;
+	int          wait_value;
+	char         file[PATH_MAX];
+
+	TEST_DBUS_MESSAGE (connection, method_call);
+
+	TEST_TRUE (dbus_message_is_method_call (method_call,
+						DBUS_INTERFACE_UPSTART,
+						"EmitEvent"));
+
+	TEST_TRUE (dbus_message_get_args (method_call, NULL,
+					  DBUS_TYPE_STRING, &name_value,
+					  DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &args_value, &args_elements,
+					  DBUS_TYPE_BOOLEAN, &wait_value,
+					  DBUS_TYPE_INVALID));
+
+	sprintf (file, "FILE=%s", path);
+
+	TEST_EQ_STR (name_value, FILE_EVENT);
+	TEST_EQ (args_elements, 2);
+	TEST_EQ_STR (args_value[0], file);
+	TEST_EQ_STR (args_value[1], "EVENT=create");
+	dbus_free_string_array (args_value);
+
+	TEST_FALSE (wait_value);
+
+	reply = dbus_message_new_method_return (method_call);
+	dbus_connection_send (connection, reply, NULL);
+	dbus_connection_flush (connection);
+
+	dbus_message_unref (method_call);
+	dbus_message_unref (reply);
+}
+
+/**
+ * reject_emit_events:
+ * @connection: server connection,
+ * @name: D-Bus error to reply with.
+ *
+ * Receive the next method call on @connection, check that it is an
+ * EmitEvents call and reply to it with the @name error.
+ **/
+static void
+reject_emit_events (DBusConnection *connection,
+		    const char     *name)
+{
+	DBusMessage *method_call;
+	DBusMessage *reply;
+
+	TEST_DBUS_MESSAGE (connection, method_call);
+
+	TEST_TRUE (dbus_message_is_method_call (method_call,
+						DBUS_INTERFACE_UPSTART,
+						"EmitEvents"));
+
+	reply = dbus_message_new_error (method_call, name, "Rejected");
+	dbus_connection_send (connection, reply, NULL);
+	dbus_connection_flush (connection);
+
+	dbus_message_unref (method_call);
+	dbus_message_unref (reply);
+}
+
+
+void
+test_emit_pending_events (void)
+{
+	pid_t           dbus_pid;
+	DBusConnection *server_conn;
+	DBusConnection *client_conn;
+	DBusMessage *   message;
+
+	TEST_FUNCTION ("emit_pending_events");
+	TEST_DBUS (dbus_pid);
+	TEST_DBUS_OPEN (server_conn);
+	TEST_DBUS_OPEN (client_conn);
+
+	assert (dbus_bus_request_name (server_conn, DBUS_SERVICE_UPSTART,
+				       0, NULL)
+			== DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER);
+
+	TEST_DBUS_MESSAGE (server_conn, message);
+	assert (dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+					"NameAcquired"));
+	dbus_message_unref (message);
+
+	upstart = nih_dbus_proxy_new (NULL, client_conn,
+				      DBUS_SERVICE_UPSTART, DBUS_PATH_UPSTART,
+				      NULL, NULL);
+	TEST_NE_P (upstart, NULL);
+
+
+	/* Check that when Upstart rejects a batch in its reply, such as
+	 * because one of the events is bad, each of the events is then
+	 * emitted on its own; and that the next batch is emitted together
+	 * again.
+	 */
+	TEST_FEATURE ("with batch rejected");
+	emit_event ("/foo", IN_CREATE, NULL);
+	emit_event ("/bar", IN_CREATE, NULL);
+
+	emit_pending_events (NULL, NULL);
+	dbus_connection_flush (client_conn);
+
+	TEST_EQ_P (pending_events, NULL);
+	TEST_EQ (pending_events_len, 0);
+
+	reject_emit_events (server_conn, DBUS_ERROR_INVALID_ARGS);
+	dispatch_until_sent (client_conn);
+
+	expect_emit_event (server_conn, "/foo");
+	expect_emit_event (server_conn, "/bar");
+
+	TEST_FALSE (emit_events_unsupported);
+
+	emit_event ("/baz", IN_CREATE, NULL);
+
+	emit_pending_events (NULL, NULL);
+	dbus_connection_flush (client_conn);
+
+	reject_emit_events (server_conn, DBUS_ERROR_INVALID_ARGS);
+	dispatch_until_sent (client_conn);
+
+	expect_emit_event (server_conn, "/baz");
+
+
+	/* Check that when Upstart does not support EmitEvents at all,
+	 * the events of the batch are emitted one at a time and that
+	 * later events go straight to EmitEvent.
+	 */
+	TEST_FEATURE ("with EmitEvents unsupported");
+	emit_event ("/foo", IN_CREATE, NULL);
+	emit_event ("/bar", IN_CREATE, NULL);
+
+	emit_pending_events (NULL, NULL);
+	dbus_connection_flush (client_conn);
+
+	reject_emit_events (server_conn, DBUS_ERROR_UNKNOWN_METHOD);
+	dispatch_until_sent (client_conn);
+
+	expect_emit_event (server_conn, "/foo");
+	expect_emit_event (server_conn, "/bar");
+
+	TEST_TRUE (emit_events_unsupported);
+
+	emit_event ("/baz", IN_CREATE, NULL);
+
+	emit_pending_events (NULL, NULL);
+	dbus_connection_flush (client_conn);
+
+	TEST_EQ_P (pending_events, NULL);
+
+	expect_emit_event (server_conn, "/baz");
+
+	emit_events_unsupported = FALSE;
+
+
+	nih_free (upstart);
+	upstart = NULL;
+
+	TEST_DBUS_CLOSE (client_conn);
+	TEST_DBUS_CLOSE (server_conn);
+	TEST_DBUS_END (dbus_pid);
+
+	dbus_shutdown ();
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	nih_error_init ();
+	program_name = "test";
+
+	test_emit_pending_events ();
+
+	return 0;
+}
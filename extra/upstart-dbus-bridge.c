@@ -39,6 +39,7 @@
 #include <nih/error.h>
 
 #include <nih-dbus/dbus_connection.h>
+#include <nih-dbus/dbus_error.h>
 #include <nih-dbus/dbus_proxy.h>
 
 #include "dbus/upstart.h"
@@ -52,6 +53,43 @@
  **/
 #define DBUS_EVENT "dbus"
 
+/**
+ * GLOB_CHARS:
+ *
+ * Characters that make a value in a job condition a pattern rather than
+ * a literal value, or that cannot be quoted in a match rule.
+ **/
+#define GLOB_CHARS "*?[]\\$'"
+
+/**
+ * Structure we use for tracking jobs
+ *
+ * @entry: list header, 
+ * @path: D-Bus path of job being tracked,
+ * @rules: match rules added to the bus for the job's conditions.
+ **/
+typedef struct job {
+	NihList entry;
+	char *path;
+	char **rules;
+} Job;
+
+/**
+ * MatchRule:
+ *
+ * @entry: list header,
+ * @rule: D-Bus match rule,
+ * @refs: number of job conditions the rule was added for.
+ *
+ * Structure we use for tracking the match rules added to the bus, so
+ * that a rule shared by several jobs is only added and removed once.
+ **/
+typedef struct match_rule {
+	NihList entry;
+	char *rule;
+	int refs;
+} MatchRule;
+
 /* Prototypes for static functions */
 static int               bus_name_setter      (NihOption *option, const char *arg);
 static int               dbus_bus_setter      (NihOption *option, const char *arg);
@@ -64,6 +102,19 @@ static void              upstart_job_added    (void *data, NihDBusMessage *messa
 					       const char *job);
 static void              upstart_job_removed  (void *data, NihDBusMessage *message,
 					       const char *job);
+static void              upstart_jobs_changed (void *data, NihDBusMessage *message,
+					       UpstartJobsChangedAddedElement * const *added,
+					       char * const *removed);
+static void              upstart_get_jobs     (void);
+static void              job_conditions_add   (const char *job_class_path,
+					       char ***start_on, char ***stop_on);
+static int               job_destroy          (Job *job);
+static void              job_add_rule         (char ***rules, size_t *len,
+					       char **event);
+static char *            job_match_rule       (const void *parent, char **event)
+	__attribute__ ((warn_unused_result));
+static void              match_rule_ref       (const char *rule);
+static void              match_rule_unref     (const char *rule);
 
 /**
  * daemonise:
@@ -102,22 +153,26 @@ DBusBusType dbus_bus = (DBusBusType)-1;
 static const char * bus_name = NULL;
 
 /**
- * Structure we use for tracking jobs
+ * jobs:
  *
- * @entry: list header, 
- * @path: D-Bus path of job being tracked.
+ * Jobs that we're monitoring.
  **/
-typedef struct job {
-	NihList entry;
-	char *path;
-} Job;
+static NihHash *jobs = NULL;
 
 /**
- * jobs:
+ * match_rules:
  *
- * Jobs that we're monitoring.
+ * Match rules added to the bus, so that we only receive the signals
+ * that jobs are waiting for.
  **/
-static NihHash *jobs = NULL;
+static NihHash *match_rules = NULL;
+
+/**
+ * bus_connection:
+ *
+ * Connection to the D-Bus bus signals are received from.
+ **/
+static DBusConnection *bus_connection = NULL;
 
 /**
  * always:
@@ -164,7 +219,7 @@ main (int   argc,
 	nih_local char     **user_session_path = NULL;
 	char                *path_element = NULL;
 	DBusError            error;
-	char               **job_class_paths;
+	UpstartGetAllJobConditionsJobsElement **job_conditions;
 
 	nih_main_init (argv[0]);
 
@@ -198,14 +253,22 @@ main (int   argc,
 		exit (EXIT_FAILURE);
 	}
 
-	dbus_bus_add_match (dbus_connection, "type='signal'", &error);
+	bus_connection = dbus_connection;
 
-	if (dbus_error_is_set (&error)) {
-		nih_fatal ("%s: %s %s", _("Could not add D-Bus signal match"),
-			   error.name, error.message);
-		dbus_error_free (&error);
+	/* Unless asked to emit events for all signals, match rules are
+	 * added for the conditions of jobs as they are found so that the
+	 * bus only sends us the signals they are waiting for.
+	 */
+	if (always) {
+		dbus_bus_add_match (dbus_connection, "type='signal'", &error);
 
-		exit (EXIT_FAILURE);
+		if (dbus_error_is_set (&error)) {
+			nih_fatal ("%s: %s %s", _("Could not add D-Bus signal match"),
+				   error.name, error.message);
+			dbus_error_free (&error);
+
+			exit (EXIT_FAILURE);
+		}
 	}
 
 	dbus_connection_add_filter (dbus_connection, signal_filter, NULL, NULL);
@@ -236,8 +299,9 @@ main (int   argc,
 		exit (EXIT_FAILURE);
 	}
 
-	/* Allocate jobs hash table */
+	/* Allocate jobs and match rules hash tables */
 	jobs = NIH_MUST (nih_hash_string_new (NULL, 0));
+	match_rules = NIH_MUST (nih_hash_string_new (NULL, 0));
 
 	upstart = NIH_SHOULD (nih_dbus_proxy_new (NULL, connection,
 				NULL, DBUS_PATH_UPSTART,
@@ -254,49 +318,51 @@ main (int   argc,
 		exit (EXIT_FAILURE);
 	}
 
-	/* Connect signals to be notified when jobs come and go */
-	if (! nih_dbus_proxy_connect (upstart, &upstart_com_ubuntu_Upstart0_6, "JobAdded",
-				      (NihDBusSignalHandler)upstart_job_added, NULL)) {
+	/* Connect signal to be notified when jobs come and go, in one
+	 * batch each time the configuration changes.
+	 */
+	if (! nih_dbus_proxy_connect (upstart, &upstart_com_ubuntu_Upstart0_6, "JobsChanged",
+				      (NihDBusSignalHandler)upstart_jobs_changed, NULL)) {
 		NihError *err;
 
 		err = nih_error_get ();
-		nih_fatal ("%s: %s", _("Could not create JobAdded signal connection"),
+		nih_fatal ("%s: %s", _("Could not create JobsChanged signal connection"),
 			   err->message);
 		nih_free (err);
 
 		exit (EXIT_FAILURE);
 	}
 
-	if (! nih_dbus_proxy_connect (upstart, &upstart_com_ubuntu_Upstart0_6, "JobRemoved",
-				      (NihDBusSignalHandler)upstart_job_removed, NULL)) {
-		NihError *err;
+	/* Request the conditions of all current jobs in one call, falling
+	 * back to asking each job for them when Upstart is too old to
+	 * support that.
+	 */
+	if (upstart_get_all_job_conditions_sync (NULL, upstart,
+						 &job_conditions) < 0) {
+		NihDBusError *dbus_err;
 
-		err = nih_error_get ();
-		nih_fatal ("%s: %s", _("Could not create JobRemoved signal connection"),
-			   err->message);
-		nih_free (err);
+		dbus_err = (NihDBusError *)nih_error_get ();
+		if ((dbus_err->number != NIH_DBUS_ERROR)
+		    || strcmp (dbus_err->name, DBUS_ERROR_UNKNOWN_METHOD)) {
+			nih_fatal ("%s: %s", _("Could not obtain job conditions"),
+				   dbus_err->message);
+			nih_free (dbus_err);
 
-		exit (EXIT_FAILURE);
-	}
+			exit (EXIT_FAILURE);
+		}
 
-	/* Request a list of all current jobs */
-	if (upstart_get_all_jobs_sync (NULL, upstart, &job_class_paths) < 0) {
-		NihError *err;
+		nih_free (dbus_err);
 
-		err = nih_error_get ();
-		nih_fatal ("%s: %s", _("Could not obtain job list"),
-			   err->message);
-		nih_free (err);
+		upstart_get_jobs ();
+	} else {
+		for (UpstartGetAllJobConditionsJobsElement **job = job_conditions;
+		     *job; job++)
+			job_conditions_add ((*job)->item0, (*job)->item1,
+					    (*job)->item2);
 
-		exit (EXIT_FAILURE);
+		nih_free (job_conditions);
 	}
 
-	for (char **job_class_path = job_class_paths;
-	     job_class_path && *job_class_path; job_class_path++)
-		upstart_job_added (NULL, NULL, *job_class_path);
-
-	nih_free (job_class_paths);
-
 	/* Become daemon */
 	if (daemonise) {
 		/* Deal with the pidfile location when becoming a daemon.
@@ -657,19 +723,67 @@ emit_event_error (void            *data,
 	nih_free (err);
 }
 
+/**
+ * upstart_get_jobs:
+ *
+ * Obtain the list of current jobs, and the conditions of each, from an
+ * Upstart too old to support GetAllJobConditions; connecting the signals
+ * it sends as each job comes and goes, since it won't send JobsChanged.
+ **/
+static void
+upstart_get_jobs (void)
+{
+	char **job_class_paths;
+
+	/* Connect signals to be notified when jobs come and go */
+	if (! nih_dbus_proxy_connect (upstart, &upstart_com_ubuntu_Upstart0_6, "JobAdded",
+				      (NihDBusSignalHandler)upstart_job_added, NULL)) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_fatal ("%s: %s", _("Could not create JobAdded signal connection"),
+			   err->message);
+		nih_free (err);
+
+		exit (EXIT_FAILURE);
+	}
+
+	if (! nih_dbus_proxy_connect (upstart, &upstart_com_ubuntu_Upstart0_6, "JobRemoved",
+				      (NihDBusSignalHandler)upstart_job_removed, NULL)) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_fatal ("%s: %s", _("Could not create JobRemoved signal connection"),
+			   err->message);
+		nih_free (err);
+
+		exit (EXIT_FAILURE);
+	}
+
+	/* Request a list of all current jobs */
+	if (upstart_get_all_jobs_sync (NULL, upstart, &job_class_paths) < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_fatal ("%s: %s", _("Could not obtain job list"),
+			   err->message);
+		nih_free (err);
+
+		exit (EXIT_FAILURE);
+	}
+
+	for (char **job_class_path = job_class_paths;
+	     job_class_path && *job_class_path; job_class_path++)
+		upstart_job_added (NULL, NULL, *job_class_path);
+
+	nih_free (job_class_paths);
+}
+
 static void
 upstart_job_added (void            *data,
 		   NihDBusMessage  *message,
 		   const char      *job_class_path)
 {
-	/* set to TRUE if jobs start/stop conditions specify
-	 * DBUS_EVENT. Used to restrict emission of events
-	 * unnecessarily. Note that event environment matching
-	 * though is handled by Upstart.
-	 */
-	int                       add = FALSE;
-
-	Job                      *job;
 	nih_local NihDBusProxy   *job_class = NULL;
 	nih_local char         ***start_on = NULL;
 	nih_local char         ***stop_on = NULL;
@@ -716,27 +830,81 @@ upstart_job_added (void            *data,
 		return;
 	}
 
-	/* Find out whether this job listens for any DBUS events */
+	job_conditions_add (job_class_path, start_on, stop_on);
+}
+
+static void
+upstart_jobs_changed (void                                   *data,
+		      NihDBusMessage                         *message,
+		      UpstartJobsChangedAddedElement * const *added,
+		      char * const                           *removed)
+{
+	nih_assert (added != NULL);
+	nih_assert (removed != NULL);
+
+	for (char * const *job_path = removed; *job_path; job_path++)
+		upstart_job_removed (NULL, NULL, *job_path);
+
+	for (UpstartJobsChangedAddedElement * const *job = added; *job; job++)
+		job_conditions_add ((*job)->item0, (*job)->item1,
+				    (*job)->item2);
+}
+
+static void
+job_conditions_add (const char   *job_class_path,
+		    char       ***start_on,
+		    char       ***stop_on)
+{
+	/* set to TRUE if jobs start/stop conditions specify
+	 * DBUS_EVENT. Used to restrict emission of events
+	 * unnecessarily. Note that event environment matching
+	 * though is handled by Upstart.
+	 */
+	int                       add = FALSE;
+
+	Job                      *job;
+	nih_local char          **rules = NULL;
+	size_t                    rules_len = 0;
+
+	nih_assert (job_class_path != NULL);
+
+	rules = NIH_MUST (nih_str_array_new (NULL));
+
+	/* Find out whether this job listens for any DBUS events, and
+	 * which signals they could match.
+	 */
 	for (char ***event = start_on; event && *event && **event; event++)
 		if (! strcmp (**event, DBUS_EVENT)) {
 			add = TRUE;
-			break;
+			job_add_rule (&rules, &rules_len, *event);
 		}
 
-	for (char ***event = stop_on; ! add && event && *event && **event; event++)
+	for (char ***event = stop_on; event && *event && **event; event++)
 		if (! strcmp (**event, DBUS_EVENT)) {
 			add = TRUE;
-			break;
+			job_add_rule (&rules, &rules_len, *event);
 		}
 
-	if (! add)
+	/* Drop any existing record for a job that no longer listens
+	 * for any, since its configuration changed.
+	 */
+	if (! add) {
+		job = (Job *)nih_hash_lookup (jobs, job_class_path);
+		if (job)
+			nih_free (job);
+
 		return;
+	}
 
 	nih_debug ("Job got added %s for event %s", job_class_path, DBUS_EVENT);
 
-	/* Free any existing record for the job (should never happen,
-	 * but worth being safe).
+	/* Add the rules for the job before freeing any existing record,
+	 * replaced when its configuration changes, so that rules shared
+	 * with it stay in place.
 	 */
+	for (char **rule = rules; *rule; rule++)
+		match_rule_ref (*rule);
+
 	job = (Job *)nih_hash_lookup (jobs, job_class_path);
 	if (job)
 		nih_free (job);
@@ -744,9 +912,11 @@ upstart_job_added (void            *data,
 	/* Create new record for the job */
 	job = NIH_MUST (nih_new (NULL, Job));
 	job->path = NIH_MUST (nih_strdup (job, job_class_path));
+	job->rules = rules;
+	nih_ref (job->rules, job);
 
 	nih_list_init (&job->entry);
-	nih_alloc_set_destructor (job, nih_list_destroy);
+	nih_alloc_set_destructor (job, job_destroy);
 	nih_hash_add (jobs, &job->entry);
 }
 
@@ -766,3 +936,208 @@ upstart_job_removed (void            *data,
 	}
 }
 
+/**
+ * job_destroy:
+ *
+ * @job: job being destroyed.
+ *
+ * Removes the match rules added for @job, and @job from the jobs hash.
+ *
+ * Returns: zero.
+ **/
+static int
+job_destroy (Job *job)
+{
+	nih_assert (job != NULL);
+
+	for (char **rule = job->rules; rule && *rule; rule++)
+		match_rule_unref (*rule);
+
+	nih_list_destroy (&job->entry);
+
+	return 0;
+}
+
+/**
+ * job_add_rule:
+ *
+ * @rules: pointer to array of match rules,
+ * @len: length of @rules,
+ * @event: DBUS_EVENT condition of a job.
+ *
+ * Append the match rule for the signals that @event could match to
+ * @rules, unless it can never match or all signals are received anyway.
+ **/
+static void
+job_add_rule (char ***rules,
+	      size_t *len,
+	      char  **event)
+{
+	char *rule;
+
+	nih_assert (rules != NULL);
+	nih_assert (len != NULL);
+	nih_assert (event != NULL);
+
+	if (always)
+		return;
+
+	rule = job_match_rule (NULL, event);
+	if (! rule)
+		return;
+
+	NIH_MUST (nih_str_array_addp (rules, NULL, len, rule));
+}
+
+/**
+ * job_match_rule:
+ *
+ * @parent: parent object for new string,
+ * @event: DBUS_EVENT condition of a job.
+ *
+ * Build a D-Bus match rule for the signals that @event could match from
+ * its SIGNAL, INTERFACE, OBJPATH and SENDER values.  Values that are
+ * patterns or negated are left out, leaving the rule broader than
+ * necessary, since Upstart itself decides whether the event matches.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned string.  When all parents
+ * of the returned string are freed, the returned string will also be
+ * freed.
+ *
+ * Returns: newly allocated match rule, or NULL if @event can never match
+ * the events we emit.
+ **/
+static char *
+job_match_rule (const void  *parent,
+		char       **event)
+{
+	nih_local char *rule = NULL;
+	int             positional = 0;
+
+	nih_assert (event != NULL);
+	nih_assert (! strcmp (event[0], DBUS_EVENT));
+
+	rule = NIH_MUST (nih_strdup (NULL, "type='signal'"));
+
+	for (char **env = event + 1; env && *env; env++) {
+		const char *key = NULL;
+		const char *val;
+		size_t      name_len;
+
+		val = strchr (*env, '=');
+		if (! val) {
+			/* Only the first positional value has a fixed
+			 * meaning, since the variables that follow SIGNAL
+			 * depend on the signal.
+			 */
+			if (positional++)
+				continue;
+
+			key = "member";
+			val = *env;
+		} else {
+			name_len = val - *env;
+			val++;
+
+			if (! strncmp (*env, "BUS=", name_len + 1)) {
+				/* Literal bus names must be ours */
+				if ((strcspn (val, GLOB_CHARS) == strlen (val))
+				    && ((! bus_name) || strcmp (val, bus_name)))
+					return NULL;
+			} else if (! strncmp (*env, "SIGNAL=", name_len + 1)) {
+				key = "member";
+			} else if (! strncmp (*env, "INTERFACE=", name_len + 1)) {
+				key = "interface";
+			} else if (! strncmp (*env, "OBJPATH=", name_len + 1)) {
+				key = "path";
+			} else if (! strncmp (*env, "SENDER=", name_len + 1)) {
+				key = "sender";
+			}
+		}
+
+		if (! key)
+			continue;
+
+		if (strcspn (val, GLOB_CHARS) < strlen (val))
+			continue;
+
+		NIH_MUST (nih_strcat_sprintf (&rule, NULL, ",%s='%s'", key, val));
+	}
+
+	return NIH_MUST (nih_strdup (parent, rule));
+}
+
+/**
+ * match_rule_ref:
+ *
+ * @rule: D-Bus match rule.
+ *
+ * Add @rule to the bus unless it has already been added for another
+ * job condition, in which case it's only counted.
+ **/
+static void
+match_rule_ref (const char *rule)
+{
+	MatchRule *match;
+	DBusError  error;
+
+	nih_assert (rule != NULL);
+
+	match = (MatchRule *)nih_hash_lookup (match_rules, rule);
+	if (match) {
+		match->refs++;
+		return;
+	}
+
+	match = NIH_MUST (nih_new (match_rules, MatchRule));
+	nih_list_init (&match->entry);
+	nih_alloc_set_destructor (match, nih_list_destroy);
+
+	match->rule = NIH_MUST (nih_strdup (match, rule));
+	match->refs = 1;
+
+	nih_hash_add (match_rules, &match->entry);
+
+	nih_debug ("Adding D-Bus signal match %s", rule);
+
+	dbus_error_init (&error);
+	dbus_bus_add_match (bus_connection, rule, &error);
+
+	if (dbus_error_is_set (&error)) {
+		nih_warn ("%s %s: %s", _("Could not add D-Bus signal match"),
+			  rule, error.message);
+		dbus_error_free (&error);
+	}
+}
+
+/**
+ * match_rule_unref:
+ *
+ * @rule: D-Bus match rule.
+ *
+ * Remove @rule from the bus once no job condition needs it any longer.
+ **/
+static void
+match_rule_unref (const char *rule)
+{
+	MatchRule *match;
+
+	nih_assert (rule != NULL);
+
+	match = (MatchRule *)nih_hash_lookup (match_rules, rule);
+	if (! match)
+		return;
+
+	if (--match->refs)
+		return;
+
+	nih_debug ("Removing D-Bus signal match %s", rule);
+
+	/* Don't wait for the reply; there's nothing to be done if the
+	 * rule can't be removed.
+	 */
+	dbus_bus_remove_match (bus_connection, rule, NULL);
+
+	nih_free (match);
+}
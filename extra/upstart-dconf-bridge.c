@@ -30,6 +30,7 @@
 #include <string.h>
 #include <syslog.h>
 #include <ctype.h>
+#include <fnmatch.h>
 
 #include <nih/macros.h>
 #include <nih/alloc.h>
@@ -60,6 +61,15 @@ static void dconf_changed (DConfClient *client, const gchar *prefix,
 			   const gchar * const *changes, const gchar *tag,
 			   GDBusProxy *upstart);
 
+static void emit_event (GDBusProxy *upstart, char * const *env);
+
+static void queue_change (const char *key, const char *value);
+
+static gboolean emit_pending_changes (GDBusProxy *upstart);
+
+static int key_wanted (const char *key)
+	__attribute__ ((warn_unused_result));
+
 static void handle_upstart_job (GDBusProxy *proxy, gchar *sender_name,
 			 gchar *signal_name, GVariant *parameters,
 			 gpointer user_data);
@@ -67,7 +77,12 @@ static void handle_upstart_job (GDBusProxy *proxy, gchar *sender_name,
 static int handle_existing_jobs (GDBusProxy *upstart_proxy)
 	__attribute__ ((warn_unused_result));
 
-static int job_needs_event (const char *object_path)
+static int job_needs_event (const char *object_path, const void *parent,
+			    char ***keys)
+	__attribute__ ((warn_unused_result));
+
+static int condition_needs_event (GVariant *condition, const void *parent,
+				  char ***keys, int *any_key)
 	__attribute__ ((warn_unused_result));
 
 static int jobs_need_event (void)
@@ -77,13 +92,31 @@ static int jobs_need_event (void)
  * Structure we use for tracking jobs
  *
  * @entry: list header, 
- * @path: D-Bus path of job being tracked.
+ * @path: D-Bus path of job being tracked,
+ * @keys: KEY patterns of the DCONF_EVENT conditions of the job, or NULL
+ * if any key might satisfy them.
  **/
 typedef struct job {
 	NihList entry;
 	char *path;
+	char **keys;
 } Job;
 
+/**
+ * DconfChange:
+ *
+ * @entry: list header,
+ * @key: full path of changed key,
+ * @value: printed value of @key when last changed.
+ *
+ * A change waiting to be emitted once the coalescing window ends.
+ **/
+typedef struct dconf_change {
+	NihList entry;
+	char *key;
+	char *value;
+} DconfChange;
+
 /**
  * daemonise:
  *
@@ -100,6 +133,37 @@ static int daemonise = FALSE;
  */
 static int always = FALSE;
 
+/**
+ * filter:
+ *
+ * If TRUE, only emit events for keys that match the KEY of a DCONF_EVENT
+ * condition of a job.
+ **/
+static int filter = FALSE;
+
+/**
+ * coalesce:
+ *
+ * Milliseconds over which to collect changes before emitting events for
+ * them, or zero to emit an event for each change as it's seen.
+ **/
+static int coalesce = 0;
+
+/**
+ * pending_changes:
+ *
+ * Hash of DconfChange by key waiting for the coalescing window to end.
+ **/
+static NihHash *pending_changes = NULL;
+
+/**
+ * pending_source:
+ *
+ * GLib source id of the timeout ending the coalescing window, or zero
+ * if no changes are pending.
+ **/
+static guint pending_source = 0;
+
 /**
  * jobs:
  *
@@ -124,6 +188,10 @@ static NihOption options[] = {
 	  NULL, NULL, &always, NULL },
 	{ 0, "daemon", N_("Detach and run in the background"),
 	  NULL, NULL, &daemonise, NULL },
+	{ 0, "filter", N_("Only emit events for keys that jobs name"),
+	  NULL, NULL, &filter, NULL },
+	{ 0, "coalesce", N_("Milliseconds to collect changes for before emitting events"),
+	  NULL, "MS", &coalesce, nih_option_int },
 	NIH_OPTION_LAST
 };
 
@@ -158,6 +226,11 @@ main (int   argc,
 	if (! args)
 		exit (1);
 
+	if (coalesce < 0) {
+		nih_fatal (_("Coalescing window must not be negative"));
+		exit (1);
+	}
+
 	user_session_addr = getenv ("UPSTART_SESSION");
 	if (! user_session_addr) {
 		nih_fatal (_("UPSTART_SESSION isn't set in environment"));
@@ -181,6 +254,8 @@ main (int   argc,
 	/* Allocate jobs hash table */
 	jobs = NIH_MUST (nih_hash_string_new (NULL, 0));
 
+	pending_changes = NIH_MUST (nih_hash_string_new (NULL, 0));
+
 	/* Get an Upstart proxy object */
 	upstart_proxy = g_dbus_proxy_new_sync (connection,
 					       G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
@@ -281,6 +356,7 @@ handle_upstart_job (GDBusProxy *proxy,
 	const gchar   *job_class_path;
 	Job           *job;
 	int            add;
+	nih_local char **keys = NULL;
 
 	nih_assert (signal_name);
 	nih_assert (parameters);
@@ -313,7 +389,7 @@ handle_upstart_job (GDBusProxy *proxy,
 		nih_free (job);
 
 	/* Job isn't interested in DCONF_EVENT */
-	if (add && ! job_needs_event (job_class_path))
+	if (add && ! job_needs_event (job_class_path, NULL, &keys))
 		goto out;
 
 	if (add)
@@ -329,6 +405,10 @@ handle_upstart_job (GDBusProxy *proxy,
 	job = NIH_MUST (nih_new (NULL, Job));
 	job->path = NIH_MUST (nih_strdup (job, job_class_path));
 
+	job->keys = keys;
+	if (keys)
+		nih_ref (keys, job);
+
 	nih_list_init (&job->entry);
 	nih_alloc_set_destructor (job, nih_list_destroy);
 	nih_hash_add (jobs, &job->entry);
@@ -340,7 +420,8 @@ out:
 /**
  * dconf_changed:
  *
- * Emit an Upstart event corresponding to a dconf key change.
+ * Emit an Upstart event corresponding to a dconf key change, or queue
+ * it to be emitted with others when the coalescing window ends.
  **/
 static void
 dconf_changed (DConfClient         *client,
@@ -352,17 +433,9 @@ dconf_changed (DConfClient         *client,
 	GVariant         *value;
 	gchar            *value_str = NULL;
 	gchar            *path = NULL;
-	gchar            *env_key = NULL;
-	gchar            *env_value = NULL;
-	GVariant         *event;
-	GVariantBuilder   builder;
+	nih_local char  **env = NULL;
 	int               i = 0;
 
-	/* dconf currently only currently supports the changed signal,
-	 * but parameterise to allow for a future API change.
-	 */
-	const gchar      *event_type = "TYPE=changed";
-
 	if (! jobs_need_event () && ! always)
 		return;
 
@@ -370,46 +443,273 @@ dconf_changed (DConfClient         *client,
 	while (changes[i] != NULL) {
 		path = g_strconcat (prefix, changes[i], NULL);
 
+		if (! always && ! key_wanted (path)) {
+			g_free (path);
+			i += 1;
+			continue;
+		}
+
 		value = dconf_client_read (client, path);
 		value_str = g_variant_print (value, FALSE);
 
-		env_key = g_strconcat ("KEY=", path, NULL);
-		env_value = g_strconcat ("VALUE=", value_str, NULL);
+		if (coalesce) {
+			queue_change (path, value_str);
+
+			if (! pending_source)
+				pending_source = g_timeout_add (
+					coalesce,
+					(GSourceFunc)emit_pending_changes,
+					upstart);
+		} else {
+			/* dconf currently only currently supports the changed
+			 * signal, but parameterise to allow for a future API
+			 * change.
+			 */
+			env = NIH_MUST (nih_str_array_new (NULL));
+			NIH_MUST (nih_str_array_add (&env, NULL, NULL,
+						     "TYPE=changed"));
+			NIH_MUST (nih_str_array_addp (&env, NULL, NULL,
+					NIH_MUST (nih_sprintf (NULL, "KEY=%s", path))));
+			NIH_MUST (nih_str_array_addp (&env, NULL, NULL,
+					NIH_MUST (nih_sprintf (NULL, "VALUE=%s",
+							       value_str))));
+
+			emit_event (upstart, env);
+
+			nih_free (env);
+			env = NULL;
+		}
+
+		g_variant_unref (value);
+		g_free (path);
+		g_free (value_str);
+
+		i += 1;
+	}
+}
+
+/**
+ * emit_event:
+ * @upstart: Upstart proxy,
+ * @env: environment of event.
+ *
+ * Emit DCONF_EVENT with @env, without waiting for it to be handled.
+ **/
+static void
+emit_event (GDBusProxy  *upstart,
+	    char * const *env)
+{
+	GVariant         *event;
+	GVariantBuilder   builder;
 
-		/* Build event environment as GVariant */
-		g_variant_builder_init (&builder, G_VARIANT_TYPE_TUPLE);
+	nih_assert (upstart);
+	nih_assert (env);
 
-		g_variant_builder_add (&builder, "s", DCONF_EVENT);
+	/* Build event environment as GVariant */
+	g_variant_builder_init (&builder, G_VARIANT_TYPE_TUPLE);
 
-		g_variant_builder_open (&builder, G_VARIANT_TYPE_ARRAY);
-		g_variant_builder_add (&builder, "s", event_type);
-		g_variant_builder_add (&builder, "s", env_key);
-		g_variant_builder_add (&builder, "s", env_value);
-		g_variant_builder_close (&builder);
+	g_variant_builder_add (&builder, "s", DCONF_EVENT);
 
-		g_variant_builder_add (&builder, "b", FALSE);
-		event = g_variant_builder_end (&builder);
+	g_variant_builder_open (&builder, G_VARIANT_TYPE_ARRAY);
+	for (char * const *e = env; e && *e; e++)
+		g_variant_builder_add (&builder, "s", *e);
+	g_variant_builder_close (&builder);
 
-		/* Send the event */
-		g_dbus_proxy_call (upstart,
-				"EmitEvent",
-				event,
-				G_DBUS_CALL_FLAGS_NONE,
-				-1,
-				NULL,
-				NULL, /* GAsyncReadyCallback
-					 we don't care about the answer */
-				NULL);
+	g_variant_builder_add (&builder, "b", FALSE);
+	event = g_variant_builder_end (&builder);
 
-		g_variant_builder_clear (&builder);
-		g_variant_unref (value);
-		g_free (path);
-		g_free (value_str);
-		g_free (env_key);
-		g_free (env_value);
+	/* Send the event */
+	g_dbus_proxy_call (upstart,
+			"EmitEvent",
+			event,
+			G_DBUS_CALL_FLAGS_NONE,
+			-1,
+			NULL,
+			NULL, /* GAsyncReadyCallback
+				 we don't care about the answer */
+			NULL);
 
-		i += 1;
+	g_variant_builder_clear (&builder);
+}
+
+/**
+ * queue_change:
+ * @key: full path of changed key,
+ * @value: printed value of @key.
+ *
+ * Record the change of @key to @value until the coalescing window ends,
+ * replacing any earlier change to @key in the same window.
+ **/
+static void
+queue_change (const char *key,
+	      const char *value)
+{
+	DconfChange *change;
+
+	nih_assert (key);
+	nih_assert (value);
+
+	change = (DconfChange *)nih_hash_lookup (pending_changes, key);
+	if (! change) {
+		change = NIH_MUST (nih_new (pending_changes, DconfChange));
+		change->key = NIH_MUST (nih_strdup (change, key));
+		change->value = NULL;
+
+		nih_list_init (&change->entry);
+		nih_alloc_set_destructor (change, nih_list_destroy);
+		nih_hash_add (pending_changes, &change->entry);
 	}
+
+	if (change->value)
+		nih_free (change->value);
+	change->value = NIH_MUST (nih_strdup (change, value));
+}
+
+/**
+ * change_cmp:
+ * @a: pointer to first DconfChange pointer,
+ * @b: pointer to second DconfChange pointer.
+ *
+ * qsort() comparison function ordering changes by directory, so that
+ * the keys of each directory are adjacent, and then by key.
+ *
+ * Returns: integer less than, equal to or greater than zero.
+ **/
+static int
+change_cmp (const void *a,
+	    const void *b)
+{
+	const char *key_a = (*(DconfChange * const *)a)->key;
+	const char *key_b = (*(DconfChange * const *)b)->key;
+	size_t      dir_a = strrchr (key_a, '/') - key_a;
+	size_t      dir_b = strrchr (key_b, '/') - key_b;
+	int         ret;
+
+	ret = memcmp (key_a, key_b, dir_a < dir_b ? dir_a : dir_b);
+	if (ret)
+		return ret;
+
+	if (dir_a != dir_b)
+		return dir_a < dir_b ? -1 : 1;
+
+	return strcmp (key_a, key_b);
+}
+
+/**
+ * emit_pending_changes:
+ * @upstart: Upstart proxy.
+ *
+ * Called when the coalescing window ends to emit the changes made in
+ * it.  A key that's the only one changed in its directory is emitted
+ * as usual, with its KEY and latest VALUE; changes to several keys of
+ * the same directory are merged into one event with the directory, up
+ * to and including its final '/', as KEY and the names of the keys
+ * within it, separated by spaces, as KEYS.
+ *
+ * Returns: FALSE, to remove the timeout.
+ **/
+static gboolean
+emit_pending_changes (GDBusProxy *upstart)
+{
+	nih_local DconfChange **changes = NULL;
+	size_t                  len = 0;
+	size_t                  i;
+	size_t                  j;
+
+	nih_assert (upstart);
+
+	pending_source = 0;
+
+	NIH_HASH_FOREACH (pending_changes, iter)
+		len++;
+
+	if (! len)
+		return FALSE;
+
+	changes = NIH_MUST (nih_alloc (NULL, sizeof (DconfChange *) * len));
+
+	len = 0;
+	NIH_HASH_FOREACH (pending_changes, iter)
+		changes[len++] = (DconfChange *)iter;
+
+	qsort (changes, len, sizeof (DconfChange *), change_cmp);
+
+	for (i = 0; i < len; i = j) {
+		nih_local char  **env = NULL;
+		nih_local char   *keys = NULL;
+		size_t            dir_len;
+
+		dir_len = strrchr (changes[i]->key, '/') - changes[i]->key + 1;
+
+		/* Find the end of the run of keys sharing a directory */
+		for (j = i + 1; j < len; j++) {
+			if (strncmp (changes[j]->key, changes[i]->key, dir_len)
+			    || strchr (changes[j]->key + dir_len, '/'))
+				break;
+		}
+
+		env = NIH_MUST (nih_str_array_new (NULL));
+		NIH_MUST (nih_str_array_add (&env, NULL, NULL, "TYPE=changed"));
+
+		if (j - i == 1) {
+			NIH_MUST (nih_str_array_addp (&env, NULL, NULL,
+					NIH_MUST (nih_sprintf (NULL, "KEY=%s",
+							       changes[i]->key))));
+			NIH_MUST (nih_str_array_addp (&env, NULL, NULL,
+					NIH_MUST (nih_sprintf (NULL, "VALUE=%s",
+							       changes[i]->value))));
+		} else {
+			NIH_MUST (nih_str_array_addp (&env, NULL, NULL,
+					NIH_MUST (nih_sprintf (NULL, "KEY=%.*s",
+							       (int)dir_len,
+							       changes[i]->key))));
+
+			keys = NIH_MUST (nih_strdup (NULL, "KEYS="));
+			for (size_t k = i; k < j; k++)
+				NIH_MUST (nih_strcat_sprintf (&keys, NULL, "%s%s",
+							      k > i ? " " : "",
+							      changes[k]->key + dir_len));
+
+			NIH_MUST (nih_str_array_add (&env, NULL, NULL, keys));
+		}
+
+		emit_event (upstart, env);
+	}
+
+	NIH_HASH_FOREACH_SAFE (pending_changes, iter)
+		nih_free (iter);
+
+	return FALSE;
+}
+
+/**
+ * key_wanted:
+ * @key: full path of changed key.
+ *
+ * Returns: TRUE if filtering is not enabled or a job might be interested
+ * in a change to @key, else FALSE.
+ **/
+static int
+key_wanted (const char *key)
+{
+	nih_assert (key);
+
+	if (! filter)
+		return TRUE;
+
+	NIH_HASH_FOREACH (jobs, iter) {
+		Job *job = (Job *)iter;
+
+		if (! job->keys)
+			return TRUE;
+
+		for (char **pattern = job->keys; *pattern; pattern++) {
+			if (! fnmatch (*pattern, key, 0))
+				return TRUE;
+		}
+	}
+
+	return FALSE;
 }
 
 /**
@@ -429,33 +729,35 @@ jobs_need_event (void)
 
 /**
  * job_needs_event:
- * @object_path: Full D-Bus object path for job.
+ * @object_path: Full D-Bus object path for job,
+ * @parent: parent object for @keys,
+ * @keys: pointer to set to KEY patterns of the job.
+ *
+ * If the job specified by @object_path needs DCONF_EVENT, @keys is set
+ * to a newly allocated array of the KEY patterns of each DCONF_EVENT
+ * condition, or to NULL if any of those conditions might match any key.
  *
  * Returns: TRUE if job specified by @object_path specifies DCONF_EVENT
  * in its 'start on' or 'stop on' stanza, else FALSE.
  **/
 static int
-job_needs_event (const char *class_path)
+job_needs_event (const char   *class_path,
+		 const void   *parent,
+		 char       ***keys)
 {
 	GDBusProxy    *job_proxy;
 	GError        *error = NULL;
-	GVariantIter   iter;
-	const gchar   *event_name;
 	int            ret = FALSE;
+	int            any_key = FALSE;
 
 	/* Arrays of arrays of strings (aas) */
 	GVariant      *start_on = NULL;
 	GVariant      *stop_on = NULL;
 
-	/* Array containing event name and optional environment
-	 * variable elements.
-	 */
-	GVariant      *event_element;
-
-	/* Either an event name or "/AND" or "/OR" */
-	GVariant      *event;
-
 	nih_assert (class_path);
+	nih_assert (keys);
+
+	*keys = NIH_MUST (nih_str_array_new (parent));
 
 	job_proxy = g_dbus_proxy_new_sync (connection,
 			G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
@@ -467,36 +769,74 @@ job_needs_event (const char *class_path)
 			&error);
 
 	start_on = g_dbus_proxy_get_cached_property (job_proxy, "start_on");
-	nih_assert (g_variant_is_of_type (start_on, G_VARIANT_TYPE_ARRAY));
+	if (condition_needs_event (start_on, parent, keys, &any_key))
+		ret = TRUE;
 
-	g_variant_iter_init (&iter, start_on);
+	/* Now handle stop on */
+	stop_on = g_dbus_proxy_get_cached_property (job_proxy, "stop_on");
+	if (condition_needs_event (stop_on, parent, keys, &any_key))
+		ret = TRUE;
 
-	while ((event_element = g_variant_iter_next_value (&iter))) {
-		nih_assert (g_variant_is_of_type (event_element, G_VARIANT_TYPE_ARRAY));
+	if (start_on)
+		g_variant_unref (start_on);
 
-		/* First element is always the event name */
-		event = g_variant_get_child_value (event_element, 0);
-		nih_assert (g_variant_is_of_type (event, G_VARIANT_TYPE_STRING));
+	if (stop_on)
+		g_variant_unref (stop_on);
 
-		event_name = g_variant_get_string (event, NULL);
+	g_object_unref (job_proxy);
 
-		if (! strcmp (event_name, DCONF_EVENT))
-			ret = TRUE;
+	if (! ret || any_key) {
+		nih_free (*keys);
+		*keys = NULL;
+	}
 
-		g_variant_unref (event_element);
-		g_variant_unref (event);
+	return ret;
+}
 
-		if (ret)
-			goto out;
-	}
+/**
+ * condition_needs_event:
+ * @condition: 'start on' or 'stop on' property of job,
+ * @parent: parent object for @keys,
+ * @keys: pointer to array to append KEY patterns to,
+ * @any_key: set to TRUE if a DCONF_EVENT has no usable KEY pattern.
+ *
+ * Appends the KEY of each DCONF_EVENT in @condition, given by name or as
+ * the second positional value, to @keys.  Patterns that refer to
+ * variables can't be matched here, so @any_key is set for those as for
+ * events without a KEY.
+ *
+ * Returns: TRUE if @condition specifies DCONF_EVENT, else FALSE.
+ **/
+static int
+condition_needs_event (GVariant    *condition,
+		       const void  *parent,
+		       char      ***keys,
+		       int         *any_key)
+{
+	GVariantIter   iter;
+	const gchar   *event_name;
+	int            ret = FALSE;
 
-	/* Now handle stop on */
-	stop_on = g_dbus_proxy_get_cached_property (job_proxy, "stop_on");
-	nih_assert (g_variant_is_of_type (stop_on, G_VARIANT_TYPE_ARRAY));
+	/* Array containing event name and optional environment
+	 * variable elements.
+	 */
+	GVariant      *event_element;
 
-	g_variant_iter_init (&iter, stop_on);
+	/* Either an event name or "/AND" or "/OR" */
+	GVariant      *event;
+
+	nih_assert (keys);
+	nih_assert (any_key);
+
+	nih_assert (g_variant_is_of_type (condition, G_VARIANT_TYPE_ARRAY));
+
+	g_variant_iter_init (&iter, condition);
 
 	while ((event_element = g_variant_iter_next_value (&iter))) {
+		const gchar *key = NULL;
+		gsize        n;
+		gsize        positional = 0;
+
 		nih_assert (g_variant_is_of_type (event_element, G_VARIANT_TYPE_ARRAY));
 
 		/* First element is always the event name */
@@ -505,24 +845,43 @@ job_needs_event (const char *class_path)
 
 		event_name = g_variant_get_string (event, NULL);
 
-		if (! strcmp (event_name, DCONF_EVENT))
-			ret = TRUE;
+		if (strcmp (event_name, DCONF_EVENT)) {
+			g_variant_unref (event_element);
+			g_variant_unref (event);
+			continue;
+		}
 
-		g_variant_unref (event_element);
-		g_variant_unref (event);
+		ret = TRUE;
 
-		if (ret)
-			goto out;
-	}
+		n = g_variant_n_children (event_element);
+		for (gsize i = 1; i < n && ! key; i++) {
+			GVariant    *child;
+			const gchar *value;
 
-out:
-	if (start_on)
-		g_variant_unref (start_on);
+			child = g_variant_get_child_value (event_element, i);
+			value = g_variant_get_string (child, NULL);
 
-	if (stop_on)
-		g_variant_unref (stop_on);
+			if (! strncmp (value, "KEY=", 4)) {
+				key = value + 4;
+			} else if (! strchr (value, '=') && positional++ == 1) {
+				key = value;
+			}
 
-	g_object_unref (job_proxy);
+			if (key && ! strchr (key, '$'))
+				NIH_MUST (nih_str_array_add (keys, parent, NULL, key));
+
+			if (key && strchr (key, '$'))
+				*any_key = TRUE;
+
+			g_variant_unref (child);
+		}
+
+		if (! key)
+			*any_key = TRUE;
+
+		g_variant_unref (event_element);
+		g_variant_unref (event);
+	}
 
 	return ret;
 }
@@ -547,6 +906,7 @@ handle_existing_jobs (GDBusProxy *upstart_proxy)
 	GError        *error = NULL;
 	GVariantIter   iter;
 	Job           *job;
+	char         **keys;
 
 	nih_assert (upstart_proxy);
 
@@ -586,11 +946,15 @@ handle_existing_jobs (GDBusProxy *upstart_proxy)
 		if (job)
 			nih_free (job);
 
-		if (job_needs_event (job_class_path)) {
+		if (job_needs_event (job_class_path, NULL, &keys)) {
 			/* Create new record for the job */
 			job = NIH_MUST (nih_new (NULL, Job));
 			job->path = NIH_MUST (nih_strdup (job, job_class_path));
 
+			job->keys = keys;
+			if (keys)
+				nih_ref (keys, job);
+
 			nih_list_init (&job->entry);
 			nih_alloc_set_destructor (job, nih_list_destroy);
 			nih_hash_add (jobs, &job->entry);
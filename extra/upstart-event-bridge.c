@@ -33,12 +33,15 @@
 #include <nih/macros.h>
 #include <nih/alloc.h>
 #include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
 #include <nih/io.h>
 #include <nih/option.h>
 #include <nih/main.h>
 #include <nih/logging.h>
 #include <nih/error.h>
 
+#include <nih-dbus/dbus_error.h>
 #include <nih-dbus/dbus_connection.h>
 #include <nih-dbus/dbus_proxy.h>
 
@@ -54,6 +57,11 @@ static void upstart_forward_event    (void *data, NihDBusMessage *message,
 				  const char *path);
 static void upstart_forward_restarted    (void *data, NihDBusMessage *message,
 				  const char *path);
+static void upstart_jobs_changed (void *data, NihDBusMessage *message,
+				  const char *path);
+static void queue_event          (const char *name, char * const *env);
+static void update_wanted_events (void);
+static void emit_pending_events  (void *data, NihMainLoopFunc *loop);
 static void emit_event_error     (void *data, NihDBusMessage *message);
 
 /**
@@ -86,6 +94,46 @@ static NihDBusProxy *system_upstart = NULL;
  **/
 static NihDBusProxy *user_upstart = NULL;
 
+/**
+ * wanted_events:
+ *
+ * Hash of NihListEntry structures naming the events that the jobs of the
+ * user session init refer to; only those are forwarded.
+ **/
+static NihHash *wanted_events = NULL;
+
+/**
+ * wanted_events_stale:
+ *
+ * Set to TRUE when jobs have been added to or removed from the user
+ * session init since wanted_events was obtained.
+ **/
+static int wanted_events_stale = TRUE;
+
+/**
+ * filter_events:
+ *
+ * Set to FALSE if the user session init cannot tell us which events its
+ * jobs refer to, in which case all events are forwarded.
+ **/
+static int filter_events = TRUE;
+
+/**
+ * pending_events:
+ *
+ * NULL-terminated array of events queued during the current main loop
+ * iteration, to be forwarded to the user session init in a single
+ * EmitEvents call by emit_pending_events().
+ **/
+static UpstartEmitEventsEventsElement **pending_events = NULL;
+
+/**
+ * pending_events_len:
+ *
+ * Number of entries in pending_events.
+ **/
+static size_t pending_events_len = 0;
+
 /**
  * options:
  *
@@ -217,6 +265,33 @@ main (int   argc,
 		exit (1);
 	}
 
+	/* Connect signals to be notified when the events that user jobs
+	 * refer to may have changed.
+	 */
+	if (! nih_dbus_proxy_connect (user_upstart, &upstart_com_ubuntu_Upstart0_6, "JobAdded",
+				      (NihDBusSignalHandler)upstart_jobs_changed, NULL)) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_fatal ("%s: %s", _("Could not create JobAdded signal connection"),
+			   err->message);
+		nih_free (err);
+
+		exit (1);
+	}
+
+	if (! nih_dbus_proxy_connect (user_upstart, &upstart_com_ubuntu_Upstart0_6, "JobRemoved",
+				      (NihDBusSignalHandler)upstart_jobs_changed, NULL)) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_fatal ("%s: %s", _("Could not create JobRemoved signal connection"),
+			   err->message);
+		nih_free (err);
+
+		exit (1);
+	}
+
 	/* Become daemon */
 	if (daemonise) {
 		/* Deal with the pidfile location when becoming a daemon.
@@ -267,6 +342,10 @@ main (int   argc,
 		NIH_MUST (nih_signal_add_handler (NULL, SIGINT, nih_main_term_signal, NULL));
 	}
 
+	/* Forward the events queued by each iteration in one call */
+	NIH_MUST (nih_main_loop_add_func (NULL, (NihMainLoopCb)emit_pending_events,
+					  NULL));
+
 	ret = nih_main_loop ();
 
 	/* Destroy any PID file we may have created */
@@ -332,19 +411,8 @@ upstart_forward_event (void *          data,
 	}
 
 	/* Re-transmit the event */
-	pending_call = upstart_emit_event (user_upstart,
-			new_event_name, event_env, FALSE,
-			NULL, emit_event_error, NULL,
-			NIH_DBUS_TIMEOUT_NEVER);
-
-	if (! pending_call) {
-		NihError *err;
-		err = nih_error_get ();
-		nih_warn ("%s", err->message);
-		nih_free (err);
-	}
+	queue_event (new_event_name, event_env);
 
-	dbus_pending_call_unref (pending_call);
 	dbus_free_string_array (event_env);
 }
 
@@ -353,22 +421,193 @@ upstart_forward_restarted (void *          data,
 		     NihDBusMessage *message,
 		     const char *    path)
 {
-	DBusPendingCall *   pending_call;
-
 	/* Re-transmit the event */
-	pending_call = upstart_emit_event (user_upstart,
-			":sys:restarted", NULL, FALSE,
-			NULL, emit_event_error, NULL,
-			NIH_DBUS_TIMEOUT_NEVER);
+	queue_event (":sys:restarted", NULL);
+}
+
+static void
+upstart_jobs_changed (void *          data,
+		      NihDBusMessage *message,
+		      const char *    path)
+{
+	wanted_events_stale = TRUE;
+}
+
+/**
+ * queue_event:
+ * @name: name of event to forward,
+ * @env: environment of event, or NULL.
+ *
+ * Queue an event to be forwarded to the user session init, along with
+ * any others queued in the same main loop iteration, by
+ * emit_pending_events().
+ **/
+static void
+queue_event (const char *  name,
+	     char * const *env)
+{
+	UpstartEmitEventsEventsElement *element;
+
+	nih_assert (name != NULL);
+
+	if (! pending_events) {
+		pending_events = NIH_MUST (nih_alloc (NULL,
+					sizeof (UpstartEmitEventsEventsElement *)));
+		pending_events[0] = NULL;
+	}
+
+	element = NIH_MUST (nih_new (pending_events, UpstartEmitEventsEventsElement));
+
+	element->item0 = NIH_MUST (nih_strdup (element, name));
+	element->item1 = env
+		? NIH_MUST (nih_str_array_copy (element, NULL, env))
+		: NIH_MUST (nih_str_array_new (element));
+	element->item2 = FALSE;
+
+	pending_events = NIH_MUST (nih_realloc (pending_events, NULL,
+				sizeof (UpstartEmitEventsEventsElement *)
+				* (pending_events_len + 2)));
+
+	pending_events[pending_events_len++] = element;
+	pending_events[pending_events_len] = NULL;
+}
+
+/**
+ * update_wanted_events:
+ *
+ * Obtain the names of the events that the jobs of the user session init
+ * refer to, or stop filtering events should it not support telling us.
+ **/
+static void
+update_wanted_events (void)
+{
+	nih_local char **names = NULL;
+
+	if (upstart_get_job_event_names_sync (NULL, user_upstart,
+					      local ? "" : ":sys:*",
+					      &names) < 0) {
+		NihDBusError *dbus_err;
+
+		dbus_err = (NihDBusError *)nih_error_get ();
+		if ((dbus_err->number == NIH_DBUS_ERROR)
+		    && (! strcmp (dbus_err->name, DBUS_ERROR_UNKNOWN_METHOD))) {
+			nih_info (_("User session init cannot filter events, "
+				    "forwarding all of them"));
+			filter_events = FALSE;
+		} else {
+			nih_warn ("%s", dbus_err->message);
+		}
+
+		nih_free (dbus_err);
+		return;
+	}
+
+	if (wanted_events)
+		nih_free (wanted_events);
+
+	wanted_events = NIH_MUST (nih_hash_string_new (NULL, 0));
+
+	for (char **name = names; *name; name++) {
+		NihListEntry *entry;
+
+		entry = NIH_MUST (nih_list_entry_new (wanted_events));
+		entry->str = NIH_MUST (nih_strdup (entry, *name));
+
+		nih_hash_add (wanted_events, &entry->entry);
+	}
+
+	wanted_events_stale = FALSE;
+}
 
-	if (! pending_call) {
+/**
+ * emit_pending_events:
+ *
+ * @data: (unused),
+ * @loop: loop callback structure (unused).
+ *
+ * Called once per main loop iteration to forward those events queued by
+ * queue_event() that user jobs refer to in a single EmitEvents method
+ * call.  Should the batch as a whole be rejected, or the user session
+ * init be too old to accept one, the events are emitted one at a time.
+ **/
+static void
+emit_pending_events (void            *data,
+		     NihMainLoopFunc *loop)
+{
+	DBusPendingCall *pending_call;
+	size_t           len = 0;
+
+	if (! pending_events_len)
+		return;
+
+	if (filter_events && wanted_events_stale)
+		update_wanted_events ();
+
+	/* Events are only dropped once we know what user jobs want */
+	if (filter_events && wanted_events) {
+		for (size_t i = 0; i < pending_events_len; i++) {
+			if (! nih_hash_lookup (wanted_events,
+					       pending_events[i]->item0)) {
+				nih_debug ("Not forwarding %s",
+					   pending_events[i]->item0);
+				continue;
+			}
+
+			pending_events[len++] = pending_events[i];
+		}
+
+		pending_events[len] = NULL;
+	} else {
+		len = pending_events_len;
+	}
+
+	if (! len)
+		goto out;
+
+	/* A user session init too old to filter events won't support
+	 * batches of them either.
+	 */
+	pending_call = NULL;
+	if (filter_events) {
+		pending_call = NIH_SHOULD (upstart_emit_events (user_upstart,
+					pending_events,
+					NULL, emit_event_error, NULL,
+					NIH_DBUS_TIMEOUT_NEVER));
+		if (! pending_call) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_warn ("%s", err->message);
+			nih_free (err);
+		}
+	}
+
+	if (pending_call) {
+		dbus_pending_call_unref (pending_call);
+	} else {
 		NihError *err;
-		err = nih_error_get ();
-		nih_warn ("%s", err->message);
-		nih_free (err);
+
+		for (size_t i = 0; i < len; i++) {
+			pending_call = NIH_SHOULD (upstart_emit_event (user_upstart,
+						pending_events[i]->item0,
+						pending_events[i]->item1, FALSE,
+						NULL, emit_event_error, NULL,
+						NIH_DBUS_TIMEOUT_NEVER));
+			if (! pending_call) {
+				err = nih_error_get ();
+				nih_warn ("%s", err->message);
+				nih_free (err);
+				continue;
+			}
+
+			dbus_pending_call_unref (pending_call);
+		}
 	}
 
-	dbus_pending_call_unref (pending_call);
+out:
+	nih_free (pending_events);
+	pending_events = NULL;
+	pending_events_len = 0;
 }
 
 static void
@@ -94,18 +94,29 @@
  *
  * = Alternative Approaches =
  *
- * fanotify is an alternative but again, it is limited:
+ * fanotify is an alternative, used when the bridge is started with
+ * --fanotify, but again, it is limited:
  *
  * == Pros ==
  *
- * + Supports recursive watches.
+ * + A single mark covers every file on a filesystem, so files in
+ *   directories that do not yet exist need no watch juggling and
+ *   large numbers of watched directories do not exhaust
+ *   max_user_watches.
  *
  * == Cons ==
  *
- * - Does not support a file delete event.
+ * - Only reports the directory and name of files that are created or
+ *   deleted from Linux 5.9 (FAN_REPORT_DFID_NAME), and requires
+ *   CAP_SYS_ADMIN.
+ *
+ * - Not all filesystems can be marked.
  *
  * - Potentially high system performance impact since _every_ file
- *   operation on the partition (except delete) is inspected.
+ *   operation on the filesystem is inspected.
+ *
+ * Where fanotify cannot be used (or a filesystem cannot be marked), the
+ * bridge falls back to inotify.
  *
  *---------- 
  *
@@ -128,6 +139,10 @@
 #include <fnmatch.h>
 #include <glob.h>
 #include <pwd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/statfs.h>
+#include <sys/fanotify.h>
 
 #include <nih/alloc.h>
 #include <nih/command.h>
@@ -145,6 +160,7 @@
 #include <nih/watch.h>
 
 #include <nih-dbus/dbus_connection.h>
+#include <nih-dbus/dbus_error.h>
 #include <nih-dbus/dbus_proxy.h>
 
 #include "dbus/upstart.h"
@@ -165,6 +181,17 @@
  **/
 #define ALL_FILE_EVENTS (IN_CREATE|IN_MODIFY|IN_CLOSE_WRITE|IN_DELETE)
 
+#ifdef FAN_REPORT_DFID_NAME
+/**
+ * FANOTIFY_EVENTS:
+ *
+ * All the fanotify events we care about; as with inotify, a file moved
+ * into or out of a directory is treated as being created or deleted.
+ **/
+#define FANOTIFY_EVENTS (FAN_CREATE|FAN_DELETE|FAN_MOVED_FROM|FAN_MOVED_TO \
+			 |FAN_MODIFY|FAN_CLOSE_WRITE|FAN_ONDIR)
+#endif /* FAN_REPORT_DFID_NAME */
+
 /**
  * GLOB_CHARS:
  *
@@ -293,6 +320,22 @@ typedef struct file_event {
 	char        *match;
 } FileEvent;
 
+/**
+ * WatchedFilesystem:
+ *
+ * @entry: list header,
+ * @fsid: identifier of filesystem,
+ * @fd: open file on filesystem, used to open the directories
+ *  that fanotify reports events for.
+ *
+ * A filesystem marked with fanotify.
+ **/
+typedef struct watched_filesystem {
+	NihList   entry;
+	fsid_t    fsid;
+	int       fd;
+} WatchedFilesystem;
+
 /* Prototypes for static functions */
 static WatchedDir *watched_dir_new (const char *path, const struct stat *statbuf)
 	__attribute__ ((warn_unused_result));
@@ -323,11 +366,24 @@ static void upstart_job_added (void *data, NihDBusMessage *message,
 static void upstart_job_removed (void *data, NihDBusMessage *message,
 				  const char *job_path);
 
+static void upstart_jobs_changed (void *data, NihDBusMessage *message,
+				  UpstartJobsChangedAddedElement * const *added,
+				  char * const *removed);
+
+static void upstart_get_jobs (void);
+
+static void job_conditions_add (const char *job_path, char ***start_on,
+				char ***stop_on);
+
 static void job_add_file (Job *job, char **file_info);
 
 static void emit_event_error (void *data, NihDBusMessage *message);
-static int  emit_event (const char *path, uint32_t event_type,
+static void emit_event (const char *path, uint32_t event_type,
 				  const char  *match);
+static void emit_pending_events (void *data, NihMainLoopFunc *loop);
+static void emit_events_each (UpstartEmitEventsEventsElement **events);
+static void emit_events_reply (void *data, NihDBusMessage *message);
+static void emit_events_error (void *data, NihDBusMessage *message);
 
 static FileEvent *file_event_new (void *parent, const char *path,
 				  uint32_t event, const char *match);
@@ -355,6 +411,20 @@ char * expand_path (const void *parent, const char *path)
 static int path_valid (const char *path)
 	__attribute__ ((warn_unused_result));
 
+static void fanotify_setup (void);
+
+#ifdef FAN_REPORT_DFID_NAME
+static int  fanotify_watch_file (WatchedFile *file)
+	__attribute__ ((warn_unused_result));
+
+static void fanotify_reader (void *data, NihIoWatch *watch,
+			     NihIoEvents events);
+
+static void fanotify_handle_event (const struct fanotify_event_metadata *metadata);
+
+static void fanotify_match (const char *path, uint32_t event);
+#endif /* FAN_REPORT_DFID_NAME */
+
 /**
  * daemonise:
  *
@@ -385,6 +455,66 @@ static NihHash *watched_dirs = NULL;
  **/
 static NihDBusProxy *upstart = NULL;
 
+/**
+ * pending_events:
+ *
+ * NULL-terminated array of events queued by emit_event() during the
+ * current main loop iteration, to be sent to Upstart in a single
+ * EmitEvents call by emit_pending_events().
+ **/
+static UpstartEmitEventsEventsElement **pending_events = NULL;
+
+/**
+ * pending_events_len:
+ *
+ * Number of entries in pending_events.
+ **/
+static size_t pending_events_len = 0;
+
+/**
+ * emit_events_unsupported:
+ *
+ * Set to TRUE once Upstart has been found not to support the EmitEvents
+ * method, after which events are always emitted one at a time.
+ **/
+static int emit_events_unsupported = FALSE;
+
+/**
+ * use_fanotify:
+ *
+ * If TRUE, watch files with a single fanotify(7) mark for each
+ * filesystem, rather than an inotify(7) watch for each directory,
+ * where possible.
+ **/
+static int use_fanotify = FALSE;
+
+#ifdef FAN_REPORT_DFID_NAME
+/**
+ * fanotify_fd:
+ *
+ * fanotify group holding the marks, or -1 if files are watched with
+ * inotify.
+ **/
+static int fanotify_fd = -1;
+
+/**
+ * fanotify_files:
+ *
+ * Hash of WatchedFile objects watched with fanotify.  Since the path of
+ * a directory or glob WatchedFile is that of the directory, the files
+ * an event concerns are found by looking up its path and the path of
+ * its directory.
+ **/
+static NihHash *fanotify_files = NULL;
+
+/**
+ * watched_filesystems:
+ *
+ * List of WatchedFilesystem objects for the filesystems marked.
+ **/
+static NihList *watched_filesystems = NULL;
+#endif /* FAN_REPORT_DFID_NAME */
+
 /**
  * user:
  *
@@ -411,6 +541,8 @@ static NihOption options[] = {
 	  NULL, NULL, &daemonise, NULL },
 	{ 0, "user", N_("Connect to user session"),
 	  NULL, NULL, &user, NULL },
+	{ 0, "fanotify", N_("Watch whole filesystems with fanotify"),
+	  NULL, NULL, &use_fanotify, NULL },
 
 	NIH_OPTION_LAST
 };
@@ -421,7 +553,7 @@ main (int   argc,
       char *argv[])
 {
 	char               **args;
-	char               **job_class_paths;
+	UpstartGetAllJobConditionsJobsElement **job_conditions;
 	DBusConnection      *connection;
 	char                *pidfile_path = NULL;
 	char                *pidfile = NULL;
@@ -466,6 +598,9 @@ main (int   argc,
 	/* Allocate jobs hash table */
 	jobs = NIH_MUST (nih_hash_string_new (NULL, 0));
 
+	if (use_fanotify)
+		fanotify_setup ();
+
 	/* Initialise the connection to Upstart */
 	connection = NIH_SHOULD (nih_dbus_connect (user
 				? user_session_addr
@@ -496,53 +631,51 @@ main (int   argc,
 		exit (EXIT_FAILURE);
 	}
 
-	/* Connect signals to be notified when jobs come and go */
-	if (! nih_dbus_proxy_connect (upstart, &upstart_com_ubuntu_Upstart0_6, "JobAdded",
-				      (NihDBusSignalHandler)upstart_job_added, NULL)) {
+	/* Connect signal to be notified when jobs come and go, in one
+	 * batch each time the configuration changes.
+	 */
+	if (! nih_dbus_proxy_connect (upstart, &upstart_com_ubuntu_Upstart0_6, "JobsChanged",
+				      (NihDBusSignalHandler)upstart_jobs_changed, NULL)) {
 		NihError *err;
 
 		err = nih_error_get ();
-		nih_fatal ("%s: %s", _("Could not create JobAdded signal connection"),
+		nih_fatal ("%s: %s", _("Could not create JobsChanged signal connection"),
 			   err->message);
 		nih_free (err);
 
 		exit (EXIT_FAILURE);
 	}
 
-	if (! nih_dbus_proxy_connect (upstart, &upstart_com_ubuntu_Upstart0_6, "JobRemoved",
-				      (NihDBusSignalHandler)upstart_job_removed, NULL)) {
-		NihError *err;
-
-		err = nih_error_get ();
-		nih_fatal ("%s: %s", _("Could not create JobRemoved signal connection"),
-			   err->message);
-		nih_free (err);
+	/* Request the conditions of all current jobs in one call, falling
+	 * back to asking each job for them when Upstart is too old to
+	 * support that.
+	 */
+	if (upstart_get_all_job_conditions_sync (NULL, upstart,
+						 &job_conditions) < 0) {
+		NihDBusError *dbus_err;
 
-		exit (EXIT_FAILURE);
-	}
+		dbus_err = (NihDBusError *)nih_error_get ();
+		if ((dbus_err->number != NIH_DBUS_ERROR)
+		    || strcmp (dbus_err->name, DBUS_ERROR_UNKNOWN_METHOD)) {
+			nih_fatal ("%s: %s", _("Could not obtain job conditions"),
+				   dbus_err->message);
+			nih_free (dbus_err);
 
-	/* Request a list of all current jobs */
-	if (upstart_get_all_jobs_sync (NULL, upstart, &job_class_paths) < 0) {
-		NihError *err;
+			exit (EXIT_FAILURE);
+		}
 
-		err = nih_error_get ();
-		nih_fatal ("%s: %s", _("Could not obtain job list"),
-			   err->message);
-		nih_free (err);
+		nih_free (dbus_err);
 
-		exit (EXIT_FAILURE);
-	}
+		upstart_get_jobs ();
+	} else {
+		for (UpstartGetAllJobConditionsJobsElement **job = job_conditions;
+		     *job; job++)
+			job_conditions_add ((*job)->item0, (*job)->item1,
+					    (*job)->item2);
 
-	/* Look for jobs that specify the FILE_EVENT event and handle
-	 * them.
-	 */
-	for (char **job_class_path = job_class_paths;
-	     job_class_path && *job_class_path; job_class_path++) {
-		upstart_job_added (NULL, NULL, *job_class_path);
+		nih_free (job_conditions);
 	}
 
-	nih_free (job_class_paths);
-
 	/* Become daemon */
 	if (daemonise) {
 		/* Deal with the pidfile location when becoming a daemon.
@@ -606,6 +739,10 @@ main (int   argc,
 		NIH_MUST (nih_signal_add_handler (NULL, SIGINT, nih_main_term_signal, NULL));
 	}
 
+	/* Send the events queued by each iteration in one call */
+	NIH_MUST (nih_main_loop_add_func (NULL, (NihMainLoopCb)emit_pending_events,
+					  NULL));
+
 	ret = nih_main_loop ();
 
 	/* Destroy any PID file we may have created */
@@ -615,6 +752,66 @@ main (int   argc,
 	return ret;
 }
 
+/**
+ * upstart_get_jobs:
+ *
+ * Obtain the list of current jobs, and the conditions of each, from an
+ * Upstart too old to support GetAllJobConditions; connecting the signals
+ * it sends as each job comes and goes, since it won't send JobsChanged.
+ **/
+static void
+upstart_get_jobs (void)
+{
+	char **job_class_paths;
+
+	/* Connect signals to be notified when jobs come and go */
+	if (! nih_dbus_proxy_connect (upstart, &upstart_com_ubuntu_Upstart0_6, "JobAdded",
+				      (NihDBusSignalHandler)upstart_job_added, NULL)) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_fatal ("%s: %s", _("Could not create JobAdded signal connection"),
+			   err->message);
+		nih_free (err);
+
+		exit (EXIT_FAILURE);
+	}
+
+	if (! nih_dbus_proxy_connect (upstart, &upstart_com_ubuntu_Upstart0_6, "JobRemoved",
+				      (NihDBusSignalHandler)upstart_job_removed, NULL)) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_fatal ("%s: %s", _("Could not create JobRemoved signal connection"),
+			   err->message);
+		nih_free (err);
+
+		exit (EXIT_FAILURE);
+	}
+
+	/* Request a list of all current jobs */
+	if (upstart_get_all_jobs_sync (NULL, upstart, &job_class_paths) < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_fatal ("%s: %s", _("Could not obtain job list"),
+			   err->message);
+		nih_free (err);
+
+		exit (EXIT_FAILURE);
+	}
+
+	/* Look for jobs that specify the FILE_EVENT event and handle
+	 * them.
+	 */
+	for (char **job_class_path = job_class_paths;
+	     job_class_path && *job_class_path; job_class_path++) {
+		upstart_job_added (NULL, NULL, *job_class_path);
+	}
+
+	nih_free (job_class_paths);
+}
+
 /**
  * upstart_job_added:
  *
@@ -629,7 +826,6 @@ upstart_job_added (void            *data,
 		   NihDBusMessage  *message,
 		   const char      *job_path)
 {
-	Job                      *job;
 	nih_local NihDBusProxy   *job_class = NULL;
 	nih_local char         ***start_on = NULL;
 	nih_local char         ***stop_on = NULL;
@@ -676,8 +872,58 @@ upstart_job_added (void            *data,
 		return;
 	}
 
-	/* Free any existing record for the job (should never happen,
-	 * but worth being safe).
+	job_conditions_add (job_path, start_on, stop_on);
+}
+
+/**
+ * upstart_jobs_changed:
+ *
+ * @data: (unused),
+ * @message: Nih D-Bus message (unused),
+ * @added: Upstart jobs added, with their start on and stop on conditions,
+ * @removed: Upstart job class (D-Bus) paths of jobs removed.
+ *
+ * Called automatically when Upstart jobs come and go ("JobsChanged"
+ * signal).
+ **/
+static void
+upstart_jobs_changed (void                                   *data,
+		      NihDBusMessage                         *message,
+		      UpstartJobsChangedAddedElement * const *added,
+		      char * const                           *removed)
+{
+	nih_assert (added);
+	nih_assert (removed);
+
+	for (char * const *job_path = removed; *job_path; job_path++)
+		upstart_job_removed (NULL, NULL, *job_path);
+
+	for (UpstartJobsChangedAddedElement * const *job = added; *job; job++)
+		job_conditions_add ((*job)->item0, (*job)->item1,
+				    (*job)->item2);
+}
+
+/**
+ * job_conditions_add:
+ *
+ * @job_path: Upstart job class (D-Bus) path associated with job,
+ * @start_on: start on condition of job,
+ * @stop_on: stop on condition of job.
+ *
+ * Watch the files that the FILE_EVENT events in @start_on and @stop_on
+ * refer to on behalf of the job at @job_path.
+ **/
+static void
+job_conditions_add (const char   *job_path,
+		    char       ***start_on,
+		    char       ***stop_on)
+{
+	Job *job;
+
+	nih_assert (job_path);
+
+	/* Free any existing record for the job, replaced when its
+	 * configuration changes.
 	 */
 	job = (Job *)nih_hash_lookup (jobs, job_path);
 	if (job)
@@ -1306,6 +1552,11 @@ ensure_watched (Job          *job,
 
 	watched_dir_init ();
 
+#ifdef FAN_REPORT_DFID_NAME
+	if (fanotify_fd >= 0 && fanotify_watch_file (file) == 0)
+		goto link;
+#endif /* FAN_REPORT_DFID_NAME */
+
 	if (file->dir || file->glob) {
 		if (! stat (file->path, &statbuf)) {
 			/* Directory already exists, so we can watch it,
@@ -1331,15 +1582,18 @@ lookup:
 			return;
 	}
 
+	file->parent = dir;
+	nih_hash_add (dir->files, &file->entry);
+
+#ifdef FAN_REPORT_DFID_NAME
+link:
+#endif /* FAN_REPORT_DFID_NAME */
 	/* Associate the WatchedFile with the job such that when the job
 	 * is freed, the corresponding files are removed from their
 	 * containing WatchedDirs.
 	 */
 	nih_ref (file, job);
 
-	file->parent = dir;
-	nih_hash_add (dir->files, &file->entry);
-
 	/* Create a link from the job to the WatchedFile.
 	*/
 	entry = NIH_MUST (nih_list_entry_new (job));
@@ -1367,53 +1621,193 @@ watched_dir_init (void)
  * @match: file match that resulted from @path if it contains glob
  *  wildcards (or NULL).
  *
- * Emit an Upstart event.
+ * Queue an Upstart event, which will be emitted along with any others
+ * queued in the same main loop iteration by emit_pending_events().
  **/
-static int
+static void
 emit_event (const char   *path,
 	    uint32_t      event_type,
 	    const char   *match)
 {
-	DBusPendingCall    *pending_call;
-	nih_local char    **env = NULL;
-	nih_local char     *var = NULL;
-	size_t              env_len = 0;
+	UpstartEmitEventsEventsElement  *element;
+	char                           **env;
+	nih_local char                  *var = NULL;
+	size_t                           env_len = 0;
 
 	nih_assert (path);
 	nih_assert (event_type == IN_CREATE ||
 			event_type == IN_MODIFY ||
 			event_type == IN_DELETE);
 
-	env = NIH_MUST (nih_str_array_new (NULL));
+	if (! pending_events) {
+		pending_events = NIH_MUST (nih_alloc (NULL,
+					sizeof (UpstartEmitEventsEventsElement *)));
+		pending_events[0] = NULL;
+	}
+
+	element = NIH_MUST (nih_new (pending_events, UpstartEmitEventsEventsElement));
+
+	env = NIH_MUST (nih_str_array_new (element));
 
 	var = NIH_MUST (nih_sprintf (NULL, "FILE=%s", path));
-	NIH_MUST (nih_str_array_addp (&env, NULL, &env_len, var));
+	NIH_MUST (nih_str_array_addp (&env, element, &env_len, var));
 
 	var = NIH_MUST (nih_sprintf (NULL, "EVENT=%s",
 				event_type == IN_CREATE ? "create" :
 				event_type == IN_MODIFY ? "modify" :
 				"delete"));
-	NIH_MUST (nih_str_array_addp (&env, NULL, &env_len, var));
+	NIH_MUST (nih_str_array_addp (&env, element, &env_len, var));
 
 	if (match) {
 		var = NIH_MUST (nih_sprintf (NULL, "MATCH=%s", match));
-		NIH_MUST (nih_str_array_addp (&env, NULL, &env_len, var));
+		NIH_MUST (nih_str_array_addp (&env, element, &env_len, var));
 	}
 
-	pending_call = NIH_SHOULD (upstart_emit_event (upstart,
-				FILE_EVENT, env, FALSE,
-				NULL, emit_event_error, NULL,
-				NIH_DBUS_TIMEOUT_NEVER));
-	if (! pending_call) {
-		NihError *err;
+	element->item0 = NIH_MUST (nih_strdup (element, FILE_EVENT));
+	element->item1 = env;
+	element->item2 = FALSE;
+
+	pending_events = NIH_MUST (nih_realloc (pending_events, NULL,
+				sizeof (UpstartEmitEventsEventsElement *)
+				* (pending_events_len + 2)));
+
+	pending_events[pending_events_len++] = element;
+	pending_events[pending_events_len] = NULL;
+}
+
+/**
+ * emit_pending_events:
+ *
+ * @data: (unused),
+ * @loop: loop callback structure (unused).
+ *
+ * Called once per main loop iteration to send any events queued by
+ * emit_event() to Upstart in a single EmitEvents method call.  Should
+ * the batch as a whole be rejected, whether when sending it or in the
+ * reply, the events are emitted one at a time so that a single bad
+ * event does not lose the others, as they always are once Upstart is
+ * found not to support EmitEvents.
+ **/
+static void
+emit_pending_events (void            *data,
+		     NihMainLoopFunc *loop)
+{
+	UpstartEmitEventsEventsElement **events;
+	DBusPendingCall                 *pending_call;
+	NihError                        *err;
+
+	if (! pending_events_len)
+		return;
+
+	events = pending_events;
+	pending_events = NULL;
+	pending_events_len = 0;
+
+	if (! emit_events_unsupported) {
+		pending_call = NIH_SHOULD (upstart_emit_events (upstart,
+					events,
+					emit_events_reply, emit_events_error,
+					events,
+					NIH_DBUS_TIMEOUT_NEVER));
+
+		/* Kept until the reply, freed by its handler */
+		if (pending_call) {
+			dbus_pending_call_unref (pending_call);
+			return;
+		}
 
 		err = nih_error_get ();
 		nih_warn ("%s", err->message);
 		nih_free (err);
-		return FALSE;
 	}
 
-	return TRUE;
+	emit_events_each (events);
+	nih_free (events);
+}
+
+/**
+ * emit_events_each:
+ *
+ * @events: NULL-terminated array of events to emit.
+ *
+ * Emit each of @events in its own EmitEvent method call.
+ **/
+static void
+emit_events_each (UpstartEmitEventsEventsElement **events)
+{
+	DBusPendingCall *pending_call;
+
+	nih_assert (events);
+
+	for (UpstartEmitEventsEventsElement **event = events; *event; event++) {
+		pending_call = NIH_SHOULD (upstart_emit_event (upstart,
+					(*event)->item0,
+					(*event)->item1, FALSE,
+					NULL, emit_event_error, NULL,
+					NIH_DBUS_TIMEOUT_NEVER));
+		if (! pending_call) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_warn ("%s", err->message);
+			nih_free (err);
+			continue;
+		}
+
+		dbus_pending_call_unref (pending_call);
+	}
+}
+
+/**
+ * emit_events_reply:
+ *
+ * @data: events emitted,
+ * @message: Nih D-Bus message (unused).
+ *
+ * Handle the reply to an EmitEvents method call made by
+ * emit_pending_events() by freeing the events sent.
+ **/
+static void
+emit_events_reply (void            *data,
+		   NihDBusMessage  *message)
+{
+	nih_assert (data);
+
+	nih_free (data);
+}
+
+/**
+ * emit_events_error:
+ *
+ * @data: events that could not be emitted,
+ * @message: Nih D-Bus message (unused).
+ *
+ * Handle an error reply to an EmitEvents method call made by
+ * emit_pending_events() by emitting the events one at a time instead,
+ * noting when it was because Upstart does not support the method at all.
+ **/
+static void
+emit_events_error (void            *data,
+		   NihDBusMessage  *message)
+{
+	NihDBusError *dbus_err;
+
+	nih_assert (data);
+
+	dbus_err = (NihDBusError *)nih_error_get ();
+	if ((dbus_err->number == NIH_DBUS_ERROR)
+	    && (! strcmp (dbus_err->name, DBUS_ERROR_UNKNOWN_METHOD))) {
+		nih_info (_("Upstart cannot emit events together, "
+			    "emitting them one at a time"));
+		emit_events_unsupported = TRUE;
+	} else {
+		nih_debug ("%s", dbus_err->message);
+	}
+
+	nih_free (dbus_err);
+
+	emit_events_each (data);
+	nih_free (data);
 }
 
 /**
@@ -1951,3 +2345,283 @@ path_valid (const char *path)
 
 	return TRUE;
 }
+
+/**
+ * fanotify_setup:
+ *
+ * Create the fanotify group that WatchedFiles will be watched with,
+ * leaving them to be watched with inotify if the kernel does not
+ * support fanotify reporting directory entries or we lack the
+ * privilege to use it.
+ **/
+static void
+fanotify_setup (void)
+{
+#ifdef FAN_REPORT_DFID_NAME
+	fanotify_fd = fanotify_init (FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME
+				     | FAN_CLOEXEC | FAN_NONBLOCK,
+				     O_RDONLY | O_LARGEFILE);
+	if (fanotify_fd < 0) {
+		nih_warn ("%s: %s", _("Unable to use fanotify, falling back to inotify"),
+			  strerror (errno));
+		return;
+	}
+
+	fanotify_files = NIH_MUST (nih_hash_string_new (NULL, 0));
+	watched_filesystems = NIH_MUST (nih_list_new (NULL));
+
+	NIH_MUST (nih_io_add_watch (NULL, fanotify_fd, NIH_IO_READ,
+				    (NihIoWatcher)fanotify_reader, NULL));
+#else /* FAN_REPORT_DFID_NAME */
+	nih_warn ("%s", _("fanotify not supported, falling back to inotify"));
+#endif /* FAN_REPORT_DFID_NAME */
+}
+
+#ifdef FAN_REPORT_DFID_NAME
+/**
+ * fanotify_watch_file:
+ *
+ * @file: file we want to watch.
+ *
+ * Ensure that the WatchedFile file specified is watched with fanotify by
+ * marking the filesystem of the first existing parent of @file, unless
+ * it is marked already.
+ *
+ * Returns: zero on success, or -1 if the filesystem cannot be marked and
+ * @file must be watched with inotify.
+ **/
+static int
+fanotify_watch_file (WatchedFile *file)
+{
+	nih_local char     *path = NULL;
+	WatchedFilesystem  *fs;
+	struct statfs       statfsbuf;
+	int                 fd;
+
+	nih_assert (file);
+	nih_assert (fanotify_fd >= 0);
+
+	path = find_first_parent (file->path);
+	if (! path)
+		return -1;
+
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstatfs (fd, &statfsbuf) < 0)
+		goto error;
+
+	NIH_LIST_FOREACH (watched_filesystems, iter) {
+		fs = (WatchedFilesystem *)iter;
+
+		if (! memcmp (&fs->fsid, &statfsbuf.f_fsid, sizeof (fs->fsid))) {
+			close (fd);
+			goto add;
+		}
+	}
+
+	if (fanotify_mark (fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+			   FANOTIFY_EVENTS, AT_FDCWD, path) < 0) {
+		nih_debug ("%s %s: %s", _("Could not mark filesystem of"),
+			   path, strerror (errno));
+		goto error;
+	}
+
+	fs = NIH_MUST (nih_new (watched_filesystems, WatchedFilesystem));
+
+	nih_list_init (&fs->entry);
+	fs->fsid = statfsbuf.f_fsid;
+	fs->fd = fd;
+
+	nih_list_add (watched_filesystems, &fs->entry);
+
+add:
+	file->parent = NULL;
+	nih_hash_add (fanotify_files, &file->entry);
+
+	return 0;
+
+error:
+	close (fd);
+	return -1;
+}
+
+/**
+ * fanotify_reader:
+ *
+ * @data: (unused),
+ * @watch: NihIoWatch for fanotify group (unused),
+ * @events: events that occurred (unused).
+ *
+ * Called when the fanotify group is readable to handle the queued
+ * events.
+ **/
+static void
+fanotify_reader (void         *data,
+		 NihIoWatch   *watch,
+		 NihIoEvents   events)
+{
+	char     buf[8192]
+		__attribute__ ((aligned (__alignof__ (struct fanotify_event_metadata))));
+	ssize_t  len;
+
+	while ((len = read (fanotify_fd, buf, sizeof (buf))) > 0) {
+		const struct fanotify_event_metadata *metadata;
+
+		for (metadata = (const struct fanotify_event_metadata *)buf;
+		     FAN_EVENT_OK (metadata, len);
+		     metadata = FAN_EVENT_NEXT (metadata, len)) {
+			if (metadata->mask & FAN_Q_OVERFLOW) {
+				nih_warn ("%s", _("fanotify queue overflowed, events lost"));
+				continue;
+			}
+
+			fanotify_handle_event (metadata);
+		}
+	}
+}
+
+/**
+ * fanotify_handle_event:
+ *
+ * @metadata: fanotify event.
+ *
+ * Reconstruct the path of the file that @metadata concerns from the
+ * handle of its directory and its name, and emit events for the
+ * WatchedFiles that match it.
+ **/
+static void
+fanotify_handle_event (const struct fanotify_event_metadata *metadata)
+{
+	const struct fanotify_event_info_fid  *fid;
+	struct file_handle                    *handle;
+	WatchedFilesystem                     *fs = NULL;
+	const char                            *name;
+	char                                   link[32];
+	char                                   dir[PATH_MAX];
+	nih_local char                        *path = NULL;
+	ssize_t                                len;
+	int                                    fd;
+
+	nih_assert (metadata);
+
+	if (metadata->event_len < sizeof (*metadata) + sizeof (*fid))
+		return;
+
+	fid = (const struct fanotify_event_info_fid *)(metadata + 1);
+	if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+		return;
+
+	NIH_LIST_FOREACH (watched_filesystems, iter) {
+		WatchedFilesystem *marked = (WatchedFilesystem *)iter;
+
+		if (! memcmp (&marked->fsid, &fid->fsid, sizeof (marked->fsid))) {
+			fs = marked;
+			break;
+		}
+	}
+
+	if (! fs)
+		return;
+
+	handle = (struct file_handle *)fid->handle;
+	name = (const char *)(handle->f_handle + handle->handle_bytes);
+
+	/* The directory may already have been removed, in which case
+	 * there is nothing left to match.
+	 */
+	fd = open_by_handle_at (fs->fd, handle, O_RDONLY | O_PATH);
+	if (fd < 0)
+		return;
+
+	sprintf (link, "/proc/self/fd/%d", fd);
+	len = readlink (link, dir, sizeof (dir) - 1);
+	close (fd);
+
+	if (len < 0)
+		return;
+
+	dir[len] = '\0';
+
+	path = NIH_MUST (nih_sprintf (NULL, "%s/%s",
+				      strcmp (dir, "/") ? dir : "", name));
+
+	if (metadata->mask & (FAN_CREATE | FAN_MOVED_TO))
+		fanotify_match (path, IN_CREATE);
+
+	if (metadata->mask & (FAN_MODIFY | FAN_CLOSE_WRITE))
+		fanotify_match (path, IN_MODIFY);
+
+	if (metadata->mask & (FAN_DELETE | FAN_MOVED_FROM))
+		fanotify_match (path, IN_DELETE);
+}
+
+/**
+ * fanotify_match:
+ *
+ * @path: full path to file,
+ * @event: inotify event type that occurred.
+ *
+ * Emit events for all WatchedFiles watched with fanotify that @path
+ * matches: the file itself, the directory containing it and any glob
+ * pattern in that directory.
+ **/
+static void
+fanotify_match (const char  *path,
+		uint32_t     event)
+{
+	nih_local NihHash  *handled = NULL;
+	nih_local char     *dirpart = NULL;
+	char               *dir;
+	WatchedFile        *file;
+
+	nih_assert (path);
+
+	handled = NIH_MUST (nih_hash_string_new (NULL, 0));
+
+	for (file = (WatchedFile *)nih_hash_search (fanotify_files, path, NULL);
+	     file;
+	     file = (WatchedFile *)nih_hash_search (fanotify_files, path,
+						    &file->entry)) {
+		if (file->glob || ! (file->events & event))
+			continue;
+
+		/* Only the creation or deletion of a directory is of
+		 * interest, its modification is that of its contents.
+		 */
+		if (file->dir && event == IN_MODIFY)
+			continue;
+
+		handle_event (handled, original_path (file), event, NULL);
+	}
+
+	dirpart = NIH_MUST (nih_strdup (NULL, path));
+	dir = dirname (dirpart);
+
+	for (file = (WatchedFile *)nih_hash_search (fanotify_files, dir, NULL);
+	     file;
+	     file = (WatchedFile *)nih_hash_search (fanotify_files, dir,
+						    &file->entry)) {
+		if (file->dir) {
+			/* A file within a watched directory was created,
+			 * modified or deleted, hence emit the _directory_
+			 * was modified.
+			 */
+			if (file->events & IN_MODIFY)
+				handle_event (handled, original_path (file),
+					      IN_MODIFY, path);
+		} else if (file->glob) {
+			nih_local char *full_path = NULL;
+
+			/* reconstruct the full path */
+			full_path = NIH_MUST (nih_sprintf (NULL, "%s/%s",
+							   file->path, file->glob));
+
+			if (! fnmatch (full_path, path, FNM_PATHNAME)
+			    && (file->events & event))
+				handle_event (handled, full_path, event, path);
+		}
+	}
+}
+#endif /* FAN_REPORT_DFID_NAME */
@@ -42,6 +42,7 @@
 #include <nih/hash.h>
 #include <nih/string.h>
 #include <nih/io.h>
+#include <nih/timer.h>
 #include <nih/option.h>
 #include <nih/main.h>
 #include <nih/logging.h>
@@ -87,14 +88,33 @@ typedef struct socket {
  *
  * @sock: socket client connected via,
  * @fd: file descriptor client connected on,
- * @ucred: client credentials.
+ * @ucred: client credentials,
+ * @io: NihIo reading from @fd,
+ * @in_flight: number of EmitEvent calls awaiting a reply,
+ * @closed: TRUE once the client has closed its end,
+ * @recent: hash of name=value pairs seen in the current collapse window,
+ * @collapse_timer: timer ending the current collapse window.
  *
  * Representation of a connected client.
+ *
+ * Once @in_flight reaches max_in_flight we stop reading from @fd,
+ * leaving any lines already read in the receive buffer of @io, until
+ * replies arrive; the client's own writes then block, rather than the
+ * bridge queueing an unbounded number of calls to init on its behalf.
+ * If the client closes its end while lines remain, the structure is
+ * kept until they've all been sent and answered.
  **/
 typedef struct client_connection {
 	Socket        *sock;
 	int            fd;
 	struct ucred   ucred;
+
+	NihIo         *io;
+	unsigned int   in_flight;
+	int            closed;
+
+	NihHash       *recent;
+	NihTimer      *collapse_timer;
 } ClientConnection;
 
 static void upstart_connect      (void);
@@ -116,7 +136,15 @@ static void socket_reader (ClientConnection *client, NihIo *io,
 
 static void close_handler (ClientConnection *client, NihIo *io);
 
-static void emit_event_error (void *data, NihDBusMessage *message);
+static void client_pause  (ClientConnection *client);
+static void client_resume (ClientConnection *client);
+static void client_collapse_expired (ClientConnection *client,
+				     NihTimer *timer);
+
+static void emit_event_reply (ClientConnection *client,
+			      NihDBusMessage *message);
+static void emit_event_error (ClientConnection *client,
+			      NihDBusMessage *message);
 
 static void emit_event (ClientConnection *client, const char *pair, size_t len);
 
@@ -210,6 +238,22 @@ static Socket *sock = NULL;
  **/
 static int any_user = FALSE;
 
+/**
+ * max_in_flight:
+ *
+ * Number of events from a single client that may be awaiting a reply
+ * from init before we stop reading from that client; zero for no limit.
+ **/
+static int max_in_flight = 32;
+
+/**
+ * collapse_window:
+ *
+ * Seconds over which repeats of the same name=value pair from a single
+ * client are collapsed into the first; zero to emit every pair.
+ **/
+static int collapse_window = 0;
+
 /**
  * options:
  *
@@ -228,6 +272,12 @@ static NihOption options[] = {
 	{ 0, "path", N_("specify path for local/abstract socket to use"),
 		NULL, "PATH", &socket_path, NULL },
 
+	{ 0, "max-in-flight", N_("number of events from a client to await replies for before pausing it (0 for no limit)"),
+		NULL, "N", &max_in_flight, nih_option_int },
+
+	{ 0, "collapse", N_("seconds over which to collapse repeated name=value pairs from a client"),
+		NULL, "SECONDS", &collapse_window, nih_option_int },
+
 	NIH_OPTION_LAST
 };
 
@@ -290,6 +340,11 @@ main (int   argc,
 		exit (1);
 	}
 
+	if (max_in_flight < 0 || collapse_window < 0) {
+		nih_fatal ("%s", _("Limits must not be negative"));
+		exit (1);
+	}
+
 	sock = create_socket (NULL);
 	if (! sock) {
 		nih_fatal ("%s %s",
@@ -614,8 +669,11 @@ socket_watcher (Socket *sock,
 			client->ucred.uid,
 			client->ucred.gid);
 
+	if (collapse_window)
+		client->recent = NIH_MUST (nih_hash_string_new (client, 0));
+
 	/* Wait for remote end to send data */
-	NIH_MUST (nih_io_reopen (sock, client->fd,
+	client->io = NIH_MUST (nih_io_reopen (sock, client->fd,
 			NIH_IO_STREAM, 
 			(NihIoReader)socket_reader, 
 			(NihIoCloseHandler)close_handler,
@@ -639,6 +697,10 @@ error:
  *
  * NihIoReader function called when data has been read from the
  * connected client.
+ *
+ * Lines are consumed from @buf only while @client has fewer than
+ * max_in_flight events awaiting a reply; the remainder is left in the
+ * receive buffer and reading paused until client_resume() is called.
  **/
 static void
 socket_reader (ClientConnection  *client,
@@ -646,9 +708,8 @@ socket_reader (ClientConnection  *client,
 	       const char        *buf,
 	       size_t             len)
 {
-	nih_local char     *pairs = NULL;
-	char               *pair;
-	size_t              used_len = 0;
+	size_t              consumed = 0;
+	size_t              used_len;
 	size_t              i;
 
 	/* Ignore messages that are too short.
@@ -664,19 +725,28 @@ socket_reader (ClientConnection  *client,
 	if (len < min_len)
 		goto error;
 
-	pairs = nih_strdup (NULL, buf);
-	if (! pairs)
-		return;
+	while (consumed < len) {
+		nih_local char *pair = NULL;
+		const char     *line;
+		const char     *eol;
+
+		if (max_in_flight
+		    && client->in_flight >= (unsigned int)max_in_flight)
+			break;
 
-	for (pair = strsep (&pairs, "\n");
-	     pair;
-	     pair = strsep (&pairs, "\n")) {
+		line = buf + consumed;
+		eol = memchr (line, '\n', len - consumed);
 
-		used_len = strlen (pair);
+		used_len = eol ? (size_t)(eol - line) : len - consumed;
+		consumed += used_len + (eol ? 1 : 0);
 
 		if (used_len < min_len)
 			continue;
 
+		pair = nih_strndup (NULL, line, used_len);
+		if (! pair)
+			break;
+
 		/* Ensure the data is a 'name=value' pair */
 		if (! strchr (pair, '=') || pair[0] == '=')
 			continue;
@@ -702,8 +772,10 @@ socket_reader (ClientConnection  *client,
 		process_event (client, pair, used_len);
 	}
 
-	/* Consume the entire length */
-	nih_io_buffer_shrink (io->recv_buf, len);
+	nih_io_buffer_shrink (io->recv_buf, consumed);
+
+	if (consumed < len)
+		client_pause (client);
 
 	return;
 
@@ -715,6 +787,17 @@ error:
 	nih_io_buffer_shrink (io->recv_buf, len);
 }
 
+/**
+ * close_handler:
+ *
+ * @client: client connection,
+ * @io: NihIo.
+ *
+ * NihIoCloseHandler function called when the client closes its end of
+ * the connection.  If lines read from it are still to be sent, or
+ * events sent are yet to be answered, freeing @client is left to
+ * client_resume() once they have been.
+ **/
 static void
 close_handler (ClientConnection *client, NihIo *io)
 {
@@ -723,11 +806,94 @@ close_handler (ClientConnection *client, NihIo *io)
 
 	nih_debug ("Remote end closed connection");
 
+	if (client->in_flight || io->recv_buf->len) {
+		client->closed = TRUE;
+		client_pause (client);
+		return;
+	}
+
 	close (client->fd);
 	nih_free (client);
 	nih_free (io);
 }
 
+/**
+ * client_pause:
+ *
+ * @client: client connection.
+ *
+ * Stop reading from @client until client_resume() is called.
+ **/
+static void
+client_pause (ClientConnection *client)
+{
+	nih_assert (client);
+	nih_assert (client->io);
+
+	client->io->watch->events &= ~NIH_IO_READ;
+}
+
+/**
+ * client_resume:
+ *
+ * @client: client connection.
+ *
+ * Called as replies arrive for @client to send any lines still in its
+ * receive buffer and, unless that fills the window again, read from it
+ * once more; a client that has closed its end is freed once nothing of
+ * it remains.
+ **/
+static void
+client_resume (ClientConnection *client)
+{
+	NihIo *io;
+
+	nih_assert (client);
+	nih_assert (client->io);
+
+	io = client->io;
+
+	if (max_in_flight
+	    && client->in_flight >= (unsigned int)max_in_flight)
+		return;
+
+	if (io->recv_buf->len) {
+		socket_reader (client, io, io->recv_buf->buf, io->recv_buf->len);
+		if (io->recv_buf->len)
+			return;
+	}
+
+	if (! client->closed) {
+		io->watch->events |= NIH_IO_READ;
+	} else if (! client->in_flight) {
+		close (client->fd);
+		nih_free (client);
+		nih_free (io);
+	}
+}
+
+/**
+ * client_collapse_expired:
+ *
+ * @client: client connection,
+ * @timer: timer that expired.
+ *
+ * Ends the collapse window of @client, so that the next of any pair
+ * it sends is emitted again.
+ **/
+static void
+client_collapse_expired (ClientConnection *client,
+			 NihTimer         *timer)
+{
+	nih_assert (client);
+
+	/* The timer is freed once we return */
+	client->collapse_timer = NULL;
+
+	NIH_HASH_FOREACH_SAFE (client->recent, iter)
+		nih_free (iter);
+}
+
 /**
  * create_socket:
  * @parent: Parent pointer.
@@ -826,14 +992,27 @@ error:
 }
 
 static void
-emit_event_error (void           *data,
-		  NihDBusMessage *message)
+emit_event_reply (ClientConnection *client,
+		  NihDBusMessage   *message)
+{
+	nih_assert (client);
+	nih_assert (client->in_flight);
+
+	client->in_flight--;
+	client_resume (client);
+}
+
+static void
+emit_event_error (ClientConnection *client,
+		  NihDBusMessage   *message)
 {
 	NihError *err;
 
 	err = nih_error_get ();
 	nih_warn ("%s", err->message);
 	nih_free (err);
+
+	emit_event_reply (client, message);
 }
 
 static void
@@ -887,9 +1066,14 @@ emit_event (ClientConnection  *client,
 	NIH_MUST (nih_str_array_addn (&env, NULL, NULL, pair, len));
 
 	if (upstart) {
+		/* Ask for a reply so that the number of calls awaiting one
+		 * can be bounded, see socket_reader().
+		 */
 		pending_call = upstart_emit_event (upstart,
 						   event_name, env, FALSE,
-						   NULL, emit_event_error, NULL,
+						   (UpstartEmitEventReply)emit_event_reply,
+						   (NihDBusErrorHandler)emit_event_error,
+						   client,
 						   NIH_DBUS_TIMEOUT_NEVER);
 		
 		if (! pending_call) {
@@ -897,9 +1081,10 @@ emit_event (ClientConnection  *client,
 			err = nih_error_get ();
 			nih_warn ("%s", err->message);
 			nih_free (err);
+		} else {
+			client->in_flight++;
+			dbus_pending_call_unref (pending_call);
 		}
-		
-		dbus_pending_call_unref (pending_call);
 	}
 
 	NIH_LIST_FOREACH (control_conns, iter) {
@@ -1026,6 +1211,27 @@ process_event (ClientConnection  *client,
 	    const char        *pair,
 	    size_t             len)
 {
+	nih_assert (client);
+
+	if (client->recent) {
+		NihListEntry *entry;
+
+		if (nih_hash_lookup (client->recent, pair)) {
+			nih_debug ("Collapsing repeated %s", pair);
+			return;
+		}
+
+		entry = NIH_MUST (nih_list_entry_new (client->recent));
+		entry->str = NIH_MUST (nih_strdup (entry, pair));
+		nih_hash_add (client->recent, &entry->entry);
+
+		if (! client->collapse_timer)
+			client->collapse_timer = NIH_MUST (nih_timer_add_timeout (
+					client, collapse_window,
+					(NihTimerCb)client_collapse_expired,
+					client));
+	}
+
 	emit_event (client, pair, len);
 
 	if (systemd) {
@@ -0,0 +1,1295 @@
+/* upstart
+ *
+ * upstart-metrics-bridge.c - serve init state and metrics to Prometheus
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <json.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/string.h>
+#include <nih/io.h>
+#include <nih/option.h>
+#include <nih/main.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include <nih-dbus/dbus_connection.h>
+#include <nih-dbus/dbus_proxy.h>
+
+#include "dbus/upstart.h"
+#include "com.ubuntu.Upstart.h"
+#include "com.ubuntu.Upstart.Job.h"
+#include "com.ubuntu.Upstart.Instance.h"
+
+
+/**
+ * DEFAULT_LISTEN:
+ *
+ * Address we serve metrics on unless told otherwise.
+ **/
+#define DEFAULT_LISTEN "127.0.0.1:9413"
+
+/**
+ * HTTP_REQUEST_MAX:
+ *
+ * Largest request header we'll buffer before giving up on a client.
+ **/
+#define HTTP_REQUEST_MAX 8192
+
+
+/**
+ * Job:
+ * @entry: list header,
+ * @path: D-Bus path of job,
+ * @name: name of job,
+ * @proxy: proxy to job,
+ * @instances: hash of Instance by path,
+ * @restarts: number of times an instance was started again without first
+ *  reaching the waiting state,
+ * @failures: number of times an instance failed,
+ * @starts: number of times an instance went from starting to running,
+ * @start_time: total microseconds those starts took,
+ * @last_start_time: microseconds the most recent start took.
+ *
+ * Model of a job kept up to date from the signals of it and its
+ * instances, so that a scrape need not ask init anything.
+ **/
+typedef struct job {
+	NihList       entry;
+	char         *path;
+	char         *name;
+	NihDBusProxy *proxy;
+	NihHash      *instances;
+
+	uint64_t      restarts;
+	uint64_t      failures;
+	uint64_t      starts;
+	uint64_t      start_time;
+	uint64_t      last_start_time;
+} Job;
+
+/**
+ * Instance:
+ * @entry: list header,
+ * @path: D-Bus path of instance,
+ * @name: name of instance,
+ * @job: job this is an instance of,
+ * @proxy: proxy to instance,
+ * @state: current state of instance,
+ * @starting: time on CLOCK_MONOTONIC in microseconds the instance last
+ *  entered the starting state, or zero once it has run or stopped.
+ **/
+typedef struct instance {
+	NihList       entry;
+	char         *path;
+	char         *name;
+	Job          *job;
+	NihDBusProxy *proxy;
+
+	char         *state;
+	uint64_t      starting;
+} Instance;
+
+
+/* Prototypes for static functions */
+static uint64_t  time_now               (void);
+static int       listen_open            (const char *address);
+static void      listen_watcher         (void *data, NihIoWatch *watch,
+					 NihIoEvents events);
+static void      http_reader            (void *data, NihIo *io,
+					 const char *buf, size_t len);
+static void      http_respond           (NihIo *io, const char *status,
+					 const char *body, int with_body);
+static void      http_close             (void *data, NihIo *io);
+static void      http_error             (void *data, NihIo *io);
+static char *    metrics_text           (const void *parent)
+	__attribute__ ((warn_unused_result, malloc));
+static char *    label_escape           (const void *parent, const char *str)
+	__attribute__ ((warn_unused_result, malloc));
+static void      jobs_text              (char **text);
+static void      snapshot_text          (char **text);
+static void      upstart_job_added      (void *data, NihDBusMessage *message,
+					 const char *job);
+static void      upstart_job_removed    (void *data, NihDBusMessage *message,
+					 const char *job);
+static void      instance_add           (Job *job, const char *path,
+					 int get_state);
+static void      job_instance_added     (Job *job, NihDBusMessage *message,
+					 const char *instance);
+static void      job_instance_removed   (Job *job, NihDBusMessage *message,
+					 const char *instance);
+static void      instance_state_changed (Instance *instance,
+					 NihDBusMessage *message,
+					 const char *state);
+static void      instance_failed        (Instance *instance,
+					 NihDBusMessage *message,
+					 int32_t status);
+static void      upstart_disconnected   (DBusConnection *connection);
+
+
+/**
+ * daemonise:
+ *
+ * Set to TRUE if we should become a daemon, rather than just running
+ * in the foreground.
+ **/
+static int daemonise = FALSE;
+
+/**
+ * listen_address:
+ *
+ * Address to serve metrics on: an absolute path or @-prefixed abstract
+ * name of a unix socket, or a [HOST:]PORT to listen on over TCP.
+ **/
+static char *listen_address = NULL;
+
+/**
+ * snapshot_interval:
+ *
+ * Seconds a metrics snapshot from init is served for before another is
+ * requested; zero requests one for every scrape.
+ **/
+static int snapshot_interval = 10;
+
+/**
+ * snapshot:
+ * @snapshot_time: time on CLOCK_MONOTONIC in microseconds it was obtained.
+ *
+ * Most recent metrics snapshot obtained from init, in the JSON form it
+ * returns it.
+ **/
+static char *   snapshot = NULL;
+static uint64_t snapshot_time = 0;
+
+/**
+ * jobs:
+ *
+ * Jobs that we're monitoring.
+ **/
+static NihHash *jobs = NULL;
+
+/**
+ * upstart:
+ *
+ * Proxy to Upstart daemon.
+ **/
+static NihDBusProxy *upstart = NULL;
+
+
+/**
+ * options:
+ *
+ * Command-line options accepted by this program.
+ **/
+static NihOption options[] = {
+	{ 0, "daemon", N_("Detach and run in the background"),
+	  NULL, NULL, &daemonise, NULL },
+
+	{ 0, "listen", N_("unix socket path, @abstract name or [HOST:]PORT to serve metrics on"),
+	  NULL, "ADDRESS", &listen_address, NULL },
+
+	{ 0, "snapshot-interval", N_("seconds to serve init's counters for before asking for them again"),
+	  NULL, "SECONDS", &snapshot_interval, nih_option_int },
+
+	NIH_OPTION_LAST
+};
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	char **         args;
+	DBusConnection *connection;
+	char **         job_class_paths;
+	int             sock;
+	int             ret;
+
+	nih_main_init (argv[0]);
+
+	nih_option_set_synopsis (_("Serve init state and metrics to Prometheus"));
+	nih_option_set_help (
+		_("Serves the state of each job and the counters kept by init "
+		  "at /metrics over HTTP, in the Prometheus text format.\n\n"
+		  "By default, upstart-metrics-bridge does not detach from the "
+		  "console and remains in the foreground.  Use the --daemon "
+		  "option to have it detach."));
+
+	args = nih_option_parser (NULL, argc, argv, options, FALSE);
+	if (! args)
+		exit (1);
+
+	if (snapshot_interval < 0) {
+		nih_fatal ("%s", _("Snapshot interval may not be negative"));
+		exit (1);
+	}
+
+	sock = listen_open (listen_address ? listen_address : DEFAULT_LISTEN);
+	if (sock < 0) {
+		nih_fatal ("%s %s: %s", _("Could not listen on"),
+			   listen_address ? listen_address : DEFAULT_LISTEN,
+			   strerror (errno));
+		exit (1);
+	}
+
+	NIH_MUST (nih_io_add_watch (NULL, sock, NIH_IO_READ,
+				    listen_watcher, NULL));
+
+	/* Allocate jobs hash table */
+	jobs = NIH_MUST (nih_hash_string_new (NULL, 0));
+
+	/* Initialise the connection to Upstart */
+	connection = NIH_SHOULD (nih_dbus_connect (DBUS_ADDRESS_UPSTART, upstart_disconnected));
+	if (! connection) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_fatal ("%s: %s", _("Could not connect to Upstart"),
+			   err->message);
+		nih_free (err);
+
+		exit (1);
+	}
+
+	upstart = NIH_SHOULD (nih_dbus_proxy_new (NULL, connection,
+						  NULL, DBUS_PATH_UPSTART,
+						  NULL, NULL));
+	if (! upstart) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_fatal ("%s: %s", _("Could not create Upstart proxy"),
+			   err->message);
+		nih_free (err);
+
+		exit (1);
+	}
+
+	/* Connect signals to be notified when jobs come and go */
+	if (! nih_dbus_proxy_connect (upstart, &upstart_com_ubuntu_Upstart0_6, "JobAdded",
+				      (NihDBusSignalHandler)upstart_job_added, NULL)) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_fatal ("%s: %s", _("Could not create JobAdded signal connection"),
+			   err->message);
+		nih_free (err);
+
+		exit (1);
+	}
+
+	if (! nih_dbus_proxy_connect (upstart, &upstart_com_ubuntu_Upstart0_6, "JobRemoved",
+				      (NihDBusSignalHandler)upstart_job_removed, NULL)) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_fatal ("%s: %s", _("Could not create JobRemoved signal connection"),
+			   err->message);
+		nih_free (err);
+
+		exit (1);
+	}
+
+	/* Request a list of all current jobs */
+	if (upstart_get_all_jobs_sync (NULL, upstart, &job_class_paths) < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_fatal ("%s: %s", _("Could not obtain job list"),
+			   err->message);
+		nih_free (err);
+
+		exit (1);
+	}
+
+	for (char **job_class_path = job_class_paths;
+	     job_class_path && *job_class_path; job_class_path++)
+		upstart_job_added (NULL, NULL, *job_class_path);
+
+	nih_free (job_class_paths);
+
+	/* Become daemon */
+	if (daemonise) {
+		if (nih_main_daemonise () < 0) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_fatal ("%s: %s", _("Unable to become daemon"),
+				   err->message);
+			nih_free (err);
+
+			exit (1);
+		}
+
+		/* Send all logging output to syslog */
+		openlog (program_name, LOG_PID, LOG_DAEMON);
+		nih_log_set_logger (nih_logger_syslog);
+	}
+
+	/* Handle TERM and INT signals gracefully */
+	nih_signal_set_handler (SIGTERM, nih_signal_handler);
+	NIH_MUST (nih_signal_add_handler (NULL, SIGTERM, nih_main_term_signal, NULL));
+
+	if (! daemonise) {
+		nih_signal_set_handler (SIGINT, nih_signal_handler);
+		NIH_MUST (nih_signal_add_handler (NULL, SIGINT, nih_main_term_signal, NULL));
+	}
+
+	ret = nih_main_loop ();
+
+	return ret;
+}
+
+
+/**
+ * time_now:
+ *
+ * Returns: current time on CLOCK_MONOTONIC in microseconds.
+ **/
+static uint64_t
+time_now (void)
+{
+	struct timespec now;
+
+	nih_assert (clock_gettime (CLOCK_MONOTONIC, &now) == 0);
+
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+/**
+ * listen_open:
+ * @address: address to listen on.
+ *
+ * Opens a socket listening on @address, which is the absolute path of
+ * a unix socket, the name of an abstract unix socket prefixed with @ or
+ * a TCP port optionally preceded by an IPv4 address and a colon; without
+ * an address only the loopback interface is listened on.
+ *
+ * Returns: listening socket or -1 on error, with errno set.
+ **/
+static int
+listen_open (const char *address)
+{
+	union {
+		struct sockaddr     addr;
+		struct sockaddr_in  sin_addr;
+		struct sockaddr_un  sun_addr;
+	} addr;
+	socklen_t addrlen;
+	int       sock;
+	int       opt = 1;
+
+	nih_assert (address != NULL);
+
+	memset (&addr, 0, sizeof (addr));
+
+	if ((address[0] == '/') || (address[0] == '@')) {
+		struct stat statbuf;
+		size_t      len = strlen (address);
+
+		if (len >= sizeof (addr.sun_addr.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		addr.sun_addr.sun_family = AF_UNIX;
+		memcpy (addr.sun_addr.sun_path, address, len);
+		addrlen = offsetof (struct sockaddr_un, sun_path) + len;
+
+		if (address[0] == '@') {
+			addr.sun_addr.sun_path[0] = '\0';
+		} else {
+			/* Replace a socket left behind by a previous run */
+			if ((lstat (address, &statbuf) == 0)
+			    && S_ISSOCK (statbuf.st_mode))
+				unlink (address);
+		}
+	} else {
+		const char    *colon;
+		char          *endptr;
+		unsigned long  port;
+
+		addr.sin_addr.sin_family = AF_INET;
+		addr.sin_addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+		addrlen = sizeof (addr.sin_addr);
+
+		colon = strrchr (address, ':');
+		if (colon) {
+			nih_local char *host = NULL;
+
+			host = NIH_MUST (nih_strndup (NULL, address,
+						      colon - address));
+			if (inet_pton (AF_INET, host,
+				       &addr.sin_addr.sin_addr) != 1) {
+				errno = EINVAL;
+				return -1;
+			}
+
+			address = colon + 1;
+		}
+
+		port = strtoul (address, &endptr, 10);
+		if ((! *address) || *endptr || (! port) || (port > 65535)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		addr.sin_addr.sin_port = htons (port);
+	}
+
+	sock = socket (addr.addr.sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+
+	if ((addr.addr.sa_family == AF_INET)
+	    && (setsockopt (sock, SOL_SOCKET, SO_REUSEADDR,
+			    &opt, sizeof (opt)) < 0))
+		goto error;
+
+	if (bind (sock, &addr.addr, addrlen) < 0)
+		goto error;
+
+	if (listen (sock, SOMAXCONN) < 0)
+		goto error;
+
+	if (nih_io_set_nonblock (sock) < 0)
+		goto error;
+
+	return sock;
+
+error:
+	opt = errno;
+	close (sock);
+	errno = opt;
+
+	return -1;
+}
+
+/**
+ * listen_watcher:
+ * @data: unused,
+ * @watch: watch on listening socket,
+ * @events: events that occurred.
+ *
+ * Called when there are connections waiting on the listening socket to
+ * accept them, reading the request from each with an NihIo.
+ **/
+static void
+listen_watcher (void *      data,
+		NihIoWatch *watch,
+		NihIoEvents events)
+{
+	int fd;
+
+	nih_assert (watch != NULL);
+
+	while ((fd = accept4 (watch->fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+		NIH_MUST (nih_io_reopen (NULL, fd, NIH_IO_STREAM,
+					 http_reader, http_close,
+					 http_error, NULL));
+
+	if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+		nih_warn ("%s: %s", _("Failed to accept connection"),
+			  strerror (errno));
+}
+
+
+/**
+ * http_reader:
+ * @data: unused,
+ * @io: client connection,
+ * @buf: data read from client,
+ * @len: length of @buf.
+ *
+ * NihIoReader function called when data has been read from the client.
+ * Once the whole request header has arrived, the request line is used to
+ * decide the response, and the connection is closed once it is sent;
+ * anything after the header is ignored.
+ **/
+static void
+http_reader (void *      data,
+	     NihIo *     io,
+	     const char *buf,
+	     size_t      len)
+{
+	nih_local char *line = NULL;
+	nih_local char *body = NULL;
+	const char *    eol;
+	char *          target;
+	char *          version;
+	int             head;
+
+	nih_assert (io != NULL);
+	nih_assert (buf != NULL);
+
+	if (io->shutdown) {
+		nih_io_buffer_shrink (io->recv_buf, len);
+		return;
+	}
+
+	if (! (memmem (buf, len, "\r\n\r\n", 4) || memmem (buf, len, "\n\n", 2))) {
+		if (len > HTTP_REQUEST_MAX) {
+			nih_io_buffer_shrink (io->recv_buf, len);
+			http_respond (io, "431 Request Header Fields Too Large",
+				      NULL, FALSE);
+		}
+
+		return;
+	}
+
+	eol = memchr (buf, '\n', len);
+	line = NIH_MUST (nih_strndup (NULL, buf, eol - buf));
+	if (strchr (line, '\r'))
+		*strchr (line, '\r') = '\0';
+
+	nih_io_buffer_shrink (io->recv_buf, len);
+
+	/* Request line is METHOD TARGET VERSION */
+	target = strchr (line, ' ');
+	version = target ? strchr (target + 1, ' ') : NULL;
+	if (! version) {
+		http_respond (io, "400 Bad Request", NULL, FALSE);
+		return;
+	}
+
+	*(target++) = '\0';
+	*version = '\0';
+
+	if (strchr (target, '?'))
+		*strchr (target, '?') = '\0';
+
+	if (! strcmp (line, "HEAD")) {
+		head = TRUE;
+	} else if (! strcmp (line, "GET")) {
+		head = FALSE;
+	} else {
+		http_respond (io, "405 Method Not Allowed", NULL, FALSE);
+		return;
+	}
+
+	if (strcmp (target, "/metrics")) {
+		http_respond (io, "404 Not Found", NULL, FALSE);
+		return;
+	}
+
+	body = metrics_text (NULL);
+	http_respond (io, "200 OK", body, ! head);
+}
+
+/**
+ * http_respond:
+ * @io: client connection,
+ * @status: HTTP status code and reason,
+ * @body: metrics to send, or NULL for an error,
+ * @with_body: FALSE if only the header should be sent.
+ *
+ * Queues an HTTP response with @status to be sent over @io, closing the
+ * connection once it has been.
+ **/
+static void
+http_respond (NihIo *     io,
+	      const char *status,
+	      const char *body,
+	      int         with_body)
+{
+	nih_local char *header = NULL;
+
+	nih_assert (io != NULL);
+	nih_assert (status != NULL);
+
+	if (! body)
+		body = status;
+
+	header = NIH_MUST (nih_sprintf (NULL,
+					"HTTP/1.0 %s\r\n"
+					"Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+					"Content-Length: %zu\r\n"
+					"Connection: close\r\n"
+					"\r\n",
+					status, strlen (body)));
+
+	NIH_ZERO (nih_io_write (io, header, strlen (header)));
+	if (with_body)
+		NIH_ZERO (nih_io_write (io, body, strlen (body)));
+
+	nih_io_shutdown (io);
+}
+
+/**
+ * http_close:
+ * @data: unused,
+ * @io: client connection.
+ *
+ * NihIoCloseHandler function called when the client closes its end of
+ * the connection before we've responded.
+ **/
+static void
+http_close (void * data,
+	    NihIo *io)
+{
+	nih_assert (io != NULL);
+
+	nih_free (io);
+}
+
+/**
+ * http_error:
+ * @data: unused,
+ * @io: client connection.
+ *
+ * NihIoErrorHandler function called when reading from or writing to the
+ * client fails, most likely because it went away.
+ **/
+static void
+http_error (void * data,
+	    NihIo *io)
+{
+	NihError *err;
+
+	nih_assert (io != NULL);
+
+	err = nih_error_get ();
+	nih_debug ("%s: %s", _("Error from client"), err->message);
+	nih_free (err);
+
+	nih_free (io);
+}
+
+
+/**
+ * metrics_text:
+ * @parent: parent object for new string.
+ *
+ * Formats the model of every job, and the most recent snapshot of init's
+ * own counters, in the Prometheus text exposition format.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned string.  When all parents
+ * of the returned string are freed, the returned string will also be
+ * freed.
+ *
+ * Returns: newly allocated string.
+ **/
+static char *
+metrics_text (const void *parent)
+{
+	char *text;
+
+	text = NIH_MUST (nih_strdup (parent, ""));
+
+	jobs_text (&text);
+	snapshot_text (&text);
+
+	return text;
+}
+
+/**
+ * label_escape:
+ * @parent: parent object for new string,
+ * @str: label value to escape.
+ *
+ * Escapes backslashes, double quotes and newlines in @str so that it may
+ * be used as a label value.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned string.  When all parents
+ * of the returned string are freed, the returned string will also be
+ * freed.
+ *
+ * Returns: newly allocated string.
+ **/
+static char *
+label_escape (const void *parent,
+	      const char *str)
+{
+	char *escaped;
+
+	nih_assert (str != NULL);
+
+	escaped = NIH_MUST (nih_strdup (parent, ""));
+
+	for (const char *c = str; *c; c++) {
+		switch (*c) {
+		case '\\':
+			NIH_MUST (nih_strcat (&escaped, parent, "\\\\"));
+			break;
+		case '"':
+			NIH_MUST (nih_strcat (&escaped, parent, "\\\""));
+			break;
+		case '\n':
+			NIH_MUST (nih_strcat (&escaped, parent, "\\n"));
+			break;
+		default:
+			NIH_MUST (nih_strcat_sprintf (&escaped, parent,
+						      "%c", *c));
+		}
+	}
+
+	return escaped;
+}
+
+/**
+ * jobs_text:
+ * @text: string to append to.
+ *
+ * Appends the instances, state, restarts, failures and start durations
+ * of every job to @text.  Samples of each metric must be grouped
+ * together, so the jobs are walked once for each.
+ **/
+static void
+jobs_text (char **text)
+{
+	nih_assert (text != NULL);
+
+	NIH_MUST (nih_strcat (text, NULL,
+			      "# HELP upstart_job_instances Number of instances of each job.\n"
+			      "# TYPE upstart_job_instances gauge\n"));
+	NIH_HASH_FOREACH (jobs, iter) {
+		Job            *job = (Job *)iter;
+		nih_local char *name = NULL;
+		size_t          instances = 0;
+
+		name = label_escape (NULL, job->name);
+		NIH_HASH_FOREACH (job->instances, instance_iter)
+			instances++;
+
+		NIH_MUST (nih_strcat_sprintf (text, NULL,
+					      "upstart_job_instances{job=\"%s\"} %zu\n",
+					      name, instances));
+	}
+
+	NIH_MUST (nih_strcat (text, NULL,
+			      "# HELP upstart_job_state Current state of each job instance.\n"
+			      "# TYPE upstart_job_state gauge\n"));
+	NIH_HASH_FOREACH (jobs, iter) {
+		Job            *job = (Job *)iter;
+		nih_local char *name = NULL;
+
+		name = label_escape (NULL, job->name);
+		NIH_HASH_FOREACH (job->instances, instance_iter) {
+			Instance       *instance = (Instance *)instance_iter;
+			nih_local char *instance_name = NULL;
+
+			instance_name = label_escape (NULL, instance->name);
+			NIH_MUST (nih_strcat_sprintf (text, NULL,
+						      "upstart_job_state{job=\"%s\",instance=\"%s\",state=\"%s\"} 1\n",
+						      name, instance_name,
+						      instance->state));
+		}
+	}
+
+	NIH_MUST (nih_strcat (text, NULL,
+			      "# HELP upstart_job_restarts_total Instances of each job started again without stopping.\n"
+			      "# TYPE upstart_job_restarts_total counter\n"));
+	NIH_HASH_FOREACH (jobs, iter) {
+		Job            *job = (Job *)iter;
+		nih_local char *name = NULL;
+
+		name = label_escape (NULL, job->name);
+		NIH_MUST (nih_strcat_sprintf (text, NULL,
+					      "upstart_job_restarts_total{job=\"%s\"} %llu\n",
+					      name,
+					      (unsigned long long)job->restarts));
+	}
+
+	NIH_MUST (nih_strcat (text, NULL,
+			      "# HELP upstart_job_failures_total Instances of each job that failed.\n"
+			      "# TYPE upstart_job_failures_total counter\n"));
+	NIH_HASH_FOREACH (jobs, iter) {
+		Job            *job = (Job *)iter;
+		nih_local char *name = NULL;
+
+		name = label_escape (NULL, job->name);
+		NIH_MUST (nih_strcat_sprintf (text, NULL,
+					      "upstart_job_failures_total{job=\"%s\"} %llu\n",
+					      name,
+					      (unsigned long long)job->failures));
+	}
+
+	NIH_MUST (nih_strcat (text, NULL,
+			      "# HELP upstart_job_start_duration_seconds Time instances of each job took from starting to running.\n"
+			      "# TYPE upstart_job_start_duration_seconds summary\n"));
+	NIH_HASH_FOREACH (jobs, iter) {
+		Job            *job = (Job *)iter;
+		nih_local char *name = NULL;
+
+		name = label_escape (NULL, job->name);
+		NIH_MUST (nih_strcat_sprintf (text, NULL,
+					      "upstart_job_start_duration_seconds_sum{job=\"%s\"} %.6f\n"
+					      "upstart_job_start_duration_seconds_count{job=\"%s\"} %llu\n",
+					      name, job->start_time / 1e6,
+					      name,
+					      (unsigned long long)job->starts));
+	}
+
+	NIH_MUST (nih_strcat (text, NULL,
+			      "# HELP upstart_job_last_start_duration_seconds Time the most recent start of each job took.\n"
+			      "# TYPE upstart_job_last_start_duration_seconds gauge\n"));
+	NIH_HASH_FOREACH (jobs, iter) {
+		Job            *job = (Job *)iter;
+		nih_local char *name = NULL;
+
+		if (! job->starts)
+			continue;
+
+		name = label_escape (NULL, job->name);
+		NIH_MUST (nih_strcat_sprintf (text, NULL,
+					      "upstart_job_last_start_duration_seconds{job=\"%s\"} %.6f\n",
+					      name, job->last_start_time / 1e6));
+	}
+}
+
+/**
+ * snapshot_text:
+ * @text: string to append to.
+ *
+ * Appends init's own counters and latencies to @text, requesting a new
+ * snapshot of them once the last is snapshot_interval seconds old.
+ * Values that may go down are exported as gauges, everything else as
+ * counters, and latencies as summaries in seconds.  Nothing is appended
+ * if init can't give us a snapshot.
+ **/
+static void
+snapshot_text (char **text)
+{
+	static const char *gauges[] = { "queue_depth", "queue_peak",
+					"admission_queued", "admission_peak",
+					"unflushed", "live", "peak",
+					"threshold", "ready", NULL };
+	struct json_object *json;
+	uint64_t            now;
+
+	nih_assert (text != NULL);
+
+	now = time_now ();
+	if ((! snapshot)
+	    || (now - snapshot_time >= (uint64_t)snapshot_interval * 1000000)) {
+		char *str;
+
+		if (upstart_metrics_get_snapshot_sync (NULL, upstart, &str) < 0) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_debug ("%s: %s", _("Could not obtain init metrics"),
+				   err->message);
+			nih_free (err);
+		} else {
+			if (snapshot)
+				nih_free (snapshot);
+
+			snapshot = str;
+			snapshot_time = now;
+		}
+	}
+
+	if (! snapshot)
+		return;
+
+	json = json_tokener_parse (snapshot);
+	if (! json)
+		return;
+
+	json_object_object_foreach (json, section, json_section) {
+		if (! json_object_is_type (json_section, json_type_object))
+			continue;
+
+		if (! strcmp (section, "latency")) {
+			json_object_object_foreach (json_section, name, json_latency) {
+				struct json_object *json_value;
+				int64_t             values[5] = { 0 };
+				const char *        keys[5] = { "p50", "p90", "p99",
+								"sum", "count" };
+
+				for (int i = 0; i < 5; i++)
+					if (json_object_object_get_ex (json_latency,
+								       keys[i],
+								       &json_value))
+						values[i] = json_object_get_int64 (json_value);
+
+				NIH_MUST (nih_strcat_sprintf (text, NULL,
+							      "# TYPE upstart_%s_latency_seconds summary\n"
+							      "upstart_%s_latency_seconds{quantile=\"0.5\"} %.6f\n"
+							      "upstart_%s_latency_seconds{quantile=\"0.9\"} %.6f\n"
+							      "upstart_%s_latency_seconds{quantile=\"0.99\"} %.6f\n"
+							      "upstart_%s_latency_seconds_sum %.6f\n"
+							      "upstart_%s_latency_seconds_count %lld\n",
+							      name, name, values[0] / 1e6,
+							      name, values[1] / 1e6,
+							      name, values[2] / 1e6,
+							      name, values[3] / 1e6,
+							      name, (long long)values[4]));
+			}
+
+			continue;
+		}
+
+		json_object_object_foreach (json_section, key, json_value) {
+			const char *type = "counter";
+			const char *suffix = "_total";
+
+			if (! json_object_is_type (json_value, json_type_int))
+				continue;
+
+			for (const char **gauge = gauges; *gauge; gauge++) {
+				if (! strcmp (key, *gauge)) {
+					type = "gauge";
+					suffix = "";
+				}
+			}
+
+			NIH_MUST (nih_strcat_sprintf (text, NULL,
+						      "# TYPE upstart_%s_%s%s %s\n"
+						      "upstart_%s_%s%s %lld\n",
+						      section, key, suffix, type,
+						      section, key, suffix,
+						      (long long)json_object_get_int64 (json_value)));
+		}
+	}
+
+	json_object_put (json);
+}
+
+
+/**
+ * upstart_job_added:
+ * @data: unused,
+ * @message: D-Bus message received, or NULL when enumerating jobs,
+ * @job_class_path: D-Bus path of job.
+ *
+ * Called when a job is added, or for each job that already exists when
+ * we start, to begin following it and its instances.
+ **/
+static void
+upstart_job_added (void *          data,
+		   NihDBusMessage *message,
+		   const char *    job_class_path)
+{
+	nih_local char **instance_paths = NULL;
+	Job *            job;
+	NihError *       err;
+
+	nih_assert (job_class_path != NULL);
+
+	/* Free any existing record for the job (should never happen,
+	 * but worth being safe).
+	 */
+	job = (Job *)nih_hash_lookup (jobs, job_class_path);
+	if (job)
+		nih_free (job);
+
+	/* Create new record for the job */
+	job = NIH_MUST (nih_new (NULL, Job));
+	memset (job, 0, sizeof (Job));
+
+	nih_list_init (&job->entry);
+	nih_alloc_set_destructor (job, nih_list_destroy);
+
+	job->path = NIH_MUST (nih_strdup (job, job_class_path));
+	job->instances = NIH_MUST (nih_hash_string_new (job, 0));
+
+	/* Obtain a proxy to the job */
+	job->proxy = nih_dbus_proxy_new (job, upstart->connection,
+					 upstart->name, job_class_path,
+					 NULL, NULL);
+	if (! job->proxy)
+		goto error;
+
+	job->proxy->auto_start = FALSE;
+
+	if (job_class_get_name_sync (job, job->proxy, &job->name) < 0)
+		goto error;
+
+	/* Connect signals before asking for the instances, so that none
+	 * can be missed in between.
+	 */
+	if (! nih_dbus_proxy_connect (job->proxy, &job_class_com_ubuntu_Upstart0_6_Job,
+				      "InstanceAdded",
+				      (NihDBusSignalHandler)job_instance_added, job))
+		goto error;
+
+	if (! nih_dbus_proxy_connect (job->proxy, &job_class_com_ubuntu_Upstart0_6_Job,
+				      "InstanceRemoved",
+				      (NihDBusSignalHandler)job_instance_removed, job))
+		goto error;
+
+	if (job_class_get_all_instances_sync (NULL, job->proxy,
+					      &instance_paths) < 0)
+		goto error;
+
+	nih_debug ("Job got added %s", job_class_path);
+
+	nih_hash_add (jobs, &job->entry);
+
+	for (char **instance_path = instance_paths;
+	     instance_path && *instance_path; instance_path++)
+		instance_add (job, *instance_path, TRUE);
+
+	return;
+
+error:
+	err = nih_error_get ();
+	nih_error ("Could not follow job %s: %s",
+		   job_class_path, err->message);
+	nih_free (err);
+
+	nih_free (job);
+}
+
+/**
+ * upstart_job_removed:
+ * @data: unused,
+ * @message: D-Bus message received,
+ * @job_path: D-Bus path of job.
+ *
+ * Called when a job is removed, to forget it and its instances.
+ **/
+static void
+upstart_job_removed (void *          data,
+		     NihDBusMessage *message,
+		     const char *    job_path)
+{
+	Job *job;
+
+	nih_assert (job_path != NULL);
+
+	job = (Job *)nih_hash_lookup (jobs, job_path);
+	if (job) {
+		nih_debug ("Job went away %s", job_path);
+		nih_free (job);
+	}
+}
+
+
+/**
+ * instance_add:
+ * @job: job instance belongs to,
+ * @path: D-Bus path of instance,
+ * @get_state: TRUE to ask for the current state of the instance.
+ *
+ * Begins following the instance of @job at @path.  Newly added instances
+ * are always waiting, and their state may have moved on by the time we
+ * could ask for it, so it's only asked for instances that already
+ * existed when we began following @job.
+ **/
+static void
+instance_add (Job *       job,
+	      const char *path,
+	      int         get_state)
+{
+	Instance *instance;
+	NihError *err;
+
+	nih_assert (job != NULL);
+	nih_assert (path != NULL);
+
+	instance = (Instance *)nih_hash_lookup (job->instances, path);
+	if (instance)
+		nih_free (instance);
+
+	instance = NIH_MUST (nih_new (job->instances, Instance));
+	memset (instance, 0, sizeof (Instance));
+
+	nih_list_init (&instance->entry);
+	nih_alloc_set_destructor (instance, nih_list_destroy);
+
+	instance->path = NIH_MUST (nih_strdup (instance, path));
+	instance->job = job;
+
+	instance->proxy = nih_dbus_proxy_new (instance, upstart->connection,
+					      upstart->name, path,
+					      NULL, NULL);
+	if (! instance->proxy)
+		goto error;
+
+	instance->proxy->auto_start = FALSE;
+
+	if (job_get_name_sync (instance, instance->proxy, &instance->name) < 0)
+		goto error;
+
+	if (! nih_dbus_proxy_connect (instance->proxy,
+				      &job_com_ubuntu_Upstart0_6_Instance,
+				      "StateChanged",
+				      (NihDBusSignalHandler)instance_state_changed,
+				      instance))
+		goto error;
+
+	if (! nih_dbus_proxy_connect (instance->proxy,
+				      &job_com_ubuntu_Upstart0_6_Instance,
+				      "Failed",
+				      (NihDBusSignalHandler)instance_failed,
+				      instance))
+		goto error;
+
+	if (get_state) {
+		if (job_get_state_sync (instance, instance->proxy,
+					&instance->state) < 0)
+			goto error;
+	} else {
+		instance->state = NIH_MUST (nih_strdup (instance, "waiting"));
+	}
+
+	nih_hash_add (job->instances, &instance->entry);
+
+	return;
+
+error:
+	err = nih_error_get ();
+	nih_error ("Could not follow instance %s: %s",
+		   path, err->message);
+	nih_free (err);
+
+	nih_free (instance);
+}
+
+/**
+ * job_instance_added:
+ * @job: job instance belongs to,
+ * @message: D-Bus message received,
+ * @instance_path: D-Bus path of instance.
+ *
+ * Called when an instance of @job is added.
+ **/
+static void
+job_instance_added (Job *           job,
+		    NihDBusMessage *message,
+		    const char *    instance_path)
+{
+	nih_assert (job != NULL);
+	nih_assert (instance_path != NULL);
+
+	instance_add (job, instance_path, FALSE);
+}
+
+/**
+ * job_instance_removed:
+ * @job: job instance belonged to,
+ * @message: D-Bus message received,
+ * @instance_path: D-Bus path of instance.
+ *
+ * Called when an instance of @job is removed.
+ **/
+static void
+job_instance_removed (Job *           job,
+		      NihDBusMessage *message,
+		      const char *    instance_path)
+{
+	Instance *instance;
+
+	nih_assert (job != NULL);
+	nih_assert (instance_path != NULL);
+
+	instance = (Instance *)nih_hash_lookup (job->instances, instance_path);
+	if (instance)
+		nih_free (instance);
+}
+
+/**
+ * instance_state_changed:
+ * @instance: instance that changed,
+ * @message: D-Bus message received,
+ * @state: new state.
+ *
+ * Called when @instance changes state.  An instance that enters the
+ * starting state from any state other than waiting has been respawned
+ * or restarted, and the time from starting to running is recorded as
+ * the duration of the start.
+ **/
+static void
+instance_state_changed (Instance *      instance,
+			NihDBusMessage *message,
+			const char *    state)
+{
+	Job *    job;
+	uint64_t now;
+
+	nih_assert (instance != NULL);
+	nih_assert (state != NULL);
+
+	job = instance->job;
+	now = time_now ();
+
+	if (! strcmp (state, "starting")) {
+		if (strcmp (instance->state, "waiting"))
+			job->restarts++;
+
+		instance->starting = now;
+	} else if (! strcmp (state, "running")) {
+		if (instance->starting) {
+			job->last_start_time = now - instance->starting;
+			job->start_time += job->last_start_time;
+			job->starts++;
+		}
+
+		instance->starting = 0;
+	} else if (! strcmp (state, "stopping")) {
+		instance->starting = 0;
+	}
+
+	nih_free (instance->state);
+	instance->state = NIH_MUST (nih_strdup (instance, state));
+}
+
+/**
+ * instance_failed:
+ * @instance: instance that failed,
+ * @message: D-Bus message received,
+ * @status: exit status or signal of failed process.
+ *
+ * Called when @instance fails.
+ **/
+static void
+instance_failed (Instance *      instance,
+		 NihDBusMessage *message,
+		 int32_t         status)
+{
+	nih_assert (instance != NULL);
+
+	instance->job->failures++;
+}
+
+
+static void
+upstart_disconnected (DBusConnection *connection)
+{
+	nih_fatal (_("Disconnected from Upstart"));
+	nih_main_loop_exit (1);
+}
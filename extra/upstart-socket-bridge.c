@@ -42,12 +42,14 @@
 #include <nih/hash.h>
 #include <nih/string.h>
 #include <nih/io.h>
+#include <nih/timer.h>
 #include <nih/option.h>
 #include <nih/main.h>
 #include <nih/logging.h>
 #include <nih/error.h>
 
 #include <nih-dbus/dbus_connection.h>
+#include <nih-dbus/dbus_error.h>
 #include <nih-dbus/dbus_proxy.h>
 
 #include "dbus/upstart.h"
@@ -65,6 +67,7 @@ typedef struct job {
 /* Structure we use for tracking listening sockets */
 typedef struct socket {
 	NihList entry;
+	Job    *job;
 
 	union {
 		struct sockaddr         addr;
@@ -75,6 +78,14 @@ typedef struct socket {
 	socklen_t addrlen;
 
 	int sock;
+	int accept;
+
+	int       idle;
+	NihTimer *idle_timer;
+
+	unsigned int accepted;
+	int          throttled;
+	NihTimer    *rate_timer;
 } Socket;
 
 
@@ -85,11 +96,25 @@ static void upstart_job_added    (void *data, NihDBusMessage *message,
 				  const char *job);
 static void upstart_job_removed  (void *data, NihDBusMessage *message,
 				  const char *job);
+static void upstart_jobs_changed (void *data, NihDBusMessage *message,
+				  UpstartJobsChangedAddedElement * const *added,
+				  char * const *removed);
+static void upstart_get_jobs     (void);
+static void job_conditions_add   (const char *job_class_path,
+				  char ***start_on, char ***stop_on);
+static char **socket_event_env   (const void *parent, Socket *sock,
+				  size_t *len);
+static void socket_accept        (Socket *sock);
+static void socket_activity      (Socket *sock);
+static void socket_idle_expired  (Socket *sock, NihTimer *timer);
+static void socket_rate_expired  (Socket *sock, NihTimer *timer);
 static void job_add_socket       (Job *job, char **socket_info);
 static void socket_destroy       (Socket *socket);
 static void upstart_disconnected (DBusConnection *connection);
 static void emit_event_reply     (Socket *sock, NihDBusMessage *message);
 static void emit_event_error     (Socket *sock, NihDBusMessage *message);
+static void stop_job_reply       (Socket *sock, NihDBusMessage *message);
+static void stop_job_error       (Socket *sock, NihDBusMessage *message);
 
 
 /**
@@ -121,6 +146,23 @@ static NihHash *jobs = NULL;
  **/
 static NihDBusProxy *upstart = NULL;
 
+/**
+ * connections:
+ *
+ * Number of connections accepted on behalf of jobs, used to give each
+ * a unique CONNECTION value that can be used as the job instance.
+ **/
+static unsigned long connections = 0;
+
+/**
+ * max_connection_rate:
+ *
+ * Maximum number of connections accepted on each socket per second;
+ * once reached we stop watching the socket until the second is up,
+ * leaving further connections in its backlog.  Zero for no limit.
+ **/
+static int max_connection_rate = 100;
+
 
 /**
  * options:
@@ -130,6 +172,9 @@ static NihDBusProxy *upstart = NULL;
 static NihOption options[] = {
 	{ 0, "daemon", N_("Detach and run in the background"),
 	  NULL, NULL, &daemonise, NULL },
+	{ 0, "max-connection-rate",
+	  N_("Accept at most NUM connections per second on each socket"),
+	  NULL, "NUM", &max_connection_rate, nih_option_int },
 
 	NIH_OPTION_LAST
 };
@@ -141,7 +186,7 @@ main (int   argc,
 {
 	char **         args;
 	DBusConnection *connection;
-	char **         job_class_paths;
+	UpstartGetAllJobConditionsJobsElement **job_conditions;
 	int             ret;
 
 	nih_main_init (argv[0]);
@@ -199,49 +244,51 @@ main (int   argc,
 		exit (1);
 	}
 
-	/* Connect signals to be notified when jobs come and go */
-	if (! nih_dbus_proxy_connect (upstart, &upstart_com_ubuntu_Upstart0_6, "JobAdded",
-				      (NihDBusSignalHandler)upstart_job_added, NULL)) {
+	/* Connect signal to be notified when jobs come and go, in one
+	 * batch each time the configuration changes.
+	 */
+	if (! nih_dbus_proxy_connect (upstart, &upstart_com_ubuntu_Upstart0_6, "JobsChanged",
+				      (NihDBusSignalHandler)upstart_jobs_changed, NULL)) {
 		NihError *err;
 
 		err = nih_error_get ();
-		nih_fatal ("%s: %s", _("Could not create JobAdded signal connection"),
+		nih_fatal ("%s: %s", _("Could not create JobsChanged signal connection"),
 			   err->message);
 		nih_free (err);
 
 		exit (1);
 	}
 
-	if (! nih_dbus_proxy_connect (upstart, &upstart_com_ubuntu_Upstart0_6, "JobRemoved",
-				      (NihDBusSignalHandler)upstart_job_removed, NULL)) {
-		NihError *err;
+	/* Request the conditions of all current jobs in one call, falling
+	 * back to asking each job for them when Upstart is too old to
+	 * support that.
+	 */
+	if (upstart_get_all_job_conditions_sync (NULL, upstart,
+						 &job_conditions) < 0) {
+		NihDBusError *dbus_err;
 
-		err = nih_error_get ();
-		nih_fatal ("%s: %s", _("Could not create JobRemoved signal connection"),
-			   err->message);
-		nih_free (err);
+		dbus_err = (NihDBusError *)nih_error_get ();
+		if ((dbus_err->number != NIH_DBUS_ERROR)
+		    || strcmp (dbus_err->name, DBUS_ERROR_UNKNOWN_METHOD)) {
+			nih_fatal ("%s: %s", _("Could not obtain job conditions"),
+				   dbus_err->message);
+			nih_free (dbus_err);
 
-		exit (1);
-	}
+			exit (1);
+		}
 
-	/* Request a list of all current jobs */
-	if (upstart_get_all_jobs_sync (NULL, upstart, &job_class_paths) < 0) {
-		NihError *err;
+		nih_free (dbus_err);
 
-		err = nih_error_get ();
-		nih_fatal ("%s: %s", _("Could not obtain job list"),
-			   err->message);
-		nih_free (err);
+		upstart_get_jobs ();
+	} else {
+		for (UpstartGetAllJobConditionsJobsElement **job = job_conditions;
+		     *job; job++)
+			job_conditions_add ((*job)->item0, (*job)->item1,
+					    (*job)->item2);
 
-		exit (1);
+		nih_free (job_conditions);
 	}
 
-	for (char **job_class_path = job_class_paths;
-	     job_class_path && *job_class_path; job_class_path++)
-		upstart_job_added (NULL, NULL, *job_class_path);
-
-	nih_free (job_class_paths);
-
 	/* Become daemon */
 	if (daemonise) {
 		if (nih_main_daemonise () < 0) {
@@ -293,10 +340,8 @@ epoll_watcher (void *      data,
 	for (int i = 0; i < num_events; i++) {
 		Socket *sock = (Socket *)event[i].data.ptr;
 		nih_local char **env = NULL;
-		size_t env_len = 0;
-		char *var;
+		size_t env_len;
 		DBusPendingCall *pending_call;
-		char buffer[INET6_ADDRSTRLEN];
 
 		if (event[i].events & EPOLLIN)
 			nih_debug ("%p EPOLLIN", sock);
@@ -305,60 +350,242 @@ epoll_watcher (void *      data,
 		if (event[i].events & EPOLLHUP)
 			nih_debug ("%p EPOLLHUP", sock);
 
-		env = NIH_MUST (nih_str_array_new (NULL));
+		if (sock->accept) {
+			socket_accept (sock);
+			continue;
+		}
 
-		switch (sock->addr.sa_family) {
-		case AF_INET:
-			NIH_MUST (nih_str_array_add (&env, NULL, &env_len,
-							"PROTO=inet"));
+		socket_activity (sock);
+
+		env = socket_event_env (NULL, sock, &env_len);
+
+		pending_call = NIH_SHOULD (upstart_emit_event_with_file (
+						   upstart, "socket", env, TRUE,
+						   sock->sock,
+						   (UpstartEmitEventWithFileReply)emit_event_reply,
+						   (NihDBusErrorHandler)emit_event_error,
+						   sock,
+						   NIH_DBUS_TIMEOUT_NEVER));
+		if (! pending_call) {
+			NihError *err;
 
-			var = NIH_MUST (nih_sprintf (NULL, "PORT=%d",
-							ntohs (sock->sin_addr.sin_port)));
-			NIH_MUST (nih_str_array_addp (&env, NULL, &env_len,
-							var));
+			err = nih_error_get ();
+			nih_warn ("%s: %s", _("Could not send socket event"),
+				  err->message);
+			nih_free (err);
+		}
+
+		dbus_pending_call_unref (pending_call);
+
+		// might be EPOLLIN
+		// might be EPOLLERR
+		// might be EPOLLHUP
+	}
+}
+
+
+/**
+ * socket_event_env:
+ * @parent: parent object for new array,
+ * @sock: socket event is for,
+ * @len: length of returned array.
+ *
+ * Builds the environment of a socket event for @sock, describing the
+ * address it listens on such that it matches the job's condition.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned array.  When all parents
+ * of the returned array are freed, the returned array will also be
+ * freed.
+ *
+ * Returns: newly allocated environment array.
+ **/
+static char **
+socket_event_env (const void *parent,
+		  Socket *    sock,
+		  size_t *    len)
+{
+	char **env;
+	char *var;
+	char buffer[INET6_ADDRSTRLEN];
+
+	nih_assert (sock != NULL);
+	nih_assert (len != NULL);
+
+	*len = 0;
+
+	env = NIH_MUST (nih_str_array_new (parent));
+
+	switch (sock->addr.sa_family) {
+	case AF_INET:
+		NIH_MUST (nih_str_array_add (&env, parent, len,
+						"PROTO=inet"));
+
+		var = NIH_MUST (nih_sprintf (NULL, "PORT=%d",
+						ntohs (sock->sin_addr.sin_port)));
+		NIH_MUST (nih_str_array_addp (&env, parent, len,
+						var));
+		nih_discard (var);
+
+		var = NIH_MUST (nih_sprintf (NULL, "ADDR=%s",
+						inet_ntoa (sock->sin_addr.sin_addr)));
+		NIH_MUST (nih_str_array_addp (&env, parent, len,
+						var));
+		nih_discard (var);
+		break;
+	case AF_INET6:
+		NIH_MUST (nih_str_array_add (&env, parent, len,
+						"PROTO=inet6"));
+
+		var = NIH_MUST (nih_sprintf (NULL, "PORT=%d",
+						ntohs (sock->sin6_addr.sin6_port)));
+		NIH_MUST (nih_str_array_addp (&env, parent, len,
+						var));
+		nih_discard (var);
+
+		var = NIH_MUST (nih_sprintf (NULL, "ADDR=%s",
+						inet_ntop(AF_INET6, &sock->sin6_addr.sin6_addr, buffer, INET6_ADDRSTRLEN)));
+
+		NIH_MUST (nih_str_array_addp (&env, parent, len,
+						var));
+		nih_discard (var);
+		break;
+	case AF_UNIX:
+		NIH_MUST (nih_str_array_add (&env, parent, len,
+					     "PROTO=unix"));
+
+		var = NIH_MUST (nih_sprintf (NULL, "SOCKET_PATH=%s",
+					     sock->sun_addr.sun_path));
+		NIH_MUST (nih_str_array_addp (&env, parent, len,
+					      var));
+		nih_discard (var);
+		break;
+	default:
+		nih_assert_not_reached ();
+	}
+
+	if (sock->idle) {
+		var = NIH_MUST (nih_sprintf (NULL, "IDLE=%d", sock->idle));
+		NIH_MUST (nih_str_array_addp (&env, parent, len, var));
+		nih_discard (var);
+	}
+
+	return env;
+}
+
+/**
+ * socket_accept:
+ * @sock: listening socket with pending connections.
+ *
+ * Accepts every pending connection on @sock on behalf of its job,
+ * emitting a socket event without waiting for each that passes the
+ * connected socket to a new instance of the job in place of the
+ * listening socket; since the socket is edge-triggered, all pending
+ * connections must be accepted before returning.
+ *
+ * The events describe @sock as for ordinary socket events, with ACCEPT=yes
+ * and a unique CONNECTION number; the address of the peer is given in
+ * REMOTE_ADDR and REMOTE_PORT for internet sockets.
+ *
+ * No more than max_connection_rate connections are accepted on @sock
+ * each second, since each starts a new job instance; at the limit @sock
+ * is removed from the epoll set until socket_rate_expired() adds it again.
+ **/
+static void
+socket_accept (Socket *sock)
+{
+	nih_assert (sock != NULL);
+	nih_assert (sock->accept);
+
+	for (;;) {
+		union {
+			struct sockaddr         addr;
+			struct sockaddr_in  sin_addr;
+			struct sockaddr_in6 sin6_addr;
+			struct sockaddr_un  sun_addr;
+		} peer;
+		socklen_t peerlen = sizeof peer;
+		nih_local char **env = NULL;
+		size_t env_len;
+		char *var;
+		char buffer[INET6_ADDRSTRLEN];
+		DBusPendingCall *pending_call;
+		int fd;
+
+		if ((max_connection_rate > 0)
+		    && (sock->accepted >= (unsigned int)max_connection_rate)) {
+			nih_warn ("%s: %s", sock->job->path,
+				  _("Connection rate limit reached, "
+				    "pausing accept"));
+
+			epoll_ctl (epoll_fd, EPOLL_CTL_DEL, sock->sock, NULL);
+			sock->throttled = TRUE;
+			return;
+		}
+
+		fd = accept4 (sock->sock, &peer.addr, &peerlen, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+				nih_warn ("%s: %s", _("Failed to accept connection"),
+					  strerror (errno));
+			return;
+		}
+
+		if (! sock->rate_timer)
+			sock->rate_timer = NIH_MUST (nih_timer_add_timeout (
+							     sock, 1,
+							     (NihTimerCb)socket_rate_expired,
+							     sock));
+		sock->accepted++;
+
+		env = socket_event_env (NULL, sock, &env_len);
+
+		NIH_MUST (nih_str_array_add (&env, NULL, &env_len,
+					     "ACCEPT=yes"));
+
+		var = NIH_MUST (nih_sprintf (NULL, "CONNECTION=%lu",
+					     ++connections));
+		NIH_MUST (nih_str_array_addp (&env, NULL, &env_len, var));
+		nih_discard (var);
+
+		switch (peer.addr.sa_family) {
+		case AF_INET:
+			var = NIH_MUST (nih_sprintf (NULL, "REMOTE_ADDR=%s",
+						     inet_ntoa (peer.sin_addr.sin_addr)));
+			NIH_MUST (nih_str_array_addp (&env, NULL, &env_len, var));
 			nih_discard (var);
 
-			var = NIH_MUST (nih_sprintf (NULL, "ADDR=%s",
-							inet_ntoa (sock->sin_addr.sin_addr)));
-			NIH_MUST (nih_str_array_addp (&env, NULL, &env_len,
-							var));
+			var = NIH_MUST (nih_sprintf (NULL, "REMOTE_PORT=%d",
+						     ntohs (peer.sin_addr.sin_port)));
+			NIH_MUST (nih_str_array_addp (&env, NULL, &env_len, var));
 			nih_discard (var);
 			break;
- 		case AF_INET6:
-			NIH_MUST (nih_str_array_add (&env, NULL, &env_len,
-							"PROTO=inet6"));
-
-			var = NIH_MUST (nih_sprintf (NULL, "PORT=%d",
-							ntohs (sock->sin6_addr.sin6_port)));
-			NIH_MUST (nih_str_array_addp (&env, NULL, &env_len,
-							var));
+		case AF_INET6:
+			var = NIH_MUST (nih_sprintf (NULL, "REMOTE_ADDR=%s",
+						     inet_ntop (AF_INET6, &peer.sin6_addr.sin6_addr,
+								buffer, INET6_ADDRSTRLEN)));
+			NIH_MUST (nih_str_array_addp (&env, NULL, &env_len, var));
 			nih_discard (var);
 
-			var = NIH_MUST (nih_sprintf (NULL, "ADDR=%s",
-							inet_ntop(AF_INET6, &sock->sin6_addr.sin6_addr, buffer, INET6_ADDRSTRLEN)));
-
-			NIH_MUST (nih_str_array_addp (&env, NULL, &env_len,
-							var));
-			nih_discard (var);
-			break;
-		case AF_UNIX:
-			NIH_MUST (nih_str_array_add (&env, NULL, &env_len,
-						     "PROTO=unix"));
-
-			var = NIH_MUST (nih_sprintf (NULL, "SOCKET_PATH=%s",
-						     sock->sun_addr.sun_path));
-			NIH_MUST (nih_str_array_addp (&env, NULL, &env_len,
-						      var));
+			var = NIH_MUST (nih_sprintf (NULL, "REMOTE_PORT=%d",
+						     ntohs (peer.sin6_addr.sin6_port)));
+			NIH_MUST (nih_str_array_addp (&env, NULL, &env_len, var));
 			nih_discard (var);
 			break;
 		default:
-			nih_assert_not_reached ();
+			break;
 		}
 
+		/* Don't wait for the job to start before accepting the next
+		 * connection; the descriptor is duplicated into the message
+		 * so ours can be closed as soon as it's queued.
+		 */
 		pending_call = NIH_SHOULD (upstart_emit_event_with_file (
-						   upstart, "socket", env, TRUE,
-						   sock->sock,
-						   (UpstartEmitEventWithFileReply)emit_event_reply,
+						   upstart, "socket", env, FALSE,
+						   fd, NULL,
 						   (NihDBusErrorHandler)emit_event_error,
 						   sock,
 						   NIH_DBUS_TIMEOUT_NEVER));
@@ -369,17 +596,195 @@ epoll_watcher (void *      data,
 			nih_warn ("%s: %s", _("Could not send socket event"),
 				  err->message);
 			nih_free (err);
+		} else {
+			dbus_pending_call_unref (pending_call);
 		}
 
-		dbus_pending_call_unref (pending_call);
+		close (fd);
+	}
+}
 
-		// might be EPOLLIN
-		// might be EPOLLERR
-		// might be EPOLLHUP
+/**
+ * socket_rate_expired:
+ * @sock: listening socket,
+ * @timer: timer that expired.
+ *
+ * Called a second after the first connection counted against the rate
+ * limit of @sock, resets the count and, if we stopped accepting on @sock
+ * when the limit was reached, watches it again; since the socket is
+ * edge-triggered, adding it with connections pending notifies us at once.
+ **/
+static void
+socket_rate_expired (Socket *  sock,
+		     NihTimer *timer)
+{
+	struct epoll_event event;
+
+	nih_assert (sock != NULL);
+
+	/* The timer is freed once we return */
+	sock->rate_timer = NULL;
+	sock->accepted = 0;
+
+	if (! sock->throttled)
+		return;
+
+	sock->throttled = FALSE;
+
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = sock;
+
+	if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, sock->sock, &event) < 0)
+		nih_warn ("Failed to watch socket in %s: %s",
+			  sock->job->path, strerror (errno));
+}
+
+/**
+ * socket_activity:
+ * @sock: listening socket with a new connection.
+ *
+ * Restarts the idle timeout of @sock, if it has one, since a connection
+ * has been made to its job.
+ **/
+static void
+socket_activity (Socket *sock)
+{
+	nih_assert (sock != NULL);
+
+	if (! sock->idle)
+		return;
+
+	if (sock->idle_timer)
+		nih_free (sock->idle_timer);
+
+	sock->idle_timer = NIH_MUST (nih_timer_add_timeout (
+					     sock, sock->idle,
+					     (NihTimerCb)socket_idle_expired,
+					     sock));
+}
+
+/**
+ * socket_idle_expired:
+ * @sock: listening socket,
+ * @timer: timer that expired.
+ *
+ * Called when no connection has been made to @sock for its idle timeout,
+ * stops the job started by it; we keep listening on @sock, so the job is
+ * started again by the next connection.
+ **/
+static void
+socket_idle_expired (Socket *  sock,
+		     NihTimer *timer)
+{
+	nih_local NihDBusProxy *job_class = NULL;
+	nih_local char **env = NULL;
+	size_t env_len;
+	DBusPendingCall *pending_call;
+
+	nih_assert (sock != NULL);
+
+	/* The timer is freed once we return */
+	sock->idle_timer = NULL;
+
+	job_class = NIH_SHOULD (nih_dbus_proxy_new (NULL, upstart->connection,
+						    upstart->name,
+						    sock->job->path,
+						    NULL, NULL));
+	if (! job_class) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_warn ("Could not create proxy for job %s: %s",
+			  sock->job->path, err->message);
+		nih_free (err);
+
+		return;
 	}
+
+	job_class->auto_start = FALSE;
+
+	nih_debug ("Stopping idle job %s", sock->job->path);
+
+	/* Name the same instance that the socket event started */
+	env = socket_event_env (NULL, sock, &env_len);
+
+	pending_call = NIH_SHOULD (job_class_stop (
+					   job_class, env, FALSE,
+					   (JobClassStopReply)stop_job_reply,
+					   (NihDBusErrorHandler)stop_job_error,
+					   sock,
+					   NIH_DBUS_TIMEOUT_NEVER));
+	if (! pending_call) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_warn ("%s: %s", _("Could not stop idle job"),
+			  err->message);
+		nih_free (err);
+
+		return;
+	}
+
+	dbus_pending_call_unref (pending_call);
 }
 
 
+/**
+ * upstart_get_jobs:
+ *
+ * Obtain the list of current jobs, and the conditions of each, from an
+ * Upstart too old to support GetAllJobConditions; connecting the signals
+ * it sends as each job comes and goes, since it won't send JobsChanged.
+ **/
+static void
+upstart_get_jobs (void)
+{
+	char **job_class_paths;
+
+	/* Connect signals to be notified when jobs come and go */
+	if (! nih_dbus_proxy_connect (upstart, &upstart_com_ubuntu_Upstart0_6, "JobAdded",
+				      (NihDBusSignalHandler)upstart_job_added, NULL)) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_fatal ("%s: %s", _("Could not create JobAdded signal connection"),
+			   err->message);
+		nih_free (err);
+
+		exit (1);
+	}
+
+	if (! nih_dbus_proxy_connect (upstart, &upstart_com_ubuntu_Upstart0_6, "JobRemoved",
+				      (NihDBusSignalHandler)upstart_job_removed, NULL)) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_fatal ("%s: %s", _("Could not create JobRemoved signal connection"),
+			   err->message);
+		nih_free (err);
+
+		exit (1);
+	}
+
+	/* Request a list of all current jobs */
+	if (upstart_get_all_jobs_sync (NULL, upstart, &job_class_paths) < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_fatal ("%s: %s", _("Could not obtain job list"),
+			   err->message);
+		nih_free (err);
+
+		exit (1);
+	}
+
+	for (char **job_class_path = job_class_paths;
+	     job_class_path && *job_class_path; job_class_path++)
+		upstart_job_added (NULL, NULL, *job_class_path);
+
+	nih_free (job_class_paths);
+}
+
 static void
 upstart_job_added (void *          data,
 		   NihDBusMessage *message,
@@ -388,7 +793,6 @@ upstart_job_added (void *          data,
 	nih_local NihDBusProxy *job_class = NULL;
 	nih_local char ***start_on = NULL;
 	nih_local char ***stop_on = NULL;
-	Job *job;
 
 	nih_assert (job_class_path != NULL);
 
@@ -432,8 +836,37 @@ upstart_job_added (void *          data,
 		return;
 	}
 
-	/* Free any existing record for the job (should never happen,
-	 * but worth being safe).
+	job_conditions_add (job_class_path, start_on, stop_on);
+}
+
+static void
+upstart_jobs_changed (void *                                  data,
+		      NihDBusMessage *                        message,
+		      UpstartJobsChangedAddedElement * const *added,
+		      char * const *                          removed)
+{
+	nih_assert (added != NULL);
+	nih_assert (removed != NULL);
+
+	for (char * const *job_path = removed; *job_path; job_path++)
+		upstart_job_removed (NULL, NULL, *job_path);
+
+	for (UpstartJobsChangedAddedElement * const *job = added; *job; job++)
+		job_conditions_add ((*job)->item0, (*job)->item1,
+				    (*job)->item2);
+}
+
+static void
+job_conditions_add (const char *job_class_path,
+		    char ***    start_on,
+		    char ***    stop_on)
+{
+	Job *job;
+
+	nih_assert (job_class_path != NULL);
+
+	/* Free any existing record for the job, replaced when its
+	 * configuration changes.
 	 */
 	job = (Job *)nih_hash_lookup (jobs, job_class_path);
 	if (job)
@@ -498,6 +931,7 @@ job_add_socket (Job *  job,
 
 	sock = NIH_MUST (nih_new (job, Socket));
 	memset (sock, 0, sizeof (Socket));
+	sock->job = job;
 	sock->sock = -1;
 
 	nih_list_init (&sock->entry);
@@ -570,6 +1004,23 @@ job_add_socket (Job *  job,
 
 			components--;
 
+		} else if (! strncmp (*env, "ACCEPT", name_len)) {
+			if (! strcmp (val, "yes")) {
+				sock->accept = TRUE;
+			} else if (strcmp (val, "no")) {
+				nih_warn ("Ignored socket event with invalid ACCEPT=%s in %s",
+					  val, job->path);
+				goto error;
+			}
+		} else if (! strncmp (*env, "IDLE", name_len)) {
+			char *endptr;
+
+			sock->idle = strtol (val, &endptr, 10);
+			if ((! *val) || *endptr || (sock->idle <= 0)) {
+				nih_warn ("Ignored socket event with invalid IDLE=%s in %s",
+					  val, job->path);
+				goto error;
+			}
 		} else {
 			nih_warn ("Ignored socket event with unknown variable %.*s in %s",
 				  (int)name_len, *env, job->path);
@@ -584,8 +1035,23 @@ job_add_socket (Job *  job,
 		goto error;
 	}
 
+	/* Every connection has an instance of its own when accepting, which
+	 * finishes with the connection; there's nothing left idle to stop.
+	 */
+	if (sock->accept && sock->idle) {
+		nih_warn ("Ignored socket event with both ACCEPT=yes and IDLE in %s",
+			  job->path);
+		goto error;
+	}
+
 	/* Let's try and set this baby up */
-	sock->sock = socket (sock->addr.sa_family, SOCK_STREAM, 0);
+	/* Connections are accepted until there are no more when accepting
+	 * on behalf of the job, which never sees the listening socket.
+	 */
+	sock->sock = socket (sock->addr.sa_family,
+			     SOCK_STREAM | (sock->accept
+					    ? SOCK_NONBLOCK | SOCK_CLOEXEC : 0),
+			     0);
 	if (sock->sock < 0) {
 		nih_warn ("Failed to create socket in %s: %s",
 			  job->path, strerror (errno));
@@ -684,3 +1150,22 @@ emit_event_error (Socket *        sock,
 	nih_warn ("%s: %s", _("Error emitting socket event"), err->message);
 	nih_free (err);
 }
+
+
+static void
+stop_job_reply (Socket *        sock,
+		NihDBusMessage *message)
+{
+	nih_debug ("Idle job stopped");
+}
+
+static void
+stop_job_error (Socket *        sock,
+		NihDBusMessage *message)
+{
+	NihError *err;
+
+	err = nih_error_get ();
+	nih_warn ("%s: %s", _("Error stopping idle job"), err->message);
+	nih_free (err);
+}
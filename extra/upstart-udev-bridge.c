@@ -32,6 +32,8 @@
 #include <nih/macros.h>
 #include <nih/alloc.h>
 #include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
 #include <nih/io.h>
 #include <nih/option.h>
 #include <nih/main.h>
@@ -39,17 +41,80 @@
 #include <nih/error.h>
 
 #include <nih-dbus/dbus_connection.h>
+#include <nih-dbus/dbus_error.h>
 #include <nih-dbus/dbus_proxy.h>
 
 #include "dbus/upstart.h"
 #include "com.ubuntu.Upstart.h"
+#include "com.ubuntu.Upstart.Job.h"
+
+
+/**
+ * UDEV_EVENT_BATCH_MAX:
+ *
+ * Maximum number of udev events read by a single call to
+ * udev_monitor_watcher() and sent to Upstart in one EmitEvents call;
+ * any remaining are handled on the next main loop iteration.
+ **/
+#define UDEV_EVENT_BATCH_MAX 64
+
+/**
+ * UDEV_EVENT_INFIX:
+ *
+ * Separates the subsystem from the action in the names of the events
+ * we emit.
+ **/
+#define UDEV_EVENT_INFIX "-device-"
+
+/**
+ * UDEV_FILTER_NONE:
+ *
+ * Subsystem matched by the kernel filter when no job refers to any
+ * udev event; no device has it, so nothing is woken for.
+ **/
+#define UDEV_FILTER_NONE "upstart-udev-bridge-none"
+
+
+/**
+ * Job:
+ *
+ * @entry: list header,
+ * @path: D-Bus path of job class,
+ * @subsystems: subsystems of udev events the job refers to.
+ *
+ * Record of a job class whose start or stop condition refers to events
+ * we emit.
+ **/
+typedef struct job {
+	NihList   entry;
+	char     *path;
+	char    **subsystems;
+} Job;
 
 
 /* Prototypes for static functions */
 static void udev_monitor_watcher (struct udev_monitor *udev_monitor,
 				  NihIoWatch *watch, NihIoEvents events);
+static UpstartEmitEventsEventsElement *
+udev_device_to_event (const void *parent, struct udev_device *udev_device);
 static void upstart_disconnected (DBusConnection *connection);
 static void emit_event_error     (void *data, NihDBusMessage *message);
+static void emit_events          (UpstartEmitEventsEventsElement **events);
+static void emit_events_each     (UpstartEmitEventsEventsElement **events);
+static void emit_events_reply    (void *data, NihDBusMessage *message);
+static void emit_events_error    (void *data, NihDBusMessage *message);
+
+static void upstart_job_added    (void *data, NihDBusMessage *message,
+				  const char *job_path);
+static void upstart_job_removed  (void *data, NihDBusMessage *message,
+				  const char *job_path);
+static int  job_add_subsystems   (Job *job, char ***conditions);
+static void udev_filter_update   (void);
+static int  udev_filter_contains (char * const *subsystems,
+				  const char *subsystem)
+	__attribute__ ((warn_unused_result));
+static int  udev_filter_wanted   (const char *subsystem)
+	__attribute__ ((warn_unused_result));
 
 static char *make_safe_string    (const void *parent, const char *original);
 
@@ -68,6 +133,14 @@ static int daemonise = FALSE;
  **/
 static NihDBusProxy *upstart = NULL;
 
+/**
+ * emit_events_unsupported:
+ *
+ * Set to TRUE once Upstart has been found not to support the EmitEvents
+ * method, after which events are always emitted one at a time.
+ **/
+static int emit_events_unsupported = FALSE;
+
 /**
  * user:
  *
@@ -85,6 +158,35 @@ static int user = FALSE;
  **/
 static int no_strip_udev_data = FALSE;
 
+/**
+ * no_filter:
+ *
+ * If TRUE, emit events for all devices (old behaviour) rather than only
+ * those of subsystems that jobs refer to.
+ **/
+static int no_filter = FALSE;
+
+/**
+ * monitor:
+ *
+ * Monitor that udev devices are received from.
+ **/
+static struct udev_monitor *monitor = NULL;
+
+/**
+ * jobs:
+ *
+ * Jobs whose conditions refer to udev events, keyed by D-Bus path.
+ **/
+static NihHash *jobs = NULL;
+
+/**
+ * filter_subsystems:
+ *
+ * Subsystems currently passed by the filter of monitor.
+ **/
+static char **filter_subsystems = NULL;
+
 /**
  * options:
  *
@@ -95,6 +197,8 @@ static NihOption options[] = {
 	  NULL, NULL, &daemonise, NULL },
 	{ 0, "no-strip", N_("Do not strip non-printable bytes from udev message data"),
 	  NULL, NULL, &no_strip_udev_data, NULL },
+	{ 0, "no-filter", N_("Emit events for all devices, not just those jobs refer to"),
+	  NULL, NULL, &no_filter, NULL },
 	{ 0, "user", N_("Connect to user session"),
 	  NULL, NULL, &user, NULL },
 
@@ -114,7 +218,7 @@ main (int   argc,
 	nih_local char **    user_session_path = NULL;
 	char *               path_element = NULL;
 	struct udev *        udev;
-	struct udev_monitor *udev_monitor;
+	nih_local char **    job_class_paths = NULL;
 	int                  ret;
 
 	nih_main_init (argv[0]);
@@ -169,14 +273,63 @@ main (int   argc,
 
 	/* Initialise the connection to udev */
 	nih_assert (udev = udev_new ());
-	nih_assert (udev_monitor = udev_monitor_new_from_netlink (udev, "udev"));
-	nih_assert (udev_monitor_enable_receiving (udev_monitor) == 0);
-	udev_monitor_set_receive_buffer_size(udev_monitor, 128*1024*1024);
+	nih_assert (monitor = udev_monitor_new_from_netlink (udev, "udev"));
+
+	if (! no_filter) {
+		jobs = NIH_MUST (nih_hash_string_new (NULL, 0));
+
+		/* Connect signals to be notified when jobs come and go */
+		if (! nih_dbus_proxy_connect (upstart, &upstart_com_ubuntu_Upstart0_6, "JobAdded",
+					      (NihDBusSignalHandler)upstart_job_added, NULL)) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_fatal ("%s: %s", _("Could not create JobAdded signal connection"),
+				   err->message);
+			nih_free (err);
+
+			exit (1);
+		}
+
+		if (! nih_dbus_proxy_connect (upstart, &upstart_com_ubuntu_Upstart0_6, "JobRemoved",
+					      (NihDBusSignalHandler)upstart_job_removed, NULL)) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_fatal ("%s: %s", _("Could not create JobRemoved signal connection"),
+				   err->message);
+			nih_free (err);
+
+			exit (1);
+		}
+
+		/* Request a list of all current jobs */
+		if (upstart_get_all_jobs_sync (NULL, upstart, &job_class_paths) < 0) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_fatal ("%s: %s", _("Could not obtain job list"),
+				   err->message);
+			nih_free (err);
+
+			exit (1);
+		}
+
+		for (char **job_class_path = job_class_paths;
+		     job_class_path && *job_class_path; job_class_path++)
+			upstart_job_added (NULL, NULL, *job_class_path);
+
+		/* In case no job refers to udev events */
+		udev_filter_update ();
+	}
 
-	NIH_MUST (nih_io_add_watch (NULL, udev_monitor_get_fd (udev_monitor),
+	nih_assert (udev_monitor_enable_receiving (monitor) == 0);
+	udev_monitor_set_receive_buffer_size(monitor, 128*1024*1024);
+
+	NIH_MUST (nih_io_add_watch (NULL, udev_monitor_get_fd (monitor),
 				    NIH_IO_READ,
 				    (NihIoWatcher)udev_monitor_watcher,
-				    udev_monitor));
+				    monitor));
 
 	/* Become daemon */
 	if (daemonise) {
@@ -242,28 +395,174 @@ main (int   argc,
 }
 
 
+/**
+ * udev_monitor_watcher:
+ * @udev_monitor: udev monitor,
+ * @watch: I/O watch (unused),
+ * @events: events that occurred (unused).
+ *
+ * Called when the udev monitor socket is readable; reads all of the
+ * pending devices, up to UDEV_EVENT_BATCH_MAX, and emits an event for
+ * each with emit_events().
+ **/
 static void
 udev_monitor_watcher (struct udev_monitor *udev_monitor,
 		      NihIoWatch *         watch,
 		      NihIoEvents          events)
 {
-	struct udev_device *    udev_device;
-	nih_local char *        subsystem = NULL;
-	nih_local char *        action = NULL;
-	nih_local char *        kernel = NULL;
-	nih_local char *        devpath = NULL;
-	nih_local char *        devname = NULL;
-	nih_local char *        name = NULL;
-	nih_local char **       env = NULL;
-	const char *            value = NULL;
-	size_t                  env_len = 0;
-	DBusPendingCall *       pending_call;
-	char                 *(*copy_string)(const void *, const char *) = NULL;
-
-
-	udev_device = udev_monitor_receive_device (udev_monitor);
-	if (! udev_device)
+	UpstartEmitEventsEventsElement **batch = NULL;
+	size_t                           batch_len = 0;
+
+	batch = NIH_MUST (nih_alloc (NULL, sizeof (UpstartEmitEventsEventsElement *)));
+	batch[0] = NULL;
+
+	while (batch_len < UDEV_EVENT_BATCH_MAX) {
+		struct udev_device *            udev_device;
+		UpstartEmitEventsEventsElement *element;
+
+		udev_device = udev_monitor_receive_device (udev_monitor);
+		if (! udev_device)
+			break;
+
+		/* Devices queued before the filter last changed may not
+		 * be wanted.
+		 */
+		if (! udev_filter_wanted (udev_device_get_subsystem (udev_device))) {
+			udev_device_unref (udev_device);
+			continue;
+		}
+
+		element = udev_device_to_event (batch, udev_device);
+		udev_device_unref (udev_device);
+
+		if (! element)
+			continue;
+
+		batch = NIH_MUST (nih_realloc (batch, NULL,
+				sizeof (UpstartEmitEventsEventsElement *)
+				* (batch_len + 2)));
+		batch[batch_len++] = element;
+		batch[batch_len] = NULL;
+	}
+
+	if (! batch_len) {
+		nih_free (batch);
 		return;
+	}
+
+	emit_events (batch);
+}
+
+/**
+ * emit_events:
+ * @events: NULL-terminated array of events to emit.
+ *
+ * Emit @events in a single EmitEvents method call, which takes ownership
+ * of @events.  Should the batch as a whole be rejected, whether when
+ * sending it or in the reply, the events are emitted one at a time so
+ * that a device with bad data does not lose the others, as they always
+ * are once Upstart is found not to support EmitEvents.
+ **/
+static void
+emit_events (UpstartEmitEventsEventsElement **events)
+{
+	DBusPendingCall *pending_call;
+
+	nih_assert (events != NULL);
+
+	if (! emit_events_unsupported) {
+		pending_call = upstart_emit_events (upstart, events,
+				emit_events_reply, emit_events_error, events,
+				NIH_DBUS_TIMEOUT_NEVER);
+
+		/* Kept until the reply, freed by its handler */
+		if (pending_call) {
+			dbus_pending_call_unref (pending_call);
+			return;
+		}
+
+		/* Discard the error and fall back to sending each
+		 * individually.
+		 */
+		{
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_debug ("%s", err->message);
+			nih_free (err);
+		}
+	}
+
+	emit_events_each (events);
+	nih_free (events);
+}
+
+/**
+ * emit_events_each:
+ * @events: NULL-terminated array of events to emit.
+ *
+ * Emit each of @events in its own EmitEvent method call.
+ **/
+static void
+emit_events_each (UpstartEmitEventsEventsElement **events)
+{
+	DBusPendingCall *pending_call;
+
+	nih_assert (events != NULL);
+
+	for (UpstartEmitEventsEventsElement **event = events; *event; event++) {
+		pending_call = upstart_emit_event (upstart,
+				(*event)->item0, (*event)->item1, FALSE,
+				NULL, emit_event_error, NULL,
+				NIH_DBUS_TIMEOUT_NEVER);
+
+		if (! pending_call) {
+			NihError *err;
+			int saved = errno;
+
+			err = nih_error_get ();
+			nih_warn ("%s", err->message);
+
+			if (saved != ENOMEM)
+				nih_warn ("Likely that udev '%s' event contains binary garbage",
+					  (*event)->item0);
+
+			nih_free (err);
+			continue;
+		}
+
+		dbus_pending_call_unref (pending_call);
+	}
+}
+
+/**
+ * udev_device_to_event:
+ * @parent: parent of returned event,
+ * @udev_device: udev device.
+ *
+ * Construct the Upstart event, named after the subsystem and action of
+ * @udev_device and carrying its properties as environment, ready to be
+ * passed to the EmitEvents method.
+ *
+ * Returns: newly allocated event, or NULL if @udev_device has no action.
+ **/
+static UpstartEmitEventsEventsElement *
+udev_device_to_event (const void *        parent,
+		      struct udev_device *udev_device)
+{
+	UpstartEmitEventsEventsElement *element;
+	nih_local char *                subsystem = NULL;
+	nih_local char *                action = NULL;
+	nih_local char *                kernel = NULL;
+	nih_local char *                devpath = NULL;
+	nih_local char *                devname = NULL;
+	char *                          name = NULL;
+	char **                         env = NULL;
+	const char *                    value = NULL;
+	size_t                          env_len = 0;
+	char                         *(*copy_string)(const void *, const char *) = NULL;
+
+	nih_assert (udev_device != NULL);
 
 	copy_string = no_strip_udev_data ? nih_strdup : make_safe_string;
 
@@ -284,57 +583,59 @@ udev_monitor_watcher (struct udev_monitor *udev_monitor,
 
 	/* Protect against the "impossible" */
 	if (! action)
-		goto out;
+		return NULL;
+
+	element = NIH_MUST (nih_new (parent, UpstartEmitEventsEventsElement));
 
 	if (! strcmp (action, "add")) {
-		name = NIH_MUST (nih_sprintf (NULL, "%s-device-added",
+		name = NIH_MUST (nih_sprintf (element, "%s-device-added",
 					      subsystem));
 	} else if (! strcmp (action, "change")) {
-		name = NIH_MUST (nih_sprintf (NULL, "%s-device-changed",
+		name = NIH_MUST (nih_sprintf (element, "%s-device-changed",
 					      subsystem));
 	} else if (! strcmp (action, "remove")) {
-		name = NIH_MUST (nih_sprintf (NULL, "%s-device-removed",
+		name = NIH_MUST (nih_sprintf (element, "%s-device-removed",
 					      subsystem));
 	} else {
-		name = NIH_MUST (nih_sprintf (NULL, "%s-device-%s",
+		name = NIH_MUST (nih_sprintf (element, "%s-device-%s",
 					      subsystem, action));
 	}
 
-	env = NIH_MUST (nih_str_array_new (NULL));
+	env = NIH_MUST (nih_str_array_new (element));
 
 	if (kernel) {
 		nih_local char *var = NULL;
 
 		var = NIH_MUST (nih_sprintf (NULL, "KERNEL=%s", kernel));
-		NIH_MUST (nih_str_array_addp (&env, NULL, &env_len, var));
+		NIH_MUST (nih_str_array_addp (&env, element, &env_len, var));
 	}
 
 	if (devpath) {
 		nih_local char *var = NULL;
 
 		var = NIH_MUST (nih_sprintf (NULL, "DEVPATH=%s", devpath));
-		NIH_MUST (nih_str_array_addp (&env, NULL, &env_len, var));
+		NIH_MUST (nih_str_array_addp (&env, element, &env_len, var));
 	}
 
 	if (devname) {
 		nih_local char *var = NULL;
 
 		var = NIH_MUST (nih_sprintf (NULL, "DEVNAME=%s", devname));
-		NIH_MUST (nih_str_array_addp (&env, NULL, &env_len, var));
+		NIH_MUST (nih_str_array_addp (&env, element, &env_len, var));
 	}
 
 	if (subsystem) {
 		nih_local char *var = NULL;
 
 		var = NIH_MUST (nih_sprintf (NULL, "SUBSYSTEM=%s", subsystem));
-		NIH_MUST (nih_str_array_addp (&env, NULL, &env_len, var));
+		NIH_MUST (nih_str_array_addp (&env, element, &env_len, var));
 	}
 
 	if (action) {
 		nih_local char *var = NULL;
 
 		var = NIH_MUST (nih_sprintf (NULL, "ACTION=%s", action));
-		NIH_MUST (nih_str_array_addp (&env, NULL, &env_len, var));
+		NIH_MUST (nih_str_array_addp (&env, element, &env_len, var));
 	}
 
 	for (struct udev_list_entry *list_entry = udev_device_get_properties_list_entry (udev_device);
@@ -358,33 +659,327 @@ udev_monitor_watcher (struct udev_monitor *udev_monitor,
 		udev_value = copy_string (NULL, udev_list_entry_get_value (list_entry));
 
 		var = NIH_MUST (nih_sprintf (NULL, "%s=%s", udev_name, udev_value));
-		NIH_MUST (nih_str_array_addp (&env, NULL, &env_len, var));
+		NIH_MUST (nih_str_array_addp (&env, element, &env_len, var));
 	}
 
 	nih_debug ("%s %s", name, devname ? devname : "");
 
-	pending_call = upstart_emit_event (upstart,
-			name, env, FALSE,
-			NULL, emit_event_error, NULL,
-			NIH_DBUS_TIMEOUT_NEVER);
+	element->item0 = name;
+	element->item1 = env;
+	element->item2 = FALSE;
 
-	if (! pending_call) {
+	return element;
+}
+
+
+/**
+ * upstart_job_added:
+ * @data: (unused),
+ * @message: Nih D-Bus message (unused),
+ * @job_path: Upstart job class (D-Bus) path associated with job.
+ *
+ * Called automatically when a new Upstart job appears on D-Bus ("JobAdded"
+ * signal), and for each existing job on startup, to record the
+ * subsystems of udev events its start and stop conditions refer to and
+ * update the filter to match.
+ **/
+static void
+upstart_job_added (void            *data,
+		   NihDBusMessage  *message,
+		   const char      *job_path)
+{
+	Job                      *job;
+	nih_local NihDBusProxy   *job_class = NULL;
+	nih_local char         ***start_on = NULL;
+	nih_local char         ***stop_on = NULL;
+
+	nih_assert (job_path);
+
+	/* Obtain a proxy to the job */
+	job_class = nih_dbus_proxy_new (NULL, upstart->connection,
+					upstart->name, job_path,
+					NULL, NULL);
+	if (! job_class) {
 		NihError *err;
-		int saved = errno;
 
 		err = nih_error_get ();
-		nih_warn ("%s", err->message);
+		nih_error ("Could not create proxy for job %s: %s",
+			   job_path, err->message);
+		nih_free (err);
+
+		return;
+	}
 
-		if (saved != ENOMEM && subsystem)
-			nih_warn ("Likely that udev '%s' event contains binary garbage", subsystem);
+	job_class->auto_start = FALSE;
 
+	/* Obtain the start_on and stop_on properties of the job */
+	if (job_class_get_start_on_sync (NULL, job_class, &start_on) < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_error ("Could not obtain job start condition %s: %s",
+			   job_path, err->message);
 		nih_free (err);
+
+		return;
+	}
+
+	if (job_class_get_stop_on_sync (NULL, job_class, &stop_on) < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_error ("Could not obtain job stop condition %s: %s",
+			   job_path, err->message);
+		nih_free (err);
+
+		return;
+	}
+
+	/* Free any existing record for the job, since a job being
+	 * replaced is added again.
+	 */
+	job = (Job *)nih_hash_lookup (jobs, job_path);
+	if (job)
+		nih_free (job);
+
+	job = NIH_MUST (nih_new (jobs, Job));
+
+	nih_list_init (&job->entry);
+	nih_alloc_set_destructor (job, nih_list_destroy);
+
+	job->path = NIH_MUST (nih_strdup (job, job_path));
+	job->subsystems = NIH_MUST (nih_str_array_new (job));
+
+	if (! (job_add_subsystems (job, start_on)
+	       + job_add_subsystems (job, stop_on))) {
+		nih_free (job);
+	} else {
+		nih_hash_add (jobs, &job->entry);
+		nih_debug ("Job got added %s", job_path);
+	}
+
+	/* On startup the filter is installed once all jobs are known */
+	if (message)
+		udev_filter_update ();
+}
+
+/**
+ * upstart_job_removed:
+ * @data: (unused),
+ * @message: Nih D-Bus message (unused),
+ * @job_path: Upstart job class (D-Bus) path associated with job.
+ *
+ * Called automatically when an Upstart job disappears from D-Bus
+ * ("JobRemoved" signal) to stop passing the subsystems only it referred
+ * to.
+ **/
+static void
+upstart_job_removed (void            *data,
+		     NihDBusMessage  *message,
+		     const char      *job_path)
+{
+	Job *job;
+
+	nih_assert (job_path);
+
+	job = (Job *)nih_hash_lookup (jobs, job_path);
+	if (! job)
+		return;
+
+	nih_debug ("Job went away %s", job_path);
+
+	nih_free (job);
+
+	udev_filter_update ();
+}
+
+/**
+ * job_add_subsystems:
+ * @job: job to add to,
+ * @conditions: start_on or stop_on property of @job.
+ *
+ * Adds the subsystem of each udev event referred to by @conditions to
+ * the subsystems of @job.
+ *
+ * Returns: number of subsystems added.
+ **/
+static int
+job_add_subsystems (Job     *job,
+		    char  ***conditions)
+{
+	int added = 0;
+
+	nih_assert (job != NULL);
+
+	for (char ***event = conditions; event && *event && **event; event++) {
+		nih_local char *subsystem = NULL;
+		const char     *infix = NULL;
+		size_t          len;
+
+		/* Subsystems don't contain the infix, but may contain
+		 * dashes; actions contain neither.
+		 */
+		for (const char *p = strstr (**event, UDEV_EVENT_INFIX); p;
+		     p = strstr (p + 1, UDEV_EVENT_INFIX))
+			infix = p;
+
+		if (! infix || infix == **event)
+			continue;
+
+		len = infix - **event;
+		subsystem = NIH_MUST (nih_strndup (NULL, **event, len));
+
+		NIH_MUST (nih_str_array_add (&job->subsystems, job, NULL,
+					     subsystem));
+
+		added++;
+	}
+
+	return added;
+}
+
+
+/**
+ * udev_filter_update:
+ *
+ * Installs a kernel socket filter on the udev monitor passing only
+ * devices of the subsystems that jobs refer to, so that we aren't woken
+ * for the others at all.  Nothing is done if the subsystems are
+ * unchanged.
+ *
+ * Should the filter fail to be installed, it is removed and every device
+ * is passed until the next update succeeds.
+ **/
+static void
+udev_filter_update (void)
+{
+	char   **subsystems;
+	size_t   len = 0;
+	int      ret;
+
+	nih_assert (monitor != NULL);
+
+	if (no_filter)
+		return;
+
+	subsystems = NIH_MUST (nih_str_array_new (NULL));
+
+	NIH_HASH_FOREACH (jobs, iter) {
+		Job *job = (Job *)iter;
+
+		for (char **subsystem = job->subsystems;
+		     subsystem && *subsystem; subsystem++) {
+			if (! udev_filter_contains (subsystems, *subsystem))
+				NIH_MUST (nih_str_array_add (&subsystems, NULL,
+							     &len, *subsystem));
+		}
 	}
 
-	dbus_pending_call_unref (pending_call);
+	/* Neither array has duplicates, so they're the same if they're
+	 * the same length and one contains everything in the other.
+	 */
+	if (filter_subsystems) {
+		size_t filter_len = 0;
+		int    changed = FALSE;
+
+		for (char **subsystem = filter_subsystems; *subsystem;
+		     subsystem++) {
+			filter_len++;
 
-out:
-	udev_device_unref (udev_device);
+			if (! udev_filter_contains (subsystems, *subsystem))
+				changed = TRUE;
+		}
+
+		if ((! changed) && (filter_len == len)) {
+			nih_free (subsystems);
+			return;
+		}
+	}
+
+	ret = udev_monitor_filter_remove (monitor);
+	if (ret < 0)
+		goto error;
+
+	for (size_t i = 0; i < len; i++) {
+		nih_debug ("Passing %s devices", subsystems[i]);
+
+		ret = udev_monitor_filter_add_match_subsystem_devtype (
+			monitor, subsystems[i], NULL);
+		if (ret < 0)
+			goto error;
+	}
+
+	/* An empty filter would pass everything */
+	if (! len) {
+		ret = udev_monitor_filter_add_match_subsystem_devtype (
+			monitor, UDEV_FILTER_NONE, NULL);
+		if (ret < 0)
+			goto error;
+	}
+
+	ret = udev_monitor_filter_update (monitor);
+	if (ret < 0)
+		goto error;
+
+	if (filter_subsystems)
+		nih_free (filter_subsystems);
+
+	filter_subsystems = subsystems;
+	return;
+
+error:
+	/* Better to be woken for every device than to miss some */
+	nih_warn ("%s: %s", _("Unable to update udev filter, passing all devices"),
+		  strerror (-ret));
+
+	if (udev_monitor_filter_remove (monitor) < 0)
+		nih_warn ("%s", _("Unable to remove udev filter"));
+
+	nih_free (subsystems);
+
+	if (filter_subsystems) {
+		nih_free (filter_subsystems);
+		filter_subsystems = NULL;
+	}
+}
+
+/**
+ * udev_filter_contains:
+ * @subsystems: array of subsystems,
+ * @subsystem: subsystem to look for.
+ *
+ * Returns: TRUE if @subsystem is in @subsystems.
+ **/
+static int
+udev_filter_contains (char * const *subsystems,
+		      const char   *subsystem)
+{
+	nih_assert (subsystems != NULL);
+	nih_assert (subsystem != NULL);
+
+	for (char * const *s = subsystems; *s; s++)
+		if (! strcmp (*s, subsystem))
+			return TRUE;
+
+	return FALSE;
+}
+
+/**
+ * udev_filter_wanted:
+ * @subsystem: subsystem of device.
+ *
+ * Returns: TRUE if events for devices of @subsystem are wanted.
+ **/
+static int
+udev_filter_wanted (const char *subsystem)
+{
+	if (no_filter || ! filter_subsystems)
+		return TRUE;
+
+	if (! subsystem)
+		return FALSE;
+
+	return udev_filter_contains (filter_subsystems, subsystem);
 }
 
 
@@ -406,6 +1001,56 @@ emit_event_error (void *          data,
 	nih_free (err);
 }
 
+/**
+ * emit_events_reply:
+ * @data: events emitted,
+ * @message: Nih D-Bus message (unused).
+ *
+ * Handle the reply to an EmitEvents method call made by emit_events()
+ * by freeing the events sent.
+ **/
+static void
+emit_events_reply (void *          data,
+		   NihDBusMessage *message)
+{
+	nih_assert (data != NULL);
+
+	nih_free (data);
+}
+
+/**
+ * emit_events_error:
+ * @data: events that could not be emitted,
+ * @message: Nih D-Bus message (unused).
+ *
+ * Handle an error reply to an EmitEvents method call made by
+ * emit_events() by emitting the events one at a time instead, noting
+ * when it was because Upstart does not support the method at all.
+ **/
+static void
+emit_events_error (void *          data,
+		   NihDBusMessage *message)
+{
+	NihDBusError *dbus_err;
+
+	nih_assert (data != NULL);
+
+	dbus_err = (NihDBusError *)nih_error_get ();
+	if ((dbus_err->number == NIH_DBUS_ERROR)
+	    && (! strcmp (dbus_err->name, DBUS_ERROR_UNKNOWN_METHOD))) {
+		nih_info (_("Upstart cannot emit events together, "
+			    "emitting them one at a time"));
+		emit_events_unsupported = TRUE;
+	} else {
+		nih_debug ("%s", dbus_err->message);
+	}
+
+	nih_free (dbus_err);
+
+	emit_events_each (data);
+	nih_free (data);
+}
+
 /**
  * make_safe_string:
  * @parent: parent,
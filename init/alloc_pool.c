@@ -0,0 +1,678 @@
+/* upstart
+ *
+ * alloc_pool.c - pooled allocation of frequently created objects
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/mman.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/logging.h>
+
+#include "alloc_pool.h"
+
+
+/**
+ * ALLOC_POOL_ALIGN:
+ *
+ * Alignment of each chunk, matching that of malloc().
+ **/
+#define ALLOC_POOL_ALIGN 16
+
+/**
+ * ALLOC_POOL_ROUND:
+ * @size: size to round,
+ * @align: power of two to round to.
+ *
+ * Rounds @size up to a multiple of @align.
+ **/
+#define ALLOC_POOL_ROUND(size, align) \
+	(((size) + (align) - 1) & ~(uintptr_t)((align) - 1))
+
+/**
+ * SLAB_EMPTY, SLAB_DELETED:
+ *
+ * Markers for unused and formerly used entries of slab_table; neither
+ * can be the address of a slab, since slabs are aligned.
+ **/
+#define SLAB_EMPTY   ((uintptr_t)0)
+#define SLAB_DELETED ((uintptr_t)1)
+
+
+/* Prototypes for static functions */
+static size_t         alloc_pool_header_size (void);
+static void *         alloc_pool_probe_malloc (size_t size);
+static void *         alloc_pool_malloc      (size_t size);
+static void *         alloc_pool_realloc     (void *ptr, size_t size);
+static void           alloc_pool_free        (void *ptr);
+static void *         alloc_pool_get         (AllocPool *pool);
+static void           alloc_pool_put         (AllocPoolSlab *slab, void *ptr);
+static AllocPoolSlab *alloc_pool_slab_new    (AllocPool *pool);
+static void           alloc_pool_slab_unlink (AllocPoolSlab *slab);
+static AllocPoolSlab *alloc_pool_slab_find   (const void *ptr);
+static int            alloc_pool_table_add   (uintptr_t base);
+static void           alloc_pool_table_remove (uintptr_t base);
+
+
+/**
+ * alloc_pools:
+ *
+ * Pools added by alloc_pool_add(), the first alloc_pools_len of which
+ * are in use.
+ **/
+AllocPool alloc_pools[ALLOC_POOL_MAX];
+
+/**
+ * alloc_pools_len:
+ *
+ * Number of pools in alloc_pools.
+ **/
+size_t alloc_pools_len = 0;
+
+/**
+ * alloc_pool_header:
+ *
+ * Number of bytes that nih_alloc() adds to each allocation for its own
+ * header, or zero before alloc_pool_init() is called.
+ **/
+static size_t alloc_pool_header = 0;
+
+/**
+ * alloc_pool_next_malloc, alloc_pool_next_realloc, alloc_pool_next_free:
+ *
+ * Allocator functions that nih_alloc() used before alloc_pool_init(),
+ * used for all allocations that aren't pooled.
+ **/
+static void *(*alloc_pool_next_malloc)  (size_t size) = NULL;
+static void *(*alloc_pool_next_realloc) (void *ptr, size_t size) = NULL;
+static void  (*alloc_pool_next_free)    (void *ptr) = NULL;
+
+/**
+ * alloc_pool_probed:
+ *
+ * Size last requested of alloc_pool_probe_malloc().
+ **/
+static size_t alloc_pool_probed = 0;
+
+/**
+ * slab_table:
+ *
+ * Open-addressed hash table of the addresses of all slabs, used to tell
+ * whether memory being freed belongs to a pool without reading memory
+ * that may not be ours; sized to a power of two and kept at most half
+ * full.  It's allocated directly with malloc() since it's used from
+ * within nih_alloc().
+ **/
+static uintptr_t *slab_table = NULL;
+
+/**
+ * slab_table_size:
+ *
+ * Number of entries in slab_table.
+ **/
+static size_t slab_table_size = 0;
+
+/**
+ * slab_table_used:
+ *
+ * Number of entries in slab_table that are not SLAB_EMPTY.
+ **/
+static size_t slab_table_used = 0;
+
+
+/**
+ * alloc_pool_init:
+ *
+ * Directs all allocations made by nih_alloc() through the pools, so that
+ * those of the sizes given to alloc_pool_add() are taken from them.
+ * Memory allocated beforehand may still be freed as usual.
+ *
+ * Since this replaces the allocator of nih_alloc(), any later change to
+ * it must preserve these functions; the pools, like nih_alloc() itself,
+ * are not thread-safe.
+ **/
+void
+alloc_pool_init (void)
+{
+	if (alloc_pool_header)
+		return;
+
+	alloc_pool_next_malloc = __nih_malloc;
+	alloc_pool_next_realloc = __nih_realloc;
+	alloc_pool_next_free = __nih_free;
+
+	alloc_pool_header = alloc_pool_header_size ();
+
+	__nih_malloc = alloc_pool_malloc;
+	__nih_realloc = alloc_pool_realloc;
+	__nih_free = alloc_pool_free;
+}
+
+/**
+ * alloc_pool_header_size:
+ *
+ * Measures the size of the header nih_alloc() adds to each allocation,
+ * which isn't otherwise visible, by making one.
+ *
+ * Returns: size of header in bytes.
+ **/
+static size_t
+alloc_pool_header_size (void)
+{
+	void *ptr;
+
+	__nih_malloc = alloc_pool_probe_malloc;
+	ptr = NIH_MUST (nih_alloc (NULL, 1));
+	__nih_malloc = alloc_pool_next_malloc;
+
+	nih_free (ptr);
+
+	return alloc_pool_probed - 1;
+}
+
+/**
+ * alloc_pool_probe_malloc:
+ * @size: bytes to allocate.
+ *
+ * Allocator used by alloc_pool_header_size() to record @size.
+ *
+ * Returns: allocated memory or NULL if insufficient memory.
+ **/
+static void *
+alloc_pool_probe_malloc (size_t size)
+{
+	alloc_pool_probed = size;
+
+	return alloc_pool_next_malloc (size);
+}
+
+
+/**
+ * alloc_pool_add:
+ * @name: name of type,
+ * @size: size of type.
+ *
+ * Adds a pool for objects of @size bytes allocated with nih_alloc(),
+ * such as by nih_new() for the type @name.  Types of the same size share
+ * the pool of the first of them.  alloc_pool_init() must have been
+ * called first.
+ *
+ * Returns: zero on success, negative value if there are too many pools.
+ **/
+int
+alloc_pool_add (const char *name,
+		size_t      size)
+{
+	AllocPool *pool;
+	size_t     offset;
+
+	nih_assert (name != NULL);
+	nih_assert (size > 0);
+	nih_assert (alloc_pool_header > 0);
+
+	size += alloc_pool_header;
+
+	for (size_t i = 0; i < alloc_pools_len; i++) {
+		if (alloc_pools[i].size == size) {
+			nih_debug ("%s shares pool of %s", name,
+				   alloc_pools[i].name);
+			return 0;
+		}
+	}
+
+	if (alloc_pools_len >= ALLOC_POOL_MAX)
+		return -1;
+
+	pool = &alloc_pools[alloc_pools_len];
+
+	offset = ALLOC_POOL_ROUND (sizeof (AllocPoolSlab), ALLOC_POOL_ALIGN);
+
+	pool->name = name;
+	pool->size = size;
+	pool->chunk_size = ALLOC_POOL_ROUND (size, ALLOC_POOL_ALIGN);
+	pool->per_slab = (ALLOC_POOL_SLAB_SIZE - offset) / pool->chunk_size;
+	if (pool->per_slab < 2)
+		return -1;
+
+	pool->partial = NULL;
+	pool->slabs = 0;
+	pool->live = 0;
+	pool->peak = 0;
+
+	alloc_pools_len++;
+
+	return 0;
+}
+
+
+/**
+ * alloc_pool_malloc:
+ * @size: bytes to allocate.
+ *
+ * Allocator for nih_alloc() that takes allocations of pooled sizes from
+ * their pool, falling back to the previous allocator for the rest or if
+ * no slab could be added to the pool.
+ *
+ * Returns: allocated memory or NULL if insufficient memory.
+ **/
+static void *
+alloc_pool_malloc (size_t size)
+{
+	for (size_t i = 0; i < alloc_pools_len; i++) {
+		void *ptr;
+
+		if (alloc_pools[i].size != size)
+			continue;
+
+		ptr = alloc_pool_get (&alloc_pools[i]);
+		if (ptr)
+			return ptr;
+
+		break;
+	}
+
+	return alloc_pool_next_malloc (size);
+}
+
+/**
+ * alloc_pool_realloc:
+ * @ptr: memory to reallocate,
+ * @size: new size.
+ *
+ * Reallocator for nih_alloc(); pooled memory resized to anything but its
+ * own size is moved out of its pool.
+ *
+ * Returns: reallocated memory or NULL if insufficient memory.
+ **/
+static void *
+alloc_pool_realloc (void   *ptr,
+		    size_t  size)
+{
+	AllocPoolSlab *slab;
+	void          *new_ptr;
+
+	slab = ptr ? alloc_pool_slab_find (ptr) : NULL;
+	if (! slab)
+		return alloc_pool_next_realloc (ptr, size);
+
+	if (size == slab->pool->size)
+		return ptr;
+
+	new_ptr = alloc_pool_malloc (size);
+	if (! new_ptr)
+		return NULL;
+
+	memcpy (new_ptr, ptr, size < slab->pool->size ? size : slab->pool->size);
+	alloc_pool_put (slab, ptr);
+
+	return new_ptr;
+}
+
+/**
+ * alloc_pool_free:
+ * @ptr: memory to free.
+ *
+ * Deallocator for nih_alloc() that returns pooled memory to its pool and
+ * passes the rest to the previous deallocator.
+ **/
+static void
+alloc_pool_free (void *ptr)
+{
+	AllocPoolSlab *slab;
+
+	slab = ptr ? alloc_pool_slab_find (ptr) : NULL;
+	if (! slab) {
+		alloc_pool_next_free (ptr);
+		return;
+	}
+
+	alloc_pool_put (slab, ptr);
+}
+
+
+/**
+ * alloc_pool_get:
+ * @pool: pool to allocate from.
+ *
+ * Takes a free chunk from the first slab of @pool with any, adding a
+ * slab if there are none.
+ *
+ * Returns: allocated chunk or NULL if insufficient memory.
+ **/
+static void *
+alloc_pool_get (AllocPool *pool)
+{
+	AllocPoolSlab  *slab;
+	AllocPoolChunk *chunk;
+
+	nih_assert (pool != NULL);
+
+	slab = pool->partial;
+	if (! slab) {
+		slab = alloc_pool_slab_new (pool);
+		if (! slab)
+			return NULL;
+	}
+
+	chunk = slab->free;
+	slab->free = chunk->next;
+	slab->used++;
+
+	if (! slab->free)
+		alloc_pool_slab_unlink (slab);
+
+	if (++pool->live > pool->peak)
+		pool->peak = pool->live;
+
+	return chunk;
+}
+
+/**
+ * alloc_pool_put:
+ * @slab: slab @ptr belongs to,
+ * @ptr: chunk to free.
+ *
+ * Returns @ptr to @slab.  A slab left empty is returned to the kernel,
+ * unless it's the only one of its pool with free chunks.
+ **/
+static void
+alloc_pool_put (AllocPoolSlab *slab,
+		void          *ptr)
+{
+	AllocPool      *pool;
+	AllocPoolChunk *chunk = ptr;
+	int             was_full;
+
+	nih_assert (slab != NULL);
+	nih_assert (slab->used > 0);
+
+	pool = slab->pool;
+	was_full = (slab->free == NULL);
+
+	chunk->next = slab->free;
+	slab->free = chunk;
+	slab->used--;
+	pool->live--;
+
+	if (was_full) {
+		slab->prev = NULL;
+		slab->next = pool->partial;
+		if (pool->partial)
+			pool->partial->prev = slab;
+		pool->partial = slab;
+	}
+
+	if (slab->used || (! slab->prev && ! slab->next))
+		return;
+
+	alloc_pool_slab_unlink (slab);
+	alloc_pool_table_remove ((uintptr_t)slab);
+	pool->slabs--;
+
+	munmap (slab, ALLOC_POOL_SLAB_SIZE);
+}
+
+
+/**
+ * alloc_pool_slab_new:
+ * @pool: pool to add slab to.
+ *
+ * Maps a new slab, aligned to its size, for @pool, divides it into free
+ * chunks and places it at the head of the slabs of @pool with free
+ * chunks.
+ *
+ * Returns: new slab or NULL if insufficient memory.
+ **/
+static AllocPoolSlab *
+alloc_pool_slab_new (AllocPool *pool)
+{
+	AllocPoolSlab *slab;
+	char          *map;
+	char          *chunk;
+	size_t         lead;
+
+	nih_assert (pool != NULL);
+
+	/* Map twice the size so that an aligned slab lies within it,
+	 * then give back the rest.
+	 */
+	map = mmap (NULL, ALLOC_POOL_SLAB_SIZE * 2, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	lead = ALLOC_POOL_ROUND ((uintptr_t)map, ALLOC_POOL_SLAB_SIZE)
+		- (uintptr_t)map;
+	if (lead)
+		munmap (map, lead);
+	munmap (map + lead + ALLOC_POOL_SLAB_SIZE, ALLOC_POOL_SLAB_SIZE - lead);
+
+	slab = (AllocPoolSlab *)(map + lead);
+
+	if (alloc_pool_table_add ((uintptr_t)slab) < 0) {
+		munmap (slab, ALLOC_POOL_SLAB_SIZE);
+		return NULL;
+	}
+
+	slab->pool = pool;
+	slab->used = 0;
+	slab->free = NULL;
+
+	/* Chain the chunks in address order */
+	chunk = (char *)slab + ALLOC_POOL_ROUND (sizeof (AllocPoolSlab),
+					       ALLOC_POOL_ALIGN);
+	chunk += pool->chunk_size * pool->per_slab;
+
+	for (size_t i = 0; i < pool->per_slab; i++) {
+		chunk -= pool->chunk_size;
+
+		((AllocPoolChunk *)chunk)->next = slab->free;
+		slab->free = (AllocPoolChunk *)chunk;
+	}
+
+	slab->prev = NULL;
+	slab->next = pool->partial;
+	if (pool->partial)
+		pool->partial->prev = slab;
+	pool->partial = slab;
+
+	pool->slabs++;
+
+	return slab;
+}
+
+/**
+ * alloc_pool_slab_unlink:
+ * @slab: slab to unlink.
+ *
+ * Removes @slab from the slabs of its pool with free chunks.
+ **/
+static void
+alloc_pool_slab_unlink (AllocPoolSlab *slab)
+{
+	nih_assert (slab != NULL);
+
+	if (slab->prev) {
+		slab->prev->next = slab->next;
+	} else if (slab->pool->partial == slab) {
+		slab->pool->partial = slab->next;
+	}
+
+	if (slab->next)
+		slab->next->prev = slab->prev;
+
+	slab->prev = slab->next = NULL;
+}
+
+/**
+ * alloc_pool_slab_find:
+ * @ptr: memory to look up.
+ *
+ * Returns: slab that @ptr was allocated from, or NULL if it isn't pooled.
+ **/
+static AllocPoolSlab *
+alloc_pool_slab_find (const void *ptr)
+{
+	uintptr_t base;
+	size_t    i;
+
+	if (! slab_table_size)
+		return NULL;
+
+	base = (uintptr_t)ptr & ~(uintptr_t)(ALLOC_POOL_SLAB_SIZE - 1);
+
+	i = (base / ALLOC_POOL_SLAB_SIZE) & (slab_table_size - 1);
+	while (slab_table[i] != SLAB_EMPTY) {
+		if (slab_table[i] == base)
+			return (AllocPoolSlab *)base;
+
+		i = (i + 1) & (slab_table_size - 1);
+	}
+
+	return NULL;
+}
+
+/**
+ * alloc_pool_table_add:
+ * @base: address of slab.
+ *
+ * Adds @base to slab_table, growing it as needed.
+ *
+ * Returns: zero on success, negative value if insufficient memory.
+ **/
+static int
+alloc_pool_table_add (uintptr_t base)
+{
+	size_t i;
+
+	if ((slab_table_used + 1) * 2 > slab_table_size) {
+		uintptr_t *old_table = slab_table;
+		size_t     old_size = slab_table_size;
+		size_t     new_size = old_size ? old_size * 2 : 64;
+		size_t     live = 0;
+
+		/* Rehashing at the same size is enough to clear out the
+		 * markers left by removed slabs when few remain.
+		 */
+		for (i = 0; i < old_size; i++)
+			if (old_table[i] > SLAB_DELETED)
+				live++;
+		if (old_size && (live + 1) * 4 <= old_size)
+			new_size = old_size;
+
+		slab_table = calloc (new_size, sizeof (uintptr_t));
+		if (! slab_table) {
+			slab_table = old_table;
+			return -1;
+		}
+
+		slab_table_size = new_size;
+		slab_table_used = 0;
+
+		for (i = 0; i < old_size; i++) {
+			if (old_table[i] > SLAB_DELETED)
+				alloc_pool_table_add (old_table[i]);
+		}
+
+		free (old_table);
+	}
+
+	i = (base / ALLOC_POOL_SLAB_SIZE) & (slab_table_size - 1);
+	while (slab_table[i] > SLAB_DELETED)
+		i = (i + 1) & (slab_table_size - 1);
+
+	if (slab_table[i] == SLAB_EMPTY)
+		slab_table_used++;
+
+	slab_table[i] = base;
+
+	return 0;
+}
+
+/**
+ * alloc_pool_table_remove:
+ * @base: address of slab.
+ *
+ * Removes @base from slab_table.
+ **/
+static void
+alloc_pool_table_remove (uintptr_t base)
+{
+	size_t i;
+
+	nih_assert (slab_table_size > 0);
+
+	i = (base / ALLOC_POOL_SLAB_SIZE) & (slab_table_size - 1);
+	while (slab_table[i] != base) {
+		nih_assert (slab_table[i] != SLAB_EMPTY);
+		i = (i + 1) & (slab_table_size - 1);
+	}
+
+	slab_table[i] = SLAB_DELETED;
+}
+
+
+/**
+ * alloc_pool_stats_to_string:
+ * @parent: parent object for new string.
+ *
+ * Returns: newly allocated JSON string giving, for each pool, the number
+ * of objects in use, the most there have been, the number the pool
+ * currently has room for and its number of slabs; or NULL if
+ * insufficient memory.
+ **/
+char *
+alloc_pool_stats_to_string (const void *parent)
+{
+	char *str;
+
+	str = nih_strdup (parent, "{");
+	if (! str)
+		return NULL;
+
+	for (size_t i = 0; i < alloc_pools_len; i++) {
+		AllocPool *pool = &alloc_pools[i];
+
+		if (! nih_strcat_sprintf (&str, parent,
+					  "%s \"%s\": { \"live\": %zu, "
+					  "\"peak\": %zu, \"size\": %zu, "
+					  "\"slabs\": %zu }",
+					  i ? "," : "", pool->name,
+					  pool->live, pool->peak,
+					  pool->slabs * pool->per_slab,
+					  pool->slabs)) {
+			nih_free (str);
+			return NULL;
+		}
+	}
+
+	if (! nih_strcat (&str, parent, " }")) {
+		nih_free (str);
+		return NULL;
+	}
+
+	return str;
+}
@@ -0,0 +1,118 @@
+/* upstart
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INIT_ALLOC_POOL_H
+#define INIT_ALLOC_POOL_H
+
+#include <stddef.h>
+
+#include <nih/macros.h>
+
+
+/**
+ * ALLOC_POOL_SLAB_SIZE:
+ *
+ * Size, and alignment, of each slab of memory that pooled objects are
+ * carved from.
+ **/
+#define ALLOC_POOL_SLAB_SIZE 65536
+
+/**
+ * ALLOC_POOL_MAX:
+ *
+ * Maximum number of pools that may be added.
+ **/
+#define ALLOC_POOL_MAX 8
+
+
+typedef struct alloc_pool AllocPool;
+
+/**
+ * AllocPoolChunk:
+ * @next: next free chunk in the slab.
+ *
+ * Overlays each free chunk of a slab.
+ **/
+typedef struct alloc_pool_chunk {
+	struct alloc_pool_chunk *next;
+} AllocPoolChunk;
+
+/**
+ * AllocPoolSlab:
+ * @pool: pool the slab belongs to,
+ * @prev: previous slab of @pool with free chunks,
+ * @next: next slab of @pool with free chunks,
+ * @free: list of free chunks,
+ * @used: number of chunks in use.
+ *
+ * Header at the start of each slab; the chunks follow it.  Since slabs
+ * are aligned to their size, the slab of any chunk is found by masking
+ * its address.
+ **/
+typedef struct alloc_pool_slab {
+	AllocPool              *pool;
+	struct alloc_pool_slab *prev;
+	struct alloc_pool_slab *next;
+
+	AllocPoolChunk         *free;
+	size_t                  used;
+} AllocPoolSlab;
+
+/**
+ * AllocPool:
+ * @name: name of the type pooled,
+ * @size: size of allocation, including the nih_alloc() header, pooled,
+ * @chunk_size: @size rounded up for alignment,
+ * @per_slab: number of chunks in each slab,
+ * @partial: slabs with free chunks,
+ * @slabs: number of slabs,
+ * @live: number of chunks in use,
+ * @peak: greatest value of @live.
+ *
+ * A pool of memory for all objects of one size, for the types that init
+ * creates and frees in large numbers; keeping them apart from the rest
+ * of the heap means the memory they use is returned to the kernel one
+ * slab at a time once they're freed, rather than fragmenting it.
+ **/
+struct alloc_pool {
+	const char     *name;
+	size_t          size;
+	size_t          chunk_size;
+	size_t          per_slab;
+
+	AllocPoolSlab  *partial;
+	size_t          slabs;
+
+	size_t          live;
+	size_t          peak;
+};
+
+
+NIH_BEGIN_EXTERN
+
+extern AllocPool alloc_pools[];
+extern size_t    alloc_pools_len;
+
+
+void  alloc_pool_init            (void);
+int   alloc_pool_add             (const char *name, size_t size);
+
+char *alloc_pool_stats_to_string (const void *parent)
+	__attribute__ ((warn_unused_result, malloc));
+
+NIH_END_EXTERN
+
+#endif /* INIT_ALLOC_POOL_H */
@@ -26,15 +26,111 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <dirent.h>
+#include <libgen.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <limits.h>
 
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/list.h>
+#include <nih/hash.h>
 #include <nih/signal.h>
 #include <nih/string.h>
+#include <nih/file.h>
+#include <nih/error.h>
+#include <nih/logging.h>
 
 #include "apparmor.h"
 
+
+/**
+ * APPARMOR_UNSAFE_CHARS:
+ *
+ * Characters of a profile path that would have the shell run the load
+ * command rather than it being run directly, so that the file loaded
+ * might not be the one named.
+ **/
+#define APPARMOR_UNSAFE_CHARS " \t~`!$^&*()=|\\{}[];\"'<>?"
+
+/**
+ * APPARMOR_PROFILE_DIR:
+ *
+ * Directory that include <name> statements of profiles are relative to.
+ **/
+#define APPARMOR_PROFILE_DIR "/etc/apparmor.d"
+
+/**
+ * APPARMOR_INCLUDE_DEPTH:
+ *
+ * Depth to which apparmor_includes() follows includes of includes.
+ **/
+#define APPARMOR_INCLUDE_DEPTH 16
+
+
+/**
+ * ApparmorProfile:
+ * @entry: list header,
+ * @path: path of profile source,
+ * @dev: device of @path,
+ * @ino: inode of @path,
+ * @size: size of @path,
+ * @mtime: modification time of @path,
+ * @includes: number of files and directories @path includes,
+ * @includes_mtime: newest modification time of those,
+ * @loaded: TRUE once the profile has been loaded as described.
+ *
+ * Records the profile source last loaded by a job, by the file it was
+ * read from and those it includes, so that the load can be skipped
+ * until any of them changes.
+ **/
+typedef struct apparmor_profile {
+	NihList          entry;
+	char            *path;
+	dev_t            dev;
+	ino_t            ino;
+	off_t            size;
+	struct timespec  mtime;
+	size_t           includes;
+	struct timespec  includes_mtime;
+	int              loaded;
+} ApparmorProfile;
+
+
+/* Prototypes for static functions */
+static int         apparmor_check     (void);
+static const char *apparmor_load_path (const char *command);
+static void        apparmor_includes  (const char *path, NihHash *seen,
+				       int depth, size_t *count,
+				       struct timespec *newest);
+static void        apparmor_include_line (const char *path,
+					  const char *line, size_t len,
+					  NihHash *seen, int depth,
+					  size_t *count,
+					  struct timespec *newest);
+
+
+/**
+ * apparmor_enabled:
+ *
+ * Result of the checks made by apparmor_available(), or -1 before they
+ * have been made; these are made once by each init process, such that
+ * they're repeated after being re-executed.
+ **/
+static int apparmor_enabled = -1;
+
+/**
+ * apparmor_profiles:
+ *
+ * Hash table of ApparmorProfile structures for the profiles loaded by
+ * jobs, indexed by path.  Not serialised, so every profile is loaded
+ * again after being re-executed.
+ **/
+static NihHash *apparmor_profiles = NULL;
+
+
 /**
  * apparmor_switch:
  * @profile: AppArmor profile to switch to
@@ -76,12 +172,31 @@ apparmor_switch (char *profile)
 /**
  * apparmor_available:
  *
- * This function checks to see if AppArmor is available and enabled
+ * This function checks to see if AppArmor is available and enabled;
+ * the checks are only made on the first call, since it's asked on
+ * every job start.
  *
  * Returns: TRUE if AppArmor is available, FALSE if it isn't
  **/
 int
 apparmor_available (void)
+{
+	if (apparmor_enabled < 0)
+		apparmor_enabled = apparmor_check ();
+
+	return apparmor_enabled;
+}
+
+/**
+ * apparmor_check:
+ *
+ * Checks whether AppArmor is enabled in the kernel and its parser
+ * installed, outside of a container or live CD.
+ *
+ * Returns: TRUE if AppArmor is available, FALSE if it isn't
+ **/
+static int
+apparmor_check (void)
 {
 	struct stat     statbuf;
 	FILE           *f;
@@ -126,3 +241,336 @@ apparmor_available (void)
 	return TRUE;
 }
 
+
+/**
+ * apparmor_load_path:
+ * @command: command of a security process.
+ *
+ * Finds the profile loaded by @command, when it is the command set by an
+ * apparmor load stanza naming a file that it's safe to check.
+ *
+ * Returns: path of the profile within @command, or NULL.
+ **/
+static const char *
+apparmor_load_path (const char *command)
+{
+	const char *prefix = APPARMOR_PARSER " " APPARMOR_PARSER_OPTS " ";
+	const char *path;
+
+	nih_assert (command != NULL);
+
+	if (strncmp (command, prefix, strlen (prefix)))
+		return NULL;
+
+	path = command + strlen (prefix);
+	if ((! *path) || strpbrk (path, APPARMOR_UNSAFE_CHARS))
+		return NULL;
+
+	return path;
+}
+
+/**
+ * apparmor_load_needed:
+ * @command: command of a security process.
+ *
+ * Determines whether the security process of a job starting needs to be
+ * run: it may be skipped when it loads a profile that an earlier job
+ * loaded from the same file, with neither it nor any file it includes
+ * changed since, as the profile in the kernel is then already up to date.  Running apparmor_parser is costly
+ * even when it has the profile compiled in its cache, and holds up the
+ * start of the job.
+ *
+ * Otherwise the file is noted as being loaded, for
+ * apparmor_load_finished() to record once the process has succeeded.
+ *
+ * Returns: FALSE if the process may be skipped, TRUE if it should run.
+ **/
+int
+apparmor_load_needed (const char *command)
+{
+	ApparmorProfile   *profile;
+	const char        *path;
+	struct stat        statbuf;
+	nih_local NihHash *seen = NULL;
+	size_t             includes = 0;
+	struct timespec    includes_mtime = { 0, 0 };
+
+	nih_assert (command != NULL);
+
+	path = apparmor_load_path (command);
+	if (! path)
+		return TRUE;
+
+	/* Leave the parser to report a missing profile */
+	if (stat (path, &statbuf) < 0)
+		return TRUE;
+
+	if (! apparmor_profiles)
+		apparmor_profiles = NIH_MUST (nih_hash_string_new (NULL, 0));
+
+	seen = NIH_MUST (nih_hash_string_new (NULL, 0));
+	apparmor_includes (path, seen, APPARMOR_INCLUDE_DEPTH,
+			   &includes, &includes_mtime);
+
+	profile = (ApparmorProfile *)nih_hash_lookup (apparmor_profiles, path);
+	if (profile && profile->loaded
+	    && (profile->dev == statbuf.st_dev)
+	    && (profile->ino == statbuf.st_ino)
+	    && (profile->size == statbuf.st_size)
+	    && (profile->mtime.tv_sec == statbuf.st_mtim.tv_sec)
+	    && (profile->mtime.tv_nsec == statbuf.st_mtim.tv_nsec)
+	    && (profile->includes == includes)
+	    && (profile->includes_mtime.tv_sec == includes_mtime.tv_sec)
+	    && (profile->includes_mtime.tv_nsec == includes_mtime.tv_nsec)) {
+		nih_debug ("AppArmor profile %s unchanged, not loading", path);
+		return FALSE;
+	}
+
+	if (! profile) {
+		profile = NIH_MUST (nih_new (apparmor_profiles, ApparmorProfile));
+
+		nih_list_init (&profile->entry);
+		nih_alloc_set_destructor (profile, nih_list_destroy);
+
+		profile->path = NIH_MUST (nih_strdup (profile, path));
+
+		nih_hash_add (apparmor_profiles, &profile->entry);
+	}
+
+	/* Describe the file as it was before being loaded, so that a change
+	 * made during the load is loaded by the next job.
+	 */
+	profile->dev = statbuf.st_dev;
+	profile->ino = statbuf.st_ino;
+	profile->size = statbuf.st_size;
+	profile->mtime = statbuf.st_mtim;
+	profile->includes = includes;
+	profile->includes_mtime = includes_mtime;
+	profile->loaded = FALSE;
+
+	return TRUE;
+}
+
+/**
+ * apparmor_includes:
+ * @path: profile source file or directory,
+ * @seen: hash table of paths already visited,
+ * @depth: depth of includes still to follow,
+ * @count: number of files and directories visited,
+ * @newest: newest modification time of those.
+ *
+ * Visits the files that @path includes, and those they include in turn
+ * to a depth of @depth, adding each to @count and @newest; for an
+ * included directory, that is the directory and every file within it.
+ * @path itself is not counted, only what it includes.
+ *
+ * Includes that can't be found or read are passed over, since the parser
+ * will report them if they matter; this only errs towards loading the
+ * profile again.
+ **/
+static void
+apparmor_includes (const char      *path,
+		   NihHash         *seen,
+		   int              depth,
+		   size_t          *count,
+		   struct timespec *newest)
+{
+	nih_local char *data = NULL;
+	struct stat     statbuf;
+	NihListEntry   *entry;
+	size_t          len;
+	size_t          pos = 0;
+
+	nih_assert (path != NULL);
+	nih_assert (seen != NULL);
+	nih_assert (count != NULL);
+	nih_assert (newest != NULL);
+
+	if (nih_hash_lookup (seen, path) || (stat (path, &statbuf) < 0))
+		return;
+
+	entry = NIH_MUST (nih_list_entry_new (seen));
+	entry->str = NIH_MUST (nih_strdup (entry, path));
+	nih_hash_add (seen, &entry->entry);
+
+	if (depth < APPARMOR_INCLUDE_DEPTH) {
+		(*count)++;
+
+		if ((statbuf.st_mtim.tv_sec > newest->tv_sec)
+		    || ((statbuf.st_mtim.tv_sec == newest->tv_sec)
+			&& (statbuf.st_mtim.tv_nsec > newest->tv_nsec)))
+			*newest = statbuf.st_mtim;
+	}
+
+	if (depth <= 0)
+		return;
+
+	if (S_ISDIR (statbuf.st_mode)) {
+		DIR           *dir;
+		struct dirent *ent;
+
+		dir = opendir (path);
+		if (! dir)
+			return;
+
+		while ((ent = readdir (dir)) != NULL) {
+			nih_local char *child = NULL;
+
+			if (ent->d_name[0] == '.')
+				continue;
+
+			child = NIH_MUST (nih_sprintf (NULL, "%s/%s",
+						       path, ent->d_name));
+			apparmor_includes (child, seen, depth - 1,
+					   count, newest);
+		}
+
+		closedir (dir);
+		return;
+	}
+
+	data = nih_file_read (NULL, path, &len);
+	if (! data) {
+		nih_free (nih_error_get ());
+		return;
+	}
+
+	while (pos < len) {
+		const char *line = data + pos;
+		const char *end;
+		size_t      line_len;
+
+		end = memchr (line, '\n', len - pos);
+		line_len = end ? (size_t)(end - line) : len - pos;
+
+		apparmor_include_line (path, line, line_len, seen, depth,
+				       count, newest);
+
+		pos += line_len + 1;
+	}
+}
+
+/**
+ * apparmor_include_line:
+ * @path: profile source file that @line is from,
+ * @line: line of @path,
+ * @len: length of @line,
+ * @seen: hash table of paths already visited,
+ * @depth: depth of includes still to follow from @path,
+ * @count: number of files and directories visited,
+ * @newest: newest modification time of those.
+ *
+ * Follows @line with apparmor_includes() if it is an include statement,
+ * in any of the forms "#include <name>", "include <name>",
+ * "include if exists <name>" or those with "name" in quotes instead;
+ * <name> is relative to APPARMOR_PROFILE_DIR, and "name" to the directory
+ * of @path.
+ **/
+static void
+apparmor_include_line (const char      *path,
+		       const char      *line,
+		       size_t           len,
+		       NihHash         *seen,
+		       int              depth,
+		       size_t          *count,
+		       struct timespec *newest)
+{
+	nih_local char *name = NULL;
+	nih_local char *dpath = NULL;
+	nih_local char *include = NULL;
+	const char     *end = line + len;
+	const char     *p = line;
+	const char     *close;
+	char            quote;
+
+	nih_assert (path != NULL);
+	nih_assert (line != NULL);
+
+	while ((p < end) && strchr (" \t", *p))
+		p++;
+
+	if (((size_t)(end - p) > 8) && (! strncmp (p, "#include", 8))) {
+		p += 8;
+	} else if (((size_t)(end - p) > 7) && (! strncmp (p, "include", 7))
+		   && strchr (" \t<\"", p[7])) {
+		p += 7;
+	} else {
+		return;
+	}
+
+	while ((p < end) && strchr (" \t", *p))
+		p++;
+
+	if (((size_t)(end - p) > 2) && (! strncmp (p, "if", 2))
+	    && strchr (" \t", p[2])) {
+		p += 2;
+		while ((p < end) && strchr (" \t", *p))
+			p++;
+
+		if (((size_t)(end - p) < 6) || strncmp (p, "exists", 6))
+			return;
+
+		p += 6;
+		while ((p < end) && strchr (" \t", *p))
+			p++;
+	}
+
+	if ((p == end) || ((*p != '<') && (*p != '"')))
+		return;
+
+	quote = (*p == '<' ? '>' : '"');
+	p++;
+
+	close = memchr (p, quote, end - p);
+	if ((! close) || (close == p))
+		return;
+
+	name = NIH_MUST (nih_strndup (NULL, p, close - p));
+
+	if (name[0] == '/') {
+		include = NIH_MUST (nih_strdup (NULL, name));
+	} else if (quote == '>') {
+		include = NIH_MUST (nih_sprintf (NULL, "%s/%s",
+						 APPARMOR_PROFILE_DIR, name));
+	} else {
+		dpath = NIH_MUST (nih_strdup (NULL, path));
+		include = NIH_MUST (nih_sprintf (NULL, "%s/%s",
+						 dirname (dpath), name));
+	}
+
+	apparmor_includes (include, seen, depth - 1, count, newest);
+}
+
+/**
+ * apparmor_load_finished:
+ * @command: command of a security process,
+ * @status: exit status of the process.
+ *
+ * Records the outcome of a security process run after
+ * apparmor_load_needed() returned TRUE for @command; a profile loaded
+ * successfully is not loaded again by later jobs until its source
+ * changes, while one that failed to load is forgotten.
+ **/
+void
+apparmor_load_finished (const char *command,
+			int         status)
+{
+	ApparmorProfile *profile;
+	const char      *path;
+
+	nih_assert (command != NULL);
+
+	path = apparmor_load_path (command);
+	if ((! path) || (! apparmor_profiles))
+		return;
+
+	profile = (ApparmorProfile *)nih_hash_lookup (apparmor_profiles, path);
+	if (! profile)
+		return;
+
+	if (status) {
+		nih_free (profile);
+	} else {
+		profile->loaded = TRUE;
+	}
+}
@@ -47,6 +47,10 @@ int    apparmor_switch (char *profile)
 int    apparmor_available (void)
 	__attribute__ ((warn_unused_result));
 
+int    apparmor_load_needed (const char *command)
+	__attribute__ ((warn_unused_result));
+void   apparmor_load_finished (const char *command, int status);
+
 NIH_END_EXTERN
 
 #endif /* INIT_APPARMOR_H */
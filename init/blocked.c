@@ -24,16 +24,76 @@
 #endif /* HAVE_CONFIG_H */
 
 
+#include <string.h>
+
 #include <nih/macros.h>
 #include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
 #include <nih/logging.h>
 
 #include <nih-dbus/dbus_message.h>
 
+#include "environ.h"
 #include "job.h"
 #include "event.h"
 #include "blocked.h"
 
+#include <json.h>
+
+
+/**
+ * BlockedTrack:
+ * @entry: hash list header,
+ * @name: name of the job or event the track is for,
+ * @tid: thread id used for @name in the trace.
+ *
+ * Used by blocked_trace_to_string() to give each job and event that
+ * waited its own track.
+ **/
+typedef struct blocked_track {
+	NihList  entry;
+	char    *name;
+	int      tid;
+} BlockedTrack;
+
+/* Prototypes for static functions */
+static char *blocked_trace_event_name (const void *parent, Event *event)
+	__attribute__ ((warn_unused_result));
+static json_object *blocked_trace_metadata (const char *name, int pid,
+					    int tid, const char *value)
+	__attribute__ ((warn_unused_result));
+
+
+/**
+ * blocked_trace:
+ *
+ * List of BlockedSpan records making up the runtime blocking graph,
+ * in the order the blocks ended.
+ **/
+NihList *blocked_trace = NULL;
+
+/**
+ * blocked_trace_len:
+ *
+ * Number of entries in blocked_trace.
+ **/
+static size_t blocked_trace_len = 0;
+
+
+/**
+ * blocked_trace_init:
+ *
+ * Initialise the blocked_trace list.
+ **/
+void
+blocked_trace_init (void)
+{
+	if (! blocked_trace)
+		blocked_trace = NIH_MUST (nih_list_new (NULL));
+}
+
 
 /**
  * blocked_new:
@@ -69,6 +129,8 @@ blocked_new (const void  *parent,
 	nih_alloc_set_destructor (blocked, nih_list_destroy);
 
 	blocked->type = type;
+	blocked->since = job_timing_now ();
+
 	switch (blocked->type) {
 	case BLOCKED_JOB:
 		blocked->job = (Job *)data;
@@ -86,6 +148,10 @@ blocked_new (const void  *parent,
 		blocked->message = (NihDBusMessage *)data;
 		nih_ref (blocked->message, blocked);
 		break;
+	case BLOCKED_EMIT_EVENTS_METHOD:
+		blocked->data = data;
+		nih_ref (blocked->data, blocked);
+		break;
 	default:
 		nih_assert_not_reached ();
 	}
@@ -109,6 +175,7 @@ blocked_type_enum_to_str (BlockedType type)
 	state_enum_to_str (BLOCKED_JOB, type);
 	state_enum_to_str (BLOCKED_EVENT, type);
 	state_enum_to_str (BLOCKED_EMIT_METHOD, type);
+	state_enum_to_str (BLOCKED_EMIT_EVENTS_METHOD, type);
 	state_enum_to_str (BLOCKED_JOB_START_METHOD, type);
 	state_enum_to_str (BLOCKED_JOB_STOP_METHOD, type);
 	state_enum_to_str (BLOCKED_JOB_RESTART_METHOD, type);
@@ -136,6 +203,7 @@ blocked_type_str_to_enum (const char *type)
 	state_str_to_enum (BLOCKED_JOB, type);
 	state_str_to_enum (BLOCKED_EVENT, type);
 	state_str_to_enum (BLOCKED_EMIT_METHOD, type);
+	state_str_to_enum (BLOCKED_EMIT_EVENTS_METHOD, type);
 	state_str_to_enum (BLOCKED_JOB_START_METHOD, type);
 	state_str_to_enum (BLOCKED_JOB_STOP_METHOD, type);
 	state_str_to_enum (BLOCKED_JOB_RESTART_METHOD, type);
@@ -145,3 +213,274 @@ blocked_type_str_to_enum (const char *type)
 
 	return -1;
 }
+
+/**
+ * blocked_trace_event_name:
+ * @parent: parent object for new string,
+ * @event: event to name.
+ *
+ * Returns: newly allocated string naming @event and, for job events, the
+ * job and instance it is for, or NULL if insufficient memory.
+ **/
+static char *
+blocked_trace_event_name (const void *parent,
+			  Event      *event)
+{
+	const char *job;
+	const char *instance;
+
+	nih_assert (event != NULL);
+
+	job = environ_get (event->env, "JOB");
+	instance = environ_get (event->env, "INSTANCE");
+
+	if (job && instance && *instance) {
+		return nih_sprintf (parent, "%s %s (%s)", event->name,
+				    job, instance);
+	} else if (job) {
+		return nih_sprintf (parent, "%s %s", event->name, job);
+	} else {
+		return nih_strdup (parent, event->name);
+	}
+}
+
+/**
+ * blocked_trace_add:
+ * @blocked: block that has ended,
+ * @blocker: Event or Job that @blocked was waiting for.
+ *
+ * Records the end of @blocked in blocked_trace, @blocked must be either
+ * a BLOCKED_JOB record, in which case @blocker is the event the job was
+ * waiting for, or a BLOCKED_EVENT record, in which case @blocker is the
+ * job the event was waiting for.
+ *
+ * Nothing is recorded once BLOCKED_TRACE_MAX spans have been.
+ **/
+void
+blocked_trace_add (const Blocked *blocked,
+		   void          *blocker)
+{
+	BlockedSpan *span;
+
+	nih_assert (blocked != NULL);
+	nih_assert (blocker != NULL);
+	nih_assert ((blocked->type == BLOCKED_JOB)
+		    || (blocked->type == BLOCKED_EVENT));
+
+	if (blocked_trace_len >= BLOCKED_TRACE_MAX)
+		return;
+
+	blocked_trace_init ();
+
+	span = NIH_MUST (nih_new (blocked_trace, BlockedSpan));
+
+	nih_list_init (&span->entry);
+	nih_alloc_set_destructor (span, nih_list_destroy);
+
+	span->type = blocked->type;
+
+	if (blocked->type == BLOCKED_JOB) {
+		span->name = NIH_MUST (nih_strdup (span,
+						   job_name (blocked->job)));
+		span->blocker = NIH_MUST (blocked_trace_event_name (
+						  span, (Event *)blocker));
+	} else {
+		span->name = NIH_MUST (blocked_trace_event_name (
+					       span, blocked->event));
+		span->blocker = NIH_MUST (nih_strdup (
+						  span, job_name ((Job *)blocker)));
+	}
+
+	span->start = blocked->since;
+	span->end = job_timing_now ();
+
+	nih_list_add (blocked_trace, &span->entry);
+	blocked_trace_len++;
+}
+
+/**
+ * blocked_trace_metadata:
+ * @name: metadata record name,
+ * @pid: process id the record applies to,
+ * @tid: thread id the record applies to,
+ * @value: name to give.
+ *
+ * Returns: new Trace Event Format metadata record naming a process or
+ * thread, or NULL on error.
+ **/
+static json_object *
+blocked_trace_metadata (const char *name,
+			int         pid,
+			int         tid,
+			const char *value)
+{
+	json_object *json;
+	json_object *json_args;
+
+	nih_assert (name != NULL);
+	nih_assert (value != NULL);
+
+	json = json_object_new_object ();
+	if (! json)
+		return NULL;
+
+	json_object_object_add (json, "name", json_object_new_string (name));
+	json_object_object_add (json, "ph", json_object_new_string ("M"));
+	json_object_object_add (json, "pid", json_object_new_int (pid));
+	json_object_object_add (json, "tid", json_object_new_int (tid));
+
+	json_args = json_object_new_object ();
+	if (! json_args)
+		goto error;
+
+	json_object_object_add (json_args, "name",
+				json_object_new_string (value));
+	json_object_object_add (json, "args", json_args);
+
+	return json;
+
+error:
+	json_object_put (json);
+	return NULL;
+}
+
+/**
+ * blocked_trace_to_string:
+ * @parent: parent object for new string.
+ *
+ * Converts blocked_trace into the Trace Event Format understood by
+ * chrome://tracing and similar viewers.  Jobs waiting for events and
+ * events waiting for jobs are shown as two processes (numbered by the
+ * BlockedType of the span plus one), with a thread for
+ * each job or event that waited and a complete event for each span named
+ * after what it waited for.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned string.  When all parents
+ * of the returned string are freed, the returned string will also be
+ * freed.
+ *
+ * Returns: newly allocated JSON string, or NULL if insufficient memory.
+ **/
+char *
+blocked_trace_to_string (const void *parent)
+{
+	nih_local NihHash *tracks = NULL;
+	json_object       *json;
+	json_object       *json_events;
+	json_object       *json_meta;
+	char              *str = NULL;
+	int                next_tid = 1;
+
+	blocked_trace_init ();
+
+	tracks = nih_hash_string_new (NULL, 0);
+	if (! tracks)
+		return NULL;
+
+	json = json_object_new_object ();
+	if (! json)
+		return NULL;
+
+	json_events = json_object_new_array ();
+	if (! json_events)
+		goto out;
+
+	json_object_object_add (json, "traceEvents", json_events);
+	json_object_object_add (json, "displayTimeUnit",
+				json_object_new_string ("ms"));
+
+	json_meta = blocked_trace_metadata ("process_name",
+					    BLOCKED_JOB + 1, 0, "jobs");
+	if (! json_meta || json_object_array_add (json_events, json_meta) < 0)
+		goto out;
+
+	json_meta = blocked_trace_metadata ("process_name",
+					    BLOCKED_EVENT + 1, 0, "events");
+	if (! json_meta || json_object_array_add (json_events, json_meta) < 0)
+		goto out;
+
+	NIH_LIST_FOREACH (blocked_trace, iter) {
+		BlockedSpan  *span = (BlockedSpan *)iter;
+		BlockedTrack *track;
+		json_object  *json_span;
+		json_object  *json_args;
+
+		/* Jobs and events may share names, so key the tracks by
+		 * type as well.
+		 */
+		nih_local char *key = nih_sprintf (NULL, "%d:%s", span->type,
+						   span->name);
+		if (! key)
+			goto out;
+
+		track = (BlockedTrack *)nih_hash_lookup (tracks, key);
+		if (! track) {
+			track = nih_new (tracks, BlockedTrack);
+			if (! track)
+				goto out;
+
+			nih_list_init (&track->entry);
+			nih_alloc_set_destructor (track, nih_list_destroy);
+
+			track->name = nih_strdup (track, key);
+			if (! track->name)
+				goto out;
+
+			track->tid = next_tid++;
+
+			nih_hash_add (tracks, &track->entry);
+
+			json_meta = blocked_trace_metadata ("thread_name",
+							    span->type + 1,
+							    track->tid,
+							    span->name);
+			if (! json_meta
+			    || json_object_array_add (json_events, json_meta) < 0)
+				goto out;
+		}
+
+		json_span = json_object_new_object ();
+		if (! json_span)
+			goto out;
+
+		if (json_object_array_add (json_events, json_span) < 0) {
+			json_object_put (json_span);
+			goto out;
+		}
+
+		json_object_object_add (json_span, "name",
+					json_object_new_string (span->blocker));
+		json_object_object_add (json_span, "cat",
+					json_object_new_string (
+						span->type == BLOCKED_JOB
+						? "job" : "event"));
+		json_object_object_add (json_span, "ph",
+					json_object_new_string ("X"));
+		json_object_object_add (json_span, "ts",
+					json_object_new_int64 (span->start));
+		json_object_object_add (json_span, "dur",
+					json_object_new_int64 (span->end
+							       - span->start));
+		json_object_object_add (json_span, "pid",
+					json_object_new_int (span->type + 1));
+		json_object_object_add (json_span, "tid",
+					json_object_new_int (track->tid));
+
+		json_args = json_object_new_object ();
+		if (! json_args)
+			goto out;
+
+		json_object_object_add (json_args, "waiting",
+					json_object_new_string (span->name));
+		json_object_object_add (json_args, "blocker",
+					json_object_new_string (span->blocker));
+		json_object_object_add (json_span, "args", json_args);
+	}
+
+	str = nih_strdup (parent, json_object_to_json_string (json));
+
+out:
+	json_object_put (json);
+	return str;
+}
@@ -20,6 +20,8 @@
 #ifndef INIT_BLOCKED_H
 #define INIT_BLOCKED_H
 
+#include <stdint.h>
+
 #include <nih/macros.h>
 #include <nih/list.h>
 
@@ -39,6 +41,7 @@ typedef enum blocked_type {
 	BLOCKED_JOB,
 	BLOCKED_EVENT,
 	BLOCKED_EMIT_METHOD,
+	BLOCKED_EMIT_EVENTS_METHOD,
 	BLOCKED_JOB_START_METHOD,
 	BLOCKED_JOB_STOP_METHOD,
 	BLOCKED_JOB_RESTART_METHOD,
@@ -55,7 +58,9 @@ typedef enum blocked_type {
  * @job: job pointer if @type is BLOCKED_JOB,
  * @event: event pointer if @type is BLOCKED_EVENT,
  * @message: D-Bus message pointer if @type is BLOCKED_*_METHOD,
- * @data: generic pointer to blocked object.
+ * @data: generic pointer to blocked object, a ControlEmitBatch if @type
+ * is BLOCKED_EMIT_EVENTS_METHOD,
+ * @since: time the block began, in microseconds on CLOCK_MONOTONIC.
  *
  * This structure is used to reference an object that is blocked on
  * some other, such as an event completing or a job reaching a goal.
@@ -71,14 +76,54 @@ typedef struct blocked {
 		NihDBusMessage *message;
 		void           *data;
 	};
+
+	uint64_t    since;
 } Blocked;
 
+/**
+ * BLOCKED_TRACE_MAX:
+ *
+ * Maximum number of spans kept in blocked_trace; once reached no more are
+ * recorded, so that the trace covers boot rather than the most recent
+ * activity.
+ **/
+#define BLOCKED_TRACE_MAX 4096
+
+/**
+ * BlockedSpan:
+ * @entry: list header,
+ * @type: BLOCKED_JOB if a job waited for an event, BLOCKED_EVENT if an
+ * event waited for a job,
+ * @name: name of the job or event that waited,
+ * @blocker: name of the event or job it waited for,
+ * @start: time the block began,
+ * @end: time the block ended.
+ *
+ * Records a single edge of the runtime blocking graph, times are in
+ * microseconds on CLOCK_MONOTONIC.
+ **/
+typedef struct blocked_span {
+	NihList      entry;
+	BlockedType  type;
+	char        *name;
+	char        *blocker;
+	uint64_t     start;
+	uint64_t     end;
+} BlockedSpan;
+
 
 NIH_BEGIN_EXTERN
 
+extern NihList *blocked_trace;
+
 Blocked *blocked_new (const void *parent, BlockedType type, void *data)
 	__attribute__ ((warn_unused_result));
 
+void     blocked_trace_init   (void);
+void     blocked_trace_add    (const Blocked *blocked, void *blocker);
+char *   blocked_trace_to_string (const void *parent)
+	__attribute__ ((warn_unused_result));
+
 const char *
 blocked_type_enum_to_str (BlockedType type)
 	__attribute__ ((warn_unused_result));
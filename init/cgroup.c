@@ -23,6 +23,7 @@
 # include <config.h>
 #endif /* HAVE_CONFIG_H */
 
+#include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <signal.h>
@@ -31,6 +32,9 @@
 #include <sys/select.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
 
 #include <nih/macros.h>
 #include <nih/logging.h>
@@ -38,6 +42,7 @@
 #include <nih/hash.h>
 #include <nih/alloc.h>
 #include <nih/io.h>
+#include <nih/signal.h>
 
 #include <dbus/dbus.h>
 
@@ -54,6 +59,10 @@
 
 #include <cgmanager/cgmanager-client.h>
 
+#ifndef CGROUP2_SUPER_MAGIC
+#define CGROUP2_SUPER_MAGIC 0x63677270
+#endif /* CGROUP2_SUPER_MAGIC */
+
 extern int          user_mode;
 
 /**
@@ -81,10 +90,77 @@ char *cgroup_manager_address = NULL;
  **/
 NihDBusProxy *cgroup_manager = NULL;
 
+/**
+ * cgroup_pending:
+ *
+ * Array of calls to the cgroup manager that have been sent but whose
+ * replies have not yet been waited for by cgroup_wait().
+ *
+ * Note: Only used by child processes.
+ **/
+static DBusPendingCall **cgroup_pending = NULL;
+static size_t            cgroup_pending_len = 0;
+
+/**
+ * cgroup_pending_error:
+ *
+ * First error returned by any call in cgroup_pending.
+ **/
+static NihError *cgroup_pending_error = NULL;
+
+/**
+ * cgroup_unified:
+ *
+ * TRUE if cgroups are created directly in the unified hierarchy rather
+ * than by the cgroup manager, FALSE if not, or -1 if not yet determined
+ * by cgroup_unified_available().
+ **/
+int cgroup_unified = -1;
+
+/**
+ * cgroup_unified_root:
+ *
+ * Mount point of the unified hierarchy, normally
+ * UPSTART_CGROUP_UNIFIED_ROOT; only changed by the test suite.
+ **/
+const char *cgroup_unified_root = UPSTART_CGROUP_UNIFIED_ROOT;
+
 static void cgroup_manager_disconnected (DBusConnection *connection);
 
 static void cgroup_name_remap (char *str);
 
+static char **cgroup_environment  (const void *parent, char * const *env)
+	__attribute__ ((warn_unused_result, malloc));
+static char  *cgroup_name_expand  (const void *parent, const CGroupName *cgname,
+				   char * const *cgroup_env)
+	__attribute__ ((warn_unused_result, malloc));
+
+static char  *cgroup_unified_create (const void *parent, const char *controller,
+				     const char *path)
+	__attribute__ ((warn_unused_result, malloc));
+static int    cgroup_unified_write  (int dirfd, const char *file,
+				     const char *value)
+	__attribute__ ((warn_unused_result));
+static int    cgroup_unified_signal (int fd, const char *cgpath, int signal)
+	__attribute__ ((warn_unused_result));
+static char  *cgroup_unified_path   (const void *parent,
+				     const CGroupName *cgname,
+				     char * const *cgroup_env)
+	__attribute__ ((warn_unused_result, malloc));
+static int    cgroup_name_private   (const CGroupName *cgname);
+static int    cgroup_unified_remove (const char *cgpath);
+static void   cgroup_unified_reap   (char *cgpath, int kill);
+static int    cgroup_unified_reap_close   (int *fd);
+static void   cgroup_unified_reap_watcher (char *cgpath, NihIoWatch *watch,
+					   NihIoEvents events);
+
+static int  cgroup_pending_add   (DBusPendingCall *call)
+	__attribute__ ((warn_unused_result));
+static void cgroup_reply         (void *data, NihDBusMessage *message);
+static void cgroup_create_reply  (void *data, NihDBusMessage *message,
+				  int32_t existed);
+static void cgroup_error_handler (void *data, NihDBusMessage *message);
+
 /**
  * cgroup_support_enabled:
  *
@@ -339,17 +415,23 @@ cgroup_clear (NihList *cgroups)
 			/* Get the cgroup manager to delete the cgroup once no more job
 			 * processes remain in it.
 			 */
-			ret = cgmanager_remove_on_empty_sync (NULL,
+			ret = cgroup_pending_add (cgmanager_remove_on_empty (
 					cgroup_manager,
 					cgroup->controller,
-					cgpath);
-
-			if (ret < 0) 
+					cgpath,
+					cgroup_reply,
+					cgroup_error_handler,
+					NULL,
+					NIH_DBUS_TIMEOUT_DEFAULT));
+
+			if (! ret) {
+				(void)cgroup_wait ();
 				return FALSE;
+			}
 		}
 	}
 
-	return TRUE;
+	return cgroup_wait ();
 }
 
 /**
@@ -364,6 +446,10 @@ cgroup_clear (NihList *cgroups)
  * in @cgroups, create the resulting cgroup paths, placing the caller
  * into each group and applying requested cgroup settings.
  *
+ * The requests for all cgroups are sent to the cgroup manager together
+ * and only then are the replies waited for, so the time taken is that
+ * of a single round trip rather than one per request.
+ *
  * Returns: TRUE on success, FALSE on raised error.
  **/
 int
@@ -372,25 +458,10 @@ cgroup_setup (NihList       *cgroups,
 	      uid_t          uid,
 	      gid_t          gid)
 {
-	const char       *upstart_job = NULL;
-	const char       *upstart_instance = NULL;
-	nih_local char   *suffix = NULL;
 	nih_local char  **cgroup_env = NULL;
-	nih_local char   *envvar = NULL;
-	int               instance = FALSE;
 	uid_t             current_uid;
 	gid_t             current_gid;
 
-	/* Value of $UPSTART_CGROUP which takes the form:
-	 *
-	 *     upstart/${UPSTART_JOB}
-	 *
-	 * Or for instance jobs:
-	 *
-	 *     upstart/${UPSTART_JOB}-${UPSTART_INSTANCE}
-	 */
-	nih_local char   *upstart_cgroup = NULL;
-
 	nih_assert (cgroups);
 	nih_assert (env);
 
@@ -405,13 +476,108 @@ cgroup_setup (NihList       *cgroups,
 	current_uid = geteuid ();
 	current_gid = getegid ();
 
-	cgroup_env = nih_str_array_new (NULL);
+	cgroup_env = cgroup_environment (NULL, env);
 	if (! cgroup_env)
-		nih_return_no_memory_error (FALSE);
+		return FALSE;
+
+	NIH_LIST_FOREACH (cgroups, iter) {
+		CGroup *cgroup = (CGroup *)iter;
+
+		NIH_LIST_FOREACH (&cgroup->names, iter2) {
+			CGroupName   *cgname = (CGroupName *)iter2;
+			char         *cgpath;
+
+			cgname->expanded = cgroup_name_expand (cgname, cgname,
+							       cgroup_env);
+			if (! cgname->expanded)
+				return FALSE;
+
+			if (! strcmp (cgname->name, cgname->expanded)) {
+				/* expanded value is the same as the
+				 * original, so don't bother storing the
+				 * former.
+				 */
+				nih_free (cgname->expanded);
+				cgname->expanded = NULL;
+			}
+
+			cgpath = cgname->expanded ? cgname->expanded : cgname->name;
+
+			/* The cgroup manager handles the requests of a
+			 * connection in order, so settings are only applied
+			 * once the cgroup has been created.
+			 */
+			if (! cgroup_create (cgroup->controller, cgpath))
+				goto error;
+
+			if (! cgroup_settings_apply (cgroup->controller,
+						cgpath,
+						&cgname->settings))
+				goto error;
+
+			if ((uid == current_uid) && (gid == current_gid)) {
+				/* No need to chown */
+				continue;
+			}
+
+			if (! cgroup_chown (cgroup->controller, cgpath, uid, gid))
+				goto error;
+		}
+	}
+
+	return cgroup_wait ();
+
+error:
+	/* Discard any replies to requests already sent */
+	(void)cgroup_wait ();
+	return FALSE;
+}
+
+/**
+ * cgroup_environment:
+ * @parent: parent object for new array,
+ * @env: environment table of job process.
+ *
+ * Copies @env, which must include UPSTART_JOB and UPSTART_INSTANCE, adding
+ * UPSTART_CGROUP_ENVVAR for the expansion of cgroup names.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned array.  When all parents
+ * of the returned array are freed, the returned array will also be
+ * freed.
+ *
+ * Returns: newly allocated environment table, or NULL on raised error.
+ **/
+static char **
+cgroup_environment (const void    *parent,
+		    char * const  *env)
+{
+	const char       *upstart_job = NULL;
+	const char       *upstart_instance = NULL;
+	nih_local char   *suffix = NULL;
+	nih_local char   *envvar = NULL;
+	char            **cgroup_env = NULL;
+	int               instance = FALSE;
+
+	/* Value of $UPSTART_CGROUP which takes the form:
+	 *
+	 *     upstart/${UPSTART_JOB}
+	 *
+	 * Or for instance jobs:
+	 *
+	 *     upstart/${UPSTART_JOB}-${UPSTART_INSTANCE}
+	 */
+	nih_local char   *upstart_cgroup = NULL;
+
+	nih_assert (env);
+
+	cgroup_env = nih_str_array_new (parent);
+	if (! cgroup_env)
+		nih_return_no_memory_error (NULL);
 
 	/* Copy the existing environment table */
-	if (! environ_append (&cgroup_env, NULL, NULL, TRUE, env))
-		nih_return_no_memory_error (FALSE);
+	if (! environ_append (&cgroup_env, parent, NULL, TRUE, env))
+		goto error;
 
 	upstart_job = environ_get (cgroup_env, "UPSTART_JOB");
 	nih_assert (upstart_job);
@@ -429,7 +595,7 @@ cgroup_setup (NihList       *cgroups,
 			instance ? upstart_instance : "");
 
 	if (! suffix)
-		nih_return_no_memory_error (FALSE);
+		goto error;
 
 	/* Remap the standard prefix to avoid creating sub-cgroups erroneously */
 	cgroup_name_remap (suffix);
@@ -437,80 +603,77 @@ cgroup_setup (NihList       *cgroups,
 	upstart_cgroup = nih_sprintf (NULL, "upstart/%s", suffix);
 
 	if (! upstart_cgroup)
-		nih_return_no_memory_error (FALSE);
-
-	envvar = NIH_MUST (nih_sprintf (NULL, "%s=%s",
-				UPSTART_CGROUP_ENVVAR,
-				upstart_cgroup));
-
-	if (! environ_add (&cgroup_env, NULL, NULL, TRUE, envvar))
-		nih_return_no_memory_error (FALSE);
-
-	NIH_LIST_FOREACH (cgroups, iter) {
-		CGroup *cgroup = (CGroup *)iter;
-
-		NIH_LIST_FOREACH (&cgroup->names, iter2) {
-			CGroupName   *cgname = (CGroupName *)iter2;
-			char         *cgpath;
-			char         *p;
-
-			/* TRUE if the path *starts with* '$UPSTART_CGROUP' */
-			int           has_var = FALSE;
-			size_t        len;
+		goto error;
 
-			/* Note that we don't support "${UPSTART_CGROUP}" */
-			p = strstr (cgname->name, UPSTART_CGROUP_SHELL_ENVVAR);
+	envvar = nih_sprintf (NULL, "%s=%s",
+			      UPSTART_CGROUP_ENVVAR,
+			      upstart_cgroup);
+	if (! envvar)
+		goto error;
 
-			/* cgroup specifies UPSTART_CGROUP initially */
-			if (p && p == cgname->name)
-				has_var = TRUE;
+	if (! environ_add (&cgroup_env, parent, NULL, TRUE, envvar))
+		goto error;
 
-			cgname->expanded = environ_expand (cgname,
-						cgname->name,
-						cgroup_env);
+	return cgroup_env;
 
-			if (! cgname->expanded)
-				return FALSE;
+error:
+	nih_free (cgroup_env);
+	nih_return_no_memory_error (NULL);
+}
 
-			len = strlen (cgname->expanded);
+/**
+ * cgroup_name_expand:
+ * @parent: parent object for new string,
+ * @cgname: cgroup name to expand,
+ * @cgroup_env: environment table from cgroup_environment().
+ *
+ * Expands the variables in the name of @cgname from @cgroup_env, then
+ * remaps any slashes that the expansion of a variable introduced to avoid
+ * unexpected sub-cgroup creation.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned string.  When all parents
+ * of the returned string are freed, the returned string will also be
+ * freed.
+ *
+ * Returns: newly allocated cgroup path, or NULL on raised error.
+ **/
+static char *
+cgroup_name_expand (const void        *parent,
+		    const CGroupName  *cgname,
+		    char * const      *cgroup_env)
+{
+	char   *expanded;
+	char   *p;
 
-			/* Remap slash to underscore to avoid unexpected
-			 * sub-cgroup creation.
-			 */
-			cgroup_name_remap (has_var && len > strlen (UPSTART_CGROUP_SHELL_ENVVAR)
-					? cgname->expanded + strlen (UPSTART_CGROUP_SHELL_ENVVAR)
-					: cgname->expanded);
+	/* TRUE if the path *starts with* '$UPSTART_CGROUP' */
+	int     has_var = FALSE;
+	size_t  len;
 
-			if (! strcmp (cgname->name, cgname->expanded)) {
-				/* expanded value is the same as the
-				 * original, so don't bother storing the
-				 * former.
-				 */
-				nih_free (cgname->expanded);
-				cgname->expanded = NULL;
-			}
+	nih_assert (cgname);
+	nih_assert (cgroup_env);
 
-			cgpath = cgname->expanded ? cgname->expanded : cgname->name;
+	/* Note that we don't support "${UPSTART_CGROUP}" */
+	p = strstr (cgname->name, UPSTART_CGROUP_SHELL_ENVVAR);
 
-			if (! cgroup_create (cgroup->controller, cgpath))
-				return FALSE;
+	/* cgroup specifies UPSTART_CGROUP initially */
+	if (p && p == cgname->name)
+		has_var = TRUE;
 
-			if (! cgroup_settings_apply (cgroup->controller,
-						cgpath,
-						&cgname->settings))
-				return FALSE;
+	expanded = environ_expand (parent, cgname->name, cgroup_env);
+	if (! expanded)
+		return NULL;
 
-			if ((uid == current_uid) && (gid == current_gid)) {
-				/* No need to chown */
-				continue;
-			}
+	len = strlen (expanded);
 
-			if (! cgroup_chown (cgroup->controller, cgpath, uid, gid))
-				return FALSE;
-		}
-	}
+	/* Remap slash to underscore to avoid unexpected
+	 * sub-cgroup creation.
+	 */
+	cgroup_name_remap (has_var && len > strlen (UPSTART_CGROUP_SHELL_ENVVAR)
+			? expanded + strlen (UPSTART_CGROUP_SHELL_ENVVAR)
+			: expanded);
 
-	return TRUE;
+	return expanded;
 }
 
 /**
@@ -943,99 +1106,862 @@ cgroup_manager_available (void)
 }
 
 /**
- * cgroup_manager_serialise:
- *
- * Convert cgroup manager address into a JSON representation for
- * serialisation. Caller must free returned value using
- * json_object_put().
+ * cgroup_unified_available:
  *
- * Returns: JSON string representing cmgroup_manager_address or NULL if
- * cmgroup_manager_address not set or on error.
+ * Determine if cgroups can be created directly in the unified (version 2)
+ * hierarchy, which is the case for the system instance when
+ * UPSTART_CGROUP_UNIFIED_ROOT is a cgroup2 filesystem.  The answer is
+ * cached, since the hierarchy cannot change while it is mounted.
  *
- * Note: If NULL is returned, check the value of cmgroup_manager_address
- * itself to determine if the error is real.
+ * Returns: TRUE if available, else FALSE.
  **/
-json_object *
-cgroup_manager_serialise (void)
+int
+cgroup_unified_available (void)
 {
-	/* A NULL return represents a JSON null */
-	return cgroup_manager_address 
-		? json_object_new_string (cgroup_manager_address)
-		: NULL;
+	struct statfs  buf;
+
+	if (cgroup_unified >= 0)
+		return cgroup_unified;
+
+	cgroup_unified = (! user_mode
+			  && statfs (cgroup_unified_root, &buf) == 0
+			  && buf.f_type == CGROUP2_SUPER_MAGIC);
+
+	if (cgroup_unified)
+		nih_debug ("Creating cgroups in unified hierarchy at %s",
+			   cgroup_unified_root);
+
+	return cgroup_unified;
 }
 
 /**
- * cgroup_manager_deserialise:
- * @json: JSON-serialised CGroup object to deserialise.
+ * cgroup_available:
  *
- * Convert @json into a CGroup object.
+ * Determine if job cgroups can be created, either directly in the
+ * unified hierarchy or by the cgroup manager.
  *
- * Returns: 0 on success, -1 on error.
+ * Returns: TRUE if available, else FALSE.
  **/
 int
-cgroup_manager_deserialise (json_object *json)
+cgroup_available (void)
 {
-	const char  *address;
+	return cgroup_unified_available () || cgroup_manager_available ();
+}
 
-	nih_assert (json);
+/**
+ * cgroup_unified_create:
+ *
+ * @parent: parent object for new string,
+ * @controller: cgroup controller,
+ * @path: cgroup path relative to UPSTART_CGROUP_UNIFIED_ROOT.
+ *
+ * Create each directory of @path in the unified hierarchy that doesn't
+ * already exist, first enabling @controller for the children of the
+ * directory it's created in so that the files of @controller appear in
+ * the new cgroup.  Enabling the controller is best effort: it fails for
+ * controllers that the parent doesn't have, in which case the settings
+ * for it will fail to be applied instead.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned string.  When all parents
+ * of the returned string are freed, the returned string will also be
+ * freed.
+ *
+ * Returns: newly allocated absolute path of cgroup, or NULL on raised
+ * error.
+ **/
+static char *
+cgroup_unified_create (const void  *parent,
+		       const char  *controller,
+		       const char  *path)
+{
+	nih_local char *enable = NULL;
+	char           *cgpath;
+	char           *p;
 
-	/* address was never set */
-	if (state_check_json_type (json, null))
-		return 0;
+	nih_assert (controller);
+	nih_assert (path);
 
-	if (! state_check_json_type (json, string))
-		goto error;
+	enable = nih_sprintf (NULL, "+%s", controller);
+	if (! enable)
+		nih_return_no_memory_error (NULL);
 
-	address = json_object_get_string (json);
-	if (! address)
-		goto error;
+	cgpath = nih_sprintf (parent, "%s/%s",
+			      cgroup_unified_root, path);
+	if (! cgpath)
+		nih_return_no_memory_error (NULL);
 
-	cgroup_manager_address = nih_strdup (NULL, address);
-	if (! cgroup_manager_address)
-		goto error;
+	/* Each component of the path follows the slash at p */
+	p = cgpath + strlen (cgroup_unified_root);
 
-	return 0;
+	while (p) {
+		char *next;
+		int   dirfd;
 
-error:
-	return -1;
+		*p = '\0';
+		dirfd = open (cgpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		*p = '/';
+
+		next = strchr (p + 1, '/');
+		if (next)
+			*next = '\0';
+
+		if (dirfd >= 0) {
+			if (! cgroup_unified_write (dirfd, "cgroup.subtree_control",
+						    enable)) {
+				NihError *err;
+
+				err = nih_error_get ();
+				nih_debug ("Failed to enable %s controller for %s: %s",
+					   controller, cgpath, err->message);
+				nih_free (err);
+			}
+
+			close (dirfd);
+		}
+
+		if (mkdir (cgpath, 0755) < 0 && errno != EEXIST) {
+			nih_error_raise_system ();
+			nih_free (cgpath);
+			return NULL;
+		}
+
+		if (next)
+			*next = '/';
+
+		p = next;
+	}
+
+	return cgpath;
 }
 
 /**
- * cgroup_manager_set_address:
+ * cgroup_unified_write:
  *
- * @address: cgroup manager address.
+ * @dirfd: open cgroup directory,
+ * @file: name of file in @dirfd,
+ * @value: value to write.
  *
- * Save the address to contact the cgroup manager on.
+ * Write @value to the cgroup interface file @file.
  *
- * Returns: TRUE on success, else FALSE.
+ * Returns: TRUE on success, FALSE on raised error.
  **/
-int
-cgroup_manager_set_address (const char *address)
+static int
+cgroup_unified_write (int          dirfd,
+		      const char  *file,
+		      const char  *value)
 {
-	nih_assert (address);
+	size_t  len;
+	ssize_t ret;
+	int     fd;
+
+	nih_assert (dirfd >= 0);
+	nih_assert (file);
+	nih_assert (value);
+
+	fd = openat (dirfd, file, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		nih_return_system_error (FALSE);
+
+	len = strlen (value);
+	ret = write (fd, value, len);
+	if (ret < 0 || (size_t)ret != len) {
+		if (ret >= 0)
+			errno = EIO;
+
+		nih_error_raise_system ();
+		close (fd);
+		return FALSE;
+	}
 
-	cgroup_manager_address = nih_strdup (NULL, address);
+	if (close (fd) < 0)
+		nih_return_system_error (FALSE);
 
-	return cgroup_manager_address ? TRUE : FALSE;
+	return TRUE;
 }
 
 /**
- * cgroup_manager_connect:
+ * cgroup_unified_setup:
  *
- * Connect to the cgroup manager.
+ * @cgroups: list of CGroup objects,
+ * @env: environment table,
+ * @uid: user id that should own the created cgroup,
+ * @gid: group id that should own the created cgroup.
  *
- * Returns: zero on success, negative value on raised error.
+ * The unified hierarchy equivalent of cgroup_setup(): use @env to expand
+ * all variables in the cgroup names specified in @cgroups, create the
+ * resulting cgroup directories and write the requested cgroup settings
+ * to their files.
+ *
+ * A process can only belong to a single cgroup of the unified hierarchy,
+ * so it is the cgroup named last that the process is placed into, either
+ * by passing the returned descriptor to clone3() with CLONE_INTO_CGROUP
+ * or by cgroup_unified_enter().
+ *
+ * Returns: open descriptor of cgroup directory on success, -1 on raised
+ * error.
  **/
 int
-cgroup_manager_connect (void)
+cgroup_unified_setup (NihList       *cgroups,
+		      char * const  *env,
+		      uid_t          uid,
+		      gid_t          gid)
 {
-	DBusConnection  *connection;
-	DBusError        dbus_error;
+	nih_local char  **cgroup_env = NULL;
+	int               fd = -1;
 
-	nih_assert (cgroup_manager_address);
-	nih_assert (! cgroup_manager);
+	nih_assert (cgroups);
+	nih_assert (env);
+	nih_assert (cgroup_unified_available ());
 
-	dbus_error_init (&dbus_error);
+	if (NIH_LIST_EMPTY (cgroups))
+		nih_return_error (-1, CGROUP_ERROR,
+				  _("No cgroups specified"));
+
+	cgroup_env = cgroup_environment (NULL, env);
+	if (! cgroup_env)
+		return -1;
+
+	NIH_LIST_FOREACH (cgroups, iter) {
+		CGroup *cgroup = (CGroup *)iter;
+
+		NIH_LIST_FOREACH (&cgroup->names, iter2) {
+			CGroupName      *cgname = (CGroupName *)iter2;
+			nih_local char  *expanded = NULL;
+			nih_local char  *cgpath = NULL;
+
+			expanded = cgroup_name_expand (NULL, cgname, cgroup_env);
+			if (! expanded)
+				goto error;
+
+			cgpath = cgroup_unified_create (NULL, cgroup->controller,
+							expanded);
+			if (! cgpath)
+				goto error;
+
+			if (fd >= 0)
+				close (fd);
+
+			fd = open (cgpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (fd < 0) {
+				nih_error_raise_system ();
+				goto error;
+			}
+
+			NIH_LIST_FOREACH (&cgname->settings, iter3) {
+				CGroupSetting   *setting = (CGroupSetting *)iter3;
+				nih_local char  *setting_key = NULL;
+
+				/* setting files in a cgroup directory take
+				 * the form "controller.key"
+				 */
+				setting_key = nih_sprintf (NULL, "%s.%s",
+						cgroup->controller, setting->key);
+				if (! setting_key) {
+					nih_error_raise_no_memory ();
+					goto error;
+				}
+
+				if (! cgroup_unified_write (fd, setting_key,
+							    setting->value
+							    ? setting->value : ""))
+					goto error;
+			}
+
+			if ((uid == geteuid ()) && (gid == getegid ())) {
+				/* No need to chown */
+				continue;
+			}
+
+			/* Delegate the cgroup to the user in the way the
+			 * kernel's delegation model expects: the directory
+			 * and the files that govern its processes and
+			 * children.
+			 */
+			if (fchown (fd, uid, gid) < 0) {
+				nih_error_raise_system ();
+				goto error;
+			}
+
+			for (const char * const *file = (const char * const []){
+					"cgroup.procs",
+					"cgroup.subtree_control",
+					"cgroup.threads",
+					NULL }; *file; file++) {
+				if (fchownat (fd, *file, uid, gid, 0) < 0
+				    && errno != ENOENT) {
+					nih_error_raise_system ();
+					goto error;
+				}
+			}
+		}
+	}
+
+	return fd;
+
+error:
+	if (fd >= 0)
+		close (fd);
+	return -1;
+}
+
+/**
+ * cgroup_unified_enter:
+ *
+ * @fd: cgroup descriptor from cgroup_unified_setup().
+ *
+ * Move the calling process into the cgroup open as @fd, for when it
+ * couldn't be created in that cgroup with clone3().
+ *
+ * Returns: TRUE on success, FALSE on raised error.
+ **/
+int
+cgroup_unified_enter (int fd)
+{
+	nih_assert (fd >= 0);
+
+	/* Writing 0 moves the writing process */
+	return cgroup_unified_write (fd, "cgroup.procs", "0");
+}
+
+/**
+ * cgroup_unified_kill:
+ *
+ * @cgroups: list of CGroup objects,
+ * @env: environment table used for cgroup_unified_setup(),
+ * @signal: signal to send.
+ *
+ * Send @signal to every process in the cgroups created in the unified
+ * hierarchy by cgroup_unified_setup(), however they came to be there,
+ * rather than just a single process group.  Only cgroups private to the
+ * job, those named below $UPSTART_CGROUP, are signalled since others may
+ * hold the processes of other jobs.
+ *
+ * SIGKILL is sent by the kernel in a single operation through the
+ * cgroup.kill file.  Other signals, or SIGKILL where the kernel predates
+ * cgroup.kill, are sent to each process listed in cgroup.procs with the
+ * cgroup frozen, so that no process can escape them by forking; they
+ * are delivered as the cgroup is thawed again.
+ *
+ * Returns: TRUE on success, FALSE on raised error, including when there
+ * are no private cgroups to signal.
+ **/
+int
+cgroup_unified_kill (NihList       *cgroups,
+		     char * const  *env,
+		     int            signal)
+{
+	nih_local char  **cgroup_env = NULL;
+	int               signalled = FALSE;
+
+	nih_assert (cgroups);
+	nih_assert (env);
+	nih_assert (cgroup_unified_available ());
+
+	cgroup_env = cgroup_environment (NULL, env);
+	if (! cgroup_env)
+		return FALSE;
+
+	NIH_LIST_FOREACH (cgroups, iter) {
+		CGroup *cgroup = (CGroup *)iter;
+
+		NIH_LIST_FOREACH (&cgroup->names, iter2) {
+			CGroupName      *cgname = (CGroupName *)iter2;
+			nih_local char  *cgpath = NULL;
+			int              fd;
+			int              ret;
+
+			if (! cgroup_name_private (cgname))
+				continue;
+
+			cgpath = cgroup_unified_path (NULL, cgname, cgroup_env);
+			if (! cgpath)
+				return FALSE;
+
+			fd = open (cgpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (fd < 0) {
+				/* Nothing left to signal */
+				if (errno == ENOENT)
+					continue;
+
+				nih_return_system_error (FALSE);
+			}
+
+			ret = cgroup_unified_signal (fd, cgpath, signal);
+			close (fd);
+
+			if (! ret)
+				return FALSE;
+
+			signalled = TRUE;
+		}
+	}
+
+	if (! signalled)
+		nih_return_error (FALSE, CGROUP_ERROR,
+				  _("No private cgroups to signal"));
+
+	return TRUE;
+}
+
+/**
+ * cgroup_unified_signal:
+ *
+ * @fd: open cgroup directory,
+ * @cgpath: absolute path of cgroup,
+ * @signal: signal to send.
+ *
+ * Send @signal to every process in the cgroup open as @fd, as described
+ * by cgroup_unified_kill().
+ *
+ * Returns: TRUE on success, FALSE on raised error.
+ **/
+static int
+cgroup_unified_signal (int          fd,
+		       const char  *cgpath,
+		       int          signal)
+{
+	FILE  *procs;
+	int    procs_fd;
+	pid_t  pid;
+
+	nih_assert (fd >= 0);
+	nih_assert (cgpath);
+
+	if (signal == SIGKILL) {
+		if (cgroup_unified_write (fd, "cgroup.kill", "1"))
+			return TRUE;
+
+		nih_free (nih_error_get ());
+	}
+
+	if (! cgroup_unified_write (fd, "cgroup.freeze", "1"))
+		return FALSE;
+
+	procs_fd = openat (fd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+	procs = procs_fd >= 0 ? fdopen (procs_fd, "r") : NULL;
+	if (! procs) {
+		nih_error_raise_system ();
+		if (procs_fd >= 0)
+			close (procs_fd);
+
+		if (! cgroup_unified_write (fd, "cgroup.freeze", "0"))
+			nih_free (nih_error_get ());
+
+		return FALSE;
+	}
+
+	while (fscanf (procs, "%d", &pid) == 1) {
+		if (kill (pid, signal) < 0 && errno != ESRCH)
+			nih_warn (_("Failed to send %s signal to process (%d) in %s: %s"),
+				  nih_signal_to_name (signal), pid, cgpath,
+				  strerror (errno));
+	}
+
+	fclose (procs);
+
+	return cgroup_unified_write (fd, "cgroup.freeze", "0");
+}
+
+/**
+ * cgroup_unified_clear:
+ *
+ * @cgroups: list of CGroup objects,
+ * @env: environment table used for cgroup_unified_setup(),
+ * @kill: TRUE to kill processes left behind.
+ *
+ * Remove the cgroups created in the unified hierarchy by
+ * cgroup_unified_setup(), along with any of their parents that are left
+ * empty; the kernel refuses to remove a cgroup that still has processes
+ * or children, which stops the removal at the first cgroup still in use.
+ *
+ * A cgroup private to the job that still has processes in it once the
+ * job has gone is removed once the cgroup.events file reports it to be
+ * no longer populated; if @kill is TRUE, those processes are killed with
+ * SIGKILL first.
+ *
+ * This is best-effort and cannot fail.
+ **/
+void
+cgroup_unified_clear (NihList       *cgroups,
+		      char * const  *env,
+		      int            kill)
+{
+	nih_local char  **cgroup_env = NULL;
+
+	nih_assert (cgroups);
+	nih_assert (env);
+
+	if (! cgroup_unified_available ())
+		return;
+
+	if (NIH_LIST_EMPTY (cgroups))
+		return;
+
+	cgroup_env = cgroup_environment (NULL, env);
+	if (! cgroup_env) {
+		nih_free (nih_error_get ());
+		return;
+	}
+
+	NIH_LIST_FOREACH (cgroups, iter) {
+		CGroup *cgroup = (CGroup *)iter;
+
+		NIH_LIST_FOREACH (&cgroup->names, iter2) {
+			CGroupName  *cgname = (CGroupName *)iter2;
+			char        *cgpath;
+
+			cgpath = cgroup_unified_path (NULL, cgname, cgroup_env);
+			if (! cgpath) {
+				nih_free (nih_error_get ());
+				continue;
+			}
+
+			if (cgroup_unified_remove (cgpath) || errno != EBUSY
+			    || (! cgroup_name_private (cgname))) {
+				nih_free (cgpath);
+				continue;
+			}
+
+			/* Ownership of cgpath passes to the watch */
+			cgroup_unified_reap (cgpath, kill);
+		}
+	}
+}
+
+/**
+ * cgroup_name_private:
+ *
+ * @cgname: cgroup name.
+ *
+ * Returns: TRUE if @cgname is below $UPSTART_CGROUP, and so names a cgroup
+ * of a single job instance, else FALSE.
+ **/
+static int
+cgroup_name_private (const CGroupName *cgname)
+{
+	nih_assert (cgname);
+
+	return ! strncmp (cgname->name, UPSTART_CGROUP_SHELL_ENVVAR,
+			  strlen (UPSTART_CGROUP_SHELL_ENVVAR));
+}
+
+/**
+ * cgroup_unified_path:
+ *
+ * @parent: parent object for new string,
+ * @cgname: cgroup name,
+ * @cgroup_env: environment table from cgroup_environment().
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned string.  When all parents
+ * of the returned string are freed, the returned string will also be
+ * freed.
+ *
+ * Returns: newly allocated absolute path of the cgroup in the unified
+ * hierarchy named by @cgname, or NULL on raised error.
+ **/
+static char *
+cgroup_unified_path (const void        *parent,
+		     const CGroupName  *cgname,
+		     char * const      *cgroup_env)
+{
+	nih_local char *expanded = NULL;
+	char           *cgpath;
+
+	nih_assert (cgname);
+	nih_assert (cgroup_env);
+
+	expanded = cgroup_name_expand (NULL, cgname, cgroup_env);
+	if (! expanded)
+		return NULL;
+
+	cgpath = nih_sprintf (parent, "%s/%s",
+			      cgroup_unified_root, expanded);
+	if (! cgpath)
+		nih_return_no_memory_error (NULL);
+
+	return cgpath;
+}
+
+/**
+ * cgroup_unified_remove:
+ *
+ * @cgpath: absolute path of cgroup.
+ *
+ * Remove the cgroup at @cgpath and then each of its parents up to
+ * UPSTART_CGROUP_UNIFIED_ROOT, stopping at the first that cannot be
+ * removed.
+ *
+ * Returns: TRUE if @cgpath was removed or didn't exist, otherwise FALSE
+ * with errno set.
+ **/
+static int
+cgroup_unified_remove (const char *cgpath)
+{
+	nih_local char *path = NULL;
+	char           *p;
+	size_t          root_len;
+
+	nih_assert (cgpath);
+
+	path = nih_strdup (NULL, cgpath);
+	if (! path) {
+		errno = ENOMEM;
+		return FALSE;
+	}
+
+	root_len = strlen (cgroup_unified_root);
+
+	if (rmdir (path) < 0)
+		return errno == ENOENT;
+
+	while ((p = strrchr (path, '/')) && (p > path + root_len)) {
+		*p = '\0';
+
+		if (rmdir (path) < 0)
+			break;
+	}
+
+	return TRUE;
+}
+
+/**
+ * cgroup_unified_reap:
+ *
+ * @cgpath: absolute path of cgroup,
+ * @kill: TRUE to kill the processes left in it.
+ *
+ * Kill the processes left in the cgroup at @cgpath if @kill is TRUE, and
+ * watch its cgroup.events file so that it's removed by
+ * cgroup_unified_reap_watcher() once the last of them has gone.  @cgpath is freed with the watch, or
+ * here should it fail.
+ **/
+static void
+cgroup_unified_reap (char *cgpath,
+		     int   kill)
+{
+	nih_local char *events_path = NULL;
+	int             dirfd;
+	int            *fd;
+
+	nih_assert (cgpath);
+
+	if (kill) {
+		dirfd = open (cgpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dirfd < 0)
+			goto error;
+
+		if (! cgroup_unified_write (dirfd, "cgroup.kill", "1")) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_debug ("Failed to kill processes left in %s: %s",
+				   cgpath, err->message);
+			nih_free (err);
+		}
+
+		close (dirfd);
+	}
+
+	fd = nih_new (cgpath, int);
+	if (! fd)
+		goto error;
+
+	events_path = nih_sprintf (NULL, "%s/cgroup.events", cgpath);
+	if (! events_path)
+		goto error;
+
+	*fd = open (events_path, O_RDONLY | O_CLOEXEC);
+	if (*fd < 0)
+		goto error;
+
+	nih_alloc_set_destructor (fd, cgroup_unified_reap_close);
+
+	/* The kernel notifies changes to cgroup.events as priority data */
+	if (! nih_io_add_watch (cgpath, *fd, NIH_IO_EXCEPT,
+				(NihIoWatcher)cgroup_unified_reap_watcher,
+				cgpath))
+		goto error;
+
+	/* The last process may have gone before the watch was added */
+	cgroup_unified_reap_watcher (cgpath, NULL, NIH_IO_EXCEPT);
+
+	return;
+
+error:
+	nih_debug ("Leaving cgroup %s in use", cgpath);
+	nih_free (cgpath);
+}
+
+/**
+ * cgroup_unified_reap_close:
+ *
+ * @fd: descriptor of cgroup.events file.
+ *
+ * Destructor closing the file watched by cgroup_unified_reap().
+ *
+ * Returns: zero.
+ **/
+static int
+cgroup_unified_reap_close (int *fd)
+{
+	nih_assert (fd);
+
+	if (*fd >= 0)
+		close (*fd);
+
+	return 0;
+}
+
+/**
+ * cgroup_unified_reap_watcher:
+ *
+ * @cgpath: absolute path of cgroup,
+ * @watch: watch on cgroup.events, or NULL,
+ * @events: events that occurred.
+ *
+ * Called when the cgroup.events file of the cgroup at @cgpath changes to
+ * remove the cgroup, and stop watching it, once it's no longer populated.
+ **/
+static void
+cgroup_unified_reap_watcher (char         *cgpath,
+			     NihIoWatch   *watch,
+			     NihIoEvents   events)
+{
+	nih_local char *events_path = NULL;
+	char            buf[256];
+	char           *p;
+	ssize_t         len;
+	int             fd;
+
+	nih_assert (cgpath);
+
+	events_path = nih_sprintf (NULL, "%s/cgroup.events", cgpath);
+	if (! events_path)
+		return;
+
+	fd = open (events_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		/* Removed by somebody else */
+		if (errno == ENOENT)
+			nih_free (cgpath);
+		return;
+	}
+
+	len = read (fd, buf, sizeof (buf) - 1);
+	close (fd);
+
+	if (len <= 0)
+		return;
+
+	buf[len] = '\0';
+
+	p = strstr (buf, "populated ");
+	if (! p || p[strlen ("populated ")] != '0')
+		return;
+
+	if (! cgroup_unified_remove (cgpath))
+		nih_debug ("Failed to remove cgroup %s: %s",
+			   cgpath, strerror (errno));
+
+	nih_free (cgpath);
+}
+
+/**
+ * cgroup_manager_serialise:
+ *
+ * Convert cgroup manager address into a JSON representation for
+ * serialisation. Caller must free returned value using
+ * json_object_put().
+ *
+ * Returns: JSON string representing cmgroup_manager_address or NULL if
+ * cmgroup_manager_address not set or on error.
+ *
+ * Note: If NULL is returned, check the value of cmgroup_manager_address
+ * itself to determine if the error is real.
+ **/
+json_object *
+cgroup_manager_serialise (void)
+{
+	/* A NULL return represents a JSON null */
+	return cgroup_manager_address 
+		? json_object_new_string (cgroup_manager_address)
+		: NULL;
+}
+
+/**
+ * cgroup_manager_deserialise:
+ * @json: JSON-serialised CGroup object to deserialise.
+ *
+ * Convert @json into a CGroup object.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+int
+cgroup_manager_deserialise (json_object *json)
+{
+	const char  *address;
+
+	nih_assert (json);
+
+	/* address was never set */
+	if (state_check_json_type (json, null))
+		return 0;
+
+	if (! state_check_json_type (json, string))
+		goto error;
+
+	address = json_object_get_string (json);
+	if (! address)
+		goto error;
+
+	cgroup_manager_address = nih_strdup (NULL, address);
+	if (! cgroup_manager_address)
+		goto error;
+
+	return 0;
+
+error:
+	return -1;
+}
+
+/**
+ * cgroup_manager_set_address:
+ *
+ * @address: cgroup manager address.
+ *
+ * Save the address to contact the cgroup manager on.
+ *
+ * Returns: TRUE on success, else FALSE.
+ **/
+int
+cgroup_manager_set_address (const char *address)
+{
+	nih_assert (address);
+
+	cgroup_manager_address = nih_strdup (NULL, address);
+
+	return cgroup_manager_address ? TRUE : FALSE;
+}
+
+/**
+ * cgroup_manager_connect:
+ *
+ * Connect to the cgroup manager.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+cgroup_manager_connect (void)
+{
+	DBusConnection  *connection;
+	DBusError        dbus_error;
+
+	nih_assert (cgroup_manager_address);
+	nih_assert (! cgroup_manager);
+
+	dbus_error_init (&dbus_error);
 
 	connection = nih_dbus_connect (cgroup_manager_address, cgroup_manager_disconnected);
 	if (! connection)
@@ -1073,6 +1999,9 @@ cgroup_manager_disconnected (DBusConnection *connection)
 	nih_assert (connection);
 	nih_assert (cgroup_manager_address);
 
+	/* Any calls still pending will be completed with an error by
+	 * D-Bus, so cgroup_wait() will fail rather than hang.
+	 */
 	cgroup_manager = NULL;
 	nih_free (cgroup_manager_address);
 	cgroup_manager_address = NULL;
@@ -1099,18 +2028,22 @@ cgroup_manager_disconnected (DBusConnection *connection)
  * Note: No validation is done on @path: that is handled by the CGroup
  * manager.
  *
+ * The request is only sent: cgroup_wait() must be called to obtain
+ * the result.
+ *
  * Returns: TRUE on success, FALSE on raised error.
  **/
 int
 cgroup_create (const char *controller, const char *path)
 {
-	int        ret = 0;
-	int        existed = -1;
 	pid_t      pid;
 
 	nih_assert (controller);
 	nih_assert (path);
-	nih_assert (cgroup_manager);
+
+	if (! cgroup_manager)
+		nih_return_error (FALSE, CGROUP_ERROR,
+				  _("cgroup manager not available"));
 
 	if (! user_mode) {
 		pid = getpid ();
@@ -1119,24 +2052,27 @@ cgroup_create (const char *controller, const char *path)
 		 * the root cgroup to avoid creating groups below the current
 		 * cgroup.
 		 */
-		ret = cgmanager_move_pid_abs_sync (NULL,
-						   cgroup_manager,
-						   controller,
-						   UPSTART_CGROUP_ROOT,
-						   pid);
-
-		if (ret < 0)
+		if (! cgroup_pending_add (cgmanager_move_pid_abs (
+						cgroup_manager,
+						controller,
+						UPSTART_CGROUP_ROOT,
+						pid,
+						cgroup_reply,
+						cgroup_error_handler,
+						NULL,
+						NIH_DBUS_TIMEOUT_DEFAULT)))
 			return FALSE;
 	}
 
 	/* Ask the cgroup manager to create the cgroup */
-	ret = cgmanager_create_sync (NULL,
-			cgroup_manager,
-			controller,
-			path,
-			&existed);
-
-	if (ret < 0)
+	if (! cgroup_pending_add (cgmanager_create (
+					cgroup_manager,
+					controller,
+					path,
+					cgroup_create_reply,
+					cgroup_error_handler,
+					NULL,
+					NIH_DBUS_TIMEOUT_DEFAULT)))
 		return FALSE;
 
 	return TRUE;
@@ -1151,27 +2087,32 @@ cgroup_create (const char *controller, const char *path)
  *
  * Put the specified pid into the specified controller cgroup.
  *
+ * The request is only sent: cgroup_wait() must be called to obtain
+ * the result.
+ *
  * Returns: TRUE on success, FALSE on raised error.
  **/
 int
 cgroup_enter (const char *controller, const char *path, pid_t pid)
 {
-	int     ret;
-
 	nih_assert (controller);
 	nih_assert (path);
 	nih_assert (pid > 0);
 
-	nih_assert (cgroup_manager);
+	if (! cgroup_manager)
+		nih_return_error (FALSE, CGROUP_ERROR,
+				  _("cgroup manager not available"));
 
 	/* Move the pid into the appropriate cgroup */
-	ret = cgmanager_move_pid_sync (NULL,
-			cgroup_manager,
-			controller,
-			path,
-			pid);
-
-	if (ret < 0)
+	if (! cgroup_pending_add (cgmanager_move_pid (
+					cgroup_manager,
+					controller,
+					path,
+					pid,
+					cgroup_reply,
+					cgroup_error_handler,
+					NULL,
+					NIH_DBUS_TIMEOUT_DEFAULT)))
 		return FALSE;
 
 	return TRUE;
@@ -1344,6 +2285,9 @@ cgroup_add (void        *parent,
  * effectively a relative path since the cgroup manager handles
  * expanding it further.
  *
+ * The requests are only sent: cgroup_wait() must be called to obtain
+ * the result.
+ *
  * Returns: TRUE on success, FALSE on raised error.
  **/
 int
@@ -1351,12 +2295,13 @@ cgroup_settings_apply (const char  *controller,
 		       const char  *path,
 		       NihList     *settings)
 {
-	int               ret;
-
 	nih_assert (controller);
 	nih_assert (path);
 	nih_assert (settings);
-	nih_assert (cgroup_manager);
+
+	if (! cgroup_manager)
+		nih_return_error (FALSE, CGROUP_ERROR,
+				  _("cgroup manager not available"));
 
 	NIH_LIST_FOREACH (settings, iter) {
 		nih_local char *setting_key = NULL;
@@ -1369,14 +2314,16 @@ cgroup_settings_apply (const char  *controller,
 		if (! setting_key)
 			nih_return_no_memory_error (FALSE);
 
-		ret = cgmanager_set_value_sync (NULL,
-				cgroup_manager,
-				controller,
-				path,
-				setting_key,
-				setting->value ? setting->value : "");
-
-		if (ret < 0)
+		if (! cgroup_pending_add (cgmanager_set_value (
+						cgroup_manager,
+						controller,
+						path,
+						setting_key,
+						setting->value ? setting->value : "",
+						cgroup_reply,
+						cgroup_error_handler,
+						NULL,
+						NIH_DBUS_TIMEOUT_DEFAULT)))
 			return FALSE;
 	}
 
@@ -1418,12 +2365,14 @@ cgroup_enter_groups (NihList  *cgroups)
 						cgname->expanded
 						? cgname->expanded
 						: cgname->name,
-						pid))
+						pid)) {
+				(void)cgroup_wait ();
 				return FALSE;
+			}
 		}
 	}
 
-	return TRUE;
+	return cgroup_wait ();
 }
 
 /**
@@ -1436,6 +2385,9 @@ cgroup_enter_groups (NihList  *cgroups)
  *
  * Change the user and group ownership of @path below @controller.
  *
+ * The request is only sent: cgroup_wait() must be called to obtain
+ * the result.
+ *
  * Returns: TRUE on success, FALSE on raised error.
  **/
 int
@@ -1444,22 +2396,145 @@ cgroup_chown (const char  *controller,
 	      uid_t        uid,
 	      gid_t        gid)
 {
-	int ret = 0;
-
 	nih_assert (controller);
 	nih_assert (path);
-	nih_assert (cgroup_manager);
+
+	if (! cgroup_manager)
+		nih_return_error (FALSE, CGROUP_ERROR,
+				  _("cgroup manager not available"));
 
 	/* Ask cgmanager to chown the path */
-	ret = cgmanager_chown_sync (NULL,
-			cgroup_manager,
-			controller,
-			path,
-			uid,
-			gid);
-
-	if (ret < 0)
+	if (! cgroup_pending_add (cgmanager_chown (
+					cgroup_manager,
+					controller,
+					path,
+					uid,
+					gid,
+					cgroup_reply,
+					cgroup_error_handler,
+					NULL,
+					NIH_DBUS_TIMEOUT_DEFAULT)))
+		return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * cgroup_pending_add:
+ *
+ * @call: pending call returned by an asynchronous cgroup manager call.
+ *
+ * Add @call to the calls to be waited for by cgroup_wait().
+ *
+ * Returns: TRUE on success, FALSE on raised error (including if @call
+ * is NULL since the call failed to be sent).
+ **/
+static int
+cgroup_pending_add (DBusPendingCall *call)
+{
+	DBusPendingCall **new_pending;
+
+	if (! call)
+		return FALSE;
+
+	new_pending = nih_realloc (cgroup_pending, NULL,
+				   sizeof (DBusPendingCall *) * (cgroup_pending_len + 1));
+	if (! new_pending) {
+		dbus_pending_call_cancel (call);
+		dbus_pending_call_unref (call);
+		nih_return_no_memory_error (FALSE);
+	}
+
+	cgroup_pending = new_pending;
+	cgroup_pending[cgroup_pending_len++] = call;
+
+	return TRUE;
+}
+
+/**
+ * cgroup_wait:
+ *
+ * Wait for the replies to all calls sent to the cgroup manager by
+ * cgroup_create(), cgroup_enter(), cgroup_settings_apply() and
+ * cgroup_chown() since the last call.
+ *
+ * Returns: TRUE if all calls succeeded, FALSE on raised error (being
+ * the error returned by the first call to fail).
+ **/
+int
+cgroup_wait (void)
+{
+	for (size_t i = 0; i < cgroup_pending_len; i++) {
+		/* Completing the call runs its reply or error handler */
+		dbus_pending_call_block (cgroup_pending[i]);
+		dbus_pending_call_unref (cgroup_pending[i]);
+	}
+
+	if (cgroup_pending) {
+		nih_free (cgroup_pending);
+		cgroup_pending = NULL;
+	}
+	cgroup_pending_len = 0;
+
+	if (cgroup_pending_error) {
+		NihError *err = cgroup_pending_error;
+
+		cgroup_pending_error = NULL;
+		nih_error_raise_error (err);
+
 		return FALSE;
+	}
 
 	return TRUE;
 }
+
+/**
+ * cgroup_reply:
+ *
+ * @data: not used,
+ * @message: D-Bus message received.
+ *
+ * Called on successful reply to a cgroup manager call that returns no
+ * value.
+ **/
+static void
+cgroup_reply (void *data, NihDBusMessage *message)
+{
+}
+
+/**
+ * cgroup_create_reply:
+ *
+ * @data: not used,
+ * @message: D-Bus message received,
+ * @existed: TRUE if cgroup already existed.
+ *
+ * Called on successful reply to a cgroup manager Create call.
+ **/
+static void
+cgroup_create_reply (void *data, NihDBusMessage *message, int32_t existed)
+{
+}
+
+/**
+ * cgroup_error_handler:
+ *
+ * @data: not used,
+ * @message: D-Bus message received.
+ *
+ * Called on error reply to a cgroup manager call (including if the
+ * connection to the cgroup manager is lost), to record the first error
+ * raised for cgroup_wait().
+ **/
+static void
+cgroup_error_handler (void *data, NihDBusMessage *message)
+{
+	NihError *err;
+
+	err = nih_error_get ();
+
+	if (cgroup_pending_error)
+		nih_free (err);
+	else
+		cgroup_pending_error = err;
+}
@@ -41,6 +41,14 @@
  **/
 #define UPSTART_CGROUP_ROOT "/"
 
+/**
+ * UPSTART_CGROUP_UNIFIED_ROOT:
+ *
+ * Mount point of the unified cgroup hierarchy, which cgroups are created
+ * below directly when it's mounted there.
+ **/
+#define UPSTART_CGROUP_UNIFIED_ROOT "/sys/fs/cgroup"
+
 /**
  * UPSTART_CGROUP_ENVVAR:
  *
@@ -172,6 +180,24 @@ int cgroup_manager_connect (void)
 int cgroup_manager_available (void)
 	__attribute__ ((warn_unused_result));
 
+int cgroup_unified_available (void)
+	__attribute__ ((warn_unused_result));
+
+int cgroup_available (void)
+	__attribute__ ((warn_unused_result));
+
+int cgroup_unified_setup (NihList *cgroups, char * const *env,
+		uid_t uid, gid_t gid)
+	__attribute__ ((warn_unused_result));
+
+int cgroup_unified_enter (int fd)
+	__attribute__ ((warn_unused_result));
+
+int cgroup_unified_kill (NihList *cgroups, char * const *env, int signal)
+	__attribute__ ((warn_unused_result));
+
+void cgroup_unified_clear (NihList *cgroups, char * const *env, int kill);
+
 int cgroup_clear (NihList *cgroups);
 
 int cgroup_setup (NihList *cgroups, char * const *env,
@@ -223,6 +249,9 @@ int cgroup_settings_apply (const char *controller,
 		const char *path, NihList *settings)
 	__attribute__ ((warn_unused_result));
 
+int cgroup_wait (void)
+	__attribute__ ((warn_unused_result));
+
 NIH_END_EXTERN
 
 #endif /* INIT_CGROUP_H */
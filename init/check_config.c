@@ -0,0 +1,535 @@
+/* upstart
+ *
+ * check_config.c - find job conditions that can never be met
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <string.h>
+#include <fnmatch.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/tree.h>
+#include <nih/main.h>
+#include <nih/logging.h>
+
+#include "events.h"
+#include "event_operator.h"
+#include "job_class.h"
+#include "conf.h"
+#include "check_config.h"
+
+extern int user_mode;
+
+/* Prototypes for static functions */
+static char *            check_config_event_key (const void *parent,
+						 const EventOperator *oper,
+						 const char **job)
+	__attribute__ ((warn_unused_result));
+static CheckConfigEvent *check_config_event     (CheckConfig *check,
+						 const EventOperator *oper,
+						 int create);
+static int               check_config_met       (CheckConfig *check,
+						 EventOperator *oper);
+static void              check_config_reached   (CheckConfig *check,
+						 const char *name);
+static void              check_config_started   (CheckConfig *check,
+						 CheckConfigJob *job);
+static int               check_config_condition (CheckConfig *check,
+						 CheckConfigJob *job,
+						 const char *header,
+						 EventOperator *oper);
+
+
+/**
+ * check_config_init_events:
+ *
+ * Events the init daemon emits itself, which need no job to emit them.
+ **/
+static const char * const check_config_init_events[] = {
+	STARTUP_EVENT,
+	"startup",
+	"debug",
+	CTRLALTDEL_EVENT,
+	KBDREQUEST_EVENT,
+	PWRSTATUS_EVENT,
+	NULL
+};
+
+/**
+ * check_config_job_events:
+ *
+ * Events emitted for each job as it changes state, which are
+ * reachable once the job is.
+ **/
+static const char * const check_config_job_events[] = {
+	JOB_STARTING_EVENT,
+	JOB_STARTED_EVENT,
+	JOB_STOPPING_EVENT,
+	JOB_STOPPED_EVENT,
+	NULL
+};
+
+
+/**
+ * check_config_new:
+ * @parent: parent object for new index.
+ *
+ * Index the events that the job classes in job_classes emit and wait
+ * for, and find which of the job classes can be started.  A job class
+ * can be if it has no start on condition, since it may still be started
+ * by hand, or if its start on condition can be met by events emitted by
+ * the init daemon or by job classes that can themselves be started.
+ *
+ * Rather than evaluating every condition again until nothing changes,
+ * each event records the job classes waiting for it, and only those are
+ * considered again when it's found to be reachable; so each job class
+ * is considered once, and again only for each of its events reached.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned index.  When all parents
+ * of the returned index are freed, the returned index will also be
+ * freed.
+ *
+ * Returns: newly allocated index.
+ **/
+CheckConfig *
+check_config_new (const void *parent)
+{
+	CheckConfig *check;
+
+	job_class_init ();
+
+	check = NIH_MUST (nih_new (parent, CheckConfig));
+
+	check->events = NIH_MUST (nih_hash_string_new (check, 0));
+	check->jobs = NIH_MUST (nih_hash_string_new (check, 0));
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass       *class = (JobClass *)iter;
+		CheckConfigJob *job;
+
+		job = NIH_MUST (nih_new (check, CheckConfigJob));
+		nih_list_init (&job->entry);
+
+		job->name = class->name;
+		job->class = class;
+		job->reachable = FALSE;
+
+		nih_hash_add (check->jobs, &job->entry);
+	}
+
+	/* Index the events of each condition, and which job classes wait
+	 * for them; events named only in stop on conditions are indexed
+	 * too so that they may be reported.
+	 */
+	NIH_HASH_FOREACH (check->jobs, iter) {
+		CheckConfigJob *job = (CheckConfigJob *)iter;
+
+		if (job->class->start_on) {
+			NIH_TREE_FOREACH_POST (&job->class->start_on->node, oper_iter) {
+				EventOperator    *oper = (EventOperator *)oper_iter;
+				CheckConfigEvent *event;
+				NihListEntry     *consumer;
+
+				event = check_config_event (check, oper, TRUE);
+				if (! event)
+					continue;
+
+				consumer = NIH_MUST (nih_list_entry_new (event));
+				consumer->data = job;
+				nih_list_add (event->consumers, &consumer->entry);
+			}
+		}
+
+		if (job->class->stop_on) {
+			NIH_TREE_FOREACH_POST (&job->class->stop_on->node, oper_iter) {
+				EventOperator *oper = (EventOperator *)oper_iter;
+
+				(void)check_config_event (check, oper, TRUE);
+			}
+		}
+	}
+
+	/* Mark the events that any job class emits, expanding globs
+	 * against the events waited for.
+	 */
+	NIH_HASH_FOREACH (check->jobs, iter) {
+		CheckConfigJob *job = (CheckConfigJob *)iter;
+
+		for (char **emit = job->class->emits; emit && *emit; emit++) {
+			CheckConfigEvent *event;
+
+			if (! strpbrk (*emit, "*?[")) {
+				event = (CheckConfigEvent *)nih_hash_lookup (
+					check->events, *emit);
+				if (event)
+					event->emitted = TRUE;
+				continue;
+			}
+
+			NIH_HASH_FOREACH (check->events, event_iter) {
+				event = (CheckConfigEvent *)event_iter;
+
+				if (! fnmatch (*emit, event->name, 0))
+					event->emitted = TRUE;
+			}
+		}
+	}
+
+	NIH_HASH_FOREACH (check->jobs, iter) {
+		CheckConfigJob *job = (CheckConfigJob *)iter;
+
+		if ((! job->reachable)
+		    && ((! job->class->start_on)
+			|| check_config_met (check, job->class->start_on)))
+			check_config_started (check, job);
+	}
+
+	return check;
+}
+
+
+/**
+ * check_config_event_key:
+ * @parent: parent object for new string,
+ * @oper: event operator,
+ * @job: set to the job named by a job event.
+ *
+ * Give the name @oper is indexed by: the name of its event, followed by
+ * the job for job events naming one.  Events that are always reachable
+ * give NULL: those emitted by the init daemon, job events for any job,
+ * and those naming a job by variable or glob.
+ *
+ * Returns: newly allocated name, or NULL if @oper is always reachable.
+ **/
+static char *
+check_config_event_key (const void          *parent,
+			const EventOperator *oper,
+			const char         **job)
+{
+	nih_assert (oper != NULL);
+	nih_assert (oper->type == EVENT_MATCH);
+	nih_assert (job != NULL);
+
+	*job = NULL;
+
+	for (const char * const *name = check_config_init_events;
+	     *name; name++)
+		if (! strcmp (oper->name, *name))
+			return NULL;
+
+	if (user_mode && (! strcmp (oper->name, SESSION_END_EVENT)))
+		return NULL;
+
+	for (const char * const *name = check_config_job_events;
+	     *name; name++) {
+		if (strcmp (oper->name, *name))
+			continue;
+
+		/* The job is the first positional argument, or JOB */
+		for (char **env = oper->env; env && *env; env++) {
+			if (! strncmp (*env, "JOB=", 4)) {
+				*job = *env + 4;
+				break;
+			} else if ((env == oper->env) && (! strchr (*env, '='))) {
+				*job = *env;
+				break;
+			}
+		}
+
+		if ((! *job) || strpbrk (*job, "$*?[\\"))
+			return NULL;
+
+		return NIH_MUST (nih_sprintf (parent, "%s %s",
+					      oper->name, *job));
+	}
+
+	return NIH_MUST (nih_strdup (parent, oper->name));
+}
+
+/**
+ * check_config_event:
+ * @check: index,
+ * @oper: event operator,
+ * @create: TRUE to add the event if not yet indexed.
+ *
+ * Find the event @oper waits for in @check, adding it if @create is
+ * TRUE.  Job events are emitted once added if their job exists.
+ *
+ * Returns: event, or NULL if @oper is not an event that needs to be
+ * indexed or is not indexed.
+ **/
+static CheckConfigEvent *
+check_config_event (CheckConfig         *check,
+		    const EventOperator *oper,
+		    int                  create)
+{
+	nih_local char   *name = NULL;
+	const char       *job;
+	CheckConfigEvent *event;
+
+	nih_assert (check != NULL);
+	nih_assert (oper != NULL);
+
+	if (oper->type != EVENT_MATCH)
+		return NULL;
+
+	name = check_config_event_key (NULL, oper, &job);
+	if (! name)
+		return NULL;
+
+	event = (CheckConfigEvent *)nih_hash_lookup (check->events, name);
+	if (event || (! create))
+		return event;
+
+	event = NIH_MUST (nih_new (check, CheckConfigEvent));
+	nih_list_init (&event->entry);
+
+	event->name = NIH_MUST (nih_strdup (event, name));
+	event->emitted = (job && nih_hash_lookup (check->jobs, job));
+	event->reachable = FALSE;
+	event->consumers = NIH_MUST (nih_list_new (event));
+
+	nih_hash_add (check->events, &event->entry);
+
+	return event;
+}
+
+/**
+ * check_config_met:
+ * @check: index,
+ * @oper: condition.
+ *
+ * Returns: TRUE if @oper can be met with the events currently known to
+ * be reachable, FALSE otherwise.
+ **/
+static int
+check_config_met (CheckConfig   *check,
+		  EventOperator *oper)
+{
+	CheckConfigEvent *event;
+
+	nih_assert (check != NULL);
+	nih_assert (oper != NULL);
+
+	switch (oper->type) {
+	case EVENT_OR:
+		return (check_config_met (check, (EventOperator *)oper->node.left)
+			|| check_config_met (check, (EventOperator *)oper->node.right));
+	case EVENT_AND:
+		return (check_config_met (check, (EventOperator *)oper->node.left)
+			&& check_config_met (check, (EventOperator *)oper->node.right));
+	case EVENT_MATCH:
+		event = check_config_event (check, oper, FALSE);
+
+		return (event ? event->reachable : TRUE);
+	default:
+		nih_assert_not_reached ();
+	}
+}
+
+/**
+ * check_config_reached:
+ * @check: index,
+ * @name: name of event.
+ *
+ * Mark the event @name as reachable, and start any job classes waiting
+ * for it whose start on condition can now be met.
+ **/
+static void
+check_config_reached (CheckConfig *check,
+		      const char  *name)
+{
+	CheckConfigEvent *event;
+
+	nih_assert (check != NULL);
+	nih_assert (name != NULL);
+
+	event = (CheckConfigEvent *)nih_hash_lookup (check->events, name);
+	if ((! event) || event->reachable)
+		return;
+
+	event->reachable = TRUE;
+
+	NIH_LIST_FOREACH (event->consumers, iter) {
+		NihListEntry   *consumer = (NihListEntry *)iter;
+		CheckConfigJob *job = (CheckConfigJob *)consumer->data;
+
+		if ((! job->reachable)
+		    && check_config_met (check, job->class->start_on))
+			check_config_started (check, job);
+	}
+}
+
+/**
+ * check_config_started:
+ * @check: index,
+ * @job: job class that can be started.
+ *
+ * Mark @job as reachable, along with its job events and the events it
+ * emits.
+ **/
+static void
+check_config_started (CheckConfig    *check,
+		      CheckConfigJob *job)
+{
+	nih_assert (check != NULL);
+	nih_assert (job != NULL);
+
+	job->reachable = TRUE;
+
+	for (const char * const *name = check_config_job_events;
+	     *name; name++) {
+		nih_local char *key = NULL;
+
+		key = NIH_MUST (nih_sprintf (NULL, "%s %s", *name, job->name));
+		check_config_reached (check, key);
+	}
+
+	for (char **emit = job->class->emits; emit && *emit; emit++) {
+		if (! strpbrk (*emit, "*?[")) {
+			check_config_reached (check, *emit);
+			continue;
+		}
+
+		NIH_HASH_FOREACH (check->events, iter) {
+			CheckConfigEvent *event = (CheckConfigEvent *)iter;
+
+			if (! fnmatch (*emit, event->name, 0))
+				check_config_reached (check, event->name);
+		}
+	}
+}
+
+
+/**
+ * check_config_report:
+ * @check: index,
+ * @name: name of job class to report, or NULL for all.
+ *
+ * Output the events of each job class condition in @check that can
+ * never be met: those no job class emits, job events of jobs that don't
+ * exist, and those emitted only by job classes that can never be
+ * started themselves.
+ *
+ * Returns: number of job classes with conditions that can't be met, or
+ * negative value if @name isn't a job class.
+ **/
+int
+check_config_report (CheckConfig *check,
+		     const char  *name)
+{
+	int ret = 0;
+
+	nih_assert (check != NULL);
+
+	if (name && (! nih_hash_lookup (check->jobs, name))) {
+		nih_error ("%s: %s", _("Invalid job class"), name);
+		return -1;
+	}
+
+	NIH_HASH_FOREACH (check->jobs, iter) {
+		CheckConfigJob *job = (CheckConfigJob *)iter;
+		int             errors = 0;
+
+		if (name && strcmp (name, job->name))
+			continue;
+
+		if (job->class->start_on && (! job->reachable))
+			errors += check_config_condition (check, job,
+							  errors ? NULL : job->name,
+							  job->class->start_on);
+
+		if (job->class->stop_on
+		    && (! check_config_met (check, job->class->stop_on)))
+			errors += check_config_condition (check, job,
+							  errors ? NULL : job->name,
+							  job->class->stop_on);
+
+		if (errors)
+			ret++;
+	}
+
+	return ret;
+}
+
+/**
+ * check_config_condition:
+ * @check: index,
+ * @job: job class,
+ * @header: name to output first, or NULL,
+ * @oper: condition that can't be met.
+ *
+ * Output each event of @oper that isn't reachable, and why, in the same
+ * form as initctl check-config.
+ *
+ * Returns: number of events output.
+ **/
+static int
+check_config_condition (CheckConfig    *check,
+			CheckConfigJob *job,
+			const char     *header,
+			EventOperator  *oper)
+{
+	const char *condition;
+	int         errors = 0;
+
+	nih_assert (check != NULL);
+	nih_assert (job != NULL);
+	nih_assert (oper != NULL);
+
+	condition = (oper == job->class->start_on) ? "start on" : "stop on";
+
+	NIH_TREE_FOREACH_POST (&oper->node, iter) {
+		EventOperator    *leaf = (EventOperator *)iter;
+		CheckConfigEvent *event;
+		const char       *job_name;
+
+		event = check_config_event (check, leaf, FALSE);
+		if ((! event) || event->reachable)
+			continue;
+
+		if (header && (! errors))
+			nih_message ("%s", header);
+
+		errors++;
+
+		if (event->emitted) {
+			nih_message ("  %s: %s %s", condition,
+				     _("unreachable event"), event->name);
+			continue;
+		}
+
+		nih_free (check_config_event_key (NULL, leaf, &job_name));
+		if (job_name) {
+			nih_message ("  %s: %s %s", condition,
+				     _("unknown job"), job_name);
+		} else {
+			nih_message ("  %s: %s %s", condition,
+				     _("unknown event"), event->name);
+		}
+	}
+
+	return errors;
+}
@@ -0,0 +1,87 @@
+/* upstart
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INIT_CHECK_CONFIG_H
+#define INIT_CHECK_CONFIG_H
+
+#include <nih/macros.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+
+#include "job_class.h"
+
+
+/**
+ * CheckConfigEvent:
+ * @entry: list header,
+ * @name: name of event, or of a job event followed by the job name,
+ * @emitted: TRUE if any job class emits the event,
+ * @reachable: TRUE if a job class that can be started emits the event,
+ * @consumers: job classes that wait for the event to start.
+ *
+ * Event named in the start on condition of a job class, with the job
+ * classes that wait for it so that they can be reconsidered once it's
+ * found to be reachable.  Job events name the job too, so that each job
+ * has its own.
+ **/
+typedef struct check_config_event {
+	NihList   entry;
+	char     *name;
+	int       emitted;
+	int       reachable;
+	NihList  *consumers;
+} CheckConfigEvent;
+
+/**
+ * CheckConfigJob:
+ * @entry: list header,
+ * @name: name of @class,
+ * @class: job class,
+ * @reachable: TRUE if @class can be started.
+ *
+ * Job class being checked.
+ **/
+typedef struct check_config_job {
+	NihList     entry;
+	const char *name;
+	JobClass   *class;
+	int         reachable;
+} CheckConfigJob;
+
+/**
+ * CheckConfig:
+ * @events: events named in the conditions of job classes,
+ * @jobs: job classes.
+ *
+ * Index built by check_config_new() of which job classes emit and wait
+ * for which events, used to find those that can never be started.
+ **/
+typedef struct check_config {
+	NihHash  *events;
+	NihHash  *jobs;
+} CheckConfig;
+
+
+NIH_BEGIN_EXTERN
+
+CheckConfig *check_config_new    (const void *parent)
+	__attribute__ ((warn_unused_result, malloc));
+
+int          check_config_report (CheckConfig *check, const char *name);
+
+NIH_END_EXTERN
+
+#endif /* INIT_CHECK_CONFIG_H */
@@ -26,9 +26,16 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -50,6 +57,59 @@
 #include "errors.h"
 #include "paths.h"
 #include "environ.h"
+#include "metrics.h"
+#include "probes.h"
+#include "hash_table.h"
+
+/**
+ * ConfPrefetch:
+ * @entry: hash list header,
+ * @path: path to file,
+ * @buf: buffer for contents of file,
+ * @len: size of file when it was found,
+ * @ok: TRUE once @buf holds the complete contents of @path.
+ *
+ * A configuration file read ahead of being parsed by conf_prefetch().
+ **/
+typedef struct conf_prefetch {
+	NihList  entry;
+	char    *path;
+	char    *buf;
+	size_t   len;
+	int      ok;
+} ConfPrefetch;
+
+/**
+ * ConfPrefetchQueue:
+ * @entries: files to be read,
+ * @count: number of @entries,
+ * @next: index of next entry to be read.
+ *
+ * Work shared between the conf_prefetch_worker() threads.
+ **/
+typedef struct conf_prefetch_queue {
+	ConfPrefetch **entries;
+	size_t         count;
+	size_t         next;
+} ConfPrefetchQueue;
+
+/**
+ * ConfStaged:
+ * @entry: list header,
+ * @source: configuration source,
+ * @path: path to job configuration file,
+ * @words: hash table of words in the file and its override file.
+ *
+ * A job configuration file passed over by a staged conf_reload(), to be
+ * loaded later by conf_staged_load().
+ **/
+typedef struct conf_staged {
+	NihList     entry;
+	ConfSource *source;
+	char       *path;
+	NihHash    *words;
+} ConfStaged;
+
 
 /* Prototypes for static functions */
 static int  conf_source_reload_file    (ConfSource *source)
@@ -57,10 +117,20 @@ static int  conf_source_reload_file    (ConfSource *source)
 static int  conf_source_reload_dir     (ConfSource *source)
 	__attribute__ ((warn_unused_result));
 
+static NihWatch *conf_source_watch_new (ConfSource *source, int create)
+	__attribute__ ((warn_unused_result));
 static int  conf_file_filter           (ConfSource *source, const char *path,
 					int is_dir);
 static int  conf_dir_filter            (ConfSource *source, const char *path,
 					int is_dir);
+static void conf_file_changed          (ConfSource *source, NihWatch *watch,
+					const char *path, struct stat *statbuf);
+static void conf_file_deleted          (ConfSource *source, NihWatch *watch,
+					const char *path);
+static int  conf_reload_defer          (ConfSource *source, const char *path)
+	__attribute__ ((warn_unused_result));
+static void conf_reload_pending        (void *data, NihIoWatch *watch,
+					NihIoEvents events);
 static void conf_create_modify_handler (ConfSource *source, NihWatch *watch,
 					const char *path,
 					struct stat *statbuf);
@@ -71,6 +141,11 @@ static int  conf_file_visitor          (ConfSource *source,
 					struct stat *statbuf)
 	__attribute__ ((warn_unused_result));
 
+static int  conf_staged_defer          (ConfSource *source, const char *path);
+static int  conf_staged_add_words      (NihHash *words, const char *path)
+	__attribute__ ((warn_unused_result));
+static int  conf_staged_destroy        (ConfStaged *staged);
+static void conf_staged_clear          (void);
 static int  conf_reload_path           (ConfSource *source, const char *path,
 					const char *override_path)
 	__attribute__ ((warn_unused_result));
@@ -95,6 +170,42 @@ static char * conf_get_best_override   (const char *name,
                                         const ConfSource *last_source)
 	__attribute__ ((warn_unused_result));
 
+static void  conf_prefetch             (void);
+static int   conf_prefetch_visitor     (ConfSource *source,
+					const char *dirname,
+					const char *path,
+					struct stat *statbuf);
+static int   conf_prefetch_add         (const char *path, off_t size)
+	__attribute__ ((warn_unused_result));
+static void *conf_prefetch_worker      (void *data);
+
+static void  conf_job_loaded           (ConfSource *source,
+					const char *path);
+static void  conf_cache_load           (void);
+static json_object *conf_cache_read    (void)
+	__attribute__ ((warn_unused_result));
+static void  conf_cache_save           (void);
+static char *conf_cache_key            (const void *parent,
+					const char *conf_path,
+					const char *override_path)
+	__attribute__ ((warn_unused_result));
+static int   conf_cache_reload_path    (ConfSource *source,
+					const char *path,
+					const char *name,
+					const char *key)
+	__attribute__ ((warn_unused_result));
+static void  conf_cache_store          (ConfSource *source,
+					const char *path,
+					const char *key);
+static ConfFile *conf_job_file         (const JobClass *class)
+	__attribute__ ((warn_unused_result));
+static int   conf_file_reuse           (ConfSource *source,
+					const char *path,
+					const char *key);
+static void  conf_file_set_key         (ConfSource *source,
+					const char *path,
+					const char *key);
+
 /**
  * user_mode:
  *
@@ -121,7 +232,147 @@ const char *session_file = NULL;
  **/
 NihList *conf_sources = NULL;
 
+/**
+ * conf_jobs:
+ *
+ * Hash table of ConfJobIndex structures by job name, giving the files
+ * that have defined each job across all sources.
+ **/
+static NihHash *conf_jobs = NULL;
+
+/**
+ * conf_cache_file:
+ *
+ * Full path to the file that compiled job configuration is cached in
+ * between runs, or NULL if the cache is disabled.
+ *
+ * Only job configuration from CONF_JOB_DIR sources without a session is
+ * cached.
+ **/
+const char *conf_cache_file = NULL;
+
+/**
+ * conf_cache:
+ *
+ * Cache entries read from conf_cache_file, keyed by configuration file
+ * path; only set while conf_reload() is in progress.
+ **/
+static json_object *conf_cache = NULL;
+
+/**
+ * conf_cache_next:
+ *
+ * Cache entries for the configuration loaded by the current conf_reload(),
+ * written to conf_cache_file once it completes.
+ **/
+static json_object *conf_cache_next = NULL;
+
+/**
+ * conf_load_threads:
+ *
+ * Number of threads to read configuration files with ahead of parsing
+ * them during conf_reload(), or zero to read each as it is parsed.
+ **/
+int conf_load_threads = 0;
+
+/**
+ * conf_reuse_state:
+ *
+ * If TRUE, jobs deserialised from the state passed over a stateful
+ * re-exec are kept rather than parsed again when the identity of their
+ * configuration file, and of any override file, is unchanged; set
+ * only for the conf_reload() that follows the re-exec.
+ **/
+int conf_reuse_state = FALSE;
+
+/**
+ * conf_lazy_load:
+ *
+ * If TRUE, jobs without a start on condition are loaded lazily: only
+ * the parts of their definition needed to describe and select them are
+ * kept until an instance is required (see job_class_unload()).
+ **/
+int conf_lazy_load = FALSE;
+
+/**
+ * conf_watch_defer:
+ *
+ * If TRUE, sources are read without creating the inotify watches that
+ * detect changes to them until conf_watch_sources() is called, so that
+ * the jobs they define can be started sooner.
+ **/
+int conf_watch_defer = FALSE;
+
+/**
+ * conf_staged_event:
+ *
+ * Name of the event that conf_reload() is staged for, or NULL to load
+ * all configuration at once.  Job configuration files that don't
+ * mention the event are only queued, to be loaded by conf_staged_load()
+ * once the event has been emitted.
+ **/
+const char *conf_staged_event = NULL;
+
+/**
+ * conf_staged:
+ *
+ * List of ConfStaged entries still to be loaded by conf_staged_load(),
+ * in the order they will be; NULL unless a staged conf_reload() has
+ * passed over some files.
+ **/
+static NihList *conf_staged = NULL;
+
+/**
+ * conf_staged_len:
+ *
+ * Number of entries in conf_staged.
+ **/
+static size_t conf_staged_len = 0;
+
+/**
+ * conf_errors:
+ *
+ * Number of errors found in configuration files while loading them,
+ * used by the init daemon when only checking configuration.
+ **/
+int conf_errors = 0;
+
+/**
+ * conf_prefetched:
+ *
+ * Hash table of ConfPrefetch objects, keyed by path, for files read
+ * ahead by the current conf_reload().
+ **/
+static NihHash *conf_prefetched = NULL;
+
+/**
+ * conf_reload_delay:
+ *
+ * Number of milliseconds to collect changes to configuration reported
+ * by inotify for before reloading them all in one pass, or zero to
+ * reload each as it is reported.
+ *
+ * This is left as zero until the main loop is running.
+ **/
+int conf_reload_delay = 0;
+
+/**
+ * conf_reload_timer:
+ *
+ * Watch on the timerfd that expires once conf_reload_delay has elapsed
+ * since the first change was deferred.
+ **/
+static NihIoWatch *conf_reload_timer = NULL;
+
+/**
+ * conf_reload_timer_armed:
+ *
+ * TRUE if conf_reload_timer is set to expire.
+ **/
+static int conf_reload_timer_armed = FALSE;
+
 extern json_object *json_conf_sources;
+extern int          default_console;
 
 /**
  * is_conf_file_std:
@@ -331,13 +582,16 @@ toggle_conf_name (const void     *parent,
 /**
  * conf_init:
  *
- * Initialise the conf_sources list.
+ * Initialise the conf_sources list and the index of jobs.
  **/
 void
 conf_init (void)
 {
 	if (! conf_sources)
 		conf_sources = NIH_MUST (nih_list_new (NULL));
+
+	if (! conf_jobs)
+		conf_jobs = NIH_MUST (nih_hash_string_new (NULL, 0));
 }
 
 /**
@@ -410,6 +664,8 @@ conf_source_new (const void     *parent,
 		return NULL;
 	}
 
+	source->pending = NULL;
+
 	nih_alloc_set_destructor (source, nih_list_destroy);
 
 	nih_list_add (conf_sources, &source->entry);
@@ -453,11 +709,14 @@ conf_file_new (ConfSource *source,
 
 	file->source = source;
 	file->flag = source->flag;
+	file->key = NULL;
 	file->data = NULL;
 
+	nih_list_init (&file->job_entry);
+
 	nih_alloc_set_destructor (file, conf_file_destroy);
 
-	nih_hash_add (source->files, &file->entry);
+	hash_table_add (source->files, &file->entry);
 
 	return file;
 }
@@ -491,10 +750,23 @@ conf_file_new (ConfSource *source,
 void
 conf_reload (void)
 {
+	MetricsStall stall;
+
 	conf_init ();
 
+	metrics_stall_begin (&stall, "conf_reload", NULL);
+
+	/* Files still queued by a staged reload are loaded by this one */
+	conf_staged_clear ();
+
+	conf_cache_load ();
+	conf_prefetch ();
+
 	NIH_LIST_FOREACH (conf_sources, iter) {
-		ConfSource *source = (ConfSource *)iter;
+		ConfSource   *source = (ConfSource *)iter;
+		MetricsStall  part;
+
+		metrics_stall_begin (&part, "conf_reload", source->path);
 
 		if (conf_source_reload (source) < 0) {
 			NihError *err;
@@ -506,539 +778,1985 @@ conf_reload (void)
 					err->message);
 			nih_free (err);
 		}
-	}
-}
-
-/**
- * conf_source_reload:
- * @source: configuration source to reload.
- *
- * Reloads the given configuration @source.
- *
- * If not already established, an inotify watch is created so that future
- * changes to this source are automatically detected and parsed.  For files,
- * this watch is actually on the parent directory, since we need to watch
- * out for editors that rename over the top, etc.
- *
- * We then parse the current state of the source.  The flag member is
- * toggled first, and this is propagated to all new and modified files and
- * items that we find as a result of parsing.  Once done, we scan for
- * anything with the wrong flag, and delete them.
- *
- * Returns: zero on success, negative value on raised error.
- **/
-int
-conf_source_reload (ConfSource *source)
-{
-	NihList deleted;
-	int     ret;
-
-	nih_assert (source != NULL);
-
-	nih_info (_("Loading configuration from %s"), source->path);
 
-	/* Toggle the flag so we can detect deleted files and items. */
-	source->flag = (! source->flag);
+		metrics_stall_attribute (&stall, &part);
+	}
 
-	/* Reload the source itself. */
-	switch (source->type) {
-	case CONF_FILE:
-		ret = conf_source_reload_file (source);
-		break;
-	case CONF_DIR:
-	case CONF_JOB_DIR:
-		ret = conf_source_reload_dir (source);
-		break;
-	default:
-		nih_assert_not_reached ();
+	if (conf_prefetched) {
+		nih_free (conf_prefetched);
+		conf_prefetched = NULL;
 	}
 
-	/* Scan for files that have been deleted since the last time we
-	 * reloaded; these are simple to detect, as they will have the wrong
-	 * flag.
-	 *
-	 * We take them out of the files list and then we can delete the
-	 * attached jobs and free the file.  We can't just do this from
-	 * the one loop because to delete the jobs, we need to be able
-	 * to iterate the sources and files.
+	/* The cache is kept open for the files staged, and only saved
+	 * once they've all been loaded.
 	 */
-	nih_list_init (&deleted);
-	NIH_HASH_FOREACH_SAFE (source->files, iter) {
-		ConfFile *file = (ConfFile *)iter;
-
-		if (file->flag != source->flag)
-			nih_list_add (&deleted, &file->entry);
+	if (conf_staged) {
+		nih_info (_("Deferred loading %zu configuration files"),
+			  conf_staged_len);
+	} else {
+		conf_cache_save ();
 	}
-	NIH_LIST_FOREACH_SAFE (&deleted, iter) {
-		ConfFile *file = (ConfFile *)iter;
 
-		nih_info (_("Handling deletion of %s"), file->path);
-		nih_unref (file, source);
-	}
+	/* Grow the tables of files and jobs that the reload has filled */
+	hash_table_grow_pending (NULL, NULL);
 
-	return ret;
+	metrics_stall_end (&stall);
 }
 
 /**
- * conf_source_reload_file:
- * @source: configuration source to reload.
- *
- * Reloads the configuration file specified by @source.
- *
- * If not already established, an inotify watch is created on the parent
- * directory so that future changes to the file are automatically detected
- * and parsed.  It is the parent directory because we need to watch out for
- * editors that rename over the top, etc.
- *
- * Returns: zero on success, negative value on raised error.
+ * conf_prefetch:
+ *
+ * Read every configuration file of every source into conf_prefetched
+ * using conf_load_threads threads, so that the reads of many small
+ * files proceed in parallel rather than each waiting in turn while the
+ * previous one is parsed.
+ *
+ * Only the reading is done on the threads; the files are still parsed
+ * and their jobs registered by the main thread in the usual order,
+ * since neither nih_alloc() nor the error context are thread-safe.
+ * Files that cannot be read are simply left to be read again when they
+ * are parsed, and will raise the error as normal then.
  **/
-static int
-conf_source_reload_file (ConfSource *source)
+static void
+conf_prefetch (void)
 {
-	NihError *err = NULL;
-	nih_local char *override_path = NULL;
+	ConfPrefetchQueue  queue;
+	pthread_t         *threads;
+	size_t             nthreads;
+	size_t             started = 0;
 
-	struct stat statbuf;
+	if (conf_load_threads <= 0)
+		return;
 
-	nih_assert (source != NULL);
-	nih_assert (source->type == CONF_FILE);
+	nih_assert (! conf_prefetched);
 
-	/* this function should only be called for standard
-	 * configuration files.
-	 */
-	if (! source->watch) {
-		nih_local char *dpath = NULL;
-		char           *dname;
+	conf_prefetched = nih_hash_string_new (NULL, 0);
+	if (! conf_prefetched)
+		return;
 
-		dpath = NIH_MUST (nih_strdup (NULL, source->path));
-		dname = dirname (dpath);
+	NIH_LIST_FOREACH (conf_sources, iter) {
+		ConfSource  *source = (ConfSource *)iter;
+		struct stat  statbuf;
 
-		source->watch = nih_watch_new (source, dname, FALSE, FALSE,
-					       (NihFileFilter)conf_file_filter,
-					       (NihCreateHandler)conf_create_modify_handler,
-					       (NihModifyHandler)conf_create_modify_handler,
-					       (NihDeleteHandler)conf_delete_handler,
-					       source);
+		if (source->type == CONF_FILE) {
+			if (stat (source->path, &statbuf) == 0
+			    && S_ISREG (statbuf.st_mode)
+			    && conf_prefetch_add (source->path, statbuf.st_size) < 0)
+				goto error;
 
-		/* If successful mark the file descriptor close-on-exec,
-		 * otherwise stash the error for comparison with a later
-		 * failure to parse the file.
-		 */
-		if (source->watch) {
-			nih_io_set_cloexec (source->watch->fd);
-		} else {
-			err = nih_error_steal ();
+			continue;
 		}
-	}
 
-	/* Parse the file itself.  If this fails, then we can discard the
-	 * inotify error, since this one will be better.
-	 */
-	if (conf_reload_path (source, source->path, NULL) < 0) {
-		if (err)
-			nih_free (err);
+		if (nih_dir_walk (source->path, (NihFileFilter)conf_dir_filter,
+				  (NihFileVisitor)conf_prefetch_visitor, NULL,
+				  source) < 0) {
+			NihError *err;
 
-		return -1;
+			/* Reported when the source is loaded */
+			err = nih_error_get ();
+			nih_free (err);
+		}
 	}
 
-	/* We were able to parse the file, but were not able to set up an
-	 * inotify watch.  This isn't critical, so we just warn about it,
-	 * unless this is simply that inotify isn't supported, in which case
-	 * we do nothing.
-	 */
-	if (err) {
-		if (err->number != ENOSYS)
-			nih_warn ("%s: %s: %s", source->path,
-				  _("Unable to watch configuration file"),
-				  err->message);
+	queue.count = 0;
+	NIH_HASH_FOREACH (conf_prefetched, iter)
+		queue.count++;
 
-		nih_free (err);
-	}
+	if (! queue.count)
+		return;
 
-	if (! is_conf_file_std (source->path))
-		return 0;
+	queue.entries = nih_alloc (conf_prefetched,
+				   sizeof (ConfPrefetch *) * queue.count);
+	if (! queue.entries)
+		goto error;
 
-	override_path = toggle_conf_name (NULL, source->path);
+	queue.count = 0;
+	queue.next = 0;
+	NIH_HASH_FOREACH (conf_prefetched, iter)
+		queue.entries[queue.count++] = (ConfPrefetch *)iter;
 
-	if (lstat (override_path, &statbuf) != 0)
-		return 0;
+	nthreads = conf_load_threads;
+	if (nthreads > queue.count)
+		nthreads = queue.count;
 
-	nih_debug ("Updating configuration for %s from %s",
-		  source->path, override_path);
-	if (conf_reload_path (source, source->path, override_path) < 0) {
-		if (err)
-			nih_free (err);
+	threads = nih_alloc (conf_prefetched, sizeof (pthread_t) * nthreads);
+	if (! threads)
+		goto error;
 
-		return -1;
+	while (started < nthreads) {
+		if (pthread_create (&threads[started], NULL,
+				    conf_prefetch_worker, &queue))
+			break;
+
+		started++;
 	}
 
-	return 0;
-}
+	/* Whatever is left is read by this thread */
+	conf_prefetch_worker (&queue);
 
-/**
- * conf_source_reload_dir:
- * @source: configuration source to reload.
- *
+	for (size_t i = 0; i < started; i++)
+		pthread_join (threads[i], NULL);
+
+	nih_debug ("Read %zu configuration files on %zu threads",
+		   queue.count, started + 1);
+
+	return;
+
+error:
+	nih_free (conf_prefetched);
+	conf_prefetched = NULL;
+}
+
+/**
+ * conf_prefetch_visitor:
+ * @source: configuration source,
+ * @dirname: top-level directory being walked,
+ * @path: path found in directory,
+ * @statbuf: stat of @path.
+ *
+ * Called by conf_prefetch() for each file found within @source; adds
+ * configuration files that will need to be parsed to conf_prefetched.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+conf_prefetch_visitor (ConfSource  *source,
+		       const char  *dirname,
+		       const char  *path,
+		       struct stat *statbuf)
+{
+	nih_assert (source != NULL);
+	nih_assert (dirname != NULL);
+	nih_assert (path != NULL);
+	nih_assert (statbuf != NULL);
+
+	if (! S_ISREG (statbuf->st_mode) || ! is_conf_file (path))
+		return 0;
+
+	/* Jobs will most likely be loaded from the cache instead */
+	if (conf_cache && json_object_object_get_ex (conf_cache, path, NULL))
+		return 0;
+
+	if (conf_prefetch_add (path, statbuf->st_size) < 0)
+		nih_return_no_memory_error (-1);
+
+	return 0;
+}
+
+/**
+ * conf_prefetch_add:
+ * @path: path to configuration file,
+ * @size: current size of @path.
+ *
+ * Add a ConfPrefetch for @path to conf_prefetched, allocating a buffer
+ * large enough for its current contents.
+ *
+ * Returns: zero on success, negative value on insufficient memory.
+ **/
+static int
+conf_prefetch_add (const char *path,
+		   off_t       size)
+{
+	ConfPrefetch *prefetch;
+
+	nih_assert (path != NULL);
+	nih_assert (conf_prefetched != NULL);
+
+	if (nih_hash_lookup (conf_prefetched, path))
+		return 0;
+
+	prefetch = nih_new (conf_prefetched, ConfPrefetch);
+	if (! prefetch)
+		return -1;
+
+	nih_list_init (&prefetch->entry);
+
+	prefetch->path = nih_strdup (prefetch, path);
+	prefetch->len = size;
+	prefetch->buf = nih_alloc (prefetch, prefetch->len + 1);
+	prefetch->ok = FALSE;
+
+	if (! prefetch->path || ! prefetch->buf) {
+		nih_free (prefetch);
+		return -1;
+	}
+
+	nih_alloc_set_destructor (prefetch, nih_list_destroy);
+
+	nih_hash_add (conf_prefetched, &prefetch->entry);
+
+	return 0;
+}
+
+/**
+ * conf_prefetch_worker:
+ * @data: ConfPrefetchQueue.
+ *
+ * Thread body for conf_prefetch(); reads entries from the queue until
+ * none remain.  Uses only system calls on memory allocated beforehand,
+ * so is safe to run alongside other workers.
+ *
+ * Returns: NULL.
+ **/
+static void *
+conf_prefetch_worker (void *data)
+{
+	ConfPrefetchQueue *queue = (ConfPrefetchQueue *)data;
+
+	nih_assert (queue != NULL);
+
+	for (;;) {
+		ConfPrefetch *prefetch;
+		size_t        i;
+		size_t        got = 0;
+		ssize_t       ret;
+		char          extra;
+		int           fd;
+
+		i = __sync_fetch_and_add (&queue->next, 1);
+		if (i >= queue->count)
+			break;
+
+		prefetch = queue->entries[i];
+
+		fd = open (prefetch->path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		while (got < prefetch->len) {
+			ret = read (fd, prefetch->buf + got, prefetch->len - got);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				break;
+
+			got += ret;
+		}
+
+		/* Only use the contents if the file was not modified while
+		 * it was being read.
+		 */
+		if (got == prefetch->len) {
+			do {
+				ret = read (fd, &extra, 1);
+			} while (ret < 0 && errno == EINTR);
+
+			if (! ret) {
+				prefetch->buf[got] = '\0';
+				prefetch->ok = TRUE;
+			}
+		}
+
+		close (fd);
+	}
+
+	return NULL;
+}
+
+/**
+ * conf_cache_invalidate:
+ *
+ * Discard the compiled job configuration cache such that the next
+ * conf_reload() parses every configuration file again.
+ **/
+void
+conf_cache_invalidate (void)
+{
+	if (! conf_cache_file)
+		return;
+
+	if (unlink (conf_cache_file) < 0 && errno != ENOENT)
+		nih_warn ("%s: %s: %s", conf_cache_file,
+			  _("Unable to remove configuration cache"),
+			  strerror (errno));
+}
+
+/**
+ * conf_cache_load:
+ *
+ * Begin collecting the cache entries for the current conf_reload() in
+ * conf_cache_next, reading those of conf_cache_file into conf_cache.
+ **/
+static void
+conf_cache_load (void)
+{
+	if (! conf_cache_file)
+		return;
+
+	nih_assert (! conf_cache_next);
+
+	conf_cache_next = json_object_new_object ();
+	if (! conf_cache_next)
+		return;
+
+	/* Entries may already have been read by conf_cache_entry() */
+	if (conf_cache)
+		json_object_put (conf_cache);
+
+	conf_cache = conf_cache_read ();
+}
+
+/**
+ * conf_cache_read:
+ *
+ * Map conf_cache_file into memory and parse its entries, discarding them
+ * if they were written by a different version of init or with a
+ * different default console.  A missing or corrupt cache is not an
+ * error; every file is simply parsed as normal.
+ *
+ * Returns: JSON object of cache entries keyed by configuration file
+ * path, or NULL if there are none.
+ **/
+static json_object *
+conf_cache_read (void)
+{
+	json_tokener   *tok;
+	json_object    *json = NULL;
+	json_object    *json_files;
+	struct stat     statbuf;
+	void           *map;
+	nih_local char *version = NULL;
+	int             console;
+	int             fd;
+
+	if (! conf_cache_file)
+		return NULL;
+
+	fd = open (conf_cache_file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat (fd, &statbuf) < 0 || ! S_ISREG (statbuf.st_mode)
+	    || ! statbuf.st_size) {
+		close (fd);
+		return NULL;
+	}
+
+	map = mmap (NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED)
+		return NULL;
+
+	tok = json_tokener_new ();
+	if (tok) {
+		json = json_tokener_parse_ex (tok, map, statbuf.st_size);
+		json_tokener_free (tok);
+	}
+
+	munmap (map, statbuf.st_size);
+
+	if (! json)
+		goto invalid;
+
+	if (! state_check_json_type (json, object))
+		goto invalid;
+
+	if (! state_get_json_string_var_strict (json, "version", NULL, version)
+	    || strcmp (version, PACKAGE_VERSION))
+		goto invalid;
+
+	if (! state_get_json_int_var (json, "console", console)
+	    || console != default_console)
+		goto invalid;
+
+	if (! json_object_object_get_ex (json, "files", &json_files)
+	    || ! state_check_json_type (json_files, object))
+		goto invalid;
+
+	json_object_get (json_files);
+	json_object_put (json);
+
+	nih_debug ("Loaded configuration cache %s", conf_cache_file);
+	return json_files;
+
+invalid:
+	nih_debug ("%s: %s", conf_cache_file,
+		   _("Ignoring invalid configuration cache"));
+
+	if (json)
+		json_object_put (json);
+
+	return NULL;
+}
+
+/**
+ * conf_cache_entry:
+ * @class: job class.
+ *
+ * Look up the configuration cache entry for the file that @class was
+ * loaded from, provided that it was made from the same revision of the
+ * file and any override file, reading the entries of conf_cache_file
+ * if they haven't been already; they are kept until the next
+ * conf_reload() completes.
+ *
+ * This allows the definition of a class dropped by job_class_unload()
+ * to be serialised without parsing its file again.
+ *
+ * Returns: JobClass serialised by job_class_serialise(), owned by the
+ * cache, or NULL if there is no valid entry.
+ **/
+json_object *
+conf_cache_entry (const JobClass *class)
+{
+	ConfFile       *file;
+	json_object    *json_entry;
+	json_object    *json_class;
+	nih_local char *entry_key = NULL;
+
+	nih_assert (class != NULL);
+
+	/* Only jobs outside of sessions are cached */
+	if (class->session)
+		return NULL;
+
+	file = conf_job_file (class);
+	if (! file || ! file->key)
+		return NULL;
+
+	if (! conf_cache)
+		conf_cache = conf_cache_read ();
+
+	if (! conf_cache)
+		return NULL;
+
+	if (! json_object_object_get_ex (conf_cache, file->path, &json_entry))
+		return NULL;
+
+	if (! state_get_json_string_var_strict (json_entry, "key", NULL, entry_key)
+	    || strcmp (entry_key, file->key))
+		return NULL;
+
+	if (! json_object_object_get_ex (json_entry, "class", &json_class))
+		return NULL;
+
+	return json_class;
+}
+
+/**
+ * conf_cache_save:
+ *
+ * Atomically replace conf_cache_file with the entries stored during the
+ * current conf_reload(), so that entries for configuration files which
+ * no longer exist are pruned.
+ *
+ * Failure is logged but otherwise ignored since the file system may
+ * well still be read-only when the configuration is first loaded.
+ **/
+static void
+conf_cache_save (void)
+{
+	json_object    *json;
+	const char     *value;
+	nih_local char *tmp = NULL;
+	size_t          len;
+	int             fd = -1;
+
+	if (! conf_cache_next)
+		return;
+
+	if (conf_cache) {
+		json_object_put (conf_cache);
+		conf_cache = NULL;
+	}
+
+	json = json_object_new_object ();
+	if (! json)
+		goto error;
+
+	if (! state_set_json_string_var (json, "version", PACKAGE_VERSION))
+		goto error;
+
+	if (! state_set_json_int_var (json, "console", default_console))
+		goto error;
+
+	json_object_object_add (json, "files", conf_cache_next);
+	conf_cache_next = NULL;
+
+	value = json_object_to_json_string (json);
+	if (! value)
+		goto error;
+
+	len = strlen (value);
+
+	tmp = nih_sprintf (NULL, "%s.new", conf_cache_file);
+	if (! tmp)
+		goto error;
+
+	{
+		nih_local char *dir = NULL;
+
+		dir = nih_strdup (NULL, conf_cache_file);
+		if (! dir)
+			goto error;
+
+		/* Only the final component is created */
+		if (mkdir (dirname (dir), 0755) < 0 && errno != EEXIST)
+			goto error;
+	}
+
+	fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		goto error;
+
+	while (len) {
+		ssize_t ret;
+
+		ret = write (fd, value, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			goto error;
+		}
+
+		value += ret;
+		len -= ret;
+	}
+
+	if (close (fd) < 0) {
+		fd = -1;
+		goto error;
+	}
+	fd = -1;
+
+	if (rename (tmp, conf_cache_file) < 0)
+		goto error;
+
+	json_object_put (json);
+	return;
+
+error:
+	nih_debug ("%s: %s: %s", conf_cache_file,
+		   _("Unable to write configuration cache"),
+		   strerror (errno));
+
+	if (fd >= 0) {
+		close (fd);
+		unlink (tmp);
+	}
+
+	if (json)
+		json_object_put (json);
+
+	if (conf_cache_next) {
+		json_object_put (conf_cache_next);
+		conf_cache_next = NULL;
+	}
+}
+
+/**
+ * conf_cache_key:
+ * @parent: parent for new string,
+ * @conf_path: path to job configuration file,
+ * @override_path: path to override file for @conf_path, or NULL.
+ *
+ * Build the key used to determine whether the cache entry for @conf_path
+ * is still valid; this identifies the exact revision of both @conf_path
+ * and @override_path from their device, inode, size and modification
+ * time.
+ *
+ * If @parent is not NULL, it should be a pointer to another allocated
+ * block which will be used as the parent for this block.  When @parent
+ * is freed, the returned block will be freed too.
+ *
+ * Returns: newly allocated key or NULL if either file could not be
+ * examined or insufficient memory.
+ **/
+static char *
+conf_cache_key (const void *parent,
+		const char *conf_path,
+		const char *override_path)
+{
+	char        *key;
+	const char  *path;
+	struct stat  statbuf;
+
+	nih_assert (conf_path != NULL);
+
+	key = nih_strdup (parent, "");
+	if (! key)
+		return NULL;
+
+	path = conf_path;
+	while (path) {
+		if (stat (path, &statbuf) < 0)
+			goto error;
+
+		if (! nih_strcat_sprintf (&key, parent, "%s%s:%llu:%llu:%lld:%lld.%09ld",
+					  *key ? ";" : "", path,
+					  (unsigned long long)statbuf.st_dev,
+					  (unsigned long long)statbuf.st_ino,
+					  (long long)statbuf.st_size,
+					  (long long)statbuf.st_mtim.tv_sec,
+					  statbuf.st_mtim.tv_nsec))
+			goto error;
+
+		path = (path == conf_path ? override_path : NULL);
+	}
+
+	return key;
+
+error:
+	nih_free (key);
+	return NULL;
+}
+
+/**
+ * conf_cache_reload_path:
+ * @source: configuration source,
+ * @path: path of job configuration file,
+ * @name: name of job defined by @path,
+ * @key: cache key for @path.
+ *
+ * Load the job defined by @path from the cache rather than parsing it,
+ * if the cache holds an entry with a matching @key.  The ConfFile is
+ * replaced in exactly the same way as conf_reload_path() does.
+ *
+ * Returns: zero on success, negative value if there is no valid entry.
+ **/
+static int
+conf_cache_reload_path (ConfSource *source,
+			const char *path,
+			const char *name,
+			const char *key)
+{
+	json_object    *json_entry;
+	json_object    *json_class;
+	nih_local char *entry_key = NULL;
+	ConfFile       *file;
+	ConfFile       *orig;
+	JobClass       *class;
+
+	nih_assert (source != NULL);
+	nih_assert (path != NULL);
+	nih_assert (name != NULL);
+	nih_assert (key != NULL);
+
+	if (! conf_cache)
+		return -1;
+
+	if (! json_object_object_get_ex (conf_cache, path, &json_entry))
+		return -1;
+
+	if (! state_get_json_string_var_strict (json_entry, "key", NULL, entry_key)
+	    || strcmp (entry_key, key))
+		return -1;
+
+	if (! json_object_object_get_ex (json_entry, "class", &json_class))
+		return -1;
+
+	class = job_class_deserialise_config (json_class, name);
+	if (! class)
+		return -1;
+
+	nih_debug ("Loading %s from configuration cache", name);
+
+	/* See conf_reload_path() for why the original ConfFile must
+	 * outlive the new JobClass being considered.
+	 */
+	orig = (ConfFile *)nih_hash_lookup (source->files, path);
+	if (orig)
+		nih_list_remove (&orig->entry);
+
+	file = NIH_MUST (conf_file_new (source, path));
+	file->job = class;
+	conf_file_index (file);
+
+	job_class_consider (file->job);
+
+	if (orig)
+		nih_unref (orig, source);
+
+	json_object_object_add (conf_cache_next, path,
+				json_object_get (json_entry));
+
+	return 0;
+}
+
+/**
+ * conf_cache_store:
+ * @source: configuration source,
+ * @path: path of job configuration file,
+ * @key: cache key for @path.
+ *
+ * Add the JobClass just parsed from @path to the entries to be written
+ * to the cache, or the entry already in the cache should it have been
+ * made from the same revision of @path.
+ **/
+static void
+conf_cache_store (ConfSource *source,
+		  const char *path,
+		  const char *key)
+{
+	json_object    *json_entry;
+	json_object    *json_class;
+	nih_local char *entry_key = NULL;
+	ConfFile       *file;
+
+	nih_assert (source != NULL);
+	nih_assert (path != NULL);
+	nih_assert (key != NULL);
+
+	if (! conf_cache_next)
+		return;
+
+	/* An entry already cached for the same revision is kept as it
+	 * is, rather than serialising the job again.
+	 */
+	if (conf_cache
+	    && json_object_object_get_ex (conf_cache, path, &json_entry)
+	    && state_get_json_string_var_strict (json_entry, "key", NULL, entry_key)
+	    && (! strcmp (entry_key, key))) {
+		json_object_object_add (conf_cache_next, path,
+					json_object_get (json_entry));
+		return;
+	}
+
+	file = (ConfFile *)nih_hash_lookup (source->files, path);
+	if (! file || ! file->job)
+		return;
+
+	/* Serialising a job whose definition has been dropped would parse
+	 * its file again; it is cached once it's next parsed instead.
+	 */
+	if (! file->job->loaded)
+		return;
+
+	json_class = job_class_serialise (file->job);
+	if (! json_class)
+		return;
+
+	json_entry = json_object_new_object ();
+	if (! json_entry) {
+		json_object_put (json_class);
+		return;
+	}
+
+	if (! state_set_json_string_var (json_entry, "key", key)) {
+		json_object_put (json_class);
+		json_object_put (json_entry);
+		return;
+	}
+
+	json_object_object_add (json_entry, "class", json_class);
+	json_object_object_add (conf_cache_next, path, json_entry);
+}
+
+/**
+ * conf_file_reuse:
+ * @source: configuration source,
+ * @path: path of job configuration file,
+ * @key: cache key for @path.
+ *
+ * When conf_reuse_state is TRUE, keep the job deserialised for @path
+ * over a stateful re-exec instead of parsing the file again, provided
+ * that it was parsed from the revision of the file and any override
+ * file identified by @key.  Only the metadata of the files has been
+ * examined, their contents are not read.
+ *
+ * Returns: TRUE if the job was kept, FALSE if @path should be parsed.
+ **/
+static int
+conf_file_reuse (ConfSource *source,
+		 const char *path,
+		 const char *key)
+{
+	ConfFile *file;
+
+	nih_assert (source != NULL);
+	nih_assert (path != NULL);
+	nih_assert (key != NULL);
+
+	if (! conf_reuse_state)
+		return FALSE;
+
+	file = (ConfFile *)nih_hash_lookup (source->files, path);
+	if (! file || ! file->job || ! file->key)
+		return FALSE;
+
+	if (strcmp (file->key, key))
+		return FALSE;
+
+	nih_debug ("Keeping %s from serialised state", path);
+
+	file->flag = source->flag;
+
+	return TRUE;
+}
+
+/**
+ * conf_file_set_key:
+ * @source: configuration source,
+ * @path: path of job configuration file,
+ * @key: cache key for @path, or NULL.
+ *
+ * Record @key in the ConfFile for @path once its job has been loaded,
+ * so that it is passed on over a stateful re-exec.
+ **/
+static void
+conf_file_set_key (ConfSource *source,
+		   const char *path,
+		   const char *key)
+{
+	ConfFile *file;
+
+	nih_assert (source != NULL);
+	nih_assert (path != NULL);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, path);
+	if (! file)
+		return;
+
+	if (file->key)
+		nih_unref (file->key, file);
+	file->key = NULL;
+
+	if (key && file->job)
+		file->key = NIH_MUST (nih_strdup (file, key));
+}
+
+
+/**
+ * conf_source_reload:
+ * @source: configuration source to reload.
+ *
+ * Reloads the given configuration @source.
+ *
+ * If not already established, an inotify watch is created so that future
+ * changes to this source are automatically detected and parsed.  For files,
+ * this watch is actually on the parent directory, since we need to watch
+ * out for editors that rename over the top, etc.
+ *
+ * We then parse the current state of the source.  The flag member is
+ * toggled first, and this is propagated to all new and modified files and
+ * items that we find as a result of parsing.  Once done, we scan for
+ * anything with the wrong flag, and delete them.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+conf_source_reload (ConfSource *source)
+{
+	NihList deleted;
+	int     ret;
+
+	nih_assert (source != NULL);
+
+	nih_info (_("Loading configuration from %s"), source->path);
+
+	/* Toggle the flag so we can detect deleted files and items. */
+	source->flag = (! source->flag);
+
+	/* Reload the source itself. */
+	switch (source->type) {
+	case CONF_FILE:
+		ret = conf_source_reload_file (source);
+		break;
+	case CONF_DIR:
+	case CONF_JOB_DIR:
+		ret = conf_source_reload_dir (source);
+		break;
+	default:
+		nih_assert_not_reached ();
+	}
+
+	/* Scan for files that have been deleted since the last time we
+	 * reloaded; these are simple to detect, as they will have the wrong
+	 * flag.
+	 *
+	 * We take them out of the files list and then we can delete the
+	 * attached jobs and free the file.  We can't just do this from
+	 * the one loop because to delete the jobs, we need to be able
+	 * to iterate the sources and files.
+	 */
+	nih_list_init (&deleted);
+	NIH_HASH_FOREACH_SAFE (source->files, iter) {
+		ConfFile *file = (ConfFile *)iter;
+
+		if (file->flag != source->flag)
+			nih_list_add (&deleted, &file->entry);
+	}
+	NIH_LIST_FOREACH_SAFE (&deleted, iter) {
+		ConfFile *file = (ConfFile *)iter;
+
+		nih_info (_("Handling deletion of %s"), file->path);
+		nih_unref (file, source);
+	}
+
+	return ret;
+}
+
+/**
+ * conf_source_reload_file:
+ * @source: configuration source to reload.
+ *
+ * Reloads the configuration file specified by @source.
+ *
+ * If not already established, an inotify watch is created on the parent
+ * directory so that future changes to the file are automatically detected
+ * and parsed.  It is the parent directory because we need to watch out for
+ * editors that rename over the top, etc.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+conf_source_reload_file (ConfSource *source)
+{
+	NihError *err = NULL;
+	nih_local char *override_path = NULL;
+
+	struct stat statbuf;
+
+	nih_assert (source != NULL);
+	nih_assert (source->type == CONF_FILE);
+
+	/* this function should only be called for standard
+	 * configuration files.
+	 */
+	if ((! source->watch) && (! conf_watch_defer)) {
+		/* If successful the file descriptor is marked close-on-exec,
+		 * otherwise stash the error for comparison with a later
+		 * failure to parse the file.
+		 */
+		source->watch = conf_source_watch_new (source, FALSE);
+		if (! source->watch)
+			err = nih_error_steal ();
+	}
+
+	/* Parse the file itself.  If this fails, then we can discard the
+	 * inotify error, since this one will be better.
+	 */
+	if (conf_reload_path (source, source->path, NULL) < 0) {
+		if (err)
+			nih_free (err);
+
+		return -1;
+	}
+
+	/* We were able to parse the file, but were not able to set up an
+	 * inotify watch.  This isn't critical, so we just warn about it,
+	 * unless this is simply that inotify isn't supported, in which case
+	 * we do nothing.
+	 */
+	if (err) {
+		if (err->number != ENOSYS)
+			nih_warn ("%s: %s: %s", source->path,
+				  _("Unable to watch configuration file"),
+				  err->message);
+
+		nih_free (err);
+	}
+
+	if (! is_conf_file_std (source->path))
+		return 0;
+
+	override_path = toggle_conf_name (NULL, source->path);
+
+	if (lstat (override_path, &statbuf) != 0)
+		return 0;
+
+	nih_debug ("Updating configuration for %s from %s",
+		  source->path, override_path);
+	if (conf_reload_path (source, source->path, override_path) < 0) {
+		if (err)
+			nih_free (err);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * conf_source_reload_dir:
+ * @source: configuration source to reload.
+ *
  * Reloads the configuration directory specified by @source.
  *
- * If not already established, an inotify watch is created on the directory
- * so that future changes to the structure or files within it are
- * automatically parsed.  This has the side-effect of parsing the current
- * tree.
+ * If not already established, an inotify watch is created on the directory
+ * so that future changes to the structure or files within it are
+ * automatically parsed.  This has the side-effect of parsing the current
+ * tree.
+ *
+ * Otherwise we walk the tree ourselves and parse all files that we find,
+ * propagating the value of the flag member to all files so that deletion
+ * can be detected by the calling function.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+conf_source_reload_dir (ConfSource *source)
+{
+	NihError *err = NULL;
+
+	nih_assert (source != NULL);
+	nih_assert (source->type != CONF_FILE);
+
+	if ((! source->watch) && (! conf_watch_defer)) {
+		/* If successful, the directory tree will have been walked
+		 * already; so just return; otherwise we'll try and walk
+		 * ourselves, so stash the error for comparison.
+		 */
+		source->watch = conf_source_watch_new (source, TRUE);
+		if (source->watch) {
+			return 0;
+		} else {
+			err = nih_error_steal ();
+		}
+	}
+
+	/* We're either performing a mandatory reload, or we failed to set
+	 * up an inotify watch; walk the directory tree the old fashioned
+	 * way.  If this fails too, then we can discard the inotify error
+	 * since this one will be better.
+	 */
+	if (nih_dir_walk (source->path, (NihFileFilter)conf_dir_filter,
+			  (NihFileVisitor)conf_file_visitor, NULL,
+			  source) < 0) {
+		if (err)
+			nih_free (err);
+
+		return -1;
+	}
+
+	/* We were able to walk the directory, but were not able to set up
+	 * an inotify watch.  This isn't critical, so we just warn about it,
+	 * unless this is simply that inotify isn't supported, in which case
+	 * we do nothing.
+	 */
+	if (err) {
+		if (err->number != ENOSYS)
+			nih_warn ("%s: %s: %s", source->path,
+				  _("Unable to watch configuration directory"),
+				  err->message);
+
+		nih_free (err);
+	}
+
+	return 0;
+}
+
+/**
+ * conf_source_watch_new:
+ * @source: configuration source to watch,
+ * @create: TRUE to call the create handler for each existing file.
+ *
+ * Create an inotify watch for @source, on the directory for CONF_DIR and
+ * CONF_JOB_DIR sources and the parent directory for CONF_FILE sources,
+ * with its file descriptor marked close-on-exec.
+ *
+ * For directories, @create causes each existing file to be loaded as if
+ * it had just been created, which walks the tree; for files it is
+ * ignored, since the file is always loaded by its caller.
+ *
+ * Returns: new NihWatch or NULL on raised error.
+ **/
+static NihWatch *
+conf_source_watch_new (ConfSource *source,
+		       int         create)
+{
+	NihWatch *watch;
+
+	nih_assert (source != NULL);
+
+	if (source->type == CONF_FILE) {
+		nih_local char *dpath = NULL;
+		char           *dname;
+
+		dpath = NIH_MUST (nih_strdup (NULL, source->path));
+		dname = dirname (dpath);
+
+		watch = nih_watch_new (source, dname, FALSE, FALSE,
+				       (NihFileFilter)conf_file_filter,
+				       (NihCreateHandler)conf_create_modify_handler,
+				       (NihModifyHandler)conf_create_modify_handler,
+				       (NihDeleteHandler)conf_delete_handler,
+				       source);
+	} else {
+		watch = nih_watch_new (source, source->path, TRUE, create,
+				       (NihFileFilter)conf_dir_filter,
+				       (NihCreateHandler)conf_create_modify_handler,
+				       (NihModifyHandler)conf_create_modify_handler,
+				       (NihDeleteHandler)conf_delete_handler,
+				       source);
+	}
+
+	if (watch)
+		nih_io_set_cloexec (watch->fd);
+
+	return watch;
+}
+
+/**
+ * conf_watch_sources:
+ *
+ * Create the inotify watches for every source not already watched,
+ * which conf_watch_defer will have put off, and stop deferring them for
+ * sources read from now on.
+ *
+ * Each source is then read again, so that changes made to it between
+ * being first read and being watched are not missed; job files whose
+ * identity (see conf_cache_key()) is unchanged are reused rather than
+ * parsed again, so this is cheap when nothing has changed.
+ **/
+void
+conf_watch_sources (void)
+{
+	conf_init ();
+
+	conf_watch_defer = FALSE;
+
+	NIH_LIST_FOREACH (conf_sources, iter) {
+		ConfSource *source = (ConfSource *)iter;
+		NihError   *err;
+
+		if (source->watch)
+			continue;
+
+		source->watch = conf_source_watch_new (source, FALSE);
+		if (source->watch) {
+			if (conf_source_reload (source) < 0) {
+				err = nih_error_get ();
+				if (err->number != ENOENT)
+					nih_error ("%s: %s: %s", source->path,
+						   _("Unable to load configuration"),
+						   err->message);
+				nih_free (err);
+			}
+
+			continue;
+		}
+
+		/* As for the original reload, not being able to watch the
+		 * source isn't critical; and we only warn if it ought to
+		 * have been possible.
+		 */
+		err = nih_error_get ();
+		if ((err->number != ENOSYS) && (err->number != ENOENT))
+			nih_warn ("%s: %s: %s", source->path,
+				  _("Unable to watch configuration"),
+				  err->message);
+		nih_free (err);
+	}
+
+	nih_debug ("Watching configuration sources");
+}
+
+
+/**
+ * conf_file_filter:
+ * @source: configuration source,
+ * @path: path to check,
+ * @is_dir: TRUE if @path is a directory.
+ *
+ * When we watch the parent directory of a file for changes, we receive
+ * notification about all changes to that directory.  We only care about
+ * those that affect the path in @source, and the path that we're watching,
+ * so we use this function to filter out all others.
+ *
+ * Returns: FALSE if @path matches @source, TRUE otherwise.
+ **/
+static int
+conf_file_filter (ConfSource *source,
+		  const char *path,
+		  int         is_dir)
+{
+	nih_assert (source != NULL);
+	nih_assert (path != NULL);
+
+	if (! strcmp (source->path, path))
+		return FALSE;
+
+	if (! strcmp (source->watch->path, path))
+		return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * conf_dir_filter:
+ * @source: configuration source,
+ * @path: path to check,
+ * @is_dir: TRUE of @path is a directory.
+ *
+ * This is the file filter used for the jobs directory, we only care
+ * about paths with particular extensions (see IS_CONF_EXT).
+ *
+ * Directories that match the nih_file_ignore() function are also ignored.
+ *
+ * Returns: FALSE if @path ends in ".conf" or ".override",
+ * or is the original source, TRUE otherwise.
+ **/
+static int
+conf_dir_filter (ConfSource *source,
+		 const char *path,
+		 int         is_dir)
+{
+	nih_assert (source != NULL);
+	nih_assert (path != NULL);
+
+	if (! strcmp (source->path, path))
+		return FALSE;
+
+	if (is_dir)
+		return nih_file_ignore (NULL, path);
+
+	if (is_conf_file (path))
+		return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * conf_load_path_with_override:
+ * @source: configuration source
+ * @conf_path: path to config file
+ *
+ * Loads given @conf_path as a config file in a given @source. Then it
+ * finds an override file. If an override file is found it applies it
+ * as well.
+ **/
+static void
+conf_load_path_with_override (ConfSource *source,
+			      const char *conf_path)
+{
+	int                     ret = 0;
+	const char   *error_path = NULL;
+	char      *override_path = NULL;
+	nih_local char *job_name = NULL;
+	nih_local char *key = NULL;
+	int             cache;
+
+	nih_assert (source != NULL);
+	nih_assert (conf_path != NULL);
+
+	job_name = conf_to_job_name (source->path, conf_path);
+	override_path = conf_get_best_override (job_name, source);
+
+	if (source->type == CONF_JOB_DIR)
+		key = conf_cache_key (NULL, conf_path, override_path);
+
+	cache = (key && conf_cache_next && ! source->session);
+
+	if (key && conf_file_reuse (source, conf_path, key)) {
+		if (override_path)
+			nih_free (override_path);
+
+		if (cache)
+			conf_cache_store (source, conf_path, key);
+
+		conf_job_loaded (source, conf_path);
+		return;
+	}
+
+	if (cache && conf_cache_reload_path (source, conf_path,
+					     job_name, key) == 0) {
+		if (override_path)
+			nih_free (override_path);
+
+		conf_file_set_key (source, conf_path, key);
+		conf_job_loaded (source, conf_path);
+		return;
+	}
+
+	/* reload conf file */
+	nih_debug ("Loading configuration file %s", conf_path);
+	ret = conf_reload_path (source, conf_path, NULL);
+	if (ret < 0) {
+		error_path = conf_path;
+		goto error;
+	}
+
+	if (override_path) {
+		/* overlay override settings */
+		nih_debug ("Loading override file %s for %s", conf_path, override_path);
+		ret = conf_reload_path (source, conf_path, override_path);
+		if (ret < 0) {
+			error_path = override_path;
+			goto error;
+		}
+		nih_free (override_path);
+	}
+
+	conf_file_set_key (source, conf_path, key);
+
+	if (cache)
+		conf_cache_store (source, conf_path, key);
+
+	conf_job_loaded (source, conf_path);
+
+	return;
+
+error:
+	{
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_error ("%s: %s: %s", error_path,
+			   _("Error while loading configuration file"),
+			   err->message);
+		nih_free (err);
+		conf_errors++;
+		if (override_path)
+			nih_free (override_path);
+		return;
+	}
+}
+
+
+/**
+ * conf_file_changed:
+ * @source: configuration source,
+ * @watch: NihWatch for source,
+ * @path: full path to modified file,
+ * @statbuf: stat of @path.
+ *
+ * Handle the creation or modification of @path within @source.
+ *
+ * After checking that it was a regular file that was changed, we reload it;
+ * we expect this to fail sometimes since the file may be only partially
+ * written.
+ **/
+static void
+conf_file_changed (ConfSource  *source,
+		   NihWatch    *watch,
+		   const char  *path,
+		   struct stat *statbuf)
+{
+	ConfFile *file = NULL;
+	char *config_path = NULL;
+	nih_local char *job_name = NULL;
+
+	nih_assert (source != NULL);
+	nih_assert (watch != NULL);
+	nih_assert (path != NULL);
+
+	/* note that symbolic links are ignored */
+	if (statbuf && ! S_ISREG (statbuf->st_mode))
+		return;
+
+	/* ignore non-config file changes */
+	if (! is_conf_file (path))
+		return;
+
+        /* For config file, load it and it's override file */
+	if (is_conf_file_std (path)) {
+		conf_load_path_with_override (source, path);
+		return;
+	}
+
+	/* For override files, reload all matching conf+override combos */
+	job_name = conf_to_job_name (source->path, path);
+	NIH_LIST_FOREACH (conf_sources, iter) {
+		ConfSource *source = (ConfSource *)iter;
+
+		if (source->type == CONF_FILE)
+			continue;
+
+		config_path = NIH_MUST (nih_sprintf (NULL, "%s/%s%s", source->path, job_name, CONF_EXT_STD));
+		file = (ConfFile *)nih_hash_lookup (source->files, config_path);
+		if (file) {
+			/* Find its override file and reload both */
+			conf_load_path_with_override (source, config_path);
+		}
+		nih_free (config_path);
+	}
+
+	return;
+}
+
+/**
+ * conf_file_deleted:
+ * @source: configuration source,
+ * @watch: NihWatch for source,
+ * @path: full path to deleted file.
+ *
+ * Handle the removal of @path from @source.
+ *
+ * We lookup the file in our hash table, and if we can find it, perform
+ * the usual deletion of it.
+ **/
+static void
+conf_file_deleted (ConfSource *source,
+		   NihWatch   *watch,
+		   const char *path)
+{
+	ConfFile *file;
+	nih_local char *new_path = NULL;
+
+	nih_assert (source != NULL);
+	nih_assert (watch != NULL);
+	nih_assert (path != NULL);
+
+	/* Lookup the file in the source.  If we haven't parsed it, this
+	 * could actually mean that it was the top-level directory itself
+	 * that was deleted, in which case we free the watch, otherwise
+	 * it's probably a directory or something, so just ignore it.
+	 */
+	file = (ConfFile *)nih_hash_lookup (source->files, path);
+	/* Note we have to be careful to consider deletion of directories too.
+	 * This is handled implicitly by the override check which will return
+	 * false if passed a directory in this case.
+	 */
+	if (! file && ! is_conf_file_override (path)) {
+		if (! strcmp (watch->path, path)) {
+			nih_warn ("%s: %s", source->path,
+				  _("Configuration directory deleted"));
+			nih_unref (source->watch, source);
+			source->watch = NULL;
+		}
+
+		return;
+	}
+
+	/* non-override files (and directories) are the simple case, so handle
+	 * them and leave.
+	 */
+	if (! is_conf_file_override (path)) {
+		nih_unref (file, source);
+		return;
+	}
+
+	/* Deleting override file is about the same as changing one.
+	 * We need to iterate across all matching jobs and reload them
+	 * with new "best" override file, if any.
+	 */
+	nih_debug ("Reloading configuration for matching configs on deletion of override (%s)",
+		   path);
+	conf_file_changed (source, watch, path, NULL);
+}
+
+/**
+ * conf_create_modify_handler:
+ * @source: configuration source,
+ * @watch: NihWatch for source,
+ * @path: full path to modified file,
+ * @statbuf: stat of @path.
+ *
+ * This function will be called whenever a file is created in a directory
+ * that we're watching, moved into the directory we're watching, or is
+ * modified.  This works for both directory and file sources, since the
+ * watch for the latter is on the parent and filtered to only return the
+ * path that we're interested in.
+ *
+ * The change is deferred when conf_reload_delay is set, otherwise it is
+ * handled immediately.
+ **/
+static void
+conf_create_modify_handler (ConfSource  *source,
+			    NihWatch    *watch,
+			    const char  *path,
+			    struct stat *statbuf)
+{
+	MetricsStall stall;
+
+	nih_assert (source != NULL);
+	nih_assert (watch != NULL);
+	nih_assert (path != NULL);
+
+	if (conf_reload_defer (source, path))
+		return;
+
+	metrics_stall_begin (&stall, "conf_create_modify_handler", path);
+	conf_file_changed (source, watch, path, statbuf);
+	metrics_stall_end (&stall);
+}
+
+/**
+ * conf_delete_handler:
+ * @source: configuration source,
+ * @watch: NihWatch for source,
+ * @path: full path to deleted file.
+ *
+ * This function will be called whenever a file is removed or moved out
+ * of a directory that we're watching.  This works for both directory and
+ * file sources, since the watch for the latter is on the parent and
+ * filtered to only return the path that we're interested in.
  *
- * Otherwise we walk the tree ourselves and parse all files that we find,
- * propagating the value of the flag member to all files so that deletion
- * can be detected by the calling function.
+ * The change is deferred when conf_reload_delay is set, otherwise it is
+ * handled immediately.
+ **/
+static void
+conf_delete_handler (ConfSource *source,
+		     NihWatch   *watch,
+		     const char *path)
+{
+	MetricsStall stall;
+
+	nih_assert (source != NULL);
+	nih_assert (watch != NULL);
+	nih_assert (path != NULL);
+
+	if (conf_reload_defer (source, path))
+		return;
+
+	metrics_stall_begin (&stall, "conf_delete_handler", path);
+	conf_file_deleted (source, watch, path);
+	metrics_stall_end (&stall);
+}
+
+/**
+ * conf_reload_defer:
+ * @source: configuration source,
+ * @path: full path that changed.
  *
- * Returns: zero on success, negative value on raised error.
+ * Add @path to the set of paths in @source to be reloaded once
+ * conf_reload_delay has elapsed, arming the timer if this is the first
+ * change since the last reload.  Paths that change repeatedly within
+ * the delay, such as when an editor writes, renames and then changes
+ * the mode of a file, are only reloaded once.
+ *
+ * Returns: TRUE if @path was deferred, FALSE if it should be handled
+ * immediately.
  **/
 static int
-conf_source_reload_dir (ConfSource *source)
+conf_reload_defer (ConfSource *source,
+		   const char *path)
 {
-	NihError *err = NULL;
+	NihListEntry      *entry;
+	struct itimerspec  timeout;
 
 	nih_assert (source != NULL);
-	nih_assert (source->type != CONF_FILE);
+	nih_assert (path != NULL);
 
-	if (! source->watch) {
-		source->watch = nih_watch_new (source, source->path,
-					       TRUE, TRUE,
-					       (NihFileFilter)conf_dir_filter,
-					       (NihCreateHandler)conf_create_modify_handler,
-					       (NihModifyHandler)conf_create_modify_handler,
-					       (NihDeleteHandler)conf_delete_handler,
-					       source);
+	if (conf_reload_delay <= 0)
+		return FALSE;
 
-		/* If successful, the directory tree will have been walked
-		 * already; so just mark the file descriptor close-on-exec
-		 * and return; otherwise we'll try and walk ourselves, so
-		 * stash the error for comparison.
-		 */
-		if (source->watch) {
-			nih_io_set_cloexec (source->watch->fd);
-			return 0;
-		} else {
-			err = nih_error_steal ();
+	if (! conf_reload_timer) {
+		int fd;
+
+		fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (fd < 0)
+			return FALSE;
+
+		conf_reload_timer = nih_io_add_watch (NULL, fd, NIH_IO_READ,
+						      conf_reload_pending, NULL);
+		if (! conf_reload_timer) {
+			close (fd);
+			return FALSE;
 		}
 	}
 
-	/* We're either performing a mandatory reload, or we failed to set
-	 * up an inotify watch; walk the directory tree the old fashioned
-	 * way.  If this fails too, then we can discard the inotify error
-	 * since this one will be better.
-	 */
-	if (nih_dir_walk (source->path, (NihFileFilter)conf_dir_filter,
-			  (NihFileVisitor)conf_file_visitor, NULL,
-			  source) < 0) {
-		if (err)
-			nih_free (err);
+	if (! source->pending) {
+		source->pending = nih_hash_string_new (source, 0);
+		if (! source->pending)
+			return FALSE;
+	}
 
-		return -1;
+	if (nih_hash_lookup (source->pending, path))
+		return TRUE;
+
+	entry = nih_list_entry_new (source->pending);
+	if (! entry)
+		return FALSE;
+
+	entry->str = nih_strdup (entry, path);
+	if (! entry->str) {
+		nih_free (entry);
+		return FALSE;
 	}
 
-	/* We were able to walk the directory, but were not able to set up
-	 * an inotify watch.  This isn't critical, so we just warn about it,
-	 * unless this is simply that inotify isn't supported, in which case
-	 * we do nothing.
-	 */
-	if (err) {
-		if (err->number != ENOSYS)
-			nih_warn ("%s: %s: %s", source->path,
-				  _("Unable to watch configuration directory"),
-				  err->message);
+	if (! conf_reload_timer_armed) {
+		memset (&timeout, 0, sizeof (timeout));
+		timeout.it_value.tv_sec = conf_reload_delay / 1000;
+		timeout.it_value.tv_nsec = (conf_reload_delay % 1000) * 1000000L;
 
-		nih_free (err);
+		if (timerfd_settime (conf_reload_timer->fd, 0, &timeout, NULL) < 0) {
+			nih_free (entry);
+			return FALSE;
+		}
+
+		conf_reload_timer_armed = TRUE;
 	}
 
-	return 0;
+	nih_hash_add (source->pending, &entry->entry);
+
+	return TRUE;
 }
 
+/**
+ * conf_reload_pending:
+ * @data: unused,
+ * @watch: NihIoWatch for conf_reload_timer,
+ * @events: events that occurred.
+ *
+ * Called once conf_reload_delay has elapsed since a change was deferred;
+ * reloads every deferred path of every source in one pass, treating
+ * each according to whether it still exists rather than the individual
+ * events that were reported for it.
+ **/
+static void
+conf_reload_pending (void        *data,
+		     NihIoWatch  *watch,
+		     NihIoEvents  events)
+{
+	uint64_t     expirations;
+	size_t       count = 0;
+	MetricsStall stall;
+
+	nih_assert (watch != NULL);
+	nih_assert (watch == conf_reload_timer);
+
+	if (read (watch->fd, &expirations, sizeof (expirations)) < 0) {
+		if (errno == EAGAIN)
+			return;
+
+		nih_warn ("%s: %s", _("Unable to read configuration reload timer"),
+			  strerror (errno));
+	}
+
+	conf_reload_timer_armed = FALSE;
+
+	metrics_stall_begin (&stall, "conf_reload_pending", NULL);
+
+	NIH_LIST_FOREACH (conf_sources, iter) {
+		ConfSource *source = (ConfSource *)iter;
+		NihHash    *pending;
+
+		if (! source->pending)
+			continue;
+
+		pending = source->pending;
+		source->pending = NULL;
+
+		NIH_HASH_FOREACH (pending, hiter) {
+			NihListEntry *entry = (NihListEntry *)hiter;
+			struct stat   statbuf;
+			MetricsStall  part;
+
+			/* The source itself may have been deleted */
+			if (! source->watch)
+				break;
+
+			metrics_stall_begin (&part, "conf_reload_pending",
+					     entry->str);
+
+			if (stat (entry->str, &statbuf) < 0) {
+				conf_file_deleted (source, source->watch,
+						   entry->str);
+			} else {
+				conf_file_changed (source, source->watch,
+						   entry->str, &statbuf);
+			}
+
+			metrics_stall_attribute (&stall, &part);
+			count++;
+		}
+
+		nih_unref (pending, source);
+	}
+
+	nih_debug ("Reloaded %zu changed configuration paths", count);
+	metrics_stall_end (&stall);
+}
 
 /**
- * conf_file_filter:
+ * conf_file_visitor:
  * @source: configuration source,
- * @path: path to check,
- * @is_dir: TRUE if @path is a directory.
+ * @dirname: top-level directory being walked,
+ * @path: path found in directory,
+ * @statbuf: stat of @path.
  *
- * When we watch the parent directory of a file for changes, we receive
- * notification about all changes to that directory.  We only care about
- * those that affect the path in @source, and the path that we're watching,
- * so we use this function to filter out all others.
+ * This function is called when walking a directory tree for each file
+ * found within it.
  *
- * Returns: FALSE if @path matches @source, TRUE otherwise.
+ * After checking that it's a regular file, we reload it.
+ *
+ * Returns: always zero.
  **/
 static int
-conf_file_filter (ConfSource *source,
-		  const char *path,
-		  int         is_dir)
+conf_file_visitor (ConfSource  *source,
+		   const char  *dirname,
+		   const char  *path,
+		   struct stat *statbuf)
 {
 	nih_assert (source != NULL);
+	nih_assert (dirname != NULL);
 	nih_assert (path != NULL);
+	nih_assert (statbuf != NULL);
 
-	if (! strcmp (source->path, path))
-		return FALSE;
-
-	if (! strcmp (source->watch->path, path))
-		return FALSE;
+	if (! S_ISREG (statbuf->st_mode))
+		return 0;
 
-	return TRUE;
+	if (is_conf_file_std (path) && (! conf_staged_defer (source, path)))
+		conf_load_path_with_override (source, path);
+	
+	return 0;      
 }
 
+
 /**
- * conf_dir_filter:
+ * CONF_STAGED_SEPARATORS:
+ *
+ * Characters that separate the words of a configuration file checked
+ * by conf_staged_defer(), including the parentheses that may enclose
+ * event names in start on and stop on conditions.
+ **/
+#define CONF_STAGED_SEPARATORS " \t\r\n\\()"
+
+/**
+ * conf_staged_defer:
  * @source: configuration source,
- * @path: path to check,
- * @is_dir: TRUE of @path is a directory.
+ * @path: path of job configuration file.
  *
- * This is the file filter used for the jobs directory, we only care
- * about paths with particular extensions (see IS_CONF_EXT).
+ * Called by conf_file_visitor() to decide whether @path can be passed
+ * over by a staged conf_reload(); job configuration outside of any
+ * session that doesn't mention conf_staged_event in either the file or
+ * its override file is queued on conf_staged, with its words, for
+ * conf_staged_load().
  *
- * Directories that match the nih_file_ignore() function are also ignored.
+ * The check is by word rather than by parsing the start on and stop on
+ * conditions, which is far quicker and can only err towards loading a
+ * file immediately.  Files that can't be read are loaded immediately so
+ * that the error is reported as usual.
  *
- * Returns: FALSE if @path ends in ".conf" or ".override",
- * or is the original source, TRUE otherwise.
+ * Returns: TRUE if @path was queued, FALSE if it should be loaded now.
  **/
 static int
-conf_dir_filter (ConfSource *source,
-		 const char *path,
-		 int         is_dir)
+conf_staged_defer (ConfSource *source,
+		   const char *path)
 {
+	ConfStaged     *staged;
+	nih_local char *name = NULL;
+	nih_local char *override_path = NULL;
+
 	nih_assert (source != NULL);
 	nih_assert (path != NULL);
 
-	if (! strcmp (source->path, path))
+	if ((! conf_staged_event) || (source->type != CONF_JOB_DIR)
+	    || source->session)
 		return FALSE;
 
-	if (is_dir)
-		return nih_file_ignore (NULL, path);
+	staged = NIH_MUST (nih_new (source, ConfStaged));
 
-	if (is_conf_file (path))
+	nih_list_init (&staged->entry);
+	nih_alloc_set_destructor (staged, conf_staged_destroy);
+
+	staged->source = source;
+	staged->path = NIH_MUST (nih_strdup (staged, path));
+	staged->words = NIH_MUST (nih_hash_string_new (staged, 0));
+
+	name = conf_to_job_name (source->path, path);
+	override_path = conf_get_best_override (name, source);
+
+	if ((conf_staged_add_words (staged->words, path) < 0)
+	    || (override_path
+		&& (conf_staged_add_words (staged->words,
+					   override_path) < 0))) {
+		NihError *err;
+
+		/* Reported when the file is loaded */
+		err = nih_error_get ();
+		nih_free (err);
+		nih_free (staged);
+
+		return FALSE;
+	}
+
+	if (nih_hash_lookup (staged->words, conf_staged_event)) {
+		nih_free (staged);
 		return FALSE;
+	}
+
+	if (! conf_staged)
+		conf_staged = NIH_MUST (nih_list_new (NULL));
+
+	nih_list_add (conf_staged, &staged->entry);
+	conf_staged_len++;
 
 	return TRUE;
 }
 
 /**
- * conf_load_path_with_override:
- * @source: configuration source
- * @conf_path: path to config file
+ * conf_staged_add_words:
+ * @words: hash table to add to,
+ * @path: path of file to read.
  *
- * Loads given @conf_path as a config file in a given @source. Then it
- * finds an override file. If an override file is found it applies it
- * as well.
+ * Adds each distinct word of the file at @path, other than those of
+ * comments, to @words as an NihListEntry.
+ *
+ * Returns: zero on success, negative value on raised error.
  **/
-static void
-conf_load_path_with_override (ConfSource *source,
-			      const char *conf_path)
+static int
+conf_staged_add_words (NihHash    *words,
+		       const char *path)
 {
-	int                     ret = 0;
-	const char   *error_path = NULL;
-	char      *override_path = NULL;
-	nih_local char *job_name = NULL;
+	nih_local char *buf = NULL;
+	size_t          len;
+	size_t          pos = 0;
 
-	nih_assert (source != NULL);
-	nih_assert (conf_path != NULL);
+	nih_assert (words != NULL);
+	nih_assert (path != NULL);
 
-	/* reload conf file */
-	nih_debug ("Loading configuration file %s", conf_path);
-	ret = conf_reload_path (source, conf_path, NULL);
-	if (ret < 0) {
-		error_path = conf_path;
-		goto error;
-	}
+	buf = nih_file_read (NULL, path, &len);
+	if (! buf)
+		return -1;
 
-	job_name = conf_to_job_name (source->path, conf_path);
-	override_path = conf_get_best_override (job_name, source);
-	if (! override_path)
-		return;
+	while (pos < len) {
+		NihListEntry *entry;
+		size_t        start;
 
-	/* overlay override settings */
-	nih_debug ("Loading override file %s for %s", conf_path, override_path);
-	ret = conf_reload_path (source, conf_path, override_path);
-	if (ret < 0) {
-		error_path = override_path;
-		goto error;
-	}
-	nih_free (override_path);
-	return;
+		if (strchr (CONF_STAGED_SEPARATORS, buf[pos])) {
+			pos++;
+			continue;
+		}
 
-error:
-	{
-		NihError *err;
+		if (buf[pos] == '#') {
+			while ((pos < len) && (buf[pos] != '\n'))
+				pos++;
+			continue;
+		}
 
-		err = nih_error_get ();
-		nih_error ("%s: %s: %s", error_path,
-			   _("Error while loading configuration file"),
-			   err->message);
-		nih_free (err);
-		if (override_path)
-			nih_free (override_path);
-		return;
+		start = pos;
+		while ((pos < len)
+		       && (! strchr (CONF_STAGED_SEPARATORS, buf[pos])))
+			pos++;
+
+		entry = NIH_MUST (nih_list_entry_new (words));
+		entry->str = NIH_MUST (nih_strndup (entry, buf + start,
+						    pos - start));
+
+		if (nih_hash_lookup (words, entry->str)) {
+			nih_free (entry);
+			continue;
+		}
+
+		nih_hash_add (words, &entry->entry);
 	}
-}
 
+	return 0;
+}
 
 /**
- * conf_create_modify_handler:
- * @source: configuration source,
- * @watch: NihWatch for source,
- * @path: full path to modified file,
- * @statbuf: stat of @path.
+ * conf_staged_destroy:
+ * @staged: entry to be destroyed.
  *
- * This function will be called whenever a file is created in a directory
- * that we're watching, moved into the directory we're watching, or is
- * modified.  This works for both directory and file sources, since the
- * watch for the latter is on the parent and filtered to only return the
- * path that we're interested in.
+ * Removes @staged from conf_staged, should it have been queued.
  *
- * After checking that it was a regular file that was changed, we reload it;
- * we expect this to fail sometimes since the file may be only partially
- * written.
+ * Returns: zero.
  **/
-static void
-conf_create_modify_handler (ConfSource  *source,
-			    NihWatch    *watch,
-			    const char  *path,
-			    struct stat *statbuf)
+static int
+conf_staged_destroy (ConfStaged *staged)
 {
-	ConfFile *file = NULL;
-	char *config_path = NULL;
-	nih_local char *job_name = NULL;
+	nih_assert (staged != NULL);
 
-	nih_assert (source != NULL);
-	nih_assert (watch != NULL);
-	nih_assert (path != NULL);
+	if (! NIH_LIST_EMPTY (&staged->entry))
+		conf_staged_len--;
 
-	/* note that symbolic links are ignored */
-	if (statbuf && ! S_ISREG (statbuf->st_mode))
-		return;
+	nih_list_destroy (&staged->entry);
 
-	/* ignore non-config file changes */
-	if (! is_conf_file (path))
-		return;
+	return 0;
+}
 
-        /* For config file, load it and it's override file */
-	if (is_conf_file_std (path)) {
-		conf_load_path_with_override (source, path);
+/**
+ * conf_staged_clear:
+ *
+ * Forget all files still queued by a staged conf_reload() without
+ * loading them, along with the cache entries kept for them.
+ **/
+static void
+conf_staged_clear (void)
+{
+	if (! conf_staged)
 		return;
-	}
 
-	/* For override files, reload all matching conf+override combos */
-	job_name = conf_to_job_name (source->path, path);
-	NIH_LIST_FOREACH (conf_sources, iter) {
-		ConfSource *source = (ConfSource *)iter;
+	NIH_LIST_FOREACH_SAFE (conf_staged, iter)
+		nih_free ((ConfStaged *)iter);
 
-		if (source->type == CONF_FILE)
-			continue;
+	nih_free (conf_staged);
+	conf_staged = NULL;
 
-		config_path = NIH_MUST (nih_sprintf (NULL, "%s/%s%s", source->path, job_name, CONF_EXT_STD));
-		file = (ConfFile *)nih_hash_lookup (source->files, config_path);
-		if (file) {
-			/* Find its override file and reload both */
-			conf_load_path_with_override (source, config_path);
-		}
-		nih_free (config_path);
+	if (conf_cache) {
+		json_object_put (conf_cache);
+		conf_cache = NULL;
 	}
 
-	return;
+	if (conf_cache_next) {
+		json_object_put (conf_cache_next);
+		conf_cache_next = NULL;
+	}
 }
 
 /**
- * conf_delete_handler:
- * @source: configuration source,
- * @watch: NihWatch for source,
- * @path: full path to deleted file.
+ * conf_staged_load:
+ * @max: most files to load, or zero for all.
  *
- * This function will be called whenever a file is removed or moved out
- * of a directory that we're watching.  This works for both directory and
- * file sources, since the watch for the latter is on the parent and
- * filtered to only return the path that we're interested in.
+ * Load up to @max of the job configuration files passed over by a
+ * staged conf_reload(), those wanted by a held event first (see
+ * conf_staged_wants()); once the last is loaded the configuration
+ * cache is saved as conf_reload() would have.
  *
- * We lookup the file in our hash table, and if we can find it, perform
- * the usual deletion of it.
+ * Errors are logged as for conf_reload().
+ *
+ * Returns: number of files still to be loaded.
  **/
-static void
-conf_delete_handler (ConfSource *source,
-		     NihWatch   *watch,
-		     const char *path)
+size_t
+conf_staged_load (size_t max)
 {
-	ConfFile *file;
-	nih_local char *new_path = NULL;
+	MetricsStall stall;
+	size_t       count = 0;
 
-	nih_assert (source != NULL);
-	nih_assert (watch != NULL);
-	nih_assert (path != NULL);
+	if (! conf_staged)
+		return 0;
 
-	/* Lookup the file in the source.  If we haven't parsed it, this
-	 * could actually mean that it was the top-level directory itself
-	 * that was deleted, in which case we free the watch, otherwise
-	 * it's probably a directory or something, so just ignore it.
-	 */
-	file = (ConfFile *)nih_hash_lookup (source->files, path);
-	/* Note we have to be careful to consider deletion of directories too.
-	 * This is handled implicitly by the override check which will return
-	 * false if passed a directory in this case.
-	 */
-	if (! file && ! is_conf_file_override (path)) {
-		if (! strcmp (watch->path, path)) {
-			nih_warn ("%s: %s", source->path,
-				  _("Configuration directory deleted"));
-			nih_unref (source->watch, source);
-			source->watch = NULL;
-		}
+	metrics_stall_begin (&stall, "conf_staged_load", NULL);
 
-		return;
+	while ((! NIH_LIST_EMPTY (conf_staged)) && ((! max) || (count < max))) {
+		ConfStaged *staged = (ConfStaged *)conf_staged->next;
+
+		conf_load_path_with_override (staged->source, staged->path);
+		nih_free (staged);
+
+		count++;
 	}
 
-	/* non-override files (and directories) are the simple case, so handle
-	 * them and leave.
-	 */
-	if (! is_conf_file_override (path)) {
-		nih_unref (file, source);
-		return;
+	if (NIH_LIST_EMPTY (conf_staged)) {
+		nih_free (conf_staged);
+		conf_staged = NULL;
+
+		conf_cache_save ();
 	}
 
-	/* Deleting override file is about the same as changing one.
-	 * We need to iterate across all matching jobs and reload them
-	 * with new "best" override file, if any.
-	 */
-	nih_debug ("Reloading configuration for matching configs on deletion of override (%s)",
-		   path);
-	conf_create_modify_handler (source, watch, path, NULL);
+	metrics_stall_end (&stall);
+
+	return conf_staged_len;
 }
 
 /**
- * conf_file_visitor:
- * @source: configuration source,
- * @dirname: top-level directory being walked,
- * @path: path found in directory,
- * @statbuf: stat of @path.
- *
- * This function is called when walking a directory tree for each file
- * found within it.
+ * conf_staged_wants:
+ * @name: name of event.
  *
- * After checking that it's a regular file, we reload it.
+ * Determine whether any job configuration file yet to be loaded by
+ * conf_staged_load() mentions @name, in which case the event must be
+ * held until it has been, since the file may define a job that starts
+ * or stops on it.  Files that do are moved to the front of the queue
+ * so that they are loaded next.
  *
- * Returns: always zero.
+ * Returns: TRUE if an event named @name must be held, FALSE otherwise.
  **/
-static int
-conf_file_visitor (ConfSource  *source,
-		   const char  *dirname,
-		   const char  *path,
-		   struct stat *statbuf)
+int
+conf_staged_wants (const char *name)
 {
-	nih_assert (source != NULL);
-	nih_assert (dirname != NULL);
-	nih_assert (path != NULL);
-	nih_assert (statbuf != NULL);
+	NihList *last;
 
-	if (! S_ISREG (statbuf->st_mode))
-		return 0;
+	nih_assert (name != NULL);
 
-	if (is_conf_file_std (path))
-		conf_load_path_with_override (source, path);
-	
-	return 0;      
+	if (! conf_staged)
+		return FALSE;
+
+	last = conf_staged;
+
+	NIH_LIST_FOREACH_SAFE (conf_staged, iter) {
+		ConfStaged *staged = (ConfStaged *)iter;
+
+		if (! nih_hash_lookup (staged->words, name))
+			continue;
+
+		nih_list_add_after (last, &staged->entry);
+		last = &staged->entry;
+	}
+
+	return (last != conf_staged);
 }
 
 
@@ -1071,7 +2789,9 @@ conf_reload_path (ConfSource *source,
 {
 	ConfFile       *file = NULL;
 	ConfFile       *orig = NULL;
+	ConfPrefetch   *prefetch;
 	nih_local char *buf = NULL;
+	const char     *data;
 	nih_local char *name = NULL;
 	size_t          len, pos, lineno;
 	NihError       *err = NULL;
@@ -1082,6 +2802,8 @@ conf_reload_path (ConfSource *source,
 
 	path_to_load = (override_path ? override_path : path);
 
+	UPSTART_PROBE (conf_reload_path, source->path, path_to_load);
+
 	/* If there is no corresponding override file, look up the old
 	 * conf file in memory, and then free it. In cases of failure,
 	 * we discard it anyway, so there's no particular reason
@@ -1126,10 +2848,20 @@ conf_reload_path (ConfSource *source,
 
 	/* Read the file into memory for parsing, if this fails we don't
 	 * bother creating a new ConfFile structure for it and bail out
-	 * now.
+	 * now.  It may already have been read for us by
+	 * conf_prefetch().
 	 */
-	buf = nih_file_read (NULL, path_to_load, &len);
-	if (! buf) {
+	prefetch = (conf_prefetched
+		    ? (ConfPrefetch *)nih_hash_lookup (conf_prefetched, path_to_load)
+		    : NULL);
+	if (prefetch && prefetch->ok) {
+		data = prefetch->buf;
+		len = prefetch->len;
+	} else {
+		data = buf = nih_file_read (NULL, path_to_load, &len);
+	}
+
+	if (! data) {
 		if (! override_path && orig) {
 			/* Failed to reload the file from disk in all
 			 * likelihood because the configuration file was
@@ -1165,7 +2897,7 @@ conf_reload_path (ConfSource *source,
 					(source->type == CONF_DIR ? "directory" : "file"), path);
 		}
 
-		if (parse_conf (file, buf, len, &pos, &lineno) < 0)
+		if (parse_conf (file, data, len, &pos, &lineno) < 0)
 			err = nih_error_get ();
 
 		break;
@@ -1184,13 +2916,14 @@ conf_reload_path (ConfSource *source,
 		}
 
 		file->job = parse_job (NULL, source->session, file->job,
-				name, buf, len, &pos, &lineno);
+				name, data, len, &pos, &lineno);
 
 		/* Allow the original ConfFile which has now been replaced to be
 		 * destroyed which will also cause the original JobClass to be
 		 * freed.
 		 */
 		if (file->job) {
+			conf_file_index (file);
 			job_class_consider (file->job);
 		} else {
 			err = nih_error_get ();
@@ -1223,8 +2956,14 @@ conf_reload_path (ConfSource *source,
 		case PARSE_ILLEGAL_EXIT:
 		case PARSE_ILLEGAL_UMASK:
 		case PARSE_ILLEGAL_NICE:
+		case PARSE_ILLEGAL_PRIORITY:
 		case PARSE_ILLEGAL_OOM:
 		case PARSE_ILLEGAL_LIMIT:
+		case PARSE_ILLEGAL_PLACEMENT:
+		case PARSE_ILLEGAL_SCHED:
+		case PARSE_ILLEGAL_IOPRIO:
+		case PARSE_ILLEGAL_TIMER_SLACK:
+		case PARSE_ILLEGAL_JITTER:
 		case PARSE_EXPECTED_EVENT:
 		case PARSE_EXPECTED_OPERATOR:
 		case PARSE_EXPECTED_VARIABLE:
@@ -1232,6 +2971,7 @@ conf_reload_path (ConfSource *source,
 			nih_error ("%s:%zi: %s", path_to_load, lineno, err->message);
 			nih_free (err);
 			err = NULL;
+			conf_errors++;
 			break;
 		}
 	}
@@ -1265,6 +3005,7 @@ conf_file_destroy (ConfFile *file)
 	nih_assert (file != NULL);
 
 	nih_list_destroy (&file->entry);
+	nih_list_destroy (&file->job_entry);
 
 	switch (file->source->type) {
 	case CONF_FILE:
@@ -1297,6 +3038,40 @@ conf_file_destroy (ConfFile *file)
 }
 
 
+/**
+ * conf_file_index:
+ * @file: file that has defined a job.
+ *
+ * Adds @file to the index of files that have defined a job with the name
+ * of its job, so that conf_select_job() finds it.  This must be called
+ * whenever the job member of a ConfFile is set.
+ **/
+void
+conf_file_index (ConfFile *file)
+{
+	ConfJobIndex *index;
+
+	nih_assert (file != NULL);
+	nih_assert (file->job != NULL);
+
+	conf_init ();
+
+	index = (ConfJobIndex *)nih_hash_lookup (conf_jobs, file->job->name);
+	if (! index) {
+		index = NIH_MUST (nih_new (conf_jobs, ConfJobIndex));
+
+		nih_list_init (&index->entry);
+		nih_list_init (&index->files);
+		nih_alloc_set_destructor (index, nih_list_destroy);
+
+		index->name = NIH_MUST (nih_strdup (index, file->job->name));
+
+		nih_hash_add (conf_jobs, &index->entry);
+	}
+
+	nih_list_add (&index->files, &file->job_entry);
+}
+
 /**
  * conf_select_job:
  * @name: name of job class to locate,
@@ -1305,15 +3080,25 @@ conf_file_destroy (ConfFile *file)
  * Select the best available class of a job named @name from the registered
  * configuration sources.
  *
+ * Only the files indexed under @name by conf_file_index() are considered,
+ * in the order of their sources; files since removed from their source,
+ * such as those being replaced or destroyed, are ignored.
+ *
  * Returns: Best available job class or NULL if none available.
  **/
 JobClass *
 conf_select_job (const char *name, const Session *session)
 {
+	ConfJobIndex *index;
+
 	nih_assert (name != NULL);
 
 	conf_init ();
 
+	index = (ConfJobIndex *)nih_hash_lookup (conf_jobs, name);
+	if (! index)
+		return NULL;
+
 	NIH_LIST_FOREACH (conf_sources, iter) {
 		ConfSource *source = (ConfSource *)iter;
 
@@ -1323,8 +3108,15 @@ conf_select_job (const char *name, const Session *session)
 		if (source->session != session)
 			continue;
 
-		NIH_HASH_FOREACH (source->files, file_iter) {
-			ConfFile *file = (ConfFile *)file_iter;
+		NIH_LIST_FOREACH (&index->files, file_iter) {
+			ConfFile *file = (ConfFile *)((char *)file_iter
+						      - offsetof (ConfFile, job_entry));
+
+			if (file->source != source)
+				continue;
+
+			if (NIH_LIST_EMPTY (&file->entry))
+				continue;
 
 			if (! file->job)
 				continue;
@@ -1692,6 +3484,14 @@ conf_file_serialise (const ConfFile *file)
 
 	json_object_object_add (json, "job_class", json_job_class);
 
+	/* The key only identifies the registered JobClass when that is
+	 * the one parsed from this file; otherwise the file has been
+	 * modified while instances of the old class were running.
+	 */
+	if (file->key && (registered == file->job)
+	    && ! state_set_json_string_var_from_obj (json, file, key))
+		goto error;
+
 out:
 	return json;
 
@@ -1738,6 +3538,12 @@ conf_file_deserialise (ConfSource *source, json_object *json)
 	if (! state_get_json_int_var_to_obj (json, file, flag))
 		goto error;
 
+	/* Older versions did not record the key */
+	if (json_object_object_get_ex (json, "key", NULL)) {
+		if (! state_get_json_string_var_to_obj (json, file, key))
+			goto error;
+	}
+
 	return file;
 
 error:
@@ -1828,6 +3634,142 @@ conf_source_get_index (const ConfSource *source)
 	return -1;
 }
 
+/**
+ * conf_job_loaded:
+ * @source: configuration source,
+ * @path: path of job configuration file just loaded.
+ *
+ * Called once the job defined by @path, including any override, has been
+ * completely loaded.  Its immutable parts are shared with identical jobs
+ * from other sources (typically those of other sessions), and when
+ * conf_lazy_load is set the parts only needed to run it are dropped,
+ * provided it has no start on condition and so may never be run at all.
+ **/
+static void
+conf_job_loaded (ConfSource *source,
+		 const char *path)
+{
+	ConfFile *file;
+
+	nih_assert (source != NULL);
+	nih_assert (path != NULL);
+
+	if (source->type != CONF_JOB_DIR)
+		return;
+
+	file = (ConfFile *)nih_hash_lookup (source->files, path);
+	if (! file || ! file->job)
+		return;
+
+	job_class_share (file->job);
+
+	if (! conf_lazy_load || file->job->start_on)
+		return;
+
+	job_class_unload (file->job);
+}
+
+/**
+ * conf_file_load_job:
+ * @class: job class to load.
+ *
+ * Parse the configuration file (and any override file) that @class was
+ * loaded from again, and complete @class with the parts of the definition
+ * dropped by job_class_unload().
+ *
+ * Only the dropped parts are taken from the file, so should it have been
+ * modified and not yet reloaded, the start and stop conditions of @class
+ * are unaffected; the reload will replace the class as normal.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+conf_file_load_job (JobClass *class)
+{
+	ConfSource     *source = NULL;
+	ConfFile       *file = NULL;
+	JobClass       *parsed = NULL;
+	nih_local char *override_path = NULL;
+	const char     *paths[2];
+
+	nih_assert (class != NULL);
+
+	file = conf_job_file (class);
+	if (! file) {
+		errno = ENOENT;
+		nih_return_system_error (-1);
+	}
+
+	source = file->source;
+
+	override_path = conf_get_best_override (class->name, source);
+
+	paths[0] = file->path;
+	paths[1] = override_path;
+
+	for (int i = 0; i < 2 && paths[i]; i++) {
+		nih_local char *buf = NULL;
+		JobClass       *ret;
+		size_t          len, pos = 0, lineno = 1;
+
+		buf = nih_file_read (NULL, paths[i], &len);
+		if (! buf)
+			goto error;
+
+		ret = parse_job (NULL, source->session, parsed, class->name,
+				 buf, len, &pos, &lineno);
+		if (! ret)
+			goto error;
+
+		parsed = ret;
+	}
+
+	job_class_load_from (class, parsed);
+	nih_free (parsed);
+
+	job_class_share (class);
+
+	return 0;
+
+error:
+	if (parsed)
+		nih_free (parsed);
+
+	return -1;
+}
+
+/**
+ * conf_job_file:
+ * @class: job class.
+ *
+ * Returns: the ConfFile that @class was loaded from, or NULL if there
+ * is none.
+ **/
+static ConfFile *
+conf_job_file (const JobClass *class)
+{
+	nih_assert (class != NULL);
+
+	conf_init ();
+
+	NIH_LIST_FOREACH (conf_sources, iter) {
+		ConfSource *source = (ConfSource *)iter;
+
+		if (source->type != CONF_JOB_DIR
+		    || source->session != class->session)
+			continue;
+
+		NIH_HASH_FOREACH (source->files, file_iter) {
+			ConfFile *file = (ConfFile *)file_iter;
+
+			if (file->job == class)
+				return file;
+		}
+	}
+
+	return NULL;
+}
+
 /**
  * conf_file_find:
  *
@@ -53,7 +53,8 @@ typedef enum conf_source_type {
  * @type: type of source,
  * @watch: NihWatch structure for automatic change notification,
  * @flag: reload flag,
- * @files: hash table of files.
+ * @files: hash table of files,
+ * @pending: hash table of changed paths awaiting reload.
  *
  * This structure represents a single source of configuration, which may be
  * a single file or a directory of files of various types, depending on
@@ -63,6 +64,9 @@ typedef enum conf_source_type {
  * automatically, however mandatory reloading is also supported; for this
  * the @flag member is toggled, and copied to all files reloaded;
  * any that are in the old state are deleted.
+ *
+ * When conf_reload_delay is non-zero, paths reported by inotify are
+ * collected in @pending and reloaded together once the delay expires.
  **/
 typedef struct conf_source {
 	NihList             entry;
@@ -74,6 +78,8 @@ typedef struct conf_source {
 
 	int                 flag;
 	NihHash            *files;
+
+	NihHash            *pending;
 } ConfSource;
 
 /**
@@ -82,7 +88,10 @@ typedef struct conf_source {
  * @path: path to file,
  * @source: configuration source,
  * @flag: reload flag,
- * @data: pointer to actual item.
+ * @key: identity of the revision of the file, and of any override file,
+ *  that @job was parsed from (see conf_cache_key()), or NULL,
+ * @data: pointer to actual item,
+ * @job_entry: entry in the ConfJobIndex for the name of @job.
  *
  * This structure represents a file within @source and links to the item
  * parsed from it.
@@ -98,17 +107,53 @@ typedef struct conf_file {
 
 	ConfSource *source;
 	int         flag;
+	char       *key;
 
 	union {
 		void     *data;
 		JobClass *job;
 	};
+
+	NihList     job_entry;
 } ConfFile;
 
+/**
+ * ConfJobIndex:
+ * @entry: list header,
+ * @name: name of job,
+ * @files: ConfFile structures, linked by their job_entry member, that
+ *  have defined a job named @name.
+ *
+ * Used to find the files that may provide the best class of a job without
+ * looking through every file of every source; see conf_select_job().
+ **/
+typedef struct conf_job_index {
+	NihList  entry;
+	char    *name;
+	NihList  files;
+} ConfJobIndex;
+
+
+/**
+ * CONF_RELOAD_DELAY:
+ *
+ * Default number of milliseconds to collect configuration changes for
+ * before reloading them.
+ **/
+#define CONF_RELOAD_DELAY 100
+
 
 NIH_BEGIN_EXTERN
 
-extern NihList *conf_sources;
+extern NihList    *conf_sources;
+extern const char *conf_cache_file;
+extern int         conf_reload_delay;
+extern int         conf_load_threads;
+extern int         conf_lazy_load;
+extern int         conf_reuse_state;
+extern int         conf_watch_defer;
+extern const char *conf_staged_event;
+extern int         conf_errors;
 
 
 void        conf_init          (void);
@@ -121,6 +166,10 @@ ConfFile *  conf_file_new      (ConfSource *source, const char *path)
 	__attribute__ ((warn_unused_result));
 
 void        conf_reload        (void);
+void        conf_cache_invalidate (void);
+void        conf_watch_sources (void);
+size_t      conf_staged_load   (size_t max);
+int         conf_staged_wants  (const char *name);
 int         conf_source_reload (ConfSource *source)
 	__attribute__ ((warn_unused_result));
 
@@ -168,10 +217,21 @@ ssize_t
 conf_source_get_index (const ConfSource *source)
 	__attribute__ ((warn_unused_result));
 
+void
+conf_file_index (ConfFile *file);
+
 ConfFile *
 conf_file_find (const char *name, const Session *session)
 	__attribute__ ((warn_unused_result));
 
+int
+conf_file_load_job (JobClass *class)
+	__attribute__ ((warn_unused_result));
+
+json_object *
+conf_cache_entry (const JobClass *class)
+	__attribute__ ((warn_unused_result));
+
 #ifdef DEBUG
 
 /* used for debugging only */
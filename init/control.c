@@ -26,8 +26,10 @@
 #include <dbus/dbus.h>
 
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <nih/macros.h>
@@ -60,6 +62,12 @@
 #include "events.h"
 #include "paths.h"
 #include "xdg.h"
+#include "subscription.h"
+#include "event_limit.h"
+#include "alloc_pool.h"
+#include "metrics.h"
+#include "status_page.h"
+#include "event_history.h"
 
 #include "com.ubuntu.Upstart.h"
 #include "org.freedesktop.DBus.h"
@@ -78,8 +86,18 @@ static int   control_get_origin_uid      (NihDBusMessage *message, uid_t *uid)
 	__attribute__ ((warn_unused_result));
 static int   control_check_permission    (NihDBusMessage *message)
 	__attribute__ ((warn_unused_result));
+static char *control_emitter             (const void *parent,
+					  NihDBusMessage *message)
+	__attribute__ ((warn_unused_result, malloc));
+static int   control_add_blocked_edge    (const void *parent,
+					  ControlGetConditionGraphBlockedElement ***list,
+					  size_t *len, Event *event, Job *job,
+					  const char *waiting)
+	__attribute__ ((warn_unused_result));
 static void  control_session_file_create (void);
 static void  control_session_file_remove (void);
+static void  control_job_change_init     (void);
+static void  control_job_change_forget   (const char *path);
 
 /**
  * use_session_bus:
@@ -135,6 +153,49 @@ DBusConnection *control_bus = NULL;
  **/
 NihList *control_conns = NULL;
 
+/**
+ * control_state_fork:
+ *
+ * If TRUE, state requested by GetState is serialised by a child process
+ * (see state_snapshot()) rather than while other requests wait.
+ **/
+int control_state_fork = FALSE;
+
+/**
+ * control_runlevel:
+ * control_prevlevel:
+ *
+ * Runlevel given by the most recent runlevel event, and the runlevel
+ * before it; 'N' until the first such event.
+ **/
+static int control_runlevel = 'N';
+static int control_prevlevel = 'N';
+
+/**
+ * ControlJobChange:
+ * @entry: list header,
+ * @path: object path of job class,
+ * @start_on: start on condition of class, or NULL if removed,
+ * @stop_on: stop on condition of class, or NULL if removed.
+ *
+ * A job class added or removed since the JobsChanged signal was last
+ * emitted, with the conditions of an added class taken when it was.
+ **/
+typedef struct control_job_change {
+	NihList   entry;
+	char     *path;
+	char   ***start_on;
+	char   ***stop_on;
+} ControlJobChange;
+
+/**
+ * control_job_changes:
+ *
+ * Job classes added and removed since the JobsChanged signal was last
+ * emitted, as ControlJobChange entries in the order they happened.
+ **/
+static NihList *control_job_changes = NULL;
+
 /* External definitions */
 extern int      user_mode;
 extern int      disable_respawn;
@@ -394,6 +455,9 @@ control_disconnected (DBusConnection *conn)
 		control_bus = NULL;
 	}
 
+	subscription_disconnected (conn);
+	session_disconnected (conn);
+
 	/* Remove from the connections list */
 	NIH_LIST_FOREACH_SAFE (control_conns, iter) {
 		NihListEntry *entry = (NihListEntry *)iter;
@@ -419,15 +483,18 @@ control_register_all (DBusConnection *conn)
 	job_class_init ();
 
 	/* Register the manager object, this is the primary point of contact
-	 * for clients.  We only check for success, otherwise we're happy
-	 * to let this object be tied to the lifetime of the connection.
+	 * for clients and also carries the Metrics interface.  We only
+	 * check for success, otherwise we're happy to let this object be
+	 * tied to the lifetime of the connection.
 	 */
 	NIH_MUST (nih_dbus_object_new (NULL, conn, DBUS_PATH_UPSTART,
 				       control_interfaces, NULL));
 
-	/* Register objects for each currently registered job and its
-	 * instances.
+	/* Register objects for each currently registered job, and the
+	 * fallback through which their instances are reached.
 	 */
+	job_register_fallback (conn);
+
 	NIH_HASH_FOREACH (job_classes, iter) {
 		JobClass *class = (JobClass *)iter;
 
@@ -467,6 +534,7 @@ control_reload_configuration (void           *data,
 	nih_info (_("Reloading configuration"));
 
 	/* This can only be called after deserialisation */
+	conf_cache_invalidate ();
 	conf_reload ();
 
 	return 0;
@@ -515,6 +583,11 @@ control_get_job_by_name (void            *data,
 	/* Get the relevant session */
 	session = session_from_dbus (NULL, message);
 
+	/* Any configuration a staged startup has yet to load might
+	 * define the job.
+	 */
+	conf_staged_load (0);
+
 	/* Lookup the job */
 	class = (JobClass *)nih_hash_search (job_classes, name, NULL);
 
@@ -587,6 +660,8 @@ control_get_all_jobs (void             *data,
 	/* Get the relevant session */
 	session = session_from_dbus (NULL, message);
 
+	conf_staged_load (0);
+
 	NIH_HASH_FOREACH (job_classes, iter) {
 		JobClass *class = (JobClass *)iter;
 
@@ -607,240 +682,1372 @@ control_get_all_jobs (void             *data,
 	return 0;
 }
 
-
-int
-control_emit_event (void            *data,
-		    NihDBusMessage  *message,
-		    const char      *name,
-		    char * const    *env,
-		    int              wait)
-{
-	return control_emit_event_with_file (data, message, name, env, wait, -1);
-}
-
 /**
- * control_emit_event_with_file:
+ * control_get_all_job_states:
  * @data: not used,
  * @message: D-Bus connection and message received,
- * @name: name of event to emit,
- * @env: environment of environment,
- * @wait: whether to wait for event completion before returning,
- * @file: file descriptor.
- *
- * Implements the top half of the EmitEvent method of the com.ubuntu.Upstart
- * interface, the bottom half may be found in event_finished().
+ * @pattern: glob that job names must match, or empty for all jobs,
+ * @states: pointer for array of job states.
  *
- * Called to emit an event with a given @name and @env, which will be
- * added to the event queue and processed asynchronously.  If @name or
- * @env are not valid, the org.freedesktop.DBus.Error.InvalidArgs D-Bus
- * error will be returned immediately.  If the event fails, the
- * com.ubuntu.Upstart.Error.EventFailed D-Bus error will be returned when
- * the event finishes.
+ * Implements the GetAllJobStates method of the com.ubuntu.Upstart
+ * interface.
  *
- * When @wait is TRUE the method call will not return until the event
- * has completed, which means that all jobs affected by the event have
- * finished starting (running for tasks) or stopping; when @wait is FALSE,
- * the method call returns once the event has been queued.
+ * Called to obtain the status of every known job class whose name
+ * matches @pattern in a single call, rather than a call for each class
+ * and instance.  An entry is stored in @states for each instance giving
+ * the class name, instance name, goal, state, and the names of its
+ * running processes with their pids at the same index; classes without
+ * instances have one entry with an empty instance name, a goal of stop
+ * and a state of waiting.
  *
  * Returns: zero on success, negative value on raised error.
  **/
 int
-control_emit_event_with_file (void            *data,
-			      NihDBusMessage  *message,
-			      const char      *name,
-			      char * const    *env,
-			      int              wait,
-			      int              file)
+control_get_all_job_states (void                                   *data,
+			    NihDBusMessage                         *message,
+			    const char                             *pattern,
+			    ControlGetAllJobStatesStatesElement  ***states)
 {
-	Event    *event;
-	Blocked  *blocked;
+	Session                              *session;
+	ControlGetAllJobStatesStatesElement **list;
+	size_t                                len = 0;
+	size_t                                num = 0;
 
 	nih_assert (message != NULL);
-	nih_assert (name != NULL);
-	nih_assert (env != NULL);
+	nih_assert (pattern != NULL);
+	nih_assert (states != NULL);
 
-	if (! control_check_permission (message)) {
-		nih_dbus_error_raise_printf (
-			DBUS_INTERFACE_UPSTART ".Error.PermissionDenied",
-			_("You do not have permission to emit an event"));
-		return -1;
-	}
+	job_class_init ();
 
-	/* Verify that the name is valid */
-	if (! strlen (name)) {
-		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
-					     _("Name may not be empty string"));
-		close (file);
-		return -1;
-	}
+	/* Get the relevant session */
+	session = session_from_dbus (NULL, message);
 
-	/* Verify that the environment is valid */
-	if (! environ_all_valid (env)) {
-		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
-					     _("Env must be KEY=VALUE pairs"));
-		close (file);
-		return -1;
-	}
+	/* Count the entries first so the reply is allocated once */
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+		size_t    instances = 0;
 
-	/* Make the event and block the message on it */
-	event = event_new (NULL, name, (char **)env);
-	if (! event) {
-		nih_error_raise_system ();
-		close (file);
-		return -1;
-	}
+		if ((class->session || (session && session->chroot))
+		    && (class->session != session))
+			continue;
 
-	event->fd = file;
-	if (event->fd >= 0) {
-		long flags;
+		if (*pattern && fnmatch (pattern, class->name, 0))
+			continue;
 
-		flags = fcntl (event->fd, F_GETFD);
-		flags &= ~FD_CLOEXEC;
-		fcntl (event->fd, F_SETFD, flags);
+		NIH_HASH_FOREACH (class->instances, job_iter)
+			instances++;
+
+		len += instances ? instances : 1;
 	}
 
-	/* Obtain the session */
-	event->session = session_from_dbus (NULL, message);
+	list = nih_alloc (message, sizeof (ControlGetAllJobStatesStatesElement *)
+			  * (len + 1));
+	if (! list)
+		nih_return_no_memory_error (-1);
 
-	if (wait) {
-		blocked = blocked_new (event, BLOCKED_EMIT_METHOD, message);
-		if (! blocked) {
-			nih_error_raise_system ();
-			nih_free (event);
-			close (file);
-			return -1;
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+		int       instances = FALSE;
+
+		if ((class->session || (session && session->chroot))
+		    && (class->session != session))
+			continue;
+
+		if (*pattern && fnmatch (pattern, class->name, 0))
+			continue;
+
+		NIH_HASH_FOREACH (class->instances, job_iter) {
+			Job                                 *job = (Job *)job_iter;
+			ControlGetAllJobStatesStatesElement *state;
+			size_t                               names_len = 0;
+
+			instances = TRUE;
+
+			state = nih_new (list, ControlGetAllJobStatesStatesElement);
+			if (! state)
+				goto error;
+
+			list[num++] = state;
+
+			state->item0 = nih_strdup (state, class->name);
+			state->item1 = nih_strdup (state, job->name);
+			state->item2 = nih_strdup (state, job_goal_name (job->goal));
+			state->item3 = nih_strdup (state, job_state_name (job->state));
+			state->item4 = nih_str_array_new (state);
+			state->item5 = nih_alloc (state, sizeof (int32_t) * PROCESS_LAST);
+			state->item5_len = 0;
+
+			if (! (state->item0 && state->item1 && state->item2
+			       && state->item3 && state->item4 && state->item5))
+				goto error;
+
+			/* Processes are listed in the same order as the
+			 * processes property, main first.
+			 */
+			for (int i = 0; i < PROCESS_LAST; i++) {
+				if (job->pid[i] <= 0)
+					continue;
+
+				if (! nih_str_array_add (&state->item4, state,
+							 &names_len,
+							 process_name (i)))
+					goto error;
+
+				state->item5[state->item5_len++] = job->pid[i];
+			}
 		}
 
-		nih_list_add (&event->blocking, &blocked->entry);
-	} else {
-		NIH_ZERO (control_emit_event_reply (message));
+		if (! instances) {
+			ControlGetAllJobStatesStatesElement *state;
+
+			state = nih_new (list, ControlGetAllJobStatesStatesElement);
+			if (! state)
+				goto error;
+
+			list[num++] = state;
+
+			state->item0 = nih_strdup (state, class->name);
+			state->item1 = nih_strdup (state, "");
+			state->item2 = nih_strdup (state, job_goal_name (JOB_STOP));
+			state->item3 = nih_strdup (state, job_state_name (JOB_WAITING));
+			state->item4 = nih_str_array_new (state);
+			state->item5 = NULL;
+			state->item5_len = 0;
+
+			if (! (state->item0 && state->item1 && state->item2
+			       && state->item3 && state->item4))
+				goto error;
+		}
 	}
 
+	nih_assert (num == len);
+	list[num] = NULL;
+
+	*states = list;
+
 	return 0;
-}
 
+error:
+	nih_free (list);
+	nih_return_no_memory_error (-1);
+}
 
 /**
- * control_get_version:
+ * control_get_job_event_names:
  * @data: not used,
  * @message: D-Bus connection and message received,
- * @version: pointer for reply string.
+ * @pattern: glob that event names must match, or empty for all events,
+ * @names: pointer for array of event names.
  *
- * Implements the get method for the version property of the
- * com.ubuntu.Upstart interface.
+ * Implements the GetJobEventNames method of the com.ubuntu.Upstart
+ * interface.
  *
- * Called to obtain the version of the init daemon, which will be stored
- * as a string in @version.
+ * Called to obtain the names of the events referenced by the start on
+ * and stop on conditions of the known jobs that match @pattern, which
+ * will be stored in @names; this allows the source of events to only
+ * send those that could affect a job.
  *
  * Returns: zero on success, negative value on raised error.
  **/
 int
-control_get_version (void *          data,
-		     NihDBusMessage *message,
-		     char **         version)
+control_get_job_event_names (void            *data,
+			     NihDBusMessage  *message,
+			     const char      *pattern,
+			     char          ***names)
 {
+	Session *session;
+	char   **list;
+	size_t   len = 0;
+
 	nih_assert (message != NULL);
-	nih_assert (version != NULL);
+	nih_assert (pattern != NULL);
+	nih_assert (names != NULL);
 
-	*version = nih_strdup (message, package_string);
-	if (! *version)
+	job_class_init ();
+
+	list = nih_str_array_new (message);
+	if (! list)
 		nih_return_no_memory_error (-1);
 
-	return 0;
-}
+	/* Get the relevant session */
+	session = session_from_dbus (NULL, message);
 
-/**
- * control_get_log_priority:
- * @data: not used,
- * @message: D-Bus connection and message received,
- * @log_priority: pointer for reply string.
- *
- * Implements the get method for the log_priority property of the
- * com.ubuntu.Upstart interface.
- *
- * Called to obtain the init daemon's current logging level, which will
- * be stored as a string in @log_priority.
- *
- * Returns: zero on success, negative value on raised error.
- **/
-int
-control_get_log_priority (void *          data,
-			  NihDBusMessage *message,
-			  char **         log_priority)
-{
-	const char *priority;
+	NIH_HASH_FOREACH (job_class_events, iter) {
+		JobClassEventIndex *index = (JobClassEventIndex *)iter;
 
-	nih_assert (message != NULL);
-	nih_assert (log_priority != NULL);
+		if (*pattern && fnmatch (pattern, index->name, 0))
+			continue;
 
-	switch (nih_log_priority) {
-	case NIH_LOG_DEBUG:
-		priority = "debug";
-		break;
-	case NIH_LOG_INFO:
-		priority = "info";
-		break;
-	case NIH_LOG_MESSAGE:
-		priority = "message";
-		break;
-	case NIH_LOG_WARN:
-		priority = "warn";
-		break;
-	case NIH_LOG_ERROR:
-		priority = "error";
-		break;
-	case NIH_LOG_FATAL:
-		priority = "fatal";
-		break;
-	default:
-		nih_assert_not_reached ();
+		NIH_LIST_FOREACH (&index->classes, class_iter) {
+			NihListEntry *entry = (NihListEntry *)class_iter;
+			JobClass     *class = (JobClass *)entry->data;
+
+			if ((class->session || (session && session->chroot))
+			    && (class->session != session))
+				continue;
+
+			if (! nih_str_array_add (&list, message, &len,
+						 index->name)) {
+				nih_free (list);
+				nih_return_no_memory_error (-1);
+			}
+
+			break;
+		}
 	}
 
-	*log_priority = nih_strdup (message, priority);
-	if (! *log_priority)
-		nih_return_no_memory_error (-1);
+	*names = list;
 
 	return 0;
 }
 
+
 /**
- * control_set_log_priority:
+ * control_get_condition_graph:
  * @data: not used,
  * @message: D-Bus connection and message received,
- * @log_priority: string log priority to be set.
+ * @runtime: TRUE to also return the edges blocked now,
+ * @jobs: pointer for array of job conditions,
+ * @blocked: pointer for array of blocked edges.
  *
- * Implements the get method for the log_priority property of the
- * com.ubuntu.Upstart interface.
+ * Implements the GetConditionGraph method of the com.ubuntu.Upstart
+ * interface.
  *
- * Called to change the init daemon's current logging level to that given
- * as a string in @log_priority.  If the string is not recognised, the
- * com.ubuntu.Upstart.Error.InvalidLogPriority error will be returned.
+ * Called to obtain the whole condition graph in a single call, rather
+ * than a call for each property of each class.  An entry is stored in
+ * @jobs for each class giving its name, its start on and stop on
+ * conditions flattened by job_class_condition_array() and the events
+ * it emits.
+ *
+ * When @runtime is TRUE, an entry is stored in @blocked for each event
+ * waiting for a job instance to finish and for each job instance waiting
+ * for an event to finish, giving the event name, class name, instance
+ * name and "event" or "job" for whichever is waiting; otherwise @blocked
+ * is empty.
  *
  * Returns: zero on success, negative value on raised error.
  **/
 int
-control_set_log_priority (void *          data,
-			  NihDBusMessage *message,
-			  const char *    log_priority)
+control_get_condition_graph (void                                      *data,
+			     NihDBusMessage                            *message,
+			     int                                        runtime,
+			     ControlGetConditionGraphJobsElement     ***jobs,
+			     ControlGetConditionGraphBlockedElement  ***blocked)
 {
+	Session                                 *session;
+	ControlGetConditionGraphJobsElement    **job_list = NULL;
+	ControlGetConditionGraphBlockedElement **blocked_list = NULL;
+	size_t                                   len = 0;
+	size_t                                   num = 0;
+	MetricsStall                             stall;
+
 	nih_assert (message != NULL);
-	nih_assert (log_priority != NULL);
+	nih_assert (jobs != NULL);
+	nih_assert (blocked != NULL);
 
-	if (! control_check_permission (message)) {
-		nih_dbus_error_raise_printf (
-			DBUS_INTERFACE_UPSTART ".Error.PermissionDenied",
-			_("You do not have permission to set log priority"));
-		return -1;
-	}
+	job_class_init ();
+	event_init ();
 
-	if (! strcmp (log_priority, "debug")) {
-		nih_log_set_priority (NIH_LOG_DEBUG);
+	/* Get the relevant session */
+	session = session_from_dbus (NULL, message);
 
-	} else if (! strcmp (log_priority, "info")) {
-		nih_log_set_priority (NIH_LOG_INFO);
+	metrics_stall_begin (&stall, "dbus", "GetConditionGraph");
 
-	} else if (! strcmp (log_priority, "message")) {
-		nih_log_set_priority (NIH_LOG_MESSAGE);
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		if ((class->session || (session && session->chroot))
+		    && (class->session != session))
+			continue;
+
+		len++;
+	}
+
+	job_list = nih_alloc (message, sizeof (ControlGetConditionGraphJobsElement *)
+			      * (len + 1));
+	if (! job_list)
+		goto error;
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass                            *class = (JobClass *)iter;
+		ControlGetConditionGraphJobsElement *element;
+
+		if ((class->session || (session && session->chroot))
+		    && (class->session != session))
+			continue;
+
+		element = nih_new (job_list, ControlGetConditionGraphJobsElement);
+		if (! element)
+			goto error;
+
+		job_list[num++] = element;
+
+		element->item0 = nih_strdup (element, class->name);
+		element->item1 = job_class_condition_array (element,
+							    class->start_on);
+		element->item2 = job_class_condition_array (element,
+							    class->stop_on);
+		if (class->emits) {
+			element->item3 = nih_str_array_copy (element, NULL,
+							     class->emits);
+		} else {
+			element->item3 = nih_str_array_new (element);
+		}
+
+		if (! (element->item0 && element->item1 && element->item2
+		       && element->item3))
+			goto error;
+	}
+
+	nih_assert (num == len);
+	job_list[num] = NULL;
+
+	len = 0;
+	blocked_list = nih_alloc (message,
+				  sizeof (ControlGetConditionGraphBlockedElement *));
+	if (! blocked_list)
+		goto error;
+
+	blocked_list[len] = NULL;
+
+	if (runtime) {
+		/* Events waiting for job instances to finish */
+		NIH_LIST_FOREACH (events, iter) {
+			Event *event = (Event *)iter;
+
+			NIH_LIST_FOREACH (&event->blocking, blocked_iter) {
+				Blocked *edge = (Blocked *)blocked_iter;
+
+				if (edge->type != BLOCKED_JOB)
+					continue;
+
+				if ((edge->job->class->session
+				     || (session && session->chroot))
+				    && (edge->job->class->session != session))
+					continue;
+
+				if (control_add_blocked_edge (message,
+							      &blocked_list, &len,
+							      event, edge->job,
+							      "event") < 0)
+					goto error;
+			}
+		}
+
+		/* Job instances waiting for events to finish */
+		NIH_HASH_FOREACH (job_classes, iter) {
+			JobClass *class = (JobClass *)iter;
+
+			if ((class->session || (session && session->chroot))
+			    && (class->session != session))
+				continue;
+
+			NIH_HASH_FOREACH (class->instances, job_iter) {
+				Job *job = (Job *)job_iter;
+
+				if (! job->blocker)
+					continue;
+
+				if (control_add_blocked_edge (message,
+							      &blocked_list, &len,
+							      job->blocker, job,
+							      "job") < 0)
+					goto error;
+			}
+		}
+	}
+
+	metrics_stall_end (&stall);
+
+	*jobs = job_list;
+	*blocked = blocked_list;
+
+	return 0;
+
+error:
+	metrics_stall_end (&stall);
+
+	if (job_list)
+		nih_free (job_list);
+	if (blocked_list)
+		nih_free (blocked_list);
+
+	nih_return_no_memory_error (-1);
+}
+
+/**
+ * control_add_blocked_edge:
+ * @parent: parent object for new element,
+ * @list: pointer to array of blocked edges,
+ * @len: length of @list,
+ * @event: event of edge,
+ * @job: job instance of edge,
+ * @waiting: "event" or "job" for whichever of @event and @job is waiting.
+ *
+ * Append an element for the edge between @event and @job to @list,
+ * updating @len.
+ *
+ * Returns: zero on success, negative value on insufficient memory.
+ **/
+static int
+control_add_blocked_edge (const void                                *parent,
+			  ControlGetConditionGraphBlockedElement  ***list,
+			  size_t                                    *len,
+			  Event                                     *event,
+			  Job                                       *job,
+			  const char                                *waiting)
+{
+	ControlGetConditionGraphBlockedElement **new_list;
+	ControlGetConditionGraphBlockedElement  *element;
+
+	nih_assert (list != NULL);
+	nih_assert (len != NULL);
+	nih_assert (event != NULL);
+	nih_assert (job != NULL);
+	nih_assert (waiting != NULL);
+
+	new_list = nih_realloc (*list, parent,
+				sizeof (ControlGetConditionGraphBlockedElement *)
+				* (*len + 2));
+	if (! new_list)
+		return -1;
+	*list = new_list;
+
+	element = nih_new (*list, ControlGetConditionGraphBlockedElement);
+	if (! element)
+		return -1;
+
+	element->item0 = nih_strdup (element, event->name);
+	element->item1 = nih_strdup (element, job->class->name);
+	element->item2 = nih_strdup (element, job->name);
+	element->item3 = nih_strdup (element, waiting);
+
+	if (! (element->item0 && element->item1 && element->item2
+	       && element->item3)) {
+		nih_free (element);
+		return -1;
+	}
+
+	(*list)[(*len)++] = element;
+	(*list)[*len] = NULL;
+
+	return 0;
+}
+
+/**
+ * control_get_all_job_conditions:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @jobs: pointer for array of job conditions.
+ *
+ * Implements the GetAllJobConditions method of the com.ubuntu.Upstart
+ * interface.
+ *
+ * Called to obtain the start on and stop on conditions of every known
+ * job class in a single call, so that a bridge starting up need not
+ * fetch the properties of each class in turn.  An entry is stored in
+ * @jobs for each class giving its object path and its start on and stop
+ * on conditions in the form of the start_on and stop_on properties.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_get_all_job_conditions (void                                      *data,
+				NihDBusMessage                            *message,
+				ControlGetAllJobConditionsJobsElement   ***jobs)
+{
+	Session                                *session;
+	ControlGetAllJobConditionsJobsElement **list;
+	size_t                                  len = 0;
+	size_t                                  num = 0;
+
+	nih_assert (message != NULL);
+	nih_assert (jobs != NULL);
+
+	job_class_init ();
+
+	/* Get the relevant session */
+	session = session_from_dbus (NULL, message);
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		if ((class->session || (session && session->chroot))
+		    && (class->session != session))
+			continue;
+
+		len++;
+	}
+
+	list = nih_alloc (message, sizeof (ControlGetAllJobConditionsJobsElement *)
+			  * (len + 1));
+	if (! list)
+		nih_return_no_memory_error (-1);
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass                              *class = (JobClass *)iter;
+		ControlGetAllJobConditionsJobsElement *element;
+
+		if ((class->session || (session && session->chroot))
+		    && (class->session != session))
+			continue;
+
+		element = nih_new (list, ControlGetAllJobConditionsJobsElement);
+		if (! element)
+			goto error;
+
+		list[num++] = element;
+
+		element->item0 = nih_strdup (element, class->path);
+		element->item1 = job_class_condition_array (element,
+							    class->start_on);
+		element->item2 = job_class_condition_array (element,
+							    class->stop_on);
+
+		if (! (element->item0 && element->item1 && element->item2))
+			goto error;
+	}
+
+	nih_assert (num == len);
+	list[num] = NULL;
+
+	*jobs = list;
+
+	return 0;
+
+error:
+	nih_free (list);
+	nih_return_no_memory_error (-1);
+}
+
+/**
+ * control_notify_job_added:
+ * @class: job class now registered.
+ *
+ * Queues @class to be sent, with its start on and stop on conditions, in
+ * the next JobsChanged signal; replacing any change to a class at the
+ * same path already queued, so a class replaced by a reload is sent once.
+ **/
+void
+control_notify_job_added (JobClass *class)
+{
+	ControlJobChange *change;
+
+	nih_assert (class != NULL);
+
+	control_init ();
+	control_job_change_init ();
+
+	/* Nobody to tell, and nobody to tell later either; connections
+	 * made after this fetch the conditions themselves.
+	 */
+	if (NIH_LIST_EMPTY (control_conns))
+		return;
+
+	control_job_change_forget (class->path);
+
+	change = NIH_MUST (nih_new (control_job_changes, ControlJobChange));
+	nih_list_init (&change->entry);
+	nih_alloc_set_destructor (change, nih_list_destroy);
+
+	change->path = NIH_MUST (nih_strdup (change, class->path));
+	change->start_on = NIH_MUST (job_class_condition_array (change,
+								class->start_on));
+	change->stop_on = NIH_MUST (job_class_condition_array (change,
+							       class->stop_on));
+
+	nih_list_add (control_job_changes, &change->entry);
+}
+
+/**
+ * control_notify_job_removed:
+ * @class: job class no longer registered.
+ *
+ * Queues the path of @class to be sent in the next JobsChanged signal,
+ * replacing any change to it already queued.
+ **/
+void
+control_notify_job_removed (JobClass *class)
+{
+	ControlJobChange *change;
+
+	nih_assert (class != NULL);
+
+	control_init ();
+	control_job_change_init ();
+
+	if (NIH_LIST_EMPTY (control_conns))
+		return;
+
+	control_job_change_forget (class->path);
+
+	change = NIH_MUST (nih_new (control_job_changes, ControlJobChange));
+	nih_list_init (&change->entry);
+	nih_alloc_set_destructor (change, nih_list_destroy);
+
+	change->path = NIH_MUST (nih_strdup (change, class->path));
+	change->start_on = NULL;
+	change->stop_on = NULL;
+
+	nih_list_add (control_job_changes, &change->entry);
+}
+
+/**
+ * control_jobs_changed_flush:
+ * @data: not used,
+ * @func: main loop function, or NULL.
+ *
+ * Emits the job classes added and removed since it was last called in
+ * a single JobsChanged signal over each control connection, so that a
+ * configuration reload touching many jobs results in one signal rather
+ * than a JobAdded or JobRemoved signal for each of them.  This is called
+ * each time through the main loop.
+ **/
+void
+control_jobs_changed_flush (void            *data,
+			    NihMainLoopFunc *func)
+{
+	nih_local ControlJobsChangedAddedElement **added = NULL;
+	nih_local char                           **removed = NULL;
+	size_t                                     added_len = 0;
+	size_t                                     removed_len = 0;
+
+	if (! control_job_changes || NIH_LIST_EMPTY (control_job_changes))
+		return;
+
+	added = NIH_MUST (nih_alloc (NULL, sizeof (ControlJobsChangedAddedElement *)));
+	added[0] = NULL;
+	removed = NIH_MUST (nih_str_array_new (NULL));
+
+	NIH_LIST_FOREACH (control_job_changes, iter) {
+		ControlJobChange               *change = (ControlJobChange *)iter;
+		ControlJobsChangedAddedElement *element;
+
+		if (! change->start_on) {
+			NIH_MUST (nih_str_array_add (&removed, NULL,
+						     &removed_len,
+						     change->path));
+			continue;
+		}
+
+		added = NIH_MUST (nih_realloc (added, NULL,
+					       sizeof (ControlJobsChangedAddedElement *)
+					       * (added_len + 2)));
+
+		element = NIH_MUST (nih_new (added, ControlJobsChangedAddedElement));
+		element->item0 = change->path;
+		element->item1 = change->start_on;
+		element->item2 = change->stop_on;
+
+		added[added_len++] = element;
+		added[added_len] = NULL;
+	}
+
+	NIH_LIST_FOREACH (control_conns, iter) {
+		NihListEntry   *entry = (NihListEntry *)iter;
+		DBusConnection *conn = (DBusConnection *)entry->data;
+
+		NIH_ZERO (control_emit_jobs_changed (conn, DBUS_PATH_UPSTART,
+						     added, removed));
+	}
+
+	NIH_LIST_FOREACH_SAFE (control_job_changes, iter)
+		nih_free (iter);
+}
+
+/**
+ * control_job_change_init:
+ *
+ * Initialise the list of queued job changes.
+ **/
+static void
+control_job_change_init (void)
+{
+	if (! control_job_changes)
+		control_job_changes = NIH_MUST (nih_list_new (NULL));
+}
+
+/**
+ * control_job_change_forget:
+ * @path: object path of job class.
+ *
+ * Drops any change to the job class at @path already queued for the
+ * next JobsChanged signal.
+ **/
+static void
+control_job_change_forget (const char *path)
+{
+	nih_assert (path != NULL);
+
+	NIH_LIST_FOREACH_SAFE (control_job_changes, iter) {
+		ControlJobChange *change = (ControlJobChange *)iter;
+
+		if (! strcmp (change->path, path))
+			nih_free (change);
+	}
+}
+
+
+int
+control_emit_event (void            *data,
+		    NihDBusMessage  *message,
+		    const char      *name,
+		    char * const    *env,
+		    int              wait)
+{
+	return control_emit_event_with_file (data, message, name, env, wait, -1);
+}
+
+/**
+ * control_emit_event_with_file:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @name: name of event to emit,
+ * @env: environment of environment,
+ * @wait: whether to wait for event completion before returning,
+ * @file: file descriptor.
+ *
+ * Implements the top half of the EmitEvent method of the com.ubuntu.Upstart
+ * interface, the bottom half may be found in event_finished().
+ *
+ * Called to emit an event with a given @name and @env, which will be
+ * added to the event queue and processed asynchronously.  If @name or
+ * @env are not valid, the org.freedesktop.DBus.Error.InvalidArgs D-Bus
+ * error will be returned immediately.  If the event fails, the
+ * com.ubuntu.Upstart.Error.EventFailed D-Bus error will be returned when
+ * the event finishes.
+ *
+ * When @wait is TRUE the method call will not return until the event
+ * has completed, which means that all jobs affected by the event have
+ * finished starting (running for tasks) or stopping; when @wait is FALSE,
+ * the method call returns once the event has been queued.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_emit_event_with_file (void            *data,
+			      NihDBusMessage  *message,
+			      const char      *name,
+			      char * const    *env,
+			      int              wait,
+			      int              file)
+{
+	Event          *event;
+	Blocked        *blocked;
+	nih_local char *emitter = NULL;
+
+	nih_assert (message != NULL);
+	nih_assert (name != NULL);
+	nih_assert (env != NULL);
+
+	if (! control_check_permission (message)) {
+		nih_dbus_error_raise_printf (
+			DBUS_INTERFACE_UPSTART ".Error.PermissionDenied",
+			_("You do not have permission to emit an event"));
+		return -1;
+	}
+
+	/* Verify that the name is valid */
+	if (! strlen (name)) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     _("Name may not be empty string"));
+		close (file);
+		return -1;
+	}
+
+	/* Verify that the environment is valid */
+	if (! environ_all_valid (env)) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     _("Env must be KEY=VALUE pairs"));
+		close (file);
+		return -1;
+	}
+
+	emitter = control_emitter (NULL, message);
+	if (! emitter) {
+		nih_error_raise_no_memory ();
+		close (file);
+		return -1;
+	}
+
+	/* Make the event and block the message on it */
+	event = event_new (NULL, name, (char **)env);
+	if (! event) {
+		nih_error_raise_system ();
+		close (file);
+		return -1;
+	}
+
+	if (! event_limit_admit (event, emitter)) {
+		nih_dbus_error_raise_printf (
+			DBUS_INTERFACE_UPSTART ".Error.RateLimited",
+			_("Too many events emitted, try again later"));
+		nih_free (event);
+		close (file);
+		return -1;
+	}
+
+	event->fd = file;
+	if (event->fd >= 0) {
+		long flags;
+
+		flags = fcntl (event->fd, F_GETFD);
+		flags &= ~FD_CLOEXEC;
+		fcntl (event->fd, F_SETFD, flags);
+	}
+
+	/* Obtain the session */
+	event->session = session_from_dbus (NULL, message);
+
+	if (wait) {
+		blocked = blocked_new (event, BLOCKED_EMIT_METHOD, message);
+		if (! blocked) {
+			nih_error_raise_system ();
+			nih_free (event);
+			close (file);
+			return -1;
+		}
+
+		nih_list_add (&event->blocking, &blocked->entry);
+	} else {
+		NIH_ZERO (control_emit_event_reply (message));
+	}
+
+	return 0;
+}
+
+/**
+ * control_emit_events:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @events: NULL-terminated array of (name, env, wait) structures.
+ *
+ * Implements the top half of the EmitEvents method of the
+ * com.ubuntu.Upstart interface, the bottom half may be found in
+ * event_finished().
+ *
+ * Called to emit a batch of events at once, each of which is added to
+ * the event queue in order so that all of them are handled by the same
+ * pass of event_poll().  The whole batch is validated first; if any
+ * name or environment is not valid the
+ * org.freedesktop.DBus.Error.InvalidArgs D-Bus error is returned
+ * immediately and no events are queued.  Likewise, unless the rate limit
+ * of the caller has room for every event, the
+ * com.ubuntu.Upstart.Error.RateLimited D-Bus error is returned and none
+ * are queued.
+ *
+ * A single reply is sent for the whole batch: once every event whose
+ * wait member is TRUE has finished, or immediately if there are none.
+ * If any of those events fails, the com.ubuntu.Upstart.Error.EventFailed
+ * D-Bus error is returned instead.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_emit_events (void                                   *data,
+		     NihDBusMessage                         *message,
+		     ControlEmitEventsEventsElement * const *events)
+{
+	nih_local ControlEmitBatch  *batch = NULL;
+	nih_local Event            **queued = NULL;
+	nih_local char              *emitter = NULL;
+	Session                     *session;
+	size_t                       len = 0;
+	size_t                       limited = 0;
+	size_t                       i;
+	int                          refused = FALSE;
+
+	nih_assert (message != NULL);
+	nih_assert (events != NULL);
+
+	if (! control_check_permission (message)) {
+		nih_dbus_error_raise_printf (
+			DBUS_INTERFACE_UPSTART ".Error.PermissionDenied",
+			_("You do not have permission to emit an event"));
+		return -1;
+	}
+
+	/* Verify the entire batch before queueing any of it */
+	for (ControlEmitEventsEventsElement * const *e = events; *e; e++) {
+		if (! strlen ((*e)->item0)) {
+			nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+						     _("Name may not be empty string"));
+			return -1;
+		}
+
+		if (! environ_all_valid ((*e)->item1)) {
+			nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+						     _("Env must be KEY=VALUE pairs"));
+			return -1;
+		}
+
+		if (strcmp ((*e)->item0, "runlevel"))
+			limited++;
+
+		len++;
+	}
+
+	batch = nih_new (NULL, ControlEmitBatch);
+	if (! batch)
+		nih_return_system_error (-1);
+
+	batch->message = message;
+	nih_ref (batch->message, batch);
+
+	batch->pending = 0;
+	batch->failed = FALSE;
+
+	queued = nih_alloc (NULL, sizeof (Event *) * (len + 1));
+	if (! queued)
+		nih_return_system_error (-1);
+
+	emitter = control_emitter (NULL, message);
+	if (! emitter)
+		nih_return_no_memory_error (-1);
+
+	/* Refuse the whole batch unless the rate limit has room for all
+	 * of it, rather than charging the limit for events that would
+	 * then be withdrawn.
+	 */
+	if (! event_limit_room (emitter, limited)) {
+		event_limit_stats.dropped += limited;
+		nih_dbus_error_raise_printf (
+			DBUS_INTERFACE_UPSTART ".Error.RateLimited",
+			_("Too many events emitted, try again later"));
+		return -1;
+	}
+
+	/* Obtain the session */
+	session = session_from_dbus (NULL, message);
+
+	for (i = 0; i < len; i++) {
+		Event   *event;
+		Blocked *blocked;
+
+		event = event_new (NULL, events[i]->item0, events[i]->item1);
+		if (! event)
+			break;
+
+		event->session = session;
+
+		if (! event_limit_admit (event, emitter)) {
+			nih_free (event);
+			refused = TRUE;
+			break;
+		}
+
+		if (events[i]->item2) {
+			blocked = blocked_new (event,
+					       BLOCKED_EMIT_EVENTS_METHOD,
+					       batch);
+			if (! blocked) {
+				nih_free (event);
+				break;
+			}
+
+			nih_list_add (&event->blocking, &blocked->entry);
+			batch->pending++;
+		}
+
+		queued[i] = event;
+	}
+
+	/* On failure, withdraw the events we already queued so that the
+	 * caller may safely retry the whole batch.
+	 */
+	if (i < len) {
+		if (refused) {
+			nih_dbus_error_raise_printf (
+				DBUS_INTERFACE_UPSTART ".Error.RateLimited",
+				_("Too many events emitted, try again later"));
+		} else {
+			nih_error_raise_system ();
+		}
+
+		while (i > 0)
+			nih_free (queued[--i]);
+
+		return -1;
+	}
+
+	if (! batch->pending)
+		NIH_ZERO (control_emit_events_reply (message));
+
+	return 0;
+}
+
+
+/**
+ * control_get_version:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @version: pointer for reply string.
+ *
+ * Implements the get method for the version property of the
+ * com.ubuntu.Upstart interface.
+ *
+ * Called to obtain the version of the init daemon, which will be stored
+ * as a string in @version.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_get_version (void *          data,
+		     NihDBusMessage *message,
+		     char **         version)
+{
+	nih_assert (message != NULL);
+	nih_assert (version != NULL);
+
+	*version = nih_strdup (message, package_string);
+	if (! *version)
+		nih_return_no_memory_error (-1);
+
+	return 0;
+}
+
+/**
+ * control_notify_runlevel:
+ * @event: event being handled.
+ *
+ * Called as each event is handled; when @event is the runlevel event,
+ * note the new and previous runlevels from its environment so that they
+ * can be obtained from the runlevel and prevlevel properties, and from
+ * the status page, rather than from the utmp file.
+ **/
+void
+control_notify_runlevel (Event *event)
+{
+	const char *runlevel;
+	const char *prevlevel;
+
+	nih_assert (event != NULL);
+
+	if (strcmp (event->name, RUNLEVEL_EVENT))
+		return;
+
+	runlevel = environ_get (event->env, "RUNLEVEL");
+	prevlevel = environ_get (event->env, "PREVLEVEL");
+
+	control_runlevel = runlevel && runlevel[0] ? runlevel[0] : 'N';
+	control_prevlevel = prevlevel && prevlevel[0] ? prevlevel[0] : 'N';
+
+	status_page_set_runlevel (control_runlevel, control_prevlevel);
+}
+
+/**
+ * control_get_runlevel:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @runlevel: pointer for reply string.
+ *
+ * Implements the get method for the runlevel property of the
+ * com.ubuntu.Upstart interface.
+ *
+ * Called to obtain the runlevel given by the most recent runlevel event,
+ * which will be stored as a single character string in @runlevel; "N"
+ * if there has been no such event.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_get_runlevel (void *          data,
+		      NihDBusMessage *message,
+		      char **         runlevel)
+{
+	nih_assert (message != NULL);
+	nih_assert (runlevel != NULL);
+
+	*runlevel = nih_sprintf (message, "%c", control_runlevel);
+	if (! *runlevel)
+		nih_return_no_memory_error (-1);
+
+	return 0;
+}
+
+/**
+ * control_get_prevlevel:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @prevlevel: pointer for reply string.
+ *
+ * Implements the get method for the prevlevel property of the
+ * com.ubuntu.Upstart interface.
+ *
+ * Called to obtain the runlevel before that given by the most recent
+ * runlevel event, which will be stored as a single character string in
+ * @prevlevel; "N" if there was none.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_get_prevlevel (void *          data,
+		       NihDBusMessage *message,
+		       char **         prevlevel)
+{
+	nih_assert (message != NULL);
+	nih_assert (prevlevel != NULL);
+
+	*prevlevel = nih_sprintf (message, "%c", control_prevlevel);
+	if (! *prevlevel)
+		nih_return_no_memory_error (-1);
+
+	return 0;
+}
+
+/**
+ * control_get_reexec_stats:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @reexec_stats: pointer for reply string.
+ *
+ * Implements the get method for the reexec_stats property of the
+ * com.ubuntu.Upstart interface.
+ *
+ * Called to obtain the timings of the phases of the most recent
+ * stateful re-exec, which will be stored as a JSON string in
+ * @reexec_stats.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_get_reexec_stats (void *          data,
+			  NihDBusMessage *message,
+			  char **         reexec_stats)
+{
+	nih_assert (message != NULL);
+	nih_assert (reexec_stats != NULL);
+
+	*reexec_stats = state_reexec_stats_to_string (message);
+	if (! *reexec_stats)
+		nih_return_no_memory_error (-1);
+
+	return 0;
+}
+
+/**
+ * control_get_event_stats:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @event_stats: pointer for reply string.
+ *
+ * Implements the get method for the event_stats property of the
+ * com.ubuntu.Upstart interface.
+ *
+ * Called to obtain the number of events emitted by clients that have
+ * been admitted, deferred and refused by their rate limits, which will
+ * be stored as a JSON string in @event_stats.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_get_event_stats (void *          data,
+			 NihDBusMessage *message,
+			 char **         event_stats)
+{
+	nih_assert (message != NULL);
+	nih_assert (event_stats != NULL);
+
+	*event_stats = event_limit_stats_to_string (message);
+	if (! *event_stats)
+		nih_return_no_memory_error (-1);
+
+	return 0;
+}
+
+/**
+ * control_get_alloc_stats:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @alloc_stats: pointer for reply string.
+ *
+ * Implements the get method for the alloc_stats property of the
+ * com.ubuntu.Upstart interface.
+ *
+ * Called to obtain the number of objects in use, the most there have
+ * been and the capacity of each allocation pool, which will be stored
+ * as a JSON string in @alloc_stats.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_get_alloc_stats (void *          data,
+			 NihDBusMessage *message,
+			 char **         alloc_stats)
+{
+	nih_assert (message != NULL);
+	nih_assert (alloc_stats != NULL);
+
+	*alloc_stats = alloc_pool_stats_to_string (message);
+	if (! *alloc_stats)
+		nih_return_no_memory_error (-1);
+
+	return 0;
+}
+
+/**
+ * control_get_log_stats:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @log_stats: pointer for reply string.
+ *
+ * Implements the get method for the log_stats property of the
+ * com.ubuntu.Upstart interface.
+ *
+ * Called to obtain the bytes written, writes made, short writes and
+ * output discarded for a full disk of the log file of each job process,
+ * which will be stored as a JSON string keyed by log file path in
+ * @log_stats.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_get_log_stats (void *          data,
+		       NihDBusMessage *message,
+		       char **         log_stats)
+{
+	char *str;
+	int   first = TRUE;
+
+	nih_assert (message != NULL);
+	nih_assert (log_stats != NULL);
+
+	job_class_init ();
+
+	str = nih_strdup (message, "{");
+	if (! str)
+		nih_return_no_memory_error (-1);
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		NIH_HASH_FOREACH (class->instances, job_iter) {
+			Job *job = (Job *)job_iter;
+
+			for (int i = 0; i < PROCESS_LAST; i++) {
+				nih_local char *stats = NULL;
+
+				if (! job->log[i])
+					continue;
+
+				stats = log_stats_to_string (NULL, job->log[i]);
+				if (! stats
+				    || ! nih_strcat_sprintf (&str, message,
+							     "%s \"%s\": %s",
+							     first ? "" : ",",
+							     job->log[i]->path,
+							     stats))
+					goto error;
+
+				first = FALSE;
+			}
+		}
+	}
+
+	if (! nih_strcat (&str, message, " }"))
+		goto error;
+
+	*log_stats = str;
+
+	return 0;
+
+error:
+	nih_free (str);
+	nih_return_no_memory_error (-1);
+}
+
+/**
+ * control_get_log_priority:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @log_priority: pointer for reply string.
+ *
+ * Implements the get method for the log_priority property of the
+ * com.ubuntu.Upstart interface.
+ *
+ * Called to obtain the init daemon's current logging level, which will
+ * be stored as a string in @log_priority.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_get_log_priority (void *          data,
+			  NihDBusMessage *message,
+			  char **         log_priority)
+{
+	const char *priority;
+
+	nih_assert (message != NULL);
+	nih_assert (log_priority != NULL);
+
+	switch (nih_log_priority) {
+	case NIH_LOG_DEBUG:
+		priority = "debug";
+		break;
+	case NIH_LOG_INFO:
+		priority = "info";
+		break;
+	case NIH_LOG_MESSAGE:
+		priority = "message";
+		break;
+	case NIH_LOG_WARN:
+		priority = "warn";
+		break;
+	case NIH_LOG_ERROR:
+		priority = "error";
+		break;
+	case NIH_LOG_FATAL:
+		priority = "fatal";
+		break;
+	default:
+		nih_assert_not_reached ();
+	}
+
+	*log_priority = nih_strdup (message, priority);
+	if (! *log_priority)
+		nih_return_no_memory_error (-1);
+
+	return 0;
+}
+
+/**
+ * control_set_log_priority:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @log_priority: string log priority to be set.
+ *
+ * Implements the get method for the log_priority property of the
+ * com.ubuntu.Upstart interface.
+ *
+ * Called to change the init daemon's current logging level to that given
+ * as a string in @log_priority.  If the string is not recognised, the
+ * com.ubuntu.Upstart.Error.InvalidLogPriority error will be returned.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_set_log_priority (void *          data,
+			  NihDBusMessage *message,
+			  const char *    log_priority)
+{
+	nih_assert (message != NULL);
+	nih_assert (log_priority != NULL);
+
+	if (! control_check_permission (message)) {
+		nih_dbus_error_raise_printf (
+			DBUS_INTERFACE_UPSTART ".Error.PermissionDenied",
+			_("You do not have permission to set log priority"));
+		return -1;
+	}
+
+	if (! strcmp (log_priority, "debug")) {
+		nih_log_set_priority (NIH_LOG_DEBUG);
+
+	} else if (! strcmp (log_priority, "info")) {
+		nih_log_set_priority (NIH_LOG_INFO);
+
+	} else if (! strcmp (log_priority, "message")) {
+		nih_log_set_priority (NIH_LOG_MESSAGE);
 
 	} else if (! strcmp (log_priority, "warn")) {
 		nih_log_set_priority (NIH_LOG_WARN);
@@ -916,6 +2123,9 @@ control_notify_disk_writeable (void   *data,
 	if (session && session->chroot)
 		return 0;
 
+	/* Logs held by the job output logger are flushed by it */
+	log_offload_flush ();
+
 	ret = log_clear_unflushed ();
 
 	if (ret < 0) {
@@ -926,6 +2136,46 @@ control_notify_disk_writeable (void   *data,
 	return 0;
 }
 
+/**
+ * control_reopen_logs:
+ * @data: not used,
+ * @message: D-Bus connection and message received.
+ *
+ * Implements the ReopenLogs method of the com.ubuntu.Upstart
+ * interface.
+ *
+ * Called once job logs have been rotated, to have each job log that is
+ * no longer at its path opened again before it is next written.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_reopen_logs (void           *data,
+		     NihDBusMessage *message)
+{
+	Session  *session;
+
+	nih_assert (message != NULL);
+
+	if (! control_check_permission (message)) {
+		nih_dbus_error_raise_printf (
+			DBUS_INTERFACE_UPSTART ".Error.PermissionDenied",
+			_("You do not have permission to reopen logs"));
+		return -1;
+	}
+
+	/* Get the relevant session */
+	session = session_from_dbus (NULL, message);
+
+	/* "nop" when run from a chroot */
+	if (session && session->chroot)
+		return 0;
+
+	log_reopen ();
+
+	return 0;
+}
+
 /**
  * control_notify_dbus_address:
  * @data: not used,
@@ -1079,150 +2329,491 @@ control_prepare_reexec (void)
 /**
  * control_conn_to_index:
  *
- * @connection: D-Bus connection.
+ * @connection: D-Bus connection.
+ *
+ * Convert a control (DBusConnection) connection to an index number
+ * the list of control connections.
+ *
+ * Returns: connection index, or -1 on error.
+ **/
+int
+control_conn_to_index (const DBusConnection *connection)
+{
+	int conn_index = 0;
+	int found = FALSE;
+
+	nih_assert (connection);
+
+	NIH_LIST_FOREACH (control_conns, iter) {
+		NihListEntry    *entry = (NihListEntry *)iter;
+		DBusConnection  *conn = (DBusConnection *)entry->data;
+
+		if (connection == conn) {
+			found = TRUE;
+			break;
+		}
+
+		conn_index++;
+	}
+	if (! found)
+		return -1;
+
+	return conn_index;
+}
+
+/**
+ * control_conn_from_index:
+ *
+ * @conn_index: control connection index number.
+ *
+ * Lookup control connection based on index number.
+ *
+ * Returns: existing connection on success, or NULL if connection
+ * not found.
+ **/
+DBusConnection *
+control_conn_from_index (int conn_index)
+{
+	int i = 0;
+
+	nih_assert (conn_index >= 0);
+	nih_assert (control_conns);
+
+	NIH_LIST_FOREACH (control_conns, iter) {
+		NihListEntry    *entry = (NihListEntry *)iter;
+		DBusConnection  *conn = (DBusConnection *)entry->data;
+
+		if (i == conn_index)
+			return conn;
+		i++;
+	}
+
+	return NULL;
+}
+
+/**
+ * control_bus_release_name:
+ *
+ * Unregister well-known D-Bus name.
+ *
+ * Returns: 0 on success, -1 on raised error.
+ **/
+int
+control_bus_release_name (void)
+{
+	DBusError  error;
+	int        ret;
+
+	if (! control_bus)
+		return 0;
+
+	dbus_error_init (&error);
+	ret = dbus_bus_release_name (control_bus,
+				     DBUS_SERVICE_UPSTART,
+				     &error);
+	if (ret < 0) {
+		nih_dbus_error_raise (error.name, error.message);
+		dbus_error_free (&error);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * control_get_state_snapshot:
+ *
+ * @message: D-Bus connection and message received,
+ * @state: JSON string of state, or NULL on failure,
+ * @len: length of @state.
+ *
+ * Called once a child process has serialised the state requested by
+ * @message, to reply to it.
+ **/
+static void
+control_get_state_snapshot (NihDBusMessage *message,
+			    const char     *state,
+			    size_t          len)
+{
+	nih_local char *str = NULL;
+
+	nih_assert (message);
+
+	if (state)
+		str = nih_strndup (NULL, state, len);
+
+	if (! str) {
+		NIH_ZERO (nih_dbus_message_error (message,
+						  DBUS_ERROR_FAILED,
+						  _("Unable to serialise state")));
+		return;
+	}
+
+	NIH_ZERO (control_get_state_reply (message, str));
+}
+
+/**
+ * control_get_state:
+ *
+ * @data: not used,
+ * @message: D-Bus connection and message received.
+ *
+ * Implements the GetState method of the com.ubuntu.Upstart interface.
+ *
+ * Called to convert internal state to a JSON string, which is sent in
+ * reply to @message.  When control_state_fork is TRUE this is done by a
+ * child process, and the reply sent once it has finished, so that other
+ * requests are not stalled by large state; should the child not be
+ * started, we serialise state ourselves.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_get_state (void           *data,
+		   NihDBusMessage  *message)
+{
+	nih_local char *state = NULL;
+	Session        *session;
+	size_t          len;
+	MetricsStall    stall;
+	int             ret;
+
+	nih_assert (message);
+
+	if (! control_check_permission (message)) {
+		nih_dbus_error_raise_printf (
+			DBUS_INTERFACE_UPSTART ".Error.PermissionDenied",
+			_("You do not have permission to request state"));
+		return -1;
+	}
+
+	/* Get the relevant session */
+	session = session_from_dbus (NULL, message);
+
+	/* We don't want chroot sessions snooping outside their domain.
+	 *
+	 * Ideally, we'd allow them to query their own session, but the
+	 * current implementation doesn't lend itself to that.
+	 */
+	if (session && session->chroot) {
+		nih_warn (_("Ignoring state query from chroot session"));
+		NIH_ZERO (control_get_state_reply (message, ""));
+		return 0;
+	}
+
+	if (control_state_fork) {
+		NihIo *io;
+
+		io = state_snapshot (NULL,
+				     (StateSnapshotHandler)control_get_state_snapshot,
+				     message);
+		if (io) {
+			/* Keep the message until the reply is sent */
+			nih_ref (message, io);
+			return 0;
+		} else {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_warn ("%s: %s", _("Unable to fork for state snapshot"),
+				  err->message);
+			nih_free (err);
+		}
+	}
+
+	metrics_stall_begin (&stall, "dbus", "GetState");
+	ret = state_to_string (&state, &len);
+	metrics_stall_end (&stall);
+
+	if (ret < 0)
+		goto error;
+
+	NIH_ZERO (control_get_state_reply (message, state));
+
+	return 0;
+
+error:
+	nih_dbus_error_raise_printf (DBUS_ERROR_NO_MEMORY,
+			_("Out of Memory"));
+	return -1;
+}
+
+/**
+ * control_get_state_filtered:
+ *
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @kinds: kinds of object to return,
+ * @names: glob patterns of names of objects to return,
+ * @since: state generation to return changes after,
+ * @state: output string returned to client.
+ *
+ * Implements the GetStateFiltered method of the com.ubuntu.Upstart
+ * interface.
  *
- * Convert a control (DBusConnection) connection to an index number
- * the list of control connections.
+ * Called to convert only the events, job classes and jobs matching
+ * @kinds, @names and @since to a JSON string (see
+ * state_to_string_filtered()), which will be stored in @state.  This is
+ * always done in the main process, since the objects asked for are
+ * expected to be few.
  *
- * Returns: connection index, or -1 on error.
+ * Returns: zero on success, negative value on raised error.
  **/
 int
-control_conn_to_index (const DBusConnection *connection)
+control_get_state_filtered (void           *data,
+			    NihDBusMessage *message,
+			    char * const   *kinds,
+			    char * const   *names,
+			    uint64_t        since,
+			    char          **state)
 {
-	int conn_index = 0;
-	int found = FALSE;
+	char         *str = NULL;
+	Session      *session;
+	size_t        len;
+	MetricsStall  stall;
+	int           ret;
 
-	nih_assert (connection);
+	nih_assert (message);
+	nih_assert (kinds);
+	nih_assert (names);
+	nih_assert (state);
 
-	NIH_LIST_FOREACH (control_conns, iter) {
-		NihListEntry    *entry = (NihListEntry *)iter;
-		DBusConnection  *conn = (DBusConnection *)entry->data;
+	if (! control_check_permission (message)) {
+		nih_dbus_error_raise_printf (
+			DBUS_INTERFACE_UPSTART ".Error.PermissionDenied",
+			_("You do not have permission to request state"));
+		return -1;
+	}
 
-		if (connection == conn) {
-			found = TRUE;
-			break;
-		}
+	/* Get the relevant session */
+	session = session_from_dbus (NULL, message);
 
-		conn_index++;
+	/* As with GetState, chroot sessions may not look outside */
+	if (session && session->chroot) {
+		nih_dbus_error_raise_printf (
+			DBUS_INTERFACE_UPSTART ".Error.PermissionDenied",
+			_("You do not have permission to request state"));
+		return -1;
 	}
-	if (! found)
+
+	for (char * const *kind = kinds; *kind; kind++) {
+		if (strcmp (*kind, "events")
+		    && strcmp (*kind, "job_classes")
+		    && strcmp (*kind, "jobs")) {
+			nih_dbus_error_raise_printf (
+				DBUS_ERROR_INVALID_ARGS,
+				_("Unknown kind of object: %s"), *kind);
+			return -1;
+		}
+	}
+
+	metrics_stall_begin (&stall, "dbus", "GetStateFiltered");
+	ret = state_to_string_filtered (&str, &len, kinds, names, since);
+	metrics_stall_end (&stall);
+
+	if (ret < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_NO_MEMORY,
+				_("Out of Memory"));
 		return -1;
+	}
 
-	return conn_index;
+	nih_ref (str, message);
+	*state = str;
+
+	return 0;
 }
 
 /**
- * control_conn_from_index:
+ * control_get_boot_trace:
  *
- * @conn_index: control connection index number.
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @trace: output string returned to client.
  *
- * Lookup control connection based on index number.
+ * Implements the GetBootTrace method of the com.ubuntu.Upstart
+ * interface.
  *
- * Returns: existing connection on success, or NULL if connection
- * not found.
+ * Called to obtain the runtime blocking graph recorded since boot, which
+ * will be stored in @trace as a Trace Event Format JSON string.
+ *
+ * Returns: zero on success, negative value on raised error.
  **/
-DBusConnection *
-control_conn_from_index (int conn_index)
+int
+control_get_boot_trace (void           *data,
+			NihDBusMessage  *message,
+			char           **trace)
 {
-	int i = 0;
+	Session      *session;
+	MetricsStall  stall;
 
-	nih_assert (conn_index >= 0);
-	nih_assert (control_conns);
+	nih_assert (message);
+	nih_assert (trace);
 
-	NIH_LIST_FOREACH (control_conns, iter) {
-		NihListEntry    *entry = (NihListEntry *)iter;
-		DBusConnection  *conn = (DBusConnection *)entry->data;
+	/* Get the relevant session */
+	session = session_from_dbus (NULL, message);
 
-		if (i == conn_index)
-			return conn;
-		i++;
+	/* Like the state, the trace covers all sessions */
+	if (session && session->chroot) {
+		nih_dbus_error_raise_printf (
+			DBUS_INTERFACE_UPSTART ".Error.PermissionDenied",
+			_("You do not have permission to request the boot trace"));
+		return -1;
 	}
 
-	return NULL;
+	metrics_stall_begin (&stall, "dbus", "GetBootTrace");
+	*trace = blocked_trace_to_string (message);
+	metrics_stall_end (&stall);
+
+	if (! *trace)
+		nih_return_no_memory_error (-1);
+
+	return 0;
 }
 
 /**
- * control_bus_release_name:
+ * control_metrics_get_snapshot:
  *
- * Unregister well-known D-Bus name.
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @snapshot: output string returned to client.
  *
- * Returns: 0 on success, -1 on raised error.
+ * Implements the GetSnapshot method of the com.ubuntu.Upstart0_6.Metrics
+ * interface.
+ *
+ * Called to obtain the counters and latency histograms of the init
+ * daemon's health, which will be stored in @snapshot as a JSON string.
+ *
+ * Returns: zero on success, negative value on raised error.
  **/
 int
-control_bus_release_name (void)
+control_metrics_get_snapshot (void           *data,
+			      NihDBusMessage  *message,
+			      char           **snapshot)
 {
-	DBusError  error;
-	int        ret;
-
-	if (! control_bus)
-		return 0;
+	nih_assert (message);
+	nih_assert (snapshot);
 
-	dbus_error_init (&error);
-	ret = dbus_bus_release_name (control_bus,
-				     DBUS_SERVICE_UPSTART,
-				     &error);
-	if (ret < 0) {
-		nih_dbus_error_raise (error.name, error.message);
-		dbus_error_free (&error);
-		return -1;
-	}
+	*snapshot = metrics_to_string (message);
+	if (! *snapshot)
+		nih_return_no_memory_error (-1);
 
 	return 0;
 }
 
 /**
- * control_get_state:
+ * control_get_event_history:
  *
  * @data: not used,
  * @message: D-Bus connection and message received,
- * @state: output string returned to client.
+ * @name: name of events to return, or empty for all,
+ * @since: number of seconds back to return events for, or zero for all,
+ * @events: pointer for array of events.
+ *
+ * Implements the GetEventHistory method of the com.ubuntu.Upstart
+ * interface.
  *
- * Convert internal state to JSON string.
+ * Called to obtain the records of recent events kept in the event
+ * history, oldest first, which will be stored in @events.  Callers in a
+ * chroot session only see the events of their session.
  *
  * Returns: zero on success, negative value on raised error.
  **/
 int
-control_get_state (void           *data,
-		   NihDBusMessage  *message,
-		   char           **state)
+control_get_event_history (void                                  *data,
+			   NihDBusMessage                        *message,
+			   const char                            *name,
+			   uint32_t                               since,
+			   ControlGetEventHistoryEventsElement ***events)
 {
-	Session  *session;
-	size_t    len;
+	Session                              *session;
+	ControlGetEventHistoryEventsElement **list;
+	const EventHistoryRecord             *record = NULL;
+	const char                           *chroot = NULL;
+	uint64_t                              earliest = 0;
+	size_t                                num = 0;
 
 	nih_assert (message);
-	nih_assert (state);
-
-	if (! control_check_permission (message)) {
-		nih_dbus_error_raise_printf (
-			DBUS_INTERFACE_UPSTART ".Error.PermissionDenied",
-			_("You do not have permission to request state"));
-		return -1;
-	}
+	nih_assert (name);
+	nih_assert (events);
 
 	/* Get the relevant session */
 	session = session_from_dbus (NULL, message);
+	if (session && session->chroot)
+		chroot = session->chroot;
 
-	/* We don't want chroot sessions snooping outside their domain.
-	 *
-	 * Ideally, we'd allow them to query their own session, but the
-	 * current implementation doesn't lend itself to that.
-	 */
-	if (session && session->chroot) {
-		nih_warn (_("Ignoring state query from chroot session"));
-		return 0;
+	if (since) {
+		struct timespec now;
+
+		if (clock_gettime (CLOCK_REALTIME, &now) < 0)
+			nih_return_system_error (-1);
+
+		earliest = ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+		earliest = earliest > (uint64_t)since * 1000000
+			? earliest - (uint64_t)since * 1000000 : 0;
 	}
 
-	if (state_to_string (state, &len) < 0)
-		goto error;
+	list = nih_alloc (message, sizeof (ControlGetEventHistoryEventsElement *)
+			  * (EVENT_HISTORY_MAX + 1));
+	if (! list)
+		nih_return_no_memory_error (-1);
+
+	while ((record = event_history_next (*name ? name : NULL,
+					     earliest, record)) != NULL) {
+		ControlGetEventHistoryEventsElement *entry;
+		size_t                               started_len = 0;
+		size_t                               stopped_len = 0;
+
+		if (chroot && strncmp (record->session, chroot,
+				       EVENT_HISTORY_NAME_MAX - 1))
+			continue;
 
-	nih_ref (*state, message);
+		entry = nih_new (list, ControlGetEventHistoryEventsElement);
+		if (! entry)
+			goto error;
+
+		list[num++] = entry;
+
+		entry->item0 = nih_strdup (entry, record->name);
+		entry->item1 = nih_strdup (entry, record->session);
+		entry->item2 = record->env_digest;
+		entry->item3 = record->emitted;
+		entry->item4 = record->handling
+			? record->handling - record->pending : 0;
+		entry->item5 = record->finished
+			? record->finished - record->pending : 0;
+		entry->item6 = record->failed;
+		entry->item7 = nih_str_array_new (entry);
+		entry->item8 = nih_str_array_new (entry);
+		entry->item9 = record->jobs_len > EVENT_HISTORY_JOBS
+			? record->jobs_len - EVENT_HISTORY_JOBS : 0;
+
+		if (! (entry->item0 && entry->item1
+		       && entry->item7 && entry->item8))
+			goto error;
+
+		for (size_t i = 0;
+		     i < record->jobs_len && i < EVENT_HISTORY_JOBS; i++) {
+			const EventHistoryJob *job = &record->jobs[i];
+
+			if (! (job->start
+			       ? nih_str_array_add (&entry->item7, entry,
+						    &started_len, job->name)
+			       : nih_str_array_add (&entry->item8, entry,
+						    &stopped_len, job->name)))
+				goto error;
+		}
+	}
+
+	nih_assert (num <= EVENT_HISTORY_MAX);
+	list[num] = NULL;
+
+	*events = list;
 
 	return 0;
 
 error:
-	nih_dbus_error_raise_printf (DBUS_ERROR_NO_MEMORY,
-			_("Out of Memory"));
-	return -1;
+	nih_free (list);
+	nih_return_no_memory_error (-1);
 }
 
 /**
@@ -1292,9 +2883,111 @@ control_notify_event_emitted (Event *event)
 		NihListEntry   *entry = (NihListEntry *)iter;
 		DBusConnection *conn = (DBusConnection *)entry->data;
 
+		/* Subscribers get the event in their next batch */
+		if (subscription_find (conn))
+			continue;
+
 		NIH_ZERO (control_emit_event_emitted (conn, DBUS_PATH_UPSTART,
 							    event->name, event->env));
 	}
+
+	subscription_notify_event (event);
+}
+
+/**
+ * control_subscribe:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @job_pattern: glob that job names must match,
+ * @event_pattern: glob that event names must match,
+ * @window: milliseconds to coalesce updates over.
+ *
+ * Implements the Subscribe method of the com.ubuntu.Upstart interface.
+ *
+ * Called to request that changes to instances of jobs matching
+ * @job_pattern, and events matching @event_pattern, be sent over the
+ * connection of @message in StateBatch signals with each instance's
+ * latest goal and state, rather than as the individual signals of every
+ * object.  Subscribing again replaces the patterns and window.
+ *
+ * Since signals on the bus cannot be aimed at a single client, this is
+ * only available over private connections.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_subscribe (void           *data,
+		   NihDBusMessage *message,
+		   const char     *job_pattern,
+		   const char     *event_pattern,
+		   uint32_t        window)
+{
+	Subscription *subscription;
+	Session      *session;
+
+	nih_assert (message != NULL);
+	nih_assert (job_pattern != NULL);
+	nih_assert (event_pattern != NULL);
+
+	if (message->connection == control_bus) {
+		nih_dbus_error_raise (DBUS_ERROR_NOT_SUPPORTED,
+				      _("Subscriptions are only available over private connections"));
+		return -1;
+	}
+
+	if (window > SUBSCRIPTION_MAX_WINDOW) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     _("Window may be no more than %d ms"),
+					     SUBSCRIPTION_MAX_WINDOW);
+		return -1;
+	}
+
+	/* Get the relevant session */
+	session = session_from_dbus (NULL, message);
+
+	subscription = subscription_find (message->connection);
+	if (subscription) {
+		/* Send what was pending under the old patterns */
+		subscription_flush (subscription);
+		nih_free (subscription);
+	}
+
+	subscription = subscription_new (NULL, message->connection, session,
+					 job_pattern, event_pattern, window);
+	if (! subscription)
+		nih_return_no_memory_error (-1);
+
+	return 0;
+}
+
+/**
+ * control_unsubscribe:
+ * @data: not used,
+ * @message: D-Bus connection and message received.
+ *
+ * Implements the Unsubscribe method of the com.ubuntu.Upstart interface.
+ *
+ * Called to cancel the subscription made over the connection of
+ * @message, sending any pending updates first; the connection then
+ * receives the individual signals of every object again.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_unsubscribe (void           *data,
+		     NihDBusMessage *message)
+{
+	Subscription *subscription;
+
+	nih_assert (message != NULL);
+
+	subscription = subscription_find (message->connection);
+	if (subscription) {
+		subscription_flush (subscription);
+		nih_free (subscription);
+	}
+
+	return 0;
 }
 
 /**
@@ -1422,6 +3115,7 @@ control_set_env_list (void            *data,
 			nih_assert (job->env);
 
 			NIH_MUST (environ_add (&job->env, job, NULL, replace, envvar));
+			job_env_changed (job);
 		} else {
 			if (job_class_environment_set (envvar, replace) < 0) {
 				nih_return_no_memory_error (-1);
@@ -1599,6 +3293,8 @@ control_unset_env_list (void            *data,
 
 			if (! environ_remove (&job->env, job, NULL, *name))
 				return -1;
+
+			job_env_changed (job);
 		} else if (job_class_environment_unset (*name) < 0) {
 			goto error;
 		}
@@ -1908,6 +3604,8 @@ control_reset_env (void           *data,
 		if (! job->env)
 			nih_return_system_error (-1);
 
+		job_env_changed (job);
+
 		return 0;
 	}
 
@@ -1996,6 +3694,32 @@ control_check_permission (NihDBusMessage *message)
 	return FALSE;
 }
 
+/**
+ * control_emitter:
+ * @parent: parent object for new string,
+ * @message: D-Bus connection and message received.
+ *
+ * Identifies the client that sent @message so that the events it emits
+ * may be rate limited together: by its unique name when connected to a
+ * bus, otherwise by its private connection.
+ *
+ * Returns: newly allocated key for client or NULL if insufficient memory.
+ **/
+static char *
+control_emitter (const void     *parent,
+		 NihDBusMessage *message)
+{
+	const char *sender;
+
+	nih_assert (message != NULL);
+
+	sender = dbus_message_get_sender (message->message);
+	if (sender)
+		return nih_strdup (parent, sender);
+
+	return nih_sprintf (parent, "%p", (void *)message->connection);
+}
+
 /**
  * control_session_file_create:
  *
@@ -2157,3 +3881,57 @@ control_deserialise_bus_address (json_object *json)
 error:
 	return -1;
 }
+
+/**
+ * control_serialise_runlevel:
+ *
+ * Convert the runlevels noted by control_notify_runlevel() into JSON
+ * representation.
+ *
+ * Returns: JSON string of the runlevel followed by the previous runlevel,
+ * or NULL on error.
+ **/
+json_object *
+control_serialise_runlevel (void)
+{
+	char runlevels[3];
+
+	runlevels[0] = control_runlevel;
+	runlevels[1] = control_prevlevel;
+	runlevels[2] = '\0';
+
+	return json_object_new_string (runlevels);
+}
+
+/**
+ * control_deserialise_runlevel:
+ *
+ * @json: JSON-serialised runlevels.
+ *
+ * Restore the runlevels noted before re-exec from @json, publishing
+ * them in the status page again if there was a runlevel event.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+int
+control_deserialise_runlevel (json_object *json)
+{
+	const char *runlevels;
+
+	nih_assert (json);
+
+	if (! state_check_json_type (json, string))
+		return -1;
+
+	runlevels = json_object_get_string (json);
+	if ((! runlevels) || (strlen (runlevels) != 2))
+		return -1;
+
+	control_runlevel = runlevels[0];
+	control_prevlevel = runlevels[1];
+
+	if ((control_runlevel != 'N') || (control_prevlevel != 'N'))
+		status_page_set_runlevel (control_runlevel, control_prevlevel);
+
+	return 0;
+}
@@ -24,6 +24,7 @@
 
 #include <nih/macros.h>
 #include <nih/list.h>
+#include <nih/main.h>
 
 #include <nih-dbus/dbus_connection.h>
 #include <nih-dbus/dbus_message.h>
@@ -31,8 +32,11 @@
 #include <json.h>
 
 #include "event.h"
+#include "job_class.h"
 #include "quiesce.h"
 
+#include "com.ubuntu.Upstart.h"
+
 /**
  * USE_SESSION_BUS_ENV:
  *
@@ -86,6 +90,24 @@
 	}                                                             \
 }
 
+/**
+ * ControlEmitBatch:
+ * @message: D-Bus connection and message received,
+ * @pending: number of events still to finish,
+ * @failed: TRUE if any of the events failed.
+ *
+ * This structure tracks the events emitted by a single EmitEvents method
+ * call that asked to wait for completion.  Each event is blocked on it
+ * with a BLOCKED_EMIT_EVENTS_METHOD Blocked entry; the reply is sent by
+ * event_finished() once @pending reaches zero.
+ **/
+typedef struct control_emit_batch {
+	NihDBusMessage *message;
+	size_t          pending;
+	int             failed;
+} ControlEmitBatch;
+
+
 NIH_BEGIN_EXTERN
 
 extern DBusServer     *control_server;
@@ -93,6 +115,8 @@ extern DBusConnection *control_bus;
 
 extern NihList        *control_conns;
 
+extern int             control_state_fork;
+
 
 void control_init                 (void);
 void control_cleanup              (void);
@@ -114,6 +138,25 @@ int  control_get_job_by_name      (void *data, NihDBusMessage *message,
 int  control_get_all_jobs         (void *data, NihDBusMessage *message,
 				   char ***jobs)
 	__attribute__ ((warn_unused_result));
+int  control_get_all_job_states   (void *data, NihDBusMessage *message,
+				   const char *pattern,
+				   ControlGetAllJobStatesStatesElement ***states)
+	__attribute__ ((warn_unused_result));
+int  control_get_job_event_names  (void *data, NihDBusMessage *message,
+				   const char *pattern, char ***names)
+	__attribute__ ((warn_unused_result));
+int  control_get_condition_graph  (void *data, NihDBusMessage *message,
+				   int runtime,
+				   ControlGetConditionGraphJobsElement ***jobs,
+				   ControlGetConditionGraphBlockedElement ***blocked)
+	__attribute__ ((warn_unused_result));
+int  control_get_all_job_conditions (void *data, NihDBusMessage *message,
+				     ControlGetAllJobConditionsJobsElement ***jobs)
+	__attribute__ ((warn_unused_result));
+
+void control_notify_job_added     (JobClass *class);
+void control_notify_job_removed   (JobClass *class);
+void control_jobs_changed_flush   (void *data, NihMainLoopFunc *func);
 
 int  control_emit_event           (void *data, NihDBusMessage *message,
 				   const char *name, char * const *env,
@@ -123,11 +166,39 @@ int  control_emit_event_with_file (void *data, NihDBusMessage *message,
 				   const char *name, char * const *env,
 				   int wait, int file)
 	__attribute__ ((warn_unused_result));
+int  control_emit_events          (void *data, NihDBusMessage *message,
+				   ControlEmitEventsEventsElement * const *events)
+	__attribute__ ((warn_unused_result));
 
 int  control_get_version          (void *data, NihDBusMessage *message,
 				   char **version)
 	__attribute__ ((warn_unused_result));
 
+int  control_get_runlevel         (void *data, NihDBusMessage *message,
+				   char **runlevel)
+	__attribute__ ((warn_unused_result));
+int  control_get_prevlevel        (void *data, NihDBusMessage *message,
+				   char **prevlevel)
+	__attribute__ ((warn_unused_result));
+
+void control_notify_runlevel      (Event *event);
+
+int  control_get_reexec_stats     (void *data, NihDBusMessage *message,
+				   char **reexec_stats)
+	__attribute__ ((warn_unused_result));
+
+int  control_get_event_stats      (void *data, NihDBusMessage *message,
+				   char **event_stats)
+	__attribute__ ((warn_unused_result));
+
+int  control_get_alloc_stats      (void *data, NihDBusMessage *message,
+				   char **alloc_stats)
+	__attribute__ ((warn_unused_result));
+
+int  control_get_log_stats        (void *data, NihDBusMessage *message,
+				   char **log_stats)
+	__attribute__ ((warn_unused_result));
+
 int  control_get_log_priority     (void *data, NihDBusMessage *message,
 				   char **log_priority)
 	__attribute__ ((warn_unused_result));
@@ -150,13 +221,45 @@ int control_bus_release_name (void)
 	__attribute__ ((warn_unused_result));
 
 int control_get_state (void           *data,
-		   NihDBusMessage  *message,
-		   char           **state)
+		   NihDBusMessage  *message)
+	__attribute__ ((warn_unused_result));
+
+int control_get_state_filtered (void           *data,
+				NihDBusMessage *message,
+				char * const   *kinds,
+				char * const   *names,
+				uint64_t        since,
+				char          **state)
+	__attribute__ ((warn_unused_result));
+
+int control_get_boot_trace (void           *data,
+			    NihDBusMessage  *message,
+			    char           **trace)
+	__attribute__ ((warn_unused_result));
+
+int control_get_event_history (void                                  *data,
+			       NihDBusMessage                        *message,
+			       const char                            *name,
+			       uint32_t                               since,
+			       ControlGetEventHistoryEventsElement ***events)
+	__attribute__ ((warn_unused_result));
+
+int control_metrics_get_snapshot (void           *data,
+				  NihDBusMessage  *message,
+				  char           **snapshot)
 	__attribute__ ((warn_unused_result));
 
 int  control_restart (void *data, NihDBusMessage *message)
 	__attribute__ ((warn_unused_result));
 
+int  control_subscribe            (void *data, NihDBusMessage *message,
+				   const char *job_pattern,
+				   const char *event_pattern,
+				   uint32_t window)
+	__attribute__ ((warn_unused_result));
+int  control_unsubscribe          (void *data, NihDBusMessage *message)
+	__attribute__ ((warn_unused_result));
+
 void control_notify_event_emitted (Event *event);
 
 void control_notify_restarted (void);
@@ -165,6 +268,9 @@ int control_notify_disk_writeable (void   *data,
 		     NihDBusMessage *message)
 	__attribute__ ((warn_unused_result));
 
+int control_reopen_logs (void *data, NihDBusMessage *message)
+	__attribute__ ((warn_unused_result));
+
 int control_notify_dbus_address (void   *data,
 		     NihDBusMessage *message,
 		     const char *address)
@@ -220,6 +326,12 @@ json_object *control_serialise_bus_address (void)
 int control_deserialise_bus_address (json_object *json)
 	__attribute__ ((warn_unused_result));
 
+json_object *control_serialise_runlevel (void)
+	__attribute__ ((warn_unused_result));
+
+int control_deserialise_runlevel (json_object *json)
+	__attribute__ ((warn_unused_result));
+
 NIH_END_EXTERN
 
 #endif /* INIT_CONTROL_H */
@@ -39,9 +39,29 @@
 
 
 /* Prototypes for static functions */
-static char *environ_expand_until (char **str, const void *parent,
-				   size_t *len, size_t *pos, char * const *env,
-				   const char *until);
+static char **environ_add_entry   (char ***env, const void *parent,
+				   size_t *len, int replace, const char *str,
+				   int shared)
+	__attribute__ ((warn_unused_result));
+static char **environ_append_entries (char ***env, const void *parent,
+				      size_t *len, int replace,
+				      char * const *new_env, int shared)
+	__attribute__ ((warn_unused_result));
+static char **env_table_add_entry (EnvTable *table, const void *parent,
+				   int replace, const char *str, int shared)
+	__attribute__ ((warn_unused_result));
+static int    environ_buf_append  (EnvironBuf *buf, const char *str,
+				   size_t len)
+	__attribute__ ((warn_unused_result));
+static int    environ_expand_until (EnvironBuf *buf, const char *string,
+				    size_t *pos, char * const *env,
+				    const char *until)
+	__attribute__ ((warn_unused_result));
+static size_t env_table_hash      (const char *key, size_t len);
+static size_t *env_table_slot     (EnvTable *table, const char *key,
+				   size_t len);
+static int    env_table_reindex   (EnvTable *table)
+	__attribute__ ((warn_unused_result));
 
 
 /**
@@ -83,10 +103,37 @@ environ_add (char       ***env,
 	     size_t       *len,
 	     int           replace,
 	     const char   *str)
+{
+	return environ_add_entry (env, parent, len, replace, str, FALSE);
+}
+
+/**
+ * environ_add_entry:
+ * @env: pointer to environment table,
+ * @parent: parent object for new array,
+ * @len: length of @env,
+ * @replace: TRUE if existing entry should be replaced,
+ * @str: string to add,
+ * @shared: TRUE if @str may be referenced rather than copied.
+ *
+ * Implements environ_add(); when @shared is TRUE and @str is in KEY=VALUE
+ * format, @str itself is placed in @env and referenced by it, see
+ * environ_reference().
+ *
+ * Returns: new array pointer or NULL if insufficient memory.
+ **/
+static char **
+environ_add_entry (char       ***env,
+		   const void   *parent,
+		   size_t       *len,
+		   int           replace,
+		   const char   *str,
+		   int           shared)
 {
 	size_t           key, _len;
 	char           **old_str;
-	nih_local char  *new_str = NULL;
+	char            *new_str = NULL;
+	nih_local char  *copy = NULL;
 
 	nih_assert (env != NULL);
 	nih_assert (str != NULL);
@@ -107,8 +154,10 @@ environ_add (char       ***env,
 	 * and use that as the new value otherwise use the string given.
 	 */
 	key = strcspn (str, "=");
-	if (str[key] == '=') {
-		new_str = nih_strdup (NULL, str);
+	if ((str[key] == '=') && shared) {
+		new_str = (char *)str;
+	} else if (str[key] == '=') {
+		new_str = copy = nih_strdup (NULL, str);
 		if (! new_str)
 			return NULL;
 	} else {
@@ -116,7 +165,8 @@ environ_add (char       ***env,
 
 		value = getenv (str);
 		if (value) {
-			new_str = nih_sprintf (NULL, "%s=%s", str, value);
+			new_str = copy = nih_sprintf (NULL, "%s=%s",
+						      str, value);
 			if (! new_str)
 				return NULL;
 		}
@@ -127,7 +177,9 @@ environ_add (char       ***env,
 	 * extending the table.
 	 */
 	old_str = (char **)environ_lookup (*env, str, key);
-	if (old_str && replace) {
+	if (old_str && (*old_str == new_str)) {
+		return *env;
+	} else if (old_str && replace) {
 		nih_unref (*old_str, *env);
 
 		if (new_str) {
@@ -258,14 +310,111 @@ environ_append (char       ***env,
 		size_t       *len,
 		int           replace,
 		char * const *new_env)
+{
+	return environ_append_entries (env, parent, len, replace, new_env,
+				       FALSE);
+}
+
+/**
+ * environ_reference:
+ * @env: pointer to environment table,
+ * @parent: parent object for new array,
+ * @len: length of @env,
+ * @replace: TRUE if existing entries should be replaced,
+ * @new_env: environment table to append to @env.
+ *
+ * Appends the entries in the environment table @new_env to the existing
+ * table @env in the same way as environ_append(), except that entries in
+ * KEY=VALUE format are not copied: the strings of @new_env are placed in
+ * @env and referenced by it, so they remain allocated for as long as
+ * either table holds them.
+ *
+ * Since the strings are shared, they must have been allocated using
+ * nih_alloc() and neither table may modify them in place; entries are
+ * only ever replaced or removed, which drops the reference of that table
+ * alone.
+ *
+ * Returns: new array pointer or NULL if insufficient memory.
+ **/
+char **
+environ_reference (char       ***env,
+		   const void   *parent,
+		   size_t       *len,
+		   int           replace,
+		   char * const *new_env)
+{
+	return environ_append_entries (env, parent, len, replace, new_env,
+				       TRUE);
+}
+
+/**
+ * environ_append_entries:
+ * @env: pointer to environment table,
+ * @parent: parent object for new array,
+ * @len: length of @env,
+ * @replace: TRUE if existing entries should be replaced,
+ * @new_env: environment table to append to @env,
+ * @shared: TRUE if entries of @new_env may be referenced.
+ *
+ * Implements environ_append() and environ_reference().
+ *
+ * Returns: new array pointer or NULL if insufficient memory.
+ **/
+static char **
+environ_append_entries (char       ***env,
+			const void   *parent,
+			size_t       *len,
+			int           replace,
+			char * const *new_env,
+			int           shared)
 {
 	char * const *e;
+	EnvTable     *table;
+	size_t        count = 0;
+	size_t        _len;
 
 	nih_assert (env != NULL);
 
 	for (e = new_env; e && *e; e++)
-		if (! environ_add (env, parent, len, replace, *e))
+		count++;
+
+	if (count < ENVIRON_TABLE_MIN) {
+		for (e = new_env; e && *e; e++)
+			if (! environ_add_entry (env, parent, len, replace,
+						 *e, shared))
+				return NULL;
+
+		return *env;
+	}
+
+	/* Appending this many entries one by one would search @env for
+	 * each, so index it first.
+	 */
+	if (! len) {
+		len = &_len;
+
+		_len = 0;
+		for (e = *env; e && *e; e++)
+			_len++;
+	}
+
+	table = env_table_new (NULL, *env, *len);
+	if (! table)
+		return NULL;
+
+	for (e = new_env; *e; e++) {
+		if (! env_table_add_entry (table, parent, replace, *e,
+					   shared)) {
+			*env = table->env;
+			*len = table->len;
+			nih_free (table);
 			return NULL;
+		}
+	}
+
+	*env = table->env;
+	*len = table->len;
+	nih_free (table);
 
 	return *env;
 }
@@ -478,6 +627,10 @@ environ_all_valid (char * const *env)
  * of the returned string are freed, the returned string will also be
  * freed.
  *
+ * Callers that only need the expansion briefly should use
+ * environ_expand_buf() instead, which needs no allocation at all for
+ * most strings.
+ *
  * Returns: newly allocated string or NULL on raised error.
  **/
 char *
@@ -485,189 +638,349 @@ environ_expand (const void   *parent,
 		const char   *string,
 		char * const *env)
 {
-	char   *str;
-	size_t  len, pos;
+	EnvironBuf  buf;
+	const char *expanded;
+	char       *str;
 
 	nih_assert (string != NULL);
 
-	str = nih_strdup (parent, string);
+	environ_buf_init (&buf);
+
+	expanded = environ_expand_buf (&buf, string, env);
+	if (! expanded)
+		return NULL;
+
+	str = nih_strdup (parent, expanded);
+	environ_buf_clear (&buf);
+
 	if (! str) {
 		nih_error_raise_system ();
 		return NULL;
 	}
 
-	len = strlen (string);
-	pos = 0;
+	return str;
+}
+
+/**
+ * environ_buf_init:
+ * @buf: buffer to initialise.
+ *
+ * Initialise @buf, usually declared on the stack, to hold the empty
+ * string in its own storage before it is passed to environ_expand_buf().
+ **/
+void
+environ_buf_init (EnvironBuf *buf)
+{
+	nih_assert (buf != NULL);
+
+	buf->str = buf->buf;
+	buf->len = 0;
+	buf->size = sizeof (buf->buf);
+	buf->buf[0] = '\0';
+}
+
+/**
+ * environ_buf_clear:
+ * @buf: buffer to clear.
+ *
+ * Free any memory allocated for expansions too long for the storage of
+ * @buf itself, and initialise it again.  This must be called once @buf
+ * is no longer needed.
+ **/
+void
+environ_buf_clear (EnvironBuf *buf)
+{
+	nih_assert (buf != NULL);
+
+	if (buf->str != buf->buf)
+		nih_free (buf->str);
+
+	environ_buf_init (buf);
+}
+
+/**
+ * environ_buf_append:
+ * @buf: buffer to append to,
+ * @str: characters to append,
+ * @len: number of characters from @str.
+ *
+ * Append @len characters from @str to the string in @buf, moving it out
+ * of the storage of @buf to a larger allocation if it doesn't fit.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+environ_buf_append (EnvironBuf *buf,
+		    const char *str,
+		    size_t      len)
+{
+	nih_assert (buf != NULL);
+	nih_assert (str != NULL);
+
+	if (buf->len + len + 1 > buf->size) {
+		char   *new_str;
+		size_t  size;
 
-	if (! environ_expand_until (&str, parent, &len, &pos, env, ""))
+		size = buf->size * 2;
+		while (size < buf->len + len + 1)
+			size *= 2;
+
+		if (buf->str == buf->buf) {
+			new_str = nih_alloc (NULL, size);
+			if (new_str)
+				memcpy (new_str, buf->str, buf->len + 1);
+		} else {
+			new_str = nih_realloc (buf->str, NULL, size);
+		}
+
+		if (! new_str) {
+			nih_error_raise_system ();
+			return -1;
+		}
+
+		buf->str = new_str;
+		buf->size = size;
+	}
+
+	memcpy (buf->str + buf->len, str, len);
+	buf->len += len;
+	buf->str[buf->len] = '\0';
+
+	return 0;
+}
+
+/**
+ * environ_expand_buf:
+ * @buf: buffer for the expansion,
+ * @string: string to expand,
+ * @env: NULL-terminated list of environment variables to use.
+ *
+ * Expand variable references in @string using the NULL-terminated list of
+ * KEY=VALUE strings in the given @env table, as environ_expand() does,
+ * but without allocating a new string for the result.
+ *
+ * If @string contains no references it is returned itself, otherwise the
+ * expansion is made into @buf, which must have been initialised with
+ * environ_buf_init().  Only expansions exceeding ENVIRON_BUF_SIZE need
+ * any memory to be allocated, and that is kept by @buf so that it may
+ * be passed again for the next string to be expanded.
+ *
+ * Either way the returned string is only valid until @string or @buf
+ * are next modified, and environ_buf_clear() must be called once @buf is
+ * finished with.  On error @buf is cleared.
+ *
+ * Returns: expanded string or NULL on raised error.
+ **/
+const char *
+environ_expand_buf (EnvironBuf   *buf,
+		    const char   *string,
+		    char * const *env)
+{
+	size_t pos;
+
+	nih_assert (buf != NULL);
+	nih_assert (string != NULL);
+
+	if (! strchr (string, '$'))
+		return string;
+
+	buf->len = 0;
+	buf->str[0] = '\0';
+
+	pos = 0;
+	if (environ_expand_until (buf, string, &pos, env, "") < 0) {
+		environ_buf_clear (buf);
 		return NULL;
+	}
 
-	return str;
+	return buf->str;
 }
 
 /**
  * environ_expand_until:
- * @str: string being expanded,
- * @parent: parent object for new string,
- * @len: length of @str,
- * @pos: current position within @str,
+ * @buf: buffer for the expansion,
+ * @string: string being expanded,
+ * @pos: current position within @string,
  * @env: NULL-terminated list of environment variables to use,
  * @until: characters to stop expansion on.
  *
- * Perform an in-place expansion of variable references in @str using the
+ * Expand variable references in @string from @pos using the
  * NULL-terminated list of KEY=VALUE strings in the given @env table,
- * stopping expansion when any of the characters in @until or the end of
- * @str is reached.
+ * appending the result to the string in @buf and stopping expansion
+ * when any of the characters in @until or the end of @string is reached.
  *
  * See environ_expand() for the valid references.
  *
- * @len will be updated after each expansion to contain the new length,
- * which may be shorter or longer than before depending on the relative
- * lengths of the reference and value.
- *
- * @pos will be likewise updated to point to the character listed in @until.
+ * @pos will be updated to point to the character listed in @until.
  *
- * @parent is ignored, though for style reasons it is usual to pass a
- * parent of @str.
- *
- * Returns: reallocated string or NULL on raised error.
+ * Returns: zero on success, negative value on raised error.
  **/
-static char *
-environ_expand_until (char        **str,
-		      const void   *parent,
-		      size_t       *len,
+static int
+environ_expand_until (EnvironBuf   *buf,
+		      const char   *string,
 		      size_t       *pos,
 		      char * const *env,
 		      const char   *until)
 {
-	nih_assert (str != NULL);
-	nih_assert (*str != NULL);
-	nih_assert (len != NULL);
+	nih_assert (buf != NULL);
+	nih_assert (string != NULL);
 	nih_assert (pos != NULL);
 	nih_assert (until != NULL);
 
 	for (;;) {
 		enum { OP_VALUE, OP_DEFAULT, OP_ALTERNATE } op = OP_VALUE;
-		size_t      start, end;
+		size_t      start, literal;
 		size_t      name_start, name_end;
 		size_t      arg_start = 0, arg_end = 0;
 		int         ignore_empty = FALSE;
 		const char *value;
-		size_t      value_len, offset;
+		size_t      value_len;
 
-		/* Locate the start of the next reference, if we have no
-		 * further references, we can exit the loop and return the
-		 * string.
+		/* Copy everything up to the start of the next reference,
+		 * if we have no further references, we can exit the loop
+		 * and return.
 		 */
-		while (((*str)[*pos] != '$')
-		       && (! strchr (until, (*str)[*pos])))
+		literal = *pos;
+		while ((string[*pos] != '$')
+		       && (! strchr (until, string[*pos])))
 			(*pos)++;
-		if ((*str)[*pos] != '$')
+
+		if ((*pos > literal)
+		    && (environ_buf_append (buf, string + literal,
+					    *pos - literal) < 0))
+			return -1;
+
+		if (string[*pos] != '$')
 			break;
 
 		/* Look at the next character to find out whether this is
 		 * a simple expansion, a bracketed expansion or a lone
-		 * dollar sign.
+		 * dollar sign.  The name and argument of the reference
+		 * are expanded into the buffer after @start, to be
+		 * replaced by the value.
 		 */
-		start = (*pos)++;
-		if (((*str)[*pos] == '_')
-		    || (((*str)[*pos] >= 'A') && ((*str)[*pos] <= 'Z'))
-		    || (((*str)[*pos] >= 'a') && ((*str)[*pos] <= 'z')))
+		start = buf->len;
+		(*pos)++;
+		if ((string[*pos] == '_')
+		    || ((string[*pos] >= 'A') && (string[*pos] <= 'Z'))
+		    || ((string[*pos] >= 'a') && (string[*pos] <= 'z')))
 		{
 			/* Simple reference; use all following alphanumeric
 			 * characters and leave pos pointing at the first
 			 * non-reference character.
 			 */
-			name_start = (*pos)++;
-			while (((*str)[*pos] == '_')
-			       || (((*str)[*pos] >= 'A') && ((*str)[*pos] <= 'Z'))
-			       || (((*str)[*pos] >= 'a') && ((*str)[*pos] <= 'z'))
-			       || (((*str)[*pos] >= '0') && ((*str)[*pos] <= '9')))
+			literal = (*pos)++;
+			while ((string[*pos] == '_')
+			       || ((string[*pos] >= 'A') && (string[*pos] <= 'Z'))
+			       || ((string[*pos] >= 'a') && (string[*pos] <= 'z'))
+			       || ((string[*pos] >= '0') && (string[*pos] <= '9')))
 				(*pos)++;
-			name_end = end = (*pos);
 
-		} else if (((*str)[*pos] == '{')
-			   && ((*str)[*pos + 1] == '}')) {
+			value = environ_getn (env, string + literal,
+					      *pos - literal);
+			if (value == NULL) {
+				nih_error_raise_printf (
+					ENVIRON_UNKNOWN_PARAM,
+					"%s: %.*s", _(ENVIRON_UNKNOWN_PARAM_STR),
+					(int)(*pos - literal),
+					string + literal);
+				return -1;
+			}
+
+			if (environ_buf_append (buf, value, strlen (value)) < 0)
+				return -1;
+
+			continue;
+
+		} else if ((string[*pos] == '{')
+			   && (string[*pos + 1] == '}')) {
 			/* Empty bracketed expression; this is a special that
 			 * is always replaced by the literal dollar sign.
 			 */
 			*pos += 2;
-			end = *pos;
 
-			value = "$";
-			value_len = 1;
-			goto subst;
+			if (environ_buf_append (buf, "$", 1) < 0)
+				return -1;
+
+			continue;
 
-		} else if ((*str)[*pos] == '{') {
+		} else if (string[*pos] == '{') {
 			/* Bracketed reference; step over the bracket and
 			 * treat the inner as another string to be expanded,
 			 * terminated by any character that terminates the
 			 * name part of the reference.
 			 */
-			name_start = ++(*pos);
-			if (! environ_expand_until (str, parent, len, pos,
-						    env, "}:-+"))
-				return NULL;
+			(*pos)++;
+			name_start = buf->len;
+			if (environ_expand_until (buf, string, pos,
+						  env, "}:-+") < 0)
+				return -1;
 
-			name_end = (*pos);
+			name_end = buf->len;
 
 			/* Check for an expression operator; if we find one,
 			 * step over it and evalulate the rest of the bracketed
 			 * expression to find the substitute value.
 			 */
-			if (((*str)[*pos] == ':')
-			    && (*str)[*pos + 1] == '-') {
+			if ((string[*pos] == ':')
+			    && string[*pos + 1] == '-') {
 				(*pos) += 2;
 				op = OP_DEFAULT;
 				ignore_empty = TRUE;
-			} else if (((*str)[*pos] == ':')
-			    && (*str)[*pos + 1] == '+') {
+			} else if ((string[*pos] == ':')
+			    && string[*pos + 1] == '+') {
 				(*pos) += 2;
 				op = OP_ALTERNATE;
 				ignore_empty = TRUE;
-			} else if ((*str)[*pos] == '-') {
+			} else if (string[*pos] == '-') {
 				(*pos)++;
 				op = OP_DEFAULT;
-			} else if ((*str)[*pos] == '+') {
+			} else if (string[*pos] == '+') {
 				(*pos)++;
 				op = OP_ALTERNATE;
-			} else if (((*str)[*pos] != '}')
-				   && ((*str)[*pos] != '\0')) {
+			} else if ((string[*pos] != '}')
+				   && (string[*pos] != '\0')) {
 				nih_error_raise (ENVIRON_EXPECTED_OPERATOR,
 						 _(ENVIRON_EXPECTED_OPERATOR_STR));
-				goto error;
+				return -1;
 			}
 
 			/* Expand any argument appearing after the expression
 			 * operator; for simple value expansion, this will
 			 * be almost a no-op, except we'll have defined values
 			 */
-			arg_start = *pos;
-			if (! environ_expand_until (str, parent, len, pos,
-							    env, "}"))
-				return NULL;
+			arg_start = buf->len;
+			if (environ_expand_until (buf, string, pos,
+						  env, "}") < 0)
+				return -1;
 
-			arg_end = (*pos);
+			arg_end = buf->len;
 
 			/* Make sure the final character ends the bracketed
 			 * expression and that we haven't hit the end of the
 			 * string.
 			 */
-			if ((*str)[*pos] != '}') {
+			if (string[*pos] != '}') {
 				nih_error_raise (ENVIRON_MISMATCHED_BRACES,
 						 _(ENVIRON_MISMATCHED_BRACES_STR));
-				goto error;
+				return -1;
 			}
 
-			end = ++(*pos);
+			(*pos)++;
 		} else {
+			/* Lone dollar sign, copied with the literal text
+			 * that follows it.
+			 */
+			if (environ_buf_append (buf, "$", 1) < 0)
+				return -1;
+
 			continue;
 		}
 
 		/* Lookup the environment variable.  How we handle whether
 		 * this is NULL or not depends on the operator in effect.
 		 */
-		value = environ_getn (env, *str + name_start,
+		value = environ_getn (env, buf->str + name_start,
 				      name_end - name_start);
 
 		switch (op) {
@@ -680,11 +993,10 @@ environ_expand_until (char        **str,
 					ENVIRON_UNKNOWN_PARAM,
 					"%s: %.*s", _(ENVIRON_UNKNOWN_PARAM_STR),
 					(int)(name_end - name_start),
-					*str + name_start);
-				goto error;
+					buf->str + name_start);
+				return -1;
 			}
 
-			value_len = strlen (value);
 			break;
 		case OP_DEFAULT:
 			/* Value may be directly substitued from the
@@ -692,12 +1004,8 @@ environ_expand_until (char        **str,
 			 * the argument to the expression.
 			 */
 			if ((value == NULL)
-			    || (ignore_empty && (value[0] == '\0'))) {
-				value = *str + arg_start;
-				value_len = arg_end - arg_start;
-			} else {
-				value_len = strlen (value);
-			}
+			    || (ignore_empty && (value[0] == '\0')))
+				value = NULL;
 			break;
 		case OP_ALTERNATE:
 			/* Substitute the empty string if the value is
@@ -707,58 +1015,356 @@ environ_expand_until (char        **str,
 			if ((value == NULL)
 			    || (ignore_empty && (value[0] == '\0'))) {
 				value = "";
-				value_len = 0;
 			} else {
-				value = *str + arg_start;
-				value_len = arg_end - arg_start;
+				value = NULL;
 			}
 			break;
 		default:
 			nih_assert_not_reached ();
 		}
 
-	subst:
-		/* Work out whether we need to extend the string to fit the
-		 * value in place, then adjust the string so that there's
-		 * the right gap for the value to slot in.
+		/* Replace the name and argument in the buffer with the
+		 * value, which is the argument itself when value is NULL.
 		 */
-		if (value_len > end - start) {
-			char *new_str;
-
-			offset = value_len - (end - start);
-			new_str = nih_realloc (*str, parent,
-					       *len + offset + 1);
-			if (! new_str) {
-				nih_error_raise_system ();
-				goto error;
-			}
+		if (value) {
+			buf->len = start;
+			if (environ_buf_append (buf, value, strlen (value)) < 0)
+				return -1;
+		} else {
+			value_len = arg_end - arg_start;
 
-			*str = new_str;
+			memmove (buf->str + start, buf->str + arg_start,
+				 value_len);
+			buf->len = start + value_len;
+			buf->str[buf->len] = '\0';
+		}
+	}
 
-			memmove (*str + end + offset, *str + end,
-				 *len - end + 1);
-			memmove (*str + start, value, value_len);
+	return 0;
+}
+
+
+/**
+ * env_table_new:
+ * @parent: parent object for new table,
+ * @env: environment table to index,
+ * @len: length of @env.
+ *
+ * Allocates and returns a new EnvTable indexing the entries of @env,
+ * which may be NULL; @env is not copied and must not be modified or
+ * freed other than through the returned table while it exists. Where
+ * @env contains more than one entry for a variable, only the first is
+ * found, as with environ_lookup().
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned table.  When all parents
+ * of the returned table are freed, the returned table will also be
+ * freed.
+ *
+ * Returns: new EnvTable or NULL if insufficient memory.
+ **/
+EnvTable *
+env_table_new (const void  *parent,
+	       char       **env,
+	       size_t       len)
+{
+	EnvTable *table;
+
+	table = nih_new (parent, EnvTable);
+	if (! table)
+		return NULL;
 
-			*len += offset;
-			*pos += offset;
-		} else if (value_len < end - start) {
-			offset = (end - start) - value_len;
+	table->env = env;
+	table->len = len;
+	table->index = NULL;
+	table->size = 0;
+
+	if (! env_table_reindex (table)) {
+		nih_free (table);
+		return NULL;
+	}
 
-			memmove (*str + start, value, value_len);
-			memmove (*str + end - offset, *str + end,
-				 *len - end + 1);
+	return table;
+}
 
-			*len -= offset;
-			*pos -= offset;
+/**
+ * env_table_hash:
+ * @key: variable name,
+ * @len: length of @key.
+ *
+ * Returns: FNV-1a hash of @key.
+ **/
+static size_t
+env_table_hash (const char *key,
+		size_t      len)
+{
+	size_t hash = 2166136261U;
+
+	nih_assert (key != NULL);
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)key[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/**
+ * env_table_slot:
+ * @table: table to search,
+ * @key: variable name,
+ * @len: length of @key.
+ *
+ * Returns: slot in the index of @table holding @key, or the empty slot
+ * where it would be placed.
+ **/
+static size_t *
+env_table_slot (EnvTable   *table,
+		const char *key,
+		size_t      len)
+{
+	size_t i;
+
+	nih_assert (table != NULL);
+	nih_assert (table->size);
+
+	for (i = env_table_hash (key, len) & (table->size - 1); table->index[i];
+	     i = (i + 1) & (table->size - 1)) {
+		const char *e = table->env[table->index[i] - 1];
+
+		if ((strncmp (e, key, len) == 0) && (e[len] == '='))
+			break;
+	}
+
+	return &table->index[i];
+}
+
+/**
+ * env_table_reindex:
+ * @table: table to index.
+ *
+ * Rebuild the index of @table, growing it so that no more than half of
+ * the slots are in use once another entry is added.
+ *
+ * Returns: TRUE on success, FALSE if insufficient memory.
+ **/
+static int
+env_table_reindex (EnvTable *table)
+{
+	size_t *index;
+	size_t  size;
+
+	nih_assert (table != NULL);
+
+	size = table->size ? table->size : 16;
+	while (size < (table->len + 1) * 2)
+		size *= 2;
+
+	index = nih_alloc (table, sizeof (size_t) * size);
+	if (! index)
+		return FALSE;
+
+	memset (index, '\0', sizeof (size_t) * size);
+
+	if (table->index)
+		nih_free (table->index);
+
+	table->index = index;
+	table->size = size;
+
+	for (size_t i = 0; i < table->len; i++) {
+		size_t  key;
+		size_t *slot;
+
+		key = strcspn (table->env[i], "=");
+
+		/* Entries without a value can never be found */
+		if (table->env[i][key] != '=')
+			continue;
+
+		slot = env_table_slot (table, table->env[i], key);
+		if (! *slot)
+			*slot = i + 1;
+	}
+
+	return TRUE;
+}
+
+/**
+ * env_table_add:
+ * @table: table to add to,
+ * @parent: parent object for new array,
+ * @replace: TRUE if existing entry should be replaced,
+ * @str: string to add.
+ *
+ * Add the new environment variable @str to @table, with the same
+ * semantics as environ_add() but without searching the table.
+ *
+ * @parent is used as the parent of the environment table if that of
+ * @table was NULL.
+ *
+ * Returns: new environment table pointer (also stored in @table), or
+ * NULL if insufficient memory.
+ **/
+char **
+env_table_add (EnvTable   *table,
+	       const void *parent,
+	       int         replace,
+	       const char *str)
+{
+	return env_table_add_entry (table, parent, replace, str, FALSE);
+}
+
+/**
+ * env_table_add_entry:
+ * @table: table to add to,
+ * @parent: parent object for new array,
+ * @replace: TRUE if existing entry should be replaced,
+ * @str: string to add,
+ * @shared: TRUE if @str may be referenced rather than copied.
+ *
+ * Implements env_table_add(), referencing @str as environ_add_entry()
+ * does when @shared is TRUE.
+ *
+ * Returns: new environment table pointer (also stored in @table), or
+ * NULL if insufficient memory.
+ **/
+static char **
+env_table_add_entry (EnvTable   *table,
+		     const void *parent,
+		     int         replace,
+		     const char *str,
+		     int         shared)
+{
+	size_t           key;
+	size_t          *slot;
+	char            *new_str = NULL;
+	nih_local char  *copy = NULL;
+
+	nih_assert (table != NULL);
+	nih_assert (str != NULL);
+
+	/* Calculate the length of the key in the string, if we reach the
+	 * end of the string, then we lookup the value in the environment
+	 * and use that as the new value otherwise use the string given.
+	 */
+	key = strcspn (str, "=");
+	if ((str[key] == '=') && shared) {
+		new_str = (char *)str;
+	} else if (str[key] == '=') {
+		new_str = copy = nih_strdup (NULL, str);
+		if (! new_str)
+			return NULL;
+	} else {
+		const char *value;
+
+		value = getenv (str);
+		if (value) {
+			new_str = copy = nih_sprintf (NULL, "%s=%s",
+						      str, value);
+			if (! new_str)
+				return NULL;
+		}
+	}
+
+	slot = env_table_slot (table, str, key);
+	if (*slot && (table->env[*slot - 1] == new_str)) {
+		return table->env;
+	} else if (*slot && replace) {
+		char **old_str = &table->env[*slot - 1];
+
+		nih_unref (*old_str, table->env);
+
+		if (new_str) {
+			*old_str = new_str;
+			nih_ref (new_str, table->env);
 		} else {
-			memmove (*str + start, value, value_len);
+			memmove (old_str, old_str + 1,
+				 (char *)(table->env + table->len) - (char *)old_str);
+			table->len--;
+
+			/* Positions of later entries have changed */
+			if (! env_table_reindex (table))
+				return NULL;
 		}
+
+		return table->env;
+	} else if (*slot) {
+		return table->env;
+	}
+
+	/* No existing entry exists so extend the table instead.
+	 */
+	if (new_str) {
+		if (! nih_str_array_addp (&table->env, parent, &table->len, new_str))
+			return NULL;
+
+		*slot = table->len;
+
+		if ((table->len + 1) * 2 > table->size
+		    && ! env_table_reindex (table))
+			return NULL;
 	}
 
-	return *str;
+	return table->env;
+}
+
+/**
+ * env_table_lookup:
+ * @table: table to search,
+ * @key: key to lookup,
+ * @len: length of @key.
+ *
+ * Lookup the environment variable named @key, which is @len characters
+ * long, in @table.
+ *
+ * Returns: pointer to entry in the environment table of @table or NULL
+ * if not found.
+ **/
+char * const *
+env_table_lookup (EnvTable   *table,
+		  const char *key,
+		  size_t      len)
+{
+	size_t *slot;
+
+	nih_assert (table != NULL);
+	nih_assert (key != NULL);
+
+	slot = env_table_slot (table, key, len);
+
+	return *slot ? &table->env[*slot - 1] : NULL;
+}
+
+/**
+ * env_table_getn:
+ * @table: table to search,
+ * @key: key to lookup,
+ * @len: length of @key.
+ *
+ * Lookup the environment variable named @key, which is @len characters
+ * long, in @table and return a pointer to the value.
+ *
+ * Returns: string from the environment table of @table or NULL if not
+ * found.
+ **/
+const char *
+env_table_getn (EnvTable   *table,
+		const char *key,
+		size_t      len)
+{
+	char * const *e;
+
+	e = env_table_lookup (table, key, len);
+	if (e) {
+		const char *ret;
+
+		ret = strchr (*e, '=');
+		nih_assert (ret != NULL);
+
+		return ret + 1;
+	}
 
-error:
-	nih_free (*str);
-	*str = NULL;
 	return NULL;
 }
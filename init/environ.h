@@ -23,6 +23,65 @@
 #include <nih/macros.h>
 
 
+/**
+ * ENVIRON_TABLE_MIN:
+ *
+ * Number of entries being appended by environ_append() at or above
+ * which it is worth indexing the environment table with an EnvTable
+ * rather than searching it for each entry.
+ **/
+#define ENVIRON_TABLE_MIN 8
+
+/**
+ * ENVIRON_BUF_SIZE:
+ *
+ * Size of the storage within an EnvironBuf, long enough for the
+ * expansion of almost any event match or job instance name.
+ **/
+#define ENVIRON_BUF_SIZE 256
+
+
+/**
+ * EnvTable:
+ * @env: environment table,
+ * @len: length of @env,
+ * @index: open-addressing hash of entries in @env by variable name,
+ *  each slot holding one more than the position of the entry in @env
+ *  or zero if empty,
+ * @size: number of slots in @index (always a power of two).
+ *
+ * Index of an environment table allowing variables to be found without
+ * searching the table. The entries of @env remain in insertion order so
+ * @env may be used directly wherever a NULL-terminated environment
+ * table is expected; it is not owned by the EnvTable.
+ **/
+typedef struct env_table {
+	char   **env;
+	size_t   len;
+	size_t  *index;
+	size_t   size;
+} EnvTable;
+
+/**
+ * EnvironBuf:
+ * @str: expanded string,
+ * @len: length of @str,
+ * @size: size of the storage @str points to,
+ * @buf: storage for @str until it needs more than ENVIRON_BUF_SIZE.
+ *
+ * Buffer for environ_expand_buf() to expand strings into, usually
+ * declared on the stack so that most expansions need no allocation.
+ * It must be initialised with environ_buf_init() and cleared with
+ * environ_buf_clear() once finished with.
+ **/
+typedef struct environ_buf {
+	char   *str;
+	size_t  len;
+	size_t  size;
+	char    buf[ENVIRON_BUF_SIZE];
+} EnvironBuf;
+
+
 NIH_BEGIN_EXTERN
 
 char **       environ_add       (char ***env, const void *parent, size_t *len,
@@ -34,6 +93,9 @@ char **       environ_remove    (char ***env, const void *parent, size_t *len,
 char **       environ_append    (char ***env, const void *parent, size_t *len,
 				 int replace, char * const *new_env)
 	__attribute__ ((warn_unused_result));
+char **       environ_reference (char ***env, const void *parent, size_t *len,
+				 int replace, char * const *new_env)
+	__attribute__ ((warn_unused_result));
 
 char **       environ_set       (char ***env, const void *parent, size_t *len,
 				 int replace, const char *format, ...)
@@ -52,6 +114,22 @@ char *        environ_expand    (const void *parent, const char *string,
 				 char * const *env)
 	__attribute__ ((warn_unused_result));
 
+void          environ_buf_init  (EnvironBuf *buf);
+void          environ_buf_clear (EnvironBuf *buf);
+const char *  environ_expand_buf (EnvironBuf *buf, const char *string,
+				  char * const *env)
+	__attribute__ ((warn_unused_result));
+
+EnvTable *    env_table_new     (const void *parent, char **env, size_t len)
+	__attribute__ ((warn_unused_result));
+char **       env_table_add     (EnvTable *table, const void *parent,
+				 int replace, const char *str)
+	__attribute__ ((warn_unused_result));
+char * const *env_table_lookup  (EnvTable *table, const char *key,
+				 size_t len);
+const char *  env_table_getn    (EnvTable *table, const char *key,
+				 size_t len);
+
 NIH_END_EXTERN
 
 #endif /* INIT_ENVIRON_H */
@@ -45,8 +45,14 @@ enum {
 	PARSE_ILLEGAL_SIGNAL,
 	PARSE_ILLEGAL_UMASK,
 	PARSE_ILLEGAL_NICE,
+	PARSE_ILLEGAL_PRIORITY,
 	PARSE_ILLEGAL_OOM,
 	PARSE_ILLEGAL_LIMIT,
+	PARSE_ILLEGAL_PLACEMENT,
+	PARSE_ILLEGAL_SCHED,
+	PARSE_ILLEGAL_IOPRIO,
+	PARSE_ILLEGAL_TIMER_SLACK,
+	PARSE_ILLEGAL_JITTER,
 	PARSE_EXPECTED_EVENT,
 	PARSE_EXPECTED_OPERATOR,
 	PARSE_EXPECTED_VARIABLE,
@@ -56,7 +62,10 @@ enum {
 	CONTROL_NAME_TAKEN,
 
 	/* Errors while manipulating cgroups */
-	CGROUP_ERROR
+	CGROUP_ERROR,
+
+	/* Errors while reading event traces */
+	EVENT_TRACE_ILLEGAL
 };
 
 /* Error strings for defined messages */
@@ -72,13 +81,20 @@ enum {
 #define PARSE_ILLEGAL_SIGNAL_STR	N_("Illegal signal status, expected integer")
 #define PARSE_ILLEGAL_UMASK_STR		N_("Illegal file creation mask, expected octal integer")
 #define PARSE_ILLEGAL_NICE_STR		N_("Illegal nice value, expected -20 to 19")
+#define PARSE_ILLEGAL_PRIORITY_STR	N_("Illegal priority, expected -100 to 100")
 #define PARSE_ILLEGAL_OOM_STR		N_("Illegal oom adjustment, expected -16 to 15 or 'never'")
 #define PARSE_ILLEGAL_OOM_SCORE_STR	N_("Illegal oom score adjustment, expected -999 to 1000 or 'never'")
 #define PARSE_ILLEGAL_LIMIT_STR		N_("Illegal limit, expected 'unlimited' or integer")
+#define PARSE_ILLEGAL_PLACEMENT_STR	N_("Illegal list, expected numbers or ranges from 0 to 1023")
+#define PARSE_ILLEGAL_SCHED_STR		N_("Illegal scheduling policy, expected other, batch, idle, or fifo or rr and priority 1 to 99")
+#define PARSE_ILLEGAL_IOPRIO_STR	N_("Illegal I/O priority, expected realtime or best-effort and level 0 to 7, or idle")
+#define PARSE_ILLEGAL_TIMER_SLACK_STR	N_("Illegal timer slack, expected positive number of nanoseconds")
+#define PARSE_ILLEGAL_JITTER_STR	N_("Illegal jitter, expected percentage from 0 to 100")
 #define PARSE_EXPECTED_EVENT_STR	N_("Expected event")
 #define PARSE_EXPECTED_OPERATOR_STR	N_("Expected operator")
 #define PARSE_EXPECTED_VARIABLE_STR	N_("Expected variable name before value")
 #define PARSE_MISMATCHED_PARENS_STR	N_("Mismatched parentheses")
 #define CONTROL_NAME_TAKEN_STR		N_("Name already taken")
+#define EVENT_TRACE_ILLEGAL_STR		N_("Illegal event trace record")
 
 #endif /* INIT_ERRORS_H */
@@ -24,6 +24,10 @@
 #endif /* HAVE_CONFIG_H */
 
 
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -40,11 +44,18 @@
 
 #include "environ.h"
 #include "event.h"
+#include "event_operator.h"
+#include "job_class.h"
 #include "job.h"
 #include "blocked.h"
+#include "conf.h"
 #include "control.h"
 #include "errors.h"
 #include "quiesce.h"
+#include "metrics.h"
+#include "probes.h"
+#include "event_history.h"
+#include "event_trace.h"
 
 #include "com.ubuntu.Upstart.h"
 
@@ -52,11 +63,64 @@
 #include "cgroup.h"
 #endif /* ENABLE_CGROUPS */
 
+/**
+ * EventMatchQueue:
+ * @trees: operator trees to check,
+ * @count: number of @trees,
+ * @next: index of next tree to be checked,
+ * @event: event being handled,
+ * @pass: value to set the unmatched member of trees that can't match to.
+ *
+ * Work shared between event_prematch() and the event_prematch_worker()
+ * threads.
+ **/
+typedef struct event_match_queue {
+	EventOperator **trees;
+	size_t          count;
+	size_t          next;
+	const Event    *event;
+	unsigned int    pass;
+} EventMatchQueue;
+
+/**
+ * EventMatchPool:
+ * @lock: mutex protecting the other members,
+ * @work: condition signalled when @queue is given to the workers,
+ * @done: condition signalled when the last worker has finished @queue,
+ * @queue: queue being checked, or NULL,
+ * @generation: incremented each time a queue is given to the workers,
+ * @threads: number of workers started,
+ * @busy: number of workers yet to finish @queue.
+ *
+ * Worker threads started once by event_prematch_start() and kept waiting
+ * for the next queue, rather than being created for every event.
+ **/
+typedef struct event_match_pool {
+	pthread_mutex_t  lock;
+	pthread_cond_t   work;
+	pthread_cond_t   done;
+	EventMatchQueue *queue;
+	uintptr_t        generation;
+	int              threads;
+	int              busy;
+} EventMatchPool;
+
+
 /* Prototypes for static functions */
+static int  event_destroy              (Event *event);
 static void event_pending              (Event *event);
 static void event_pending_handle_jobs  (Event *event);
 static void event_finished             (Event *event);
 
+static unsigned int event_prematch        (JobClassEventIndex *index,
+					   Event *event);
+static void         event_prematch_start  (void);
+static void *       event_prematch_worker (void *data);
+static void         event_prematch_check  (EventMatchQueue *queue);
+static int          event_unmatched       (const EventOperator *tree,
+					   unsigned int pass)
+	__attribute__ ((warn_unused_result));
+
 static const char * event_progress_enum_to_str (EventProgress progress)
 	__attribute__ ((warn_unused_result));
 
@@ -74,6 +138,64 @@ extern json_object *json_events;
  **/
 NihList *events = NULL;
 
+/**
+ * events_ready:
+ *
+ * Events from the events list that event_poll() has work to do for, one
+ * list for each EventLane, in the order that they became ready: those
+ * pending and those whose last blocker has been removed.  Blocked events
+ * in the handling state are not on these lists, so are not revisited
+ * until they're unblocked.  Linked through the ready member of each
+ * Event.
+ **/
+NihList *events_ready[EVENT_LANE_LAST] = { NULL };
+
+/**
+ * event_table:
+ *
+ * Array of all events in the order they appear in the events list,
+ * used to make event_to_index() and event_from_index() constant-time
+ * during serialisation and deserialisation.  Only valid between calls
+ * to event_index_build() and event_index_clear(), during which the
+ * events list must not be modified.
+ **/
+static Event **event_table = NULL;
+
+/**
+ * event_table_len:
+ *
+ * Number of entries in event_table.
+ **/
+static size_t event_table_len = 0;
+
+/**
+ * event_match_threads:
+ *
+ * Number of threads besides the main one to rule out, with
+ * event_prematch(), the conditions an event can't match before they're
+ * handled; zero handles every condition on the main thread.
+ **/
+int event_match_threads = 0;
+
+/**
+ * event_match_pass:
+ *
+ * Number of the last pass of event_prematch(), never zero once one has
+ * been made.
+ **/
+static unsigned int event_match_pass = 0;
+
+/**
+ * event_match_pool:
+ *
+ * Threads of event_prematch(), started when first needed.
+ **/
+static EventMatchPool event_match_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
 
 /**
  * event_init:
@@ -85,6 +207,11 @@ event_init (void)
 {
 	if (! events)
 		events = NIH_MUST (nih_list_new (NULL));
+
+	for (int lane = 0; lane < EVENT_LANE_LAST; lane++) {
+		if (! events_ready[lane])
+			events_ready[lane] = NIH_MUST (nih_list_new (NULL));
+	}
 }
 
 
@@ -141,12 +268,22 @@ event_new (const void  *parent,
 	event->fd = -1;
 
 	event->progress = EVENT_PENDING;
+	event->lane = EVENT_LANE_INTERNAL;
 	event->failed = FALSE;
 
 	event->blockers = 0;
 	nih_list_init (&event->blocking);
+	nih_list_init (&event->ready);
+
+	event->state_index = -1;
+
+	event->emitted = job_timing_now ();
+	event->history = 0;
+	event->generation = state_touch ();
 
-	nih_alloc_set_destructor (event, nih_list_destroy);
+	metrics_count (METRICS_EVENTS_EMITTED);
+	metrics_queue_add ();
+	nih_alloc_set_destructor (event, event_destroy);
 
 
 	/* Fill in the event details */
@@ -160,16 +297,86 @@ event_new (const void  *parent,
 	if (event->env)
 		nih_ref (event->env, event);
 
+	event_history_new (event);
 
 	/* Place it in the pending list */
 	nih_debug ("Pending %s event", name);
+	UPSTART_PROBE (event_new, event, event->name);
 	nih_list_add (events, &event->entry);
+	event_ready (event);
 
 	nih_main_loop_interrupt ();
 
 	return event;
 }
 
+/**
+ * event_destroy:
+ * @event: event being destroyed.
+ *
+ * Removes @event from the events list and, if it's there, from
+ * events_ready.
+ *
+ * Returns: zero.
+ **/
+static int
+event_destroy (Event *event)
+{
+	nih_assert (event != NULL);
+
+	nih_list_destroy (&event->ready);
+	nih_list_destroy (&event->entry);
+
+	metrics_queue_remove ();
+
+	return 0;
+}
+
+/**
+ * event_set_lane:
+ * @event: event to change,
+ * @lane: new lane for @event.
+ *
+ * Moves @event to @lane; if it's ready, it's placed at the end of the
+ * list of those ready in @lane.  Events are created in the internal
+ * lane, those emitted on behalf of clients should be moved as soon as
+ * they're created.
+ **/
+void
+event_set_lane (Event     *event,
+		EventLane  lane)
+{
+	nih_assert (event != NULL);
+	nih_assert (lane >= 0 && lane < EVENT_LANE_LAST);
+
+	event->lane = lane;
+
+	if (! NIH_LIST_EMPTY (&event->ready)) {
+		nih_list_remove (&event->ready);
+		event_ready (event);
+	}
+}
+
+/**
+ * event_ready:
+ * @event: event with work to be done.
+ *
+ * Appends @event to the events_ready list of its lane so that it is seen
+ * by the next event_poll(), unless it's already on a list through its
+ * ready member; events deferred by event_limit_admit() are released by
+ * removing them from its list first.
+ **/
+void
+event_ready (Event *event)
+{
+	nih_assert (event != NULL);
+
+	event_init ();
+
+	if (NIH_LIST_EMPTY (&event->ready))
+		nih_list_add (events_ready[event->lane], &event->ready);
+}
+
 
 /**
  * event_block:
@@ -187,6 +394,8 @@ event_block (Event *event)
 	nih_assert (event != NULL);
 
 	event->blockers++;
+	event->generation = state_touch ();
+	metrics_count (METRICS_EVENT_BLOCKERS);
 }
 
 /**
@@ -196,7 +405,8 @@ event_block (Event *event)
  * This function should be called by jobs that are holding a reference on the
  * event which blocks it from finishing, and wish to discard that reference.
  *
- * It must match a previous call to event_block().
+ * It must match a previous call to event_block().  Removing the last
+ * blocker makes the event ready to be finished by the next event_poll().
  **/
 void
 event_unblock (Event *event)
@@ -205,6 +415,10 @@ event_unblock (Event *event)
 	nih_assert (event->blockers > 0);
 
 	event->blockers--;
+	event->generation = state_touch ();
+
+	if (! event->blockers)
+		event_ready (event);
 }
 
 
@@ -218,55 +432,87 @@ event_unblock (Event *event)
  *
  * Events remain in the handling state while they have blocking jobs.
  *
- * This function will only return once the events list is empty, or all
- * events are in the handling state; so any time an event queues another,
- * it will be processed immediately.
+ * Only events on events_ready are visited, those of the highest priority
+ * lane first and within a lane in the order that they became ready, so
+ * blocked events cost nothing until event_unblock() removes their last
+ * blocker.  This function will only return once those lists are empty,
+ * or a pending event must wait for conf_staged_load(); so any time an
+ * event queues another, or unblocks another, it will be processed
+ * immediately.
  *
- * Normally this function is used as a main loop callback.
+ * Normally this function is used as a main loop callback; a pass that
+ * stalls the main loop is attributed to the event that took longest.
  **/
 void
 event_poll (void)
 {
-	int poll_again;
+	MetricsStall stall;
 
 	event_init ();
 
-	do {
-		poll_again = FALSE;
+	metrics_stall_begin (&stall, "event_poll", NULL);
 
-		NIH_LIST_FOREACH_SAFE (events, iter) {
-			Event *event = (Event *)iter;
+	for (;;) {
+		NihList      *ready = NULL;
+		Event        *event;
+		MetricsStall  part;
 
-			/* Ignore events that we're handling and are
-			 * blocked, there's nothing we can do to hurry them.
-			 *
-			 * Decide whether to poll again based on the state
-			 * before handling the event; that way we always loop
-			 * at least once more after finding a pending or
-			 * finished event, in case they added new events as
-			 * a side effect that we missed.
-			 */
-			switch (event->progress) {
-			case EVENT_PENDING:
-				event_pending (event);
-				poll_again = TRUE;
-
-				/* fall through */
-			case EVENT_HANDLING:
-				if (event->blockers)
-					break;
+		for (int lane = 0; lane < EVENT_LANE_LAST; lane++) {
+			if (! NIH_LIST_EMPTY (events_ready[lane])) {
+				ready = events_ready[lane];
+				break;
+			}
+		}
+
+		if (! ready)
+			break;
+
+		event = (Event *)((char *)ready->next - offsetof (Event, ready));
+
+		/* Configuration not yet loaded by a staged startup may
+		 * define jobs waiting for the event, so it's held until
+		 * that has been, along with those queued behind it.
+		 */
+		if ((event->progress == EVENT_PENDING)
+		    && conf_staged_wants (event->name))
+			break;
 
-				event->progress = EVENT_FINISHED;
-				/* fall through */
-			case EVENT_FINISHED:
-				event_finished (event);
-				poll_again = TRUE;
+		/* The event may be freed once finished, so the name it's
+		 * attributed to is copied before handling it.
+		 */
+		if (stall.started)
+			metrics_stall_begin (&part, "event_poll", event->name);
+
+		switch (event->progress) {
+		case EVENT_PENDING:
+			event_pending (event);
+
+			/* fall through */
+		case EVENT_HANDLING:
+			/* Blocked events come off the ready list, there's
+			 * nothing we can do to hurry them; event_unblock()
+			 * puts them back.
+			 */
+			if (event->blockers) {
+				nih_list_remove (&event->ready);
 				break;
-			default:
-				nih_assert_not_reached ();
 			}
+
+			event->progress = EVENT_FINISHED;
+			event->generation = state_touch ();
+			/* fall through */
+		case EVENT_FINISHED:
+			event_finished (event);
+			break;
+		default:
+			nih_assert_not_reached ();
 		}
-	} while (poll_again);
+
+		if (stall.started)
+			metrics_stall_attribute (&stall, &part);
+	}
+
+	metrics_stall_end (&stall);
 }
 
 
@@ -288,9 +534,17 @@ event_pending (Event *event)
 	nih_assert (event->progress == EVENT_PENDING);
 
 	nih_info (_("Handling %s event"), event->name);
+	UPSTART_PROBE (event_pending, event, event->name);
 	event->progress = EVENT_HANDLING;
+	event->generation = state_touch ();
 
+	event_trace_event (event);
+	event_history_handling (event);
 	event_pending_handle_jobs (event);
+	event_history_handled (event);
+
+	control_notify_runlevel (event);
+	quiesce_runlevel (event);
 }
 
 /**
@@ -298,128 +552,157 @@ event_pending (Event *event)
  * @event: event to be handled.
  *
  * This function is called whenever an event reaches the handling state.
- * It iterates the list of jobs and stops or starts any necessary.
+ * It iterates the list of jobs interested in the event and stops or starts
+ * any necessary; conditions event_prematch() found can't match the event
+ * are passed over.
  **/
 static void
 event_pending_handle_jobs (Event *event)
 {
-	int  empty = TRUE;
+	JobClassEventIndex *index;
+	unsigned int        pass = 0;
+	int                 empty = TRUE;
+	int                 failed = FALSE;
 
 #ifdef ENABLE_CGROUPS
-	int  warn = FALSE;
+	int                 warn = FALSE;
 #endif /* ENABLE_CGROUPS */
 
 	nih_assert (event != NULL);
 
 	job_class_init ();
 
-	NIH_HASH_FOREACH_SAFE (job_classes, iter) {
-		JobClass *class = (JobClass *)iter;
-
-		/* Only affect jobs within the same session as the event
-		 * unless the event has no session, in which case do them
-		 * all.
-		 */
-		if (event->session && (class->session != event->session))
-			continue;
-
-		/* We stop first so that if an event is listed both as a
-		 * stop and start event, it causes an active running process
-		 * to be killed, and then stop script then the start script
-		 * to be run. In any other state, it has no special effect.
-		 *
-		 * (The other way around would be just strange, it'd cause
-		 * a process's start and stop scripts to be run without the
-		 * actual process).
-		 */
-		NIH_HASH_FOREACH_SAFE (class->instances, job_iter) {
-			Job *job = (Job *)job_iter;
+	/* Only classes which reference the event by name in their start
+	 * on or stop on conditions can possibly be affected by it.  Hold a
+	 * reference on the index entry since handling may cause classes to
+	 * be removed from it.
+	 */
+	index = (JobClassEventIndex *)nih_hash_lookup (job_class_events,
+						       event->name);
+	if (index) {
+		nih_ref (index, event);
 
-			if (job->stop_on
-			    && event_operator_handle (job->stop_on, event,
-						      job->env)
-			    && job->stop_on->value) {
-				if (job->goal != JOB_STOP) {
-					size_t len = 0;
-
-					if (job->stop_env)
-						nih_unref (job->stop_env, job);
-					job->stop_env = NULL;
-
-					/* Collect environment that stopped
-					 * the job for the pre-stop script;
-					 * it can make a more informed
-					 * decision whether the stop is valid.
-					 * We don't add class environment
-					 * since this is appended to the
-					 * existing job environment.
-					 */
-					NIH_MUST (event_operator_environment (
-						job->stop_on, &job->stop_env,
-						job, &len, "UPSTART_STOP_EVENTS"));
+		pass = event_prematch (index, event);
 
-					job_finished (job, FALSE);
+		NIH_LIST_FOREACH_SAFE (&index->classes, iter) {
+			NihListEntry *entry = (NihListEntry *)iter;
+			JobClass     *class = (JobClass *)entry->data;
 
-					event_operator_events (
-						job->stop_on,
-						job, &job->blocking);
+			/* Only affect jobs within the same session as the event
+			 * unless the event has no session, in which case do them
+			 * all.
+			 */
+			if (event->session && (class->session != event->session))
+				continue;
 
-					job_change_goal (job, JOB_STOP);
+			/* We stop first so that if an event is listed both as a
+			 * stop and start event, it causes an active running process
+			 * to be killed, and then stop script then the start script
+			 * to be run. In any other state, it has no special effect.
+			 *
+			 * (The other way around would be just strange, it'd cause
+			 * a process's start and stop scripts to be run without the
+			 * actual process).
+			 */
+			NIH_HASH_FOREACH_SAFE (class->instances, job_iter) {
+				Job *job = (Job *)job_iter;
+
+				if (job->stop_on
+				    && (! event_unmatched (job->stop_on, pass))
+				    && event_operator_handle (job->stop_on, event,
+							      job->env)
+				    && job->stop_on->value) {
+					if (job->goal != JOB_STOP) {
+						size_t len = 0;
+
+						if (job->stop_env)
+							nih_unref (job->stop_env, job);
+						job->stop_env = NULL;
+
+						/* Collect environment that stopped
+						 * the job for the pre-stop script;
+						 * it can make a more informed
+						 * decision whether the stop is valid.
+						 * We don't add class environment
+						 * since this is appended to the
+						 * existing job environment.
+						 */
+						NIH_MUST (event_operator_environment (
+							job->stop_on, &job->stop_env,
+							job, &len, "UPSTART_STOP_EVENTS"));
+
+						job_finished (job, FALSE);
+
+						event_operator_events (
+							job->stop_on,
+							job, &job->blocking);
+
+						job_change_goal (job, JOB_STOP);
+					}
+
+					event_operator_reset (job->stop_on);
 				}
 
-				event_operator_reset (job->stop_on);
 			}
 
-		}
-
-		/* If the job has specified a cgroup stanza, do not
-		 * start it until the cgroup manager is available. Also,
-		 * block any events that the job requires such that when
-		 * the cgroup manager is available, the job may be
-		 * started.
-		 */
+			/* If the job has specified a cgroup stanza, do not
+			 * start it until the cgroup manager is available,
+			 * unless cgroups are created directly in the unified
+			 * hierarchy. Also, block any events that the job
+			 * requires such that when the cgroup manager is
+			 * available, the job may be started.
+			 */
 
 #ifdef ENABLE_CGROUPS
-		if (class->start_on && job_class_cgroups (class)) {
-			if (cgroup_manager_available ()) {
-
-				if (class->cgmanager_wait) {
-					/* Unref the events that were ref'ed
-					 * whilst waiting for the cgroup manager
-					 * to become available.
+			if (class->start_on && job_class_cgroups (class)) {
+				if (cgroup_available ()) {
+
+					if (class->cgmanager_wait) {
+						/* Unref the events that were ref'ed
+						 * whilst waiting for the cgroup manager
+						 * to become available.
+						 */
+						event_operator_reset (class->start_on);
+						class->cgmanager_wait = FALSE;
+					}
+				} else {
+					warn = TRUE;
+
+					/* Reference the event to stop it being destroyed since it will
+					 * be required by the job once the cgroup manager eventually
+					 * becomes available.
 					 */
-					event_operator_reset (class->start_on);
-					class->cgmanager_wait = FALSE;
-				}
-			} else {
-				warn = TRUE;
-
-				/* Reference the event to stop it being destroyed since it will
-				 * be required by the job once the cgroup manager eventually
-				 * becomes available.
-				 */
-				if (! class->cgmanager_wait) {
-					if (event_operator_handle (class->start_on, event, NULL))
-						class->cgmanager_wait = TRUE;
-				}
+					if (! class->cgmanager_wait) {
+						if (event_operator_handle (class->start_on, event, NULL))
+							class->cgmanager_wait = TRUE;
+					}
 
-				continue;
+					continue;
+				}
 			}
-		}
 #endif /* ENABLE_CGROUPS */
 
-		/* Now we match the start events for the class to see
-		 * whether we need a new instance.
-		 */
-		if (class->start_on
-		    && event_operator_handle (class->start_on, event, NULL)
-		    && class->start_on->value) {
+			/* Now we match the start events for the class to see
+			 * whether we need a new instance.
+			 */
+			if (class->start_on
+			    && (! event_unmatched (class->start_on, pass))
+			    && event_operator_handle (class->start_on, event, NULL)
+			    && class->start_on->value) {
 
-			if (! job_class_induct_job (class))
-				return;
+				if (! job_class_induct_job (class)) {
+					failed = TRUE;
+					break;
+				}
+			}
 		}
+
+		nih_unref (index, event);
 	}
 
+	if (failed)
+		return;
+
 #ifdef ENABLE_CGROUPS
 	if (warn)
 		nih_debug ("Cannot start some jobs until cgroup manager available");
@@ -446,6 +729,238 @@ event_pending_handle_jobs (Event *event)
 		quiesce_complete ();
 }
 
+/**
+ * event_prematch:
+ * @index: classes interested in @event,
+ * @event: event being handled.
+ *
+ * When event_match_threads is set and @event is of interest to at least
+ * EVENT_MATCH_MIN start on and stop on conditions of the classes in
+ * @index and their instances, checks them all with
+ * event_operator_may_match() using that many threads alongside this one,
+ * and marks those that can't match @event with the number of this pass.
+ * The threads are started by the first pass and then wait for the next.
+ *
+ * Conditions marked need not be handled at all, since handling them
+ * would change nothing; everything else, and everything that changes
+ * the state of jobs, is still done by event_pending_handle_jobs() on the
+ * main thread in the usual order, so the outcome is the same either way.
+ *
+ * Returns: number of this pass, or zero if none was made.
+ **/
+static unsigned int
+event_prematch (JobClassEventIndex *index,
+		Event              *event)
+{
+	nih_local EventOperator **trees = NULL;
+	EventMatchQueue           queue;
+	EventMatchPool           *pool = &event_match_pool;
+	size_t                    count = 0;
+
+	nih_assert (index != NULL);
+	nih_assert (event != NULL);
+
+	if (event_match_threads <= 0)
+		return 0;
+
+	NIH_LIST_FOREACH (&index->classes, iter) {
+		JobClass *class = (JobClass *)((NihListEntry *)iter)->data;
+
+		if (event->session && (class->session != event->session))
+			continue;
+
+		NIH_HASH_FOREACH (class->instances, job_iter)
+			if (((Job *)job_iter)->stop_on)
+				count++;
+
+		if (class->start_on)
+			count++;
+	}
+
+	if (count < EVENT_MATCH_MIN)
+		return 0;
+
+	trees = nih_alloc (NULL, sizeof (EventOperator *) * count);
+	if (! trees)
+		return 0;
+
+	queue.trees = trees;
+	queue.count = 0;
+	queue.next = 0;
+	queue.event = event;
+
+	NIH_LIST_FOREACH (&index->classes, iter) {
+		JobClass *class = (JobClass *)((NihListEntry *)iter)->data;
+
+		if (event->session && (class->session != event->session))
+			continue;
+
+		NIH_HASH_FOREACH (class->instances, job_iter) {
+			Job *job = (Job *)job_iter;
+
+			if (job->stop_on)
+				trees[queue.count++] = job->stop_on;
+		}
+
+		if (class->start_on)
+			trees[queue.count++] = class->start_on;
+	}
+
+	nih_assert (queue.count == count);
+
+	if (! ++event_match_pass)
+		event_match_pass++;
+	queue.pass = event_match_pass;
+
+	event_prematch_start ();
+
+	pthread_mutex_lock (&pool->lock);
+	pool->queue = &queue;
+	pool->generation++;
+	pool->busy = pool->threads;
+	pthread_cond_broadcast (&pool->work);
+	pthread_mutex_unlock (&pool->lock);
+
+	/* Whatever is left is checked by this thread */
+	event_prematch_check (&queue);
+
+	/* The trees may not change until every worker is done with them */
+	pthread_mutex_lock (&pool->lock);
+	while (pool->busy)
+		pthread_cond_wait (&pool->done, &pool->lock);
+	pool->queue = NULL;
+	pthread_mutex_unlock (&pool->lock);
+
+	return queue.pass;
+}
+
+/**
+ * event_prematch_start:
+ *
+ * Starts worker threads for event_prematch() until there are
+ * event_match_threads of them.  Signals are blocked in the workers so
+ * that they are only ever delivered to the main thread.  Failing to
+ * start a thread is not an error, a later call tries again.
+ **/
+static void
+event_prematch_start (void)
+{
+	EventMatchPool *pool = &event_match_pool;
+	sigset_t        mask;
+	sigset_t        oldmask;
+
+	if (pool->threads >= event_match_threads)
+		return;
+
+	sigfillset (&mask);
+	pthread_sigmask (SIG_SETMASK, &mask, &oldmask);
+
+	while (pool->threads < event_match_threads) {
+		pthread_t thread;
+
+		/* Only this thread changes the generation, so the worker
+		 * waits for the one after the current one.
+		 */
+		if (pthread_create (&thread, NULL, event_prematch_worker,
+				    (void *)pool->generation))
+			break;
+
+		pthread_detach (thread);
+
+		pthread_mutex_lock (&pool->lock);
+		pool->threads++;
+		pthread_mutex_unlock (&pool->lock);
+	}
+
+	pthread_sigmask (SIG_SETMASK, &oldmask, NULL);
+}
+
+/**
+ * event_prematch_worker:
+ * @data: generation of event_match_pool when the thread was started.
+ *
+ * Thread function of event_prematch_start() which waits for each queue
+ * given to event_match_pool after @data and checks it alongside the other
+ * threads with event_prematch_check().
+ *
+ * Returns: never returns.
+ **/
+static void *
+event_prematch_worker (void *data)
+{
+	EventMatchPool *pool = &event_match_pool;
+	uintptr_t       generation = (uintptr_t)data;
+
+	pthread_mutex_lock (&pool->lock);
+
+	for (;;) {
+		EventMatchQueue *queue;
+
+		while (pool->generation == generation)
+			pthread_cond_wait (&pool->work, &pool->lock);
+
+		generation = pool->generation;
+		queue = pool->queue;
+
+		pthread_mutex_unlock (&pool->lock);
+		event_prematch_check (queue);
+		pthread_mutex_lock (&pool->lock);
+
+		if (! --pool->busy)
+			pthread_cond_signal (&pool->done);
+	}
+
+	return NULL;
+}
+
+/**
+ * event_prematch_check:
+ * @queue: EventMatchQueue to take trees from.
+ *
+ * Checks the trees of @queue EVENT_MATCH_BATCH at a time until there are
+ * none left, marking those that can't match its event.
+ **/
+static void
+event_prematch_check (EventMatchQueue *queue)
+{
+	nih_assert (queue != NULL);
+
+	for (;;) {
+		size_t i, end;
+
+		i = __sync_fetch_and_add (&queue->next, EVENT_MATCH_BATCH);
+		if (i >= queue->count)
+			break;
+
+		end = i + EVENT_MATCH_BATCH;
+		if (end > queue->count)
+			end = queue->count;
+
+		for (; i < end; i++) {
+			EventOperator *tree = queue->trees[i];
+
+			if (! event_operator_may_match (tree, queue->event))
+				tree->unmatched = queue->pass;
+		}
+	}
+}
+
+/**
+ * event_unmatched:
+ * @tree: operator tree to check,
+ * @pass: number of pass returned by event_prematch().
+ *
+ * Returns: TRUE if @pass found that @tree can't match its event.
+ **/
+static int
+event_unmatched (const EventOperator *tree,
+		 unsigned int         pass)
+{
+	nih_assert (tree != NULL);
+
+	return (pass && (tree->unmatched == pass));
+}
+
 
 /**
  * event_finished:
@@ -463,6 +978,15 @@ event_finished (Event *event)
 	nih_assert (event->progress == EVENT_FINISHED);
 
 	nih_debug ("Finished %s event", event->name);
+	UPSTART_PROBE (event_finished, event, event->name, event->failed);
+	event_history_finished (event);
+
+	metrics_count (METRICS_EVENTS_HANDLED);
+	if (event->failed)
+		metrics_count (METRICS_EVENTS_FAILED);
+
+	metrics_record (METRICS_EVENT_LATENCY,
+			job_timing_now () - event->emitted);
 
 	NIH_LIST_FOREACH_SAFE (&event->blocking, iter) {
 		Blocked *blocked = (Blocked *)iter;
@@ -472,6 +996,8 @@ event_finished (Event *event)
 			/* Event was blocking a job, let it enter the
 			 * next state.
 			 */
+			blocked_trace_add (blocked, event);
+
 			blocked->job->blocker = NULL;
 			job_change_state (blocked->job,
 					  job_next_state (blocked->job));
@@ -491,6 +1017,33 @@ event_finished (Event *event)
 						  blocked->message));
 			}
 
+			break;
+		case BLOCKED_EMIT_EVENTS_METHOD:
+			/* Event was one of a batch emitted by a single
+			 * method call, send the reply once the last of
+			 * them finishes, or an error if any failed.
+			 */
+			{
+				ControlEmitBatch *batch = blocked->data;
+
+				if (event->failed)
+					batch->failed = TRUE;
+
+				nih_assert (batch->pending > 0);
+				if (--batch->pending)
+					break;
+
+				if (batch->failed) {
+					NIH_ZERO (nih_dbus_message_error (
+							  batch->message,
+							  DBUS_INTERFACE_UPSTART ".Error.EventFailed",
+							  "%s", _("Event failed")));
+				} else {
+					NIH_ZERO (control_emit_events_reply (
+							  batch->message));
+				}
+			}
+
 			break;
 		default:
 			nih_assert_not_reached ();
@@ -812,6 +1365,12 @@ event_to_index (const Event *event)
 	nih_assert (event);
 	event_init ();
 
+	if (event_table
+	    && event->state_index >= 0
+	    && (size_t)event->state_index < event_table_len
+	    && event_table[event->state_index] == event)
+		return event->state_index;
+
 	NIH_LIST_FOREACH (events, iter) {
 		Event *tmp = (Event *)iter;
 
@@ -846,6 +1405,10 @@ event_from_index (int event_index)
 	nih_assert (event_index >= 0);
 	event_init ();
 
+	if (event_table)
+		return ((size_t)event_index < event_table_len
+			? event_table[event_index] : NULL);
+
 	NIH_LIST_FOREACH (events, iter) {
 		Event *event = (Event *)iter;
 
@@ -856,3 +1419,57 @@ event_from_index (int event_index)
 
 	return NULL;
 }
+
+/**
+ * event_index_build:
+ *
+ * Stamp each event with its position in the events list and record it
+ * in an array so that event_to_index() and event_from_index() no longer
+ * need to walk the list.  The index must be discarded with
+ * event_index_clear() before the events list is next modified.
+ *
+ * If insufficient memory is available the index is not built and the
+ * lookup functions fall back to walking the list.
+ **/
+void
+event_index_build (void)
+{
+	size_t len = 0;
+
+	event_init ();
+	event_index_clear ();
+
+	NIH_LIST_FOREACH (events, iter)
+		len++;
+
+	if (! len)
+		return;
+
+	event_table = nih_alloc (NULL, len * sizeof (Event *));
+	if (! event_table)
+		return;
+
+	NIH_LIST_FOREACH (events, iter) {
+		Event *event = (Event *)iter;
+
+		event->state_index = event_table_len;
+		event_table[event_table_len++] = event;
+	}
+}
+
+/**
+ * event_index_clear:
+ *
+ * Discard the index created by event_index_build().  Stamps left on
+ * events are harmless since event_to_index() only trusts a stamp that
+ * agrees with the current index.
+ **/
+void
+event_index_clear (void)
+{
+	if (event_table)
+		nih_free (event_table);
+
+	event_table = NULL;
+	event_table_len = 0;
+}
@@ -20,6 +20,8 @@
 #ifndef INIT_EVENT_H
 #define INIT_EVENT_H
 
+#include <stdint.h>
+
 #include <nih/macros.h>
 #include <nih/list.h>
 
@@ -41,6 +43,21 @@ typedef enum event_progress {
 	EVENT_FINISHED
 } EventProgress;
 
+/**
+ * EventLane:
+ *
+ * Events on a higher priority lane, lower in value, are always handled
+ * before any on a lower priority lane that are ready at the same time;
+ * within a lane they are handled in the order that they became ready.
+ * Events emitted by init itself, such as those of job lifecycles, are
+ * internal, while those emitted by clients are external.
+ **/
+typedef enum event_lane {
+	EVENT_LANE_INTERNAL,
+	EVENT_LANE_EXTERNAL,
+	EVENT_LANE_LAST
+} EventLane;
+
 /**
  * Event:
  * @entry: list header,
@@ -50,9 +67,18 @@ typedef enum event_progress {
  * @fd: open file descriptor associated with a particular
  *      socket-bridge socket (see socket-event(8)),
  * @progress: progress of event,
+ * @lane: priority lane of event,
  * @failed: whether this event has failed,
  * @blockers: number of blockers for finishing,
- * @blocking: messages and jobs we're blocking.
+ * @blocking: messages and jobs we're blocking,
+ * @ready: entry in events_ready while event_poll() has work to do for
+ *  the event,
+ * @state_index: position of the event in the events list, only
+ *  meaningful while a serialisation index exists (see event_index_build()),
+ * @emitted: time the event was queued, in microseconds on CLOCK_MONOTONIC,
+ * @history: serial number of the event's record in the event history,
+ * @generation: state generation the event last changed in (see
+ *  state_touch()).
  *
  * Events are one of the core concepts of upstart; they occur whenever
  * something, somewhere changes state.  They are idenitied by a unique
@@ -63,7 +89,8 @@ typedef enum event_progress {
  * the information contained within the event and the current progress of
  * that event through the queue.
  *
- * Events remain in the handling state while @blockers is non-zero.
+ * Events remain in the handling state while @blockers is non-zero, and
+ * are only placed back on events_ready once it falls to zero.
  **/
 typedef struct event {
 	NihList          entry;
@@ -74,23 +101,51 @@ typedef struct event {
 	int              fd;
 
 	EventProgress    progress;
+	EventLane        lane;
 	int              failed;
 
 	unsigned int     blockers;
 	NihList          blocking;
+	NihList          ready;
+
+	int              state_index;
+
+	uint64_t         emitted;
+	uint64_t         history;
+	uint64_t         generation;
 } Event;
 
+/**
+ * EVENT_MATCH_MIN:
+ *
+ * Number of conditions an event must be of interest to before they're
+ * checked on threads as well as the main one.
+ **/
+#define EVENT_MATCH_MIN 256
+
+/**
+ * EVENT_MATCH_BATCH:
+ *
+ * Number of conditions each thread checks at a time.
+ **/
+#define EVENT_MATCH_BATCH 32
+
 
 NIH_BEGIN_EXTERN
 
 extern int      paused;
+extern int      event_match_threads;
 extern NihList *events;
+extern NihList *events_ready[EVENT_LANE_LAST];
 
 
 void   event_init    (void);
 
 Event *event_new     (const void *parent, const char *name, char **env);
 
+void   event_set_lane (Event *event, EventLane lane);
+void   event_ready   (Event *event);
+
 void   event_block   (Event *event);
 void   event_unblock (Event *event);
 
@@ -114,6 +169,9 @@ int    event_to_index (const Event *event)
 Event * event_from_index (int event_index)
 	__attribute__ ((warn_unused_result));
 
+void   event_index_build (void);
+void   event_index_clear (void);
+
 NIH_END_EXTERN
 
 #endif /* INIT_EVENT_H */
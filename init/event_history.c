@@ -0,0 +1,405 @@
+/* upstart
+ *
+ * event_history.c - history of recent events
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <nih/macros.h>
+#include <nih/hash.h>
+#include <nih/logging.h>
+
+#include "event.h"
+#include "job.h"
+#include "session.h"
+#include "event_history.h"
+
+
+/* Prototypes for static functions */
+static void event_history_copy   (char *dest, const char *src);
+static int  event_history_bin    (const char *name);
+static void event_history_unlink (int slot);
+static EventHistoryRecord *event_history_get (uint64_t id);
+
+
+/**
+ * event_history:
+ *
+ * Ring of records of recent events, each stored in the slot given by its
+ * serial number modulo EVENT_HISTORY_MAX.
+ **/
+static EventHistoryRecord event_history[EVENT_HISTORY_MAX];
+
+/**
+ * event_history_heads:
+ * @event_history_tails:
+ *
+ * Slots of the oldest and newest records in each bin of the index by
+ * event name, or -1 for empty bins; only meaningful once
+ * event_history_last is non-zero.
+ **/
+static int event_history_heads[EVENT_HISTORY_BINS];
+static int event_history_tails[EVENT_HISTORY_BINS];
+
+/**
+ * event_history_last:
+ *
+ * Serial number of the most recent event recorded, or zero if none.
+ **/
+static uint64_t event_history_last = 0;
+
+/**
+ * event_history_current:
+ *
+ * Serial number of the event being handled, to which job goal changes are
+ * attributed, or zero.
+ **/
+static uint64_t event_history_current = 0;
+
+
+/**
+ * event_history_new:
+ * @event: event being emitted.
+ *
+ * Records @event in the history, replacing the oldest record should the
+ * history be full, and stores its serial number in @event.
+ **/
+void
+event_history_new (Event *event)
+{
+	EventHistoryRecord *record;
+	struct timespec     now;
+	uint64_t            digest = 14695981039346656037ULL;
+	int                 slot;
+	int                 bin;
+
+	nih_assert (event != NULL);
+
+	if (! event_history_last) {
+		for (int i = 0; i < EVENT_HISTORY_BINS; i++)
+			event_history_heads[i] = event_history_tails[i] = -1;
+	}
+
+	slot = (int)(++event_history_last % EVENT_HISTORY_MAX);
+	record = &event_history[slot];
+
+	if (record->id)
+		event_history_unlink (slot);
+
+	memset (record, 0, sizeof (EventHistoryRecord));
+
+	record->id = event_history_last;
+	event_history_copy (record->name, event->name);
+	event_history_copy (record->session,
+			    event->session && event->session->chroot
+			    ? event->session->chroot : "");
+
+	/* FNV-1a, with each variable followed by its nul */
+	for (char **e = event->env; e && *e; e++) {
+		for (const char *p = *e; ; p++) {
+			digest ^= (unsigned char)*p;
+			digest *= 1099511628211ULL;
+
+			if (! *p)
+				break;
+		}
+	}
+	record->env_digest = digest;
+
+	if (clock_gettime (CLOCK_REALTIME, &now) == 0)
+		record->emitted = ((uint64_t)now.tv_sec * 1000000)
+			+ (now.tv_nsec / 1000);
+
+	record->pending = event->emitted;
+
+	/* Link at the end of its bin, so each bin runs oldest first */
+	bin = event_history_bin (record->name);
+
+	record->prev = event_history_tails[bin];
+	record->next = -1;
+
+	if (record->prev >= 0) {
+		event_history[record->prev].next = slot;
+	} else {
+		event_history_heads[bin] = slot;
+	}
+	event_history_tails[bin] = slot;
+
+	event->history = record->id;
+}
+
+/**
+ * event_history_handling:
+ * @event: event being handled.
+ *
+ * Records the time @event began to be handled, and attributes the job
+ * goal changes recorded by event_history_job() to it until
+ * event_history_handled() is called.
+ **/
+void
+event_history_handling (Event *event)
+{
+	EventHistoryRecord *record;
+
+	nih_assert (event != NULL);
+
+	record = event_history_get (event->history);
+	if (! record)
+		return;
+
+	record->handling = job_timing_now ();
+	event_history_current = record->id;
+}
+
+/**
+ * event_history_handled:
+ * @event: event that was handled.
+ *
+ * Stops attributing job goal changes to @event.
+ **/
+void
+event_history_handled (Event *event)
+{
+	nih_assert (event != NULL);
+
+	if (event_history_current == event->history)
+		event_history_current = 0;
+}
+
+/**
+ * event_history_finished:
+ * @event: event that has finished.
+ *
+ * Records the time @event finished and whether it failed.
+ **/
+void
+event_history_finished (Event *event)
+{
+	EventHistoryRecord *record;
+
+	nih_assert (event != NULL);
+
+	record = event_history_get (event->history);
+	if (! record)
+		return;
+
+	record->finished = job_timing_now ();
+	record->failed = event->failed;
+}
+
+/**
+ * event_history_job:
+ * @job: job whose goal has changed,
+ * @goal: new goal of @job.
+ *
+ * Records in the history of the event being handled, if any, that it
+ * started or stopped @job.
+ **/
+void
+event_history_job (Job     *job,
+		   JobGoal  goal)
+{
+	EventHistoryRecord *record;
+	EventHistoryJob    *entry;
+
+	nih_assert (job != NULL);
+
+	if (goal == JOB_RESPAWN)
+		return;
+
+	record = event_history_get (event_history_current);
+	if (! record)
+		return;
+
+	if (record->jobs_len++ >= EVENT_HISTORY_JOBS)
+		return;
+
+	entry = &record->jobs[record->jobs_len - 1];
+
+	event_history_copy (entry->name, job_name (job));
+	entry->start = (goal == JOB_START);
+}
+
+/**
+ * event_history_next:
+ * @name: name of events to find, or NULL for all,
+ * @since: earliest time on CLOCK_REALTIME of events to find, in
+ * microseconds,
+ * @after: record returned by the previous call, or NULL for the first.
+ *
+ * Iterates the records in the history of events named @name, or of all
+ * events, emitted at or after @since in the order they were emitted.
+ * Events of a single name are found through the index without visiting
+ * the others.
+ *
+ * Records remain valid only until the next event is emitted.
+ *
+ * Returns: next record, or NULL if there are no more.
+ **/
+const EventHistoryRecord *
+event_history_next (const char               *name,
+		    uint64_t                  since,
+		    const EventHistoryRecord *after)
+{
+	nih_assert ((after == NULL) || (after->id != 0));
+
+	if (! event_history_last)
+		return NULL;
+
+	if (name) {
+		int slot;
+
+		slot = after ? after->next
+			: event_history_heads[event_history_bin (name)];
+
+		for (; slot >= 0; slot = event_history[slot].next) {
+			const EventHistoryRecord *record = &event_history[slot];
+
+			if (record->emitted < since)
+				continue;
+
+			if (! strncmp (record->name, name,
+				       EVENT_HISTORY_NAME_MAX - 1))
+				return record;
+		}
+	} else {
+		uint64_t id;
+
+		if (after) {
+			id = after->id + 1;
+		} else if (event_history_last > EVENT_HISTORY_MAX) {
+			id = event_history_last - EVENT_HISTORY_MAX + 1;
+		} else {
+			id = 1;
+		}
+
+		for (; id <= event_history_last; id++) {
+			const EventHistoryRecord *record;
+
+			record = &event_history[id % EVENT_HISTORY_MAX];
+			if (record->emitted >= since)
+				return record;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * event_history_clear:
+ *
+ * Forgets every record in the history.
+ **/
+void
+event_history_clear (void)
+{
+	memset (event_history, 0, sizeof (event_history));
+
+	event_history_last = 0;
+	event_history_current = 0;
+}
+
+
+/**
+ * event_history_copy:
+ * @dest: buffer of EVENT_HISTORY_NAME_MAX bytes,
+ * @src: string to copy.
+ *
+ * Copies @src into @dest, truncating it if too long.
+ **/
+static void
+event_history_copy (char       *dest,
+		    const char *src)
+{
+	nih_assert (dest != NULL);
+	nih_assert (src != NULL);
+
+	strncpy (dest, src, EVENT_HISTORY_NAME_MAX - 1);
+	dest[EVENT_HISTORY_NAME_MAX - 1] = '\0';
+}
+
+/**
+ * event_history_bin:
+ * @name: event name.
+ *
+ * Returns: bin of the index for events named @name, hashing only as much
+ * of @name as is kept in a record.
+ **/
+static int
+event_history_bin (const char *name)
+{
+	char buf[EVENT_HISTORY_NAME_MAX];
+
+	nih_assert (name != NULL);
+
+	event_history_copy (buf, name);
+
+	return (int)(nih_hash_string_hash (buf) % EVENT_HISTORY_BINS);
+}
+
+/**
+ * event_history_unlink:
+ * @slot: slot of record about to be replaced.
+ *
+ * Removes the record in @slot from the index, which being the oldest
+ * record must be at the head of its bin.
+ **/
+static void
+event_history_unlink (int slot)
+{
+	EventHistoryRecord *record = &event_history[slot];
+	int                 bin;
+
+	bin = event_history_bin (record->name);
+
+	nih_assert (event_history_heads[bin] == slot);
+	nih_assert (record->prev < 0);
+
+	event_history_heads[bin] = record->next;
+
+	if (record->next >= 0) {
+		event_history[record->next].prev = -1;
+	} else {
+		event_history_tails[bin] = -1;
+	}
+}
+
+/**
+ * event_history_get:
+ * @id: serial number of event.
+ *
+ * Returns: record of the event with serial number @id, or NULL if @id is
+ * zero or the record has since been replaced.
+ **/
+static EventHistoryRecord *
+event_history_get (uint64_t id)
+{
+	EventHistoryRecord *record;
+
+	if (! id)
+		return NULL;
+
+	record = &event_history[id % EVENT_HISTORY_MAX];
+
+	return record->id == id ? record : NULL;
+}
@@ -0,0 +1,130 @@
+/* upstart
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INIT_EVENT_HISTORY_H
+#define INIT_EVENT_HISTORY_H
+
+#include <stdint.h>
+
+#include <nih/macros.h>
+
+#include "event.h"
+#include "job.h"
+
+
+/**
+ * EVENT_HISTORY_MAX:
+ *
+ * Number of events kept in the history; once reached, each new event
+ * takes the place of the oldest.
+ **/
+#define EVENT_HISTORY_MAX 256
+
+/**
+ * EVENT_HISTORY_NAME_MAX:
+ *
+ * Size of the buffers holding names in the history, including the
+ * terminating nul; longer names are truncated.
+ **/
+#define EVENT_HISTORY_NAME_MAX 48
+
+/**
+ * EVENT_HISTORY_JOBS:
+ *
+ * Number of jobs started or stopped by an event that are named in its
+ * history record; the others are only counted.
+ **/
+#define EVENT_HISTORY_JOBS 8
+
+/**
+ * EVENT_HISTORY_BINS:
+ *
+ * Number of bins of the index of the history by event name.
+ **/
+#define EVENT_HISTORY_BINS 64
+
+
+/**
+ * EventHistoryJob:
+ * @name: name and instance of job,
+ * @start: TRUE if the job was started, FALSE if stopped.
+ *
+ * A job whose goal an event changed.
+ **/
+typedef struct event_history_job {
+	char name[EVENT_HISTORY_NAME_MAX];
+	int  start;
+} EventHistoryJob;
+
+/**
+ * EventHistoryRecord:
+ * @id: serial number of the event, or zero for an unused record,
+ * @name: name of the event,
+ * @session: chroot of the session of the event, or empty,
+ * @env_digest: digest of the environment of the event,
+ * @emitted: time on CLOCK_REALTIME the event was emitted, in microseconds,
+ * @pending: time on CLOCK_MONOTONIC the event was emitted, in microseconds,
+ * @handling: time on CLOCK_MONOTONIC the event began to be handled, or 0,
+ * @finished: time on CLOCK_MONOTONIC the event finished, or 0,
+ * @failed: TRUE if the event failed,
+ * @jobs_len: number of jobs the event started or stopped,
+ * @jobs: first EVENT_HISTORY_JOBS of those jobs,
+ * @prev: slot of previous record with a name in the same bin, or -1,
+ * @next: slot of next record with a name in the same bin, or -1.
+ *
+ * Record of an event kept in the history after it has been freed.
+ * Records are of a fixed size, so the history takes the same memory
+ * however many events there are.
+ **/
+typedef struct event_history_record {
+	uint64_t        id;
+	char            name[EVENT_HISTORY_NAME_MAX];
+	char            session[EVENT_HISTORY_NAME_MAX];
+	uint64_t        env_digest;
+
+	uint64_t        emitted;
+	uint64_t        pending;
+	uint64_t        handling;
+	uint64_t        finished;
+	int             failed;
+
+	size_t          jobs_len;
+	EventHistoryJob jobs[EVENT_HISTORY_JOBS];
+
+	int             prev;
+	int             next;
+} EventHistoryRecord;
+
+
+NIH_BEGIN_EXTERN
+
+void     event_history_new      (Event *event);
+void     event_history_handling (Event *event);
+void     event_history_handled  (Event *event);
+void     event_history_finished (Event *event);
+
+void     event_history_job      (Job *job, JobGoal goal);
+
+const EventHistoryRecord *event_history_next (const char *name,
+					      uint64_t since,
+					      const EventHistoryRecord *after)
+	__attribute__ ((warn_unused_result));
+
+void     event_history_clear    (void);
+
+NIH_END_EXTERN
+
+#endif /* INIT_EVENT_HISTORY_H */
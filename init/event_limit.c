@@ -0,0 +1,440 @@
+/* upstart
+ *
+ * event_limit.c - rate limits on events emitted by clients
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/main.h>
+#include <nih/logging.h>
+
+#include "event.h"
+#include "timer_wheel.h"
+#include "event_limit.h"
+
+
+/* Prototypes for static functions */
+static uint64_t     event_limit_interval (void)
+	__attribute__ ((warn_unused_result));
+static uint64_t     event_limit_slack    (void)
+	__attribute__ ((warn_unused_result));
+static EventBucket *event_bucket_new     (const char *emitter)
+	__attribute__ ((warn_unused_result, malloc));
+static int          event_bucket_destroy (EventBucket *bucket);
+static void         event_bucket_arm     (EventBucket *bucket);
+static void         event_bucket_timer   (EventBucket *bucket,
+					  WheelTimer *timer);
+
+
+/**
+ * event_limit_rate:
+ *
+ * Number of events per second that each emitter may emit over time, or
+ * zero for no limit.
+ **/
+int event_limit_rate = 0;
+
+/**
+ * event_limit_burst:
+ *
+ * Number of events that each emitter may emit at once before
+ * event_limit_rate applies, and the number that may then be deferred
+ * for it before further events are refused.
+ **/
+int event_limit_burst = EVENT_LIMIT_BURST;
+
+/**
+ * event_buckets:
+ *
+ * Hash of EventBucket by emitter for emitters that have recently
+ * emitted events.
+ **/
+NihHash *event_buckets = NULL;
+
+/**
+ * event_limit_stats:
+ *
+ * Counters of external events by what became of them.
+ **/
+EventLimitStats event_limit_stats = { 0, 0, 0 };
+
+
+/**
+ * event_limit_init:
+ *
+ * Initialise the event_buckets hash.
+ **/
+void
+event_limit_init (void)
+{
+	if (! event_buckets)
+		event_buckets = NIH_MUST (nih_hash_string_new (NULL, 0));
+}
+
+
+/**
+ * event_limit_interval:
+ *
+ * Returns: microseconds between events at event_limit_rate.
+ **/
+static uint64_t
+event_limit_interval (void)
+{
+	nih_assert (event_limit_rate > 0);
+
+	return UINT64_C (1000000) / event_limit_rate;
+}
+
+/**
+ * event_limit_slack:
+ *
+ * Returns: microseconds that an emitter may be ahead of event_limit_rate
+ * and still have an event admitted.
+ **/
+static uint64_t
+event_limit_slack (void)
+{
+	if (event_limit_burst < 1)
+		return 0;
+
+	return (event_limit_burst - 1) * event_limit_interval ();
+}
+
+
+/**
+ * event_limit_admit:
+ * @event: newly created event emitted by a client,
+ * @emitter: key identifying the client.
+ *
+ * Called for each event emitted on behalf of a client, immediately after
+ * it has been created, to move it to the external lane and apply the
+ * rate limit of @emitter to it.
+ *
+ * An event within the limit is left ready to be handled.  Once @emitter
+ * exceeds it, up to event_limit_burst further events are deferred and
+ * released in order as the limit allows; beyond that they are refused.
+ * The runlevel event is neither limited nor moved out of the internal
+ * lane, since it drives shutdown alongside init's own events.
+ *
+ * Returns: TRUE if @event was admitted or deferred, FALSE if it was
+ * refused and should be freed.
+ **/
+int
+event_limit_admit (Event      *event,
+		   const char *emitter)
+{
+	EventBucket *bucket;
+	uint64_t     now;
+	size_t       deferred = 0;
+
+	nih_assert (event != NULL);
+	nih_assert (emitter != NULL);
+
+	event_limit_init ();
+
+	if (! strcmp (event->name, "runlevel"))
+		return TRUE;
+
+	event_set_lane (event, EVENT_LANE_EXTERNAL);
+
+	if (event_limit_rate <= 0) {
+		event_limit_stats.admitted++;
+		return TRUE;
+	}
+
+	bucket = (EventBucket *)nih_hash_lookup (event_buckets, emitter);
+	if (! bucket)
+		bucket = event_bucket_new (emitter);
+
+	now = timer_wheel_now () * 1000;
+	if (bucket->tat < now)
+		bucket->tat = now;
+
+	/* Admit the event if there are none ahead of it and the emitter
+	 * is no more than its burst ahead of the rate.
+	 */
+	if (NIH_LIST_EMPTY (&bucket->deferred)
+	    && bucket->tat - now <= event_limit_slack ()) {
+		bucket->tat += event_limit_interval ();
+		event_limit_stats.admitted++;
+
+		event_bucket_arm (bucket);
+		return TRUE;
+	}
+
+	NIH_LIST_FOREACH (&bucket->deferred, iter)
+		deferred++;
+
+	if (deferred >= (size_t)(event_limit_burst > 0 ? event_limit_burst : 1)) {
+		nih_debug ("Refused %s event from %s", event->name, emitter);
+		event_limit_stats.dropped++;
+		return FALSE;
+	}
+
+	nih_debug ("Deferred %s event from %s", event->name, emitter);
+	nih_list_add (&bucket->deferred, &event->ready);
+	event_limit_stats.deferred++;
+
+	event_bucket_arm (bucket);
+	return TRUE;
+}
+
+/**
+ * event_limit_room:
+ * @emitter: key identifying the client,
+ * @count: number of events.
+ *
+ * Determine whether @count further events emitted by @emitter would all
+ * be admitted or deferred by event_limit_admit(), without charging them
+ * to its limit, so that a batch of events can be refused as a whole.
+ * The runlevel event is not limited and should not be counted.
+ *
+ * Returns: TRUE if there is room for @count events, FALSE otherwise.
+ **/
+int
+event_limit_room (const char *emitter,
+		  size_t      count)
+{
+	EventBucket *bucket;
+	uint64_t     now;
+	uint64_t     tat;
+	size_t       deferred = 0;
+	size_t       max_deferred;
+
+	nih_assert (emitter != NULL);
+
+	event_limit_init ();
+
+	if (event_limit_rate <= 0)
+		return TRUE;
+
+	now = timer_wheel_now () * 1000;
+	tat = now;
+
+	bucket = (EventBucket *)nih_hash_lookup (event_buckets, emitter);
+	if (bucket) {
+		if (bucket->tat > now)
+			tat = bucket->tat;
+
+		NIH_LIST_FOREACH (&bucket->deferred, iter)
+			deferred++;
+	}
+
+	max_deferred = (size_t)(event_limit_burst > 0 ? event_limit_burst : 1);
+
+	/* Follow event_limit_admit() for each event in turn */
+	while (count--) {
+		if ((! deferred) && (tat - now <= event_limit_slack ())) {
+			tat += event_limit_interval ();
+		} else if (deferred < max_deferred) {
+			deferred++;
+		} else {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+
+/**
+ * event_bucket_new:
+ * @emitter: key identifying the emitter.
+ *
+ * Allocates a full EventBucket for @emitter and adds it to the
+ * event_buckets hash.
+ *
+ * Returns: newly allocated EventBucket.
+ **/
+static EventBucket *
+event_bucket_new (const char *emitter)
+{
+	EventBucket *bucket;
+
+	nih_assert (emitter != NULL);
+
+	bucket = NIH_MUST (nih_new (NULL, EventBucket));
+
+	nih_list_init (&bucket->entry);
+	nih_list_init (&bucket->deferred);
+
+	bucket->emitter = NIH_MUST (nih_strdup (bucket, emitter));
+	bucket->tat = 0;
+	bucket->timer = NULL;
+
+	nih_alloc_set_destructor (bucket, event_bucket_destroy);
+
+	nih_hash_add (event_buckets, &bucket->entry);
+
+	return bucket;
+}
+
+/**
+ * event_bucket_destroy:
+ * @bucket: bucket being destroyed.
+ *
+ * Releases any events still deferred in @bucket, cancels its timer and
+ * removes it from the event_buckets hash.
+ *
+ * Returns: zero.
+ **/
+static int
+event_bucket_destroy (EventBucket *bucket)
+{
+	nih_assert (bucket != NULL);
+
+	NIH_LIST_FOREACH_SAFE (&bucket->deferred, iter) {
+		Event *event = (Event *)((char *)iter - offsetof (Event, ready));
+
+		nih_list_remove (&event->ready);
+		event_ready (event);
+	}
+
+	/* The timer isn't a child of the bucket, since the bucket may be
+	 * freed by the timer's own callback.
+	 */
+	if (bucket->timer)
+		nih_free (bucket->timer);
+
+	nih_list_destroy (&bucket->entry);
+
+	return 0;
+}
+
+/**
+ * event_bucket_arm:
+ * @bucket: bucket to arm timer for.
+ *
+ * Ensures the timer of @bucket is due when the first of its deferred
+ * events may be released, or if there are none, when it will be full.
+ **/
+static void
+event_bucket_arm (EventBucket *bucket)
+{
+	uint64_t due;
+	uint64_t now;
+
+	nih_assert (bucket != NULL);
+
+	if (! NIH_LIST_EMPTY (&bucket->deferred)) {
+		due = bucket->tat - event_limit_slack ();
+	} else {
+		due = bucket->tat;
+	}
+
+	/* Round up to the millisecond resolution of the wheel */
+	due = (due + 999) / 1000;
+
+	if (bucket->timer) {
+		timer_wheel_adjust (bucket->timer, due);
+		return;
+	}
+
+	now = timer_wheel_now ();
+
+	bucket->timer = NIH_MUST (timer_wheel_add (
+			NULL, due > now ? due - now : 0,
+			(WheelTimerCb)event_bucket_timer, bucket));
+}
+
+/**
+ * event_bucket_timer:
+ * @bucket: bucket to release events for,
+ * @timer: timer that triggered.
+ *
+ * Called when the first deferred event of @bucket may be released to
+ * release it and any others now within the limit, or once @bucket is
+ * full again to free it.
+ **/
+static void
+event_bucket_timer (EventBucket *bucket,
+		    WheelTimer  *timer)
+{
+	uint64_t now;
+
+	nih_assert (bucket != NULL);
+	nih_assert (bucket->timer == timer);
+
+	/* The timer is freed once we return */
+	bucket->timer = NULL;
+
+	now = timer_wheel_now () * 1000;
+	if (bucket->tat < now)
+		bucket->tat = now;
+
+	while (! NIH_LIST_EMPTY (&bucket->deferred)
+	       && bucket->tat - now <= event_limit_slack ()) {
+		Event *event;
+
+		event = (Event *)((char *)bucket->deferred.next
+				  - offsetof (Event, ready));
+
+		nih_debug ("Released %s event from %s",
+			   event->name, bucket->emitter);
+
+		nih_list_remove (&event->ready);
+		event_ready (event);
+
+		bucket->tat += event_limit_interval ();
+
+		nih_main_loop_interrupt ();
+	}
+
+	if (NIH_LIST_EMPTY (&bucket->deferred) && bucket->tat <= now) {
+		nih_free (bucket);
+		return;
+	}
+
+	event_bucket_arm (bucket);
+}
+
+
+/**
+ * event_limit_stats_to_string:
+ * @parent: parent object for new string.
+ *
+ * Returns: newly allocated JSON string of event_limit_stats and the
+ * number of emitters currently limited, or NULL if insufficient memory.
+ **/
+char *
+event_limit_stats_to_string (const void *parent)
+{
+	size_t emitters = 0;
+
+	event_limit_init ();
+
+	NIH_HASH_FOREACH (event_buckets, iter)
+		emitters++;
+
+	return nih_sprintf (parent, "{ \"admitted\": %lu, \"deferred\": %lu, "
+			    "\"dropped\": %lu, \"emitters\": %zu }",
+			    event_limit_stats.admitted,
+			    event_limit_stats.deferred,
+			    event_limit_stats.dropped,
+			    emitters);
+}
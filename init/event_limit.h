@@ -0,0 +1,101 @@
+/* upstart
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INIT_EVENT_LIMIT_H
+#define INIT_EVENT_LIMIT_H
+
+#include <stdint.h>
+
+#include <nih/macros.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+
+#include "event.h"
+#include "timer_wheel.h"
+
+
+/**
+ * EVENT_LIMIT_BURST:
+ *
+ * Default number of events that an emitter may emit at once before its
+ * rate limit applies, and that may be deferred for it once it does.
+ **/
+#define EVENT_LIMIT_BURST 100
+
+
+/**
+ * EventBucket:
+ * @entry: list header,
+ * @emitter: key identifying the emitter, used as the hash key,
+ * @tat: time on CLOCK_MONOTONIC, in microseconds, at which the emitter
+ *  will have its full burst available again,
+ * @deferred: events deferred for the emitter, in order of emission,
+ *  linked through their ready member,
+ * @timer: timer to release the first of @deferred, or to free the bucket
+ *  once it's full again.
+ *
+ * A token bucket limiting the rate at which one emitter may emit events,
+ * kept as the time by which the emitter's debt will have been repaid
+ * (the generic cell rate algorithm) rather than a count of tokens.
+ * Buckets free themselves once full, since a full bucket is no
+ * different from a new one.
+ **/
+typedef struct event_bucket {
+	NihList     entry;
+	char       *emitter;
+
+	uint64_t    tat;
+	NihList     deferred;
+
+	WheelTimer *timer;
+} EventBucket;
+
+/**
+ * EventLimitStats:
+ * @admitted: number of external events admitted immediately,
+ * @deferred: number of external events deferred by a rate limit,
+ * @dropped: number of external events refused by a rate limit.
+ *
+ * Counters of every external event seen by event_limit_admit().
+ **/
+typedef struct event_limit_stats {
+	unsigned long admitted;
+	unsigned long deferred;
+	unsigned long dropped;
+} EventLimitStats;
+
+
+NIH_BEGIN_EXTERN
+
+extern int              event_limit_rate;
+extern int              event_limit_burst;
+extern NihHash         *event_buckets;
+extern EventLimitStats  event_limit_stats;
+
+
+void  event_limit_init            (void);
+
+int   event_limit_admit           (Event *event, const char *emitter)
+	__attribute__ ((warn_unused_result));
+int   event_limit_room            (const char *emitter, size_t count)
+	__attribute__ ((warn_unused_result));
+
+char *event_limit_stats_to_string (const void *parent)
+	__attribute__ ((warn_unused_result, malloc));
+
+NIH_END_EXTERN
+
+#endif /* INIT_EVENT_LIMIT_H */
@@ -33,17 +33,36 @@
 #include <nih/macros.h>
 #include <nih/alloc.h>
 #include <nih/string.h>
+#include <nih/hash.h>
 #include <nih/tree.h>
 #include <nih/logging.h>
 #include <nih/error.h>
 
 #include "environ.h"
 #include "event.h"
+#include "events.h"
 #include "event_operator.h"
 #include "blocked.h"
 #include "errors.h"
 
 
+/* Prototypes for static functions */
+static int            event_operator_compiled       (const EventOperator *oper)
+	__attribute__ ((warn_unused_result));
+static EventOperator *event_operator_share_node     (EventOperator *nodes,
+						     size_t *next,
+						     EventOperator *shape);
+static int            event_operator_destroy_shared (EventOperator *root);
+static int            event_operator_match_value    (const EventMatchEnv *m,
+						     const char *eval)
+	__attribute__ ((warn_unused_result));
+static uint64_t       event_operator_name_bits      (const char *name)
+	__attribute__ ((warn_unused_result));
+static void           event_operator_summarise      (EventOperator *root);
+static int            event_operator_unnamed        (uint64_t *bits,
+						     EventOperator *oper);
+
+
 /**
  * event_operator_new:
  * @parent: parent object for new operator,
@@ -107,6 +126,20 @@ event_operator_new (const void         *parent,
 
 	oper->event = NULL;
 
+	oper->match = NULL;
+	oper->match_len = 0;
+
+	/* Never compiled, whatever @env is */
+	oper->env_gen = 1;
+	oper->match_gen = 0;
+
+	oper->shape = NULL;
+
+	oper->unmatched = 0;
+
+	oper->names = ((oper->type == EVENT_MATCH)
+		       ? event_operator_name_bits (oper->name) : 0);
+
 	nih_alloc_set_destructor (oper, event_operator_destroy);
 
 	return oper;
@@ -156,6 +189,14 @@ event_operator_copy (const void          *parent,
 			nih_free (oper);
 			return NULL;
 		}
+
+		/* Compile the copy up front if the original was, so
+		 * that instances don't pay for it on their first event.
+		 */
+		if (old_oper->match && (event_operator_compile (oper) < 0)) {
+			nih_free (oper);
+			return NULL;
+		}
 	}
 
 	if (old_oper->event) {
@@ -186,9 +227,165 @@ event_operator_copy (const void          *parent,
 		nih_tree_add (&oper->node, &child->node, NIH_TREE_RIGHT);
 	}
 
+	if (oper->type != EVENT_MATCH)
+		oper->names = (((EventOperator *)oper->node.left)->names
+			       | ((EventOperator *)oper->node.right)->names);
+
+	return oper;
+}
+
+/**
+ * event_operator_share:
+ * @parent: parent object for new tree,
+ * @shape: operator tree to share.
+ *
+ * Allocates and returns a new EventOperator tree with the same structure
+ * and current state as the tree rooted at @shape, as event_operator_copy()
+ * does, but as a single allocation whose nodes share the name, environment
+ * and compiled environment of the nodes of @shape rather than copying
+ * them.  This is how each instance of a job gets its own stop on
+ * condition.
+ *
+ * @shape is referenced by the new tree, so remains at least as long as
+ * it, but must not be changed other than by matching events; its nodes
+ * are compiled first so that the new tree need never be.
+ *
+ * Nodes of the new tree must not be freed, or used as parents, other than
+ * by way of the root node returned; otherwise they may be used exactly as
+ * those of any other tree.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned tree.  When all parents
+ * of the returned tree are freed, the returned tree will also be
+ * freed.
+ *
+ * Returns: newly allocated root of EventOperator tree, or NULL if
+ * insufficient memory.
+ **/
+EventOperator *
+event_operator_share (const void    *parent,
+		      EventOperator *shape)
+{
+	EventOperator *nodes;
+	size_t         len = 0;
+	size_t         next = 0;
+
+	nih_assert (shape != NULL);
+
+	NIH_TREE_FOREACH_POST (&shape->node, iter) {
+		EventOperator *oper = (EventOperator *)iter;
+
+		if ((oper->type == EVENT_MATCH)
+		    && (! event_operator_compiled (oper))
+		    && (event_operator_compile (oper) < 0))
+			return NULL;
+
+		len++;
+	}
+
+	if (! shape->names)
+		event_operator_summarise (shape);
+
+	nodes = nih_alloc (parent, sizeof (EventOperator) * len);
+	if (! nodes)
+		return NULL;
+
+	event_operator_share_node (nodes, &next, shape);
+	nih_assert (next == len);
+
+	nih_ref (shape, nodes);
+
+	nih_alloc_set_destructor (nodes, event_operator_destroy_shared);
+
+	return nodes;
+}
+
+/**
+ * event_operator_share_node:
+ * @nodes: nodes of new tree,
+ * @next: index of next unused entry of @nodes,
+ * @shape: node to share.
+ *
+ * Fills in the next entry of @nodes from @shape, followed by those for
+ * its children, for event_operator_share().
+ *
+ * Returns: entry filled in.
+ **/
+static EventOperator *
+event_operator_share_node (EventOperator *nodes,
+			   size_t        *next,
+			   EventOperator *shape)
+{
+	EventOperator *oper, *child;
+
+	nih_assert (nodes != NULL);
+	nih_assert (next != NULL);
+	nih_assert (shape != NULL);
+
+	oper = &nodes[(*next)++];
+
+	nih_tree_init (&oper->node);
+
+	oper->type = shape->type;
+	oper->value = shape->value;
+
+	oper->name = shape->name;
+	oper->env = shape->env;
+	oper->match = shape->match;
+	oper->match_len = shape->match_len;
+	oper->env_gen = shape->env_gen;
+	oper->match_gen = shape->match_gen;
+	oper->shape = shape;
+
+	oper->unmatched = 0;
+	oper->names = shape->names;
+
+	oper->event = shape->event;
+	if (oper->event)
+		event_block (oper->event);
+
+	if (shape->node.left) {
+		child = event_operator_share_node (
+			nodes, next, (EventOperator *)shape->node.left);
+		nih_tree_add (&oper->node, &child->node, NIH_TREE_LEFT);
+	}
+
+	if (shape->node.right) {
+		child = event_operator_share_node (
+			nodes, next, (EventOperator *)shape->node.right);
+		nih_tree_add (&oper->node, &child->node, NIH_TREE_RIGHT);
+	}
+
 	return oper;
 }
 
+/**
+ * event_operator_destroy_shared:
+ * @root: root of tree to be destroyed.
+ *
+ * Unblocks and unreferences the events referenced by the nodes of the
+ * tree made by event_operator_share() rooted at @root, which are freed
+ * along with it, and unlinks it from any tree it's in.
+ *
+ * Returns: zero.
+ **/
+static int
+event_operator_destroy_shared (EventOperator *root)
+{
+	nih_assert (root != NULL);
+
+	NIH_TREE_FOREACH_POST (&root->node, iter) {
+		EventOperator *oper = (EventOperator *)iter;
+
+		if (oper->event)
+			event_unblock (oper->event);
+	}
+
+	nih_tree_destroy (&root->node);
+
+	return 0;
+}
+
 /**
  * event_operator_destroy:
  * @oper: operator to be destroyed.
@@ -248,6 +445,147 @@ event_operator_update (EventOperator *oper)
 	}
 }
 
+/**
+ * event_operator_compile:
+ * @oper: operator to compile.
+ *
+ * Parses the environment of @oper into an array of EventMatchEnv
+ * structures so that event_operator_match() need not re-parse each entry,
+ * nor expand and glob-match values that are plain strings, for every
+ * event it is offered.
+ *
+ * Each entry is classified by its value: those referencing variables
+ * must be expanded at match time, those containing pattern characters
+ * are glob-matched, a single trailing '*' is matched as a prefix and
+ * anything else is compared literally.
+ *
+ * This is called when the operator is parsed, and automatically by
+ * event_operator_match() for operators constructed in other ways or whose
+ * environment has changed since.  Any previous compiled form is discarded.
+ *
+ * This may only be called if the type of @oper is EVENT_MATCH.
+ *
+ * Returns: zero on success, negative value on insufficient memory.
+ **/
+int
+event_operator_compile (EventOperator *oper)
+{
+	EventMatchEnv *match = NULL;
+	size_t         len = 0;
+
+	nih_assert (oper != NULL);
+	nih_assert (oper->type == EVENT_MATCH);
+
+	for (char * const *e = oper->env; e && *e; e++)
+		len++;
+
+	if (oper->env) {
+		match = nih_alloc (oper, sizeof (EventMatchEnv) * (len ? len : 1));
+		if (! match)
+			return -1;
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		EventMatchEnv *m = &match[i];
+		const char    *str = oper->env[i];
+		const char    *val;
+
+		m->str = str;
+		m->negate = FALSE;
+
+		val = strstr (str, "!=");
+		if (! val)
+			val = strchr (str, '=');
+
+		if (val) {
+			m->key = str;
+			m->keylen = val - str;
+
+			/* != means we negate the result (and skip the !) */
+			if (*val == '!') {
+				m->negate = TRUE;
+				val++;
+			}
+
+			/* Value to match against follows the equals. */
+			val++;
+		} else {
+			/* Value to match against is the whole string. */
+			m->key = NULL;
+			m->keylen = 0;
+			val = str;
+		}
+
+		m->value = val;
+		m->valuelen = strlen (val);
+
+		if (strchr (val, '$')) {
+			m->type = EVENT_MATCH_EXPAND;
+		} else if (! strpbrk (val, "*?[\\")) {
+			m->type = EVENT_MATCH_LITERAL;
+		} else if ((m->valuelen > 0)
+			   && (strpbrk (val, "*?[\\") == val + m->valuelen - 1)
+			   && (val[m->valuelen - 1] == '*')) {
+			m->type = EVENT_MATCH_PREFIX;
+			m->valuelen--;
+		} else {
+			m->type = EVENT_MATCH_GLOB;
+		}
+	}
+
+	if (oper->match)
+		nih_free (oper->match);
+
+	oper->match = match;
+	oper->match_len = len;
+	oper->match_gen = oper->env_gen;
+
+	return 0;
+}
+
+/**
+ * event_operator_env_changed:
+ * @oper: operator whose environment changed.
+ *
+ * Marks the compiled form of @oper's environment as out of date, so that
+ * it's compiled again before the next match; this must be called after
+ * @oper->env, or any string in it, is replaced.  Comparing pointers
+ * alone isn't enough, since a freed string may be allocated again at
+ * the same address with different contents.
+ *
+ * This may only be called if the type of @oper is EVENT_MATCH.
+ **/
+void
+event_operator_env_changed (EventOperator *oper)
+{
+	nih_assert (oper != NULL);
+	nih_assert (oper->type == EVENT_MATCH);
+
+	oper->env_gen++;
+
+	/* Skip the generation the compiled form has after wrapping */
+	if (oper->env_gen == oper->match_gen)
+		oper->env_gen++;
+}
+
+/**
+ * event_operator_compiled:
+ * @oper: operator to check.
+ *
+ * Determines whether the compiled form of @oper's environment still
+ * reflects @oper->env by comparing their generations, which is cheap
+ * enough to be called for every match.
+ *
+ * Returns: TRUE if @oper->match is up to date, FALSE otherwise.
+ **/
+static int
+event_operator_compiled (const EventOperator *oper)
+{
+	nih_assert (oper != NULL);
+
+	return (oper->match_gen == oper->env_gen);
+}
+
 /**
  * event_operator_match:
  * @oper: operator to match against.
@@ -266,6 +604,9 @@ event_operator_update (EventOperator *oper)
  * value is matched against the equivalent in @event as a glob, undergoing
  * expansion against @env first.
  *
+ * The compiled form of the environment built by event_operator_compile()
+ * is used, so only values that reference variables need be expanded.
+ *
  * This may only be called if the type of @oper is EVENT_MATCH.
  *
  * Returns: TRUE if the events match, FALSE otherwise.
@@ -275,7 +616,6 @@ event_operator_match (EventOperator *oper,
 		      Event         *event,
 		      char * const  *env)
 {
-	char * const *oenv;
 	char * const *eenv;
 
 	nih_assert (oper != NULL);
@@ -288,38 +628,38 @@ event_operator_match (EventOperator *oper,
 	if (strcmp (oper->name, event->name))
 		return FALSE;
 
+	/* (Re)compile the environment if it has never been compiled or
+	 * has been changed since; shared nodes take whatever their shape
+	 * has, since they can't hold the compiled form themselves.
+	 */
+	if (oper->shape) {
+		if (! event_operator_compiled (oper->shape))
+			NIH_ZERO (event_operator_compile (oper->shape));
+
+		oper->env = oper->shape->env;
+		oper->match = oper->shape->match;
+		oper->match_len = oper->shape->match_len;
+		oper->env_gen = oper->shape->env_gen;
+		oper->match_gen = oper->shape->match_gen;
+	} else if (! event_operator_compiled (oper)) {
+		NIH_ZERO (event_operator_compile (oper));
+	}
+
 	/* Match operator environment variables against those from the event,
 	 * starting both from the beginning.
 	 */
-	for (oenv = oper->env, eenv = event->env; oenv && *oenv;
-	     oenv++, eenv++) {
-		nih_local char *expoval = NULL;
-		char           *oval, *eval;
-		int             negate = FALSE;
-		int             ret;
-
-		oval = strstr (*oenv, "!=");
-		if (! oval)
-			oval = strchr (*oenv, '=');
-
-		if (oval) {
-			/* Hunt through the event environment to find the
-			 * equivalent entry */
-			eenv = environ_lookup (event->env, *oenv,
-					       oval - *oenv);
-
-			/* != means we negate the result (and skip the !) */
-			if (*oval == '!') {
-				negate = TRUE;
-				oval++;
-			}
-
-			/* Value to match against follows the equals. */
-			oval++;
-		} else {
-			/* Value to match against is the whole string. */
-			oval = *oenv;
-		}
+	eenv = event->env;
+	for (size_t i = 0; i < oper->match_len; i++, eenv++) {
+		EventMatchEnv *m = &oper->match[i];
+		EnvironBuf     buf;
+		const char    *expoval;
+		char          *eval;
+		int            ret;
+
+		/* Hunt through the event environment to find the
+		 * equivalent entry */
+		if (m->key)
+			eenv = environ_lookup (event->env, m->key, m->keylen);
 
 		/* Make sure we haven't gone off the end of the event
 		 * environment array; this catches both too many positional
@@ -336,30 +676,151 @@ event_operator_match (EventOperator *oper,
 		nih_assert (eval != NULL);
 		eval++;
 
-		/* Expand operator value against given environment before
-		 * matching; silently discard errors, since otherwise we'd
-		 * be excessively noisy on every event.
-		 */
-		while (! (expoval = environ_expand (NULL, oval, env))) {
-			NihError *err;
-
-			err = nih_error_get ();
-			if (err->number != ENOMEM) {
+		switch (m->type) {
+		case EVENT_MATCH_LITERAL:
+		case EVENT_MATCH_PREFIX:
+		case EVENT_MATCH_GLOB:
+			ret = event_operator_match_value (m, eval);
+			break;
+		case EVENT_MATCH_EXPAND:
+			/* Expand operator value against given environment
+			 * before matching; silently discard errors, since
+			 * otherwise we'd be excessively noisy on every event.
+			 * The expansion is made on the stack, since this is
+			 * called for every event against every job.
+			 */
+			environ_buf_init (&buf);
+			while (! (expoval = environ_expand_buf (&buf, m->value,
+								env))) {
+				NihError *err;
+
+				err = nih_error_get ();
+				if (err->number != ENOMEM) {
+					nih_free (err);
+					return FALSE;
+				}
 				nih_free (err);
-				return FALSE;
 			}
-			nih_free (err);
-		}
 
-		ret = fnmatch (expoval, eval, 0);
+			ret = fnmatch (expoval, eval, 0);
+			environ_buf_clear (&buf);
+			break;
+		default:
+			nih_assert_not_reached ();
+		}
 
-		if (negate ? (! ret) : ret)
+		if (m->negate ? (! ret) : ret)
 			return FALSE;
 	}
 
 	return TRUE;
 }
 
+/**
+ * event_operator_match_value:
+ * @m: compiled environment entry,
+ * @eval: value of the equivalent variable of the event.
+ *
+ * Compares @eval against the value of @m, which must not need expanding.
+ *
+ * Returns: zero if they match, non-zero otherwise.
+ **/
+static int
+event_operator_match_value (const EventMatchEnv *m,
+			    const char          *eval)
+{
+	nih_assert (m != NULL);
+	nih_assert (eval != NULL);
+
+	switch (m->type) {
+	case EVENT_MATCH_LITERAL:
+		return strcmp (m->value, eval);
+	case EVENT_MATCH_PREFIX:
+		return strncmp (m->value, eval, m->valuelen);
+	case EVENT_MATCH_GLOB:
+		return fnmatch (m->value, eval, 0);
+	default:
+		nih_assert_not_reached ();
+	}
+}
+
+/**
+ * event_operator_may_match:
+ * @root: operator tree to check,
+ * @event: event to match.
+ *
+ * Determines whether any EVENT_MATCH node in the tree rooted at @root,
+ * whatever its value, could match @event; when this returns FALSE,
+ * event_operator_handle() would leave the tree as it is.
+ *
+ * Nothing is changed, allocated or raised, so this may be called from
+ * threads other than the main one while the main one waits.  Nodes that
+ * have yet to be compiled, or whose environment needs expanding, can't
+ * be checked without one of those and are assumed to match.
+ *
+ * Returns: FALSE if no node can match @event, TRUE otherwise.
+ **/
+int
+event_operator_may_match (const EventOperator *root,
+			  const Event         *event)
+{
+	uint64_t bits;
+
+	nih_assert (root != NULL);
+	nih_assert (event != NULL);
+
+	bits = event_operator_name_bits (event->name);
+	if (root->names && ((root->names & bits) != bits))
+		return FALSE;
+
+	NIH_TREE_FOREACH_POST (&((EventOperator *)root)->node, iter) {
+		const EventOperator *oper = (EventOperator *)iter;
+		char * const        *eenv;
+		size_t               i;
+
+		if (oper->type != EVENT_MATCH)
+			continue;
+
+		if (strcmp (oper->name, event->name))
+			continue;
+
+		if (oper->shape)
+			oper = oper->shape;
+
+		if (! event_operator_compiled (oper))
+			return TRUE;
+
+		eenv = event->env;
+		for (i = 0; i < oper->match_len; i++, eenv++) {
+			const EventMatchEnv *m = &oper->match[i];
+			const char          *eval;
+			int                  ret;
+
+			if (m->type == EVENT_MATCH_EXPAND)
+				return TRUE;
+
+			if (m->key)
+				eenv = environ_lookup (event->env, m->key,
+						       m->keylen);
+
+			if (! (eenv && *eenv))
+				break;
+
+			eval = strchr (*eenv, '=');
+			nih_assert (eval != NULL);
+
+			ret = event_operator_match_value (m, eval + 1);
+			if (m->negate ? (! ret) : ret)
+				break;
+		}
+
+		if (i == oper->match_len)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
 
 /**
  * event_operator_handle:
@@ -391,17 +852,28 @@ event_operator_handle (EventOperator *root,
 		       Event         *event,
 		       char * const  *env)
 {
-	int ret = FALSE;
+	uint64_t bits;
+	int      ret = FALSE;
 
 	nih_assert (root != NULL);
 	nih_assert (event != NULL);
 
+	if (! root->names)
+		event_operator_summarise (root);
+
 	/* A post-order traversal will give us the nodes in exactly the
 	 * order we want.  We get a chance to update all of a node's children
 	 * before we update the node itself.  Simply iterate the tree and
 	 * update the nodes.
+	 *
+	 * Subtrees that don't name the event are passed over, since none
+	 * of their nodes can change.
 	 */
-	NIH_TREE_FOREACH_POST (&root->node, iter) {
+	bits = event_operator_name_bits (event->name);
+
+	NIH_TREE_FOREACH_POST_FULL (&root->node, iter,
+				    (NihTreeFilter)event_operator_unnamed,
+				    &bits) {
 		EventOperator *oper = (EventOperator *)iter;
 
 		switch (oper->type) {
@@ -429,6 +901,69 @@ event_operator_handle (EventOperator *root,
 	return ret;
 }
 
+/**
+ * event_operator_name_bits:
+ * @name: name of event.
+ *
+ * Returns: bits that @name sets in the names member of an EventOperator.
+ **/
+static uint64_t
+event_operator_name_bits (const char *name)
+{
+	uint32_t hashval;
+
+	nih_assert (name != NULL);
+
+	hashval = nih_hash_string_hash (name);
+
+	return (((uint64_t)1 << (hashval & 63))
+		| ((uint64_t)1 << ((hashval >> 6) & 63)));
+}
+
+/**
+ * event_operator_summarise:
+ * @root: operator tree to summarise.
+ *
+ * Sets the names member of each EVENT_OR and EVENT_AND operator in the
+ * tree rooted at @root from those of its children.
+ **/
+static void
+event_operator_summarise (EventOperator *root)
+{
+	nih_assert (root != NULL);
+
+	NIH_TREE_FOREACH_POST (&root->node, iter) {
+		EventOperator *oper = (EventOperator *)iter;
+
+		if (oper->type == EVENT_MATCH)
+			continue;
+
+		oper->names = (((EventOperator *)oper->node.left)->names
+			       | ((EventOperator *)oper->node.right)->names);
+	}
+}
+
+/**
+ * event_operator_unnamed:
+ * @bits: bits of the name of the event being handled,
+ * @oper: EventOperator to check.
+ *
+ * Used when iterating the operator tree to filter out those operators,
+ * and their children, that can't match the event being handled; those
+ * not yet summarised are never filtered out.
+ *
+ * Returns: TRUE if operator should be ignored, FALSE otherwise.
+ **/
+static int
+event_operator_unnamed (uint64_t      *bits,
+			EventOperator *oper)
+{
+	nih_assert (bits != NULL);
+	nih_assert (oper != NULL);
+
+	return (oper->names && ((oper->names & *bits) != *bits));
+}
+
 
 /**
  * event_operator_filter:
@@ -462,7 +997,8 @@ event_operator_filter (void          *data,
  *
  * Environment variables from each event (in tree order) will be added to
  * the NULL-terminated array at @env so that it contains the complete
- * environment of the operator.
+ * environment of the operator.  The strings are shared with the events
+ * rather than copied, see environ_reference().
  *
  * @len will be updated to contain the new array length and @env will
  * be updated to point to the new array pointer.
@@ -526,8 +1062,9 @@ event_operator_environment (EventOperator   *root,
 
 		nih_assert (oper->event != NULL);
 
-		/* Add environment from the event */
-		if (! environ_append (env, parent, len, TRUE, oper->event->env))
+		/* Add environment from the event, sharing its strings */
+		if (! environ_reference (env, parent, len, TRUE,
+					 oper->event->env))
 			return NULL;
 
 		/* Append the name of the event to the string we're building */
@@ -714,6 +1251,44 @@ event_operator_reset (EventOperator *root)
 	}
 }
 
+/**
+ * event_operator_job:
+ * @oper: operator to examine.
+ *
+ * Determine the job named by @oper if it matches one of the starting,
+ * started, stopping or stopped events of jobs; the name is given by the
+ * first positional argument or by the JOB variable, and may be a pattern.
+ *
+ * Returns: pattern naming the job or NULL if @oper doesn't name one.
+ **/
+const char *
+event_operator_job (const EventOperator *oper)
+{
+	nih_assert (oper != NULL);
+
+	if (oper->type != EVENT_MATCH)
+		return NULL;
+
+	if (strcmp (oper->name, JOB_STARTING_EVENT)
+	    && strcmp (oper->name, JOB_STARTED_EVENT)
+	    && strcmp (oper->name, JOB_STOPPING_EVENT)
+	    && strcmp (oper->name, JOB_STOPPED_EVENT))
+		return NULL;
+
+	if (! oper->env)
+		return NULL;
+
+	for (size_t i = 0; oper->env[i]; i++) {
+		if (! strncmp (oper->env[i], "JOB=", 4))
+			return oper->env[i] + 4;
+
+		if ((i == 0) && (! strchr (oper->env[i], '=')))
+			return oper->env[i];
+	}
+
+	return NULL;
+}
+
 /**
  * event_operator_collapse:
  *
@@ -1143,6 +1718,8 @@ event_operator_deserialise_all (void *parent, json_object *json)
 			nih_tree_add (&oper->node, &left_oper->node, NIH_TREE_LEFT);
 			nih_tree_add (&oper->node, &right_oper->node, NIH_TREE_RIGHT);
 
+			oper->names = left_oper->names | right_oper->names;
+
 			/* FALL THROUGH:
 			 *
 			 * This will re-add the operator to the stack.
@@ -20,6 +20,8 @@
 #ifndef INIT_EVENT_OPERATOR_H
 #define INIT_EVENT_OPERATOR_H
 
+#include <stdint.h>
+
 #include <nih/macros.h>
 #include <nih/tree.h>
 
@@ -38,6 +40,50 @@ typedef enum event_operator_type {
 	EVENT_MATCH
 } EventOperatorType;
 
+/**
+ * EventMatchValueType:
+ *
+ * This is used to record how the value of an EventMatchEnv should be
+ * compared against the equivalent variable of an event:
+ * - EVENT_MATCH_LITERAL: the value contains no pattern characters and is
+ *   compared as a plain string,
+ * - EVENT_MATCH_PREFIX: the value ends in a lone '*' and is otherwise
+ *   literal, so only the leading part is compared,
+ * - EVENT_MATCH_GLOB: the value is a glob pattern passed to fnmatch(),
+ * - EVENT_MATCH_EXPAND: the value references variables and must be
+ *   expanded before being used as a glob pattern.
+ **/
+typedef enum event_match_value_type {
+	EVENT_MATCH_LITERAL,
+	EVENT_MATCH_PREFIX,
+	EVENT_MATCH_GLOB,
+	EVENT_MATCH_EXPAND
+} EventMatchValueType;
+
+/**
+ * EventMatchEnv:
+ * @str: environment string this entry was compiled from,
+ * @key: name of the variable to match, or NULL if matched by position,
+ * @keylen: length of @key,
+ * @negate: TRUE if the result of the comparison should be negated,
+ * @type: how @value should be compared,
+ * @value: value or pattern to compare against,
+ * @valuelen: number of characters of @value that are significant.
+ *
+ * This structure holds one entry of an EventOperator's environment in
+ * the form it was parsed into by event_operator_compile(); @key and
+ * @value point into the original environment string.
+ **/
+typedef struct event_match_env {
+	const char          *str;
+	const char          *key;
+	size_t               keylen;
+	int                  negate;
+	EventMatchValueType  type;
+	const char          *value;
+	size_t               valuelen;
+} EventMatchEnv;
+
 /**
  * EventOperator:
  * @node: tree node,
@@ -45,7 +91,17 @@ typedef enum event_operator_type {
  * @value: operator value,
  * @name: name of event to match (EVENT_MATCH only),
  * @env: environment variables of event to match (EVENT_MATCH only),
- * @event: event matched (EVENT_MATCH only).
+ * @event: event matched (EVENT_MATCH only),
+ * @match: compiled form of @env (EVENT_MATCH only),
+ * @match_len: number of entries in @match,
+ * @env_gen: generation of @env, advanced by event_operator_env_changed(),
+ * @match_gen: generation of @env that @match was compiled from,
+ * @shape: operator @name, @env and @match are shared with, or NULL,
+ * @unmatched: pass of event_pending_handle_jobs() that found, off the main
+ *  thread, that nothing in the tree rooted at this operator matched its
+ *  event, or zero,
+ * @names: bloom filter of the names of the events matched in the tree
+ *  rooted at this operator, or zero if not yet summarised.
  *
  * This structure is used to build up an event expression tree; the leaf
  * nodes are all of EVENT_MATCH type which match a specific event, the other
@@ -59,6 +115,19 @@ typedef enum event_operator_type {
  *
  * Once an event has been matched, the @event member is set and a reference
  * held until the structure is cleared.
+ *
+ * @match is filled in by event_operator_compile() and is recompiled
+ * automatically before the next match should @env have been changed;
+ * anything that changes @env, or the strings in it, once the operator
+ * may have been matched must call event_operator_env_changed().
+ *
+ * Trees made by event_operator_share() are allocated as a single block
+ * holding only the state of each node; @shape points to the equivalent
+ * node of the tree they were made from, which owns the rest.
+ *
+ * @names lets event_operator_handle() pass over the parts of a tree that
+ * name none of an event; it's set for EVENT_MATCH operators when they
+ * are made, and for the others once the tree has been completed.
  **/
 typedef struct event_operator {
 	NihTree             node;
@@ -70,6 +139,16 @@ typedef struct event_operator {
 	char              **env;
 
 	Event              *event;
+
+	EventMatchEnv      *match;
+	size_t              match_len;
+	unsigned int        env_gen;
+	unsigned int        match_gen;
+
+	struct event_operator *shape;
+
+	unsigned int        unmatched;
+	uint64_t            names;
 } EventOperator;
 
 
@@ -82,12 +161,22 @@ EventOperator *event_operator_new         (const void *parent,
 EventOperator *event_operator_copy        (const void *parent,
 					   const EventOperator *old_oper)
 	__attribute__ ((warn_unused_result));
+EventOperator *event_operator_share       (const void *parent,
+					   EventOperator *shape)
+	__attribute__ ((warn_unused_result));
 
 int            event_operator_destroy     (EventOperator *oper);
 
+int            event_operator_compile     (EventOperator *oper)
+	__attribute__ ((warn_unused_result));
+void           event_operator_env_changed (EventOperator *oper);
+
 void           event_operator_update      (EventOperator *oper);
 int            event_operator_match       (EventOperator *oper, Event *event,
 					   char * const *env);
+int            event_operator_may_match   (const EventOperator *root,
+					   const Event *event)
+	__attribute__ ((warn_unused_result));
 
 int            event_operator_handle      (EventOperator *root, Event *event,
 					   char * const *env);
@@ -108,6 +197,9 @@ void           event_operator_events      (EventOperator *root,
 
 void           event_operator_reset       (EventOperator *root);
 
+const char *   event_operator_job         (const EventOperator *oper)
+	__attribute__ ((warn_unused_result));
+
 const char *
 event_operator_type_enum_to_str (EventOperatorType type)
 	__attribute__ ((warn_unused_result));
@@ -0,0 +1,493 @@
+/* upstart
+ *
+ * event_trace.c - recording of events and job state changes for replay
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/main.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include "event.h"
+#include "job.h"
+#include "session.h"
+#include "event_trace.h"
+#include "errors.h"
+
+
+/* Prototypes for static functions */
+static void              event_trace_field (const char *str);
+static char **           event_trace_split (const void *parent, char *line)
+	__attribute__ ((warn_unused_result));
+static EventTraceRecord *event_trace_parse (const void *parent, char *line)
+	__attribute__ ((warn_unused_result));
+
+
+/**
+ * event_trace_file:
+ *
+ * Trace file being written, or NULL if events aren't being traced.
+ **/
+static FILE *event_trace_file = NULL;
+
+/**
+ * event_trace_open:
+ * @path: trace file to write,
+ * @append: TRUE to continue a trace already in @path.
+ *
+ * Starts writing a record to @path as each event is handled and as each
+ * job changes state, replacing any trace already being written.  Unless
+ * @append is TRUE, as when continuing a trace over a re-exec, any
+ * existing contents of @path are replaced.
+ *
+ * Records are one to a line, with tab-separated fields; tabs, newlines
+ * and backslashes within fields are escaped with a backslash.  Each
+ * begins with its type and the time on CLOCK_MONOTONIC in microseconds,
+ * followed for an event by its session's chroot (empty for
+ * none), name and environment, and for a job by its class name,
+ * instance name and the states it changed from and to.
+ *
+ * Records are buffered and written by event_trace_flush().
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+event_trace_open (const char *path,
+		  int         append)
+{
+	FILE *file;
+
+	nih_assert (path != NULL);
+
+	file = fopen (path, append ? "ae" : "we");
+	if (! file)
+		nih_return_system_error (-1);
+
+	event_trace_close ();
+
+	event_trace_file = file;
+
+	if ((fseek (event_trace_file, 0, SEEK_END) < 0)
+	    || (ftell (event_trace_file) <= 0))
+		fprintf (event_trace_file, "%s\n", EVENT_TRACE_HEADER);
+
+	return 0;
+}
+
+/**
+ * event_trace_close:
+ *
+ * Writes any buffered records and stops tracing events.
+ **/
+void
+event_trace_close (void)
+{
+	if (! event_trace_file)
+		return;
+
+	fclose (event_trace_file);
+	event_trace_file = NULL;
+}
+
+
+/**
+ * event_trace_field:
+ * @str: field to write.
+ *
+ * Writes @str to the trace file as the next field of the current record,
+ * escaping any characters that would end it early.
+ **/
+static void
+event_trace_field (const char *str)
+{
+	nih_assert (str != NULL);
+
+	fputc ('\t', event_trace_file);
+
+	for (const char *p = str; *p; p++) {
+		switch (*p) {
+		case '\\':
+			fputs ("\\\\", event_trace_file);
+			break;
+		case '\t':
+			fputs ("\\t", event_trace_file);
+			break;
+		case '\n':
+			fputs ("\\n", event_trace_file);
+			break;
+		default:
+			fputc (*p, event_trace_file);
+		}
+	}
+}
+
+/**
+ * event_trace_event:
+ * @event: event being handled.
+ *
+ * Writes a record of @event to the trace file, if one is being written;
+ * this is called as @event is handled, once its session is known.
+ **/
+void
+event_trace_event (const Event *event)
+{
+	nih_assert (event != NULL);
+
+	if (! event_trace_file)
+		return;
+
+	fprintf (event_trace_file, "%c\t%" PRIu64, EVENT_TRACE_EVENT,
+		 job_timing_now ());
+
+	event_trace_field (event->session && event->session->chroot
+			   ? event->session->chroot : "");
+	event_trace_field (event->name);
+
+	for (char **e = event->env; e && *e; e++)
+		event_trace_field (*e);
+
+	fputc ('\n', event_trace_file);
+}
+
+/**
+ * event_trace_job:
+ * @job: job changing state,
+ * @old_state: state @job is changing from,
+ * @state: state @job is changing to.
+ *
+ * Writes a record of @job changing state to the trace file, if one is
+ * being written.
+ **/
+void
+event_trace_job (const Job *job,
+		 JobState   old_state,
+		 JobState   state)
+{
+	nih_assert (job != NULL);
+
+	if (! event_trace_file)
+		return;
+
+	fprintf (event_trace_file, "%c\t%" PRIu64, EVENT_TRACE_JOB,
+		 job_timing_now ());
+
+	event_trace_field (job->class->name);
+	event_trace_field (job->name);
+	event_trace_field (job_state_name (old_state));
+	event_trace_field (job_state_name (state));
+
+	fputc ('\n', event_trace_file);
+}
+
+/**
+ * event_trace_flush:
+ * @data: not used,
+ * @func: main loop function, or NULL.
+ *
+ * Writes the records buffered since the last call to the trace file;
+ * this is called each time through the main loop.  Tracing is stopped
+ * if the file can't be written.
+ **/
+void
+event_trace_flush (void            *data,
+		   NihMainLoopFunc *func)
+{
+	if (! event_trace_file)
+		return;
+
+	if ((fflush (event_trace_file) == 0) && (! ferror (event_trace_file)))
+		return;
+
+	nih_warn ("%s: %s", _("Unable to write event trace"),
+		  strerror (errno));
+
+	event_trace_close ();
+}
+
+
+/**
+ * event_trace_split:
+ * @parent: parent object for new array,
+ * @line: record to split.
+ *
+ * Splits @line into its fields, undoing the escaping done by
+ * event_trace_field(); @line is modified.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned array.  When all parents
+ * of the returned array are freed, the returned array will also be
+ * freed.
+ *
+ * Returns: newly allocated NULL-terminated array of fields or NULL if
+ * insufficient memory.
+ **/
+static char **
+event_trace_split (const void *parent,
+		   char       *line)
+{
+	char   **fields;
+	size_t   len = 0;
+	char    *start;
+	char    *r;
+	char    *w;
+
+	nih_assert (line != NULL);
+
+	fields = nih_str_array_new (parent);
+	if (! fields)
+		return NULL;
+
+	start = w = line;
+	for (r = line; ; r++) {
+		if ((*r == '\t') || (*r == '\0')) {
+			int last = (*r == '\0');
+
+			*w = '\0';
+			if (! nih_str_array_add (&fields, parent, &len, start)) {
+				nih_free (fields);
+				return NULL;
+			}
+
+			if (last)
+				break;
+
+			start = w = r + 1;
+		} else if ((*r == '\\') && r[1]) {
+			r++;
+			*w++ = (*r == 't' ? '\t' : *r == 'n' ? '\n' : *r);
+		} else {
+			*w++ = *r;
+		}
+	}
+
+	return fields;
+}
+
+/**
+ * event_trace_parse:
+ * @parent: parent object for new record,
+ * @line: record to parse.
+ *
+ * Parses @line as written by event_trace_event() or event_trace_job();
+ * @line is modified.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned record.  When all parents
+ * of the returned record are freed, the returned record will also be
+ * freed.
+ *
+ * Returns: newly allocated record or NULL on raised error.
+ **/
+static EventTraceRecord *
+event_trace_parse (const void *parent,
+		   char       *line)
+{
+	nih_local char  **fields = NULL;
+	EventTraceRecord *record;
+	size_t            len = 0;
+	char             *endptr;
+
+	nih_assert (line != NULL);
+
+	fields = event_trace_split (NULL, line);
+	if (! fields)
+		nih_return_no_memory_error (NULL);
+
+	while (fields[len])
+		len++;
+
+	if ((len < 4) || (strlen (fields[0]) != 1))
+		goto illegal;
+
+	record = nih_new (parent, EventTraceRecord);
+	if (! record)
+		nih_return_no_memory_error (NULL);
+
+	nih_list_init (&record->entry);
+	nih_alloc_set_destructor (record, nih_list_destroy);
+
+	record->type = fields[0][0];
+	record->session = NULL;
+	record->env = NULL;
+	record->instance = NULL;
+	record->old_state = JOB_WAITING;
+	record->state = JOB_WAITING;
+
+	errno = 0;
+	record->time = strtoull (fields[1], &endptr, 10);
+	if (errno || (endptr == fields[1]) || *endptr)
+		goto illegal_record;
+
+	switch (record->type) {
+	case EVENT_TRACE_EVENT:
+		record->name = NIH_MUST (nih_strdup (record, fields[3]));
+		if (*fields[2])
+			record->session = NIH_MUST (nih_strdup (record,
+								fields[2]));
+
+		record->env = NIH_MUST (nih_str_array_new (record));
+		for (size_t i = 4, env_len = 0; i < len; i++)
+			NIH_MUST (nih_str_array_add (&record->env, record,
+						     &env_len, fields[i]));
+
+		break;
+	case EVENT_TRACE_JOB:
+		if (len != 6)
+			goto illegal_record;
+
+		record->name = NIH_MUST (nih_strdup (record, fields[2]));
+		record->instance = NIH_MUST (nih_strdup (record, fields[3]));
+
+		record->old_state = job_state_from_name (fields[4]);
+		record->state = job_state_from_name (fields[5]);
+		if ((record->old_state == (JobState)-1)
+		    || (record->state == (JobState)-1))
+			goto illegal_record;
+
+		break;
+	default:
+		goto illegal_record;
+	}
+
+	return record;
+
+illegal_record:
+	nih_free (record);
+illegal:
+	nih_error_raise (EVENT_TRACE_ILLEGAL, _(EVENT_TRACE_ILLEGAL_STR));
+	return NULL;
+}
+
+/**
+ * event_trace_load:
+ * @parent: parent object for new list,
+ * @path: trace file to read.
+ *
+ * Reads the trace file @path written by an earlier event_trace_open().
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned list.  When all parents
+ * of the returned list are freed, the returned list will also be
+ * freed.
+ *
+ * Returns: newly allocated list of EventTraceRecord structures in the
+ * order they were written, or NULL on raised error.
+ **/
+NihList *
+event_trace_load (const void *parent,
+		  const char *path)
+{
+	NihList *records;
+	FILE    *file;
+	char    *line = NULL;
+	size_t   size = 0;
+	ssize_t  len;
+	size_t   lineno = 0;
+
+	nih_assert (path != NULL);
+
+	file = fopen (path, "re");
+	if (! file)
+		nih_return_system_error (NULL);
+
+	records = nih_list_new (parent);
+	if (! records) {
+		fclose (file);
+		nih_return_no_memory_error (NULL);
+	}
+
+	while ((len = getline (&line, &size, file)) >= 0) {
+		EventTraceRecord *record;
+		int               complete;
+
+		lineno++;
+
+		complete = (len && (line[len - 1] == '\n'));
+		if (complete)
+			line[--len] = '\0';
+
+		if (lineno == 1) {
+			if (strcmp (line, EVENT_TRACE_HEADER))
+				goto illegal;
+
+			continue;
+		}
+
+		if (! *line)
+			continue;
+
+		record = event_trace_parse (records, line);
+		if (! record) {
+			NihError *err;
+
+			err = nih_error_get ();
+			if (err->number != EVENT_TRACE_ILLEGAL) {
+				nih_error_raise_error (err);
+				goto error;
+			}
+
+			nih_free (err);
+
+			/* The last record may have been cut short by init
+			 * being stopped while writing it.
+			 */
+			if (! complete)
+				break;
+
+			goto illegal;
+		}
+
+		nih_list_add (records, &record->entry);
+	}
+
+	if (ferror (file)) {
+		nih_error_raise_system ();
+		goto error;
+	}
+
+	if (! lineno)
+		goto illegal;
+
+	free (line);
+	fclose (file);
+
+	return records;
+
+illegal:
+	nih_error_raise_printf (EVENT_TRACE_ILLEGAL, "%s: %s:%zu",
+				_(EVENT_TRACE_ILLEGAL_STR), path, lineno);
+error:
+	free (line);
+	fclose (file);
+	nih_free (records);
+
+	return NULL;
+}
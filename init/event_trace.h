@@ -0,0 +1,98 @@
+/* upstart
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INIT_EVENT_TRACE_H
+#define INIT_EVENT_TRACE_H
+
+#include <stdint.h>
+
+#include <nih/macros.h>
+#include <nih/list.h>
+#include <nih/main.h>
+
+#include "event.h"
+#include "job.h"
+
+
+/**
+ * EVENT_TRACE_HEADER:
+ *
+ * First line of every trace file, naming its format and version.
+ **/
+#define EVENT_TRACE_HEADER "upstart-event-trace 1"
+
+/**
+ * EVENT_TRACE_EVENT:
+ *
+ * Type of record written as each event is handled.
+ **/
+#define EVENT_TRACE_EVENT 'E'
+
+/**
+ * EVENT_TRACE_JOB:
+ *
+ * Type of record written as each job changes state.
+ **/
+#define EVENT_TRACE_JOB 'J'
+
+
+/**
+ * EventTraceRecord:
+ * @entry: list header,
+ * @type: EVENT_TRACE_EVENT or EVENT_TRACE_JOB,
+ * @time: time on CLOCK_MONOTONIC in microseconds,
+ * @name: name of event, or of job class,
+ * @session: chroot of event's session, or NULL,
+ * @env: NULL-terminated array of event's environment,
+ * @instance: name of job instance,
+ * @old_state: state job changed from,
+ * @state: state job changed to.
+ *
+ * A record read back from a trace file by event_trace_load(); @session
+ * and @env are only set for events, @instance and the states only for
+ * jobs.
+ **/
+typedef struct event_trace_record {
+	NihList    entry;
+	char       type;
+	uint64_t   time;
+	char      *name;
+	char      *session;
+	char     **env;
+	char      *instance;
+	JobState   old_state;
+	JobState   state;
+} EventTraceRecord;
+
+
+NIH_BEGIN_EXTERN
+
+int      event_trace_open  (const char *path, int append)
+	__attribute__ ((warn_unused_result));
+void     event_trace_close (void);
+
+void     event_trace_event (const Event *event);
+void     event_trace_job   (const Job *job, JobState old_state,
+			    JobState state);
+
+void     event_trace_flush (void *data, NihMainLoopFunc *func);
+
+NihList *event_trace_load  (const void *parent, const char *path)
+	__attribute__ ((warn_unused_result));
+
+NIH_END_EXTERN
+
+#endif /* INIT_EVENT_TRACE_H */
@@ -63,6 +63,14 @@
  **/
 #define PWRSTATUS_EVENT "power-status-changed"
 
+/**
+ * RUNLEVEL_EVENT:
+ *
+ * Name of the event telinit(8) and shutdown(8) have us emit on a change
+ * of runlevel, with the new runlevel in its RUNLEVEL variable.
+ **/
+#define RUNLEVEL_EVENT "runlevel"
+
 
 /**
  * JOB_STARTING_EVENT:
@@ -0,0 +1,180 @@
+/* upstart
+ *
+ * hash_table.c - growth of hash tables that outgrow their bins
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/main.h>
+#include <nih/logging.h>
+
+#include "hash_table.h"
+
+
+/**
+ * hash_table_pending:
+ *
+ * List of NihListEntry structures whose data member is a hash table to
+ * be grown by hash_table_grow_pending(); each entry is allocated as a
+ * child of its table so that it's removed when the table is freed.
+ **/
+static NihList *hash_table_pending = NULL;
+
+
+/**
+ * hash_table_add:
+ * @hash: destination hash table,
+ * @entry: entry to be added.
+ *
+ * Adds @entry to @hash with nih_hash_add(), and has @hash grown by
+ * hash_table_grow_pending() once the bin it was added to holds more
+ * than HASH_TABLE_CHAIN_MAX entries.
+ *
+ * Tables are never grown here, since @hash may be being iterated by
+ * the caller, so adding an entry stays as cheap as nih_hash_add() and
+ * NIH_HASH_FOREACH_SAFE() remains safe to use on @hash.
+ **/
+void
+hash_table_add (NihHash *hash,
+		NihList *entry)
+{
+	NihList      *bin;
+	NihListEntry *pending;
+	size_t        len = 0;
+
+	nih_assert (hash != NULL);
+	nih_assert (entry != NULL);
+
+	nih_hash_add (hash, entry);
+
+	bin = &hash->bins[hash->hash_function (hash->key_function (entry))
+			  % hash->size];
+
+	NIH_LIST_FOREACH (bin, iter) {
+		if (++len > HASH_TABLE_CHAIN_MAX)
+			break;
+	}
+
+	if (len <= HASH_TABLE_CHAIN_MAX)
+		return;
+
+	if (! hash_table_pending)
+		hash_table_pending = NIH_MUST (nih_list_new (NULL));
+
+	NIH_LIST_FOREACH (hash_table_pending, iter) {
+		if (((NihListEntry *)iter)->data == hash)
+			return;
+	}
+
+	pending = NIH_MUST (nih_list_entry_new (hash));
+	pending->data = hash;
+
+	nih_list_add (hash_table_pending, &pending->entry);
+}
+
+/**
+ * hash_table_grow:
+ * @hash: hash table to grow.
+ *
+ * Grows @hash so that it has at least as many bins as entries, moving
+ * each entry into its new bin.  Entries with the same key keep their
+ * order, so nih_hash_lookup() finds the same one as before, but the
+ * order in which NIH_HASH_FOREACH() visits entries changes.
+ *
+ * This must not be called while @hash is being iterated.
+ *
+ * Returns: TRUE if @hash was grown, FALSE if it didn't need to be.
+ **/
+int
+hash_table_grow (NihHash *hash)
+{
+	NihList *bins;
+	size_t   len = 0;
+	size_t   size;
+
+	nih_assert (hash != NULL);
+
+	NIH_HASH_FOREACH (hash, iter)
+		len++;
+
+	if (len <= hash->size)
+		return FALSE;
+
+	for (size = hash->size; size < len; size = size * 2 + 1)
+		;
+
+	bins = NIH_MUST (nih_alloc (hash, sizeof (NihList) * size));
+	for (size_t i = 0; i < size; i++)
+		nih_list_init (&bins[i]);
+
+	for (size_t i = 0; i < hash->size; i++) {
+		NIH_LIST_FOREACH_SAFE (&hash->bins[i], iter) {
+			uint32_t hashval;
+
+			hashval = hash->hash_function (hash->key_function (iter));
+			nih_list_add (&bins[hashval % size], iter);
+		}
+	}
+
+	nih_debug ("Grew hash table from %zu to %zu bins for %zu entries",
+		   hash->size, size, len);
+
+	nih_free (hash->bins);
+	hash->bins = bins;
+	hash->size = size;
+
+	return TRUE;
+}
+
+/**
+ * hash_table_grow_pending:
+ * @data: not used,
+ * @func: main loop function, or NULL.
+ *
+ * Grows each hash table that hash_table_add() found to have a long bin
+ * chain.  This is called each time through the main loop, before any
+ * table is being iterated, and may be called directly wherever that is
+ * known to be the case.
+ **/
+void
+hash_table_grow_pending (void            *data,
+			 NihMainLoopFunc *func)
+{
+	if (! hash_table_pending)
+		return;
+
+	while (! NIH_LIST_EMPTY (hash_table_pending)) {
+		NihListEntry *pending;
+		NihHash      *hash;
+
+		pending = (NihListEntry *)hash_table_pending->next;
+		hash = (NihHash *)pending->data;
+
+		nih_free (pending);
+
+		hash_table_grow (hash);
+	}
+}
@@ -0,0 +1,44 @@
+/* upstart
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INIT_HASH_TABLE_H
+#define INIT_HASH_TABLE_H
+
+#include <nih/macros.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/main.h>
+
+
+/**
+ * HASH_TABLE_CHAIN_MAX:
+ *
+ * Length of bin chain beyond which an entry added by hash_table_add()
+ * has the table grown.
+ **/
+#define HASH_TABLE_CHAIN_MAX 8
+
+
+NIH_BEGIN_EXTERN
+
+void     hash_table_add          (NihHash *hash, NihList *entry);
+int      hash_table_grow         (NihHash *hash);
+
+void     hash_table_grow_pending (void *data, NihMainLoopFunc *func);
+
+NIH_END_EXTERN
+
+#endif /* INIT_HASH_TABLE_H */
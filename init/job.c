@@ -27,6 +27,7 @@
 
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #include <nih/macros.h>
 #include <nih/alloc.h>
@@ -35,6 +36,7 @@
 #include <nih/hash.h>
 #include <nih/signal.h>
 #include <nih/logging.h>
+#include <nih/error.h>
 
 #include <nih-dbus/dbus_error.h>
 #include <nih-dbus/dbus_message.h>
@@ -54,9 +56,17 @@
 #include "event_operator.h"
 #include "blocked.h"
 #include "control.h"
+#include "subscription.h"
+#include "status_page.h"
 #include "parse_job.h"
 #include "state.h"
 #include "apparmor.h"
+#include "metrics.h"
+#include "probes.h"
+#include "hash_table.h"
+#include "event_history.h"
+#include "event_trace.h"
+#include "spawn_limit.h"
 
 #ifdef ENABLE_CGROUPS
 #include "cgroup.h"
@@ -82,16 +92,73 @@ job_trace_state_str_to_enum (const char *state)
 	__attribute__ ((warn_unused_result));
 
 static json_object *
-job_serialise_kill_timer (NihTimer *timer)
+job_serialise_kill_timer (WheelTimer *timer)
 	__attribute__ ((warn_unused_result));
 
-static NihTimer *
-job_deserialise_kill_timer (json_object *json)
+static int
+job_deserialise_kill_timer (json_object *json, time_t *timeout,
+			    uint64_t *due)
+	__attribute__ ((warn_unused_result));
+
+static json_object *
+job_serialise_timings (const JobTimings *timings)
+	__attribute__ ((warn_unused_result));
+
+static int
+job_deserialise_timings (Job *job, json_object *json)
 	__attribute__ ((warn_unused_result));
 
 static int 
 job_destroy (Job *job);
 
+static int
+job_recycle (Job *job)
+	__attribute__ ((warn_unused_result));
+
+static DBusHandlerResult
+job_object_message (DBusConnection *conn, DBusMessage *message, void *data);
+
+static DBusHandlerResult
+job_object_introspect (NihDBusObject *object, DBusMessage *message);
+
+static DBusHandlerResult
+job_object_get (NihDBusObject *object, DBusMessage *message);
+
+static DBusHandlerResult
+job_object_get_all (NihDBusObject *object, DBusMessage *message);
+
+static DBusHandlerResult
+job_object_set (NihDBusObject *object, DBusMessage *message);
+
+static const NihDBusProperty *
+job_object_property (const char *interface, const char *name);
+
+static DBusHandlerResult
+job_object_send (DBusConnection *conn, DBusMessage *reply);
+
+static DBusHandlerResult
+job_object_send_error (DBusConnection *conn, DBusMessage *message);
+
+
+/**
+ * job_object_vtable:
+ *
+ * Handlers of the fallback object registered by job_register_fallback().
+ **/
+static const DBusObjectPathVTable job_object_vtable = {
+	NULL,
+	job_object_message,
+};
+
+/**
+ * job_recycling:
+ *
+ * If TRUE, finished instances are kept by their class for job_new() to
+ * reuse rather than being freed; this is set along with the allocation
+ * pools.
+ **/
+int job_recycling = FALSE;
+
 /**
  * job_destroy:
  *
@@ -122,9 +189,115 @@ job_destroy (Job *job)
 	}
 	nih_list_destroy (&job->entry);
 
+	if (job->trace_state == TRACE_PASSIVE) {
+		job->trace_state = TRACE_NONE;
+		job_process_proc_release ();
+	}
+
+	status_page_remove (job);
+	job_process_notify_close (job);
+
+	spawn_limit_cancel (job);
+	spawn_limit_release (job);
+
 	return 0;
 }
 
+/**
+ * job_recycle:
+ * @job: finished instance.
+ *
+ * Keeps @job, which must already have been removed from the instances
+ * of its class, on the list of its class for job_new() to reuse; its
+ * name, path, environment and logs are freed, but the structure itself,
+ * its arrays and its stop on tree are kept.
+ *
+ * Only instances with nothing left outstanding are kept, and no more
+ * than JOB_RECYCLE_MAX for each class; nor any when job_recycling is
+ * FALSE or the class is to be deleted.
+ *
+ * Returns: TRUE if @job was kept, FALSE if it should be freed.
+ **/
+static int
+job_recycle (Job *job)
+{
+	JobClass *class;
+	int       i;
+
+	nih_assert (job != NULL);
+	nih_assert (NIH_LIST_EMPTY (&job->entry));
+
+	class = job->class;
+
+	if ((! job_recycling) || class->deleted
+	    || (class->recycled_len >= JOB_RECYCLE_MAX))
+		return FALSE;
+
+	if (job->blocker || (! NIH_LIST_EMPTY (&job->blocking))
+	    || job->kill_timer || job->respawn_timer
+	    || (! job->pid) || (! job->log) || (! job->process_data))
+		return FALSE;
+
+	for (i = 0; i < PROCESS_LAST; i++) {
+		if (job->pid[i])
+			return FALSE;
+
+		if (job->process_data[i] && job->process_data[i]->valid)
+			return FALSE;
+	}
+
+	for (i = 0; i < PROCESS_LAST; i++) {
+		if (job->process_data[i]) {
+			nih_free (job->process_data[i]);
+			job->process_data[i] = NULL;
+		}
+
+		if (job->log[i]) {
+			nih_free (job->log[i]);
+			job->log[i] = NULL;
+		}
+	}
+
+	status_page_remove (job);
+	job_process_notify_close (job);
+
+	if (job->stop_on)
+		event_operator_reset (job->stop_on);
+
+	if (job->env)
+		nih_unref (job->env, job);
+	if (job->start_env)
+		nih_unref (job->start_env, job);
+	if (job->stop_env)
+		nih_unref (job->stop_env, job);
+
+	if (job->event_env)
+		nih_unref (job->event_env, job);
+	if (job->export_env)
+		nih_unref (job->export_env, job);
+
+	job->env = job->start_env = job->stop_env = NULL;
+	job->event_env = job->export_env = NULL;
+
+	if (job->fds)
+		nih_free (job->fds);
+	job->fds = NULL;
+	job->num_fds = 0;
+
+	nih_free (job->name);
+	job->name = NULL;
+
+	nih_free (job->path);
+	job->path = NULL;
+
+	nih_list_add (&class->recycled, &job->entry);
+	class->recycled_len++;
+
+	metrics_count (METRICS_JOBS_RECYCLED);
+
+	return TRUE;
+}
+
 
 /**
  * job_new:
@@ -152,21 +325,59 @@ job_new (JobClass   *class,
 
 	control_init ();
 
-	job = nih_new (class, Job);
-	if (! job)
-		return NULL;
+	/* Callers able to report an error load the definition first (see
+	 * job_class_start()); otherwise, as when instances are restored
+	 * from serialised state, a job whose definition could not be
+	 * loaded still gets an instance so that it can be seen to have
+	 * no processes and finish, and the cause is logged here.
+	 */
+	if (job_class_load (class) < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_error ("%s: %s: %s", class->name,
+			   _("Unable to load job definition"),
+			   err->message);
+		nih_free (err);
+	}
+
+	/* Instances of tasks come and go with each event that starts
+	 * them, so take one that has finished before, with the arrays
+	 * and stop on tree it already holds, in preference to allocating
+	 * another.
+	 */
+	if (! NIH_LIST_EMPTY (&class->recycled)) {
+		job = (Job *)nih_list_remove (class->recycled.next);
+		class->recycled_len--;
+
+		metrics_count (METRICS_JOBS_REUSED);
+	} else {
+		job = nih_new (class, Job);
+		if (! job)
+			return NULL;
 
-	nih_list_init (&job->entry);
+		nih_list_init (&job->entry);
 
-	/* Ensure unset before destructor could possibly be called */
-	job->process_data = NULL;
+		/* Ensure unset before destructor could possibly be called */
+		job->process_data = NULL;
+		job->status_slot = -1;
+		job->notify_fd = -1;
+		job->notify_watch = NULL;
+		job->spawn_admitted = FALSE;
 
-	nih_alloc_set_destructor (job, job_destroy);
+		job->stop_on = NULL;
+		job->pid = NULL;
+		job->log = NULL;
+
+		nih_alloc_set_destructor (job, job_destroy);
+	}
 
 	job->name = nih_strdup (job, name);
 	if (! job->name)
 		goto error;
 
+	job->generation = state_touch ();
+
 	job->class = class;
 
 	if (job->class->session && job->class->session->chroot) {
@@ -187,10 +398,11 @@ job_new (JobClass   *class,
 	job->start_env = NULL;
 	job->stop_env = NULL;
 
-	job->stop_on = NULL;
+	job->event_env = NULL;
+	job->export_env = NULL;
 
-	if (class->stop_on) {
-		job->stop_on = event_operator_copy (job, class->stop_on);
+	if (class->stop_on && (! job->stop_on)) {
+		job->stop_on = event_operator_share (job, class->stop_on);
 		if (! job->stop_on)
 			goto error;
 	}
@@ -198,9 +410,11 @@ job_new (JobClass   *class,
 	job->fds = NULL;
 	job->num_fds = 0;
 
-	job->pid = nih_alloc (job, sizeof (pid_t) * PROCESS_LAST);
-	if (! job->pid)
-		goto error;
+	if (! job->pid) {
+		job->pid = nih_alloc (job, sizeof (pid_t) * PROCESS_LAST);
+		if (! job->pid)
+			goto error;
+	}
 
 	for (i = 0; i < PROCESS_LAST; i++)
 		job->pid[i] = 0;
@@ -211,9 +425,11 @@ job_new (JobClass   *class,
 	 * flushed) before the main process has a chance to have its log
 	 * drained.
 	 */
-	job->log = nih_alloc (job, sizeof (Log *) * PROCESS_LAST);
-	if (! job->log)
-		goto error;
+	if (! job->log) {
+		job->log = nih_alloc (job, sizeof (Log *) * PROCESS_LAST);
+		if (! job->log)
+			goto error;
+	}
 
 	for (i = 0; i < PROCESS_LAST; i++)
 		job->log[i] = NULL;
@@ -230,11 +446,18 @@ job_new (JobClass   *class,
 
 	job->respawn_time = 0;
 	job->respawn_count = 0;
+	job->respawn_delay = 0;
+	job->respawn_timer = NULL;
 
 	job->trace_forks = 0;
 	job->trace_state = TRACE_NONE;
 
-	nih_hash_add (class->instances, &job->entry);
+	memset (&job->timings, 0, sizeof (JobTimings));
+	job->timings.state[JOB_WAITING] = job_timing_now ();
+
+	memset (job->resources, 0, sizeof (job->resources));
+
+	hash_table_add (class->instances, &job->entry);
 
 	NIH_LIST_FOREACH (control_conns, iter) {
 		NihListEntry   *entry = (NihListEntry *)iter;
@@ -254,9 +477,11 @@ job_new (JobClass   *class,
 	 * overhead (a single pointer) for those job processes tha
 	 * cannot run in parallel with others.
 	 */
-	job->process_data = nih_alloc (job, sizeof (JobProcessData *) * PROCESS_LAST);
-	if (! job->process_data)
-		goto error;
+	if (! job->process_data) {
+		job->process_data = nih_alloc (job, sizeof (JobProcessData *) * PROCESS_LAST);
+		if (! job->process_data)
+			goto error;
+	}
 
 	for (i = 0; i < PROCESS_LAST; i++)
 		job->process_data[i] = NULL;
@@ -274,8 +499,13 @@ error:
  * @conn: connection to register for,
  * @signal: emit the InstanceAdded signal.
  *
- * Register the @job instance with the D-Bus connection @conn, using
- * the path set when the job was created.
+ * Announce the @job instance on the D-Bus connection @conn, which must
+ * have the fallback of job_register_fallback() registered for it to be
+ * reachable at the path set when the job was created.
+ *
+ * No object is registered for each instance, instances come and go far
+ * more often than classes and there'd be one for every connection; so
+ * this costs nothing unless @signal is TRUE.
  **/
 void
 job_register (Job            *job,
@@ -285,16 +515,652 @@ job_register (Job            *job,
 	nih_assert (job != NULL);
 	nih_assert (conn != NULL);
 
-	NIH_MUST (nih_dbus_object_new (job, conn, job->path,
-				       job_interfaces, job));
-
-	nih_debug ("Registered instance %s", job->path);
-
 	if (signal)
 		NIH_ZERO (job_class_emit_instance_added (conn, job->class->path,
 							 job->path));
 }
 
+/**
+ * job_register_fallback:
+ * @conn: connection to register for.
+ *
+ * Register a fallback object on @conn beneath the paths of the job
+ * classes, which resolves the instance each message is addressed to
+ * when it arrives and handles it as the instance's own object would.
+ **/
+void
+job_register_fallback (DBusConnection *conn)
+{
+	nih_assert (conn != NULL);
+
+	NIH_MUST (dbus_connection_register_fallback (conn,
+						     DBUS_PATH_UPSTART "/jobs",
+						     &job_object_vtable, NULL));
+}
+
+/**
+ * job_find_by_path:
+ * @path: D-Bus object path.
+ *
+ * Lookup the job instance whose path is @path among the instances of
+ * the registered classes.
+ *
+ * Returns: existing Job, or NULL if no instance has @path.
+ **/
+Job *
+job_find_by_path (const char *path)
+{
+	nih_assert (path != NULL);
+
+	if (! job_classes)
+		return NULL;
+
+	/* Escaped names never contain a slash, so only one class can
+	 * have a path that the instance path starts with.
+	 */
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+		size_t    len = strlen (class->path);
+
+		if (strncmp (path, class->path, len) || (path[len] != '/'))
+			continue;
+
+		NIH_HASH_FOREACH (class->instances, job_iter) {
+			Job *job = (Job *)job_iter;
+
+			if (! strcmp (job->path, path))
+				return job;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * job_object_message:
+ * @conn: connection message was received on,
+ * @message: message received,
+ * @data: not used.
+ *
+ * Called for messages addressed to paths beneath the job classes that
+ * have no object of their own; messages for an instance are dispatched
+ * to the methods and properties of its interfaces in the manner of the
+ * object that would otherwise be registered for it, while any others
+ * are left for libdbus to reject.
+ *
+ * Returns: result of handling @message.
+ **/
+static DBusHandlerResult
+job_object_message (DBusConnection *conn,
+		    DBusMessage    *message,
+		    void           *data)
+{
+	NihDBusObject  object;
+	const char    *interface;
+	const char    *member;
+	Job           *job;
+
+	nih_assert (conn != NULL);
+	nih_assert (message != NULL);
+
+	if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	job = job_find_by_path (dbus_message_get_path (message));
+	if (! job)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	/* The marshallers only look at the object for the instance, so
+	 * one on the stack serves for the duration of the call.
+	 */
+	object.path = job->path;
+	object.connection = conn;
+	object.data = job;
+	object.interfaces = job_interfaces;
+	object.registered = TRUE;
+
+	if (dbus_message_is_method_call (message, DBUS_INTERFACE_INTROSPECTABLE,
+					 "Introspect"))
+		return job_object_introspect (&object, message);
+
+	if (dbus_message_is_method_call (message, DBUS_INTERFACE_PROPERTIES,
+					 "Get"))
+		return job_object_get (&object, message);
+
+	if (dbus_message_is_method_call (message, DBUS_INTERFACE_PROPERTIES,
+					 "GetAll"))
+		return job_object_get_all (&object, message);
+
+	if (dbus_message_is_method_call (message, DBUS_INTERFACE_PROPERTIES,
+					 "Set"))
+		return job_object_set (&object, message);
+
+	interface = dbus_message_get_interface (message);
+	member = dbus_message_get_member (message);
+
+	for (const NihDBusInterface **iface = job_interfaces;
+	     iface && *iface; iface++) {
+		if (interface && strcmp (interface, (*iface)->name))
+			continue;
+
+		for (const NihDBusMethod *method = (*iface)->methods;
+		     method && method->name; method++) {
+			nih_local NihDBusMessage *msg = NULL;
+			DBusHandlerResult         result;
+
+			if (strcmp (method->name, member))
+				continue;
+
+			msg = nih_dbus_message_new (NULL, conn, message);
+			if (! msg)
+				return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+			nih_error_push_context ();
+			result = method->marshaller (&object, msg);
+			nih_error_pop_context ();
+
+			return result;
+		}
+	}
+
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/**
+ * job_object_introspect:
+ * @object: object for instance,
+ * @message: Introspect method call.
+ *
+ * Replies to @message with the introspection data of the interfaces of
+ * @object.
+ *
+ * Returns: result of handling @message.
+ **/
+static DBusHandlerResult
+job_object_introspect (NihDBusObject *object,
+		       DBusMessage   *message)
+{
+	nih_local char *xml = NULL;
+	DBusMessage    *reply;
+
+	nih_assert (object != NULL);
+	nih_assert (message != NULL);
+
+	xml = nih_sprintf (NULL, "%s<node name=\"%s\">\n",
+			   DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE,
+			   object->path);
+	if (! xml)
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+	for (const NihDBusInterface **iface = object->interfaces;
+	     iface && *iface; iface++) {
+		if (! nih_strcat_sprintf (&xml, NULL,
+					  "  <interface name=\"%s\">\n",
+					  (*iface)->name))
+			return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+		for (const NihDBusMethod *method = (*iface)->methods;
+		     method && method->name; method++) {
+			if (! nih_strcat_sprintf (&xml, NULL,
+						  "    <method name=\"%s\">\n",
+						  method->name))
+				return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+			for (const NihDBusArg *arg = method->args;
+			     arg && arg->type; arg++)
+				if (! nih_strcat_sprintf (
+					    &xml, NULL,
+					    "      <arg name=\"%s\" type=\"%s\""
+					    " direction=\"%s\"/>\n",
+					    arg->name, arg->type,
+					    (arg->dir == NIH_DBUS_ARG_IN
+					     ? "in" : "out")))
+					return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+			if (! nih_strcat (&xml, NULL, "    </method>\n"))
+				return DBUS_HANDLER_RESULT_NEED_MEMORY;
+		}
+
+		for (const NihDBusSignal *signal = (*iface)->signals;
+		     signal && signal->name; signal++) {
+			if (! nih_strcat_sprintf (&xml, NULL,
+						  "    <signal name=\"%s\">\n",
+						  signal->name))
+				return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+			for (const NihDBusArg *arg = signal->args;
+			     arg && arg->type; arg++)
+				if (! nih_strcat_sprintf (
+					    &xml, NULL,
+					    "      <arg name=\"%s\" type=\"%s\"/>\n",
+					    arg->name, arg->type))
+					return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+			if (! nih_strcat (&xml, NULL, "    </signal>\n"))
+				return DBUS_HANDLER_RESULT_NEED_MEMORY;
+		}
+
+		for (const NihDBusProperty *property = (*iface)->properties;
+		     property && property->name; property++)
+			if (! nih_strcat_sprintf (
+				    &xml, NULL,
+				    "    <property name=\"%s\" type=\"%s\""
+				    " access=\"%s\"/>\n",
+				    property->name, property->type,
+				    (property->access == NIH_DBUS_READ ? "read"
+				     : property->access == NIH_DBUS_WRITE ? "write"
+				     : "readwrite")))
+				return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+		if (! nih_strcat (&xml, NULL, "  </interface>\n"))
+			return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	if (! nih_strcat (&xml, NULL,
+			  "  <interface name=\"" DBUS_INTERFACE_INTROSPECTABLE "\">\n"
+			  "    <method name=\"Introspect\">\n"
+			  "      <arg name=\"data\" type=\"s\" direction=\"out\"/>\n"
+			  "    </method>\n"
+			  "  </interface>\n"
+			  "  <interface name=\"" DBUS_INTERFACE_PROPERTIES "\">\n"
+			  "    <method name=\"Get\">\n"
+			  "      <arg name=\"interface_name\" type=\"s\" direction=\"in\"/>\n"
+			  "      <arg name=\"property_name\" type=\"s\" direction=\"in\"/>\n"
+			  "      <arg name=\"value\" type=\"v\" direction=\"out\"/>\n"
+			  "    </method>\n"
+			  "    <method name=\"Set\">\n"
+			  "      <arg name=\"interface_name\" type=\"s\" direction=\"in\"/>\n"
+			  "      <arg name=\"property_name\" type=\"s\" direction=\"in\"/>\n"
+			  "      <arg name=\"value\" type=\"v\" direction=\"in\"/>\n"
+			  "    </method>\n"
+			  "    <method name=\"GetAll\">\n"
+			  "      <arg name=\"interface_name\" type=\"s\" direction=\"in\"/>\n"
+			  "      <arg name=\"props\" type=\"a{sv}\" direction=\"out\"/>\n"
+			  "    </method>\n"
+			  "  </interface>\n"
+			  "</node>\n"))
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+	reply = dbus_message_new_method_return (message);
+	if (! reply)
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+	if (! dbus_message_append_args (reply,
+					DBUS_TYPE_STRING, &xml,
+					DBUS_TYPE_INVALID)) {
+		dbus_message_unref (reply);
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	return job_object_send (object->connection, reply);
+}
+
+/**
+ * job_object_get:
+ * @object: object for instance,
+ * @message: Get method call.
+ *
+ * Replies to @message with the value of the property of @object named
+ * in it.
+ *
+ * Returns: result of handling @message.
+ **/
+static DBusHandlerResult
+job_object_get (NihDBusObject *object,
+		DBusMessage   *message)
+{
+	nih_local NihDBusMessage *msg = NULL;
+	const NihDBusProperty    *property;
+	const char               *interface;
+	const char               *name;
+	DBusMessage              *reply;
+	DBusMessageIter           iter;
+	int                       ret;
+
+	nih_assert (object != NULL);
+	nih_assert (message != NULL);
+
+	if (! dbus_message_get_args (message, NULL,
+				     DBUS_TYPE_STRING, &interface,
+				     DBUS_TYPE_STRING, &name,
+				     DBUS_TYPE_INVALID)) {
+		reply = dbus_message_new_error (message, DBUS_ERROR_INVALID_ARGS,
+						_("Invalid arguments to Get method"));
+		if (! reply)
+			return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+		return job_object_send (object->connection, reply);
+	}
+
+	property = job_object_property (interface, name);
+	if ((! property) || (! property->getter)) {
+		reply = dbus_message_new_error (message, DBUS_ERROR_INVALID_ARGS,
+						_("Unknown or write-only property"));
+		if (! reply)
+			return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+		return job_object_send (object->connection, reply);
+	}
+
+	msg = nih_dbus_message_new (NULL, object->connection, message);
+	if (! msg)
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+	reply = dbus_message_new_method_return (message);
+	if (! reply)
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+	dbus_message_iter_init_append (reply, &iter);
+
+	nih_error_push_context ();
+	ret = property->getter (object, msg, &iter);
+	if (ret < 0) {
+		DBusHandlerResult result;
+
+		dbus_message_unref (reply);
+
+		result = job_object_send_error (object->connection, message);
+		nih_error_pop_context ();
+
+		return result;
+	}
+	nih_error_pop_context ();
+
+	return job_object_send (object->connection, reply);
+}
+
+/**
+ * job_object_get_all:
+ * @object: object for instance,
+ * @message: GetAll method call.
+ *
+ * Replies to @message with the values of the readable properties of the
+ * interface of @object named in it, or of all interfaces when the name
+ * is empty.
+ *
+ * Returns: result of handling @message.
+ **/
+static DBusHandlerResult
+job_object_get_all (NihDBusObject *object,
+		    DBusMessage   *message)
+{
+	nih_local NihDBusMessage *msg = NULL;
+	const char               *interface;
+	DBusMessage              *reply;
+	DBusMessageIter           iter, arrayiter;
+
+	nih_assert (object != NULL);
+	nih_assert (message != NULL);
+
+	if (! dbus_message_get_args (message, NULL,
+				     DBUS_TYPE_STRING, &interface,
+				     DBUS_TYPE_INVALID)) {
+		reply = dbus_message_new_error (message, DBUS_ERROR_INVALID_ARGS,
+						_("Invalid arguments to GetAll method"));
+		if (! reply)
+			return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+		return job_object_send (object->connection, reply);
+	}
+
+	msg = nih_dbus_message_new (NULL, object->connection, message);
+	if (! msg)
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+	reply = dbus_message_new_method_return (message);
+	if (! reply)
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+	dbus_message_iter_init_append (reply, &iter);
+
+	if (! dbus_message_iter_open_container (
+		    &iter, DBUS_TYPE_ARRAY,
+		    (DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+		     DBUS_TYPE_STRING_AS_STRING
+		     DBUS_TYPE_VARIANT_AS_STRING
+		     DBUS_DICT_ENTRY_END_CHAR_AS_STRING),
+		    &arrayiter)) {
+		dbus_message_unref (reply);
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	for (const NihDBusInterface **iface = object->interfaces;
+	     iface && *iface; iface++) {
+		if (*interface && strcmp (interface, (*iface)->name))
+			continue;
+
+		for (const NihDBusProperty *property = (*iface)->properties;
+		     property && property->name; property++) {
+			DBusMessageIter dictiter;
+			int             ret;
+
+			if (! property->getter)
+				continue;
+
+			if (! dbus_message_iter_open_container (
+				    &arrayiter, DBUS_TYPE_DICT_ENTRY, NULL,
+				    &dictiter))
+				goto no_memory;
+
+			if (! dbus_message_iter_append_basic (
+				    &dictiter, DBUS_TYPE_STRING,
+				    &property->name)) {
+				dbus_message_iter_abandon_container (&arrayiter,
+								     &dictiter);
+				goto no_memory;
+			}
+
+			nih_error_push_context ();
+			ret = property->getter (object, msg, &dictiter);
+			if (ret < 0) {
+				DBusHandlerResult result;
+
+				dbus_message_iter_abandon_container (&arrayiter,
+								     &dictiter);
+				dbus_message_iter_abandon_container (&iter,
+								     &arrayiter);
+				dbus_message_unref (reply);
+
+				result = job_object_send_error (
+					object->connection, message);
+				nih_error_pop_context ();
+
+				return result;
+			}
+			nih_error_pop_context ();
+
+			if (! dbus_message_iter_close_container (&arrayiter,
+								 &dictiter))
+				goto no_memory;
+		}
+	}
+
+	if (! dbus_message_iter_close_container (&iter, &arrayiter)) {
+		dbus_message_unref (reply);
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	return job_object_send (object->connection, reply);
+
+no_memory:
+	dbus_message_iter_abandon_container (&iter, &arrayiter);
+	dbus_message_unref (reply);
+
+	return DBUS_HANDLER_RESULT_NEED_MEMORY;
+}
+
+/**
+ * job_object_set:
+ * @object: object for instance,
+ * @message: Set method call.
+ *
+ * Sets the property of @object named in @message to the value given
+ * in it, replying to @message.
+ *
+ * Returns: result of handling @message.
+ **/
+static DBusHandlerResult
+job_object_set (NihDBusObject *object,
+		DBusMessage   *message)
+{
+	nih_local NihDBusMessage *msg = NULL;
+	const NihDBusProperty    *property;
+	const char               *interface = NULL;
+	const char               *name = NULL;
+	DBusMessage              *reply;
+	DBusMessageIter           iter;
+	int                       ret;
+
+	nih_assert (object != NULL);
+	nih_assert (message != NULL);
+
+	if (dbus_message_iter_init (message, &iter)
+	    && (dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_STRING)) {
+		dbus_message_iter_get_basic (&iter, &interface);
+		dbus_message_iter_next (&iter);
+	}
+
+	if (interface
+	    && (dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_STRING)) {
+		dbus_message_iter_get_basic (&iter, &name);
+		dbus_message_iter_next (&iter);
+	}
+
+	if ((! name)
+	    || (dbus_message_iter_get_arg_type (&iter) != DBUS_TYPE_VARIANT)) {
+		reply = dbus_message_new_error (message, DBUS_ERROR_INVALID_ARGS,
+						_("Invalid arguments to Set method"));
+		if (! reply)
+			return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+		return job_object_send (object->connection, reply);
+	}
+
+	property = job_object_property (interface, name);
+	if ((! property) || (! property->setter)) {
+		reply = dbus_message_new_error (message, DBUS_ERROR_INVALID_ARGS,
+						_("Unknown or read-only property"));
+		if (! reply)
+			return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+		return job_object_send (object->connection, reply);
+	}
+
+	msg = nih_dbus_message_new (NULL, object->connection, message);
+	if (! msg)
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+	nih_error_push_context ();
+	ret = property->setter (object, msg, &iter);
+	if (ret < 0) {
+		DBusHandlerResult result;
+
+		result = job_object_send_error (object->connection, message);
+		nih_error_pop_context ();
+
+		return result;
+	}
+	nih_error_pop_context ();
+
+	reply = dbus_message_new_method_return (message);
+	if (! reply)
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+	return job_object_send (object->connection, reply);
+}
+
+/**
+ * job_object_property:
+ * @interface: name of interface, or empty for any,
+ * @name: name of property.
+ *
+ * Returns: property of the instance interfaces named @name, or NULL.
+ **/
+static const NihDBusProperty *
+job_object_property (const char *interface,
+		     const char *name)
+{
+	nih_assert (interface != NULL);
+	nih_assert (name != NULL);
+
+	for (const NihDBusInterface **iface = job_interfaces;
+	     iface && *iface; iface++) {
+		if (*interface && strcmp (interface, (*iface)->name))
+			continue;
+
+		for (const NihDBusProperty *property = (*iface)->properties;
+		     property && property->name; property++)
+			if (! strcmp (property->name, name))
+				return property;
+	}
+
+	return NULL;
+}
+
+/**
+ * job_object_send:
+ * @conn: connection to send on,
+ * @reply: reply to send.
+ *
+ * Sends @reply on @conn, dropping our reference to it.
+ *
+ * Returns: result of handling the message @reply is for.
+ **/
+static DBusHandlerResult
+job_object_send (DBusConnection *conn,
+		 DBusMessage    *reply)
+{
+	dbus_bool_t sent;
+
+	nih_assert (conn != NULL);
+	nih_assert (reply != NULL);
+
+	sent = dbus_connection_send (conn, reply, NULL);
+	dbus_message_unref (reply);
+
+	return (sent ? DBUS_HANDLER_RESULT_HANDLED
+		: DBUS_HANDLER_RESULT_NEED_MEMORY);
+}
+
+/**
+ * job_object_send_error:
+ * @conn: connection to send on,
+ * @message: message being handled.
+ *
+ * Replies to @message with the error raised by a property handler.
+ *
+ * Returns: result of handling @message.
+ **/
+static DBusHandlerResult
+job_object_send_error (DBusConnection *conn,
+		       DBusMessage    *message)
+{
+	DBusMessage *reply;
+	NihError    *err;
+
+	nih_assert (conn != NULL);
+	nih_assert (message != NULL);
+
+	err = nih_error_get ();
+	if (err->number == ENOMEM) {
+		nih_free (err);
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	} else if (err->number == NIH_DBUS_ERROR) {
+		reply = dbus_message_new_error (message,
+						((NihDBusError *)err)->name,
+						err->message);
+	} else {
+		reply = dbus_message_new_error (message, DBUS_ERROR_FAILED,
+						err->message);
+	}
+	nih_free (err);
+
+	if (! reply)
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+	return job_object_send (conn, reply);
+}
+
 
 /**
  * job_change_goal:
@@ -333,18 +1199,30 @@ job_change_goal (Job     *job,
 
 	nih_info (_("%s goal changed from %s to %s"), job_name (job),
 		  job_goal_name (job->goal), job_goal_name (goal));
+	UPSTART_PROBE (job_change_goal, job, job->class->name, job->name,
+		       job->goal, goal);
 
 	job->goal = goal;
+	state_changed ();
+	job->generation = state_generation;
+	event_history_job (job, goal);
 
 	NIH_LIST_FOREACH (control_conns, iter) {
 		NihListEntry   *entry = (NihListEntry *)iter;
 		DBusConnection *conn = (DBusConnection *)entry->data;
 
+		/* Subscribers get the change in their next batch */
+		if (subscription_find (conn))
+			continue;
+
 		NIH_ZERO (job_emit_goal_changed (
 				conn, job->path,
 				job_goal_name (job->goal)));
 	}
 
+	subscription_notify_job (job);
+	status_page_update (job);
+
 
 	/* Normally whatever process or event is associated with the state
 	 * will finish naturally, so all we need do is change the goal and
@@ -360,8 +1238,12 @@ job_change_goal (Job     *job,
 
 		break;
 	case JOB_STOP:
-		if (job->state == JOB_RUNNING)
+		if (job->state == JOB_RUNNING) {
+			job_change_state (job, job_next_state (job));
+		} else if (spawn_limit_cancel (job)) {
+			/* Waiting to be admitted is a rest state too */
 			job_change_state (job, job_next_state (job));
+		}
 
 		break;
 	case JOB_RESPAWN:
@@ -397,8 +1279,9 @@ job_change_state (Job      *job,
 	nih_assert (job != NULL);
 
 	while (job->state != state) {
-		JobState old_state;
-		int      unused;
+		JobState  old_state;
+		JobClass *class;
+		int       unused;
 
 		/* If we got blocked during async spawns, stop
 		 * transitions.
@@ -406,21 +1289,57 @@ job_change_state (Job      *job,
 		if (job->blocker)
 		    return;
 
+		/* Hold the job in the starting state until it's admitted,
+		 * so that no more than the spawn limit are spawning their
+		 * processes at once.
+		 */
+		if ((job->state == JOB_STARTING)
+		    && (state == JOB_SECURITY_SPAWNING)
+		    && (! spawn_limit_admit (job)))
+			return;
+
 		nih_info (_("%s state changed from %s to %s"), job_name (job),
 			  job_state_name (job->state), job_state_name (state));
+		UPSTART_PROBE (job_change_state, job, job->class->name,
+			       job->name, job->state, state);
+		event_trace_job (job, job->state, state);
 
 		old_state = job->state;
 		job->state = state;
+		state_changed ();
+		job->generation = state_generation;
+
+		/* Each start is traced afresh, but keep the time the
+		 * instance was created.
+		 */
+		if (state == JOB_STARTING) {
+			for (int i = JOB_STARTING; i < JOB_STATE_LAST; i++)
+				job->timings.state[i] = 0;
+
+			memset (job->timings.fork, 0, sizeof (job->timings.fork));
+			memset (job->timings.exec, 0, sizeof (job->timings.exec));
+		}
+
+		job->timings.state[state] = job_timing_now ();
+
+		if ((state == JOB_RUNNING) || (state == JOB_STOPPING))
+			spawn_limit_release (job);
 
 		NIH_LIST_FOREACH (control_conns, iter) {
 			NihListEntry   *entry = (NihListEntry *)iter;
 			DBusConnection *conn = (DBusConnection *)entry->data;
 
+			if (subscription_find (conn))
+				continue;
+
 			NIH_ZERO (job_emit_state_changed (
 					conn, job->path,
 					job_state_name (job->state)));
 		}
 
+		subscription_notify_job (job);
+		status_page_update (job);
+
 		/* Perform whatever action is necessary to enter the new
 		 * state, such as executing a process or emitting an event.
 		 */
@@ -440,6 +1359,8 @@ job_change_state (Job      *job,
 
 				job->env = job->start_env;
 				job->start_env = NULL;
+
+				job_env_changed (job);
 			}
 
 			/* Throw away the stop environment */
@@ -461,7 +1382,8 @@ job_change_state (Job      *job,
 			nih_assert (old_state == JOB_STARTING);
 
 			if (job->class->process[PROCESS_SECURITY]
-			    && apparmor_available()) {
+			    && apparmor_available()
+			    && apparmor_load_needed (job->class->process[PROCESS_SECURITY]->command)) {
 				job_process_start (job, PROCESS_SECURITY);
 			}
 			state = job_next_state (job);
@@ -470,8 +1392,8 @@ job_change_state (Job      *job,
 			nih_assert (job->goal == JOB_START);
 			nih_assert (old_state == JOB_SECURITY_SPAWNING);
 
-			if (! (job->class->process[PROCESS_SECURITY]
-			       && apparmor_available())) {
+			/* Skipped when the profile is already loaded */
+			if (job->pid[PROCESS_SECURITY] <= 0) {
 				state = job_next_state (job);
 			}
 			break;
@@ -548,6 +1470,12 @@ job_change_state (Job      *job,
 				/* Cancel the stop attempt */
 				job_finished (job, FALSE);
 			} else {
+				metrics_count (METRICS_JOBS_STARTED);
+				if (job->timings.state[JOB_STARTING])
+					metrics_record (METRICS_START_LATENCY,
+							job->timings.state[JOB_RUNNING]
+							- job->timings.state[JOB_STARTING]);
+
 				job_emit_event (job);
 
 				/* If we're not a task, our goal is to be
@@ -585,6 +1513,14 @@ job_change_state (Job      *job,
 				    || (old_state == JOB_RUNNING)
 				    || (old_state == JOB_PRE_STOP));
 
+			/* Whether respawning or stopping, any delayed
+			 * respawn is no longer needed.
+			 */
+			if (job->respawn_timer) {
+				nih_unref (job->respawn_timer, job);
+				job->respawn_timer = NULL;
+			}
+
 			job->blocker = job_emit_event (job);
 
 			break;
@@ -623,6 +1559,21 @@ job_change_state (Job      *job,
 
 			job_finished (job, FALSE);
 
+#ifdef ENABLE_CGROUPS
+			/* Remove any cgroups created directly for the job
+			 * now that its processes are gone, killing any
+			 * they left behind if asked to; the cgroup manager
+			 * removes its own by itself.
+			 */
+			if (job_needs_cgroups (job) && cgroup_unified_available ()) {
+				nih_local char **env = NULL;
+
+				env = job_cgroup_environment (NULL, job);
+				cgroup_unified_clear (&job->class->cgroups, env,
+						      job->class->kill_cgroup);
+			}
+#endif /* ENABLE_CGROUPS */
+
 			/* Remove the job from the list of instances and
 			 * then allow a better class to replace us
 			 * in the hash table if we have no other instances
@@ -653,8 +1604,14 @@ job_change_state (Job      *job,
 							  job->path));
 				}
 
-				/* Destroy the instance */
-				nih_free (job);
+				/* Destroy the instance, or keep it for the
+				 * next one.
+				 */
+				class = job->class;
+				if (! job_recycle (job))
+					nih_free (job);
+
+				job_class_release (class);
 			}
 
 			return;
@@ -887,6 +1844,8 @@ job_failed (Job         *job,
 	job->failed_process = process;
 	job->exit_status = status;
 
+	metrics_count (METRICS_JOBS_FAILED);
+
 	NIH_LIST_FOREACH (control_conns, iter) {
 		NihListEntry   *entry = (NihListEntry *)iter;
 		DBusConnection *conn = (DBusConnection *)entry->data;
@@ -923,6 +1882,7 @@ job_finished (Job *job,
 			if (failed)
 				blocked->event->failed = TRUE;
 
+			blocked_trace_add (blocked, job);
 			event_unblock (blocked->event);
 
 			break;
@@ -1058,14 +2018,40 @@ job_emit_event (Job *job)
 		nih_assert_not_reached ();
 	}
 
+	/* The job and instance name, and the variables exported from the
+	 * job environment, are the same for every event the instance
+	 * emits until that environment changes; so they're only built
+	 * for the first, and the strings referenced rather than copied
+	 * into each event.
+	 */
+	if (! job->event_env) {
+		job->event_env = NIH_MUST (nih_str_array_new (job));
+
+		NIH_MUST (environ_set (&job->event_env, job, NULL, TRUE,
+				       "JOB=%s", job->class->name));
+		NIH_MUST (environ_set (&job->event_env, job, NULL, TRUE,
+				       "INSTANCE=%s", job->name));
+	}
+
+	if (! job->export_env) {
+		job->export_env = NIH_MUST (nih_str_array_new (job));
+
+		for (e = job->class->export; e && *e; e++) {
+			char * const *str;
+
+			str = environ_lookup (job->env, *e, strlen (*e));
+			if (str)
+				NIH_MUST (environ_add (&job->export_env, job,
+						       NULL, FALSE, *str));
+		}
+	}
+
 	len = 0;
 	env = NIH_MUST (nih_str_array_new (NULL));
 
 	/* Add the job and instance name */
-	NIH_MUST (environ_set (&env, NULL, &len, TRUE,
-			       "JOB=%s", job->class->name));
-	NIH_MUST (environ_set (&env, NULL, &len, TRUE,
-			       "INSTANCE=%s", job->name));
+	NIH_MUST (environ_reference (&env, NULL, &len, TRUE,
+				     job->event_env));
 
 	/* Stop events include a "failed" argument if a process failed,
 	 * otherwise stop events have an "ok" argument.
@@ -1118,13 +2104,8 @@ job_emit_event (Job *job)
 	}
 
 	/* Add any exported variables from the job environment */
-	for (e = job->class->export; e && *e; e++) {
-		char * const *str;
-
-		str = environ_lookup (job->env, *e, strlen (*e));
-		if (str)
-			NIH_MUST (environ_add (&env, NULL, &len, FALSE, *str));
-	}
+	NIH_MUST (environ_reference (&env, NULL, &len, FALSE,
+				     job->export_env));
 
 	event = NIH_MUST (event_new (NULL, name, env));
 	event->session = job->class->session;
@@ -1139,6 +2120,25 @@ job_emit_event (Job *job)
 	return event;
 }
 
+/**
+ * job_env_changed:
+ * @job: job whose environment changed.
+ *
+ * Must be called whenever the env member of @job is changed or replaced,
+ * so that the variables exported to the events it emits are looked up
+ * again for the next of them.
+ **/
+void
+job_env_changed (Job *job)
+{
+	nih_assert (job != NULL);
+
+	if (job->export_env) {
+		nih_unref (job->export_env, job);
+		job->export_env = NULL;
+	}
+}
+
 
 /**
  * job_name:
@@ -1324,6 +2324,24 @@ job_state_from_name (const char *state)
 	}
 }
 
+/**
+ * job_timing_now:
+ *
+ * Obtain the current time for recording in a JobTimings structure.
+ *
+ * Returns: time on CLOCK_MONOTONIC in microseconds.
+ **/
+uint64_t
+job_timing_now (void)
+{
+	struct timespec now;
+
+	if (clock_gettime (CLOCK_MONOTONIC, &now) < 0)
+		return 0;
+
+	return ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
 
 /**
  * job_start:
@@ -1379,9 +2397,10 @@ job_start (Job             *job,
 
 #ifdef ENABLE_CGROUPS
 	/* Job has specified a cgroup stanza but since the cgroup
-	 * manager has not yet been contacted, the job cannot be started.
+	 * manager has not yet been contacted, and cgroups cannot be
+	 * created directly, the job cannot be started.
 	 */
-	if (job_class_cgroups (job->class) && ! cgroup_manager_available ()) {
+	if (job_class_cgroups (job->class) && ! cgroup_available ()) {
 		nih_dbus_error_raise_printf (
 			DBUS_INTERFACE_UPSTART ".Error.CGroupManagerNotAvailable",
 			_("Job cannot be started as cgroup manager not available: %s"),
@@ -1707,6 +2726,62 @@ job_get_state (Job             *job,
 	return 0;
 }
 
+/**
+ * job_get_respawn_delay:
+ * @job: job to obtain respawn delay from,
+ * @message: D-Bus connection and message received,
+ * @respawn_delay: pointer for reply.
+ *
+ * Implements the get method for the respawn_delay property of the
+ * com.ubuntu.Upstart.Instance interface.
+ *
+ * Called to obtain the milliseconds the last respawn of the given @job
+ * was delayed by, which will be stored in @respawn_delay.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+job_get_respawn_delay (Job             *job,
+		       NihDBusMessage  *message,
+		       uint64_t        *respawn_delay)
+{
+	nih_assert (job != NULL);
+	nih_assert (message != NULL);
+	nih_assert (respawn_delay != NULL);
+
+	*respawn_delay = job->respawn_delay;
+
+	return 0;
+}
+
+/**
+ * job_get_respawn_due:
+ * @job: job to obtain respawn due time from,
+ * @message: D-Bus connection and message received,
+ * @respawn_due: pointer for reply.
+ *
+ * Implements the get method for the respawn_due property of the
+ * com.ubuntu.Upstart.Instance interface.
+ *
+ * Called to obtain the time that a delayed respawn of the given @job is
+ * due, which will be stored in @respawn_due.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+job_get_respawn_due (Job             *job,
+		     NihDBusMessage  *message,
+		     uint64_t        *respawn_due)
+{
+	nih_assert (job != NULL);
+	nih_assert (message != NULL);
+	nih_assert (respawn_due != NULL);
+
+	*respawn_due = job->respawn_timer ? job->respawn_timer->due : 0;
+
+	return 0;
+}
+
 
 /**
  * job_get_processes:
@@ -1780,6 +2855,156 @@ job_get_processes (Job *                  job,
 	return 0;
 }
 
+/**
+ * job_get_timings:
+ * @job: job to obtain timings from,
+ * @message: D-Bus connection and message received,
+ * @names: pointer for array of transition names,
+ * @times: pointer for array of transition times,
+ * @times_len: pointer for length of @times.
+ *
+ * Implements the GetTimings method of the com.ubuntu.Upstart.Instance
+ * interface.
+ *
+ * Called to obtain the start-up latency trace of the given @job.  Each
+ * state entered and each process forked or exec'd since the job last
+ * entered the starting state is returned as a name in @names, either the
+ * state name or the process name prefixed by "fork:" or "exec:", with the
+ * CLOCK_MONOTONIC time in microseconds at the same index in @times.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+job_get_timings (Job             *job,
+		 NihDBusMessage  *message,
+		 char          ***names,
+		 uint64_t       **times,
+		 size_t          *times_len)
+{
+	size_t len = 0;
+
+	nih_assert (job != NULL);
+	nih_assert (message != NULL);
+	nih_assert (names != NULL);
+	nih_assert (times != NULL);
+	nih_assert (times_len != NULL);
+
+	*names = nih_str_array_new (message);
+	if (! *names)
+		nih_return_no_memory_error (-1);
+
+	*times = nih_alloc (message, sizeof (uint64_t)
+			    * (JOB_STATE_LAST + (PROCESS_LAST * 2)));
+	if (! *times)
+		goto error;
+
+	*times_len = 0;
+
+	for (int i = 0; i < JOB_STATE_LAST; i++) {
+		if (! job->timings.state[i])
+			continue;
+
+		if (! nih_str_array_add (names, message, &len,
+					 job_state_name (i)))
+			goto error;
+
+		(*times)[(*times_len)++] = job->timings.state[i];
+	}
+
+	for (int i = 0; i < PROCESS_LAST; i++) {
+		nih_local char *fork_name = NULL;
+		nih_local char *exec_name = NULL;
+
+		if (job->timings.fork[i]) {
+			fork_name = nih_sprintf (NULL, "fork:%s",
+						 process_name (i));
+			if (! fork_name)
+				goto error;
+
+			if (! nih_str_array_add (names, message, &len,
+						 fork_name))
+				goto error;
+
+			(*times)[(*times_len)++] = job->timings.fork[i];
+		}
+
+		if (job->timings.exec[i]) {
+			exec_name = nih_sprintf (NULL, "exec:%s",
+						 process_name (i));
+			if (! exec_name)
+				goto error;
+
+			if (! nih_str_array_add (names, message, &len,
+						 exec_name))
+				goto error;
+
+			(*times)[(*times_len)++] = job->timings.exec[i];
+		}
+	}
+
+	return 0;
+
+error:
+	nih_error_raise_no_memory ();
+	nih_free (*names);
+	*names = NULL;
+	return -1;
+}
+
+/**
+ * job_get_resources:
+ * @job: job to obtain resources from,
+ * @message: D-Bus connection and message received,
+ * @resources: pointer for reply array.
+ *
+ * Implements the get method for the resources property of the
+ * com.ubuntu.Upstart.Instance interface.
+ *
+ * Called to obtain the resources used by the processes of the given @job
+ * as an array of resource names and values, which will be stored in
+ * @resources; see JobResource.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+job_get_resources (Job                   *job,
+		   NihDBusMessage        *message,
+		   JobResourcesElement ***resources)
+{
+	nih_assert (job != NULL);
+	nih_assert (message != NULL);
+	nih_assert (resources != NULL);
+
+	*resources = nih_alloc (message, sizeof (JobResourcesElement *)
+				* (JOB_RESOURCE_LAST + 1));
+	if (! *resources)
+		nih_return_no_memory_error (-1);
+
+	for (int i = 0; i < JOB_RESOURCE_LAST; i++) {
+		JobResourcesElement *resource;
+
+		resource = nih_new (*resources, JobResourcesElement);
+		if (! resource)
+			goto error;
+
+		resource->item0 = nih_strdup (resource, job_resource_name (i));
+		if (! resource->item0)
+			goto error;
+
+		resource->item1 = job->resources[i];
+
+		(*resources)[i] = resource;
+	}
+
+	(*resources)[JOB_RESOURCE_LAST] = NULL;
+
+	return 0;
+
+error:
+	nih_free (*resources);
+	nih_return_no_memory_error (-1);
+}
+
 /**
  * job_serialise:
  * @job: job serialise.
@@ -1800,6 +3025,8 @@ job_serialise (const Job *job)
 	json_object      *json_pid;
 	json_object      *json_fds;
 	json_object      *json_logs;
+	json_object      *json_timings;
+	json_object      *json_resources;
 	json_object      *json_handler_data;
 
 	nih_assert (job);
@@ -1920,6 +3147,16 @@ job_serialise (const Job *job)
 	if (! state_set_json_int_var_from_obj (json, job, respawn_count))
 		goto error;
 
+	if (! state_set_json_int_var_from_obj (json, job, respawn_delay))
+		goto error;
+
+	if (job->respawn_timer) {
+		int64_t respawn_due = job->respawn_timer->due;
+
+		if (! state_set_json_int_var (json, "respawn_due", respawn_due))
+			goto error;
+	}
+
 	if (! state_set_json_int_var_from_obj (json, job, trace_forks))
 		goto error;
 
@@ -1928,6 +3165,21 @@ job_serialise (const Job *job)
 				"trace_state", job->trace_state))
 		goto error;
 
+	json_timings = job_serialise_timings (&job->timings);
+	if (! json_timings)
+		goto error;
+
+	json_object_object_add (json, "timings", json_timings);
+
+	json_resources = job_resources_serialise (job->resources);
+	if (! json_resources)
+		goto error;
+
+	json_object_object_add (json, "resources", json_resources);
+
+	if (! state_set_json_int_var_from_obj (json, job, notify_fd))
+		goto error;
+
 	json_logs = json_object_new_array ();
 
 	if (! json_logs)
@@ -2037,6 +3289,8 @@ job_deserialise (JobClass *parent, json_object *json)
 	json_object    *json_pid;
 	json_object    *json_logs;
 	json_object    *json_process_data;
+	json_object    *json_timings;
+	json_object    *json_resources;
 	json_object    *json_stop_on = NULL;
 	size_t          len;
 	int             ret;
@@ -2169,14 +3423,16 @@ job_deserialise (JobClass *parent, json_object *json)
 		 *   to give their processes the full amount of time to
 		 *   end.
 		 */
-		nih_local NihTimer *kill_timer = job_deserialise_kill_timer (json_kill_timer);
-		if (! kill_timer)
+		time_t   timeout;
+		uint64_t due;
+
+		if (job_deserialise_kill_timer (json_kill_timer,
+						&timeout, &due) < 0)
 			goto error;
 
 		nih_assert (job->kill_process);
-		job_process_set_kill_timer (job, job->kill_process,
-		                            kill_timer->timeout);
-		job_process_adj_kill_timer (job, kill_timer->due);
+		job_process_set_kill_timer (job, job->kill_process, timeout);
+		job_process_adj_kill_timer (job, due);
 	}
 
 	if (! state_get_json_int_var_to_obj (json, job, failed))
@@ -2196,6 +3452,22 @@ job_deserialise (JobClass *parent, json_object *json)
 	if (! state_get_json_int_var_to_obj (json, job, respawn_count))
 		goto error;
 
+	/* Older versions did not support respawn backoff */
+	if (json_object_object_get_ex (json, "respawn_delay", NULL)) {
+		if (! state_get_json_int_var_to_obj (json, job, respawn_delay))
+			goto error;
+	}
+
+	if (json_object_object_get_ex (json, "respawn_due", NULL)) {
+		int64_t respawn_due;
+
+		if (! state_get_json_int_var (json, "respawn_due", respawn_due))
+			goto error;
+
+		job_process_set_respawn_timer (job, 0);
+		timer_wheel_adjust (job->respawn_timer, respawn_due);
+	}
+
 	if (! json_object_object_get_ex (json, "fds", &json_fds))
 		goto error;
 
@@ -2228,6 +3500,14 @@ job_deserialise (JobClass *parent, json_object *json)
 		goto error;
 	}
 
+	/* Add the restored processes to the pid hash so that they can
+	 * still be reaped; the job is new so has no entries yet.
+	 */
+	for (int i = 0; i < PROCESS_LAST; i++) {
+		if (job->pid[i] > 0)
+			job_process_set_pid (job, i, job->pid[i]);
+	}
+
 	if (! state_get_json_int_var_to_obj (json, job, trace_forks))
 			goto error;
 
@@ -2236,6 +3516,45 @@ job_deserialise (JobClass *parent, json_object *json)
 				"trace_state", job->trace_state))
 		goto error;
 
+	/* The proc connector socket doesn't survive a re-exec, so listen
+	 * again if we're still following forks through it.
+	 */
+	if ((job->trace_state == TRACE_PASSIVE)
+	    && (job_process_proc_init () < 0)) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_warn (_("Failed to follow %s %s process (%d): %s"),
+			  job_name (job), process_name (PROCESS_MAIN),
+			  job->pid[PROCESS_MAIN], err->message);
+		nih_free (err);
+	}
+
+	/* Older versions did not record timings */
+	if (json_object_object_get_ex (json, "timings", &json_timings)) {
+		if (job_deserialise_timings (job, json_timings) < 0)
+			goto error;
+	}
+
+	/* Nor did they account resources */
+	if (json_object_object_get_ex (json, "resources", &json_resources)) {
+		if (job_resources_deserialise (json_resources,
+					       job->resources) < 0)
+			goto error;
+	}
+
+	/* Nor did they give the main process a notification socket */
+	if (json_object_object_get_ex (json, "notify_fd", NULL)) {
+		int notify_fd = -1;
+
+		if (! state_get_json_int_var (json, "notify_fd", notify_fd))
+			goto error;
+
+		if ((notify_fd >= 0)
+		    && (job_process_notify_restore (job, notify_fd) < 0))
+			goto error;
+	}
+
 	if (! json_object_object_get_ex (json, "log", &json_logs))
 		goto error;
 
@@ -2252,6 +3571,9 @@ job_deserialise (JobClass *parent, json_object *json)
 			 * deserialise it; either way, this should be non-fatal.
 			 */
 			job->log[process] = log_deserialise (job->log, json_log);
+			if (job->log[process])
+				log_set_store (job->log[process], process,
+					       job->pid[process]);
 		} else {
 			/* If we are missing one, we're probably importing from a
 			 * previous version that didn't include PROCESS_SECURITY.
@@ -2470,6 +3792,7 @@ job_trace_state_enum_to_str (TraceState state)
 	state_enum_to_str (TRACE_NEW, state);
 	state_enum_to_str (TRACE_NEW_CHILD, state);
 	state_enum_to_str (TRACE_NORMAL, state);
+	state_enum_to_str (TRACE_PASSIVE, state);
 
 	return NULL;
 }
@@ -2490,6 +3813,7 @@ job_trace_state_str_to_enum (const char *state)
 	state_str_to_enum (TRACE_NEW, state);
 	state_str_to_enum (TRACE_NEW_CHILD, state);
 	state_str_to_enum (TRACE_NORMAL, state);
+	state_str_to_enum (TRACE_PASSIVE, state);
 
 	return -1;
 }
@@ -2497,16 +3821,20 @@ job_trace_state_str_to_enum (const char *state)
 /**
  * job_serialise_kill_timer:
  *
- * @timer: NihTimer to serialise.
+ * @timer: WheelTimer to serialise.
  *
- * Serialise @timer into JSON.
+ * Serialise @timer into JSON.  The timeout and due time are recorded in
+ * seconds, as they were when kill timers were NihTimers, and the due time
+ * also in milliseconds.
  *
- * Returns: JSON-serialised NihTimer object, or NULL on error.
+ * Returns: JSON-serialised WheelTimer object, or NULL on error.
  **/
 static json_object *
-job_serialise_kill_timer (NihTimer *timer)
+job_serialise_kill_timer (WheelTimer *timer)
 {
 	json_object  *json;
+	int64_t       timeout;
+	int64_t       due;
 
 	nih_assert (timer);
 
@@ -2514,10 +3842,18 @@ job_serialise_kill_timer (NihTimer *timer)
 	if (! json)
 		return NULL;
 
-	if (! state_set_json_int_var_from_obj (json, timer, timeout))
+	timeout = timer->timeout / 1000;
+	due = (timer->due + 999) / 1000;
+
+	if (! state_set_json_int_var (json, "timeout", timeout))
+		goto error;
+
+	if (! state_set_json_int_var (json, "due", due))
 		goto error;
 
-	if (! state_set_json_int_var_from_obj (json, timer, due))
+	due = timer->due;
+
+	if (! state_set_json_int_var (json, "due_ms", due))
 		goto error;
 
 	return json;
@@ -2530,38 +3866,151 @@ error:
 /**
  * job_deserialise_kill_timer:
  *
- * @json: JSON representation of NihTimer.
+ * @json: JSON representation of WheelTimer,
+ * @timeout: set to timeout of timer in seconds,
+ * @due: set to due time of timer in milliseconds.
  *
- * Deserialise @json back into an NihTimer.
+ * Deserialise @json back into the timeout and due time of a kill timer.
  *
- * Returns: NihTimer on NULL on error.
+ * Returns: zero on success, -1 on error.
  **/
-static NihTimer *
-job_deserialise_kill_timer (json_object *json)
+static int
+job_deserialise_kill_timer (json_object *json,
+			    time_t      *timeout,
+			    uint64_t    *due)
 {
-	NihTimer *timer;
+	int64_t value;
 
 	nih_assert (json);
+	nih_assert (timeout);
+	nih_assert (due);
+
+	if (! state_get_json_int_var (json, "timeout", value))
+		return -1;
+
+	*timeout = value;
+
+	/* Older versions only recorded the due time in seconds */
+	if (json_object_object_get_ex (json, "due_ms", NULL)) {
+		if (! state_get_json_int_var (json, "due_ms", value))
+			return -1;
+
+		*due = value;
+	} else {
+		if (! state_get_json_int_var (json, "due", value))
+			return -1;
+
+		*due = (uint64_t)value * 1000;
+	}
+
+	return 0;
+}
+
+/**
+ * job_serialise_timings:
+ *
+ * @timings: JobTimings to serialise.
+ *
+ * Serialise @timings into JSON.
+ *
+ * Returns: JSON-serialised JobTimings object, or NULL on error.
+ **/
+static json_object *
+job_serialise_timings (const JobTimings *timings)
+{
+	json_object  *json;
+	json_object  *json_state;
+	json_object  *json_fork;
+	json_object  *json_exec;
+
+	nih_assert (timings);
 
-	timer = nih_new (NULL, NihTimer);
-	if (! timer)
+	json = json_object_new_object ();
+	if (! json)
 		return NULL;
 
-	memset (timer, '\0', sizeof (NihTimer));
+	json_state = state_serialise_int_array (uint64_t, timings->state,
+						JOB_STATE_LAST);
+	if (! json_state)
+		goto error;
 
-	if (! state_get_json_int_var_to_obj (json, timer, due))
-			goto error;
+	json_object_object_add (json, "state", json_state);
 
-	if (! state_get_json_int_var_to_obj (json, timer, timeout))
-			goto error;
+	json_fork = state_serialise_int_array (uint64_t, timings->fork,
+					       PROCESS_LAST);
+	if (! json_fork)
+		goto error;
+
+	json_object_object_add (json, "fork", json_fork);
+
+	json_exec = state_serialise_int_array (uint64_t, timings->exec,
+					       PROCESS_LAST);
+	if (! json_exec)
+		goto error;
+
+	json_object_object_add (json, "exec", json_exec);
 
-	return timer;
+	return json;
 
 error:
-	nih_free (timer);
+	json_object_put (json);
 	return NULL;
 }
 
+/**
+ * job_deserialise_timings:
+ *
+ * @job: job to restore timings into,
+ * @json: JSON representation of JobTimings.
+ *
+ * Deserialise @json into the timings of @job; entries beyond those
+ * known to this version are ignored and missing entries are left zero.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+static int
+job_deserialise_timings (Job *job, json_object *json)
+{
+	struct {
+		const char *name;
+		uint64_t   *array;
+		size_t      len;
+	} fields[] = {
+		{ "state", job->timings.state, JOB_STATE_LAST },
+		{ "fork",  job->timings.fork,  PROCESS_LAST },
+		{ "exec",  job->timings.exec,  PROCESS_LAST },
+	};
+
+	nih_assert (job);
+	nih_assert (json);
+
+	for (size_t i = 0; i < NIH_N_ELEMENTS (fields); i++) {
+		uint64_t     *array = NULL;
+		json_object  *json_array;
+		size_t        len = 0;
+
+		if (! json_object_object_get_ex (json, fields[i].name,
+						 &json_array))
+			return -1;
+
+		if (state_deserialise_int_array (job, json_array,
+						 uint64_t, &array, &len) < 0)
+			return -1;
+
+		memset (fields[i].array, 0,
+			sizeof (uint64_t) * fields[i].len);
+
+		if (array) {
+			memcpy (fields[i].array, array,
+				sizeof (uint64_t) * (len < fields[i].len
+						     ? len : fields[i].len));
+			nih_free (array);
+		}
+	}
+
+	return 0;
+}
+
 /**
  * job_find:
  *
@@ -2645,7 +4094,7 @@ job_child_error_handler (Job *job, ProcessType process)
 	nih_assert (process > PROCESS_INVALID);
 	nih_assert (process < PROCESS_LAST);
 
-	job->pid[process] = 0;
+	job_process_set_pid (job, process, 0);
 
 	switch (process) {
 	case PROCESS_SECURITY:
@@ -2711,5 +4160,44 @@ job_last_process (const Job *job, ProcessType process)
 
 	return last == process ? TRUE : FALSE;
 }
+
+/**
+ * job_cgroup_environment:
+ *
+ * @parent: parent object for new array,
+ * @job: job.
+ *
+ * Builds the environment that the cgroup names of @job are expanded
+ * with: that of the job with the variables identifying it, from which
+ * the cgroups of its processes can be found again once they have gone.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned array.  When all parents
+ * of the returned array are freed, the returned array will also be
+ * freed.
+ *
+ * Returns: newly allocated environment table.
+ **/
+char **
+job_cgroup_environment (const void *parent,
+			const Job  *job)
+{
+	char   **env;
+	size_t   envc = 0;
+
+	nih_assert (job);
+
+	env = NIH_MUST (nih_str_array_new (parent));
+
+	if (job->env)
+		NIH_MUST (environ_reference (&env, parent, &envc, TRUE, job->env));
+
+	NIH_MUST (environ_set (&env, parent, &envc, TRUE,
+			       "UPSTART_JOB=%s", job->class->name));
+	NIH_MUST (environ_set (&env, parent, &envc, TRUE,
+			       "UPSTART_INSTANCE=%s", job->name));
+
+	return env;
+}
 #endif /* ENABLE_CGROUPS */
 
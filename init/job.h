@@ -24,17 +24,20 @@
 
 #include <sys/types.h>
 
+#include <stdint.h>
 #include <time.h>
 
 #include <nih/macros.h>
 #include <nih/list.h>
 #include <nih/timer.h>
+#include <nih/io.h>
 
 #include <nih-dbus/dbus_message.h>
 
 #include "job_class.h"
 #include "event_operator.h"
 #include "log.h"
+#include "timer_wheel.h"
 
 #include "com.ubuntu.Upstart.Instance.h"
 
@@ -83,22 +86,47 @@ typedef enum job_state {
 	JOB_POST_STOP
 } JobState;
 
+/**
+ * JOB_STATE_LAST:
+ *
+ * Number of entries in JobState, used to size per-state arrays.
+ **/
+#define JOB_STATE_LAST (JOB_POST_STOP + 1)
+
 /**
  * TraceState:
  *
  * We trace jobs to follow forks and detect execs in order to be able to
  * supervise daemon processes.  Unfortunately due to the "unique and arcane"
- * nature of ptrace(), we need to track some state.
+ * nature of ptrace(), we need to track some state.  Jobs followed through
+ * the proc connector instead are simply TRACE_PASSIVE until done.
  **/
 typedef enum trace_state {
 	TRACE_NONE,
 	TRACE_NEW,
 	TRACE_NEW_CHILD,
-	TRACE_NORMAL
+	TRACE_NORMAL,
+	TRACE_PASSIVE
 } TraceState;
 
 typedef struct job_process_data JobProcessData;
 
+/**
+ * JobTimings:
+ * @state: time each state was last entered,
+ * @fork: time each process was last forked,
+ * @exec: time each process was last seen to exec.
+ *
+ * Start-up latency trace of a job, all times are in microseconds on
+ * CLOCK_MONOTONIC and zero if the transition has not happened since the
+ * job last entered the starting state.
+ **/
+typedef struct job_timings {
+	uint64_t state[JOB_STATE_LAST];
+	uint64_t fork[PROCESS_LAST];
+	uint64_t exec[PROCESS_LAST];
+} JobTimings;
+
 /**
  * Job:
  * @entry: list header,
@@ -110,6 +138,10 @@ typedef struct job_process_data JobProcessData;
  * @env: NULL-terminated list of environment variables,
  * @start_env: environment to use next time the job is started,
  * @stop_env: environment to add for the next pre-stop script,
+ * @event_env: JOB and INSTANCE variables of the events the instance
+ *  emits, or NULL until the first of them (see job_emit_event()),
+ * @export_env: variables of @env that the class exports to those events,
+ *  or NULL until the next of them when @env changes (see job_env_changed()),
  * @stop_on: event operator expression that can stop this job.
  * @fds: array of file descriptors associated with events in parent
  *       JobClasses @start_on condition,
@@ -124,10 +156,25 @@ typedef struct job_process_data JobProcessData;
  * @exit_status: exit status of the last failed process,
  * @respawn_time: time job was first respawned,
  * @respawn_count: number of respawns since @respawn_time,
+ * @respawn_delay: milliseconds the last respawn was delayed by before
+ *  jitter, zero if not backing off,
+ * @respawn_timer: timer to respawn the main process after a delay,
  * @trace_forks: number of forks traced,
  * @trace_state: state of trace,
  * @log: pointer to array of log objects for handling job output,
- * @process_data: transitory async job process metadata.
+ * @process_data: transitory async job process metadata,
+ * @timings: start-up latency trace,
+ * @status_slot: entry of the status page the instance is published in,
+ *  -1 if none or -2 if there was no entry free (see status_page_update()),
+ * @resources: resources used by the processes of the instance, including
+ *  those respawned, indexed by JobResource,
+ * @notify_fd: socket the main process sends readiness notifications to,
+ *  or -1 if none (see job_process_notify_open()),
+ * @notify_watch: NihIoWatch for @notify_fd,
+ * @spawn_admitted: TRUE while the instance is counted against the spawn
+ *  limit (see spawn_limit_admit()),
+ * @generation: state generation the instance last changed in (see
+ *  state_touch()).
  *
  * This structure holds the state of an active job instance being tracked
  * by the init daemon, the configuration details of the job are available
@@ -146,6 +193,8 @@ typedef struct job {
 
 	char           **start_env;
 	char           **stop_env;
+	char           **event_env;
+	char           **export_env;
 	EventOperator   *stop_on;
 
 	int             *fds;
@@ -155,7 +204,7 @@ typedef struct job {
 	Event           *blocker;
 	NihList          blocking;
 
-	NihTimer        *kill_timer;
+	WheelTimer      *kill_timer;
 	ProcessType      kill_process;
 
 	int              failed;
@@ -164,12 +213,26 @@ typedef struct job {
 
 	time_t           respawn_time;
 	int              respawn_count;
+	uint64_t         respawn_delay;
+	WheelTimer      *respawn_timer;
 
 	int              trace_forks;
 	TraceState       trace_state;
 	Log            **log;
 	JobProcessData **process_data;
 
+	JobTimings       timings;
+
+	int              status_slot;
+
+	uint64_t         resources[JOB_RESOURCE_LAST];
+
+	int              notify_fd;
+	NihIoWatch      *notify_watch;
+
+	int              spawn_admitted;
+
+	uint64_t         generation;
 } Job;
 
 /**
@@ -222,12 +285,25 @@ typedef struct job_process_data {
 		nih_free (err); \
 	 }
 
+/**
+ * JOB_RECYCLE_MAX:
+ *
+ * Number of finished instances of each class kept for reuse by job_new().
+ **/
+#define JOB_RECYCLE_MAX 16
+
 
 NIH_BEGIN_EXTERN
 
+extern int job_recycling;
+
+
 Job *       job_new             (JobClass *class, const char *name)
 	__attribute__ ((warn_unused_result));
 void        job_register        (Job *job, DBusConnection *conn, int signal);
+void        job_register_fallback (DBusConnection *conn);
+Job *       job_find_by_path    (const char *path)
+	__attribute__ ((warn_unused_result));
 
 void        job_change_goal     (Job *job, JobGoal goal);
 
@@ -238,6 +314,7 @@ void        job_failed          (Job *job, ProcessType process, int status);
 void        job_finished        (Job *job, int failed);
 
 Event      *job_emit_event      (Job *job);
+void        job_env_changed     (Job *job);
 
 const char *job_name            (Job *job);
 
@@ -249,6 +326,8 @@ const char *job_state_name      (JobState state)
 	__attribute__ ((const));
 JobState    job_state_from_name (const char *state);
 
+uint64_t    job_timing_now      (void);
+
 int         job_start           (Job *job, NihDBusMessage *message, int wait)
 	__attribute__ ((warn_unused_result));
 int         job_stop            (Job *job, NihDBusMessage *message, int wait)
@@ -267,10 +346,23 @@ int         job_get_goal        (Job *job, NihDBusMessage *message,
 int         job_get_state       (Job *job, NihDBusMessage *message,
 				 char **state)
 	__attribute__ ((warn_unused_result));
+int         job_get_respawn_delay (Job *job, NihDBusMessage *message,
+				   uint64_t *respawn_delay)
+	__attribute__ ((warn_unused_result));
+int         job_get_respawn_due (Job *job, NihDBusMessage *message,
+				 uint64_t *respawn_due)
+	__attribute__ ((warn_unused_result));
 
 int         job_get_processes   (Job *job, NihDBusMessage *message,
 				 JobProcessesElement ***processes)
 	__attribute__ ((warn_unused_result));
+int         job_get_timings     (Job *job, NihDBusMessage *message,
+				 char ***names, uint64_t **times,
+				 size_t *times_len)
+	__attribute__ ((warn_unused_result));
+int         job_get_resources   (Job *job, NihDBusMessage *message,
+				 JobResourcesElement ***resources)
+	__attribute__ ((warn_unused_result));
 
 json_object *job_serialise (const Job *job);
 Job *job_deserialise (JobClass *parent, json_object *json);
@@ -305,6 +397,9 @@ int job_needs_cgroups (const Job *job)
 int job_last_process (const Job *job, ProcessType process)
 	__attribute__ ((warn_unused_result));
 
+char **job_cgroup_environment (const void *parent, const Job *job)
+	__attribute__ ((warn_unused_result, malloc));
+
 #endif /* ENABLE_CGROUPS */
 
 NIH_END_EXTERN
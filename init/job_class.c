@@ -25,7 +25,9 @@
 
 
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sched.h>
 #include <signal.h>
 #include <sys/time.h>
 #include <sys/resource.h>
@@ -55,6 +57,8 @@
 #include "conf.h"
 #include "control.h"
 #include "parse_job.h"
+#include "start_order.h"
+#include "hash_table.h"
 
 #ifdef ENABLE_CGROUPS
 #include "cgroup.h"
@@ -73,6 +77,42 @@ extern char **environ;
 /* Prototypes for static functions */
 static void  job_class_add (JobClass *class);
 static int   job_class_remove (JobClass *class, const Session *session);
+static void  job_class_index_events (JobClass *class);
+static void  job_class_unindex_events (JobClass *class);
+static void  job_class_lazy_remove (JobClass *class);
+static int   job_class_idle (JobClass *class);
+static int   job_class_require (JobClass *class)
+	__attribute__ ((warn_unused_result));
+static char **job_class_environment_base (JobClass *class)
+	__attribute__ ((warn_unused_result));
+static int   job_class_instance_compile (JobClass *class)
+	__attribute__ ((warn_unused_result));
+static void *job_class_share_block (NihHash **table, const char *key,
+				    void *block, const void *parent);
+static void  job_class_serialise_dropped (json_object *json,
+					  json_object *json_cached);
+
+/**
+ * JobClassShared:
+ * @entry: hash list header,
+ * @key: content of @block in string form,
+ * @block: shared block.
+ *
+ * Entry for a block of immutable job definition shared between job
+ * classes by job_class_share().  The entry is a child of @block, so is
+ * removed from its table once the last class using @block drops it.
+ **/
+typedef struct job_class_shared {
+	NihList  entry;
+	char    *key;
+	void    *block;
+} JobClassShared;
+static int   job_class_deserialise_definition (JobClass *class,
+					       json_object *json)
+	__attribute__ ((warn_unused_result));
+static JobClass **job_class_sorted (const void *parent, size_t *len)
+	__attribute__ ((warn_unused_result, malloc));
+static int   job_class_index_cmp (const void *a, const void *b);
 
 /**
  * default_console:
@@ -92,6 +132,15 @@ int default_console = -1;
  **/
 NihHash *job_classes = NULL;
 
+/**
+ * job_class_events:
+ *
+ * This hash table indexes the registered job classes by the names of the
+ * events referenced in their start on and stop on conditions.  Each entry
+ * is a JobClassEventIndex structure.
+ **/
+NihHash *job_class_events = NULL;
+
 /**
  * job_environ:
  *
@@ -100,6 +149,56 @@ NihHash *job_classes = NULL;
  **/
 static char **job_environ = NULL;
 
+/**
+ * job_environ_generation:
+ *
+ * Incremented whenever job_environ changes, to invalidate the
+ * env_cache member of every job class.
+ **/
+static unsigned int job_environ_generation = 1;
+
+/**
+ * job_class_indexed:
+ *
+ * TRUE while the state_index member of every registered job class is
+ * valid, between calls to job_class_index_build() and
+ * job_class_index_clear().
+ **/
+static int job_class_indexed = FALSE;
+
+/**
+ * job_class_lazy_lru:
+ *
+ * List of idle lazily-loaded job classes whose definition is currently
+ * loaded, most recently used first; the least recently used are
+ * unloaded once there are more than JOB_CLASS_LAZY_MAX.
+ **/
+static NihList *job_class_lazy_lru = NULL;
+
+/**
+ * job_class_shared_commands:
+ *
+ * Hash table of JobClassShared for process commands and scripts, keyed
+ * by the command itself.
+ **/
+static NihHash *job_class_shared_commands = NULL;
+
+/**
+ * job_class_shared_limits:
+ *
+ * Hash table of JobClassShared for resource limits, keyed by their
+ * soft and hard values.
+ **/
+static NihHash *job_class_shared_limits = NULL;
+
+/**
+ * job_class_shared_emits:
+ *
+ * Hash table of JobClassShared for emits arrays, keyed by the event
+ * names they contain.
+ **/
+static NihHash *job_class_shared_emits = NULL;
+
 /**
  * initial_umask:
  *
@@ -110,13 +209,16 @@ mode_t initial_umask;
 /**
  * job_class_init:
  *
- * Initialise the job classes hash table.
+ * Initialise the job classes and job class events hash tables.
  **/
 void
 job_class_init (void)
 {
 	if (! job_classes)
 		job_classes = NIH_MUST (nih_hash_string_new (NULL, 0));
+
+	if (! job_class_events)
+		job_class_events = NIH_MUST (nih_hash_string_new (NULL, 0));
 }
 
 /**
@@ -137,6 +239,8 @@ job_class_environment_init (void)
 
 	if (user_mode && ! no_inherit_env)
 		NIH_MUST(environ_append (&job_environ, NULL, 0, TRUE, environ));
+
+	job_environ_generation++;
 }
 
 /**
@@ -165,6 +269,8 @@ job_class_environment_clear (void)
 		nih_free (job_environ);
 		job_environ = NULL;
 	}
+
+	job_environ_generation++;
 }
 
 /**
@@ -187,6 +293,8 @@ job_class_environment_set (const char *var, int replace)
 	if (! environ_add (&job_environ, NULL, NULL, replace, var))
 		return -1;
 
+	job_environ_generation++;
+
 	/* Update all running jobs */
 	NIH_HASH_FOREACH (job_classes, iter) {
 		JobClass *class = (JobClass *)iter;
@@ -196,6 +304,8 @@ job_class_environment_set (const char *var, int replace)
 
 			if (! environ_add (&job->env, job, NULL, replace, var))
 				return -1;
+
+			job_env_changed (job);
 		}
 	}
 
@@ -220,6 +330,8 @@ job_class_environment_unset (const char *name)
 	if (! environ_remove (&job_environ, NULL, NULL, name))
 		return -1;
 
+	job_environ_generation++;
+
 	/* Update all running jobs */
 	NIH_HASH_FOREACH (job_classes, iter) {
 		JobClass *class = (JobClass *)iter;
@@ -229,6 +341,8 @@ job_class_environment_unset (const char *name)
 
 			if ( ! environ_remove (&job->env, job, NULL, name))
 				return -1;
+
+			job_env_changed (job);
 		}
 	}
 
@@ -362,25 +476,43 @@ job_class_new (const void *parent,
 
 	class->kill_timeout = JOB_DEFAULT_KILL_TIMEOUT;
 	class->kill_signal = SIGTERM;
+	class->kill_cgroup = FALSE;
 
 	class->reload_signal = SIGHUP;
 
 	class->respawn = FALSE;
 	class->respawn_limit = JOB_DEFAULT_RESPAWN_LIMIT;
 	class->respawn_interval = JOB_DEFAULT_RESPAWN_INTERVAL;
+	class->respawn_backoff_initial = 0;
+	class->respawn_backoff_max = 0;
+	class->respawn_backoff_jitter = 0;
 
 	class->normalexit = NULL;
 	class->normalexit_len = 0;
 
 	class->console = default_console >= 0 ? default_console : CONSOLE_LOG;
+	class->console_socket = NULL;
+
+	class->log_limit_rate = 0;
+	class->log_limit_burst = 0;
+	class->log_limit_size = 0;
 
 	class->umask = (user_mode && ! no_inherit_env) ? initial_umask : JOB_DEFAULT_UMASK;
 	class->nice = JOB_NICE_INVALID;
+	class->priority = 0;
 	class->oom_score_adj = JOB_DEFAULT_OOM_SCORE_ADJ;
 
+	class->sched_policy = JOB_SCHED_INVALID;
+	class->sched_priority = 0;
+	class->ioprio_class = JOB_IOPRIO_NONE;
+	class->ioprio_level = 0;
+	class->timer_slack = 0;
+
 	for (i = 0; i < RLIMIT_NLIMITS; i++)
 		class->limits[i] = NULL;
 
+	class->placement = NULL;
+
 	class->chroot = NULL;
 	class->chdir = NULL;
 
@@ -398,6 +530,27 @@ job_class_new (const void *parent,
 
 	nih_list_init (&class->cgroups);
 
+	class->event_refs = NULL;
+	class->state_index = -1;
+
+	class->env_cache = NULL;
+	class->env_cache_generation = 0;
+
+	class->instance_template = NULL;
+	class->instance_parts = NULL;
+	class->instance_parts_len = 0;
+
+	class->lazy = FALSE;
+	class->loaded = TRUE;
+	class->lazy_entry = NULL;
+
+	memset (class->resources, 0, sizeof (class->resources));
+
+	nih_list_init (&class->recycled);
+	class->recycled_len = 0;
+
+	class->generation = state_touch ();
+
 	return class;
 
 error:
@@ -405,6 +558,410 @@ error:
 	return NULL;
 }
 
+/**
+ * job_class_unload:
+ * @class: job class with no instances.
+ *
+ * Drop the parts of the definition of @class that are only needed to run
+ * instances of it (processes, environment, limits, placement and AppArmor
+ * profile),
+ * marking it as lazy so that they are loaded again by job_class_load()
+ * before it next needs an instance.
+ **/
+void
+job_class_unload (JobClass *class)
+{
+	nih_assert (class != NULL);
+
+	NIH_HASH_FOREACH (class->instances, iter)
+		return;
+
+	job_class_lazy_remove (class);
+
+	class->lazy = TRUE;
+
+	if (! class->loaded)
+		return;
+
+	for (int i = 0; i < PROCESS_LAST; i++) {
+		if (class->process[i]) {
+			nih_unref (class->process[i], class->process);
+			class->process[i] = NULL;
+		}
+	}
+
+	if (class->env) {
+		nih_unref (class->env, class);
+		class->env = NULL;
+	}
+
+	for (int i = 0; i < RLIMIT_NLIMITS; i++) {
+		if (class->limits[i]) {
+			nih_unref (class->limits[i], class);
+			class->limits[i] = NULL;
+		}
+	}
+
+	if (class->placement) {
+		nih_unref (class->placement, class);
+		class->placement = NULL;
+	}
+
+	if (class->apparmor_switch) {
+		nih_unref (class->apparmor_switch, class);
+		class->apparmor_switch = NULL;
+	}
+
+	if (class->env_cache) {
+		nih_unref (class->env_cache, class);
+		class->env_cache = NULL;
+	}
+
+	class->loaded = FALSE;
+}
+
+/**
+ * job_class_load:
+ * @class: job class whose full definition is needed.
+ *
+ * Ensure that the full definition of @class is loaded, parsing its
+ * configuration file again if it was dropped by job_class_unload().
+ *
+ * This must be done before the environment of @class is used, as well
+ * as before it is given an instance.  Until it is, @class is tracked as
+ * the most recently used idle class so that it is unloaded again should
+ * it not be given one.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+job_class_load (JobClass *class)
+{
+	nih_assert (class != NULL);
+
+	if (! class->lazy || class->loaded)
+		return 0;
+
+	nih_debug ("Loading definition of %s", class->name);
+
+	if (conf_file_load_job (class) < 0)
+		return -1;
+
+	nih_assert (class->loaded);
+
+	job_class_release (class);
+
+	return 0;
+}
+
+/**
+ * job_class_require:
+ * @class: job class acted on by a D-Bus method.
+ *
+ * Load the full definition of @class with job_class_load() before its
+ * environment is used to find or create an instance, converting any
+ * error to a D-Bus error for the method caller.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+job_class_require (JobClass *class)
+{
+	NihError *error;
+
+	nih_assert (class != NULL);
+
+	if (job_class_load (class) == 0)
+		return 0;
+
+	error = nih_error_get ();
+	if (error->number != ENOMEM) {
+		error = nih_error_steal ();
+		nih_dbus_error_raise_printf (DBUS_ERROR_FAILED, "%s: %s: %s",
+					     class->name,
+					     _("Unable to load job definition"),
+					     error->message);
+		nih_free (error);
+	}
+
+	return -1;
+}
+
+/**
+ * job_class_load_from:
+ * @class: job class to complete,
+ * @from: job class freshly parsed from the same configuration.
+ *
+ * Move the parts of the definition that job_class_unload() drops from
+ * @from to @class; @from should be freed afterwards.
+ **/
+void
+job_class_load_from (JobClass *class,
+		     JobClass *from)
+{
+	nih_assert (class != NULL);
+	nih_assert (from != NULL);
+	nih_assert (! class->loaded);
+
+	for (int i = 0; i < PROCESS_LAST; i++) {
+		if (from->process[i]) {
+			class->process[i] = from->process[i];
+			nih_ref (class->process[i], class->process);
+			nih_unref (from->process[i], from->process);
+			from->process[i] = NULL;
+		}
+	}
+
+	if (from->env) {
+		class->env = from->env;
+		nih_ref (class->env, class);
+		nih_unref (from->env, from);
+		from->env = NULL;
+	}
+
+	for (int i = 0; i < RLIMIT_NLIMITS; i++) {
+		if (from->limits[i]) {
+			class->limits[i] = from->limits[i];
+			nih_ref (class->limits[i], class);
+			nih_unref (from->limits[i], from);
+			from->limits[i] = NULL;
+		}
+	}
+
+	if (from->placement) {
+		class->placement = from->placement;
+		nih_ref (class->placement, class);
+		nih_unref (from->placement, from);
+		from->placement = NULL;
+	}
+
+	if (from->apparmor_switch) {
+		class->apparmor_switch = from->apparmor_switch;
+		nih_ref (class->apparmor_switch, class);
+		nih_unref (from->apparmor_switch, from);
+		from->apparmor_switch = NULL;
+	}
+
+	class->loaded = TRUE;
+}
+
+/**
+ * job_class_release:
+ * @class: job class whose last instance may have finished.
+ *
+ * If @class is lazy and now has no instances, make it the most recently
+ * used idle class, unloading the least recently used ones beyond
+ * JOB_CLASS_LAZY_MAX.
+ **/
+void
+job_class_release (JobClass *class)
+{
+	size_t count = 0;
+
+	nih_assert (class != NULL);
+
+	if (! class->lazy || ! class->loaded)
+		return;
+
+	NIH_HASH_FOREACH (class->instances, iter)
+		return;
+
+	if (! job_class_lazy_lru)
+		job_class_lazy_lru = NIH_MUST (nih_list_new (NULL));
+
+	job_class_lazy_remove (class);
+
+	/* Not being able to track the class only means that it stays
+	 * loaded.
+	 */
+	class->lazy_entry = nih_list_entry_new (class);
+	if (! class->lazy_entry)
+		return;
+
+	class->lazy_entry->data = class;
+	nih_list_add_after (job_class_lazy_lru, &class->lazy_entry->entry);
+
+	NIH_LIST_FOREACH_SAFE (job_class_lazy_lru, iter) {
+		NihListEntry *entry = (NihListEntry *)iter;
+		JobClass     *idle = (JobClass *)entry->data;
+
+		/* Loaded for an instance since it was tracked, it's tracked
+		 * again once that finishes.
+		 */
+		if (! job_class_idle (idle)) {
+			job_class_lazy_remove (idle);
+			continue;
+		}
+
+		if (++count <= JOB_CLASS_LAZY_MAX)
+			continue;
+
+		nih_debug ("Unloading definition of %s", idle->name);
+		job_class_unload (idle);
+	}
+}
+
+/**
+ * job_class_lazy_remove:
+ * @class: job class.
+ *
+ * Remove @class from job_class_lazy_lru if it is there.
+ **/
+static void
+job_class_lazy_remove (JobClass *class)
+{
+	nih_assert (class != NULL);
+
+	if (! class->lazy_entry)
+		return;
+
+	nih_unref (class->lazy_entry, class);
+	class->lazy_entry = NULL;
+}
+
+/**
+ * job_class_idle:
+ * @class: job class.
+ *
+ * Returns: TRUE if @class has no instances, FALSE otherwise.
+ **/
+static int
+job_class_idle (JobClass *class)
+{
+	nih_assert (class != NULL);
+
+	NIH_HASH_FOREACH (class->instances, iter)
+		return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * job_class_share:
+ * @class: fully loaded job class.
+ *
+ * Replace the immutable parts of the definition of @class (process
+ * commands, resource limits and the emits array) with references to
+ * identical ones used by other job classes, if there are any, so that
+ * many sessions loading the same job configuration only hold a single
+ * copy of each.
+ *
+ * Shared blocks have one parent per class using them, so are freed
+ * along with the last such class; nothing may modify them in place,
+ * which is why this must only be called once @class has been completely
+ * parsed, including any override file.
+ **/
+void
+job_class_share (JobClass *class)
+{
+	nih_assert (class != NULL);
+
+	for (int i = 0; i < PROCESS_LAST; i++) {
+		Process *process = class->process[i];
+
+		if (! process || ! process->command)
+			continue;
+
+		process->command = job_class_share_block (
+			&job_class_shared_commands, process->command,
+			process->command, process);
+	}
+
+	for (int i = 0; i < RLIMIT_NLIMITS; i++) {
+		nih_local char *key = NULL;
+
+		if (! class->limits[i])
+			continue;
+
+		key = nih_sprintf (NULL, "%d:%llu:%llu", i,
+				   (unsigned long long)class->limits[i]->rlim_cur,
+				   (unsigned long long)class->limits[i]->rlim_max);
+		if (! key)
+			continue;
+
+		class->limits[i] = job_class_share_block (
+			&job_class_shared_limits, key,
+			class->limits[i], class);
+	}
+
+	if (class->emits && *class->emits) {
+		nih_local char *key = NULL;
+
+		key = nih_str_join (NULL, (const char **)class->emits, " ");
+		if (key)
+			class->emits = job_class_share_block (
+				&job_class_shared_emits, key,
+				class->emits, class);
+	}
+}
+
+/**
+ * job_class_share_block:
+ * @table: hash table of shared blocks,
+ * @key: content of @block in string form,
+ * @block: block to share,
+ * @parent: parent of @block.
+ *
+ * Look up a block with the same content as @block in @table, adding
+ * @block if there is none.  If there is one, it is given @parent as an
+ * additional parent and @block is unreferenced from @parent.  @key may
+ * be @block itself, in which case it is not copied.
+ *
+ * Returns: the shared block, which should be used in place of @block.
+ **/
+static void *
+job_class_share_block (NihHash    **table,
+		       const char  *key,
+		       void        *block,
+		       const void  *parent)
+{
+	JobClassShared *shared;
+
+	nih_assert (table != NULL);
+	nih_assert (key != NULL);
+	nih_assert (block != NULL);
+	nih_assert (parent != NULL);
+
+	if (! *table) {
+		*table = nih_hash_string_new (NULL, 0);
+		if (! *table)
+			return block;
+	}
+
+	shared = (JobClassShared *)nih_hash_lookup (*table, key);
+	if (shared) {
+		if (shared->block != block) {
+			nih_ref (shared->block, parent);
+			nih_unref (block, parent);
+		}
+
+		return shared->block;
+	}
+
+	shared = nih_new (block, JobClassShared);
+	if (! shared)
+		return block;
+
+	nih_list_init (&shared->entry);
+	nih_alloc_set_destructor (shared, nih_list_destroy);
+
+	shared->block = block;
+
+	if (key == block) {
+		shared->key = block;
+	} else {
+		shared->key = nih_strdup (shared, key);
+		if (! shared->key) {
+			nih_free (shared);
+			return block;
+		}
+	}
+
+	nih_hash_add (*table, &shared->entry);
+
+	return block;
+}
+
 /**
  * job_class_get_registered:
  *
@@ -471,6 +1028,10 @@ job_class_consider (JobClass *class)
 					event_operator_reset (best->start_on);
 				return FALSE;
 			}
+
+			/* Keep accounting across the change of definition */
+			memcpy (best->resources, registered->resources,
+				sizeof (best->resources));
 		}
 
 		job_class_add (best);
@@ -511,6 +1072,10 @@ job_class_reconsider (JobClass *class)
 			if (! job_class_remove (class, class->session))
 				return FALSE;
 
+			if (best)
+				memcpy (best->resources, class->resources,
+					sizeof (best->resources));
+
 			job_class_add (best);
 
 			return TRUE;
@@ -611,7 +1176,8 @@ job_class_add (JobClass *class)
 	if (! class)
 		return;
 
-	nih_hash_add (job_classes, &class->entry);
+	hash_table_add (job_classes, &class->entry);
+	job_class_index_events (class);
 
 	NIH_LIST_FOREACH (control_conns, iter) {
 		NihListEntry   *entry = (NihListEntry *)iter;
@@ -619,6 +1185,8 @@ job_class_add (JobClass *class)
 
 		job_class_register (class, conn, TRUE);
 	}
+
+	control_notify_job_added (class);
 }
 
 /**
@@ -673,6 +1241,7 @@ job_class_remove (JobClass *class, const Session *session)
 		return FALSE;
 
 	nih_list_remove (&class->entry);
+	job_class_unindex_events (class);
 
 	NIH_LIST_FOREACH (control_conns, iter) {
 		NihListEntry   *entry = (NihListEntry *)iter;
@@ -681,37 +1250,166 @@ job_class_remove (JobClass *class, const Session *session)
 		job_class_unregister (class, conn);
 	}
 
+	control_notify_job_removed (class);
+
 	return TRUE;
 }
 
 /**
- * job_class_register:
- * @class: class to register,
- * @conn: connection to register for
- * @signal: emit the JobAdded signal.
+ * job_class_index_events:
+ * @class: class to index.
  *
- * Register the job @class with the D-Bus connection @conn, using the
- * path set when the class was created.  Since multiple classes with the
- * same name may exist, this should only ever be called with the current
- * class of that name, and job_class_unregister() should be used before
- * registering a new one with the same name.
+ * Adds @class to the job_class_events hash table under the name of
+ * each event referenced by its start on and stop on conditions.  Since
+ * the stop on condition of each instance is a copy of that of its class,
+ * this also covers the events that may stop any instance of @class.
+ *
+ * The entries are allocated with @class->event_refs as their parent, so
+ * they are removed from the index automatically should @class be freed.
  **/
-void
-job_class_register (JobClass       *class,
-		    DBusConnection *conn,
-		    int             signal)
+static void
+job_class_index_events (JobClass *class)
 {
+	EventOperator *roots[2];
+
 	nih_assert (class != NULL);
-	nih_assert (conn != NULL);
 
-	NIH_MUST (nih_dbus_object_new (class, conn, class->path,
-				       job_class_interfaces, class));
+	job_class_init ();
 
-	nih_debug ("Registered job %s", class->path);
+	if (class->event_refs)
+		return;
 
-	if (signal)
-		NIH_ZERO (control_emit_job_added (conn, DBUS_PATH_UPSTART,
-						  class->path));
+	class->event_refs = NIH_MUST (nih_alloc (class, 0));
+
+	start_order_invalidate ();
+
+	roots[0] = class->start_on;
+	roots[1] = class->stop_on;
+
+	for (int i = 0; i < 2; i++) {
+		if (! roots[i])
+			continue;
+
+		NIH_TREE_FOREACH_POST (&roots[i]->node, iter) {
+			EventOperator      *oper = (EventOperator *)iter;
+			JobClassEventIndex *index;
+			NihListEntry       *entry;
+
+			if (oper->type != EVENT_MATCH)
+				continue;
+
+			index = (JobClassEventIndex *)nih_hash_lookup (
+				job_class_events, oper->name);
+			if (! index) {
+				index = NIH_MUST (nih_new (job_class_events,
+							   JobClassEventIndex));
+
+				nih_list_init (&index->entry);
+				nih_alloc_set_destructor (index, nih_list_destroy);
+
+				index->name = NIH_MUST (nih_strdup (index,
+								    oper->name));
+				nih_list_init (&index->classes);
+
+				nih_hash_add (job_class_events, &index->entry);
+			}
+
+			/* Entries for this class are always appended
+			 * together, so a repeated reference to the same
+			 * event will find us at the tail.
+			 */
+			if ((! NIH_LIST_EMPTY (&index->classes))
+			    && (((NihListEntry *)index->classes.prev)->data
+				== class))
+				continue;
+
+			entry = NIH_MUST (nih_list_entry_new (class->event_refs));
+			entry->data = class;
+
+			nih_list_add (&index->classes, &entry->entry);
+		}
+	}
+}
+
+/**
+ * job_class_unindex_events:
+ * @class: class to remove from the index.
+ *
+ * Removes @class from the job_class_events hash table, discarding any
+ * index entries that no longer refer to any class.  @class need not have
+ * been indexed.
+ *
+ * Index entries are discarded with nih_unref() so that a caller which is
+ * iterating an entry may hold its own reference to it.
+ **/
+static void
+job_class_unindex_events (JobClass *class)
+{
+	EventOperator *roots[2];
+
+	nih_assert (class != NULL);
+
+	if (! class->event_refs)
+		return;
+
+	nih_free (class->event_refs);
+	class->event_refs = NULL;
+
+	start_order_invalidate ();
+
+	roots[0] = class->start_on;
+	roots[1] = class->stop_on;
+
+	for (int i = 0; i < 2; i++) {
+		if (! roots[i])
+			continue;
+
+		NIH_TREE_FOREACH_POST (&roots[i]->node, iter) {
+			EventOperator      *oper = (EventOperator *)iter;
+			JobClassEventIndex *index;
+
+			if (oper->type != EVENT_MATCH)
+				continue;
+
+			index = (JobClassEventIndex *)nih_hash_lookup (
+				job_class_events, oper->name);
+			if (! index || ! NIH_LIST_EMPTY (&index->classes))
+				continue;
+
+			nih_list_remove (&index->entry);
+			nih_unref (index, job_class_events);
+		}
+	}
+}
+
+/**
+ * job_class_register:
+ * @class: class to register,
+ * @conn: connection to register for
+ * @signal: emit the JobAdded signal.
+ *
+ * Register the job @class with the D-Bus connection @conn, using the
+ * path set when the class was created.  Since multiple classes with the
+ * same name may exist, this should only ever be called with the current
+ * class of that name, and job_class_unregister() should be used before
+ * registering a new one with the same name.
+ **/
+void
+job_class_register (JobClass       *class,
+		    DBusConnection *conn,
+		    int             signal)
+{
+	nih_assert (class != NULL);
+	nih_assert (conn != NULL);
+
+	NIH_MUST (nih_dbus_object_new (class, conn, class->path,
+				       job_class_interfaces, class));
+
+	nih_debug ("Registered job %s", class->path);
+
+	if (signal)
+		NIH_ZERO (control_emit_job_added (conn, DBUS_PATH_UPSTART,
+						  class->path));
 
 	NIH_HASH_FOREACH (class->instances, iter) {
 		Job *job = (Job *)iter;
@@ -765,38 +1463,91 @@ job_class_unregister (JobClass       *class,
  * of the returned array are freed, the returned array will also be
  * freed.
  *
+ * Merging the tables requires a search for each variable, so the result
+ * is cached in @class until the job environment next changes; the
+ * environment in @class must not be modified once this has been called.
+ * The strings of the returned table are shared with that cache, so must
+ * only be replaced or removed, never modified in place.
+ *
  * Returns: new environment table or NULL if insufficient memory.
  **/
 char **
 job_class_environment (const void *parent,
 		       JobClass   *class,
 		       size_t     *len)
+{
+	char   **env;
+	char   **copy;
+	size_t   _len = 0;
+
+	nih_assert (class != NULL);
+
+	env = job_class_environment_base (class);
+	if (! env)
+		return NULL;
+
+	copy = nih_str_array_new (parent);
+	if (! copy)
+		return NULL;
+
+	for (char **e = env; *e; e++) {
+		if (! nih_str_array_addp (&copy, parent, &_len, *e)) {
+			nih_free (copy);
+			return NULL;
+		}
+	}
+
+	if (len)
+		*len = _len;
+
+	return copy;
+}
+
+/**
+ * job_class_environment_base:
+ * @class: job class.
+ *
+ * Returns: the cached environment table of @class, built first if it
+ * isn't up to date, or NULL if insufficient memory.
+ **/
+static char **
+job_class_environment_base (JobClass *class)
 {
 	char  **env;
 
 	nih_assert (class != NULL);
 	nih_assert (job_environ);
 
-	env = nih_str_array_new (parent);
+	if (class->env_cache
+	    && class->env_cache_generation == job_environ_generation)
+		return class->env_cache;
+
+	if (class->env_cache) {
+		nih_free (class->env_cache);
+		class->env_cache = NULL;
+	}
+
+	env = nih_str_array_new (class);
 	if (! env)
 		return NULL;
-	if (len)
-		*len = 0;
 
 	/* Copy the set of environment variables, usually these just
 	 * pick up the values from init's own environment.
 	 */
-	if (! environ_append (&env, parent, len, TRUE, job_environ))
+	if (! environ_reference (&env, class, NULL, TRUE, job_environ))
 		goto error;
 
 	/* Copy the set of environment variables from the job configuration,
 	 * these often have values but also often don't and we want them to
 	 * override the builtins.
 	 */
-	if (! environ_append (&env, parent, len, TRUE, class->env))
+	if (! environ_reference (&env, class, NULL, TRUE, class->env))
 		goto error;
 
-	return env;
+	class->env_cache = env;
+	class->env_cache_generation = job_environ_generation;
+
+	return class->env_cache;
 
 error:
 	nih_free (env);
@@ -804,6 +1555,229 @@ error:
 }
 
 
+/**
+ * job_class_instance_compile:
+ * @class: job class.
+ *
+ * Splits the instance name template of @class into literal text and the
+ * names of the variables it references, so that job_class_instance_name()
+ * need only look those up rather than expand the template against the
+ * whole environment.  Only plain $KEY and ${KEY} references are handled
+ * this way; templates using any other form of expansion are left to be
+ * expanded in full.
+ *
+ * Returns: zero on success, negative value on insufficient memory.
+ **/
+static int
+job_class_instance_compile (JobClass *class)
+{
+	char            *template;
+	JobInstancePart *parts;
+	size_t           len = 0;
+	char            *lit, *ptr;
+
+	nih_assert (class != NULL);
+	nih_assert (class->instance != NULL);
+
+	template = nih_strdup (class, class->instance);
+	if (! template)
+		return -1;
+
+	/* Each reference gives at most one literal and one variable */
+	parts = nih_alloc (template, sizeof (JobInstancePart)
+			   * (strlen (template) + 1));
+	if (! parts) {
+		nih_free (template);
+		return -1;
+	}
+
+#define ADD_PART(_text, _len, _var)			  \
+	do {						  \
+		if ((_len) || (_var)) {			  \
+			parts[len].text = (_text);	  \
+			parts[len].len = (_len);	  \
+			parts[len].var = (_var);	  \
+			len++;				  \
+		}					  \
+	} while (0)
+#define IS_NAME_START(_c) \
+	(((_c) == '_') || (((_c) >= 'A') && ((_c) <= 'Z')) \
+	 || (((_c) >= 'a') && ((_c) <= 'z')))
+#define IS_NAME(_c) \
+	(IS_NAME_START (_c) || (((_c) >= '0') && ((_c) <= '9')))
+
+	lit = ptr = template;
+	while (*ptr) {
+		char *name, *end;
+
+		if (*ptr != '$') {
+			ptr++;
+			continue;
+		}
+
+		if (IS_NAME_START (ptr[1])) {
+			name = end = ptr + 1;
+			while (IS_NAME (*end))
+				end++;
+
+			ADD_PART (lit, ptr - lit, FALSE);
+			ADD_PART (name, end - name, TRUE);
+			lit = ptr = end;
+
+		} else if ((ptr[1] == '{') && (ptr[2] == '}')) {
+			/* ${} is always a literal dollar sign */
+			ADD_PART (lit, ptr - lit, FALSE);
+			ADD_PART (ptr, 1, FALSE);
+			lit = ptr = ptr + 3;
+
+		} else if ((ptr[1] == '{') && IS_NAME_START (ptr[2])) {
+			name = end = ptr + 2;
+			while (IS_NAME (*end))
+				end++;
+
+			if (*end != '}')
+				goto expand;
+
+			ADD_PART (lit, ptr - lit, FALSE);
+			ADD_PART (name, end - name, TRUE);
+			lit = ptr = end + 1;
+
+		} else if (ptr[1] == '{') {
+			goto expand;
+
+		} else {
+			/* Lone dollar sign */
+			ptr++;
+		}
+	}
+
+	ADD_PART (lit, ptr - lit, FALSE);
+
+#undef IS_NAME
+#undef IS_NAME_START
+#undef ADD_PART
+
+	if (class->instance_template)
+		nih_unref (class->instance_template, class);
+
+	class->instance_template = template;
+	class->instance_parts = parts;
+	class->instance_parts_len = len;
+
+	return 0;
+
+expand:
+	nih_free (parts);
+
+	if (class->instance_template)
+		nih_unref (class->instance_template, class);
+
+	class->instance_template = template;
+	class->instance_parts = NULL;
+	class->instance_parts_len = 0;
+
+	return 0;
+}
+
+/**
+ * job_class_instance_name:
+ * @parent: parent object for new string,
+ * @class: job class,
+ * @env: NULL-terminated array of environment variables.
+ *
+ * Expands the instance name template of @class against its environment
+ * overridden by @env, as is done to find or name the instance that
+ * Start, Stop, Restart and GetInstance act on.
+ *
+ * Templates are compiled once, and then only the variables they reference
+ * are looked up; those using more than plain references, or referencing
+ * variables that aren't set, are expanded in full with environ_expand()
+ * so that any error raised is the same.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned string.  When all parents
+ * of the returned string are freed, the returned string will also be
+ * freed.
+ *
+ * Returns: newly allocated string or NULL on raised error.
+ **/
+char *
+job_class_instance_name (const void   *parent,
+			 JobClass     *class,
+			 char * const *env)
+{
+	nih_local char **full_env = NULL;
+	char           **base;
+	char            *name;
+	size_t           len;
+
+	nih_assert (class != NULL);
+	nih_assert (class->instance != NULL);
+
+	if ((! class->instance_template)
+	    || strcmp (class->instance_template, class->instance)) {
+		if (job_class_instance_compile (class) < 0)
+			nih_return_no_memory_error (NULL);
+	}
+
+	if (! class->instance_parts)
+		goto expand;
+
+	base = job_class_environment_base (class);
+	if (! base)
+		nih_return_no_memory_error (NULL);
+
+	name = nih_strdup (parent, "");
+	if (! name)
+		nih_return_no_memory_error (NULL);
+
+	for (size_t i = 0; i < class->instance_parts_len; i++) {
+		JobInstancePart *part = &class->instance_parts[i];
+		const char      *text = part->text;
+		size_t           text_len = part->len;
+
+		if (part->var) {
+			/* The last setting in @env wins, as it would once
+			 * appended to the class environment.
+			 */
+			text = NULL;
+			for (char * const *e = env; e && *e; e++) {
+				if ((! strncmp (*e, part->text, part->len))
+				    && ((*e)[part->len] == '='))
+					text = *e + part->len + 1;
+			}
+
+			if (! text)
+				text = environ_getn (base, part->text,
+						     part->len);
+			if (! text) {
+				nih_free (name);
+				goto expand;
+			}
+
+			text_len = strlen (text);
+		}
+
+		if (! nih_strncat (&name, parent, text, text_len)) {
+			nih_free (name);
+			nih_return_no_memory_error (NULL);
+		}
+	}
+
+	return name;
+
+expand:
+	full_env = job_class_environment (NULL, class, &len);
+	if (! full_env)
+		nih_return_no_memory_error (NULL);
+
+	if (env && ! environ_append (&full_env, NULL, &len, TRUE, env))
+		nih_return_no_memory_error (NULL);
+
+	return environ_expand (parent, class->instance, full_env);
+}
+
+
 /**
  * job_class_get_instance:
  * @class: job class to be query,
@@ -829,9 +1803,7 @@ job_class_get_instance (JobClass        *class,
 			char           **instance)
 {
 	Job             *job;
-	nih_local char **instance_env = NULL;
 	nih_local char  *name = NULL;
-	size_t           len;
 
 	nih_assert (class != NULL);
 	nih_assert (message != NULL);
@@ -844,20 +1816,13 @@ job_class_get_instance (JobClass        *class,
 		return -1;
 	}
 
-	/* Construct the full environment for the instance based on the class
-	 * and that provided.
-	 */
-	instance_env = job_class_environment (NULL, class, &len);
-	if (! instance_env)
-		nih_return_system_error (-1);
-
-	if (! environ_append (&instance_env, NULL, &len, TRUE, env))
-		nih_return_system_error (-1);
+	if (job_class_require (class) < 0)
+		return -1;
 
-	/* Use the environment to expand the instance name and look it up
-	 * in the job.
+	/* Use the class environment, overridden by that provided, to
+	 * expand the instance name and look it up in the job.
 	 */
-	name = environ_expand (NULL, class->instance, instance_env);
+	name = job_class_instance_name (NULL, class, env);
 	if (! name) {
 		NihError *error;
 		nih_local char *error_message = NULL;
@@ -1049,9 +2014,10 @@ job_class_start (JobClass        *class,
 
 #ifdef ENABLE_CGROUPS
 	/* Job has specified a cgroup stanza but since the cgroup
-	 * manager has not yet been contacted, the job cannot be started.
+	 * manager has not yet been contacted, and cgroups cannot be
+	 * created directly, the job cannot be started.
 	 */
-	if (job_class_cgroups (class) && ! cgroup_manager_available ()) {
+	if (job_class_cgroups (class) && ! cgroup_available ()) {
 		nih_dbus_error_raise_printf (
 			DBUS_INTERFACE_UPSTART ".Error.CGroupManagerNotAvailable",
 			_("Job cannot be started as cgroup manager not available: %s"),
@@ -1067,6 +2033,10 @@ job_class_start (JobClass        *class,
 		return -1;
 	}
 
+	/* The environment of the class is only known once loaded */
+	if (job_class_require (class) < 0)
+		return -1;
+
 	/* Construct the full environment for the instance based on the class
 	 * and that provided.
 	 */
@@ -1074,13 +2044,13 @@ job_class_start (JobClass        *class,
 	if (! start_env)
 		nih_return_system_error (-1);
 
-	if (! environ_append (&start_env, NULL, &len, TRUE, env))
+	if (! environ_reference (&start_env, NULL, &len, TRUE, env))
 		nih_return_system_error (-1);
 
 	/* Use the environment to expand the instance name and look it up
 	 * in the job.
 	 */
-	name = environ_expand (NULL, class->instance, start_env);
+	name = job_class_instance_name (NULL, class, start_env);
 	if (! name) {
 		NihError *error;
 		nih_local char *error_message = NULL;
@@ -1207,6 +2177,10 @@ job_class_stop (JobClass       *class,
 		return -1;
 	}
 
+	/* The environment of the class is only known once loaded */
+	if (job_class_require (class) < 0)
+		return -1;
+
 	/* Construct the full environment for the instance based on the class
 	 * and that provided; while we don't pass this to the instance itself,
 	 * we need this to look up the instance in the first place.
@@ -1215,13 +2189,13 @@ job_class_stop (JobClass       *class,
 	if (! stop_env)
 		nih_return_system_error (-1);
 
-	if (! environ_append (&stop_env, NULL, &len, TRUE, env))
+	if (! environ_reference (&stop_env, NULL, &len, TRUE, env))
 		nih_return_system_error (-1);
 
 	/* Use the environment to expand the instance name and look it up
 	 * in the job.
 	 */
-	name = environ_expand (NULL, class->instance, stop_env);
+	name = job_class_instance_name (NULL, class, stop_env);
 	if (! name) {
 		NihError *error;
 
@@ -1343,6 +2317,10 @@ job_class_restart (JobClass        *class,
 		return -1;
 	}
 
+	/* The environment of the class is only known once loaded */
+	if (job_class_require (class) < 0)
+		return -1;
+
 	/* Construct the full environment for the instance based on the class
 	 * and that provided.
 	 */
@@ -1350,13 +2328,13 @@ job_class_restart (JobClass        *class,
 	if (! restart_env)
 		nih_return_system_error (-1);
 
-	if (! environ_append (&restart_env, NULL, &len, TRUE, env))
+	if (! environ_reference (&restart_env, NULL, &len, TRUE, env))
 		nih_return_system_error (-1);
 
 	/* Use the environment to expand the instance name and look it up
 	 * in the job.
 	 */
-	name = environ_expand (NULL, class->instance, restart_env);
+	name = job_class_instance_name (NULL, class, restart_env);
 	if (! name) {
 		NihError *error;
 
@@ -1588,6 +2566,88 @@ job_class_get_version (JobClass        *class,
 }
 
 
+/**
+ * job_class_condition_array:
+ * @parent: parent object for new array,
+ * @condition: event tree to flatten.
+ *
+ * Flatten the event tree @condition into reverse polish form, as
+ * returned by the start_on and stop_on properties of the
+ * com.ubuntu.Upstart.Job interface.
+ *
+ * Each array element is an array of strings representing the events,
+ * or a single element containing "/OR" or "/AND" to represent the
+ * operators.  @condition may be NULL, in which case the array is empty.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned array.  When all parents
+ * of the returned array are freed, the returned array will also be
+ * freed.
+ *
+ * Returns: newly allocated array or NULL if insufficient memory.
+ **/
+char ***
+job_class_condition_array (const void    *parent,
+			   EventOperator *condition)
+{
+	char   ***array;
+	size_t    len = 0;
+
+	array = nih_alloc (parent, sizeof (char **));
+	if (! array)
+		return NULL;
+
+	array[len] = NULL;
+
+	if (! condition)
+		return array;
+
+	NIH_TREE_FOREACH_POST (&condition->node, iter) {
+		EventOperator *oper = (EventOperator *)iter;
+		char ***       new_array;
+
+		new_array = nih_realloc (array, parent,
+					 sizeof (char **) * (len + 2));
+		if (! new_array)
+			goto error;
+		array = new_array;
+
+		array[len] = nih_str_array_new (array);
+		if (! array[len])
+			goto error;
+
+		switch (oper->type) {
+		case EVENT_OR:
+			if (! nih_str_array_add (&array[len], array,
+						 NULL, "/OR"))
+				goto error;
+			break;
+		case EVENT_AND:
+			if (! nih_str_array_add (&array[len], array,
+						 NULL, "/AND"))
+				goto error;
+			break;
+		case EVENT_MATCH:
+			if (! nih_str_array_add (&array[len], array,
+						 NULL, oper->name))
+				goto error;
+			if (oper->env)
+				if (! nih_str_array_append (&array[len], array,
+							    NULL, oper->env))
+					goto error;
+			break;
+		}
+
+		array[++len] = NULL;
+	}
+
+	return array;
+
+error:
+	nih_free (array);
+	return NULL;
+}
+
 /**
  * job_class_get_start_on:
  * @class: class to obtain events from,
@@ -1599,11 +2659,7 @@ job_class_get_version (JobClass        *class,
  *
  * Called to obtain the set of events that will start jobs of the given
  * @class, this is returned as an array of the event tree flattened into
- * reverse polish form.
- *
- * Each array element is an array of strings representing the events,
- * or a single element containing "/OR" or "/AND" to represent the
- * operators.
+ * reverse polish form by job_class_condition_array().
  *
  * Returns: zero on success, negative value on raised error.
  **/
@@ -1612,58 +2668,14 @@ job_class_get_start_on (JobClass *      class,
 			NihDBusMessage *message,
 			char ****       start_on)
 {
-	size_t len = 0;
-
 	nih_assert (class != NULL);
 	nih_assert (message != NULL);
 	nih_assert (start_on != NULL);
 
-	*start_on = nih_alloc (message, sizeof (char ***));
+	*start_on = job_class_condition_array (message, class->start_on);
 	if (! *start_on)
 		nih_return_no_memory_error (-1);
 
-	len = 0;
-	(*start_on)[len] = NULL;
-
-	if (class->start_on) {
-		NIH_TREE_FOREACH_POST (&class->start_on->node, iter) {
-			EventOperator *oper = (EventOperator *)iter;
-
-			*start_on = nih_realloc (*start_on, message,
-						 sizeof (char ***) * (len + 2));
-			if (! *start_on)
-				nih_return_no_memory_error (-1);
-
-			(*start_on)[len] = nih_str_array_new (*start_on);
-			if (! (*start_on)[len])
-				nih_return_no_memory_error (-1);
-
-			switch (oper->type) {
-			case EVENT_OR:
-				if (! nih_str_array_add (&(*start_on)[len], *start_on,
-							 NULL, "/OR"))
-					nih_return_no_memory_error (-1);
-				break;
-			case EVENT_AND:
-				if (! nih_str_array_add (&(*start_on)[len], *start_on,
-							 NULL, "/AND"))
-					nih_return_no_memory_error (-1);
-				break;
-			case EVENT_MATCH:
-				if (! nih_str_array_add (&(*start_on)[len], *start_on,
-							 NULL, oper->name))
-					nih_return_no_memory_error (-1);
-				if (oper->env)
-					if (! nih_str_array_append (&(*start_on)[len], *start_on,
-								    NULL, oper->env))
-						nih_return_no_memory_error (-1);
-				break;
-			}
-
-			(*start_on)[++len] = NULL;
-		}
-	}
-
 	return 0;
 }
 
@@ -1678,11 +2690,7 @@ job_class_get_start_on (JobClass *      class,
  *
  * Called to obtain the set of events that will stop jobs of the given
  * @class, this is returned as an array of the event tree flattened into
- * reverse polish form.
- *
- * Each array element is an array of strings representing the events,
- * or a single element containing "/OR" or "/AND" to represent the
- * operators.
+ * reverse polish form by job_class_condition_array().
  *
  * Returns: zero on success, negative value on raised error.
  **/
@@ -1691,60 +2699,16 @@ job_class_get_stop_on (JobClass *      class,
 		       NihDBusMessage *message,
 		       char ****       stop_on)
 {
-	size_t len = 0;
-
 	nih_assert (class != NULL);
 	nih_assert (message != NULL);
 	nih_assert (stop_on != NULL);
 
-	*stop_on = nih_alloc (message, sizeof (char ***));
+	*stop_on = job_class_condition_array (message, class->stop_on);
 	if (! *stop_on)
 		nih_return_no_memory_error (-1);
 
-	len = 0;
-	(*stop_on)[len] = NULL;
-
-	if (class->stop_on) {
-		NIH_TREE_FOREACH_POST (&class->stop_on->node, iter) {
-			EventOperator *oper = (EventOperator *)iter;
-
-			*stop_on = nih_realloc (*stop_on, message,
-						 sizeof (char ***) * (len + 2));
-			if (! *stop_on)
-				nih_return_no_memory_error (-1);
-
-			(*stop_on)[len] = nih_str_array_new (*stop_on);
-			if (! (*stop_on)[len])
-				nih_return_no_memory_error (-1);
-
-			switch (oper->type) {
-			case EVENT_OR:
-				if (! nih_str_array_add (&(*stop_on)[len], *stop_on,
-							 NULL, "/OR"))
-					nih_return_no_memory_error (-1);
-				break;
-			case EVENT_AND:
-				if (! nih_str_array_add (&(*stop_on)[len], *stop_on,
-							 NULL, "/AND"))
-					nih_return_no_memory_error (-1);
-				break;
-			case EVENT_MATCH:
-				if (! nih_str_array_add (&(*stop_on)[len], *stop_on,
-							 NULL, oper->name))
-					nih_return_no_memory_error (-1);
-				if (oper->env)
-					if (! nih_str_array_append (&(*stop_on)[len], *stop_on,
-								    NULL, oper->env))
-						nih_return_no_memory_error (-1);
-				break;
-			}
-
-			(*stop_on)[++len] = NULL;
-		}
-	}
-
-	return 0;
-}
+	return 0;
+}
 
 /**
  * job_class_get_emits:
@@ -1799,11 +2763,69 @@ job_class_console_type (const char *console)
 		return CONSOLE_OWNER;
 	} else if (! strcmp (console, "log")) {
 		return CONSOLE_LOG;
+	} else if (! strcmp (console, "socket")) {
+		return CONSOLE_SOCKET;
 	}
 
 	return (ConsoleType)-1;
 }
 
+/**
+ * job_class_placement_list:
+ * @list: comma-separated list of numbers and ranges,
+ * @mask: mask of JOB_PLACEMENT_MAX bits to set.
+ *
+ * Set the bits of @mask for the processors or memory nodes named in
+ * @list, such as "0-3,8"; bits already set are left set.
+ *
+ * Returns: zero on success, -1 if @list is invalid or names a number
+ * beyond JOB_PLACEMENT_MAX.
+ **/
+int
+job_class_placement_list (const char    *list,
+			  unsigned long *mask)
+{
+	const char *p = list;
+
+	nih_assert (list != NULL);
+	nih_assert (mask != NULL);
+
+	do {
+		char          *endptr;
+		unsigned long  first;
+		unsigned long  last;
+
+		if ((*p < '0') || (*p > '9'))
+			return -1;
+
+		errno = 0;
+		first = last = strtoul (p, &endptr, 10);
+		if (errno)
+			return -1;
+
+		if (*endptr == '-') {
+			p = endptr + 1;
+			if ((*p < '0') || (*p > '9'))
+				return -1;
+
+			last = strtoul (p, &endptr, 10);
+			if (errno)
+				return -1;
+		}
+
+		if ((first > last) || (last >= JOB_PLACEMENT_MAX))
+			return -1;
+
+		for (unsigned long i = first; i <= last; i++)
+			mask[i / (8 * sizeof (unsigned long))]
+				|= 1UL << (i % (8 * sizeof (unsigned long)));
+
+		p = endptr;
+	} while ((*p == ',') && p++);
+
+	return *p ? -1 : 0;
+}
+
 /**
  * job_class_get_usage:
  * @class: class to obtain usage from,
@@ -1841,6 +2863,353 @@ job_class_get_usage (JobClass *      class,
 	return 0;
 }
 
+/**
+ * job_class_get_resources:
+ * @class: class to obtain resources from,
+ * @message: D-Bus connection and message received,
+ * @resources: pointer for reply array.
+ *
+ * Implements the get method for the resources property of the
+ * com.ubuntu.Upstart.Job interface.
+ *
+ * Called to obtain the resources used by the processes of every instance
+ * of @class as an array of resource names and values, which will be
+ * stored in @resources; see JobResource.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+job_class_get_resources (JobClass                   *class,
+			 NihDBusMessage             *message,
+			 JobClassResourcesElement ***resources)
+{
+	nih_assert (class != NULL);
+	nih_assert (message != NULL);
+	nih_assert (resources != NULL);
+
+	*resources = nih_alloc (message, sizeof (JobClassResourcesElement *)
+				* (JOB_RESOURCE_LAST + 1));
+	if (! *resources)
+		nih_return_no_memory_error (-1);
+
+	for (int i = 0; i < JOB_RESOURCE_LAST; i++) {
+		JobClassResourcesElement *resource;
+
+		resource = nih_new (*resources, JobClassResourcesElement);
+		if (! resource)
+			goto error;
+
+		resource->item0 = nih_strdup (resource, job_resource_name (i));
+		if (! resource->item0)
+			goto error;
+
+		resource->item1 = class->resources[i];
+
+		(*resources)[i] = resource;
+	}
+
+	(*resources)[JOB_RESOURCE_LAST] = NULL;
+
+	return 0;
+
+error:
+	nih_free (*resources);
+	nih_return_no_memory_error (-1);
+}
+
+
+/**
+ * job_class_get_scheduling:
+ * @class: class to obtain scheduling from,
+ * @message: D-Bus connection and message received,
+ * @scheduling: pointer for reply array.
+ *
+ * Implements the get method for the scheduling property of the
+ * com.ubuntu.Upstart.Job interface.
+ *
+ * Called to obtain the sched, ioprio and timer-slack stanzas that apply
+ * to processes of @class, written as they would be in its definition,
+ * which will be stored in @scheduling; stanzas that are not set are
+ * left out.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+job_class_get_scheduling (JobClass       *class,
+			  NihDBusMessage *message,
+			  char         ***scheduling)
+{
+	size_t len = 0;
+
+	nih_assert (class != NULL);
+	nih_assert (message != NULL);
+	nih_assert (scheduling != NULL);
+
+	*scheduling = nih_str_array_new (message);
+	if (! *scheduling)
+		nih_return_no_memory_error (-1);
+
+	if (class->sched_policy != JOB_SCHED_INVALID) {
+		nih_local char *stanza = NULL;
+
+		if ((class->sched_policy == SCHED_FIFO)
+		    || (class->sched_policy == SCHED_RR)) {
+			stanza = nih_sprintf (NULL, "sched %s %d",
+					      job_sched_policy_name (class->sched_policy),
+					      class->sched_priority);
+		} else {
+			stanza = nih_sprintf (NULL, "sched %s",
+					      job_sched_policy_name (class->sched_policy));
+		}
+		if (! stanza)
+			goto error;
+
+		if (! nih_str_array_addp (scheduling, message, &len, stanza))
+			goto error;
+	}
+
+	if (class->ioprio_class != JOB_IOPRIO_NONE) {
+		nih_local char *stanza = NULL;
+
+		if (class->ioprio_class != JOB_IOPRIO_IDLE) {
+			stanza = nih_sprintf (NULL, "ioprio %s %d",
+					      job_ioprio_class_name (class->ioprio_class),
+					      class->ioprio_level);
+		} else {
+			stanza = nih_sprintf (NULL, "ioprio %s",
+					      job_ioprio_class_name (class->ioprio_class));
+		}
+		if (! stanza)
+			goto error;
+
+		if (! nih_str_array_addp (scheduling, message, &len, stanza))
+			goto error;
+	}
+
+	if (class->timer_slack) {
+		nih_local char *stanza = NULL;
+
+		stanza = nih_sprintf (NULL, "timer-slack %lu",
+				      class->timer_slack);
+		if (! stanza)
+			goto error;
+
+		if (! nih_str_array_addp (scheduling, message, &len, stanza))
+			goto error;
+	}
+
+	return 0;
+
+error:
+	nih_free (*scheduling);
+	nih_return_no_memory_error (-1);
+}
+
+/**
+ * job_sched_policy_name:
+ * @policy: scheduling policy.
+ *
+ * Returns: name of @policy as used by the sched stanza, or NULL if it
+ * has none.
+ **/
+const char *
+job_sched_policy_name (int policy)
+{
+	switch (policy) {
+	case SCHED_OTHER:
+		return "other";
+	case SCHED_BATCH:
+		return "batch";
+	case SCHED_IDLE:
+		return "idle";
+	case SCHED_FIFO:
+		return "fifo";
+	case SCHED_RR:
+		return "rr";
+	default:
+		return NULL;
+	}
+}
+
+/**
+ * job_sched_policy_from_name:
+ * @name: name of scheduling policy.
+ *
+ * Returns: scheduling policy named @name by the sched stanza, or
+ * JOB_SCHED_INVALID if there is none.
+ **/
+int
+job_sched_policy_from_name (const char *name)
+{
+	nih_assert (name != NULL);
+
+	if (! strcmp (name, "other")) {
+		return SCHED_OTHER;
+	} else if (! strcmp (name, "batch")) {
+		return SCHED_BATCH;
+	} else if (! strcmp (name, "idle")) {
+		return SCHED_IDLE;
+	} else if (! strcmp (name, "fifo")) {
+		return SCHED_FIFO;
+	} else if (! strcmp (name, "rr")) {
+		return SCHED_RR;
+	} else {
+		return JOB_SCHED_INVALID;
+	}
+}
+
+/**
+ * job_ioprio_class_name:
+ * @ioprio_class: I/O scheduling class.
+ *
+ * Returns: name of @ioprio_class as used by the ioprio stanza, or NULL
+ * if it has none.
+ **/
+const char *
+job_ioprio_class_name (JobIoprioClass ioprio_class)
+{
+	switch (ioprio_class) {
+	case JOB_IOPRIO_REALTIME:
+		return "realtime";
+	case JOB_IOPRIO_BEST_EFFORT:
+		return "best-effort";
+	case JOB_IOPRIO_IDLE:
+		return "idle";
+	default:
+		return NULL;
+	}
+}
+
+/**
+ * job_ioprio_class_from_name:
+ * @name: name of I/O scheduling class.
+ *
+ * Returns: I/O scheduling class named @name by the ioprio stanza, or
+ * JOB_IOPRIO_NONE if there is none.
+ **/
+JobIoprioClass
+job_ioprio_class_from_name (const char *name)
+{
+	nih_assert (name != NULL);
+
+	if (! strcmp (name, "realtime")) {
+		return JOB_IOPRIO_REALTIME;
+	} else if (! strcmp (name, "best-effort")) {
+		return JOB_IOPRIO_BEST_EFFORT;
+	} else if (! strcmp (name, "idle")) {
+		return JOB_IOPRIO_IDLE;
+	} else {
+		return JOB_IOPRIO_NONE;
+	}
+}
+
+/**
+ * job_resource_name:
+ * @resource: resource to convert.
+ *
+ * Converts an enumerated resource into the string used for it by the
+ * resources property of instances and classes.
+ *
+ * Returns: static string or NULL if resource not known.
+ **/
+const char *
+job_resource_name (JobResource resource)
+{
+	switch (resource) {
+	case JOB_RESOURCE_PROCESSES:
+		return N_("processes");
+	case JOB_RESOURCE_USER_TIME:
+		return N_("user_time");
+	case JOB_RESOURCE_SYSTEM_TIME:
+		return N_("system_time");
+	case JOB_RESOURCE_MAX_RSS:
+		return N_("max_rss");
+	case JOB_RESOURCE_READ_BLOCKS:
+		return N_("read_blocks");
+	case JOB_RESOURCE_WRITE_BLOCKS:
+		return N_("write_blocks");
+	default:
+		return NULL;
+	}
+}
+
+/**
+ * job_resources_add:
+ * @resources: resources to add to,
+ * @usage: resources used by a process.
+ *
+ * Add @usage to the totals in @resources, both indexed by JobResource;
+ * JOB_RESOURCE_MAX_RSS is instead raised to that of @usage.
+ **/
+void
+job_resources_add (uint64_t       *resources,
+		   const uint64_t *usage)
+{
+	nih_assert (resources != NULL);
+	nih_assert (usage != NULL);
+
+	for (int i = 0; i < JOB_RESOURCE_LAST; i++) {
+		if (i == JOB_RESOURCE_MAX_RSS) {
+			if (usage[i] > resources[i])
+				resources[i] = usage[i];
+		} else {
+			resources[i] += usage[i];
+		}
+	}
+}
+
+/**
+ * job_resources_serialise:
+ * @resources: resources indexed by JobResource.
+ *
+ * Serialise @resources into JSON.
+ *
+ * Returns: JSON-serialised array of resources, or NULL on error.
+ **/
+json_object *
+job_resources_serialise (const uint64_t *resources)
+{
+	nih_assert (resources != NULL);
+
+	return state_serialise_int_array (uint64_t, resources,
+					  JOB_RESOURCE_LAST);
+}
+
+/**
+ * job_resources_deserialise:
+ * @json: JSON-serialised array of resources,
+ * @resources: resources to restore, indexed by JobResource.
+ *
+ * Deserialise @json into @resources; entries beyond those known to this
+ * version are ignored and missing entries are left zero.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+int
+job_resources_deserialise (json_object *json,
+			   uint64_t    *resources)
+{
+	nih_local uint64_t *array = NULL;
+	size_t              len = 0;
+
+	nih_assert (json != NULL);
+	nih_assert (resources != NULL);
+
+	if (state_deserialise_int_array (NULL, json, uint64_t,
+					 &array, &len) < 0)
+		return -1;
+
+	memset (resources, 0, sizeof (uint64_t) * JOB_RESOURCE_LAST);
+
+	if (array)
+		memcpy (resources, array,
+			sizeof (uint64_t) * (len < JOB_RESOURCE_LAST
+					     ? len : JOB_RESOURCE_LAST));
+
+	return 0;
+}
+
+
 /**
  * job_class_serialise_job_environ:
  *
@@ -1887,6 +3256,8 @@ job_class_deserialise_job_environ (json_object *json)
 	if (! state_deserialise_str_array (NULL, json, &job_environ))
 		goto error;
 
+	job_environ_generation++;
+
 	return 0;
 
 error:
@@ -1915,6 +3286,8 @@ job_class_serialise (JobClass *class)
 	json_object      *json_jobs;
 	json_object      *json_start_on;
 	json_object      *json_stop_on;
+	json_object      *json_resources;
+	json_object      *json_cached = NULL;
 	int               session_index;
 
 #ifdef ENABLE_CGROUPS
@@ -1924,6 +3297,16 @@ job_class_serialise (JobClass *class)
 	nih_assert (class);
 	nih_assert (job_classes);
 
+	/* Any part of the definition that was dropped would otherwise be
+	 * lost, so is taken from the configuration cache, or failing that
+	 * by parsing the file again.
+	 */
+	if (! class->loaded) {
+		json_cached = conf_cache_entry (class);
+		if (! json_cached && job_class_load (class) < 0)
+			return NULL;
+	}
+
 	json = json_object_new_object ();
 	if (! json)
 		return NULL;
@@ -2015,6 +3398,9 @@ job_class_serialise (JobClass *class)
 	if (! state_set_json_int_var_from_obj (json, class, kill_signal))
 		goto error;
 
+	if (! state_set_json_int_var_from_obj (json, class, kill_cgroup))
+		goto error;
+
 	if (! state_set_json_int_var_from_obj (json, class, reload_signal))
 		goto error;
 
@@ -2027,6 +3413,15 @@ job_class_serialise (JobClass *class)
 	if (! state_set_json_int_var_from_obj (json, class, respawn_interval))
 		goto error;
 
+	if (! state_set_json_int_var_from_obj (json, class, respawn_backoff_initial))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, class, respawn_backoff_max))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, class, respawn_backoff_jitter))
+		goto error;
+
 	json_normalexit = state_serialise_int_array (int, class->normalexit,
 					     class->normalexit_len);
 	if (! json_normalexit)
@@ -2039,20 +3434,59 @@ job_class_serialise (JobClass *class)
 				"console", class->console))
 		goto error;
 
+	if (! state_set_json_string_var_from_obj (json, class, console_socket))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, class, log_limit_rate))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, class, log_limit_burst))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, class, log_limit_size))
+		goto error;
+
 	if (! state_set_json_int_var_from_obj (json, class, umask))
 		goto error;
 
 	if (! state_set_json_int_var_from_obj (json, class, nice))
 		goto error;
 
+	if (! state_set_json_int_var_from_obj (json, class, priority))
+		goto error;
+
 	if (! state_set_json_int_var_from_obj (json, class, oom_score_adj))
 		goto error;
 
+	if (! state_set_json_int_var_from_obj (json, class, sched_policy))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, class, sched_priority))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, class, ioprio_class))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, class, ioprio_level))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, class, timer_slack))
+		goto error;
+
 	json_limits = state_rlimit_serialise_all (class->limits);
 	if (! json_limits)
 		goto error;
 	json_object_object_add (json, "limits", json_limits);
 
+	if (class->placement) {
+		json_object *json_placement;
+
+		json_placement = state_placement_serialise (class->placement);
+		if (! json_placement)
+			goto error;
+		json_object_object_add (json, "placement", json_placement);
+	}
+
 	if (! state_set_json_string_var_from_obj (json, class, chroot))
 		goto error;
 
@@ -2080,6 +3514,12 @@ job_class_serialise (JobClass *class)
 	if (! state_set_json_int_var_from_obj (json, class, cgmanager_wait))
 		goto error;
 
+	json_resources = job_resources_serialise (class->resources);
+	if (! json_resources)
+		goto error;
+
+	json_object_object_add (json, "resources", json_resources);
+
 #ifdef ENABLE_CGROUPS
 	json_cgroups = cgroup_serialise_all (&class->cgroups);
 	if (! json_cgroups)
@@ -2088,6 +3528,9 @@ job_class_serialise (JobClass *class)
 	json_object_object_add (json, "cgroups", json_cgroups);
 #endif /* ENABLE_CGROUPS */
 
+	if (json_cached)
+		job_class_serialise_dropped (json, json_cached);
+
 	return json;
 
 error:
@@ -2095,6 +3538,37 @@ error:
 	return NULL;
 }
 
+/**
+ * job_class_serialise_dropped:
+ * @json: JSON-serialised JobClass object whose definition was dropped,
+ * @json_cached: JSON-serialised JobClass object with its full definition.
+ *
+ * Replace the parts of the definition that job_class_unload() drops in
+ * @json with those in @json_cached, as found by conf_cache_entry().
+ **/
+static void
+job_class_serialise_dropped (json_object *json,
+			     json_object *json_cached)
+{
+	static const char * const keys[] = {
+		"env", "process", "limits", "placement", "apparmor_switch",
+	};
+
+	nih_assert (json);
+	nih_assert (json_cached);
+
+	for (size_t i = 0; i < NIH_N_ELEMENTS (keys); i++) {
+		json_object *value;
+
+		if (json_object_object_get_ex (json_cached, keys[i], &value)) {
+			json_object_object_add (json, keys[i],
+						json_object_get (value));
+		} else {
+			json_object_object_del (json, keys[i]);
+		}
+	}
+}
+
 /**
  * job_class_serialise_all:
  *
@@ -2119,17 +3593,22 @@ error:
 json_object *
 job_class_serialise_all (void)
 {
-	json_object *json;
-
-	job_class_init ();
+	json_object         *json;
+	nih_local JobClass **classes = NULL;
+	size_t               len;
 
 	json = json_object_new_array ();
 	if (! json)
 		return NULL;
 
-	NIH_HASH_FOREACH (job_classes, iter) {
+	/* Classes are referred to by their position, so serialise them
+	 * in the order job_class_get_index() gives.
+	 */
+	classes = job_class_sorted (NULL, &len);
+
+	for (size_t i = 0; i < len; i++) {
 		json_object  *json_class;
-		JobClass     *class = (JobClass *)iter;
+		JobClass     *class = classes[i];
 
 		json_class = job_class_serialise (class);
 
@@ -2147,65 +3626,28 @@ error:
 }
 
 /**
- * job_class_deserialise:
- * @json: JSON-serialised JobClass object to deserialise.
+ * job_class_deserialise_definition:
+ * @class: JobClass to fill in,
+ * @json: JSON-serialised JobClass object.
  *
- * Create JobClass from provided JSON and add to the
- * job classes table.
+ * Set the configuration fields of @class (everything bar its instances
+ * and runtime state) from @json.
  *
- * Returns: JobClass object, or NULL on error.
+ * Returns: 0 on success, -1 on error.
  **/
-JobClass *
-job_class_deserialise (json_object *json)
-{
-	json_object    *json_normalexit;
-	JobClass       *class = NULL;
-	ConfFile       *file = NULL;
-	Session        *session;
-	int             session_index = -1;
-	int             ret;
-	nih_local char *name = NULL;
-	nih_local char *path = NULL;
-	json_object    *json_start_on = NULL;
-	json_object    *json_stop_on = NULL;
-
-	nih_assert (json);
-	nih_assert (job_classes);
-
-	if (! state_check_json_type (json, object))
-		goto error;
-
-	if (! state_get_json_int_var (json, "session", session_index))
-		goto error;
-
-	if (session_index < 0)
-		goto error;
-
-	session = session_from_index (session_index);
-
-	/* XXX: chroot and old user session jobs not currently supported */
-	if (session) {
-		nih_info ("WARNING: deserialisation of user/chroot "
-				"sessions not currently supported");
-		goto error;
-	}
-
-	if (! state_get_json_string_var_strict (json, "name", NULL, name))
-		goto error;
-
-	/* Create the class and associate it with the ConfFile */
-	class = job_class_new (NULL, name, session);
-	if (! class)
-		goto error;
+static int
+job_class_deserialise_definition (JobClass    *class,
+				  json_object *json)
+{
+	json_object    *json_normalexit;
+	json_object    *json_placement;
+	int             ret;
+	nih_local char *path = NULL;
+	json_object    *json_start_on = NULL;
+	json_object    *json_stop_on = NULL;
 
-	/* Lookup the ConfFile associated with this class.
-	 *
-	 * Don't error if this fails since previous serialisation data
-	 * formats did not encode ConfSources and ConfFiles.
-	 */
-	file = conf_file_find (name, session);
-	if (file)
-		file->job = class;
+	nih_assert (class);
+	nih_assert (json);
 
 	/* job_class_new() sets path */
 	if (! state_get_json_string_var_strict (json, "path", NULL, path))
@@ -2329,6 +3771,11 @@ job_class_deserialise (json_object *json)
 	if (! state_get_json_int_var_to_obj (json, class, kill_signal))
 		goto error;
 
+	if (json_object_object_get_ex (json, "kill_cgroup", NULL)) {
+		if (! state_get_json_int_var_to_obj (json, class, kill_cgroup))
+			goto error;
+	}
+
 	/* reload_signal is new in upstart 1.10+ */
 	if (json_object_object_get_ex (json, "reload_signal", NULL)) {
 		if (! state_get_json_int_var_to_obj (json, class, reload_signal))
@@ -2344,20 +3791,71 @@ job_class_deserialise (json_object *json)
 	if (! state_get_json_int_var_to_obj (json, class, respawn_interval))
 		goto error;
 
+	/* Older versions did not support respawn backoff */
+	if (json_object_object_get_ex (json, "respawn_backoff_initial", NULL)) {
+		if (! state_get_json_int_var_to_obj (json, class, respawn_backoff_initial))
+			goto error;
+
+		if (! state_get_json_int_var_to_obj (json, class, respawn_backoff_max))
+			goto error;
+
+		if (! state_get_json_int_var_to_obj (json, class, respawn_backoff_jitter))
+			goto error;
+	}
+
 	if (! state_get_json_enum_var (json,
 				job_class_console_type_str_to_enum,
 				"console", class->console))
 		goto error;
 
+	if (json_object_object_get_ex (json, "console_socket", NULL)) {
+		if (! state_get_json_string_var_to_obj (json, class, console_socket))
+			goto error;
+	}
+
+	/* log limits are new in upstart 1.14+ */
+	if (json_object_object_get_ex (json, "log_limit_rate", NULL)) {
+		if (! state_get_json_int_var_to_obj (json, class, log_limit_rate))
+			goto error;
+
+		if (! state_get_json_int_var_to_obj (json, class, log_limit_burst))
+			goto error;
+
+		if (! state_get_json_int_var_to_obj (json, class, log_limit_size))
+			goto error;
+	}
+
 	if (! state_get_json_int_var_to_obj (json, class, umask))
 		goto error;
 
 	if (! state_get_json_int_var_to_obj (json, class, nice))
 		goto error;
 
+	if (json_object_object_get_ex (json, "priority", NULL)) {
+		if (! state_get_json_int_var_to_obj (json, class, priority))
+			goto error;
+	}
+
 	if (! state_get_json_int_var_to_obj (json, class, oom_score_adj))
 		goto error;
 
+	if (json_object_object_get_ex (json, "sched_policy", NULL)) {
+		if (! state_get_json_int_var_to_obj (json, class, sched_policy))
+			goto error;
+
+		if (! state_get_json_int_var_to_obj (json, class, sched_priority))
+			goto error;
+
+		if (! state_get_json_int_var_to_obj (json, class, ioprio_class))
+			goto error;
+
+		if (! state_get_json_int_var_to_obj (json, class, ioprio_level))
+			goto error;
+
+		if (! state_get_json_int_var_to_obj (json, class, timer_slack))
+			goto error;
+	}
+
 	if (! state_get_json_string_var_to_obj (json, class, chroot))
 		goto error;
 
@@ -2398,9 +3896,91 @@ job_class_deserialise (json_object *json)
 	if (state_rlimit_deserialise_all (json, class, &class->limits) < 0)
 		goto error;
 
+	if (json_object_object_get_ex (json, "placement", &json_placement)) {
+		class->placement = state_placement_deserialise (class,
+								json_placement);
+		if (! class->placement)
+			goto error;
+	}
+
 	if (process_deserialise_all (json, class->process, class->process) < 0)
 		goto error;
 
+	return 0;
+
+error:
+	return -1;
+}
+
+/**
+ * job_class_deserialise:
+ * @json: JSON-serialised JobClass object to deserialise.
+ *
+ * Create JobClass from provided JSON and add to the
+ * job classes table.
+ *
+ * Returns: JobClass object, or NULL on error.
+ **/
+JobClass *
+job_class_deserialise (json_object *json)
+{
+	JobClass       *class = NULL;
+	ConfFile       *file = NULL;
+	Session        *session;
+	int             session_index = -1;
+	nih_local char *name = NULL;
+	json_object    *json_resources;
+
+	nih_assert (json);
+	nih_assert (job_classes);
+
+	if (! state_check_json_type (json, object))
+		goto error;
+
+	if (! state_get_json_int_var (json, "session", session_index))
+		goto error;
+
+	if (session_index < 0)
+		goto error;
+
+	session = session_from_index (session_index);
+
+	/* XXX: chroot and old user session jobs not currently supported */
+	if (session) {
+		nih_info ("WARNING: deserialisation of user/chroot "
+				"sessions not currently supported");
+		goto error;
+	}
+
+	if (! state_get_json_string_var_strict (json, "name", NULL, name))
+		goto error;
+
+	/* Create the class and associate it with the ConfFile */
+	class = job_class_new (NULL, name, session);
+	if (! class)
+		goto error;
+
+	/* Lookup the ConfFile associated with this class.
+	 *
+	 * Don't error if this fails since previous serialisation data
+	 * formats did not encode ConfSources and ConfFiles.
+	 */
+	file = conf_file_find (name, session);
+	if (file) {
+		file->job = class;
+		conf_file_index (file);
+	}
+
+	if (job_class_deserialise_definition (class, json) < 0)
+		goto error;
+
+	/* Older versions did not account resources */
+	if (json_object_object_get_ex (json, "resources", &json_resources)) {
+		if (job_resources_deserialise (json_resources,
+					       class->resources) < 0)
+			goto error;
+	}
+
 	if (file) {
 		/* Add the class to the job_classes hash if ConfFiles were
 		 * available in the serialisation data.
@@ -2440,6 +4020,61 @@ error:
 	return NULL;
 }
 
+/**
+ * job_class_deserialise_config:
+ * @json: JSON-serialised JobClass object to deserialise,
+ * @name: expected name of the class.
+ *
+ * Create a JobClass named @name from the configuration held in @json,
+ * as produced by job_class_serialise() for a class with no instances.
+ * Unlike job_class_deserialise(), the class is neither associated with
+ * a ConfFile nor added to the job classes table; the caller must do
+ * both.
+ *
+ * Returns: new JobClass object, or NULL on error.
+ **/
+JobClass *
+job_class_deserialise_config (json_object *json,
+			      const char  *name)
+{
+	JobClass       *class = NULL;
+	nih_local char *json_name = NULL;
+
+	nih_assert (json);
+	nih_assert (name);
+
+	if (! state_check_json_type (json, object))
+		goto error;
+
+	if (! state_get_json_string_var_strict (json, "name", NULL, json_name))
+		goto error;
+
+	if (strcmp (json_name, name))
+		goto error;
+
+	class = job_class_new (NULL, name, NULL);
+	if (! class)
+		goto error;
+
+	if (job_class_deserialise_definition (class, json) < 0)
+		goto error;
+
+#ifdef ENABLE_CGROUPS
+	if (json_object_object_get_ex (json, "cgroups", NULL)) {
+		if (cgroup_deserialise_all (class, &class->cgroups, json) < 0)
+			goto error;
+	}
+#endif /* ENABLE_CGROUPS */
+
+	return class;
+
+error:
+	if (class)
+		nih_free (class);
+
+	return NULL;
+}
+
 /**
  * job_class_deserialise_all:
  *
@@ -2524,6 +4159,9 @@ job_class_expect_type_enum_to_str (ExpectType expect)
 	state_enum_to_str (EXPECT_STOP, expect);
 	state_enum_to_str (EXPECT_DAEMON, expect);
 	state_enum_to_str (EXPECT_FORK, expect);
+	state_enum_to_str (EXPECT_DAEMON_PASSIVE, expect);
+	state_enum_to_str (EXPECT_FORK_PASSIVE, expect);
+	state_enum_to_str (EXPECT_NOTIFY, expect);
 
 	return NULL;
 }
@@ -2546,6 +4184,9 @@ job_class_expect_type_str_to_enum (const char *expect)
 	state_str_to_enum (EXPECT_STOP, expect);
 	state_str_to_enum (EXPECT_DAEMON, expect);
 	state_str_to_enum (EXPECT_FORK, expect);
+	state_str_to_enum (EXPECT_DAEMON_PASSIVE, expect);
+	state_str_to_enum (EXPECT_FORK_PASSIVE, expect);
+	state_str_to_enum (EXPECT_NOTIFY, expect);
 
 	return -1;
 }
@@ -2566,6 +4207,7 @@ job_class_console_type_enum_to_str (ConsoleType console)
 	state_enum_to_str (CONSOLE_OUTPUT, console);
 	state_enum_to_str (CONSOLE_OWNER, console);
 	state_enum_to_str (CONSOLE_LOG, console);
+	state_enum_to_str (CONSOLE_SOCKET, console);
 
 	return NULL;
 }
@@ -2589,6 +4231,7 @@ job_class_console_type_str_to_enum (const char *console)
 	state_str_to_enum (CONSOLE_OUTPUT, console);
 	state_str_to_enum (CONSOLE_OWNER, console);
 	state_str_to_enum (CONSOLE_LOG, console);
+	state_str_to_enum (CONSOLE_SOCKET, console);
 
 error:
 	return -1;
@@ -2598,7 +4241,8 @@ error:
  * job_class_prepare_reexec:
  *
  * Prepare for a re-exec by clearing the CLOEXEC bit on all log object
- * file descriptors associated with their parent jobs.
+ * file descriptors associated with their parent jobs, and on their
+ * notification sockets.
  **/
 void
 job_class_prepare_reexec (void)
@@ -2641,6 +4285,11 @@ job_class_prepare_reexec (void)
 				if (state_modify_cloexec (fd, FALSE) < 0)
 					goto error;
 			}
+
+			if ((job->notify_fd >= 0)
+			    && (state_modify_cloexec (job->notify_fd, FALSE) < 0))
+				nih_warn (_("unable to clear CLOEXEC bit on "
+					    "notification socket"));
 		}
 	}
 
@@ -2650,6 +4299,84 @@ error:
 	nih_warn (_("unable to clear CLOEXEC bit on log fd"));
 }
 
+/**
+ * job_class_reexec_fds:
+ * @parent: parent object for new array.
+ *
+ * Find the file descriptors that must survive a re-exec for the state
+ * of jobs to be read by the new instance: those of the log objects
+ * cleared by job_class_prepare_reexec(), the notification sockets of
+ * main processes and those of job processes still being spawned.
+ *
+ * Returns: newly allocated array of file descriptors terminated by -1,
+ * or NULL if insufficient memory.
+ **/
+int *
+job_class_reexec_fds (const void *parent)
+{
+	int    *fds;
+	size_t  len = 0;
+
+	job_class_init ();
+
+	fds = nih_alloc (parent, sizeof (int));
+	if (! fds)
+		return NULL;
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		NIH_HASH_FOREACH (class->instances, job_iter) {
+			Job *job = (Job *)job_iter;
+
+			for (int process = 0; process < PROCESS_LAST; process++) {
+				Log            *log = job->log ? job->log[process] : NULL;
+				JobProcessData *process_data = NULL;
+				int             found[5];
+				size_t          found_len = 0;
+				int            *new_fds;
+
+				if (log && log->io && log->io->watch->fd >= 0) {
+					found[found_len++] = log->io->watch->fd;
+					if (log->fd >= 0)
+						found[found_len++] = log->fd;
+				}
+
+				if (job->process_data)
+					process_data = job->process_data[process];
+
+				if (process_data && process_data->valid) {
+					if (process_data->shell_fd >= 0)
+						found[found_len++] = process_data->shell_fd;
+					if (process_data->job_process_fd >= 0)
+						found[found_len++] = process_data->job_process_fd;
+				}
+
+				if ((process == PROCESS_MAIN) && (job->notify_fd >= 0))
+					found[found_len++] = job->notify_fd;
+
+				if (! found_len)
+					continue;
+
+				new_fds = nih_realloc (fds, parent,
+						       sizeof (int) * (len + found_len + 1));
+				if (! new_fds) {
+					nih_free (fds);
+					return NULL;
+				}
+				fds = new_fds;
+
+				memcpy (fds + len, found, sizeof (int) * found_len);
+				len += found_len;
+			}
+		}
+	}
+
+	fds[len] = -1;
+
+	return fds;
+}
+
 /**
  * job_class_max_kill_timeout:
  *
@@ -2684,26 +4411,137 @@ job_class_max_kill_timeout (void)
  * job_class_get_index:
  * @class: JobClass to search for.
  *
- * Returns: index of @class in the job classes hash,
+ * The index of a registered class is its position when the classes are
+ * ordered by name and then by the index of their session, which depends
+ * only on which classes are registered and not on the layout of the job
+ * classes hash, so is the same for a re-exec'd instance.
+ *
+ * Returns: index of @class among the registered job classes,
  * or -1 if not found.
  **/
 ssize_t
 job_class_get_index (const JobClass *class)
 {
-	ssize_t i = 0;
+	JobClass *registered;
+	ssize_t   i = 0;
 
 	nih_assert (class);
 
+	registered = job_class_get_registered (class->name, class->session);
+	if (! registered)
+		return -1;
+
+	if (job_class_indexed)
+		return registered->state_index;
+
 	NIH_HASH_FOREACH (job_classes, iter) {
 		JobClass *c = (JobClass *)iter;
 
-		if (! strcmp (c->name, class->name)
-				&& c->session == class->session)
-			return i;
-		i++;
+		if (job_class_index_cmp (&c, &registered) < 0)
+			i++;
 	}
 
-	return -1;
+	return i;
+}
+
+/**
+ * job_class_index_build:
+ *
+ * Stamp each registered job class with its index so that
+ * job_class_get_index() can find it without walking the whole table.
+ * The index must be discarded with job_class_index_clear() before the
+ * job classes hash is next modified.
+ **/
+void
+job_class_index_build (void)
+{
+	nih_local JobClass **classes = NULL;
+	size_t               len;
+
+	classes = job_class_sorted (NULL, &len);
+
+	for (size_t i = 0; i < len; i++)
+		classes[i]->state_index = i;
+
+	job_class_indexed = TRUE;
+}
+
+/**
+ * job_class_index_clear:
+ *
+ * Discard the index created by job_class_index_build().
+ **/
+void
+job_class_index_clear (void)
+{
+	job_class_indexed = FALSE;
+}
+
+/**
+ * job_class_sorted:
+ * @parent: parent object for new array,
+ * @len: set to the number of registered job classes.
+ *
+ * Collects the registered job classes in the order of their indexes.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned array.  When all parents
+ * of the returned array are freed, the returned array will also be
+ * freed.
+ *
+ * Returns: newly allocated array of @len job classes.
+ **/
+static JobClass **
+job_class_sorted (const void *parent,
+		  size_t     *len)
+{
+	JobClass **classes;
+	size_t     i = 0;
+
+	nih_assert (len != NULL);
+
+	job_class_init ();
+
+	*len = 0;
+	NIH_HASH_FOREACH (job_classes, iter)
+		(*len)++;
+
+	classes = NIH_MUST (nih_alloc (parent,
+				       sizeof (JobClass *) * (*len + 1)));
+
+	NIH_HASH_FOREACH (job_classes, iter)
+		classes[i++] = (JobClass *)iter;
+
+	qsort (classes, *len, sizeof (JobClass *), job_class_index_cmp);
+
+	return classes;
+}
+
+/**
+ * job_class_index_cmp:
+ * @a: pointer to first job class,
+ * @b: pointer to second job class.
+ *
+ * Compares two registered job classes for qsort(), by name and then by
+ * the index of their session.
+ *
+ * Returns: negative, zero or positive value as @a is before, the same as
+ * or after @b.
+ **/
+static int
+job_class_index_cmp (const void *a,
+		     const void *b)
+{
+	const JobClass *class_a = *(JobClass * const *)a;
+	const JobClass *class_b = *(JobClass * const *)b;
+	int             ret;
+
+	ret = strcmp (class_a->name, class_b->name);
+	if (ret)
+		return ret;
+
+	return (session_get_index (class_a->session)
+		- session_get_index (class_b->session));
 }
 
 /**
@@ -2724,6 +4562,19 @@ job_class_induct_job (JobClass *class)
 
 	job_class_init ();
 
+	if (job_class_load (class) < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_warn ("%s: %s: %s", class->name,
+			  _("Unable to load job definition"),
+			  err->message);
+		nih_free (err);
+
+		event_operator_reset (class->start_on);
+		return FALSE;
+	}
+
 	/* Construct the environment for the new instance
 	 * from the class and the start events.
 	 */
@@ -2734,9 +4585,7 @@ job_class_induct_job (JobClass *class)
 				"UPSTART_EVENTS"));
 
 	/* Expand the instance name against the environment */
-	name = NIH_SHOULD (environ_expand (NULL,
-				class->instance,
-				env));
+	name = NIH_SHOULD (job_class_instance_name (NULL, class, env));
 	if (! name) {
 		NihError *err;
 
@@ -25,6 +25,7 @@
 #include <sys/types.h>
 #include <sys/resource.h>
 
+#include <stdint.h>
 #include <time.h>
 
 #include <nih/macros.h>
@@ -37,6 +38,8 @@
 #include "event_operator.h"
 #include "session.h"
 
+#include "com.ubuntu.Upstart.Job.h"
+
 
 /**
  * ExpectType:
@@ -44,12 +47,20 @@
  * This is used to determine what to expect to happen before moving the job
  * from the spawned state.  EXPECT_NONE means that we don't expect anything
  * so the job will move directly out of the spawned state without waiting.
+ * EXPECT_DAEMON_PASSIVE and EXPECT_FORK_PASSIVE are as EXPECT_DAEMON and
+ * EXPECT_FORK but follow the forks from proc connector events rather than
+ * by tracing, and so without stopping the process.  EXPECT_NOTIFY waits
+ * for the process to send READY=1 to the socket given to it in
+ * NOTIFY_SOCKET.
  **/
 typedef enum expect_type {
 	EXPECT_NONE,
 	EXPECT_STOP,
 	EXPECT_DAEMON,
-	EXPECT_FORK
+	EXPECT_FORK,
+	EXPECT_DAEMON_PASSIVE,
+	EXPECT_FORK_PASSIVE,
+	EXPECT_NOTIFY
 } ExpectType;
 
 /**
@@ -61,15 +72,59 @@ typedef enum expect_type {
  * - CONSOLE_OUTPUT: the console device (non-owning process),
  * - CONSOLE_OWNER: the console device (owning process),
  * - CONSOLE_LOG: stdin is mapped to /dev/null and standard output and error
- *   are redirected to the built-in logger (this is the default).
+ *   are redirected to the built-in logger (this is the default),
+ * - CONSOLE_SOCKET: stdin is mapped to /dev/null and standard output and
+ *   error are connected directly to a log collector's socket.
  **/
 typedef enum console_type {
 	CONSOLE_NONE,
 	CONSOLE_OUTPUT,
 	CONSOLE_OWNER,
-	CONSOLE_LOG
+	CONSOLE_LOG,
+	CONSOLE_SOCKET
 } ConsoleType;
 
+/**
+ * JobResource:
+ *
+ * Resources accounted to job instances and classes as each of their
+ * processes is reaped:
+ * - JOB_RESOURCE_PROCESSES: number of processes reaped,
+ * - JOB_RESOURCE_USER_TIME: CPU time spent in user mode (microseconds),
+ * - JOB_RESOURCE_SYSTEM_TIME: CPU time spent in the kernel (microseconds),
+ * - JOB_RESOURCE_MAX_RSS: largest resident set size seen (kilobytes),
+ * - JOB_RESOURCE_READ_BLOCKS: blocks read from the filesystem,
+ * - JOB_RESOURCE_WRITE_BLOCKS: blocks written to the filesystem.
+ *
+ * All but JOB_RESOURCE_MAX_RSS are totals.
+ **/
+typedef enum job_resource {
+	JOB_RESOURCE_PROCESSES,
+	JOB_RESOURCE_USER_TIME,
+	JOB_RESOURCE_SYSTEM_TIME,
+	JOB_RESOURCE_MAX_RSS,
+	JOB_RESOURCE_READ_BLOCKS,
+	JOB_RESOURCE_WRITE_BLOCKS,
+	JOB_RESOURCE_LAST
+} JobResource;
+
+
+/**
+ * JobInstancePart:
+ * @text: literal text, or name of variable, within the compiled instance
+ *  name template,
+ * @len: length of @text,
+ * @var: TRUE if @text is the name of a variable to substitute.
+ *
+ * One piece of the instance name template of a job class as split up by
+ * job_class_instance_compile().
+ **/
+typedef struct job_instance_part {
+	const char *text;
+	size_t      len;
+	int         var;
+} JobInstancePart;
+
 
 /**
  * JOB_DEFAULT_KILL_TIMEOUT:
@@ -94,6 +149,14 @@ typedef enum console_type {
  **/
 #define JOB_DEFAULT_RESPAWN_INTERVAL 5
 
+/**
+ * JOB_CLASS_LAZY_MAX:
+ *
+ * Maximum number of idle lazily-loaded job classes whose definition is
+ * kept in memory after their last instance has finished.
+ **/
+#define JOB_CLASS_LAZY_MAX 16
+
 /**
  * JOB_DEFAULT_UMASK:
  *
@@ -115,6 +178,36 @@ typedef enum console_type {
  **/
 #define JOB_DEFAULT_OOM_SCORE_ADJ 0
 
+/**
+ * JOB_PLACEMENT_MAX:
+ *
+ * Number of processors, and of NUMA nodes, that may be named in the
+ * cpu-affinity and numa stanzas.
+ **/
+#define JOB_PLACEMENT_MAX 1024
+
+/**
+ * JOB_PLACEMENT_LONGS:
+ *
+ * Number of unsigned longs in a mask of JOB_PLACEMENT_MAX bits.
+ **/
+#define JOB_PLACEMENT_LONGS (JOB_PLACEMENT_MAX / (8 * sizeof (unsigned long)))
+
+/**
+ * JOB_SCHED_INVALID:
+ *
+ * The scheduling policy for processes when no policy is set.
+ **/
+#define JOB_SCHED_INVALID -1
+
+/**
+ * JOB_IOPRIO_DEFAULT_LEVEL:
+ *
+ * The I/O priority level within the realtime and best-effort classes
+ * when none is given.
+ **/
+#define JOB_IOPRIO_DEFAULT_LEVEL 4
+
 /**
  * JOB_DEFAULT_ENVIRONMENT:
  *
@@ -127,6 +220,48 @@ typedef enum console_type {
 	"TERM"
 
 
+/**
+ * JobNumaPolicy:
+ *
+ * Memory policy job processes are given, if any.
+ **/
+typedef enum job_numa_policy {
+	JOB_NUMA_DEFAULT,
+	JOB_NUMA_BIND,
+	JOB_NUMA_INTERLEAVE,
+} JobNumaPolicy;
+
+/**
+ * JobIoprioClass:
+ *
+ * I/O scheduling class job processes are given, if any; these have the
+ * values of the kernel's IOPRIO_CLASS_* constants.
+ **/
+typedef enum job_ioprio_class {
+	JOB_IOPRIO_NONE,
+	JOB_IOPRIO_REALTIME,
+	JOB_IOPRIO_BEST_EFFORT,
+	JOB_IOPRIO_IDLE,
+} JobIoprioClass;
+
+/**
+ * JobPlacement:
+ * @cpus: mask of processors the processes may run on, or all zero to
+ *  inherit ours,
+ * @numa_policy: memory policy of the processes,
+ * @numa_nodes: mask of memory nodes for @numa_policy, or all zero for
+ *  every node we may use.
+ *
+ * Processors and memory nodes that job processes are placed on, in the
+ * layout the kernel expects of masks.
+ **/
+typedef struct job_placement {
+	unsigned long cpus[JOB_PLACEMENT_LONGS];
+	JobNumaPolicy numa_policy;
+	unsigned long numa_nodes[JOB_PLACEMENT_LONGS];
+} JobPlacement;
+
+
 /**
  * JobClass:
  * @entry: list header,
@@ -148,17 +283,44 @@ typedef enum console_type {
  * @task: start requests are not unblocked until instances have finished,
  * @kill_timeout: time to wait between sending TERM and KILL signals,
  * @kill_signal: first signal to send (usually SIGTERM),
+ * @kill_cgroup: signal every process in the cgroups of instances rather
+ * than the process group of the process being stopped,
  * @reload_signal: reload signal to send (usually SIGHUP),
  * @respawn: instances should be restarted if main process fails,
  * @respawn_limit: number of respawns in @respawn_interval that we permit,
  * @respawn_interval: barrier for @respawn_limit,
+ * @respawn_backoff_initial: seconds to delay the first respawn, or zero
+ *  to respawn immediately subject to @respawn_limit,
+ * @respawn_backoff_max: maximum seconds to delay a respawn, also the
+ *  time the main process must run for before the delay is reset,
+ * @respawn_backoff_jitter: percentage by which each delay is randomly
+ *  varied,
  * @normalexit: array of exit codes that prevent a respawn,
  * @normalexit_len: length of @normalexit array,
  * @console: how to arrange processes' stdin/out/err file descriptors,
+ * @console_socket: path of log collector's socket for CONSOLE_SOCKET,
+ * @log_limit_rate: bytes per second of output logged for CONSOLE_LOG
+ *  processes (0 for unlimited),
+ * @log_limit_burst: bytes of output above @log_limit_rate that may be
+ *  logged at once,
+ * @log_limit_size: maximum bytes of output buffered while the log file
+ *  cannot be written (0 for unlimited),
  * @umask: file mode creation mask,
  * @nice: process priority,
+ * @priority: order instances are admitted in by the spawn limit,
+ *  highest first,
  * @oom_score_adj: OOM killer score adjustment,
+ * @sched_policy: scheduling policy of processes, or JOB_SCHED_INVALID
+ *  to inherit ours,
+ * @sched_priority: static priority for the SCHED_FIFO and SCHED_RR
+ *  policies,
+ * @ioprio_class: I/O scheduling class of processes,
+ * @ioprio_level: I/O priority level within @ioprio_class,
+ * @timer_slack: timer slack of processes in nanoseconds, or 0 to
+ *  inherit ours,
  * @limits: resource limits indexed by resource,
+ * @placement: processors and memory nodes of processes, or NULL to
+ *  inherit ours,
  * @chroot: root directory of process (implies @chdir if not set),
  * @chdir: working directory of process,
  * @setuid: user name to drop to before starting process,
@@ -169,7 +331,33 @@ typedef enum console_type {
  * @cgroups: list of CGroup objects representing the cgroups the
  *  job is required to run in,
  * @cgmanager_wait: TRUE if job waiting for cgroup manager to be
- * available.
+ * available,
+ * @event_refs: parent of this class's entries in job_class_events, or NULL
+ *  if the class is not currently indexed,
+ * @state_index: position of the class in job_classes, only meaningful
+ *  while a serialisation index exists (see job_class_index_build()),
+ * @env_cache: base environment for instances of the class as built by
+ *  job_class_environment(),
+ * @env_cache_generation: job environment generation @env_cache was
+ *  built from,
+ * @instance_template: copy of @instance that @instance_parts was compiled
+ *  from, or NULL if not yet compiled,
+ * @instance_parts: pieces of @instance_template, or NULL if it needs full
+ *  expansion,
+ * @instance_parts_len: number of entries in @instance_parts,
+ * @lazy: TRUE if the definition of the class may be dropped while it
+ *  has no instances, and loaded again from its configuration file by
+ *  job_class_load() when it next needs one,
+ * @loaded: FALSE if @process, @env, @limits and @apparmor_switch have
+ *  been dropped,
+ * @lazy_entry: entry for the class in the list of idle lazy classes whose
+ *  definition is loaded, or NULL,
+ * @resources: resources used by the processes of every instance of the
+ *  class, and of the definitions it replaced, indexed by JobResource,
+ * @recycled: list of finished Job structures kept for reuse by job_new(),
+ * @recycled_len: number of entries in @recycled,
+ * @generation: state generation the class was created in (see
+ *  state_touch()).
  *
  * This structure holds the configuration of a known task or service that
  * should be tracked by the init daemon; as tasks and services are
@@ -203,22 +391,37 @@ typedef struct job_class {
 
 	time_t          kill_timeout;
 	int             kill_signal;
+	int             kill_cgroup;
 
 	int             reload_signal;
 
 	int             respawn;
 	int             respawn_limit;
 	time_t          respawn_interval;
+	time_t          respawn_backoff_initial;
+	time_t          respawn_backoff_max;
+	int             respawn_backoff_jitter;
 
 	int            *normalexit;
 	size_t          normalexit_len;
 
 	ConsoleType     console;
+	char           *console_socket;
+	size_t          log_limit_rate;
+	size_t          log_limit_burst;
+	size_t          log_limit_size;
 
 	mode_t          umask;
 	int             nice;
+	int             priority;
 	int             oom_score_adj;
+	int             sched_policy;
+	int             sched_priority;
+	JobIoprioClass  ioprio_class;
+	int             ioprio_level;
+	unsigned long   timer_slack;
 	struct rlimit  *limits[RLIMIT_NLIMITS];
+	JobPlacement   *placement;
 	char           *chroot;
 	char           *chdir;
 	char           *setuid;
@@ -232,12 +435,52 @@ typedef struct job_class {
 	char	       *apparmor_switch;
 	NihList         cgroups;
 	int             cgmanager_wait;
+
+	void           *event_refs;
+	ssize_t         state_index;
+
+	char          **env_cache;
+	unsigned int    env_cache_generation;
+
+	char           *instance_template;
+	JobInstancePart *instance_parts;
+	size_t          instance_parts_len;
+
+	int             lazy;
+	int             loaded;
+	NihListEntry   *lazy_entry;
+
+	uint64_t        resources[JOB_RESOURCE_LAST];
+
+	NihList         recycled;
+	size_t          recycled_len;
+
+	uint64_t        generation;
 } JobClass;
 
+/**
+ * JobClassEventIndex:
+ * @entry: list header,
+ * @name: name of event,
+ * @classes: list of NihListEntry structures whose data member is a
+ *  registered JobClass referencing @name in its start on or stop on
+ *  condition.
+ *
+ * This structure is used to index the registered job classes by the
+ * events they are interested in, so that an event need only be offered
+ * to those classes which could possibly match it.
+ **/
+typedef struct job_class_event_index {
+	NihList   entry;
+	char     *name;
+	NihList   classes;
+} JobClassEventIndex;
+
 
 NIH_BEGIN_EXTERN
 
 extern NihHash  *job_classes;
+extern NihHash  *job_class_events;
 
 void        job_class_init                 (void);
 
@@ -266,6 +509,13 @@ int         job_class_reconsider           (JobClass *class);
 
 void        job_class_add_safe             (JobClass *class);
 
+void        job_class_unload               (JobClass *class);
+int         job_class_load                 (JobClass *class)
+	__attribute__ ((warn_unused_result));
+void        job_class_load_from            (JobClass *class, JobClass *from);
+void        job_class_release              (JobClass *class);
+void        job_class_share                (JobClass *class);
+
 void        job_class_register             (JobClass *class,
 					    DBusConnection *conn, int signal);
 void        job_class_unregister           (JobClass *class,
@@ -275,6 +525,10 @@ char      **job_class_environment          (const void *parent,
 					    JobClass *class, size_t *len)
 	__attribute__ ((warn_unused_result));
 
+char *      job_class_instance_name        (const void *parent,
+					    JobClass *class,
+					    char * const *env)
+	__attribute__ ((warn_unused_result, malloc));
 
 int         job_class_get_instance         (JobClass *class,
 					    NihDBusMessage *message,
@@ -321,6 +575,9 @@ int         job_class_get_version          (JobClass *class,
 					    char **version)
 	__attribute__ ((warn_unused_result));
 
+char ***    job_class_condition_array      (const void *parent,
+					    EventOperator *condition)
+	__attribute__ ((warn_unused_result, malloc));
 int         job_class_get_start_on         (JobClass *class,
 					    NihDBusMessage *message,
 					    char ****start_on);
@@ -333,6 +590,33 @@ int         job_class_get_emits	           (JobClass *class,
 int         job_class_get_usage	           (JobClass *class,
 					    NihDBusMessage *message,
 					    char **usage);
+int         job_class_get_resources        (JobClass *class,
+					    NihDBusMessage *message,
+					    JobClassResourcesElement ***resources)
+	__attribute__ ((warn_unused_result));
+int         job_class_get_scheduling       (JobClass *class,
+					    NihDBusMessage *message,
+					    char ***scheduling)
+	__attribute__ ((warn_unused_result));
+
+const char *job_sched_policy_name          (int policy)
+	__attribute__ ((const, warn_unused_result));
+int         job_sched_policy_from_name     (const char *name)
+	__attribute__ ((warn_unused_result));
+const char *job_ioprio_class_name          (JobIoprioClass ioprio_class)
+	__attribute__ ((const, warn_unused_result));
+JobIoprioClass job_ioprio_class_from_name  (const char *name)
+	__attribute__ ((warn_unused_result));
+
+const char *job_resource_name              (JobResource resource)
+	__attribute__ ((const, warn_unused_result));
+void        job_resources_add              (uint64_t *resources,
+					    const uint64_t *usage);
+json_object *job_resources_serialise       (const uint64_t *resources)
+	__attribute__ ((warn_unused_result));
+int         job_resources_deserialise      (json_object *json,
+					    uint64_t *resources)
+	__attribute__ ((warn_unused_result));
 
 const char *
 job_class_console_type_enum_to_str (ConsoleType console)
@@ -352,6 +636,9 @@ job_class_expect_type_str_to_enum (const char *name)
 
 ConsoleType job_class_console_type         (const char *console)
 	__attribute__ ((warn_unused_result));
+int         job_class_placement_list       (const char *list,
+					    unsigned long *mask)
+	__attribute__ ((warn_unused_result));
 
 json_object *job_class_serialise (JobClass *class)
 	__attribute__ ((warn_unused_result));
@@ -359,6 +646,9 @@ json_object *job_class_serialise (JobClass *class)
 JobClass *job_class_deserialise (json_object *json)
 	__attribute__ ((warn_unused_result));
 
+JobClass *job_class_deserialise_config (json_object *json, const char *name)
+	__attribute__ ((warn_unused_result));
+
 json_object * job_class_serialise_all (void)
 	__attribute__ ((warn_unused_result));
 
@@ -376,6 +666,9 @@ int job_class_deserialise_job_environ (json_object *json)
 
 void job_class_prepare_reexec (void);
 
+int *job_class_reexec_fds (const void *parent)
+	__attribute__ ((warn_unused_result, malloc));
+
 time_t     job_class_max_kill_timeout (void)
 	__attribute__ ((warn_unused_result));
 
@@ -388,6 +681,9 @@ ssize_t
 job_class_get_index (const JobClass *class)
 	__attribute__ ((warn_unused_result));
 
+void       job_class_index_build (void);
+void       job_class_index_clear (void);
+
 int job_class_induct_job (JobClass *class)
 	__attribute__ ((warn_unused_result));
 
@@ -32,9 +32,24 @@
 #include <sys/ptrace.h>
 #include <sys/resource.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif /* HAVE_MEMFD_CREATE */
+
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include <linux/mempolicy.h>
 
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sched.h>
 #include <stdio.h>
 #include <limits.h>
 #include <signal.h>
@@ -51,6 +66,8 @@
 #include <nih/macros.h>
 #include <nih/alloc.h>
 #include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
 #include <nih/signal.h>
 #include <nih/io.h>
 #include <nih/logging.h>
@@ -64,8 +81,13 @@
 #include "job_process.h"
 #include "job_class.h"
 #include "job.h"
+#include "spawn_helper.h"
+#include "metrics.h"
+#include "probes.h"
 #include "errors.h"
 #include "control.h"
+#include "quiesce.h"
+#include "state.h"
 #include "xdg.h"
 #include "apparmor.h"
 
@@ -81,6 +103,56 @@
  **/
 #define SHELL_CHARS "~`!$^&*()=|\\{}[];\"'<>?"
 
+/**
+ * JOB_PROCESS_ANCESTRY_MAX:
+ *
+ * Number of parents of a process given by MAINPID= that are examined
+ * looking for the current main process.
+ **/
+#define JOB_PROCESS_ANCESTRY_MAX 64
+
+
+/**
+ * JOB_PROCESS_CLONE_STACK_SIZE:
+ *
+ * Size of the stack a child spawned by job_process_clone() runs on until
+ * it calls exec.
+ **/
+#define JOB_PROCESS_CLONE_STACK_SIZE (64 * 1024)
+
+
+/**
+ * JobProcessClone:
+ * @class: class of job being spawned,
+ * @process: job process being spawned,
+ * @argv: NULL-terminated list of arguments to execute,
+ * @env: environment for the new process,
+ * @orig_set: signal mask to restore before exec,
+ * @error_fd: writing end of the error pipe,
+ * @reading_fd: reading end of the error pipe,
+ * @script_fd: descriptor to move to JOB_PROCESS_SCRIPT_FD, or -1,
+ * @pty_slave: pty slave for stdout and stderr if console logging, or -1,
+ * @groups: supplementary groups to set, or NULL to leave them alone,
+ * @num_groups: number of entries in @groups.
+ *
+ * Everything a child spawned by job_process_clone() needs; since it
+ * shares our memory until it execs it mustn't allocate, raise errors or
+ * look anything up itself, so all of that is done beforehand by
+ * job_process_clone_prepare().
+ **/
+typedef struct job_process_clone {
+	JobClass      *class;
+	ProcessType    process;
+	char * const  *argv;
+	char * const  *env;
+	sigset_t       orig_set;
+	int            error_fd;
+	int            reading_fd;
+	int            script_fd;
+	int            pty_slave;
+	gid_t         *groups;
+	int            num_groups;
+} JobProcessClone;
 
 /**
  * JobProcessWireError:
@@ -95,6 +167,16 @@ typedef struct job_process_wire_error {
 	int                 errnum;
 } JobProcessWireError;
 
+/**
+ * job_process_pids:
+ *
+ * This hash table holds the list of supervised processes indexed by
+ * their process id, so that job_process_find() need not search every
+ * job; each entry is a JobProcessPid structure.  It is maintained by
+ * job_process_set_pid().
+ **/
+NihHash *job_process_pids = NULL;
+
 /**
  * log_dir:
  *
@@ -110,8 +192,82 @@ char *log_dir = NULL;
  **/
 int disable_respawn = FALSE;
 
+/**
+ * disable_clone_spawn:
+ *
+ * If TRUE, always spawn job processes with fork() rather than using
+ * job_process_clone() for those that need no complex setup.
+ **/
+int disable_clone_spawn = FALSE;
+
+/**
+ * job_process_proc_fd:
+ *
+ * Netlink socket receiving proc connector events, used to follow the
+ * forks of jobs that expect to become a daemon or fork passively, or -1
+ * if not yet opened.
+ **/
+static int job_process_proc_fd = -1;
+
+/**
+ * job_process_proc_watch:
+ *
+ * Watch on job_process_proc_fd, or NULL if not yet opened.
+ **/
+static NihIoWatch *job_process_proc_watch = NULL;
+
+/**
+ * job_process_proc_reading:
+ *
+ * TRUE while reading events from job_process_proc_fd, during which
+ * job_process_proc_release() must leave the socket open.
+ **/
+static int job_process_proc_reading = FALSE;
+
+/**
+ * job_process_scripts:
+ *
+ * Processes holding a memory file created by job_process_script_fd(),
+ * least recently run first; each entry is a Process structure.
+ **/
+static NihList *job_process_scripts = NULL;
+
+/**
+ * job_process_rusage:
+ *
+ * Resources used by our children reaped so far, as last obtained from
+ * getrusage() by job_process_account() or job_process_account_init().
+ **/
+static struct rusage job_process_rusage;
+
+#ifdef ENABLE_CGROUPS
+/**
+ * job_process_cgroup_placed:
+ *
+ * Set in a child that job_process_fork() created inside the cgroup of
+ * its job, so that it needn't move itself there.
+ **/
+static int job_process_cgroup_placed = FALSE;
+#endif /* ENABLE_CGROUPS */
+
+/**
+ * CLONE_INTO_CGROUP:
+ *
+ * clone3() flag to create the child in the cgroup given by descriptor,
+ * for C libraries that predate it.
+ **/
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif /* CLONE_INTO_CGROUP */
+
 /* Prototypes for static functions */
 static void job_process_remap_fd        (int *fd, int reserved_fd, int error_fd);
+static pid_t job_process_fork           (int cgroup_fd);
+#ifdef HAVE_MEMFD_CREATE
+static void job_process_scripts_trim    (size_t keep);
+#endif /* HAVE_MEMFD_CREATE */
+static int  job_process_signal          (Job *job, ProcessType process,
+					 int signal);
 
 /**
  * disable_job_logging:
@@ -121,6 +277,15 @@ static void job_process_remap_fd        (int *fd, int reserved_fd, int error_fd)
  **/
 int disable_job_logging = 0;
 
+/**
+ * job_output_console:
+ *
+ * If TRUE while job logging is disabled, the output of jobs that would
+ * have been logged is written to the system console rather than
+ * discarded, so it goes wherever that of init itself was sent.
+ **/
+int job_output_console = FALSE;
+
 /**
  * no_inherit_env:
  *
@@ -130,11 +295,18 @@ int disable_job_logging = 0;
 int no_inherit_env = FALSE;
 
 /* Prototypes for static functions */
-static void job_process_kill_timer      (Job *job, NihTimer *timer);
+static void job_process_pids_init       (void);
+static const void *job_process_pid_key  (NihList *entry);
+static uint32_t job_process_pid_hash    (const void *key);
+static int  job_process_pid_cmp         (const void *key1, const void *key2);
+static void job_process_kill_timer      (Job *job, WheelTimer *timer);
 static void job_process_terminated      (Job *job, ProcessType process,
 					 int status, int state_only);
 static int  job_process_catch_runaway   (Job *job);
+static uint64_t job_process_respawn_backoff (Job *job);
+static void job_process_respawn_timer   (Job *job, WheelTimer *timer);
 static void job_process_stopped         (Job *job, ProcessType process);
+static void job_process_account         (Job *job, NihChildEvents event);
 static void job_process_trace_new       (Job *job, ProcessType process);
 static void job_process_trace_new_child (Job *job, ProcessType process);
 static void job_process_trace_signal    (Job *job, ProcessType process,
@@ -142,10 +314,57 @@ static void job_process_trace_signal    (Job *job, ProcessType process,
 static void job_process_trace_fork      (Job *job, ProcessType process);
 static void job_process_trace_exec      (Job *job, ProcessType process);
 
+static void job_process_proc_watcher   (void *data, NihIoWatch *watch,
+					NihIoEvents events);
+static int  job_process_proc_send      (enum proc_cn_mcast_op op);
+static int  job_process_proc_read      (int *acked);
+static void job_process_passive_fork   (Job *job, ProcessType process,
+					pid_t pid);
+static void job_process_passive_exec   (Job *job, ProcessType process);
+
+static void job_process_notify_watcher (Job *job, NihIoWatch *watch,
+					NihIoEvents events);
+static int  job_process_notify_read    (Job *job);
+static int  job_process_notify_message (Job *job, char *msg);
+static int  job_process_notify_pid     (Job *job, pid_t pid)
+	__attribute__ ((warn_unused_result));
+static pid_t job_process_parent        (pid_t pid)
+	__attribute__ ((warn_unused_result));
+
+static int   job_process_console_socket (JobClass *class, Job *job)
+	__attribute__ ((warn_unused_result));
+static int   job_process_can_clone      (Job *job, ProcessType process,
+					 int trace)
+	__attribute__ ((warn_unused_result));
+static int   job_process_clone_prepare  (JobProcessClone *spawn,
+					 int pty_master)
+	__attribute__ ((warn_unused_result));
+static void  job_process_clone_cleanup  (JobProcessClone *spawn);
+static pid_t job_process_clone          (JobProcessClone *spawn)
+	__attribute__ ((warn_unused_result));
+static int   job_process_clone_child    (void *data)
+	__attribute__ ((noreturn));
+static void  job_process_clone_remap_fd (int *fd, int error_fd);
+static void  job_process_clone_abort    (int fd, JobProcessErrorType type,
+					 int arg)
+	__attribute__ ((noreturn));
+
+static int   job_process_set_affinity   (const JobPlacement *placement)
+	__attribute__ ((warn_unused_result));
+static int   job_process_set_mempolicy  (const JobPlacement *placement)
+	__attribute__ ((warn_unused_result));
+static int   job_process_set_sched      (const JobClass *class)
+	__attribute__ ((warn_unused_result));
+static int   job_process_set_ioprio     (const JobClass *class)
+	__attribute__ ((warn_unused_result));
+static int   job_process_set_resources  (const JobClass *class,
+					 JobProcessErrorType *type,
+					 int *arg)
+	__attribute__ ((warn_unused_result));
+
 extern char         *control_server_address;
 extern int           user_mode;
 extern int           session_end;
-extern time_t        quiesce_phase_time;
 
 
 /**
@@ -166,10 +385,13 @@ extern time_t        quiesce_phase_time;
  * When executed with the shell, if the command (which may be an entire
  * script) is reasonably small (less than 1KB) it is passed to the
  * shell using the POSIX-specified -c option.  Otherwise the shell is told
- * to read commands from one of the special /proc/self/fd/NN devices and NihIo
- * used to feed the script into that device.  A pointer to the NihIo object
- * is not kept or stored because it will automatically clean itself up should
- * the script go away as the other end of the pipe will be closed.
+ * to read commands from one of the special /proc/self/fd/NN devices,
+ * which is a sealed memory file holding the script shared by every
+ * instance (see job_process_script_fd()) or, where those aren't
+ * available, a pipe with an NihIo used to feed the script into it.
+ * A pointer to the NihIo object is not kept or stored because it will
+ * automatically clean itself up should the script go away as the other
+ * end of the pipe will be closed.
  *
  * In either case the shell is run with the -e option so that commands will
  * fail if their exit status is not checked.
@@ -191,11 +413,12 @@ job_process_start (Job                    *job,
 	nih_local char    **argv = NULL;
 	nih_local char    **env = NULL;
 	nih_local char     *script = NULL;
-	char              **e;
 	size_t              argc, envc;
 	int                 fds[2] = { -1, -1 };
-	int                 trace = FALSE, shell = FALSE;
+	int                 script_fd = -1;
+	int                 trace = FALSE, passive = FALSE, shell = FALSE;
 	int                 job_process_fd = -1;
+	pid_t               pid;
 	JobProcessData     *process_data = NULL;
 
 	nih_assert (job);
@@ -255,11 +478,18 @@ job_process_start (Job                    *job,
 		} else {
 			nih_local char *cmd = NULL;
 
-			/* Close the writing end when the child is exec'd */
-			NIH_ZERO (pipe (fds));
-			nih_io_set_cloexec (fds[1]);
+			/* Hand the shell the memory file holding the script
+			 * if we can, otherwise feed it through a pipe; close
+			 * the writing end when the child is exec'd.
+			 */
+			script_fd = job_process_script_fd (proc, script);
+			if (script_fd < 0) {
+				NIH_ZERO (pipe (fds));
+				nih_io_set_cloexec (fds[1]);
 
-			shell = TRUE;
+				script_fd = fds[0];
+				shell = TRUE;
+			}
 
 			cmd = NIH_MUST (nih_sprintf (argv, "%s/%d",
 						     "/proc/self/fd",
@@ -284,13 +514,13 @@ job_process_start (Job                    *job,
 	env = NIH_MUST (nih_str_array_new (NULL));
 
 	if (job->env)
-		NIH_MUST (environ_append (&env, NULL, &envc, TRUE, job->env));
+		NIH_MUST (environ_reference (&env, NULL, &envc, TRUE, job->env));
 
 	if (job->stop_env
 	    && ((process == PROCESS_PRE_STOP)
 		|| (process == PROCESS_POST_STOP)))
-		for (e = job->stop_env; *e; e++)
-			NIH_MUST (environ_set (&env, NULL, &envc, TRUE, *e));
+		NIH_MUST (environ_reference (&env, NULL, &envc, TRUE,
+					     job->stop_env));
 
 	NIH_MUST (environ_set (&env, NULL, &envc, TRUE,
 			       "UPSTART_JOB=%s", job->class->name));
@@ -300,18 +530,62 @@ job_process_start (Job                    *job,
 		NIH_MUST (environ_set (&env, NULL, &envc, TRUE,
 			       "UPSTART_SESSION=%s", control_server_address));
 
+	/* If we expect the main process to tell us when it's ready, give
+	 * it a socket to do so; should that fail, it's treated as if it
+	 * were ready as soon as it has been run.
+	 */
+	if ((process == PROCESS_MAIN)
+	    && (job->class->expect == EXPECT_NOTIFY)) {
+		nih_local char *notify = NULL;
+
+		notify = job_process_notify_open (NULL, job);
+		if (notify) {
+			NIH_MUST (environ_set (&env, NULL, &envc, TRUE,
+					       "NOTIFY_SOCKET=%s", notify));
+		} else {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_warn (_("Not waiting for %s %s process to be "
+				    "ready, unable to create socket: %s"),
+				  job_name (job), process_name (process),
+				  err->message);
+			nih_free (err);
+		}
+	}
+
 	/* If we're about to spawn the main job and we expect it to become
 	 * a daemon or fork before we can move out of spawned, we need to
-	 * set a trace on it.
+	 * set a trace on it; unless we can follow it passively through
+	 * the proc connector instead.
 	 */
 	if ((process == PROCESS_MAIN)
 	    && ((job->class->expect == EXPECT_DAEMON)
 		|| (job->class->expect == EXPECT_FORK)))
 		trace = TRUE;
 
+	if ((process == PROCESS_MAIN)
+	    && ((job->class->expect == EXPECT_DAEMON_PASSIVE)
+		|| (job->class->expect == EXPECT_FORK_PASSIVE))) {
+		if (job_process_proc_init () < 0) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_warn (_("Tracing %s %s process, unable to follow "
+				    "it passively: %s"),
+				  job_name (job), process_name (process),
+				  err->message);
+			nih_free (err);
+
+			trace = TRUE;
+		} else {
+			passive = TRUE;
+		}
+	}
+
 	/* Spawn the process, repeat until fork() works */
-	while ((job->pid[process] = job_process_spawn_with_fd (job, argv, env,
-					trace, fds[0], process, &job_process_fd)) < 0) {
+	while ((pid = job_process_spawn_with_fd (job, argv, env,
+					trace, script_fd, process, &job_process_fd)) < 0) {
 		NihError *err;
 
 		err = nih_error_get ();
@@ -320,11 +594,14 @@ job_process_start (Job                    *job,
 		nih_free (err);
 	}
 
+	job_process_set_pid (job, process, pid);
+
 	nih_info (_("%s %s process (%d)"),
 		  job_name (job), process_name (process), job->pid[process]);
 
 	job->trace_forks = 0;
-	job->trace_state = trace ? TRACE_NEW : TRACE_NONE;
+	job->trace_state = (trace ? TRACE_NEW
+			    : passive ? TRACE_PASSIVE : TRACE_NONE);
 
 	if (shell) {
 		/* Clean up and close the reading end (we don't need it) */
@@ -361,6 +638,135 @@ job_process_start (Job                    *job,
 			job_process_fd, process_data);
 }
 
+/**
+ * job_process_script_fd:
+ * @proc: job process to run,
+ * @script: script the shell is to read for @proc.
+ *
+ * Writes @script into a sealed memory file the first time @proc is run
+ * and keeps a read-only descriptor for it in @proc, so that every
+ * instance of the job reads the same copy without init having to feed
+ * it to each shell.  The descriptor is close-on-exec and above
+ * JOB_PROCESS_SCRIPT_FD so that it is always duplicated onto that in
+ * the child, and is closed along with @proc when the configuration
+ * is reloaded.
+ *
+ * At most JOB_PROCESS_SCRIPT_FDS_MAX descriptors are kept open; once
+ * there are that many, the one of the process run least recently is
+ * closed to make room, and is created again should it be run later.
+ *
+ * Returns: descriptor or -1 if memory files are not available.
+ **/
+int
+job_process_script_fd (Process    *proc,
+		       const char *script)
+{
+#ifdef HAVE_MEMFD_CREATE
+	char    path[PATH_MAX];
+	int     fd;
+	int     ro_fd;
+	size_t  len;
+	size_t  off = 0;
+#endif /* HAVE_MEMFD_CREATE */
+
+	nih_assert (proc != NULL);
+	nih_assert (script != NULL);
+
+#ifdef HAVE_MEMFD_CREATE
+	if (! job_process_scripts)
+		job_process_scripts = NIH_MUST (nih_list_new (NULL));
+
+	if (proc->script_fd != -1) {
+		/* Move to the end, as the most recently run */
+		nih_list_add (job_process_scripts, &proc->entry);
+		return proc->script_fd;
+	}
+
+	job_process_scripts_trim (JOB_PROCESS_SCRIPT_FDS_MAX - 1);
+
+	fd = memfd_create ("upstart-script", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return -1;
+
+	len = strlen (script);
+	while (off < len) {
+		ssize_t ret;
+
+		ret = write (fd, script + off, len - off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			goto error;
+		}
+
+		off += ret;
+	}
+
+	if (fcntl (fd, F_ADD_SEALS, (F_SEAL_SHRINK | F_SEAL_GROW
+				     | F_SEAL_WRITE | F_SEAL_SEAL)) < 0)
+		goto error;
+
+	/* Reopen the file read-only, so that's all the shell can do */
+	sprintf (path, "/proc/self/fd/%d", fd);
+	ro_fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (ro_fd < 0)
+		goto error;
+
+	close (fd);
+
+	if (ro_fd <= JOB_PROCESS_SCRIPT_FD) {
+		fd = fcntl (ro_fd, F_DUPFD_CLOEXEC, JOB_PROCESS_SCRIPT_FD + 1);
+		close (ro_fd);
+		if (fd < 0)
+			return -1;
+
+		ro_fd = fd;
+	}
+
+	proc->script_fd = ro_fd;
+	nih_list_add (job_process_scripts, &proc->entry);
+
+	return proc->script_fd;
+
+error:
+	close (fd);
+#endif /* HAVE_MEMFD_CREATE */
+	return -1;
+}
+
+#ifdef HAVE_MEMFD_CREATE
+/**
+ * job_process_scripts_trim:
+ * @keep: number of memory files to keep.
+ *
+ * Closes the memory files created by job_process_script_fd() for the
+ * processes run least recently until no more than @keep remain open.
+ **/
+static void
+job_process_scripts_trim (size_t keep)
+{
+	size_t count = 0;
+
+	nih_assert (job_process_scripts != NULL);
+
+	NIH_LIST_FOREACH (job_process_scripts, iter)
+		count++;
+
+	NIH_LIST_FOREACH_SAFE (job_process_scripts, iter) {
+		Process *proc = (Process *)iter;
+
+		if (count <= keep)
+			break;
+
+		close (proc->script_fd);
+		proc->script_fd = -1;
+		nih_list_remove (&proc->entry);
+		count--;
+	}
+}
+#endif /* HAVE_MEMFD_CREATE */
+
 /**
  * job_process_spawn_with_fd:
  * @job: job of process to be spawned,
@@ -412,19 +818,17 @@ job_process_spawn_with_fd (Job          *job,
 		   int          *job_process_fd)
 {
 	sigset_t        child_set, orig_set;
-	pid_t           pid;
-	int             i, fds[2] = { -1, -1 };
+	pid_t           pid = -1;
+	int             fds[2] = { -1, -1 };
 	int             pty_master = -1;
-	int             pty_slave = -1;
-	char            pts_name[PATH_MAX];
-	char            filename[PATH_MAX];
-	FILE           *fd;
+	int             pty_offloaded = FALSE;
 	nih_local char *log_path = NULL;
 	JobClass       *class;
-	uid_t           job_setuid = -1;
-	gid_t           job_setgid = -1;
-	struct passwd   *pwd = NULL;
-	struct group    *grp = NULL;
+	JobProcessClone  spawn;
+	int              cloned = FALSE;
+	uint64_t         started;
+
+	int              cgroup_fd = -1;
 
 #ifdef ENABLE_CGROUPS
 	int              cgroups_needed = FALSE;
@@ -439,6 +843,8 @@ job_process_spawn_with_fd (Job          *job,
 
 	nih_assert (class != NULL);
 
+	started = job_timing_now ();
+
 #ifdef ENABLE_CGROUPS
 
 	cgroups_needed = job_needs_cgroups (job);
@@ -448,7 +854,7 @@ job_process_spawn_with_fd (Job          *job,
 			nih_return_error (-1, CGROUP_ERROR, _("cgroup support not available"));
 
 		/* Should never happen */
-		if (! cgroup_manager_available ())
+		if (! cgroup_available ())
 			nih_return_error (-1, CGROUP_ERROR, _("cgroup manager not available"));
 	}
 
@@ -461,7 +867,8 @@ job_process_spawn_with_fd (Job          *job,
 		nih_return_system_error (-1);
 
 	if (class->console == CONSOLE_LOG && disable_job_logging)
-			class->console = CONSOLE_NONE;
+			class->console = (job_output_console
+					  ? CONSOLE_OUTPUT : CONSOLE_NONE);
 
 	if (class->console == CONSOLE_LOG) {
 		NihError *err;
@@ -507,16 +914,46 @@ job_process_spawn_with_fd (Job          *job,
 		 */
 		nih_io_set_cloexec (pty_master);
 
-		/* pty_master will be closed by log_destroy() */
-		job->log[process] = log_new (job->log, log_path, pty_master, 0);
-		if (! job->log[process]) {
-			close (pty_master);
-			close (fds[0]);
-			close (fds[1]);
-			nih_return_system_error (-1);
+		/* The job output logger has no structured store */
+		if (log_offload && ! log_store
+				&& log_offload_send (log_path, pty_master,
+					class->log_limit_rate,
+					class->log_limit_burst,
+					class->log_limit_size) == 0) {
+			/* The logger now has its own copy of pty_master,
+			 * ours is closed once the child has been forked.
+			 */
+			pty_offloaded = TRUE;
+		} else {
+			/* pty_master will be closed by log_destroy() */
+			job->log[process] = log_new (job->log, log_path, pty_master, 0);
+			if (! job->log[process]) {
+				close (pty_master);
+				close (fds[0]);
+				close (fds[1]);
+				nih_return_system_error (-1);
+			}
+
+			log_set_limits (job->log[process], class->log_limit_rate,
+					class->log_limit_burst, class->log_limit_size);
+			log_set_store (job->log[process], process, 0);
 		}
 	}
 
+#ifdef ENABLE_CGROUPS
+	/* Create the cgroups of jobs that run as us now so that the child
+	 * can be created inside them; should that fail, the child creates
+	 * them itself and reports the error in the usual way.
+	 */
+	if (cgroups_needed && cgroup_unified_available ()
+	    && (! class->setuid) && (! class->setgid)) {
+		cgroup_fd = cgroup_unified_setup (&class->cgroups, env,
+						  geteuid (), getegid ());
+		if (cgroup_fd < 0)
+			nih_free (nih_error_get ());
+	}
+#endif /* ENABLE_CGROUPS */
+
 	/* Block all signals while we fork to avoid the child process running
 	 * our own signal handlers before we've reset them all back to the
 	 * default.
@@ -531,11 +968,70 @@ job_process_spawn_with_fd (Job          *job,
 	 */
 	fflush (NULL);
 
-	/* Fork the child process, handling success and failure by resetting
-	 * the signal mask and returning the new process id or a raised error.
+	UPSTART_PROBE (job_spawn, job, class->name, job->name, process);
+
+	/* Processes that need no complex setup are spawned without copying
+	 * our page tables, otherwise fork the child process.  In either case
+	 * handle success and failure by resetting the signal mask and
+	 * returning the new process id or a raised error.
+	 */
+	if ((! disable_clone_spawn)
+	    && job_process_can_clone (job, process, trace)) {
+		spawn.class = class;
+		spawn.process = process;
+		spawn.argv = argv;
+		spawn.env = env;
+		spawn.orig_set = orig_set;
+		spawn.error_fd = fds[1];
+		spawn.reading_fd = fds[0];
+		spawn.script_fd = script_fd;
+
+		cloned = (job_process_clone_prepare (&spawn, pty_master) == 0);
+	}
+
+	/* Others are passed to the spawn helper where there is one, which
+	 * is small enough to fork cheaply; should it fail for any reason,
+	 * fork the child ourselves instead.
 	 */
-	pid = fork ();
+	if (cloned) {
+		int saved_errno;
+
+		pid = job_process_clone (&spawn);
+
+		saved_errno = errno;
+		job_process_clone_cleanup (&spawn);
+		errno = saved_errno;
+	} else {
+		if (spawn_helper_wanted (job, process, trace))
+			pid = spawn_helper_spawn (job, process, argv, env,
+						  script_fd, fds[1], pty_master);
+
+		if (pid < 0)
+			pid = job_process_fork (cgroup_fd);
+	}
+
+	if (cgroup_fd >= 0 && pid != 0) {
+		int saved_errno;
+
+		saved_errno = errno;
+		close (cgroup_fd);
+		errno = saved_errno;
+	}
+
 	if (pid > 0) {
+		job->timings.fork[process] = job_timing_now ();
+
+		UPSTART_PROBE (job_spawned, job, class->name, job->name,
+			       process, pid);
+
+		metrics_count (METRICS_PROCESSES_SPAWNED);
+		metrics_record (METRICS_SPAWN_LATENCY,
+				job->timings.fork[process] - started);
+
+		if (metrics_startup_begin && (! metrics_first_spawn_time))
+			metrics_first_spawn_time = (job->timings.fork[process]
+						    - metrics_startup_begin);
+
 		if (class->debug) {
 			nih_info (_("Pausing %s (%d) [pre-exec] for debug"),
 			  class->name, pid);
@@ -544,6 +1040,9 @@ job_process_spawn_with_fd (Job          *job,
 		sigprocmask (SIG_SETMASK, &orig_set, NULL);
 		close (fds[1]);
 
+		if (pty_offloaded)
+			close (pty_master);
+
 		*job_process_fd = fds[0];
 
 		nih_io_set_cloexec (*job_process_fd);
@@ -551,38 +1050,214 @@ job_process_spawn_with_fd (Job          *job,
 		return pid;
 	} else if (pid < 0) {
 		nih_error_raise_system ();
+		metrics_count (METRICS_FORKS_FAILED);
 
 		sigprocmask (SIG_SETMASK, &orig_set, NULL);
 		close (fds[0]);
 		close (fds[1]);
-		if (class->console == CONSOLE_LOG) {
+		if (pty_offloaded) {
+			close (pty_master);
+		} else if (class->console == CONSOLE_LOG) {
 			nih_free (job->log[process]);
 			job->log[process] = NULL;
 		}
 		return -1;
 	}
 
-	/* We're now in the child process.
-	 *
-	 * The rest of this function sets the child up and ends by executing
-	 * the new binary.  Failures are handled by terminating the child
-	 * and writing an error back to the parent.
+	/* We're now in the child process. */
+	job_process_spawn_child (job, class, argv, env, trace, script_fd,
+				 process, fds[0], fds[1], pty_master, &orig_set);
+}
+
+
+/**
+ * job_process_fork:
+ * @cgroup_fd: cgroup to create the child in, or -1.
+ *
+ * Forks the child process, created inside the cgroup open as @cgroup_fd
+ * by clone3() where the kernel supports it, so that it never runs
+ * outside the cgroup of its job; otherwise it's an ordinary fork and,
+ * should the child need to, it moves itself there.
+ *
+ * Returns: as fork().
+ **/
+static pid_t
+job_process_fork (int cgroup_fd)
+{
+#if defined (ENABLE_CGROUPS) && defined (__NR_clone3)
+	if (cgroup_fd >= 0) {
+		/* struct clone_args, as of the version introducing cgroup */
+		uint64_t args[11] = { 0 };
+		pid_t    pid;
+
+		args[0] = CLONE_INTO_CGROUP;	/* flags */
+		args[4] = SIGCHLD;		/* exit_signal */
+		args[10] = cgroup_fd;		/* cgroup */
+
+		pid = syscall (__NR_clone3, args, sizeof (args));
+		if (! pid)
+			job_process_cgroup_placed = TRUE;
+
+		if (pid >= 0 || (errno != ENOSYS && errno != EINVAL
+				 && errno != E2BIG))
+			return pid;
+	}
+#endif /* ENABLE_CGROUPS && __NR_clone3 */
+
+	return fork ();
+}
+
+
+/**
+ * job_process_console_socket:
+ * @class: class of job,
+ * @job: job of process being spawned, or NULL.
+ *
+ * Called in a newly forked child to connect to the log collector
+ * listening on the console_socket of @class, trying each type of socket
+ * a collector might use in turn, and write the header identifying the
+ * output that follows as that of @job.
+ *
+ * The header is that of the journald stdout stream protocol, so that
+ * journald's stdout socket may be given; it is written as a single
+ * message, so is also the first read by a datagram or sequenced-packet
+ * collector.
+ *
+ * Returns: connected socket, or -1 on raised error.
+ **/
+static int
+job_process_console_socket (JobClass *class,
+			    Job      *job)
+{
+	static const int   types[] = { SOCK_STREAM, SOCK_SEQPACKET, SOCK_DGRAM };
+	struct sockaddr_un addr;
+	char               header[PATH_MAX];
+	int                len;
+	int                sock = -1;
+	int                saved_errno;
+
+	nih_assert (class != NULL);
+	nih_assert (class->console_socket != NULL);
+
+	if (strlen (class->console_socket) >= sizeof (addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		nih_return_system_error (-1);
+	}
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, class->console_socket);
+
+	for (size_t i = 0; i < sizeof (types) / sizeof (types[0]); i++) {
+		sock = socket (AF_UNIX, types[i] | SOCK_CLOEXEC, 0);
+		if (sock < 0)
+			nih_return_system_error (-1);
+
+		if (connect (sock, (struct sockaddr *)&addr, sizeof (addr)) == 0)
+			break;
+
+		saved_errno = errno;
+		close (sock);
+		sock = -1;
+		errno = saved_errno;
+
+		/* Only a socket of the wrong type is worth trying again */
+		if (errno != EPROTOTYPE)
+			nih_return_system_error (-1);
+	}
+
+	if (sock < 0)
+		nih_return_system_error (-1);
+
+	/* Identifier and unit, then priority (LOG_INFO), no level prefix
+	 * and no forwarding to syslog, kmsg or the console.
 	 */
+	len = snprintf (header, sizeof (header), "%s%s%s\n\n6\n0\n0\n0\n0\n",
+			class->name,
+			(job && *job->name) ? "-" : "",
+			job ? job->name : "");
+	if (len >= (int)sizeof (header))
+		len = sizeof (header) - 1;
+
+	if (write (sock, header, len) < 0) {
+		saved_errno = errno;
+		close (sock);
+		errno = saved_errno;
+
+		nih_return_system_error (-1);
+	}
+
+	return sock;
+}
+
+/**
+ * job_process_spawn_child:
+ * @job: job of process being spawned, or NULL,
+ * @class: class of job,
+ * @argv: NULL-terminated list of arguments for the process,
+ * @env: NULL-terminated list of environment variables for the process,
+ * @trace: whether to trace this process,
+ * @script_fd: script file descriptor, or -1,
+ * @process: job process being spawned,
+ * @reading_fd: reading end of the error pipe, or -1,
+ * @error_fd: writing end of the error pipe,
+ * @pty_master: pty master for console logging, or -1,
+ * @orig_set: signal mask to restore before exec.
+ *
+ * Called in a newly forked child to set it up as described by @class and
+ * end by executing @argv, as job_process_spawn_with_fd() describes.
+ * Failures are handled by terminating the child and writing an error
+ * to @error_fd for the parent.
+ *
+ * @job is only needed for cgroups, and may be NULL when called by the
+ * spawn helper (see spawn_helper_server()).
+ *
+ * This function never returns.
+ **/
+void
+job_process_spawn_child (Job             *job,
+			 JobClass        *class,
+			 char * const     argv[],
+			 char * const    *env,
+			 int              trace,
+			 int              script_fd,
+			 ProcessType      process,
+			 int              reading_fd,
+			 int              error_fd,
+			 int              pty_master,
+			 const sigset_t  *orig_set)
+{
+	int             pty_slave = -1;
+	char            pts_name[PATH_MAX];
+	uid_t           job_setuid = -1;
+	gid_t           job_setgid = -1;
+	struct passwd   *pwd = NULL;
+	struct group    *grp = NULL;
+
+#ifdef ENABLE_CGROUPS
+	int              cgroups_needed;
+
+	cgroups_needed = job ? job_needs_cgroups (job) : FALSE;
+#endif /* ENABLE_CGROUPS */
+
+	nih_assert (class != NULL);
+	nih_assert (orig_set != NULL);
 
 	/* Close the reading end of the pipe with our parent and mark the
 	 * writing end to be closed-on-exec so the parent knows we got that
 	 * far because read() returned zero.
 	 */
-	close (fds[0]);
+	if (reading_fd != -1)
+		close (reading_fd);
 
-	job_process_remap_fd (&fds[1], JOB_PROCESS_SCRIPT_FD, fds[1]);
-	nih_io_set_cloexec (fds[1]);
+	job_process_remap_fd (&error_fd, JOB_PROCESS_SCRIPT_FD, error_fd);
+	nih_io_set_cloexec (error_fd);
 
 	if (class->console == CONSOLE_LOG) {
 		struct sigaction act;
 		struct sigaction ignore;
 
-		job_process_remap_fd (&pty_master, JOB_PROCESS_SCRIPT_FD, fds[1]);
+		job_process_remap_fd (&pty_master, JOB_PROCESS_SCRIPT_FD, error_fd);
 
 		/* Child is the slave, so won't need this */
 		nih_io_set_cloexec (pty_master);
@@ -596,38 +1271,38 @@ job_process_spawn_with_fd (Job          *job,
 
 		if (sigaction (SIGCHLD, &ignore, &act) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_SIGNAL, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_SIGNAL, 0);
 		}
 
 		if (grantpt (pty_master) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_GRANTPT, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_GRANTPT, 0);
 		}
 
 		/* Restore child handler */
 		if (sigaction (SIGCHLD, &act, NULL) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_SIGNAL, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_SIGNAL, 0);
 		}
 
 		if (unlockpt (pty_master) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_UNLOCKPT, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_UNLOCKPT, 0);
 		}
 
 		if (ptsname_r (pty_master, pts_name, sizeof(pts_name)) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_PTSNAME, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_PTSNAME, 0);
 		}
 
 		pty_slave = open (pts_name, O_RDWR | O_NOCTTY);
 
 		if (pty_slave < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_OPENPT_SLAVE, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_OPENPT_SLAVE, 0);
 		}
 
-		job_process_remap_fd (&pty_slave, JOB_PROCESS_SCRIPT_FD, fds[1]);
+		job_process_remap_fd (&pty_slave, JOB_PROCESS_SCRIPT_FD, error_fd);
 	}
 
 	/* Move the script fd to special fd 9; the only gotcha is if that
@@ -637,10 +1312,15 @@ job_process_spawn_with_fd (Job          *job,
 		int tmp = dup2 (script_fd, JOB_PROCESS_SCRIPT_FD);
 		if (tmp < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_DUP, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_DUP, 0);
 		}
 		close (script_fd);
 		script_fd = tmp;
+	} else if (script_fd == JOB_PROCESS_SCRIPT_FD) {
+		/* Descriptors passed to the spawn helper may already be
+		 * there, but close-on-exec.
+		 */
+		fcntl (script_fd, F_SETFD, 0);
 	}
 
 	/* Become the leader of a new session and process group, shedding
@@ -666,25 +1346,50 @@ job_process_spawn_with_fd (Job          *job,
 			nih_free (err);
 
 			if (system_setup_console (CONSOLE_NONE, FALSE) < 0)
-				job_process_error_abort (fds[1], JOB_PROCESS_ERROR_CONSOLE, 0);
+				job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CONSOLE, 0);
 		} else
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_CONSOLE, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CONSOLE, 0);
 	}
 
-	if (class->console == CONSOLE_LOG) {
-		/* Redirect stdout and stderr to the logger fd */
-		if (dup2 (pty_slave, STDOUT_FILENO) < 0) {
-			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_DUP, 0);
-		}
+	if (class->console == CONSOLE_SOCKET) {
+		int sock;
 
-		if (dup2 (pty_slave, STDERR_FILENO) < 0) {
-			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_DUP, 0);
-		}
+		/* Output is lost, rather than the process failing, should
+		 * the collector not be listening.
+		 */
+		sock = job_process_console_socket (class, job);
+		if (sock < 0) {
+			NihError *err;
 
-		close (pty_slave);
-	}
+			err = nih_error_get ();
+			nih_warn (_("Failed to connect to log socket %s: %s"),
+				  class->console_socket, err->message);
+			nih_free (err);
+		} else {
+			if ((dup2 (sock, STDOUT_FILENO) < 0)
+			    || (dup2 (sock, STDERR_FILENO) < 0)) {
+				nih_error_raise_system ();
+				job_process_error_abort (error_fd, JOB_PROCESS_ERROR_DUP, 0);
+			}
+
+			close (sock);
+		}
+	}
+
+	if (class->console == CONSOLE_LOG) {
+		/* Redirect stdout and stderr to the logger fd */
+		if (dup2 (pty_slave, STDOUT_FILENO) < 0) {
+			nih_error_raise_system ();
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_DUP, 0);
+		}
+
+		if (dup2 (pty_slave, STDERR_FILENO) < 0) {
+			nih_error_raise_system ();
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_DUP, 0);
+		}
+
+		close (pty_slave);
+	}
 
 	/* Switch to the specified AppArmor profile, but only for the main
 	   process, so we don't confine the pre- and post- processes.
@@ -699,71 +1404,25 @@ job_process_spawn_with_fd (Job          *job,
 						      environ));
 
 		if (! profile) {
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_SECURITY, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_SECURITY, 0);
 		}
 
 		if (apparmor_switch (profile) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_SECURITY, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_SECURITY, 0);
 		}
 	}
 
 	if (process != PROCESS_SECURITY) {
-		/* Set resource limits for the process, skipping over any that
-		 * aren't set in the job class such that they inherit from
-		 * ourselves (and we inherit from kernel defaults).
-		 */
-		for (i = 0; i < RLIMIT_NLIMITS; i++) {
-			if (! class->limits[i])
-				continue;
-
-			if (setrlimit (i, class->limits[i]) < 0) {
-				nih_error_raise_system ();
-				job_process_error_abort (fds[1],
-							 JOB_PROCESS_ERROR_RLIMIT, i);
-			}
-		}
-
-		/* Set the file mode creation mask; this is one of the few operations
-		 * that can never fail.
-		 */
-		umask (class->umask);
+		JobProcessErrorType type;
+		int                 arg;
 
-		/* Adjust the process priority ("nice level").
+		/* Set resource limits, priorities, placement and so on for
+		 * the process, the same way as a cloned child.
 		 */
-		if (class->nice != JOB_NICE_INVALID &&
-		    setpriority (PRIO_PROCESS, 0, class->nice) < 0) {
+		if (job_process_set_resources (class, &type, &arg) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1],
-						 JOB_PROCESS_ERROR_PRIORITY, 0);
-		}
-
-		/* Adjust the process OOM killer priority.
-		 */
-		if (class->oom_score_adj != JOB_DEFAULT_OOM_SCORE_ADJ) {
-			int oom_value;
-			snprintf (filename, sizeof (filename),
-				  "/proc/%d/oom_score_adj", getpid ());
-			oom_value = class->oom_score_adj;
-			fd = fopen (filename, "w");
-			if ((! fd) && (errno == ENOENT)) {
-				snprintf (filename, sizeof (filename),
-					  "/proc/%d/oom_adj", getpid ());
-				oom_value = (class->oom_score_adj
-					     * ((class->oom_score_adj < 0) ? 17 : 15)) / 1000;
-				fd = fopen (filename, "w");
-			}
-			if (! fd) {
-				nih_error_raise_system ();
-				job_process_error_abort (fds[1], JOB_PROCESS_ERROR_OOM_ADJ, 0);
-			} else {
-				fprintf (fd, "%d\n", oom_value);
-
-				if (fclose (fd)) {
-					nih_error_raise_system ();
-					job_process_error_abort (fds[1], JOB_PROCESS_ERROR_OOM_ADJ, 0);
-				}
-			}
+			job_process_error_abort (error_fd, type, arg);
 		}
 
 		/* Handle changing a chroot session job prior to dealing with
@@ -772,7 +1431,7 @@ job_process_spawn_with_fd (Job          *job,
 		if (class->session && class->session->chroot) {
 			if (chroot (class->session->chroot) < 0) {
 				nih_error_raise_system ();
-				job_process_error_abort (fds[1], JOB_PROCESS_ERROR_CHROOT, 0);
+				job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CHROOT, 0);
 			}
 		}
 
@@ -783,7 +1442,7 @@ job_process_spawn_with_fd (Job          *job,
 		if (class->chroot) {
 			if (chroot (class->chroot) < 0) {
 				nih_error_raise_system ();
-				job_process_error_abort (fds[1],
+				job_process_error_abort (error_fd,
 							 JOB_PROCESS_ERROR_CHROOT, 0);
 			}
 		}
@@ -795,7 +1454,7 @@ job_process_spawn_with_fd (Job          *job,
 		if (class->chdir || user_mode == FALSE) {
 			if (chdir (class->chdir ? class->chdir : "/") < 0) {
 				nih_error_raise_system ();
-				job_process_error_abort (fds[1], JOB_PROCESS_ERROR_CHDIR, 0);
+				job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CHDIR, 0);
 			}
 		}
 
@@ -813,11 +1472,11 @@ job_process_spawn_with_fd (Job          *job,
 			if (! pwd) {
 				if (errno != 0) {
 					nih_error_raise_system ();
-					job_process_error_abort (fds[1], JOB_PROCESS_ERROR_GETPWNAM, 0);
+					job_process_error_abort (error_fd, JOB_PROCESS_ERROR_GETPWNAM, 0);
 				} else {
 					nih_error_raise (JOB_PROCESS_INVALID_SETUID,
 							 JOB_PROCESS_INVALID_SETUID_STR);
-					job_process_error_abort (fds[1], JOB_PROCESS_ERROR_BAD_SETUID, 0);
+					job_process_error_abort (error_fd, JOB_PROCESS_ERROR_BAD_SETUID, 0);
 				}
 			}
 
@@ -832,11 +1491,11 @@ job_process_spawn_with_fd (Job          *job,
 			if (! grp) {
 				if (errno != 0) {
 					nih_error_raise_system ();
-					job_process_error_abort (fds[1], JOB_PROCESS_ERROR_GETGRNAM, 0);
+					job_process_error_abort (error_fd, JOB_PROCESS_ERROR_GETGRNAM, 0);
 				} else {
 					nih_error_raise (JOB_PROCESS_INVALID_SETGID,
 							 JOB_PROCESS_INVALID_SETGID_STR);
-					job_process_error_abort (fds[1], JOB_PROCESS_ERROR_BAD_SETGID, 0);
+					job_process_error_abort (error_fd, JOB_PROCESS_ERROR_BAD_SETGID, 0);
 				}
 			}
 
@@ -847,7 +1506,7 @@ job_process_spawn_with_fd (Job          *job,
 		    (job_setuid != (uid_t) -1 || job_setgid != (gid_t) -1) &&
 		    fchown (script_fd, job_setuid, job_setgid) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_CHOWN, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CHOWN, 0);
 		}
 
 		/* Make sure we always have the needed pwd and grp structs.
@@ -858,7 +1517,7 @@ job_process_spawn_with_fd (Job          *job,
 				pwd = getpwuid (geteuid ());
 				if (! pwd) {
 					nih_error_raise_system ();
-					job_process_error_abort (fds[1], JOB_PROCESS_ERROR_GETPWUID, 0);
+					job_process_error_abort (error_fd, JOB_PROCESS_ERROR_GETPWUID, 0);
 				}
 			}
 
@@ -866,28 +1525,49 @@ job_process_spawn_with_fd (Job          *job,
 				grp = getgrgid (getegid ());
 				if (! grp) {
 					nih_error_raise_system ();
-					job_process_error_abort (fds[1], JOB_PROCESS_ERROR_GETGRGID, 0);
+					job_process_error_abort (error_fd, JOB_PROCESS_ERROR_GETGRGID, 0);
 				}
 			}
 
 			if (pwd && grp) {
 				if (initgroups (pwd->pw_name, grp->gr_gid) < 0) {
 					nih_error_raise_system ();
-					job_process_error_abort (fds[1], JOB_PROCESS_ERROR_INITGROUPS, 0);
+					job_process_error_abort (error_fd, JOB_PROCESS_ERROR_INITGROUPS, 0);
 				}
 			}
 		}
 
 #ifdef ENABLE_CGROUPS
-		if (cgroups_needed) {
+		if (cgroups_needed && cgroup_unified_available ()) {
+			/* Move ourselves into the cgroup of the job unless
+			 * we were created in it; it has to be done before
+			 * dropping privileges, unlike with the cgroup
+			 * manager.
+			 */
+			if (! job_process_cgroup_placed) {
+				int fd;
+
+				fd = cgroup_unified_setup (&class->cgroups,
+						env,
+						class->setuid ? job_setuid : geteuid (),
+						class->setgid ? job_setgid : getegid ());
+				if (fd < 0)
+					job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CGROUP_SETUP, 0);
+
+				if (! cgroup_unified_enter (fd))
+					job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CGROUP_ENTER, 0);
+
+				close (fd);
+			}
+		} else if (cgroups_needed) {
 			if (cgroup_manager_connect () < 0)
-				job_process_error_abort (fds[1], JOB_PROCESS_ERROR_CGROUP_MGR_CONNECT, 0);
+				job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CGROUP_MGR_CONNECT, 0);
 
-			if (! cgroup_setup (&job->class->cgroups,
+			if (! cgroup_setup (&class->cgroups,
 						env,
 						class->setuid ? job_setuid : geteuid (),
 						class->setgid ? job_setgid : getegid ())) {
-				job_process_error_abort (fds[1], JOB_PROCESS_ERROR_CGROUP_SETUP, 0);
+				job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CGROUP_SETUP, 0);
 			}
 
 			/* If spawning the last process for the job,
@@ -896,8 +1576,8 @@ job_process_spawn_with_fd (Job          *job,
 			 * job processes have completed.
 			 */
 			if (job_last_process (job, process)) {
-				if (! cgroup_clear (&job->class->cgroups)) {
-					job_process_error_abort (fds[1], JOB_PROCESS_ERROR_CGROUP_CLEAR, 0);
+				if (! cgroup_clear (&class->cgroups)) {
+					job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CGROUP_CLEAR, 0);
 				}
 			}
 		}
@@ -906,12 +1586,12 @@ job_process_spawn_with_fd (Job          *job,
 		/* Start dropping privileges */
 		if (job_setgid != (gid_t) -1 && setgid (job_setgid) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_SETGID, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_SETGID, 0);
 		}
 
 		if (job_setuid != (uid_t)-1 && setuid (job_setuid) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_SETUID, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_SETUID, 0);
 		}
 	}
 
@@ -920,7 +1600,7 @@ job_process_spawn_with_fd (Job          *job,
 	 * surprisingly handle them before we've exec()d the new process.
 	 */
 	nih_signal_reset ();
-	sigprocmask (SIG_SETMASK, &orig_set, NULL);
+	sigprocmask (SIG_SETMASK, orig_set, NULL);
 
 	/* Notes:
 	 *
@@ -945,8 +1625,12 @@ job_process_spawn_with_fd (Job          *job,
 		 * have a copy of the parents fds open. As such, re-exec
 		 * will not work.
 		 */
-		close (fds[1]);
-		raise (SIGSTOP);
+		close (error_fd);
+
+		/* Not raise(), which signals the thread id cached by the
+		 * C library: job_process_fork() may have bypassed it.
+		 */
+		kill (getpid (), SIGSTOP);
 	}
 
 #ifdef ENABLE_CGROUPS
@@ -954,8 +1638,9 @@ job_process_spawn_with_fd (Job          *job,
 	 * the process is running with the correct group and user
 	 * ownership.
 	 */
-	if (cgroups_needed && cgroup_enter_groups (&job->class->cgroups) != TRUE)
-		job_process_error_abort (fds[1], JOB_PROCESS_ERROR_CGROUP_ENTER, 0);
+	if (cgroups_needed && (! cgroup_unified_available ())
+	    && cgroup_enter_groups (&class->cgroups) != TRUE)
+		job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CGROUP_ENTER, 0);
 
 #endif /* ENABLE_CGROUPS */
 
@@ -963,7 +1648,7 @@ job_process_spawn_with_fd (Job          *job,
 	if (trace) {
 		if (ptrace (PTRACE_TRACEME, 0, NULL, 0) < 0) {
 			nih_error_raise_system();
-			job_process_error_abort (fds[1],
+			job_process_error_abort (error_fd,
 						 JOB_PROCESS_ERROR_PTRACE, 0);
 		}
 	}
@@ -971,13 +1656,12 @@ job_process_spawn_with_fd (Job          *job,
 	/* Execute the process, if we escape from here it failed */
 	if (execvp (argv[0], argv) < 0) {
 		nih_error_raise_system ();
-		job_process_error_abort (fds[1], JOB_PROCESS_ERROR_EXEC, 0);
+		job_process_error_abort (error_fd, JOB_PROCESS_ERROR_EXEC, 0);
 	}
 
 	nih_assert_not_reached ();
 }
 
-
 /**
  * job_process_error_abort:
  * @fd: writing end of pipe,
@@ -1019,1272 +1703,3176 @@ job_process_error_abort (int                 fd,
 
 
 /**
- * job_process_error_handler:
- * @buf: data read from child process,
- * @len: length of data read as @wire_err.
+ * job_process_can_clone:
+ * @job: job context for process to be spawned,
+ * @process: job process to spawn,
+ * @trace: whether to trace this process.
  *
- * Read from the reading end of the pipe specified by @fd, if we receive
- * data then the child raised a process error which we reconstruct and raise
- * again; otherwise no problem was found and no action is taken.
+ * Determines whether @process of @job can be spawned by
+ * job_process_clone().  Processes that are to be traced, paused for
+ * debugging, confined by AppArmor, run in a chroot, run as another user
+ * or group, placed in cgroups or given the system console all need the
+ * child to allocate or look things up, so must be forked instead.
  *
- * The reconstructed error will be of JOB_PROCESS_ERROR type, the human-
- * readable message is generated according to the type of process error
- * and argument passed along with it.
+ * Returns: TRUE if @process can be cloned, FALSE if it must be forked.
  **/
-void
-job_process_error_handler (const char *buf, size_t len)
+static int
+job_process_can_clone (Job         *job,
+		       ProcessType  process,
+		       int          trace)
 {
-	JobProcessWireError  *wire_err;
-	JobProcessError      *err;
-	const char           *res;
+	JobClass *class;
 
-	wire_err = (JobProcessWireError *)buf;
+	nih_assert (job != NULL);
 
-	nih_assert (wire_err);
+	class = job->class;
 
-	/* Read the error from the pipe; a zero read indicates that the
-	 * exec succeeded so we return success, otherwise if we don't receive
-	 * a JobProcessWireError structure, we return a temporary error so we
-	 * try again.
+	if (trace || class->debug)
+		return FALSE;
+
+	if ((class->console != CONSOLE_NONE)
+	    && (class->console != CONSOLE_LOG))
+		return FALSE;
+
+	if (class->apparmor_switch && (process == PROCESS_MAIN))
+		return FALSE;
+
+	if (process != PROCESS_SECURITY) {
+		if (class->session && class->session->chroot)
+			return FALSE;
+
+		if (class->chroot || class->setuid || class->setgid)
+			return FALSE;
+	}
+
+#ifdef ENABLE_CGROUPS
+	if (job_needs_cgroups (job))
+		return FALSE;
+#endif /* ENABLE_CGROUPS */
+
+	return TRUE;
+}
+
+/**
+ * job_process_clone_prepare:
+ * @spawn: details of process to spawn,
+ * @pty_master: pty master for console logging, or -1.
+ *
+ * Performs the parts of the child setup in job_process_spawn_with_fd()
+ * that would need the child to allocate or look things up: opening the
+ * pty slave and working out the supplementary groups of the user we run
+ * as.  The results are stored in @spawn, which must be passed to
+ * job_process_clone_cleanup() once the child has been spawned.
+ *
+ * Must be called with all signals blocked.  No error is raised on failure
+ * since the caller simply falls back to forking, which repeats the setup
+ * in the child and reports any problem in the usual way.
+ *
+ * Returns: zero on success, negative value on failure.
+ **/
+static int
+job_process_clone_prepare (JobProcessClone *spawn,
+			   int              pty_master)
+{
+	char pts_name[PATH_MAX];
+
+	nih_assert (spawn != NULL);
+
+	spawn->pty_slave = -1;
+	spawn->groups = NULL;
+	spawn->num_groups = 0;
+
+	if (spawn->class->console == CONSOLE_LOG) {
+		struct sigaction act;
+		struct sigaction ignore;
+		int              ret;
+
+		nih_assert (pty_master >= 0);
+
+		/* grantpt(3) disallows a child handler being in effect,
+		 * signals are blocked so none will be lost meanwhile.
+		 */
+		ignore.sa_handler = SIG_DFL;
+		ignore.sa_flags = 0;
+		sigemptyset (&ignore.sa_mask);
+
+		if (sigaction (SIGCHLD, &ignore, &act) < 0)
+			return -1;
+
+		ret = grantpt (pty_master);
+
+		if (sigaction (SIGCHLD, &act, NULL) < 0)
+			return -1;
+
+		if ((ret < 0)
+		    || (unlockpt (pty_master) < 0)
+		    || (ptsname_r (pty_master, pts_name, sizeof (pts_name))))
+			return -1;
+
+		spawn->pty_slave = open (pts_name, O_RDWR | O_NOCTTY);
+		if (spawn->pty_slave < 0)
+			return -1;
+	}
+
+	/* Set up the same group list that initgroups() would in the child,
+	 * it won't work when non-root.
 	 */
-	if (len != sizeof (JobProcessWireError)) {
-		errno = EILSEQ;
-		nih_return_system_error ();
+	if ((spawn->process != PROCESS_SECURITY) && (geteuid () == 0)) {
+		struct passwd *pwd;
+		struct group  *grp;
+		int            num_groups = 0;
+
+		pwd = getpwuid (geteuid ());
+		grp = getgrgid (getegid ());
+		if (! pwd || ! grp)
+			goto error;
+
+		getgrouplist (pwd->pw_name, grp->gr_gid, NULL, &num_groups);
+		if (num_groups <= 0)
+			goto error;
+
+		spawn->groups = nih_alloc (NULL, sizeof (gid_t) * num_groups);
+		if (! spawn->groups)
+			goto error;
+
+		if (getgrouplist (pwd->pw_name, grp->gr_gid,
+				  spawn->groups, &num_groups) < 0)
+			goto error;
+
+		spawn->num_groups = num_groups;
 	}
 
-	/* Construct a JobProcessError to be raised containing information
-	 * from the wire, augmented with human-readable information we
-	 * generate here.
+	return 0;
+
+error:
+	job_process_clone_cleanup (spawn);
+	return -1;
+}
+
+/**
+ * job_process_clone_cleanup:
+ * @spawn: details of spawned process.
+ *
+ * Releases the resources obtained by job_process_clone_prepare().
+ **/
+static void
+job_process_clone_cleanup (JobProcessClone *spawn)
+{
+	nih_assert (spawn != NULL);
+
+	if (spawn->pty_slave != -1) {
+		close (spawn->pty_slave);
+		spawn->pty_slave = -1;
+	}
+
+	if (spawn->groups) {
+		nih_free (spawn->groups);
+		spawn->groups = NULL;
+	}
+}
+
+/**
+ * job_process_clone:
+ * @spawn: details of process to spawn.
+ *
+ * Spawns the process described by @spawn using clone() with CLONE_VM and
+ * CLONE_VFORK, so that unlike fork() none of our page tables are copied;
+ * we are suspended until the child has called exec or exited.  The child
+ * runs job_process_clone_child() on a small dedicated stack and reports
+ * errors over the same pipe, in the same way, as a forked child.
+ *
+ * Must be called with all signals blocked.
+ *
+ * Returns: process id of new process on success, -1 with errno set on
+ * failure.
+ **/
+static pid_t
+job_process_clone (JobProcessClone *spawn)
+{
+	static char  stack[JOB_PROCESS_CLONE_STACK_SIZE]
+		__attribute__ ((aligned (16)));
+	char       **saved_environ;
+	pid_t        pid;
+
+	nih_assert (spawn != NULL);
+
+	/* The child sets environ so that execvp() searches the job's
+	 * PATH, which being shared would change ours too.
 	 */
-	err = NIH_MUST (nih_new (NULL, JobProcessError));
+	saved_environ = environ;
 
-	err->type = wire_err->type;
-	err->arg = wire_err->arg;
-	err->errnum = wire_err->errnum;
+	pid = clone (job_process_clone_child,
+		     stack + JOB_PROCESS_CLONE_STACK_SIZE,
+		     CLONE_VM | CLONE_VFORK | SIGCHLD, spawn);
 
-	err->error.number = JOB_PROCESS_ERROR;
+	environ = saved_environ;
 
-	switch (err->type) {
-	case JOB_PROCESS_ERROR_DUP:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to move script fd: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_CONSOLE:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to open console: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_RLIMIT:
-		switch (err->arg) {
-		case RLIMIT_CPU:
-			res = "cpu";
-			break;
-		case RLIMIT_FSIZE:
-			res = "fsize";
-			break;
-		case RLIMIT_DATA:
-			res = "data";
-			break;
-		case RLIMIT_STACK:
-			res = "stack";
-			break;
-		case RLIMIT_CORE:
-			res = "core";
-			break;
-		case RLIMIT_RSS:
-			res = "rss";
-			break;
-		case RLIMIT_NPROC:
-			res = "nproc";
-			break;
-		case RLIMIT_NOFILE:
-			res = "nofile";
-			break;
-		case RLIMIT_MEMLOCK:
-			res = "memlock";
-			break;
-		case RLIMIT_AS:
-			res = "as";
-			break;
-		case RLIMIT_LOCKS:
-			res = "locks";
-			break;
-		case RLIMIT_SIGPENDING:
-			res = "sigpending";
-			break;
-		case RLIMIT_MSGQUEUE:
-			res = "msgqueue";
-			break;
-		case RLIMIT_NICE:
-			res = "nice";
-			break;
-		case RLIMIT_RTPRIO:
-			res = "rtprio";
-			break;
-		default:
-			nih_assert_not_reached ();
+	return pid;
+}
+
+/**
+ * job_process_clone_child:
+ * @data: JobProcessClone describing process.
+ *
+ * Sets up and executes the process described by @data in a child spawned
+ * by job_process_clone(), performing the same setup as a forked child in
+ * job_process_spawn_with_fd() for the cases job_process_can_clone()
+ * allows.
+ *
+ * Since the child shares our memory, the only variable it may change is
+ * environ, which job_process_clone() restores, and errors are written
+ * back with job_process_clone_abort() rather than being raised.
+ *
+ * This function never returns.
+ **/
+static int
+job_process_clone_child (void *data)
+{
+	JobProcessClone *spawn = (JobProcessClone *)data;
+	JobClass        *class;
+	int              error_fd;
+	int              fd;
+
+	nih_assert (spawn != NULL);
+
+	class = spawn->class;
+	error_fd = spawn->error_fd;
+
+	/* The writing end of the pipe is closed when we exec so the parent
+	 * knows we got that far.
+	 */
+	close (spawn->reading_fd);
+
+	job_process_clone_remap_fd (&error_fd, error_fd);
+	if (fcntl (error_fd, F_SETFD, FD_CLOEXEC) < 0)
+		job_process_clone_abort (error_fd, JOB_PROCESS_ERROR_DUP, 0);
+
+	if (spawn->pty_slave != -1)
+		job_process_clone_remap_fd (&spawn->pty_slave, error_fd);
+
+	/* Move the script fd to special fd 9 */
+	if ((spawn->script_fd != -1)
+	    && (spawn->script_fd != JOB_PROCESS_SCRIPT_FD)) {
+		if (dup2 (spawn->script_fd, JOB_PROCESS_SCRIPT_FD) < 0)
+			job_process_clone_abort (error_fd,
+						 JOB_PROCESS_ERROR_DUP, 0);
+
+		close (spawn->script_fd);
+	}
+
+	setsid ();
+
+	environ = (char **)spawn->env;
+
+	/* Standard input is always /dev/null, as are standard output and
+	 * error unless logging.
+	 */
+	for (fd = 0; fd < 3; fd++)
+		close (fd);
+
+	fd = open (DEV_NULL, O_RDWR | O_NOCTTY);
+	if (fd < 0)
+		job_process_clone_abort (error_fd, JOB_PROCESS_ERROR_CONSOLE, 0);
+
+	while (dup (fd) < 2)
+		;
+
+	if (spawn->pty_slave != -1) {
+		if ((dup2 (spawn->pty_slave, STDOUT_FILENO) < 0)
+		    || (dup2 (spawn->pty_slave, STDERR_FILENO) < 0))
+			job_process_clone_abort (error_fd,
+						 JOB_PROCESS_ERROR_DUP, 0);
+
+		close (spawn->pty_slave);
+	}
+
+	if (spawn->process != PROCESS_SECURITY) {
+		JobProcessErrorType type;
+		int                 arg;
+
+		if (job_process_set_resources (class, &type, &arg) < 0)
+			job_process_clone_abort (error_fd, type, arg);
+
+		if (class->chdir || user_mode == FALSE) {
+			if (chdir (class->chdir ? class->chdir : "/") < 0)
+				job_process_clone_abort (error_fd,
+							 JOB_PROCESS_ERROR_CHDIR, 0);
 		}
 
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to set \"%s\" resource limit: %s"),
-				  res, strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_PRIORITY:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to set priority: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_OOM_ADJ:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to set oom adjustment: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_CHROOT:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to change root directory: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_CHDIR:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to change working directory: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_PTRACE:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to set trace: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_EXEC:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to execute: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_GETPWNAM:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to getpwnam: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_GETGRNAM:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to getgrnam: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_GETPWUID:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to getpwuid: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_GETGRGID:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to getgrgid: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_BAD_SETUID:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to find setuid user")));
-		break;
-	case JOB_PROCESS_ERROR_BAD_SETGID:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to find setgid group")));
-		break;
-	case JOB_PROCESS_ERROR_SETUID:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to setuid: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_SETGID:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to setgid: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_CHOWN:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to chown: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_UNLOCKPT:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to unlockpt: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_GRANTPT:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to granpt: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_PTSNAME:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to get ptsname: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_OPENPT_SLAVE:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to open pty slave: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_SIGNAL:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to modify signal handler: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_ALLOC:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to allocate memory: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_INITGROUPS:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to initgroups: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_SECURITY:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to switch security profile: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_CGROUP_MGR_CONNECT:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to connect to CGManager: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_CGROUP_SETUP:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to setup cgroup: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_CGROUP_ENTER:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to enter cgroup: %s"),
-				  strerror (err->errnum)));
-		break;
-	case JOB_PROCESS_ERROR_CGROUP_CLEAR:
-		err->error.message = NIH_MUST (nih_sprintf (
-				  err, _("unable to mark cgroups for removal: %s"),
-				  strerror (err->errnum)));
-		break;
-
-	default:
-		nih_assert_not_reached ();
+		if (spawn->groups
+		    && (setgroups (spawn->num_groups, spawn->groups) < 0))
+			job_process_clone_abort (error_fd,
+						 JOB_PROCESS_ERROR_INITGROUPS, 0);
 	}
 
-	nih_error_raise_error (&err->error);
-}
+	nih_signal_reset ();
+	sigprocmask (SIG_SETMASK, &spawn->orig_set, NULL);
 
+	execvp (spawn->argv[0], spawn->argv);
+	job_process_clone_abort (error_fd, JOB_PROCESS_ERROR_EXEC, 0);
+}
 
 /**
- * job_process_kill:
- * @job: job to kill process of,
- * @process: process to be killed.
+ * job_process_clone_remap_fd:
+ * @fd: pointer to file descriptor,
+ * @error_fd: writing end of the error pipe.
  *
- * This function forces a @job to leave its current state by sending
- * @process the "kill signal" defined signal (TERM by default), and maybe
- * later the KILL signal.  The actual state changes are performed by
- * job_child_reaper when the process has actually terminated.
+ * Equivalent of job_process_remap_fd() for a child spawned by
+ * job_process_clone(), moving @fd out of the way if it is
+ * JOB_PROCESS_SCRIPT_FD.
  **/
-void
-job_process_kill (Job         *job,
-		  ProcessType  process)
+static void
+job_process_clone_remap_fd (int *fd,
+			    int  error_fd)
 {
-	nih_assert (job != NULL);
-	nih_assert (job->pid[process] > 0);
-	nih_assert (job->kill_timer == NULL);
-	nih_assert (job->kill_process == PROCESS_INVALID);
-
-	nih_info (_("Sending %s signal to %s %s process (%d)"),
-		  nih_signal_to_name (job->class->kill_signal),
-		  job_name (job), process_name (process), job->pid[process]);
-
-	if (system_kill (job->pid[process], job->class->kill_signal) < 0) {
-		NihError *err;
-
-		err = nih_error_get ();
-		if (err->number != ESRCH)
-			nih_warn (_("Failed to send %s signal to %s %s process (%d): %s"),
-				  nih_signal_to_name (job->class->kill_signal),
-				  job_name (job), process_name (process),
-				  job->pid[process], err->message);
-		nih_free (err);
+	int new;
 
+	if (*fd != JOB_PROCESS_SCRIPT_FD)
 		return;
-	}
 
-	job_process_set_kill_timer (job, process, job->class->kill_timeout);
+	new = dup (*fd);
+	if (new < 0)
+		job_process_clone_abort (error_fd, JOB_PROCESS_ERROR_DUP, 0);
+
+	close (*fd);
+	*fd = new;
 }
 
 /**
- * job_process_jobs_running:
+ * job_process_clone_abort:
+ * @fd: writing end of pipe,
+ * @type: step that failed,
+ * @arg: argument to @type.
  *
- * Determine if any jobs are running. Note that simply checking if class
- * instances exist is insufficient: since this call is used for shutdown
- * abstract jobs must not be able to block the shutdown.
+ * Equivalent of job_process_error_abort() for a child spawned by
+ * job_process_clone(), taking the error number from errno and exiting
+ * without running any of our exit handlers.
  *
- * Returns: TRUE if jobs are still running, else FALSE.
+ * This function never returns.
  **/
-int
-job_process_jobs_running (void)
+static void
+job_process_clone_abort (int                 fd,
+			 JobProcessErrorType type,
+			 int                 arg)
 {
-	job_class_init ();
-
-	NIH_HASH_FOREACH (job_classes, iter) {
-		JobClass *class = (JobClass *)iter;
+	JobProcessWireError wire_err;
 
-		NIH_HASH_FOREACH (class->instances, job_iter) {
-			Job *job = (Job *)job_iter;
-			int i;
+	wire_err.type = type;
+	wire_err.arg = arg;
+	wire_err.errnum = errno;
 
-			for (i = 0; i < PROCESS_LAST; i++) {
-				if (job->pid[i])
-					return TRUE;
-			}
-		}
-	}
+	while (write (fd, &wire_err, sizeof (wire_err)) < 0)
+		;
 
-	return FALSE;
+	_exit (255);
 }
 
 
 /**
- * job_process_stop_all:
+ * job_process_set_affinity:
+ * @placement: placement of job processes.
  *
- * Stop all running jobs.
+ * Restrict the calling process to the processors of @placement, if any.
+ * Only a system call is made, so this is safe in a child spawned by
+ * job_process_clone().
+ *
+ * Returns: zero on success, -1 with errno set on failure.
  **/
-void
-job_process_stop_all (void)
+static int
+job_process_set_affinity (const JobPlacement *placement)
 {
-	job_class_init ();
-
-	NIH_HASH_FOREACH (job_classes, iter) {
-		JobClass *class = (JobClass *)iter;
+	nih_assert (placement != NULL);
 
-		/* Note that instances get killed in a random order */
-		NIH_HASH_FOREACH (class->instances, job_iter) {
-			Job *job = (Job *)job_iter;
+	for (size_t i = 0; i < JOB_PLACEMENT_LONGS; i++)
+		if (placement->cpus[i])
+			return (int)syscall (SYS_sched_setaffinity, 0,
+					     sizeof (placement->cpus),
+					     placement->cpus);
 
-			/* Request job instance stops */
-			job_change_goal (job, JOB_STOP);
-		}
-	}
+	return 0;
 }
 
 /**
- * job_process_set_kill_timer:
- * @job: job to set kill timer for,
- * @process: process to be killed,
- * @timeout: timeout to apply for timer.
+ * job_process_set_mempolicy:
+ * @placement: placement of job processes.
  *
- * Set kill timer for specified @job @process with timeout @timeout.
+ * Give the calling process the memory policy of @placement, if any,
+ * across the nodes it names or, if it names none, every node we may use.
+ * Only system calls are made, so this is safe in a child spawned by
+ * job_process_clone().
+ *
+ * Returns: zero on success, -1 with errno set on failure.
  **/
-void
-job_process_set_kill_timer (Job          *job,
-		  	    ProcessType   process,
-			    time_t        timeout)
+static int
+job_process_set_mempolicy (const JobPlacement *placement)
 {
-	nih_assert (job);
-	nih_assert (timeout);
-	nih_assert (job->kill_timer == NULL);
+	unsigned long        allowed[JOB_PLACEMENT_LONGS];
+	const unsigned long *nodes = NULL;
+	int                  mode;
 
-	job->kill_process = process;
-	job->kill_timer = NIH_MUST (nih_timer_add_timeout (
-			  job, timeout,
-			  (NihTimerCb)job_process_kill_timer, job));
+	nih_assert (placement != NULL);
+
+	switch (placement->numa_policy) {
+	case JOB_NUMA_DEFAULT:
+		return 0;
+	case JOB_NUMA_BIND:
+		mode = MPOL_BIND;
+		break;
+	case JOB_NUMA_INTERLEAVE:
+		mode = MPOL_INTERLEAVE;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (size_t i = 0; i < JOB_PLACEMENT_LONGS; i++)
+		if (placement->numa_nodes[i])
+			nodes = placement->numa_nodes;
+
+	if (! nodes) {
+		memset (allowed, 0, sizeof (allowed));
+		if (syscall (SYS_get_mempolicy, NULL, allowed,
+			     JOB_PLACEMENT_MAX, NULL, MPOL_F_MEMS_ALLOWED) < 0)
+			return -1;
+
+		nodes = allowed;
+	}
+
+	/* The kernel takes one more than the number of bits in the mask */
+	return (int)syscall (SYS_set_mempolicy, mode, nodes,
+			     JOB_PLACEMENT_MAX + 1);
 }
 
+
 /**
- * job_process_adj_kill_timer:
+ * job_process_set_sched:
+ * @class: job class of process.
  *
- * @job: job whose kill timer is to be modified,
- * @due: new due time to set for job kill timer.
+ * Give the calling process the scheduling policy of @class, if any,
+ * with its static priority for the realtime policies.  Only a system
+ * call is made, so this is safe in a child spawned by job_process_clone().
  *
- * Adjust due time for @job's kill timer to @due.
+ * Returns: zero on success, -1 with errno set on failure.
  **/
-void
-job_process_adj_kill_timer (Job *job, time_t due)
+static int
+job_process_set_sched (const JobClass *class)
 {
-	nih_assert (job);
-	nih_assert (job->kill_timer);
-	nih_assert (due);
+	struct sched_param param;
+
+	nih_assert (class != NULL);
+
+	if (class->sched_policy == JOB_SCHED_INVALID)
+		return 0;
 
-	job->kill_timer->due = due;
+	memset (&param, 0, sizeof (param));
+	param.sched_priority = class->sched_priority;
+
+	return (int)syscall (SYS_sched_setscheduler, 0,
+			     class->sched_policy, &param);
 }
 
 /**
- * job_process_kill_timer:
- * @job: job to kill process of,
- * @timer: timer that caused us to be called.
+ * job_process_set_ioprio:
+ * @class: job class of process.
  *
- * This callback is called if the process failed to terminate within
- * a particular time of being sent the TERM signal.  The process is killed
- * more forcibly by sending the KILL signal.
+ * Give the calling process the I/O scheduling class and level of
+ * @class, if any.  Only a system call is made, so this is safe in a
+ * child spawned by job_process_clone().
+ *
+ * Returns: zero on success, -1 with errno set on failure.
  **/
-static void
-job_process_kill_timer (Job      *job,
-			NihTimer *timer)
+static int
+job_process_set_ioprio (const JobClass *class)
 {
-	ProcessType process;
-
-	nih_assert (job != NULL);
-	nih_assert (timer != NULL);
-	nih_assert (job->kill_timer == timer);
-	nih_assert (job->kill_process != PROCESS_INVALID);
-
-	process = job->kill_process;
-	nih_assert (job->pid[process] > 0);
-
-	job->kill_timer = NULL;
-	job->kill_process = PROCESS_INVALID;
-
-	nih_info (_("Sending %s signal to %s %s process (%d)"),
-		  "KILL",
-		  job_name (job), process_name (process), job->pid[process]);
+	nih_assert (class != NULL);
 
-	if (system_kill (job->pid[process], SIGKILL) < 0) {
-		NihError *err;
+	if (class->ioprio_class == JOB_IOPRIO_NONE)
+		return 0;
 
-		err = nih_error_get ();
-		if (err->number != ESRCH)
-			nih_warn (_("Failed to send %s signal to %s %s process (%d): %s"),
-				  "KILL",
-				  job_name (job), process_name (process),
-				  job->pid[process], err->message);
-		nih_free (err);
-	}
+	/* IOPRIO_WHO_PROCESS is 1; the class is held above the 13 bits
+	 * of level, as the kernel's IOPRIO_PRIO_VALUE() has it.
+	 */
+	return (int)syscall (SYS_ioprio_set, 1, 0,
+			     ((int)class->ioprio_class << 13)
+			     | class->ioprio_level);
 }
 
-
 /**
- * job_process_handler:
- * @data: unused,
- * @pid: process that changed,
- * @event: event that occurred on the child,
- * @status: exit status, signal raised or ptrace event.
+ * job_process_set_resources:
+ * @class: job class of process,
+ * @type: set to the step that failed,
+ * @arg: set to the argument to @type.
  *
- * This callback should be registered with nih_child_add_watch() so that
- * when processes associated with jobs die, stop, receive signals or other
- * ptrace events, the appropriate action is taken.
+ * Give the calling process the resource limits, file mode creation
+ * mask, nice level, placement, scheduling policy, I/O priority, timer
+ * slack and OOM killer adjustment of @class.  This is the setup shared
+ * by forked children and those spawned by job_process_clone(), so only
+ * system calls are made.
  *
- * Normally this is registered so it is called for all processes, and is
- * safe to do as it only acts if the process is linked to a job.
+ * Returns: zero on success, -1 with errno set and @type and @arg filled
+ * in on failure.
  **/
-void
-job_process_handler (void           *data,
-		     pid_t           pid,
-		     NihChildEvents  event,
-		     int             status)
+static int
+job_process_set_resources (const JobClass      *class,
+			   JobProcessErrorType *type,
+			   int                 *arg)
 {
-	Job         *job;
-	ProcessType  process;
-	NihLogLevel  priority;
-	const char  *sig;
-
-	nih_assert (pid > 0);
+	nih_assert (class != NULL);
+	nih_assert (type != NULL);
+	nih_assert (arg != NULL);
 
-	/* Find the job that an event ocurred for, and identify which of the
-	 * job's process it was.  If we don't know about it, then we simply
-	 * ignore the event.
-	 */
-	job = job_process_find (pid, &process);
-	if (! job)
-		return;
+	*arg = 0;
 
-	/* Check the job's normal exit clauses to see whether this is a failure
-	 * worth warning about.
+	/* Skip over any limits that aren't set in the job class such that
+	 * they inherit from ourselves (and we inherit from kernel defaults).
 	 */
-	priority = NIH_LOG_WARN;
-	for (size_t i = 0; i < job->class->normalexit_len; i++) {
-		if (job->class->normalexit[i] == status) {
-			priority = NIH_LOG_INFO;
-			break;
+	for (int i = 0; i < RLIMIT_NLIMITS; i++) {
+		if (! class->limits[i])
+			continue;
+
+		if (setrlimit (i, class->limits[i]) < 0) {
+			*type = JOB_PROCESS_ERROR_RLIMIT;
+			*arg = i;
+			return -1;
 		}
 	}
 
-	switch (event) {
-	case NIH_CHILD_EXITED:
-		/* Child exited; check status to see whether it exited
-		 * normally (zero) or with a non-zero status.
-		 */
-		if (status) {
-			nih_log_message (priority, _("%s %s process (%d) "
-						     "terminated with status %d"),
-					 job_name (job), process_name (process),
-					 pid, status);
-		} else {
-			nih_info (_("%s %s process (%d) exited normally"),
-				  job_name (job), process_name (process), pid);
-		}
+	/* This is one of the few operations that can never fail */
+	umask (class->umask);
 
-		job_process_terminated (job, process, status, FALSE);
-		break;
-	case NIH_CHILD_KILLED:
-	case NIH_CHILD_DUMPED:
-		/* Child was killed by a signal, and maybe dumped core.  We
-		 * store the signal value in the higher byte of status (it's
-		 * safe to do that) to distinguish it from a normal exit
-		 * status.
-		 */
-		sig = nih_signal_to_name (status);
-		if (sig) {
-			nih_log_message (priority, _("%s %s process (%d) killed by %s signal"),
-					 job_name (job), process_name (process),
-					 pid, sig);
-		} else {
-			nih_warn (_("%s %s process (%d) killed by signal %d"),
-				  job_name (job), process_name (process),
-				  pid, status);
-		}
+	if (class->nice != JOB_NICE_INVALID &&
+	    setpriority (PRIO_PROCESS, 0, class->nice) < 0) {
+		*type = JOB_PROCESS_ERROR_PRIORITY;
+		return -1;
+	}
 
-		status <<= 8;
-		job_process_terminated (job, process, status, FALSE);
-		break;
-	case NIH_CHILD_STOPPED:
-		/* Child was stopped by a signal, make sure it was SIGSTOP
-		 * and not a tty-related signal.
-		 */
-		sig = nih_signal_to_name (status);
-		if (sig) {
-			nih_info (_("%s %s process (%d) stopped by %s signal"),
-				  job_name (job), process_name (process),
-				  pid, sig);
-		} else {
-			nih_info (_("%s %s process (%d) stopped by signal %d"),
-				  job_name (job), process_name (process),
-				  pid, status);
-		}
+	if (class->placement
+	    && (job_process_set_affinity (class->placement) < 0)) {
+		*type = JOB_PROCESS_ERROR_AFFINITY;
+		return -1;
+	}
 
-		if (status == SIGSTOP)
-			job_process_stopped (job, process);
+	if (class->placement
+	    && (job_process_set_mempolicy (class->placement) < 0)) {
+		*type = JOB_PROCESS_ERROR_MEMPOLICY;
+		return -1;
+	}
 
-		break;
-	case NIH_CHILD_CONTINUED:
-		/* Child was continued by a signal.
-		 */
-		sig = nih_signal_to_name (status);
-		if (sig) {
-			nih_info (_("%s %s process (%d) continued by %s signal"),
-				  job_name (job), process_name (process),
-				  pid, sig);
-		} else {
-			nih_info (_("%s %s process (%d) continued by signal %d"),
-				  job_name (job), process_name (process),
-				  pid, status);
+	if (job_process_set_sched (class) < 0) {
+		*type = JOB_PROCESS_ERROR_SCHED;
+		return -1;
+	}
+
+	if (job_process_set_ioprio (class) < 0) {
+		*type = JOB_PROCESS_ERROR_IOPRIO;
+		return -1;
+	}
+
+	if (class->timer_slack
+	    && (prctl (PR_SET_TIMERSLACK, class->timer_slack) < 0)) {
+		*type = JOB_PROCESS_ERROR_TIMER_SLACK;
+		return -1;
+	}
+
+	/* Older kernels only have the coarser oom_adj, scaled to its
+	 * range.
+	 */
+	if (class->oom_score_adj != JOB_DEFAULT_OOM_SCORE_ADJ) {
+		char buf[16];
+		int  oom_value = class->oom_score_adj;
+		int  len;
+		int  fd;
+
+		fd = open ("/proc/self/oom_score_adj", O_WRONLY);
+		if ((fd < 0) && (errno == ENOENT)) {
+			oom_value = (class->oom_score_adj
+				     * ((class->oom_score_adj < 0) ? 17 : 15)) / 1000;
+			fd = open ("/proc/self/oom_adj", O_WRONLY);
 		}
-		break;
-	case NIH_CHILD_TRAPPED:
-		/* Child received a signal while we were tracing it.  This
-		 * can be a signal raised inside the kernel as a side-effect
-		 * of the trace because the child called fork() or exec();
-		 * we only know that from our own state tracking.
-		 */
-		if ((job->trace_state == TRACE_NEW)
-		    && (status == SIGTRAP)) {
-			job_process_trace_new (job, process);
-		} else if ((job->trace_state == TRACE_NEW_CHILD)
-			   && (status == SIGSTOP)) {
-			job_process_trace_new_child (job, process);
-		} else {
-			job_process_trace_signal (job, process, status);
+		if (fd < 0) {
+			*type = JOB_PROCESS_ERROR_OOM_ADJ;
+			return -1;
 		}
-		break;
-	case NIH_CHILD_PTRACE:
-		/* Child called an important syscall that can modify the
-		 * state of the process trace we hold.
-		 */
-		switch (status) {
-		case PTRACE_EVENT_FORK:
-			job_process_trace_fork (job, process);
-			break;
-		case PTRACE_EVENT_EXEC:
-			job_process_trace_exec (job, process);
-			break;
-		default:
-			nih_assert_not_reached ();
+
+		len = snprintf (buf, sizeof (buf), "%d\n", oom_value);
+		if (write (fd, buf, len) != len) {
+			int saved_errno = errno;
+
+			close (fd);
+			errno = saved_errno;
+			*type = JOB_PROCESS_ERROR_OOM_ADJ;
+			return -1;
+		}
+
+		if (close (fd) < 0) {
+			*type = JOB_PROCESS_ERROR_OOM_ADJ;
+			return -1;
 		}
-		break;
-	default:
-		nih_assert_not_reached ();
 	}
 
+	return 0;
 }
 
-
 /**
- * job_process_terminated:
- * @job: job that changed,
- * @process: specific process,
- * @status: exit status or signal in higher byte,
- * @state_only: if TRUE, only update the jobs state (not its goal).
+ * job_process_error_handler:
+ * @buf: data read from child process,
+ * @len: length of data read as @wire_err.
  *
- * This function is called whenever a @process attached to @job terminates,
- * @status should contain the exit status in the lower byte or signal in
- * the higher byte.
+ * Read from the reading end of the pipe specified by @fd, if we receive
+ * data then the child raised a process error which we reconstruct and raise
+ * again; otherwise no problem was found and no action is taken.
  *
- * The job structure is updated and the next appropriate state for the job
- * is chosen, which may involve changing the goal to stop first.
+ * The reconstructed error will be of JOB_PROCESS_ERROR type, the human-
+ * readable message is generated according to the type of process error
+ * and argument passed along with it.
  **/
-static void
-job_process_terminated (Job         *job,
-			ProcessType  process,
-			int          status,
-			int          state_only)
+void
+job_process_error_handler (const char *buf, size_t len)
 {
-	int failed = FALSE, stop = FALSE, state = TRUE;
-	struct utmpx *utmptr;
-	struct timeval tv;
+	JobProcessWireError  *wire_err;
+	JobProcessError      *err;
+	const char           *res;
 
-	nih_assert (job != NULL);
+	wire_err = (JobProcessWireError *)buf;
 
-	if (job->state == JOB_SECURITY_SPAWNING ||
-			job->state == JOB_PRE_STARTING ||
-			job->state == JOB_SPAWNING ||
-			job->state == JOB_POST_STARTING ||
-			job->state == JOB_PRE_STOPPING ||
-			job->state == JOB_POST_STOPPING) {
-		/* A child process has been spawned by
-		 * job_process_spawn(), but we have not yet received
-		 * confirmation of whether the child setup phase was
-		 * successful or not.
-		 *
-		 * The fact that we are in this function means the child
-		 * setup actually failed, however we handle that
-		 * by waiting for the handlers registered by
-		 * job_register_child_handler() to be called to deal
-		 * with this error.
-		 */
-		nih_assert (job->process_data);
-		nih_assert (job->process_data[process]);
+	nih_assert (wire_err);
 
-		/* Add the child data for the *second* call to this
-		 * function when the child pipe has been closed.
-		 */
-		job->process_data[process]->status = status;
+	/* Read the error from the pipe; a zero read indicates that the
+	 * exec succeeded so we return success, otherwise if we don't receive
+	 * a JobProcessWireError structure, we return a temporary error so we
+	 * try again.
+	 */
+	if (len != sizeof (JobProcessWireError)) {
+		errno = EILSEQ;
+		nih_return_system_error ();
+	}
+
+	/* Construct a JobProcessError to be raised containing information
+	 * from the wire, augmented with human-readable information we
+	 * generate here.
+	 */
+	err = NIH_MUST (nih_new (NULL, JobProcessError));
+
+	err->type = wire_err->type;
+	err->arg = wire_err->arg;
+	err->errnum = wire_err->errnum;
+
+	err->error.number = JOB_PROCESS_ERROR;
+
+	switch (err->type) {
+	case JOB_PROCESS_ERROR_DUP:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to move script fd: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_CONSOLE:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to open console: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_RLIMIT:
+		switch (err->arg) {
+		case RLIMIT_CPU:
+			res = "cpu";
+			break;
+		case RLIMIT_FSIZE:
+			res = "fsize";
+			break;
+		case RLIMIT_DATA:
+			res = "data";
+			break;
+		case RLIMIT_STACK:
+			res = "stack";
+			break;
+		case RLIMIT_CORE:
+			res = "core";
+			break;
+		case RLIMIT_RSS:
+			res = "rss";
+			break;
+		case RLIMIT_NPROC:
+			res = "nproc";
+			break;
+		case RLIMIT_NOFILE:
+			res = "nofile";
+			break;
+		case RLIMIT_MEMLOCK:
+			res = "memlock";
+			break;
+		case RLIMIT_AS:
+			res = "as";
+			break;
+		case RLIMIT_LOCKS:
+			res = "locks";
+			break;
+		case RLIMIT_SIGPENDING:
+			res = "sigpending";
+			break;
+		case RLIMIT_MSGQUEUE:
+			res = "msgqueue";
+			break;
+		case RLIMIT_NICE:
+			res = "nice";
+			break;
+		case RLIMIT_RTPRIO:
+			res = "rtprio";
+			break;
+		default:
+			nih_assert_not_reached ();
+		}
+
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to set \"%s\" resource limit: %s"),
+				  res, strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_PRIORITY:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to set priority: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_OOM_ADJ:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to set oom adjustment: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_AFFINITY:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to set processor affinity: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_MEMPOLICY:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to set memory policy: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_SCHED:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to set scheduling policy: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_IOPRIO:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to set I/O priority: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_TIMER_SLACK:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to set timer slack: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_CHROOT:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to change root directory: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_CHDIR:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to change working directory: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_PTRACE:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to set trace: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_EXEC:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to execute: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_GETPWNAM:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to getpwnam: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_GETGRNAM:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to getgrnam: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_GETPWUID:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to getpwuid: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_GETGRGID:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to getgrgid: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_BAD_SETUID:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to find setuid user")));
+		break;
+	case JOB_PROCESS_ERROR_BAD_SETGID:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to find setgid group")));
+		break;
+	case JOB_PROCESS_ERROR_SETUID:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to setuid: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_SETGID:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to setgid: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_CHOWN:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to chown: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_UNLOCKPT:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to unlockpt: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_GRANTPT:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to granpt: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_PTSNAME:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to get ptsname: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_OPENPT_SLAVE:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to open pty slave: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_SIGNAL:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to modify signal handler: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_ALLOC:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to allocate memory: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_INITGROUPS:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to initgroups: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_SECURITY:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to switch security profile: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_CGROUP_MGR_CONNECT:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to connect to CGManager: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_CGROUP_SETUP:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to setup cgroup: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_CGROUP_ENTER:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to enter cgroup: %s"),
+				  strerror (err->errnum)));
+		break;
+	case JOB_PROCESS_ERROR_CGROUP_CLEAR:
+		err->error.message = NIH_MUST (nih_sprintf (
+				  err, _("unable to mark cgroups for removal: %s"),
+				  strerror (err->errnum)));
+		break;
+
+	default:
+		nih_assert_not_reached ();
+	}
+
+	nih_error_raise_error (&err->error);
+}
+
+
+/**
+ * job_process_kill:
+ * @job: job to kill process of,
+ * @process: process to be killed.
+ *
+ * This function forces a @job to leave its current state by sending
+ * @process the "kill signal" defined signal (TERM by default), and maybe
+ * later the KILL signal, to its process group or to every process in
+ * the job's cgroups as job_process_signal() describes.  The actual state
+ * changes are performed by job_child_reaper when the process has actually
+ * terminated.
+ **/
+void
+job_process_kill (Job         *job,
+		  ProcessType  process)
+{
+	nih_assert (job != NULL);
+	nih_assert (job->pid[process] > 0);
+	nih_assert (job->kill_timer == NULL);
+	nih_assert (job->kill_process == PROCESS_INVALID);
+
+	nih_info (_("Sending %s signal to %s %s process (%d)"),
+		  nih_signal_to_name (job->class->kill_signal),
+		  job_name (job), process_name (process), job->pid[process]);
+
+	if (job_process_signal (job, process, job->class->kill_signal) < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		if (err->number != ESRCH)
+			nih_warn (_("Failed to send %s signal to %s %s process (%d): %s"),
+				  nih_signal_to_name (job->class->kill_signal),
+				  job_name (job), process_name (process),
+				  job->pid[process], err->message);
+		nih_free (err);
+
+		return;
+	}
+
+	job_process_set_kill_timer (job, process, job->class->kill_timeout);
+}
+
+/**
+ * job_process_signal:
+ * @job: job to signal process of,
+ * @process: process to be signalled,
+ * @signal: signal to send.
+ *
+ * Sends @signal to the process group of @process or, for jobs with
+ * "kill mode cgroup" whose cgroups are created directly in the unified
+ * hierarchy, to every process in them in a single operation, so that the
+ * whole process tree of the job goes however it was forked.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+job_process_signal (Job         *job,
+		    ProcessType  process,
+		    int          signal)
+{
+	nih_assert (job != NULL);
+	nih_assert (job->pid[process] > 0);
+
+#ifdef ENABLE_CGROUPS
+	if (job->class->kill_cgroup && job_needs_cgroups (job)
+	    && cgroup_unified_available ()) {
+		nih_local char **env = NULL;
+		NihError        *err;
+
+		env = job_cgroup_environment (NULL, job);
+		if (cgroup_unified_kill (&job->class->cgroups, env, signal))
+			return 0;
+
+		err = nih_error_get ();
+		nih_debug ("Failed to signal cgroups of %s: %s",
+			   job_name (job), err->message);
+		nih_free (err);
+	}
+#endif /* ENABLE_CGROUPS */
+
+	return system_kill (job->pid[process], signal);
+}
+
+/**
+ * job_process_jobs_running:
+ *
+ * Determine if any jobs are running. Note that simply checking if class
+ * instances exist is insufficient: since this call is used for shutdown
+ * abstract jobs must not be able to block the shutdown.
+ *
+ * Returns: TRUE if jobs are still running, else FALSE.
+ **/
+int
+job_process_jobs_running (void)
+{
+	job_class_init ();
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		NIH_HASH_FOREACH (class->instances, job_iter) {
+			Job *job = (Job *)job_iter;
+			int i;
+
+			for (i = 0; i < PROCESS_LAST; i++) {
+				if (job->pid[i])
+					return TRUE;
+			}
+		}
+	}
+
+	return FALSE;
+}
+
+
+/**
+ * job_process_stop_all:
+ *
+ * Stop all running jobs.
+ **/
+void
+job_process_stop_all (void)
+{
+	job_class_init ();
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		/* Note that instances get killed in a random order */
+		NIH_HASH_FOREACH (class->instances, job_iter) {
+			Job *job = (Job *)job_iter;
+
+			/* Request job instance stops */
+			job_change_goal (job, JOB_STOP);
+		}
+	}
+}
+
+/**
+ * job_process_set_kill_timer:
+ * @job: job to set kill timer for,
+ * @process: process to be killed,
+ * @timeout: timeout to apply for timer.
+ *
+ * Set kill timer for specified @job @process with timeout @timeout.
+ **/
+void
+job_process_set_kill_timer (Job          *job,
+		  	    ProcessType   process,
+			    time_t        timeout)
+{
+	nih_assert (job);
+	nih_assert (timeout);
+	nih_assert (job->kill_timer == NULL);
+
+	job->kill_process = process;
+	job->kill_timer = NIH_MUST (timer_wheel_add (
+			  job, (uint64_t)timeout * 1000,
+			  (WheelTimerCb)job_process_kill_timer, job));
+}
+
+/**
+ * job_process_adj_kill_timer:
+ *
+ * @job: job whose kill timer is to be modified,
+ * @due: new due time to set for job kill timer, in milliseconds on
+ * CLOCK_MONOTONIC.
+ *
+ * Adjust due time for @job's kill timer to @due.
+ **/
+void
+job_process_adj_kill_timer (Job *job, uint64_t due)
+{
+	nih_assert (job);
+	nih_assert (job->kill_timer);
+	nih_assert (due);
+
+	timer_wheel_adjust (job->kill_timer, due);
+}
+
+/**
+ * job_process_kill_timer:
+ * @job: job to kill process of,
+ * @timer: timer that caused us to be called.
+ *
+ * This callback is called if the process failed to terminate within
+ * a particular time of being sent the TERM signal.  The process is killed
+ * more forcibly by sending the KILL signal.
+ **/
+static void
+job_process_kill_timer (Job        *job,
+			WheelTimer *timer)
+{
+	ProcessType process;
+
+	nih_assert (job != NULL);
+	nih_assert (timer != NULL);
+	nih_assert (job->kill_timer == timer);
+	nih_assert (job->kill_process != PROCESS_INVALID);
+
+	process = job->kill_process;
+	nih_assert (job->pid[process] > 0);
+
+	job->kill_timer = NULL;
+	job->kill_process = PROCESS_INVALID;
+
+	nih_info (_("Sending %s signal to %s %s process (%d)"),
+		  "KILL",
+		  job_name (job), process_name (process), job->pid[process]);
+
+	if (job_process_signal (job, process, SIGKILL) < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		if (err->number != ESRCH)
+			nih_warn (_("Failed to send %s signal to %s %s process (%d): %s"),
+				  "KILL",
+				  job_name (job), process_name (process),
+				  job->pid[process], err->message);
+		nih_free (err);
+	}
+}
+
+
+/**
+ * job_process_handler:
+ * @data: unused,
+ * @pid: process that changed,
+ * @event: event that occurred on the child,
+ * @status: exit status, signal raised or ptrace event.
+ *
+ * This callback should be registered with nih_child_add_watch() so that
+ * when processes associated with jobs die, stop, receive signals or other
+ * ptrace events, the appropriate action is taken.
+ *
+ * Normally this is registered so it is called for all processes, and is
+ * safe to do as it only acts if the process is linked to a job.
+ **/
+void
+job_process_handler (void           *data,
+		     pid_t           pid,
+		     NihChildEvents  event,
+		     int             status)
+{
+	Job          *job;
+	ProcessType   process;
+	NihLogLevel   priority;
+	const char   *sig;
+	MetricsStall  stall;
+
+	nih_assert (pid > 0);
+
+	UPSTART_PROBE (job_process_handler, pid, event, status);
+
+	metrics_stall_begin (&stall, "job_process_handler", NULL);
+
+	/* Find the job that an event ocurred for, and identify which of the
+	 * job's process it was.  If we don't know about it, then we simply
+	 * ignore the event.
+	 */
+	/* The process may have forked a new main process that we've been
+	 * told about but not yet heard of, which has to be caught up on
+	 * before it can be known whether this one still matters.
+	 */
+	job_process_proc_poll ();
+
+	job = job_process_find (pid, &process);
+
+	/* Account the process even if unknown, so that it isn't counted
+	 * against the next one.
+	 */
+	job_process_account (job, event);
+
+	if (! job) {
+		metrics_stall_end (&stall);
+		return;
+	}
+
+	metrics_stall_name (&stall, job_name (job));
+
+	/* Check the job's normal exit clauses to see whether this is a failure
+	 * worth warning about.
+	 */
+	priority = NIH_LOG_WARN;
+	for (size_t i = 0; i < job->class->normalexit_len; i++) {
+		if (job->class->normalexit[i] == status) {
+			priority = NIH_LOG_INFO;
+			break;
+		}
+	}
+
+	switch (event) {
+	case NIH_CHILD_EXITED:
+		/* Child exited; check status to see whether it exited
+		 * normally (zero) or with a non-zero status.
+		 */
+		if (status) {
+			nih_log_message (priority, _("%s %s process (%d) "
+						     "terminated with status %d"),
+					 job_name (job), process_name (process),
+					 pid, status);
+		} else {
+			nih_info (_("%s %s process (%d) exited normally"),
+				  job_name (job), process_name (process), pid);
+		}
+
+		metrics_count (METRICS_PROCESSES_REAPED);
+		job_process_terminated (job, process, status, FALSE);
+		break;
+	case NIH_CHILD_KILLED:
+	case NIH_CHILD_DUMPED:
+		/* Child was killed by a signal, and maybe dumped core.  We
+		 * store the signal value in the higher byte of status (it's
+		 * safe to do that) to distinguish it from a normal exit
+		 * status.
+		 */
+		sig = nih_signal_to_name (status);
+		if (sig) {
+			nih_log_message (priority, _("%s %s process (%d) killed by %s signal"),
+					 job_name (job), process_name (process),
+					 pid, sig);
+		} else {
+			nih_warn (_("%s %s process (%d) killed by signal %d"),
+				  job_name (job), process_name (process),
+				  pid, status);
+		}
+
+		status <<= 8;
+		metrics_count (METRICS_PROCESSES_REAPED);
+		job_process_terminated (job, process, status, FALSE);
+		break;
+	case NIH_CHILD_STOPPED:
+		/* Child was stopped by a signal, make sure it was SIGSTOP
+		 * and not a tty-related signal.
+		 */
+		sig = nih_signal_to_name (status);
+		if (sig) {
+			nih_info (_("%s %s process (%d) stopped by %s signal"),
+				  job_name (job), process_name (process),
+				  pid, sig);
+		} else {
+			nih_info (_("%s %s process (%d) stopped by signal %d"),
+				  job_name (job), process_name (process),
+				  pid, status);
+		}
+
+		if (status == SIGSTOP)
+			job_process_stopped (job, process);
+
+		break;
+	case NIH_CHILD_CONTINUED:
+		/* Child was continued by a signal.
+		 */
+		sig = nih_signal_to_name (status);
+		if (sig) {
+			nih_info (_("%s %s process (%d) continued by %s signal"),
+				  job_name (job), process_name (process),
+				  pid, sig);
+		} else {
+			nih_info (_("%s %s process (%d) continued by signal %d"),
+				  job_name (job), process_name (process),
+				  pid, status);
+		}
+		break;
+	case NIH_CHILD_TRAPPED:
+		/* Child received a signal while we were tracing it.  This
+		 * can be a signal raised inside the kernel as a side-effect
+		 * of the trace because the child called fork() or exec();
+		 * we only know that from our own state tracking.
+		 */
+		if ((job->trace_state == TRACE_NEW)
+		    && (status == SIGTRAP)) {
+			job_process_trace_new (job, process);
+		} else if ((job->trace_state == TRACE_NEW_CHILD)
+			   && (status == SIGSTOP)) {
+			job_process_trace_new_child (job, process);
+		} else {
+			job_process_trace_signal (job, process, status);
+		}
+		break;
+	case NIH_CHILD_PTRACE:
+		/* Child called an important syscall that can modify the
+		 * state of the process trace we hold.
+		 */
+		switch (status) {
+		case PTRACE_EVENT_FORK:
+			job_process_trace_fork (job, process);
+			break;
+		case PTRACE_EVENT_EXEC:
+			job_process_trace_exec (job, process);
+			break;
+		default:
+			nih_assert_not_reached ();
+		}
+		break;
+	default:
+		nih_assert_not_reached ();
+	}
+
+	metrics_stall_end (&stall);
+}
+
+/**
+ * job_process_account_init:
+ *
+ * Note the resources used by the children we reaped before jobs were
+ * watched, such as those of an earlier instance of the init daemon that
+ * re-executed itself, so that they aren't accounted to any job.
+ **/
+void
+job_process_account_init (void)
+{
+	if (getrusage (RUSAGE_CHILDREN, &job_process_rusage) < 0)
+		memset (&job_process_rusage, 0, sizeof (job_process_rusage));
+}
+
+/**
+ * job_process_account:
+ * @job: job the process belonged to, or NULL,
+ * @event: event that occurred on the child.
+ *
+ * Called from job_process_handler() as each child is reaped to add the
+ * resources it used to those of @job and of its class.  These are the
+ * difference in the resources used by all of our reaped children since
+ * the last call, and so include those of any of its own children that it
+ * reaped.
+ *
+ * The maximum resident set size of reaped children is only known to the
+ * kernel as a whole, so that of the process is only known when it is the
+ * largest so far.
+ **/
+static void
+job_process_account (Job            *job,
+		     NihChildEvents  event)
+{
+	struct rusage usage;
+	uint64_t      resources[JOB_RESOURCE_LAST];
+
+	switch (event) {
+	case NIH_CHILD_EXITED:
+	case NIH_CHILD_KILLED:
+	case NIH_CHILD_DUMPED:
+		break;
+	default:
+		return;
+	}
+
+	if (getrusage (RUSAGE_CHILDREN, &usage) < 0)
+		return;
+
+	resources[JOB_RESOURCE_PROCESSES] = 1;
+	resources[JOB_RESOURCE_USER_TIME] = (
+		((uint64_t)usage.ru_utime.tv_sec * 1000000
+		 + usage.ru_utime.tv_usec)
+		- ((uint64_t)job_process_rusage.ru_utime.tv_sec * 1000000
+		   + job_process_rusage.ru_utime.tv_usec));
+	resources[JOB_RESOURCE_SYSTEM_TIME] = (
+		((uint64_t)usage.ru_stime.tv_sec * 1000000
+		 + usage.ru_stime.tv_usec)
+		- ((uint64_t)job_process_rusage.ru_stime.tv_sec * 1000000
+		   + job_process_rusage.ru_stime.tv_usec));
+	resources[JOB_RESOURCE_MAX_RSS] = (
+		usage.ru_maxrss > job_process_rusage.ru_maxrss
+		? usage.ru_maxrss : 0);
+	resources[JOB_RESOURCE_READ_BLOCKS] = (
+		usage.ru_inblock - job_process_rusage.ru_inblock);
+	resources[JOB_RESOURCE_WRITE_BLOCKS] = (
+		usage.ru_oublock - job_process_rusage.ru_oublock);
+
+	job_process_rusage = usage;
+
+	if (! job)
+		return;
+
+	job_resources_add (job->resources, resources);
+	job_resources_add (job->class->resources, resources);
+}
+
+
+/**
+ * job_process_terminated:
+ * @job: job that changed,
+ * @process: specific process,
+ * @status: exit status or signal in higher byte,
+ * @state_only: if TRUE, only update the jobs state (not its goal).
+ *
+ * This function is called whenever a @process attached to @job terminates,
+ * @status should contain the exit status in the lower byte or signal in
+ * the higher byte.
+ *
+ * The job structure is updated and the next appropriate state for the job
+ * is chosen, which may involve changing the goal to stop first.
+ **/
+static void
+job_process_terminated (Job         *job,
+			ProcessType  process,
+			int          status,
+			int          state_only)
+{
+	int failed = FALSE, stop = FALSE, state = TRUE;
+	struct utmpx *utmptr;
+	struct timeval tv;
+
+	nih_assert (job != NULL);
+
+	if (job->state == JOB_SECURITY_SPAWNING ||
+			job->state == JOB_PRE_STARTING ||
+			job->state == JOB_SPAWNING ||
+			job->state == JOB_POST_STARTING ||
+			job->state == JOB_PRE_STOPPING ||
+			job->state == JOB_POST_STOPPING) {
+		/* A child process has been spawned by
+		 * job_process_spawn(), but we have not yet received
+		 * confirmation of whether the child setup phase was
+		 * successful or not.
+		 *
+		 * The fact that we are in this function means the child
+		 * setup actually failed, however we handle that
+		 * by waiting for the handlers registered by
+		 * job_register_child_handler() to be called to deal
+		 * with this error.
+		 */
+		nih_assert (job->process_data);
+		nih_assert (job->process_data[process]);
+
+		/* Add the child data for the *second* call to this
+		 * function when the child pipe has been closed.
+		 */
+		job->process_data[process]->status = status;
 
 		job->state = job_next_state (job);
 
 		return;
 	}
 
-	switch (process) {
-	case PROCESS_MAIN:
-		nih_assert ((job->state == JOB_RUNNING)
-			    || (job->state == JOB_SPAWNED)
-			    || (job->state == JOB_KILLED)
-			    || (job->state == JOB_STOPPING)
-			    || (job->state == JOB_POST_START)
-			    || (job->state == JOB_PRE_STOP));
+	switch (process) {
+	case PROCESS_MAIN:
+		nih_assert ((job->state == JOB_RUNNING)
+			    || (job->state == JOB_SPAWNED)
+			    || (job->state == JOB_KILLED)
+			    || (job->state == JOB_STOPPING)
+			    || (job->state == JOB_POST_START)
+			    || (job->state == JOB_PRE_STOP));
+
+		/* Nothing more can be heard from the process, nor can it
+		 * fork any more.
+		 */
+		job_process_notify_close (job);
+
+		if (job->trace_state == TRACE_PASSIVE) {
+			job->trace_state = TRACE_NONE;
+			job_process_proc_release ();
+		}
+
+		/* We don't change the state if we're in post-start and there's
+		 * a post-start process running, or if we're in pre-stop and
+		 * there's a pre-stop process running; we wait for those to
+		 * finish instead.
+		 */
+		if ((job->state == JOB_POST_START)
+		    && job->class->process[PROCESS_POST_START]
+		    && (job->pid[PROCESS_POST_START] > 0)) {
+			state = FALSE;
+		} else if ((job->state == JOB_PRE_STOP)
+		    && job->class->process[PROCESS_PRE_STOP]
+		    && (job->pid[PROCESS_PRE_STOP] > 0)) {
+			state = FALSE;
+		}
+
+		/* Dying when we killed it is perfectly normal and never
+		 * considered a failure.  We also don't want to tamper with
+		 * the goal since we might be restarting the job anyway.
+		 */
+		if (job->state == JOB_KILLED)
+			break;
+
+		/* Yet another corner case is terminating when we were
+		 * already stopping, we don't to tamper with the goal or
+		 * state because we're still waiting for the stopping
+		 * event to finish and that might restart it anyway.
+		 * We also don't want to consider it a failure, because
+		 * we want the stopping and stopped events to match.
+		 */
+		if (job->state == JOB_STOPPING) {
+			state = FALSE;
+			break;
+		}
+
+		/* We don't assume that because the primary process was
+		 * killed or exited with a non-zero status, it failed.
+		 * Instead we check the normalexit list to see whether
+		 * the exit signal or status is in that list, and only
+		 * if not, do we consider it failed.
+		 *
+		 * For services that can be respawned, a zero exit status is
+		 * also a failure unless listed.
+		 */
+		if ((status || (job->class->respawn && (! job->class->task)))
+		    && (job->goal == JOB_START)) {
+			failed = TRUE;
+			for (size_t i = 0; i < job->class->normalexit_len; i++) {
+				if (job->class->normalexit[i] == status) {
+					failed = FALSE;
+					break;
+				}
+			}
+
+			/* We might be able to respawn the failed job;
+			 * that's a simple matter of doing nothing.  Check
+			 * the job isn't running away first though.
+			 */
+			if (failed && job->class->respawn && ! disable_respawn
+			    && job->class->respawn_backoff_initial) {
+				uint64_t delay;
+
+				/* Respawn once the backoff delay has passed,
+				 * leaving the job where it is until then.
+				 */
+				delay = job_process_respawn_backoff (job);
+
+				nih_warn (_("%s %s process ended, respawning in %llu ms"),
+					  job_name (job),
+					  process_name (process),
+					  (unsigned long long)delay);
+				failed = FALSE;
+				state = FALSE;
+
+				metrics_count (METRICS_JOBS_RESPAWNED);
+				job_process_set_respawn_timer (job, delay);
+				break;
+			} else if (failed && job->class->respawn && ! disable_respawn) {
+				if (job_process_catch_runaway (job)) {
+					nih_warn (_("%s respawning too fast, stopped"),
+						  job_name (job));
+
+					failed = FALSE;
+					job_failed (job, PROCESS_INVALID, 0);
+				} else {
+					nih_warn (_("%s %s process ended, respawning"),
+						  job_name (job),
+						  process_name (process));
+					failed = FALSE;
+					metrics_count (METRICS_JOBS_RESPAWNED);
+
+					/* If we're not going to change the
+					 * state because there's a post-start
+					 * or pre-stop script running, we need
+					 * to remember to do it when that
+					 * finishes.
+					 */
+					if (! state)
+						job_change_goal (job, JOB_RESPAWN);
+					break;
+				}
+			}
+		}
+
+		/* Otherwise whether it's failed or not, we should
+		 * stop the job now.
+		 */
+		stop = TRUE;
+		break;
+	case PROCESS_SECURITY:
+		nih_assert (job->state == JOB_SECURITY);
+
+		if (job->class->process[PROCESS_SECURITY])
+			apparmor_load_finished (job->class->process[PROCESS_SECURITY]->command,
+						status);
+
+		/* We should always fail the job if the security profile
+		 * failed to load
+		 */
+
+		/* Disabled for now to emulate current Ubuntu behaviour
+		 * in /lib/init/apparmor-profile-load to work around bug
+		 * LP: #1058356
+
+		if (status) {
+			failed = TRUE;
+			stop = TRUE;
+		}
+
+		 */
+
+		break;
+	case PROCESS_PRE_START:
+		nih_assert (job->state == JOB_PRE_START);
+
+		/* If the pre-start script is killed or exits with a status
+		 * other than zero, it's always considered a failure since
+		 * we don't know what state the job might be in.
+		 */
+		if (status) {
+			failed = TRUE;
+			stop = TRUE;
+		}
+		break;
+	case PROCESS_POST_START:
+		nih_assert (job->state == JOB_POST_START || job->state == JOB_RUNNING);
+
+		/* We always want to change the state when the post-start
+		 * script terminates; if the main process is running, we'll
+		 * stay in that state, otherwise we'll skip through.
+		 *
+		 * Failure is ignored since there's not much we can do
+		 * about it at this point.
+		 */
+		break;
+	case PROCESS_PRE_STOP:
+		nih_assert (job->state == JOB_PRE_STOP);
+
+		/* We always want to change the state when the pre-stop
+		 * script terminates, we either want to go back into running
+		 * or head towards killing the main process.
+		 *
+		 * Failure is ignored since there's not much we can do
+		 * about it at this point.
+		 */
+		break;
+	case PROCESS_POST_STOP:
+		nih_assert (job->state == JOB_POST_STOP);
+
+		/* If the post-stop script is killed or exits with a status
+		 * other than zero, it's always considered a failure since
+		 * we don't know what state the job might be in.
+		 */
+		if (status) {
+			failed = TRUE;
+			stop = TRUE;
+		}
+		break;
+	default:
+		nih_assert_not_reached ();
+	}
+
+	/* Cancel any timer trying to kill the job, since it's just
+	 * died.  We could do this inside the main process block above, but
+	 * leaving it here for now means we can use the timer for any
+	 * additional process later.
+	 */
+	if (job->kill_timer) {
+		nih_unref (job->kill_timer, job);
+		job->kill_timer = NULL;
+		job->kill_process = PROCESS_INVALID;
+	}
+
+	if (job->class->console == CONSOLE_LOG && job->log[process] && ! state_only) {
+		int  ret;
+
+		/* It is imperative that we free the log at this stage to ensure
+		 * that jobs which respawn have their log written _now_
+		 * (and not just when the overall Job object is freed at
+		 * some distant future point).
+		 */
+		ret = log_handle_unflushed (job->log, job->log[process]);
+
+		if (ret != 0) {
+			if (ret < 0) {
+				/* Any lingering data will now be lost in what
+				 * is probably a low-memory scenario.
+				 */
+				nih_warn (_("Failed to add log to unflushed queue"));
+			}
+			nih_free (job->log[process]);
+		}
+
+		/* Either the log has been freed, or it needs to be
+		 * severed from its parent job fully.
+		 */
+		job->log[process] = NULL;
+	}
+
+	if (! state_only) {
+		/* Find existing utmp entry for the process pid */
+		setutxent();
+		while ((utmptr = getutxent()) != NULL) {
+			if (utmptr->ut_pid == job->pid[process]) {
+				/* set type and clean ut_user, ut_host,
+				 * ut_time as described in utmp(5)
+				 */
+				utmptr->ut_type = DEAD_PROCESS;
+				memset(utmptr->ut_user, 0, UT_NAMESIZE);
+				memset(utmptr->ut_host, 0, UT_HOSTSIZE);
+				utmptr->ut_time = 0;
+				/* Update existing utmp file. */
+				pututxline(utmptr);
+
+				/* set ut_time for log */
+				gettimeofday(&tv, NULL);
+				utmptr->ut_tv.tv_sec = tv.tv_sec;
+				utmptr->ut_tv.tv_usec = tv.tv_usec;
+				/* Write wtmp entry */
+				updwtmpx (_PATH_WTMP, utmptr);
+
+				break;
+			}
+		}
+		endutxent();
+
+		/* Clear the process pid field */
+		job_process_set_pid (job, process, 0);
+	}
+
+	/* Mark the job as failed */
+	if (failed)
+		job_failed (job, process, status);
+
+	/* Cancel goal transition if the job state only should be
+	 * changed.
+	 */
+	if (state_only && stop) {
+		stop = 0;
+		nih_assert (! failed);
+	}
+
+	/* Change the goal to stop; normally this doesn't have any
+	 * side-effects, except when we're in the RUNNING state when it'll
+	 * change the state as well.  We obviously don't want to change the
+	 * state twice.
+	 */
+	if (stop) {
+		if (job->state == JOB_RUNNING)
+			state = FALSE;
+
+		job_change_goal (job, JOB_STOP);
+	}
+
+	if (state)
+		job_change_state (job, job_next_state (job));
+
+	/* Finish shutting down as soon as the last process is gone */
+	if (! state_only)
+		quiesce_job_reaped ();
+}
+
+/**
+ * job_process_catch_runaway
+ * @job: job being started.
+ *
+ * This function is called when changing the state of a job to starting,
+ * before emitting the event.  It ensures that a job doesn't end up in
+ * a restart loop by limiting the number of restarts in a particular
+ * time limit.
+ *
+ * Returns: TRUE if the job is respawning too fast, FALSE if not.
+ */
+static int
+job_process_catch_runaway (Job *job)
+{
+	struct timespec now;
+
+	nih_assert (job != NULL);
+
+	if (job->class->respawn_limit && job->class->respawn_interval) {
+		time_t interval;
+
+		/* Time since last respawn ... this goes very large if we
+		 * haven't done one, which is fine
+		 */
+		nih_assert (clock_gettime (CLOCK_MONOTONIC, &now) == 0);
+
+		interval = now.tv_sec - job->respawn_time;
+		if (interval < job->class->respawn_interval) {
+			job->respawn_count++;
+			if (job->respawn_count > job->class->respawn_limit)
+				return TRUE;
+		} else {
+			job->respawn_time = now.tv_sec;
+			job->respawn_count = 1;
+		}
+	}
+
+	return FALSE;
+}
+
+
+/**
+ * job_process_respawn_backoff:
+ * @job: job being respawned.
+ *
+ * This function is called when the main process of a job whose class
+ * has a respawn backoff has failed, to work out how long to delay the
+ * respawn for.  The delay starts at the initial backoff of the class and
+ * doubles with each respawn up to its maximum; if the process ran for at
+ * least that maximum it's considered to have been stable and the delay
+ * starts again from the initial backoff.
+ *
+ * The delay is then varied randomly by up to the jitter percentage of
+ * the class, so that many jobs failing at once don't respawn together.
+ *
+ * Returns: milliseconds to delay the respawn by.
+ **/
+static uint64_t
+job_process_respawn_backoff (Job *job)
+{
+	uint64_t initial;
+	uint64_t max;
+	uint64_t delay;
+	uint64_t jitter;
+
+	nih_assert (job != NULL);
+	nih_assert (job->class->respawn_backoff_initial > 0);
+
+	initial = (uint64_t)job->class->respawn_backoff_initial * 1000;
+	max = (uint64_t)job->class->respawn_backoff_max * 1000;
+	if (max < initial)
+		max = initial;
+
+	if (job->respawn_delay && job->timings.fork[PROCESS_MAIN]) {
+		uint64_t uptime;
+
+		uptime = (timer_wheel_now () * 1000
+			  - job->timings.fork[PROCESS_MAIN]) / 1000;
+		if (uptime >= max)
+			job->respawn_delay = 0;
+	}
+
+	if (! job->respawn_delay) {
+		delay = initial;
+	} else if (job->respawn_delay >= max / 2) {
+		delay = max;
+	} else {
+		delay = job->respawn_delay * 2;
+	}
+
+	job->respawn_delay = delay;
+
+	jitter = delay * job->class->respawn_backoff_jitter / 100;
+	if (jitter)
+		delay = delay - jitter + ((uint64_t)random () % (jitter * 2 + 1));
+
+	return delay;
+}
+
+/**
+ * job_process_set_respawn_timer:
+ * @job: job to respawn,
+ * @timeout: milliseconds to wait.
+ *
+ * Set a timer to respawn the main process of @job after @timeout
+ * milliseconds.
+ **/
+void
+job_process_set_respawn_timer (Job      *job,
+			       uint64_t  timeout)
+{
+	nih_assert (job != NULL);
+
+	if (job->respawn_timer)
+		nih_unref (job->respawn_timer, job);
+
+	job->respawn_timer = NIH_MUST (timer_wheel_add (
+			  job, timeout,
+			  (WheelTimerCb)job_process_respawn_timer, job));
+}
+
+/**
+ * job_process_respawn_timer:
+ * @job: job to respawn,
+ * @timer: timer that caused us to be called.
+ *
+ * This callback is called once the respawn backoff delay of @job has
+ * passed, and respawns it in the same way as an undelayed respawn would
+ * have been.
+ **/
+static void
+job_process_respawn_timer (Job        *job,
+			   WheelTimer *timer)
+{
+	nih_assert (job != NULL);
+	nih_assert (timer != NULL);
+	nih_assert (job->respawn_timer == timer);
+
+	job->respawn_timer = NULL;
+
+	if (job->goal != JOB_START)
+		return;
+
+	switch (job->state) {
+	case JOB_RUNNING:
+		job_change_state (job, job_next_state (job));
+		break;
+	case JOB_POST_START:
+		/* The post-start script is still running, respawn when
+		 * it finishes.
+		 */
+		job_change_goal (job, JOB_RESPAWN);
+		break;
+	default:
+		break;
+	}
+}
+
+
+/**
+ * job_process_stopped:
+ * @job: job that changed,
+ * @process: specific process.
+ *
+ * This function is called whenever a @process attached to @job is stopped
+ * by the SIGSTOP signal (and not by a tty-related signal).
+ *
+ * Some jobs use this signal to signify that they have completed starting
+ * up and are now running; thus we move them out of the spawned state.
+ **/
+static void
+job_process_stopped (Job         *job,
+		     ProcessType  process)
+{
+	nih_assert (job != NULL);
+
+	/* Any process can stop on a signal, but we only care about the
+	 * main process when the state is still spawned.
+	 */
+	if ((process != PROCESS_MAIN) || ((job->state != JOB_SPAWNING) && job->state != JOB_SPAWNED))
+		return;
+
+	/* Send SIGCONT back and change the state to the next one, if this
+	 * job behaves that way.
+	 */
+	if (job->class->expect == EXPECT_STOP) {
+		kill (job->pid[process], SIGCONT);
+		job_change_state (job, job_next_state (job));
+	}
+}
+
+
+/**
+ * job_process_trace_new:
+ * @job: job that changed,
+ * @process: specific process.
+ *
+ * This function is called when the traced @process attached to @job calls
+ * its first exec(), still within the Upstart code before passing control
+ * to the new executable.
+ *
+ * It sets the options for the trace so that forks and execs are reported.
+ **/
+static void
+job_process_trace_new (Job         *job,
+		       ProcessType  process)
+{
+	nih_assert (job != NULL);
+
+	nih_assert ((job->trace_state == TRACE_NEW)
+		    || (job->trace_state == TRACE_NEW_CHILD));
+
+	/* Any process can get us to trace them, but we only care about the
+	 * main process when the state is still spawned.
+	 */
+	if ((process != PROCESS_MAIN) || ((job->state != JOB_SPAWNING) && (job->state != JOB_SPAWNED))) {
+		return;
+	}
+
+	/* Set options so that we are notified when the process forks, and
+	 * get a different kind of notification when it execs to a plain
+	 * SIGTRAP.
+	 */
+	if (ptrace (PTRACE_SETOPTIONS, job->pid[process], NULL,
+		    PTRACE_O_TRACEFORK | PTRACE_O_TRACEEXEC) < 0) {
+		nih_warn (_("Failed to set ptrace options for "
+			    "%s %s process (%d): %s"),
+			  job_name (job), process_name (process),
+			  job->pid[process], strerror (errno));
+		return;
+	}
+
+	job->trace_state = TRACE_NORMAL;
+
+	/* Allow the process to continue without delivering the
+	 * kernel-generated signal that was for our eyes not theirs.
+	 */
+	if (ptrace (PTRACE_CONT, job->pid[process], NULL, 0) < 0)
+		nih_warn (_("Failed to continue traced %s %s process (%d): %s"),
+			  job_name (job), process_name (process),
+			  job->pid[process], strerror (errno));
+}
+
+/**
+ * job_process_trace_new_child:
+ * @job: job that changed,
+ * @process: specific process.
+ *
+ * This function is called whenever a traced @process attached to @job stops
+ * after the fork() so that we can set the options before continuing it.
+ *
+ * Check to see whether we've reached the number of forks we expected, if
+ * so detach the process and move towards the running state; otherwise we
+ * set our important ptrace options, update the trace state so that
+ * further SIGSTOP or SIGTRAP signals are treated as just that and allow
+ * the process to continue.
+ **/
+static void
+job_process_trace_new_child (Job         *job,
+			     ProcessType  process)
+{
+	nih_assert (job != NULL);
+	nih_assert (job->trace_state == TRACE_NEW_CHILD);
+
+	/* Any process can get us to trace them, but we only care about the
+	 * main process when the state is still spawned.
+	 */
+	if ((process != PROCESS_MAIN) || ((job->state != JOB_SPAWNING) && (job->state != JOB_SPAWNED)))
+		return;
+
+	/* We need to fork at least twice unless we're expecting a
+	 * single fork when we only need to fork once; once that limit
+	 * has been reached, end the trace.
+	 */
+	job->trace_forks++;
+	if ((job->trace_forks > 1) || (job->class->expect == EXPECT_FORK))
+	{
+		if (ptrace (PTRACE_DETACH, job->pid[process], NULL, 0) < 0)
+			nih_warn (_("Failed to detach traced "
+				    "%s %s process (%d): %s"),
+				  job_name (job), process_name (process),
+				  job->pid[process], strerror (errno));
+
+		job->trace_state = TRACE_NONE;
+		job_change_state (job, job_next_state (job));
+		return;
+	}
+
+	job_process_trace_new (job, process);
+}
+
+/**
+ * job_process_trace_signal:
+ * @job: job that changed,
+ * @process: specific process.
+ *
+ * This function is called whenever a traced @process attached to @job has
+ * a signal sent to it.
+ *
+ * We don't care about these, they're a side effect of ptrace that we can't
+ * turn off, so we just deliver them untampered with.
+ **/
+static void
+job_process_trace_signal (Job         *job,
+			  ProcessType  process,
+			  int          signum)
+{
+	nih_assert (job != NULL);
+
+	/* Any process can get us to trace them, but we only care about the
+	 * main process when the state is still spawned.
+	 */
+	if ((process != PROCESS_MAIN) || ((job->state != JOB_SPAWNING) && (job->state != JOB_SPAWNED))
+	    || (job->trace_state != TRACE_NORMAL))
+		return;
+
+	/* Deliver the signal */
+	if (ptrace (PTRACE_CONT, job->pid[process], NULL, signum) < 0)
+		nih_warn (_("Failed to deliver signal to traced "
+			    "%s %s process (%d): %s"),
+			  job_name (job), process_name (process),
+			  job->pid[process], strerror (errno));
+}
+
+/**
+ * job_process_trace_fork:
+ * @job: job that changed,
+ * @process: specific process.
+ *
+ * This function is called whenever a traced @process attached to @job calls
+ * the fork() system call.
+ *
+ * We obtain the new child process id from the message and update the
+ * structure so that we follow that instead, detaching from the process that
+ * called fork.
+ **/
+static void
+job_process_trace_fork (Job         *job,
+			ProcessType  process)
+{
+	unsigned long data;
+
+	nih_assert (job != NULL);
+
+	/* Any process can get us to trace them, but we only care about the
+	 * main process when the state is still spawned.
+	 */
+	if ((process != PROCESS_MAIN) || ((job->state != JOB_SPAWNING) && (job->state != JOB_SPAWNED))
+	    || (job->trace_state != TRACE_NORMAL)) {
+		return;
+	}
+
+	/* Obtain the child process id from the ptrace event. */
+	if (ptrace (PTRACE_GETEVENTMSG, job->pid[process], NULL, &data) < 0) {
+		nih_warn (_("Failed to obtain child process id "
+			    "for %s %s process (%d): %s"),
+			  job_name (job), process_name (process),
+			  job->pid[process], strerror (errno));
+		return;
+	}
+
+	nih_info (_("%s %s process (%d) became new process (%d)"),
+		  job_name (job), process_name (process),
+		  job->pid[process], (pid_t)data);
+
+	/* We no longer care about this process, it's the child that we're
+	 * interested in from now on, so detach it and allow it to go about
+	 * its business unhindered.
+	 */
+	if (ptrace (PTRACE_DETACH, job->pid[process], NULL, 0) < 0)
+		nih_warn (_("Failed to detach traced %s %s process (%d): %s"),
+			  job_name (job), process_name (process),
+			  job->pid[process], strerror (errno));
+
+	/* Update the process we're supervising which is about to get SIGSTOP
+	 * so set the trace options to capture it.
+	 */
+	job_process_set_pid (job, process, (pid_t)data);
+	job->trace_state = TRACE_NEW_CHILD;
+
+	/* We may have already had the wait notification for the new child
+	 * waiting at SIGSTOP, in which case a ptrace() call will succeed
+	 * for it.
+	 */
+	if (ptrace (PTRACE_SETOPTIONS, job->pid[process], NULL, 0) < 0) {
+		nih_debug ("Failed to set options for new %s %s process (%d), "
+			   "probably not yet forked: %s",
+			   job_name (job), process_name (process),
+			   job->pid[process], strerror (errno));
+		return;
+	}
+
+	job_process_trace_new_child (job, process);
+}
+
+/**
+ * job_process_trace_exec:
+ * @job: job that changed,
+ * @process: specific process.
+ *
+ * This function is called whenever a traced @process attached to @job calls
+ * the exec() system call after we've set options on it to distinguish them
+ * from ordinary SIGTRAPs.
+ *
+ * We assume that if the job calls exec that it's finished forking so we can
+ * drop the trace entirely; we have no interest in tracing the new child.
+ **/
+static void
+job_process_trace_exec (Job         *job,
+			ProcessType  process)
+{
+	nih_assert (job != NULL);
+
+	/* Any process can get us to trace them, but we only care about the
+	 * main process when the state is still spawned and we're tracing it.
+	 */
+	if ((process != PROCESS_MAIN) || ((job->state != JOB_SPAWNING) && job->state != JOB_SPAWNED)
+	    || (job->trace_state != TRACE_NORMAL))
+		return;
+
+	nih_info (_("%s %s process (%d) executable changed"),
+		  job_name (job), process_name (process), job->pid[process]);
+
+	if (job->trace_forks) {
+		if (ptrace (PTRACE_DETACH, job->pid[process], NULL, 0) < 0)
+			nih_warn (_("Failed to detach traced "
+				    "%s %s process (%d): %s"),
+				  job_name (job), process_name (process),
+				  job->pid[process], strerror (errno));
+
+		job->trace_state = TRACE_NONE;
+		job_change_state (job, job_next_state (job));
+	} else {
+		if (ptrace (PTRACE_CONT, job->pid[process], NULL, 0) < 0)
+			nih_warn (_("Failed to continue traced %s %s process (%d): %s"),
+				  job_name (job), process_name (process),
+				  job->pid[process], strerror (errno));
+	}
+}
+
 
-		/* We don't change the state if we're in post-start and there's
-		 * a post-start process running, or if we're in pre-stop and
-		 * there's a pre-stop process running; we wait for those to
-		 * finish instead.
-		 */
-		if ((job->state == JOB_POST_START)
-		    && job->class->process[PROCESS_POST_START]
-		    && (job->pid[PROCESS_POST_START] > 0)) {
-			state = FALSE;
-		} else if ((job->state == JOB_PRE_STOP)
-		    && job->class->process[PROCESS_PRE_STOP]
-		    && (job->pid[PROCESS_PRE_STOP] > 0)) {
-			state = FALSE;
-		}
+/**
+ * job_process_proc_init:
+ *
+ * Opens the netlink socket over which the kernel proc connector informs
+ * us of every fork and exec on the system, so that jobs which expect to
+ * become a daemon or fork passively can be followed without tracing them.
+ * This does nothing if the socket is already open.
+ *
+ * Listening requires privilege, which is confirmed by the kernel's
+ * acknowledgement of our request; if it isn't given the socket is closed
+ * again.
+ *
+ * Returns: zero on success, negative value with error raised on failure.
+ **/
+int
+job_process_proc_init (void)
+{
+	struct sockaddr_nl  addr;
+	int                 acked = -1;
+	int                 ret;
 
-		/* Dying when we killed it is perfectly normal and never
-		 * considered a failure.  We also don't want to tamper with
-		 * the goal since we might be restarting the job anyway.
-		 */
-		if (job->state == JOB_KILLED)
-			break;
+	if (job_process_proc_fd >= 0)
+		return 0;
 
-		/* Yet another corner case is terminating when we were
-		 * already stopping, we don't to tamper with the goal or
-		 * state because we're still waiting for the stopping
-		 * event to finish and that might restart it anyway.
-		 * We also don't want to consider it a failure, because
-		 * we want the stopping and stopped events to match.
-		 */
-		if (job->state == JOB_STOPPING) {
-			state = FALSE;
-			break;
-		}
+	job_process_proc_fd = socket (PF_NETLINK,
+				      SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				      NETLINK_CONNECTOR);
+	if (job_process_proc_fd < 0)
+		nih_return_system_error (-1);
 
-		/* We don't assume that because the primary process was
-		 * killed or exited with a non-zero status, it failed.
-		 * Instead we check the normalexit list to see whether
-		 * the exit signal or status is in that list, and only
-		 * if not, do we consider it failed.
-		 *
-		 * For services that can be respawned, a zero exit status is
-		 * also a failure unless listed.
-		 */
-		if ((status || (job->class->respawn && (! job->class->task)))
-		    && (job->goal == JOB_START)) {
-			failed = TRUE;
-			for (size_t i = 0; i < job->class->normalexit_len; i++) {
-				if (job->class->normalexit[i] == status) {
-					failed = FALSE;
-					break;
-				}
-			}
+	memset (&addr, 0, sizeof (addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = CN_IDX_PROC;
 
-			/* We might be able to respawn the failed job;
-			 * that's a simple matter of doing nothing.  Check
-			 * the job isn't running away first though.
-			 */
-			if (failed && job->class->respawn && ! disable_respawn) {
-				if (job_process_catch_runaway (job)) {
-					nih_warn (_("%s respawning too fast, stopped"),
-						  job_name (job));
+	if (bind (job_process_proc_fd, (struct sockaddr *)&addr,
+		  sizeof (addr)) < 0)
+		goto error;
 
-					failed = FALSE;
-					job_failed (job, PROCESS_INVALID, 0);
-				} else {
-					nih_warn (_("%s %s process ended, respawning"),
-						  job_name (job),
-						  process_name (process));
-					failed = FALSE;
+	if (job_process_proc_send (PROC_CN_MCAST_LISTEN) < 0)
+		goto error;
 
-					/* If we're not going to change the
-					 * state because there's a post-start
-					 * or pre-stop script running, we need
-					 * to remember to do it when that
-					 * finishes.
-					 */
-					if (! state)
-						job_change_goal (job, JOB_RESPAWN);
-					break;
-				}
-			}
-		}
+	/* The acknowledgement is sent before send() returns, but may be
+	 * preceded by events for anyone else already listening.
+	 */
+	job_process_proc_reading = TRUE;
+	do {
+		ret = job_process_proc_read (&acked);
+	} while ((ret > 0) && (acked < 0));
+	job_process_proc_reading = FALSE;
 
-		/* Otherwise whether it's failed or not, we should
-		 * stop the job now.
-		 */
-		stop = TRUE;
-		break;
-	case PROCESS_SECURITY:
-		nih_assert (job->state == JOB_SECURITY);
+	if (ret < 0)
+		goto error;
 
-		/* We should always fail the job if the security profile
-		 * failed to load
-		 */
+	if (acked < 0) {
+		errno = EPROTO;
+		goto error;
+	}
 
-		/* Disabled for now to emulate current Ubuntu behaviour
-		 * in /lib/init/apparmor-profile-load to work around bug
-		 * LP: #1058356
+	if (acked) {
+		errno = acked;
+		goto error;
+	}
 
-		if (status) {
-			failed = TRUE;
-			stop = TRUE;
-		}
+	job_process_proc_watch = NIH_MUST (nih_io_add_watch (
+						   NULL, job_process_proc_fd,
+						   NIH_IO_READ,
+						   job_process_proc_watcher,
+						   NULL));
 
-		 */
+	return 0;
 
-		break;
-	case PROCESS_PRE_START:
-		nih_assert (job->state == JOB_PRE_START);
+error:
+	nih_error_raise_system ();
+	close (job_process_proc_fd);
+	job_process_proc_fd = -1;
+	return -1;
+}
 
-		/* If the pre-start script is killed or exits with a status
-		 * other than zero, it's always considered a failure since
-		 * we don't know what state the job might be in.
-		 */
-		if (status) {
-			failed = TRUE;
-			stop = TRUE;
-		}
-		break;
-	case PROCESS_POST_START:
-		nih_assert (job->state == JOB_POST_START || job->state == JOB_RUNNING);
+/**
+ * job_process_proc_poll:
+ *
+ * Handles any proc connector events waiting to be read, to bring the
+ * processes of jobs being followed passively up to date.  This does
+ * nothing unless job_process_proc_init() has been called.
+ **/
+void
+job_process_proc_poll (void)
+{
+	if (job_process_proc_fd < 0)
+		return;
 
-		/* We always want to change the state when the post-start
-		 * script terminates; if the main process is running, we'll
-		 * stay in that state, otherwise we'll skip through.
-		 *
-		 * Failure is ignored since there's not much we can do
-		 * about it at this point.
-		 */
-		break;
-	case PROCESS_PRE_STOP:
-		nih_assert (job->state == JOB_PRE_STOP);
+	job_process_proc_reading = TRUE;
+	while (job_process_proc_read (NULL) > 0)
+		;
+	job_process_proc_reading = FALSE;
 
-		/* We always want to change the state when the pre-stop
-		 * script terminates, we either want to go back into running
-		 * or head towards killing the main process.
-		 *
-		 * Failure is ignored since there's not much we can do
-		 * about it at this point.
-		 */
-		break;
-	case PROCESS_POST_STOP:
-		nih_assert (job->state == JOB_POST_STOP);
+	job_process_proc_release ();
+}
 
-		/* If the post-stop script is killed or exits with a status
-		 * other than zero, it's always considered a failure since
-		 * we don't know what state the job might be in.
-		 */
-		if (status) {
-			failed = TRUE;
-			stop = TRUE;
+/**
+ * job_process_proc_release:
+ *
+ * Closes the socket opened by job_process_proc_init() once no job is
+ * being followed through it, since the kernel sends us every fork and
+ * exec on the system for as long as we listen; we tell it to stop
+ * first, as others may still be listening.  This does nothing while
+ * any job is still being followed, or while events are being read.
+ **/
+void
+job_process_proc_release (void)
+{
+	if ((job_process_proc_fd < 0) || job_process_proc_reading)
+		return;
+
+	job_class_init ();
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		NIH_HASH_FOREACH (class->instances, job_iter) {
+			Job *job = (Job *)job_iter;
+
+			if (job->trace_state == TRACE_PASSIVE)
+				return;
 		}
-		break;
-	default:
-		nih_assert_not_reached ();
 	}
 
-	/* Cancel any timer trying to kill the job, since it's just
-	 * died.  We could do this inside the main process block above, but
-	 * leaving it here for now means we can use the timer for any
-	 * additional process later.
-	 */
-	if (job->kill_timer) {
-		nih_unref (job->kill_timer, job);
-		job->kill_timer = NULL;
-		job->kill_process = PROCESS_INVALID;
+	if (job_process_proc_send (PROC_CN_MCAST_IGNORE) < 0)
+		nih_debug ("Failed to stop proc connector events: %s",
+			   strerror (errno));
+
+	if (job_process_proc_watch) {
+		nih_free (job_process_proc_watch);
+		job_process_proc_watch = NULL;
 	}
 
-	if (job->class->console == CONSOLE_LOG && job->log[process] && ! state_only) {
-		int  ret;
+	close (job_process_proc_fd);
+	job_process_proc_fd = -1;
+}
 
-		/* It is imperative that we free the log at this stage to ensure
-		 * that jobs which respawn have their log written _now_
-		 * (and not just when the overall Job object is freed at
-		 * some distant future point).
+/**
+ * job_process_proc_send:
+ * @op: operation to request.
+ *
+ * Sends a request to the kernel proc connector on job_process_proc_fd,
+ * either PROC_CN_MCAST_LISTEN to start receiving events or
+ * PROC_CN_MCAST_IGNORE to stop.
+ *
+ * Returns: zero on success, negative value with errno set on failure.
+ **/
+static int
+job_process_proc_send (enum proc_cn_mcast_op op)
+{
+	char             buf[NLMSG_SPACE (sizeof (struct cn_msg)
+					  + sizeof (enum proc_cn_mcast_op))]
+		__attribute__ ((aligned (NLMSG_ALIGNTO)));
+	struct nlmsghdr *hdr = (struct nlmsghdr *)buf;
+	struct cn_msg   *msg;
+
+	nih_assert (job_process_proc_fd >= 0);
+
+	memset (buf, 0, sizeof (buf));
+	hdr->nlmsg_len = NLMSG_LENGTH (sizeof (struct cn_msg) + sizeof (op));
+	hdr->nlmsg_type = NLMSG_DONE;
+
+	msg = NLMSG_DATA (hdr);
+	msg->id.idx = CN_IDX_PROC;
+	msg->id.val = CN_VAL_PROC;
+	msg->len = sizeof (op);
+	memcpy (msg->data, &op, sizeof (op));
+
+	if (send (job_process_proc_fd, buf, hdr->nlmsg_len, 0) < 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * job_process_proc_watcher:
+ * @data: unused,
+ * @watch: NihIoWatch for which an event occurred,
+ * @events: events that occurred.
+ *
+ * Called when proc connector events are ready to be read.
+ **/
+static void
+job_process_proc_watcher (void        *data,
+			  NihIoWatch  *watch,
+			  NihIoEvents  events)
+{
+	nih_assert (watch != NULL);
+
+	job_process_proc_poll ();
+}
+
+/**
+ * job_process_proc_read:
+ * @acked: set to the result of our listen request, or NULL.
+ *
+ * Reads one datagram of proc connector events and hands the forks and
+ * execs of main processes we're following passively to
+ * job_process_passive_fork() and job_process_passive_exec().
+ *
+ * If @acked is not NULL and the datagram contains the acknowledgement of
+ * our request to listen, it is set to the error number of that request,
+ * zero meaning success.
+ *
+ * Returns: positive value if events were read, zero if there were none
+ * or negative value with errno set on failure.
+ **/
+static int
+job_process_proc_read (int *acked)
+{
+	char                buf[4096] __attribute__ ((aligned (NLMSG_ALIGNTO)));
+	struct nlmsghdr    *hdr;
+	struct sockaddr_nl  addr;
+	socklen_t           addrlen = sizeof (addr);
+	ssize_t             len;
+
+	len = recvfrom (job_process_proc_fd, buf, sizeof (buf), 0,
+			(struct sockaddr *)&addr, &addrlen);
+	if (len < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			return 0;
+
+		/* Events were dropped because we didn't keep up, any job
+		 * whose fork was among them won't leave spawned.
 		 */
-		ret = log_handle_unflushed (job->log, job->log[process]);
-
-		if (ret != 0) {
-			if (ret < 0) {
-				/* Any lingering data will now be lost in what
-				 * is probably a low-memory scenario.
-				 */
-				nih_warn (_("Failed to add log to unflushed queue"));
-			}
-			nih_free (job->log[process]);
+		if (errno == ENOBUFS) {
+			nih_warn (_("Lost proc connector events, daemons "
+				    "being followed may be missed"));
+			return 1;
 		}
 
-		/* Either the log has been freed, or it needs to be
-		 * severed from its parent job fully.
-		 */
-		job->log[process] = NULL;
+		return -1;
 	}
 
-	if (! state_only) {
-		/* Find existing utmp entry for the process pid */
-		setutxent();
-		while ((utmptr = getutxent()) != NULL) {
-			if (utmptr->ut_pid == job->pid[process]) {
-				/* set type and clean ut_user, ut_host,
-				 * ut_time as described in utmp(5)
-				 */
-				utmptr->ut_type = DEAD_PROCESS;
-				memset(utmptr->ut_user, 0, UT_NAMESIZE);
-				memset(utmptr->ut_host, 0, UT_HOSTSIZE);
-				utmptr->ut_time = 0;
-				/* Update existing utmp file. */
-				pututxline(utmptr);
+	/* Only the kernel may tell us about processes */
+	if (addr.nl_pid != 0)
+		return 1;
 
-				/* set ut_time for log */
-				gettimeofday(&tv, NULL);
-				utmptr->ut_tv.tv_sec = tv.tv_sec;
-				utmptr->ut_tv.tv_usec = tv.tv_usec;
-				/* Write wtmp entry */
-				updwtmpx (_PATH_WTMP, utmptr);
+	for (hdr = (struct nlmsghdr *)buf; NLMSG_OK (hdr, (size_t)len);
+	     hdr = NLMSG_NEXT (hdr, len)) {
+		struct cn_msg     *msg;
+		struct proc_event *ev;
+		Job               *job;
+		ProcessType        process;
+
+		if ((hdr->nlmsg_type == NLMSG_ERROR)
+		    || (hdr->nlmsg_type == NLMSG_NOOP))
+			continue;
+
+		msg = NLMSG_DATA (hdr);
+		if ((msg->id.idx != CN_IDX_PROC) || (msg->id.val != CN_VAL_PROC))
+			continue;
+
+		ev = (struct proc_event *)msg->data;
 
+		switch (ev->what) {
+		case PROC_EVENT_NONE:
+			if (acked)
+				*acked = ev->event_data.ack.err;
+			break;
+		case PROC_EVENT_FORK:
+			/* Ignore new threads */
+			if (ev->event_data.fork.child_pid
+			    != ev->event_data.fork.child_tgid)
 				break;
-			}
-		}
-		endutxent();
 
-		/* Clear the process pid field */
-		job->pid[process] = 0;
+			job = job_process_find (ev->event_data.fork.parent_tgid,
+						&process);
+			if (job)
+				job_process_passive_fork (
+					job, process,
+					ev->event_data.fork.child_tgid);
+			break;
+		case PROC_EVENT_EXEC:
+			job = job_process_find (ev->event_data.exec.process_tgid,
+						&process);
+			if (job)
+				job_process_passive_exec (job, process);
+			break;
+		default:
+			break;
+		}
 	}
 
-	/* Mark the job as failed */
-	if (failed)
-		job_failed (job, process, status);
+	return 1;
+}
 
-	/* Cancel goal transition if the job state only should be
-	 * changed.
-	 */
-	if (state_only && stop) {
-		stop = 0;
-		nih_assert (! failed);
-	}
+/**
+ * job_process_passive_fork:
+ * @job: job that changed,
+ * @process: specific process,
+ * @pid: process id of new child.
+ *
+ * This function is called whenever a @process attached to @job that we're
+ * following passively forks a new child @pid.
+ *
+ * As with a traced process we follow the child from now on, and once the
+ * number of forks we expected is reached move towards the running state.
+ **/
+static void
+job_process_passive_fork (Job         *job,
+			  ProcessType  process,
+			  pid_t        pid)
+{
+	nih_assert (job != NULL);
+	nih_assert (pid > 0);
 
-	/* Change the goal to stop; normally this doesn't have any
-	 * side-effects, except when we're in the RUNNING state when it'll
-	 * change the state as well.  We obviously don't want to change the
-	 * state twice.
+	/* Only the main process is followed, while the state is still
+	 * spawned.
 	 */
-	if (stop) {
-		if (job->state == JOB_RUNNING)
-			state = FALSE;
+	if ((process != PROCESS_MAIN)
+	    || ((job->state != JOB_SPAWNING) && (job->state != JOB_SPAWNED))
+	    || (job->trace_state != TRACE_PASSIVE))
+		return;
 
-		job_change_goal (job, JOB_STOP);
-	}
+	nih_info (_("%s %s process (%d) became new process (%d)"),
+		  job_name (job), process_name (process),
+		  job->pid[process], pid);
 
-	if (state)
+	job_process_set_pid (job, process, pid);
+
+	job->trace_forks++;
+	if ((job->trace_forks > 1) || (job->class->expect == EXPECT_FORK_PASSIVE)) {
+		job->trace_state = TRACE_NONE;
 		job_change_state (job, job_next_state (job));
+	}
 }
 
 /**
- * job_process_catch_runaway
- * @job: job being started.
+ * job_process_passive_exec:
+ * @job: job that changed,
+ * @process: specific process.
  *
- * This function is called when changing the state of a job to starting,
- * before emitting the event.  It ensures that a job doesn't end up in
- * a restart loop by limiting the number of restarts in a particular
- * time limit.
+ * This function is called whenever a @process attached to @job that we're
+ * following passively calls exec().
  *
- * Returns: TRUE if the job is respawning too fast, FALSE if not.
- */
-static int
-job_process_catch_runaway (Job *job)
+ * As for a traced process, we assume that if the job calls exec after
+ * forking it has finished doing so.
+ **/
+static void
+job_process_passive_exec (Job         *job,
+			  ProcessType  process)
 {
-	struct timespec now;
+	nih_assert (job != NULL);
+
+	if ((process != PROCESS_MAIN)
+	    || ((job->state != JOB_SPAWNING) && (job->state != JOB_SPAWNED))
+	    || (job->trace_state != TRACE_PASSIVE) || (! job->trace_forks))
+		return;
+
+	nih_info (_("%s %s process (%d) executable changed"),
+		  job_name (job), process_name (process), job->pid[process]);
+
+	job->trace_state = TRACE_NONE;
+	job_change_state (job, job_next_state (job));
+}
+
+
+/**
+ * job_process_notify_open:
+ * @parent: parent object for new string,
+ * @job: job to open socket for.
+ *
+ * Opens the socket over which the main process of @job tells us that it
+ * is ready, replacing any opened earlier; datagrams received on it are
+ * handled by job_process_notify_poll().
+ *
+ * The socket is bound to a unique name in the abstract namespace chosen
+ * by the kernel, so there is nothing to remove from the filesystem; the
+ * name is returned in the form expected in the NOTIFY_SOCKET variable.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned string.  When all parents
+ * of the returned string are freed, the returned string will also be
+ * freed.
+ *
+ * Returns: newly allocated name of socket or NULL on raised error.
+ **/
+char *
+job_process_notify_open (const void *parent,
+			 Job        *job)
+{
+	struct sockaddr_un  addr;
+	socklen_t           addrlen;
+	char               *name;
+	int                 opt = 1;
 
 	nih_assert (job != NULL);
 
-	if (job->class->respawn_limit && job->class->respawn_interval) {
-		time_t interval;
+	job_process_notify_close (job);
 
-		/* Time since last respawn ... this goes very large if we
-		 * haven't done one, which is fine
-		 */
-		nih_assert (clock_gettime (CLOCK_MONOTONIC, &now) == 0);
+	job->notify_fd = socket (AF_UNIX,
+				 SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (job->notify_fd < 0)
+		nih_return_system_error (NULL);
 
-		interval = now.tv_sec - job->respawn_time;
-		if (interval < job->class->respawn_interval) {
-			job->respawn_count++;
-			if (job->respawn_count > job->class->respawn_limit)
-				return TRUE;
-		} else {
-			job->respawn_time = now.tv_sec;
-			job->respawn_count = 1;
-		}
+	/* Credentials are needed to tell who sent each notification;
+	 * binding only the family has the kernel choose the name.
+	 */
+	if (setsockopt (job->notify_fd, SOL_SOCKET, SO_PASSCRED,
+			&opt, sizeof (opt)) < 0)
+		goto error;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+
+	if (bind (job->notify_fd, (struct sockaddr *)&addr,
+		  sizeof (sa_family_t)) < 0)
+		goto error;
+
+	addrlen = sizeof (addr);
+	if (getsockname (job->notify_fd, (struct sockaddr *)&addr,
+			 &addrlen) < 0)
+		goto error;
+
+	/* Abstract names begin with a NUL, given to clients as '@' */
+	name = nih_sprintf (parent, "@%.*s",
+			    (int)(addrlen - offsetof (struct sockaddr_un,
+						      sun_path) - 1),
+			    addr.sun_path + 1);
+	if (! name)
+		goto no_memory;
+
+	job->notify_watch = nih_io_add_watch (
+		job, job->notify_fd, NIH_IO_READ,
+		(NihIoWatcher)job_process_notify_watcher, job);
+	if (! job->notify_watch) {
+		nih_free (name);
+		goto no_memory;
 	}
 
-	return FALSE;
+	return name;
+
+no_memory:
+	errno = ENOMEM;
+error:
+	nih_error_raise_system ();
+	close (job->notify_fd);
+	job->notify_fd = -1;
+	return NULL;
+}
+
+/**
+ * job_process_notify_restore:
+ * @job: job to restore socket of,
+ * @fd: socket opened by job_process_notify_open() before a re-exec.
+ *
+ * Resumes handling notifications from the main process of @job received
+ * on @fd, which was carried across a re-exec.
+ *
+ * Returns: zero on success, negative value on failure.
+ **/
+int
+job_process_notify_restore (Job *job,
+			    int  fd)
+{
+	nih_assert (job != NULL);
+	nih_assert (fd >= 0);
+
+	job_process_notify_close (job);
+
+	if (state_modify_cloexec (fd, TRUE) < 0)
+		return -1;
+
+	job->notify_watch = nih_io_add_watch (
+		job, fd, NIH_IO_READ,
+		(NihIoWatcher)job_process_notify_watcher, job);
+	if (! job->notify_watch)
+		return -1;
+
+	job->notify_fd = fd;
+
+	return 0;
 }
 
+/**
+ * job_process_notify_close:
+ * @job: job to close socket of.
+ *
+ * Closes the socket opened by job_process_notify_open() for @job, if any;
+ * called once the main process has terminated, since nothing more can
+ * be heard from it.
+ **/
+void
+job_process_notify_close (Job *job)
+{
+	nih_assert (job != NULL);
+
+	if (job->notify_watch) {
+		nih_free (job->notify_watch);
+		job->notify_watch = NULL;
+	}
+
+	if (job->notify_fd >= 0) {
+		close (job->notify_fd);
+		job->notify_fd = -1;
+	}
+}
 
 /**
- * job_process_stopped:
- * @job: job that changed,
- * @process: specific process.
+ * job_process_notify_poll:
+ * @job: job to handle notifications for.
  *
- * This function is called whenever a @process attached to @job is stopped
- * by the SIGSTOP signal (and not by a tty-related signal).
+ * Handles any notifications from the main process of @job waiting to be
+ * read.  This does nothing unless job_process_notify_open() has been
+ * called for @job.
  *
- * Some jobs use this signal to signify that they have completed starting
- * up and are now running; thus we move them out of the spawned state.
+ * @job may have been freed on return if a notification changed its state.
+ **/
+void
+job_process_notify_poll (Job *job)
+{
+	nih_assert (job != NULL);
+
+	while ((job->notify_fd >= 0) && (job_process_notify_read (job) > 0))
+		;
+}
+
+/**
+ * job_process_notify_watcher:
+ * @job: job the socket belongs to,
+ * @watch: NihIoWatch for which an event occurred,
+ * @events: events that occurred.
+ *
+ * Called when notifications from the main process of @job are ready to
+ * be read.
  **/
 static void
-job_process_stopped (Job         *job,
-		     ProcessType  process)
+job_process_notify_watcher (Job         *job,
+			    NihIoWatch  *watch,
+			    NihIoEvents  events)
 {
 	nih_assert (job != NULL);
+	nih_assert (watch != NULL);
 
-	/* Any process can stop on a signal, but we only care about the
-	 * main process when the state is still spawned.
-	 */
-	if ((process != PROCESS_MAIN) || ((job->state != JOB_SPAWNING) && job->state != JOB_SPAWNED))
-		return;
+	job_process_notify_poll (job);
+}
 
-	/* Send SIGCONT back and change the state to the next one, if this
-	 * job behaves that way.
+/**
+ * job_process_notify_read:
+ * @job: job to read notification for.
+ *
+ * Reads one datagram from the notification socket of @job and, if it was
+ * sent by the main process, hands it to job_process_notify_message().
+ * Any file descriptors passed with it are closed, since we have no use
+ * for them.
+ *
+ * Returns: positive value if more notifications may be read, zero if
+ * there were none or @job changed state as a result.
+ **/
+static int
+job_process_notify_read (Job *job)
+{
+	char             buf[4096];
+	char             control[CMSG_SPACE (sizeof (struct ucred))
+				 + CMSG_SPACE (sizeof (int) * 16)];
+	struct iovec     iov;
+	struct msghdr    msg;
+	struct cmsghdr  *cmsg;
+	struct ucred    *cred = NULL;
+	ssize_t          len;
+
+	nih_assert (job != NULL);
+	nih_assert (job->notify_fd >= 0);
+
+	iov.iov_base = buf;
+	iov.iov_len = sizeof (buf) - 1;
+
+	memset (&msg, 0, sizeof (msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof (control);
+
+	len = recvmsg (job->notify_fd, &msg, MSG_CMSG_CLOEXEC);
+	if (len < 0) {
+		if (errno == EINTR)
+			return 1;
+
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+			nih_warn (_("Unable to read notification from %s %s "
+				    "process: %s"),
+				  job_name (job), process_name (PROCESS_MAIN),
+				  strerror (errno));
+
+		return 0;
+	}
+
+	buf[len] = '\0';
+
+	for (cmsg = CMSG_FIRSTHDR (&msg); cmsg;
+	     cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+
+		if ((cmsg->cmsg_type == SCM_CREDENTIALS)
+		    && (cmsg->cmsg_len == CMSG_LEN (sizeof (struct ucred)))) {
+			cred = (struct ucred *)CMSG_DATA (cmsg);
+		} else if (cmsg->cmsg_type == SCM_RIGHTS) {
+			int    *fds = (int *)CMSG_DATA (cmsg);
+			size_t  nfds;
+
+			nfds = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+			for (size_t i = 0; i < nfds; i++)
+				close (fds[i]);
+		}
+	}
+
+	/* Anyone may send to the socket, so only listen to the main
+	 * process.
 	 */
-	if (job->class->expect == EXPECT_STOP) {
-		kill (job->pid[process], SIGCONT);
-		job_change_state (job, job_next_state (job));
+	if ((! cred) || (cred->pid != job->pid[PROCESS_MAIN])) {
+		nih_debug ("Ignored notification for %s from process %d",
+			   job_name (job), cred ? (int)cred->pid : 0);
+		return 1;
 	}
-}
 
+	return job_process_notify_message (job, buf) ? 0 : 1;
+}
 
 /**
- * job_process_trace_new:
- * @job: job that changed,
- * @process: specific process.
+ * job_process_notify_message:
+ * @job: job that sent notification,
+ * @msg: notification to handle.
  *
- * This function is called when the traced @process attached to @job calls
- * its first exec(), still within the Upstart code before passing control
- * to the new executable.
+ * Handles the newline-separated assignments in @msg sent by the main
+ * process of @job: READY=1 moves the job out of the spawned state as for
+ * expect stop, MAINPID= gives a new main process, such as the child of a
+ * daemon that forks, provided that job_process_notify_pid() accepts it,
+ * and STATUS= is logged.  Anything else is ignored.
  *
- * It sets the options for the trace so that forks and execs are reported.
+ * @msg is modified.
+ *
+ * Returns: TRUE if the state of @job was changed, FALSE otherwise.
  **/
-static void
-job_process_trace_new (Job         *job,
-		       ProcessType  process)
+static int
+job_process_notify_message (Job  *job,
+			    char *msg)
 {
+	char  *line, *next;
+	int    ready = FALSE;
+	pid_t  pid = 0;
+
 	nih_assert (job != NULL);
+	nih_assert (msg != NULL);
 
-	nih_assert ((job->trace_state == TRACE_NEW)
-		    || (job->trace_state == TRACE_NEW_CHILD));
+	for (line = msg; line && *line; line = next) {
+		next = strchr (line, '\n');
+		if (next)
+			*next++ = '\0';
 
-	/* Any process can get us to trace them, but we only care about the
-	 * main process when the state is still spawned.
-	 */
-	if ((process != PROCESS_MAIN) || ((job->state != JOB_SPAWNING) && (job->state != JOB_SPAWNED))) {
-		return;
+		if (! strcmp (line, "READY=1")) {
+			ready = TRUE;
+		} else if (! strncmp (line, "MAINPID=", 8)) {
+			char *endptr;
+			long  value;
+
+			errno = 0;
+			value = strtol (line + 8, &endptr, 10);
+			if (errno || *endptr || (value <= 0)
+			    || (value > INT_MAX)) {
+				nih_warn (_("%s %s process gave invalid %s"),
+					  job_name (job),
+					  process_name (PROCESS_MAIN), line);
+			} else {
+				pid = value;
+			}
+		} else if (! strncmp (line, "STATUS=", 7)) {
+			nih_info (_("%s %s process status: %s"),
+				  job_name (job), process_name (PROCESS_MAIN),
+				  line + 7);
+		}
+	}
+
+	if (pid && (pid != job->pid[PROCESS_MAIN])
+	    && (! job_process_notify_pid (job, pid))) {
+		nih_warn (_("%s %s process (%d) gave unacceptable new process (%d)"),
+			  job_name (job), process_name (PROCESS_MAIN),
+			  job->pid[PROCESS_MAIN], pid);
+		pid = 0;
 	}
 
-	/* Set options so that we are notified when the process forks, and
-	 * get a different kind of notification when it execs to a plain
-	 * SIGTRAP.
-	 */
-	if (ptrace (PTRACE_SETOPTIONS, job->pid[process], NULL,
-		    PTRACE_O_TRACEFORK | PTRACE_O_TRACEEXEC) < 0) {
-		nih_warn (_("Failed to set ptrace options for "
-			    "%s %s process (%d): %s"),
-			  job_name (job), process_name (process),
-			  job->pid[process], strerror (errno));
-		return;
+	if (pid && (pid != job->pid[PROCESS_MAIN])) {
+		nih_info (_("%s %s process (%d) became new process (%d)"),
+			  job_name (job), process_name (PROCESS_MAIN),
+			  job->pid[PROCESS_MAIN], pid);
+
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 	}
 
-	job->trace_state = TRACE_NORMAL;
+	if ((! ready) || ((job->state != JOB_SPAWNING)
+			  && (job->state != JOB_SPAWNED)))
+		return FALSE;
 
-	/* Allow the process to continue without delivering the
-	 * kernel-generated signal that was for our eyes not theirs.
-	 */
-	if (ptrace (PTRACE_CONT, job->pid[process], NULL, 0) < 0)
-		nih_warn (_("Failed to continue traced %s %s process (%d): %s"),
-			  job_name (job), process_name (process),
-			  job->pid[process], strerror (errno));
+	nih_info (_("%s %s process (%d) is ready"),
+		  job_name (job), process_name (PROCESS_MAIN),
+		  job->pid[PROCESS_MAIN]);
+
+	job_change_state (job, job_next_state (job));
+
+	return TRUE;
 }
 
 /**
- * job_process_trace_new_child:
- * @job: job that changed,
- * @process: specific process.
+ * job_process_notify_pid:
+ * @job: job that sent notification,
+ * @pid: process id given by MAINPID=.
  *
- * This function is called whenever a traced @process attached to @job stops
- * after the fork() so that we can set the options before continuing it.
+ * Determine whether @pid may become the main process of @job.  It must
+ * be a descendant of the current main process, or have been reparented
+ * to us, so that we are eventually notified when it exits; and it
+ * mustn't be init itself or a process of any job, since it will be sent
+ * the signals that stop @job.
  *
- * Check to see whether we've reached the number of forks we expected, if
- * so detach the process and move towards the running state; otherwise we
- * set our important ptrace options, update the trace state so that
- * further SIGSTOP or SIGTRAP signals are treated as just that and allow
- * the process to continue.
+ * Returns: TRUE if @pid is acceptable, FALSE otherwise.
  **/
-static void
-job_process_trace_new_child (Job         *job,
-			     ProcessType  process)
+static int
+job_process_notify_pid (Job   *job,
+			pid_t  pid)
 {
+	pid_t parent;
+
 	nih_assert (job != NULL);
-	nih_assert (job->trace_state == TRACE_NEW_CHILD);
+	nih_assert (pid > 0);
 
-	/* Any process can get us to trace them, but we only care about the
-	 * main process when the state is still spawned.
-	 */
-	if ((process != PROCESS_MAIN) || ((job->state != JOB_SPAWNING) && (job->state != JOB_SPAWNED)))
-		return;
+	if ((pid == 1) || (pid == getpid ()))
+		return FALSE;
 
-	/* We need to fork at least twice unless we're expecting a
-	 * single fork when we only need to fork once; once that limit
-	 * has been reached, end the trace.
-	 */
-	job->trace_forks++;
-	if ((job->trace_forks > 1) || (job->class->expect == EXPECT_FORK))
-	{
-		if (ptrace (PTRACE_DETACH, job->pid[process], NULL, 0) < 0)
-			nih_warn (_("Failed to detach traced "
-				    "%s %s process (%d): %s"),
-				  job_name (job), process_name (process),
-				  job->pid[process], strerror (errno));
+	if (job_process_find (pid, NULL))
+		return FALSE;
 
-		job->trace_state = TRACE_NONE;
-		job_change_state (job, job_next_state (job));
-		return;
+	parent = job_process_parent (pid);
+	if (parent == getpid ())
+		return TRUE;
+
+	for (int i = 0; (i < JOB_PROCESS_ANCESTRY_MAX) && (parent > 1); i++) {
+		if (parent == job->pid[PROCESS_MAIN])
+			return TRUE;
+
+		if (parent == getpid ())
+			break;
+
+		parent = job_process_parent (parent);
 	}
 
-	job_process_trace_new (job, process);
+	return FALSE;
 }
 
 /**
- * job_process_trace_signal:
- * @job: job that changed,
- * @process: specific process.
+ * job_process_parent:
+ * @pid: process id.
  *
- * This function is called whenever a traced @process attached to @job has
- * a signal sent to it.
- *
- * We don't care about these, they're a side effect of ptrace that we can't
- * turn off, so we just deliver them untampered with.
+ * Returns: process id of the parent of @pid, or -1 if it can't be
+ * determined.
  **/
-static void
-job_process_trace_signal (Job         *job,
-			  ProcessType  process,
-			  int          signum)
+static pid_t
+job_process_parent (pid_t pid)
 {
-	nih_assert (job != NULL);
+	char        path[PATH_MAX];
+	char        buf[1024];
+	const char *p;
+	FILE       *f;
+	size_t      len;
+	int         ppid;
 
-	/* Any process can get us to trace them, but we only care about the
-	 * main process when the state is still spawned.
+	nih_assert (pid > 0);
+
+	snprintf (path, sizeof (path), "/proc/%d/stat", (int)pid);
+
+	f = fopen (path, "r");
+	if (! f)
+		return -1;
+
+	len = fread (buf, 1, sizeof (buf) - 1, f);
+	buf[len] = '\0';
+	fclose (f);
+
+	/* The command name may itself contain spaces and parentheses, so
+	 * the fields follow the last of them.
 	 */
-	if ((process != PROCESS_MAIN) || ((job->state != JOB_SPAWNING) && (job->state != JOB_SPAWNED))
-	    || (job->trace_state != TRACE_NORMAL))
-		return;
+	p = strrchr (buf, ')');
+	if ((! p) || (sscanf (p + 1, " %*c %d", &ppid) != 1))
+		return -1;
 
-	/* Deliver the signal */
-	if (ptrace (PTRACE_CONT, job->pid[process], NULL, signum) < 0)
-		nih_warn (_("Failed to deliver signal to traced "
-			    "%s %s process (%d): %s"),
-			  job_name (job), process_name (process),
-			  job->pid[process], strerror (errno));
+	return ppid;
 }
 
 /**
- * job_process_trace_fork:
- * @job: job that changed,
- * @process: specific process.
+ * job_process_find:
+ * @pid: process id to find,
+ * @process: pointer to place process which is running @pid.
  *
- * This function is called whenever a traced @process attached to @job calls
- * the fork() system call.
+ * Finds the job with a process of the given @pid in the job_process_pids
+ * hash table.
+ * If @process is not NULL, the @process variable is set to point at the
+ * process entry in the table which has @pid.
  *
- * We obtain the new child process id from the message and update the
- * structure so that we follow that instead, detaching from the process that
- * called fork.
+ * Returns: job found or NULL if not known.
  **/
-static void
-job_process_trace_fork (Job         *job,
-			ProcessType  process)
+Job *
+job_process_find (pid_t        pid,
+		  ProcessType *process)
 {
-	unsigned long data;
+	JobProcessPid *entry;
+
+	nih_assert (pid > 0);
+
+	job_process_pids_init ();
+
+	entry = (JobProcessPid *)nih_hash_lookup (job_process_pids, &pid);
+	if (! entry)
+		return NULL;
+
+	if (process)
+		*process = entry->process;
+
+	return entry->job;
+}
+
+/**
+ * job_process_set_pid:
+ * @job: job to update,
+ * @process: process of @job to update,
+ * @pid: new process id, or zero.
+ *
+ * Sets the process id of @process in @job's process table to @pid and
+ * updates the job_process_pids hash table to match, so that
+ * job_process_find() can locate the job later.  A @pid of zero clears
+ * the table entry.
+ *
+ * All changes to the pid member of a Job must be made through this
+ * function.
+ **/
+void
+job_process_set_pid (Job         *job,
+		     ProcessType  process,
+		     pid_t        pid)
+{
+	JobProcessPid *entry = NULL;
+	pid_t          old;
 
 	nih_assert (job != NULL);
+	nih_assert (process > PROCESS_INVALID);
+	nih_assert (process < PROCESS_LAST);
+	nih_assert (pid >= 0);
 
-	/* Any process can get us to trace them, but we only care about the
-	 * main process when the state is still spawned.
+	job_process_pids_init ();
+
+	/* Find the existing entry for this process, if any; other jobs
+	 * may share the pid, so make sure we only take our own.
 	 */
-	if ((process != PROCESS_MAIN) || ((job->state != JOB_SPAWNING) && (job->state != JOB_SPAWNED))
-	    || (job->trace_state != TRACE_NORMAL)) {
-		return;
+	old = job->pid[process];
+	if (old > 0) {
+		do {
+			entry = (JobProcessPid *)nih_hash_search (
+				job_process_pids, &old,
+				entry ? &entry->entry : NULL);
+		} while (entry && (entry->job != job
+				   || entry->process != process));
 	}
 
-	/* Obtain the child process id from the ptrace event. */
-	if (ptrace (PTRACE_GETEVENTMSG, job->pid[process], NULL, &data) < 0) {
-		nih_warn (_("Failed to obtain child process id "
-			    "for %s %s process (%d): %s"),
-			  job_name (job), process_name (process),
-			  job->pid[process], strerror (errno));
-		return;
-	}
+	if (entry && pid > 0) {
+		nih_list_remove (&entry->entry);
+	} else if (entry) {
+		nih_free (entry);
+		entry = NULL;
+	} else if (pid > 0) {
+		entry = NIH_MUST (nih_new (job, JobProcessPid));
 
-	nih_info (_("%s %s process (%d) became new process (%d)"),
-		  job_name (job), process_name (process),
-		  job->pid[process], (pid_t)data);
+		nih_list_init (&entry->entry);
+		nih_alloc_set_destructor (entry, nih_list_destroy);
 
-	/* We no longer care about this process, it's the child that we're
-	 * interested in from now on, so detach it and allow it to go about
-	 * its business unhindered.
-	 */
-	if (ptrace (PTRACE_DETACH, job->pid[process], NULL, 0) < 0)
-		nih_warn (_("Failed to detach traced %s %s process (%d): %s"),
-			  job_name (job), process_name (process),
-			  job->pid[process], strerror (errno));
+		entry->job = job;
+		entry->process = process;
+	}
 
-	/* Update the process we're supervising which is about to get SIGSTOP
-	 * so set the trace options to capture it.
-	 */
-	job->pid[process] = (pid_t)data;
-	job->trace_state = TRACE_NEW_CHILD;
+	job->pid[process] = pid;
 
-	/* We may have already had the wait notification for the new child
-	 * waiting at SIGSTOP, in which case a ptrace() call will succeed
-	 * for it.
-	 */
-	if (ptrace (PTRACE_SETOPTIONS, job->pid[process], NULL, 0) < 0) {
-		nih_debug ("Failed to set options for new %s %s process (%d), "
-			   "probably not yet forked: %s",
-			   job_name (job), process_name (process),
-			   job->pid[process], strerror (errno));
-		return;
+	if (pid > 0 && job->log[process] && job->log[process]->store)
+		job->log[process]->store->pid = pid;
+
+	if (entry) {
+		entry->pid = pid;
+		nih_hash_add (job_process_pids, &entry->entry);
 	}
 
-	job_process_trace_new_child (job, process);
+	state_changed ();
+	job->generation = state_generation;
 }
 
 /**
- * job_process_trace_exec:
- * @job: job that changed,
- * @process: specific process.
- *
- * This function is called whenever a traced @process attached to @job calls
- * the exec() system call after we've set options on it to distinguish them
- * from ordinary SIGTRAPs.
+ * job_process_check_pids:
  *
- * We assume that if the job calls exec that it's finished forking so we can
- * drop the trace entirely; we have no interest in tracing the new child.
+ * Check that the process of each job is still one of ours once state
+ * has been recovered from a checkpoint, which may have been taken before
+ * the process ended and was reaped; those whose pid has gone, or been
+ * reused by a process that is not our child, are handled as though they
+ * exited normally.
  **/
-static void
-job_process_trace_exec (Job         *job,
-			ProcessType  process)
+void
+job_process_check_pids (void)
 {
-	nih_assert (job != NULL);
+	nih_local pid_t *lost = NULL;
+	size_t           lost_len = 0;
 
-	/* Any process can get us to trace them, but we only care about the
-	 * main process when the state is still spawned and we're tracing it.
+	job_process_pids_init ();
+
+	NIH_HASH_FOREACH (job_process_pids, iter) {
+		JobProcessPid *entry = (JobProcessPid *)iter;
+
+		if (job_process_parent (entry->pid) == getpid ())
+			continue;
+
+		lost = NIH_MUST (nih_realloc (lost, NULL,
+					      sizeof (pid_t) * (lost_len + 1)));
+		lost[lost_len++] = entry->pid;
+	}
+
+	/* Handling a process may change the table, so only do so once
+	 * the lost processes are all known.
 	 */
-	if ((process != PROCESS_MAIN) || ((job->state != JOB_SPAWNING) && job->state != JOB_SPAWNED)
-	    || (job->trace_state != TRACE_NORMAL))
-		return;
+	for (size_t i = 0; i < lost_len; i++) {
+		Job         *job;
+		ProcessType  process;
 
-	nih_info (_("%s %s process (%d) executable changed"),
-		  job_name (job), process_name (process), job->pid[process]);
+		job = job_process_find (lost[i], &process);
+		if (! job)
+			continue;
 
-	if (job->trace_forks) {
-		if (ptrace (PTRACE_DETACH, job->pid[process], NULL, 0) < 0)
-			nih_warn (_("Failed to detach traced "
-				    "%s %s process (%d): %s"),
-				  job_name (job), process_name (process),
-				  job->pid[process], strerror (errno));
+		nih_warn (_("%s %s process (%d) ended while init was restarting"),
+			  job_name (job), process_name (process), lost[i]);
 
-		job->trace_state = TRACE_NONE;
-		job_change_state (job, job_next_state (job));
-	} else {
-		if (ptrace (PTRACE_CONT, job->pid[process], NULL, 0) < 0)
-			nih_warn (_("Failed to continue traced %s %s process (%d): %s"),
-				  job_name (job), process_name (process),
-				  job->pid[process], strerror (errno));
+		job_process_terminated (job, process, 0, FALSE);
 	}
 }
 
+/**
+ * job_process_pids_init:
+ *
+ * Initialise the job_process_pids hash table.
+ **/
+static void
+job_process_pids_init (void)
+{
+	if (! job_process_pids)
+		job_process_pids = NIH_MUST (nih_hash_new (NULL, 0,
+						job_process_pid_key,
+						job_process_pid_hash,
+						job_process_pid_cmp));
+}
 
 /**
- * job_process_find:
- * @pid: process id to find,
- * @process: pointer to place process which is running @pid.
+ * job_process_pid_key:
+ * @entry: JobProcessPid entry.
  *
- * Finds the job with a process of the given @pid in the jobs hash table.
- * If @process is not NULL, the @process variable is set to point at the
- * process entry in the table which has @pid.
+ * Key function for the job_process_pids hash table.
  *
- * Returns: job found or NULL if not known.
+ * Returns: pointer to the process id of @entry.
  **/
-Job *
-job_process_find (pid_t        pid,
-		  ProcessType *process)
+static const void *
+job_process_pid_key (NihList *entry)
 {
-	nih_assert (pid > 0);
+	nih_assert (entry != NULL);
 
-	job_class_init ();
+	return &((JobProcessPid *)entry)->pid;
+}
 
-	NIH_HASH_FOREACH (job_classes, iter) {
-		JobClass *class = (JobClass *)iter;
+/**
+ * job_process_pid_hash:
+ * @key: pointer to process id.
+ *
+ * Hash function for the job_process_pids hash table; process ids are
+ * already well distributed so are used directly.
+ *
+ * Returns: hash value of @key.
+ **/
+static uint32_t
+job_process_pid_hash (const void *key)
+{
+	nih_assert (key != NULL);
 
-		NIH_HASH_FOREACH (class->instances, job_iter) {
-			Job *job = (Job *)job_iter;
-			int  i;
+	return (uint32_t)*(const pid_t *)key;
+}
 
-			for (i = 0; i < PROCESS_LAST; i++) {
-				if (job->pid[i] == pid) {
-					if (process)
-						*process = i;
-					return job;
-				}
-			}
-		}
-	}
+/**
+ * job_process_pid_cmp:
+ * @key1: pointer to first process id,
+ * @key2: pointer to second process id.
+ *
+ * Comparison function for the job_process_pids hash table.
+ *
+ * Returns: zero if the process ids are equal, non-zero otherwise.
+ **/
+static int
+job_process_pid_cmp (const void *key1,
+		     const void *key2)
+{
+	nih_assert (key1 != NULL);
+	nih_assert (key2 != NULL);
 
-	return NULL;
+	return *(const pid_t *)key1 != *(const pid_t *)key2;
 }
 
 /**
@@ -2555,6 +5143,10 @@ job_process_close_handler (JobProcessData  *process_data,
 	process = process_data->process;
 	status = process_data->status;
 
+	/* The child closes its end of the pipe on exec. */
+	if (job)
+		job->timings.exec[process] = job_timing_now ();
+
 	/* Ensure the job process error fd is closed before attempting
 	 * to handle any scripts.
 	 */
@@ -2567,7 +5159,9 @@ job_process_close_handler (JobProcessData  *process_data,
 	job_process_run_bottom (process_data);
 
 	if (job && job->state == JOB_SPAWNED) {
-		if (job->class->expect == EXPECT_NONE) {
+		if ((job->class->expect == EXPECT_NONE)
+		    || ((job->class->expect == EXPECT_NOTIFY)
+			&& (job->notify_fd < 0))) {
 			if (process == PROCESS_MAIN) {
 				/* Job has not specified expect stanza so will
 				 * not have its state automatically progressed
@@ -22,7 +22,11 @@
 
 #include <sys/types.h>
 
+#include <signal.h>
+
 #include <nih/macros.h>
+#include <nih/list.h>
+#include <nih/hash.h>
 #include <nih/child.h>
 #include <nih/error.h>
 
@@ -40,6 +44,14 @@
  **/
 #define JOB_PROCESS_SCRIPT_FD 9
 
+/**
+ * JOB_PROCESS_SCRIPT_FDS_MAX:
+ *
+ * Maximum number of memory files holding scripts that are kept open;
+ * beyond this the least recently run is closed to make room.
+ **/
+#define JOB_PROCESS_SCRIPT_FDS_MAX 64
+
 /**
  * JOB_PROCESS_LOG_REMAP_FROM_CHAR:
  * JOB_PROCESS_LOG_REMAP_TO_CHAR:
@@ -99,7 +111,12 @@ typedef enum job_process_error_type {
 	JOB_PROCESS_ERROR_CGROUP_MGR_CONNECT,
 	JOB_PROCESS_ERROR_CGROUP_SETUP,
 	JOB_PROCESS_ERROR_CGROUP_ENTER,
-	JOB_PROCESS_ERROR_CGROUP_CLEAR
+	JOB_PROCESS_ERROR_CGROUP_CLEAR,
+	JOB_PROCESS_ERROR_AFFINITY,
+	JOB_PROCESS_ERROR_MEMPOLICY,
+	JOB_PROCESS_ERROR_SCHED,
+	JOB_PROCESS_ERROR_IOPRIO,
+	JOB_PROCESS_ERROR_TIMER_SLACK
 } JobProcessErrorType;
 
 /**
@@ -129,6 +146,25 @@ typedef struct job_process_error {
 } JobProcessError;
 
 
+/**
+ * JobProcessPid:
+ * @entry: list header,
+ * @pid: process id,
+ * @job: job running @pid,
+ * @process: process of @job running @pid.
+ *
+ * This structure is used as an entry in the job_process_pids hash table,
+ * it is allocated as a child of @job so that it is removed from the table
+ * when the job is freed.
+ **/
+typedef struct job_process_pid {
+	NihList      entry;
+	pid_t        pid;
+	Job         *job;
+	ProcessType  process;
+} JobProcessPid;
+
+
 /**
  * JobProcessErrorHandler:
  *
@@ -142,6 +178,9 @@ typedef void (*JobProcessErrorHandler) (Job *job, JobState state, ProcessType pr
 
 NIH_BEGIN_EXTERN
 
+extern NihHash *job_process_pids;
+
+
 void   job_process_start      (Job *job, ProcessType process);
 void   job_process_run_bottom (JobProcessData *handler_data);
 
@@ -160,14 +199,40 @@ pid_t  job_process_spawn_with_fd   (Job *job, char * const argv[],
 			    ProcessType process, int *job_process_fd)
 	__attribute__ ((warn_unused_result));
 
+int    job_process_script_fd (Process *proc, const char *script)
+	__attribute__ ((warn_unused_result));
+
+void   job_process_spawn_child (Job *job, JobClass *class,
+				char * const argv[], char * const *env,
+				int trace, int script_fd, ProcessType process,
+				int reading_fd, int error_fd, int pty_master,
+				const sigset_t *orig_set)
+	__attribute__ ((noreturn));
+
 
 void   job_process_kill    (Job *job, ProcessType process);
 
 void   job_process_handler (void *ptr, pid_t pid,
 			    NihChildEvents event, int status);
+void   job_process_account_init (void);
 
 Job   *job_process_find     (pid_t pid, ProcessType *process);
 
+int    job_process_proc_init (void)
+	__attribute__ ((warn_unused_result));
+void   job_process_proc_poll (void);
+void   job_process_proc_release (void);
+
+char  *job_process_notify_open  (const void *parent, Job *job)
+	__attribute__ ((warn_unused_result, malloc));
+int    job_process_notify_restore (Job *job, int fd)
+	__attribute__ ((warn_unused_result));
+void   job_process_notify_close (Job *job);
+void   job_process_notify_poll  (Job *job);
+
+void   job_process_set_pid  (Job *job, ProcessType process, pid_t pid);
+void   job_process_check_pids (void);
+
 char  *job_process_log_path (Job *job, int user_job)
 	__attribute__ ((warn_unused_result));
 
@@ -175,7 +240,9 @@ void   job_process_set_kill_timer (Job          *job,
 				   ProcessType   process,
 				   time_t        timeout);
 
-void   job_process_adj_kill_timer  (Job *job, time_t due);
+void   job_process_adj_kill_timer  (Job *job, uint64_t due);
+
+void   job_process_set_respawn_timer (Job *job, uint64_t timeout);
 
 int    job_process_jobs_running (void);
 
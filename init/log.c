@@ -20,6 +20,20 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */    
 
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif /* HAVE_MEMFD_CREATE */
+
+#include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include <limits.h>
 #include <signal.h>
@@ -31,11 +45,34 @@
 #include "session.h"
 #include "conf.h"
 #include "paths.h"
+#include "metrics.h"
+#include "probes.h"
 
 static int  log_file_open   (Log *log);
+static int  log_file_changed (Log *log);
+static int  log_watch_dir   (Log *log);
+static void log_watch_reader (void *data, NihIoWatch *watch,
+			      NihIoEvents events);
 static int  log_file_write  (Log *log, const char *buf, size_t len);
+static void log_file_written (Log *log);
+static void log_file_sync   (Log *log);
+static void log_sync_timer  (Log *log, WheelTimer *timer);
 static void log_read_watch  (Log *log);
 static void log_flush       (Log *log);
+static void log_io_watcher  (NihIo *io, NihIoWatch *watch,
+			     NihIoEvents events);
+static int  log_splice      (Log *log, NihIoWatch *watch);
+static size_t log_rate_limit (Log *log, size_t len);
+static int  log_unflushed_push (Log *log, const char *buf, size_t len);
+static int  log_unflushed_to_fd (Log *log)
+	__attribute__ ((warn_unused_result));
+static int  log_unflushed_from_fd (Log *log, int fd, size_t len)
+	__attribute__ ((warn_unused_result));
+static int  log_file_write_dropped (Log *log);
+static int  log_offload_sendmsg (struct msghdr *hdr);
+static void log_offload_receive (void *data, NihIoWatch *watch,
+				 NihIoEvents events);
+static void log_offload_reap    (void *data, NihMainLoopFunc *func);
 
 /**
  * log_flushed:
@@ -57,6 +94,82 @@ int log_flushed = 0;
  **/
 NihList *log_unflushed_files = NULL;
 
+/**
+ * log_generation:
+ *
+ * Incremented each time a file is removed from or renamed within a
+ * watched log directory, or logs are asked to be reopened; open log
+ * files are only checked to still be at their path when this changes.
+ **/
+static unsigned int log_generation = 0;
+
+/**
+ * log_watch_fd:
+ *
+ * inotify instance watching the directories of open log files, or -1 if
+ * not yet created (or, when log_watch_failed is TRUE, if inotify is
+ * unavailable).
+ **/
+static int log_watch_fd = -1;
+static int log_watch_failed = FALSE;
+
+/**
+ * LOG_WATCH_MASK:
+ *
+ * Changes to a log directory that may mean an open log file is no longer
+ * the file at its path.
+ **/
+#define LOG_WATCH_MASK (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+			| IN_DELETE_SELF | IN_MOVE_SELF)
+
+/**
+ * log_sync:
+ *
+ * When job output written to log files is synchronised to disk: never
+ * (leaving it to the kernel), log_sync_interval milliseconds after each
+ * is first written to, or only once the job finishes with it.
+ **/
+LogSync log_sync = LOG_SYNC_NONE;
+
+/**
+ * log_sync_interval:
+ *
+ * Milliseconds after a log file is written that it is synchronised to
+ * disk when log_sync is LOG_SYNC_INTERVAL.
+ **/
+int log_sync_interval = 1000;
+
+/**
+ * log_offload:
+ *
+ * If TRUE, job output is logged by a separate logger process (see
+ * log_offload_start()) rather than by init itself.
+ **/
+int log_offload = FALSE;
+
+/**
+ * log_offload_fd:
+ *
+ * Socket connected to the job output logger, or -1 if there is none.
+ **/
+int log_offload_fd = -1;
+
+/**
+ * log_offload_logs:
+ *
+ * Within the job output logger, list of NihListEntry objects containing
+ * Log objects whose job may still produce output.
+ **/
+static NihList *log_offload_logs = NULL;
+
+/**
+ * log_offload_closed:
+ *
+ * Within the job output logger, TRUE once init has closed its end of
+ * the socket.
+ **/
+static int log_offload_closed = FALSE;
+
 /**
  * log_new:
  *
@@ -129,6 +242,30 @@ log_new (const void *parent,
 	log->detached      = 0;
 	log->remote_closed = 0;
 	log->open_errno    = 0;
+	log->io_watcher    = NULL;
+
+	log->splice_pipe[0]  = -1;
+	log->splice_pipe[1]  = -1;
+	log->splice_disabled = 0;
+
+	log->limit_rate      = 0;
+	log->limit_burst     = 0;
+	log->limit_size      = 0;
+	log->limit_tokens    = 0;
+	log->limit_refilled  = 0;
+	log->dropped         = 0;
+	log->dropped_pending = 0;
+
+	log->watched    = FALSE;
+	log->generation = 0;
+	log->store      = NULL;
+
+	log->unsynced       = FALSE;
+	log->sync_timer     = NULL;
+	log->bytes_written  = 0;
+	log->writes         = 0;
+	log->short_writes   = 0;
+	log->enospc_dropped = 0;
 
 	log->path = nih_strndup (log, path, len);
 	if (! log->path)
@@ -151,6 +288,12 @@ log_new (const void *parent,
 		goto error;
 	}
 
+	/* Interpose on the watch so that job output can be spliced
+	 * directly into the log file where possible.
+	 */
+	log->io_watcher = log->io->watch->watcher;
+	log->io->watch->watcher = (NihIoWatcher)log_io_watcher;
+
 	nih_alloc_set_destructor (log, log_destroy);
 
 	return log;
@@ -191,9 +334,78 @@ log_destroy (Log *log)
 
 	log->fd = -1;
 
+	if (log->splice_pipe[0] != -1) {
+		close (log->splice_pipe[0]);
+		close (log->splice_pipe[1]);
+	}
+
+	log->splice_pipe[0] = log->splice_pipe[1] = -1;
+
 	return 0;
 }
 
+/**
+ * log_set_limits:
+ *
+ * @log: Log,
+ * @rate: bytes per second of output to log (0 for unlimited),
+ * @burst: bytes of output above @rate that may be logged at once,
+ * @size: maximum bytes of output to buffer while the log file cannot
+ *        be written (0 for unlimited).
+ *
+ * Apply the limits of a jobs log-limit stanza to @log. Output in excess
+ * of @rate (plus @burst) is discarded, and once @size bytes are
+ * buffered the oldest output is discarded to make way for new output.
+ * In both cases the number of bytes discarded is noted in the log file
+ * when it is next written.
+ **/
+void
+log_set_limits (Log    *log,
+		size_t  rate,
+		size_t  burst,
+		size_t  size)
+{
+	struct timespec now;
+
+	nih_assert (log);
+
+	nih_assert (clock_gettime (CLOCK_MONOTONIC, &now) == 0);
+
+	log->limit_rate     = rate;
+	log->limit_burst    = burst;
+	log->limit_size     = size;
+	log->limit_tokens   = rate + burst;
+	log->limit_refilled = now.tv_sec;
+}
+
+/**
+ * log_set_store:
+ *
+ * @log: Log,
+ * @process: ProcessType of job process being logged,
+ * @pid: process id of job process, or 0 if not yet known.
+ *
+ * When log_store is TRUE, have output written to the log file of @log
+ * also recorded in a structured store alongside it (see
+ * log_store_new()).  This is a copy, so failing to allocate it only
+ * means the output isn't recorded there.
+ **/
+void
+log_set_store (Log   *log,
+	       int    process,
+	       pid_t  pid)
+{
+	nih_assert (log);
+	nih_assert (log->path);
+
+	if (! log_store || log->store)
+		return;
+
+	log->store = log_store_new (log, log->path, process);
+	if (log->store)
+		log->store->pid = pid;
+}
+
 /**
  * log_flush:
  *
@@ -270,8 +482,10 @@ log_flush (Log *log)
 	}
 
 	/* Force file to flush */
-	if (log->fd != -1)
+	if (log->fd != -1) {
+		log_file_sync (log);
 		close (log->fd);
+	}
 
 out:
 	log->fd = -1;
@@ -315,6 +529,8 @@ void
 log_io_reader (Log *log, NihIo *io, const char *buf, size_t len)
 {
 	int          ret;
+	size_t       allowed;
+	MetricsStall stall;
 
 	nih_assert (log);
 	nih_assert (log->path);
@@ -331,13 +547,30 @@ log_io_reader (Log *log, NihIo *io, const char *buf, size_t len)
 	 */
 	nih_assert (sizeof (size_t) == sizeof (ssize_t));
 
+	metrics_add (METRICS_LOG_BYTES, len);
+	UPSTART_PROBE (log_read, log, log->path, len);
+	metrics_stall_begin (&stall, "log_io_reader", log->path);
+
+	allowed = log_rate_limit (log, len);
+	if (allowed < len) {
+		/* Discard the output in excess of the rate limit */
+		nih_assert (buf == io->recv_buf->buf);
+		io->recv_buf->len -= len - allowed;
+		len = allowed;
+
+		if (! len)
+			goto out;
+	}
+
 	ret = log_file_open (log);
 
 	if (ret < 0) {
 		if (log->open_errno != ENOSPC) {
 			/* Add new data to unflushed buffer */
-			if (nih_io_buffer_push (log->unflushed, buf, len) < 0)
-				return;
+			if (log_unflushed_push (log, buf, len) < 0)
+				goto out;
+		} else {
+			log->enospc_dropped += len;
 		}
 
 		/* Note that we always discard when out of space */
@@ -346,12 +579,193 @@ log_io_reader (Log *log, NihIo *io, const char *buf, size_t len)
 		/* No point attempting to write if we cannot
 		 * open the file.
 		 */
-		return;
+		goto out;
 	}
 
 	ret = log_file_write (log, buf, len);
 	if (ret < 0)
 		nih_warn ("%s %s", _("Failed to write to log file"), log->path);
+
+out:
+	metrics_stall_end (&stall);
+}
+
+/**
+ * log_io_watcher:
+ *
+ * @io: NihIo associated with the jobs stdout and stderr,
+ * @watch: NihIoWatch for @io,
+ * @events: events that occurred.
+ *
+ * Called instead of the standard NihIo watcher when activity occurs on
+ * the jobs pty. If the data can be moved straight into the log file
+ * with log_splice(), it never enters @io; otherwise the original
+ * watcher is called, which reads the data into @io and passes it to
+ * log_io_reader().
+ **/
+static void
+log_io_watcher (NihIo       *io,
+		NihIoWatch  *watch,
+		NihIoEvents  events)
+{
+	Log *log;
+
+	nih_assert (io);
+	nih_assert (watch);
+
+	log = io->data;
+
+	nih_assert (log);
+	nih_assert (log->io == io);
+	nih_assert (log->io_watcher);
+
+	if (events == NIH_IO_READ && log_splice (log, watch) == 0)
+		return;
+
+	log->io_watcher (io, watch, events);
+}
+
+/**
+ * log_splice:
+ *
+ * @log: Log,
+ * @watch: NihIoWatch with data to be read.
+ *
+ * Attempt to move up to LOG_SPLICE_SIZE bytes of job output from the fd
+ * of @watch to the log file using splice(2) via an intermediate pipe,
+ * avoiding copying the data into and out of userspace.
+ *
+ * This is only attempted when the log file can be opened and there is
+ * no data already buffered, since the log would otherwise be written
+ * out of order. Should the log file not accept all the data, the
+ * remainder is drained from the pipe into the unflushed buffer (unless
+ * the filesystem is full, in which case it is discarded exactly as
+ * log_file_write() would).
+ *
+ * Splicing into a file opened with O_APPEND is rejected by the kernel,
+ * so the flag is cleared for the duration of the splice and the file
+ * offset moved to the end of the file by hand.
+ *
+ * Kernels whose pty or filesystem implementation does not support
+ * splice(2) fail with EINVAL; splicing is then disabled for @log.
+ *
+ * Returns: 0 if the data was handled, -1 if the caller should read it
+ * the standard way.
+ **/
+static int
+log_splice (Log *log, NihIoWatch *watch)
+{
+	char     buf[LOG_READ_SIZE];
+	ssize_t  len;
+	ssize_t  wlen;
+	int      flags;
+	int      saved = 0;
+
+	nih_assert (log);
+	nih_assert (log->io);
+	nih_assert (log->unflushed);
+	nih_assert (watch);
+
+	/* User job logging not currently available */
+	nih_assert (log->uid == 0);
+
+	/* Rate limiting needs to see (and possibly discard) the data, as
+	 * does the structured store to record it.
+	 */
+	if (log->splice_disabled || log->limit_rate || log->store)
+		return -1;
+
+	if (log->unflushed->len || log->io->recv_buf->len)
+		return -1;
+
+	if (log_file_open (log) < 0)
+		return -1;
+
+	if (log->splice_pipe[0] == -1
+			&& pipe2 (log->splice_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+		log->splice_pipe[0] = log->splice_pipe[1] = -1;
+		return -1;
+	}
+
+	len = splice (watch->fd, NULL, log->splice_pipe[1], NULL,
+			LOG_SPLICE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+	if (len < 0) {
+		saved = errno;
+
+		if (saved == EAGAIN || saved == EWOULDBLOCK || saved == EINTR)
+			return 0;
+
+		if (saved == EINVAL || saved == ENOSYS)
+			log->splice_disabled = 1;
+
+		/* Let the standard watcher handle (and report) errors
+		 * such as EIO from the remote end closing.
+		 */
+		return -1;
+	}
+
+	/* End of file */
+	if (! len)
+		return -1;
+
+	flags = fcntl (log->fd, F_GETFL);
+
+	if (flags < 0
+			|| fcntl (log->fd, F_SETFL, flags & ~O_APPEND) < 0
+			|| lseek (log->fd, 0, SEEK_END) < 0) {
+		saved = errno;
+		goto drain;
+	}
+
+	while (len > 0) {
+		wlen = splice (log->splice_pipe[0], NULL, log->fd, NULL,
+				(size_t)len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		saved = errno;
+
+		if (wlen < 0 && saved == EINTR)
+			continue;
+
+		if (wlen <= 0)
+			break;
+
+		log->writes++;
+		log->bytes_written += (size_t)wlen;
+		log_file_written (log);
+
+		len -= wlen;
+	}
+
+	(void)fcntl (log->fd, F_SETFL, flags);
+
+	if (! len)
+		return 0;
+
+	if (saved == EINVAL)
+		log->splice_disabled = 1;
+
+drain:
+	/* Recover whatever the log file did not accept, always
+	 * discarding it when out of space.
+	 */
+	while ((len = read (log->splice_pipe[0], buf, sizeof (buf))) > 0) {
+		if (saved != ENOSPC) {
+			(void)log_unflushed_push (log, buf, (size_t)len);
+		} else {
+			log->enospc_dropped += (size_t)len;
+		}
+	}
+
+	if (! log->unflushed->len) {
+		close (log->fd);
+		log->fd = -1;
+		return 0;
+	}
+
+	if (log_file_write (log, NULL, 0) < 0)
+		nih_warn ("%s %s", _("Failed to write to log file"), log->path);
+
+	return 0;
 }
 
 /**
@@ -402,8 +816,6 @@ log_io_error_handler (Log *log, NihIo *io)
 static int
 log_file_open (Log *log)
 {
-	struct stat  statbuf;
-	int          ret = -1;
 	int          mode = LOG_DEFAULT_MODE;
 	mode_t       old;
 	int          flags = (O_CREAT | O_APPEND | O_WRONLY |
@@ -415,24 +827,31 @@ log_file_open (Log *log)
 	/* User job logging not currently available */
 	nih_assert (log->uid == 0);
 
-	memset (&statbuf, '\0', sizeof (struct stat));
+	if (log->fd > -1) {
+		/* Already open, and nothing has been removed or renamed
+		 * alongside it since it was last checked.
+		 */
+		if (log->watched && log->generation == log_generation)
+			return 0;
 
-	ret = fstat (log->fd, &statbuf);
+		if (! log_file_changed (log)) {
+			log->generation = log_generation;
+			if (! log->watched)
+				(void)log_watch_dir (log);
 
-	/* Already open */
-	if (log->fd > -1 && (! ret && statbuf.st_nlink))
-		return 0;
+			return 0;
+		}
 
-	/* File was deleted. This isn't a problem for
-	 * the logger as it is happy to keep writing the
-	 * unlinked file, but it *is* a problem for
-	 * users who expect to see some data. Therefore,
-	 * close the file and attempt to rewrite it.
-	 *
-	 * This behaviour also allows tools such as logrotate(8)
-	 * to operate without disrupting the logger.
-	 */
-	if (log->fd > -1 && ! statbuf.st_nlink) {
+		/* File was deleted or renamed. This isn't a
+		 * problem for the logger as it is happy to keep
+		 * writing the old file, but it *is* a problem for
+		 * users who expect to see some data. Therefore,
+		 * close the file and attempt to rewrite it.
+		 *
+		 * This behaviour also allows tools such as logrotate(8)
+		 * to operate without disrupting the logger.
+		 */
+		log_file_sync (log);
 		close (log->fd);
 		log->fd = -1;
 	}
@@ -459,9 +878,167 @@ log_file_open (Log *log)
 	if (log->fd < 0)
 		return -1;
 
+	log->generation = log_generation;
+	(void)log_watch_dir (log);
+
 	return 0;
 }
 
+/**
+ * log_file_changed:
+ * @log: Log.
+ *
+ * Determine whether the open log file of @log has been removed, or
+ * replaced at its path by another file.
+ *
+ * Returns: TRUE if the log file should be opened again, FALSE if not.
+ **/
+static int
+log_file_changed (Log *log)
+{
+	struct stat  fdbuf;
+	struct stat  pathbuf;
+
+	nih_assert (log);
+	nih_assert (log->fd > -1);
+
+	if (fstat (log->fd, &fdbuf) < 0 || ! fdbuf.st_nlink)
+		return TRUE;
+
+	/* Renamed away by logrotate(8) (or the like); unless it's
+	 * inaccessible, write to whatever is now there instead.
+	 */
+	if (stat (log->path, &pathbuf) < 0)
+		return (errno == ENOENT);
+
+	return (fdbuf.st_dev != pathbuf.st_dev
+		|| fdbuf.st_ino != pathbuf.st_ino);
+}
+
+/**
+ * log_watch_dir:
+ * @log: Log.
+ *
+ * Watch the directory containing the log file of @log, so that the file
+ * need only be checked when something in that directory is removed or
+ * renamed rather than on every write.  Watching the same directory again
+ * has no effect, so this takes a single watch for all logs in it.
+ *
+ * Returns: 0 on success, -1 if the file must be checked on every write.
+ **/
+static int
+log_watch_dir (Log *log)
+{
+	char    dir[PATH_MAX];
+	char   *slash;
+	size_t  len;
+
+	nih_assert (log);
+	nih_assert (log->path);
+	nih_assert (strlen (log->path) < sizeof (dir));
+
+	if (log_watch_fd == -1)
+		return -1;
+
+	slash = strrchr (log->path, '/');
+	if (! slash) {
+		strcpy (dir, ".");
+	} else {
+		len = slash > log->path ? slash - log->path : 1;
+		memcpy (dir, log->path, len);
+		dir[len] = '\0';
+	}
+
+	if (inotify_add_watch (log_watch_fd, dir, LOG_WATCH_MASK) < 0)
+		return -1;
+
+	log->watched = TRUE;
+
+	return 0;
+}
+
+/**
+ * log_watch_reader:
+ * @data: not used,
+ * @watch: NihIoWatch for log_watch_fd,
+ * @events: events that occurred.
+ *
+ * Called when files are removed from or renamed within a log directory,
+ * so that open log files will be checked before they are next written.
+ **/
+static void
+log_watch_reader (void        *data,
+		  NihIoWatch  *watch,
+		  NihIoEvents  events)
+{
+	char    buf[4096]
+		__attribute__ ((aligned (__alignof__ (struct inotify_event))));
+	ssize_t len;
+
+	nih_assert (watch);
+
+	do {
+		len = read (watch->fd, buf, sizeof (buf));
+	} while (len > 0 || (len < 0 && errno == EINTR));
+
+	log_generation++;
+}
+
+/**
+ * log_reopen:
+ *
+ * Have every log file checked to still be at its path before it is next
+ * written, opening the path again if not; as used by logrotate(8) after
+ * rotating logs, should it not have been noticed already.  Logs held by
+ * the job output logger are checked by it.
+ **/
+void
+log_reopen (void)
+{
+	LogOffloadMessage  msg;
+	struct iovec       iov;
+	struct msghdr      hdr;
+
+	log_generation++;
+
+	if (log_offload_fd == -1)
+		return;
+
+	memset (&msg, '\0', sizeof (msg));
+	msg.type = LOG_OFFLOAD_REOPEN;
+
+	iov.iov_base = &msg;
+	iov.iov_len  = sizeof (msg);
+
+	memset (&hdr, '\0', sizeof (hdr));
+	hdr.msg_iov    = &iov;
+	hdr.msg_iovlen = 1;
+
+	(void)log_offload_sendmsg (&hdr);
+}
+
+/**
+ * log_stats_to_string:
+ *
+ * @parent: parent object for new string,
+ * @log: Log.
+ *
+ * Returns: newly allocated JSON string of the bytes written to the log
+ * file of @log, the writes made, how many of those were short and the
+ * bytes discarded since the disk was full, or NULL if insufficient memory.
+ **/
+char *
+log_stats_to_string (const void *parent,
+		     const Log  *log)
+{
+	nih_assert (log);
+
+	return nih_sprintf (parent, "{ \"bytes\": %zu, \"writes\": %zu, "
+			    "\"short_writes\": %zu, \"enospc_dropped\": %zu }",
+			    log->bytes_written, log->writes,
+			    log->short_writes, log->enospc_dropped);
+}
+
 
 /**
  * log_file_write:
@@ -518,95 +1095,436 @@ log_file_open (Log *log)
 static int
 log_file_write (Log *log, const char *buf, size_t len)
 {
-	ssize_t      wlen = 0;
-	NihIo       *io;
-	int          saved;
+	struct iovec iov[2];
+	int          iovcnt = 0;
+	size_t       unflushed;
+	size_t       total;
+	ssize_t      wlen = 0;
+	NihIo       *io;
+	int          saved;
+
+	nih_assert (log);
+	nih_assert (log->path);
+	nih_assert (log->unflushed);
+	nih_assert (log->fd != -1);
+
+	/* User job logging not currently available */
+	nih_assert (log->uid == 0);
+
+	io = log->io;
+
+	if (! buf)
+		len = 0;
+
+	/* Note any output discarded since the log was last written */
+	if (log->dropped_pending && log_file_write_dropped (log) < 0) {
+		saved = errno;
+		goto failed;
+	}
+
+	/* Write any data we previously failed to write along with the
+	 * new data, in a single call.
+	 */
+	unflushed = log->unflushed->len;
+
+	if (unflushed) {
+		iov[iovcnt].iov_base = log->unflushed->buf;
+		iov[iovcnt].iov_len  = unflushed;
+		iovcnt++;
+	}
+
+	if (len) {
+		iov[iovcnt].iov_base = (void *)buf;
+		iov[iovcnt].iov_len  = len;
+		iovcnt++;
+	}
+
+	if (! iovcnt)
+		return 0;
+
+	total = unflushed + len;
+
+	wlen = writev (log->fd, iov, iovcnt);
+	saved = errno;
+
+	if (wlen < 0)
+		goto failed;
+
+	log->writes++;
+	log->bytes_written += (size_t)wlen;
+	if ((size_t)wlen < total)
+		log->short_writes++;
+
+	if (wlen)
+		log_file_written (log);
+
+	if ((size_t)wlen < unflushed) {
+		/* Only managed a partial write for the unflushed data,
+		 * so store the new data for next time rather than leave
+		 * a gap in the log.
+		 */
+		if (log->store)
+			(void)log_store_append (log->store, log->unflushed->buf,
+						(size_t)wlen);
+
+		nih_io_buffer_shrink (log->unflushed, (size_t)wlen);
+
+		if (! len)
+			goto error;
+
+		/* Save new data */
+		if (log_unflushed_push (log, buf, len) < 0)
+			goto error;
+
+		nih_io_buffer_shrink (io->recv_buf, len);
+
+		goto error;
+	}
+
+	if (unflushed) {
+		if (log->store)
+			(void)log_store_append (log->store, log->unflushed->buf,
+						unflushed);
+
+		nih_io_buffer_shrink (log->unflushed, unflushed);
+	}
+
+	if (! len)
+		return 0;
+
+	if (log->store)
+		(void)log_store_append (log->store, buf,
+					(size_t)wlen - unflushed);
+
+	/* Shrink buffer by amount of data written (which handles
+	 * partial writes)
+	 */
+	nih_io_buffer_shrink (io->recv_buf, (size_t)wlen - unflushed);
+
+	return 0;
+
+failed:
+	/* Failed to flush the unflushed data, so unlikely to be
+	 * able to flush the new data. Hence, add the new data
+	 * to the unflushed buffer.
+	 *
+	 * If this fails, we still want to indicate an error
+	 * condition, so no explicit return check.
+	 *
+	 * Note that data is always discarded when out of
+	 * space.
+	 */
+	if (saved == ENOSPC)
+		log->enospc_dropped += len;
+
+	if (saved != ENOSPC && len
+			&& log_unflushed_push (log, buf, len) < 0)
+		goto error;
+
+	if (len)
+		nih_io_buffer_shrink (io->recv_buf, len);
+
+	/* Still need to indicate that the write failed */
+
+error:
+	close (log->fd);
+	log->fd = -1;
+	return -1;
+}
+
+/**
+ * log_file_written:
+ *
+ * @log: Log.
+ *
+ * Called after job output is written to the log file of @log to note
+ * that it needs to be synchronised to disk, and when log_sync is
+ * LOG_SYNC_INTERVAL, to arrange for that to happen after
+ * log_sync_interval milliseconds unless already arranged.
+ **/
+static void
+log_file_written (Log *log)
+{
+	nih_assert (log);
+
+	log->unsynced = TRUE;
+
+	if (log_sync != LOG_SYNC_INTERVAL || log->sync_timer)
+		return;
+
+	/* Should this fail, the next write will try again */
+	log->sync_timer = timer_wheel_add (log, log_sync_interval,
+					   (WheelTimerCb)log_sync_timer, log);
+}
+
+/**
+ * log_file_sync:
+ *
+ * @log: Log.
+ *
+ * Synchronise the output written to the log file of @log to disk, unless
+ * log_sync is LOG_SYNC_NONE or nothing has been written since it last
+ * was.
+ **/
+static void
+log_file_sync (Log *log)
+{
+	nih_assert (log);
+
+	if (log_sync != LOG_SYNC_NONE && log->unsynced && log->fd != -1)
+		(void)fdatasync (log->fd);
+
+	log->unsynced = FALSE;
+}
+
+/**
+ * log_sync_timer:
+ *
+ * @log: Log,
+ * @timer: timer that triggered.
+ *
+ * Called log_sync_interval milliseconds after the log file of @log was
+ * first written since it was last synchronised, to synchronise it.
+ **/
+static void
+log_sync_timer (Log        *log,
+		WheelTimer *timer)
+{
+	nih_assert (log);
+	nih_assert (log->sync_timer == timer);
+
+	/* The timer is freed once we return */
+	log->sync_timer = NULL;
+
+	log_file_sync (log);
+}
+
+/**
+ * log_file_write_dropped:
+ *
+ * @log: Log.
+ *
+ * Write a marker to the log file associated with @log noting how much
+ * output has been discarded due to the limits applied by
+ * log_set_limits() since the log file was last written.
+ *
+ * Returns: 0 on success, -1 on failure.
+ **/
+static int
+log_file_write_dropped (Log *log)
+{
+	nih_local char *marker = NULL;
+	ssize_t         wlen;
+
+	nih_assert (log);
+	nih_assert (log->fd != -1);
+	nih_assert (log->dropped_pending);
+
+	marker = nih_sprintf (NULL, _("[%zu bytes of output dropped]\n"),
+			      log->dropped_pending);
+	if (! marker) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	wlen = write (log->fd, marker, strlen (marker));
+	if (wlen < 0)
+		return -1;
+
+	/* Don't repeat a partially written marker */
+	log->dropped_pending = 0;
+
+	return 0;
+}
+
+/**
+ * log_unflushed_push:
+ *
+ * @log: Log,
+ * @buf: data to buffer,
+ * @len: bytes in @buf.
+ *
+ * Append @len bytes of @buf to the unflushed data of @log. If this
+ * would take the buffer beyond the size limit of @log, the oldest data
+ * is discarded such that only the most recent output is retained.
+ *
+ * Returns: 0 on success, -1 on failure.
+ **/
+static int
+log_unflushed_push (Log *log, const char *buf, size_t len)
+{
+	size_t excess;
+
+	nih_assert (log);
+	nih_assert (log->unflushed);
+	nih_assert (buf);
+
+	if (log->limit_size && log->unflushed->len + len > log->limit_size) {
+		excess = log->unflushed->len + len - log->limit_size;
+
+		log->dropped         += excess;
+		log->dropped_pending += excess;
+
+		if (excess >= log->unflushed->len) {
+			/* New data alone fills the buffer */
+			excess -= log->unflushed->len;
+			nih_io_buffer_shrink (log->unflushed, log->unflushed->len);
+
+			buf += excess;
+			len -= excess;
+		} else {
+			nih_io_buffer_shrink (log->unflushed, excess);
+		}
+	}
+
+	return nih_io_buffer_push (log->unflushed, buf, len);
+}
+
+/**
+ * log_unflushed_to_fd:
+ *
+ * @log: Log.
+ *
+ * Write the unflushed data of @log to a new memory file whose descriptor
+ * does not have FD_CLOEXEC set, so that a re-exec'd instance inherits
+ * it; the data is left in @log.
+ *
+ * Returns: file descriptor, or -1 on failure.
+ **/
+static int
+log_unflushed_to_fd (Log *log)
+{
+#ifdef HAVE_MEMFD_CREATE
+	int     fd;
+	size_t  off = 0;
+#endif /* HAVE_MEMFD_CREATE */
+
+	nih_assert (log);
+	nih_assert (log->unflushed);
+
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create ("upstart-log", 0);
+	if (fd < 0)
+		return -1;
+
+	while (off < log->unflushed->len) {
+		ssize_t ret;
+
+		ret = write (fd, log->unflushed->buf + off,
+			     log->unflushed->len - off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			close (fd);
+			return -1;
+		}
+
+		off += ret;
+	}
+
+	return fd;
+#else /* HAVE_MEMFD_CREATE */
+	return -1;
+#endif /* HAVE_MEMFD_CREATE */
+}
+
+/**
+ * log_unflushed_from_fd:
+ *
+ * @log: Log,
+ * @fd: file written by log_unflushed_to_fd(),
+ * @len: bytes of unflushed data in @fd.
+ *
+ * Append the @len bytes at the start of @fd to the unflushed data of
+ * @log; @fd is left open.
+ *
+ * Returns: 0 on success, -1 on failure.
+ **/
+static int
+log_unflushed_from_fd (Log    *log,
+		       int     fd,
+		       size_t  len)
+{
+	nih_local char *buf = NULL;
+	size_t          off = 0;
 
 	nih_assert (log);
-	nih_assert (log->path);
 	nih_assert (log->unflushed);
-	nih_assert (log->fd != -1);
-
-	/* User job logging not currently available */
-	nih_assert (log->uid == 0);
+	nih_assert (fd >= 0);
 
-	io = log->io;
-
-	/* Flush any data we previously failed to write */
-	if (log->unflushed->len) {
-		wlen = write (log->fd, log->unflushed->buf, log->unflushed->len);
-		saved = errno;
+	if (! len)
+		return 0;
 
-		if (wlen < 0) {
-			/* Failed to flush the unflushed data, so unlikely to be
-			 * able to flush the new data. Hence, add the new data
-			 * to the unflushed buffer.
-                         *
-			 * If this fails, we still want to indicate an error
-			 * condition, so no explicit return check.
-			 *
-			 * Note that data is always discarded when out of
-			 * space.
-			 */
-			if (saved != ENOSPC && len
-					&& nih_io_buffer_push (log->unflushed, buf, len) < 0)
-				goto error;
+	buf = nih_alloc (NULL, len);
+	if (! buf)
+		return -1;
 
-			if (len)
-				nih_io_buffer_shrink (io->recv_buf, len);
+	while (off < len) {
+		ssize_t ret;
 
-			/* Still need to indicate that the write failed */
-			goto error;
-		}
+		ret = pread (fd, buf + off, len - off, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
 
-		nih_io_buffer_shrink (log->unflushed, (size_t)wlen);
+		off += ret;
 	}
 
-	/* Only managed a partial write for the unflushed data,
-	 * so don't attempt to write the new data as that would
-	 * leave a gap in the log. Just store the new data for
-	 * next time.
-	 */
-	if (log->unflushed->len) {
-		if (! len)
-			goto error;
+	return nih_io_buffer_push (log->unflushed, buf, len);
+}
 
-		/* Save new data */
-		if (nih_io_buffer_push (log->unflushed, buf, len) < 0)
-			goto error;
+/**
+ * log_rate_limit:
+ *
+ * @log: Log,
+ * @len: bytes of new output.
+ *
+ * Determine how many of @len bytes of new output may be logged without
+ * exceeding the rate limit of @log, accounting for any excess as
+ * dropped.
+ *
+ * Returns: number of bytes that may be logged.
+ **/
+static size_t
+log_rate_limit (Log *log, size_t len)
+{
+	struct timespec now;
+	size_t          max;
+	size_t          allowed;
 
-		nih_io_buffer_shrink (io->recv_buf, len);
+	nih_assert (log);
 
-		goto error;
-	}
+	if (! log->limit_rate)
+		return len;
 
-	if (! buf || ! len)
-		return 0;
+	nih_assert (clock_gettime (CLOCK_MONOTONIC, &now) == 0);
 
-	/* Write the new data */
-	wlen = write (log->fd, buf, len);
-	saved = errno;
+	max = log->limit_rate + log->limit_burst;
 
-	if (wlen < 0) {
-		if (saved != ENOSPC && nih_io_buffer_push (log->unflushed, buf, len) < 0)
-			goto error;
+	if (now.tv_sec > log->limit_refilled) {
+		time_t elapsed = now.tv_sec - log->limit_refilled;
 
-		nih_io_buffer_shrink (io->recv_buf, len);
+		/* Avoid overflow for long idle periods */
+		if ((size_t)elapsed > max / log->limit_rate)
+			log->limit_tokens = max;
+		else
+			log->limit_tokens += (size_t)elapsed * log->limit_rate;
 
-		goto error;
+		if (log->limit_tokens > max)
+			log->limit_tokens = max;
+
+		log->limit_refilled = now.tv_sec;
 	}
 
-	/* Shrink buffer by amount of data written (which handles
-	 * partial writes)
-	 */
-	nih_io_buffer_shrink (io->recv_buf, (size_t)wlen);
+	allowed = len < log->limit_tokens ? len : log->limit_tokens;
+	log->limit_tokens -= allowed;
 
-	return 0;
+	log->dropped         += len - allowed;
+	log->dropped_pending += len - allowed;
 
-error:
-	close (log->fd);
-	log->fd = -1;
-	return -1;
+	return allowed;
 }
 
 /**
@@ -715,13 +1633,33 @@ log_read_watch (Log *log)
 /**
  * log_unflushed_init:
  *
- * Initialise the log_unflushed_files list.
+ * Initialise the log_unflushed_files list, and the inotify instance
+ * that log directories are watched with (see log_watch_dir()).
  **/
 void
 log_unflushed_init (void)
 {
+	NihIoWatch *watch;
+
 	if (! log_unflushed_files)
 		log_unflushed_files = NIH_MUST (nih_list_new (NULL));
+
+	if (log_watch_fd != -1 || log_watch_failed)
+		return;
+
+	log_watch_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+	if (log_watch_fd < 0) {
+		log_watch_failed = TRUE;
+		return;
+	}
+
+	watch = NIH_MUST (nih_io_add_watch (NULL, log_watch_fd, NIH_IO_READ,
+					    log_watch_reader, NULL));
+
+	/* Notice changes before any job output read in the same
+	 * iteration of the main loop is written.
+	 */
+	nih_list_add_after (nih_io_watches, &watch->entry);
 }
 
 /**
@@ -736,6 +1674,8 @@ log_unflushed_init (void)
  * associated process exits to ensure that all data from that process is
  * captured to the log.
  *
+ * Any output discarded due to the limits of @log is reported.
+ *
  * Returns: 0 on success (log added to list), 1 if log does not need to
  * be added to the list, or -1 on error.
  **/
@@ -749,6 +1689,10 @@ log_handle_unflushed (void *parent, Log *log)
 
 	log_read_watch (log);
 
+	if (log->dropped)
+		nih_warn (_("%s: %zu bytes of output dropped"),
+			  log->path, log->dropped);
+
 	if (! log->unflushed->len)
 		return 1;
 
@@ -786,6 +1730,9 @@ log_handle_unflushed (void *parent, Log *log)
  *
  * Call once the log disk partition is mounted as read-write.
  *
+ * Any output discarded due to the limits of each log while it could
+ * not be written is reported.
+ *
  * Returns: 0 on success, -1 on error.
  */
 int
@@ -873,6 +1820,10 @@ log_clear_unflushed (void)
 		if (log_file_open (log) != 0)
 			return -1;
 
+		if (log->dropped)
+			nih_warn (_("%s: %zu bytes of output dropped"),
+				  log->path, log->dropped);
+
 		if (log_file_write (log, NULL, 0) < 0)
 			return -1;
 
@@ -899,6 +1850,8 @@ log_serialise (Log *log)
 {
 	json_object     *json;
 	nih_local char  *unflushed_hex = NULL;
+	int              unflushed_fd;
+	ssize_t          blob;
 
 	json = json_object_new_object ();
 	if (! json)
@@ -907,8 +1860,10 @@ log_serialise (Log *log)
 	if (! log || (! log->io && log->unflushed && ! log->unflushed->len))
 		goto placeholder;
 
-	/* Attempt to flush any cached data */
-	if (log->unflushed && log->unflushed->len) {
+	/* Attempt to flush any cached data, unless serialising in a
+	 * forked child when init would write it again later.
+	 */
+	if (! state_forked && log->unflushed && log->unflushed->len) {
 		/* Don't check return values since if this fails and
 		 * unflushed data remains, we encode it below.
 		 */
@@ -941,10 +1896,33 @@ log_serialise (Log *log)
 	if (! state_set_json_int_var_from_obj (json, log, uid))
 		goto error;
 
-	/* Encode unflushed data as hex to ensure any embedded
+	/* Pass unflushed data to a re-exec'd instance in a file it
+	 * inherits if possible, otherwise store it as a raw blob if
+	 * possible; otherwise encode it as hex to ensure any embedded
 	 * nulls are handled.
 	 */
 	if (log->unflushed && log->unflushed->len) {
+		if (state_passing_fds) {
+			unflushed_fd = log_unflushed_to_fd (log);
+			if (unflushed_fd >= 0) {
+				if (! state_set_json_int_var (json, "unflushed_fd",
+							      unflushed_fd)
+				    || ! state_set_json_int_var (json, "unflushed_len",
+								 log->unflushed->len)) {
+					close (unflushed_fd);
+					goto error;
+				}
+				goto unflushed_done;
+			}
+		}
+
+		blob = state_blob_add (log->unflushed->buf, log->unflushed->len);
+		if (blob >= 0) {
+			if (! state_set_json_int_var (json, "unflushed_blob", blob))
+				goto error;
+			goto unflushed_done;
+		}
+
 		unflushed_hex = state_data_to_hex (NULL,
 				log->unflushed->buf,
 				log->unflushed->len);
@@ -956,6 +1934,8 @@ log_serialise (Log *log)
 			goto error;
 	}
 
+unflushed_done:
+
 	if (! state_set_json_int_var_from_obj (json, log, detached))
 		goto error;
 
@@ -965,6 +1945,21 @@ log_serialise (Log *log)
 	if (! state_set_json_int_var_from_obj (json, log, open_errno))
 		goto error;
 
+	if (! state_set_json_int_var_from_obj (json, log, limit_rate))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, log, limit_burst))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, log, limit_size))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, log, dropped))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, log, dropped_pending))
+		goto error;
+
 	return json;
 
 placeholder:
@@ -1062,6 +2057,35 @@ log_deserialise (const void *parent,
 
 		if (nih_io_buffer_push (log->unflushed, unflushed, len) < 0)
 			goto error;
+	} else if (json_object_object_get_ex (json, "unflushed_blob", NULL)) {
+		const char  *blob_data;
+		int          blob = -1;
+
+		if (! state_get_json_int_var (json, "unflushed_blob", blob))
+			goto error;
+
+		if (blob < 0 || state_blob_get ((size_t)blob, &blob_data, &len) < 0)
+			goto error;
+
+		if (nih_io_buffer_push (log->unflushed, blob_data, len) < 0)
+			goto error;
+	} else if (json_object_object_get_ex (json, "unflushed_fd", NULL)) {
+		int  unflushed_fd = -1;
+
+		if (! state_get_json_int_var (json, "unflushed_fd", unflushed_fd))
+			goto error;
+
+		if (! state_get_json_int_var (json, "unflushed_len", len))
+			goto error;
+
+		if (unflushed_fd < 0)
+			goto error;
+
+		ret = log_unflushed_from_fd (log, unflushed_fd, len);
+		close (unflushed_fd);
+
+		if (ret < 0)
+			goto error;
 	}
 
 	if (! state_get_json_int_var_to_obj (json, log, detached))
@@ -1073,9 +2097,424 @@ log_deserialise (const void *parent,
 	if (! state_get_json_int_var_to_obj (json, log, open_errno))
 		goto error;
 
+	/* log limits are new in upstart 1.14+ */
+	if (json_object_object_get_ex (json, "limit_rate", NULL)) {
+		size_t  rate = 0;
+		size_t  burst = 0;
+		size_t  size = 0;
+
+		if (! state_get_json_int_var (json, "limit_rate", rate))
+			goto error;
+
+		if (! state_get_json_int_var (json, "limit_burst", burst))
+			goto error;
+
+		if (! state_get_json_int_var (json, "limit_size", size))
+			goto error;
+
+		log_set_limits (log, rate, burst, size);
+
+		if (! state_get_json_int_var_to_obj (json, log, dropped))
+			goto error;
+
+		if (! state_get_json_int_var_to_obj (json, log, dropped_pending))
+			goto error;
+	}
+
 	return log;
 
 error:
 	nih_free (log);
 	return NULL;
 }
+
+/**
+ * log_offload_start:
+ *
+ * Start a job output logger: a copy of init executed with
+ * --logd-fd, connected to us over a UNIX socket. Job pty master fds
+ * can then be passed to it with log_offload_send() so that writing job
+ * output to disk (which may be slow) does not hold up our main loop.
+ *
+ * The logger outlives a re-exec of init; once we close our end of the
+ * socket, it finishes logging the jobs it already has and exits.
+ *
+ * Returns: 0 on success, -1 on raised error.
+ **/
+int
+log_offload_start (void)
+{
+	int             sv[2];
+	pid_t           pid;
+	nih_local char *fd_str = NULL;
+
+	nih_assert (args_copy);
+	nih_assert (args_copy[0]);
+	nih_assert (log_offload_fd == -1);
+
+	if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+		nih_return_system_error (-1);
+
+	fd_str = nih_sprintf (NULL, "%d", sv[1]);
+	if (! fd_str) {
+		close (sv[0]);
+		close (sv[1]);
+		nih_return_no_memory_error (-1);
+	}
+
+	pid = fork ();
+	if (pid < 0) {
+		nih_error_raise_system ();
+		close (sv[0]);
+		close (sv[1]);
+		return -1;
+	} else if (! pid) {
+		char *argv[] = { args_copy[0], "--logd-fd", fd_str, NULL };
+
+		close (sv[0]);
+
+		if (state_modify_cloexec (sv[1], FALSE) < 0)
+			_exit (1);
+
+		execvp (argv[0], argv);
+		_exit (1);
+	}
+
+	close (sv[1]);
+	log_offload_fd = sv[0];
+
+	nih_debug ("Started job output logger (%d)", pid);
+
+	return 0;
+}
+
+/**
+ * log_offload_send:
+ *
+ * @path: full path to on-disk log file,
+ * @fd: pty master file descriptor of job,
+ * @rate: see log_set_limits(),
+ * @burst: see log_set_limits(),
+ * @size: see log_set_limits().
+ *
+ * Pass @fd to the job output logger, which will then log all output
+ * read from it to @path. The caller remains responsible for closing
+ * its copy of @fd.
+ *
+ * Should the logger have exited, it is not used again.
+ *
+ * Returns: 0 on success, -1 if the output must be logged by the
+ * caller.
+ **/
+int
+log_offload_send (const char *path,
+		  int         fd,
+		  size_t      rate,
+		  size_t      burst,
+		  size_t      size)
+{
+	LogOffloadMessage  msg;
+	struct iovec       iov[2];
+	struct msghdr      hdr;
+	struct cmsghdr    *cmsg;
+	char               control[CMSG_SPACE (sizeof (int))];
+
+	nih_assert (path);
+	nih_assert (fd >= 0);
+
+	if (log_offload_fd == -1)
+		return -1;
+
+	memset (&msg, '\0', sizeof (msg));
+	msg.type  = LOG_OFFLOAD_OPEN;
+	msg.rate  = rate;
+	msg.burst = burst;
+	msg.size  = size;
+
+	iov[0].iov_base = &msg;
+	iov[0].iov_len  = sizeof (msg);
+	iov[1].iov_base = (void *)path;
+	iov[1].iov_len  = strlen (path) + 1;
+
+	memset (&hdr, '\0', sizeof (hdr));
+	memset (control, '\0', sizeof (control));
+	hdr.msg_iov        = iov;
+	hdr.msg_iovlen     = 2;
+	hdr.msg_control    = control;
+	hdr.msg_controllen = sizeof (control);
+
+	cmsg = CMSG_FIRSTHDR (&hdr);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN (sizeof (int));
+	memcpy (CMSG_DATA (cmsg), &fd, sizeof (int));
+
+	return log_offload_sendmsg (&hdr);
+}
+
+/**
+ * log_offload_flush:
+ *
+ * Ask the job output logger to flush its unflushed logs
+ * (see log_clear_unflushed()).
+ **/
+void
+log_offload_flush (void)
+{
+	LogOffloadMessage  msg;
+	struct iovec       iov;
+	struct msghdr      hdr;
+
+	if (log_offload_fd == -1)
+		return;
+
+	memset (&msg, '\0', sizeof (msg));
+	msg.type = LOG_OFFLOAD_FLUSH;
+
+	iov.iov_base = &msg;
+	iov.iov_len  = sizeof (msg);
+
+	memset (&hdr, '\0', sizeof (hdr));
+	hdr.msg_iov    = &iov;
+	hdr.msg_iovlen = 1;
+
+	(void)log_offload_sendmsg (&hdr);
+}
+
+/**
+ * log_offload_sendmsg:
+ *
+ * @hdr: message to send.
+ *
+ * Send @hdr to the job output logger without blocking. If the logger
+ * has gone away, close our end of the socket so no further attempts
+ * are made.
+ *
+ * Returns: 0 on success, -1 on failure.
+ **/
+static int
+log_offload_sendmsg (struct msghdr *hdr)
+{
+	ssize_t ret;
+
+	nih_assert (hdr);
+	nih_assert (log_offload_fd != -1);
+
+	do {
+		ret = sendmsg (log_offload_fd, hdr, MSG_DONTWAIT | MSG_NOSIGNAL);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret >= 0)
+		return 0;
+
+	/* Logger is busy, so log this job ourselves */
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return -1;
+
+	nih_warn ("%s: %s", _("Job output logger unavailable"),
+		  strerror (errno));
+
+	close (log_offload_fd);
+	log_offload_fd = -1;
+
+	return -1;
+}
+
+/**
+ * log_offload_server:
+ *
+ * @sock: socket connected to init.
+ *
+ * Run as the job output logger, creating a Log for each pty master fd
+ * received on @sock and otherwise behaving exactly as init does for
+ * CONSOLE_LOG jobs.
+ *
+ * Returns: exit status of main loop.
+ **/
+int
+log_offload_server (int sock)
+{
+	nih_assert (sock >= 0);
+
+	log_unflushed_init ();
+
+	log_offload_logs = NIH_MUST (nih_list_new (NULL));
+
+	(void)state_modify_cloexec (sock, TRUE);
+
+	NIH_MUST (nih_io_add_watch (NULL, sock, NIH_IO_READ,
+				    log_offload_receive, NULL));
+
+	NIH_MUST (nih_main_loop_add_func (NULL,
+				(NihMainLoopCb)log_offload_reap, NULL));
+
+	return nih_main_loop ();
+}
+
+/**
+ * log_offload_receive:
+ *
+ * @data: not used,
+ * @watch: NihIoWatch for socket connected to init,
+ * @events: events that occurred.
+ *
+ * Called within the job output logger when a message from init is
+ * available on the fd of @watch.
+ **/
+static void
+log_offload_receive (void        *data,
+		     NihIoWatch  *watch,
+		     NihIoEvents  events)
+{
+	LogOffloadMessage  msg;
+	char               buf[sizeof (LogOffloadMessage) + PATH_MAX + 1];
+	char               control[CMSG_SPACE (sizeof (int))];
+	struct iovec       iov;
+	struct msghdr      hdr;
+	struct cmsghdr    *cmsg;
+	ssize_t            len;
+	int                fd = -1;
+	NihListEntry      *elem;
+	Log               *log;
+
+	nih_assert (watch);
+
+	iov.iov_base = buf;
+	iov.iov_len  = sizeof (buf);
+
+	memset (&hdr, '\0', sizeof (hdr));
+	hdr.msg_iov        = &iov;
+	hdr.msg_iovlen     = 1;
+	hdr.msg_control    = control;
+	hdr.msg_controllen = sizeof (control);
+
+	len = recvmsg (watch->fd, &hdr, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+
+	if (len < 0 && (errno == EINTR || errno == EAGAIN
+				|| errno == EWOULDBLOCK))
+		return;
+
+	if (len <= 0) {
+		/* init has closed its end (most likely due to a
+		 * re-exec), so finish off the logs we have.
+		 */
+		close (watch->fd);
+		nih_free (watch);
+		log_offload_closed = TRUE;
+		return;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR (&hdr); cmsg;
+			cmsg = CMSG_NXTHDR (&hdr, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET
+				&& cmsg->cmsg_type == SCM_RIGHTS
+				&& cmsg->cmsg_len == CMSG_LEN (sizeof (int)))
+			memcpy (&fd, CMSG_DATA (cmsg), sizeof (int));
+	}
+
+	if ((size_t)len < sizeof (msg))
+		goto bad;
+
+	memcpy (&msg, buf, sizeof (msg));
+
+	switch (msg.type) {
+	case LOG_OFFLOAD_OPEN:
+		if (fd < 0 || (size_t)len == sizeof (msg)
+				|| buf[len - 1] != '\0')
+			goto bad;
+
+		elem = nih_list_entry_new (log_offload_logs);
+		if (! elem)
+			goto fail;
+
+		/* fd will be closed by log_destroy() */
+		log = log_new (elem, buf + sizeof (msg), fd, 0);
+		if (! log) {
+			nih_free (elem);
+			goto fail;
+		}
+
+		log_set_limits (log, msg.rate, msg.burst, msg.size);
+
+		elem->data = log;
+		nih_list_add (log_offload_logs, &elem->entry);
+		break;
+
+	case LOG_OFFLOAD_FLUSH:
+		if (fd != -1)
+			goto bad;
+
+		if (log_clear_unflushed () < 0)
+			nih_warn ("%s", _("Failed to flush unflushed logs"));
+		break;
+
+	case LOG_OFFLOAD_REOPEN:
+		if (fd != -1)
+			goto bad;
+
+		log_reopen ();
+		break;
+
+	default:
+		goto bad;
+	}
+
+	return;
+
+bad:
+	nih_warn ("%s", _("Ignoring invalid message from init"));
+	if (fd != -1)
+		close (fd);
+	return;
+
+fail:
+	nih_warn ("%s %s", _("Failed to log job output to"),
+		  buf + sizeof (msg));
+	close (fd);
+}
+
+/**
+ * log_offload_reap:
+ *
+ * @data: not used,
+ * @func: loop function.
+ *
+ * Called within the job output logger on each iteration of the main
+ * loop to deal with logs whose job has closed its end of the pty, in
+ * the same way as init does when a job process ends. Once init has
+ * gone away and all logs are finished with, the logger exits after a
+ * final attempt to flush any data that could not yet be written.
+ **/
+static void
+log_offload_reap (void            *data,
+		  NihMainLoopFunc *func)
+{
+	nih_assert (log_offload_logs);
+
+	NIH_LIST_FOREACH_SAFE (log_offload_logs, iter) {
+		NihListEntry *elem = (NihListEntry *)iter;
+		Log          *log = elem->data;
+
+		nih_assert (log);
+
+		if (! log->remote_closed)
+			continue;
+
+		/* Either the log is moved to the unflushed list, or
+		 * it is finished with and freed along with elem.
+		 */
+		if (log_handle_unflushed (elem, log) < 0)
+			nih_warn ("%s", _("Failed to add log to unflushed queue"));
+
+		nih_free (elem);
+	}
+
+	if (! log_offload_closed || ! NIH_LIST_EMPTY (log_offload_logs))
+		return;
+
+	if (! NIH_LIST_EMPTY (log_unflushed_files)
+			&& log_clear_unflushed () < 0)
+		nih_warn ("%s", _("Failed to flush unflushed logs"));
+
+	nih_main_loop_exit (0);
+}
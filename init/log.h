@@ -30,6 +30,8 @@
 #include <nih/error.h>
 
 #include "state.h"
+#include "log_store.h"
+#include "timer_wheel.h"
 
 /** LOG_DEFAULT_UMASK:
  *
@@ -49,6 +51,56 @@
  **/
 #define LOG_READ_SIZE            1024
 
+/** LOG_SPLICE_SIZE:
+ *
+ * Maximum number of bytes moved from a jobs pty to its log file by a
+ * single splice(2) call.
+ **/
+#define LOG_SPLICE_SIZE          65536
+
+/**
+ * LogSync:
+ *
+ * When job output written to log files is synchronised to disk.
+ **/
+typedef enum log_sync {
+	LOG_SYNC_NONE,
+	LOG_SYNC_INTERVAL,
+	LOG_SYNC_ON_EXIT,
+} LogSync;
+
+/**
+ * LogOffloadType:
+ *
+ * Type of message sent by init to the job output logger
+ * (see log_offload_start()).
+ **/
+typedef enum log_offload_type {
+	LOG_OFFLOAD_OPEN,
+	LOG_OFFLOAD_FLUSH,
+	LOG_OFFLOAD_REOPEN,
+} LogOffloadType;
+
+/**
+ * LogOffloadMessage:
+ *
+ * @type: type of message,
+ * @rate: see log_set_limits() (LOG_OFFLOAD_OPEN only),
+ * @burst: see log_set_limits() (LOG_OFFLOAD_OPEN only),
+ * @size: see log_set_limits() (LOG_OFFLOAD_OPEN only).
+ *
+ * Fixed header of messages sent to the job output logger. For
+ * LOG_OFFLOAD_OPEN, it is followed by the nul-terminated path of the
+ * log file, and the pty master fd of the job is passed as SCM_RIGHTS
+ * ancillary data.
+ **/
+typedef struct log_offload_message {
+	LogOffloadType type;
+	size_t         rate;
+	size_t         burst;
+	size_t         size;
+} LogOffloadMessage;
+
 /**
  * Log:
  *
@@ -59,7 +111,34 @@
  * @unflushed: Unflushed data,
  * @detached: TRUE if log is no longer associated with a parent (job),
  * @remote_closed: TRUE if remote end of pty has been closed,
- * @open_errno: value of errno immediately after last attempt to open @path.
+ * @open_errno: value of errno immediately after last attempt to open @path,
+ * @io_watcher: original watcher function for the watch of @io,
+ * @splice_pipe: pipe used to splice job output into @fd without copying
+ *  it through userspace (both ends -1 until first used),
+ * @splice_disabled: TRUE if splicing has failed such that all data must
+ *  be passed through @io,
+ * @limit_rate: bytes per second of output to log (0 for unlimited),
+ * @limit_burst: bytes of output above @limit_rate permitted at once,
+ * @limit_size: maximum size of @unflushed (0 for unlimited),
+ * @limit_tokens: bytes that may currently be logged without exceeding
+ *  @limit_rate,
+ * @limit_refilled: time (CLOCK_MONOTONIC seconds) @limit_tokens was
+ *  last replenished,
+ * @dropped: total bytes of output discarded due to the limits,
+ * @dropped_pending: bytes of @dropped not yet noted in the log file,
+ * @watched: TRUE if the directory containing @path is watched for files
+ *  being removed or renamed,
+ * @generation: value of log_generation when @fd was last checked to
+ *  still be @path,
+ * @store: structured copy of the log (see log_set_store()), or NULL,
+ * @unsynced: TRUE if @fd has been written since it was last synchronised,
+ * @sync_timer: timer to synchronise @fd when log_sync is
+ *  LOG_SYNC_INTERVAL, or NULL,
+ * @bytes_written: total bytes written to log files,
+ * @writes: number of writes to log files,
+ * @short_writes: number of writes that didn't write all they were given,
+ * @enospc_dropped: bytes of output discarded because the filesystem was
+ *  full.
  **/
 typedef struct log {
 	int          fd;
@@ -70,15 +149,40 @@ typedef struct log {
 	int          detached;
 	int          remote_closed;
 	int          open_errno;
+	NihIoWatcher io_watcher;
+	int          splice_pipe[2];
+	int          splice_disabled;
+	size_t       limit_rate;
+	size_t       limit_burst;
+	size_t       limit_size;
+	size_t       limit_tokens;
+	time_t       limit_refilled;
+	size_t       dropped;
+	size_t       dropped_pending;
+	int          watched;
+	unsigned int generation;
+	LogStore    *store;
+	int          unsynced;
+	WheelTimer  *sync_timer;
+	size_t       bytes_written;
+	size_t       writes;
+	size_t       short_writes;
+	size_t       enospc_dropped;
 } Log;
 
 NIH_BEGIN_EXTERN
 
 extern NihList *log_unflushed_files;
+extern int      log_offload;
+extern LogSync  log_sync;
+extern int      log_sync_interval;
 
 Log  *log_new                (const void *parent, const char *path,
 			      int fd, uid_t uid)
 	__attribute__ ((warn_unused_result));
+void  log_set_limits         (Log *log, size_t rate, size_t burst,
+			      size_t size);
+void  log_set_store          (Log *log, int process, pid_t pid);
 void  log_io_reader          (Log *log, NihIo *io, const char *buf, size_t len);
 void  log_io_error_handler   (Log *log, NihIo *io);
 int   log_destroy            (Log *log)
@@ -88,11 +192,23 @@ int   log_handle_unflushed   (void *parent, Log *log)
 int   log_clear_unflushed    (void)
 	__attribute__ ((warn_unused_result));
 void  log_unflushed_init     (void);
+void  log_reopen             (void);
+char *log_stats_to_string    (const void *parent, const Log *log)
+	__attribute__ ((warn_unused_result, malloc));
 json_object * log_serialise (Log *log)
 	__attribute__ ((warn_unused_result));
 Log * log_deserialise (const void *parent, json_object *json)
 	__attribute__ ((warn_unused_result));
 
+int   log_offload_start      (void)
+	__attribute__ ((warn_unused_result));
+int   log_offload_send       (const char *path, int fd, size_t rate,
+			      size_t burst, size_t size)
+	__attribute__ ((warn_unused_result));
+void  log_offload_flush      (void);
+int   log_offload_server     (int sock)
+	__attribute__ ((warn_unused_result));
+
 NIH_END_EXTERN
 
 #endif /* INIT_LOG_H */
@@ -0,0 +1,644 @@
+/* upstart
+ *
+ * log_store.c - structured, indexed copy of job logs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include "log_store.h"
+
+
+/**
+ * LOG_STORE_MODE:
+ *
+ * File creation mode for segments and their indexes, as for job logs.
+ **/
+#define LOG_STORE_MODE  (S_IRWXU | S_IRGRP)
+
+/**
+ * LOG_STORE_UMASK:
+ *
+ * File creation mask for segments and their indexes, as for job logs.
+ **/
+#define LOG_STORE_UMASK (S_IXUSR | S_IXGRP | S_IRWXO)
+
+/**
+ * LOG_STORE_PAD:
+ * @len: bytes of output.
+ *
+ * Bytes of padding after @len bytes of output to align the next record.
+ **/
+#define LOG_STORE_PAD(len) ((8 - ((len) & 7)) & 7)
+
+
+/* Prototypes for static functions */
+static int      log_store_destroy      (LogStore *store);
+static int      log_store_open         (LogStore *store);
+static void     log_store_close        (LogStore *store);
+static int      log_store_rotate       (LogStore *store);
+static uint64_t log_store_now          (clockid_t clock);
+static int      log_store_read_segment (const char *path,
+					const char *index_path,
+					uint64_t since, uint64_t *until,
+					LogStoreReader reader, void *data,
+					int *stopped);
+
+
+/**
+ * log_store:
+ *
+ * If TRUE, job logs are also written to a structured store alongside
+ * each plain log file (see log_store_new()).
+ **/
+int log_store = FALSE;
+
+
+/**
+ * log_store_new:
+ * @parent: parent for new store,
+ * @log_path: path of plain log file,
+ * @process: ProcessType of job process being logged.
+ *
+ * Allocates and returns a new LogStore that records the output of a job
+ * process, logged to @log_path, in a segment next to it.  Each record
+ * notes when the output was written and which process wrote it, and
+ * the segment is indexed by time so that log_store_read() need not
+ * read it all.  Files are only opened once the first output is
+ * appended with log_store_append().
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned store.  When all parents
+ * of the returned store are freed, the returned store will also be
+ * freed.
+ *
+ * Returns: newly allocated LogStore or NULL if insufficient memory.
+ **/
+LogStore *
+log_store_new (const void *parent,
+	       const char *log_path,
+	       int         process)
+{
+	LogStore *store;
+
+	nih_assert (log_path != NULL);
+
+	store = nih_new (parent, LogStore);
+	if (! store)
+		return NULL;
+
+	store->fd = -1;
+	store->index_fd = -1;
+	store->size = 0;
+	store->indexed = 0;
+	store->latest = 0;
+	store->pid = 0;
+	store->process = process;
+
+	store->path = nih_sprintf (store, "%s%s", log_path,
+				   LOG_STORE_SEGMENT_EXT);
+	if (! store->path)
+		goto error;
+
+	store->index_path = nih_sprintf (store, "%s%s", log_path,
+					 LOG_STORE_INDEX_EXT);
+	if (! store->index_path)
+		goto error;
+
+	nih_alloc_set_destructor (store, log_store_destroy);
+
+	return store;
+
+error:
+	nih_free (store);
+	return NULL;
+}
+
+/**
+ * log_store_destroy:
+ * @store: store being destroyed.
+ *
+ * Closes the segment and index of @store.
+ *
+ * Returns: zero.
+ **/
+static int
+log_store_destroy (LogStore *store)
+{
+	nih_assert (store != NULL);
+
+	log_store_close (store);
+
+	return 0;
+}
+
+
+/**
+ * log_store_open:
+ * @store: store to open.
+ *
+ * Opens the segment of @store and its index, creating them if need be,
+ * and notes where the segment ends so that the next record appended is
+ * added to the index.
+ *
+ * Returns: zero on success, negative value on failure.
+ **/
+static int
+log_store_open (LogStore *store)
+{
+	struct stat   statbuf;
+	LogStoreIndex last;
+	mode_t        old;
+	int           flags = (O_CREAT | O_APPEND | O_WRONLY |
+			       O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+
+	nih_assert (store != NULL);
+	nih_assert (store->fd == -1);
+
+	old = umask (LOG_STORE_UMASK);
+	store->fd = open (store->path, flags, LOG_STORE_MODE);
+	if (store->fd >= 0)
+		store->index_fd = open (store->index_path, flags,
+					LOG_STORE_MODE);
+	umask (old);
+
+	if (store->fd < 0 || store->index_fd < 0)
+		goto error;
+
+	if (fstat (store->fd, &statbuf) < 0)
+		goto error;
+
+	store->size = statbuf.st_size;
+	if (! store->size) {
+		if (write (store->fd, LOG_STORE_MAGIC,
+			   strlen (LOG_STORE_MAGIC)) != strlen (LOG_STORE_MAGIC))
+			goto error;
+
+		store->size = strlen (LOG_STORE_MAGIC);
+	}
+
+	/* Records already in the segment were written before now, and
+	 * no later than the last entry of its index; keep new entries
+	 * in order after it even if the clock has since been stepped back.
+	 */
+	store->latest = log_store_now (CLOCK_REALTIME);
+
+	if ((fstat (store->index_fd, &statbuf) == 0)
+	    && (statbuf.st_size >= (off_t)sizeof (last))
+	    && (pread (store->index_fd, &last, sizeof (last),
+		       statbuf.st_size - (statbuf.st_size % sizeof (last))
+		       - sizeof (last)) == sizeof (last))
+	    && (last.realtime > store->latest))
+		store->latest = last.realtime;
+
+	store->indexed = 0;
+
+	return 0;
+
+error:
+	log_store_close (store);
+	return -1;
+}
+
+/**
+ * log_store_close:
+ * @store: store to close.
+ *
+ * Closes the segment of @store and its index, if open.
+ **/
+static void
+log_store_close (LogStore *store)
+{
+	nih_assert (store != NULL);
+
+	if (store->fd != -1)
+		close (store->fd);
+	if (store->index_fd != -1)
+		close (store->index_fd);
+
+	store->fd = store->index_fd = -1;
+}
+
+/**
+ * log_store_rotate:
+ * @store: store to rotate.
+ *
+ * Replaces the previous segment of @store, and its index, with the
+ * current one; the next record appended starts a new segment.
+ *
+ * Returns: zero on success, negative value on failure.
+ **/
+static int
+log_store_rotate (LogStore *store)
+{
+	nih_local char *path = NULL;
+	nih_local char *index_path = NULL;
+
+	nih_assert (store != NULL);
+
+	log_store_close (store);
+
+	path = nih_sprintf (NULL, "%s.1", store->path);
+	if (! path)
+		return -1;
+
+	index_path = nih_sprintf (NULL, "%s.1", store->index_path);
+	if (! index_path)
+		return -1;
+
+	if (rename (store->path, path) < 0)
+		return -1;
+
+	(void)rename (store->index_path, index_path);
+
+	return 0;
+}
+
+/**
+ * log_store_now:
+ * @clock: clock to read.
+ *
+ * Returns: current time of @clock in nanoseconds.
+ **/
+static uint64_t
+log_store_now (clockid_t clock)
+{
+	struct timespec now;
+
+	nih_assert (clock_gettime (clock, &now) == 0);
+
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+/**
+ * log_store_append:
+ * @store: store to append to,
+ * @buf: output of job process,
+ * @len: bytes in @buf.
+ *
+ * Appends a record of the @len bytes of output in @buf, written now by
+ * the job process of @store, to its segment; first opening it, or
+ * starting a new segment should it have reached LOG_STORE_SEGMENT_SIZE.
+ * An index entry is written before the record when none has been
+ * written for LOG_STORE_INDEX_INTERVAL bytes.
+ *
+ * Should the record not be written in full, the segment is truncated to
+ * remove it so that the segment can still be read.
+ *
+ * Returns: zero on success, negative value on failure.
+ **/
+int
+log_store_append (LogStore   *store,
+		  const char *buf,
+		  size_t      len)
+{
+	static const char zero[8] = { 0 };
+	LogStoreRecord    record;
+	LogStoreIndex     index;
+	struct iovec      iov[3];
+	size_t            total;
+	ssize_t           ret;
+
+	nih_assert (store != NULL);
+	nih_assert (buf != NULL);
+	nih_assert (len <= UINT32_MAX);
+
+	if (! len)
+		return 0;
+
+	if ((store->fd != -1) && (store->size >= LOG_STORE_SEGMENT_SIZE)
+	    && (log_store_rotate (store) < 0))
+		return -1;
+
+	if ((store->fd == -1) && (log_store_open (store) < 0))
+		return -1;
+
+	memset (&record, '\0', sizeof (record));
+	record.magic = LOG_STORE_RECORD_MAGIC;
+	record.len = len;
+	record.realtime = log_store_now (CLOCK_REALTIME);
+	record.monotonic = log_store_now (CLOCK_MONOTONIC);
+	record.pid = store->pid;
+	record.process = store->process;
+
+	if ((! store->indexed)
+	    || (store->size - store->indexed >= LOG_STORE_INDEX_INTERVAL)) {
+		index.realtime = store->latest;
+		index.offset = store->size;
+
+		if (write (store->index_fd, &index, sizeof (index))
+		    == sizeof (index))
+			store->indexed = store->size;
+	}
+
+	iov[0].iov_base = &record;
+	iov[0].iov_len = sizeof (record);
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+	iov[2].iov_base = (void *)zero;
+	iov[2].iov_len = LOG_STORE_PAD (len);
+
+	total = sizeof (record) + len + LOG_STORE_PAD (len);
+
+	ret = writev (store->fd, iov, 3);
+	if (ret < 0 || (size_t)ret != total) {
+		if (ret > 0 && ftruncate (store->fd, store->size) < 0) {
+			/* Can't be read past here, so start afresh */
+			log_store_close (store);
+			(void)log_store_rotate (store);
+		}
+
+		return -1;
+	}
+
+	store->size += total;
+	if (record.realtime > store->latest)
+		store->latest = record.realtime;
+
+	return 0;
+}
+
+
+/**
+ * log_store_path:
+ * @parent: parent for returned string,
+ * @dir: directory job logs are written to,
+ * @job: name of job,
+ * @instance: name of instance, or NULL.
+ *
+ * Determine the path of the plain log file of @instance of @job in @dir,
+ * named in the same way as job_process_log_path() names it, whose
+ * segments are read by log_store_read().
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned string.  When all parents
+ * of the returned string are freed, the returned string will also be
+ * freed.
+ *
+ * Returns: newly allocated string or NULL if insufficient memory.
+ **/
+char *
+log_store_path (const void *parent,
+		const char *dir,
+		const char *job,
+		const char *instance)
+{
+	char *path;
+	char *p;
+
+	nih_assert (dir != NULL);
+	nih_assert (job != NULL);
+
+	if (instance && *instance) {
+		path = nih_sprintf (parent, "%s/%s-%s.log", dir, job, instance);
+	} else {
+		path = nih_sprintf (parent, "%s/%s.log", dir, job);
+	}
+
+	if (! path)
+		return NULL;
+
+	/* Remap slashes in the names, not the directory */
+	for (p = path + strlen (dir) + 1; *p; p++)
+		if (*p == '/')
+			*p = '_';
+
+	return path;
+}
+
+
+/**
+ * log_store_read:
+ * @log_path: path of plain log file,
+ * @since: earliest CLOCK_REALTIME nanoseconds of records to read,
+ * @until: latest CLOCK_REALTIME of records read,
+ * @reader: function to call for each record,
+ * @data: data pointer to pass to @reader.
+ *
+ * Reads the records of output logged to @log_path no earlier than
+ * @since, from the previous segment and then the current one, calling
+ * @reader for each in the order they were written.  Each segment is
+ * mapped into memory, and its index used to find the first record that
+ * may be needed, so that only records after it are read.
+ *
+ * @until is set to the latest time of the records read, if later than
+ * its value on entry.  Reading stops early should @reader return a
+ * negative value.
+ *
+ * Returns: number of segments found, or negative value on raised error.
+ **/
+int
+log_store_read (const char     *log_path,
+		uint64_t        since,
+		uint64_t       *until,
+		LogStoreReader  reader,
+		void           *data)
+{
+	static const char *suffixes[] = { ".1", "", NULL };
+	int                found = 0;
+	int                stopped = FALSE;
+
+	nih_assert (log_path != NULL);
+	nih_assert (until != NULL);
+	nih_assert (reader != NULL);
+
+	for (const char **suffix = suffixes; *suffix && ! stopped; suffix++) {
+		nih_local char *path = NULL;
+		nih_local char *index_path = NULL;
+		int             ret;
+
+		path = nih_sprintf (NULL, "%s%s%s", log_path,
+				    LOG_STORE_SEGMENT_EXT, *suffix);
+		if (! path)
+			nih_return_no_memory_error (-1);
+
+		index_path = nih_sprintf (NULL, "%s%s%s", log_path,
+					  LOG_STORE_INDEX_EXT, *suffix);
+		if (! index_path)
+			nih_return_no_memory_error (-1);
+
+		ret = log_store_read_segment (path, index_path, since, until,
+					      reader, data, &stopped);
+		if (ret < 0)
+			return -1;
+
+		found += ret;
+	}
+
+	return found;
+}
+
+/**
+ * log_store_read_segment:
+ * @path: path of segment,
+ * @index_path: path of index of segment,
+ * @since: earliest CLOCK_REALTIME nanoseconds of records to read,
+ * @until: latest CLOCK_REALTIME of records read,
+ * @reader: function to call for each record,
+ * @data: data pointer to pass to @reader,
+ * @stopped: set to TRUE should @reader stop reading.
+ *
+ * Reads the records in the segment at @path for log_store_read(),
+ * starting from the last index entry before @since; a missing or damaged
+ * index just means reading from the start.  Reading stops at the first
+ * record that isn't complete.
+ *
+ * Returns: 1 if the segment was read, 0 if it doesn't exist, negative
+ * value on raised error.
+ **/
+static int
+log_store_read_segment (const char     *path,
+			const char     *index_path,
+			uint64_t        since,
+			uint64_t       *until,
+			LogStoreReader  reader,
+			void           *data,
+			int            *stopped)
+{
+	struct stat  statbuf;
+	int          fd;
+	const char  *map;
+	size_t       size;
+	size_t       offset;
+
+	nih_assert (path != NULL);
+	nih_assert (index_path != NULL);
+	nih_assert (stopped != NULL);
+
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+
+		nih_return_system_error (-1);
+	}
+
+	if (fstat (fd, &statbuf) < 0) {
+		nih_error_raise_system ();
+		close (fd);
+		return -1;
+	}
+
+	size = statbuf.st_size;
+	offset = strlen (LOG_STORE_MAGIC);
+
+	if (size <= offset) {
+		close (fd);
+		return 1;
+	}
+
+	map = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED)
+		nih_return_system_error (-1);
+
+	if (memcmp (map, LOG_STORE_MAGIC, offset)) {
+		munmap ((void *)map, size);
+		nih_return_error (-1, EINVAL, strerror (EINVAL));
+	}
+
+	/* Find the last index entry before which every record is known
+	 * to be earlier than @since.
+	 */
+	fd = open (index_path, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		const LogStoreIndex *index = MAP_FAILED;
+		size_t               entries = 0;
+
+		if (fstat (fd, &statbuf) == 0) {
+			entries = statbuf.st_size / sizeof (LogStoreIndex);
+			if (entries)
+				index = mmap (NULL, entries * sizeof (LogStoreIndex),
+					      PROT_READ, MAP_SHARED, fd, 0);
+		}
+		close (fd);
+
+		if (index != MAP_FAILED) {
+			size_t lo = 0;
+			size_t hi = entries;
+
+			while (lo < hi) {
+				size_t mid = lo + (hi - lo) / 2;
+
+				if (index[mid].realtime < since) {
+					lo = mid + 1;
+				} else {
+					hi = mid;
+				}
+			}
+
+			if (lo && (index[lo - 1].offset >= offset)
+			    && (index[lo - 1].offset < size)
+			    && ! (index[lo - 1].offset & 7))
+				offset = index[lo - 1].offset;
+
+			munmap ((void *)index, entries * sizeof (LogStoreIndex));
+		}
+	}
+
+	while (offset + sizeof (LogStoreRecord) <= size) {
+		const LogStoreRecord *record;
+		size_t                len;
+
+		record = (const LogStoreRecord *)(map + offset);
+		if (record->magic != LOG_STORE_RECORD_MAGIC)
+			break;
+
+		len = sizeof (LogStoreRecord) + record->len
+			+ LOG_STORE_PAD (record->len);
+		if (len > size - offset)
+			break;
+
+		if (record->realtime >= since) {
+			if (record->realtime > *until)
+				*until = record->realtime;
+
+			if (reader (data, record,
+				    (const char *)(record + 1)) < 0) {
+				*stopped = TRUE;
+				break;
+			}
+		}
+
+		offset += len;
+	}
+
+	munmap ((void *)map, size);
+
+	return 1;
+}
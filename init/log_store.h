@@ -0,0 +1,175 @@
+/* upstart
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INIT_LOG_STORE_H
+#define INIT_LOG_STORE_H
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+#include <nih/macros.h>
+
+
+/**
+ * LOG_STORE_SEGMENT_EXT:
+ *
+ * Appended to the path of a job log file to give the path of its record
+ * segment; the previous segment has ".1" appended to that.
+ **/
+#define LOG_STORE_SEGMENT_EXT    ".seg"
+
+/**
+ * LOG_STORE_INDEX_EXT:
+ *
+ * Appended to the path of a job log file to give the path of the index
+ * of its record segment; the index of the previous segment has ".1"
+ * appended to that.
+ **/
+#define LOG_STORE_INDEX_EXT      ".idx"
+
+/**
+ * LOG_STORE_SEGMENT_SIZE:
+ *
+ * Size a segment may grow to before it replaces the previous segment
+ * and a new one is started.
+ **/
+#define LOG_STORE_SEGMENT_SIZE   (16 * 1024 * 1024)
+
+/**
+ * LOG_STORE_INDEX_INTERVAL:
+ *
+ * Bytes of records between entries in a segment's index.
+ **/
+#define LOG_STORE_INDEX_INTERVAL 65536
+
+/**
+ * LOG_STORE_MAGIC:
+ *
+ * First bytes of every segment.
+ **/
+#define LOG_STORE_MAGIC          "UPSTLOG1"
+
+/**
+ * LOG_STORE_RECORD_MAGIC:
+ *
+ * First member of every record, to catch reading a damaged segment.
+ **/
+#define LOG_STORE_RECORD_MAGIC   0x4c4f4752U
+
+
+/**
+ * LogStoreRecord:
+ * @magic: LOG_STORE_RECORD_MAGIC,
+ * @len: bytes of job output following the record,
+ * @realtime: CLOCK_REALTIME nanoseconds the output was written,
+ * @monotonic: CLOCK_MONOTONIC nanoseconds the output was written,
+ * @pid: process id of job process,
+ * @process: ProcessType of job process.
+ *
+ * Header of each record in a segment, which is followed by @len bytes of
+ * output and then padding to a multiple of 8 bytes.  Records are written
+ * in host byte order, since only this host reads them.
+ **/
+typedef struct log_store_record {
+	uint32_t magic;
+	uint32_t len;
+	uint64_t realtime;
+	uint64_t monotonic;
+	int32_t  pid;
+	uint32_t process;
+} LogStoreRecord;
+
+/**
+ * LogStoreIndex:
+ * @realtime: latest CLOCK_REALTIME of records before @offset,
+ * @offset: offset of a record in the segment.
+ *
+ * Entry of a segment index, written when the first record is appended
+ * after the segment is opened and each LOG_STORE_INDEX_INTERVAL bytes
+ * after that.  Since @realtime is the latest of all earlier records
+ * rather than of the record at @offset, entries are in order even when
+ * the clock is stepped back, and every record before @offset is known
+ * to be no later than @realtime.
+ **/
+typedef struct log_store_index {
+	uint64_t realtime;
+	uint64_t offset;
+} LogStoreIndex;
+
+/**
+ * LogStore:
+ * @path: path of segment,
+ * @index_path: path of index of segment,
+ * @fd: segment, or -1 if not open,
+ * @index_fd: index, or -1 if not open,
+ * @size: current size of segment,
+ * @indexed: size of segment when an index entry was last written,
+ * @latest: latest CLOCK_REALTIME of records in segment,
+ * @pid: process id of job process being logged,
+ * @process: ProcessType of job process being logged.
+ *
+ * Structured copy of a job log, kept alongside the plain file (see
+ * log_store_new()) when log_store is TRUE.
+ **/
+typedef struct log_store {
+	char     *path;
+	char     *index_path;
+	int       fd;
+	int       index_fd;
+	off_t     size;
+	off_t     indexed;
+	uint64_t  latest;
+	pid_t     pid;
+	int       process;
+} LogStore;
+
+/**
+ * LogStoreReader:
+ * @data: data pointer given to log_store_read(),
+ * @record: record read,
+ * @buf: output of @record.
+ *
+ * Called by log_store_read() for each record found.
+ *
+ * Returns: zero to continue reading, negative value to stop.
+ **/
+typedef int (*LogStoreReader) (void *data, const LogStoreRecord *record,
+			       const char *buf);
+
+
+NIH_BEGIN_EXTERN
+
+extern int log_store;
+
+
+LogStore *log_store_new    (const void *parent, const char *log_path,
+			    int process)
+	__attribute__ ((warn_unused_result, malloc));
+
+int       log_store_append (LogStore *store, const char *buf, size_t len);
+
+char     *log_store_path   (const void *parent, const char *dir,
+			    const char *job, const char *instance)
+	__attribute__ ((warn_unused_result, malloc));
+
+int       log_store_read   (const char *log_path, uint64_t since,
+			    uint64_t *until, LogStoreReader reader,
+			    void *data);
+
+NIH_END_EXTERN
+
+#endif /* INIT_LOG_STORE_H */
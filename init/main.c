@@ -29,6 +29,7 @@
 #include <sys/reboot.h>
 #include <sys/resource.h>
 #include <sys/mount.h>
+#include <sys/syscall.h>
 
 #ifdef HAVE_SYS_PRCTL_H
 #include <sys/prctl.h>
@@ -38,6 +39,7 @@
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <limits.h>
 #include <signal.h>
@@ -64,17 +66,32 @@
 #include "system.h"
 #include "job_class.h"
 #include "job_process.h"
+#include "job.h"
 #include "event.h"
+#include "event_operator.h"
+#include "blocked.h"
+#include "alloc_pool.h"
 #include "conf.h"
 #include "control.h"
 #include "state.h"
 #include "xdg.h"
+#include "check_config.h"
+#include "spawn_helper.h"
+#include "spawn_limit.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+#include "status_page.h"
+#include "start_order.h"
+#include "hash_table.h"
+#include "event_trace.h"
 
 
 /* Prototypes for static functions */
 #ifndef DEBUG
-static int  logger_kmsg     (NihLogLevel priority, const char *message);
-static void crash_handler   (int signum);
+static int  logger_kmsg       (NihLogLevel priority, const char *message);
+static int  logger_kmsg_write (const char *record, size_t len);
+static void logger_kmsg_flush (void *data, NihMainLoopFunc *func);
+static void crash_handler     (int signum);
 #endif /* DEBUG */
 static void term_handler    (void *data, NihSignal *signal);
 #ifndef DEBUG
@@ -85,12 +102,26 @@ static void hup_handler     (void *data, NihSignal *signal);
 static void usr1_handler    (void *data, NihSignal *signal);
 #endif /* DEBUG */
 
+static void add_conf_sources        (void);
+static int  check_configuration     (void)
+	__attribute__ ((warn_unused_result));
 static void handle_confdir          (void);
 static void handle_logdir           (void);
+static void handle_conf_cache       (void);
+static void handle_alloc_pools      (void);
+static void handle_container_lean   (void);
+static void startup_check           (void *data, NihMainLoopFunc *func);
+static void startup_watch_timeout   (void *data, WheelTimer *timer);
+static void startup_load            (void *data, NihMainLoopFunc *func);
+static void startup_bus_open        (void *data, NihMainLoopFunc *func);
+static void open_control_bus        (void);
 static int  console_type_setter     (NihOption *option, const char *arg);
 static int  conf_dir_setter         (NihOption *option, const char *arg);
 static int  prepend_conf_dir_setter (NihOption *option, const char *arg);
 static int  append_conf_dir_setter  (NihOption *option, const char *arg);
+static int  state_format_setter     (NihOption *option, const char *arg);
+static int  log_sync_setter         (NihOption *option, const char *arg);
+static int  cpu_affinity_setter     (NihOption *option, const char *arg);
 
 
 /**
@@ -101,6 +132,24 @@ static int  append_conf_dir_setter  (NihOption *option, const char *arg);
  **/
 static int state_fd = -1;
 
+/**
+ * logd_fd:
+ *
+ * Socket connected to the init that started us. If value is not -1,
+ * act solely as the job output logger for that init
+ * (see log_offload_start()).
+ **/
+static int logd_fd = -1;
+
+/**
+ * spawnd_fd:
+ *
+ * Socket connected to the init that started us. If value is not -1,
+ * act solely as the spawn helper for that init
+ * (see spawn_helper_start()).
+ **/
+static int spawnd_fd = -1;
+
 /**
  * conf_dirs:
  *
@@ -131,6 +180,14 @@ static char **append_conf_dirs = NULL;
  **/
 static char *initial_event = NULL;
 
+/**
+ * check_config_only:
+ *
+ * If TRUE, load the configuration, report the conditions of jobs that
+ * can never be met and exit (see check_configuration()).
+ **/
+static int check_config_only = FALSE;
+
 /**
  * disable_startup_event:
  *
@@ -138,6 +195,163 @@ static char *initial_event = NULL;
  **/
 static int disable_startup_event = FALSE;
 
+/**
+ * disable_conf_cache:
+ *
+ * If TRUE, always parse job configuration rather than loading it from
+ * the compiled configuration cache.
+ **/
+static int disable_conf_cache = FALSE;
+
+/**
+ * reuse_state_config:
+ *
+ * If TRUE, keep the jobs passed over a stateful re-exec whose
+ * configuration files are unchanged rather than parsing them again.
+ **/
+static int reuse_state_config = FALSE;
+
+/**
+ * disable_watch_defer:
+ *
+ * If TRUE, create the inotify watches for configuration in user mode
+ * before starting any job rather than once the startup event has been
+ * handled.
+ **/
+static int disable_watch_defer = FALSE;
+
+/**
+ * status_page_enabled:
+ *
+ * If TRUE, publish the goal and state of every job instance in a shared
+ * memory status page that may be read without asking us.
+ **/
+static int status_page_enabled = FALSE;
+
+/**
+ * event_trace_path:
+ *
+ * File to record each event handled and each job state change in, for
+ * replay against a configuration, or NULL to not record them.
+ **/
+static char *event_trace_path = NULL;
+
+/**
+ * STARTUP_WATCH_TIMEOUT:
+ *
+ * Number of seconds after starting that deferred watches on
+ * configuration are created even if the startup event has not yet
+ * finished.
+ **/
+#define STARTUP_WATCH_TIMEOUT 30
+
+/**
+ * STARTUP_LOAD_BATCH:
+ *
+ * Number of job configuration files deferred by a staged startup that
+ * are loaded each time through the main loop.
+ **/
+#define STARTUP_LOAD_BATCH 16
+
+/**
+ * startup_begin:
+ *
+ * Time we started, in microseconds on CLOCK_MONOTONIC.
+ **/
+static uint64_t startup_begin = 0;
+
+/**
+ * startup_timer:
+ *
+ * Timer creating deferred watches on configuration should the startup
+ * event take too long to finish.
+ **/
+static WheelTimer *startup_timer = NULL;
+
+/**
+ * staged_startup:
+ *
+ * If TRUE, emit the startup event once the jobs that might start on it
+ * are loaded, loading the rest of the configuration, and connecting to
+ * the D-Bus bus, while those jobs are started.
+ **/
+static int staged_startup = FALSE;
+
+/**
+ * startup_loader:
+ *
+ * Main loop function loading the configuration deferred by a staged
+ * startup, or NULL once it has all been loaded.
+ **/
+static NihMainLoopFunc *startup_loader = NULL;
+
+/**
+ * disable_alloc_pools:
+ *
+ * If TRUE, allocate all objects from the heap rather than taking those
+ * created most often from pools.
+ **/
+static int disable_alloc_pools = FALSE;
+
+/**
+ * log_batch:
+ *
+ * If TRUE, queue messages logged to the kernel log and write them once
+ * each time through the main loop rather than as each is logged.
+ **/
+static int log_batch = FALSE;
+
+/**
+ * reload_delay:
+ *
+ * Number of milliseconds to collect configuration changes for before
+ * reloading them, once the main loop is running.
+ **/
+static int reload_delay = CONF_RELOAD_DELAY;
+
+/**
+ * stall_threshold:
+ *
+ * Number of milliseconds a main loop callback may take before it is
+ * logged as a stall, once the main loop is running.
+ **/
+static int stall_threshold = METRICS_STALL_THRESHOLD;
+
+/**
+ * load_threads:
+ *
+ * Number of threads to read configuration files with when first
+ * loading them.
+ **/
+static int load_threads = 0;
+
+/**
+ * restore_checkpoint:
+ *
+ * If TRUE when restarting without a state file descriptor, read state
+ * from the checkpoint written by the previous instance.
+ **/
+static int restore_checkpoint = FALSE;
+
+#ifndef DEBUG
+/**
+ * crash_args:
+ *
+ * Arguments to re-exec ourselves with to recover state from the last
+ * checkpoint should we crash, prepared in advance so that nothing need
+ * be allocated by crash_handler(); NULL if state is not checkpointed.
+ **/
+static char **crash_args = NULL;
+
+/**
+ * crash_restore_path:
+ *
+ * Path that crash_handler() moves the last checkpoint to before
+ * re-executing to restore it, prepared along with crash_args.
+ **/
+static char *crash_restore_path = NULL;
+#endif /* DEBUG */
+
 /**
  * disable_dbus:
  *
@@ -146,10 +360,20 @@ static int disable_startup_event = FALSE;
  **/
 static int disable_dbus = FALSE;
 
+/**
+ * container_lean:
+ *
+ * If TRUE, keep our footprint as small as we can, for running as the init
+ * daemon of one of many system containers on a host; see
+ * handle_container_lean().
+ **/
+static int container_lean = FALSE;
+
 extern int          no_inherit_env;
 extern int          user_mode;
 extern int          chroot_sessions;
 extern int          disable_job_logging;
+extern int          job_output_console;
 extern int          use_session_bus;
 extern int          default_console;
 extern int          write_state_file;
@@ -157,6 +381,12 @@ extern char        *log_dir;
 extern DBusBusType  dbus_bus_type;
 extern mode_t       initial_umask;
 extern int          debug_stanza_enabled;
+extern int          conf_lazy_load;
+extern int          disable_clone_spawn;
+extern int          quiesce_max_timeout;
+extern int          quiesce_fast_shutdown;
+extern int          event_limit_rate;
+extern int          event_limit_burst;
 
 #ifdef ENABLE_CGROUPS
 extern int          disable_cgroups;
@@ -171,23 +401,90 @@ static NihOption options[] = {
 	{ 0, "append-confdir", N_("specify additional directory to load configuration files from"),
 		NULL, "DIR", NULL, append_conf_dir_setter },
 
+	{ 0, "check-config", N_("check configuration for conditions that can never be met and exit"),
+		NULL, NULL, &check_config_only, NULL },
+
 	{ 0, "chroot-sessions", N_("enable chroot sessions"),
 		NULL, NULL, &chroot_sessions, NULL },
 
 	{ 0, "confdir", N_("specify alternative directory to load configuration files from"),
 		NULL, "DIR", NULL, conf_dir_setter },
 
+	{ 0, "conf-load-threads", N_("number of threads to read configuration files with at startup"),
+		NULL, "N", &load_threads, nih_option_int },
+
+	{ 0, "conf-reload-delay", N_("milliseconds to collect configuration changes for before reloading them"),
+		NULL, "MS", &reload_delay, nih_option_int },
+
+	{ 0, "container-lean", N_("keep footprint small, as the init daemon of one of many containers"),
+		NULL, NULL, &container_lean, NULL },
+
+	{ 0, "cpu-affinity", N_("run init, its helpers and jobs without a cpu-affinity stanza on the processors in LIST"),
+		NULL, "LIST", NULL, cpu_affinity_setter },
+
+	{ 0, "critical-path", N_("log the longest chain of jobs started by one another whenever the configuration changes"),
+		NULL, NULL, &start_order_report, NULL },
+
 	{ 0, "default-console", N_("default value for console stanza"),
 		NULL, "VALUE", NULL, console_type_setter },
 
+	{ 0, "event-burst", N_("number of events a client may emit at once before its rate limit applies"),
+		NULL, "N", &event_limit_burst, nih_option_int },
+
+	{ 0, "event-match-threads", N_("number of threads to rule out job conditions an event can't match with"),
+		NULL, "N", &event_match_threads, nih_option_int },
+
+	{ 0, "event-rate", N_("number of events per second each client may emit (0 for no limit)"),
+		NULL, "N", &event_limit_rate, nih_option_int },
+
+	{ 0, "event-trace", N_("record events and job state changes in FILE for replay"),
+		NULL, "FILE", &event_trace_path, NULL },
+
+	{ 0, "fast-shutdown", N_("stop jobs in parallel waves when the runlevel changes to halt or reboot"),
+		NULL, NULL, &quiesce_fast_shutdown, NULL },
+
+	{ 0, "lazy-load", N_("only load the definition of jobs without a start on condition when they are first run"),
+		NULL, NULL, &conf_lazy_load, NULL },
+
 	{ 0, "logdir", N_("specify alternative directory to store job output logs in"),
 		NULL, "DIR", &log_dir, NULL },
 
+	{ 0, "log-batch", N_("write messages to the kernel log once each time through the main loop"),
+		NULL, NULL, &log_batch, NULL },
+
+	{ 0, "log-offload", N_("write job output logs from a separate process"),
+		NULL, NULL, &log_offload, NULL },
+
+	{ 0, "log-store", N_("also write job output logs to an indexed store for initctl log"),
+		NULL, NULL, &log_store, NULL },
+
+	{ 0, "log-sync", N_("when to synchronise job output logs to disk (none, on-exit or milliseconds)"),
+		NULL, "POLICY", NULL, log_sync_setter },
+
+	/* Used internally by log_offload_start() */
+	{ 0, "logd-fd", N_("act as job output logger for socket FD"),
+		NULL, "FD", &logd_fd, nih_option_int },
+
+	{ 0, "no-alloc-pools", N_("do not pool allocations of frequently created objects"),
+		NULL, NULL, &disable_alloc_pools, NULL },
+
 #ifdef ENABLE_CGROUPS
 	{ 0, "no-cgroups", N_("do not support cgroups"),
 		NULL, NULL, &disable_cgroups, NULL },
 #endif /* ENABLE_CGROUPS */
 
+	{ 0, "no-clone-spawn", N_("always fork to spawn job processes"),
+		NULL, NULL, &disable_clone_spawn, NULL },
+
+	{ 0, "no-conf-cache", N_("do not cache compiled job configuration"),
+		NULL, NULL, &disable_conf_cache, NULL },
+
+	{ 0, "status-page", N_("publish job states in a shared memory status page"),
+		NULL, NULL, &status_page_enabled, NULL },
+
+	{ 0, "no-defer-watches", N_("watch configuration for changes before starting jobs in user mode"),
+		NULL, NULL, &disable_watch_defer, NULL },
+
 	{ 0, "no-dbus", N_("do not connect to a D-Bus bus"),
 		NULL, NULL, &disable_dbus, NULL },
 
@@ -207,13 +504,57 @@ static NihOption options[] = {
 	{ 0, "restart", N_("flag a re-exec has occurred"),
 		NULL, NULL, &restart, NULL },
 
+	{ 0, "restore-checkpoint", N_("read state from the last checkpoint when restarting"),
+		NULL, NULL, &restore_checkpoint, NULL },
+
+	{ 0, "reuse-state-config", N_("only parse job configuration that has changed since a stateful re-exec"),
+		NULL, NULL, &reuse_state_config, NULL },
+
+	{ 0, "state-checkpoint", N_("checkpoint state at most every MS milliseconds to recover from a crash"),
+		NULL, "MS", &state_checkpoint_interval, nih_option_int },
+
 	/* Required for stateful re-exec */
 	{ 0, "state-fd", N_("specify file descriptor to read serialisation data from"),
 		NULL, "FD", &state_fd, nih_option_int },
 
+	{ 0, "state-format", N_("specify format of serialisation data passed on stateful re-exec"),
+		NULL, "FORMAT", NULL, state_format_setter },
+
+	{ 0, "state-fork", N_("serialise state requested over D-Bus in a child process"),
+		NULL, NULL, &control_state_fork, NULL },
+
+	{ 0, "shutdown-timeout", N_("maximum seconds to wait for jobs to stop on shutdown"),
+		NULL, "SECONDS", &quiesce_max_timeout, nih_option_int },
+
+	{ 0, "spawn-helper", N_("fork job processes from a separate small process"),
+		NULL, NULL, &spawn_helper, NULL },
+
+	{ 0, "spawn-limit", N_("number of jobs that may be spawning their processes at once (0 for no limit)"),
+		NULL, "N", &spawn_limit, nih_option_int },
+
+	{ 0, "spawn-limit-load", N_("lower the spawn limit while the load average exceeds the number of processors"),
+		NULL, NULL, &spawn_limit_load, NULL },
+
+	{ 0, "spawn-limit-wait", N_("maximum seconds a job waits for the spawn limit before it is admitted anyway (0 for no maximum)"),
+		NULL, "SECONDS", &spawn_limit_wait, nih_option_int },
+
+	/* Used internally by spawn_helper_prepare_reexec() */
+	{ 0, "spawn-helper-fd", N_("use spawn helper connected to socket FD"),
+		NULL, "FD", &spawn_helper_fd, nih_option_int },
+
+	/* Used internally by spawn_helper_start() */
+	{ 0, "spawnd-fd", N_("act as spawn helper for socket FD"),
+		NULL, "FD", &spawnd_fd, nih_option_int },
+
 	{ 0, "session", N_("use D-Bus session bus rather than system bus (for testing)"),
 		NULL, NULL, &use_session_bus, NULL },
 
+	{ 0, "staged-startup", N_("emit the startup event before all configuration is loaded"),
+		NULL, NULL, &staged_startup, NULL },
+
+	{ 0, "stall-threshold", N_("milliseconds a main loop callback may take before it is logged as a stall (0 to disable)"),
+		NULL, "MS", &stall_threshold, nih_option_int },
+
 	{ 0, "startup-event", N_("specify an alternative initial event (for testing)"),
 		NULL, "NAME", &initial_event, NULL },
 
@@ -237,6 +578,8 @@ main (int   argc,
 	char **args = NULL;
 	int    ret;
 
+	startup_begin = job_timing_now ();
+
 	conf_dirs = NIH_MUST (nih_str_array_new (NULL));
 	append_conf_dirs = NIH_MUST (nih_str_array_new (NULL));
 	prepend_conf_dirs = NIH_MUST (nih_str_array_new (NULL));
@@ -258,8 +601,17 @@ main (int   argc,
 	if (nih_log_priority == NIH_LOG_DEBUG)
 		debug_stanza_enabled = TRUE;
 
+	if (logd_fd != -1)
+		exit (log_offload_server (logd_fd));
+
+	if (spawnd_fd != -1)
+		exit (spawn_helper_server (spawnd_fd));
+
+	handle_container_lean ();
 	handle_confdir ();
 	handle_logdir ();
+	handle_conf_cache ();
+	handle_alloc_pools ();
 
 	if (disable_job_logging)
 		nih_debug ("Job logging disabled");
@@ -270,6 +622,9 @@ main (int   argc,
 	if (! user_mode)
 		no_inherit_env = TRUE;
 
+	if (check_config_only)
+		exit (check_configuration ());
+
 #ifndef DEBUG
 	if (use_session_bus == FALSE && user_mode == FALSE) {
 
@@ -445,6 +800,9 @@ main (int   argc,
 		/* Save initial value */
 		initial_umask = umask (0);
 		(void)umask (initial_umask);
+
+		/* A Session Init is quiesced instead */
+		quiesce_fast_shutdown = FALSE;
 	}
 
 	/* Reset the signal state and install the signal handler for those
@@ -461,6 +819,21 @@ main (int   argc,
 		 */
 		nih_signal_set_handler (SIGSEGV, crash_handler);
 		nih_signal_set_handler (SIGABRT, crash_handler);
+
+		if (state_checkpoint_interval > 0) {
+			crash_args = NIH_MUST (nih_str_array_copy (NULL, NULL,
+								   args_copy));
+			clean_args (&crash_args);
+
+			if (! restart)
+				NIH_MUST (nih_str_array_add (&crash_args, NULL, NULL,
+							     "--restart"));
+			NIH_MUST (nih_str_array_add (&crash_args, NULL, NULL,
+						     "--restore-checkpoint"));
+
+			crash_restore_path = NIH_MUST (
+				state_checkpoint_restore_path (NULL));
+		}
 	}
 #endif /* DEBUG */
 
@@ -520,13 +893,56 @@ main (int   argc,
 
 
 	/* Watch children for events */
+	job_process_account_init ();
 	NIH_MUST (nih_child_add_watch (NULL, -1, NIH_CHILD_ALL,
 				       job_process_handler, NULL));
 
-	/* Process the event queue each time through the main loop */
+	/* Order the job classes by their start chains whenever they've
+	 * changed, before the event queue is processed each time through
+	 * the main loop.
+	 */
+	NIH_MUST (nih_main_loop_add_func (NULL,
+					  (NihMainLoopCb)start_order_update,
+					  NULL));
+
+	/* Grow any hash table that new entries have crowded before the
+	 * event queue is processed.
+	 */
+	NIH_MUST (nih_main_loop_add_func (NULL, hash_table_grow_pending,
+					  NULL));
+
+	/* Admit the jobs waiting for others to finish spawning, ahead of
+	 * the events that might start more.
+	 */
+	NIH_MUST (nih_main_loop_add_func (NULL, spawn_limit_poll, NULL));
 	NIH_MUST (nih_main_loop_add_func (NULL, (NihMainLoopCb)event_poll,
 					  NULL));
 
+	/* Tell bridges about the jobs added and removed each time through
+	 * the main loop in one signal, rather than one for each job.
+	 */
+	NIH_MUST (nih_main_loop_add_func (NULL, control_jobs_changed_flush,
+					  NULL));
+
+	/* Record events and job state changes, writing out those of each
+	 * time through the main loop once the event queue is processed.
+	 */
+	if (event_trace_path) {
+		if (event_trace_open (event_trace_path, restart) < 0) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_warn ("%s: %s: %s", event_trace_path,
+				  _("Unable to open event trace"),
+				  err->message);
+			nih_free (err);
+		} else {
+			NIH_MUST (nih_main_loop_add_func (NULL,
+							  event_trace_flush,
+							  NULL));
+		}
+	}
+
 
 	/* Adjust our OOM priority to the default, which will be inherited
 	 * by all jobs.
@@ -559,6 +975,43 @@ main (int   argc,
 		}
 	}
 
+	/* Start the job output logger (which inherits our OOM score) */
+	if (log_offload && ! disable_job_logging) {
+		if (log_offload_start () < 0) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_warn ("%s: %s", _("Unable to start job output logger"),
+				  err->message);
+			nih_free (err);
+		}
+	}
+
+	/* Start the spawn helper while we're still small, unless we kept
+	 * the one from before a re-exec.
+	 */
+	if (spawn_helper_fd != -1) {
+		(void)state_modify_cloexec (spawn_helper_fd, TRUE);
+	} else if (spawn_helper) {
+		if (spawn_helper_start () < 0) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_warn ("%s: %s", _("Unable to start spawn helper"),
+				  err->message);
+			nih_free (err);
+		}
+	}
+
+
+	if (restart && restore_checkpoint && state_fd == -1) {
+		state_fd = state_checkpoint_open ();
+		if (state_fd < 0)
+			nih_warn ("%s %s: %s", _("Unable to read checkpoint"),
+				  state_checkpoint_path (), strerror (errno));
+	} else {
+		restore_checkpoint = FALSE;
+	}
 
 	if (restart) {
 		if (state_fd == -1) {
@@ -597,6 +1050,14 @@ main (int   argc,
 		} else {
 			close (state_fd);
 
+			/* The checkpoint may predate processes ending */
+			if (restore_checkpoint) {
+				job_process_check_pids ();
+				nih_info ("State recovered from checkpoint");
+			}
+
+			spawn_limit_recover ();
+
 			nih_info ("Stateful re-exec completed");
 		}
 	}
@@ -607,39 +1068,7 @@ main (int   argc,
 	 */
 	if (! restart || (restart && state_fd == -1)) {
 		/* Read configuration */
-		if (prepend_conf_dirs[0]) {
-			for (char **d = prepend_conf_dirs; d && *d; d++) {
-				nih_debug ("Prepending configuration directory %s", *d);
-				NIH_MUST (conf_source_new (NULL, *d, CONF_JOB_DIR));
-			}
-		}
-
-		if (! user_mode) {
-			nih_assert (conf_dirs[0]);
-
-			NIH_MUST (conf_source_new (NULL, CONFFILE, CONF_FILE));
-
-			for (char **d = conf_dirs; d && *d; d++) {
-				nih_debug ("Using configuration directory %s", *d);
-				NIH_MUST (conf_source_new (NULL, *d, CONF_JOB_DIR));
-			}
-		} else {
-			nih_local char **dirs = NULL;
-
-			dirs = NIH_MUST (get_user_upstart_dirs ());
-
-			for (char **d = conf_dirs[0] ? conf_dirs : dirs; d && *d; d++) {
-				nih_debug ("Using configuration directory %s", *d);
-				NIH_MUST (conf_source_new (NULL, *d, CONF_JOB_DIR));
-			}
-		}
-
-		if (append_conf_dirs[0]) {
-			for (char **d = append_conf_dirs; d && *d; d++) {
-				nih_debug ("Adding configuration directory %s", *d);
-				NIH_MUST (conf_source_new (NULL, *d, CONF_JOB_DIR));
-			}
-		}
+		add_conf_sources ();
 	}
 
 	nih_free (conf_dirs);
@@ -648,11 +1077,49 @@ main (int   argc,
 
 	job_class_environment_init ();
 
+	/* A session init only watches its configuration, which takes a
+	 * walk of each directory, once the jobs for the session are
+	 * running; the configuration itself has just been read.  So does
+	 * a staged startup, which needs the directories walked to pass
+	 * over the files it defers.
+	 */
+	if ((! restart)
+	    && ((user_mode && (! disable_watch_defer)) || staged_startup)) {
+		conf_watch_defer = TRUE;
+
+		startup_timer = NIH_MUST (timer_wheel_add (
+				NULL, STARTUP_WATCH_TIMEOUT * 1000,
+				startup_watch_timeout, NULL));
+	}
+
+	/* Files are only read in parallel for the initial load, and the
+	 * jobs passed over a stateful re-exec only kept by it.
+	 */
+	conf_load_threads = load_threads;
+	conf_reuse_state = (reuse_state_config && restart && state_fd != -1);
+	if (staged_startup && (! restart) && (! disable_startup_event))
+		conf_staged_event = (initial_event ? initial_event : STARTUP_EVENT);
 	conf_reload ();
+	conf_load_threads = 0;
+	conf_reuse_state = FALSE;
+	conf_staged_event = NULL;
 
 	/* We must have atleast one source of configuration */
 	nih_assert (! NIH_LIST_EMPTY (conf_sources));
 
+	/* Publish the job instances restored, and those to come; the page
+	 * is always replaced, even after a stateful re-exec.
+	 */
+	if (status_page_enabled && (! user_mode)
+	    && (status_page_open (UPSTART_STATUS_FILE) < 0)) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_warn ("%s: %s: %s", UPSTART_STATUS_FILE,
+			  _("Unable to publish status page"), err->message);
+		nih_free (err);
+	}
+
 	/* Create a listening server for private connections. */
 	if (use_session_bus == FALSE) {
 		while (control_server_open () < 0) {
@@ -669,25 +1136,16 @@ main (int   argc,
 		}
 	}
 
-	/* Open connection to the appropriate D-Bus bus; we normally expect this to
-	 * fail (since dbus-daemon probably isn't running yet) and will try again
-	 * later - don't let ENOMEM stop us though.
+	/* Open connection to the appropriate D-Bus bus; a staged startup
+	 * leaves this until the startup event has been handled.
 	 */
 	if (disable_dbus) {
 		nih_info (_("Not connecting to %s bus"),
 				use_session_bus ? "session" : "system");
+	} else if (staged_startup && (! restart)) {
+		NIH_MUST (nih_main_loop_add_func (NULL, startup_bus_open, NULL));
 	} else {
-		while (control_bus_open () < 0) {
-			NihError *err;
-			int       number;
-
-			err = nih_error_get ();
-			number = err->number;
-			nih_free (err);
-
-			if (number != ENOMEM)
-				break;
-		}
+		open_control_bus ();
 	}
 
 #ifndef DEBUG
@@ -707,6 +1165,10 @@ main (int   argc,
 		}
 
 		nih_log_set_logger (logger_kmsg);
+
+		if (log_batch)
+			NIH_MUST (nih_main_loop_add_func (NULL, logger_kmsg_flush,
+							  NULL));
 	}
 #endif /* DEBUG */
 
@@ -715,6 +1177,8 @@ main (int   argc,
 	 * init daemon that exec'd us
 	 */
 	if (! restart) {
+		metrics_startup_begin = startup_begin;
+
 		if (disable_startup_event) {
 			nih_debug ("Startup event disabled");
 		} else {
@@ -723,8 +1187,21 @@ main (int   argc,
 				? initial_event
 				: STARTUP_EVENT,
 				NULL));
+
+			metrics_startup_event_time = (job_timing_now ()
+						      - startup_begin);
 		}
 
+		/* Load the configuration the startup event isn't waiting
+		 * for while the jobs it starts are spawned.
+		 */
+		if (staged_startup)
+			startup_loader = NIH_MUST (nih_main_loop_add_func (
+					NULL, startup_load, NULL));
+
+		/* Report once we're ready */
+		NIH_MUST (nih_main_loop_add_func (NULL, startup_check, NULL));
+
 	} else {
 		sigset_t        mask;
 
@@ -762,13 +1239,31 @@ main (int   argc,
 	}
 #endif
 
+	if (restart && state_fd != -1)
+		state_reexec_stats_complete ();
+
 	/* Run through the loop at least once to deal with signals that were
 	 * delivered to the previous process while the mask was set or to
 	 * process the startup event we emitted.
 	 */
 	nih_main_loop_interrupt ();
+
+	/* Changes to configuration are only collected once the main loop
+	 * is running; until now they have been loaded immediately.
+	 */
+	conf_reload_delay = reload_delay;
+
+	/* Nor are callbacks timed until then, since nothing is waiting on
+	 * the main loop while the configuration is first loaded.
+	 */
+	metrics_stall_threshold = stall_threshold;
+
 	ret = nih_main_loop ();
 
+#ifndef DEBUG
+	logger_kmsg_flush (NULL, NULL);
+#endif /* DEBUG */
+
 	/* Cleanup */
 	conf_destroy ();
 	session_destroy ();
@@ -779,6 +1274,40 @@ main (int   argc,
 
 
 #ifndef DEBUG
+/**
+ * KMSG_BATCH_SIZE:
+ *
+ * Size of the buffer that messages are queued in when batching them.
+ **/
+#define KMSG_BATCH_SIZE 16384
+
+/**
+ * KMSG_BATCH_RECORDS:
+ *
+ * Maximum number of messages that may be queued when batching them.
+ **/
+#define KMSG_BATCH_RECORDS 256
+
+/**
+ * kmsg_fd:
+ *
+ * Kernel log device, kept open between messages; closed on exec so that
+ * our replacement opens its own when it first logs.
+ **/
+static int kmsg_fd = -1;
+
+/**
+ * kmsg_batch:
+ *
+ * Messages queued to be written to the kernel log, one after another;
+ * the length of each is held in kmsg_batch_lens.  Statically allocated
+ * so that they can still be written from crash_handler().
+ **/
+static char   kmsg_batch[KMSG_BATCH_SIZE];
+static size_t kmsg_batch_len = 0;
+static size_t kmsg_batch_lens[KMSG_BATCH_RECORDS];
+static size_t kmsg_batch_records = 0;
+
 /**
  * logger_kmsg:
  * @priority: priority of message being logged,
@@ -788,6 +1317,11 @@ main (int   argc,
  * appropriate tag based on @priority, the program name and terminated with
  * a new line.
  *
+ * When log_batch is TRUE, messages below warning priority are queued to
+ * be written by logger_kmsg_flush() rather than immediately; those of
+ * higher priority have the queue written before them so that order is
+ * kept.
+ *
  * Returns: zero on success, negative value on error.
  **/
 static int
@@ -795,11 +1329,8 @@ logger_kmsg (NihLogLevel priority,
 	     const char *message)
 {
 	int             tag;
-	int             fd;
-	ssize_t         ret;
-	size_t          remaining = -1;
+	int             len;
 	nih_local char *buffer = NULL;
-	char           *p;
 
 	nih_assert (message != NULL);
 
@@ -826,34 +1357,111 @@ logger_kmsg (NihLogLevel priority,
 		tag = 'd';
 	}
 
-	fd = open ("/dev/kmsg", O_WRONLY | O_NOCTTY);
-	if (fd < 0)
-		return -1;
+	if (log_batch && (priority < NIH_LOG_WARN)) {
+		size_t space = sizeof (kmsg_batch) - kmsg_batch_len;
+
+		len = snprintf (kmsg_batch + kmsg_batch_len, space,
+				"<%c>%s: %s\n", tag, program_name, message);
+		if (len < 0)
+			return -1;
+
+		if (((size_t)len < space)
+		    && (kmsg_batch_records < KMSG_BATCH_RECORDS)) {
+			kmsg_batch_lens[kmsg_batch_records++] = len;
+			kmsg_batch_len += len;
+
+			return 0;
+		}
+
+		/* Doesn't fit, so write what's queued and this after it */
+		logger_kmsg_flush (NULL, NULL);
+	} else if (kmsg_batch_records) {
+		logger_kmsg_flush (NULL, NULL);
+	}
 
 	buffer = nih_sprintf (NULL, "<%c>%s: %s\n", tag, program_name, message);
 	if (! buffer)
-		goto out;
+		return 0;
+
+	return logger_kmsg_write (buffer, strlen (buffer));
+}
 
-	p = buffer;
+/**
+ * logger_kmsg_write:
+ * @record: message to write,
+ * @len: length of @record.
+ *
+ * Writes @record to the kernel log as a single record, opening the device
+ * if it isn't already.  Should the write fail, the device is opened again
+ * and the write retried once.
+ *
+ * Returns: zero on success, negative value on error.
+ **/
+static int
+logger_kmsg_write (const char *record,
+		   size_t      len)
+{
+	nih_assert (record != NULL);
+
+	for (int attempt = 0; attempt < 2; attempt++) {
+		const char *p = record;
+		size_t      remaining = len;
+		ssize_t     ret;
+
+		if (kmsg_fd < 0) {
+			kmsg_fd = open ("/dev/kmsg",
+					O_WRONLY | O_NOCTTY | O_CLOEXEC);
+			if (kmsg_fd < 0)
+				return -1;
+		}
+
+		do {
+			ret = write (kmsg_fd, p, remaining);
+			if (ret > 0) {
+				p += ret;
+				remaining -= ret;
+			} else if (! ret || (ret < 0 && errno != EINTR)) {
+				break;
+			}
+		} while (remaining);
 
-	remaining = strlen (p);
+		if (! remaining)
+			return 0;
 
-	do {
-		ret = write (fd, p, remaining);
-		if (ret > 0) {
-			p += ret;
-			remaining -= ret;
-		} else if (! ret || (ret < 0 && errno != EINTR)) {
-			close (fd);
+		close (kmsg_fd);
+		kmsg_fd = -1;
+
+		/* Don't write the part already written again */
+		if (p != record)
 			return -1;
-		}
-	} while (remaining);
+	}
 
-out:
-	if (close (fd) < 0)
-		return -1;
+	return -1;
+}
 
-	return 0;
+/**
+ * logger_kmsg_flush:
+ * @data: unused,
+ * @func: main loop function, or NULL.
+ *
+ * Writes the messages queued by logger_kmsg(), each with a write of its
+ * own since the kernel takes each write as a separate record.  Called
+ * each time through the main loop when log_batch is TRUE, and before
+ * anything that would lose the queue.
+ **/
+static void
+logger_kmsg_flush (void            *data,
+		   NihMainLoopFunc *func)
+{
+	const char *p = kmsg_batch;
+
+	for (size_t i = 0; i < kmsg_batch_records; i++) {
+		logger_kmsg_write (p, kmsg_batch_lens[i]);
+		p += kmsg_batch_lens[i];
+	}
+
+	kmsg_batch_len = 0;
+	kmsg_batch_records = 0;
 }
 
 
@@ -865,11 +1473,15 @@ out:
  * our own mistakes.  We deal with it by dumping core in a child process
  * and then killing the parent.
  *
- * Sadly there's no real alternative to the ensuing kernel panic.  Our
- * state is likely in tatters, so we can't sigjmp() anywhere "safe" or
- * re-exec since the system will be suddenly lobotomised.  We definitely
- * don't want to start a root shell or anything like that.  Best thing is
- * to just stop the whole thing and hope that bug report comes quickly.
+ * Our state is likely in tatters, so we can't sigjmp() anywhere "safe"
+ * or re-exec with our current state.  If state has been checkpointed
+ * (see state_checkpoint()) we re-exec to recover the last checkpoint,
+ * which was taken while all was well; it is moved aside first so that
+ * should the recovered state crash us again before a new checkpoint is
+ * taken, we don't loop.  Otherwise there's no real
+ * alternative to the ensuing kernel panic; we definitely don't want to
+ * start a root shell or anything like that.  Best thing is to just stop
+ * the whole thing and hope that bug report comes quickly.
  **/
 static void
 crash_handler (int signum)
@@ -878,6 +1490,10 @@ crash_handler (int signum)
 
 	nih_assert (args_copy[0] != NULL);
 
+	/* Write anything we've queued, and our last words, immediately */
+	logger_kmsg_flush (NULL, NULL);
+	log_batch = FALSE;
+
 	pid = fork ();
 	if (pid == 0) {
 		struct sigaction act;
@@ -927,6 +1543,13 @@ crash_handler (int signum)
 			    ? "segmentation fault" : "abort"));
 	}
 
+	if (crash_args && ! state_checkpoint_claim (crash_restore_path)) {
+		nih_fatal (_("Recovering state from checkpoint"));
+
+		state_checkpoint_inherit_fds ();
+		execvp (crash_args[0], crash_args);
+	}
+
 	/* Goodbye, cruel world. */
 	exit (signum);
 }
@@ -954,6 +1577,9 @@ term_handler (void      *data,
 	}
 
 	nih_warn (_("Re-executing %s"), args_copy[0]);
+#ifndef DEBUG
+	logger_kmsg_flush (NULL, NULL);
+#endif /* DEBUG */
 	stateful_reexec ();
 }
 
@@ -1020,6 +1646,7 @@ hup_handler (void      *data,
 	     NihSignal *signal)
 {
 	nih_info (_("Reloading configuration"));
+	conf_cache_invalidate ();
 	conf_reload ();
 }
 
@@ -1061,6 +1688,78 @@ usr1_handler (void      *data,
 }
 #endif /* DEBUG */
 
+/**
+ * add_conf_sources:
+ *
+ * Add the configuration sources given on the command-line, or the
+ * defaults for the mode we're running in.
+ **/
+static void
+add_conf_sources (void)
+{
+	if (prepend_conf_dirs[0]) {
+		for (char **d = prepend_conf_dirs; d && *d; d++) {
+			nih_debug ("Prepending configuration directory %s", *d);
+			NIH_MUST (conf_source_new (NULL, *d, CONF_JOB_DIR));
+		}
+	}
+
+	if (! user_mode) {
+		nih_assert (conf_dirs[0]);
+
+		NIH_MUST (conf_source_new (NULL, CONFFILE, CONF_FILE));
+
+		for (char **d = conf_dirs; d && *d; d++) {
+			nih_debug ("Using configuration directory %s", *d);
+			NIH_MUST (conf_source_new (NULL, *d, CONF_JOB_DIR));
+		}
+	} else {
+		nih_local char **dirs = NULL;
+
+		dirs = NIH_MUST (get_user_upstart_dirs ());
+
+		for (char **d = conf_dirs[0] ? conf_dirs : dirs; d && *d; d++) {
+			nih_debug ("Using configuration directory %s", *d);
+			NIH_MUST (conf_source_new (NULL, *d, CONF_JOB_DIR));
+		}
+	}
+
+	if (append_conf_dirs[0]) {
+		for (char **d = append_conf_dirs; d && *d; d++) {
+			nih_debug ("Adding configuration directory %s", *d);
+			NIH_MUST (conf_source_new (NULL, *d, CONF_JOB_DIR));
+		}
+	}
+}
+
+/**
+ * check_configuration:
+ *
+ * Load the configuration from the usual sources, as when running as the
+ * init daemon, and report the conditions of jobs that can never be met.
+ * Used to check configuration offline, without any init daemon running.
+ *
+ * Returns: exit status, non-zero if any condition can't be met or any
+ * configuration file has errors.
+ **/
+static int
+check_configuration (void)
+{
+	nih_local CheckConfig *check = NULL;
+
+	add_conf_sources ();
+
+	job_class_environment_init ();
+	conf_reload ();
+
+	check = check_config_new (NULL);
+
+	if (check_config_report (check, NULL) || conf_errors)
+		return 1;
+
+	return 0;
+}
+
 /**
  * handle_confdir:
  *
@@ -1118,6 +1817,228 @@ out:
 			log_dir);
 }
 
+/**
+ * handle_conf_cache:
+ *
+ * Determine the file compiled job configuration should be cached in,
+ * if any.
+ **/
+static void
+handle_conf_cache (void)
+{
+	char *file;
+
+	if (disable_conf_cache)
+		return;
+
+	file = getenv (CONF_CACHE_ENV);
+
+	/* A session init keeps its cache alongside its logs, since the
+	 * user's own jobs are cached along with the system's session
+	 * jobs, and nothing cached by one user is trusted by another.
+	 */
+	if (! file && user_mode) {
+		file = get_user_cache_file (CONF_CACHE_USER_FILE);
+		if (! file)
+			return;
+	}
+
+	conf_cache_file = file ? file : CONF_CACHE_FILE;
+
+	nih_debug ("Using configuration cache %s", conf_cache_file);
+}
+
+/**
+ * startup_check:
+ * @data: unused,
+ * @func: main loop function.
+ *
+ * Called each time through the main loop after we first start until the
+ * startup event, and any other events it led to, have been handled and
+ * the jobs they started are running, and any configuration deferred by
+ * a staged startup has been loaded; records and logs the time taken,
+ * then creates any watches on configuration that were deferred.
+ **/
+static void
+startup_check (void            *data,
+	       NihMainLoopFunc *func)
+{
+	nih_assert (func != NULL);
+
+	if ((! NIH_LIST_EMPTY (events)) || startup_loader)
+		return;
+
+	metrics_ready_time = job_timing_now () - startup_begin;
+
+	nih_info (_("Ready after %llu ms (startup event after %llu ms, "
+		    "first job after %llu ms)"),
+		  (unsigned long long)metrics_ready_time / 1000,
+		  (unsigned long long)metrics_startup_event_time / 1000,
+		  (unsigned long long)metrics_first_spawn_time / 1000);
+
+	if (startup_timer) {
+		nih_free (startup_timer);
+		startup_timer = NULL;
+	}
+
+	if (conf_watch_defer && (! container_lean))
+		conf_watch_sources ();
+
+	nih_free (func);
+}
+
+/**
+ * startup_watch_timeout:
+ * @data: unused,
+ * @timer: timer that triggered.
+ *
+ * Creates any watches on configuration that were deferred should the
+ * startup event still not have finished STARTUP_WATCH_TIMEOUT seconds
+ * after we started; the time we become ready is still reported by
+ * startup_check().
+ **/
+static void
+startup_watch_timeout (void       *data,
+		       WheelTimer *timer)
+{
+	nih_assert (timer != NULL);
+
+	startup_timer = NULL;
+
+	if (conf_watch_defer && (! container_lean)) {
+		nih_info (_("Startup has not finished, watching configuration"));
+		conf_watch_sources ();
+	}
+}
+
+/**
+ * startup_load:
+ * @data: unused,
+ * @func: main loop function.
+ *
+ * Called each time through the main loop, after the event queue has
+ * been processed, until all of the configuration deferred by a staged
+ * startup has been loaded; loads up to STARTUP_LOAD_BATCH files each
+ * time so that the jobs already started aren't kept waiting.
+ **/
+static void
+startup_load (void            *data,
+	      NihMainLoopFunc *func)
+{
+	nih_assert (func != NULL);
+
+	/* Go round again either way, once more to handle any events
+	 * held for the files just loaded.
+	 */
+	nih_main_loop_interrupt ();
+
+	if (conf_staged_load (STARTUP_LOAD_BATCH))
+		return;
+
+	nih_info (_("Loaded deferred configuration after %llu ms"),
+		  (unsigned long long)(job_timing_now () - startup_begin) / 1000);
+
+	startup_loader = NULL;
+	nih_free (func);
+}
+
+/**
+ * startup_bus_open:
+ * @data: unused,
+ * @func: main loop function.
+ *
+ * Called the first time through the main loop of a staged startup, once
+ * the startup event has been handled, to connect to the D-Bus bus.
+ **/
+static void
+startup_bus_open (void            *data,
+		  NihMainLoopFunc *func)
+{
+	nih_assert (func != NULL);
+
+	open_control_bus ();
+
+	nih_free (func);
+}
+
+/**
+ * open_control_bus:
+ *
+ * Open the connection to the appropriate D-Bus bus; we normally expect
+ * this to fail (since dbus-daemon probably isn't running yet) and will
+ * try again later - don't let ENOMEM stop us though.
+ **/
+static void
+open_control_bus (void)
+{
+	while (control_bus_open () < 0) {
+		NihError *err;
+		int       number;
+
+		err = nih_error_get ();
+		number = err->number;
+		nih_free (err);
+
+		if (number != ENOMEM)
+			break;
+	}
+}
+
+/**
+ * handle_alloc_pools:
+ *
+ * Take allocations of the objects created and freed most often, those
+ * of each event and the instances it starts and stops, from pools
+ * unless disabled; finished instances are then only reused by their
+ * class when pools are used.
+ **/
+static void
+handle_alloc_pools (void)
+{
+	if (disable_alloc_pools)
+		return;
+
+	job_recycling = TRUE;
+
+	alloc_pool_init ();
+
+	if (alloc_pool_add ("Event", sizeof (Event)) < 0
+	    || alloc_pool_add ("Blocked", sizeof (Blocked)) < 0
+	    || alloc_pool_add ("EventOperator", sizeof (EventOperator)) < 0
+	    || alloc_pool_add ("Job", sizeof (Job)) < 0)
+		nih_warn (_("Unable to pool allocations"));
+}
+
+/**
+ * handle_container_lean:
+ *
+ * Drop what we can do without as the init daemon of one of many system
+ * containers sharing a host: clients are only accepted on the private
+ * control socket, without connecting to a D-Bus bus, so that objects
+ * are only registered as each connects; allocations are made as they
+ * are needed rather than taken from pools; configuration is read, from
+ * the compiled cache where it can be, without watching for changes,
+ * which are only read on request; and job output is written to the
+ * console rather than logged through a pty for each process.
+ **/
+static void
+handle_container_lean (void)
+{
+	if (! container_lean)
+		return;
+
+	nih_debug ("Using lean container profile");
+
+	disable_dbus = TRUE;
+	disable_alloc_pools = TRUE;
+	conf_watch_defer = TRUE;
+
+	disable_job_logging = TRUE;
+	job_output_console = TRUE;
+	log_offload = FALSE;
+	log_store = FALSE;
+}
+
 /**  
  * NihOption setter function to handle selection of default console
  * type.
@@ -1131,7 +2052,7 @@ console_type_setter (NihOption *option, const char *arg)
 
 	 default_console = (int)job_class_console_type (arg);
 
-	 if (default_console == -1) {
+	 if ((default_console == -1) || (default_console == CONSOLE_SOCKET)) {
 		 nih_fatal ("%s: %s", _("invalid console type specified"), arg);
 		 return -1;
 	 }
@@ -1139,6 +2060,92 @@ console_type_setter (NihOption *option, const char *arg)
 	 return 0;
 }
 
+/**
+ * NihOption setter function to handle selection of the format used to
+ * pass state on stateful re-exec.
+ *
+ * Returns: 0 on success, -1 on invalid format.
+ **/
+static int
+state_format_setter (NihOption *option, const char *arg)
+{
+	nih_assert (option);
+
+	if (! strcmp (arg, "binary")) {
+		state_format = STATE_FORMAT_BINARY;
+	} else if (! strcmp (arg, "json")) {
+		state_format = STATE_FORMAT_JSON;
+	} else {
+		nih_fatal ("%s: %s", _("invalid state format specified"), arg);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * NihOption setter function to handle selection of when job output logs
+ * are synchronised to disk: "none", "on-exit", or a number of
+ * milliseconds after being written.
+ *
+ * Returns: 0 on success, -1 on invalid policy.
+ **/
+static int
+log_sync_setter (NihOption *option, const char *arg)
+{
+	char *endptr;
+	long  interval;
+
+	nih_assert (option);
+
+	if (! strcmp (arg, "none")) {
+		log_sync = LOG_SYNC_NONE;
+	} else if (! strcmp (arg, "on-exit")) {
+		log_sync = LOG_SYNC_ON_EXIT;
+	} else {
+		errno = 0;
+		interval = strtol (arg, &endptr, 10);
+		if (errno || *endptr || endptr == arg
+		    || interval <= 0 || interval > INT_MAX) {
+			nih_fatal ("%s: %s", _("invalid log sync policy specified"),
+				   arg);
+			return -1;
+		}
+
+		log_sync = LOG_SYNC_INTERVAL;
+		log_sync_interval = (int)interval;
+	}
+
+	return 0;
+}
+
+/**
+ * NihOption setter function to handle the list of processors that init
+ * runs on, which its helpers and any job without a cpu-affinity stanza
+ * inherit; failing to apply it is not fatal, since the processors may
+ * simply not be online.
+ *
+ * Returns: 0 on success, -1 on invalid list.
+ **/
+static int
+cpu_affinity_setter (NihOption *option, const char *arg)
+{
+	unsigned long cpus[JOB_PLACEMENT_LONGS] = { 0 };
+
+	nih_assert (option);
+
+	if (job_class_placement_list (arg, cpus) < 0) {
+		nih_fatal ("%s: %s", _("invalid processor list specified"), arg);
+		return -1;
+	}
+
+	if (syscall (SYS_sched_setaffinity, 0, sizeof (cpus), cpus) < 0)
+		nih_warn ("%s: %s: %s", _("Unable to set processor affinity"),
+			  arg, strerror (errno));
+
+	return 0;
+}
+
 /**  
  * NihOption setter function to handle selection of configuration file
  * directories.
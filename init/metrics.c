@@ -0,0 +1,771 @@
+/* upstart
+ *
+ * metrics.c - counters and latency histograms of init's health
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/io.h>
+#include <nih/logging.h>
+
+#include "job_class.h"
+#include "job.h"
+#include "log.h"
+#include "alloc_pool.h"
+#include "spawn_limit.h"
+#include "metrics.h"
+
+#include <json.h>
+
+
+/* Prototypes for static functions */
+static size_t metrics_log_unflushed      (void)
+	__attribute__ ((warn_unused_result));
+static void   metrics_stall_warn          (const MetricsStall *stall);
+static int    metrics_stalls_to_string    (char **str, const void *parent)
+	__attribute__ ((warn_unused_result));
+static int    metrics_histogram_to_string (char **str, const void *parent,
+					   const char *name,
+					   const MetricsHistogram *histogram)
+	__attribute__ ((warn_unused_result));
+
+
+/**
+ * metrics_counters:
+ *
+ * Value of each MetricsCounter, incremented with metrics_count().
+ **/
+uint64_t metrics_counters[METRICS_COUNTER_LAST];
+
+/**
+ * metrics_histograms:
+ *
+ * Histogram of each MetricsLatency, recorded with metrics_record().
+ **/
+MetricsHistogram metrics_histograms[METRICS_LATENCY_LAST];
+
+/**
+ * metrics_queue_depth:
+ *
+ * Number of events queued that have not yet finished.
+ **/
+size_t metrics_queue_depth = 0;
+
+/**
+ * metrics_queue_peak:
+ *
+ * Most events there have been queued at once.
+ **/
+size_t metrics_queue_peak = 0;
+
+/**
+ * metrics_ready_time:
+ *
+ * Microseconds from init starting to its startup event, and the jobs it
+ * started, being finished with, or zero if not yet finished or after a
+ * re-exec.
+ **/
+uint64_t metrics_ready_time = 0;
+
+/**
+ * metrics_startup_begin:
+ *
+ * Time init started, in microseconds on CLOCK_MONOTONIC, or zero after a
+ * re-exec since there's no startup to measure then.
+ **/
+uint64_t metrics_startup_begin = 0;
+
+/**
+ * metrics_startup_event_time:
+ *
+ * Microseconds from init starting to its startup event being emitted,
+ * or zero if not yet emitted or after a re-exec.
+ **/
+uint64_t metrics_startup_event_time = 0;
+
+/**
+ * metrics_first_spawn_time:
+ *
+ * Microseconds from init starting to the first job process being
+ * spawned, or zero if none has been yet or after a re-exec.
+ **/
+uint64_t metrics_first_spawn_time = 0;
+
+/**
+ * metrics_stall_threshold:
+ *
+ * Milliseconds a main loop callback may take before it is logged as a
+ * stall, or zero not to time callbacks at all.
+ **/
+int metrics_stall_threshold = 0;
+
+/**
+ * metrics_stalls:
+ *
+ * Worst stalls there have been, longest first.
+ **/
+MetricsStall metrics_stalls[METRICS_STALLS];
+
+/**
+ * metrics_stalls_len:
+ *
+ * Number of stalls in metrics_stalls.
+ **/
+size_t metrics_stalls_len = 0;
+
+/**
+ * metrics_stall_count:
+ *
+ * Number of stalls there have been.
+ **/
+uint64_t metrics_stall_count = 0;
+
+
+/**
+ * metrics_names:
+ *
+ * Section and name of each MetricsCounter in the snapshot; counters of
+ * the same section must be adjacent.
+ **/
+static const char * const metrics_names[METRICS_COUNTER_LAST][2] = {
+	[METRICS_EVENTS_EMITTED]    = { "events", "emitted" },
+	[METRICS_EVENTS_HANDLED]    = { "events", "handled" },
+	[METRICS_EVENTS_FAILED]     = { "events", "failed" },
+	[METRICS_EVENT_BLOCKERS]    = { "events", "blockers" },
+	[METRICS_JOBS_STARTED]      = { "jobs", "started" },
+	[METRICS_JOBS_FAILED]       = { "jobs", "failed" },
+	[METRICS_JOBS_RESPAWNED]    = { "jobs", "respawned" },
+	[METRICS_JOBS_RECYCLED]     = { "jobs", "recycled" },
+	[METRICS_JOBS_REUSED]       = { "jobs", "reused" },
+	[METRICS_PROCESSES_SPAWNED] = { "processes", "spawned" },
+	[METRICS_FORKS_FAILED]      = { "processes", "fork_failed" },
+	[METRICS_PROCESSES_REAPED]  = { "processes", "reaped" },
+	[METRICS_LOG_BYTES]         = { "log", "bytes" },
+};
+
+/**
+ * metrics_latency_names:
+ *
+ * Name of each MetricsLatency in the snapshot.
+ **/
+static const char * const metrics_latency_names[METRICS_LATENCY_LAST] = {
+	[METRICS_SPAWN_LATENCY]     = "spawn",
+	[METRICS_EVENT_LATENCY]     = "event",
+	[METRICS_START_LATENCY]     = "start",
+	[METRICS_ADMISSION_LATENCY] = "admission",
+};
+
+
+/**
+ * metrics_queue_add:
+ *
+ * Called as each event is queued to count it in metrics_queue_depth.
+ **/
+void
+metrics_queue_add (void)
+{
+	metrics_queue_depth++;
+	if (metrics_queue_depth > metrics_queue_peak)
+		metrics_queue_peak = metrics_queue_depth;
+
+	memset (metrics_stalls, 0, sizeof (metrics_stalls));
+	metrics_stalls_len = 0;
+	metrics_stall_count = 0;
+}
+
+/**
+ * metrics_queue_remove:
+ *
+ * Called as each event is freed to remove it from metrics_queue_depth.
+ **/
+void
+metrics_queue_remove (void)
+{
+	if (metrics_queue_depth)
+		metrics_queue_depth--;
+}
+
+
+/**
+ * metrics_record:
+ * @latency: MetricsLatency to record,
+ * @value: latency in microseconds.
+ *
+ * Record @value in the histogram of @latency.
+ **/
+void
+metrics_record (MetricsLatency latency,
+		uint64_t       value)
+{
+	MetricsHistogram *histogram;
+
+	nih_assert (latency >= 0 && latency < METRICS_LATENCY_LAST);
+
+	histogram = &metrics_histograms[latency];
+
+	histogram->count++;
+	histogram->sum += value;
+	if (value > histogram->max)
+		histogram->max = value;
+
+	histogram->buckets[metrics_bucket (value)]++;
+}
+
+/**
+ * metrics_bucket:
+ * @value: value to be recorded.
+ *
+ * Values below METRICS_SUB_BUCKETS have a bucket each; above that, the
+ * highest bit set selects a run of METRICS_SUB_BUCKETS buckets and the
+ * METRICS_SUB_BUCKET_BITS bits below it the bucket within that run.
+ *
+ * Returns: index of the histogram bucket that @value is counted in.
+ **/
+size_t
+metrics_bucket (uint64_t value)
+{
+	unsigned int exponent;
+
+	if (value < METRICS_SUB_BUCKETS)
+		return value;
+
+	exponent = 63 - __builtin_clzll (value);
+	if (exponent > METRICS_MAX_EXPONENT)
+		return METRICS_BUCKETS - 1;
+
+	return (((exponent - METRICS_SUB_BUCKET_BITS + 1)
+		 << METRICS_SUB_BUCKET_BITS)
+		+ ((value >> (exponent - METRICS_SUB_BUCKET_BITS))
+		   & (METRICS_SUB_BUCKETS - 1)));
+}
+
+/**
+ * metrics_bucket_lower:
+ * @bucket: index of histogram bucket.
+ *
+ * Returns: lowest value counted in @bucket.
+ **/
+uint64_t
+metrics_bucket_lower (size_t bucket)
+{
+	unsigned int exponent;
+
+	nih_assert (bucket < METRICS_BUCKETS);
+
+	if (bucket < METRICS_SUB_BUCKETS)
+		return bucket;
+
+	exponent = (bucket >> METRICS_SUB_BUCKET_BITS) + METRICS_SUB_BUCKET_BITS - 1;
+
+	return ((uint64_t)(METRICS_SUB_BUCKETS
+			   + (bucket & (METRICS_SUB_BUCKETS - 1)))
+		<< (exponent - METRICS_SUB_BUCKET_BITS));
+}
+
+/**
+ * metrics_percentile:
+ * @histogram: histogram to examine,
+ * @percent: percentile to find.
+ *
+ * Finds the bucket of @histogram holding the value that @percent of
+ * those recorded are no greater than.
+ *
+ * Returns: highest value counted in that bucket, no greater than the
+ * largest value recorded, or zero if nothing has been.
+ **/
+uint64_t
+metrics_percentile (const MetricsHistogram *histogram,
+		    unsigned int            percent)
+{
+	uint64_t rank;
+	uint64_t seen = 0;
+
+	nih_assert (histogram != NULL);
+	nih_assert (percent <= 100);
+
+	if (! histogram->count)
+		return 0;
+
+	rank = (histogram->count * percent + 99) / 100;
+	if (! rank)
+		rank = 1;
+
+	for (size_t i = 0; i < METRICS_BUCKETS - 1; i++) {
+		uint64_t upper;
+
+		seen += histogram->buckets[i];
+		if (seen < rank)
+			continue;
+
+		upper = metrics_bucket_lower (i + 1) - 1;
+
+		return upper < histogram->max ? upper : histogram->max;
+	}
+
+	return histogram->max;
+}
+
+
+/**
+ * metrics_stall_begin:
+ * @stall: stall to start,
+ * @callback: name of main loop callback,
+ * @name: name of object it was called for, or NULL.
+ *
+ * Called on entry to a main loop callback to record the time it began
+ * in @stall.  When metrics_stall_threshold is zero, @stall is marked
+ * as not started and nothing is timed.
+ **/
+void
+metrics_stall_begin (MetricsStall *stall,
+		     const char   *callback,
+		     const char   *name)
+{
+	nih_assert (stall != NULL);
+	nih_assert (callback != NULL);
+
+	stall->started = 0;
+	stall->duration = 0;
+	stall->callback = callback;
+	stall->name[0] = '\0';
+
+	if (metrics_stall_threshold <= 0)
+		return;
+
+	stall->started = job_timing_now ();
+	metrics_stall_name (stall, name);
+}
+
+/**
+ * metrics_stall_name:
+ * @stall: stall to change,
+ * @name: name of object the callback was called for, or NULL.
+ *
+ * Attribute @stall to @name, for when that is not known until after the
+ * callback has begun.  @name is copied since the object may be freed
+ * before the callback returns.
+ **/
+void
+metrics_stall_name (MetricsStall *stall,
+		    const char   *name)
+{
+	nih_assert (stall != NULL);
+
+	if ((! stall->started) || (! name))
+		return;
+
+	strncpy (stall->name, name, sizeof (stall->name) - 1);
+	stall->name[sizeof (stall->name) - 1] = '\0';
+}
+
+/**
+ * metrics_stall_attribute:
+ * @stall: stall of callback,
+ * @part: stall of part of callback.
+ *
+ * Called for each object handled by a callback that handles many, such
+ * as event_poll(), once it has been handled with @part started before;
+ * @stall is attributed to the object that took longest.
+ **/
+void
+metrics_stall_attribute (MetricsStall       *stall,
+			 const MetricsStall *part)
+{
+	uint64_t duration;
+
+	nih_assert (stall != NULL);
+	nih_assert (part != NULL);
+
+	if ((! stall->started) || (! part->started))
+		return;
+
+	duration = job_timing_now () - part->started;
+	if (duration < stall->duration)
+		return;
+
+	stall->duration = duration;
+	memcpy (stall->name, part->name, sizeof (stall->name));
+}
+
+/**
+ * metrics_stall_end:
+ * @stall: stall to end.
+ *
+ * Called on return from a main loop callback begun with
+ * metrics_stall_begin().  Should the callback have taken longer than
+ * metrics_stall_threshold, a warning is logged and @stall is kept in
+ * metrics_stalls if it is one of the worst there have been.
+ **/
+void
+metrics_stall_end (MetricsStall *stall)
+{
+	size_t pos;
+
+	nih_assert (stall != NULL);
+
+	if (! stall->started)
+		return;
+
+	stall->duration = job_timing_now () - stall->started;
+	if (stall->duration < (uint64_t)metrics_stall_threshold * 1000)
+		return;
+
+	metrics_stall_count++;
+	metrics_stall_warn (stall);
+
+	for (pos = 0; pos < metrics_stalls_len; pos++)
+		if (stall->duration > metrics_stalls[pos].duration)
+			break;
+
+	if (pos >= METRICS_STALLS)
+		return;
+
+	if (metrics_stalls_len < METRICS_STALLS)
+		metrics_stalls_len++;
+
+	memmove (&metrics_stalls[pos + 1], &metrics_stalls[pos],
+		 (metrics_stalls_len - pos - 1) * sizeof (MetricsStall));
+	metrics_stalls[pos] = *stall;
+}
+
+/**
+ * metrics_stall_warn:
+ * @stall: stall to log.
+ *
+ * Log a warning naming the callback and object that @stall was
+ * attributed to, and how long it took.
+ **/
+static void
+metrics_stall_warn (const MetricsStall *stall)
+{
+	nih_assert (stall != NULL);
+
+	if (stall->name[0]) {
+		nih_warn (_("Main loop stalled for %llu ms in %s for %s"),
+			  (unsigned long long)stall->duration / 1000,
+			  stall->callback, stall->name);
+	} else {
+		nih_warn (_("Main loop stalled for %llu ms in %s"),
+			  (unsigned long long)stall->duration / 1000,
+			  stall->callback);
+	}
+}
+
+/**
+ * metrics_show_stalls:
+ *
+ * Log each of the worst stalls there have been, longest first.
+ **/
+void
+metrics_show_stalls (void)
+{
+	for (size_t i = 0; i < metrics_stalls_len; i++)
+		metrics_stall_warn (&metrics_stalls[i]);
+}
+
+
+/**
+ * metrics_log_unflushed:
+ *
+ * Returns: bytes of job output waiting to be written to log files.
+ **/
+static size_t
+metrics_log_unflushed (void)
+{
+	size_t unflushed = 0;
+
+	job_class_init ();
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		NIH_HASH_FOREACH (class->instances, job_iter) {
+			Job *job = (Job *)job_iter;
+
+			for (int i = 0; i < PROCESS_LAST; i++) {
+				if (job->log && job->log[i]
+				    && job->log[i]->unflushed)
+					unflushed += job->log[i]->unflushed->len;
+			}
+		}
+	}
+
+	if (log_unflushed_files) {
+		NIH_LIST_FOREACH (log_unflushed_files, iter) {
+			NihListEntry *elem = (NihListEntry *)iter;
+			Log          *log = elem->data;
+
+			if (log->unflushed)
+				unflushed += log->unflushed->len;
+		}
+	}
+
+	return unflushed;
+}
+
+/**
+ * metrics_histogram_to_string:
+ * @str: pointer to string to append to,
+ * @parent: parent of @str,
+ * @name: name of histogram,
+ * @histogram: histogram to append.
+ *
+ * Appends @histogram to @str as a JSON member named @name giving the
+ * number, total and largest of the values recorded, the 50th, 90th and
+ * 99th percentiles and the lowest value and count of each non-empty
+ * bucket.
+ *
+ * Returns: zero on success, negative value if insufficient memory.
+ **/
+static int
+metrics_histogram_to_string (char                  **str,
+			     const void             *parent,
+			     const char             *name,
+			     const MetricsHistogram *histogram)
+{
+	int first = TRUE;
+
+	nih_assert (str != NULL);
+	nih_assert (name != NULL);
+	nih_assert (histogram != NULL);
+
+	if (! nih_strcat_sprintf (str, parent,
+				  " \"%s\": { \"count\": %llu, \"sum\": %llu, "
+				  "\"max\": %llu, \"p50\": %llu, \"p90\": %llu, "
+				  "\"p99\": %llu, \"buckets\": [",
+				  name,
+				  (unsigned long long)histogram->count,
+				  (unsigned long long)histogram->sum,
+				  (unsigned long long)histogram->max,
+				  (unsigned long long)metrics_percentile (histogram, 50),
+				  (unsigned long long)metrics_percentile (histogram, 90),
+				  (unsigned long long)metrics_percentile (histogram, 99)))
+		return -1;
+
+	for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+		if (! histogram->buckets[i])
+			continue;
+
+		if (! nih_strcat_sprintf (str, parent, "%s [ %llu, %llu ]",
+					  first ? "" : ",",
+					  (unsigned long long)metrics_bucket_lower (i),
+					  (unsigned long long)histogram->buckets[i]))
+			return -1;
+
+		first = FALSE;
+	}
+
+	if (! nih_strcat (str, parent, " ] }"))
+		return -1;
+
+	return 0;
+}
+
+/**
+ * metrics_stalls_to_string:
+ * @str: pointer to string to append to,
+ * @parent: parent of @str.
+ *
+ * Appends the stall threshold, the number of stalls there have been and
+ * the callback, object, microseconds taken and time on CLOCK_MONOTONIC
+ * of each of the worst to @str as a JSON member named stalls.
+ *
+ * Returns: zero on success, negative value if insufficient memory.
+ **/
+static int
+metrics_stalls_to_string (char       **str,
+			  const void  *parent)
+{
+	json_object *json;
+	int          ret = 0;
+
+	nih_assert (str != NULL);
+
+	json = json_object_new_array ();
+	if (! json)
+		return -1;
+
+	for (size_t i = 0; i < metrics_stalls_len; i++) {
+		MetricsStall *stall = &metrics_stalls[i];
+		json_object  *json_stall;
+
+		json_stall = json_object_new_object ();
+		if (! json_stall)
+			goto error;
+
+		json_object_array_add (json, json_stall);
+
+		json_object_object_add (json_stall, "callback",
+					json_object_new_string (stall->callback));
+		json_object_object_add (json_stall, "name",
+					json_object_new_string (stall->name));
+		json_object_object_add (json_stall, "duration",
+					json_object_new_int64 (stall->duration));
+		json_object_object_add (json_stall, "started",
+					json_object_new_int64 (stall->started));
+	}
+
+	if (! nih_strcat_sprintf (str, parent,
+				  " \"stalls\": { \"threshold\": %d, "
+				  "\"count\": %llu, \"worst\": %s }",
+				  metrics_stall_threshold,
+				  (unsigned long long)metrics_stall_count,
+				  json_object_to_json_string (json)))
+		goto error;
+
+out:
+	json_object_put (json);
+	return ret;
+
+error:
+	ret = -1;
+	goto out;
+}
+
+/**
+ * metrics_to_string:
+ * @parent: parent object for new string.
+ *
+ * Counters are grouped by what they count; events also gives the number
+ * queued now and the most there have been, jobs the same of those
+ * waiting to be admitted by the spawn limit, log the bytes of job output
+ * not yet written and alloc the objects in use and the most there have
+ * been across every allocation pool.  The number of blockers divided by
+ * the events handled gives the average blockers per event.  Latencies
+ * are in microseconds, and stalls of the main loop follow them.
+ *
+ * Returns: newly allocated JSON string of a snapshot of the counters
+ * and latency histograms, or NULL if insufficient memory.
+ **/
+char *
+metrics_to_string (const void *parent)
+{
+	char       *str;
+	const char *section = NULL;
+	size_t      live = 0;
+	size_t      peak = 0;
+
+	str = nih_strdup (parent, "{");
+	if (! str)
+		return NULL;
+
+	for (int i = 0; i < METRICS_COUNTER_LAST; i++) {
+		int same = section && ! strcmp (section, metrics_names[i][0]);
+
+		if (section && ! same) {
+			if (! strcmp (section, "events")
+			    && ! nih_strcat_sprintf (&str, parent,
+						     ", \"queue_depth\": %zu, "
+						     "\"queue_peak\": %zu",
+						     metrics_queue_depth,
+						     metrics_queue_peak))
+				goto error;
+
+			if (! strcmp (section, "jobs")
+			    && ! nih_strcat_sprintf (&str, parent,
+						     ", \"admission_queued\": %zu, "
+						     "\"admission_peak\": %zu",
+						     spawn_limit_queued,
+						     spawn_limit_queue_peak))
+				goto error;
+
+			if (! nih_strcat (&str, parent, " },"))
+				goto error;
+		}
+
+		if (! nih_strcat_sprintf (&str, parent, "%s%s%s\"%s\": %llu",
+					  same ? ", " : " \"",
+					  same ? "" : metrics_names[i][0],
+					  same ? "" : "\": { ",
+					  metrics_names[i][1],
+					  (unsigned long long)metrics_counters[i]))
+			goto error;
+
+		section = metrics_names[i][0];
+	}
+
+	for (size_t i = 0; i < alloc_pools_len; i++) {
+		live += alloc_pools[i].live;
+		peak += alloc_pools[i].peak;
+	}
+
+	if (! nih_strcat_sprintf (&str, parent,
+				  ", \"unflushed\": %zu },"
+				  " \"alloc\": { \"live\": %zu, \"peak\": %zu },"
+				  " \"startup\": { \"ready\": %llu,"
+				  " \"event\": %llu, \"spawn\": %llu },"
+				  " \"latency\": {",
+				  metrics_log_unflushed (), live, peak,
+				  (unsigned long long)metrics_ready_time,
+				  (unsigned long long)metrics_startup_event_time,
+				  (unsigned long long)metrics_first_spawn_time))
+		goto error;
+
+	for (int i = 0; i < METRICS_LATENCY_LAST; i++) {
+		if (i && ! nih_strcat (&str, parent, ","))
+			goto error;
+
+		if (metrics_histogram_to_string (&str, parent,
+						 metrics_latency_names[i],
+						 &metrics_histograms[i]) < 0)
+			goto error;
+	}
+
+	if (! nih_strcat (&str, parent, " },"))
+		goto error;
+
+	if (metrics_stalls_to_string (&str, parent) < 0)
+		goto error;
+
+	if (! nih_strcat (&str, parent, " }"))
+		goto error;
+
+	return str;
+
+error:
+	nih_free (str);
+	return NULL;
+}
+
+
+/**
+ * metrics_reset:
+ *
+ * Zero every counter and histogram and forget the stalls there have
+ * been, other than the number of events queued and jobs waiting to be
+ * admitted now.
+ **/
+void
+metrics_reset (void)
+{
+	memset (metrics_counters, 0, sizeof (metrics_counters));
+	memset (metrics_histograms, 0, sizeof (metrics_histograms));
+
+	metrics_queue_peak = metrics_queue_depth;
+	spawn_limit_queue_peak = spawn_limit_queued;
+}
@@ -0,0 +1,226 @@
+/* upstart
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INIT_METRICS_H
+#define INIT_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nih/macros.h>
+
+
+/**
+ * MetricsCounter:
+ *
+ * Counters kept by the init daemon since it was started, or last
+ * re-exec'd.
+ **/
+typedef enum metrics_counter {
+	METRICS_EVENTS_EMITTED,
+	METRICS_EVENTS_HANDLED,
+	METRICS_EVENTS_FAILED,
+	METRICS_EVENT_BLOCKERS,
+	METRICS_JOBS_STARTED,
+	METRICS_JOBS_FAILED,
+	METRICS_JOBS_RESPAWNED,
+	METRICS_JOBS_RECYCLED,
+	METRICS_JOBS_REUSED,
+	METRICS_PROCESSES_SPAWNED,
+	METRICS_FORKS_FAILED,
+	METRICS_PROCESSES_REAPED,
+	METRICS_LOG_BYTES,
+	METRICS_COUNTER_LAST,
+} MetricsCounter;
+
+/**
+ * MetricsLatency:
+ *
+ * Latencies a histogram is kept of: the time taken to spawn a job
+ * process, from an event being emitted to it finishing, from a job
+ * starting to it running and that a starting job waited to be admitted
+ * by the spawn limit.
+ **/
+typedef enum metrics_latency {
+	METRICS_SPAWN_LATENCY,
+	METRICS_EVENT_LATENCY,
+	METRICS_START_LATENCY,
+	METRICS_ADMISSION_LATENCY,
+	METRICS_LATENCY_LAST,
+} MetricsLatency;
+
+
+/**
+ * METRICS_SUB_BUCKET_BITS:
+ *
+ * Histogram buckets for each power of two are split into this many bits
+ * worth of linear sub-buckets, bounding the error of any value recorded
+ * to one part in eight.
+ **/
+#define METRICS_SUB_BUCKET_BITS 3
+
+/**
+ * METRICS_SUB_BUCKETS:
+ *
+ * Number of sub-buckets for each power of two.
+ **/
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+
+/**
+ * METRICS_MAX_EXPONENT:
+ *
+ * Highest power of two of microseconds given buckets of its own, a
+ * little over nine hours; longer latencies are counted in the last.
+ **/
+#define METRICS_MAX_EXPONENT 35
+
+/**
+ * METRICS_BUCKETS:
+ *
+ * Number of buckets in each histogram.
+ **/
+#define METRICS_BUCKETS \
+	((METRICS_MAX_EXPONENT - METRICS_SUB_BUCKET_BITS + 2) \
+	 << METRICS_SUB_BUCKET_BITS)
+
+
+/**
+ * MetricsHistogram:
+ * @count: number of values recorded,
+ * @sum: total of values recorded,
+ * @max: largest value recorded,
+ * @buckets: number of values recorded in each bucket.
+ *
+ * Histogram of latencies in microseconds, with buckets whose width
+ * doubles with each power of two (see metrics_bucket()) so that the
+ * whole range is covered to the same relative precision in constant
+ * space.
+ **/
+typedef struct metrics_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[METRICS_BUCKETS];
+} MetricsHistogram;
+
+
+/**
+ * METRICS_STALLS:
+ *
+ * Number of the worst main loop stalls kept.
+ **/
+#define METRICS_STALLS 16
+
+/**
+ * METRICS_STALL_THRESHOLD:
+ *
+ * Default number of milliseconds a main loop callback may take before it
+ * is logged as a stall.
+ **/
+#define METRICS_STALL_THRESHOLD 100
+
+/**
+ * METRICS_STALL_NAME_MAX:
+ *
+ * Size of the buffer the name of the object a stall is attributed to is
+ * kept in, longer names are truncated.
+ **/
+#define METRICS_STALL_NAME_MAX 64
+
+
+/**
+ * MetricsStall:
+ * @started: time the callback began, in microseconds on CLOCK_MONOTONIC,
+ *  or zero if stalls are not being detected,
+ * @duration: microseconds the callback took,
+ * @callback: name of main loop callback,
+ * @name: name of the event, job, method or path it was called for.
+ *
+ * Timing of a main loop callback, started by metrics_stall_begin() and
+ * kept by metrics_stall_end() if it took longer than
+ * metrics_stall_threshold.
+ **/
+typedef struct metrics_stall {
+	uint64_t    started;
+	uint64_t    duration;
+	const char *callback;
+	char        name[METRICS_STALL_NAME_MAX];
+} MetricsStall;
+
+
+/**
+ * metrics_count:
+ * @counter: MetricsCounter to increment.
+ *
+ * Increment @counter by one.
+ **/
+#define metrics_count(counter) (metrics_counters[(counter)]++)
+
+/**
+ * metrics_add:
+ * @counter: MetricsCounter to increment,
+ * @n: amount to add.
+ *
+ * Increment @counter by @n.
+ **/
+#define metrics_add(counter, n) (metrics_counters[(counter)] += (n))
+
+
+NIH_BEGIN_EXTERN
+
+extern uint64_t         metrics_counters[METRICS_COUNTER_LAST];
+extern MetricsHistogram metrics_histograms[METRICS_LATENCY_LAST];
+extern size_t           metrics_queue_depth;
+extern size_t           metrics_queue_peak;
+extern uint64_t         metrics_ready_time;
+extern uint64_t         metrics_startup_begin;
+extern uint64_t         metrics_startup_event_time;
+extern uint64_t         metrics_first_spawn_time;
+extern int              metrics_stall_threshold;
+extern MetricsStall     metrics_stalls[METRICS_STALLS];
+extern size_t           metrics_stalls_len;
+extern uint64_t         metrics_stall_count;
+
+
+void     metrics_queue_add    (void);
+void     metrics_queue_remove (void);
+
+void     metrics_record       (MetricsLatency latency, uint64_t value);
+
+size_t   metrics_bucket       (uint64_t value)
+	__attribute__ ((warn_unused_result));
+uint64_t metrics_bucket_lower (size_t bucket)
+	__attribute__ ((warn_unused_result));
+uint64_t metrics_percentile   (const MetricsHistogram *histogram,
+			       unsigned int percent)
+	__attribute__ ((warn_unused_result));
+
+void     metrics_stall_begin     (MetricsStall *stall,
+				  const char *callback, const char *name);
+void     metrics_stall_name      (MetricsStall *stall, const char *name);
+void     metrics_stall_attribute (MetricsStall *stall,
+				  const MetricsStall *part);
+void     metrics_stall_end       (MetricsStall *stall);
+void     metrics_show_stalls     (void);
+
+char *   metrics_to_string    (const void *parent)
+	__attribute__ ((warn_unused_result, malloc));
+
+void     metrics_reset        (void);
+
+NIH_END_EXTERN
+
+#endif /* INIT_METRICS_H */
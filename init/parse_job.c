@@ -29,6 +29,7 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -51,7 +52,38 @@
 #include "cgroup.h"
 #endif /* ENABLE_CGROUPS */
 
+/**
+ * PARSE_JOB_STANZA_SLOTS:
+ *
+ * Number of slots in stanza_index, a power of two.
+ **/
+#define PARSE_JOB_STANZA_SLOTS 128
+
+/**
+ * PARSE_JOB_STANZA_SEED:
+ *
+ * Initial value of parse_job_stanza_hash(), chosen so that no two of the
+ * names in the stanzas table share a slot of stanza_index.
+ **/
+#define PARSE_JOB_STANZA_SEED 5
+
+/**
+ * PARSE_JOB_QUOTES:
+ *
+ * Characters that make nih_config_next_token() treat a stanza name as
+ * more than the bytes of the file it spans.
+ **/
+#define PARSE_JOB_QUOTES "\"'\\"
+
+
 /* Prototypes for static functions */
+static int              parse_job_stanzas     (JobClass *class,
+					       const char *file, size_t len,
+					       size_t *pos, size_t *lineno)
+	__attribute__ ((warn_unused_result));
+static NihConfigStanza *parse_job_stanza      (const char *name, size_t len);
+static size_t           parse_job_stanza_hash (const char *name, size_t len);
+
 static int            parse_exec        (Process *process,
 					 NihConfigStanza *stanza,
 					 const char *file, size_t len,
@@ -197,6 +229,10 @@ static int stanza_console     (JobClass *class, NihConfigStanza *stanza,
 			       const char *file, size_t len,
 			       size_t *pos, size_t *lineno)
 	__attribute__ ((warn_unused_result));
+static int stanza_log_limit   (JobClass *class, NihConfigStanza *stanza,
+			       const char *file, size_t len,
+			       size_t *pos, size_t *lineno)
+	__attribute__ ((warn_unused_result));
 
 static int stanza_umask       (JobClass *class, NihConfigStanza *stanza,
 			       const char *file, size_t len,
@@ -206,6 +242,34 @@ static int stanza_nice        (JobClass *class, NihConfigStanza *stanza,
 			       const char *file, size_t len,
 			       size_t *pos, size_t *lineno)
 	__attribute__ ((warn_unused_result));
+static int stanza_priority    (JobClass *class, NihConfigStanza *stanza,
+			       const char *file, size_t len,
+			       size_t *pos, size_t *lineno)
+	__attribute__ ((warn_unused_result));
+static int stanza_cpu_affinity (JobClass *class, NihConfigStanza *stanza,
+			       const char *file, size_t len,
+			       size_t *pos, size_t *lineno)
+	__attribute__ ((warn_unused_result));
+static int stanza_numa_membind (JobClass *class, NihConfigStanza *stanza,
+			       const char *file, size_t len,
+			       size_t *pos, size_t *lineno)
+	__attribute__ ((warn_unused_result));
+static int stanza_numa_interleave (JobClass *class, NihConfigStanza *stanza,
+			       const char *file, size_t len,
+			       size_t *pos, size_t *lineno)
+	__attribute__ ((warn_unused_result));
+static int stanza_sched       (JobClass *class, NihConfigStanza *stanza,
+			       const char *file, size_t len,
+			       size_t *pos, size_t *lineno)
+	__attribute__ ((warn_unused_result));
+static int stanza_ioprio      (JobClass *class, NihConfigStanza *stanza,
+			       const char *file, size_t len,
+			       size_t *pos, size_t *lineno)
+	__attribute__ ((warn_unused_result));
+static int stanza_timer_slack (JobClass *class, NihConfigStanza *stanza,
+			       const char *file, size_t len,
+			       size_t *pos, size_t *lineno)
+	__attribute__ ((warn_unused_result));
 static int stanza_oom         (JobClass *class, NihConfigStanza *stanza,
 			       const char *file, size_t len,
 			       size_t *pos, size_t *lineno)
@@ -247,6 +311,10 @@ static int stanza_cgroup      (JobClass *class, NihConfigStanza *stanza,
 			       const char *file, size_t len,
 			       size_t *pos, size_t *lineno)
 	__attribute__ ((warn_unused_result));
+static JobPlacement *parse_job_placement (JobClass *class)
+	__attribute__ ((warn_unused_result));
+static int parse_job_size     (const char *arg, size_t *value)
+	__attribute__ ((warn_unused_result));
 static int parse_cgroup       (JobClass        *class,
 			       NihConfigStanza *stanza,
 			       const char      *file,
@@ -291,10 +359,18 @@ static NihConfigStanza stanzas[] = {
 	{ "respawn",     (NihConfigHandler)stanza_respawn     },
 	{ "normal",      (NihConfigHandler)stanza_normal      },
 	{ "console",     (NihConfigHandler)stanza_console     },
+	{ "log-limit",   (NihConfigHandler)stanza_log_limit   },
 	{ "umask",       (NihConfigHandler)stanza_umask       },
 	{ "nice",        (NihConfigHandler)stanza_nice        },
+	{ "priority",    (NihConfigHandler)stanza_priority    },
 	{ "oom",         (NihConfigHandler)stanza_oom         },
 	{ "limit",       (NihConfigHandler)stanza_limit       },
+	{ "cpu-affinity", (NihConfigHandler)stanza_cpu_affinity },
+	{ "numa-membind", (NihConfigHandler)stanza_numa_membind },
+	{ "numa-interleave", (NihConfigHandler)stanza_numa_interleave },
+	{ "sched",       (NihConfigHandler)stanza_sched       },
+	{ "ioprio",      (NihConfigHandler)stanza_ioprio      },
+	{ "timer-slack", (NihConfigHandler)stanza_timer_slack },
 	{ "chroot",      (NihConfigHandler)stanza_chroot      },
 	{ "chdir",       (NihConfigHandler)stanza_chdir       },
 	{ "setuid",      (NihConfigHandler)stanza_setuid      },
@@ -308,6 +384,21 @@ static NihConfigStanza stanzas[] = {
 	NIH_CONFIG_LAST
 };
 
+/**
+ * stanza_index:
+ *
+ * Perfect hash of the stanzas table by name, filled in by
+ * parse_job_stanza() when first called.
+ **/
+static NihConfigStanza *stanza_index[PARSE_JOB_STANZA_SLOTS];
+
+/**
+ * stanza_indexed:
+ *
+ * TRUE once stanza_index has been filled in.
+ **/
+static int stanza_indexed = FALSE;
+
 
 /**
  * parse_job:
@@ -360,8 +451,7 @@ parse_job (const void *parent,
 			nih_return_system_error (NULL);
 	}
 
-	if (nih_config_parse_file (file, len, pos, lineno,
-				stanzas, class) < 0) {
+	if (parse_job_stanzas (class, file, len, pos, lineno) < 0) {
 		if (!update)
 			nih_free (class);
 		return NULL;
@@ -370,6 +460,151 @@ parse_job (const void *parent,
 	return class;
 }
 
+/**
+ * parse_job_stanzas:
+ * @class: job class being parsed,
+ * @file: file or string to parse,
+ * @len: length of @file,
+ * @pos: offset within @file,
+ * @lineno: line number.
+ *
+ * Parses the sequence of stanzas in @file into @class, as
+ * nih_config_parse_file() would with the stanzas table.
+ *
+ * Rather than copying each stanza name out of @file to search the table
+ * for it, the name is lexed as the span of @file up to the first
+ * delimiter and looked up directly in stanza_index.  Names containing
+ * quotes or escapes, and names that aren't found, are handed to
+ * nih_config_parse_stanza() from their start so that they are parsed
+ * and reported exactly as before; the stanza handlers themselves are
+ * unchanged.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+parse_job_stanzas (JobClass   *class,
+		   const char *file,
+		   size_t      len,
+		   size_t     *pos,
+		   size_t     *lineno)
+{
+	size_t p;
+	int    ret = -1;
+
+	nih_assert (class != NULL);
+	nih_assert (file != NULL);
+	nih_assert (pos != NULL);
+
+	p = *pos;
+
+	while (p < len) {
+		NihConfigStanza *stanza = NULL;
+		size_t           start;
+
+		/* Skip initial whitespace */
+		while ((p < len) && strchr (NIH_CONFIG_WS, file[p]))
+			p++;
+
+		/* Skip over comments and blank lines */
+		if (! nih_config_has_token (file, len, &p, lineno)) {
+			nih_config_next_line (file, len, &p, lineno);
+			continue;
+		}
+
+		start = p;
+		while ((p < len) && ! strchr (NIH_CONFIG_CNLWS, file[p])
+		       && ! strchr (PARSE_JOB_QUOTES, file[p]))
+			p++;
+
+		if ((p == len) || ! strchr (PARSE_JOB_QUOTES, file[p]))
+			stanza = parse_job_stanza (file + start, p - start);
+
+		if (! stanza) {
+			p = start;
+			if (nih_config_parse_stanza (file, len, &p, lineno,
+						     stanzas, class) < 0)
+				goto finish;
+
+			continue;
+		}
+
+		nih_config_skip_whitespace (file, len, &p, lineno);
+
+		if (stanza->handler (class, stanza, file, len, &p, lineno) < 0)
+			goto finish;
+	}
+
+	ret = 0;
+
+finish:
+	*pos = p;
+
+	return ret;
+}
+
+/**
+ * parse_job_stanza:
+ * @name: stanza name,
+ * @len: length of @name.
+ *
+ * Looks up the stanza named by the first @len characters of @name, which
+ * need not be nul-terminated.  Should a stanza ever share a slot with
+ * another, it is left out of stanza_index and is still found through
+ * nih_config_parse_stanza().
+ *
+ * Returns: stanza, or NULL if not found.
+ **/
+static NihConfigStanza *
+parse_job_stanza (const char *name,
+		  size_t      len)
+{
+	NihConfigStanza *stanza;
+
+	nih_assert (name != NULL);
+
+	if (! stanza_indexed) {
+		for (stanza = stanzas; stanza->name; stanza++) {
+			size_t slot;
+
+			slot = parse_job_stanza_hash (stanza->name,
+						      strlen (stanza->name));
+			if (! stanza_index[slot])
+				stanza_index[slot] = stanza;
+		}
+
+		stanza_indexed = TRUE;
+	}
+
+	stanza = stanza_index[parse_job_stanza_hash (name, len)];
+	if ((! stanza)
+	    || (strlen (stanza->name) != len)
+	    || memcmp (stanza->name, name, len))
+		return NULL;
+
+	return stanza;
+}
+
+/**
+ * parse_job_stanza_hash:
+ * @name: stanza name,
+ * @len: length of @name.
+ *
+ * Returns: slot of stanza_index for the first @len characters of @name.
+ **/
+static size_t
+parse_job_stanza_hash (const char *name,
+		       size_t      len)
+{
+	size_t hash = PARSE_JOB_STANZA_SEED;
+
+	nih_assert (name != NULL);
+
+	for (size_t i = 0; i < len; i++)
+		hash = hash * 31 + (unsigned char)name[i];
+
+	return hash & (PARSE_JOB_STANZA_SLOTS - 1);
+}
+
 
 /**
  * parse_exec:
@@ -1004,6 +1239,9 @@ parse_on_operand (JobClass         *class,
 				return -1;
 			}
 		}
+
+		if (event_operator_compile (oper) < 0)
+			nih_return_system_error (-1);
 	}
 
 	return 0;
@@ -1877,7 +2115,8 @@ stanza_post_stop (JobClass        *class,
  *
  * Parse an expect stanza from @file.  This stanza expects a single argument
  * single argument giving one of the possible ExpectType enumerations which
- * sets the class's expect member.
+ * sets the class's expect member; "daemon" and "fork" may be followed by
+ * "passive" to select the variants that don't trace the process.
  *
  * Returns: zero on success, negative value on error.
  **/
@@ -1911,6 +2150,8 @@ stanza_expect (JobClass        *class,
 		class->expect = EXPECT_DAEMON;
 	} else if (! strcmp (arg, "fork")) {
 		class->expect = EXPECT_FORK;
+	} else if (! strcmp (arg, "notify")) {
+		class->expect = EXPECT_NOTIFY;
 	} else if (! strcmp (arg, "none")) {
 		class->expect = EXPECT_NONE;
 	} else {
@@ -1918,6 +2159,28 @@ stanza_expect (JobClass        *class,
 				  _(NIH_CONFIG_UNKNOWN_STANZA_STR));
 	}
 
+	/* Any other argument is left to be rejected as unexpected */
+	if (((class->expect == EXPECT_DAEMON) || (class->expect == EXPECT_FORK))
+	    && nih_config_has_token (file, len, &a_pos, &a_lineno)) {
+		nih_local char *mode = NULL;
+		size_t          m_pos = a_pos, m_lineno = a_lineno;
+
+		mode = nih_config_next_arg (NULL, file, len, &m_pos, &m_lineno);
+		if (! mode) {
+			a_pos = m_pos;
+			a_lineno = m_lineno;
+			goto finish;
+		}
+
+		if (! strcmp (mode, "passive")) {
+			class->expect = ((class->expect == EXPECT_DAEMON)
+					 ? EXPECT_DAEMON_PASSIVE
+					 : EXPECT_FORK_PASSIVE);
+			a_pos = m_pos;
+			a_lineno = m_lineno;
+		}
+	}
+
 	ret = nih_config_skip_comment (file, len, &a_pos, &a_lineno);
 
 finish:
@@ -2048,6 +2311,27 @@ stanza_kill (JobClass        *class,
 
 		/* Set the signal */
 		class->kill_signal = signal;
+	} else if (! strcmp (arg, "mode")) {
+		nih_local char *modearg = NULL;
+
+		/* Update error position to the mode */
+		*pos = a_pos;
+		if (lineno)
+			*lineno = a_lineno;
+
+		modearg = nih_config_next_arg (NULL, file, len, &a_pos,
+					       &a_lineno);
+		if (! modearg)
+			goto finish;
+
+		if (! strcmp (modearg, "process")) {
+			class->kill_cgroup = FALSE;
+		} else if (! strcmp (modearg, "cgroup")) {
+			class->kill_cgroup = TRUE;
+		} else {
+			nih_return_error (-1, NIH_CONFIG_UNKNOWN_STANZA,
+					  _(NIH_CONFIG_UNKNOWN_STANZA_STR));
+		}
 	} else {
 		nih_return_error (-1, NIH_CONFIG_UNKNOWN_STANZA,
 				  _(NIH_CONFIG_UNKNOWN_STANZA_STR));
@@ -2263,7 +2547,9 @@ finish:
  *
  * Parse a daemon stanza from @file.  This either has no arguments, in
  * which case it sets the respawn flag for the job, or it has the "limit"
- * argument and sets the respawn rate limit.
+ * argument and sets the respawn rate limit, or it has the "backoff"
+ * argument and sets the initial and maximum respawn delay and optionally
+ * the jitter applied to it.
  *
  * Returns: zero on success, negative value on error.
  **/
@@ -2348,6 +2634,76 @@ stanza_respawn (JobClass        *class,
 
 		ret = nih_config_skip_comment (file, len, &a_pos, &a_lineno);
 
+	} else if (! strcmp (arg, "backoff")) {
+		nih_local char *initialarg = NULL;
+		nih_local char *maxarg = NULL;
+		char           *endptr;
+
+		/* Update error position to the initial delay */
+		*pos = a_pos;
+		if (lineno)
+			*lineno = a_lineno;
+
+		/* Parse the initial delay */
+		initialarg = nih_config_next_arg (NULL, file, len,
+						  &a_pos, &a_lineno);
+		if (! initialarg)
+			goto finish;
+
+		errno = 0;
+		class->respawn_backoff_initial = strtol (initialarg, &endptr, 10);
+		if (errno || *endptr || (class->respawn_backoff_initial <= 0))
+			nih_return_error (-1, PARSE_ILLEGAL_INTERVAL,
+					  _(PARSE_ILLEGAL_INTERVAL_STR));
+
+		/* Update error position to the maximum delay */
+		*pos = a_pos;
+		if (lineno)
+			*lineno = a_lineno;
+
+		/* Parse the maximum delay, which may not be less than the
+		 * initial delay.
+		 */
+		maxarg = nih_config_next_arg (NULL, file, len,
+					      &a_pos, &a_lineno);
+		if (! maxarg)
+			goto finish;
+
+		errno = 0;
+		class->respawn_backoff_max = strtol (maxarg, &endptr, 10);
+		if (errno || *endptr
+		    || (class->respawn_backoff_max < class->respawn_backoff_initial))
+			nih_return_error (-1, PARSE_ILLEGAL_INTERVAL,
+					  _(PARSE_ILLEGAL_INTERVAL_STR));
+
+		/* Parse the optional jitter percentage */
+		class->respawn_backoff_jitter = 0;
+
+		if (nih_config_has_token (file, len, &a_pos, &a_lineno)) {
+			nih_local char *jitterarg = NULL;
+
+			/* Update error position to the jitter */
+			*pos = a_pos;
+			if (lineno)
+				*lineno = a_lineno;
+
+			jitterarg = nih_config_next_arg (NULL, file, len,
+							 &a_pos, &a_lineno);
+			if (! jitterarg)
+				goto finish;
+
+			errno = 0;
+			class->respawn_backoff_jitter = strtol (jitterarg,
+								&endptr, 10);
+			if (errno || *endptr
+			    || (class->respawn_backoff_jitter < 0)
+			    || (class->respawn_backoff_jitter > 100))
+				nih_return_error (-1, PARSE_ILLEGAL_JITTER,
+						  _(PARSE_ILLEGAL_JITTER_STR));
+		}
+
+		ret = nih_config_skip_comment (file, len, &a_pos, &a_lineno);
+
 	} else {
 		nih_return_error (-1, NIH_CONFIG_UNKNOWN_STANZA,
 				  _(NIH_CONFIG_UNKNOWN_STANZA_STR));
@@ -2467,7 +2823,8 @@ finish:
  * @lineno: line number.
  *
  * Parse a console stanza from @file, extracting a single argument that
- * specifies where console output should be sent.
+ * specifies where console output should be sent, followed by the path
+ * of the log collector's socket for "socket".
  *
  * Returns: zero on success, negative value on error.
  **/
@@ -2502,6 +2859,121 @@ stanza_console (JobClass        *class,
 				_(NIH_CONFIG_UNKNOWN_STANZA_STR));
 	}
 
+	if (class->console_socket) {
+		nih_unref (class->console_socket, class);
+		class->console_socket = NULL;
+	}
+
+	if (class->console == CONSOLE_SOCKET) {
+		class->console_socket = nih_config_next_arg (class, file, len,
+							     &a_pos, &a_lineno);
+		if (! class->console_socket)
+			goto finish;
+	}
+
+	ret = nih_config_skip_comment (file, len, &a_pos, &a_lineno);
+
+finish:
+	*pos = a_pos;
+	if (lineno)
+		*lineno = a_lineno;
+
+	return ret;
+}
+
+
+/**
+ * stanza_log_limit:
+ * @class: job class being parsed,
+ * @stanza: stanza found,
+ * @file: file or string to parse,
+ * @len: length of @file,
+ * @pos: offset within @file,
+ * @lineno: line number.
+ *
+ * Parse a log-limit stanza from @file.  This has either the "rate"
+ * argument, followed by the number of bytes per second and the burst
+ * size in bytes of output to log, or the "size" argument followed by
+ * the maximum number of bytes of output to buffer while the log file
+ * cannot be written.  Either value may be given as "unlimited".
+ *
+ * Returns: zero on success, negative value on error.
+ **/
+static int
+stanza_log_limit (JobClass        *class,
+		  NihConfigStanza *stanza,
+		  const char      *file,
+		  size_t           len,
+		  size_t          *pos,
+		  size_t          *lineno)
+{
+	nih_local char *arg = NULL, *limitarg = NULL;
+	size_t          a_pos, a_lineno;
+	int             ret = -1;
+
+	nih_assert (class != NULL);
+	nih_assert (stanza != NULL);
+	nih_assert (file != NULL);
+	nih_assert (pos != NULL);
+
+	a_pos = *pos;
+	a_lineno = (lineno ? *lineno : 1);
+
+	arg = nih_config_next_arg (NULL, file, len, &a_pos, &a_lineno);
+	if (! arg)
+		goto finish;
+
+	if (strcmp (arg, "rate") && strcmp (arg, "size"))
+		nih_return_error (-1, NIH_CONFIG_UNKNOWN_STANZA,
+				  _(NIH_CONFIG_UNKNOWN_STANZA_STR));
+
+	/* Update error position to the limit value */
+	*pos = a_pos;
+	if (lineno)
+		*lineno = a_lineno;
+
+	/* Parse the limit value */
+	limitarg = nih_config_next_arg (NULL, file, len, &a_pos, &a_lineno);
+	if (! limitarg)
+		goto finish;
+
+	if (! strcmp (arg, "size")) {
+		if (strcmp (limitarg, "unlimited")) {
+			if ((parse_job_size (limitarg,
+					     &class->log_limit_size) < 0)
+			    || (! class->log_limit_size))
+				nih_return_error (-1, PARSE_ILLEGAL_LIMIT,
+						  _(PARSE_ILLEGAL_LIMIT_STR));
+		} else {
+			class->log_limit_size = 0;
+		}
+	} else if (strcmp (limitarg, "unlimited")) {
+		nih_local char *burstarg = NULL;
+
+		if ((parse_job_size (limitarg, &class->log_limit_rate) < 0)
+		    || (! class->log_limit_rate))
+			nih_return_error (-1, PARSE_ILLEGAL_LIMIT,
+					  _(PARSE_ILLEGAL_LIMIT_STR));
+
+		/* Update error position to the burst value */
+		*pos = a_pos;
+		if (lineno)
+			*lineno = a_lineno;
+
+		/* Parse the burst value */
+		burstarg = nih_config_next_arg (NULL, file, len,
+						&a_pos, &a_lineno);
+		if (! burstarg)
+			goto finish;
+
+		if (parse_job_size (burstarg, &class->log_limit_burst) < 0)
+			nih_return_error (-1, PARSE_ILLEGAL_LIMIT,
+					  _(PARSE_ILLEGAL_LIMIT_STR));
+	} else {
+		class->log_limit_rate = 0;
+		class->log_limit_burst = 0;
+	}
+
 	ret = nih_config_skip_comment (file, len, &a_pos, &a_lineno);
 
 finish:
@@ -2624,7 +3096,7 @@ finish:
 }
 
 /**
- * stanza_oom:
+ * stanza_priority:
  * @class: job class being parsed,
  * @stanza: stanza found,
  * @file: file or string to parse,
@@ -2632,16 +3104,72 @@ finish:
  * @pos: offset within @file,
  * @lineno: line number.
  *
- * Parse an oom stanza from @file, extracting a single argument containing
- * a OOM killer adjustment (which may be "never" for the magic -17 value).
+ * Parse a priority stanza from @file, extracting a single argument
+ * containing the order instances are admitted in by the spawn limit.
  *
  * Returns: zero on success, negative value on error.
  **/
 static int
-stanza_oom (JobClass        *class,
-	    NihConfigStanza *stanza,
-	    const char      *file,
-	    size_t           len,
+stanza_priority (JobClass        *class,
+		 NihConfigStanza *stanza,
+		 const char      *file,
+		 size_t           len,
+		 size_t          *pos,
+		 size_t          *lineno)
+{
+	nih_local char *arg = NULL;
+	char           *endptr;
+	size_t          a_pos, a_lineno;
+	int             ret = -1;
+
+	nih_assert (class != NULL);
+	nih_assert (stanza != NULL);
+	nih_assert (file != NULL);
+	nih_assert (pos != NULL);
+
+	a_pos = *pos;
+	a_lineno = (lineno ? *lineno : 1);
+
+	arg = nih_config_next_arg (NULL, file, len, &a_pos, &a_lineno);
+	if (! arg)
+		goto finish;
+
+	errno = 0;
+	class->priority = (int)strtol (arg, &endptr, 10);
+	if (errno || *endptr || (class->priority < -100)
+	    || (class->priority > 100))
+		nih_return_error (-1, PARSE_ILLEGAL_PRIORITY,
+				  _(PARSE_ILLEGAL_PRIORITY_STR));
+
+	ret = nih_config_skip_comment (file, len, &a_pos, &a_lineno);
+
+finish:
+	*pos = a_pos;
+	if (lineno)
+		*lineno = a_lineno;
+
+	return ret;
+}
+
+/**
+ * stanza_oom:
+ * @class: job class being parsed,
+ * @stanza: stanza found,
+ * @file: file or string to parse,
+ * @len: length of @file,
+ * @pos: offset within @file,
+ * @lineno: line number.
+ *
+ * Parse an oom stanza from @file, extracting a single argument containing
+ * a OOM killer adjustment (which may be "never" for the magic -17 value).
+ *
+ * Returns: zero on success, negative value on error.
+ **/
+static int
+stanza_oom (JobClass        *class,
+	    NihConfigStanza *stanza,
+	    const char      *file,
+	    size_t           len,
 	    size_t          *pos,
 	    size_t          *lineno)
 {
@@ -2840,6 +3368,465 @@ finish:
 	return ret;
 }
 
+/**
+ * parse_job_size:
+ * @arg: argument to parse,
+ * @value: pointer to store value in.
+ *
+ * Parse @arg as a decimal number of bytes, storing it in @value;
+ * unlike strtoul() alone, a sign or leading whitespace is refused
+ * rather than a negative number wrapping around to a huge one.
+ *
+ * Returns: zero on success, negative value if @arg is not a number.
+ **/
+static int
+parse_job_size (const char *arg,
+		size_t     *value)
+{
+	char          *endptr;
+	unsigned long  num;
+
+	nih_assert (arg != NULL);
+	nih_assert (value != NULL);
+
+	if ((*arg < '0') || (*arg > '9'))
+		return -1;
+
+	errno = 0;
+	num = strtoul (arg, &endptr, 10);
+	if (errno || *endptr)
+		return -1;
+
+	*value = num;
+
+	return 0;
+}
+
+/**
+ * parse_job_placement:
+ * @class: job class being parsed.
+ *
+ * Returns: placement of @class, allocated with every mask empty if it had
+ * none, or NULL if insufficient memory.
+ **/
+static JobPlacement *
+parse_job_placement (JobClass *class)
+{
+	nih_assert (class != NULL);
+
+	if (! class->placement) {
+		class->placement = nih_new (class, JobPlacement);
+		if (! class->placement)
+			return NULL;
+
+		memset (class->placement, '\0', sizeof (JobPlacement));
+		class->placement->numa_policy = JOB_NUMA_DEFAULT;
+	}
+
+	return class->placement;
+}
+
+/**
+ * stanza_cpu_affinity:
+ * @class: job class being parsed,
+ * @stanza: stanza found,
+ * @file: file or string to parse,
+ * @len: length of @file,
+ * @pos: offset within @file,
+ * @lineno: line number.
+ *
+ * Parse a cpu-affinity stanza from @file, extracting a single argument
+ * containing the list of processors the job's processes may run on.
+ *
+ * Returns: zero on success, negative value on error.
+ **/
+static int
+stanza_cpu_affinity (JobClass        *class,
+		     NihConfigStanza *stanza,
+		     const char      *file,
+		     size_t           len,
+		     size_t          *pos,
+		     size_t          *lineno)
+{
+	nih_local char *arg = NULL;
+	JobPlacement   *placement;
+	unsigned long   cpus[JOB_PLACEMENT_LONGS] = { 0 };
+	size_t          a_pos, a_lineno;
+	int             ret = -1;
+
+	nih_assert (class != NULL);
+	nih_assert (stanza != NULL);
+	nih_assert (file != NULL);
+	nih_assert (pos != NULL);
+
+	a_pos = *pos;
+	a_lineno = (lineno ? *lineno : 1);
+
+	arg = nih_config_next_arg (NULL, file, len, &a_pos, &a_lineno);
+	if (! arg)
+		goto finish;
+
+	if (job_class_placement_list (arg, cpus) < 0)
+		nih_return_error (-1, PARSE_ILLEGAL_PLACEMENT,
+				  _(PARSE_ILLEGAL_PLACEMENT_STR));
+
+	placement = parse_job_placement (class);
+	if (! placement)
+		nih_return_system_error (-1);
+
+	memcpy (placement->cpus, cpus, sizeof (cpus));
+
+	ret = nih_config_skip_comment (file, len, &a_pos, &a_lineno);
+
+finish:
+	*pos = a_pos;
+	if (lineno)
+		*lineno = a_lineno;
+
+	return ret;
+}
+
+/**
+ * stanza_numa_membind:
+ * @class: job class being parsed,
+ * @stanza: stanza found,
+ * @file: file or string to parse,
+ * @len: length of @file,
+ * @pos: offset within @file,
+ * @lineno: line number.
+ *
+ * Parse a numa-membind stanza from @file, extracting a single argument
+ * containing the list of memory nodes the job's processes may allocate
+ * from.
+ *
+ * Returns: zero on success, negative value on error.
+ **/
+static int
+stanza_numa_membind (JobClass        *class,
+		     NihConfigStanza *stanza,
+		     const char      *file,
+		     size_t           len,
+		     size_t          *pos,
+		     size_t          *lineno)
+{
+	nih_local char *arg = NULL;
+	JobPlacement   *placement;
+	unsigned long   nodes[JOB_PLACEMENT_LONGS] = { 0 };
+	size_t          a_pos, a_lineno;
+	int             ret = -1;
+
+	nih_assert (class != NULL);
+	nih_assert (stanza != NULL);
+	nih_assert (file != NULL);
+	nih_assert (pos != NULL);
+
+	a_pos = *pos;
+	a_lineno = (lineno ? *lineno : 1);
+
+	arg = nih_config_next_arg (NULL, file, len, &a_pos, &a_lineno);
+	if (! arg)
+		goto finish;
+
+	if (job_class_placement_list (arg, nodes) < 0)
+		nih_return_error (-1, PARSE_ILLEGAL_PLACEMENT,
+				  _(PARSE_ILLEGAL_PLACEMENT_STR));
+
+	placement = parse_job_placement (class);
+	if (! placement)
+		nih_return_system_error (-1);
+
+	placement->numa_policy = JOB_NUMA_BIND;
+	memcpy (placement->numa_nodes, nodes, sizeof (nodes));
+
+	ret = nih_config_skip_comment (file, len, &a_pos, &a_lineno);
+
+finish:
+	*pos = a_pos;
+	if (lineno)
+		*lineno = a_lineno;
+
+	return ret;
+}
+
+/**
+ * stanza_numa_interleave:
+ * @class: job class being parsed,
+ * @stanza: stanza found,
+ * @file: file or string to parse,
+ * @len: length of @file,
+ * @pos: offset within @file,
+ * @lineno: line number.
+ *
+ * Parse a numa-interleave stanza from @file, extracting an optional
+ * argument containing the list of memory nodes the job's processes
+ * interleave their allocations across; without one, they are
+ * interleaved across every node.
+ *
+ * Returns: zero on success, negative value on error.
+ **/
+static int
+stanza_numa_interleave (JobClass        *class,
+			NihConfigStanza *stanza,
+			const char      *file,
+			size_t           len,
+			size_t          *pos,
+			size_t          *lineno)
+{
+	nih_local char *arg = NULL;
+	JobPlacement   *placement;
+	unsigned long   nodes[JOB_PLACEMENT_LONGS] = { 0 };
+	size_t          a_pos, a_lineno;
+	int             ret = -1;
+
+	nih_assert (class != NULL);
+	nih_assert (stanza != NULL);
+	nih_assert (file != NULL);
+	nih_assert (pos != NULL);
+
+	a_pos = *pos;
+	a_lineno = (lineno ? *lineno : 1);
+
+	if (nih_config_has_token (file, len, &a_pos, &a_lineno)) {
+		arg = nih_config_next_arg (NULL, file, len, &a_pos, &a_lineno);
+		if (! arg)
+			goto finish;
+
+		if (job_class_placement_list (arg, nodes) < 0)
+			nih_return_error (-1, PARSE_ILLEGAL_PLACEMENT,
+					  _(PARSE_ILLEGAL_PLACEMENT_STR));
+	}
+
+	placement = parse_job_placement (class);
+	if (! placement)
+		nih_return_system_error (-1);
+
+	placement->numa_policy = JOB_NUMA_INTERLEAVE;
+	memcpy (placement->numa_nodes, nodes, sizeof (nodes));
+
+	ret = nih_config_skip_comment (file, len, &a_pos, &a_lineno);
+
+finish:
+	*pos = a_pos;
+	if (lineno)
+		*lineno = a_lineno;
+
+	return ret;
+}
+
+/**
+ * stanza_sched:
+ * @class: job class being parsed,
+ * @stanza: stanza found,
+ * @file: file or string to parse,
+ * @len: length of @file,
+ * @pos: offset within @file,
+ * @lineno: line number.
+ *
+ * Parse a sched stanza from @file, extracting an argument containing
+ * the scheduling policy of the job's processes, followed by their
+ * static priority for the fifo and rr policies.
+ *
+ * Returns: zero on success, negative value on error.
+ **/
+static int
+stanza_sched (JobClass        *class,
+	      NihConfigStanza *stanza,
+	      const char      *file,
+	      size_t           len,
+	      size_t          *pos,
+	      size_t          *lineno)
+{
+	nih_local char *arg = NULL;
+	nih_local char *prioarg = NULL;
+	char           *endptr;
+	int             policy;
+	long            priority = 0;
+	size_t          a_pos, a_lineno;
+	int             ret = -1;
+
+	nih_assert (class != NULL);
+	nih_assert (stanza != NULL);
+	nih_assert (file != NULL);
+	nih_assert (pos != NULL);
+
+	a_pos = *pos;
+	a_lineno = (lineno ? *lineno : 1);
+
+	arg = nih_config_next_arg (NULL, file, len, &a_pos, &a_lineno);
+	if (! arg)
+		goto finish;
+
+	policy = job_sched_policy_from_name (arg);
+	if (policy == JOB_SCHED_INVALID)
+		nih_return_error (-1, PARSE_ILLEGAL_SCHED,
+				  _(PARSE_ILLEGAL_SCHED_STR));
+
+	if ((policy == SCHED_FIFO) || (policy == SCHED_RR)) {
+		if (! nih_config_has_token (file, len, &a_pos, &a_lineno))
+			nih_return_error (-1, PARSE_ILLEGAL_SCHED,
+					  _(PARSE_ILLEGAL_SCHED_STR));
+
+		prioarg = nih_config_next_arg (NULL, file, len,
+					       &a_pos, &a_lineno);
+		if (! prioarg)
+			goto finish;
+
+		errno = 0;
+		priority = strtol (prioarg, &endptr, 10);
+		if (errno || *endptr || (priority < 1) || (priority > 99))
+			nih_return_error (-1, PARSE_ILLEGAL_SCHED,
+					  _(PARSE_ILLEGAL_SCHED_STR));
+	}
+
+	class->sched_policy = policy;
+	class->sched_priority = (int)priority;
+
+	ret = nih_config_skip_comment (file, len, &a_pos, &a_lineno);
+
+finish:
+	*pos = a_pos;
+	if (lineno)
+		*lineno = a_lineno;
+
+	return ret;
+}
+
+/**
+ * stanza_ioprio:
+ * @class: job class being parsed,
+ * @stanza: stanza found,
+ * @file: file or string to parse,
+ * @len: length of @file,
+ * @pos: offset within @file,
+ * @lineno: line number.
+ *
+ * Parse an ioprio stanza from @file, extracting an argument containing
+ * the I/O scheduling class of the job's processes, followed by an
+ * optional level within the realtime and best-effort classes.
+ *
+ * Returns: zero on success, negative value on error.
+ **/
+static int
+stanza_ioprio (JobClass        *class,
+	       NihConfigStanza *stanza,
+	       const char      *file,
+	       size_t           len,
+	       size_t          *pos,
+	       size_t          *lineno)
+{
+	nih_local char *arg = NULL;
+	nih_local char *levelarg = NULL;
+	char           *endptr;
+	JobIoprioClass  ioprio_class;
+	long            level = 0;
+	size_t          a_pos, a_lineno;
+	int             ret = -1;
+
+	nih_assert (class != NULL);
+	nih_assert (stanza != NULL);
+	nih_assert (file != NULL);
+	nih_assert (pos != NULL);
+
+	a_pos = *pos;
+	a_lineno = (lineno ? *lineno : 1);
+
+	arg = nih_config_next_arg (NULL, file, len, &a_pos, &a_lineno);
+	if (! arg)
+		goto finish;
+
+	ioprio_class = job_ioprio_class_from_name (arg);
+	if (ioprio_class == JOB_IOPRIO_NONE)
+		nih_return_error (-1, PARSE_ILLEGAL_IOPRIO,
+				  _(PARSE_ILLEGAL_IOPRIO_STR));
+
+	if (ioprio_class != JOB_IOPRIO_IDLE) {
+		level = JOB_IOPRIO_DEFAULT_LEVEL;
+
+		if (nih_config_has_token (file, len, &a_pos, &a_lineno)) {
+			levelarg = nih_config_next_arg (NULL, file, len,
+							&a_pos, &a_lineno);
+			if (! levelarg)
+				goto finish;
+
+			errno = 0;
+			level = strtol (levelarg, &endptr, 10);
+			if (errno || *endptr || (level < 0) || (level > 7))
+				nih_return_error (-1, PARSE_ILLEGAL_IOPRIO,
+						  _(PARSE_ILLEGAL_IOPRIO_STR));
+		}
+	}
+
+	class->ioprio_class = ioprio_class;
+	class->ioprio_level = (int)level;
+
+	ret = nih_config_skip_comment (file, len, &a_pos, &a_lineno);
+
+finish:
+	*pos = a_pos;
+	if (lineno)
+		*lineno = a_lineno;
+
+	return ret;
+}
+
+/**
+ * stanza_timer_slack:
+ * @class: job class being parsed,
+ * @stanza: stanza found,
+ * @file: file or string to parse,
+ * @len: length of @file,
+ * @pos: offset within @file,
+ * @lineno: line number.
+ *
+ * Parse a timer-slack stanza from @file, extracting a single argument
+ * containing the timer slack of the job's processes in nanoseconds.
+ *
+ * Returns: zero on success, negative value on error.
+ **/
+static int
+stanza_timer_slack (JobClass        *class,
+		    NihConfigStanza *stanza,
+		    const char      *file,
+		    size_t           len,
+		    size_t          *pos,
+		    size_t          *lineno)
+{
+	nih_local char *arg = NULL;
+	char           *endptr;
+	unsigned long   slack;
+	size_t          a_pos, a_lineno;
+	int             ret = -1;
+
+	nih_assert (class != NULL);
+	nih_assert (stanza != NULL);
+	nih_assert (file != NULL);
+	nih_assert (pos != NULL);
+
+	a_pos = *pos;
+	a_lineno = (lineno ? *lineno : 1);
+
+	arg = nih_config_next_arg (NULL, file, len, &a_pos, &a_lineno);
+	if (! arg)
+		goto finish;
+
+	errno = 0;
+	slack = strtoul (arg, &endptr, 10);
+	if (errno || *endptr || (*arg < '0') || (*arg > '9') || (! slack))
+		nih_return_error (-1, PARSE_ILLEGAL_TIMER_SLACK,
+				  _(PARSE_ILLEGAL_TIMER_SLACK_STR));
+
+	class->timer_slack = slack;
+
+	ret = nih_config_skip_comment (file, len, &a_pos, &a_lineno);
+
+finish:
+	*pos = a_pos;
+	if (lineno)
+		*lineno = a_lineno;
+
+	return ret;
+}
+
 /**
  * stanza_chroot:
  * @class: job class being parsed,
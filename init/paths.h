@@ -105,6 +105,26 @@
 #define STATE_FILE_ENV "UPSTART_WRITE_STATEFILE"
 #endif
 
+/**
+ * STATE_CHECKPOINT_FILE:
+ *
+ * File that state is periodically checkpointed to, from which it can be
+ * recovered should init crash.
+ **/
+#ifndef STATE_CHECKPOINT_FILE
+#define STATE_CHECKPOINT_FILE "/run/upstart/state.checkpoint"
+#endif
+
+/**
+ * STATE_CHECKPOINT_ENV:
+ *
+ * Environment variable that if set specifies an alternative file to
+ * STATE_CHECKPOINT_FILE to checkpoint state to.
+ **/
+#ifndef STATE_CHECKPOINT_ENV
+#define STATE_CHECKPOINT_ENV "UPSTART_STATE_CHECKPOINT"
+#endif
+
 /**
  * INIT_XDG_SUBDIR:
  *
@@ -174,6 +194,36 @@
 #define JOB_LOGDIR "/var/log/upstart"
 #endif
 
+/**
+ * CONF_CACHE_FILE:
+ *
+ * File that compiled system job configuration is cached in, so that
+ * unchanged configuration files need not be parsed again.
+ **/
+#ifndef CONF_CACHE_FILE
+#define CONF_CACHE_FILE "/var/cache/upstart/conf.cache"
+#endif
+
+/**
+ * CONF_CACHE_ENV:
+ *
+ * Environment variable that if set specifies an alternative file to
+ * CONF_CACHE_FILE to cache compiled job configuration in.
+ **/
+#ifndef CONF_CACHE_ENV
+#define CONF_CACHE_ENV "UPSTART_CONF_CACHE"
+#endif
+
+/**
+ * CONF_CACHE_USER_FILE:
+ *
+ * Name of the file within the user's upstart cache directory that
+ * compiled job configuration for a session init is cached in.
+ **/
+#ifndef CONF_CACHE_USER_FILE
+#define CONF_CACHE_USER_FILE "conf.cache"
+#endif
+
 /**
  * LOGDIR_ENV:
  *
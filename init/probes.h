@@ -0,0 +1,67 @@
+/* upstart
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INIT_PROBES_H
+#define INIT_PROBES_H
+
+#ifdef ENABLE_TRACEPOINTS
+#include <sys/sdt.h>
+#endif /* ENABLE_TRACEPOINTS */
+
+
+/**
+ * UPSTART_PROBE:
+ * @name: name of probe,
+ * @...: arguments of probe.
+ *
+ * Marks a static probe named @name of the upstart provider, which
+ * SystemTap, perf and bpftrace can attach to as
+ * usdt:/sbin/init:upstart:@name to read its arguments; numbers and
+ * pointers are passed as they are, strings as pointers to them.
+ *
+ * Probes are only built with --enable-tracepoints.  Even then they cost
+ * a single no-op instruction until something attaches to them, besides
+ * working out their arguments, which must be cheap and without side
+ * effects.
+ *
+ * Probes in the tree are:
+ *
+ *   event_new (event, name)
+ *   event_pending (event, name)
+ *   event_finished (event, name, failed)
+ *   job_change_goal (job, class, name, old goal, new goal)
+ *   job_change_state (job, class, name, old state, new state)
+ *   job_spawn (job, class, name, process)
+ *   job_spawned (job, class, name, process, pid)
+ *   job_process_handler (pid, event, status)
+ *   log_read (log, path, bytes)
+ *   conf_reload_path (source, path)
+ *   reexec_serialised (bytes)
+ *   reexec_prepared ()
+ *   reexec_exec ()
+ *
+ * States, goals, events and processes are the values of JobState,
+ * JobGoal, NihChildEvents and ProcessType.
+ **/
+#ifdef ENABLE_TRACEPOINTS
+#define UPSTART_PROBE(name, ...) \
+	STAP_PROBEV (upstart, name, ##__VA_ARGS__)
+#else /* ENABLE_TRACEPOINTS */
+#define UPSTART_PROBE(name, ...) \
+	do { } while (0)
+#endif /* ENABLE_TRACEPOINTS */
+
+#endif /* INIT_PROBES_H */
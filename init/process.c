@@ -25,9 +25,11 @@
 
 
 #include <string.h>
+#include <unistd.h>
 
 #include <nih/macros.h>
 #include <nih/alloc.h>
+#include <nih/list.h>
 #include <nih/logging.h>
 #include <nih/string.h>
 
@@ -58,10 +60,37 @@ process_new  (const void *parent)
 
 	process->script = FALSE;
 	process->command = NULL;
+	process->script_fd = -1;
+	nih_list_init (&process->entry);
+
+	nih_alloc_set_destructor (process, process_destroy);
 
 	return process;
 }
 
+/**
+ * process_destroy:
+ * @process: process to be destroyed.
+ *
+ * Closes the memory file holding the script of @process, if one was
+ * created to run it, and removes @process from the cache of those.
+ * Normally used or called from an nih_alloc() destructor.
+ *
+ * Returns: zero.
+ **/
+int
+process_destroy (Process *process)
+{
+	nih_assert (process != NULL);
+
+	nih_list_remove (&process->entry);
+
+	if (process->script_fd != -1)
+		close (process->script_fd);
+
+	return 0;
+}
+
 
 /**
  * process_name:
@@ -21,6 +21,7 @@
 #define INIT_PROCESS_H
 
 #include <nih/macros.h>
+#include <nih/list.h>
 
 #include <json.h>
 
@@ -53,7 +54,9 @@ typedef enum process_type {
 /**
  * Process:
  * @script: whether a shell will be required,
- * @command: command or script to be run.
+ * @command: command or script to be run,
+ * @script_fd: sealed memory file holding the script, or -1,
+ * @entry: list entry in the cache of memory files.
  *
  * This structure is used for process definitions in the job class, defining
  * processes that will be run by its instances.
@@ -62,10 +65,16 @@ typedef enum process_type {
  * are none, it is split on whitespace and executed directly using exec().
  * If there are shell characters, or @script is TRUE, @command is executed
  * using a shell.
+ *
+ * @script_fd is created by job_process_script_fd() when a long script is
+ * first run, and shared by every instance until the job class is freed
+ * or it is evicted from the cache to make room for another.
  **/
 typedef struct process {
-	int    script;
-	char  *command;
+	int      script;
+	char    *command;
+	int      script_fd;
+	NihList  entry;
 } Process;
 
 
@@ -73,6 +82,7 @@ NIH_BEGIN_EXTERN
 
 Process *   process_new       (const void *parent)
 	__attribute__ ((warn_unused_result));
+int         process_destroy   (Process *process);
 
 const char *process_name      (ProcessType process)
 	__attribute__ ((const));
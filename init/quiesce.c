@@ -29,8 +29,13 @@
 #include "conf.h"
 #include "job_process.h"
 #include "control.h"
+#include "metrics.h"
+
+#include <fnmatch.h>
+#include <string.h>
 
 #include <nih/main.h>
+#include <nih/string.h>
 
 /**
  * quiesce_requester:
@@ -55,19 +60,42 @@ static QuiescePhase quiesce_phase = QUIESCE_PHASE_NOT_QUIESCED;
 static char *quiesce_reason = NULL;
 
 /**
- * max_kill_timeout:
+ * quiesce_max_timeout:
+ *
+ * Maximum number of seconds that the whole quiesce may take, however long
+ * any job's kill timeout; zero for no limit.
+ **/
+int quiesce_max_timeout = 0;
+
+/**
+ * quiesce_timer:
  *
- * Maxiumum kill_timeout value calculated from all running jobs used to
- * determine how long to wait before exiting.
+ * Timer for the next time quiesce_wait_callback() needs to run.
  **/
-static time_t max_kill_timeout = 0;
+static WheelTimer *quiesce_timer = NULL;
 
 /**
  * quiesce_phase_time:
  *
- * Time that a particular phase started.
+ * Time on CLOCK_MONOTONIC in milliseconds that a particular phase
+ * started.
+ **/
+static uint64_t quiesce_phase_time = 0;
+
+/**
+ * quiesce_reported:
+ *
+ * Milliseconds into the kill phase up to which jobs still running past
+ * their deadline have been reported.
  **/
-static time_t quiesce_phase_time = 0;
+static uint64_t quiesce_reported = 0;
+
+/**
+ * quiesce_start_ms:
+ *
+ * Time on CLOCK_MONOTONIC in milliseconds that quiesce commenced.
+ **/
+static uint64_t quiesce_start_ms = 0;
 
 /**
  * quiesce_start_time:
@@ -84,7 +112,64 @@ static time_t quiesce_start_time = 0;
  **/
 static int session_end_jobs = FALSE;
 
-static int quiesce_event_match (Event *event)
+/**
+ * quiesce_fast_shutdown:
+ *
+ * TRUE if, on seeing the runlevel event for a halt or reboot, the init
+ * daemon should stop the jobs itself in waves rather than leave each to
+ * its own stop on condition.
+ **/
+int quiesce_fast_shutdown = FALSE;
+
+/**
+ * quiesce_excluded:
+ *
+ * Names of the job classes that a fast shutdown leaves running, those
+ * started by the runlevel event that began it.
+ **/
+static char **quiesce_excluded = NULL;
+
+/**
+ * quiesce_wave:
+ *
+ * Number of the current wave of a fast shutdown, from one.
+ **/
+static int quiesce_wave = 0;
+
+/**
+ * quiesce_wave_jobs:
+ *
+ * Number of instances stopping in the current wave.
+ **/
+static int quiesce_wave_jobs = 0;
+
+/**
+ * quiesce_wave_deadline:
+ *
+ * Milliseconds into the current wave after which it's abandoned for the
+ * next.
+ **/
+static uint64_t quiesce_wave_deadline = 0;
+
+static int      quiesce_event_match    (Event *event)
+	__attribute__ ((warn_unused_result));
+static int      quiesce_class_match    (JobClass *class, Event *event)
+	__attribute__ ((warn_unused_result));
+static int      quiesce_job_running    (const Job *job)
+	__attribute__ ((warn_unused_result));
+static uint64_t quiesce_job_deadline   (const Job *job)
+	__attribute__ ((warn_unused_result));
+static uint64_t quiesce_kill_deadline  (void)
+	__attribute__ ((warn_unused_result));
+static void     quiesce_report_slow_jobs (uint64_t elapsed);
+static void     quiesce_arm            (void);
+static void     quiesce_waves_start    (Event *event);
+static void     quiesce_waves_check    (void);
+static void     quiesce_waves_next     (uint64_t now);
+static void     quiesce_waves_arm      (void);
+static int      quiesce_wave_candidate (Job *job)
+	__attribute__ ((warn_unused_result));
+static int      quiesce_depends        (JobClass *class, const char *name)
 	__attribute__ ((warn_unused_result));
 
 /* External definitions */
@@ -111,6 +196,19 @@ quiesce (QuiesceRequester requester)
 
 	quiesce_requester = requester;
 
+	if (requester == QUIESCE_REQUESTER_SHUTDOWN) {
+		quiesce_phase = QUIESCE_PHASE_WAVES;
+		quiesce_reason = _("shutdown");
+
+		nih_info (_("Stopping jobs in waves for fast shutdown"));
+
+		quiesce_start_time = time (NULL);
+		quiesce_start_ms = quiesce_phase_time = timer_wheel_now ();
+		disable_respawn = TRUE;
+
+		return;
+	}
+
 	/* System shutdown skips the wait phase to ensure all running
 	 * jobs get signalled.
 	 *
@@ -128,7 +226,9 @@ quiesce (QuiesceRequester requester)
 
 	nih_info (_("Quiescing due to %s request"), quiesce_reason);
 
-	quiesce_start_time = quiesce_phase_time = time (NULL);
+	quiesce_start_time = time (NULL);
+	quiesce_start_ms = quiesce_phase_time = timer_wheel_now ();
+	quiesce_reported = 0;
 
 	/* Stop existing jobs from respawning */
 	disable_respawn = TRUE;
@@ -177,21 +277,15 @@ quiesce (QuiesceRequester requester)
 		}
 	}
 
-	if (quiesce_phase == QUIESCE_PHASE_KILL) {
-		/* We'll attempt to wait for this long, but system
-		 * policy may prevent it such that we just get killed
-		 * and job processes reparented to PID 1.
-		 */
-		max_kill_timeout = job_class_max_kill_timeout ();
-
+	if (quiesce_phase == QUIESCE_PHASE_KILL)
 		job_process_stop_all ();
-	}
 
-	/* Check every second to see if all jobs have finished. If so,
-	 * we can exit early.
+	/* Rather than checking periodically, wait for the next deadline
+	 * or for the last job process to be reaped, whichever comes first;
+	 * there may be none to wait for.
 	 */
-	NIH_MUST (nih_timer_add_periodic (NULL, 1,
-				(NihTimerCb)quiesce_wait_callback, NULL));
+	quiesce_arm ();
+	quiesce_job_reaped ();
 }
 
 /**
@@ -200,43 +294,69 @@ quiesce (QuiesceRequester requester)
  * @data: not used,
  * @timer: timer that caused us to be called.
  *
- * Callback used to check if all jobs have finished and if so
- * finalise Session Init shutdown.
+ * Callback used when a deadline of the current phase is reached or a job
+ * process has been reaped, to move on to the next phase or finalise
+ * Session Init shutdown once all jobs have finished or the last deadline
+ * has passed.
  **/
 void
-quiesce_wait_callback (void *data, NihTimer *timer)
+quiesce_wait_callback (void *data, WheelTimer *timer)
 {
-	time_t now;
+	uint64_t now;
+	uint64_t elapsed;
+	int      capped;
 
 	nih_assert (timer);
 	nih_assert (quiesce_phase_time);
 	nih_assert (quiesce_requester != QUIESCE_REQUESTER_INVALID);
 
-	now = time (NULL);
+	/* This timer is freed on return */
+	if (quiesce_timer == timer)
+		quiesce_timer = NULL;
+
+	if (quiesce_phase == QUIESCE_PHASE_CLEANUP)
+		return;
+
+	if (quiesce_phase == QUIESCE_PHASE_WAVES) {
+		quiesce_waves_check ();
+		return;
+	}
+
+	now = timer_wheel_now ();
+	elapsed = now - quiesce_phase_time;
+
+	capped = (quiesce_max_timeout
+		  && ((now - quiesce_start_ms)
+		      >= (uint64_t)quiesce_max_timeout * 1000));
 
 	if (quiesce_phase == QUIESCE_PHASE_KILL) {
-		nih_assert (max_kill_timeout);
+		if (! job_process_jobs_running ())
+			goto out;
+
+		quiesce_report_slow_jobs (elapsed);
 
-		if ((now - quiesce_phase_time) > max_kill_timeout)
+		if (capped || (elapsed >= quiesce_kill_deadline ()))
 			goto timed_out;
 
 	} else if (quiesce_phase == QUIESCE_PHASE_WAIT) {
 		int  timed_out = 0;
 
-		timed_out = ((now - quiesce_phase_time) >= QUIESCE_DEFAULT_JOB_RUNTIME);
+		timed_out = (elapsed >= (QUIESCE_DEFAULT_JOB_RUNTIME * 1000));
 
-		if (timed_out
+		if (timed_out || capped
 			|| (session_end_jobs && ! job_process_jobs_running ())
 			|| ! job_process_jobs_running ()) {
 
 			quiesce_phase = QUIESCE_PHASE_KILL;
 
 			/* reset for new phase */
-			quiesce_phase_time = time (NULL);
-
-			max_kill_timeout = job_class_max_kill_timeout ();
+			quiesce_phase_time = timer_wheel_now ();
+			quiesce_reported = 0;
 
 			job_process_stop_all ();
+
+			if (capped && job_process_jobs_running ())
+				goto timed_out;
 		}
 	} else {
 		nih_assert_not_reached ();
@@ -245,6 +365,8 @@ quiesce_wait_callback (void *data, NihTimer *timer)
 	if (! job_process_jobs_running ())
 		goto out;
 
+	quiesce_arm ();
+
 	return;
 
 timed_out:
@@ -256,9 +378,218 @@ out:
 	 */
 	quiesce_phase = QUIESCE_PHASE_CLEANUP;
 	quiesce_finalise ();
+}
+
+/**
+ * quiesce_job_reaped:
+ *
+ * Called whenever a job process has been reaped, so that shutdown
+ * finishes as soon as the last one has been rather than at the next
+ * deadline.  The check is made from the main loop, since the job may
+ * be in the middle of changing state.
+ **/
+void
+quiesce_job_reaped (void)
+{
+	/* Check the wave once the reaping has finished */
+	if (quiesce_phase == QUIESCE_PHASE_WAVES) {
+		if (quiesce_timer)
+			nih_free (quiesce_timer);
+
+		quiesce_timer = NIH_MUST (timer_wheel_add (NULL, 0,
+							   quiesce_wait_callback,
+							   NULL));
+		return;
+	}
+
+	if ((quiesce_phase != QUIESCE_PHASE_WAIT)
+	    && (quiesce_phase != QUIESCE_PHASE_KILL))
+		return;
+
+	if (job_process_jobs_running ())
+		return;
+
+	/* Jobs that start on the session end event may not have been
+	 * started yet.
+	 */
+	if (quiesce_phase == QUIESCE_PHASE_WAIT) {
+		NIH_LIST_FOREACH (events, iter) {
+			Event *event = (Event *)iter;
+
+			if (! strcmp (event->name, SESSION_END_EVENT))
+				return;
+		}
+	}
+
+	if (quiesce_timer)
+		nih_free (quiesce_timer);
+
+	quiesce_timer = NIH_MUST (timer_wheel_add (NULL, 0,
+						   quiesce_wait_callback,
+						   NULL));
+}
+
+/**
+ * quiesce_arm:
+ *
+ * Arrange for quiesce_wait_callback() to be called at the next deadline
+ * of the current phase: the end of the wait phase, the deadline of the
+ * next job in the kill phase yet to be reported as slow, the last of
+ * those deadlines or the global limit, whichever is soonest.
+ **/
+static void
+quiesce_arm (void)
+{
+	uint64_t now;
+	uint64_t due;
+
+	now = timer_wheel_now ();
+
+	if (quiesce_phase == QUIESCE_PHASE_WAIT) {
+		due = quiesce_phase_time + (QUIESCE_DEFAULT_JOB_RUNTIME * 1000);
+	} else {
+		due = quiesce_phase_time + quiesce_kill_deadline ();
+
+		job_class_init ();
+
+		NIH_HASH_FOREACH (job_classes, iter) {
+			JobClass *class = (JobClass *)iter;
+
+			NIH_HASH_FOREACH (class->instances, job_iter) {
+				Job      *job = (Job *)job_iter;
+				uint64_t  deadline;
+
+				if (! quiesce_job_running (job))
+					continue;
+
+				deadline = quiesce_job_deadline (job);
+				if ((deadline > quiesce_reported)
+				    && (quiesce_phase_time + deadline < due))
+					due = quiesce_phase_time + deadline;
+			}
+		}
+	}
+
+	if (quiesce_max_timeout) {
+		uint64_t cap;
+
+		cap = quiesce_start_ms + (uint64_t)quiesce_max_timeout * 1000;
+		if (cap < due)
+			due = cap;
+	}
 
-	/* Deregister */
-	nih_free (timer);
+	if (quiesce_timer)
+		nih_free (quiesce_timer);
+
+	quiesce_timer = NIH_MUST (timer_wheel_add (NULL,
+						   due > now ? due - now : 0,
+						   quiesce_wait_callback,
+						   NULL));
+}
+
+/**
+ * quiesce_job_running:
+ * @job: job.
+ *
+ * Returns: TRUE if any process of @job is still running, else FALSE.
+ **/
+static int
+quiesce_job_running (const Job *job)
+{
+	nih_assert (job);
+
+	for (int i = 0; i < PROCESS_LAST; i++) {
+		if (job->pid[i])
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * quiesce_job_deadline:
+ * @job: job.
+ *
+ * Returns: milliseconds into the kill phase by which @job should have
+ * stopped: its kill timeout and QUIESCE_KILL_GRACE for the KILL signal
+ * to take effect.
+ **/
+static uint64_t
+quiesce_job_deadline (const Job *job)
+{
+	nih_assert (job);
+
+	return ((uint64_t)job->class->kill_timeout * 1000) + QUIESCE_KILL_GRACE;
+}
+
+/**
+ * quiesce_kill_deadline:
+ *
+ * Unlike job_class_max_kill_timeout(), only jobs that are still running
+ * are considered, so that the phase ends as soon as those jobs have had
+ * their own time to stop.
+ *
+ * Returns: milliseconds into the kill phase by which all running jobs
+ * should have stopped.
+ **/
+static uint64_t
+quiesce_kill_deadline (void)
+{
+	uint64_t deadline = QUIESCE_KILL_GRACE;
+
+	job_class_init ();
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		NIH_HASH_FOREACH (class->instances, job_iter) {
+			Job *job = (Job *)job_iter;
+
+			if (! quiesce_job_running (job))
+				continue;
+
+			if (quiesce_job_deadline (job) > deadline)
+				deadline = quiesce_job_deadline (job);
+		}
+	}
+
+	return deadline;
+}
+
+/**
+ * quiesce_report_slow_jobs:
+ * @elapsed: milliseconds into the kill phase.
+ *
+ * Report jobs still running whose deadline has passed since the last
+ * report, so that the jobs holding up shutdown are known while it
+ * happens rather than only once it has given up.
+ **/
+static void
+quiesce_report_slow_jobs (uint64_t elapsed)
+{
+	job_class_init ();
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		NIH_HASH_FOREACH (class->instances, job_iter) {
+			Job      *job = (Job *)job_iter;
+			uint64_t  deadline;
+
+			if (! quiesce_job_running (job))
+				continue;
+
+			deadline = quiesce_job_deadline (job);
+			if ((deadline <= quiesce_reported) || (deadline > elapsed))
+				continue;
+
+			nih_warn (_("job %s still running %d seconds after being stopped"),
+				  job_name (job), (int)(elapsed / 1000));
+		}
+	}
+
+	if (elapsed > quiesce_reported)
+		quiesce_reported = elapsed;
 }
 
 /**
@@ -283,7 +614,13 @@ quiesce_show_slow_jobs (void)
 
 			name = job_name (job);
 
-			nih_warn ("job %s failed to stop", name);
+			for (int i = 0; i < PROCESS_LAST; i++) {
+				if (job->pid[i] <= 0)
+					continue;
+
+				nih_warn ("job %s failed to stop: %s process (%d) still running",
+					  name, process_name (i), job->pid[i]);
+			}
 		}
 	}
 }
@@ -308,6 +645,16 @@ quiesce_finalise (void)
 
 	finalising = TRUE;
 
+	/* Leave a record of what held up the main loop most before the
+	 * system goes down.
+	 */
+	metrics_show_stalls ();
+
+	if (quiesce_timer) {
+		nih_free (quiesce_timer);
+		quiesce_timer = NULL;
+	}
+
 	diff = time (NULL) - quiesce_start_time;
 
 	nih_info (_("Quiesce %s sequence took %s%d second%s"),
@@ -316,6 +663,10 @@ quiesce_finalise (void)
 			(int)diff ? (int)diff : 1,
 			diff <= 1 ? "" : "s");
 
+	/* The init daemon carries on to halt or reboot the system */
+	if (quiesce_requester == QUIESCE_REQUESTER_SHUTDOWN)
+		return;
+
 	nih_main_loop_exit (0);
 
 }
@@ -355,27 +706,50 @@ quiesce_event_match (Event *event)
 	NIH_HASH_FOREACH (job_classes, iter) {
 		JobClass *class = (JobClass *)iter;
 
-		if (! class->start_on)
-			continue;
+		/* Job may attempt to start as the session ends */
+		if (quiesce_class_match (class, event))
+			return TRUE;
+	}
 
-		/* Note that only the jobs start on condition is
-		 * relevant.
-		 */
-		NIH_TREE_FOREACH_POST (&class->start_on->node, iter) {
-			EventOperator *oper = (EventOperator *)iter;
+	return FALSE;
+}
 
-			switch (oper->type) {
-			case EVENT_OR:
-			case EVENT_AND:
-				break;
-			case EVENT_MATCH:
-				/* Job may attempt to start as the session ends */
-				if (event_operator_match (oper, event, NULL))
-					return TRUE;
-				break;
-			default:
-				nih_assert_not_reached ();
-			}
+/**
+ * quiesce_class_match:
+ * @class: job class,
+ * @event: event.
+ *
+ * Determine if @event is one of those that the start on condition of
+ * @class waits for.
+ *
+ * Returns: TRUE if so, else FALSE.
+ **/
+static int
+quiesce_class_match (JobClass *class,
+		     Event    *event)
+{
+	nih_assert (class);
+	nih_assert (event);
+
+	if (! class->start_on)
+		return FALSE;
+
+	/* Note that only the jobs start on condition is
+	 * relevant.
+	 */
+	NIH_TREE_FOREACH_POST (&class->start_on->node, iter) {
+		EventOperator *oper = (EventOperator *)iter;
+
+		switch (oper->type) {
+		case EVENT_OR:
+		case EVENT_AND:
+			break;
+		case EVENT_MATCH:
+			if (event_operator_match (oper, event, NULL))
+				return TRUE;
+			break;
+		default:
+			nih_assert_not_reached ();
 		}
 	}
 
@@ -394,3 +768,382 @@ quiesce_in_progress (void)
 {
 	return quiesce_phase != QUIESCE_PHASE_NOT_QUIESCED;
 }
+
+
+/**
+ * quiesce_runlevel:
+ * @event: event being handled.
+ *
+ * Called as each event is handled; when fast shutdown is enabled and
+ * @event is the runlevel event for a halt or reboot, begin stopping the
+ * jobs in waves rather than leave each to its own stop on condition.
+ *
+ * The jobs started by @event itself, such as the rc job that completes
+ * the shutdown, are left running.
+ **/
+void
+quiesce_runlevel (Event *event)
+{
+	const char *runlevel;
+
+	nih_assert (event);
+
+	if (! quiesce_fast_shutdown)
+		return;
+
+	if (strcmp (event->name, RUNLEVEL_EVENT))
+		return;
+
+	runlevel = environ_get (event->env, "RUNLEVEL");
+	if ((! runlevel) || (strcmp (runlevel, "0") && strcmp (runlevel, "6")))
+		return;
+
+	if (quiesce_in_progress ())
+		return;
+
+	quiesce (QUIESCE_REQUESTER_SHUTDOWN);
+	quiesce_waves_start (event);
+}
+
+/**
+ * quiesce_waves_start:
+ * @event: runlevel event that began the shutdown.
+ *
+ * Note the classes started by @event, which are left running, and stop
+ * the first wave of jobs.
+ **/
+static void
+quiesce_waves_start (Event *event)
+{
+	nih_assert (event);
+	nih_assert (quiesce_phase == QUIESCE_PHASE_WAVES);
+
+	job_class_init ();
+
+	if (quiesce_excluded)
+		nih_free (quiesce_excluded);
+
+	quiesce_excluded = NIH_MUST (nih_str_array_new (NULL));
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		if (quiesce_class_match (class, event))
+			NIH_MUST (nih_str_array_add (&quiesce_excluded, NULL,
+						     NULL, class->name));
+	}
+
+	quiesce_wave = 0;
+	quiesce_waves_next (timer_wheel_now ());
+}
+
+/**
+ * quiesce_waves_check:
+ *
+ * Called whenever a job process is reaped, and otherwise every
+ * QUIESCE_WAVE_CHECK milliseconds, to begin the next wave once the jobs
+ * of the current one have stopped.
+ *
+ * A wave taking longer than the kill timeout of its slowest job is left
+ * to finish on its own while the next begins; should the whole shutdown
+ * take longer than the --shutdown-timeout, or QUIESCE_SHUTDOWN_TIMEOUT
+ * by default, the remaining jobs are all stopped at once.
+ **/
+static void
+quiesce_waves_check (void)
+{
+	uint64_t now;
+	uint64_t limit;
+	int      stopping = FALSE;
+
+	nih_assert (quiesce_phase == QUIESCE_PHASE_WAVES);
+
+	job_class_init ();
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		NIH_HASH_FOREACH (class->instances, job_iter) {
+			Job *job = (Job *)job_iter;
+
+			if (quiesce_wave_candidate (job)
+			    && (job->goal == JOB_STOP))
+				stopping = TRUE;
+		}
+	}
+
+	now = timer_wheel_now ();
+	limit = (uint64_t)(quiesce_max_timeout
+			   ? quiesce_max_timeout
+			   : QUIESCE_SHUTDOWN_TIMEOUT) * 1000;
+
+	if (stopping && (now - quiesce_start_ms >= limit)) {
+		nih_warn (_("Shutdown took longer than %d seconds, stopping all remaining jobs"),
+			  (int)(limit / 1000));
+
+		NIH_HASH_FOREACH (job_classes, iter) {
+			JobClass *class = (JobClass *)iter;
+
+			NIH_HASH_FOREACH_SAFE (class->instances, job_iter) {
+				Job *job = (Job *)job_iter;
+
+				if (quiesce_wave_candidate (job)
+				    && (job->goal == JOB_START))
+					job_change_goal (job, JOB_STOP);
+			}
+		}
+
+		quiesce_phase = QUIESCE_PHASE_CLEANUP;
+		quiesce_finalise ();
+		return;
+	}
+
+	if (stopping && (now - quiesce_phase_time < quiesce_wave_deadline)) {
+		quiesce_waves_arm ();
+		return;
+	}
+
+	if (stopping) {
+		nih_warn (_("Shutdown wave %d still stopping after %d ms, starting next wave"),
+			  quiesce_wave, (int)(now - quiesce_phase_time));
+	} else {
+		nih_info (_("Shutdown wave %d stopped %d job%s in %d ms"),
+			  quiesce_wave, quiesce_wave_jobs,
+			  quiesce_wave_jobs == 1 ? "" : "s",
+			  (int)(now - quiesce_phase_time));
+	}
+
+	quiesce_waves_next (now);
+}
+
+/**
+ * quiesce_waves_next:
+ * @now: current time.
+ *
+ * Stop the next wave of jobs, those running instances that no other
+ * running instance depends on by naming it in a job event of its start
+ * on or stop on condition; so jobs are stopped before those they were
+ * started after, and jobs of the same depth are stopped together.
+ *
+ * Should dependencies form a loop, so no instance qualifies, the
+ * remaining instances are all stopped.  Once none remain, the shutdown is
+ * complete.
+ **/
+static void
+quiesce_waves_next (uint64_t now)
+{
+	nih_local Job **wave = NULL;
+	size_t          wave_len = 0;
+	size_t          remaining = 0;
+	int             stopping = 0;
+
+	nih_assert (quiesce_phase == QUIESCE_PHASE_WAVES);
+
+	job_class_init ();
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		NIH_HASH_FOREACH (class->instances, job_iter) {
+			Job *job = (Job *)job_iter;
+
+			if (! quiesce_wave_candidate (job))
+				continue;
+
+			if (job->goal == JOB_STOP) {
+				stopping++;
+			} else {
+				remaining++;
+			}
+		}
+	}
+
+	if (! (remaining || stopping)) {
+		quiesce_phase = QUIESCE_PHASE_CLEANUP;
+		quiesce_finalise ();
+		return;
+	}
+
+	wave = NIH_MUST (nih_alloc (NULL, sizeof (Job *) * (remaining + 1)));
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		NIH_HASH_FOREACH (class->instances, job_iter) {
+			Job *job = (Job *)job_iter;
+			int  depended = FALSE;
+
+			if ((! quiesce_wave_candidate (job))
+			    || (job->goal != JOB_START))
+				continue;
+
+			NIH_HASH_FOREACH (job_classes, other_iter) {
+				JobClass *other = (JobClass *)other_iter;
+				int       running = FALSE;
+
+				if (other == class)
+					continue;
+
+				NIH_HASH_FOREACH (other->instances, other_job_iter) {
+					if (quiesce_wave_candidate ((Job *)other_job_iter))
+						running = TRUE;
+				}
+
+				if (running && quiesce_depends (other, class->name)) {
+					depended = TRUE;
+					break;
+				}
+			}
+
+			if (! depended)
+				wave[wave_len++] = job;
+		}
+	}
+
+	/* Loop of dependencies, so stop everything left */
+	if (remaining && ! wave_len) {
+		NIH_HASH_FOREACH (job_classes, iter) {
+			JobClass *class = (JobClass *)iter;
+
+			NIH_HASH_FOREACH (class->instances, job_iter) {
+				Job *job = (Job *)job_iter;
+
+				if (quiesce_wave_candidate (job)
+				    && (job->goal == JOB_START))
+					wave[wave_len++] = job;
+			}
+		}
+	}
+
+	quiesce_wave++;
+	quiesce_wave_jobs = stopping + wave_len;
+	quiesce_wave_deadline = QUIESCE_KILL_GRACE;
+	quiesce_phase_time = now;
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		NIH_HASH_FOREACH (class->instances, job_iter) {
+			Job *job = (Job *)job_iter;
+
+			if (quiesce_wave_candidate (job)
+			    && (job->goal == JOB_STOP)
+			    && (quiesce_job_deadline (job) > quiesce_wave_deadline))
+				quiesce_wave_deadline = quiesce_job_deadline (job);
+		}
+	}
+
+	for (size_t i = 0; i < wave_len; i++) {
+		if (quiesce_job_deadline (wave[i]) > quiesce_wave_deadline)
+			quiesce_wave_deadline = quiesce_job_deadline (wave[i]);
+	}
+
+	nih_debug ("Shutdown wave %d stopping %d jobs", quiesce_wave,
+		   quiesce_wave_jobs);
+
+	for (size_t i = 0; i < wave_len; i++)
+		job_change_goal (wave[i], JOB_STOP);
+
+	quiesce_waves_arm ();
+}
+
+/**
+ * quiesce_waves_arm:
+ *
+ * Arrange for quiesce_waves_check() to be called by the earliest of the
+ * next periodic check, the deadline of the current wave and the deadline
+ * of the whole shutdown.
+ **/
+static void
+quiesce_waves_arm (void)
+{
+	uint64_t now;
+	uint64_t due;
+	uint64_t cap;
+
+	now = timer_wheel_now ();
+
+	due = now + QUIESCE_WAVE_CHECK;
+
+	if (quiesce_phase_time + quiesce_wave_deadline < due)
+		due = quiesce_phase_time + quiesce_wave_deadline;
+
+	cap = quiesce_start_ms + (uint64_t)(quiesce_max_timeout
+					    ? quiesce_max_timeout
+					    : QUIESCE_SHUTDOWN_TIMEOUT) * 1000;
+	if (cap < due)
+		due = cap;
+
+	if (quiesce_timer)
+		nih_free (quiesce_timer);
+
+	quiesce_timer = NIH_MUST (timer_wheel_add (NULL,
+						   due > now ? due - now : 0,
+						   quiesce_wait_callback,
+						   NULL));
+}
+
+/**
+ * quiesce_wave_candidate:
+ * @job: job instance.
+ *
+ * Returns: TRUE if @job is yet to finish stopping and isn't of one of
+ * the classes a fast shutdown leaves running, else FALSE.
+ **/
+static int
+quiesce_wave_candidate (Job *job)
+{
+	nih_assert (job);
+
+	if (job->state == JOB_WAITING)
+		return FALSE;
+
+	if (quiesce_excluded) {
+		for (char **name = quiesce_excluded; *name; name++) {
+			if (! strcmp (*name, job->class->name))
+				return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * quiesce_depends:
+ * @class: job class,
+ * @name: name of another job class.
+ *
+ * Determine if @class depends on the job named @name, that is if its
+ * start on or stop on condition includes a starting, started, stopping
+ * or stopped event for it.
+ *
+ * Returns: TRUE if so, else FALSE.
+ **/
+static int
+quiesce_depends (JobClass   *class,
+		 const char *name)
+{
+	EventOperator *conditions[2];
+
+	nih_assert (class);
+	nih_assert (name);
+
+	conditions[0] = class->start_on;
+	conditions[1] = class->stop_on;
+
+	for (int i = 0; i < 2; i++) {
+		if (! conditions[i])
+			continue;
+
+		NIH_TREE_FOREACH_POST (&conditions[i]->node, iter) {
+			EventOperator *oper = (EventOperator *)iter;
+			const char    *value;
+
+			value = event_operator_job (oper);
+			if (value && (! fnmatch (value, name, 0)))
+				return TRUE;
+		}
+	}
+
+	return FALSE;
+}
@@ -20,7 +20,8 @@
 #ifndef INIT_QUIESCE_H
 #define INIT_QUIESCE_H
 
-#include <nih/timer.h>
+#include "timer_wheel.h"
+#include "event.h"
 
 /**
  * QUIESCE_DEFAULT_JOB_RUNTIME:
@@ -30,17 +31,47 @@
  **/
 #define QUIESCE_DEFAULT_JOB_RUNTIME 5
 
+/**
+ * QUIESCE_KILL_GRACE:
+ *
+ * Milliseconds beyond its kill timeout to allow a job to stop in before
+ * considering it slow, for the KILL signal to take effect.
+ **/
+#define QUIESCE_KILL_GRACE 1000
+
+/**
+ * QUIESCE_SHUTDOWN_TIMEOUT:
+ *
+ * Default maximum number of seconds that the waves of a fast shutdown
+ * may take when no --shutdown-timeout is given.
+ **/
+#define QUIESCE_SHUTDOWN_TIMEOUT 90
+
+/**
+ * QUIESCE_WAVE_CHECK:
+ *
+ * Milliseconds between checks of whether the current wave of a fast
+ * shutdown has stopped, since instances without processes may finish
+ * stopping without one being reaped.
+ **/
+#define QUIESCE_WAVE_CHECK 100
+
 /**
  * QuiesceRequester:
  *
  * Reason for Session Init wishing to shutdown; either the Session Init
  * has been notified the system is being shutdown, or the session has
  * requested it be ended (for example due to a user logout request).
+ *
+ * QUIESCE_REQUESTER_SHUTDOWN is instead the init daemon itself, with
+ * fast shutdown enabled, seeing the runlevel event for a halt or
+ * reboot; it stops the jobs but doesn't exit.
  **/
 typedef enum quiesce_requester {
 	QUIESCE_REQUESTER_INVALID = -1,
 	QUIESCE_REQUESTER_SYSTEM = 0,
 	QUIESCE_REQUESTER_SESSION,
+	QUIESCE_REQUESTER_SHUTDOWN,
 } QuiesceRequester;
 
 /**
@@ -56,18 +87,26 @@ typedef enum quiesce_requester {
  *
  * Phase 3: Cleanup: Period between all jobs having ended
  *          (either naturally or by induction) and final exit.
+ *
+ * A fast shutdown instead goes from the waves phase, during which the
+ * jobs are stopped in waves by dependency depth, to cleanup.
  **/
 typedef enum quiesce_phase {
 	QUIESCE_PHASE_NOT_QUIESCED,
 	QUIESCE_PHASE_WAIT,
 	QUIESCE_PHASE_KILL,
 	QUIESCE_PHASE_CLEANUP,
+	QUIESCE_PHASE_WAVES,
 } QuiescePhase;
 
 NIH_BEGIN_EXTERN
 
+extern int quiesce_fast_shutdown;
+
 void    quiesce                (QuiesceRequester requester);
-void    quiesce_wait_callback  (void *data, NihTimer *timer);
+void    quiesce_runlevel       (Event *event);
+void    quiesce_wait_callback  (void *data, WheelTimer *timer);
+void    quiesce_job_reaped     (void);
 void    quiesce_show_slow_jobs (void);
 void    quiesce_finalise       (void);
 void    quiesce_complete       (void);
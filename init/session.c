@@ -37,6 +37,7 @@
 #include <nih/macros.h>
 #include <nih/alloc.h>
 #include <nih/list.h>
+#include <nih/hash.h>
 #include <nih/string.h>
 #include <nih/logging.h>
 #include <nih/error.h>
@@ -74,8 +75,44 @@ NihList *sessions = NULL;
 int chroot_sessions = FALSE;
 
 
+/**
+ * SessionKey:
+ * @entry: list header,
+ * @chroot: chroot path of @session, used as the key,
+ * @session: session.
+ *
+ * Entry of the session_index hash; allocated as a child of @session so
+ * that it is removed from the hash when the session is freed.
+ **/
+typedef struct session_key {
+	NihList  entry;
+	char    *chroot;
+	Session *session;
+} SessionKey;
+
+/**
+ * session_index:
+ *
+ * Hash of the known sessions, keyed by chroot path; each item is a
+ * SessionKey structure.  The sessions list remains authoritative for
+ * the order of the sessions.
+ **/
+static NihHash *session_index = NULL;
+
+/**
+ * session_root_slot:
+ *
+ * D-Bus connection data slot holding the root path of the process at
+ * the other end of a connection, once session_from_dbus() has looked
+ * it up.
+ **/
+static dbus_int32_t session_root_slot = -1;
+
+
 /* Prototypes for static functions */
-static void session_create_conf_source (Session *sesson, int deserialised);
+static void        session_create_conf_source (Session *sesson, int deserialised);
+static const char *session_dbus_root          (DBusConnection *conn);
+static void        session_root_free          (void *root);
 
 /**
  * session_init:
@@ -87,6 +124,9 @@ session_init (void)
 {
 	if (! sessions)
 		sessions = NIH_MUST (nih_list_new (NULL));
+
+	if (! session_index)
+		session_index = NIH_MUST (nih_hash_string_new (NULL, 0));
 }
 
 /**
@@ -99,6 +139,11 @@ session_destroy (void)
 {
 	if (sessions)
 		nih_free (sessions);
+
+	if (session_index) {
+		nih_free (session_index);
+		session_index = NULL;
+	}
 }
 
 
@@ -115,7 +160,8 @@ Session *
 session_new (const void *parent,
 	     const char *chroot)
 {
-	Session *session;
+	Session    *session;
+	SessionKey *key;
 
 	nih_assert (chroot);
 
@@ -135,8 +181,20 @@ session_new (const void *parent,
 
 	session->conf_path = NULL;
 
+	key = nih_new (session, SessionKey);
+	if (! key) {
+		nih_free (session);
+		return NULL;
+	}
+
+	nih_list_init (&key->entry);
+	key->chroot = session->chroot;
+	key->session = session;
+
+	nih_alloc_set_destructor (key, nih_list_destroy);
 	nih_alloc_set_destructor (session, nih_list_destroy);
 
+	nih_hash_add (session_index, &key->entry);
 	nih_list_add (sessions, &session->entry);
 
 	return session;
@@ -147,21 +205,21 @@ session_new (const void *parent,
  * @parent: parent,
  * @message: D-Bus message.
  *
- * Create a new session, based on the specified D-Bus message.
+ * Find the session of the caller of the specified D-Bus message,
+ * creating a new one if it is the first caller from its chroot.
  *
- * Returns: new Session, or NULL on error.
+ * The root path of the caller is only looked up once for each
+ * connection, see session_disconnected().
+ *
+ * Returns: Session, or NULL for the NULL session or on error.
  **/
 Session *
 session_from_dbus (const void     *parent,
 		   NihDBusMessage *message)
 {
-	DBusError        dbus_error;
-	unsigned long    unix_process_id;
-	char             root[PATH_MAX];
-	Session         *session;
-	nih_local char  *conf_path = NULL;
-	nih_local char  *symlink = NULL;
-	ssize_t          len;
+	const char *root;
+	SessionKey *key;
+	Session    *session;
 
 	nih_assert (message != NULL);
 
@@ -173,46 +231,109 @@ session_from_dbus (const void     *parent,
 
 	session_init ();
 
-	dbus_error_init (&dbus_error);
+	root = session_dbus_root (message->connection);
+	if (! root)
+		return NULL;
 
-	/* Query origin pid of the caller */
-	if (! dbus_connection_get_unix_process_id (message->connection,
-				&unix_process_id)) {
+	/* Path is not inside a chroot */
+	if (! strcmp (root, "/"))
 		return NULL;
+
+	key = (SessionKey *)nih_hash_lookup (session_index, root);
+	if (key) {
+		if (! key->session->conf_path)
+			session_create_conf_source (key->session, FALSE);
+
+		return key->session;
 	}
 
+	/* Didn't find one, make a new one */
+	session = NIH_MUST (session_new (parent, root));
+	session_create_conf_source (session, FALSE);
+
+	return session;
+}
+
+/**
+ * session_disconnected:
+ * @conn: connection that was disconnected.
+ *
+ * Forgets the root path of the process at the other end of @conn, which
+ * session_from_dbus() would otherwise reuse should a new connection be
+ * made at the same address.
+ **/
+void
+session_disconnected (DBusConnection *conn)
+{
+	nih_assert (conn != NULL);
+
+	if (session_root_slot < 0)
+		return;
+
+	dbus_connection_set_data (conn, session_root_slot, NULL, NULL);
+}
+
+/**
+ * session_dbus_root:
+ * @conn: D-Bus connection.
+ *
+ * Looks up the root path of the process at the other end of @conn from
+ * /proc, remembering it in the connection so that later calls are
+ * answered without doing so again.
+ *
+ * Returns: root path, or NULL if it cannot be found.
+ **/
+static const char *
+session_dbus_root (DBusConnection *conn)
+{
+	unsigned long   unix_process_id;
+	char            buf[PATH_MAX];
+	char           *root;
+	nih_local char *symlink = NULL;
+	ssize_t         len;
+
+	nih_assert (conn != NULL);
+
+	if (session_root_slot < 0)
+		NIH_MUST (dbus_connection_allocate_data_slot (&session_root_slot));
+
+	root = dbus_connection_get_data (conn, session_root_slot);
+	if (root)
+		return root;
+
+	/* Query origin pid of the caller */
+	if (! dbus_connection_get_unix_process_id (conn, &unix_process_id))
+		return NULL;
+
 	/* Look up the root path for retrieved pid */
 	symlink = NIH_MUST (nih_sprintf (NULL, "/proc/%lu/root",
 				unix_process_id));
-	len = readlink (symlink, root, sizeof (root)-1);
+	len = readlink (symlink, buf, sizeof (buf)-1);
 	if (len < 0)
 		return NULL;
 
-	root[len] = '\0';
-
-	/* Path is not inside a chroot */
-	if (! strcmp (root, "/"))
-		return NULL;
-
-	/* Now find in the existing Sessions list */
-	NIH_LIST_FOREACH_SAFE (sessions, iter) {
-		Session *session = (Session *)iter;
+	buf[len] = '\0';
 
-		if (strcmp (session->chroot, root))
-			/* ignore sessions relating to other chroots */
-			continue;
+	root = NIH_MUST (nih_strdup (NULL, buf));
 
-		if (! session->conf_path)
-			session_create_conf_source (session, FALSE);
+	NIH_MUST (dbus_connection_set_data (conn, session_root_slot, root,
+					    session_root_free));
 
-		return session;
-	}
+	return root;
+}
 
-	/* Didn't find one, make a new one */
-	session = NIH_MUST (session_new (parent, root));
-	session_create_conf_source (session, FALSE);
+/**
+ * session_root_free:
+ * @root: root path.
+ *
+ * Frees a root path stored in a connection by session_dbus_root().
+ **/
+static void
+session_root_free (void *root)
+{
+	nih_assert (root != NULL);
 
-	return session;
+	nih_free (root);
 }
 
 /**
@@ -84,6 +84,7 @@ Session      * session_new         (const void *parent, const char *chroot)
 	__attribute__ ((warn_unused_result));
 
 Session      * session_from_dbus   (const void *parent, NihDBusMessage *message);
+void           session_disconnected (DBusConnection *conn);
 
 json_object  * session_serialise_all   (void)
 	__attribute__ ((warn_unused_result));
@@ -0,0 +1,700 @@
+/* upstart
+ *
+ * spawn_helper.c - spawning job processes outside of init
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include "job_class.h"
+#include "job_process.h"
+#include "state.h"
+#include "spawn_helper.h"
+
+
+/**
+ * SPAWN_HELPER_MAX_FDS:
+ *
+ * Most descriptors passed with a SpawnHelperRequest.
+ **/
+#define SPAWN_HELPER_MAX_FDS 3
+
+
+/* Prototypes for static functions */
+static char *      spawn_helper_append  (char *p, const char *str);
+static const char *spawn_helper_next    (const char **p, const char *end);
+static void        spawn_helper_receive (int sock, size_t len);
+static pid_t       spawn_helper_fork    (const char *buf, size_t len,
+					 const int *fds, int nfds);
+
+
+/**
+ * spawn_helper:
+ *
+ * If TRUE, start a spawn helper with spawn_helper_start() at boot.
+ **/
+int spawn_helper = FALSE;
+
+/**
+ * spawn_helper_fd:
+ *
+ * Our end of the socket connected to the spawn helper, or -1 if there
+ * is none.  Kept open over a re-exec, see spawn_helper_prepare_reexec().
+ **/
+int spawn_helper_fd = -1;
+
+extern int user_mode;
+
+
+/**
+ * spawn_helper_start:
+ *
+ * Start a spawn helper: a copy of init executed with --spawnd-fd,
+ * connected to us over a UNIX socket.  Since it holds none of our job
+ * classes, events or logs it stays small, and job processes can be
+ * forked from it with spawn_helper_spawn() at a cost that doesn't grow
+ * with our own.
+ *
+ * Returns: 0 on success, -1 on raised error.
+ **/
+int
+spawn_helper_start (void)
+{
+	int             sv[2];
+	pid_t           pid;
+	nih_local char *fd_str = NULL;
+
+	nih_assert (args_copy);
+	nih_assert (args_copy[0]);
+	nih_assert (spawn_helper_fd == -1);
+
+	if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+		nih_return_system_error (-1);
+
+	fd_str = nih_sprintf (NULL, "%d", sv[1]);
+	if (! fd_str) {
+		close (sv[0]);
+		close (sv[1]);
+		nih_return_no_memory_error (-1);
+	}
+
+	pid = fork ();
+	if (pid < 0) {
+		nih_error_raise_system ();
+		close (sv[0]);
+		close (sv[1]);
+		return -1;
+	} else if (! pid) {
+		char *argv[] = { args_copy[0], "--spawnd-fd", fd_str, NULL };
+
+		close (sv[0]);
+
+		if (state_modify_cloexec (sv[1], FALSE) < 0)
+			_exit (1);
+
+		execvp (argv[0], argv);
+		_exit (1);
+	}
+
+	close (sv[1]);
+	spawn_helper_fd = sv[0];
+
+	nih_debug ("Started spawn helper (%d)", pid);
+
+	return 0;
+}
+
+/**
+ * spawn_helper_wanted:
+ * @job: job of process to be spawned,
+ * @process: job process to spawn,
+ * @trace: whether the process is to be traced.
+ *
+ * Determine whether @process of @job can be spawned by the spawn helper;
+ * those that are traced, debugged, in a chroot or user session, need
+ * cgroups or log to a socket rely on state only we have and are forked
+ * by us, as are those placed on particular processors or memory nodes,
+ * or given a scheduling policy, I/O priority or timer slack, which the
+ * spawn helper's requests don't carry.
+ *
+ * Returns: TRUE if spawn_helper_spawn() should be tried, FALSE otherwise.
+ **/
+int
+spawn_helper_wanted (Job         *job,
+		     ProcessType  process,
+		     int          trace)
+{
+	JobClass *class;
+
+	nih_assert (job != NULL);
+	nih_assert (process < PROCESS_LAST);
+
+	class = job->class;
+
+	if (spawn_helper_fd == -1)
+		return FALSE;
+
+	if (trace || class->debug || class->session)
+		return FALSE;
+
+	if (class->console == CONSOLE_SOCKET)
+		return FALSE;
+
+	if (class->placement)
+		return FALSE;
+
+	if ((class->sched_policy != JOB_SCHED_INVALID)
+	    || (class->ioprio_class != JOB_IOPRIO_NONE)
+	    || class->timer_slack)
+		return FALSE;
+
+#ifdef ENABLE_CGROUPS
+	if (job_needs_cgroups (job))
+		return FALSE;
+#endif /* ENABLE_CGROUPS */
+
+	return TRUE;
+}
+
+/**
+ * spawn_helper_append:
+ * @p: position in message buffer,
+ * @str: string to append.
+ *
+ * Returns: position in message buffer following @str and its nul.
+ **/
+static char *
+spawn_helper_append (char       *p,
+		     const char *str)
+{
+	size_t len;
+
+	nih_assert (p != NULL);
+	nih_assert (str != NULL);
+
+	len = strlen (str) + 1;
+	memcpy (p, str, len);
+
+	return p + len;
+}
+
+/**
+ * spawn_helper_spawn:
+ * @job: job of process to be spawned,
+ * @process: job process to spawn,
+ * @argv: NULL-terminated list of arguments for the process,
+ * @env: NULL-terminated list of environment variables for the process,
+ *  or NULL,
+ * @script_fd: script file descriptor, or -1,
+ * @error_fd: writing end of the error pipe,
+ * @pty_master: pty master for console logging, or -1.
+ *
+ * Ask the spawn helper to fork @process of @job in place of fork() in
+ * job_process_spawn_with_fd().  The helper forks it such that it is our
+ * child rather than its own, then sets it up exactly as we would have,
+ * reporting any failure over @error_fd.  The caller remains responsible
+ * for closing its copies of the descriptors passed.
+ *
+ * Must be called with all signals blocked.  No error is raised on
+ * failure since the caller simply forks the process itself; should the
+ * helper have gone away, it is not used again.
+ *
+ * Returns: process id of new process, or -1 on failure.
+ **/
+pid_t
+spawn_helper_spawn (Job          *job,
+		    ProcessType   process,
+		    char * const  argv[],
+		    char * const *env,
+		    int           script_fd,
+		    int           error_fd,
+		    int           pty_master)
+{
+	JobClass           *class;
+	SpawnHelperRequest  req;
+	SpawnHelperReply    reply;
+	const char         *strings[SPAWN_HELPER_STRING_LAST];
+	nih_local char     *buf = NULL;
+	char               *p;
+	size_t              len;
+	struct iovec        iov;
+	struct msghdr       hdr;
+	struct cmsghdr     *cmsg;
+	char                control[CMSG_SPACE (SPAWN_HELPER_MAX_FDS * sizeof (int))];
+	int                 fds[SPAWN_HELPER_MAX_FDS];
+	int                 nfds = 0;
+	ssize_t             ret;
+
+	nih_assert (job != NULL);
+	nih_assert (argv != NULL);
+	nih_assert (error_fd >= 0);
+	nih_assert (spawn_helper_fd != -1);
+
+	class = job->class;
+
+	memset (&req, '\0', sizeof (req));
+	req.process       = process;
+	req.console       = class->console;
+	req.user_mode     = user_mode;
+	req.umask         = class->umask;
+	req.nice          = class->nice;
+	req.oom_score_adj = class->oom_score_adj;
+	req.has_script    = (script_fd != -1);
+
+	for (int i = 0; i < RLIMIT_NLIMITS; i++) {
+		if (! class->limits[i])
+			continue;
+
+		req.limits_set |= (1U << i);
+		req.limits[i] = *class->limits[i];
+	}
+
+	strings[SPAWN_HELPER_SETUID] = class->setuid;
+	strings[SPAWN_HELPER_SETGID] = class->setgid;
+	strings[SPAWN_HELPER_CHROOT] = class->chroot;
+	strings[SPAWN_HELPER_CHDIR] = class->chdir;
+	strings[SPAWN_HELPER_APPARMOR_SWITCH] = class->apparmor_switch;
+
+	len = sizeof (req);
+
+	for (int i = 0; i < SPAWN_HELPER_STRING_LAST; i++) {
+		if (! strings[i])
+			continue;
+
+		req.strings_set |= (1U << i);
+		len += strlen (strings[i]) + 1;
+	}
+
+	for (char * const *arg = argv; *arg; arg++) {
+		req.argc++;
+		len += strlen (*arg) + 1;
+	}
+
+	for (char * const *e = env; e && *e; e++) {
+		req.envc++;
+		len += strlen (*e) + 1;
+	}
+
+	buf = nih_alloc (NULL, len);
+	if (! buf)
+		return -1;
+
+	memcpy (buf, &req, sizeof (req));
+	p = buf + sizeof (req);
+
+	for (int i = 0; i < SPAWN_HELPER_STRING_LAST; i++)
+		if (strings[i])
+			p = spawn_helper_append (p, strings[i]);
+
+	for (char * const *arg = argv; *arg; arg++)
+		p = spawn_helper_append (p, *arg);
+
+	for (char * const *e = env; e && *e; e++)
+		p = spawn_helper_append (p, *e);
+
+	fds[nfds++] = error_fd;
+
+	if (class->console == CONSOLE_LOG) {
+		nih_assert (pty_master >= 0);
+		fds[nfds++] = pty_master;
+	}
+
+	if (script_fd != -1)
+		fds[nfds++] = script_fd;
+
+	iov.iov_base = buf;
+	iov.iov_len  = len;
+
+	memset (&hdr, '\0', sizeof (hdr));
+	memset (control, '\0', sizeof (control));
+	hdr.msg_iov        = &iov;
+	hdr.msg_iovlen     = 1;
+	hdr.msg_control    = control;
+	hdr.msg_controllen = CMSG_SPACE (nfds * sizeof (int));
+
+	cmsg = CMSG_FIRSTHDR (&hdr);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN (nfds * sizeof (int));
+	memcpy (CMSG_DATA (cmsg), fds, nfds * sizeof (int));
+
+	do {
+		ret = sendmsg (spawn_helper_fd, &hdr, MSG_NOSIGNAL);
+	} while (ret < 0 && errno == EINTR);
+
+	/* An environment too large for a single message is not a reason
+	 * to stop using the helper for other jobs.
+	 */
+	if (ret < 0 && errno == EMSGSIZE)
+		return -1;
+
+	if (ret < 0)
+		goto error;
+
+	do {
+		ret = recv (spawn_helper_fd, &reply, sizeof (reply), 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret != sizeof (reply)) {
+		if (ret >= 0)
+			errno = ECONNRESET;
+		goto error;
+	}
+
+	if (reply.pid < 0) {
+		errno = reply.errnum;
+		return -1;
+	}
+
+	return reply.pid;
+
+error:
+	nih_warn ("%s: %s", _("Spawn helper unavailable"), strerror (errno));
+
+	close (spawn_helper_fd);
+	spawn_helper_fd = -1;
+
+	return -1;
+}
+
+/**
+ * spawn_helper_prepare_reexec:
+ *
+ * Arrange for the spawn helper to be kept by the init we re-exec:
+ * our end of its socket is left open over the exec, and passed to the
+ * new instance with --spawn-helper-fd.
+ **/
+void
+spawn_helper_prepare_reexec (void)
+{
+	nih_local char *fd_str = NULL;
+
+	nih_assert (args_copy);
+
+	if (spawn_helper_fd == -1)
+		return;
+
+	if (state_modify_cloexec (spawn_helper_fd, FALSE) < 0)
+		return;
+
+	fd_str = NIH_MUST (nih_sprintf (NULL, "--spawn-helper-fd=%d",
+					spawn_helper_fd));
+	NIH_MUST (nih_str_array_add (&args_copy, NULL, NULL, fd_str));
+}
+
+/**
+ * spawn_helper_server:
+ * @sock: socket connected to init.
+ *
+ * Run as the spawn helper, forking a job process for each request
+ * received on @sock until init closes its end.
+ *
+ * Returns: exit status.
+ **/
+int
+spawn_helper_server (int sock)
+{
+	nih_assert (sock >= 0);
+
+	(void)state_modify_cloexec (sock, TRUE);
+
+	for (;;) {
+		ssize_t len;
+
+		len = recv (sock, NULL, 0, MSG_PEEK | MSG_TRUNC);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			nih_error ("%s: %s", _("Unable to receive request"),
+				   strerror (errno));
+			return 1;
+		}
+
+		/* init has gone away */
+		if (! len)
+			return 0;
+
+		spawn_helper_receive (sock, len);
+	}
+}
+
+/**
+ * spawn_helper_receive:
+ * @sock: socket connected to init,
+ * @len: length of waiting message.
+ *
+ * Called within the spawn helper to handle the SpawnHelperRequest of
+ * @len bytes waiting on @sock, sending a SpawnHelperReply in return.
+ **/
+static void
+spawn_helper_receive (int    sock,
+		      size_t len)
+{
+	nih_local char  *buf = NULL;
+	char             control[CMSG_SPACE (SPAWN_HELPER_MAX_FDS * sizeof (int))];
+	int              fds[SPAWN_HELPER_MAX_FDS];
+	int              nfds = 0;
+	struct iovec     iov;
+	struct msghdr    hdr;
+	struct cmsghdr  *cmsg;
+	SpawnHelperReply reply;
+	ssize_t          ret;
+
+	nih_assert (sock >= 0);
+
+	buf = NIH_MUST (nih_alloc (NULL, len));
+
+	iov.iov_base = buf;
+	iov.iov_len  = len;
+
+	memset (&hdr, '\0', sizeof (hdr));
+	hdr.msg_iov        = &iov;
+	hdr.msg_iovlen     = 1;
+	hdr.msg_control    = control;
+	hdr.msg_controllen = sizeof (control);
+
+	do {
+		ret = recvmsg (sock, &hdr, MSG_CMSG_CLOEXEC);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return;
+
+	for (cmsg = CMSG_FIRSTHDR (&hdr); cmsg;
+	     cmsg = CMSG_NXTHDR (&hdr, cmsg)) {
+		size_t n;
+
+		if ((cmsg->cmsg_level != SOL_SOCKET)
+		    || (cmsg->cmsg_type != SCM_RIGHTS))
+			continue;
+
+		n = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+		for (size_t i = 0; i < n; i++) {
+			int fd;
+
+			memcpy (&fd, CMSG_DATA (cmsg) + i * sizeof (int),
+				sizeof (int));
+
+			if (nfds < SPAWN_HELPER_MAX_FDS) {
+				fds[nfds++] = fd;
+			} else {
+				close (fd);
+			}
+		}
+	}
+
+	if (((size_t)ret != len) || (hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+		reply.pid = -1;
+		reply.errnum = EINVAL;
+	} else {
+		reply.pid = spawn_helper_fork (buf, len, fds, nfds);
+		reply.errnum = (reply.pid < 0) ? errno : 0;
+	}
+
+	for (int i = 0; i < nfds; i++)
+		close (fds[i]);
+
+	do {
+		ret = send (sock, &reply, sizeof (reply), MSG_NOSIGNAL);
+	} while (ret < 0 && errno == EINTR);
+}
+
+/**
+ * spawn_helper_next:
+ * @p: pointer to position in message,
+ * @end: end of message.
+ *
+ * Returns: next nul-terminated string of message, advancing @p past it,
+ * or NULL if the message ends first.
+ **/
+static const char *
+spawn_helper_next (const char **p,
+		   const char  *end)
+{
+	const char *str;
+	const char *nul;
+
+	nih_assert (p != NULL);
+	nih_assert (*p != NULL);
+
+	nul = memchr (*p, '\0', end - *p);
+	if (! nul)
+		return NULL;
+
+	str = *p;
+	*p = nul + 1;
+
+	return str;
+}
+
+/**
+ * spawn_helper_fork:
+ * @buf: SpawnHelperRequest received,
+ * @len: length of @buf,
+ * @fds: descriptors received,
+ * @nfds: number of entries in @fds.
+ *
+ * Called within the spawn helper to fork the job process described by
+ * @buf.  The process is cloned with CLONE_PARENT so that it is a child
+ * of init, which reaps and traces it as normal, and it then runs
+ * job_process_spawn_child() for a job class built from @buf.
+ *
+ * Returns: process id of new process, or -1 on failure with errno set.
+ **/
+static pid_t
+spawn_helper_fork (const char *buf,
+		   size_t      len,
+		   const int  *fds,
+		   int         nfds)
+{
+	SpawnHelperRequest  req;
+	const char         *strings[SPAWN_HELPER_STRING_LAST];
+	const char         *p;
+	const char         *end;
+	nih_local JobClass *class = NULL;
+	char              **argv;
+	char              **env;
+	int                 pty_master = -1;
+	int                 script_fd = -1;
+	sigset_t            child_set, orig_set;
+	pid_t               pid;
+	int                 saved_errno;
+
+	nih_assert (buf != NULL);
+	nih_assert (fds != NULL);
+
+	if (len < sizeof (req))
+		goto invalid;
+
+	memcpy (&req, buf, sizeof (req));
+	p = buf + sizeof (req);
+	end = buf + len;
+
+	if ((req.process < 0) || (req.process >= PROCESS_LAST)
+	    || (! req.argc) || (req.argc > len) || (req.envc > len))
+		goto invalid;
+
+	if (nfds != (1 + (req.console == CONSOLE_LOG) + (req.has_script != 0)))
+		goto invalid;
+
+	if (req.console == CONSOLE_LOG)
+		pty_master = fds[1];
+
+	if (req.has_script)
+		script_fd = fds[nfds - 1];
+
+	class = NIH_MUST (job_class_new (NULL, "spawn-helper", NULL));
+
+	for (int i = 0; i < SPAWN_HELPER_STRING_LAST; i++) {
+		strings[i] = NULL;
+
+		if (! (req.strings_set & (1U << i)))
+			continue;
+
+		strings[i] = spawn_helper_next (&p, end);
+		if (! strings[i])
+			goto invalid;
+	}
+
+	argv = NIH_MUST (nih_alloc (class, sizeof (char *) * (req.argc + 1)));
+	for (size_t i = 0; i < req.argc; i++) {
+		argv[i] = (char *)spawn_helper_next (&p, end);
+		if (! argv[i])
+			goto invalid;
+	}
+	argv[req.argc] = NULL;
+
+	env = NIH_MUST (nih_alloc (class, sizeof (char *) * (req.envc + 1)));
+	for (size_t i = 0; i < req.envc; i++) {
+		env[i] = (char *)spawn_helper_next (&p, end);
+		if (! env[i])
+			goto invalid;
+	}
+	env[req.envc] = NULL;
+
+	class->console = req.console;
+	class->umask = req.umask;
+	class->nice = req.nice;
+	class->oom_score_adj = req.oom_score_adj;
+
+	for (int i = 0; i < RLIMIT_NLIMITS; i++) {
+		if (! (req.limits_set & (1U << i)))
+			continue;
+
+		class->limits[i] = NIH_MUST (nih_new (class, struct rlimit));
+		*class->limits[i] = req.limits[i];
+	}
+
+	if (strings[SPAWN_HELPER_SETUID])
+		class->setuid = NIH_MUST (nih_strdup (class, strings[SPAWN_HELPER_SETUID]));
+	if (strings[SPAWN_HELPER_SETGID])
+		class->setgid = NIH_MUST (nih_strdup (class, strings[SPAWN_HELPER_SETGID]));
+	if (strings[SPAWN_HELPER_CHROOT])
+		class->chroot = NIH_MUST (nih_strdup (class, strings[SPAWN_HELPER_CHROOT]));
+	if (strings[SPAWN_HELPER_CHDIR])
+		class->chdir = NIH_MUST (nih_strdup (class, strings[SPAWN_HELPER_CHDIR]));
+	if (strings[SPAWN_HELPER_APPARMOR_SWITCH])
+		class->apparmor_switch = NIH_MUST (nih_strdup (class, strings[SPAWN_HELPER_APPARMOR_SWITCH]));
+
+	/* The child's setup depends on this, and we run as a plain copy
+	 * of init.
+	 */
+	user_mode = req.user_mode;
+
+	sigfillset (&child_set);
+	sigprocmask (SIG_BLOCK, &child_set, &orig_set);
+
+	/* With no stack given, clone behaves as fork() does; the argument
+	 * order only matters for those that are zero.
+	 */
+	pid = syscall (SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+	if (! pid)
+		job_process_spawn_child (NULL, class, argv, env, FALSE,
+					 script_fd, req.process, -1, fds[0],
+					 pty_master, &orig_set);
+
+	saved_errno = errno;
+	sigprocmask (SIG_SETMASK, &orig_set, NULL);
+	errno = saved_errno;
+
+	return pid;
+
+invalid:
+	nih_warn ("%s", _("Ignoring invalid message from init"));
+	errno = EINVAL;
+	return -1;
+}
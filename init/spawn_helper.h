@@ -0,0 +1,114 @@
+/* upstart
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INIT_SPAWN_HELPER_H
+#define INIT_SPAWN_HELPER_H
+
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#include <nih/macros.h>
+
+#include "process.h"
+#include "job.h"
+
+
+/**
+ * SpawnHelperString:
+ *
+ * Optional strings of the job class that follow a SpawnHelperRequest,
+ * in this order, for those set in its strings_set mask.
+ **/
+typedef enum spawn_helper_string {
+	SPAWN_HELPER_SETUID,
+	SPAWN_HELPER_SETGID,
+	SPAWN_HELPER_CHROOT,
+	SPAWN_HELPER_CHDIR,
+	SPAWN_HELPER_APPARMOR_SWITCH,
+	SPAWN_HELPER_STRING_LAST,
+} SpawnHelperString;
+
+/**
+ * SpawnHelperRequest:
+ * @process: job process to spawn,
+ * @console: console type of job class,
+ * @user_mode: TRUE if init is a Session Init,
+ * @umask: file mode creation mask of job class,
+ * @nice: nice level of job class,
+ * @oom_score_adj: OOM killer score of job class,
+ * @has_script: TRUE if a script fd is passed,
+ * @limits_set: mask of the resource limits set in @limits,
+ * @limits: resource limits of job class,
+ * @strings_set: mask of the SpawnHelperString values that follow,
+ * @argc: number of arguments that follow,
+ * @envc: number of environment variables that follow.
+ *
+ * Fixed header of a message sent by init to the spawn helper asking it
+ * to spawn a job process, followed by the nul-terminated strings that
+ * @strings_set, @argc and @envc count.  The writing end of the error
+ * pipe, the pty master fd if @console is CONSOLE_LOG and the script fd
+ * if @has_script are passed, in that order, as SCM_RIGHTS ancillary
+ * data.
+ **/
+typedef struct spawn_helper_request {
+	int           process;
+	int           console;
+	int           user_mode;
+	mode_t        umask;
+	int           nice;
+	int           oom_score_adj;
+	int           has_script;
+	unsigned int  limits_set;
+	struct rlimit limits[RLIMIT_NLIMITS];
+	unsigned int  strings_set;
+	size_t        argc;
+	size_t        envc;
+} SpawnHelperRequest;
+
+/**
+ * SpawnHelperReply:
+ * @pid: process id of spawned process, or -1,
+ * @errnum: errno value if @pid is -1.
+ *
+ * Message sent by the spawn helper in reply to each SpawnHelperRequest.
+ **/
+typedef struct spawn_helper_reply {
+	pid_t pid;
+	int   errnum;
+} SpawnHelperReply;
+
+
+NIH_BEGIN_EXTERN
+
+extern int spawn_helper;
+extern int spawn_helper_fd;
+
+int   spawn_helper_start          (void)
+	__attribute__ ((warn_unused_result));
+int   spawn_helper_wanted         (Job *job, ProcessType process,
+				   int trace)
+	__attribute__ ((warn_unused_result));
+pid_t spawn_helper_spawn          (Job *job, ProcessType process,
+				   char * const argv[], char * const *env,
+				   int script_fd, int error_fd, int pty_master)
+	__attribute__ ((warn_unused_result));
+void  spawn_helper_prepare_reexec (void);
+int   spawn_helper_server         (int sock)
+	__attribute__ ((warn_unused_result));
+
+NIH_END_EXTERN
+
+#endif /* INIT_SPAWN_HELPER_H */
@@ -0,0 +1,525 @@
+/* upstart
+ *
+ * spawn_limit.c - admission control of jobs spawning processes
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/main.h>
+#include <nih/timer.h>
+#include <nih/logging.h>
+
+#include "job.h"
+#include "job_class.h"
+#include "metrics.h"
+#include "spawn_limit.h"
+
+
+/* Prototypes for static functions */
+static int          spawn_limit_effective (void)
+	__attribute__ ((warn_unused_result));
+static void         spawn_limit_take      (Job *job, uint64_t queued);
+static void         spawn_limit_queue     (Job *job);
+static SpawnWaiter *spawn_waiter_find     (Job *job)
+	__attribute__ ((warn_unused_result));
+static int          spawn_waiter_destroy  (SpawnWaiter *waiter);
+static void         spawn_limit_overdue   (void);
+static void         spawn_limit_timer_expired (void *data, NihTimer *timer);
+
+
+/**
+ * spawn_limit:
+ *
+ * Number of instances that may be spawning their processes at once, from
+ * leaving the starting state until running or stopping, or zero for no
+ * limit.
+ **/
+int spawn_limit = 0;
+
+/**
+ * spawn_limit_load:
+ *
+ * TRUE if spawn_limit should be lowered in proportion while the load
+ * average is greater than the number of processors online.
+ **/
+int spawn_limit_load = FALSE;
+
+/**
+ * spawn_limit_wait:
+ *
+ * Seconds an instance may wait to be admitted before it is admitted
+ * regardless of the limit, or zero to wait for as long as it takes.
+ * Those spawning may be waiting on the instance themselves, such as a
+ * pre-start script that runs "start" for another job, and would never
+ * finish otherwise.
+ **/
+int spawn_limit_wait = 30;
+
+/**
+ * spawn_limit_active:
+ *
+ * Number of instances admitted that are still spawning their processes.
+ **/
+size_t spawn_limit_active = 0;
+
+/**
+ * spawn_limit_queued:
+ *
+ * Number of instances waiting to be admitted.
+ **/
+size_t spawn_limit_queued = 0;
+
+/**
+ * spawn_limit_queue_peak:
+ *
+ * Most instances there have been waiting to be admitted at once.
+ **/
+size_t spawn_limit_queue_peak = 0;
+
+/**
+ * spawn_queue:
+ *
+ * List of SpawnWaiter in the order they will be admitted: by the
+ * priority of their class, highest first, and the order they were queued
+ * in within each priority.
+ **/
+NihList *spawn_queue = NULL;
+
+/**
+ * spawn_limit_timer:
+ *
+ * Timer that wakes us when the longest waiting instance has waited for
+ * spawn_limit_wait seconds, or NULL if none is set.
+ **/
+static NihTimer *spawn_limit_timer = NULL;
+
+
+/**
+ * spawn_limit_init:
+ *
+ * Initialise the spawn_queue list.
+ **/
+void
+spawn_limit_init (void)
+{
+	if (! spawn_queue)
+		spawn_queue = NIH_MUST (nih_list_new (NULL));
+}
+
+
+/**
+ * spawn_limit_effective:
+ *
+ * While spawn_limit_load is set and the load average over the last
+ * minute is greater than the number of processors online, spawn_limit
+ * is scaled down by the ratio between them; never below one, so that
+ * instances keep being admitted.
+ *
+ * Returns: number of instances that may be spawning at once now.
+ **/
+static int
+spawn_limit_effective (void)
+{
+	double load;
+	long   cpus;
+	int    limit;
+
+	nih_assert (spawn_limit > 0);
+
+	if (! spawn_limit_load)
+		return spawn_limit;
+
+	if (getloadavg (&load, 1) != 1)
+		return spawn_limit;
+
+	cpus = sysconf (_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+
+	if (load <= cpus)
+		return spawn_limit;
+
+	limit = (int)(spawn_limit * cpus / load);
+
+	return limit > 0 ? limit : 1;
+}
+
+/**
+ * spawn_limit_take:
+ * @job: instance to admit,
+ * @queued: time it was queued, or zero if it never was.
+ *
+ * Count @job as spawning and record the time it waited.
+ **/
+static void
+spawn_limit_take (Job      *job,
+		  uint64_t  queued)
+{
+	nih_assert (job != NULL);
+	nih_assert (! job->spawn_admitted);
+
+	job->spawn_admitted = TRUE;
+	spawn_limit_active++;
+
+	metrics_record (METRICS_ADMISSION_LATENCY,
+			queued ? job_timing_now () - queued : 0);
+}
+
+
+/**
+ * spawn_limit_queue:
+ * @job: instance to queue.
+ *
+ * Add @job to spawn_queue ahead of the first waiter of lower priority,
+ * unless it's already there.
+ **/
+static void
+spawn_limit_queue (Job *job)
+{
+	SpawnWaiter *waiter;
+	NihList     *before;
+
+	nih_assert (job != NULL);
+
+	if (spawn_waiter_find (job))
+		return;
+
+	waiter = NIH_MUST (nih_new (spawn_queue, SpawnWaiter));
+
+	nih_list_init (&waiter->entry);
+	nih_alloc_set_destructor (waiter, spawn_waiter_destroy);
+
+	waiter->job = job;
+	waiter->priority = job->class->priority;
+	waiter->queued = job_timing_now ();
+
+	before = spawn_queue;
+	NIH_LIST_FOREACH (spawn_queue, iter) {
+		SpawnWaiter *other = (SpawnWaiter *)iter;
+
+		if (other->priority < waiter->priority) {
+			before = &other->entry;
+			break;
+		}
+	}
+
+	nih_list_add (before, &waiter->entry);
+
+	spawn_limit_queued++;
+	if (spawn_limit_queued > spawn_limit_queue_peak)
+		spawn_limit_queue_peak = spawn_limit_queued;
+
+	nih_debug ("Queued %s to spawn with %zu others spawning",
+		   job_name (job), spawn_limit_active);
+}
+
+
+/**
+ * spawn_limit_admit:
+ * @job: instance about to leave the starting state.
+ *
+ * Called as @job is about to leave the starting state for its first
+ * process.  @job is admitted if it already was, if there is no limit, or
+ * if no others are waiting and fewer than the limit are spawning now;
+ * otherwise it is queued by the priority of its class and left in the
+ * starting state until spawn_limit_poll() admits it.
+ *
+ * Returns: TRUE if @job may spawn its processes now, FALSE if it has
+ * been queued.
+ **/
+int
+spawn_limit_admit (Job *job)
+{
+	nih_assert (job != NULL);
+
+	spawn_limit_init ();
+
+	if (job->spawn_admitted || (spawn_limit <= 0))
+		return TRUE;
+
+	if (NIH_LIST_EMPTY (spawn_queue)
+	    && (spawn_limit_active < (size_t)spawn_limit_effective ())) {
+		spawn_limit_take (job, 0);
+		return TRUE;
+	}
+
+	spawn_limit_queue (job);
+
+	return FALSE;
+}
+
+/**
+ * spawn_limit_cancel:
+ * @job: instance that may be queued.
+ *
+ * Remove @job from spawn_queue, if it's there, when its goal is changed
+ * or it's freed before being admitted.
+ *
+ * Returns: TRUE if @job was queued, FALSE if not.
+ **/
+int
+spawn_limit_cancel (Job *job)
+{
+	SpawnWaiter *waiter;
+
+	nih_assert (job != NULL);
+
+	if (! spawn_queue)
+		return FALSE;
+
+	waiter = spawn_waiter_find (job);
+	if (! waiter)
+		return FALSE;
+
+	nih_free (waiter);
+
+	return TRUE;
+}
+
+/**
+ * spawn_limit_release:
+ * @job: instance leaving the spawning states.
+ *
+ * Called as @job becomes running or starts to stop, or is freed, to stop
+ * counting it as spawning if it was admitted so that the next waiting
+ * may be.
+ **/
+void
+spawn_limit_release (Job *job)
+{
+	nih_assert (job != NULL);
+
+	if (! job->spawn_admitted)
+		return;
+
+	job->spawn_admitted = FALSE;
+	if (spawn_limit_active)
+		spawn_limit_active--;
+
+	if (spawn_queue && (! NIH_LIST_EMPTY (spawn_queue)))
+		nih_main_loop_interrupt ();
+}
+
+
+/**
+ * spawn_limit_poll:
+ * @data: not used,
+ * @func: main loop function.
+ *
+ * Admit as many waiting instances as the limit now allows, in the order
+ * they are queued, moving each on from the starting state; then admit
+ * any that have waited longer than spawn_limit_wait regardless.
+ *
+ * Called each time through the main loop, before the event queue is
+ * processed.
+ **/
+void
+spawn_limit_poll (void            *data,
+		  NihMainLoopFunc *func)
+{
+	int limit;
+
+	if ((! spawn_queue) || NIH_LIST_EMPTY (spawn_queue))
+		return;
+
+	limit = spawn_limit > 0 ? spawn_limit_effective () : 0;
+
+	while ((! NIH_LIST_EMPTY (spawn_queue))
+	       && ((limit <= 0) || (spawn_limit_active < (size_t)limit))) {
+		SpawnWaiter *waiter = (SpawnWaiter *)spawn_queue->next;
+		Job         *job = waiter->job;
+		uint64_t     queued = waiter->queued;
+
+		nih_free (waiter);
+
+		if (limit > 0)
+			spawn_limit_take (job, queued);
+
+		job_change_state (job, job_next_state (job));
+	}
+
+	if (limit > 0)
+		spawn_limit_overdue ();
+}
+
+/**
+ * spawn_limit_overdue:
+ *
+ * Admit every waiting instance that has waited for spawn_limit_wait
+ * seconds, even beyond the limit, and set spawn_limit_timer to wake us
+ * when the next of those still waiting will have.
+ **/
+static void
+spawn_limit_overdue (void)
+{
+	uint64_t now;
+	uint64_t wait;
+	uint64_t oldest = 0;
+
+	if (spawn_limit_wait <= 0)
+		return;
+
+	now = job_timing_now ();
+	wait = (uint64_t)spawn_limit_wait * 1000000;
+
+	NIH_LIST_FOREACH_SAFE (spawn_queue, iter) {
+		SpawnWaiter *waiter = (SpawnWaiter *)iter;
+		Job         *job = waiter->job;
+		uint64_t     queued = waiter->queued;
+
+		if (now - queued < wait) {
+			if ((! oldest) || (queued < oldest))
+				oldest = queued;
+			continue;
+		}
+
+		nih_warn (_("%s admitted to spawn after waiting %d seconds"),
+			  job_name (job), spawn_limit_wait);
+
+		nih_free (waiter);
+
+		spawn_limit_take (job, queued);
+		job_change_state (job, job_next_state (job));
+	}
+
+	if ((! oldest) || spawn_limit_timer)
+		return;
+
+	spawn_limit_timer = NIH_MUST (nih_timer_add_timeout (
+					      NULL,
+					      (time_t)((oldest + wait - now) / 1000000) + 1,
+					      spawn_limit_timer_expired, NULL));
+}
+
+/**
+ * spawn_limit_timer_expired:
+ * @data: not used,
+ * @timer: timer that expired.
+ *
+ * Called when an instance may have waited for spawn_limit_wait seconds;
+ * spawn_limit_poll() admits it as the main loop goes round again.
+ **/
+static void
+spawn_limit_timer_expired (void     *data,
+			   NihTimer *timer)
+{
+	/* The timer is freed once we return */
+	spawn_limit_timer = NULL;
+}
+
+/**
+ * spawn_limit_recover:
+ *
+ * Called once the state of jobs has been restored after a stateful
+ * re-exec, to count those still spawning their processes against the
+ * limit and queue those that were waiting to be admitted; those are
+ * left for spawn_limit_poll(), even if there is no longer a limit.
+ **/
+void
+spawn_limit_recover (void)
+{
+	job_class_init ();
+	spawn_limit_init ();
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		NIH_HASH_FOREACH (class->instances, job_iter) {
+			Job *job = (Job *)job_iter;
+
+			switch (job->state) {
+			case JOB_STARTING:
+				if ((job->goal == JOB_START) && (! job->blocker))
+					spawn_limit_queue (job);
+
+				break;
+			case JOB_SECURITY_SPAWNING:
+			case JOB_SECURITY:
+			case JOB_PRE_STARTING:
+			case JOB_PRE_START:
+			case JOB_SPAWNING:
+			case JOB_SPAWNED:
+			case JOB_POST_STARTING:
+			case JOB_POST_START:
+				if ((spawn_limit > 0) && (! job->spawn_admitted)) {
+					job->spawn_admitted = TRUE;
+					spawn_limit_active++;
+				}
+
+				break;
+			default:
+				break;
+			}
+		}
+	}
+}
+
+
+/**
+ * spawn_waiter_find:
+ * @job: instance to find.
+ *
+ * Returns: SpawnWaiter for @job in spawn_queue, or NULL if it isn't
+ * queued.
+ **/
+static SpawnWaiter *
+spawn_waiter_find (Job *job)
+{
+	nih_assert (job != NULL);
+	nih_assert (spawn_queue != NULL);
+
+	NIH_LIST_FOREACH (spawn_queue, iter) {
+		SpawnWaiter *waiter = (SpawnWaiter *)iter;
+
+		if (waiter->job == job)
+			return waiter;
+	}
+
+	return NULL;
+}
+
+/**
+ * spawn_waiter_destroy:
+ * @waiter: waiter being freed.
+ *
+ * Removes @waiter from spawn_queue.
+ *
+ * Returns: zero.
+ **/
+static int
+spawn_waiter_destroy (SpawnWaiter *waiter)
+{
+	nih_assert (waiter != NULL);
+
+	nih_list_destroy (&waiter->entry);
+
+	if (spawn_limit_queued)
+		spawn_limit_queued--;
+
+	return 0;
+}
@@ -0,0 +1,71 @@
+/* upstart
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INIT_SPAWN_LIMIT_H
+#define INIT_SPAWN_LIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nih/macros.h>
+#include <nih/list.h>
+#include <nih/main.h>
+
+#include "job.h"
+
+
+/**
+ * SpawnWaiter:
+ * @entry: list header,
+ * @job: instance waiting to be admitted,
+ * @priority: priority of its class when it was queued,
+ * @queued: time it was queued, in microseconds on CLOCK_MONOTONIC.
+ *
+ * An instance that has finished its starting event but is held in the
+ * starting state until fewer than spawn_limit others are spawning.
+ **/
+typedef struct spawn_waiter {
+	NihList   entry;
+	Job      *job;
+	int       priority;
+	uint64_t  queued;
+} SpawnWaiter;
+
+
+NIH_BEGIN_EXTERN
+
+extern int      spawn_limit;
+extern int      spawn_limit_load;
+extern int      spawn_limit_wait;
+extern size_t   spawn_limit_active;
+extern size_t   spawn_limit_queued;
+extern size_t   spawn_limit_queue_peak;
+extern NihList *spawn_queue;
+
+
+void spawn_limit_init    (void);
+
+int  spawn_limit_admit   (Job *job)
+	__attribute__ ((warn_unused_result));
+int  spawn_limit_cancel  (Job *job);
+void spawn_limit_release (Job *job);
+
+void spawn_limit_poll    (void *data, NihMainLoopFunc *func);
+void spawn_limit_recover (void);
+
+NIH_END_EXTERN
+
+#endif /* INIT_SPAWN_LIMIT_H */
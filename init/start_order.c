@@ -0,0 +1,447 @@
+/* upstart
+ *
+ * start_order.c - ordering of job starts by their dependency chains
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/tree.h>
+#include <nih/logging.h>
+
+#include "event_operator.h"
+#include "job_class.h"
+#include "start_order.h"
+
+
+/**
+ * StartOrderNode:
+ * @entry: list header,
+ * @name: name of @class,
+ * @class: registered job class,
+ * @dependants: list of NihListEntry structures whose data member is the
+ *  node of a class whose start on condition names an event of @class,
+ * @height: number of jobs in the longest chain started from @class,
+ *  including itself, or zero if not yet measured,
+ * @visiting: TRUE while the chains from @class are being measured,
+ * @next: first dependant in that longest chain, or NULL.
+ *
+ * Vertex of the graph of job classes built by start_order_update().
+ **/
+typedef struct start_order_node {
+	NihList                  entry;
+	const char              *name;
+	JobClass                *class;
+	NihList                  dependants;
+	int                      height;
+	int                      visiting;
+	struct start_order_node *next;
+} StartOrderNode;
+
+/**
+ * StartOrderItem:
+ * @entry: entry of an event index,
+ * @height: height of its class,
+ * @pos: position of @entry in the index.
+ *
+ * Used by start_order_sort() to order an event index.
+ **/
+typedef struct start_order_item {
+	NihListEntry *entry;
+	int           height;
+	size_t        pos;
+} StartOrderItem;
+
+
+/* Prototypes for static functions */
+static void  start_order_edges  (NihHash *nodes, StartOrderNode *node);
+static void  start_order_edge   (StartOrderNode *from, StartOrderNode *to);
+static int   start_order_height (StartOrderNode *node);
+static void  start_order_sort   (NihList *classes, NihHash *nodes);
+static int   start_order_cmp    (const void *a, const void *b);
+
+
+/**
+ * start_order_report:
+ *
+ * If TRUE, the critical path found by start_order_update() is logged
+ * each time the configuration has changed.
+ **/
+int start_order_report = FALSE;
+
+/**
+ * start_order_dirty:
+ *
+ * TRUE if the job classes have changed since start_order_update() was
+ * last called.
+ **/
+static int start_order_dirty = TRUE;
+
+/**
+ * start_order_path:
+ *
+ * Names of the jobs in the critical path found by start_order_update(),
+ * separated by arrows, or NULL if no job is started by another.
+ **/
+static char *start_order_path = NULL;
+
+/**
+ * start_order_path_len:
+ *
+ * Number of jobs in start_order_path.
+ **/
+static size_t start_order_path_len = 0;
+
+
+/**
+ * start_order_invalidate:
+ *
+ * Note that the start on conditions of the registered job classes have
+ * changed, so that start_order_update() repeats its analysis.
+ **/
+void
+start_order_invalidate (void)
+{
+	start_order_dirty = TRUE;
+}
+
+/**
+ * start_order_update:
+ *
+ * Analyse the start on conditions of the registered job classes, if they
+ * have changed, for chains of jobs each started by a starting, started,
+ * stopping or stopped event of the one before.  Each chain is run one
+ * job after another, however many processes are spawned at once, so the
+ * longest of them, the critical path, bounds how quickly the jobs can
+ * all be started.
+ *
+ * The classes that an event is offered to are then ordered so that those
+ * heading the longest chains are offered it first: when one event starts
+ * many independent jobs, their processes are spawned within the same
+ * pass of event_poll() regardless, but those the most jobs wait on are
+ * spawned earliest.  The order is otherwise left as it was, and the
+ * conditions themselves are unaffected.
+ *
+ * The critical path is logged when start_order_report is TRUE.
+ **/
+void
+start_order_update (void)
+{
+	nih_local NihHash *nodes = NULL;
+	StartOrderNode    *longest = NULL;
+
+	if (! start_order_dirty)
+		return;
+
+	start_order_dirty = FALSE;
+
+	job_class_init ();
+
+	nodes = NIH_MUST (nih_hash_string_new (NULL, 0));
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass       *class = (JobClass *)iter;
+		StartOrderNode *node;
+
+		node = NIH_MUST (nih_new (nodes, StartOrderNode));
+
+		nih_list_init (&node->entry);
+		node->name = class->name;
+		node->class = class;
+		nih_list_init (&node->dependants);
+		node->height = 0;
+		node->visiting = FALSE;
+		node->next = NULL;
+
+		nih_hash_add (nodes, &node->entry);
+	}
+
+	NIH_HASH_FOREACH (nodes, iter)
+		start_order_edges (nodes, (StartOrderNode *)iter);
+
+	/* Of chains of the same length, report the first by name so that
+	 * the report doesn't change with the order of the hash.
+	 */
+	NIH_HASH_FOREACH (nodes, iter) {
+		StartOrderNode *node = (StartOrderNode *)iter;
+		int             height;
+
+		height = start_order_height (node);
+		if ((! longest) || (height > longest->height)
+		    || ((height == longest->height)
+			&& (strcmp (node->name, longest->name) < 0)))
+			longest = node;
+	}
+
+	NIH_HASH_FOREACH (job_class_events, iter) {
+		JobClassEventIndex *index = (JobClassEventIndex *)iter;
+
+		start_order_sort (&index->classes, nodes);
+	}
+
+	if (start_order_path)
+		nih_free (start_order_path);
+	start_order_path = NULL;
+	start_order_path_len = 0;
+
+	if (longest && (longest->height > 1)) {
+		start_order_path = NIH_MUST (nih_strdup (NULL, longest->name));
+		start_order_path_len = 1;
+
+		for (StartOrderNode *node = longest->next; node;
+		     node = node->next) {
+			NIH_MUST (nih_strcat_sprintf (&start_order_path, NULL,
+						      " -> %s", node->name));
+			start_order_path_len++;
+		}
+	}
+
+	if (! start_order_report)
+		return;
+
+	if (start_order_path) {
+		nih_message (_("Critical start path of %zu jobs: %s"),
+			     start_order_path_len, start_order_path);
+	} else {
+		nih_message (_("No job is started by another"));
+	}
+}
+
+/**
+ * start_order_critical_path:
+ * @len: set to the number of jobs in the path, or NULL.
+ *
+ * Brings the analysis of start_order_update() up to date and returns the
+ * critical path it found.
+ *
+ * Returns: names of the jobs in the path separated by arrows, or NULL
+ * if no job is started by another.
+ **/
+const char *
+start_order_critical_path (size_t *len)
+{
+	start_order_update ();
+
+	if (len)
+		*len = start_order_path_len;
+
+	return start_order_path;
+}
+
+
+/**
+ * start_order_edges:
+ * @nodes: nodes of the graph,
+ * @node: node to add edges to.
+ *
+ * Adds @node as a dependant of the node of each class named by the job
+ * events in the start on condition of its class; names may be patterns,
+ * which are only matched against every node when they contain wildcards.
+ **/
+static void
+start_order_edges (NihHash        *nodes,
+		   StartOrderNode *node)
+{
+	EventOperator *start_on;
+
+	nih_assert (nodes != NULL);
+	nih_assert (node != NULL);
+
+	start_on = node->class->start_on;
+	if (! start_on)
+		return;
+
+	NIH_TREE_FOREACH_POST (&start_on->node, iter) {
+		EventOperator  *oper = (EventOperator *)iter;
+		StartOrderNode *from;
+		const char     *pattern;
+
+		pattern = event_operator_job (oper);
+		if (! pattern)
+			continue;
+
+		if (! strpbrk (pattern, "*?[\\")) {
+			from = (StartOrderNode *)nih_hash_lookup (nodes,
+								  pattern);
+			if (from)
+				start_order_edge (from, node);
+
+			continue;
+		}
+
+		NIH_HASH_FOREACH (nodes, from_iter) {
+			from = (StartOrderNode *)from_iter;
+
+			if (! fnmatch (pattern, from->name, 0))
+				start_order_edge (from, node);
+		}
+	}
+}
+
+/**
+ * start_order_edge:
+ * @from: node whose events start @to,
+ * @to: dependant node.
+ *
+ * Adds @to to the dependants of @from, unless they are the same.
+ **/
+static void
+start_order_edge (StartOrderNode *from,
+		  StartOrderNode *to)
+{
+	NihListEntry *entry;
+
+	nih_assert (from != NULL);
+	nih_assert (to != NULL);
+
+	if (from == to)
+		return;
+
+	entry = NIH_MUST (nih_list_entry_new (from));
+	entry->data = to;
+
+	nih_list_add (&from->dependants, &entry->entry);
+}
+
+/**
+ * start_order_height:
+ * @node: node to measure.
+ *
+ * Measures the longest chain of dependants from @node, recording it in
+ * the height and next members of each node along it.  A dependant that
+ * leads back to a node still being measured is not counted, since such
+ * a cycle can never be completed.
+ *
+ * Returns: height of @node, or zero when it is part of a cycle being
+ * measured.
+ **/
+static int
+start_order_height (StartOrderNode *node)
+{
+	int best = 0;
+
+	nih_assert (node != NULL);
+
+	if (node->height)
+		return node->height;
+
+	if (node->visiting)
+		return 0;
+
+	node->visiting = TRUE;
+
+	NIH_LIST_FOREACH (&node->dependants, iter) {
+		StartOrderNode *dependant;
+		int             height;
+
+		dependant = (StartOrderNode *)((NihListEntry *)iter)->data;
+
+		height = start_order_height (dependant);
+		if ((height > best)
+		    || (height && (height == best)
+			&& (strcmp (dependant->name, node->next->name) < 0))) {
+			best = height;
+			node->next = dependant;
+		}
+	}
+
+	node->visiting = FALSE;
+	node->height = best + 1;
+
+	return node->height;
+}
+
+/**
+ * start_order_sort:
+ * @classes: list of NihListEntry structures of an event index,
+ * @nodes: nodes of the graph.
+ *
+ * Reorders @classes so that those with the greatest height come first,
+ * otherwise leaving them in the order they were in.
+ **/
+static void
+start_order_sort (NihList *classes,
+		  NihHash *nodes)
+{
+	nih_local StartOrderItem *items = NULL;
+	size_t                    len = 0;
+	size_t                    pos = 0;
+
+	nih_assert (classes != NULL);
+	nih_assert (nodes != NULL);
+
+	NIH_LIST_FOREACH (classes, iter)
+		len++;
+
+	if (len < 2)
+		return;
+
+	items = NIH_MUST (nih_alloc (NULL, sizeof (StartOrderItem) * len));
+
+	NIH_LIST_FOREACH (classes, iter) {
+		NihListEntry   *entry = (NihListEntry *)iter;
+		JobClass       *class = (JobClass *)entry->data;
+		StartOrderNode *node;
+
+		node = (StartOrderNode *)nih_hash_lookup (nodes, class->name);
+
+		items[pos].entry = entry;
+		items[pos].height = ((node && (node->class == class))
+				     ? node->height : 0);
+		items[pos].pos = pos;
+		pos++;
+	}
+
+	qsort (items, len, sizeof (StartOrderItem), start_order_cmp);
+
+	for (size_t i = 0; i < len; i++)
+		nih_list_add (classes, &items[i].entry->entry);
+}
+
+/**
+ * start_order_cmp:
+ * @a: first item,
+ * @b: second item.
+ *
+ * Compares two StartOrderItem structures for qsort(), greatest height
+ * first and then by their original position.
+ *
+ * Returns: negative, zero or positive value as @a is before, the same as
+ * or after @b.
+ **/
+static int
+start_order_cmp (const void *a,
+		 const void *b)
+{
+	const StartOrderItem *item_a = a;
+	const StartOrderItem *item_b = b;
+
+	if (item_a->height != item_b->height)
+		return item_b->height - item_a->height;
+
+	return ((item_a->pos > item_b->pos) - (item_a->pos < item_b->pos));
+}
@@ -0,0 +1,38 @@
+/* upstart
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INIT_START_ORDER_H
+#define INIT_START_ORDER_H
+
+#include <stddef.h>
+
+#include <nih/macros.h>
+
+
+NIH_BEGIN_EXTERN
+
+extern int start_order_report;
+
+
+void        start_order_invalidate    (void);
+void        start_order_update        (void);
+
+const char *start_order_critical_path (size_t *len)
+	__attribute__ ((warn_unused_result));
+
+NIH_END_EXTERN
+
+#endif /* INIT_START_ORDER_H */
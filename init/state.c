@@ -31,11 +31,17 @@
 #include <sys/select.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fnmatch.h>
 
 #include <nih/macros.h>
 #include <nih/logging.h>
 #include <nih/string.h>
 #include <nih/io.h>
+#include <nih/child.h>
+#include <nih/error.h>
 
 #include "paths.h"
 #include "state.h"
@@ -47,6 +53,11 @@
 #include "blocked.h"
 #include "conf.h"
 #include "control.h"
+#include "job_process.h"
+#include "spawn_helper.h"
+#include "timer_wheel.h"
+#include "probes.h"
+#include "event_trace.h"
 
 #ifdef ENABLE_CGROUPS
 #include "cgroup.h"
@@ -88,8 +99,180 @@ int restart = FALSE;
  **/
 int write_state_file = FALSE;
 
+/**
+ * state_format:
+ *
+ * Format used to pass state to the new instance on stateful re-exec.
+ *
+ * STATE_FORMAT_BINARY is only understood by instances that support it,
+ * so must be asked for explicitly; the default of STATE_FORMAT_JSON
+ * allows re-exec into any version of init.
+ **/
+StateFormat state_format = STATE_FORMAT_JSON;
+
+/**
+ * StateBlob:
+ *
+ * @data: blob data,
+ * @len: length of @data.
+ *
+ * Raw data record read from STATE_FORMAT_BINARY state.
+ **/
+typedef struct state_blob {
+	const char *data;
+	size_t      len;
+} StateBlob;
+
+/**
+ * state_binary_buffer:
+ *
+ * Buffer that state_to_binary() is currently writing to; set only
+ * while serialising so that state_blob_add() can append raw records.
+ **/
+static NihIoBuffer *state_binary_buffer = NULL;
+
+/**
+ * state_blob_count:
+ *
+ * Number of blobs written to state_binary_buffer.
+ **/
+static size_t state_blob_count = 0;
+
+/**
+ * state_blobs:
+ *
+ * Blobs read from STATE_FORMAT_BINARY state, valid only during
+ * deserialisation.
+ **/
+static StateBlob *state_blobs = NULL;
+static size_t     state_blobs_len = 0;
+
+/**
+ * state_reexec_stats:
+ *
+ * Timings of the most recent stateful re-exec.
+ **/
+StateReexecStats state_reexec_stats = { FALSE, 0, 0, 0, 0, 0, 0, 0 };
+
+/**
+ * state_reexec_begin:
+ *
+ * Time at which the old instance began the stateful re-exec, or zero
+ * if unknown.
+ **/
+static uint64_t state_reexec_begin = 0;
+
+/**
+ * state_read_begin:
+ *
+ * Time at which state_read() was called, or zero if not reading state
+ * for a re-exec.
+ **/
+static uint64_t state_read_begin = 0;
+
+/**
+ * state_checkpoint_interval:
+ *
+ * Least number of milliseconds between checkpoints of state to
+ * state_checkpoint_path(), or zero to not checkpoint state.
+ **/
+int state_checkpoint_interval = 0;
+
+/**
+ * state_forked:
+ *
+ * TRUE only in a child process serialising state for a checkpoint or
+ * snapshot, which must not have any effect outside it.
+ **/
+int state_forked = FALSE;
+
+/**
+ * state_generation:
+ *
+ * Counter advanced by state_touch() with each change to an event, job
+ * class or job, which records the value in its generation member so that
+ * state_to_string_filtered() can return only what changed since.
+ **/
+uint64_t state_generation = 0;
+
+/**
+ * state_passing_fds:
+ *
+ * TRUE while stateful_reexec() serialises state, when any file
+ * descriptor without FD_CLOEXEC set is inherited by the new instance
+ * and so can carry data in place of the serialisation itself.
+ **/
+int state_passing_fds = FALSE;
+
+/**
+ * state_checkpoint_dirty:
+ *
+ * TRUE if state has changed since the last checkpoint was begun.
+ **/
+static int state_checkpoint_dirty = FALSE;
+
+/**
+ * state_checkpoint_timer:
+ *
+ * Timer for the next checkpoint, or NULL if none is due.
+ **/
+static WheelTimer *state_checkpoint_timer = NULL;
+
+/**
+ * state_checkpoint_pid:
+ *
+ * Process writing a checkpoint, or zero if none is.
+ **/
+static pid_t state_checkpoint_pid = 0;
+
+/**
+ * state_checkpoint_fds:
+ *
+ * File descriptors, terminated by -1, that the last checkpoint written
+ * refers to (see job_class_reexec_fds()), or NULL before one has been.
+ * Must be kept in a form state_checkpoint_inherit_fds() can use from a
+ * signal handler.
+ **/
+static int *state_checkpoint_fds = NULL;
+
+/**
+ * StateSnapshot:
+ *
+ * @handler: function to call with state,
+ * @data: data pointer to pass to @handler.
+ *
+ * Snapshot being serialised by a child process of state_snapshot().
+ **/
+typedef struct state_snapshot {
+	StateSnapshotHandler  handler;
+	void                 *data;
+} StateSnapshot;
+
 /* Prototypes for static functions */
 static void state_write_file (NihIoBuffer *buffer);
+static void state_write_json_file (void);
+static void state_snapshot_child (int fd)
+	__attribute__ ((noreturn));
+static void state_snapshot_close (StateSnapshot *snapshot, NihIo *io);
+static void state_snapshot_error (StateSnapshot *snapshot, NihIo *io);
+static int state_write_path (const char *path, NihIoBuffer *buffer,
+			     int sync)
+	__attribute__ ((warn_unused_result));
+static void state_checkpoint_timer_cb (void *data, WheelTimer *timer);
+static void state_checkpoint_child (void)
+	__attribute__ ((noreturn));
+static void state_checkpoint_reaped (int *fds, pid_t pid,
+				     NihChildEvents event, int status);
+static void state_reexec_stats_begin (uint64_t now);
+static int state_from_json (json_object *json)
+	__attribute__ ((warn_unused_result));
+static int state_from_binary (const char *data, size_t len)
+	__attribute__ ((warn_unused_result));
+static json_object *state_placement_bits_serialise (const unsigned long *mask)
+	__attribute__ ((warn_unused_result));
+static int state_placement_bits_deserialise (json_object *json,
+					     unsigned long *mask)
+	__attribute__ ((warn_unused_result));
 
 /**
  * state_read:
@@ -113,6 +296,9 @@ state_read (int fd)
 
 	nih_assert (fd != -1);
 
+	state_read_begin = job_timing_now ();
+	state_reexec_stats_begin (state_read_begin);
+
 	state_get_timeout (timeout.tv_sec);
 	timeout.tv_usec = 0;
 
@@ -220,6 +406,7 @@ state_read_objects (int fd)
 	int                      initial_size = 4096;
 	nih_local NihIoBuffer   *buffer = NULL;
 	nih_local char          *buf = NULL;
+	uint64_t                 parse_begin;
 
 	nih_assert (fd != -1);
 
@@ -246,18 +433,41 @@ state_read_objects (int fd)
 			goto error;
 	} while (TRUE);
 
-	/* Recreate internal state from JSON */
-	if (state_from_string (buffer->buf) < 0)
-		goto error;
+	parse_begin = job_timing_now ();
 
-	if (write_state_file || getenv (STATE_FILE_ENV))
-		state_write_file (buffer);
+	if (buffer->len >= sizeof (StateBinaryHeader)
+	    && ! memcmp (buffer->buf, STATE_BINARY_MAGIC,
+			 sizeof (STATE_BINARY_MAGIC))) {
+		if (state_from_binary (buffer->buf, buffer->len) < 0)
+			goto error;
+
+		/* STATE_FILE is intended to be human-readable, so write
+		 * the state we recreated as JSON instead.
+		 */
+		if (write_state_file || getenv (STATE_FILE_ENV))
+			state_write_json_file ();
+	} else {
+		/* Recreate internal state from JSON */
+		if (state_from_string (buffer->buf) < 0)
+			goto error;
+
+		if (write_state_file || getenv (STATE_FILE_ENV))
+			state_write_file (buffer);
+	}
+
+	if (state_read_begin) {
+		state_reexec_stats.read = parse_begin - state_read_begin;
+		state_reexec_stats.parse = job_timing_now () - parse_begin
+			- state_reexec_stats.resolve_deps;
+		state_reexec_stats.valid = TRUE;
+		state_read_begin = 0;
+	}
 
 	return 0;
 
 error:
 	/* Failed to reconstruct internal state so attempt to write
-	 * the JSON state data to a file to allow for manual post
+	 * the state data to a file to allow for manual post
 	 * re-exec analysis.
 	 */
 	if (buffer->len && log_dir)
@@ -279,8 +489,6 @@ error:
 void
 state_write_file (NihIoBuffer *buffer)
 {
-	int              fd;
-	ssize_t          bytes;
 	nih_local char  *state_file = NULL;
 
 	nih_assert (buffer);
@@ -289,12 +497,72 @@ state_write_file (NihIoBuffer *buffer)
 	if (! state_file)
 		return;
 
+	(void)state_write_path (state_file, buffer, FALSE);
+}
+
+/**
+ * state_write_json_file:
+ *
+ * Serialise the current internal state as JSON and write it to
+ * STATE_FILE below log_dir, as is done with the JSON data read when
+ * the new instance was passed state in STATE_FORMAT_BINARY.
+ *
+ * Failures are logged but otherwise ignored.
+ **/
+static void
+state_write_json_file (void)
+{
+	nih_local char         *json_string = NULL;
+	nih_local NihIoBuffer  *buffer = NULL;
+	size_t                  len;
+
+	if (state_to_string (&json_string, &len) < 0)
+		goto error;
+
+	buffer = nih_io_buffer_new (NULL);
+	if (! buffer)
+		goto error;
+
+	if (nih_io_buffer_push (buffer, json_string, len) < 0)
+		goto error;
+
+	state_write_file (buffer);
+	return;
+
+error:
+	nih_warn ("%s: %s", _("Failed to write state file"),
+		  _("unable to serialise state"));
+}
+
+/**
+ * state_write_path:
+ *
+ * @path: path of file to write,
+ * @buffer: NihIoBuffer containing serialisation data,
+ * @sync: TRUE to synchronise the file to disk.
+ *
+ * Write the data contained in @buffer to @path, which is replaced,
+ * consuming the buffer.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+static int
+state_write_path (const char  *path,
+		  NihIoBuffer *buffer,
+		  int          sync)
+{
+	int      fd;
+	ssize_t  bytes;
+
+	nih_assert (path);
+	nih_assert (buffer);
+
 	/* Note the very restrictive permissions */
-	fd = open (state_file, (O_CREAT|O_WRONLY|O_TRUNC), S_IRUSR);
+	fd = open (path, (O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC), S_IRUSR);
 	if (fd < 0)
-		return;
+		return -1;
 
-	while (TRUE) {
+	while (buffer->len) {
 		bytes = write (fd, buffer->buf, buffer->len);
 
 		if (! bytes)
@@ -305,7 +573,15 @@ state_write_file (NihIoBuffer *buffer)
 			break;
 	}
 
-	close (fd);
+	if (buffer->len || (sync && fsync (fd) < 0)) {
+		close (fd);
+		return -1;
+	}
+
+	if (close (fd) < 0)
+		return -1;
+
+	return 0;
 }
 
 /**
@@ -335,50 +611,66 @@ state_write_objects (int fd, const char *state_data, size_t len)
 }
 
 /**
- * state_to_string:
+ * StateSectionHandler:
  *
- * @json_string; newly-allocated string,
- * @len: length of @json_string.
+ * @data: data pointer passed to state_serialise(),
+ * @name: name of section,
+ * @json: JSON value of section (may be NULL).
  *
- * Serialise internal data structures to a JSON string.
+ * Called by state_serialise() for each top-level section of state.
+ * The handler takes ownership of @json.
  *
  * Returns: 0 on success, -1 on error.
  **/
-int
-state_to_string (char **json_string, size_t *len)
+typedef int (*StateSectionHandler) (void *data, const char *name,
+				    json_object *json);
+
+/**
+ * state_serialise:
+ *
+ * @handler: function to call for each section,
+ * @data: data pointer to pass to @handler.
+ *
+ * Serialise internal data structures one top-level section at a time,
+ * passing each to @handler as soon as it is complete.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+static int
+state_serialise (StateSectionHandler handler, void *data)
 {
 	json_object  *json;
-	json_object  *json_job_environ;
 	json_object  *json_control_bus_address;
-	const char   *value;
 
 #ifdef ENABLE_CGROUPS
 	json_object  *json_cgroup_manager_address;
 #endif /* ENABLE_CGROUPS */
 
-	nih_assert (json_string);
-	nih_assert (len);
-
-	json = json_object_new_object ();
+	nih_assert (handler);
 
-	if (! json)
-		return -1;
+	/* Objects refer to each other by position, so index them up
+	 * front to avoid walking the lists for every reference.
+	 */
+	event_index_build ();
+	job_class_index_build ();
 
-	json_sessions = session_serialise_all ();
-	if (! json_sessions) {
+	json = session_serialise_all ();
+	if (! json) {
 		nih_error ("%s Sessions", _("Failed to serialise"));
 		goto error;
 	}
 
-	json_object_object_add (json, "sessions", json_sessions);
+	if (handler (data, "sessions", json) < 0)
+		goto error;
 
-	json_events = event_serialise_all ();
-	if (! json_events) {
+	json = event_serialise_all ();
+	if (! json) {
 		nih_error ("%s Events", _("Failed to serialise"));
 		goto error;
 	}
 
-	json_object_object_add (json, "events", json_events);
+	if (handler (data, "events", json) < 0)
+		goto error;
 
 	json_control_bus_address = control_serialise_bus_address ();
 
@@ -392,7 +684,8 @@ state_to_string (char **json_string, size_t *len)
 		goto error;
 	}
 
-	json_object_object_add (json, "control_bus_address", json_control_bus_address);
+	if (handler (data, "control_bus_address", json_control_bus_address) < 0)
+		goto error;
 
 #ifdef ENABLE_CGROUPS
 	json_cgroup_manager_address = cgroup_manager_serialise ();
@@ -407,36 +700,112 @@ state_to_string (char **json_string, size_t *len)
 		goto error;
 	}
 
-	json_object_object_add (json, "cgroup_manager_address", json_cgroup_manager_address);
+	if (handler (data, "cgroup_manager_address", json_cgroup_manager_address) < 0)
+		goto error;
 #endif /* ENABLE_CGROUPS */
 
-	json_job_environ = job_class_serialise_job_environ ();
+	json = control_serialise_runlevel ();
+	if (! json) {
+		nih_error ("%s %s",
+				_("Failed to serialise"),
+			       _("runlevel"));
+		goto error;
+	}
+
+	if (handler (data, "runlevel", json) < 0)
+		goto error;
+
+	json = job_class_serialise_job_environ ();
 
-	if (! json_job_environ) {
+	if (! json) {
 		nih_error ("%s global job environment",
 				_("Failed to serialise"));
 		goto error;
 	}
 
-	json_object_object_add (json, "job_environment", json_job_environ);
+	if (handler (data, "job_environment", json) < 0)
+		goto error;
 
-	json_classes = job_class_serialise_all ();
+	json = job_class_serialise_all ();
 
-	if (! json_classes) {
+	if (! json) {
 		nih_error ("%s JobClasses", _("Failed to serialise"));
 		goto error;
 	}
 
-	json_object_object_add (json, "job_classes", json_classes);
+	if (handler (data, "job_classes", json) < 0)
+		goto error;
 
-	json_conf_sources = conf_source_serialise_all ();
+	json = conf_source_serialise_all ();
 
-	if (! json_conf_sources) {
+	if (! json) {
 		nih_error ("%s ConfSources", _("Failed to serialise"));
 		goto error;
 	}
 
-	json_object_object_add (json, "conf_sources", json_conf_sources);
+	if (handler (data, "conf_sources", json) < 0)
+		goto error;
+
+	event_index_clear ();
+	job_class_index_clear ();
+
+	return 0;
+
+error:
+	event_index_clear ();
+	job_class_index_clear ();
+
+	return -1;
+}
+
+/**
+ * state_add_section:
+ *
+ * @root: JSON object,
+ * @name: name of section,
+ * @json: JSON value of section.
+ *
+ * StateSectionHandler that adds each section to @root.
+ *
+ * Returns: 0 always.
+ **/
+static int
+state_add_section (json_object *root, const char *name, json_object *json)
+{
+	nih_assert (root);
+	nih_assert (name);
+
+	json_object_object_add (root, name, json);
+
+	return 0;
+}
+
+/**
+ * state_to_string:
+ *
+ * @json_string; newly-allocated string,
+ * @len: length of @json_string.
+ *
+ * Serialise internal data structures to a JSON string.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+int
+state_to_string (char **json_string, size_t *len)
+{
+	json_object  *json;
+	const char   *value;
+
+	nih_assert (json_string);
+	nih_assert (len);
+
+	json = json_object_new_object ();
+
+	if (! json)
+		return -1;
+
+	if (state_serialise ((StateSectionHandler)state_add_section, json) < 0)
+		goto error;
 
 	/* Note that the returned value is managed by json-c! */
 	value = json_object_to_json_string (json);
@@ -457,467 +826,814 @@ error:
 }
 
 /**
- * state_from_string:
- *
- * @state: JSON-encoded state.
+ * state_filter_kind:
  *
- * Convert JSON string back to an internal representation.
+ * @kinds: NULL-terminated array of kinds of object, or NULL,
+ * @kind: kind to check.
  *
- * Returns: 0 on success, -1 on error.
+ * Returns: TRUE if @kind is in @kinds or @kinds is empty.
  **/
-int
-state_from_string (const char *state)
+static int
+state_filter_kind (char * const *kinds, const char *kind)
 {
-	int                       ret = -1;
-	json_object              *json;
-	json_object              *json_job_environ;
-	json_object              *json_control_bus_address;
-	enum json_tokener_error   error;
-
-#ifdef ENABLE_CGROUPS
-	json_object              *json_cgroup_manager_address;
-#endif /* ENABLE_CGROUPS */
+	nih_assert (kind);
 
-	nih_assert (state);
-
-	/* This function is called before conf_source_new (), so setup
-	 * the environment.
-	 */
-	conf_init ();
+	if (! kinds || ! *kinds)
+		return TRUE;
 
-	json = json_tokener_parse_verbose (state, &error);
+	for (char * const *k = kinds; *k; k++)
+		if (! strcmp (*k, kind))
+			return TRUE;
 
-	if (! json) {
-		nih_error ("%s: %s",
-				_("Detected invalid serialisation data"),
-				json_tokener_error_desc (error));
-		return ret;
-	}
+	return FALSE;
+}
 
-	if (! state_check_json_type (json, object))
-		goto out;
+/**
+ * state_filter_name:
+ *
+ * @names: NULL-terminated array of glob patterns, or NULL,
+ * @name: name to check.
+ *
+ * Returns: TRUE if @name matches one of @names or @names is empty.
+ **/
+static int
+state_filter_name (char * const *names, const char *name)
+{
+	nih_assert (name);
 
-	if (session_deserialise_all (json) < 0) {
-		nih_error ("%s Sessions", _("Failed to deserialise"));
-		goto out;
-	}
+	if (! names || ! *names)
+		return TRUE;
 
-	if (event_deserialise_all (json) < 0) {
-		nih_error ("%s Events", _("Failed to deserialise"));
-		goto out;
-	}
+	for (char * const *pattern = names; *pattern; pattern++)
+		if (! fnmatch (*pattern, name, 0))
+			return TRUE;
 
-	ret = json_object_object_get_ex (json, "control_bus_address", &json_control_bus_address);
+	return FALSE;
+}
 
-	if (json_control_bus_address) {
-		if (control_deserialise_bus_address (json_control_bus_address) < 0) {
-			nih_error ("%s control details", _("Failed to deserialise"));
-			goto out;
-		}
-	} else if (! ret) {
-		/* Probably deserialising from older format that doesn't
-		 * encode control details.
-		 */
-		nih_warn ("%s", _("No control details present in state data"));
-	}
+/**
+ * state_to_string_filtered:
+ *
+ * @json_string; newly-allocated string,
+ * @len: length of @json_string,
+ * @kinds: "events", "job_classes" and "jobs" to return, or empty for all,
+ * @names: glob patterns of the names of the events and classes to
+ *  return, or empty for all,
+ * @since: only return objects changed after this generation, or zero.
+ *
+ * Serialise only the events, job classes and jobs matching @kinds,
+ * @names and @since to a JSON string, with the same per-object
+ * serialisations as state_to_string(), so that inspecting a single job
+ * doesn't cost as much as serialising everything.  Jobs match on the
+ * name of their class, and have it added to their object as "class";
+ * a class changed after @since if it or any of its instances did.
+ *
+ * The current state_generation is included in the result as
+ * "generation", to be given as @since in the next request.  Objects
+ * that were freed since aren't reported.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+int
+state_to_string_filtered (char         **json_string,
+			  size_t        *len,
+			  char * const  *kinds,
+			  char * const  *names,
+			  uint64_t       since)
+{
+	json_object  *json;
+	json_object  *json_array;
+	const char   *value;
 
-#ifdef ENABLE_CGROUPS
-	ret = json_object_object_get_ex (json, "cgroup_manager_address", &json_cgroup_manager_address);
+	nih_assert (json_string);
+	nih_assert (len);
 
-	if (json_cgroup_manager_address) {
-		if (cgroup_manager_deserialise (json_cgroup_manager_address) < 0) {
-			nih_error ("%s %s",
-					_("Failed to deserialise"),
-					_("cgroup manager address"));
-			goto out;
+	json = json_object_new_object ();
+	if (! json)
+		return -1;
+
+	if (! state_set_json_int_var (json, "generation", state_generation))
+		goto error;
+
+	event_index_build ();
+	job_class_index_build ();
+
+	if (state_filter_kind (kinds, "events")) {
+		json_array = json_object_new_array ();
+		if (! json_array)
+			goto error;
+
+		json_object_object_add (json, "events", json_array);
+
+		event_init ();
+
+		NIH_LIST_FOREACH (events, iter) {
+			Event       *event = (Event *)iter;
+			json_object *json_event;
+
+			if ((event->generation <= since)
+			    || ! state_filter_name (names, event->name))
+				continue;
+
+			json_event = event_serialise (event);
+			if (! json_event)
+				goto error;
+
+			json_object_array_add (json_array, json_event);
 		}
-	} else if (! ret) {
-		nih_warn ("No %s in state data", _("cgroup manager address"));
 	}
-#endif /* ENABLE_CGROUPS */
 
-	/* Again, we cannot error here since older JSON state data did
-	 * not encode ConfSource or ConfFile objects.
-	 */
-	if (json_object_object_get_ex (json, "conf_sources", NULL)) {
-		if (conf_source_deserialise_all (json) < 0) {
-			nih_error ("%s ConfSources", _("Failed to deserialise"));
-			goto out;
+	if (state_filter_kind (kinds, "job_classes")) {
+		json_array = json_object_new_array ();
+		if (! json_array)
+			goto error;
+
+		json_object_object_add (json, "job_classes", json_array);
+
+		job_class_init ();
+
+		NIH_HASH_FOREACH (job_classes, iter) {
+			JobClass    *class = (JobClass *)iter;
+			json_object *json_class;
+			int          changed;
+
+			if (! state_filter_name (names, class->name))
+				continue;
+
+			changed = (class->generation > since);
+			NIH_HASH_FOREACH (class->instances, job_iter)
+				if (((Job *)job_iter)->generation > since)
+					changed = TRUE;
+
+			if (! changed)
+				continue;
+
+			json_class = job_class_serialise (class);
+			if (! json_class)
+				goto error;
+
+			json_object_array_add (json_array, json_class);
 		}
-	} else {
-		nih_warn ("%s", _("No ConfSources present in state data"));
 	}
 
-	if (json_object_object_get_ex (json, "job_environment", &json_job_environ)) {
-		if (job_class_deserialise_job_environ (json_job_environ) < 0) {
-			nih_error ("%s global job environment",
-					_("Failed to deserialise"));
-			goto out;
+	if (state_filter_kind (kinds, "jobs")) {
+		json_array = json_object_new_array ();
+		if (! json_array)
+			goto error;
+
+		json_object_object_add (json, "jobs", json_array);
+
+		job_class_init ();
+
+		NIH_HASH_FOREACH (job_classes, iter) {
+			JobClass *class = (JobClass *)iter;
+
+			if (! state_filter_name (names, class->name))
+				continue;
+
+			NIH_HASH_FOREACH (class->instances, job_iter) {
+				Job         *job = (Job *)job_iter;
+				json_object *json_job;
+
+				if (job->generation <= since)
+					continue;
+
+				json_job = job_serialise (job);
+				if (! json_job)
+					goto error;
+
+				json_object_array_add (json_array, json_job);
+
+				if (! state_set_json_string_var (json_job, "class",
+								 class->name))
+					goto error;
+			}
 		}
-	} else {
-		nih_warn ("%s", _("No global job environment data present in state data"));
 	}
 
-	if (job_class_deserialise_all (json) < 0) {
-		nih_error ("%s JobClasses", _("Failed to deserialise"));
-		goto out;
-	}
+	event_index_clear ();
+	job_class_index_clear ();
 
-	if (state_deserialise_resolve_deps (json) < 0) {
-		nih_error (_("Failed to resolve deserialisation dependencies"));
-		goto out;
-	}
+	/* Note that the returned value is managed by json-c! */
+	value = json_object_to_json_string (json);
+	if (! value)
+		goto error;
 
-	ret = 0;
+	*len = strlen (value);
+
+	*json_string = NIH_MUST (nih_strndup (NULL, value, *len));
 
-out:
-	/* Only need to free the root JSON node */
 	json_object_put (json);
 
-	return ret;
-}
+	return 0;
+
+error:
+	event_index_clear ();
+	job_class_index_clear ();
 
+	json_object_put (json);
+	return -1;
+}
 
 /**
- * state_modify_cloexec:
+ * state_binary_add_record:
  *
- * @fd: file descriptor,
- * @set: set close-on-exec flag if TRUE, clear if FALSE.
+ * @buffer: buffer to append to,
+ * @type: StateRecordType of record,
+ * @name: name of record, or NULL,
+ * @data: record data,
+ * @len: length of @data.
  *
- * Set or clear the close-on-exec file descriptor flag.
+ * Append a record to @buffer in STATE_FORMAT_BINARY.
  *
  * Returns: 0 on success, -1 on error.
  **/
-int
-state_modify_cloexec (int fd, int set)
+static int
+state_binary_add_record (NihIoBuffer     *buffer,
+			 StateRecordType  type,
+			 const char      *name,
+			 const void      *data,
+			 size_t           len)
 {
-	long   flags;
-	int    ret;
+	StateRecordHeader  header;
 
-	nih_assert (fd >= 0);
+	nih_assert (buffer);
+	nih_assert (data || ! len);
 
-	flags = fcntl (fd, F_GETFD);
+	memset (&header, '\0', sizeof (header));
+	header.type     = type;
+	header.name_len = name ? strlen (name) + 1 : 0;
+	header.len      = len;
 
-	if (flags < 0)
+	if (nih_io_buffer_push (buffer, (const char *)&header, sizeof (header)) < 0)
 		return -1;
 
-	if (set)
-		flags |= FD_CLOEXEC;
-	else
-		flags &= ~FD_CLOEXEC;
+	if (name && nih_io_buffer_push (buffer, name, header.name_len) < 0)
+		return -1;
 
-	ret = fcntl (fd, F_SETFD, flags);
-	if (ret < 0)
+	if (len && nih_io_buffer_push (buffer, data, len) < 0)
 		return -1;
 
 	return 0;
 }
 
 /**
- * state_fd_valid:
- * @fd: file descriptor.
+ * state_binary_add_section:
  *
- * Return TRUE if @fd is valid, else FALSE.
+ * @buffer: buffer to append to,
+ * @name: name of section,
+ * @json: JSON value of section.
+ *
+ * StateSectionHandler that renders each section and appends it to
+ * @buffer, then discards the JSON so that only a single section is
+ * held in memory at any time.
+ *
+ * Returns: 0 on success, -1 on error.
  **/
-int
-state_fd_valid (int fd)
+static int
+state_binary_add_section (NihIoBuffer *buffer, const char *name,
+			  json_object *json)
 {
-	int flags = 0;
-
-	if (fd < 0)
-		return FALSE;
+	const char  *value;
+	int          ret = -1;
 
-	errno = 0;
-	flags = fcntl (fd, F_GETFL);
+	nih_assert (buffer);
+	nih_assert (name);
 
-	if (flags < 0)
-		return FALSE;
+	/* Note that the returned value is managed by json-c! */
+	value = json_object_to_json_string (json);
+	if (value)
+		ret = state_binary_add_record (buffer, STATE_RECORD_SECTION,
+					       name, value, strlen (value));
 
-	/* redundant really */
-	if (errno == EBADF)
-		return FALSE;
+	if (json)
+		json_object_put (json);
 
-	return TRUE;
+	return ret;
 }
 
 /**
- * state_serialise_str_array:
+ * state_to_binary:
  *
- * @array: string array to serialise.
+ * @buffer: newly-allocated buffer.
  *
- * Convert string array @array into a JSON array object.
+ * Serialise internal data structures in STATE_FORMAT_BINARY: each
+ * top-level section is rendered separately as a length-prefixed record
+ * and raw data (such as unflushed job output) is stored as is rather
+ * than hex-encoded.
  *
- * Returns: JSON-serialised @array, or NULL on error.
+ * Returns: 0 on success, -1 on error.
  **/
-json_object *
-state_serialise_str_array (char ** const array)
+int
+state_to_binary (NihIoBuffer **buffer)
 {
-	char * const       *elem;
-	json_object        *json;
-	json_object        *json_element;
-	int                 i;
+	StateBinaryHeader  header;
+	NihIoBuffer       *new_buffer;
 
-	nih_assert (array);
+	nih_assert (buffer);
+	nih_assert (! state_binary_buffer);
 
-	json = json_object_new_array ();
-	if (! json)
-		return NULL;
+	new_buffer = nih_io_buffer_new (NULL);
+	if (! new_buffer)
+		return -1;
 
-	for (elem = array, i = 0; elem && *elem; ++elem, ++i) {
+	memset (&header, '\0', sizeof (header));
+	memcpy (header.magic, STATE_BINARY_MAGIC, sizeof (STATE_BINARY_MAGIC));
+	header.version = STATE_BINARY_VERSION;
 
-		json_element = json_object_new_string (*elem);
+	if (nih_io_buffer_push (new_buffer, (const char *)&header, sizeof (header)) < 0)
+		goto error;
 
-		if (! json_element)
-			goto error;
+	state_binary_buffer = new_buffer;
+	state_blob_count = 0;
 
-		if (json_object_array_put_idx (json, i, json_element) < 0)
-			goto error;
-	}
+	if (state_serialise ((StateSectionHandler)state_binary_add_section,
+			     new_buffer) < 0)
+		goto error;
 
-	return json;
+	if (state_binary_add_record (new_buffer, STATE_RECORD_END,
+				     NULL, NULL, 0) < 0)
+		goto error;
+
+	state_binary_buffer = NULL;
+
+	*buffer = new_buffer;
+
+	return 0;
 
 error:
-	json_object_put (json);
-	return NULL;
+	state_binary_buffer = NULL;
+	nih_free (new_buffer);
+	return -1;
 }
 
 /**
- * _state_deserialise_str_array:
+ * state_blob_add:
  *
- * @parent: parent object for new array (may be NULL),
- * @json: JSON array object representing a string array,
- * @array: string array,
- * @len: length of returned array,
- * @env: TRUE if @json represents an array of environment
- * variables, FALSE for simple strings.
+ * @data: data to store,
+ * @len: length of @data.
  *
- * Convert JSON array object @json into a string array.
+ * When serialising in STATE_FORMAT_BINARY, store @data as a raw blob
+ * record ahead of the section currently being serialised, which should
+ * refer to it by the returned index.
  *
- * If @len is >0, @array will contain the newly-allocated array.
- * If @len is zero, the contents of @array are undefined.
+ * Returns: index of blob, or -1 if not serialising in
+ * STATE_FORMAT_BINARY or on error (in which case @data should be
+ * encoded within the JSON instead).
+ **/
+ssize_t
+state_blob_add (const void *data, size_t len)
+{
+	nih_assert (data);
+
+	if (! state_binary_buffer)
+		return -1;
+
+	if (state_binary_add_record (state_binary_buffer, STATE_RECORD_BLOB,
+				     NULL, data, len) < 0)
+		return -1;
+
+	return (ssize_t)state_blob_count++;
+}
+
+/**
+ * state_blob_get:
  *
- * Returns: 0 on success, -1 on error.
+ * @index: index of blob,
+ * @data: pointer to set to blob data,
+ * @len: pointer to set to length of @data.
+ *
+ * When deserialising STATE_FORMAT_BINARY state, obtain the blob stored
+ * by state_blob_add() with @index. @data remains valid until
+ * deserialisation is complete.
+ *
+ * Returns: 0 on success, -1 if no such blob exists.
  **/
 int
-_state_deserialise_str_array (void           *parent,
-			      json_object    *json,
-			      char         ***array,
-			      size_t         *len,
-			      int             env)
+state_blob_get (size_t index, const char **data, size_t *len)
 {
-	nih_assert (json);
-	nih_assert (array);
+	nih_assert (data);
 	nih_assert (len);
 
-	if (! state_check_json_type (json, array))
+	if (index >= state_blobs_len)
 		return -1;
 
-	*len = json_object_array_length (json);
+	*data = state_blobs[index].data;
+	*len = state_blobs[index].len;
 
-	if (! *len)
-		return 0;
+	return 0;
+}
 
-	*array = nih_str_array_new (parent);
+/**
+ * state_from_string:
+ *
+ * @state: JSON-encoded state.
+ *
+ * Convert JSON string back to an internal representation.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+int
+state_from_string (const char *state)
+{
+	int                       ret;
+	json_object              *json;
+	enum json_tokener_error   error;
 
-	if (! *array)
-		return -1;
+	nih_assert (state);
 
-	for (size_t i = 0; i < *len; i++) {
-		json_object  *json_element;
-		const char   *element;
-		char        **new;
+	json = json_tokener_parse_verbose (state, &error);
 
-		json_element = json_object_array_get_idx (json, i);
-		if (! json_element)
-			goto error;
-
-		if (! state_check_json_type (json_element, string))
-			goto error;
-
-		element = json_object_get_string (json_element);
-		if (! element)
-			goto error;
-
-		if (env) {
-			new = environ_add (array, parent, NULL, TRUE, element);
-			if (! new)
-				goto error;
-			*array = new;
-		} else {
-			new = nih_str_array_add (array, parent, NULL, element);
-
-			if (! new)
-				goto error;
-			*array = new;
-		}
+	if (! json) {
+		nih_error ("%s: %s",
+				_("Detected invalid serialisation data"),
+				json_tokener_error_desc (error));
+		return -1;
 	}
 
-	return 0;
+	ret = state_from_json (json);
 
-error:
-	nih_free (*array);
-	*array = NULL;
-	return -1;
+	/* Only need to free the root JSON node */
+	json_object_put (json);
+
+	return ret;
 }
 
 /**
- * state_serialise_int32_array:
+ * state_from_json:
  *
- * @array: array of 32-bit integers,
- * @count: number of values in @array,
+ * @json: JSON state.
  *
- * Convert integer array @array into a JSON array object.
+ * Convert JSON state back to an internal representation.
  *
- * Returns: JSON-serialised @array, or NULL on error.
+ * Returns: 0 on success, -1 on error.
  **/
-json_object *
-state_serialise_int32_array (int32_t *array, int count)
+static int
+state_from_json (json_object *json)
 {
-	json_object   *json;
-	json_object   *json_element;
-	int            i;
+	int                       ret = -1;
+	json_object              *json_job_environ;
+	json_object              *json_control_bus_address;
+	json_object              *json_runlevel;
+	uint64_t                  resolve_begin;
 
-	nih_assert (count >= 0);
+#ifdef ENABLE_CGROUPS
+	json_object              *json_cgroup_manager_address;
+#endif /* ENABLE_CGROUPS */
 
-	json = json_object_new_array ();
-	if (! json)
-		return NULL;
+	nih_assert (json);
 
-	if (! count || ! array)
-		return json;
+	/* This function is called before conf_source_new (), so setup
+	 * the environment.
+	 */
+	conf_init ();
 
-	for (i = 0; i < count; ++i) {
+	if (! state_check_json_type (json, object))
+		goto out;
 
-		json_element = json_object_new_int (array[i]);
+	if (session_deserialise_all (json) < 0) {
+		nih_error ("%s Sessions", _("Failed to deserialise"));
+		goto out;
+	}
 
-		if (! json_element)
-			goto error;
+	if (event_deserialise_all (json) < 0) {
+		nih_error ("%s Events", _("Failed to deserialise"));
+		goto out;
+	}
 
-		if (json_object_array_put_idx (json, i, json_element) < 0)
-			goto error;
+	/* The events list is now complete; JobClasses, Jobs and
+	 * Blocked objects below refer to events by index.
+	 */
+	event_index_build ();
+
+	ret = json_object_object_get_ex (json, "control_bus_address", &json_control_bus_address);
+
+	if (json_control_bus_address) {
+		if (control_deserialise_bus_address (json_control_bus_address) < 0) {
+			nih_error ("%s control details", _("Failed to deserialise"));
+			goto out;
+		}
+	} else if (! ret) {
+		/* Probably deserialising from older format that doesn't
+		 * encode control details.
+		 */
+		nih_warn ("%s", _("No control details present in state data"));
 	}
 
-	return json;
+	/* Older state data does not encode the runlevel, in which case
+	 * it is read from the utmp file until the next runlevel event.
+	 */
+	if (json_object_object_get_ex (json, "runlevel", &json_runlevel)
+	    && (control_deserialise_runlevel (json_runlevel) < 0)) {
+		nih_error ("%s %s",
+				_("Failed to deserialise"),
+				_("runlevel"));
+		goto out;
+	}
 
-error:
-	json_object_put (json);
-	return NULL;
+#ifdef ENABLE_CGROUPS
+	ret = json_object_object_get_ex (json, "cgroup_manager_address", &json_cgroup_manager_address);
+
+	if (json_cgroup_manager_address) {
+		if (cgroup_manager_deserialise (json_cgroup_manager_address) < 0) {
+			nih_error ("%s %s",
+					_("Failed to deserialise"),
+					_("cgroup manager address"));
+			goto out;
+		}
+	} else if (! ret) {
+		nih_warn ("No %s in state data", _("cgroup manager address"));
+	}
+#endif /* ENABLE_CGROUPS */
+
+	/* Again, we cannot error here since older JSON state data did
+	 * not encode ConfSource or ConfFile objects.
+	 */
+	if (json_object_object_get_ex (json, "conf_sources", NULL)) {
+		if (conf_source_deserialise_all (json) < 0) {
+			nih_error ("%s ConfSources", _("Failed to deserialise"));
+			goto out;
+		}
+	} else {
+		nih_warn ("%s", _("No ConfSources present in state data"));
+	}
+
+	if (json_object_object_get_ex (json, "job_environment", &json_job_environ)) {
+		if (job_class_deserialise_job_environ (json_job_environ) < 0) {
+			nih_error ("%s global job environment",
+					_("Failed to deserialise"));
+			goto out;
+		}
+	} else {
+		nih_warn ("%s", _("No global job environment data present in state data"));
+	}
+
+	if (job_class_deserialise_all (json) < 0) {
+		nih_error ("%s JobClasses", _("Failed to deserialise"));
+		goto out;
+	}
+
+	resolve_begin = job_timing_now ();
+
+	if (state_deserialise_resolve_deps (json) < 0) {
+		nih_error (_("Failed to resolve deserialisation dependencies"));
+		goto out;
+	}
+
+	state_reexec_stats.resolve_deps = job_timing_now () - resolve_begin;
+
+	ret = 0;
+
+out:
+	event_index_clear ();
+
+	return ret;
 }
 
 /**
- * state_serialise_int64_array:
+ * state_from_binary:
  *
- * @array: array of 64-bit integers,
- * @count: number of values in @array,
+ * @data: STATE_FORMAT_BINARY state,
+ * @len: length of @data.
  *
- * Convert integer array @array into a JSON array object.
+ * Convert state written by state_to_binary() back to an internal
+ * representation. Each section is parsed directly from @data, as are
+ * blobs which remain valid for the duration of the call.
  *
- * Returns: JSON-serialised @array, or NULL on error.
+ * Returns: 0 on success, -1 on error.
  **/
-json_object *
-state_serialise_int64_array (int64_t *array, int count)
+static int
+state_from_binary (const char *data, size_t len)
 {
-	json_object   *json;
-	json_object   *json_element;
-	int            i;
+	const StateBinaryHeader  *header;
+	StateRecordHeader         record;
+	json_object              *json;
+	json_tokener             *tok = NULL;
+	size_t                    offset;
+	int                       ret = -1;
 
-	nih_assert (count >= 0);
+	nih_assert (data);
+	nih_assert (len >= sizeof (StateBinaryHeader));
+	nih_assert (! state_blobs);
 
-	json = json_object_new_array ();
+	header = (const StateBinaryHeader *)data;
+	if (header->version != STATE_BINARY_VERSION) {
+		nih_error ("%s: %s %u",
+				_("Detected invalid serialisation data"),
+				_("unsupported version"),
+				(unsigned int)header->version);
+		return -1;
+	}
+
+	json = json_object_new_object ();
 	if (! json)
-		return NULL;
+		return -1;
 
-	if (! count || ! array)
-		return json;
+	tok = json_tokener_new ();
+	if (! tok)
+		goto out;
 
-	for (i = 0; i < count; ++i) {
+	offset = sizeof (StateBinaryHeader);
 
-		json_element = json_object_new_int64 (array[i]);
+	while (TRUE) {
+		const char   *name = NULL;
+		const char   *payload;
+		json_object  *json_section;
 
-		if (! json_element)
-			goto error;
+		if (len - offset < sizeof (record))
+			goto invalid;
 
-		if (json_object_array_put_idx (json, i, json_element) < 0)
-			goto error;
+		/* Records are not necessarily aligned */
+		memcpy (&record, data + offset, sizeof (record));
+		offset += sizeof (record);
+
+		if (record.type == STATE_RECORD_END)
+			break;
+
+		if (len - offset < record.name_len
+		    || len - offset - record.name_len < record.len)
+			goto invalid;
+
+		if (record.name_len) {
+			name = data + offset;
+			if (name[record.name_len - 1] != '\0')
+				goto invalid;
+			offset += record.name_len;
+		}
+
+		payload = data + offset;
+		offset += record.len;
+
+		switch (record.type) {
+		case STATE_RECORD_SECTION:
+			if (! name)
+				goto invalid;
+
+			json_tokener_reset (tok);
+			json_section = json_tokener_parse_ex (tok, payload,
+							      (int)record.len);
+
+			if (json_tokener_get_error (tok) != json_tokener_success) {
+				nih_error ("%s: %s",
+						_("Detected invalid serialisation data"),
+						json_tokener_error_desc (json_tokener_get_error (tok)));
+				goto out;
+			}
+
+			json_object_object_add (json, name, json_section);
+			break;
+		case STATE_RECORD_BLOB:
+			state_blobs = NIH_MUST (nih_realloc (state_blobs, NULL,
+							     sizeof (StateBlob) * (state_blobs_len + 1)));
+			state_blobs[state_blobs_len].data = payload;
+			state_blobs[state_blobs_len].len = record.len;
+			state_blobs_len++;
+			break;
+		default:
+			/* Skip records added by later versions */
+			break;
+		}
 	}
 
-	return json;
+	ret = state_from_json (json);
+	goto out;
 
-error:
+invalid:
+	nih_error ("%s: %s",
+			_("Detected invalid serialisation data"),
+			_("truncated record"));
+
+out:
+	if (tok)
+		json_tokener_free (tok);
+
+	if (state_blobs) {
+		nih_free (state_blobs);
+		state_blobs = NULL;
+	}
+	state_blobs_len = 0;
+
+	/* Only need to free the root JSON node */
 	json_object_put (json);
-	return NULL;
+
+	return ret;
 }
 
+
 /**
- * state_deserialise_int32_array:
- *
- * @parent: parent object for new array,
- * @json: JSON array object representing an integer array,
- * @array: array of 32-bit integers,
- * @len: length of @array.
+ * state_modify_cloexec:
  *
- * Convert JSON array object @json into an array of 32-bit integers.
+ * @fd: file descriptor,
+ * @set: set close-on-exec flag if TRUE, clear if FALSE.
  *
- * If @len is >0, @array will contain the newly-allocated array.
- * If @len is zero, the contents of @array are undefined.
+ * Set or clear the close-on-exec file descriptor flag.
  *
  * Returns: 0 on success, -1 on error.
  **/
 int
-state_deserialise_int32_array (void          *parent,
-			       json_object   *json,
-			       int32_t      **array,
-			       size_t        *len)
+state_modify_cloexec (int fd, int set)
 {
-	nih_assert (parent);
-	nih_assert (json);
-	nih_assert (array);
-	nih_assert (len);
-
-	if (! state_check_json_type (json, array))
-		return -1;
+	long   flags;
+	int    ret;
 
-	*len = json_object_array_length (json);
+	nih_assert (fd >= 0);
 
-	if (! *len)
-		return 0;
+	flags = fcntl (fd, F_GETFD);
 
-	*array = nih_realloc (*array, parent, (*len) * sizeof (int32_t));
-	if (! *array)
+	if (flags < 0)
 		return -1;
 
-	for (size_t i = 0; i < *len; i++) {
-		json_object  *json_element;
+	if (set)
+		flags |= FD_CLOEXEC;
+	else
+		flags &= ~FD_CLOEXEC;
 
-		json_element = json_object_array_get_idx (json, i);
-		if (! json_element)
-			goto error;
+	ret = fcntl (fd, F_SETFD, flags);
+	if (ret < 0)
+		return -1;
 
-		if (! state_check_json_type (json_element, int))
+	return 0;
+}
+
+/**
+ * state_fd_valid:
+ * @fd: file descriptor.
+ *
+ * Return TRUE if @fd is valid, else FALSE.
+ **/
+int
+state_fd_valid (int fd)
+{
+	int flags = 0;
+
+	if (fd < 0)
+		return FALSE;
+
+	errno = 0;
+	flags = fcntl (fd, F_GETFL);
+
+	if (flags < 0)
+		return FALSE;
+
+	/* redundant really */
+	if (errno == EBADF)
+		return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * state_serialise_str_array:
+ *
+ * @array: string array to serialise.
+ *
+ * Convert string array @array into a JSON array object.
+ *
+ * Returns: JSON-serialised @array, or NULL on error.
+ **/
+json_object *
+state_serialise_str_array (char ** const array)
+{
+	char * const       *elem;
+	json_object        *json;
+	json_object        *json_element;
+	int                 i;
+
+	nih_assert (array);
+
+	json = json_object_new_array ();
+	if (! json)
+		return NULL;
+
+	for (elem = array, i = 0; elem && *elem; ++elem, ++i) {
+
+		json_element = json_object_new_string (*elem);
+
+		if (! json_element)
 			goto error;
 
-		errno = 0;
-		(*array)[i] = json_object_get_int (json_element);
-		if (! (*array)[i] && errno == EINVAL)
+		if (json_object_array_put_idx (json, i, json_element) < 0)
 			goto error;
 	}
 
-	return 0;
+	return json;
 
 error:
-	nih_free (*array);
-	return -1;
+	json_object_put (json);
+	return NULL;
 }
 
 /**
- * state_deserialise_int64_array:
+ * _state_deserialise_str_array:
  *
- * @parent: parent object for new array,
- * @json: JSON array object representing an integer array,
- * @array: array of 64-bit integers,
- * @len: length of @array.
+ * @parent: parent object for new array (may be NULL),
+ * @json: JSON array object representing a string array,
+ * @array: string array,
+ * @len: length of returned array,
+ * @env: TRUE if @json represents an array of environment
+ * variables, FALSE for simple strings.
  *
- * Convert JSON array object @json into an array of 64-bit integers.
+ * Convert JSON array object @json into a string array.
  *
  * If @len is >0, @array will contain the newly-allocated array.
  * If @len is zero, the contents of @array are undefined.
@@ -925,12 +1641,12 @@ error:
  * Returns: 0 on success, -1 on error.
  **/
 int
-state_deserialise_int64_array (void           *parent,
-			       json_object    *json,
-			       int64_t       **array,
-			       size_t         *len)
+_state_deserialise_str_array (void           *parent,
+			      json_object    *json,
+			      char         ***array,
+			      size_t         *len,
+			      int             env)
 {
-	nih_assert (parent);
 	nih_assert (json);
 	nih_assert (array);
 	nih_assert (len);
@@ -943,58 +1659,85 @@ state_deserialise_int64_array (void           *parent,
 	if (! *len)
 		return 0;
 
-	*array = nih_realloc (*array, parent, (*len) * sizeof (int64_t));
+	*array = nih_str_array_new (parent);
+
 	if (! *array)
 		return -1;
 
 	for (size_t i = 0; i < *len; i++) {
 		json_object  *json_element;
+		const char   *element;
+		char        **new;
 
 		json_element = json_object_array_get_idx (json, i);
 		if (! json_element)
 			goto error;
 
-		if (! state_check_json_type (json_element, int))
+		if (! state_check_json_type (json_element, string))
 			goto error;
 
-		errno = 0;
-		(*array)[i] = json_object_get_int64 (json_element);
-		if (! (*array)[i] && errno == EINVAL)
+		element = json_object_get_string (json_element);
+		if (! element)
 			goto error;
+
+		if (env) {
+			new = environ_add (array, parent, NULL, TRUE, element);
+			if (! new)
+				goto error;
+			*array = new;
+		} else {
+			new = nih_str_array_add (array, parent, NULL, element);
+
+			if (! new)
+				goto error;
+			*array = new;
+		}
 	}
 
 	return 0;
 
 error:
 	nih_free (*array);
+	*array = NULL;
 	return -1;
 }
 
 /**
- * state_rlimit_serialise:
- * @limit: rlimit to serialise.
+ * state_serialise_int32_array:
  *
- * Convert @limit into a JSON representation for serialisation.
- * Caller must free returned value using json_object_put().
+ * @array: array of 32-bit integers,
+ * @count: number of values in @array,
  *
- * Returns: JSON-serialised rlimit structure, or NULL on error.
+ * Convert integer array @array into a JSON array object.
+ *
+ * Returns: JSON-serialised @array, or NULL on error.
  **/
 json_object *
-state_rlimit_serialise (const struct rlimit *rlimit)
+state_serialise_int32_array (int32_t *array, int count)
 {
-	json_object  *json;
+	json_object   *json;
+	json_object   *json_element;
+	int            i;
 
-	nih_assert (rlimit);
+	nih_assert (count >= 0);
 
-	json = json_object_new_object ();
+	json = json_object_new_array ();
 	if (! json)
 		return NULL;
 
-	if (! state_set_json_int_var_from_obj (json, rlimit, rlim_cur))
-		goto error;
+	if (! count || ! array)
+		return json;
 
-	if (! state_set_json_int_var_from_obj (json, rlimit, rlim_max))
-		goto error;
+	for (i = 0; i < count; ++i) {
+
+		json_element = json_object_new_int (array[i]);
+
+		if (! json_element)
+			goto error;
+
+		if (json_object_array_put_idx (json, i, json_element) < 0)
+			goto error;
+	}
 
 	return json;
 
@@ -1004,86 +1747,285 @@ error:
 }
 
 /**
- * state_rlimit_serialise_all:
+ * state_serialise_int64_array:
  *
- * @rlimits: array of rlimit structures.
+ * @array: array of 64-bit integers,
+ * @count: number of values in @array,
  *
- * Convert array of rlimit structures to JSON representation.
+ * Convert integer array @array into a JSON array object.
  *
- * Returns: JSON object containing array of rlimits, or NULL on error.
- */
+ * Returns: JSON-serialised @array, or NULL on error.
+ **/
 json_object *
-state_rlimit_serialise_all (struct rlimit * const *rlimits)
+state_serialise_int64_array (int64_t *array, int count)
 {
-	json_object    *json;
-	json_object    *json_rlimit;
-	struct rlimit   dummy = { 0x0, 0x0 };
+	json_object   *json;
+	json_object   *json_element;
+	int            i;
 
-	nih_assert (rlimits);
+	nih_assert (count >= 0);
 
 	json = json_object_new_array ();
 	if (! json)
 		return NULL;
 
-	for (int i = 0; i < RLIMIT_NLIMITS; i++) {
-		/* We must encode a blank entry for missing array elements
-		 * to ensure correct ordering of limits on deserialisation.
-		 */
-		json_rlimit = state_rlimit_serialise (rlimits[i]
-				? rlimits[i] : &dummy);
+	if (! count || ! array)
+		return json;
 
-		if (! json_rlimit)
+	for (i = 0; i < count; ++i) {
+
+		json_element = json_object_new_int64 (array[i]);
+
+		if (! json_element)
 			goto error;
 
-		if (json_object_array_add (json, json_rlimit) < 0)
+		if (json_object_array_put_idx (json, i, json_element) < 0)
 			goto error;
 	}
 
 	return json;
 
 error:
-
 	json_object_put (json);
 	return NULL;
 }
 
 /**
- * state_rlimit_deserialise:
+ * state_deserialise_int32_array:
  *
- * @json: JSON-serialised rlimit structure to deserialise.
+ * @parent: parent object for new array,
+ * @json: JSON array object representing an integer array,
+ * @array: array of 32-bit integers,
+ * @len: length of @array.
  *
- * Convert @json into an rlimit structure.
+ * Convert JSON array object @json into an array of 32-bit integers.
  *
- * Caller must manually nih_ref() returned object to a parent object.
+ * If @len is >0, @array will contain the newly-allocated array.
+ * If @len is zero, the contents of @array are undefined.
  *
- * Returns: struct rlimit, or NULL on error.
+ * Returns: 0 on success, -1 on error.
  **/
-struct rlimit *
-state_rlimit_deserialise (json_object *json)
+int
+state_deserialise_int32_array (void          *parent,
+			       json_object   *json,
+			       int32_t      **array,
+			       size_t        *len)
 {
-	struct rlimit  *rlimit = NULL;
-
+	nih_assert (parent);
 	nih_assert (json);
+	nih_assert (array);
+	nih_assert (len);
 
-	if (! state_check_json_type (json, object))
-		goto error;
+	if (! state_check_json_type (json, array))
+		return -1;
 
-	rlimit = nih_new (NULL, struct rlimit);
-	if (! rlimit)
-		return NULL;
+	*len = json_object_array_length (json);
 
-	memset (rlimit, '\0', sizeof (struct rlimit));
+	if (! *len)
+		return 0;
 
-	if (! state_get_json_int_var_to_obj (json, rlimit, rlim_cur))
-		goto error;
+	*array = nih_realloc (*array, parent, (*len) * sizeof (int32_t));
+	if (! *array)
+		return -1;
 
-	if (! state_get_json_int_var_to_obj (json, rlimit, rlim_max))
-		goto error;
+	for (size_t i = 0; i < *len; i++) {
+		json_object  *json_element;
 
-	return rlimit;
+		json_element = json_object_array_get_idx (json, i);
+		if (! json_element)
+			goto error;
 
-error:
-	nih_free (rlimit);
+		if (! state_check_json_type (json_element, int))
+			goto error;
+
+		errno = 0;
+		(*array)[i] = json_object_get_int (json_element);
+		if (! (*array)[i] && errno == EINVAL)
+			goto error;
+	}
+
+	return 0;
+
+error:
+	nih_free (*array);
+	return -1;
+}
+
+/**
+ * state_deserialise_int64_array:
+ *
+ * @parent: parent object for new array,
+ * @json: JSON array object representing an integer array,
+ * @array: array of 64-bit integers,
+ * @len: length of @array.
+ *
+ * Convert JSON array object @json into an array of 64-bit integers.
+ *
+ * If @len is >0, @array will contain the newly-allocated array.
+ * If @len is zero, the contents of @array are undefined.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+int
+state_deserialise_int64_array (void           *parent,
+			       json_object    *json,
+			       int64_t       **array,
+			       size_t         *len)
+{
+	nih_assert (parent);
+	nih_assert (json);
+	nih_assert (array);
+	nih_assert (len);
+
+	if (! state_check_json_type (json, array))
+		return -1;
+
+	*len = json_object_array_length (json);
+
+	if (! *len)
+		return 0;
+
+	*array = nih_realloc (*array, parent, (*len) * sizeof (int64_t));
+	if (! *array)
+		return -1;
+
+	for (size_t i = 0; i < *len; i++) {
+		json_object  *json_element;
+
+		json_element = json_object_array_get_idx (json, i);
+		if (! json_element)
+			goto error;
+
+		if (! state_check_json_type (json_element, int))
+			goto error;
+
+		errno = 0;
+		(*array)[i] = json_object_get_int64 (json_element);
+		if (! (*array)[i] && errno == EINVAL)
+			goto error;
+	}
+
+	return 0;
+
+error:
+	nih_free (*array);
+	return -1;
+}
+
+/**
+ * state_rlimit_serialise:
+ * @limit: rlimit to serialise.
+ *
+ * Convert @limit into a JSON representation for serialisation.
+ * Caller must free returned value using json_object_put().
+ *
+ * Returns: JSON-serialised rlimit structure, or NULL on error.
+ **/
+json_object *
+state_rlimit_serialise (const struct rlimit *rlimit)
+{
+	json_object  *json;
+
+	nih_assert (rlimit);
+
+	json = json_object_new_object ();
+	if (! json)
+		return NULL;
+
+	if (! state_set_json_int_var_from_obj (json, rlimit, rlim_cur))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, rlimit, rlim_max))
+		goto error;
+
+	return json;
+
+error:
+	json_object_put (json);
+	return NULL;
+}
+
+/**
+ * state_rlimit_serialise_all:
+ *
+ * @rlimits: array of rlimit structures.
+ *
+ * Convert array of rlimit structures to JSON representation.
+ *
+ * Returns: JSON object containing array of rlimits, or NULL on error.
+ */
+json_object *
+state_rlimit_serialise_all (struct rlimit * const *rlimits)
+{
+	json_object    *json;
+	json_object    *json_rlimit;
+	struct rlimit   dummy = { 0x0, 0x0 };
+
+	nih_assert (rlimits);
+
+	json = json_object_new_array ();
+	if (! json)
+		return NULL;
+
+	for (int i = 0; i < RLIMIT_NLIMITS; i++) {
+		/* We must encode a blank entry for missing array elements
+		 * to ensure correct ordering of limits on deserialisation.
+		 */
+		json_rlimit = state_rlimit_serialise (rlimits[i]
+				? rlimits[i] : &dummy);
+
+		if (! json_rlimit)
+			goto error;
+
+		if (json_object_array_add (json, json_rlimit) < 0)
+			goto error;
+	}
+
+	return json;
+
+error:
+
+	json_object_put (json);
+	return NULL;
+}
+
+/**
+ * state_rlimit_deserialise:
+ *
+ * @json: JSON-serialised rlimit structure to deserialise.
+ *
+ * Convert @json into an rlimit structure.
+ *
+ * Caller must manually nih_ref() returned object to a parent object.
+ *
+ * Returns: struct rlimit, or NULL on error.
+ **/
+struct rlimit *
+state_rlimit_deserialise (json_object *json)
+{
+	struct rlimit  *rlimit = NULL;
+
+	nih_assert (json);
+
+	if (! state_check_json_type (json, object))
+		goto error;
+
+	rlimit = nih_new (NULL, struct rlimit);
+	if (! rlimit)
+		return NULL;
+
+	memset (rlimit, '\0', sizeof (struct rlimit));
+
+	if (! state_get_json_int_var_to_obj (json, rlimit, rlim_cur))
+		goto error;
+
+	if (! state_get_json_int_var_to_obj (json, rlimit, rlim_max))
+		goto error;
+
+	return rlimit;
+
+error:
+	nih_free (rlimit);
 	return NULL;
 }
 
@@ -1162,72 +2104,244 @@ error:
 }
 
 /**
- * state_collapse_env:
+ * state_placement_bits_serialise:
+ * @mask: mask of JOB_PLACEMENT_MAX bits.
  *
- * @env: string array.
- *
- * Convert @env into a flattened string, quoting values as required.
- *
- * Returns: newly-allocated flattened string representing @env on
- * success, or NULL on error.
+ * Returns: JSON array of the numbers of the bits set in @mask, or NULL
+ * on error.
  **/
-char *
-state_collapse_env (const char **env)
+static json_object *
+state_placement_bits_serialise (const unsigned long *mask)
 {
-	char          *p;
-	char          *flattened = NULL;
-	const char  **elem;
+	json_object *json;
 
-	if (! env)
+	nih_assert (mask);
+
+	json = json_object_new_array ();
+	if (! json)
 		return NULL;
 
-	for (elem = env; elem && *elem; ++elem) {
-		p = strchr (*elem, '=');
+	for (int i = 0; i < JOB_PLACEMENT_MAX; i++) {
+		json_object *json_bit;
 
-		/* If an environment variable contains an equals and whitespace
-		 * in the value part, quote the value.
-		 */
-		if (p && strpbrk (p, " \t")) {
-			/* append name and equals */
-			NIH_MUST (nih_strcat_sprintf (&flattened, NULL,
-						"%s%.*s",
-						elem == env ? "" : " ",
-						(int)((p - *elem) + 1), *elem));
-			p++;
+		if (! (mask[i / (8 * sizeof (unsigned long))]
+		       & (1UL << (i % (8 * sizeof (unsigned long))))))
+			continue;
 
-			/* add quoted value */
-			if (p) {
-				NIH_MUST (nih_strcat_sprintf
-						(&flattened, NULL, "\"%s\"", p));
-			}
-		} else {
-			/* either a simple 'name' environment variable,
-			 * or a name/value pair without space in the
-			 * value part.
-			 */
-			NIH_MUST (nih_strcat_sprintf
-					(&flattened, NULL,
-					 "%s%s",
-					 elem == env ? "" : " ",
-					 *elem));
-		}
+		json_bit = json_object_new_int (i);
+		if (! json_bit)
+			goto error;
+
+		if (json_object_array_add (json, json_bit) < 0)
+			goto error;
 	}
 
-	return flattened;
+	return json;
+
+error:
+	json_object_put (json);
+	return NULL;
 }
 
 /**
- * state_get_json_type:
- *
- * @short_type: name of JSON type without the prefix.
- *
- * Convert JSON short-type name to a full JSON type.
+ * state_placement_bits_deserialise:
+ * @json: JSON array of bit numbers,
+ * @mask: mask of JOB_PLACEMENT_MAX bits to set.
  *
- * This function is only required due to JSON-C's integer handling:
- * RFC 4627, the JSON "memo" (not a spec!) alludes to JSON being a
- * subset of ECMA-262, and yet no mention is made of the maximum integer
- * size. ECMA-262 defines a 'Number' to be a 64-bit entity, but older
- * versions of JSON-C defined a number to be the same size as a native
+ * Returns: 0 on success, -1 on error.
+ **/
+static int
+state_placement_bits_deserialise (json_object   *json,
+				  unsigned long *mask)
+{
+	nih_assert (json);
+	nih_assert (mask);
+
+	if (! state_check_json_type (json, array))
+		return -1;
+
+	for (int i = 0; i < json_object_array_length (json); i++) {
+		json_object *json_bit;
+		int          bit;
+
+		json_bit = json_object_array_get_idx (json, i);
+		if (! json_bit)
+			return -1;
+
+		if (! state_check_json_type (json_bit, int))
+			return -1;
+
+		bit = json_object_get_int (json_bit);
+		if ((bit < 0) || (bit >= JOB_PLACEMENT_MAX))
+			return -1;
+
+		mask[bit / (8 * sizeof (unsigned long))]
+			|= 1UL << (bit % (8 * sizeof (unsigned long)));
+	}
+
+	return 0;
+}
+
+/**
+ * state_placement_serialise:
+ * @placement: placement of job processes.
+ *
+ * Convert @placement to JSON representation, with its masks as arrays
+ * of the processors and memory nodes they contain.
+ *
+ * Returns: JSON-serialised JobPlacement, or NULL on error.
+ **/
+json_object *
+state_placement_serialise (const JobPlacement *placement)
+{
+	json_object *json;
+	json_object *json_cpus;
+	json_object *json_nodes;
+
+	nih_assert (placement);
+
+	json = json_object_new_object ();
+	if (! json)
+		return NULL;
+
+	json_cpus = state_placement_bits_serialise (placement->cpus);
+	if (! json_cpus)
+		goto error;
+	json_object_object_add (json, "cpus", json_cpus);
+
+	if (! state_set_json_int_var_from_obj (json, placement, numa_policy))
+		goto error;
+
+	json_nodes = state_placement_bits_serialise (placement->numa_nodes);
+	if (! json_nodes)
+		goto error;
+	json_object_object_add (json, "numa_nodes", json_nodes);
+
+	return json;
+
+error:
+	json_object_put (json);
+	return NULL;
+}
+
+/**
+ * state_placement_deserialise:
+ * @parent: parent of new JobPlacement,
+ * @json: JSON-serialised JobPlacement to deserialise.
+ *
+ * Convert @json back into a JobPlacement.
+ *
+ * Returns: newly allocated JobPlacement, or NULL on error.
+ **/
+JobPlacement *
+state_placement_deserialise (const void  *parent,
+			     json_object *json)
+{
+	JobPlacement *placement;
+	json_object  *json_cpus;
+	json_object  *json_nodes;
+
+	nih_assert (json);
+
+	if (! state_check_json_type (json, object))
+		return NULL;
+
+	placement = nih_new (parent, JobPlacement);
+	if (! placement)
+		return NULL;
+
+	memset (placement, '\0', sizeof (JobPlacement));
+
+	if (! json_object_object_get_ex (json, "cpus", &json_cpus))
+		goto error;
+
+	if (state_placement_bits_deserialise (json_cpus, placement->cpus) < 0)
+		goto error;
+
+	if (! state_get_json_int_var_to_obj (json, placement, numa_policy))
+		goto error;
+
+	if (! json_object_object_get_ex (json, "numa_nodes", &json_nodes))
+		goto error;
+
+	if (state_placement_bits_deserialise (json_nodes,
+					      placement->numa_nodes) < 0)
+		goto error;
+
+	return placement;
+
+error:
+	nih_free (placement);
+	return NULL;
+}
+
+/**
+ * state_collapse_env:
+ *
+ * @env: string array.
+ *
+ * Convert @env into a flattened string, quoting values as required.
+ *
+ * Returns: newly-allocated flattened string representing @env on
+ * success, or NULL on error.
+ **/
+char *
+state_collapse_env (const char **env)
+{
+	char          *p;
+	char          *flattened = NULL;
+	const char  **elem;
+
+	if (! env)
+		return NULL;
+
+	for (elem = env; elem && *elem; ++elem) {
+		p = strchr (*elem, '=');
+
+		/* If an environment variable contains an equals and whitespace
+		 * in the value part, quote the value.
+		 */
+		if (p && strpbrk (p, " \t")) {
+			/* append name and equals */
+			NIH_MUST (nih_strcat_sprintf (&flattened, NULL,
+						"%s%.*s",
+						elem == env ? "" : " ",
+						(int)((p - *elem) + 1), *elem));
+			p++;
+
+			/* add quoted value */
+			if (p) {
+				NIH_MUST (nih_strcat_sprintf
+						(&flattened, NULL, "\"%s\"", p));
+			}
+		} else {
+			/* either a simple 'name' environment variable,
+			 * or a name/value pair without space in the
+			 * value part.
+			 */
+			NIH_MUST (nih_strcat_sprintf
+					(&flattened, NULL,
+					 "%s%s",
+					 elem == env ? "" : " ",
+					 *elem));
+		}
+	}
+
+	return flattened;
+}
+
+/**
+ * state_get_json_type:
+ *
+ * @short_type: name of JSON type without the prefix.
+ *
+ * Convert JSON short-type name to a full JSON type.
+ *
+ * This function is only required due to JSON-C's integer handling:
+ * RFC 4627, the JSON "memo" (not a spec!) alludes to JSON being a
+ * subset of ECMA-262, and yet no mention is made of the maximum integer
+ * size. ECMA-262 defines a 'Number' to be a 64-bit entity, but older
+ * versions of JSON-C defined a number to be the same size as a native
  * integer (which might be 32-bit or 64-bit). Version 0.10 rectified
  * this by storing all integer types as 64-bit internally but it does
  * not define 
@@ -1721,475 +2835,1148 @@ state_deserialise_blocked (void *parent, json_object *json,
 			nih_local char  *dbus_message_data_raw = NULL;
 			int              conn_index = -1;
 
-			if (! state_get_json_string_var_strict (json_blocked_data,
-						"msg-data",
-						NULL,
-						dbus_message_data_str))
-				goto error;
+			if (! state_get_json_string_var_strict (json_blocked_data,
+						"msg-data",
+						NULL,
+						dbus_message_data_str))
+				goto error;
+
+			if (! state_get_json_int_var (json_blocked_data,
+						"msg-id", serial))
+				goto error;
+
+			ret = state_hex_to_data (NULL,
+					dbus_message_data_str,
+					strlen (dbus_message_data_str),
+					&dbus_message_data_raw,
+					&raw_len);
+
+			if (ret < 0)
+				goto error;
+
+			if (! state_get_json_int_var (json_blocked_data, "msg-connection", conn_index))
+				goto error;
+
+			dbus_conn = control_conn_from_index (conn_index);
+			if (! dbus_conn)
+				goto error;
+
+			dbus_error_init (&error);
+			dbus_msg = dbus_message_demarshal (dbus_message_data_raw,
+					(int)raw_len,
+					&error);
+			if (! dbus_msg || dbus_error_is_set (&error)) {
+				nih_error ("%s: %s",
+						_("failed to demarshal D-Bus message"),
+						error.message);
+				dbus_error_free (&error);
+				goto error;
+			}
+
+			dbus_message_set_serial (dbus_msg, serial);
+
+			/* FIXME:
+			 *
+			 * *EITHER*:
+			 *
+			 * a) call nih_dbus_message_new() then *deref*
+			 * both the DBusMessage and the DBusConnection
+			 * (since they've *ALREADY* been refed by the
+			 * pre-re-exec call to nih_dbus_message_new(),
+			 *
+			 * b) Create nih_dbus_message_renew (const void
+			 * *parent, DBusConnection *connection,
+			 * DBusMessage *   message) that creates a
+			 * NihDBusMessage, but does *NOT* ref() the
+			 * msg+connection (again).
+			 */
+			/* FIXME: parent is incorrect?!? */
+			nih_dbus_msg = nih_dbus_message_new (NULL, dbus_conn, dbus_msg);
+			if (! nih_dbus_msg)
+				goto error;
+
+			blocked = NIH_MUST (blocked_new (parent, blocked_type, nih_dbus_msg));
+			nih_list_add (list, &blocked->entry);
+		}
+		break;
+	}
+
+	return blocked;
+
+error:
+	if (blocked)
+		nih_free (blocked);
+
+	return NULL;
+}
+
+/**
+ * state_deserialise_blocking:
+ *
+ * @parent: parent,
+ * @list: list to add new blocked entries to,
+ * @json: JSON representing object containing a blocking entry.
+ *
+ * Recreate Blocked objects from JSON encoded blocking array and add to
+ * specified list.
+ *
+ * Returns: 0 on success, or -1 on error.
+ **/
+int
+state_deserialise_blocking (void *parent, NihList *list, json_object *json)
+{
+	json_object *json_blocking;
+
+	nih_assert (parent);
+	nih_assert (list);
+	nih_assert (json);
+
+	if (! json_object_object_get_ex (json, "blocking", &json_blocking)) {
+		/* parent is not blocking anything */
+		return 0;
+	}
+
+	for (int i = 0; i < json_object_array_length (json_blocking); i++) {
+		json_object * json_blocked;
+
+		json_blocked = json_object_array_get_idx (json_blocking, i);
+		if (! json_blocked)
+			goto error;
+
+		/* Don't error in this scenario to allow for possibility
+		 * that version of Upstart that performed the
+		 * serialisation did not correctly handle user and
+		 * chroot jobs.
+		 */
+		if (! state_deserialise_blocked (parent, json_blocked, list))
+			;
+	}
+
+	return 0;
+
+error:
+	return -1;
+}
+
+/**
+ * state_data_to_hex:
+ *
+ * @parent: parent,
+ * @data: data to convert,
+ * @len: length of @data.
+ *
+ * Convert @data to a hex-encoded string.
+ *
+ * Returns: newly-allocated hex-encoded string,
+ * or NULL on error.
+ **/
+char *
+state_data_to_hex (void *parent, const void *data, size_t len)
+{
+	unsigned char  *p;
+	char           *encoded = NULL;
+	size_t          i;
+
+	nih_assert (data);
+	nih_assert (len);
+
+	for (i = 0, p = (unsigned char *)data;
+			i < len;
+			i++, p++) {
+		if (! nih_strcat_sprintf (&encoded, parent, "%02x", *p))
+			goto error;
+	}
+
+	return encoded;
+
+error:
+	if (encoded)
+		nih_free (encoded);
+
+	return NULL;
+}
+
+/**
+ * state_hex_to_data:
+ *
+ * @parent: parent,
+ * @hex_data: hex data to convert,
+ * @hex_len: length of @hex,
+ * @data: newly-allocated data,
+ * @data_len: length of @data.
+ *
+ * Convert hex-encoded data @hex back into its
+ * natural representation.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+int
+state_hex_to_data (void      *parent,
+		const void   *hex_data,
+		size_t        hex_len,
+		char        **data,
+		size_t       *data_len)
+{
+	char    *p;
+	char    *d;
+	char    *decoded;
+	size_t   new_len;
+
+	nih_assert (hex_data);
+	nih_assert (hex_len);
+	nih_assert (data);
+	nih_assert (data_len);
+	nih_assert (! (hex_len % 2));
+
+	new_len = hex_len / 2;
+
+	*data = decoded = nih_alloc (parent, new_len);
+	if (! decoded)
+		return 0;
+
+	memset (decoded, '\0', new_len);
+
+	d = (char *)decoded;
+
+	for (size_t i = 0; i < hex_len; i += 2, d++) {
+		char   byte;
+		char   str[3] = { '\0' };
+		char  *endptr;
+
+		p = ((char *)hex_data)+i;
+
+		str[0] = *p;
+		str[1] = *(p+1);
+
+		errno = 0;
+		byte = strtol (str, &endptr, 16);
+
+		if (errno || *endptr)
+			goto error;
+
+		*d = byte;
+	}
+
+	*data_len = (size_t)(d - decoded);
+
+	nih_assert (*data_len == new_len);
+
+	return 0;
+
+error:
+	nih_free (*data);
+	return -1;
+}
+
+/**
+ * perform_reexec:
+ *
+ * Perform a bare re-exec.
+ *
+ * Note that unless the appropriate command-line option has
+ * _already_ been specified in @args_copy, all internal state will be lost.
+ **/
+void
+perform_reexec (void)
+{
+	NihError    *err;
+	const char  *loglevel = NULL;
+
+	/* Although we have a copy of the original arguments (which may
+	 * have included an option to modify the log level), we need to
+	 * handle the case where the log priority has been changed at
+	 * runtime which potentially invalidates the original command-line
+	 * option value.
+	 *
+	 * Fortuitously, this can be handled easily: NIH option parsing
+	 * semantics allow any option to be specified multiple times -
+	 * the last value seen is used. Therefore, we just append the
+	 * current log-level option and ignore any existing (earlier)
+	 * log level options.
+	 *
+	 * Note that should Upstart be re-exec'ed too many times,
+	 * eventually an unexpected log level may result if the
+	 * command-line becomes too large (and thus truncates).
+	 *
+	 * The correct way to handle this would be to prune now invalid
+	 * options from the command-line to ensure it does not continue
+	 * to increase. That said, if we hit the limit, worse things
+	 * are probably going on so for now we'll settle for the
+	 * simplistic approach.
+	 */
+	if (nih_log_priority <= NIH_LOG_DEBUG) {
+		loglevel = "--debug";
+	} else if (nih_log_priority <= NIH_LOG_INFO) {
+		loglevel = "--verbose";
+	} else if (nih_log_priority >= NIH_LOG_ERROR) {
+		loglevel = "--error";
+	} else {
+		/* User has not modified default log level of
+		 * NIH_LOG_MESSAGE.
+		 */
+		loglevel = NULL;
+	}
+
+	if (loglevel)
+		NIH_MUST (nih_str_array_add (&args_copy, NULL, NULL, loglevel));
+
+	/* if the currently running instance wasn't invoked as
+	 * part of a re-exec, ensure that the next instance is (since
+	 * otherwise, why would this function be being called!? :)
+	 */
+	if (! restart)
+		NIH_MUST (nih_str_array_add (&args_copy, NULL, NULL, "--restart"));
+
+	/* Keep the spawn helper, which needn't start again */
+	spawn_helper_prepare_reexec ();
+
+	/* Write out the event trace, which the new instance continues */
+	event_trace_close ();
+
+	UPSTART_PROBE (reexec_exec);
+
+	execvp (args_copy[0], args_copy);
+	nih_error_raise_system ();
+
+	err = nih_error_get ();
+	nih_error (_("Failed to re-execute %s: %s"), args_copy[0], err->message);
+	nih_free (err);
+}
+
+/**
+ * stateful_reexec:
+ *
+ * Perform re-exec with state-passing. UPSTART must be capable of
+ * stateful re-exec for this routine to be called. Any failures
+ * result in a basic re-exec being performed where all state
+ * will be lost.
+ *
+ * The process involves the initial Upstart instance (PID 1) creating a
+ * pipe and then forking. The child then writes its serialised state
+ * over the pipe back to PID 1 which has now re-exec'd itself.
+ *
+ * Once the state has been passed, the child can exit.
+ **/
+void
+stateful_reexec (void)
+{
+	int             fds[2] = { -1, -1 };
+	pid_t           pid;
+	sigset_t        mask, oldmask;
+	nih_local char *state_string = NULL;
+	nih_local NihIoBuffer *state_buffer = NULL;
+	const char     *state_data;
+	size_t          len;
+	int             ret;
+	uint64_t        begin;
+	uint64_t        serialised;
+	uint64_t        prepared = 0;
+
+
+	/* Block signals while we work.  We're the last signal handler
+	 * installed so this should mean that they're all handled now.
+	 *
+	 * The child must make sure that it unblocks these again when
+	 * it's ready.
+	 */
+	sigfillset (&mask);
+	sigprocmask (SIG_BLOCK, &mask, &oldmask);
+
+	begin = job_timing_now ();
+
+	state_passing_fds = TRUE;
+
+	if (state_format == STATE_FORMAT_BINARY) {
+		ret = state_to_binary (&state_buffer);
+		if (! ret) {
+			state_data = state_buffer->buf;
+			len = state_buffer->len;
+		}
+	} else {
+		ret = state_to_string (&state_string, &len);
+		state_data = state_string;
+	}
+
+	state_passing_fds = FALSE;
+
+	serialised = job_timing_now ();
+
+	if (ret < 0) {
+		nih_error ("%s - %s",
+				_("Failed to generate serialisation data"),
+				_("reverting to stateless re-exec"));
+		goto reexec;
+	}
+
+	UPSTART_PROBE (reexec_serialised, len);
+
+	if (pipe (fds) < 0)
+		goto reexec;
+
+	nih_info (_("Performing stateful re-exec"));
+
+	/* retain the D-Bus connection across the re-exec */
+	control_prepare_reexec ();
+
+	/* Clear CLOEXEC flag for any job log objects prior to re-exec */
+	job_class_prepare_reexec ();
+
+	prepared = job_timing_now ();
+
+	UPSTART_PROBE (reexec_prepared);
+
+	pid = fork ();
+
+	if (pid < 0)
+		goto reexec;
+	else if (pid > 0) {
+		nih_local char *arg = NULL;
+
+		/* Parent */
+		close (fds[1]);
+
+		/* Tidy up from any previous re-exec */
+		clean_args (&args_copy);
+
+		/* Tell the new instance where to read the
+		 * serialisation data from.
+		 *
+		 * Note that if the "new" instance is actually an older
+		 * version of Upstart (that does not understand stateful
+		 * re-exec), due to the way NIH handles command-line
+		 * paring, this option will be ignored and the new instance
+		 * will therefore not be able to read the state and overall
+		 * a stateless re-exec will therefore be performed.
+		 */
+		arg = NIH_MUST (nih_strdup (NULL, "--state-fd"));
+		NIH_MUST (nih_str_array_add (&args_copy, NULL, NULL, arg));
+
+		arg = NIH_MUST (nih_sprintf (NULL, "%d", fds[0]));
+		NIH_MUST (nih_str_array_add (&args_copy, NULL, NULL, arg));
+
+		/* Tell the new instance how long we took */
+		arg = NIH_MUST (nih_sprintf (NULL, "%" PRIu64 ":%" PRIu64
+					     ":%" PRIu64 ":%" PRIu64,
+					     begin, serialised, prepared,
+					     job_timing_now ()));
+		if (setenv (STATE_REEXEC_TIMES_ENV, arg, TRUE) < 0)
+			nih_warn ("%s: %s", _("Unable to set environment"),
+				  strerror (errno));
+	} else {
+		/* Child */
+		close (fds[0]);
+
+		nih_info (_("Passing state from PID %d to parent"), (int)getpid ());
+
+		/* D-Bus name and the private control server connection must be
+		 * relinquished now to allow parent to acquire them.
+		 */
+		if (control_bus_release_name () < 0) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_error (_("Failed to release D-Bus name: %s"),
+					err->message);
+			nih_free (err);
+		}
+
+		control_server_close ();
+
+		if (state_write (fds[1], state_data, len) < 0) {
+			nih_error ("%s",
+				_("Failed to write serialisation data"));
+			exit (1);
+		}
+
+		/* The baton has now been passed */
+		exit (0);
+	}
+
+reexec:
+	/* Attempt stateful re-exec */
+	perform_reexec ();
+
+	unsetenv (STATE_REEXEC_TIMES_ENV);
+
+	/* We should never end up here since it likely indicates the
+	 * new init binary is damaged.
+	 *
+	 * All we can do is restore the signal handler and drop back into
+	 * the main loop.
+	 */
+
+	/* Restore */
+	sigprocmask (SIG_SETMASK, &oldmask, NULL);
+}
+
+/**
+ * clean_args:
+ *
+ * @argsp: pointer to pointer to array of string arguments.
+ *
+ * Remove any existing state fd and log-level-altering arguments.
+ *
+ * This stops command-line exhaustion if stateful re-exec is
+ * performed many times.
+ **/
+void
+clean_args (char ***argsp)
+{
+	int    i;
+	char **args;
+
+	nih_assert (argsp);
 
-			if (! state_get_json_int_var (json_blocked_data,
-						"msg-id", serial))
-				goto error;
+	for (args = *argsp, i = 0; args && args[i]; i++) {
+		int tmp = i;
 
-			ret = state_hex_to_data (NULL,
-					dbus_message_data_str,
-					strlen (dbus_message_data_str),
-					&dbus_message_data_raw,
-					&raw_len);
+		if (! strcmp (args[i], "--state-fd")) {
+			/* Remove existing entry and fd value */
+			nih_free (args[tmp]);
+			nih_free (args[tmp+1]);
 
-			if (ret < 0)
-				goto error;
+			/* shuffle up the remaining args */
+			for (int j = tmp+2; args[j]; tmp++, j++)
+				args[tmp] = args[j];
+			args[tmp] = NULL;
 
-			if (! state_get_json_int_var (json_blocked_data, "msg-connection", conn_index))
-				goto error;
+			/* reconsider the newly-shuffled index entry */
+			i--;
+		} else if ((! strcmp (args[i], "--debug")) ||
+				(! strcmp (args[i], "--verbose")) ||
+				(! strcmp (args[i], "--error")) ||
+				(! strcmp (args[i], "--restore-checkpoint"))) {
+			nih_free (args[i]);
 
-			dbus_conn = control_conn_from_index (conn_index);
-			if (! dbus_conn)
-				goto error;
+			/* shuffle up the remaining args */
+			for (int j = tmp+1; args[j]; tmp++, j++)
+				args[tmp] = args[j];
+			args[tmp] = NULL;
 
-			dbus_error_init (&error);
-			dbus_msg = dbus_message_demarshal (dbus_message_data_raw,
-					(int)raw_len,
-					&error);
-			if (! dbus_msg || dbus_error_is_set (&error)) {
-				nih_error ("%s: %s",
-						_("failed to demarshal D-Bus message"),
-						error.message);
-				dbus_error_free (&error);
-				goto error;
-			}
+			/* reconsider the newly-shuffled index entry */
+			i--;
+		}
+	}
+}
 
-			dbus_message_set_serial (dbus_msg, serial);
+/**
+ * state_reexec_stats_begin:
+ *
+ * @now: time state_read() was called.
+ *
+ * Reset state_reexec_stats, filling in the timings of the phases
+ * performed by the old instance from STATE_REEXEC_TIMES_ENV if it was
+ * set.
+ **/
+static void
+state_reexec_stats_begin (uint64_t now)
+{
+	const char  *value;
+	uint64_t     begin;
+	uint64_t     serialised;
+	uint64_t     prepared;
+	uint64_t     exec;
 
-			/* FIXME:
-			 *
-			 * *EITHER*:
-			 *
-			 * a) call nih_dbus_message_new() then *deref*
-			 * both the DBusMessage and the DBusConnection
-			 * (since they've *ALREADY* been refed by the
-			 * pre-re-exec call to nih_dbus_message_new(),
-			 *
-			 * b) Create nih_dbus_message_renew (const void
-			 * *parent, DBusConnection *connection,
-			 * DBusMessage *   message) that creates a
-			 * NihDBusMessage, but does *NOT* ref() the
-			 * msg+connection (again).
-			 */
-			/* FIXME: parent is incorrect?!? */
-			nih_dbus_msg = nih_dbus_message_new (NULL, dbus_conn, dbus_msg);
-			if (! nih_dbus_msg)
-				goto error;
+	memset (&state_reexec_stats, '\0', sizeof (state_reexec_stats));
+	state_reexec_begin = 0;
 
-			blocked = NIH_MUST (blocked_new (parent, blocked_type, nih_dbus_msg));
-			nih_list_add (list, &blocked->entry);
-		}
-		break;
+	value = getenv (STATE_REEXEC_TIMES_ENV);
+	if (! value)
+		return;
+
+	if (sscanf (value, "%" SCNu64 ":%" SCNu64 ":%" SCNu64 ":%" SCNu64,
+		    &begin, &serialised, &prepared, &exec) == 4
+	    && begin <= serialised && serialised <= prepared
+	    && prepared <= exec && exec <= now) {
+		state_reexec_begin = begin;
+
+		state_reexec_stats.serialise = serialised - begin;
+		state_reexec_stats.prepare = prepared - serialised;
+		state_reexec_stats.exec = now - exec;
 	}
 
-	return blocked;
+	/* Don't leak to jobs or to any further re-exec */
+	unsetenv (STATE_REEXEC_TIMES_ENV);
+}
 
-error:
-	if (blocked)
-		nih_free (blocked);
+/**
+ * state_reexec_stats_complete:
+ *
+ * Called once the new instance has finished initialising after a
+ * stateful re-exec and is about to enter the main loop, so that the
+ * total pause time can be calculated and the timings logged.
+ **/
+void
+state_reexec_stats_complete (void)
+{
+	if (! state_reexec_stats.valid)
+		return;
 
-	return NULL;
+	if (state_reexec_begin)
+		state_reexec_stats.total = job_timing_now () - state_reexec_begin;
+
+	nih_info (_("Stateful re-exec paused for %" PRIu64 "us "
+		    "(serialise %" PRIu64 "us, prepare %" PRIu64 "us, "
+		    "exec %" PRIu64 "us, read %" PRIu64 "us, "
+		    "parse %" PRIu64 "us, resolve %" PRIu64 "us)"),
+		  state_reexec_stats.total,
+		  state_reexec_stats.serialise,
+		  state_reexec_stats.prepare,
+		  state_reexec_stats.exec,
+		  state_reexec_stats.read,
+		  state_reexec_stats.parse,
+		  state_reexec_stats.resolve_deps);
 }
 
 /**
- * state_deserialise_blocking:
+ * state_reexec_stats_to_string:
  *
- * @parent: parent,
- * @list: list to add new blocked entries to,
- * @json: JSON representing object containing a blocking entry.
+ * @parent: parent for new string.
  *
- * Recreate Blocked objects from JSON encoded blocking array and add to
- * specified list.
+ * Encode state_reexec_stats as a JSON object whose values are in
+ * microseconds; the object is empty if no stateful re-exec has been
+ * performed.
  *
- * Returns: 0 on success, or -1 on error.
+ * Returns: newly-allocated JSON string, or NULL on insufficient memory.
  **/
-int
-state_deserialise_blocking (void *parent, NihList *list, json_object *json)
+char *
+state_reexec_stats_to_string (const void *parent)
 {
-	json_object *json_blocking;
+	json_object  *json;
+	const char   *value;
+	char         *str = NULL;
 
-	nih_assert (parent);
-	nih_assert (list);
-	nih_assert (json);
+	json = json_object_new_object ();
+	if (! json)
+		return NULL;
 
-	if (! json_object_object_get_ex (json, "blocking", &json_blocking)) {
-		/* parent is not blocking anything */
-		return 0;
+	if (state_reexec_stats.valid) {
+		if (! state_set_json_int_var (json, "serialise", state_reexec_stats.serialise)
+		    || ! state_set_json_int_var (json, "prepare", state_reexec_stats.prepare)
+		    || ! state_set_json_int_var (json, "exec", state_reexec_stats.exec)
+		    || ! state_set_json_int_var (json, "read", state_reexec_stats.read)
+		    || ! state_set_json_int_var (json, "parse", state_reexec_stats.parse)
+		    || ! state_set_json_int_var (json, "resolve_deps", state_reexec_stats.resolve_deps)
+		    || ! state_set_json_int_var (json, "total", state_reexec_stats.total))
+			goto out;
 	}
 
-	for (int i = 0; i < json_object_array_length (json_blocking); i++) {
-		json_object * json_blocked;
+	value = json_object_to_json_string (json);
+	if (value)
+		str = nih_strdup (parent, value);
 
-		json_blocked = json_object_array_get_idx (json_blocking, i);
-		if (! json_blocked)
-			goto error;
+out:
+	json_object_put (json);
 
-		/* Don't error in this scenario to allow for possibility
-		 * that version of Upstart that performed the
-		 * serialisation did not correctly handle user and
-		 * chroot jobs.
-		 */
-		if (! state_deserialise_blocked (parent, json_blocked, list))
-			;
-	}
+	return str;
+}
 
-	return 0;
+/**
+ * state_checkpoint_path:
+ *
+ * Returns: path of the file that state is checkpointed to.
+ **/
+const char *
+state_checkpoint_path (void)
+{
+	const char *path;
 
-error:
-	return -1;
+	path = getenv (STATE_CHECKPOINT_ENV);
+
+	return path ? path : STATE_CHECKPOINT_FILE;
 }
 
 /**
- * state_data_to_hex:
- *
- * @parent: parent,
- * @data: data to convert,
- * @len: length of @data.
+ * state_checkpoint_restore_path:
+ * @parent: parent object for new string.
  *
- * Convert @data to a hex-encoded string.
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned string.  When all parents
+ * of the returned string are freed, the returned string will also be
+ * freed.
  *
- * Returns: newly-allocated hex-encoded string,
- * or NULL on error.
+ * Returns: newly allocated path that state_checkpoint_claim() moves the
+ * checkpoint to, or NULL on insufficient memory.
  **/
 char *
-state_data_to_hex (void *parent, const void *data, size_t len)
+state_checkpoint_restore_path (const void *parent)
 {
-	unsigned char  *p;
-	char           *encoded = NULL;
-	size_t          i;
+	return nih_sprintf (parent, "%s.restore", state_checkpoint_path ());
+}
 
-	nih_assert (data);
-	nih_assert (len);
+/**
+ * state_checkpoint_claim:
+ * @restore_path: path from state_checkpoint_restore_path().
+ *
+ * Move the last checkpoint to @restore_path, for a new instance to
+ * restore with state_checkpoint_open() once we have crashed.  Since that
+ * removes it, a checkpoint is only ever restored once: should the
+ * restored state itself cause a crash before a new checkpoint has been
+ * written, there is nothing left to claim and we don't loop re-executing
+ * into the same state.
+ *
+ * @restore_path must be prepared in advance since this is called from
+ * crash_handler(), so may not allocate.
+ *
+ * Returns: 0 on success, -1 if there is no checkpoint to claim.
+ **/
+int
+state_checkpoint_claim (const char *restore_path)
+{
+	nih_assert (restore_path);
 
-	for (i = 0, p = (unsigned char *)data;
-			i < len;
-			i++, p++) {
-		if (! nih_strcat_sprintf (&encoded, parent, "%02x", *p))
-			goto error;
+	return rename (state_checkpoint_path (), restore_path);
+}
+
+/**
+ * state_checkpoint_open:
+ *
+ * Open the checkpoint claimed by state_checkpoint_claim() for reading,
+ * removing it so that it cannot be restored again.
+ *
+ * Returns: file descriptor open on checkpoint, or -1 on error.
+ **/
+int
+state_checkpoint_open (void)
+{
+	nih_local char *path = NULL;
+	int             fd;
+
+	path = state_checkpoint_restore_path (NULL);
+	if (! path) {
+		errno = ENOMEM;
+		return -1;
 	}
 
-	return encoded;
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
 
-error:
-	if (encoded)
-		nih_free (encoded);
+	(void)unlink (path);
 
-	return NULL;
+	return fd;
 }
 
 /**
- * state_hex_to_data:
+ * state_touch:
  *
- * @parent: parent,
- * @hex_data: hex data to convert,
- * @hex_len: length of @hex,
- * @data: newly-allocated data,
- * @data_len: length of @data.
+ * Advance state_generation for an object that has been created or
+ * changed.
  *
- * Convert hex-encoded data @hex back into its
- * natural representation.
+ * Returns: new generation, to be stored in the object.
+ **/
+uint64_t
+state_touch (void)
+{
+	return ++state_generation;
+}
+
+/**
+ * state_changed:
  *
- * Returns: 0 on success, -1 on error.
+ * Called whenever state that would be serialised changes, to have it
+ * checkpointed once state_checkpoint_interval has passed; further
+ * changes in the meantime are covered by the same checkpoint, so that
+ * its cost is bounded however busy we are.
+ *
+ * state_generation is advanced as well, callers record it in the
+ * object that changed.
  **/
-int
-state_hex_to_data (void      *parent,
-		const void   *hex_data,
-		size_t        hex_len,
-		char        **data,
-		size_t       *data_len)
+void
+state_changed (void)
 {
-	char    *p;
-	char    *d;
-	char    *decoded;
-	size_t   new_len;
+	state_touch ();
 
-	nih_assert (hex_data);
-	nih_assert (hex_len);
-	nih_assert (data);
-	nih_assert (data_len);
-	nih_assert (! (hex_len % 2));
+	if (! state_checkpoint_interval || state_forked)
+		return;
 
-	new_len = hex_len / 2;
+	state_checkpoint_dirty = TRUE;
 
-	*data = decoded = nih_alloc (parent, new_len);
-	if (! decoded)
-		return 0;
+	/* Once a checkpoint being written is done, another is scheduled
+	 * if needed.
+	 */
+	if (state_checkpoint_timer || state_checkpoint_pid)
+		return;
 
-	memset (decoded, '\0', new_len);
+	/* Should this fail, the next change will try again */
+	state_checkpoint_timer = timer_wheel_add (
+		NULL, state_checkpoint_interval,
+		(WheelTimerCb)state_checkpoint_timer_cb, NULL);
+}
 
-	d = (char *)decoded;
+/**
+ * state_checkpoint_timer_cb:
+ *
+ * @data: not used,
+ * @timer: timer that triggered.
+ *
+ * Called state_checkpoint_interval milliseconds after state first
+ * changed since the last checkpoint, to take another.
+ **/
+static void
+state_checkpoint_timer_cb (void       *data,
+			   WheelTimer *timer)
+{
+	nih_assert (state_checkpoint_timer == timer);
 
-	for (size_t i = 0; i < hex_len; i += 2, d++) {
-		char   byte;
-		char   str[3] = { '\0' };
-		char  *endptr;
+	/* The timer is freed once we return */
+	state_checkpoint_timer = NULL;
 
-		p = ((char *)hex_data)+i;
+	if (state_checkpoint () < 0) {
+		NihError *err;
 
-		str[0] = *p;
-		str[1] = *(p+1);
+		err = nih_error_get ();
+		nih_warn ("%s: %s", _("Unable to checkpoint state"),
+			  err->message);
+		nih_free (err);
+	}
+}
+
+/**
+ * state_checkpoint:
+ *
+ * Write the current state to state_checkpoint_path() if it has changed
+ * since the last checkpoint was begun.
+ *
+ * The state is serialised and written by a child process, as for a
+ * stateful re-exec, and it's replaced atomically so that the file
+ * always holds a complete checkpoint; we need only copy our page
+ * tables, and never wait on the disk.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+state_checkpoint (void)
+{
+	int   *fds;
+	pid_t  pid;
 
-		errno = 0;
-		byte = strtol (str, &endptr, 16);
+	if (! state_checkpoint_dirty || state_checkpoint_pid)
+		return 0;
 
-		if (errno || *endptr)
-			goto error;
+	fds = job_class_reexec_fds (NULL);
+	if (! fds)
+		nih_return_no_memory_error (-1);
 
-		*d = byte;
+	pid = fork ();
+	if (pid < 0) {
+		nih_error_raise_system ();
+		nih_free (fds);
+		return -1;
+	} else if (! pid) {
+		state_checkpoint_child ();
 	}
 
-	*data_len = (size_t)(d - decoded);
+	state_checkpoint_pid = pid;
+	state_checkpoint_dirty = FALSE;
 
-	nih_assert (*data_len == new_len);
+	NIH_MUST (nih_child_add_watch (NULL, pid,
+				       NIH_CHILD_EXITED | NIH_CHILD_KILLED
+				       | NIH_CHILD_DUMPED,
+				       (NihChildHandler)state_checkpoint_reaped,
+				       fds));
 
 	return 0;
-
-error:
-	nih_free (*data);
-	return -1;
 }
 
 /**
- * perform_reexec:
+ * state_checkpoint_child:
  *
- * Perform a bare re-exec.
+ * Serialise state in the child process forked by state_checkpoint(),
+ * and write it to a new file which then replaces the last checkpoint.
  *
- * Note that unless the appropriate command-line option has
- * _already_ been specified in @args_copy, all internal state will be lost.
+ * This function does not return; the child exits with a non-zero status
+ * on failure.
  **/
-void
-perform_reexec (void)
+static void
+state_checkpoint_child (void)
 {
-	NihError    *err;
-	const char  *loglevel = NULL;
+	nih_local NihIoBuffer *buffer = NULL;
+	nih_local char        *state_string = NULL;
+	nih_local char        *new_path = NULL;
+	const char            *path;
+	sigset_t               mask;
+	size_t                 len;
+
+	/* Leave all signals for init to handle */
+	sigfillset (&mask);
+	sigprocmask (SIG_BLOCK, &mask, NULL);
 
-	/* Although we have a copy of the original arguments (which may
-	 * have included an option to modify the log level), we need to
-	 * handle the case where the log priority has been changed at
-	 * runtime which potentially invalidates the original command-line
-	 * option value.
-	 *
-	 * Fortuitously, this can be handled easily: NIH option parsing
-	 * semantics allow any option to be specified multiple times -
-	 * the last value seen is used. Therefore, we just append the
-	 * current log-level option and ignore any existing (earlier)
-	 * log level options.
-	 *
-	 * Note that should Upstart be re-exec'ed too many times,
-	 * eventually an unexpected log level may result if the
-	 * command-line becomes too large (and thus truncates).
-	 *
-	 * The correct way to handle this would be to prune now invalid
-	 * options from the command-line to ensure it does not continue
-	 * to increase. That said, if we hit the limit, worse things
-	 * are probably going on so for now we'll settle for the
-	 * simplistic approach.
-	 */
-	if (nih_log_priority <= NIH_LOG_DEBUG) {
-		loglevel = "--debug";
-	} else if (nih_log_priority <= NIH_LOG_INFO) {
-		loglevel = "--verbose";
-	} else if (nih_log_priority >= NIH_LOG_ERROR) {
-		loglevel = "--error";
+	state_forked = TRUE;
+
+	if (state_format == STATE_FORMAT_BINARY) {
+		if (state_to_binary (&buffer) < 0)
+			_exit (1);
 	} else {
-		/* User has not modified default log level of
-		 * NIH_LOG_MESSAGE.
-		 */
-		loglevel = NULL;
+		if (state_to_string (&state_string, &len) < 0)
+			_exit (1);
+
+		buffer = nih_io_buffer_new (NULL);
+		if (! buffer || nih_io_buffer_push (buffer, state_string, len) < 0)
+			_exit (1);
 	}
 
-	if (loglevel)
-		NIH_MUST (nih_str_array_add (&args_copy, NULL, NULL, loglevel));
+	path = state_checkpoint_path ();
 
-	/* if the currently running instance wasn't invoked as
-	 * part of a re-exec, ensure that the next instance is (since
-	 * otherwise, why would this function be being called!? :)
-	 */
-	if (! restart)
-		NIH_MUST (nih_str_array_add (&args_copy, NULL, NULL, "--restart"));
+	new_path = nih_sprintf (NULL, "%s.new", path);
+	if (! new_path)
+		_exit (1);
 
-	execvp (args_copy[0], args_copy);
-	nih_error_raise_system ();
+	(void)unlink (new_path);
 
-	err = nih_error_get ();
-	nih_error (_("Failed to re-execute %s: %s"), args_copy[0], err->message);
-	nih_free (err);
+	if (state_write_path (new_path, buffer, TRUE) < 0
+	    || rename (new_path, path) < 0) {
+		nih_error ("%s %s: %s", _("Unable to write checkpoint"),
+			   path, strerror (errno));
+		(void)unlink (new_path);
+		_exit (1);
+	}
+
+	_exit (0);
 }
 
 /**
- * stateful_reexec:
+ * state_checkpoint_reaped:
  *
- * Perform re-exec with state-passing. UPSTART must be capable of
- * stateful re-exec for this routine to be called. Any failures
- * result in a basic re-exec being performed where all state
- * will be lost.
+ * @fds: file descriptors the checkpoint refers to,
+ * @pid: process writing the checkpoint,
+ * @event: event that occurred on the child,
+ * @status: exit status or signal raised.
  *
- * The process involves the initial Upstart instance (PID 1) creating a
- * pipe and then forking. The child then writes its serialised state
- * over the pipe back to PID 1 which has now re-exec'd itself.
+ * Called once the process writing a checkpoint has finished, to record
+ * what it refers to should it have succeeded, and to begin waiting for
+ * the next should state have changed while it was being written.
+ **/
+static void
+state_checkpoint_reaped (int            *fds,
+			 pid_t           pid,
+			 NihChildEvents  event,
+			 int             status)
+{
+	int *old_fds;
+
+	nih_assert (fds != NULL);
+	nih_assert (pid == state_checkpoint_pid);
+
+	state_checkpoint_pid = 0;
+
+	if (event == NIH_CHILD_EXITED && ! status) {
+		/* Take care that a crash never sees a freed array */
+		old_fds = state_checkpoint_fds;
+		state_checkpoint_fds = fds;
+
+		if (old_fds)
+			nih_free (old_fds);
+	} else {
+		nih_warn (_("Unable to checkpoint state"));
+		nih_free (fds);
+	}
+
+	if (state_checkpoint_dirty)
+		state_changed ();
+}
+
+/**
+ * state_checkpoint_inherit_fds:
  *
- * Once the state has been passed, the child can exit.
+ * Clear the CLOEXEC flag of every file descriptor the last checkpoint
+ * refers to, so that a new instance exec'd to recover from a crash may
+ * read it.  Only async-signal-safe functions are called, since this is
+ * called from the crash handler.
  **/
 void
-stateful_reexec (void)
+state_checkpoint_inherit_fds (void)
 {
-	int             fds[2] = { -1, -1 };
-	pid_t           pid;
-	sigset_t        mask, oldmask;
-	nih_local char *state_data = NULL;
-	size_t          len;
+	int *fds = state_checkpoint_fds;
 
+	if (! fds)
+		return;
 
-	/* Block signals while we work.  We're the last signal handler
-	 * installed so this should mean that they're all handled now.
-	 *
-	 * The child must make sure that it unblocks these again when
-	 * it's ready.
-	 */
-	sigfillset (&mask);
-	sigprocmask (SIG_BLOCK, &mask, &oldmask);
+	for (; *fds != -1; fds++) {
+		int flags;
 
-	if (state_to_string (&state_data, &len) < 0) {
-		nih_error ("%s - %s",
-				_("Failed to generate serialisation data"),
-				_("reverting to stateless re-exec"));
-		goto reexec;
+		flags = fcntl (*fds, F_GETFD);
+		if (flags >= 0)
+			(void)fcntl (*fds, F_SETFD, flags & ~FD_CLOEXEC);
 	}
+}
 
-	if (pipe (fds) < 0)
-		goto reexec;
-
-	nih_info (_("Performing stateful re-exec"));
+/**
+ * state_snapshot:
+ *
+ * @parent: parent object for new NihIo,
+ * @handler: function to call with state,
+ * @data: data pointer to pass to @handler.
+ *
+ * Serialise state to JSON without blocking: a child process is forked to
+ * serialise its copy-on-write view of our memory and stream the result
+ * back over a pipe, and @handler is called from the main loop once all
+ * of it has been read (or once it's known the child failed).
+ *
+ * The returned NihIo reads the child's output; should it be freed
+ * before then, @handler is never called.
+ *
+ * Returns: newly allocated NihIo or NULL on raised error.
+ **/
+NihIo *
+state_snapshot (const void           *parent,
+		StateSnapshotHandler  handler,
+		void                 *data)
+{
+	StateSnapshot *snapshot;
+	NihIo         *io;
+	int            fds[2];
+	pid_t          pid;
 
-	/* retain the D-Bus connection across the re-exec */
-	control_prepare_reexec ();
+	nih_assert (handler != NULL);
 
-	/* Clear CLOEXEC flag for any job log objects prior to re-exec */
-	job_class_prepare_reexec ();
+	if (pipe2 (fds, O_CLOEXEC) < 0)
+		nih_return_system_error (NULL);
 
 	pid = fork ();
+	if (pid < 0) {
+		nih_error_raise_system ();
+		close (fds[0]);
+		close (fds[1]);
+		return NULL;
+	} else if (! pid) {
+		close (fds[0]);
+		state_snapshot_child (fds[1]);
+	}
 
-	if (pid < 0)
-		goto reexec;
-	else if (pid > 0) {
-		nih_local char *arg = NULL;
+	/* The child is reaped by the handler for all processes, which
+	 * ignores it.
+	 */
+	close (fds[1]);
 
-		/* Parent */
-		close (fds[1]);
+	io = nih_io_reopen (parent, fds[0], NIH_IO_STREAM, NULL,
+			    (NihIoCloseHandler)state_snapshot_close,
+			    (NihIoErrorHandler)state_snapshot_error, NULL);
+	if (! io) {
+		close (fds[0]);
+		return NULL;
+	}
 
-		/* Tidy up from any previous re-exec */
-		clean_args (&args_copy);
+	snapshot = nih_new (io, StateSnapshot);
+	if (! snapshot) {
+		nih_free (io);
+		nih_return_no_memory_error (NULL);
+	}
 
-		/* Tell the new instance where to read the
-		 * serialisation data from.
-		 *
-		 * Note that if the "new" instance is actually an older
-		 * version of Upstart (that does not understand stateful
-		 * re-exec), due to the way NIH handles command-line
-		 * paring, this option will be ignored and the new instance
-		 * will therefore not be able to read the state and overall
-		 * a stateless re-exec will therefore be performed.
-		 */
-		arg = NIH_MUST (nih_strdup (NULL, "--state-fd"));
-		NIH_MUST (nih_str_array_add (&args_copy, NULL, NULL, arg));
+	snapshot->handler = handler;
+	snapshot->data = data;
 
-		arg = NIH_MUST (nih_sprintf (NULL, "%d", fds[0]));
-		NIH_MUST (nih_str_array_add (&args_copy, NULL, NULL, arg));
-	} else {
-		/* Child */
-		close (fds[0]);
+	io->data = snapshot;
 
-		nih_info (_("Passing state from PID %d to parent"), (int)getpid ());
+	return io;
+}
 
-		/* D-Bus name and the private control server connection must be
-		 * relinquished now to allow parent to acquire them.
-		 */
-		if (control_bus_release_name () < 0) {
-			NihError *err;
+/**
+ * state_snapshot_child:
+ *
+ * @fd: write end of pipe to parent.
+ *
+ * Serialise state in the child process forked by state_snapshot() and
+ * write it to @fd, preceded by its length so that the parent can tell
+ * it has all of it.
+ *
+ * This function does not return.
+ **/
+static void
+state_snapshot_child (int fd)
+{
+	nih_local char *state_string = NULL;
+	sigset_t        mask;
+	uint64_t        len = 0;
+	size_t          state_len;
+	size_t          written = 0;
+	ssize_t         ret;
+
+	/* Leave all signals for init to handle */
+	sigfillset (&mask);
+	sigprocmask (SIG_BLOCK, &mask, NULL);
 
-			err = nih_error_get ();
-			nih_error (_("Failed to release D-Bus name: %s"),
-					err->message);
-			nih_free (err);
-		}
+	state_forked = TRUE;
 
-		control_server_close ();
+	if (state_to_string (&state_string, &state_len) < 0)
+		_exit (1);
 
-		if (state_write (fds[1], state_data, len) < 0) {
-			nih_error ("%s",
-				_("Failed to write serialisation data"));
-			exit (1);
-		}
+	len = state_len;
 
-		/* The baton has now been passed */
-		exit (0);
-	}
+	if (write (fd, &len, sizeof (len)) != sizeof (len))
+		_exit (1);
 
-reexec:
-	/* Attempt stateful re-exec */
-	perform_reexec ();
+	while (written < state_len) {
+		ret = write (fd, state_string + written, state_len - written);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			_exit (1);
 
-	/* We should never end up here since it likely indicates the
-	 * new init binary is damaged.
-	 *
-	 * All we can do is restore the signal handler and drop back into
-	 * the main loop.
-	 */
+		written += (size_t)ret;
+	}
 
-	/* Restore */
-	sigprocmask (SIG_SETMASK, &oldmask, NULL);
+	_exit (0);
 }
 
 /**
- * clean_args:
- *
- * @argsp: pointer to pointer to array of string arguments.
+ * state_snapshot_close:
  *
- * Remove any existing state fd and log-level-altering arguments.
+ * @snapshot: StateSnapshot,
+ * @io: NihIo reading from child.
  *
- * This stops command-line exhaustion if stateful re-exec is
- * performed many times.
+ * Called when the child forked by state_snapshot() has closed its end of
+ * the pipe, to pass the state it wrote to the handler; should less than
+ * the length it began with have been read, it failed part way.
  **/
-void
-clean_args (char ***argsp)
+static void
+state_snapshot_close (StateSnapshot *snapshot,
+		      NihIo         *io)
 {
-	int    i;
-	char **args;
+	NihIoBuffer *buffer;
+	uint64_t     len;
 
-	nih_assert (argsp);
+	nih_assert (snapshot != NULL);
+	nih_assert (io != NULL);
 
-	for (args = *argsp, i = 0; args && args[i]; i++) {
-		int tmp = i;
+	buffer = io->recv_buf;
 
-		if (! strcmp (args[i], "--state-fd")) {
-			/* Remove existing entry and fd value */
-			nih_free (args[tmp]);
-			nih_free (args[tmp+1]);
+	if (buffer->len >= sizeof (len))
+		memcpy (&len, buffer->buf, sizeof (len));
 
-			/* shuffle up the remaining args */
-			for (int j = tmp+2; args[j]; tmp++, j++)
-				args[tmp] = args[j];
-			args[tmp] = NULL;
+	if (buffer->len >= sizeof (len) && buffer->len - sizeof (len) == len) {
+		snapshot->handler (snapshot->data, buffer->buf + sizeof (len),
+				   (size_t)len);
+	} else {
+		snapshot->handler (snapshot->data, NULL, 0);
+	}
 
-			/* reconsider the newly-shuffled index entry */
-			i--;
-		} else if ((! strcmp (args[i], "--debug")) ||
-				(! strcmp (args[i], "--verbose")) ||
-				(! strcmp (args[i], "--error"))) {
-			nih_free (args[i]);
+	nih_free (io);
+}
 
-			/* shuffle up the remaining args */
-			for (int j = tmp+1; args[j]; tmp++, j++)
-				args[tmp] = args[j];
-			args[tmp] = NULL;
+/**
+ * state_snapshot_error:
+ *
+ * @snapshot: StateSnapshot,
+ * @io: NihIo reading from child.
+ *
+ * Called should reading from the child forked by state_snapshot() fail,
+ * to tell the handler.
+ **/
+static void
+state_snapshot_error (StateSnapshot *snapshot,
+		      NihIo         *io)
+{
+	NihError *err;
 
-			/* reconsider the newly-shuffled index entry */
-			i--;
-		}
-	}
+	nih_assert (snapshot != NULL);
+	nih_assert (io != NULL);
+
+	err = nih_error_get ();
+	nih_warn ("%s: %s", _("Unable to read state snapshot"), err->message);
+	nih_free (err);
+
+	snapshot->handler (snapshot->data, NULL, 0);
+
+	nih_free (io);
 }
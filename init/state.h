@@ -328,6 +328,7 @@
 #define INIT_STATE_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <errno.h>
 
 #include <sys/time.h>
@@ -336,9 +337,13 @@
 #include <nih/macros.h>
 #include <nih/alloc.h>
 #include <nih/list.h>
+#include <nih/io.h>
 
 #include <json.h>
 
+/* Defined in job_class.h */
+struct job_placement;
+
 /**
  * STATE_WAIT_SECS:
  *
@@ -372,6 +377,119 @@
  **/
 #define STATE_FILE "upstart.state"
 
+/**
+ * STATE_REEXEC_TIMES_ENV:
+ *
+ * Name of environment variable used by the old instance to pass the
+ * times (in microseconds on CLOCK_MONOTONIC) at which the phases of a
+ * stateful re-exec it performed completed. The new instance unsets it
+ * on reading it so that it is not inherited by jobs.
+ **/
+#define STATE_REEXEC_TIMES_ENV "UPSTART_REEXEC_TIMES"
+
+/**
+ * STATE_BINARY_MAGIC:
+ *
+ * Bytes that start state data in STATE_FORMAT_BINARY (which can never
+ * start JSON state data).
+ **/
+#define STATE_BINARY_MAGIC "UPSTATE"
+
+/**
+ * STATE_BINARY_VERSION:
+ *
+ * Version of STATE_FORMAT_BINARY written; bump whenever the record
+ * layout changes incompatibly.
+ **/
+#define STATE_BINARY_VERSION 1
+
+/**
+ * StateFormat:
+ *
+ * Format used to pass state to the new instance on stateful re-exec.
+ **/
+typedef enum state_format {
+	STATE_FORMAT_JSON,
+	STATE_FORMAT_BINARY,
+} StateFormat;
+
+/**
+ * StateRecordType:
+ *
+ * Types of record in STATE_FORMAT_BINARY state data.
+ *
+ * STATE_RECORD_SECTION records contain a nul-terminated name followed
+ * by the JSON encoding of the top-level value of that name.
+ * STATE_RECORD_BLOB records contain raw data referred to by index from
+ * subsequent sections (see state_blob_add()). A STATE_RECORD_END
+ * record terminates the data.
+ **/
+typedef enum state_record_type {
+	STATE_RECORD_END,
+	STATE_RECORD_SECTION,
+	STATE_RECORD_BLOB,
+} StateRecordType;
+
+/**
+ * StateBinaryHeader:
+ *
+ * @magic: STATE_BINARY_MAGIC (including terminator),
+ * @version: STATE_BINARY_VERSION of writer,
+ * @reserved: always zero.
+ *
+ * Header at the start of STATE_FORMAT_BINARY state data. Since state is
+ * only ever passed between processes on the same machine, all values
+ * are in host byte order.
+ **/
+typedef struct state_binary_header {
+	char      magic[8];
+	uint32_t  version;
+	uint32_t  reserved;
+} StateBinaryHeader;
+
+/**
+ * StateRecordHeader:
+ *
+ * @type: StateRecordType of record,
+ * @name_len: bytes of name (including terminator) following header,
+ * @len: bytes of data following name.
+ *
+ * Header preceding each record in STATE_FORMAT_BINARY state data.
+ **/
+typedef struct state_record_header {
+	uint32_t  type;
+	uint32_t  name_len;
+	uint64_t  len;
+} StateRecordHeader;
+
+/**
+ * StateReexecStats:
+ *
+ * @valid: TRUE if a stateful re-exec has been timed,
+ * @serialise: time taken to serialise state,
+ * @prepare: time taken to prepare job and D-Bus fds to survive exec,
+ * @exec: time from exec'ing the new instance to it starting to read
+ *  state,
+ * @read: time spent waiting for and reading state (and so the time
+ *  taken by the old instance's child to write it),
+ * @parse: time taken to parse state and recreate objects,
+ * @resolve_deps: time taken by state_deserialise_resolve_deps(),
+ * @total: time PID 1 was unresponsive, from the old instance blocking
+ *  signals to the new instance entering the main loop.
+ *
+ * Timings of the most recent stateful re-exec, all in microseconds.
+ **/
+typedef struct state_reexec_stats {
+	int       valid;
+	uint64_t  serialise;
+	uint64_t  prepare;
+	uint64_t  exec;
+	uint64_t  read;
+	uint64_t  parse;
+	uint64_t  resolve_deps;
+	uint64_t  total;
+} StateReexecStats;
+
 /**
  * state_get_timeout:
  *
@@ -1126,6 +1244,20 @@ typedef const char *(*EnumSerialiser) (int value);
  **/
 typedef int (*EnumDeserialiser) (const char *name);
 
+/**
+ * StateSnapshotHandler:
+ *
+ * @data: data pointer given to state_snapshot(),
+ * @state: JSON string of state, or NULL on failure,
+ * @len: length of @state.
+ *
+ * Called once the child process forked by state_snapshot() has
+ * serialised state.  @state is not nul-terminated, and is only valid
+ * for the duration of the call.
+ **/
+typedef void (*StateSnapshotHandler) (void *data, const char *state,
+				      size_t len);
+
 int  state_read          (int fd)
 	__attribute__ ((warn_unused_result));
 
@@ -1141,6 +1273,14 @@ int  state_write_objects (int fd, const char *state_data, size_t len)
 int  state_to_string (char **json_string, size_t *len)
 	__attribute__ ((warn_unused_result));
 
+int  state_to_string_filtered (char **json_string, size_t *len,
+			       char * const *kinds, char * const *names,
+			       uint64_t since)
+	__attribute__ ((warn_unused_result));
+
+int  state_to_binary (NihIoBuffer **buffer)
+	__attribute__ ((warn_unused_result));
+
 int    state_from_string (const char *state)
 	__attribute__ ((warn_unused_result));
 
@@ -1220,11 +1360,50 @@ json_object *state_rlimit_serialise (const struct rlimit *rlimit)
 struct rlimit *state_rlimit_deserialise (json_object *json)
 	__attribute__ ((warn_unused_result));
 
+json_object *state_placement_serialise (const struct job_placement *placement)
+	__attribute__ ((warn_unused_result));
+
+struct job_placement *state_placement_deserialise (const void *parent,
+						   json_object *json)
+	__attribute__ ((warn_unused_result));
+
 int state_get_version (void)
 	__attribute__ ((warn_unused_result));
 
+ssize_t state_blob_add (const void *data, size_t len)
+	__attribute__ ((warn_unused_result));
+
+int state_blob_get (size_t index, const char **data, size_t *len)
+	__attribute__ ((warn_unused_result));
+
+void  state_reexec_stats_complete (void);
+
+const char *state_checkpoint_path (void);
+char       *state_checkpoint_restore_path (const void *parent)
+	__attribute__ ((warn_unused_result));
+int         state_checkpoint_claim (const char *restore_path);
+int         state_checkpoint_open (void)
+	__attribute__ ((warn_unused_result));
+uint64_t    state_touch           (void);
+void        state_changed         (void);
+int         state_checkpoint      (void);
+void        state_checkpoint_inherit_fds (void);
+
+NihIo      *state_snapshot        (const void *parent,
+				   StateSnapshotHandler handler, void *data)
+	__attribute__ ((warn_unused_result));
+
+char *state_reexec_stats_to_string (const void *parent)
+	__attribute__ ((warn_unused_result));
+
 extern char **args_copy;
 extern int restart;
+extern StateFormat state_format;
+extern StateReexecStats state_reexec_stats;
+extern int state_checkpoint_interval;
+extern uint64_t state_generation;
+extern int state_forked;
+extern int state_passing_fds;
 
 void perform_reexec  (void);
 void stateful_reexec (void);
@@ -0,0 +1,439 @@
+/* upstart
+ *
+ * status_page.c - shared memory page of job states
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/hash.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include "job_class.h"
+#include "job.h"
+#include "status_page.h"
+
+
+/* Prototypes for static functions */
+static void status_page_mark_closed (const char *path);
+static void status_page_write       (Job *job, int assign);
+static void status_page_clear_jobs  (void);
+
+
+/**
+ * status_page:
+ *
+ * Header of the status page mapped into our address space, or NULL if
+ * the page is not being published.
+ **/
+static UpstartStatusHeader *status_page = NULL;
+
+/**
+ * status_page_entries:
+ *
+ * Entries of status_page.
+ **/
+static UpstartStatusEntry *status_page_entries = NULL;
+
+/**
+ * status_page_size:
+ *
+ * Size of the mapping of status_page.
+ **/
+static size_t status_page_size = 0;
+
+/**
+ * status_page_free:
+ *
+ * Entries of status_page not in use, taken from the end; those never
+ * used are at the start so that they're taken lowest first.
+ **/
+static uint32_t *status_page_free = NULL;
+static size_t    status_page_free_len = 0;
+
+/**
+ * status_page_runlevel:
+ *
+ * Runlevel last given to status_page_set_runlevel(), in the form of the
+ * runlevel member of the page, so that it can be written into a new page.
+ **/
+static uint32_t status_page_runlevel = 0;
+
+
+/**
+ * status_page_open:
+ * @path: file to publish the page in.
+ *
+ * Create a status page of STATUS_PAGE_ENTRIES entries at @path, replacing
+ * any page already there, and publish every job instance in it.  From
+ * then on each instance is updated by status_page_update() whenever its
+ * goal or state changes.
+ *
+ * Readers map the page read-only, see upstart_status_open(); an earlier
+ * page at @path is marked closed so that its readers know to open the
+ * new one.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+status_page_open (const char *path)
+{
+	nih_local char *tmp = NULL;
+	nih_local char *dir = NULL;
+	void           *map;
+	size_t          size;
+	int             fd;
+
+	nih_assert (path != NULL);
+
+	status_page_close ();
+
+	size = sizeof (UpstartStatusHeader)
+		+ STATUS_PAGE_ENTRIES * sizeof (UpstartStatusEntry);
+
+	status_page_free = nih_alloc (NULL, sizeof (uint32_t)
+				      * STATUS_PAGE_ENTRIES);
+	if (! status_page_free)
+		nih_return_no_memory_error (-1);
+
+	tmp = nih_sprintf (NULL, "%s.new", path);
+	dir = nih_strdup (NULL, path);
+	if ((! tmp) || (! dir))
+		goto no_memory;
+
+	/* Only the final component is created */
+	if ((mkdir (dirname (dir), 0755) < 0) && (errno != EEXIST))
+		goto error;
+
+	fd = open (tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		goto error;
+
+	if (ftruncate (fd, size) < 0) {
+		close (fd);
+		unlink (tmp);
+		goto error;
+	}
+
+	map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		unlink (tmp);
+		goto error;
+	}
+
+	/* The new file is zero-filled, so every entry starts out unused
+	 * with an even sequence count.
+	 */
+	status_page = map;
+	status_page_entries = (UpstartStatusEntry *)(status_page + 1);
+	status_page_size = size;
+
+	status_page->magic = UPSTART_STATUS_MAGIC;
+	status_page->version = UPSTART_STATUS_VERSION;
+	status_page->header_size = sizeof (UpstartStatusHeader);
+	status_page->entry_size = sizeof (UpstartStatusEntry);
+	status_page->entries = STATUS_PAGE_ENTRIES;
+	status_page->runlevel = status_page_runlevel;
+
+	status_page_free_len = STATUS_PAGE_ENTRIES;
+	for (size_t i = 0; i < STATUS_PAGE_ENTRIES; i++)
+		status_page_free[i] = STATUS_PAGE_ENTRIES - 1 - i;
+
+	job_class_init ();
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		NIH_HASH_FOREACH (class->instances, job_iter)
+			status_page_update ((Job *)job_iter);
+	}
+
+	status_page_mark_closed (path);
+
+	if (rename (tmp, path) < 0) {
+		unlink (tmp);
+		status_page_close ();
+		nih_return_system_error (-1);
+	}
+
+	nih_debug ("Publishing job status in %s", path);
+
+	return 0;
+
+no_memory:
+	errno = ENOMEM;
+error:
+	nih_error_raise_system ();
+
+	nih_free (status_page_free);
+	status_page_free = NULL;
+
+	return -1;
+}
+
+/**
+ * status_page_mark_closed:
+ * @path: file of earlier status page.
+ *
+ * Mark the status page at @path, if any, as closed; it is about to be
+ * replaced by a new page and will no longer be updated.
+ **/
+static void
+status_page_mark_closed (const char *path)
+{
+	UpstartStatusHeader *header;
+	int                  fd;
+
+	nih_assert (path != NULL);
+
+	fd = open (path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	header = mmap (NULL, sizeof (UpstartStatusHeader),
+		       PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	if (header == MAP_FAILED)
+		return;
+
+	if (header->magic == UPSTART_STATUS_MAGIC)
+		__atomic_store_n (&header->closed, 1, __ATOMIC_RELEASE);
+
+	munmap (header, sizeof (UpstartStatusHeader));
+}
+
+/**
+ * status_page_close:
+ *
+ * Stop publishing job instances in the status page, if we were,
+ * without removing the page itself.
+ **/
+void
+status_page_close (void)
+{
+	if (! status_page)
+		return;
+
+	status_page_clear_jobs ();
+
+	munmap (status_page, status_page_size);
+	status_page = NULL;
+	status_page_entries = NULL;
+	status_page_size = 0;
+
+	nih_free (status_page_free);
+	status_page_free = NULL;
+	status_page_free_len = 0;
+}
+
+/**
+ * status_page_clear_jobs:
+ *
+ * Forget the entries of every job instance, as the page they refer to
+ * is being unmapped.
+ **/
+static void
+status_page_clear_jobs (void)
+{
+	if (! job_classes)
+		return;
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		NIH_HASH_FOREACH (class->instances, job_iter) {
+			Job *job = (Job *)job_iter;
+
+			job->status_slot = -1;
+		}
+	}
+}
+
+
+/**
+ * status_page_set_runlevel:
+ * @runlevel: new runlevel,
+ * @prevlevel: previous runlevel.
+ *
+ * Publish @runlevel and @prevlevel in the status page, so that they can
+ * be read without scanning the utmp file; they are also written into
+ * any page opened later.
+ **/
+void
+status_page_set_runlevel (int runlevel,
+			  int prevlevel)
+{
+	nih_assert (runlevel > 0);
+	nih_assert (prevlevel > 0);
+
+	status_page_runlevel = ((uint32_t)(runlevel & 0xff)
+				| (uint32_t)(prevlevel & 0xff) << 8);
+
+	if (! status_page)
+		return;
+
+	__atomic_store_n (&status_page->runlevel, status_page_runlevel,
+			  __ATOMIC_RELEASE);
+}
+
+
+/**
+ * status_page_update:
+ * @job: job instance that has changed.
+ *
+ * Publish the goal, state and main process of @job in the status page,
+ * taking an entry for it if it doesn't yet have one; does nothing if the
+ * page is not being published.
+ *
+ * Should there be no entry free, the instance is counted in the overflow
+ * member of the page until it is removed.
+ **/
+void
+status_page_update (Job *job)
+{
+	nih_assert (job != NULL);
+
+	if (! status_page)
+		return;
+
+	if (job->status_slot == -1) {
+		if (! status_page_free_len) {
+			job->status_slot = -2;
+			__atomic_add_fetch (&status_page->overflow, 1,
+					    __ATOMIC_RELEASE);
+			return;
+		}
+
+		job->status_slot = status_page_free[--status_page_free_len];
+		if ((uint32_t)job->status_slot >= status_page->used)
+			__atomic_store_n (&status_page->used,
+					  job->status_slot + 1,
+					  __ATOMIC_RELEASE);
+
+		status_page_write (job, TRUE);
+	} else if (job->status_slot >= 0) {
+		status_page_write (job, FALSE);
+	}
+}
+
+/**
+ * status_page_remove:
+ * @job: job instance being freed.
+ *
+ * Remove @job from the status page, freeing its entry for another.
+ **/
+void
+status_page_remove (Job *job)
+{
+	UpstartStatusEntry *entry;
+	uint32_t            seq;
+
+	nih_assert (job != NULL);
+
+	if (! status_page) {
+		job->status_slot = -1;
+		return;
+	}
+
+	if (job->status_slot == -2) {
+		__atomic_sub_fetch (&status_page->overflow, 1,
+				    __ATOMIC_RELEASE);
+		job->status_slot = -1;
+		return;
+	}
+
+	if (job->status_slot < 0)
+		return;
+
+	entry = &status_page_entries[job->status_slot];
+
+	seq = entry->seq;
+	__atomic_store_n (&entry->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+
+	memset ((char *)entry + sizeof (entry->seq), 0,
+		sizeof (UpstartStatusEntry) - sizeof (entry->seq));
+
+	__atomic_store_n (&entry->seq, seq + 2, __ATOMIC_RELEASE);
+
+	status_page_free[status_page_free_len++] = job->status_slot;
+	job->status_slot = -1;
+}
+
+/**
+ * status_page_write:
+ * @job: job instance to write,
+ * @assign: TRUE if the entry has just been taken for @job.
+ *
+ * Write @job into its entry of the status page, incrementing the
+ * sequence count of the entry before and after so that readers can
+ * tell that they need to read it again.  The names of the instance are
+ * only written when @assign is TRUE, since they never change.
+ **/
+static void
+status_page_write (Job *job,
+		   int  assign)
+{
+	UpstartStatusEntry *entry;
+	struct timespec     now;
+	uint32_t            seq;
+
+	nih_assert (job != NULL);
+	nih_assert (job->status_slot >= 0);
+
+	entry = &status_page_entries[job->status_slot];
+
+	clock_gettime (CLOCK_REALTIME, &now);
+
+	seq = entry->seq;
+	__atomic_store_n (&entry->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+
+	if (assign) {
+		entry->used = 1;
+		strncpy (entry->class, job->class->name,
+			 sizeof (entry->class) - 1);
+		strncpy (entry->instance, job->name,
+			 sizeof (entry->instance) - 1);
+	}
+
+	entry->pid = job->pid ? job->pid[PROCESS_MAIN] : 0;
+	entry->changed = ((uint64_t)now.tv_sec * 1000000
+			  + now.tv_nsec / 1000);
+	strncpy (entry->goal, job_goal_name (job->goal),
+		 sizeof (entry->goal) - 1);
+	strncpy (entry->state, job_state_name (job->state),
+		 sizeof (entry->state) - 1);
+
+	__atomic_store_n (&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,49 @@
+/* upstart
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INIT_STATUS_PAGE_H
+#define INIT_STATUS_PAGE_H
+
+#include <nih/macros.h>
+
+#include "lib/upstart-status.h"
+
+#include "job.h"
+
+
+/**
+ * STATUS_PAGE_ENTRIES:
+ *
+ * Number of job instances that may be published in the status page at
+ * once; further instances are counted in its overflow member.
+ **/
+#define STATUS_PAGE_ENTRIES 4096
+
+
+NIH_BEGIN_EXTERN
+
+int  status_page_open         (const char *path)
+	__attribute__ ((warn_unused_result));
+void status_page_close        (void);
+
+void status_page_update       (Job *job);
+void status_page_remove       (Job *job);
+
+void status_page_set_runlevel (int runlevel, int prevlevel);
+
+NIH_END_EXTERN
+
+#endif /* INIT_STATUS_PAGE_H */
@@ -0,0 +1,460 @@
+/* upstart
+ *
+ * subscription.c - coalesced job and event updates for subscribers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <dbus/dbus.h>
+
+#include <fnmatch.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/logging.h>
+
+#include "dbus/upstart.h"
+
+#include "session.h"
+#include "job_class.h"
+#include "job.h"
+#include "event.h"
+#include "timer_wheel.h"
+#include "subscription.h"
+
+#include "com.ubuntu.Upstart.h"
+
+
+/* Prototypes for static functions */
+static int  subscription_destroy (Subscription *subscription);
+static void subscription_timer   (Subscription *subscription,
+				  WheelTimer *timer);
+static void subscription_pending (Subscription *subscription);
+
+
+/**
+ * subscriptions:
+ *
+ * List of Subscription for clients that have asked for batched updates,
+ * at most one for each connection.
+ **/
+NihList *subscriptions = NULL;
+
+
+/**
+ * subscription_init:
+ *
+ * Initialise the subscriptions list.
+ **/
+void
+subscription_init (void)
+{
+	if (! subscriptions)
+		subscriptions = NIH_MUST (nih_list_new (NULL));
+}
+
+
+/**
+ * subscription_new:
+ * @parent: parent object for new subscription,
+ * @conn: connection to send updates over,
+ * @session: session of subscriber,
+ * @job_pattern: glob that job names must match,
+ * @event_pattern: glob that event names must match,
+ * @window: milliseconds to coalesce updates over.
+ *
+ * Allocates and returns a new Subscription for @conn, appending it to the
+ * subscriptions list.  Changes to instances of jobs in @session whose
+ * names match @job_pattern, and emissions of events whose names match
+ * @event_pattern, will be sent to @conn in a StateBatch signal no more
+ * than @window milliseconds after the first of them.  An empty pattern
+ * matches no names.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned subscription.  When all
+ * parents of the returned subscription are freed, the returned
+ * subscription will also be freed.
+ *
+ * Returns: newly allocated Subscription or NULL if insufficient memory.
+ **/
+Subscription *
+subscription_new (const void     *parent,
+		  DBusConnection *conn,
+		  Session        *session,
+		  const char     *job_pattern,
+		  const char     *event_pattern,
+		  uint32_t        window)
+{
+	Subscription *subscription;
+
+	nih_assert (conn != NULL);
+	nih_assert (job_pattern != NULL);
+	nih_assert (event_pattern != NULL);
+
+	subscription_init ();
+
+	subscription = nih_new (parent, Subscription);
+	if (! subscription)
+		return NULL;
+
+	nih_list_init (&subscription->entry);
+	nih_list_init (&subscription->events);
+	subscription->events_len = 0;
+	subscription->dropped = 0;
+
+	subscription->conn = conn;
+	subscription->session = session;
+	subscription->window = window;
+	subscription->timer = NULL;
+
+	subscription->job_pattern = nih_strdup (subscription, job_pattern);
+	if (! subscription->job_pattern)
+		goto error;
+
+	subscription->event_pattern = nih_strdup (subscription, event_pattern);
+	if (! subscription->event_pattern)
+		goto error;
+
+	subscription->jobs = nih_hash_string_new (subscription, 0);
+	if (! subscription->jobs)
+		goto error;
+
+	nih_alloc_set_destructor (subscription, subscription_destroy);
+
+	nih_list_add (subscriptions, &subscription->entry);
+
+	return subscription;
+
+error:
+	nih_free (subscription);
+	return NULL;
+}
+
+/**
+ * subscription_destroy:
+ * @subscription: subscription being destroyed.
+ *
+ * Removes @subscription from the subscriptions list; pending updates and
+ * any timer to send them are freed along with it.
+ *
+ * Returns: zero.
+ **/
+static int
+subscription_destroy (Subscription *subscription)
+{
+	nih_assert (subscription != NULL);
+
+	nih_list_destroy (&subscription->entry);
+
+	return 0;
+}
+
+
+/**
+ * subscription_find:
+ * @conn: connection to look for.
+ *
+ * Returns: Subscription for @conn or NULL if it hasn't subscribed.
+ **/
+Subscription *
+subscription_find (DBusConnection *conn)
+{
+	nih_assert (conn != NULL);
+
+	if (! subscriptions)
+		return NULL;
+
+	NIH_LIST_FOREACH (subscriptions, iter) {
+		Subscription *subscription = (Subscription *)iter;
+
+		if (subscription->conn == conn)
+			return subscription;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * subscription_notify_job:
+ * @job: instance that changed.
+ *
+ * Called when the goal or state of @job changes to record the change for
+ * each subscriber interested in it, replacing any change to @job they
+ * have yet to be sent.
+ **/
+void
+subscription_notify_job (Job *job)
+{
+	nih_assert (job != NULL);
+	nih_assert (job->class != NULL);
+
+	if (! subscriptions)
+		return;
+
+	NIH_LIST_FOREACH (subscriptions, iter) {
+		Subscription    *subscription = (Subscription *)iter;
+		SubscriptionJob *update;
+
+		if (job->class->session != subscription->session)
+			continue;
+
+		if (fnmatch (subscription->job_pattern, job->class->name, 0))
+			continue;
+
+		update = (SubscriptionJob *)nih_hash_lookup (subscription->jobs,
+							     job->path);
+		if (! update) {
+			update = NIH_MUST (nih_new (subscription->jobs,
+						    SubscriptionJob));
+
+			nih_list_init (&update->entry);
+			nih_alloc_set_destructor (update, nih_list_destroy);
+
+			update->path = NIH_MUST (nih_strdup (update, job->path));
+			update->job = NIH_MUST (nih_strdup (update,
+							    job->class->name));
+			update->instance = NIH_MUST (nih_strdup (update,
+								 job->name));
+
+			nih_hash_add (subscription->jobs, &update->entry);
+		}
+
+		update->goal = job->goal;
+		update->state = job->state;
+
+		subscription_pending (subscription);
+	}
+}
+
+/**
+ * subscription_notify_event:
+ * @event: event emitted.
+ *
+ * Called when @event is emitted to record it for each subscriber
+ * interested in it.
+ *
+ * A subscriber that already has SUBSCRIPTION_MAX_EVENTS events pending
+ * loses the oldest of them, which is counted in the next batch.
+ **/
+void
+subscription_notify_event (Event *event)
+{
+	nih_assert (event != NULL);
+
+	if (! subscriptions)
+		return;
+
+	NIH_LIST_FOREACH (subscriptions, iter) {
+		Subscription      *subscription = (Subscription *)iter;
+		SubscriptionEvent *update;
+
+		if (event->session != subscription->session)
+			continue;
+
+		if (fnmatch (subscription->event_pattern, event->name, 0))
+			continue;
+
+		update = NIH_MUST (nih_new (subscription, SubscriptionEvent));
+
+		nih_list_init (&update->entry);
+		nih_alloc_set_destructor (update, nih_list_destroy);
+
+		update->name = NIH_MUST (nih_strdup (update, event->name));
+		if (event->env) {
+			update->env = NIH_MUST (nih_str_array_copy (update, NULL,
+								    event->env));
+		} else {
+			update->env = NIH_MUST (nih_str_array_new (update));
+		}
+
+		nih_list_add (&subscription->events, &update->entry);
+
+		if (++subscription->events_len > SUBSCRIPTION_MAX_EVENTS) {
+			nih_free (subscription->events.next);
+			subscription->events_len--;
+			subscription->dropped++;
+		}
+
+		subscription_pending (subscription);
+	}
+}
+
+/**
+ * subscription_pending:
+ * @subscription: subscription with a pending update.
+ *
+ * Ensures that the pending updates of @subscription will be sent once its
+ * window has passed since the first of them.
+ **/
+static void
+subscription_pending (Subscription *subscription)
+{
+	nih_assert (subscription != NULL);
+
+	if (subscription->timer)
+		return;
+
+	subscription->timer = NIH_MUST (timer_wheel_add (
+			subscription, subscription->window,
+			(WheelTimerCb)subscription_timer, subscription));
+}
+
+/**
+ * subscription_timer:
+ * @subscription: subscription to send updates for,
+ * @timer: timer that triggered.
+ *
+ * Called once the window of @subscription has passed since its first
+ * pending update to send them all.
+ *
+ * Should the subscriber not yet have read the earlier batches, so that
+ * more than SUBSCRIPTION_MAX_OUTGOING bytes are still queued to it, the
+ * updates are instead held back for SUBSCRIPTION_RETRY_WINDOW; changes
+ * to instances continue to replace each other meanwhile.
+ **/
+static void
+subscription_timer (Subscription *subscription,
+		    WheelTimer   *timer)
+{
+	nih_assert (subscription != NULL);
+	nih_assert (subscription->timer == timer);
+
+	/* The timer is freed once we return */
+	subscription->timer = NULL;
+
+	if (dbus_connection_get_outgoing_size (subscription->conn)
+	    > SUBSCRIPTION_MAX_OUTGOING) {
+		subscription->timer = NIH_MUST (timer_wheel_add (
+				subscription, SUBSCRIPTION_RETRY_WINDOW,
+				(WheelTimerCb)subscription_timer, subscription));
+		return;
+	}
+
+	subscription_flush (subscription);
+}
+
+
+/**
+ * subscription_flush:
+ * @subscription: subscription to send updates for.
+ *
+ * Sends the pending updates of @subscription, the latest goal and state
+ * of each changed instance and every event emitted since the last were
+ * sent, in a single StateBatch signal over its connection along with the
+ * number of events dropped meanwhile.  Nothing is sent if there are no
+ * updates pending.
+ **/
+void
+subscription_flush (Subscription *subscription)
+{
+	nih_local ControlStateBatchJobsElement   **jobs = NULL;
+	nih_local ControlStateBatchEventsElement **events = NULL;
+	size_t                                     jobs_len = 0;
+	size_t                                     events_len = 0;
+
+	nih_assert (subscription != NULL);
+
+	if (subscription->timer) {
+		nih_free (subscription->timer);
+		subscription->timer = NULL;
+	}
+
+	NIH_HASH_FOREACH (subscription->jobs, iter)
+		jobs_len++;
+
+	NIH_LIST_FOREACH (&subscription->events, iter)
+		events_len++;
+
+	if (! (jobs_len || events_len || subscription->dropped))
+		return;
+
+	jobs = NIH_MUST (nih_alloc (NULL, sizeof (ControlStateBatchJobsElement *)
+				    * (jobs_len + 1)));
+	events = NIH_MUST (nih_alloc (NULL, sizeof (ControlStateBatchEventsElement *)
+				      * (events_len + 1)));
+
+	jobs_len = 0;
+	NIH_HASH_FOREACH (subscription->jobs, iter) {
+		SubscriptionJob              *update = (SubscriptionJob *)iter;
+		ControlStateBatchJobsElement *element;
+
+		element = NIH_MUST (nih_new (jobs, ControlStateBatchJobsElement));
+		element->item0 = update->job;
+		element->item1 = update->instance;
+		element->item2 = (char *)job_goal_name (update->goal);
+		element->item3 = (char *)job_state_name (update->state);
+
+		jobs[jobs_len++] = element;
+	}
+	jobs[jobs_len] = NULL;
+
+	events_len = 0;
+	NIH_LIST_FOREACH (&subscription->events, iter) {
+		SubscriptionEvent              *update = (SubscriptionEvent *)iter;
+		ControlStateBatchEventsElement *element;
+
+		element = NIH_MUST (nih_new (events, ControlStateBatchEventsElement));
+		element->item0 = update->name;
+		element->item1 = update->env;
+
+		events[events_len++] = element;
+	}
+	events[events_len] = NULL;
+
+	NIH_ZERO (control_emit_state_batch (subscription->conn,
+					    DBUS_PATH_UPSTART,
+					    jobs, events,
+					    subscription->dropped));
+
+	NIH_HASH_FOREACH_SAFE (subscription->jobs, iter)
+		nih_free (iter);
+
+	NIH_LIST_FOREACH_SAFE (&subscription->events, iter)
+		nih_free (iter);
+
+	subscription->events_len = 0;
+	subscription->dropped = 0;
+}
+
+
+/**
+ * subscription_disconnected:
+ * @conn: connection that was dropped.
+ *
+ * Frees the subscription for @conn, if any, when it's dropped.
+ **/
+void
+subscription_disconnected (DBusConnection *conn)
+{
+	nih_assert (conn != NULL);
+
+	if (! subscriptions)
+		return;
+
+	NIH_LIST_FOREACH_SAFE (subscriptions, iter) {
+		Subscription *subscription = (Subscription *)iter;
+
+		if (subscription->conn == conn)
+			nih_free (subscription);
+	}
+}
@@ -0,0 +1,166 @@
+/* upstart
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INIT_SUBSCRIPTION_H
+#define INIT_SUBSCRIPTION_H
+
+#include <stdint.h>
+
+#include <dbus/dbus.h>
+
+#include <nih/macros.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+
+#include "session.h"
+#include "job.h"
+#include "event.h"
+#include "timer_wheel.h"
+
+
+/**
+ * SUBSCRIPTION_MAX_WINDOW:
+ *
+ * Longest window, in milliseconds, that a subscriber may ask for updates
+ * to be coalesced over.
+ **/
+#define SUBSCRIPTION_MAX_WINDOW 60000
+
+/**
+ * SUBSCRIPTION_MAX_EVENTS:
+ *
+ * Most events that may be pending for a subscriber; should more be
+ * emitted before they're sent, the oldest are dropped and counted.
+ **/
+#define SUBSCRIPTION_MAX_EVENTS 1024
+
+/**
+ * SUBSCRIPTION_MAX_OUTGOING:
+ *
+ * Bytes that may be queued to a subscriber before further batches are
+ * held back until it has read them.
+ **/
+#define SUBSCRIPTION_MAX_OUTGOING (1024 * 1024)
+
+/**
+ * SUBSCRIPTION_RETRY_WINDOW:
+ *
+ * Milliseconds to wait before trying again to send a batch held back
+ * because the subscriber hasn't read the last.
+ **/
+#define SUBSCRIPTION_RETRY_WINDOW 100
+
+
+/**
+ * SubscriptionJob:
+ * @entry: list header,
+ * @path: D-Bus path of instance, used as the hash key,
+ * @job: name of job,
+ * @instance: name of instance,
+ * @goal: latest goal of instance,
+ * @state: latest state of instance.
+ *
+ * The latest change to an instance that's yet to be sent to a
+ * subscriber; further changes before it's sent replace @goal and
+ * @state, so that only the last is seen.  The names are copied since
+ * the instance may be freed before the update is sent.
+ **/
+typedef struct subscription_job {
+	NihList   entry;
+	char     *path;
+
+	char     *job;
+	char     *instance;
+	JobGoal   goal;
+	JobState  state;
+} SubscriptionJob;
+
+/**
+ * SubscriptionEvent:
+ * @entry: list header,
+ * @name: name of event,
+ * @env: environment of event.
+ *
+ * An emitted event that's yet to be sent to a subscriber.
+ **/
+typedef struct subscription_event {
+	NihList   entry;
+	char     *name;
+	char    **env;
+} SubscriptionEvent;
+
+/**
+ * Subscription:
+ * @entry: list header,
+ * @conn: private connection updates are sent over,
+ * @session: session of subscriber,
+ * @job_pattern: glob that job names must match,
+ * @event_pattern: glob that event names must match,
+ * @window: milliseconds to coalesce updates over,
+ * @jobs: hash of pending SubscriptionJob by path,
+ * @events: list of pending SubscriptionEvent in order of emission,
+ * @events_len: number of entries in @events,
+ * @dropped: number of events dropped since the last batch was sent,
+ * @timer: timer to send pending updates, or NULL if there are none.
+ *
+ * A client's request, made with the Subscribe method, to receive changes
+ * to the jobs and events it cares about in batches of StateBatch signals
+ * rather than the individual signals of every object.
+ **/
+typedef struct subscription {
+	NihList         entry;
+	DBusConnection *conn;
+	Session        *session;
+
+	char           *job_pattern;
+	char           *event_pattern;
+	uint32_t        window;
+
+	NihHash        *jobs;
+	NihList         events;
+	size_t          events_len;
+	uint32_t        dropped;
+	WheelTimer     *timer;
+} Subscription;
+
+
+NIH_BEGIN_EXTERN
+
+extern NihList *subscriptions;
+
+
+void          subscription_init         (void);
+
+Subscription *subscription_new          (const void *parent,
+					 DBusConnection *conn,
+					 Session *session,
+					 const char *job_pattern,
+					 const char *event_pattern,
+					 uint32_t window)
+	__attribute__ ((warn_unused_result, malloc));
+
+Subscription *subscription_find         (DBusConnection *conn)
+	__attribute__ ((warn_unused_result));
+
+void          subscription_notify_job   (Job *job);
+void          subscription_notify_event (Event *event);
+
+void          subscription_flush        (Subscription *subscription);
+void          subscription_disconnected (DBusConnection *conn);
+
+NIH_END_EXTERN
+
+#endif /* INIT_SUBSCRIPTION_H */
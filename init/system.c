@@ -112,6 +112,7 @@ system_setup_console (ConsoleType type,
 		break;
 		/* FALLTHROUGH */
 	case CONSOLE_LOG:
+	case CONSOLE_SOCKET:
 	case CONSOLE_NONE:
 		/* No console really means /dev/null */
 		fd = open (DEV_NULL, O_RDWR | O_NOCTTY);
@@ -0,0 +1,206 @@
+/* upstart
+ *
+ * bench_environ.c - benchmark for expanding environment references.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <nih/test.h>
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/main.h>
+
+#include "environ.h"
+
+/**
+ * BENCH_DEFAULT_COUNT:
+ *
+ * Number of times each string is expanded if not specified on the
+ * command-line.
+ **/
+#define BENCH_DEFAULT_COUNT 1000000
+
+/**
+ * BenchString:
+ * @name: name of the case,
+ * @string: string to expand.
+ *
+ * Strings expanded by the benchmark, typical of the event matches and
+ * instance names of real jobs; the last is filled in by main() with an
+ * expansion too long for the storage of an EnvironBuf.
+ **/
+typedef struct bench_string {
+	const char *name;
+	const char *string;
+} BenchString;
+
+static BenchString bench_strings[] = {
+	{ "plain",  "/dev/sda1" },
+	{ "simple", "$UPSTART_JOB-$INSTANCE" },
+	{ "nested", "${DEVNAME:-/dev/${KERNEL}}" },
+	{ "long",   NULL },
+};
+
+/**
+ * bench_env:
+ *
+ * Environment the strings are expanded with.
+ **/
+static char *bench_env[] = {
+	"PATH=/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin",
+	"TERM=linux",
+	"UPSTART_JOB=network-interface",
+	"UPSTART_EVENTS=net-device-added",
+	"INSTANCE=eth0",
+	"KERNEL=sda1",
+	"SUBSYSTEM=block",
+	"ACTION=add",
+	NULL,
+};
+
+/**
+ * bench_allocs:
+ *
+ * Number of allocations made through nih_alloc().
+ **/
+static unsigned long long bench_allocs = 0;
+
+/**
+ * bench_malloc:
+ * @size: bytes to allocate.
+ *
+ * Allocator installed for nih_alloc() to count the allocations it makes.
+ *
+ * Returns: newly allocated memory or NULL.
+ **/
+static void *
+bench_malloc (size_t size)
+{
+	bench_allocs++;
+
+	return malloc (size);
+}
+
+/**
+ * bench_now:
+ *
+ * Returns: current time on CLOCK_MONOTONIC in microseconds.
+ **/
+static unsigned long long
+bench_now (void)
+{
+	struct timespec  now;
+
+	assert0 (clock_gettime (CLOCK_MONOTONIC, &now));
+
+	return ((unsigned long long)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+/**
+ * bench_report:
+ * @name: name of the case,
+ * @func: function timed,
+ * @count: number of expansions,
+ * @elapsed: microseconds taken,
+ * @allocs: allocations made.
+ *
+ * Output a line of results.
+ **/
+static void
+bench_report (const char         *name,
+	      const char         *func,
+	      int                 count,
+	      unsigned long long  elapsed,
+	      unsigned long long  allocs)
+{
+	printf ("%-8s %-20s %10d %10.1f %10.2f\n", name, func, count,
+		count ? (double)elapsed * 1000 / count : 0.0,
+		count ? (double)allocs / count : 0.0);
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	nih_local char *longstr = NULL;
+	int             count = BENCH_DEFAULT_COUNT;
+
+	nih_main_init (argv[0]);
+
+	if (argc > 1)
+		count = atoi (argv[1]);
+
+	if ((argc > 2) || (count < 0)) {
+		fprintf (stderr, "Usage: %s [COUNT]\n", argv[0]);
+		exit (1);
+	}
+
+	for (size_t i = 0; i < ENVIRON_BUF_SIZE / 4; i++)
+		NIH_MUST (nih_strcat (&longstr, NULL, "$KERNEL "));
+	bench_strings[3].string = longstr;
+
+	__nih_malloc = bench_malloc;
+
+	printf ("%-8s %-20s %10s %10s %10s\n",
+		"case", "function", "count", "ns/call", "allocs");
+
+	for (size_t i = 0; i < NIH_N_ELEMENTS (bench_strings); i++) {
+		BenchString        *bench = &bench_strings[i];
+		EnvironBuf          buf;
+		unsigned long long  start, allocs;
+
+		/* A newly allocated copy of each expansion, as every caller
+		 * made before.
+		 */
+		allocs = bench_allocs;
+		start = bench_now ();
+
+		for (int j = 0; j < count; j++) {
+			char *str;
+
+			str = NIH_MUST (environ_expand (NULL, bench->string,
+							bench_env));
+			nih_free (str);
+		}
+
+		bench_report (bench->name, "environ_expand", count,
+			      bench_now () - start, bench_allocs - allocs);
+
+		/* Expansion into a buffer on the stack, kept for each */
+		allocs = bench_allocs;
+		start = bench_now ();
+
+		environ_buf_init (&buf);
+		for (int j = 0; j < count; j++) {
+			const char *str;
+
+			str = environ_expand_buf (&buf, bench->string,
+						  bench_env);
+			nih_assert (str != NULL);
+		}
+		environ_buf_clear (&buf);
+
+		bench_report (bench->name, "environ_expand_buf", count,
+			      bench_now () - start, bench_allocs - allocs);
+	}
+
+	return 0;
+}
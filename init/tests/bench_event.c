@@ -0,0 +1,513 @@
+/* upstart
+ *
+ * bench_event.c - benchmark for dispatching storms of events to jobs.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <nih/test.h>
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/logging.h>
+#include <nih/main.h>
+
+#include "session.h"
+#include "event.h"
+#include "environ.h"
+#include "conf.h"
+#include "job_class.h"
+#include "job.h"
+#include "parse_job.h"
+#include "test_util_common.h"
+
+/**
+ * BENCH_DEFAULT_JOBS:
+ *
+ * Number of job classes to create if not specified on the command-line.
+ **/
+#define BENCH_DEFAULT_JOBS 1000
+
+/**
+ * BENCH_DEFAULT_EVENTS:
+ *
+ * Number of events to emit in each scenario if not specified on the
+ * command-line.
+ **/
+#define BENCH_DEFAULT_EVENTS 10000
+
+/**
+ * BENCH_DEFAULT_DEPTH:
+ *
+ * Depth of the AND/OR trees of the "tree" scenario if not specified on
+ * the command-line.
+ **/
+#define BENCH_DEFAULT_DEPTH 4
+
+/**
+ * BENCH_TREE_EVENTS:
+ *
+ * Number of distinct event names the leaves of the "tree" scenario's
+ * conditions are chosen from.
+ **/
+#define BENCH_TREE_EVENTS 16
+
+/**
+ * BenchScenario:
+ * @name: name shown in the results,
+ * @job: function returning the configuration of each job class,
+ * @event: function emitting each event.
+ *
+ * A synthetic workload: @job is called for each of the job classes to
+ * create, and @event for each of the events to emit, each with its
+ * index and the number of them.
+ **/
+typedef struct bench_scenario {
+	const char *name;
+	char *    (*job)   (int i, int jobs, int depth);
+	Event *   (*event) (int i, int jobs, int events);
+} BenchScenario;
+
+static char * udev_job        (int i, int jobs, int depth);
+static Event *udev_event      (int i, int jobs, int events);
+static char * fanout_job      (int i, int jobs, int depth);
+static Event *fanout_event    (int i, int jobs, int events);
+static char * tree_job        (int i, int jobs, int depth);
+static Event *tree_event      (int i, int jobs, int events);
+static char * instance_job    (int i, int jobs, int depth);
+static Event *instance_event  (int i, int jobs, int events);
+
+/**
+ * scenarios:
+ *
+ * udev storms of device events mostly matched by no job or by just one,
+ * wide fan-out of a single event to every job, deep trees of AND and OR
+ * operators matched a leaf at a time, and events creating and stopping
+ * instances of instance jobs.
+ **/
+static const BenchScenario scenarios[] = {
+	{ "udev",     udev_job,     udev_event },
+	{ "fanout",   fanout_job,   fanout_event },
+	{ "tree",     tree_job,     tree_event },
+	{ "instance", instance_job, instance_event },
+	{ NULL }
+};
+
+/**
+ * bench_allocs:
+ *
+ * Number of allocations made through nih_alloc().
+ **/
+static unsigned long long bench_allocs = 0;
+
+/**
+ * bench_malloc:
+ * @size: bytes to allocate.
+ *
+ * Allocator installed for nih_alloc() to count the allocations it makes.
+ *
+ * Returns: newly allocated memory or NULL.
+ **/
+static void *
+bench_malloc (size_t size)
+{
+	bench_allocs++;
+
+	return malloc (size);
+}
+
+/**
+ * bench_now:
+ *
+ * Returns: current time on CLOCK_MONOTONIC in microseconds.
+ **/
+static unsigned long long
+bench_now (void)
+{
+	struct timespec  now;
+
+	assert0 (clock_gettime (CLOCK_MONOTONIC, &now));
+
+	return ((unsigned long long)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+/**
+ * bench_maxrss:
+ *
+ * Returns: peak resident set size of this process in kilobytes.
+ **/
+static long
+bench_maxrss (void)
+{
+	struct rusage  usage;
+
+	assert0 (getrusage (RUSAGE_SELF, &usage));
+
+	return usage.ru_maxrss;
+}
+
+/**
+ * bench_compare:
+ * @a: latency,
+ * @b: latency.
+ *
+ * qsort() comparison of latencies.
+ *
+ * Returns: less than, equal to or greater than zero as @a is less than,
+ * equal to or greater than @b.
+ **/
+static int
+bench_compare (const void *a,
+	       const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * bench_event_new:
+ * @name: name of event,
+ * @...: environment variables of event, followed by NULL.
+ *
+ * Create a new event with the given environment.
+ *
+ * Returns: new event.
+ **/
+static Event *
+bench_event_new (const char *name,
+		 ...)
+{
+	nih_local char **env = NULL;
+	size_t           len = 0;
+	const char      *var;
+	va_list          args;
+
+	env = NIH_MUST (nih_str_array_new (NULL));
+
+	va_start (args, name);
+	while ((var = va_arg (args, const char *)) != NULL)
+		NIH_MUST (environ_add (&env, NULL, &len, TRUE, var));
+	va_end (args);
+
+	return NIH_MUST (event_new (NULL, name, env));
+}
+
+
+static char *
+udev_job (int i,
+	  int jobs,
+	  int depth)
+{
+	return NIH_MUST (nih_sprintf (NULL,
+				      "start on net-device-added INTERFACE=eth%d\n"
+				      "stop on net-device-removed INTERFACE=eth%d\n",
+				      i, i));
+}
+
+static Event *
+udev_event (int i,
+	    int jobs,
+	    int events)
+{
+	nih_local char *var = NULL;
+
+	/* Only every other event is for a device any job is interested in */
+	switch (i % 4) {
+	case 0:
+		var = NIH_MUST (nih_sprintf (NULL, "INTERFACE=eth%d",
+					     (i / 4) % jobs));
+		return bench_event_new ("net-device-added", var, NULL);
+	case 2:
+		var = NIH_MUST (nih_sprintf (NULL, "INTERFACE=eth%d",
+					     (i / 4) % jobs));
+		return bench_event_new ("net-device-removed", var, NULL);
+	default:
+		var = NIH_MUST (nih_sprintf (NULL, "DEVNAME=/dev/sd%d", i));
+		return bench_event_new ("block-device-added", var, NULL);
+	}
+}
+
+
+static char *
+fanout_job (int i,
+	    int jobs,
+	    int depth)
+{
+	return NIH_MUST (nih_strdup (NULL,
+				     "start on fanout-start\n"
+				     "stop on fanout-stop\n"));
+}
+
+static Event *
+fanout_event (int i,
+	      int jobs,
+	      int events)
+{
+	return bench_event_new (i % 2 ? "fanout-stop" : "fanout-start", NULL);
+}
+
+
+/**
+ * tree_condition:
+ * @str: string to append to,
+ * @depth: depth of tree,
+ * @leaf: index of next leaf.
+ *
+ * Append a tree of @depth levels of alternating AND and OR operators to
+ * @str, with events chosen from BENCH_TREE_EVENTS names at the leaves.
+ **/
+static void
+tree_condition (char **str,
+		int    depth,
+		int   *leaf)
+{
+	if (! depth) {
+		NIH_MUST (nih_strcat_sprintf (str, NULL, "tree-%d",
+					      (*leaf)++ % BENCH_TREE_EVENTS));
+		return;
+	}
+
+	NIH_MUST (nih_strcat (str, NULL, "("));
+	tree_condition (str, depth - 1, leaf);
+	NIH_MUST (nih_strcat (str, NULL, depth % 2 ? " and " : " or "));
+	tree_condition (str, depth - 1, leaf);
+	NIH_MUST (nih_strcat (str, NULL, ")"));
+}
+
+static char *
+tree_job (int i,
+	  int jobs,
+	  int depth)
+{
+	char *str;
+	int   leaf = i;
+
+	str = NIH_MUST (nih_strdup (NULL, "start on "));
+	tree_condition (&str, depth, &leaf);
+	NIH_MUST (nih_strcat (&str, NULL, "\nstop on tree-reset\n"));
+
+	return str;
+}
+
+static Event *
+tree_event (int i,
+	    int jobs,
+	    int events)
+{
+	nih_local char *name = NULL;
+
+	if (i % 32 == 31)
+		return bench_event_new ("tree-reset", NULL);
+
+	name = NIH_MUST (nih_sprintf (NULL, "tree-%d",
+				      (i * 7) % BENCH_TREE_EVENTS));
+
+	return bench_event_new (name, NULL);
+}
+
+
+static char *
+instance_job (int i,
+	      int jobs,
+	      int depth)
+{
+	return NIH_MUST (nih_sprintf (NULL,
+				      "instance $ID\n"
+				      "start on instance-start JOB=bench%d\n"
+				      "stop on instance-stop ID=$ID\n",
+				      i));
+}
+
+static Event *
+instance_event (int i,
+		int jobs,
+		int events)
+{
+	nih_local char *id = NULL;
+	nih_local char *job = NULL;
+
+	/* The first half of the events each start an instance of a job,
+	 * the second half stop them again.
+	 */
+	if (i < events / 2) {
+		id = NIH_MUST (nih_sprintf (NULL, "ID=%d", i));
+		job = NIH_MUST (nih_sprintf (NULL, "JOB=bench%d", i % jobs));
+
+		return bench_event_new ("instance-start", job, id, NULL);
+	} else {
+		id = NIH_MUST (nih_sprintf (NULL, "ID=%d", i - events / 2));
+
+		return bench_event_new ("instance-stop", id, NULL);
+	}
+}
+
+
+/**
+ * bench_scenario:
+ * @scenario: workload to run,
+ * @jobs: number of job classes to create,
+ * @events: number of events to emit,
+ * @depth: depth of condition trees.
+ *
+ * Create @jobs job classes for @scenario, then emit @events events for
+ * it one at a time and time event_poll() handling each, including any
+ * events emitted by the jobs it starts and stops, writing the result to
+ * stdout.
+ **/
+static void
+bench_scenario (const BenchScenario *scenario,
+		int                  jobs,
+		int                  events,
+		int                  depth)
+{
+	unsigned long long *latency;
+	unsigned long long  total = 0;
+	unsigned long long  allocs;
+	long                rss_before;
+
+	for (int i = 0; i < jobs; i++) {
+		nih_local char *name = NULL;
+		nih_local char *conf = NULL;
+		JobClass       *class;
+		size_t          pos = 0;
+		size_t          lineno = 1;
+
+		name = NIH_MUST (nih_sprintf (NULL, "bench%d", i));
+		conf = scenario->job (i, jobs, depth);
+
+		class = parse_job (NULL, NULL, NULL, name, conf, strlen (conf),
+				   &pos, &lineno);
+		if (! class) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_fatal ("%s:%zu: %s", name, lineno, err->message);
+			exit (1);
+		}
+
+		class->console = CONSOLE_NONE;
+		job_class_add_safe (class);
+	}
+
+	latency = NIH_MUST (nih_alloc (NULL, sizeof (unsigned long long) * events));
+
+	rss_before = bench_maxrss ();
+	allocs = bench_allocs;
+
+	for (int i = 0; i < events; i++) {
+		unsigned long long begin;
+
+		begin = bench_now ();
+		scenario->event (i, jobs, events);
+		event_poll ();
+		latency[i] = bench_now () - begin;
+
+		total += latency[i];
+	}
+
+	allocs = bench_allocs - allocs;
+
+	qsort (latency, events, sizeof (unsigned long long), bench_compare);
+
+	printf ("%-8s %6d %8d %10.0f %8llu %8llu %8llu %8llu %10.1f %8ld\n",
+		scenario->name, jobs, events,
+		total ? (events * 1000000.0) / total : 0.0,
+		latency[events / 2], latency[events * 9 / 10],
+		latency[events * 99 / 100], latency[events - 1],
+		(double)allocs / events, bench_maxrss () - rss_before);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+	int jobs = BENCH_DEFAULT_JOBS;
+	int events = BENCH_DEFAULT_EVENTS;
+	int depth = BENCH_DEFAULT_DEPTH;
+	int threads = 0;
+
+	nih_main_init (argv[0]);
+
+	if (argc > 1)
+		jobs = atoi (argv[1]);
+	if (argc > 2)
+		events = atoi (argv[2]);
+	if (argc > 3)
+		depth = atoi (argv[3]);
+	if (argc > 4)
+		threads = atoi (argv[4]);
+
+	if ((argc > 5) || (jobs <= 0) || (events <= 0) || (depth < 0)
+	    || (threads < 0)) {
+		fprintf (stderr, "Usage: %s [JOBS [EVENTS [DEPTH [THREADS]]]]\n",
+			 argv[0]);
+		exit (1);
+	}
+
+	/* Compare runs with and without threads, over a range of JOBS, to
+	 * see what ruling out conditions in parallel gains.
+	 */
+	event_match_threads = threads;
+
+	setenv ("UPSTART_NO_SESSIONS", "1", 1);
+
+	session_init ();
+	event_init ();
+	conf_init ();
+	job_class_init ();
+
+	__nih_malloc = bench_malloc;
+
+	printf ("%-8s %6s %8s %10s %8s %8s %8s %8s %10s %8s\n",
+		"scenario", "jobs", "events", "events/s", "p50(us)",
+		"p90(us)", "p99(us)", "max(us)", "allocs/ev", "rss(KB)");
+
+	/* Peak RSS only ever increases, and each scenario needs its own
+	 * job classes, so run each in a fresh process.
+	 */
+	for (const BenchScenario *scenario = scenarios; scenario->name; scenario++) {
+		pid_t pid;
+		int   status;
+
+		fflush (stdout);
+
+		pid = fork ();
+		assert (pid >= 0);
+
+		if (! pid) {
+			bench_scenario (scenario, jobs, events, depth);
+			exit (0);
+		}
+
+		assert (waitpid (pid, &status, 0) == pid);
+		if (! WIFEXITED (status) || WEXITSTATUS (status))
+			exit (1);
+	}
+
+	return 0;
+}
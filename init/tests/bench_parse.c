@@ -0,0 +1,625 @@
+/* upstart
+ *
+ * bench_parse.c - benchmark for parsing and loading job configuration.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <nih/test.h>
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/file.h>
+#include <nih/logging.h>
+#include <nih/main.h>
+
+#include "session.h"
+#include "event.h"
+#include "conf.h"
+#include "job_class.h"
+#include "parse_job.h"
+#include "test_util_common.h"
+
+/**
+ * BENCH_DEFAULT_COUNT:
+ *
+ * Number of large job configuration files to generate if not specified
+ * on the command-line.
+ **/
+#define BENCH_DEFAULT_COUNT 500
+
+/**
+ * BENCH_CORPUS_DIR:
+ *
+ * Directory of real job configuration files copied into the corpus if
+ * another is not specified on the command-line.
+ **/
+#define BENCH_CORPUS_DIR TEST_DATA_DIR "/corpus"
+
+/**
+ * BENCH_ROUNDS:
+ *
+ * Number of times every file in the corpus is passed to parse_job().
+ **/
+#define BENCH_ROUNDS 10
+
+/**
+ * BENCH_THREADS:
+ *
+ * Number of threads configuration is read ahead with in the "threads"
+ * mode.
+ **/
+#define BENCH_THREADS 4
+
+/**
+ * BenchFile:
+ * @name: job name,
+ * @text: contents,
+ * @len: length of @text.
+ *
+ * A job configuration file of the corpus, kept in memory so that
+ * parse_job() may be timed without reading it.
+ **/
+typedef struct bench_file {
+	char   *name;
+	char   *text;
+	size_t  len;
+} BenchFile;
+
+/**
+ * BenchMode:
+ *
+ * Ways of loading the corpus: parse_job() on each file in memory, and
+ * conf_reload() reading files as each is parsed, reading them ahead in
+ * several threads, from a cache of compiled configuration written by an
+ * earlier run, and loading jobs without a start on condition lazily.
+ **/
+typedef enum bench_mode {
+	BENCH_PARSE_JOB,
+	BENCH_RELOAD,
+	BENCH_RELOAD_THREADS,
+	BENCH_RELOAD_CACHED,
+	BENCH_RELOAD_LAZY,
+	BENCH_MODE_LAST,
+} BenchMode;
+
+static const char *bench_mode_names[] = {
+	"parse_job",
+	"reload",
+	"threads",
+	"cached",
+	"lazy",
+};
+
+/**
+ * corpus:
+ * @corpus_len: number of files in corpus,
+ * @corpus_bytes: total length of files in corpus,
+ * @corpus_dir: temporary directory the corpus is written to.
+ *
+ * Job configuration files every mode is timed loading.
+ **/
+static BenchFile *corpus = NULL;
+static size_t     corpus_len = 0;
+static size_t     corpus_bytes = 0;
+static char       corpus_dir[] = "/tmp/upstart-bench-parse-XXXXXX";
+
+/**
+ * bench_allocs:
+ *
+ * Number of allocations made through nih_alloc(), from any thread.
+ **/
+static unsigned long long bench_allocs = 0;
+
+/**
+ * bench_malloc:
+ * @size: bytes to allocate.
+ *
+ * Allocator installed for nih_alloc() to count the allocations it makes.
+ *
+ * Returns: newly allocated memory or NULL.
+ **/
+static void *
+bench_malloc (size_t size)
+{
+	__sync_fetch_and_add (&bench_allocs, 1);
+
+	return malloc (size);
+}
+
+/**
+ * bench_now:
+ *
+ * Returns: current time on CLOCK_MONOTONIC in microseconds.
+ **/
+static unsigned long long
+bench_now (void)
+{
+	struct timespec  now;
+
+	assert0 (clock_gettime (CLOCK_MONOTONIC, &now));
+
+	return ((unsigned long long)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+/**
+ * bench_maxrss:
+ *
+ * Returns: peak resident set size of this process in kilobytes.
+ **/
+static long
+bench_maxrss (void)
+{
+	struct rusage  usage;
+
+	assert0 (getrusage (RUSAGE_SELF, &usage));
+
+	return usage.ru_maxrss;
+}
+
+/**
+ * bench_add:
+ * @name: job name,
+ * @text: contents of file.
+ *
+ * Add a job configuration file named after @name to the corpus, both in
+ * memory and in corpus_dir.
+ **/
+static void
+bench_add (const char *name,
+	   const char *text)
+{
+	nih_local char *path = NULL;
+	BenchFile      *file;
+	FILE           *out;
+
+	corpus = NIH_MUST (nih_realloc (corpus, NULL,
+					sizeof (BenchFile) * (corpus_len + 1)));
+	file = &corpus[corpus_len++];
+
+	file->name = NIH_MUST (nih_strdup (corpus, name));
+	file->text = NIH_MUST (nih_strdup (corpus, text));
+	file->len = strlen (text);
+
+	corpus_bytes += file->len;
+
+	path = NIH_MUST (nih_sprintf (NULL, "%s/%s.conf", corpus_dir, name));
+	out = fopen (path, "w");
+	assert (out);
+	assert (fwrite (text, 1, file->len, out) == file->len);
+	assert0 (fclose (out));
+}
+
+/**
+ * bench_generate:
+ * @i: index of file.
+ *
+ * Generate a large job configuration file, with a start on condition of
+ * several levels of operators for most, many env stanzas and long
+ * scripts.
+ *
+ * Returns: newly allocated string.
+ **/
+static char *
+bench_generate (int i)
+{
+	char *text;
+
+	text = NIH_MUST (nih_sprintf (NULL,
+				      "# generated%d - synthetic job\n"
+				      "\n"
+				      "description \"synthetic job %d\"\n"
+				      "author \"bench_parse\"\n"
+				      "\n",
+				      i, i));
+
+	/* One in four is only ever started by hand, as many real jobs are */
+	if (i % 4 != 3)
+		NIH_MUST (nih_strcat_sprintf (&text, NULL,
+					      "start on (filesystem and (net-device-up IFACE=eth%d or "
+					      "net-device-up IFACE=wlan%d)) and (started dbus or\n"
+					      "          (runlevel [2345] and (stopped rc RUNLEVEL=[2345] or "
+					      "starting generated%d)))\n",
+					      i % 4, i % 4, i + 1));
+
+	NIH_MUST (nih_strcat_sprintf (&text, NULL,
+				      "stop on runlevel [!2345] or stopping dbus or "
+				      "net-device-down IFACE=eth%d\n"
+				      "\n"
+				      "respawn\n"
+				      "respawn limit 10 5\n"
+				      "kill timeout 30\n"
+				      "normal exit 0 1 TERM HUP\n"
+				      "\n",
+				      i % 4));
+
+	for (int j = 0; j < 10 + i % 50; j++)
+		NIH_MUST (nih_strcat_sprintf (&text, NULL,
+					      "env GENERATED_%d_%d=\"value %d of job %d\"\n",
+					      i, j, j, i));
+
+	NIH_MUST (nih_strcat (&text, NULL, "\npre-start script\n"));
+	for (int j = 0; j < 20 + i % 200; j++)
+		NIH_MUST (nih_strcat_sprintf (&text, NULL,
+					      "    [ -d /run/generated%d/%d ] || "
+					      "mkdir -p /run/generated%d/%d\n",
+					      i, j, i, j));
+	NIH_MUST (nih_strcat (&text, NULL, "end script\n\nscript\n"));
+	for (int j = 0; j < 20 + i % 100; j++)
+		NIH_MUST (nih_strcat_sprintf (&text, NULL,
+					      "    echo \"step %d of $GENERATED_%d_0\" "
+					      ">> /var/log/generated%d.log\n",
+					      j, i, i));
+	NIH_MUST (nih_strcat_sprintf (&text, NULL,
+				      "    exec /usr/sbin/generated%d --foreground\n"
+				      "end script\n"
+				      "\n"
+				      "post-stop exec rm -rf /run/generated%d\n",
+				      i, i));
+
+	return text;
+}
+
+/**
+ * bench_corpus:
+ * @dir: directory of real job configuration files,
+ * @count: number of files to generate.
+ *
+ * Build the corpus from the .conf files of @dir and @count generated
+ * ones.
+ **/
+static void
+bench_corpus (const char *dir,
+	      int         count)
+{
+	DIR           *d;
+	struct dirent *ent;
+
+	assert (mkdtemp (corpus_dir));
+
+	d = opendir (dir);
+	if (! d) {
+		nih_fatal ("%s: %s", dir, strerror (errno));
+		exit (1);
+	}
+
+	while ((ent = readdir (d)) != NULL) {
+		nih_local char *name = NULL;
+		nih_local char *path = NULL;
+		nih_local char *data = NULL;
+		nih_local char *text = NULL;
+		size_t          len;
+
+		len = strlen (ent->d_name);
+		if ((len <= 5) || strcmp (ent->d_name + len - 5, ".conf"))
+			continue;
+
+		name = NIH_MUST (nih_strndup (NULL, ent->d_name, len - 5));
+		path = NIH_MUST (nih_sprintf (NULL, "%s/%s", dir, ent->d_name));
+
+		data = nih_file_read (NULL, path, &len);
+		if (! data) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_warn ("%s: %s", path, err->message);
+			nih_free (err);
+			continue;
+		}
+
+		/* File contents aren't terminated */
+		text = NIH_MUST (nih_strndup (NULL, data, len));
+
+		bench_add (name, text);
+	}
+
+	closedir (d);
+
+	for (int i = 0; i < count; i++) {
+		nih_local char *name = NULL;
+		nih_local char *text = NULL;
+
+		name = NIH_MUST (nih_sprintf (NULL, "generated%d", i));
+		text = bench_generate (i);
+
+		bench_add (name, text);
+	}
+}
+
+/**
+ * bench_corpus_remove:
+ *
+ * Remove corpus_dir and the files in it.
+ **/
+static void
+bench_corpus_remove (void)
+{
+	for (size_t i = 0; i < corpus_len; i++) {
+		nih_local char *path = NULL;
+
+		path = NIH_MUST (nih_sprintf (NULL, "%s/%s.conf",
+					      corpus_dir, corpus[i].name));
+		unlink (path);
+	}
+
+	rmdir (corpus_dir);
+}
+
+/**
+ * bench_parse_job:
+ * @classes: set to number of job classes parsed,
+ * @rss: set to RSS growth in kilobytes while they were kept.
+ *
+ * Parse every file of the corpus BENCH_ROUNDS times with parse_job(),
+ * keeping the job classes of the first round until it completes so that
+ * their memory may be measured.
+ *
+ * Returns: microseconds taken.
+ **/
+static unsigned long long
+bench_parse_job (size_t *classes,
+		 long   *rss)
+{
+	nih_local JobClass **kept = NULL;
+	unsigned long long   total = 0;
+	long                 rss_before;
+
+	kept = NIH_MUST (nih_alloc (NULL, sizeof (JobClass *) * corpus_len));
+	rss_before = bench_maxrss ();
+
+	*classes = 0;
+
+	for (int round = 0; round < BENCH_ROUNDS; round++) {
+		for (size_t i = 0; i < corpus_len; i++) {
+			unsigned long long begin;
+			JobClass *         class;
+			size_t             pos = 0;
+			size_t             lineno = 1;
+
+			begin = bench_now ();
+			class = parse_job (NULL, NULL, NULL, corpus[i].name,
+					   corpus[i].text, corpus[i].len,
+					   &pos, &lineno);
+			total += bench_now () - begin;
+
+			if (! class) {
+				NihError *err;
+
+				err = nih_error_get ();
+				nih_fatal ("%s:%zu: %s", corpus[i].name,
+					   lineno, err->message);
+				exit (1);
+			}
+
+			if (round) {
+				nih_free (class);
+			} else {
+				kept[(*classes)++] = class;
+			}
+		}
+
+		if (! round) {
+			*rss = bench_maxrss () - rss_before;
+
+			for (size_t i = 0; i < *classes; i++)
+				nih_free (kept[i]);
+		}
+	}
+
+	return total;
+}
+
+/**
+ * bench_reload:
+ * @classes: set to number of job classes loaded,
+ * @rss: set to RSS growth in kilobytes once loaded.
+ *
+ * Load the corpus through conf_reload() as the init daemon would at
+ * boot, with whatever the mode has set.
+ *
+ * Returns: microseconds taken.
+ **/
+static unsigned long long
+bench_reload (size_t *classes,
+	      long   *rss)
+{
+	unsigned long long begin;
+	unsigned long long total;
+	long               rss_before;
+
+	NIH_MUST (conf_source_new (NULL, corpus_dir, CONF_JOB_DIR));
+
+	rss_before = bench_maxrss ();
+
+	begin = bench_now ();
+	conf_reload ();
+	total = bench_now () - begin;
+
+	*rss = bench_maxrss () - rss_before;
+	*classes = test_hash_count (job_classes);
+
+	return total;
+}
+
+/**
+ * bench_mode:
+ * @mode: way of loading the corpus.
+ *
+ * Time loading the corpus in @mode, writing the result to stdout.
+ **/
+static void
+bench_mode (BenchMode mode)
+{
+	nih_local char     *cache = NULL;
+	unsigned long long  total;
+	unsigned long long  allocs;
+	unsigned long long  files;
+	unsigned long long  bytes;
+	size_t              classes;
+	long                rss = 0;
+
+	switch (mode) {
+	case BENCH_RELOAD_THREADS:
+		conf_load_threads = BENCH_THREADS;
+		break;
+	case BENCH_RELOAD_CACHED:
+		cache = NIH_MUST (nih_sprintf (NULL, "%s.cache", corpus_dir));
+		conf_cache_file = cache;
+		break;
+	case BENCH_RELOAD_LAZY:
+		conf_lazy_load = TRUE;
+		break;
+	default:
+		break;
+	}
+
+	allocs = bench_allocs;
+
+	if (mode == BENCH_PARSE_JOB) {
+		total = bench_parse_job (&classes, &rss);
+		files = (unsigned long long)corpus_len * BENCH_ROUNDS;
+		bytes = (unsigned long long)corpus_bytes * BENCH_ROUNDS;
+	} else {
+		total = bench_reload (&classes, &rss);
+		files = corpus_len;
+		bytes = corpus_bytes;
+	}
+
+	allocs = bench_allocs - allocs;
+
+	if (classes != corpus_len) {
+		nih_fatal ("expected %zu job classes, got %zu",
+			   corpus_len, classes);
+		exit (1);
+	}
+
+	printf ("%-10s %8llu %12llu %10.0f %10.2f %10.1f %10ld\n",
+		bench_mode_names[mode], files, bytes,
+		total ? (files * 1000000.0) / total : 0.0,
+		total ? (double)bytes / total : 0.0,
+		(double)allocs / files,
+		classes ? (rss * 1024) / (long)classes : 0);
+}
+
+/**
+ * bench_fork:
+ * @mode: way of loading the corpus.
+ *
+ * Run bench_mode() for @mode in a child process, so that it starts with
+ * no job classes loaded and peak RSS measures only its own.
+ **/
+static void
+bench_fork (BenchMode mode)
+{
+	pid_t pid;
+	int   status;
+
+	fflush (stdout);
+
+	pid = fork ();
+	assert (pid >= 0);
+
+	if (! pid) {
+		bench_mode (mode);
+		exit (0);
+	}
+
+	assert (waitpid (pid, &status, 0) == pid);
+	if (! WIFEXITED (status) || WEXITSTATUS (status))
+		exit (1);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+	nih_local char *cache = NULL;
+	const char     *dir = BENCH_CORPUS_DIR;
+	int             count = BENCH_DEFAULT_COUNT;
+
+	nih_main_init (argv[0]);
+
+	if (argc > 1)
+		count = atoi (argv[1]);
+	if (argc > 2)
+		dir = argv[2];
+
+	if ((argc > 3) || (count < 0)) {
+		fprintf (stderr, "Usage: %s [COUNT [DIR]]\n", argv[0]);
+		exit (1);
+	}
+
+	setenv ("UPSTART_NO_SESSIONS", "1", 1);
+
+	session_init ();
+	event_init ();
+	conf_init ();
+	job_class_init ();
+
+	bench_corpus (dir, count);
+
+	__nih_malloc = bench_malloc;
+
+	printf ("%-10s %8s %12s %10s %10s %10s %10s\n",
+		"mode", "files", "bytes", "files/s", "MB/s",
+		"allocs/f", "B/class");
+
+	for (BenchMode mode = 0; mode < BENCH_MODE_LAST; mode++) {
+		/* The cache is written by a reload before the one timed */
+		if (mode == BENCH_RELOAD_CACHED) {
+			pid_t pid;
+			int   status;
+
+			pid = fork ();
+			assert (pid >= 0);
+
+			if (! pid) {
+				size_t classes;
+				long   rss;
+
+				cache = NIH_MUST (nih_sprintf (NULL, "%s.cache",
+							       corpus_dir));
+				conf_cache_file = cache;
+				(void)bench_reload (&classes, &rss);
+				exit (0);
+			}
+
+			assert (waitpid (pid, &status, 0) == pid);
+			if (! WIFEXITED (status) || WEXITSTATUS (status))
+				exit (1);
+		}
+
+		bench_fork (mode);
+	}
+
+	cache = NIH_MUST (nih_sprintf (NULL, "%s.cache", corpus_dir));
+	unlink (cache);
+
+	bench_corpus_remove ();
+
+	return 0;
+}
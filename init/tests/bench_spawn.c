@@ -0,0 +1,200 @@
+/* upstart
+ *
+ * bench_spawn.c - benchmark for the rate at which job processes can be
+ * spawned.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include <nih/test.h>
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/logging.h>
+#include <nih/main.h>
+
+#include "session.h"
+#include "event.h"
+#include "conf.h"
+#include "job_class.h"
+#include "job.h"
+#include "job_process.h"
+#include "test_util_common.h"
+
+/**
+ * BENCH_DEFAULT_COUNT:
+ *
+ * Number of processes to spawn with each engine if not specified on the
+ * command-line.
+ **/
+#define BENCH_DEFAULT_COUNT 1000
+
+/**
+ * BENCH_BALLAST_MB:
+ *
+ * Megabytes of touched heap to add for the second run of each engine,
+ * standing in for the memory of a long-running init with many jobs.
+ **/
+#define BENCH_BALLAST_MB 256
+
+extern int disable_clone_spawn;
+
+/**
+ * bench_now:
+ *
+ * Returns: current time on CLOCK_MONOTONIC in microseconds.
+ **/
+static unsigned long long
+bench_now (void)
+{
+	struct timespec  now;
+
+	assert0 (clock_gettime (CLOCK_MONOTONIC, &now));
+
+	return ((unsigned long long)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+/**
+ * bench_engine:
+ *
+ * @count: number of processes to spawn,
+ * @ballast: megabytes of memory in use.
+ *
+ * Time spawning and reaping @count processes of /bin/true with the
+ * engine selected by disable_clone_spawn, writing the result to stdout.
+ **/
+static void
+bench_engine (int count, int ballast)
+{
+	JobClass           *class;
+	Job                *job;
+	char               *argv[] = { "/bin/true", NULL };
+	unsigned long long  begin;
+	unsigned long long  spawn = 0;
+	unsigned long long  total;
+
+	class = NIH_MUST (job_class_new (NULL, "bench", NULL));
+	class->console = CONSOLE_NONE;
+	job = NIH_MUST (job_new (class, ""));
+
+	total = bench_now ();
+
+	for (int i = 0; i < count; i++) {
+		pid_t pid;
+		int   fd = -1;
+		int   status;
+
+		begin = bench_now ();
+		pid = job_process_spawn_with_fd (job, argv, NULL, FALSE, -1,
+						 PROCESS_MAIN, &fd);
+		spawn += bench_now () - begin;
+
+		if (pid < 0) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_fatal ("%s", err->message);
+			exit (1);
+		}
+
+		close (fd);
+
+		assert (waitpid (pid, &status, 0) == pid);
+		if (! WIFEXITED (status) || WEXITSTATUS (status))
+			exit (1);
+	}
+
+	total = bench_now () - total;
+
+	nih_free (class);
+
+	printf ("%-6s %8d %8d %12llu %12llu %10.0f\n",
+		disable_clone_spawn ? "fork" : "clone",
+		count, ballast, spawn / count, total / count,
+		total ? (count * 1000000.0) / total : 0.0);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+	int count = BENCH_DEFAULT_COUNT;
+
+	nih_main_init (argv[0]);
+
+	if (argc > 1) {
+		count = atoi (argv[1]);
+		if (count <= 0) {
+			fprintf (stderr, "Usage: %s [COUNT]\n", argv[0]);
+			exit (1);
+		}
+	}
+
+	setenv ("UPSTART_NO_SESSIONS", "1", 1);
+
+	session_init ();
+	event_init ();
+	conf_init ();
+	job_class_init ();
+
+	printf ("%-6s %8s %8s %12s %12s %10s\n",
+		"engine", "procs", "heap(MB)", "spawn(us)", "total(us)",
+		"procs/s");
+
+	/* Spawn costs under fork() grow with the size of our address
+	 * space, so run each engine both without and with ballast, in a
+	 * fresh process so earlier runs don't leave memory behind.
+	 */
+	for (int ballast = 0; ballast <= BENCH_BALLAST_MB; ballast += BENCH_BALLAST_MB) {
+		for (int engine = FALSE; engine <= TRUE; engine++) {
+			pid_t pid;
+			int   status;
+
+			fflush (stdout);
+
+			pid = fork ();
+			assert (pid >= 0);
+
+			if (! pid) {
+				char *heap = NULL;
+
+				if (ballast) {
+					heap = malloc ((size_t)ballast << 20);
+					assert (heap);
+					memset (heap, 1, (size_t)ballast << 20);
+				}
+
+				disable_clone_spawn = engine;
+				bench_engine (count, ballast);
+
+				free (heap);
+				exit (0);
+			}
+
+			assert (waitpid (pid, &status, 0) == pid);
+			if (! WIFEXITED (status) || WEXITSTATUS (status))
+				exit (1);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,310 @@
+/* upstart
+ *
+ * bench_state.c - benchmark for stateful re-exec serialisation and
+ * deserialisation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <nih/test.h>
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/logging.h>
+#include <nih/main.h>
+
+#include "state.h"
+#include "session.h"
+#include "process.h"
+#include "event.h"
+#include "environ.h"
+#include "conf.h"
+#include "job_class.h"
+#include "job.h"
+#include "test_util_common.h"
+
+/**
+ * BENCH_DEFAULT_COUNT:
+ *
+ * Number of job classes (each with a single job) and events to create
+ * if not specified on the command-line.
+ **/
+#define BENCH_DEFAULT_COUNT 1000
+
+/**
+ * BENCH_DIR:
+ *
+ * Configuration directory the synthetic job classes claim to have been
+ * loaded from; it need not exist.
+ **/
+#define BENCH_DIR "/tmp/upstart-bench-state"
+
+/**
+ * bench_now:
+ *
+ * Returns: current time on CLOCK_MONOTONIC in microseconds.
+ **/
+static unsigned long long
+bench_now (void)
+{
+	struct timespec  now;
+
+	assert0 (clock_gettime (CLOCK_MONOTONIC, &now));
+
+	return ((unsigned long long)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+/**
+ * bench_maxrss:
+ *
+ * Returns: peak resident set size of this process in kilobytes.
+ **/
+static long
+bench_maxrss (void)
+{
+	struct rusage  usage;
+
+	assert0 (getrusage (RUSAGE_SELF, &usage));
+
+	return usage.ru_maxrss;
+}
+
+/**
+ * bench_populate:
+ *
+ * @count: number of objects to create.
+ *
+ * Create @count job classes, each with a running instance and main
+ * process, and @count events each with some environment.
+ **/
+static void
+bench_populate (int count)
+{
+	ConfSource *source;
+
+	source = NIH_MUST (conf_source_new (NULL, BENCH_DIR, CONF_JOB_DIR));
+
+	for (int i = 0; i < count; i++) {
+		nih_local char  *path = NULL;
+		nih_local char  *name = NULL;
+		nih_local char **env = NULL;
+		size_t           len = 0;
+		ConfFile        *file;
+		JobClass        *class;
+		Job             *job;
+		Event           *event;
+
+		name = NIH_MUST (nih_sprintf (NULL, "bench%d", i));
+		path = NIH_MUST (nih_sprintf (NULL, "%s/%s.conf", BENCH_DIR, name));
+
+		file = NIH_MUST (conf_file_new (source, path));
+		class = file->job = NIH_MUST (job_class_new (NULL, name, NULL));
+		conf_file_index (file);
+		assert (job_class_consider (class));
+
+		class->process[PROCESS_MAIN] = NIH_MUST (process_new (class));
+		class->process[PROCESS_MAIN]->command = NIH_MUST (
+				nih_sprintf (class->process[PROCESS_MAIN],
+					     "/bin/sleep %d", i));
+
+		job = NIH_MUST (job_new (class, ""));
+		job->goal = JOB_START;
+		job->state = JOB_RUNNING;
+		job->pid[PROCESS_MAIN] = 1000 + i;
+
+		env = NIH_MUST (nih_str_array_new (NULL));
+		NIH_MUST (environ_add (&env, NULL, &len, TRUE, "FOO=BAR"));
+		NIH_MUST (environ_set (&env, NULL, &len, TRUE, "JOB=%s", name));
+
+		event = NIH_MUST (event_new (NULL, "bench-event", env));
+		event->progress = EVENT_HANDLING;
+	}
+}
+
+/**
+ * bench_clear:
+ *
+ * Free all objects, as though a re-exec had occurred.
+ **/
+static void
+bench_clear (void)
+{
+	NIH_LIST_FOREACH_SAFE (conf_sources, iter) {
+		ConfSource *source = (ConfSource *)iter;
+
+		nih_free (source);
+	}
+
+	NIH_LIST_FOREACH_SAFE (events, iter) {
+		Event *event = (Event *)iter;
+
+		nih_free (event);
+	}
+
+	NIH_LIST_FOREACH_SAFE (sessions, iter) {
+		Session *session = (Session *)iter;
+
+		nih_free (session);
+	}
+
+	job_class_environment_clear ();
+}
+
+/**
+ * bench_check:
+ *
+ * @count: number of objects expected.
+ *
+ * Check that deserialisation recreated all objects.
+ **/
+static void
+bench_check (int count)
+{
+	if (test_hash_count (job_classes) != (size_t)count
+	    || test_list_count (events) != (size_t)count) {
+		nih_fatal ("expected %d job classes and events, got %zu and %zu",
+			   count, test_hash_count (job_classes),
+			   test_list_count (events));
+		exit (1);
+	}
+}
+
+/**
+ * bench_format:
+ *
+ * @count: number of objects to create,
+ * @format: format to serialise in.
+ *
+ * Time a serialise and deserialise round trip of @count objects in
+ * @format, writing the result to stdout.
+ **/
+static void
+bench_format (int count, StateFormat format)
+{
+	nih_local char         *json_string = NULL;
+	nih_local NihIoBuffer  *buffer = NULL;
+	const char             *data;
+	size_t                  len;
+	unsigned long long      begin;
+	unsigned long long      serialise;
+	unsigned long long      deserialise;
+	long                    rss_before;
+	long                    rss_serialise;
+	long                    rss_deserialise;
+	FILE                   *file;
+
+	bench_populate (count);
+
+	rss_before = bench_maxrss ();
+	begin = bench_now ();
+
+	if (format == STATE_FORMAT_BINARY) {
+		assert0 (state_to_binary (&buffer));
+		data = buffer->buf;
+		len = buffer->len;
+	} else {
+		assert0 (state_to_string (&json_string, &len));
+		data = json_string;
+	}
+
+	serialise = bench_now () - begin;
+	rss_serialise = bench_maxrss ();
+
+	/* Deserialise through the same path as a re-exec */
+	file = tmpfile ();
+	assert (file);
+	assert (fwrite (data, 1, len, file) == len);
+	assert0 (fflush (file));
+	rewind (file);
+
+	bench_clear ();
+
+	begin = bench_now ();
+	assert0 (state_read_objects (fileno (file)));
+	deserialise = bench_now () - begin;
+	rss_deserialise = bench_maxrss ();
+
+	fclose (file);
+
+	bench_check (count);
+	bench_clear ();
+
+	printf ("%-6s %8d %12zu %12llu %12llu %10ld %10ld\n",
+		format == STATE_FORMAT_BINARY ? "binary" : "json",
+		count, len, serialise, deserialise,
+		rss_serialise - rss_before, rss_deserialise - rss_before);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+	int count = BENCH_DEFAULT_COUNT;
+
+	nih_main_init (argv[0]);
+
+	if (argc > 1) {
+		count = atoi (argv[1]);
+		if (count <= 0) {
+			fprintf (stderr, "Usage: %s [COUNT]\n", argv[0]);
+			exit (1);
+		}
+	}
+
+	setenv ("UPSTART_NO_SESSIONS", "1", 1);
+
+	session_init ();
+	event_init ();
+	conf_init ();
+	job_class_init ();
+
+	printf ("%-6s %8s %12s %12s %12s %10s %10s\n",
+		"format", "objects", "bytes", "ser(us)", "deser(us)",
+		"ser(KB)", "deser(KB)");
+
+	/* Peak RSS only ever increases, so run each format in a fresh
+	 * process.
+	 */
+	for (int format = STATE_FORMAT_JSON; format <= STATE_FORMAT_BINARY; format++) {
+		pid_t pid;
+		int   status;
+
+		fflush (stdout);
+
+		pid = fork ();
+		assert (pid >= 0);
+
+		if (! pid) {
+			bench_format (count, format);
+			exit (0);
+		}
+
+		assert (waitpid (pid, &status, 0) == pid);
+		if (! WIFEXITED (status) || WEXITSTATUS (status))
+			exit (1);
+	}
+
+	return 0;
+}
@@ -0,0 +1,499 @@
+/* upstart
+ *
+ * replay_trace.c - replay of recorded event traces against a configuration.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <nih/test.h>
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+#include <nih/main.h>
+
+#include "session.h"
+#include "event.h"
+#include "events.h"
+#include "conf.h"
+#include "job_class.h"
+#include "job.h"
+#include "event_trace.h"
+
+#ifdef ENABLE_CGROUPS
+extern int disable_cgroups;
+#endif /* ENABLE_CGROUPS */
+
+/**
+ * ReplayCounts:
+ * @events: event records in the trace,
+ * @generated: event records emitted by jobs, or for failed events,
+ * @sessions: event records of chroot sessions,
+ * @jobs: job records in the trace,
+ * @goals: job records replayed as goal changes.
+ *
+ * What was found in the trace and how much of it was replayed.
+ **/
+typedef struct replay_counts {
+	size_t events;
+	size_t generated;
+	size_t sessions;
+	size_t jobs;
+	size_t goals;
+} ReplayCounts;
+
+
+/**
+ * replay_now:
+ *
+ * Returns: current time on CLOCK_MONOTONIC in microseconds.
+ **/
+static unsigned long long
+replay_now (void)
+{
+	struct timespec  now;
+
+	assert0 (clock_gettime (CLOCK_MONOTONIC, &now));
+
+	return ((unsigned long long)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+/**
+ * replay_compare:
+ * @a: latency,
+ * @b: latency.
+ *
+ * qsort() comparison of latencies.
+ *
+ * Returns: less than, equal to or greater than zero as @a is less than,
+ * equal to or greater than @b.
+ **/
+static int
+replay_compare (const void *a,
+		const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * replay_wait:
+ * @begin: time the replay began,
+ * @origin: time of the first record in the trace,
+ * @time: time of the next record,
+ * @speed: factor to speed the trace up by, or zero for no delay.
+ *
+ * Sleeps until the record at @time is due, keeping the gaps between the
+ * records of the trace divided by @speed.
+ **/
+static void
+replay_wait (unsigned long long begin,
+	     unsigned long long origin,
+	     unsigned long long time,
+	     double             speed)
+{
+	unsigned long long due;
+	unsigned long long now;
+	struct timespec    delay;
+
+	if ((speed <= 0) || (time < origin))
+		return;
+
+	due = begin + (unsigned long long)((time - origin) / speed);
+	now = replay_now ();
+	if (due <= now)
+		return;
+
+	delay.tv_sec = (due - now) / 1000000;
+	delay.tv_nsec = ((due - now) % 1000000) * 1000;
+
+	nanosleep (&delay, NULL);
+}
+
+/**
+ * replay_generated:
+ * @record: event record.
+ *
+ * Events emitted by jobs as they change state, and those emitted when
+ * other events fail, are emitted again by the replay itself.
+ *
+ * Returns: TRUE if @record is of such an event.
+ **/
+static int
+replay_generated (const EventTraceRecord *record)
+{
+	size_t len;
+
+	nih_assert (record != NULL);
+
+	if ((! strcmp (record->name, JOB_STARTING_EVENT))
+	    || (! strcmp (record->name, JOB_STARTED_EVENT))
+	    || (! strcmp (record->name, JOB_STOPPING_EVENT))
+	    || (! strcmp (record->name, JOB_STOPPED_EVENT)))
+		return TRUE;
+
+	len = strlen (record->name);
+
+	return ((len > 7) && (! strcmp (record->name + len - 7, "/failed")));
+}
+
+/**
+ * replay_job:
+ * @name: name of job class,
+ * @instance: name of instance,
+ * @create: TRUE to create the instance if there isn't one.
+ *
+ * Returns: instance @instance of the job class @name, or NULL if there is
+ * no such class, or no such instance and @create is FALSE.
+ **/
+static Job *
+replay_job (const char *name,
+	    const char *instance,
+	    int         create)
+{
+	JobClass *class;
+	Job      *job;
+
+	nih_assert (name != NULL);
+	nih_assert (instance != NULL);
+
+	class = (JobClass *)nih_hash_lookup (job_classes, name);
+	if (! class)
+		return NULL;
+
+	job = (Job *)nih_hash_lookup (class->instances, instance);
+	if ((! job) && create)
+		job = NIH_MUST (job_new (class, instance));
+
+	return job;
+}
+
+/**
+ * replay_key:
+ * @parent: parent object for new string,
+ * @name: name of job class,
+ * @instance: name of instance.
+ *
+ * Returns: newly allocated name of instance @instance of @name, as
+ * written in the results.
+ **/
+static char *
+replay_key (const void *parent,
+	    const char *name,
+	    const char *instance)
+{
+	nih_assert (name != NULL);
+	nih_assert (instance != NULL);
+
+	if (*instance)
+		return NIH_MUST (nih_sprintf (parent, "%s (%s)", name, instance));
+
+	return NIH_MUST (nih_strdup (parent, name));
+}
+
+/**
+ * replay_abstract:
+ *
+ * Replaces each job class loaded with an abstract job, running no
+ * processes, so that the trace may be replayed without side effects and
+ * without waiting for processes.
+ **/
+static void
+replay_abstract (void)
+{
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		for (int i = 0; i < PROCESS_LAST; i++) {
+			if (class->process[i]) {
+				nih_free (class->process[i]);
+				class->process[i] = NULL;
+			}
+		}
+
+		class->console = CONSOLE_NONE;
+	}
+}
+
+/**
+ * replay_goal:
+ * @record: job record,
+ * @counts: counts to update.
+ *
+ * Jobs that left a rest state in the trace without an event having
+ * caused them to, because they were started or stopped by a client or
+ * because their main process exited, are sent the same way in the
+ * replay by changing their goal.
+ **/
+static void
+replay_goal (const EventTraceRecord *record,
+	     ReplayCounts           *counts)
+{
+	Job *job;
+
+	nih_assert (record != NULL);
+	nih_assert (counts != NULL);
+
+	if ((record->old_state == JOB_WAITING)
+	    && (record->state == JOB_STARTING)) {
+		job = replay_job (record->name, record->instance, TRUE);
+		if ((! job) || (job->state != JOB_WAITING))
+			return;
+
+		job_change_goal (job, JOB_START);
+	} else if ((record->old_state == JOB_RUNNING)
+		   && ((record->state == JOB_STOPPING)
+		       || (record->state == JOB_PRE_STOPPING))) {
+		job = replay_job (record->name, record->instance, FALSE);
+		if ((! job) || (job->state != JOB_RUNNING)
+		    || (job->goal != JOB_START))
+			return;
+
+		job_change_goal (job, JOB_STOP);
+	} else {
+		return;
+	}
+
+	counts->goals++;
+	event_poll ();
+}
+
+/**
+ * replay_states:
+ * @records: records of trace.
+ *
+ * Compares the state each job was left in by the replay with the last
+ * state the trace recorded for it, jobs not in the trace being expected
+ * to be waiting, and writes any that differ to stdout.
+ *
+ * Returns: number of jobs whose states differ.
+ **/
+static size_t
+replay_states (NihList *records)
+{
+	nih_local NihHash *seen = NULL;
+	size_t             jobs = 0;
+	size_t             mismatched = 0;
+
+	nih_assert (records != NULL);
+
+	seen = NIH_MUST (nih_hash_string_new (NULL, 0));
+
+	/* Walk the trace backwards so the last state of each job is the
+	 * first found.
+	 */
+	for (NihList *iter = records->prev; iter != records; iter = iter->prev) {
+		EventTraceRecord *record = (EventTraceRecord *)iter;
+		nih_local char   *key = NULL;
+		NihListEntry     *entry;
+		Job              *job;
+		JobState          state;
+
+		if (record->type != EVENT_TRACE_JOB)
+			continue;
+
+		key = replay_key (NULL, record->name, record->instance);
+		if (nih_hash_lookup (seen, key))
+			continue;
+
+		entry = NIH_MUST (nih_list_entry_new (seen));
+		entry->str = NIH_MUST (nih_strdup (entry, key));
+		nih_hash_add (seen, &entry->entry);
+
+		jobs++;
+
+		job = replay_job (record->name, record->instance, FALSE);
+		state = job ? job->state : JOB_WAITING;
+		if (state == record->state)
+			continue;
+
+		printf ("  %s: expected %s, got %s\n", key,
+			job_state_name (record->state), job_state_name (state));
+		mismatched++;
+	}
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		NIH_HASH_FOREACH (class->instances, job_iter) {
+			Job            *job = (Job *)job_iter;
+			nih_local char *key = NULL;
+
+			key = replay_key (NULL, class->name, job->name);
+			if (nih_hash_lookup (seen, key))
+				continue;
+
+			jobs++;
+
+			if (job->state == JOB_WAITING)
+				continue;
+
+			printf ("  %s: expected %s, got %s\n", key,
+				job_state_name (JOB_WAITING),
+				job_state_name (job->state));
+			mismatched++;
+		}
+	}
+
+	printf ("%zu jobs, %zu mismatched\n", jobs, mismatched);
+
+	return mismatched;
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+	nih_local NihList  *records = NULL;
+	ConfSource         *source;
+	ReplayCounts        counts = { 0 };
+	unsigned long long *latency;
+	unsigned long long  total = 0;
+	unsigned long long  origin = 0;
+	unsigned long long  begin;
+	size_t              replayed = 0;
+	double              speed = 1.0;
+	char               *endptr;
+
+	nih_main_init (argv[0]);
+
+	if (argc > 3) {
+		speed = strtod (argv[3], &endptr);
+		if (*endptr)
+			speed = -1;
+	}
+
+	if ((argc < 3) || (argc > 4) || (speed < 0)) {
+		fprintf (stderr, "Usage: %s CONFDIR TRACE [SPEED]\n", argv[0]);
+		exit (1);
+	}
+
+	setenv ("UPSTART_NO_SESSIONS", "1", 1);
+
+#ifdef ENABLE_CGROUPS
+	disable_cgroups = TRUE;
+#endif /* ENABLE_CGROUPS */
+
+	session_init ();
+	event_init ();
+	conf_init ();
+	job_class_init ();
+
+	records = event_trace_load (NULL, argv[2]);
+	if (! records) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_fatal ("%s: %s", argv[2], err->message);
+		exit (1);
+	}
+
+	source = NIH_MUST (conf_source_new (NULL, argv[1], CONF_JOB_DIR));
+	if (conf_source_reload (source) < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_fatal ("%s: %s", argv[1], err->message);
+		exit (1);
+	}
+
+	replay_abstract ();
+
+	NIH_LIST_FOREACH (records, iter) {
+		EventTraceRecord *record = (EventTraceRecord *)iter;
+
+		if (! origin)
+			origin = record->time;
+
+		if (record->type == EVENT_TRACE_EVENT) {
+			counts.events++;
+		} else {
+			counts.jobs++;
+		}
+	}
+
+	latency = NIH_MUST (nih_alloc (NULL, sizeof (unsigned long long)
+				       * (counts.events + 1)));
+
+	/* Events emitted by jobs are emitted again as the replayed jobs
+	 * change state; those of chroot sessions would have no jobs to
+	 * go to, since only the host's configuration is loaded.
+	 */
+	begin = replay_now ();
+
+	NIH_LIST_FOREACH (records, iter) {
+		EventTraceRecord   *record = (EventTraceRecord *)iter;
+		nih_local char    **env = NULL;
+		unsigned long long  start;
+
+		replay_wait (begin, origin, record->time, speed);
+
+		if (record->type == EVENT_TRACE_JOB) {
+			replay_goal (record, &counts);
+			continue;
+		}
+
+		if (replay_generated (record)) {
+			counts.generated++;
+			continue;
+		}
+
+		if (record->session) {
+			counts.sessions++;
+			continue;
+		}
+
+		env = NIH_MUST (nih_str_array_copy (NULL, NULL, record->env));
+
+		start = replay_now ();
+		NIH_MUST (event_new (NULL, record->name, env));
+		event_poll ();
+		latency[replayed] = replay_now () - start;
+
+		total += latency[replayed++];
+	}
+
+	printf ("%zu events (%zu generated, %zu in chroot sessions), "
+		"%zu job changes (%zu replayed as goals)\n",
+		counts.events, counts.generated, counts.sessions,
+		counts.jobs, counts.goals);
+
+	if (replayed) {
+		qsort (latency, replayed, sizeof (unsigned long long),
+		       replay_compare);
+
+		printf ("%8s %10s %8s %8s %8s %8s\n",
+			"events", "events/s", "p50(us)", "p90(us)",
+			"p99(us)", "max(us)");
+		printf ("%8zu %10.0f %8llu %8llu %8llu %8llu\n",
+			replayed,
+			total ? (replayed * 1000000.0) / total : 0.0,
+			latency[replayed / 2], latency[replayed * 9 / 10],
+			latency[replayed * 99 / 100], latency[replayed - 1]);
+	}
+
+	nih_free (latency);
+
+	return replay_states (records) ? 1 : 0;
+}
@@ -0,0 +1,216 @@
+/* upstart
+ *
+ * test_alloc_pool.c - test suite for init/alloc_pool.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nih/test.h>
+#include <nih/alloc.h>
+
+#include "alloc_pool.h"
+
+
+/**
+ * pool_of:
+ * @ptr: object allocated with nih_alloc().
+ *
+ * Returns: pool the slab containing @ptr belongs to; only meaningful for
+ * pooled objects.
+ **/
+static AllocPool *
+pool_of (const void *ptr)
+{
+	AllocPoolSlab *slab;
+
+	slab = (AllocPoolSlab *)((uintptr_t)ptr
+				 & ~(uintptr_t)(ALLOC_POOL_SLAB_SIZE - 1));
+
+	return slab->pool;
+}
+
+
+void
+test_add (void)
+{
+	TEST_FUNCTION ("alloc_pool_add");
+	alloc_pool_init ();
+
+	/* Check that adding a pool records it with room for no objects
+	 * until one is allocated.
+	 */
+	TEST_FEATURE ("with new size");
+	TEST_EQ (alloc_pool_add ("Test", 40), 0);
+
+	TEST_EQ (alloc_pools_len, 1);
+	TEST_EQ_STR (alloc_pools[0].name, "Test");
+	TEST_GT (alloc_pools[0].size, 40);
+	TEST_EQ (alloc_pools[0].chunk_size % 16, 0);
+	TEST_GT (alloc_pools[0].per_slab, 1);
+	TEST_EQ (alloc_pools[0].slabs, 0);
+	TEST_EQ (alloc_pools[0].live, 0);
+
+
+	/* Check that a type the same size as one already pooled shares
+	 * its pool.
+	 */
+	TEST_FEATURE ("with existing size");
+	TEST_EQ (alloc_pool_add ("Other", 40), 0);
+
+	TEST_EQ (alloc_pools_len, 1);
+	TEST_EQ_STR (alloc_pools[0].name, "Test");
+}
+
+
+void
+test_alloc (void)
+{
+	AllocPool  *pool = &alloc_pools[0];
+	void       *ptr;
+	void       *other;
+	void      **ptrs;
+	size_t      count;
+
+	TEST_FUNCTION ("nih_alloc");
+
+	/* Check that an object of the pooled size is taken from the pool,
+	 * and returned to it when freed, leaving the slab for the next.
+	 */
+	TEST_FEATURE ("with pooled size");
+	ptr = nih_alloc (NULL, 40);
+
+	TEST_NE_P (ptr, NULL);
+	TEST_EQ_P (pool_of (ptr), pool);
+	TEST_EQ (pool->live, 1);
+	TEST_EQ (pool->peak, 1);
+	TEST_EQ (pool->slabs, 1);
+
+	memset (ptr, 'x', 40);
+	nih_free (ptr);
+
+	TEST_EQ (pool->live, 0);
+	TEST_EQ (pool->peak, 1);
+	TEST_EQ (pool->slabs, 1);
+
+
+	/* Check that an object of any other size isn't pooled. */
+	TEST_FEATURE ("with other size");
+	ptr = nih_alloc (NULL, 41);
+
+	TEST_NE_P (ptr, NULL);
+	TEST_EQ (pool->live, 0);
+
+	nih_free (ptr);
+
+
+	/* Check that children of a pooled object are freed along with it,
+	 * whether pooled themselves or not.
+	 */
+	TEST_FEATURE ("with children");
+	ptr = nih_alloc (NULL, 40);
+	other = nih_alloc (ptr, 40);
+	TEST_FREE_TAG (other);
+	NIH_MUST (nih_alloc (ptr, 100));
+
+	TEST_EQ (pool->live, 2);
+
+	nih_free (ptr);
+
+	TEST_FREE (other);
+	TEST_EQ (pool->live, 0);
+
+
+	/* Check that filling a slab adds another, and that once emptied
+	 * it's returned, leaving only one.
+	 */
+	TEST_FEATURE ("with more than a slab");
+	count = pool->per_slab + 1;
+	ptrs = malloc (sizeof (void *) * count);
+
+	for (size_t i = 0; i < count; i++)
+		ptrs[i] = NIH_MUST (nih_alloc (NULL, 40));
+
+	TEST_EQ (pool->live, count);
+	TEST_EQ (pool->peak, count);
+	TEST_EQ (pool->slabs, 2);
+
+	for (size_t i = 0; i < count; i++)
+		nih_free (ptrs[i]);
+
+	TEST_EQ (pool->live, 0);
+	TEST_EQ (pool->slabs, 1);
+
+	free (ptrs);
+
+
+	/* Check that resizing a pooled object moves it out of the pool,
+	 * keeping its contents.
+	 */
+	TEST_FEATURE ("with reallocation");
+	ptr = nih_alloc (NULL, 40);
+	strcpy (ptr, "pooled");
+
+	TEST_EQ (pool->live, 1);
+
+	ptr = nih_realloc (ptr, NULL, 100);
+
+	TEST_NE_P (ptr, NULL);
+	TEST_EQ_STR (ptr, "pooled");
+	TEST_EQ (pool->live, 0);
+
+	nih_free (ptr);
+}
+
+
+void
+test_stats_to_string (void)
+{
+	AllocPool *pool = &alloc_pools[0];
+	char      *str;
+	char       expected[200];
+	void      *ptr;
+
+	TEST_FUNCTION ("alloc_pool_stats_to_string");
+
+	/* Check that the counts of each pool are given. */
+	ptr = nih_alloc (NULL, 40);
+
+	str = alloc_pool_stats_to_string (NULL);
+
+	TEST_NE_P (str, NULL);
+	sprintf (expected, "{ \"Test\": { \"live\": 1, \"peak\": %zu, "
+		 "\"size\": %zu, \"slabs\": 1 } }",
+		 pool->peak, pool->per_slab);
+	TEST_EQ_STR (str, expected);
+
+	nih_free (str);
+	nih_free (ptr);
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	test_add ();
+	test_alloc ();
+	test_stats_to_string ();
+
+	return 0;
+}
@@ -0,0 +1,193 @@
+/* upstart
+ *
+ * test_apparmor.c - test suite for init/apparmor.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <nih/test.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/main.h>
+
+#include "apparmor.h"
+
+
+void
+test_load_needed (void)
+{
+	char            filename[PATH_MAX];
+	char            include[PATH_MAX];
+	nih_local char *command = NULL;
+	FILE           *f;
+
+	TEST_FUNCTION ("apparmor_load_needed");
+	TEST_FILENAME (filename);
+	TEST_FILENAME (include);
+
+	command = NIH_MUST (nih_sprintf (NULL, "%s %s %s", APPARMOR_PARSER,
+					 APPARMOR_PARSER_OPTS, filename));
+
+	f = fopen (filename, "w");
+	assert (f != NULL);
+	fprintf (f, "profile test {}\n");
+	fclose (f);
+
+
+	/* Check that a profile not yet loaded needs loading, and does
+	 * again until the load has finished.
+	 */
+	TEST_FEATURE ("with new profile");
+	TEST_TRUE (apparmor_load_needed (command));
+	TEST_TRUE (apparmor_load_needed (command));
+
+
+	/* Check that once the profile has been loaded, it isn't loaded
+	 * again.
+	 */
+	TEST_FEATURE ("with loaded profile");
+	apparmor_load_finished (command, 0);
+
+	TEST_FALSE (apparmor_load_needed (command));
+	TEST_FALSE (apparmor_load_needed (command));
+
+
+	/* Check that a profile is loaded again once its source has been
+	 * changed.
+	 */
+	TEST_FEATURE ("with changed profile");
+	f = fopen (filename, "a");
+	assert (f != NULL);
+	fprintf (f, "profile other {}\n");
+	fclose (f);
+
+	TEST_TRUE (apparmor_load_needed (command));
+
+	apparmor_load_finished (command, 0);
+
+	TEST_FALSE (apparmor_load_needed (command));
+
+
+	/* Check that a profile that failed to load is loaded again. */
+	TEST_FEATURE ("with failed load");
+	f = fopen (filename, "a");
+	assert (f != NULL);
+	fprintf (f, "profile broken {\n");
+	fclose (f);
+
+	TEST_TRUE (apparmor_load_needed (command));
+
+	apparmor_load_finished (command, 1);
+
+	TEST_TRUE (apparmor_load_needed (command));
+
+
+	/* Check that a profile is loaded again once a file that it
+	 * includes has been changed, even though it hasn't itself.
+	 */
+	TEST_FEATURE ("with changed include");
+	f = fopen (include, "w");
+	assert (f != NULL);
+	fprintf (f, "# nothing yet\n");
+	fclose (f);
+
+	f = fopen (filename, "w");
+	assert (f != NULL);
+	fprintf (f, "#include \"%s\"\n", include);
+	fprintf (f, "profile test {\n");
+	fprintf (f, "  include if exists <upstart-test-missing>\n");
+	fprintf (f, "}\n");
+	fclose (f);
+
+	TEST_TRUE (apparmor_load_needed (command));
+
+	apparmor_load_finished (command, 0);
+
+	TEST_FALSE (apparmor_load_needed (command));
+
+	/* Make sure the modification time differs */
+	sleep (1);
+
+	f = fopen (include, "a");
+	assert (f != NULL);
+	fprintf (f, "capability,\n");
+	fclose (f);
+
+	TEST_TRUE (apparmor_load_needed (command));
+
+	apparmor_load_finished (command, 0);
+
+	TEST_FALSE (apparmor_load_needed (command));
+
+	unlink (include);
+
+	TEST_TRUE (apparmor_load_needed (command));
+
+	apparmor_load_finished (command, 1);
+
+
+	/* Check that a missing profile is always loaded, so that the
+	 * parser reports it.
+	 */
+	TEST_FEATURE ("with missing profile");
+	apparmor_load_finished (command, 0);
+	unlink (filename);
+
+	TEST_TRUE (apparmor_load_needed (command));
+
+
+	/* Check that a profile named through a variable is always loaded,
+	 * since the file can't be known.
+	 */
+	TEST_FEATURE ("with variable in path");
+	{
+		nih_local char *variable = NULL;
+
+		variable = NIH_MUST (nih_sprintf (NULL, "%s %s $PROFILE",
+						  APPARMOR_PARSER,
+						  APPARMOR_PARSER_OPTS));
+
+		TEST_TRUE (apparmor_load_needed (variable));
+		apparmor_load_finished (variable, 0);
+		TEST_TRUE (apparmor_load_needed (variable));
+	}
+
+
+	/* Check that any other command is always run. */
+	TEST_FEATURE ("with other command");
+	TEST_TRUE (apparmor_load_needed ("/bin/true"));
+	apparmor_load_finished ("/bin/true", 0);
+	TEST_TRUE (apparmor_load_needed ("/bin/true"));
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	/* run tests in legacy (pre-session support) mode */
+	setenv ("UPSTART_NO_SESSIONS", "1", 1);
+
+	nih_main_init (argv[0]);
+
+	test_load_needed ();
+
+	return 0;
+}
@@ -19,7 +19,10 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <string.h>
+
 #include <nih/test.h>
+#include <nih/string.h>
 
 #include <nih-dbus/dbus_message.h>
 
@@ -359,6 +362,99 @@ test_new (void)
 	}
 }
 
+void
+test_trace_add (void)
+{
+	Blocked     *blocked;
+	BlockedSpan *span;
+	JobClass    *class;
+	Job         *job;
+	Event       *event;
+	char        *str;
+	char       **env;
+
+	TEST_FUNCTION ("blocked_trace_add");
+	event_init ();
+	blocked_trace_init ();
+
+	class = job_class_new (NULL, "test", NULL);
+	job = job_new (class, "foo");
+
+	env = nih_str_array_new (NULL);
+	assert (nih_str_array_add (&env, NULL, NULL, "JOB=test"));
+	assert (nih_str_array_add (&env, NULL, NULL, "INSTANCE=foo"));
+
+	event = event_new (NULL, "starting", env);
+	nih_discard (env);
+
+
+	/* Check that a job waiting for an event is recorded with the
+	 * names of both and the time the block began.
+	 */
+	TEST_FEATURE ("with job blocked by event");
+	blocked = blocked_new (NULL, BLOCKED_JOB, job);
+
+	blocked_trace_add (blocked, event);
+
+	TEST_LIST_NOT_EMPTY (blocked_trace);
+	span = (BlockedSpan *)blocked_trace->prev;
+
+	TEST_ALLOC_SIZE (span, sizeof (BlockedSpan));
+	TEST_ALLOC_PARENT (span, blocked_trace);
+	TEST_EQ (span->type, BLOCKED_JOB);
+	TEST_EQ_STR (span->name, "test (foo)");
+	TEST_EQ_STR (span->blocker, "starting test (foo)");
+	TEST_EQ (span->start, blocked->since);
+	TEST_GE (span->end, span->start);
+
+	nih_free (blocked);
+
+
+	/* Check that an event waiting for a job is recorded the other
+	 * way around.
+	 */
+	TEST_FEATURE ("with event blocked by job");
+	blocked = blocked_new (NULL, BLOCKED_EVENT, event);
+
+	blocked_trace_add (blocked, job);
+
+	span = (BlockedSpan *)blocked_trace->prev;
+
+	TEST_EQ (span->type, BLOCKED_EVENT);
+	TEST_EQ_STR (span->name, "starting test (foo)");
+	TEST_EQ_STR (span->blocker, "test (foo)");
+	TEST_EQ (span->start, blocked->since);
+
+	nih_free (blocked);
+
+
+	/* Check that the trace is output as Trace Event Format JSON with
+	 * a span for each block.
+	 */
+	TEST_FEATURE ("with trace output");
+	TEST_ALLOC_FAIL {
+		str = blocked_trace_to_string (NULL);
+
+		if (test_alloc_failed) {
+			if (str)
+				nih_free (str);
+			continue;
+		}
+
+		TEST_NE_P (str, NULL);
+		TEST_NE_P (strstr (str, "\"traceEvents\""), NULL);
+		TEST_NE_P (strstr (str, "\"ph\": \"X\""), NULL);
+		TEST_NE_P (strstr (str, "\"waiting\": \"test (foo)\""), NULL);
+		TEST_NE_P (strstr (str, "\"blocker\": \"starting test (foo)\""),
+			   NULL);
+
+		nih_free (str);
+	}
+
+	nih_free (event);
+	nih_free (class);
+}
+
 
 int
 main (int   argc,
@@ -368,6 +464,7 @@ main (int   argc,
 	setenv ("UPSTART_NO_SESSIONS", "1", 1);
 
 	test_new ();
+	test_trace_add ();
 
 	return 0;
 }
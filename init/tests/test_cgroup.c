@@ -23,11 +23,19 @@
 #include <nih/file.h>
 #include <nih/test.h>
 
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
+#include <signal.h>
+
 #include "cgroup.h"
+#include "errors.h"
 
 #include "test_util_common.h"
 
 extern NihHash *cgroup_paths;
+extern int cgroup_unified;
+extern const char *cgroup_unified_root;
 
 void
 test_cgroup_new (void)
@@ -243,6 +251,296 @@ test_cgroup_setting_new (void)
 	}
 }
 
+/**
+ * test_unified_file:
+ * @root: root of test hierarchy,
+ * @name: path of file below @root,
+ * @value: value to write, or NULL to remove the file.
+ *
+ * Create or remove an interface file in the test hierarchy.
+ **/
+static void
+test_unified_file (const char *root,
+		   const char *name,
+		   const char *value)
+{
+	nih_local char *path = NULL;
+	FILE           *f;
+
+	path = NIH_MUST (nih_sprintf (NULL, "%s/%s", root, name));
+
+	if (! value) {
+		assert0 (unlink (path));
+		return;
+	}
+
+	f = fopen (path, "w");
+	TEST_NE_P (f, NULL);
+	fputs (value, f);
+	assert0 (fclose (f));
+}
+
+/**
+ * test_unified_exists:
+ * @root: root of test hierarchy,
+ * @name: path below @root.
+ *
+ * Returns: TRUE if @name exists below @root, else FALSE.
+ **/
+static int
+test_unified_exists (const char *root,
+		     const char *name)
+{
+	nih_local char *path = NULL;
+
+	path = NIH_MUST (nih_sprintf (NULL, "%s/%s", root, name));
+
+	return access (path, F_OK) == 0;
+}
+
+void
+test_cgroup_unified (void)
+{
+	char               root[PATH_MAX];
+	char               path[PATH_MAX];
+	nih_local NihList *cgroups = NULL;
+	nih_local NihList *shared = NULL;
+	CGroup            *cgroup;
+	CGroupName        *cgname;
+	CGroupSetting     *setting;
+	char              *env[] = { "UPSTART_JOB=test",
+				     "UPSTART_INSTANCE=a/b",
+				     NULL };
+	struct statfs      fsbuf;
+	struct stat        statbuf;
+	struct stat        dirbuf;
+	NihError          *err;
+	FILE              *f;
+	pid_t              pid;
+	int                status;
+	int                fd;
+	int                is_unified;
+
+	TEST_FUNCTION ("cgroup_unified_available");
+
+	/* Check that whether the real hierarchy is used is decided by
+	 * the type of filesystem mounted at its root.
+	 */
+	TEST_FEATURE ("with real hierarchy");
+	is_unified = (statfs (UPSTART_CGROUP_UNIFIED_ROOT, &fsbuf) == 0
+		      && fsbuf.f_type == 0x63677270);
+
+	cgroup_unified = -1;
+	TEST_EQ (cgroup_unified_available (), is_unified);
+
+	/* Check that where the root is not a cgroup2 filesystem, the
+	 * legacy hierarchy and cgroup manager are used instead, and that
+	 * without a manager no cgroups are available.
+	 */
+	TEST_FEATURE ("with legacy hierarchy");
+	TEST_FILENAME (root);
+	assert0 (mkdir (root, 0755));
+	cgroup_unified_root = root;
+
+	cgroup_unified = -1;
+	TEST_FALSE (cgroup_unified_available ());
+	TEST_FALSE (cgroup_manager_available ());
+	TEST_FALSE (cgroup_available ());
+
+	/* Check that the answer is cached, so that once the unified
+	 * hierarchy is found it is used without looking again.
+	 */
+	TEST_FEATURE ("with unified hierarchy cached");
+	cgroup_unified = TRUE;
+	TEST_TRUE (cgroup_unified_available ());
+	TEST_TRUE (cgroup_available ());
+
+
+	TEST_FUNCTION ("cgroup_unified_setup");
+
+	/* Check that a job without cgroups is an error. */
+	TEST_FEATURE ("with no cgroups");
+	cgroups = NIH_MUST (nih_list_new (NULL));
+
+	TEST_EQ (cgroup_unified_setup (cgroups, env, geteuid (), getegid ()),
+		 -1);
+	err = nih_error_get ();
+	TEST_EQ (err->number, CGROUP_ERROR);
+	nih_free (err);
+
+	/* Check that each cgroup named is created below the root, with
+	 * slashes in the job instance remapped in $UPSTART_CGROUP, and
+	 * that the descriptor returned is of the one named last.
+	 */
+	TEST_FEATURE ("with shared and private cgroups");
+	cgroup = NIH_MUST (cgroup_new (cgroups, "memory"));
+	nih_list_add (cgroups, &cgroup->entry);
+
+	cgname = NIH_MUST (cgroup_name_new (cgroup, "foo/bar"));
+	nih_list_add (&cgroup->names, &cgname->entry);
+
+	cgname = NIH_MUST (cgroup_name_new (cgroup, "$UPSTART_CGROUP"));
+	nih_list_add (&cgroup->names, &cgname->entry);
+
+	fd = cgroup_unified_setup (cgroups, env, geteuid (), getegid ());
+	TEST_GE (fd, 0);
+
+	TEST_TRUE (test_unified_exists (root, "foo/bar"));
+
+	sprintf (path, "%s/upstart/test-a_b", root);
+	assert0 (stat (path, &statbuf));
+	TEST_TRUE (S_ISDIR (statbuf.st_mode));
+
+	assert0 (fstat (fd, &dirbuf));
+	TEST_EQ (dirbuf.st_dev, statbuf.st_dev);
+	TEST_EQ (dirbuf.st_ino, statbuf.st_ino);
+	close (fd);
+
+	/* Check that a setting for which the cgroup has no interface
+	 * file, such as one for a controller that isn't enabled, is an
+	 * error.
+	 */
+	TEST_FEATURE ("with setting for missing interface file");
+	setting = NIH_MUST (cgroup_setting_new (cgname, "max", "1"));
+	nih_list_add (&cgname->settings, &setting->entry);
+
+	TEST_EQ (cgroup_unified_setup (cgroups, env, geteuid (), getegid ()),
+		 -1);
+	err = nih_error_get ();
+	TEST_EQ (err->number, ENOENT);
+	nih_free (err);
+
+	/* Check that a setting is written to the interface file named
+	 * from the controller and key.
+	 */
+	TEST_FEATURE ("with setting");
+	test_unified_file (root, "upstart/test-a_b/memory.max", "");
+
+	fd = cgroup_unified_setup (cgroups, env, geteuid (), getegid ());
+	TEST_GE (fd, 0);
+	close (fd);
+
+	sprintf (path, "%s/upstart/test-a_b/memory.max", root);
+	f = fopen (path, "r");
+	TEST_NE_P (f, NULL);
+	TEST_FILE_EQ (f, "1");
+	TEST_FILE_END (f);
+	fclose (f);
+
+	test_unified_file (root, "upstart/test-a_b/memory.max", NULL);
+	nih_free (setting);
+
+
+	TEST_FUNCTION ("cgroup_unified_kill");
+
+	/* Check that only cgroups private to the job are signalled, so
+	 * that a job with none is an error.
+	 */
+	TEST_FEATURE ("with no private cgroups");
+	shared = NIH_MUST (nih_list_new (NULL));
+
+	cgroup = NIH_MUST (cgroup_new (shared, "memory"));
+	nih_list_add (shared, &cgroup->entry);
+
+	cgname = NIH_MUST (cgroup_name_new (cgroup, "foo/bar"));
+	nih_list_add (&cgroup->names, &cgname->entry);
+
+	TEST_FALSE (cgroup_unified_kill (shared, env, SIGTERM));
+	err = nih_error_get ();
+	TEST_EQ (err->number, CGROUP_ERROR);
+	nih_free (err);
+
+	/* Check that SIGKILL is sent through the cgroup.kill file. */
+	TEST_FEATURE ("with SIGKILL");
+	test_unified_file (root, "upstart/test-a_b/cgroup.kill", "");
+
+	TEST_TRUE (cgroup_unified_kill (cgroups, env, SIGKILL));
+
+	sprintf (path, "%s/upstart/test-a_b/cgroup.kill", root);
+	f = fopen (path, "r");
+	TEST_NE_P (f, NULL);
+	TEST_FILE_EQ (f, "1");
+	TEST_FILE_END (f);
+	fclose (f);
+
+	test_unified_file (root, "upstart/test-a_b/cgroup.kill", NULL);
+
+	/* Check that other signals are sent to each process listed in
+	 * cgroup.procs, with the cgroup frozen and thawed again.
+	 */
+	TEST_FEATURE ("with other signal");
+	TEST_CHILD (pid) {
+		pause ();
+	}
+
+	sprintf (path, "%d\n", pid);
+	test_unified_file (root, "upstart/test-a_b/cgroup.procs", path);
+	test_unified_file (root, "upstart/test-a_b/cgroup.freeze", "");
+
+	TEST_TRUE (cgroup_unified_kill (cgroups, env, SIGTERM));
+
+	TEST_EQ (waitpid (pid, &status, 0), pid);
+	TEST_TRUE (WIFSIGNALED (status));
+	TEST_EQ (WTERMSIG (status), SIGTERM);
+
+	sprintf (path, "%s/upstart/test-a_b/cgroup.freeze", root);
+	f = fopen (path, "r");
+	TEST_NE_P (f, NULL);
+	TEST_FILE_EQ (f, "0");
+	TEST_FILE_END (f);
+	fclose (f);
+
+	/* Check that without cgroup.kill or a freezer, such as on older
+	 * kernels, signalling fails rather than racing with forks.
+	 */
+	TEST_FEATURE ("with no freezer");
+	test_unified_file (root, "upstart/test-a_b/cgroup.freeze", NULL);
+
+	TEST_FALSE (cgroup_unified_kill (cgroups, env, SIGKILL));
+	err = nih_error_get ();
+	TEST_EQ (err->number, ENOENT);
+	nih_free (err);
+
+	test_unified_file (root, "upstart/test-a_b/cgroup.procs", NULL);
+
+
+	TEST_FUNCTION ("cgroup_unified_clear");
+
+	/* Check that nothing is removed for the legacy hierarchy. */
+	TEST_FEATURE ("with legacy hierarchy");
+	cgroup_unified = FALSE;
+
+	cgroup_unified_clear (cgroups, env, FALSE);
+
+	TEST_TRUE (test_unified_exists (root, "foo/bar"));
+	TEST_TRUE (test_unified_exists (root, "upstart/test-a_b"));
+
+	/* Check that empty cgroups are removed along with their empty
+	 * parents, leaving the root.
+	 */
+	TEST_FEATURE ("with empty cgroups");
+	cgroup_unified = TRUE;
+
+	cgroup_unified_clear (cgroups, env, FALSE);
+
+	TEST_FALSE (test_unified_exists (root, "foo/bar"));
+	TEST_FALSE (test_unified_exists (root, "foo"));
+	TEST_FALSE (test_unified_exists (root, "upstart/test-a_b"));
+	TEST_FALSE (test_unified_exists (root, "upstart"));
+	TEST_TRUE (test_unified_exists (root, ""));
+
+	/* Check that cgroups already gone are ignored. */
+	TEST_FEATURE ("with cgroups already removed");
+	cgroup_unified_clear (cgroups, env, FALSE);
+
+	TEST_TRUE (test_unified_exists (root, ""));
+
+	assert0 (rmdir (root));
+
+	cgroup_unified_root = UPSTART_CGROUP_UNIFIED_ROOT;
+	cgroup_unified = -1;
+}
+
 void
 test_cgroup_job_start (void)
 {
@@ -382,6 +680,7 @@ main (int   argc,
 	test_cgroup_new ();
 	test_cgroup_name_new ();
 	test_cgroup_setting_new ();
+	test_cgroup_unified ();
 	test_cgroup_job_start ();
 
 	return 0;
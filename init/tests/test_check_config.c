@@ -0,0 +1,235 @@
+/* upstart
+ *
+ * test_check_config.c - test suite for init/check_config.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <nih/test.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/hash.h>
+#include <nih/main.h>
+
+#include "job_class.h"
+#include "parse_job.h"
+#include "check_config.h"
+
+
+static JobClass *
+my_class (const char *name,
+	  const char *conf)
+{
+	JobClass *class;
+	size_t    pos = 0;
+	size_t    lineno = 1;
+
+	class = parse_job (NULL, NULL, NULL, name, conf, strlen (conf),
+			   &pos, &lineno);
+	nih_assert (class != NULL);
+
+	job_class_add_safe (class);
+
+	return class;
+}
+
+static int
+my_reachable (CheckConfig *check,
+	      const char  *name)
+{
+	CheckConfigJob *job;
+
+	job = (CheckConfigJob *)nih_hash_lookup (check->jobs, name);
+	nih_assert (job != NULL);
+
+	return job->reachable;
+}
+
+
+void
+test_new (void)
+{
+	CheckConfig *check;
+	JobClass    *classes[9];
+
+	TEST_FUNCTION ("check_config_new");
+	job_class_init ();
+
+	classes[0] = my_class ("a", "start on startup\nemits foo\n");
+	classes[1] = my_class ("b", "start on foo and started a\n");
+	classes[2] = my_class ("c", "start on bar\n");
+	classes[3] = my_class ("d", "start on started c\nemits baz\n");
+	classes[4] = my_class ("e", "start on baz or foo\n");
+	classes[5] = my_class ("f", "stop on stopped nosuch\n");
+	classes[6] = my_class ("g", "emits net-*\n");
+	classes[7] = my_class ("h", "start on net-up and started d\n");
+	classes[8] = my_class ("i", "start on started $JOB\n");
+
+	check = check_config_new (NULL);
+
+	/* Check that a job is reachable from an event the init daemon
+	 * emits, and the jobs waiting for what it emits and its job
+	 * events after it.
+	 */
+	TEST_FEATURE ("with chain from init event");
+	TEST_TRUE (my_reachable (check, "a"));
+	TEST_TRUE (my_reachable (check, "b"));
+
+
+	/* Check that a job waiting for an event nothing emits can't be
+	 * reached, and nor can those waiting for its job events or the
+	 * events it emits alone.
+	 */
+	TEST_FEATURE ("with unknown event");
+	TEST_FALSE (my_reachable (check, "c"));
+	TEST_FALSE (my_reachable (check, "d"));
+	TEST_FALSE (my_reachable (check, "h"));
+
+
+	/* Check that one reachable side of an "or" is enough. */
+	TEST_FEATURE ("with alternative");
+	TEST_TRUE (my_reachable (check, "e"));
+
+
+	/* Check that jobs without a start on condition are reachable,
+	 * as are those waiting for a job named by variable.
+	 */
+	TEST_FEATURE ("without start on");
+	TEST_TRUE (my_reachable (check, "f"));
+	TEST_TRUE (my_reachable (check, "g"));
+	TEST_TRUE (my_reachable (check, "i"));
+
+	nih_free (check);
+
+	for (int i = 0; i < 9; i++)
+		nih_free (classes[i]);
+}
+
+
+void
+test_report (void)
+{
+	CheckConfig *check;
+	JobClass    *classes[4];
+	FILE        *output;
+	int          ret;
+
+	TEST_FUNCTION ("check_config_report");
+	job_class_init ();
+	output = tmpfile ();
+
+	classes[0] = my_class ("c", "start on bar or started nosuch\n");
+	classes[1] = my_class ("d", "start on started c\nemits baz\n");
+	classes[2] = my_class ("e", "start on baz\n");
+	classes[3] = my_class ("f", "start on startup\nstop on baz\n");
+
+	check = check_config_new (NULL);
+
+	/* Check that events nothing emits and jobs that don't exist are
+	 * reported as unknown.
+	 */
+	TEST_FEATURE ("with unknown event and job");
+	TEST_DIVERT_STDOUT (output) {
+		ret = check_config_report (check, "c");
+	}
+	rewind (output);
+
+	TEST_EQ (ret, 1);
+	TEST_FILE_EQ (output, "c\n");
+	TEST_FILE_EQ (output, "  start on: unknown event bar\n");
+	TEST_FILE_EQ (output, "  start on: unknown job nosuch\n");
+	TEST_FILE_END (output);
+	TEST_FILE_RESET (output);
+
+
+	/* Check that events emitted only by jobs that can't be started
+	 * are reported as unreachable, in either condition.
+	 */
+	TEST_FEATURE ("with unreachable event");
+	TEST_DIVERT_STDOUT (output) {
+		ret = check_config_report (check, "e");
+	}
+	rewind (output);
+
+	TEST_EQ (ret, 1);
+	TEST_FILE_EQ (output, "e\n");
+	TEST_FILE_EQ (output, "  start on: unreachable event baz\n");
+	TEST_FILE_END (output);
+	TEST_FILE_RESET (output);
+
+	TEST_DIVERT_STDOUT (output) {
+		ret = check_config_report (check, "f");
+	}
+	rewind (output);
+
+	TEST_EQ (ret, 1);
+	TEST_FILE_EQ (output, "f\n");
+	TEST_FILE_EQ (output, "  stop on: unreachable event baz\n");
+	TEST_FILE_END (output);
+	TEST_FILE_RESET (output);
+
+
+	/* Check that every job is reported when no name is given. */
+	TEST_FEATURE ("with all jobs");
+	TEST_DIVERT_STDOUT (output) {
+		ret = check_config_report (check, NULL);
+	}
+	rewind (output);
+
+	TEST_EQ (ret, 4);
+	TEST_FILE_RESET (output);
+
+
+	/* Check that a job that doesn't exist is an error. */
+	TEST_FEATURE ("with unknown job class");
+	TEST_DIVERT_STDERR (output) {
+		ret = check_config_report (check, "nosuch");
+	}
+	rewind (output);
+
+	TEST_LT (ret, 0);
+	TEST_FILE_EQ (output, "test: Invalid job class: nosuch\n");
+	TEST_FILE_END (output);
+	TEST_FILE_RESET (output);
+
+	nih_free (check);
+
+	for (int i = 0; i < 4; i++)
+		nih_free (classes[i]);
+
+	fclose (output);
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	/* run tests in legacy (pre-session support) mode */
+	setenv ("UPSTART_NO_SESSIONS", "1", 1);
+
+	nih_main_init (argv[0]);
+	program_name = "test";
+
+	test_new ();
+	test_report ();
+
+	return 0;
+}
@@ -85,6 +85,7 @@ test_source_new (void)
 		TEST_EQ_P (source->watch, NULL);
 		TEST_EQ (source->flag, FALSE);
 		TEST_NE_P (source->files, NULL);
+		TEST_EQ_P (source->pending, NULL);
 
 		nih_free (source);
 	}
@@ -1094,6 +1095,69 @@ test_source_reload_job_dir (void)
 	unlink (filename);
 	rmdir (dirname);
 
+
+	/* Check that when a reload delay is set, changes to a file are
+	 * collected rather than loaded immediately, and that they are
+	 * loaded once the delay expires.
+	 */
+	TEST_FEATURE ("with reload delay");
+
+	TEST_FILENAME (dirname);
+	mkdir (dirname, 0755);
+
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+	ret = conf_source_reload (source);
+
+	TEST_EQ (ret, 0);
+	TEST_HASH_EMPTY (source->files);
+
+	conf_reload_delay = 10;
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo.conf");
+
+	f = fopen (filename, "w");
+	fprintf (f, "exec /sbin/daemon\n");
+	fclose (f);
+
+	nfds = 0;
+	FD_ZERO (&readfds);
+	FD_ZERO (&writefds);
+	FD_ZERO (&exceptfds);
+
+	nih_io_select_fds (&nfds, &readfds, &writefds, &exceptfds);
+	nih_io_handle_fds (&readfds, &writefds, &exceptfds);
+
+	TEST_HASH_EMPTY (source->files);
+	TEST_HASH_EMPTY (job_classes);
+	TEST_NE_P (source->pending, NULL);
+	TEST_HASH_NOT_EMPTY (source->pending);
+
+	nfds = 0;
+	FD_ZERO (&readfds);
+	FD_ZERO (&writefds);
+	FD_ZERO (&exceptfds);
+
+	nih_io_select_fds (&nfds, &readfds, &writefds, &exceptfds);
+	TEST_GT (select (nfds, &readfds, &writefds, &exceptfds, NULL), 0);
+	nih_io_handle_fds (&readfds, &writefds, &exceptfds);
+
+	TEST_EQ_P (source->pending, NULL);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_NE_P (file->job, NULL);
+
+	job = (JobClass *)nih_hash_lookup (job_classes, "foo");
+	TEST_EQ_P (file->job, job);
+
+	conf_reload_delay = 0;
+
+	nih_free (source);
+
+	unlink (filename);
+	rmdir (dirname);
+
 no_inotify:
 
 	/* Disable inotify for the following tests */
@@ -4641,6 +4705,27 @@ test_source_reload (void)
 
 	TEST_HASH_EMPTY (source3->files);
 
+
+	/* Check that reading the files ahead on several threads loads
+	 * the same configuration.
+	 */
+	TEST_FEATURE ("with load threads");
+	conf_load_threads = 4;
+	conf_reload ();
+	conf_load_threads = 0;
+
+	TEST_HASH_NOT_EMPTY (source1->files);
+
+	TEST_HASH_NOT_EMPTY (source2->files);
+
+	TEST_HASH_EMPTY (source3->files);
+
+	class1 = (JobClass *)nih_hash_lookup (job_classes, "bar");
+	TEST_NE_P (class1, NULL);
+	TEST_NE_P (class1->process[PROCESS_MAIN], NULL);
+	TEST_TRUE (class1->process[PROCESS_MAIN]->script);
+	TEST_EQ_STR (class1->process[PROCESS_MAIN]->command, "echo\n");
+
 	nih_free (source1);
 	nih_free (source2);
 	nih_free (source3);
@@ -4943,6 +5028,649 @@ test_source_reload (void)
 }
 
 
+void
+test_cache (void)
+{
+	ConfSource     *source;
+	JobClass       *job;
+	json_object    *json;
+	json_object    *json_process;
+	FILE           *f;
+	struct stat     statbuf;
+	struct timespec times[2];
+	char            dirname[PATH_MAX];
+	char            filename[PATH_MAX];
+	char            cachename[PATH_MAX];
+
+	TEST_FUNCTION ("conf_reload");
+	nih_log_set_priority (NIH_LOG_FATAL);
+
+	TEST_FILENAME (dirname);
+	mkdir (dirname, 0755);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo.conf");
+
+	strcpy (cachename, dirname);
+	strcat (cachename, ".cache");
+
+	conf_cache_file = cachename;
+
+	f = fopen (filename, "w");
+	fprintf (f, "exec /bin/aaa\n");
+	fclose (f);
+
+	TEST_EQ (stat (filename, &statbuf), 0);
+
+	/* Check that loading a job directory with the cache enabled
+	 * writes the compiled job to the cache file.
+	 */
+	TEST_FEATURE ("with empty configuration cache");
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+	TEST_NE_P (source, NULL);
+
+	conf_reload ();
+
+	job = (JobClass *)nih_hash_lookup (job_classes, "foo");
+	TEST_NE_P (job, NULL);
+	TEST_EQ_STR (job->process[PROCESS_MAIN]->command, "/bin/aaa");
+
+	TEST_EQ (access (cachename, R_OK), 0);
+
+	nih_free (source);
+
+	/* Check that a job whose configuration file is unchanged is loaded
+	 * from the cache rather than parsed; rewrite the file with the
+	 * same size and timestamps so that only parsing it would notice.
+	 */
+	TEST_FEATURE ("with unchanged configuration file");
+	f = fopen (filename, "r+");
+	fprintf (f, "exec /bin/bbb\n");
+	fclose (f);
+
+	times[0] = statbuf.st_atim;
+	times[1] = statbuf.st_mtim;
+	TEST_EQ (utimensat (AT_FDCWD, filename, times, 0), 0);
+
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+	TEST_NE_P (source, NULL);
+
+	conf_reload ();
+
+	job = (JobClass *)nih_hash_lookup (job_classes, "foo");
+	TEST_NE_P (job, NULL);
+	TEST_EQ_STR (job->process[PROCESS_MAIN]->command, "/bin/aaa");
+
+	nih_free (source);
+
+	/* Check that invalidating the cache causes the configuration
+	 * file to be parsed again.
+	 */
+	TEST_FEATURE ("with invalidated configuration cache");
+	conf_cache_invalidate ();
+	TEST_LT (access (cachename, F_OK), 0);
+
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+	TEST_NE_P (source, NULL);
+
+	conf_reload ();
+
+	job = (JobClass *)nih_hash_lookup (job_classes, "foo");
+	TEST_NE_P (job, NULL);
+	TEST_EQ_STR (job->process[PROCESS_MAIN]->command, "/bin/bbb");
+
+	nih_free (source);
+
+	/* Check that a changed configuration file invalidates its
+	 * cache entry.
+	 */
+	TEST_FEATURE ("with changed configuration file");
+	f = fopen (filename, "w");
+	fprintf (f, "exec /bin/cccc\n");
+	fclose (f);
+
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+	TEST_NE_P (source, NULL);
+
+	conf_reload ();
+
+	job = (JobClass *)nih_hash_lookup (job_classes, "foo");
+	TEST_NE_P (job, NULL);
+	TEST_EQ_STR (job->process[PROCESS_MAIN]->command, "/bin/cccc");
+
+	nih_free (source);
+
+	/* Check that a job kept from the serialised state keeps its cache
+	 * entry as it is, without its file being parsed again should its
+	 * definition have been dropped; rewrite the file with the same
+	 * size and timestamps so that only parsing it would notice.
+	 */
+	TEST_FEATURE ("with unloaded job kept from state");
+	TEST_EQ (stat (filename, &statbuf), 0);
+
+	f = fopen (filename, "r+");
+	fprintf (f, "exec /bin/dddd\n");
+	fclose (f);
+
+	times[0] = statbuf.st_atim;
+	times[1] = statbuf.st_mtim;
+	TEST_EQ (utimensat (AT_FDCWD, filename, times, 0), 0);
+
+	conf_lazy_load = TRUE;
+
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+	TEST_NE_P (source, NULL);
+
+	conf_reload ();
+
+	job = (JobClass *)nih_hash_lookup (job_classes, "foo");
+	TEST_NE_P (job, NULL);
+	TEST_FALSE (job->loaded);
+
+	conf_reuse_state = TRUE;
+	conf_reload ();
+	conf_reuse_state = FALSE;
+
+	TEST_EQ_P ((JobClass *)nih_hash_lookup (job_classes, "foo"), job);
+	TEST_FALSE (job->loaded);
+
+	/* Check that the unloaded job is serialised with its definition
+	 * from the cache, rather than by parsing the file again.
+	 */
+	TEST_FEATURE ("with unloaded job serialised");
+	json = job_class_serialise (job);
+	TEST_NE_P (json, NULL);
+	TEST_FALSE (job->loaded);
+
+	TEST_TRUE (json_object_object_get_ex (json, "process", &json_process));
+	json_process = json_object_array_get_idx (json_process, PROCESS_MAIN);
+	TEST_NE_P (json_process, NULL);
+	TEST_TRUE (json_object_object_get_ex (json_process, "command",
+					      &json_process));
+	TEST_EQ_STR (json_object_get_string (json_process), "/bin/cccc");
+
+	json_object_put (json);
+
+	nih_free (source);
+
+	conf_lazy_load = FALSE;
+
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+	TEST_NE_P (source, NULL);
+
+	conf_reload ();
+
+	job = (JobClass *)nih_hash_lookup (job_classes, "foo");
+	TEST_NE_P (job, NULL);
+	TEST_EQ_STR (job->process[PROCESS_MAIN]->command, "/bin/cccc");
+
+	nih_free (source);
+
+	conf_cache_file = NULL;
+
+	unlink (cachename);
+	unlink (filename);
+	rmdir (dirname);
+
+	nih_log_set_priority (NIH_LOG_MESSAGE);
+}
+
+
+void
+test_reuse_state (void)
+{
+	ConfSource     *source;
+	ConfFile       *file;
+	JobClass       *job;
+	json_object    *json;
+	FILE           *f;
+	struct stat     statbuf;
+	struct timespec times[2];
+	char            dirname[PATH_MAX];
+	char            filename[PATH_MAX];
+
+	TEST_FUNCTION ("conf_source_reload");
+	nih_log_set_priority (NIH_LOG_FATAL);
+
+	TEST_FILENAME (dirname);
+	mkdir (dirname, 0755);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo.conf");
+
+	f = fopen (filename, "w");
+	fprintf (f, "exec /bin/aaa\n");
+	fclose (f);
+
+	TEST_EQ (stat (filename, &statbuf), 0);
+
+	/* Check that a file in a job directory records the identity of
+	 * the revision its job was parsed from, and that this is passed
+	 * on in the serialised state.
+	 */
+	TEST_FEATURE ("with job parsed");
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+	TEST_NE_P (source, NULL);
+
+	TEST_EQ (conf_source_reload (source), 0);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_NE_P (file->job, NULL);
+	TEST_NE_P (file->key, NULL);
+	TEST_ALLOC_PARENT (file->key, file);
+
+	job = file->job;
+
+	json = conf_file_serialise (file);
+	TEST_NE_P (json, NULL);
+	TEST_TRUE (json_object_object_get_ex (json, "key", NULL));
+	json_object_put (json);
+
+	/* Check that when reusing the state, a job whose file is
+	 * unchanged is kept without the file being read; rewrite it with
+	 * the same size and timestamps so that only reading it would
+	 * notice.
+	 */
+	TEST_FEATURE ("with unchanged file");
+	f = fopen (filename, "r+");
+	fprintf (f, "exec /bin/bbb\n");
+	fclose (f);
+
+	times[0] = statbuf.st_atim;
+	times[1] = statbuf.st_mtim;
+	TEST_EQ (utimensat (AT_FDCWD, filename, times, 0), 0);
+
+	conf_reuse_state = TRUE;
+	TEST_EQ (conf_source_reload (source), 0);
+	conf_reuse_state = FALSE;
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_EQ_P (file->job, job);
+	TEST_EQ_STR (job->process[PROCESS_MAIN]->command, "/bin/aaa");
+
+	/* Check that without reusing the state, the file is parsed
+	 * again as normal.
+	 */
+	TEST_FEATURE ("without reusing state");
+	TEST_EQ (conf_source_reload (source), 0);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_NE_P (file->job, NULL);
+	TEST_EQ_STR (file->job->process[PROCESS_MAIN]->command, "/bin/bbb");
+
+	/* Check that a changed file is parsed again even when reusing
+	 * the state.
+	 */
+	TEST_FEATURE ("with changed file");
+	f = fopen (filename, "w");
+	fprintf (f, "exec /bin/cccc\n");
+	fclose (f);
+
+	conf_reuse_state = TRUE;
+	TEST_EQ (conf_source_reload (source), 0);
+	conf_reuse_state = FALSE;
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_NE_P (file->job, NULL);
+	TEST_EQ_STR (file->job->process[PROCESS_MAIN]->command, "/bin/cccc");
+
+	nih_free (source);
+
+	unlink (filename);
+	rmdir (dirname);
+
+	nih_log_set_priority (NIH_LOG_MESSAGE);
+}
+
+
+void
+test_lazy_load (void)
+{
+	ConfSource *source;
+	JobClass   *job;
+	FILE       *f;
+	int         ret;
+	char        dirname[PATH_MAX];
+	char        filename[PATH_MAX];
+
+	TEST_FUNCTION ("conf_file_load_job");
+	nih_log_set_priority (NIH_LOG_FATAL);
+
+	TEST_FILENAME (dirname);
+	mkdir (dirname, 0755);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo.conf");
+
+	f = fopen (filename, "w");
+	fprintf (f, "description \"a manual job\"\n");
+	fprintf (f, "env FOO=BAR\n");
+	fprintf (f, "limit nofile 10 20\n");
+	fprintf (f, "exec /bin/foo\n");
+	fclose (f);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/bar.conf");
+
+	f = fopen (filename, "w");
+	fprintf (f, "start on wibble\n");
+	fprintf (f, "exec /bin/bar\n");
+	fclose (f);
+
+	conf_lazy_load = TRUE;
+
+	/* Check that with lazy loading enabled, only the parts of a job
+	 * without a start on condition needed to run it are dropped when
+	 * it is loaded; jobs with a start on condition are loaded as
+	 * normal.
+	 */
+	TEST_FEATURE ("with lazy loading");
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+	TEST_NE_P (source, NULL);
+
+	ret = conf_source_reload (source);
+	TEST_EQ (ret, 0);
+
+	job = (JobClass *)nih_hash_lookup (job_classes, "bar");
+	TEST_NE_P (job, NULL);
+	TEST_FALSE (job->lazy);
+	TEST_NE_P (job->process[PROCESS_MAIN], NULL);
+
+	job = (JobClass *)nih_hash_lookup (job_classes, "foo");
+	TEST_NE_P (job, NULL);
+	TEST_TRUE (job->lazy);
+	TEST_FALSE (job->loaded);
+	TEST_EQ_STR (job->description, "a manual job");
+	TEST_EQ_P (job->process[PROCESS_MAIN], NULL);
+	TEST_EQ_P (job->env, NULL);
+	TEST_EQ_P (job->limits[RLIMIT_NOFILE], NULL);
+
+	/* Check that loading the job again parses the dropped parts from
+	 * its configuration file.
+	 */
+	TEST_FEATURE ("with unloaded job");
+	ret = job_class_load (job);
+	TEST_EQ (ret, 0);
+
+	TEST_TRUE (job->loaded);
+	TEST_NE_P (job->process[PROCESS_MAIN], NULL);
+	TEST_ALLOC_PARENT (job->process[PROCESS_MAIN], job->process);
+	TEST_EQ_STR (job->process[PROCESS_MAIN]->command, "/bin/foo");
+	TEST_NE_P (job->env, NULL);
+	TEST_ALLOC_PARENT (job->env, job);
+	TEST_EQ_STR (job->env[0], "FOO=BAR");
+	TEST_NE_P (job->limits[RLIMIT_NOFILE], NULL);
+	TEST_EQ (job->limits[RLIMIT_NOFILE]->rlim_cur, 10);
+	TEST_EQ (job->limits[RLIMIT_NOFILE]->rlim_max, 20);
+
+	/* Check that releasing an idle job keeps its definition loaded,
+	 * tracking it as recently used.
+	 */
+	TEST_FEATURE ("with released job");
+	job_class_release (job);
+
+	TEST_TRUE (job->loaded);
+	TEST_NE_P (job->lazy_entry, NULL);
+
+	nih_free (source);
+
+	conf_lazy_load = FALSE;
+
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo.conf");
+	unlink (filename);
+
+	rmdir (dirname);
+
+	nih_log_set_priority (NIH_LOG_MESSAGE);
+}
+
+
+
+
+void
+test_watch_sources (void)
+{
+	ConfSource *source;
+	JobClass   *job;
+	FILE       *f;
+	int         ret, fd, nfds;
+	char        dirname[PATH_MAX];
+	char        filename[PATH_MAX];
+	fd_set      readfds, writefds, exceptfds;
+
+	TEST_FUNCTION ("conf_watch_sources");
+
+	/* Make sure that we have inotify before performing the tests */
+	if ((fd = inotify_init ()) < 0) {
+		printf ("SKIP: inotify not available\n");
+		return;
+	}
+	close (fd);
+
+	nih_log_set_priority (NIH_LOG_FATAL);
+
+	TEST_FILENAME (dirname);
+	mkdir (dirname, 0755);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo.conf");
+
+	f = fopen (filename, "w");
+	fprintf (f, "exec /bin/foo\n");
+	fclose (f);
+
+	/* Check that with watches deferred, a directory is read without
+	 * being watched.
+	 */
+	TEST_FEATURE ("with deferred watch");
+	conf_watch_defer = TRUE;
+
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+	TEST_NE_P (source, NULL);
+
+	ret = conf_source_reload (source);
+	TEST_EQ (ret, 0);
+
+	TEST_EQ_P (source->watch, NULL);
+
+	job = (JobClass *)nih_hash_lookup (job_classes, "foo");
+	TEST_NE_P (job, NULL);
+
+
+	/* Check that the watch is created later without unchanged files
+	 * being parsed again, and that it then notices changes.
+	 */
+	TEST_FEATURE ("with watch created");
+	conf_watch_sources ();
+
+	TEST_FALSE (conf_watch_defer);
+	TEST_NE_P (source->watch, NULL);
+	TEST_EQ_P ((JobClass *)nih_hash_lookup (job_classes, "foo"), job);
+
+	f = fopen (filename, "w");
+	fprintf (f, "exec /bin/bar\n");
+	fclose (f);
+
+	nfds = 0;
+	FD_ZERO (&readfds);
+	FD_ZERO (&writefds);
+	FD_ZERO (&exceptfds);
+
+	nih_io_select_fds (&nfds, &readfds, &writefds, &exceptfds);
+	nih_io_handle_fds (&readfds, &writefds, &exceptfds);
+
+	job = (JobClass *)nih_hash_lookup (job_classes, "foo");
+	TEST_NE_P (job, NULL);
+	TEST_EQ_STR (job->process[PROCESS_MAIN]->command, "/bin/bar");
+
+	nih_free (source);
+
+
+	/* Check that changes made after the directory was read but before
+	 * the watch was created are picked up when it is.
+	 */
+	TEST_FEATURE ("with change before watch created");
+	conf_watch_defer = TRUE;
+
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+	TEST_NE_P (source, NULL);
+
+	ret = conf_source_reload (source);
+	TEST_EQ (ret, 0);
+
+	TEST_EQ_P (source->watch, NULL);
+
+	job = (JobClass *)nih_hash_lookup (job_classes, "foo");
+	TEST_NE_P (job, NULL);
+	TEST_EQ_STR (job->process[PROCESS_MAIN]->command, "/bin/bar");
+
+	/* Make sure the modification time differs */
+	sleep (1);
+
+	f = fopen (filename, "w");
+	fprintf (f, "exec /bin/baz\n");
+	fclose (f);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/new.conf");
+
+	f = fopen (filename, "w");
+	fprintf (f, "exec /bin/new\n");
+	fclose (f);
+
+	conf_watch_sources ();
+
+	TEST_NE_P (source->watch, NULL);
+
+	job = (JobClass *)nih_hash_lookup (job_classes, "foo");
+	TEST_NE_P (job, NULL);
+	TEST_EQ_STR (job->process[PROCESS_MAIN]->command, "/bin/baz");
+
+	job = (JobClass *)nih_hash_lookup (job_classes, "new");
+	TEST_NE_P (job, NULL);
+	TEST_EQ_STR (job->process[PROCESS_MAIN]->command, "/bin/new");
+
+	nih_free (source);
+
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo.conf");
+
+	unlink (filename);
+	rmdir (dirname);
+
+	nih_log_set_priority (NIH_LOG_MESSAGE);
+}
+void
+test_staged_load (void)
+{
+	ConfSource *source;
+	FILE       *f;
+	char        dirname[PATH_MAX];
+	char        filename[PATH_MAX];
+
+	TEST_FUNCTION ("conf_staged_load");
+
+	nih_log_set_priority (NIH_LOG_FATAL);
+
+	TEST_FILENAME (dirname);
+	mkdir (dirname, 0755);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo.conf");
+
+	f = fopen (filename, "w");
+	fprintf (f, "start on startup\n");
+	fprintf (f, "exec /bin/foo\n");
+	fclose (f);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/bar.conf");
+
+	f = fopen (filename, "w");
+	fprintf (f, "start on (started foo)\n");
+	fprintf (f, "exec /bin/bar\n");
+	fclose (f);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/baz.conf");
+
+	f = fopen (filename, "w");
+	fprintf (f, "# not started by startup\n");
+	fprintf (f, "start on runlevel [2345]\n");
+	fprintf (f, "exec /bin/baz\n");
+	fclose (f);
+
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+	TEST_NE_P (source, NULL);
+
+	/* Check that a staged reload only loads the jobs that mention
+	 * the event in their configuration, ignoring comments, and that
+	 * events the others mention would be held for them.
+	 */
+	TEST_FEATURE ("with staged reload");
+	conf_watch_defer = TRUE;
+	conf_staged_event = "startup";
+
+	conf_reload ();
+
+	conf_staged_event = NULL;
+
+	TEST_NE_P (nih_hash_lookup (job_classes, "foo"), NULL);
+	TEST_EQ_P (nih_hash_lookup (job_classes, "bar"), NULL);
+	TEST_EQ_P (nih_hash_lookup (job_classes, "baz"), NULL);
+
+	TEST_TRUE (conf_staged_wants ("started"));
+	TEST_FALSE (conf_staged_wants ("stopped"));
+	TEST_FALSE (conf_staged_wants ("startup"));
+
+
+	/* Check that the files wanted by a held event are loaded first. */
+	TEST_FEATURE ("with held event");
+	TEST_TRUE (conf_staged_wants ("runlevel"));
+
+	TEST_EQ (conf_staged_load (1), 1);
+
+	TEST_EQ_P (nih_hash_lookup (job_classes, "bar"), NULL);
+	TEST_NE_P (nih_hash_lookup (job_classes, "baz"), NULL);
+
+
+	/* Check that the rest are loaded when no limit is given, after
+	 * which no event is held.
+	 */
+	TEST_FEATURE ("with remaining files");
+	TEST_EQ (conf_staged_load (0), 0);
+
+	TEST_NE_P (nih_hash_lookup (job_classes, "bar"), NULL);
+	TEST_FALSE (conf_staged_wants ("started"));
+
+	conf_watch_defer = FALSE;
+
+	nih_free (source);
+
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/bar.conf");
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo.conf");
+	unlink (filename);
+
+	rmdir (dirname);
+
+	nih_log_set_priority (NIH_LOG_MESSAGE);
+}
+
 void
 test_file_destroy (void)
 {
@@ -4961,6 +5689,7 @@ test_file_destroy (void)
 	TEST_FEATURE ("with not-current job");
 	file = conf_file_new (source, "/path/to/file");
 	job = file->job = job_class_new (NULL, "foo", NULL);
+	conf_file_index (file);
 
 	other = job_class_new (NULL, "foo", NULL);
 	nih_hash_add (job_classes, &other->entry);
@@ -4983,6 +5712,7 @@ test_file_destroy (void)
 	TEST_FEATURE ("with stopped job");
 	file = conf_file_new (source, "/path/to/file");
 	job = file->job = job_class_new (NULL, "foo", NULL);
+	conf_file_index (file);
 
 	nih_hash_add (job_classes, &job->entry);
 
@@ -5003,6 +5733,7 @@ test_file_destroy (void)
 	TEST_FEATURE ("with running job");
 	file = conf_file_new (source, "/path/to/file");
 	job = file->job = job_class_new (NULL, "foo", NULL);
+	conf_file_index (file);
 
 	nih_hash_add (job_classes, &job->entry);
 
@@ -5034,11 +5765,10 @@ test_select_job (void)
 {
 	ConfSource *source1, *source2, *source3;
 	ConfFile   *file1, *file3, *file4, *file5;
-	JobClass   *class1, *class2, *class4, *ptr;
+	JobClass   *class1, *class2, *class3, *class4, *ptr;
 
 	/* keep gcc 4.6 happy */
 	ConfFile   *file2  __attribute__((__unused__));
-	JobClass   *class3 __attribute__((__unused__));
 
 	TEST_FUNCTION ("conf_select_job");
 	source1 = conf_source_new (NULL, "/tmp/foo", CONF_DIR);
@@ -5047,19 +5777,23 @@ test_select_job (void)
 
 	file1 = conf_file_new (source2, "/tmp/bar/frodo");
 	class1 = file1->job = job_class_new (NULL, "frodo", NULL);
+	conf_file_index (file1);
 
 	file2 = conf_file_new (source2, "/tmp/bar/bilbo");
 
 	file3 = conf_file_new (source2, "/tmp/bar/drogo");
 	class2 = file3->job = job_class_new (NULL, "drogo", NULL);
+	conf_file_index (file3);
 
 	source3 = conf_source_new (NULL, "/tmp/baz", CONF_JOB_DIR);
 
 	file4 = conf_file_new (source3, "/tmp/baz/frodo");
 	class3 = file4->job = job_class_new (NULL, "frodo", NULL);
+	conf_file_index (file4);
 
 	file5 = conf_file_new (source2, "/tmp/bar/bilbo");
 	class4 = file5->job = job_class_new (NULL, "bilbo", NULL);
+	conf_file_index (file5);
 
 
 	/* Check that a job with only one file is returned.
@@ -5095,6 +5829,25 @@ test_select_job (void)
 	TEST_EQ_P (ptr, NULL);
 
 
+	/* Check that indexed files are selected in the order of their
+	 * sources whatever the order they were indexed in, and that a
+	 * file removed from its source is no longer selected.
+	 */
+	TEST_FEATURE ("with indexed files");
+	conf_file_index (file4);
+	conf_file_index (file1);
+
+	ptr = conf_select_job ("frodo", NULL);
+
+	TEST_EQ_P (ptr, class1);
+
+	nih_list_remove (&file1->entry);
+
+	ptr = conf_select_job ("frodo", NULL);
+
+	TEST_EQ_P (ptr, class3);
+
+
 	nih_free (source3);
 	nih_free (source2);
 	nih_free (source1);
@@ -5115,6 +5868,11 @@ main (int   argc,
 	test_source_reload_file ();
 	test_source_reload ();
 	test_override ();
+	test_cache ();
+	test_reuse_state ();
+	test_lazy_load ();
+	test_watch_sources ();
+	test_staged_load ();
 	test_file_destroy ();
 	test_select_job ();
 
@@ -55,6 +55,8 @@
 #include "dbus/upstart.h"
 
 #include "blocked.h"
+#include "event.h"
+#include "event_limit.h"
 #include "job_class.h"
 #include "job.h"
 #include "conf.h"
@@ -305,21 +307,18 @@ test_server_connect (void)
 	TEST_EQ_STR (object->path, DBUS_PATH_UPSTART "/jobs/bar");
 	TEST_EQ_P (object->data, class2);
 
+	/* Instances are reached through the fallback for their paths,
+	 * rather than objects of their own.
+	 */
 	TEST_TRUE (dbus_connection_get_object_path_data (conn,
 							 DBUS_PATH_UPSTART "/jobs/bar/test1",
 							 (void **)&object));
-
-	TEST_ALLOC_SIZE (object, sizeof (NihDBusObject));
-	TEST_EQ_STR (object->path, DBUS_PATH_UPSTART "/jobs/bar/test1");
-	TEST_EQ_P (object->data, job1);
+	TEST_EQ_P (object, NULL);
 
 	TEST_TRUE (dbus_connection_get_object_path_data (conn,
 							 DBUS_PATH_UPSTART "/jobs/bar/test2",
 							 (void **)&object));
-
-	TEST_ALLOC_SIZE (object, sizeof (NihDBusObject));
-	TEST_EQ_STR (object->path, DBUS_PATH_UPSTART "/jobs/bar/test2");
-	TEST_EQ_P (object->data, job2);
+	TEST_EQ_P (object, NULL);
 
 	kill (pid, SIGTERM);
 	waitpid (pid, &status, 0);
@@ -607,21 +606,18 @@ test_bus_open (void)
 	TEST_EQ_STR (object->path, DBUS_PATH_UPSTART "/jobs/bar");
 	TEST_EQ_P (object->data, class2);
 
+	/* Instances are reached through the fallback for their paths,
+	 * rather than objects of their own.
+	 */
 	TEST_TRUE (dbus_connection_get_object_path_data (control_bus,
 							 DBUS_PATH_UPSTART "/jobs/bar/test1",
 							 (void **)&object));
-
-	TEST_ALLOC_SIZE (object, sizeof (NihDBusObject));
-	TEST_EQ_STR (object->path, DBUS_PATH_UPSTART "/jobs/bar/test1");
-	TEST_EQ_P (object->data, job1);
+	TEST_EQ_P (object, NULL);
 
 	TEST_TRUE (dbus_connection_get_object_path_data (control_bus,
 							 DBUS_PATH_UPSTART "/jobs/bar/test2",
 							 (void **)&object));
-
-	TEST_ALLOC_SIZE (object, sizeof (NihDBusObject));
-	TEST_EQ_STR (object->path, DBUS_PATH_UPSTART "/jobs/bar/test2");
-	TEST_EQ_P (object->data, job2);
+	TEST_EQ_P (object, NULL);
 
 	kill (pid, SIGTERM);
 	waitpid (pid, &status, 0);
@@ -1201,61 +1197,49 @@ test_get_all_jobs (void)
 }
 
 void
-test_emit_event (void)
+test_get_all_job_states (void)
 {
-	DBusConnection  *conn, *client_conn;
-	pid_t            dbus_pid;
-	DBusMessage     *method, *reply;
-	NihDBusMessage  *message = NULL;
-	dbus_uint32_t    serial;
-	char           **env;
-	int              ret;
-	Event           *event;
-	Blocked *        blocked;
-	NihError        *error;
-	NihDBusError    *dbus_error;
-
-	TEST_FUNCTION ("control_emit_event");
+	NihDBusMessage                       *message = NULL;
+	JobClass                             *class1, *class2;
+	Job                                  *job;
+	NihError                             *error;
+	ControlGetAllJobStatesStatesElement **states;
+	int                                   ret;
+
+	TEST_FUNCTION ("control_get_all_job_states");
 	nih_error_init ();
-	nih_main_loop_init ();
-	event_init ();
+	job_class_init ();
 
-	TEST_DBUS (dbus_pid);
-	TEST_DBUS_OPEN (conn);
-	TEST_DBUS_OPEN (client_conn);
+	class1 = job_class_new (NULL, "frodo", NULL);
+	nih_hash_add (job_classes, &class1->entry);
 
+	class2 = job_class_new (NULL, "bilbo", NULL);
+	nih_hash_add (job_classes, &class2->entry);
 
-	/* Check that we can emit an event with an empty environment list
-	 * which will be added to the event queue while the message is
-	 * blocked.  When the event is finished, the reply will be sent
-	 * and the message structure freed.
-	 */
-	TEST_FEATURE ("with empty environment list");
-	TEST_ALLOC_FAIL {
-		method = dbus_message_new_method_call (
-			dbus_bus_get_unique_name (conn),
-			DBUS_PATH_UPSTART,
-			DBUS_INTERFACE_UPSTART,
-			"EmitEvent");
+	job = job_new (class2, "");
+	job->goal = JOB_STOP;
+	job->state = JOB_PRE_STOP;
+	job->pid[PROCESS_MAIN] = 1000;
+	job->pid[PROCESS_PRE_STOP] = 1001;
 
-		dbus_connection_send (client_conn, method, &serial);
-		dbus_connection_flush (client_conn);
-		dbus_message_unref (method);
 
-		TEST_DBUS_MESSAGE (conn, method);
-		assert (dbus_message_get_serial (method) == serial);
+	/* Check that an entry for each instance is returned in an array
+	 * allocated as a child of the message structure, with the goal,
+	 * state and running processes of the instance, and that a job
+	 * without instances has a stopped entry with an empty name.
+	 */
+	TEST_FEATURE ("with registered jobs");
+	TEST_ALLOC_FAIL {
+		ControlGetAllJobStatesStatesElement *frodo = NULL;
+		ControlGetAllJobStatesStatesElement *bilbo = NULL;
 
 		TEST_ALLOC_SAFE {
 			message = nih_new (NULL, NihDBusMessage);
-			message->connection = conn;
-			message->message = method;
-
-			TEST_FREE_TAG (message);
-
-			env = nih_str_array_new (message);
+			message->connection = NULL;
+			message->message = NULL;
 		}
 
-		ret = control_emit_event (NULL, message, "test", env, TRUE);
+		ret = control_get_all_job_states (NULL, message, "", &states);
 
 		if (test_alloc_failed) {
 			TEST_LT (ret, 0);
@@ -1265,89 +1249,95 @@ test_emit_event (void)
 			nih_free (error);
 
 			nih_free (message);
-			dbus_message_unref (method);
+
 			continue;
 		}
 
 		TEST_EQ (ret, 0);
 
-		TEST_LIST_NOT_EMPTY (events);
-
-		event = (Event *)events->next;
-		TEST_ALLOC_SIZE (event, sizeof (Event));
-		TEST_EQ_STR (event->name, "test");
-		TEST_EQ_P (event->env[0], NULL);
-
-		TEST_LIST_NOT_EMPTY (&event->blocking);
+		TEST_ALLOC_PARENT (states, message);
+		TEST_ALLOC_SIZE (states, sizeof (ControlGetAllJobStatesStatesElement *) * 3);
+		TEST_EQ_P (states[2], NULL);
 
-		blocked = (Blocked *)event->blocking.next;
-		TEST_ALLOC_SIZE (blocked, sizeof (Blocked));
-		TEST_ALLOC_PARENT (blocked, event);
-		TEST_EQ (blocked->type, BLOCKED_EMIT_METHOD);
-		TEST_EQ_P (blocked->message, message);
+		for (int i = 0; i < 2; i++) {
+			if (! strcmp (states[i]->item0, "frodo"))
+				frodo = states[i];
+			if (! strcmp (states[i]->item0, "bilbo"))
+				bilbo = states[i];
+		}
 
-		TEST_ALLOC_PARENT (blocked->message, blocked);
+		TEST_NE_P (frodo, NULL);
+		TEST_EQ_STR (frodo->item1, "");
+		TEST_EQ_STR (frodo->item2, "stop");
+		TEST_EQ_STR (frodo->item3, "waiting");
+		TEST_EQ_P (frodo->item4[0], NULL);
+		TEST_EQ (frodo->item5_len, 0);
+
+		TEST_NE_P (bilbo, NULL);
+		TEST_EQ_STR (bilbo->item1, "");
+		TEST_EQ_STR (bilbo->item2, "stop");
+		TEST_EQ_STR (bilbo->item3, "pre-stop");
+		TEST_EQ_STR (bilbo->item4[0], "main");
+		TEST_EQ_STR (bilbo->item4[1], "pre-stop");
+		TEST_EQ_P (bilbo->item4[2], NULL);
+		TEST_EQ (bilbo->item5_len, 2);
+		TEST_EQ (bilbo->item5[0], 1000);
+		TEST_EQ (bilbo->item5[1], 1001);
 
-		TEST_FREE_TAG (blocked);
+		nih_free (message);
+	}
 
-		nih_discard (message);
-		TEST_NOT_FREE (message);
 
+	/* Check that only jobs whose names match the pattern are
+	 * returned.
+	 */
+	TEST_FEATURE ("with pattern");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			message = nih_new (NULL, NihDBusMessage);
+			message->connection = NULL;
+			message->message = NULL;
+		}
 
-		event_poll ();
+		ret = control_get_all_job_states (NULL, message, "fro*", &states);
 
-		TEST_LIST_EMPTY (events);
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
 
-		TEST_FREE (blocked);
+			error = nih_error_get ();
+			TEST_EQ (error->number, ENOMEM);
+			nih_free (error);
 
-		TEST_FREE (message);
-		dbus_message_unref (method);
+			nih_free (message);
 
-		dbus_connection_flush (conn);
+			continue;
+		}
 
-		TEST_DBUS_MESSAGE (client_conn, reply);
+		TEST_EQ (ret, 0);
 
-		TEST_EQ (dbus_message_get_type (reply),
-			 DBUS_MESSAGE_TYPE_METHOD_RETURN);
-		TEST_EQ (dbus_message_get_reply_serial (reply), serial);
+		TEST_ALLOC_SIZE (states, sizeof (ControlGetAllJobStatesStatesElement *) * 2);
+		TEST_EQ_STR (states[0]->item0, "frodo");
+		TEST_EQ_P (states[1], NULL);
 
-		dbus_message_unref (reply);
+		nih_free (message);
 	}
 
+	nih_free (class2);
+	nih_free (class1);
 
-	/* Check that if we supply an environment list, it's placed straight
-	 * into the event.
+
+	/* Check that when no jobs are registered, an empty array is
+	 * returned instead of an error.
 	 */
-	TEST_FEATURE ("with environment list");
+	TEST_FEATURE ("with no registered jobs");
 	TEST_ALLOC_FAIL {
-		method = dbus_message_new_method_call (
-			dbus_bus_get_unique_name (conn),
-			DBUS_PATH_UPSTART,
-			DBUS_INTERFACE_UPSTART,
-			"EmitEvent");
-
-		dbus_connection_send (client_conn, method, &serial);
-		dbus_connection_flush (client_conn);
-		dbus_message_unref (method);
-
-		TEST_DBUS_MESSAGE (conn, method);
-		assert (dbus_message_get_serial (method) == serial);
-
 		TEST_ALLOC_SAFE {
 			message = nih_new (NULL, NihDBusMessage);
-			message->connection = conn;
-			message->message = method;
-
-			TEST_FREE_TAG (message);
-
-			env = nih_str_array_new (message);
-			assert (nih_str_array_add (&env, message, NULL,
-						   "FOO=BAR"));
-			assert (nih_str_array_add (&env, message, NULL,
-						   "BAR=BAZ"));
+			message->connection = NULL;
+			message->message = NULL;
 		}
 
-		ret = control_emit_event (NULL, message, "test", env, TRUE);
+		ret = control_get_all_job_states (NULL, message, "", &states);
 
 		if (test_alloc_failed) {
 			TEST_LT (ret, 0);
@@ -1357,87 +1347,116 @@ test_emit_event (void)
 			nih_free (error);
 
 			nih_free (message);
-			dbus_message_unref (method);
+
 			continue;
 		}
 
 		TEST_EQ (ret, 0);
 
-		TEST_LIST_NOT_EMPTY (events);
+		TEST_ALLOC_PARENT (states, message);
+		TEST_ALLOC_SIZE (states, sizeof (ControlGetAllJobStatesStatesElement *) * 1);
+		TEST_EQ_P (states[0], NULL);
 
-		event = (Event *)events->next;
-		TEST_ALLOC_SIZE (event, sizeof (Event));
-		TEST_EQ_STR (event->name, "test");
-		TEST_EQ_STR (event->env[0], "FOO=BAR");
-		TEST_EQ_STR (event->env[1], "BAR=BAZ");
-		TEST_EQ_P (event->env[2], NULL);
+		nih_free (message);
+	}
+}
 
-		TEST_LIST_NOT_EMPTY (&event->blocking);
+void
+test_get_job_event_names (void)
+{
+	NihDBusMessage *message = NULL;
+	JobClass       *class1, *class2;
+	EventOperator  *oper;
+	NihError       *error;
+	char          **names;
+	int             ret;
 
-		blocked = (Blocked *)event->blocking.next;
-		TEST_ALLOC_SIZE (blocked, sizeof (Blocked));
-		TEST_ALLOC_PARENT (blocked, event);
-		TEST_EQ (blocked->type, BLOCKED_EMIT_METHOD);
-		TEST_EQ_P (blocked->message, message);
+	TEST_FUNCTION ("control_get_job_event_names");
+	nih_error_init ();
+	job_class_init ();
 
-		TEST_ALLOC_PARENT (blocked->message, blocked);
+	class1 = job_class_new (NULL, "frodo", NULL);
+	class1->start_on = event_operator_new (class1, EVENT_MATCH,
+					       ":sys:startup", NULL);
+	class1->stop_on = event_operator_new (class1, EVENT_MATCH,
+					      "runlevel", NULL);
+	job_class_add_safe (class1);
 
-		TEST_FREE_TAG (blocked);
+	class2 = job_class_new (NULL, "bilbo", NULL);
+	class2->start_on = event_operator_new (class2, EVENT_OR, NULL, NULL);
 
-		nih_discard (message);
-		TEST_NOT_FREE (message);
+	oper = event_operator_new (class2, EVENT_MATCH, ":sys:startup", NULL);
+	nih_tree_add (&class2->start_on->node, &oper->node, NIH_TREE_LEFT);
 
+	oper = event_operator_new (class2, EVENT_MATCH, "login", NULL);
+	nih_tree_add (&class2->start_on->node, &oper->node, NIH_TREE_RIGHT);
 
-		event_poll ();
+	job_class_add_safe (class2);
 
-		TEST_LIST_EMPTY (events);
 
-		TEST_FREE (blocked);
+	/* Check that the name of each event in the conditions of the
+	 * registered jobs is returned once, in an array allocated as a
+	 * child of the message structure.
+	 */
+	TEST_FEATURE ("with registered jobs");
+	TEST_ALLOC_FAIL {
+		int startup = 0, runlevel = 0, login = 0;
 
-		TEST_FREE (message);
-		dbus_message_unref (method);
+		TEST_ALLOC_SAFE {
+			message = nih_new (NULL, NihDBusMessage);
+			message->connection = NULL;
+			message->message = NULL;
+		}
 
-		dbus_connection_flush (conn);
+		ret = control_get_job_event_names (NULL, message, "", &names);
 
-		TEST_DBUS_MESSAGE (client_conn, reply);
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
 
-		TEST_EQ (dbus_message_get_type (reply),
-			 DBUS_MESSAGE_TYPE_METHOD_RETURN);
-		TEST_EQ (dbus_message_get_reply_serial (reply), serial);
+			error = nih_error_get ();
+			TEST_EQ (error->number, ENOMEM);
+			nih_free (error);
 
-		dbus_message_unref (reply);
-	}
+			nih_free (message);
 
+			continue;
+		}
 
-	/* Check that we can emit an event without waiting for it to
-	 * finish, we should get the reply straight away.
-	 */
-	TEST_FEATURE ("with no wait");
-	TEST_ALLOC_FAIL {
-		method = dbus_message_new_method_call (
-			dbus_bus_get_unique_name (conn),
-			DBUS_PATH_UPSTART,
-			DBUS_INTERFACE_UPSTART,
-			"EmitEvent");
+		TEST_EQ (ret, 0);
 
-		dbus_connection_send (client_conn, method, &serial);
-		dbus_connection_flush (client_conn);
-		dbus_message_unref (method);
+		TEST_ALLOC_PARENT (names, message);
+		TEST_ALLOC_SIZE (names, sizeof (char *) * 4);
+		TEST_EQ_P (names[3], NULL);
+
+		for (int i = 0; i < 3; i++) {
+			if (! strcmp (names[i], ":sys:startup"))
+				startup++;
+			if (! strcmp (names[i], "runlevel"))
+				runlevel++;
+			if (! strcmp (names[i], "login"))
+				login++;
+		}
 
-		TEST_DBUS_MESSAGE (conn, method);
-		assert (dbus_message_get_serial (method) == serial);
+		TEST_EQ (startup, 1);
+		TEST_EQ (runlevel, 1);
+		TEST_EQ (login, 1);
 
-		TEST_ALLOC_SAFE {
-			message = nih_new (NULL, NihDBusMessage);
-			message->connection = conn;
-			message->message = method;
+		nih_free (message);
+	}
 
-			TEST_FREE_TAG (message);
 
-			env = nih_str_array_new (message);
+	/* Check that only the names of events that match the pattern
+	 * are returned.
+	 */
+	TEST_FEATURE ("with pattern");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			message = nih_new (NULL, NihDBusMessage);
+			message->connection = NULL;
+			message->message = NULL;
 		}
 
-		ret = control_emit_event (NULL, message, "test", env, FALSE);
+		ret = control_get_job_event_names (NULL, message, ":sys:*", &names);
 
 		if (test_alloc_failed) {
 			TEST_LT (ret, 0);
@@ -1447,24 +1466,796 @@ test_emit_event (void)
 			nih_free (error);
 
 			nih_free (message);
-			dbus_message_unref (method);
+
 			continue;
 		}
 
 		TEST_EQ (ret, 0);
 
-		TEST_LIST_NOT_EMPTY (events);
+		TEST_EQ_STR (names[0], ":sys:startup");
+		TEST_EQ_P (names[1], NULL);
 
-		event = (Event *)events->next;
-		TEST_ALLOC_SIZE (event, sizeof (Event));
-		TEST_EQ_STR (event->name, "test");
-		TEST_EQ_P (event->env[0], NULL);
+		nih_free (message);
+	}
 
-		TEST_LIST_EMPTY (&event->blocking);
+	nih_free (class2);
+	nih_free (class1);
+}
 
-		nih_discard (message);
-		TEST_FREE (message);
-		dbus_message_unref (method);
+void
+test_get_condition_graph (void)
+{
+	NihDBusMessage                          *message = NULL;
+	JobClass                                *class;
+	Job                                     *job;
+	Event                                   *event1, *event2;
+	Blocked                                 *blocked;
+	EventOperator                           *oper;
+	NihError                                *error;
+	ControlGetConditionGraphJobsElement    **jobs;
+	ControlGetConditionGraphBlockedElement **edges;
+	int                                      ret;
+
+	TEST_FUNCTION ("control_get_condition_graph");
+	nih_error_init ();
+	job_class_init ();
+	event_init ();
+
+	class = job_class_new (NULL, "frodo", NULL);
+	class->start_on = event_operator_new (class, EVENT_AND, NULL, NULL);
+
+	oper = event_operator_new (class, EVENT_MATCH, "wibble", NULL);
+	nih_tree_add (&class->start_on->node, &oper->node, NIH_TREE_LEFT);
+
+	oper = event_operator_new (class, EVENT_MATCH, "wobble", NULL);
+	NIH_MUST (nih_str_array_add (&oper->env, oper, NULL, "FOO=BAR"));
+	nih_tree_add (&class->start_on->node, &oper->node, NIH_TREE_RIGHT);
+
+	class->emits = nih_str_array_new (class);
+	NIH_MUST (nih_str_array_add (&class->emits, class, NULL, "ring"));
+
+	job_class_add_safe (class);
+
+	job = job_new (class, "foo");
+
+	event1 = event_new (NULL, "wibble", NULL);
+	blocked = blocked_new (event1, BLOCKED_JOB, job);
+	nih_list_add (&event1->blocking, &blocked->entry);
+
+	event2 = event_new (NULL, "stopping", NULL);
+	job->blocker = event2;
+
+
+	/* Check that the conditions and emits of each job are returned,
+	 * with the conditions flattened as for the start_on property, and
+	 * that no edges are returned without runtime.
+	 */
+	TEST_FEATURE ("without runtime");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			message = nih_new (NULL, NihDBusMessage);
+			message->connection = NULL;
+			message->message = NULL;
+		}
+
+		ret = control_get_condition_graph (NULL, message, FALSE,
+						   &jobs, &edges);
+
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
+
+			error = nih_error_get ();
+			TEST_EQ (error->number, ENOMEM);
+			nih_free (error);
+
+			nih_free (message);
+
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_ALLOC_PARENT (jobs, message);
+		TEST_NE_P (jobs[0], NULL);
+		TEST_EQ_P (jobs[1], NULL);
+
+		TEST_EQ_STR (jobs[0]->item0, "frodo");
+
+		TEST_EQ_STR (jobs[0]->item1[0][0], "wibble");
+		TEST_EQ_P (jobs[0]->item1[0][1], NULL);
+		TEST_EQ_STR (jobs[0]->item1[1][0], "wobble");
+		TEST_EQ_STR (jobs[0]->item1[1][1], "FOO=BAR");
+		TEST_EQ_P (jobs[0]->item1[1][2], NULL);
+		TEST_EQ_STR (jobs[0]->item1[2][0], "/AND");
+		TEST_EQ_P (jobs[0]->item1[3], NULL);
+
+		TEST_EQ_P (jobs[0]->item2[0], NULL);
+
+		TEST_EQ_STR (jobs[0]->item3[0], "ring");
+		TEST_EQ_P (jobs[0]->item3[1], NULL);
+
+		TEST_ALLOC_PARENT (edges, message);
+		TEST_EQ_P (edges[0], NULL);
+
+		nih_free (message);
+	}
+
+
+	/* Check that with runtime, the event waiting for the job and the
+	 * job waiting for the event are both returned as edges.
+	 */
+	TEST_FEATURE ("with runtime");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			message = nih_new (NULL, NihDBusMessage);
+			message->connection = NULL;
+			message->message = NULL;
+		}
+
+		ret = control_get_condition_graph (NULL, message, TRUE,
+						   &jobs, &edges);
+
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
+
+			error = nih_error_get ();
+			TEST_EQ (error->number, ENOMEM);
+			nih_free (error);
+
+			nih_free (message);
+
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_NE_P (edges[0], NULL);
+		TEST_NE_P (edges[1], NULL);
+		TEST_EQ_P (edges[2], NULL);
+
+		TEST_EQ_STR (edges[0]->item0, "wibble");
+		TEST_EQ_STR (edges[0]->item1, "frodo");
+		TEST_EQ_STR (edges[0]->item2, "foo");
+		TEST_EQ_STR (edges[0]->item3, "event");
+
+		TEST_EQ_STR (edges[1]->item0, "stopping");
+		TEST_EQ_STR (edges[1]->item1, "frodo");
+		TEST_EQ_STR (edges[1]->item2, "foo");
+		TEST_EQ_STR (edges[1]->item3, "job");
+
+		nih_free (message);
+	}
+
+	job->blocker = NULL;
+	nih_free (event2);
+	nih_free (event1);
+	nih_free (class);
+}
+
+void
+test_get_all_job_conditions (void)
+{
+	NihDBusMessage                         *message = NULL;
+	JobClass                               *class;
+	EventOperator                          *oper;
+	NihError                               *error;
+	ControlGetAllJobConditionsJobsElement **jobs;
+	int                                     ret;
+
+	TEST_FUNCTION ("control_get_all_job_conditions");
+	nih_error_init ();
+	job_class_init ();
+
+	class = job_class_new (NULL, "frodo", NULL);
+	class->start_on = event_operator_new (class, EVENT_OR, NULL, NULL);
+
+	oper = event_operator_new (class, EVENT_MATCH, "wibble", NULL);
+	nih_tree_add (&class->start_on->node, &oper->node, NIH_TREE_LEFT);
+
+	oper = event_operator_new (class, EVENT_MATCH, "wobble", NULL);
+	NIH_MUST (nih_str_array_add (&oper->env, oper, NULL, "FOO=BAR"));
+	nih_tree_add (&class->start_on->node, &oper->node, NIH_TREE_RIGHT);
+
+	class->stop_on = event_operator_new (class, EVENT_MATCH, "runlevel",
+					     NULL);
+
+	job_class_add_safe (class);
+
+
+	/* Check that the path of each job is returned with its conditions
+	 * flattened as for the start_on and stop_on properties.
+	 */
+	TEST_FEATURE ("with job");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			message = nih_new (NULL, NihDBusMessage);
+			message->connection = NULL;
+			message->message = NULL;
+		}
+
+		ret = control_get_all_job_conditions (NULL, message, &jobs);
+
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
+
+			error = nih_error_get ();
+			TEST_EQ (error->number, ENOMEM);
+			nih_free (error);
+
+			nih_free (message);
+
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_ALLOC_PARENT (jobs, message);
+		TEST_NE_P (jobs[0], NULL);
+		TEST_EQ_P (jobs[1], NULL);
+
+		TEST_EQ_STR (jobs[0]->item0, class->path);
+
+		TEST_EQ_STR (jobs[0]->item1[0][0], "wibble");
+		TEST_EQ_P (jobs[0]->item1[0][1], NULL);
+		TEST_EQ_STR (jobs[0]->item1[1][0], "wobble");
+		TEST_EQ_STR (jobs[0]->item1[1][1], "FOO=BAR");
+		TEST_EQ_P (jobs[0]->item1[1][2], NULL);
+		TEST_EQ_STR (jobs[0]->item1[2][0], "/OR");
+		TEST_EQ_P (jobs[0]->item1[3], NULL);
+
+		TEST_EQ_STR (jobs[0]->item2[0][0], "runlevel");
+		TEST_EQ_P (jobs[0]->item2[0][1], NULL);
+		TEST_EQ_P (jobs[0]->item2[1], NULL);
+
+		nih_free (message);
+	}
+
+	nih_free (class);
+}
+
+void
+test_emit_event (void)
+{
+	DBusConnection  *conn, *client_conn;
+	pid_t            dbus_pid;
+	DBusMessage     *method, *reply;
+	NihDBusMessage  *message = NULL;
+	dbus_uint32_t    serial;
+	char           **env;
+	int              ret;
+	Event           *event;
+	Blocked *        blocked;
+	NihError        *error;
+	NihDBusError    *dbus_error;
+
+	TEST_FUNCTION ("control_emit_event");
+	nih_error_init ();
+	nih_main_loop_init ();
+	event_init ();
+
+	TEST_DBUS (dbus_pid);
+	TEST_DBUS_OPEN (conn);
+	TEST_DBUS_OPEN (client_conn);
+
+
+	/* Check that we can emit an event with an empty environment list
+	 * which will be added to the event queue while the message is
+	 * blocked.  When the event is finished, the reply will be sent
+	 * and the message structure freed.
+	 */
+	TEST_FEATURE ("with empty environment list");
+	TEST_ALLOC_FAIL {
+		method = dbus_message_new_method_call (
+			dbus_bus_get_unique_name (conn),
+			DBUS_PATH_UPSTART,
+			DBUS_INTERFACE_UPSTART,
+			"EmitEvent");
+
+		dbus_connection_send (client_conn, method, &serial);
+		dbus_connection_flush (client_conn);
+		dbus_message_unref (method);
+
+		TEST_DBUS_MESSAGE (conn, method);
+		assert (dbus_message_get_serial (method) == serial);
+
+		TEST_ALLOC_SAFE {
+			message = nih_new (NULL, NihDBusMessage);
+			message->connection = conn;
+			message->message = method;
+
+			TEST_FREE_TAG (message);
+
+			env = nih_str_array_new (message);
+		}
+
+		ret = control_emit_event (NULL, message, "test", env, TRUE);
+
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
+
+			error = nih_error_get ();
+			TEST_EQ (error->number, ENOMEM);
+			nih_free (error);
+
+			nih_free (message);
+			dbus_message_unref (method);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_LIST_NOT_EMPTY (events);
+
+		event = (Event *)events->next;
+		TEST_ALLOC_SIZE (event, sizeof (Event));
+		TEST_EQ_STR (event->name, "test");
+		TEST_EQ_P (event->env[0], NULL);
+
+		TEST_LIST_NOT_EMPTY (&event->blocking);
+
+		blocked = (Blocked *)event->blocking.next;
+		TEST_ALLOC_SIZE (blocked, sizeof (Blocked));
+		TEST_ALLOC_PARENT (blocked, event);
+		TEST_EQ (blocked->type, BLOCKED_EMIT_METHOD);
+		TEST_EQ_P (blocked->message, message);
+
+		TEST_ALLOC_PARENT (blocked->message, blocked);
+
+		TEST_FREE_TAG (blocked);
+
+		nih_discard (message);
+		TEST_NOT_FREE (message);
+
+
+		event_poll ();
+
+		TEST_LIST_EMPTY (events);
+
+		TEST_FREE (blocked);
+
+		TEST_FREE (message);
+		dbus_message_unref (method);
+
+		dbus_connection_flush (conn);
+
+		TEST_DBUS_MESSAGE (client_conn, reply);
+
+		TEST_EQ (dbus_message_get_type (reply),
+			 DBUS_MESSAGE_TYPE_METHOD_RETURN);
+		TEST_EQ (dbus_message_get_reply_serial (reply), serial);
+
+		dbus_message_unref (reply);
+	}
+
+
+	/* Check that if we supply an environment list, it's placed straight
+	 * into the event.
+	 */
+	TEST_FEATURE ("with environment list");
+	TEST_ALLOC_FAIL {
+		method = dbus_message_new_method_call (
+			dbus_bus_get_unique_name (conn),
+			DBUS_PATH_UPSTART,
+			DBUS_INTERFACE_UPSTART,
+			"EmitEvent");
+
+		dbus_connection_send (client_conn, method, &serial);
+		dbus_connection_flush (client_conn);
+		dbus_message_unref (method);
+
+		TEST_DBUS_MESSAGE (conn, method);
+		assert (dbus_message_get_serial (method) == serial);
+
+		TEST_ALLOC_SAFE {
+			message = nih_new (NULL, NihDBusMessage);
+			message->connection = conn;
+			message->message = method;
+
+			TEST_FREE_TAG (message);
+
+			env = nih_str_array_new (message);
+			assert (nih_str_array_add (&env, message, NULL,
+						   "FOO=BAR"));
+			assert (nih_str_array_add (&env, message, NULL,
+						   "BAR=BAZ"));
+		}
+
+		ret = control_emit_event (NULL, message, "test", env, TRUE);
+
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
+
+			error = nih_error_get ();
+			TEST_EQ (error->number, ENOMEM);
+			nih_free (error);
+
+			nih_free (message);
+			dbus_message_unref (method);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_LIST_NOT_EMPTY (events);
+
+		event = (Event *)events->next;
+		TEST_ALLOC_SIZE (event, sizeof (Event));
+		TEST_EQ_STR (event->name, "test");
+		TEST_EQ_STR (event->env[0], "FOO=BAR");
+		TEST_EQ_STR (event->env[1], "BAR=BAZ");
+		TEST_EQ_P (event->env[2], NULL);
+
+		TEST_LIST_NOT_EMPTY (&event->blocking);
+
+		blocked = (Blocked *)event->blocking.next;
+		TEST_ALLOC_SIZE (blocked, sizeof (Blocked));
+		TEST_ALLOC_PARENT (blocked, event);
+		TEST_EQ (blocked->type, BLOCKED_EMIT_METHOD);
+		TEST_EQ_P (blocked->message, message);
+
+		TEST_ALLOC_PARENT (blocked->message, blocked);
+
+		TEST_FREE_TAG (blocked);
+
+		nih_discard (message);
+		TEST_NOT_FREE (message);
+
+
+		event_poll ();
+
+		TEST_LIST_EMPTY (events);
+
+		TEST_FREE (blocked);
+
+		TEST_FREE (message);
+		dbus_message_unref (method);
+
+		dbus_connection_flush (conn);
+
+		TEST_DBUS_MESSAGE (client_conn, reply);
+
+		TEST_EQ (dbus_message_get_type (reply),
+			 DBUS_MESSAGE_TYPE_METHOD_RETURN);
+		TEST_EQ (dbus_message_get_reply_serial (reply), serial);
+
+		dbus_message_unref (reply);
+	}
+
+
+	/* Check that we can emit an event without waiting for it to
+	 * finish, we should get the reply straight away.
+	 */
+	TEST_FEATURE ("with no wait");
+	TEST_ALLOC_FAIL {
+		method = dbus_message_new_method_call (
+			dbus_bus_get_unique_name (conn),
+			DBUS_PATH_UPSTART,
+			DBUS_INTERFACE_UPSTART,
+			"EmitEvent");
+
+		dbus_connection_send (client_conn, method, &serial);
+		dbus_connection_flush (client_conn);
+		dbus_message_unref (method);
+
+		TEST_DBUS_MESSAGE (conn, method);
+		assert (dbus_message_get_serial (method) == serial);
+
+		TEST_ALLOC_SAFE {
+			message = nih_new (NULL, NihDBusMessage);
+			message->connection = conn;
+			message->message = method;
+
+			TEST_FREE_TAG (message);
+
+			env = nih_str_array_new (message);
+		}
+
+		ret = control_emit_event (NULL, message, "test", env, FALSE);
+
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
+
+			error = nih_error_get ();
+			TEST_EQ (error->number, ENOMEM);
+			nih_free (error);
+
+			nih_free (message);
+			dbus_message_unref (method);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_LIST_NOT_EMPTY (events);
+
+		event = (Event *)events->next;
+		TEST_ALLOC_SIZE (event, sizeof (Event));
+		TEST_EQ_STR (event->name, "test");
+		TEST_EQ_P (event->env[0], NULL);
+
+		TEST_LIST_EMPTY (&event->blocking);
+
+		nih_discard (message);
+		TEST_FREE (message);
+		dbus_message_unref (method);
+
+		dbus_connection_flush (conn);
+
+		TEST_DBUS_MESSAGE (client_conn, reply);
+
+		TEST_EQ (dbus_message_get_type (reply),
+			 DBUS_MESSAGE_TYPE_METHOD_RETURN);
+		TEST_EQ (dbus_message_get_reply_serial (reply), serial);
+
+		dbus_message_unref (reply);
+
+
+		event_poll ();
+
+		TEST_LIST_EMPTY (events);
+	}
+
+
+	/* Check that if the event is marked as failed, an ordinary reply
+	 * is not sent when its finished, but an error instead.
+	 */
+	TEST_FEATURE ("with failed event");
+	method = dbus_message_new_method_call (
+		dbus_bus_get_unique_name (conn),
+		DBUS_PATH_UPSTART,
+		DBUS_INTERFACE_UPSTART,
+		"EmitEvent");
+
+	dbus_connection_send (client_conn, method, &serial);
+	dbus_connection_flush (client_conn);
+	dbus_message_unref (method);
+
+	TEST_DBUS_MESSAGE (conn, method);
+	assert (dbus_message_get_serial (method) == serial);
+
+	message = nih_new (NULL, NihDBusMessage);
+	message->connection = conn;
+	message->message = method;
+
+	TEST_FREE_TAG (message);
+
+	env = nih_str_array_new (NULL);
+
+	ret = control_emit_event (NULL, message, "test", env, TRUE);
+	nih_discard (env);
+
+	TEST_EQ (ret, 0);
+
+	TEST_LIST_NOT_EMPTY (events);
+
+	event = (Event *)events->next;
+	TEST_ALLOC_SIZE (event, sizeof (Event));
+	TEST_EQ_STR (event->name, "test");
+	TEST_EQ_P (event->env[0], NULL);
+
+	nih_discard (message);
+	TEST_NOT_FREE (message);
+
+
+	event->failed = TRUE;
+	event_poll ();
+
+	TEST_LIST_EMPTY (events);
+
+	TEST_FREE (message);
+	dbus_message_unref (method);
+
+	dbus_connection_flush (conn);
+
+	TEST_DBUS_MESSAGE (client_conn, reply);
+
+	TEST_TRUE (dbus_message_is_error (reply,
+					  DBUS_INTERFACE_UPSTART ".Error.EventFailed"));
+	TEST_EQ (dbus_message_get_reply_serial (reply), serial);
+
+	dbus_message_unref (reply);
+
+
+	/* Check that if the event name is empty, an error is returned
+	 * immediately.
+	 */
+	TEST_FEATURE ("with empty name");
+	method = dbus_message_new_method_call (
+		dbus_bus_get_unique_name (conn),
+		DBUS_PATH_UPSTART,
+		DBUS_INTERFACE_UPSTART,
+		"EmitEvent");
+
+	dbus_connection_send (client_conn, method, &serial);
+	dbus_connection_flush (client_conn);
+	dbus_message_unref (method);
+
+	TEST_DBUS_MESSAGE (conn, method);
+	assert (dbus_message_get_serial (method) == serial);
+
+	message = nih_new (NULL, NihDBusMessage);
+	message->connection = conn;
+	message->message = method;
+
+	env = nih_str_array_new (message);
+
+	ret = control_emit_event (NULL, message, "", env, TRUE);
+
+	TEST_LT (ret, 0);
+
+	dbus_error = (NihDBusError *)nih_error_get ();
+	TEST_ALLOC_SIZE (dbus_error, sizeof (NihDBusError));
+	TEST_EQ (dbus_error->number, NIH_DBUS_ERROR);
+	TEST_EQ_STR (dbus_error->name, DBUS_ERROR_INVALID_ARGS);
+	nih_free (dbus_error);
+
+	nih_free (message);
+	dbus_message_unref (method);
+
+
+	/* Check that if an entry in the environment list is missing an
+	 * equals, an error is returned immediately.
+	 */
+	TEST_FEATURE ("with missing equals in environment list");
+	method = dbus_message_new_method_call (
+		dbus_bus_get_unique_name (conn),
+		DBUS_PATH_UPSTART,
+		DBUS_INTERFACE_UPSTART,
+		"EmitEvent");
+
+	dbus_connection_send (client_conn, method, &serial);
+	dbus_connection_flush (client_conn);
+	dbus_message_unref (method);
+
+	TEST_DBUS_MESSAGE (conn, method);
+	assert (dbus_message_get_serial (method) == serial);
+
+	message = nih_new (NULL, NihDBusMessage);
+	message->connection = conn;
+	message->message = method;
+
+	env = nih_str_array_new (message);
+	assert (nih_str_array_add (&env, message, NULL, "FOO_BAR"));
+
+	ret = control_emit_event (NULL, message, "test", env, TRUE);
+
+	TEST_LT (ret, 0);
+
+	dbus_error = (NihDBusError *)nih_error_get ();
+	TEST_ALLOC_SIZE (dbus_error, sizeof (NihDBusError));
+	TEST_EQ (dbus_error->number, NIH_DBUS_ERROR);
+	TEST_EQ_STR (dbus_error->name, DBUS_ERROR_INVALID_ARGS);
+	nih_free (dbus_error);
+
+	nih_free (message);
+	dbus_message_unref (method);
+
+
+	TEST_DBUS_CLOSE (conn);
+	TEST_DBUS_CLOSE (client_conn);
+	TEST_DBUS_END (dbus_pid);
+
+	dbus_shutdown ();
+}
+
+
+void
+test_emit_events (void)
+{
+	DBusConnection                  *conn, *client_conn;
+	pid_t                            dbus_pid;
+	DBusMessage                     *method, *reply;
+	NihDBusMessage                  *message = NULL;
+	dbus_uint32_t                    serial;
+	ControlEmitEventsEventsElement **batch;
+	int                              ret;
+	Event                           *event1, *event2;
+	Blocked *                        blocked;
+	NihError                        *error;
+	NihDBusError                    *dbus_error;
+
+	TEST_FUNCTION ("control_emit_events");
+	nih_error_init ();
+	nih_main_loop_init ();
+	event_init ();
+
+	TEST_DBUS (dbus_pid);
+	TEST_DBUS_OPEN (conn);
+	TEST_DBUS_OPEN (client_conn);
+
+
+	/* Check that all of the events in the batch are added to the
+	 * event queue in order, each blocking the message, and that a
+	 * single reply is sent once they have all finished.
+	 */
+	TEST_FEATURE ("with wait");
+	TEST_ALLOC_FAIL {
+		method = dbus_message_new_method_call (
+			dbus_bus_get_unique_name (conn),
+			DBUS_PATH_UPSTART,
+			DBUS_INTERFACE_UPSTART,
+			"EmitEvents");
+
+		dbus_connection_send (client_conn, method, &serial);
+		dbus_connection_flush (client_conn);
+		dbus_message_unref (method);
+
+		TEST_DBUS_MESSAGE (conn, method);
+		assert (dbus_message_get_serial (method) == serial);
+
+		TEST_ALLOC_SAFE {
+			message = nih_new (NULL, NihDBusMessage);
+			message->connection = conn;
+			message->message = method;
+
+			TEST_FREE_TAG (message);
+
+			batch = nih_alloc (message, sizeof (ControlEmitEventsEventsElement *) * 3);
+			for (int i = 0; i < 2; i++) {
+				batch[i] = nih_new (batch, ControlEmitEventsEventsElement);
+				batch[i]->item1 = nih_str_array_new (batch[i]);
+				batch[i]->item2 = TRUE;
+			}
+			batch[0]->item0 = "foo";
+			assert (nih_str_array_add (&batch[0]->item1, batch[0],
+						   NULL, "FOO=BAR"));
+			batch[1]->item0 = "bar";
+			batch[2] = NULL;
+		}
+
+		ret = control_emit_events (NULL, message, batch);
+
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
+
+			error = nih_error_get ();
+			TEST_EQ (error->number, ENOMEM);
+			nih_free (error);
+
+			TEST_LIST_EMPTY (events);
+
+			nih_free (message);
+			dbus_message_unref (method);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_LIST_NOT_EMPTY (events);
+
+		event1 = (Event *)events->next;
+		TEST_ALLOC_SIZE (event1, sizeof (Event));
+		TEST_EQ_STR (event1->name, "foo");
+		TEST_EQ_STR (event1->env[0], "FOO=BAR");
+		TEST_EQ_P (event1->env[1], NULL);
+
+		TEST_LIST_NOT_EMPTY (&event1->blocking);
+
+		blocked = (Blocked *)event1->blocking.next;
+		TEST_ALLOC_SIZE (blocked, sizeof (Blocked));
+		TEST_ALLOC_PARENT (blocked, event1);
+		TEST_EQ (blocked->type, BLOCKED_EMIT_EVENTS_METHOD);
+		TEST_EQ_P (((ControlEmitBatch *)blocked->data)->message, message);
+		TEST_EQ (((ControlEmitBatch *)blocked->data)->pending, 2);
+
+		event2 = (Event *)event1->entry.next;
+		TEST_ALLOC_SIZE (event2, sizeof (Event));
+		TEST_EQ_STR (event2->name, "bar");
+		TEST_EQ_P (event2->env[0], NULL);
+
+		TEST_LIST_NOT_EMPTY (&event2->blocking);
+		TEST_EQ_P (event2->entry.next, events);
+
+		nih_discard (message);
+		TEST_NOT_FREE (message);
+
+
+		event_poll ();
+
+		TEST_LIST_EMPTY (events);
+
+		TEST_FREE (message);
+		dbus_message_unref (method);
 
 		dbus_connection_flush (conn);
 
@@ -1475,23 +2266,85 @@ test_emit_event (void)
 		TEST_EQ (dbus_message_get_reply_serial (reply), serial);
 
 		dbus_message_unref (reply);
+	}
 
 
-		event_poll ();
+	/* Check that when none of the events in the batch wait, the
+	 * reply is sent straight away.
+	 */
+	TEST_FEATURE ("with no wait");
+	method = dbus_message_new_method_call (
+		dbus_bus_get_unique_name (conn),
+		DBUS_PATH_UPSTART,
+		DBUS_INTERFACE_UPSTART,
+		"EmitEvents");
 
-		TEST_LIST_EMPTY (events);
+	dbus_connection_send (client_conn, method, &serial);
+	dbus_connection_flush (client_conn);
+	dbus_message_unref (method);
+
+	TEST_DBUS_MESSAGE (conn, method);
+	assert (dbus_message_get_serial (method) == serial);
+
+	message = nih_new (NULL, NihDBusMessage);
+	message->connection = conn;
+	message->message = method;
+
+	TEST_FREE_TAG (message);
+
+	batch = nih_alloc (message, sizeof (ControlEmitEventsEventsElement *) * 3);
+	for (int i = 0; i < 2; i++) {
+		batch[i] = nih_new (batch, ControlEmitEventsEventsElement);
+		batch[i]->item1 = nih_str_array_new (batch[i]);
+		batch[i]->item2 = FALSE;
 	}
+	batch[0]->item0 = "foo";
+	batch[1]->item0 = "bar";
+	batch[2] = NULL;
 
+	ret = control_emit_events (NULL, message, batch);
 
-	/* Check that if the event is marked as failed, an ordinary reply
-	 * is not sent when its finished, but an error instead.
+	TEST_EQ (ret, 0);
+
+	TEST_LIST_NOT_EMPTY (events);
+
+	event1 = (Event *)events->next;
+	TEST_EQ_STR (event1->name, "foo");
+	TEST_LIST_EMPTY (&event1->blocking);
+
+	event2 = (Event *)event1->entry.next;
+	TEST_EQ_STR (event2->name, "bar");
+	TEST_LIST_EMPTY (&event2->blocking);
+
+	nih_discard (message);
+	TEST_FREE (message);
+	dbus_message_unref (method);
+
+	dbus_connection_flush (conn);
+
+	TEST_DBUS_MESSAGE (client_conn, reply);
+
+	TEST_EQ (dbus_message_get_type (reply),
+		 DBUS_MESSAGE_TYPE_METHOD_RETURN);
+	TEST_EQ (dbus_message_get_reply_serial (reply), serial);
+
+	dbus_message_unref (reply);
+
+
+	event_poll ();
+
+	TEST_LIST_EMPTY (events);
+
+
+	/* Check that if one event of the batch fails, an error is sent
+	 * instead of the reply once all of them have finished.
 	 */
 	TEST_FEATURE ("with failed event");
 	method = dbus_message_new_method_call (
 		dbus_bus_get_unique_name (conn),
 		DBUS_PATH_UPSTART,
 		DBUS_INTERFACE_UPSTART,
-		"EmitEvent");
+		"EmitEvents");
 
 	dbus_connection_send (client_conn, method, &serial);
 	dbus_connection_flush (client_conn);
@@ -1506,25 +2359,28 @@ test_emit_event (void)
 
 	TEST_FREE_TAG (message);
 
-	env = nih_str_array_new (NULL);
+	batch = nih_alloc (message, sizeof (ControlEmitEventsEventsElement *) * 3);
+	for (int i = 0; i < 2; i++) {
+		batch[i] = nih_new (batch, ControlEmitEventsEventsElement);
+		batch[i]->item1 = nih_str_array_new (batch[i]);
+		batch[i]->item2 = TRUE;
+	}
+	batch[0]->item0 = "foo";
+	batch[1]->item0 = "bar";
+	batch[2] = NULL;
 
-	ret = control_emit_event (NULL, message, "test", env, TRUE);
-	nih_discard (env);
+	ret = control_emit_events (NULL, message, batch);
 
 	TEST_EQ (ret, 0);
 
-	TEST_LIST_NOT_EMPTY (events);
-
-	event = (Event *)events->next;
-	TEST_ALLOC_SIZE (event, sizeof (Event));
-	TEST_EQ_STR (event->name, "test");
-	TEST_EQ_P (event->env[0], NULL);
+	event1 = (Event *)events->next;
+	TEST_EQ_STR (event1->name, "foo");
 
 	nih_discard (message);
 	TEST_NOT_FREE (message);
 
 
-	event->failed = TRUE;
+	event1->failed = TRUE;
 	event_poll ();
 
 	TEST_LIST_EMPTY (events);
@@ -1543,15 +2399,15 @@ test_emit_event (void)
 	dbus_message_unref (reply);
 
 
-	/* Check that if the event name is empty, an error is returned
-	 * immediately.
+	/* Check that if the name of any event in the batch is empty, an
+	 * error is returned immediately and none of the events are queued.
 	 */
 	TEST_FEATURE ("with empty name");
 	method = dbus_message_new_method_call (
 		dbus_bus_get_unique_name (conn),
 		DBUS_PATH_UPSTART,
 		DBUS_INTERFACE_UPSTART,
-		"EmitEvent");
+		"EmitEvents");
 
 	dbus_connection_send (client_conn, method, &serial);
 	dbus_connection_flush (client_conn);
@@ -1564,9 +2420,17 @@ test_emit_event (void)
 	message->connection = conn;
 	message->message = method;
 
-	env = nih_str_array_new (message);
+	batch = nih_alloc (message, sizeof (ControlEmitEventsEventsElement *) * 3);
+	for (int i = 0; i < 2; i++) {
+		batch[i] = nih_new (batch, ControlEmitEventsEventsElement);
+		batch[i]->item1 = nih_str_array_new (batch[i]);
+		batch[i]->item2 = TRUE;
+	}
+	batch[0]->item0 = "foo";
+	batch[1]->item0 = "";
+	batch[2] = NULL;
 
-	ret = control_emit_event (NULL, message, "", env, TRUE);
+	ret = control_emit_events (NULL, message, batch);
 
 	TEST_LT (ret, 0);
 
@@ -1576,19 +2440,26 @@ test_emit_event (void)
 	TEST_EQ_STR (dbus_error->name, DBUS_ERROR_INVALID_ARGS);
 	nih_free (dbus_error);
 
+	TEST_LIST_EMPTY (events);
+
 	nih_free (message);
 	dbus_message_unref (method);
 
 
-	/* Check that if an entry in the environment list is missing an
-	 * equals, an error is returned immediately.
+	/* Check that if the rate limit of the caller doesn't have room for
+	 * the whole batch, an error is returned immediately, none of the
+	 * events are queued and none are charged to the limit.
 	 */
-	TEST_FEATURE ("with missing equals in environment list");
+	TEST_FEATURE ("with batch over rate limit");
+	event_limit_rate = 1;
+	event_limit_burst = 1;
+	memset (&event_limit_stats, 0, sizeof (event_limit_stats));
+
 	method = dbus_message_new_method_call (
 		dbus_bus_get_unique_name (conn),
 		DBUS_PATH_UPSTART,
 		DBUS_INTERFACE_UPSTART,
-		"EmitEvent");
+		"EmitEvents");
 
 	dbus_connection_send (client_conn, method, &serial);
 	dbus_connection_flush (client_conn);
@@ -1601,22 +2472,38 @@ test_emit_event (void)
 	message->connection = conn;
 	message->message = method;
 
-	env = nih_str_array_new (message);
-	assert (nih_str_array_add (&env, message, NULL, "FOO_BAR"));
+	batch = nih_alloc (message, sizeof (ControlEmitEventsEventsElement *) * 4);
+	for (int i = 0; i < 3; i++) {
+		batch[i] = nih_new (batch, ControlEmitEventsEventsElement);
+		batch[i]->item0 = "foo";
+		batch[i]->item1 = nih_str_array_new (batch[i]);
+		batch[i]->item2 = FALSE;
+	}
+	batch[3] = NULL;
 
-	ret = control_emit_event (NULL, message, "test", env, TRUE);
+	ret = control_emit_events (NULL, message, batch);
 
 	TEST_LT (ret, 0);
 
 	dbus_error = (NihDBusError *)nih_error_get ();
 	TEST_ALLOC_SIZE (dbus_error, sizeof (NihDBusError));
 	TEST_EQ (dbus_error->number, NIH_DBUS_ERROR);
-	TEST_EQ_STR (dbus_error->name, DBUS_ERROR_INVALID_ARGS);
+	TEST_EQ_STR (dbus_error->name, DBUS_INTERFACE_UPSTART ".Error.RateLimited");
 	nih_free (dbus_error);
 
+	TEST_LIST_EMPTY (events);
+
+	TEST_EQ (event_limit_stats.admitted, 0);
+	TEST_EQ (event_limit_stats.deferred, 0);
+	TEST_EQ (event_limit_stats.dropped, 3);
+	TEST_HASH_EMPTY (event_buckets);
+
 	nih_free (message);
 	dbus_message_unref (method);
 
+	event_limit_rate = 0;
+	event_limit_burst = EVENT_LIMIT_BURST;
+
 
 	TEST_DBUS_CLOSE (conn);
 	TEST_DBUS_CLOSE (client_conn);
@@ -1673,6 +2560,95 @@ test_get_version (void)
 }
 
 
+void
+test_get_runlevel (void)
+{
+	NihDBusMessage *message = NULL;
+	Event          *event;
+	char          **env;
+	char           *runlevel;
+	char           *prevlevel;
+	int             ret;
+
+	TEST_FUNCTION ("control_get_runlevel");
+	nih_error_init ();
+	event_init ();
+
+	message = nih_new (NULL, NihDBusMessage);
+	message->connection = NULL;
+	message->message = NULL;
+
+
+	/* Check that "N" is returned for both runlevels before there has
+	 * been a runlevel event.
+	 */
+	TEST_FEATURE ("without runlevel event");
+	ret = control_get_runlevel (NULL, message, &runlevel);
+
+	TEST_EQ (ret, 0);
+	TEST_ALLOC_PARENT (runlevel, message);
+	TEST_EQ_STR (runlevel, "N");
+
+	ret = control_get_prevlevel (NULL, message, &prevlevel);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ_STR (prevlevel, "N");
+
+
+	/* Check that the runlevels are taken from the environment of the
+	 * runlevel event, but not from that of any other event.
+	 */
+	TEST_FEATURE ("with runlevel event");
+	env = NIH_MUST (nih_str_array_new (NULL));
+	NIH_MUST (nih_str_array_add (&env, NULL, NULL, "RUNLEVEL=2"));
+	NIH_MUST (nih_str_array_add (&env, NULL, NULL, "PREVLEVEL=S"));
+
+	event = event_new (NULL, "runlevel", env);
+	control_notify_runlevel (event);
+	nih_free (event);
+
+	env = NIH_MUST (nih_str_array_new (NULL));
+	NIH_MUST (nih_str_array_add (&env, NULL, NULL, "RUNLEVEL=3"));
+
+	event = event_new (NULL, "wibble", env);
+	control_notify_runlevel (event);
+	nih_free (event);
+
+	ret = control_get_runlevel (NULL, message, &runlevel);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ_STR (runlevel, "2");
+
+	ret = control_get_prevlevel (NULL, message, &prevlevel);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ_STR (prevlevel, "S");
+
+
+	/* Check that an empty previous runlevel is returned as "N". */
+	TEST_FEATURE ("without previous runlevel");
+	env = NIH_MUST (nih_str_array_new (NULL));
+	NIH_MUST (nih_str_array_add (&env, NULL, NULL, "RUNLEVEL=S"));
+	NIH_MUST (nih_str_array_add (&env, NULL, NULL, "PREVLEVEL="));
+
+	event = event_new (NULL, "runlevel", env);
+	control_notify_runlevel (event);
+	nih_free (event);
+
+	ret = control_get_runlevel (NULL, message, &runlevel);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ_STR (runlevel, "S");
+
+	ret = control_get_prevlevel (NULL, message, &prevlevel);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ_STR (prevlevel, "N");
+
+	nih_free (message);
+}
+
+
 void
 test_get_log_priority (void)
 {
@@ -2716,10 +3692,16 @@ main (int   argc,
 
 	test_get_job_by_name ();
 	test_get_all_jobs ();
+	test_get_all_job_states ();
+	test_get_job_event_names ();
+	test_get_condition_graph ();
+	test_get_all_job_conditions ();
 
 	test_emit_event ();
+	test_emit_events ();
 
 	test_get_version ();
+	test_get_runlevel ();
 
 	test_get_log_priority ();
 	test_set_log_priority ();
@@ -1108,6 +1108,247 @@ test_append (void)
 	}
 
 	nih_free (new_env);
+
+
+	/* Check that appending enough entries for the table to be
+	 * indexed gives the same result as adding them one at a time,
+	 * including replacing, removing and repeated entries.
+	 */
+	TEST_FEATURE ("with many entries");
+	unsetenv ("UPSTART_TEST_UNSET");
+
+	new_env = nih_str_array_new (NULL);
+	for (int i = 0; i < ENVIRON_TABLE_MIN * 4; i++)
+		assert (environ_set (&new_env, NULL, NULL, TRUE, "VAR%d=%d", i, i));
+	assert (nih_str_array_add (&new_env, NULL, NULL, "FOO=apricot"));
+	assert (nih_str_array_add (&new_env, NULL, NULL, "UPSTART_TEST_UNSET"));
+	assert (nih_str_array_add (&new_env, NULL, NULL, "VAR1=again"));
+
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			len = 0;
+			env = nih_str_array_new (NULL);
+			assert (environ_add (&env, NULL, &len, TRUE, "FOO=BAR"));
+			assert (environ_add (&env, NULL, &len, TRUE, "BAR=BAZ"));
+			assert (environ_add (&env, NULL, &len, TRUE, "UPSTART_TEST_UNSET=set"));
+			assert (environ_add (&env, NULL, &len, TRUE, "BAZ=QUX"));
+		}
+
+		ret = environ_append (&env, NULL, &len, TRUE, new_env);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (ret, NULL);
+			nih_free (env);
+			continue;
+		}
+
+		TEST_EQ_P (ret, env);
+		TEST_EQ (len, 3 + ENVIRON_TABLE_MIN * 4);
+
+		TEST_EQ_STR (env[0], "FOO=apricot");
+		TEST_EQ_STR (env[1], "BAR=BAZ");
+		TEST_EQ_STR (env[2], "BAZ=QUX");
+		TEST_EQ_STR (env[3], "VAR0=0");
+		TEST_EQ_STR (env[4], "VAR1=again");
+		TEST_EQ_STR (env[5], "VAR2=2");
+		TEST_EQ_STR (env[2 + ENVIRON_TABLE_MIN * 4],
+			     "VAR31=31");
+		TEST_EQ_P (env[3 + ENVIRON_TABLE_MIN * 4], NULL);
+
+		TEST_EQ_STR (environ_get (env, "VAR17"), "17");
+		TEST_EQ_P (environ_get (env, "UPSTART_TEST_UNSET"), NULL);
+
+		nih_free (env);
+	}
+
+	nih_free (new_env);
+}
+
+
+void
+test_reference (void)
+{
+	char   **env = NULL, **new_env, **ret;
+	size_t   len = 0;
+
+	TEST_FUNCTION ("environ_reference");
+
+	/* Check that entries appended are the strings of the new table,
+	 * referenced by the existing table rather than copied, and that
+	 * existing entries are still replaced.
+	 */
+	TEST_FEATURE ("with new and replacement entries");
+	new_env = nih_str_array_new (NULL);
+	assert (environ_add (&new_env, NULL, NULL, TRUE, "MILK=white"));
+	assert (environ_add (&new_env, NULL, NULL, TRUE, "FOO=apricot"));
+
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			len = 0;
+			env = nih_str_array_new (NULL);
+			assert (environ_add (&env, NULL, &len, TRUE, "FOO=BAR"));
+			assert (environ_add (&env, NULL, &len, TRUE, "BAR=BAZ"));
+		}
+
+		ret = environ_reference (&env, NULL, &len, TRUE, new_env);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (ret, NULL);
+			nih_free (env);
+			continue;
+		}
+
+		TEST_EQ_P (ret, env);
+		TEST_EQ (len, 3);
+
+		TEST_EQ_P (env[0], new_env[1]);
+		TEST_EQ_STR (env[1], "BAR=BAZ");
+		TEST_EQ_P (env[2], new_env[0]);
+		TEST_EQ_P (env[3], NULL);
+
+		TEST_ALLOC_PARENT (env[0], env);
+		TEST_ALLOC_PARENT (env[0], new_env);
+
+		nih_free (env);
+
+		TEST_EQ_STR (new_env[0], "MILK=white");
+		TEST_EQ_STR (new_env[1], "FOO=apricot");
+	}
+
+
+	/* Check that the shared strings outlive the table they came from,
+	 * and that replacing one in either table leaves the other alone.
+	 */
+	TEST_FEATURE ("with source table freed");
+	len = 0;
+	env = nih_str_array_new (NULL);
+	assert (environ_reference (&env, NULL, &len, TRUE, new_env));
+
+	nih_free (new_env);
+
+	TEST_EQ (len, 2);
+	TEST_EQ_STR (env[0], "MILK=white");
+	TEST_EQ_STR (env[1], "FOO=apricot");
+	TEST_EQ_P (env[2], NULL);
+
+	new_env = nih_str_array_new (NULL);
+	assert (environ_reference (&new_env, NULL, NULL, TRUE, env));
+	assert (environ_add (&new_env, NULL, NULL, TRUE, "MILK=skimmed"));
+
+	TEST_EQ_STR (env[0], "MILK=white");
+	TEST_EQ_STR (new_env[0], "MILK=skimmed");
+	TEST_EQ_P (new_env[1], env[1]);
+
+	nih_free (env);
+	nih_free (new_env);
+
+
+	/* Check that referencing enough entries for the table to be
+	 * indexed shares them in the same way, and that entries without
+	 * a value are still taken from our own environment.
+	 */
+	TEST_FEATURE ("with many entries");
+	setenv ("UPSTART_TEST_SET", "yes", 1);
+
+	new_env = nih_str_array_new (NULL);
+	for (int i = 0; i < ENVIRON_TABLE_MIN * 2; i++)
+		assert (environ_set (&new_env, NULL, NULL, TRUE, "VAR%d=%d", i, i));
+	assert (nih_str_array_add (&new_env, NULL, NULL, "UPSTART_TEST_SET"));
+
+	len = 0;
+	env = nih_str_array_new (NULL);
+	assert (environ_add (&env, NULL, &len, TRUE, "VAR3=three"));
+
+	ret = environ_reference (&env, NULL, &len, TRUE, new_env);
+
+	TEST_EQ_P (ret, env);
+	TEST_EQ (len, 1 + ENVIRON_TABLE_MIN * 2);
+
+	TEST_EQ_P (env[0], new_env[3]);
+	TEST_EQ_P (env[1], new_env[0]);
+	for (int i = 4; i < ENVIRON_TABLE_MIN * 2; i++)
+		TEST_EQ_P (env[i], new_env[i]);
+	TEST_EQ_STR (env[ENVIRON_TABLE_MIN * 2], "UPSTART_TEST_SET=yes");
+	TEST_NE_P (env[ENVIRON_TABLE_MIN * 2], new_env[ENVIRON_TABLE_MIN * 2]);
+
+	nih_free (env);
+	nih_free (new_env);
+
+	unsetenv ("UPSTART_TEST_SET");
+}
+
+
+void
+test_env_table (void)
+{
+	EnvTable  *table;
+	char     **env;
+	size_t     len = 0;
+
+	TEST_FUNCTION ("env_table_new");
+
+	/* Check that variables already in the table can be found, and
+	 * that only the first of duplicate entries and entries with a
+	 * value are found.
+	 */
+	TEST_FEATURE ("with existing entries");
+	env = nih_str_array_new (NULL);
+	assert (nih_str_array_add (&env, NULL, &len, "FOO=BAR"));
+	assert (nih_str_array_add (&env, NULL, &len, "BARE"));
+	assert (nih_str_array_add (&env, NULL, &len, "FOO=BAZ"));
+	assert (nih_str_array_add (&env, NULL, &len, "FOOD=cake"));
+
+	TEST_ALLOC_FAIL {
+		table = env_table_new (NULL, env, len);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (table, NULL);
+			continue;
+		}
+
+		TEST_NE_P (table, NULL);
+		TEST_EQ_P (table->env, env);
+		TEST_EQ (table->len, 4);
+
+		TEST_EQ_P (env_table_lookup (table, "FOO", 3), &env[0]);
+		TEST_EQ_STR (env_table_getn (table, "FOOD", 4), "cake");
+		TEST_EQ_STR (env_table_getn (table, "FOODIE", 4), "cake");
+		TEST_EQ_P (env_table_lookup (table, "BARE", 4), NULL);
+		TEST_EQ_P (env_table_lookup (table, "FO", 2), NULL);
+
+		nih_free (table);
+	}
+
+	nih_free (env);
+
+
+	/* Check that adding to the table grows the index as required and
+	 * keeps the entries in insertion order.
+	 */
+	TEST_FEATURE ("with added entries");
+	table = env_table_new (NULL, NULL, 0);
+	TEST_NE_P (table, NULL);
+
+	for (int i = 0; i < 100; i++) {
+		nih_local char *str = NULL;
+
+		str = NIH_MUST (nih_sprintf (NULL, "VAR%d=%d", i, i));
+		TEST_NE_P (env_table_add (table, NULL, TRUE, str), NULL);
+	}
+
+	TEST_NE_P (env_table_add (table, NULL, FALSE, "VAR10=ignored"), NULL);
+	TEST_NE_P (env_table_add (table, NULL, TRUE, "VAR20=replaced"), NULL);
+
+	TEST_EQ (table->len, 100);
+	TEST_EQ_STR (table->env[0], "VAR0=0");
+	TEST_EQ_STR (table->env[99], "VAR99=99");
+	TEST_EQ_P (table->env[100], NULL);
+	TEST_EQ_STR (env_table_getn (table, "VAR10", 5), "10");
+	TEST_EQ_STR (env_table_getn (table, "VAR20", 5), "replaced");
+	TEST_EQ_STR (env_table_getn (table, "VAR99", 5), "99");
+
+	nih_free (table->env);
+	nih_free (table);
 }
 
 
@@ -1990,6 +2231,110 @@ test_expand (void)
 	nih_free (error);
 }
 
+void
+test_expand_buf (void)
+{
+	NihError   *error;
+	EnvironBuf  buf;
+	char       *env[4], *string, *expected;
+	const char *str;
+
+	TEST_FUNCTION ("environ_expand_buf");
+	env[0] = "FOO=frodo";
+	env[1] = "BAR=bilbo";
+	env[2] = "HOBBIT=FOO";
+	env[3] = NULL;
+
+	environ_buf_init (&buf);
+
+
+	/* Check that a string containing no references is returned
+	 * itself, without being copied into the buffer.
+	 */
+	TEST_FEATURE ("with no expansion");
+	string = "this is a test";
+	str = environ_expand_buf (&buf, string, env);
+
+	TEST_EQ_P (str, string);
+	TEST_EQ (buf.len, 0);
+
+
+	/* Check that a string with references is expanded into the
+	 * storage of the buffer itself.
+	 */
+	TEST_FEATURE ("with expansion");
+	str = environ_expand_buf (&buf, "this is a ${$HOBBIT:-$BAR} test", env);
+
+	TEST_EQ_STR (str, "this is a frodo test");
+	TEST_EQ_P (str, buf.buf);
+	TEST_EQ (buf.len, strlen (str));
+
+
+	/* Check that the buffer may be used again for another expansion,
+	 * replacing the first.
+	 */
+	TEST_FEATURE ("with reused buffer");
+	str = environ_expand_buf (&buf, "${BAR:+$FOO} $BAR", env);
+
+	TEST_EQ_STR (str, "frodo bilbo");
+	TEST_EQ_P (str, buf.buf);
+
+
+	/* Check that an expansion too long for the buffer is moved into
+	 * allocated memory, and that this is freed when the buffer is
+	 * cleared.
+	 */
+	TEST_FEATURE ("with long expansion");
+	string = NULL;
+	expected = NULL;
+	for (size_t i = 0; i < ENVIRON_BUF_SIZE / 4; i++) {
+		TEST_NE_P (nih_strcat (&string, NULL, "$FOO"), NULL);
+		TEST_NE_P (nih_strcat (&expected, NULL, "frodo"), NULL);
+	}
+
+	TEST_ALLOC_FAIL {
+		environ_buf_init (&buf);
+		str = environ_expand_buf (&buf, string, env);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (str, NULL);
+			TEST_EQ_P (buf.str, buf.buf);
+
+			error = nih_error_get ();
+			TEST_EQ (error->number, ENOMEM);
+			nih_free (error);
+			continue;
+		}
+
+		TEST_EQ_STR (str, expected);
+		TEST_NE_P (str, buf.buf);
+		TEST_ALLOC_SIZE (str, buf.size);
+
+		environ_buf_clear (&buf);
+		TEST_EQ_P (buf.str, buf.buf);
+		TEST_EQ (buf.len, 0);
+	}
+
+	nih_free (string);
+	nih_free (expected);
+
+
+	/* Check that errors are raised as they are by environ_expand(),
+	 * and that the buffer is left cleared.
+	 */
+	TEST_FEATURE ("with unknown variable");
+	str = environ_expand_buf (&buf, "this is a $WIBBLE test", env);
+
+	TEST_EQ_P (str, NULL);
+	TEST_EQ_P (buf.str, buf.buf);
+
+	error = nih_error_get ();
+	TEST_EQ (error->number, ENVIRON_UNKNOWN_PARAM);
+	nih_free (error);
+
+	environ_buf_clear (&buf);
+}
+
 
 int
 main (int   argc,
@@ -2001,12 +2346,15 @@ main (int   argc,
 	test_add ();
 	test_remove ();
 	test_append ();
+	test_reference ();
+	test_env_table ();
 	test_set ();
 	test_lookup ();
 	test_get ();
 	test_getn ();
 	test_all_valid ();
 	test_expand ();
+	test_expand_buf ();
 
 	return 0;
 }
@@ -77,6 +77,7 @@ test_new (void)
 
 		TEST_ALLOC_SIZE (event, sizeof (Event));
 		TEST_LIST_NOT_EMPTY (&event->entry);
+		TEST_EQ_P (events_ready[EVENT_LANE_INTERNAL]->prev, &event->ready);
 
 		TEST_EQ (event->progress, EVENT_PENDING);
 		TEST_EQ (event->failed, FALSE);
@@ -131,6 +132,24 @@ test_unblock (void)
 	TEST_EQ (event->blockers, 3);
 
 	nih_free (event);
+
+
+	/* Check that removing the last blocker of a handling event places
+	 * it back on the ready list.
+	 */
+	TEST_FEATURE ("with last blocker");
+	event = event_new (NULL, "test", NULL);
+	event->progress = EVENT_HANDLING;
+	event->blockers = 1;
+	nih_list_remove (&event->ready);
+
+	event_unblock (event);
+
+	TEST_EQ (event->blockers, 0);
+	TEST_EQ_P (events_ready[EVENT_LANE_INTERNAL]->prev, &event->ready);
+
+	nih_free (event);
+	TEST_LIST_EMPTY (events_ready[EVENT_LANE_INTERNAL]);
 }
 
 
@@ -138,6 +157,7 @@ void
 test_poll (void)
 {
 	Event *event = NULL;
+	Event          *external;
 	pid_t           dbus_pid;
 	DBusError       dbus_error;
 	DBusConnection *conn, *client_conn;
@@ -195,6 +215,48 @@ test_poll (void)
 	}
 
 
+	/* Check that an event in the internal lane is handled before one
+	 * in the external lane, even though it was queued after it.
+	 */
+	TEST_FEATURE ("with events in different lanes");
+	external = event_new (NULL, "external", NULL);
+	event_set_lane (external, EVENT_LANE_EXTERNAL);
+
+	TEST_EQ (external->lane, EVENT_LANE_EXTERNAL);
+	TEST_EQ_P (events_ready[EVENT_LANE_EXTERNAL]->prev, &external->ready);
+
+	TEST_FREE_TAG (external);
+
+	event = event_new (NULL, "internal", NULL);
+
+	TEST_FREE_TAG (event);
+
+	event_poll ();
+
+	TEST_FREE (external);
+	TEST_FREE (event);
+
+	for (int i = 0; i < 2; i++) {
+		char  *name;
+		char **env;
+		int    env_len;
+
+		TEST_DBUS_MESSAGE (client_conn, message);
+		TEST_TRUE (dbus_message_is_signal (message, DBUS_INTERFACE_UPSTART,
+						   "EventEmitted"));
+		TEST_TRUE (dbus_message_get_args (message, NULL,
+						  DBUS_TYPE_STRING, &name,
+						  DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+						  &env, &env_len,
+						  DBUS_TYPE_INVALID));
+
+		TEST_EQ_STR (name, i ? "external" : "internal");
+
+		dbus_free_string_array (env);
+		dbus_message_unref (message);
+	}
+
+
 	/* Check that a handling event which is not blocked goes
 	 * straight though and gets freed.
 	 */
@@ -230,11 +292,37 @@ test_poll (void)
 
 		TEST_NOT_FREE (event);
 		TEST_LIST_NOT_EMPTY (&event->entry);
+		TEST_LIST_EMPTY (&event->ready);
 
 		nih_free (event);
 	}
 
 
+	/* Check that a blocked handling event is finished by the next poll
+	 * once its last blocker is removed.
+	 */
+	TEST_FEATURE ("with unblocked blocked event");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			event = event_new (NULL, "test", NULL);
+			event->progress = EVENT_HANDLING;
+			event->blockers = 1;
+		}
+
+		TEST_FREE_TAG (event);
+
+		event_poll ();
+
+		TEST_NOT_FREE (event);
+
+		event_unblock (event);
+		event_poll ();
+
+		TEST_FREE (event);
+		TEST_LIST_EMPTY (events_ready[EVENT_LANE_INTERNAL]);
+	}
+
+
 	/* Check that a finished event is freed.
 	 */
 	TEST_FEATURE ("with finished event");
@@ -287,7 +375,7 @@ test_pending (void)
 			class->start_on = event_operator_new (
 				class, EVENT_MATCH, "test", NULL);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -314,12 +402,13 @@ void
 test_pending_handle_jobs (void)
 {
 	FILE           *output;
-	JobClass       *class = NULL;
+	JobClass       *class = NULL, *other = NULL;
 	Job            *job = NULL, *ptr;
 	Event          *event1 = NULL, *event2 = NULL;
 	Event          *event3 = NULL, *event4 = NULL;
 	EventOperator  *oper;
 	Blocked        *blocked = NULL, *blocked1 = NULL, *blocked2 = NULL;
+	JobClassEventIndex *index;
 	char          **env1 = NULL, **env2 = NULL;
 
 	TEST_FUNCTION ("event_pending_handle_jobs");
@@ -345,7 +434,7 @@ test_pending_handle_jobs (void)
 			class->start_on = event_operator_new (
 				class, EVENT_MATCH, "wibble", NULL);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -362,6 +451,74 @@ test_pending_handle_jobs (void)
 	}
 
 
+	/* Check that a class is only indexed once for an event referenced
+	 * by both its start and stop conditions, that an event is only
+	 * offered to the classes that reference it, and that the index
+	 * entry is discarded along with the classes.
+	 */
+	TEST_FEATURE ("with event referenced by only some classes");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			event1 = event_new (NULL, "wibble", NULL);
+
+			class = job_class_new (NULL, "test", NULL);
+			class->console = CONSOLE_NONE;
+			class->task = TRUE;
+			class->process[PROCESS_MAIN] = process_new (class->process);
+			class->process[PROCESS_MAIN]->command = "echo";
+
+			class->start_on = event_operator_new (
+				class, EVENT_MATCH, "wibble", NULL);
+			class->stop_on = event_operator_new (
+				class, EVENT_MATCH, "wibble", NULL);
+
+			job_class_add_safe (class);
+
+			other = job_class_new (NULL, "other", NULL);
+			other->console = CONSOLE_NONE;
+			other->task = TRUE;
+
+			other->start_on = event_operator_new (
+				other, EVENT_MATCH, "wobble", NULL);
+
+			job_class_add_safe (other);
+		}
+
+		index = (JobClassEventIndex *)nih_hash_lookup (
+			job_class_events, "wibble");
+		TEST_NE_P (index, NULL);
+		TEST_LIST_NOT_EMPTY (&index->classes);
+		TEST_EQ_P (index->classes.next->next, &index->classes);
+		TEST_EQ_P (((NihListEntry *)index->classes.next)->data, class);
+
+		event_poll ();
+
+		TEST_HASH_NOT_EMPTY (class->instances);
+		TEST_HASH_EMPTY (other->instances);
+
+		job = (Job *)nih_hash_lookup (class->instances, "");
+
+		TEST_EQ (job->goal, JOB_START);
+		TEST_EQ (job->state, JOB_SPAWNED);
+		TEST_GT (job->pid[PROCESS_MAIN], 0);
+
+		waitpid (job->pid[PROCESS_MAIN], NULL, 0);
+
+		oper = other->start_on;
+		TEST_EQ (oper->value, FALSE);
+		TEST_EQ_P (oper->event, NULL);
+
+		nih_free (class);
+		nih_free (other);
+		nih_free (event1);
+
+		index = (JobClassEventIndex *)nih_hash_lookup (
+			job_class_events, "wibble");
+		if (index)
+			TEST_LIST_EMPTY (&index->classes);
+	}
+
+
 	/* Check that an event that only partially matches an operator
 	 * marks the individual node as true, but does not result in the
 	 * job being changed yet.  The event should now be blocked on the
@@ -391,7 +548,7 @@ test_pending_handle_jobs (void)
 			nih_tree_add (&class->start_on->node, &oper->node,
 				      NIH_TREE_RIGHT);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -456,7 +613,7 @@ test_pending_handle_jobs (void)
 			nih_tree_add (&class->start_on->node, &oper->node,
 				      NIH_TREE_RIGHT);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -573,7 +730,7 @@ test_pending_handle_jobs (void)
 			nih_tree_add (&class->start_on->node, &oper->node,
 				      NIH_TREE_RIGHT);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 
@@ -700,7 +857,7 @@ test_pending_handle_jobs (void)
 			nih_tree_add (&class->start_on->node, &oper->node,
 				      NIH_TREE_RIGHT);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 
 			job = job_new (class, "");
 			job->goal = JOB_STOP;
@@ -869,7 +1026,7 @@ test_pending_handle_jobs (void)
 			nih_tree_add (&class->start_on->node, &oper->node,
 				      NIH_TREE_RIGHT);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 
 			job = job_new (class, "");
 			job->goal = JOB_START;
@@ -981,7 +1138,7 @@ test_pending_handle_jobs (void)
 			class->start_on = event_operator_new (
 				class, EVENT_MATCH, "wibble", NULL);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1061,7 +1218,7 @@ test_pending_handle_jobs (void)
 			class->start_on = event_operator_new (
 				class, EVENT_MATCH, "wibble", NULL);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 
 			job = job_new (class, "brandybuck");
 			job->goal = JOB_STOP;
@@ -1146,7 +1303,7 @@ test_pending_handle_jobs (void)
 			class->start_on = event_operator_new (
 				class, EVENT_MATCH, "wibble", NULL);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		TEST_DIVERT_STDERR (output) {
@@ -1196,7 +1353,7 @@ test_pending_handle_jobs (void)
 			job->goal = JOB_START;
 			job->state = JOB_RUNNING;
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1245,7 +1402,7 @@ test_pending_handle_jobs (void)
 			job->goal = JOB_START;
 			job->state = JOB_RUNNING;
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1321,7 +1478,7 @@ test_pending_handle_jobs (void)
 			job->goal = JOB_START;
 			job->state = JOB_RUNNING;
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1425,7 +1582,7 @@ test_pending_handle_jobs (void)
 			TEST_FREE_TAG (blocked2);
 			TEST_FREE_TAG (event4);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1536,7 +1693,7 @@ test_pending_handle_jobs (void)
 			TEST_FREE_TAG (blocked2);
 			TEST_FREE_TAG (event4);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1607,7 +1764,7 @@ test_pending_handle_jobs (void)
 			assert (nih_str_array_add (&(job->env), job,
 						   NULL, "COLOUR=GOLD"));
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1692,7 +1849,7 @@ test_finished (void)
 			class->start_on = event_operator_new (
 				class, EVENT_MATCH, "test/failed", NULL);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1727,7 +1884,7 @@ test_finished (void)
 			class->start_on = event_operator_new (
 				class, EVENT_MATCH, "test/failed", NULL);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1780,7 +1937,7 @@ test_finished (void)
 			nih_tree_add (&class->start_on->node, &oper->node,
 				      NIH_TREE_RIGHT);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1812,7 +1969,7 @@ test_finished (void)
 			job->state = JOB_STOPPING;
 			job->blocker = NULL;
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1846,7 +2003,7 @@ test_finished (void)
 			job->state = JOB_STARTING;
 			job->blocker = NULL;
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1886,7 +2043,7 @@ test_finished (void)
 
 			TEST_FREE_TAG (blocked);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1929,7 +2086,7 @@ test_finished (void)
 
 			TEST_FREE_TAG (blocked);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1974,7 +2131,7 @@ test_finished (void)
 
 			TEST_FREE_TAG (blocked);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -2020,7 +2177,7 @@ test_finished (void)
 
 			TEST_FREE_TAG (blocked);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -2040,6 +2197,81 @@ test_finished (void)
 }
 
 
+void
+test_index (void)
+{
+	Event *event1;
+	Event *event2;
+	Event *event3;
+
+	TEST_FUNCTION ("event_to_index");
+	event_init ();
+
+	TEST_LIST_EMPTY (events);
+
+	event1 = event_new (NULL, "foo", NULL);
+	event2 = event_new (NULL, "bar", NULL);
+	event3 = event_new (NULL, "baz", NULL);
+
+	/* Check that the position of each event in the list is returned
+	 * when no index has been built.
+	 */
+	TEST_FEATURE ("without index");
+	TEST_EQ (event_to_index (event1), 0);
+	TEST_EQ (event_to_index (event2), 1);
+	TEST_EQ (event_to_index (event3), 2);
+
+	/* Check that the index gives the same answers.
+	 */
+	TEST_FEATURE ("with index");
+	event_index_build ();
+
+	TEST_EQ (event1->state_index, 0);
+	TEST_EQ (event2->state_index, 1);
+	TEST_EQ (event3->state_index, 2);
+
+	TEST_EQ (event_to_index (event1), 0);
+	TEST_EQ (event_to_index (event2), 1);
+	TEST_EQ (event_to_index (event3), 2);
+
+	event_index_clear ();
+
+	/* Check that a stale stamp is not trusted once the index has
+	 * been cleared and the list has changed.
+	 */
+	TEST_FEATURE ("with stale stamp");
+	nih_free (event1);
+
+	TEST_EQ (event_to_index (event2), 0);
+	TEST_EQ (event_to_index (event3), 1);
+
+
+	TEST_FUNCTION ("event_from_index");
+
+	/* Check that an event is found by position when no index has
+	 * been built, and that an out of range position returns NULL.
+	 */
+	TEST_FEATURE ("without index");
+	TEST_EQ_P (event_from_index (0), event2);
+	TEST_EQ_P (event_from_index (1), event3);
+	TEST_EQ_P (event_from_index (2), NULL);
+
+	/* Check that the index gives the same answers.
+	 */
+	TEST_FEATURE ("with index");
+	event_index_build ();
+
+	TEST_EQ_P (event_from_index (0), event2);
+	TEST_EQ_P (event_from_index (1), event3);
+	TEST_EQ_P (event_from_index (2), NULL);
+
+	event_index_clear ();
+
+	nih_free (event2);
+	nih_free (event3);
+}
+
+
 int
 main (int   argc,
       char *argv[])
@@ -2057,6 +2289,7 @@ main (int   argc,
 	test_pending ();
 	test_pending_handle_jobs ();
 	test_finished ();
+	test_index ();
 
 	return 0;
 }
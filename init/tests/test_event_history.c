@@ -0,0 +1,270 @@
+/* upstart
+ *
+ * test_event_history.c - test suite for init/event_history.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <nih/test.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/main.h>
+
+#include "event.h"
+#include "job_class.h"
+#include "job.h"
+#include "event_history.h"
+
+
+void
+test_new (void)
+{
+	const EventHistoryRecord *record;
+	Event                    *event;
+	char                    **env;
+	uint64_t                  digest;
+
+	TEST_FUNCTION ("event_history_new");
+	event_history_clear ();
+
+	/* Check that an event is recorded when it's created, with its
+	 * name, a digest of its environment and the times it was
+	 * emitted at, and not yet handled or finished.
+	 */
+	TEST_FEATURE ("with new event");
+	env = NIH_MUST (nih_str_array_new (NULL));
+	NIH_MUST (nih_str_array_add (&env, NULL, NULL, "FOO=BAR"));
+
+	event = event_new (NULL, "test", env);
+
+	TEST_NE (event->history, 0);
+
+	record = event_history_next (NULL, 0, NULL);
+	TEST_NE_P (record, NULL);
+	TEST_EQ (record->id, event->history);
+	TEST_EQ_STR (record->name, "test");
+	TEST_EQ_STR (record->session, "");
+	TEST_EQ (record->pending, event->emitted);
+	TEST_NE (record->emitted, 0);
+	TEST_EQ (record->handling, 0);
+	TEST_EQ (record->finished, 0);
+	TEST_FALSE (record->failed);
+	TEST_EQ (record->jobs_len, 0);
+
+	digest = record->env_digest;
+
+	TEST_EQ_P (event_history_next (NULL, 0, record), NULL);
+
+	nih_free (event);
+
+
+	/* Check that events with the same environment have the same
+	 * digest, and those with different environments don't.
+	 */
+	TEST_FEATURE ("with environment digest");
+	env = NIH_MUST (nih_str_array_new (NULL));
+	NIH_MUST (nih_str_array_add (&env, NULL, NULL, "FOO=BAR"));
+	event = event_new (NULL, "other", env);
+
+	record = event_history_next ("other", 0, NULL);
+	TEST_NE_P (record, NULL);
+	TEST_EQ (record->env_digest, digest);
+
+	nih_free (event);
+
+	env = NIH_MUST (nih_str_array_new (NULL));
+	NIH_MUST (nih_str_array_add (&env, NULL, NULL, "FOO=BAZ"));
+	event = event_new (NULL, "other", env);
+
+	record = event_history_next ("other", 0, record);
+	TEST_NE_P (record, NULL);
+	TEST_NE (record->env_digest, digest);
+
+	nih_free (event);
+
+
+	/* Check that the record of an event outlives it, and notes when
+	 * it was handled and finished and whether it failed.
+	 */
+	TEST_FEATURE ("with finished event");
+	event_history_clear ();
+	event = event_new (NULL, "test", NULL);
+
+	event_history_handling (event);
+	event_history_handled (event);
+
+	event->failed = TRUE;
+	event_history_finished (event);
+
+	nih_free (event);
+
+	record = event_history_next (NULL, 0, NULL);
+	TEST_NE_P (record, NULL);
+	TEST_NE (record->handling, 0);
+	TEST_GE (record->finished, record->handling);
+	TEST_TRUE (record->failed);
+}
+
+void
+test_job (void)
+{
+	const EventHistoryRecord *record;
+	JobClass                 *class;
+	Job                      *job;
+	Event                    *event;
+	char                      name[16];
+
+	TEST_FUNCTION ("event_history_job");
+	event_history_clear ();
+
+	class = job_class_new (NULL, "test", NULL);
+	job = job_new (class, "foo");
+
+	/* Check that a job whose goal changes while an event is being
+	 * handled is recorded against it, but not once it has been.
+	 */
+	TEST_FEATURE ("with event being handled");
+	event = event_new (NULL, "test", NULL);
+
+	event_history_handling (event);
+	event_history_job (job, JOB_START);
+	event_history_job (job, JOB_STOP);
+	event_history_handled (event);
+
+	event_history_job (job, JOB_START);
+
+	record = event_history_next (NULL, 0, NULL);
+	TEST_NE_P (record, NULL);
+	TEST_EQ (record->jobs_len, 2);
+	TEST_EQ_STR (record->jobs[0].name, "test (foo)");
+	TEST_TRUE (record->jobs[0].start);
+	TEST_EQ_STR (record->jobs[1].name, "test (foo)");
+	TEST_FALSE (record->jobs[1].start);
+
+	nih_free (event);
+
+
+	/* Check that only the first EVENT_HISTORY_JOBS jobs are named,
+	 * with the rest counted.
+	 */
+	TEST_FEATURE ("with many jobs");
+	event_history_clear ();
+	event = event_new (NULL, "test", NULL);
+
+	event_history_handling (event);
+	for (int i = 0; i < EVENT_HISTORY_JOBS + 3; i++) {
+		sprintf (name, "job%d", i);
+		job = job_new (class, name);
+
+		event_history_job (job, JOB_START);
+	}
+	event_history_handled (event);
+
+	record = event_history_next (NULL, 0, NULL);
+	TEST_NE_P (record, NULL);
+	TEST_EQ (record->jobs_len, EVENT_HISTORY_JOBS + 3);
+	TEST_EQ_STR (record->jobs[EVENT_HISTORY_JOBS - 1].name, "test (job7)");
+
+	nih_free (event);
+	nih_free (class);
+}
+
+void
+test_next (void)
+{
+	const EventHistoryRecord *record;
+	Event                    *event;
+	char                      name[16];
+	size_t                    len;
+	uint64_t                  last = 0;
+
+	TEST_FUNCTION ("event_history_next");
+
+	/* Check that once the history is full the oldest records are
+	 * replaced, with all records still found in the order their
+	 * events were emitted.
+	 */
+	TEST_FEATURE ("with full history");
+	event_history_clear ();
+
+	for (int i = 0; i < EVENT_HISTORY_MAX * 2 + 10; i++) {
+		sprintf (name, "event%d", i % 3);
+
+		event = event_new (NULL, name, NULL);
+		nih_free (event);
+	}
+
+	len = 0;
+	for (record = event_history_next (NULL, 0, NULL); record;
+	     record = event_history_next (NULL, 0, record)) {
+		TEST_GT (record->id, last);
+		last = record->id;
+		len++;
+	}
+
+	TEST_EQ (len, EVENT_HISTORY_MAX);
+
+
+	/* Check that records of a single name are found through the
+	 * index, oldest first.
+	 */
+	TEST_FEATURE ("with name");
+	len = 0;
+	last = 0;
+	for (record = event_history_next ("event1", 0, NULL); record;
+	     record = event_history_next ("event1", 0, record)) {
+		TEST_EQ_STR (record->name, "event1");
+		TEST_GT (record->id, last);
+		last = record->id;
+		len++;
+	}
+
+	TEST_GE (len, EVENT_HISTORY_MAX / 3);
+	TEST_LE (len, EVENT_HISTORY_MAX / 3 + 1);
+
+	TEST_EQ_P (event_history_next ("unknown", 0, NULL), NULL);
+
+
+	/* Check that no records are found emitted after a time in the
+	 * future.
+	 */
+	TEST_FEATURE ("with since");
+	TEST_EQ_P (event_history_next (NULL, UINT64_MAX, NULL), NULL);
+	TEST_EQ_P (event_history_next ("event1", UINT64_MAX, NULL), NULL);
+
+	event_history_clear ();
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	/* run tests in legacy (pre-session support) mode */
+	setenv ("UPSTART_NO_SESSIONS", "1", 1);
+
+	nih_main_init (argv[0]);
+
+	test_new ();
+	test_job ();
+	test_next ();
+
+	return 0;
+}
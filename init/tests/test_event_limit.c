@@ -0,0 +1,278 @@
+/* upstart
+ *
+ * test_event_limit.c - test suite for init/event_limit.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <nih/test.h>
+
+#include <string.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+
+#include "event.h"
+#include "timer_wheel.h"
+#include "event_limit.h"
+
+
+void
+test_admit (void)
+{
+	Event       *event1;
+	Event       *event2;
+	Event       *event3;
+	Event       *event4;
+	Event       *event5;
+	EventBucket *bucket;
+	NihList     *ready;
+
+	TEST_FUNCTION ("event_limit_admit");
+	timer_wheel_init ();
+	event_init ();
+	event_limit_init ();
+
+	ready = events_ready[EVENT_LANE_EXTERNAL];
+
+
+	/* Check that without a rate limit, an event is admitted into the
+	 * external lane without creating a bucket for its emitter.
+	 */
+	TEST_FEATURE ("with no limit");
+	event_limit_rate = 0;
+	memset (&event_limit_stats, 0, sizeof (event_limit_stats));
+
+	event1 = event_new (NULL, "test", NULL);
+
+	TEST_TRUE (event_limit_admit (event1, ":1.42"));
+
+	TEST_EQ (event1->lane, EVENT_LANE_EXTERNAL);
+	TEST_EQ_P (ready->prev, &event1->ready);
+	TEST_EQ (event_limit_stats.admitted, 1);
+	TEST_HASH_EMPTY (event_buckets);
+
+	nih_free (event1);
+
+
+	/* Check that the runlevel event is left in the internal lane and
+	 * isn't counted.
+	 */
+	TEST_FEATURE ("with runlevel event");
+	event_limit_rate = 1;
+	memset (&event_limit_stats, 0, sizeof (event_limit_stats));
+
+	event1 = event_new (NULL, "runlevel", NULL);
+
+	TEST_TRUE (event_limit_admit (event1, ":1.42"));
+
+	TEST_EQ (event1->lane, EVENT_LANE_INTERNAL);
+	TEST_EQ (event_limit_stats.admitted, 0);
+	TEST_HASH_EMPTY (event_buckets);
+
+	nih_free (event1);
+
+
+	/* Check that an emitter may emit its burst of events at once,
+	 * that as many again are then deferred, taken off the ready list,
+	 * and that any more are refused.
+	 */
+	TEST_FEATURE ("with burst exceeded");
+	event_limit_rate = 1;
+	event_limit_burst = 2;
+	memset (&event_limit_stats, 0, sizeof (event_limit_stats));
+
+	event1 = event_new (NULL, "test", NULL);
+	event2 = event_new (NULL, "test", NULL);
+	event3 = event_new (NULL, "test", NULL);
+	event4 = event_new (NULL, "test", NULL);
+	event5 = event_new (NULL, "test", NULL);
+
+	TEST_TRUE (event_limit_admit (event1, ":1.42"));
+	TEST_TRUE (event_limit_admit (event2, ":1.42"));
+	TEST_TRUE (event_limit_admit (event3, ":1.42"));
+	TEST_TRUE (event_limit_admit (event4, ":1.42"));
+	TEST_FALSE (event_limit_admit (event5, ":1.42"));
+
+	TEST_EQ (event_limit_stats.admitted, 2);
+	TEST_EQ (event_limit_stats.deferred, 2);
+	TEST_EQ (event_limit_stats.dropped, 1);
+
+	bucket = (EventBucket *)nih_hash_lookup (event_buckets, ":1.42");
+	TEST_NE_P (bucket, NULL);
+	TEST_NE_P (bucket->timer, NULL);
+
+	TEST_EQ_P (ready->prev, &event2->ready);
+	TEST_EQ_P (bucket->deferred.next, &event3->ready);
+	TEST_EQ_P (bucket->deferred.prev, &event4->ready);
+
+	nih_free (event5);
+
+
+	/* Check that another emitter has its own bucket and so isn't
+	 * deferred behind the first.
+	 */
+	TEST_FEATURE ("with other emitter");
+	event5 = event_new (NULL, "test", NULL);
+
+	TEST_TRUE (event_limit_admit (event5, ":1.43"));
+
+	TEST_EQ_P (ready->prev, &event5->ready);
+	TEST_NE_P (nih_hash_lookup (event_buckets, ":1.43"), NULL);
+
+	nih_free (event5);
+
+
+	/* Check that once the emitter's debt has been repaid, the timer
+	 * releases deferred events in order onto the ready list.
+	 */
+	TEST_FEATURE ("with deferred events released");
+	bucket->tat = timer_wheel_now () * 1000;
+	timer_wheel_adjust (bucket->timer, timer_wheel_now ());
+	timer_wheel_poll ();
+
+	TEST_LIST_EMPTY (&bucket->deferred);
+	TEST_EQ_P (ready->prev->prev, &event3->ready);
+	TEST_EQ_P (ready->prev, &event4->ready);
+	TEST_NE_P (bucket->timer, NULL);
+
+	nih_free (event1);
+	nih_free (event2);
+	nih_free (event3);
+	nih_free (event4);
+
+
+	/* Check that a bucket frees itself once it's full again. */
+	TEST_FEATURE ("with full bucket");
+	TEST_FREE_TAG (bucket);
+
+	bucket->tat = 0;
+	timer_wheel_adjust (bucket->timer, timer_wheel_now ());
+	timer_wheel_poll ();
+
+	TEST_FREE (bucket);
+
+	NIH_HASH_FOREACH_SAFE (event_buckets, iter)
+		nih_free (iter);
+
+	event_limit_rate = 0;
+	event_limit_burst = EVENT_LIMIT_BURST;
+}
+
+
+void
+test_room (void)
+{
+	Event       *event1;
+	Event       *event2;
+
+	TEST_FUNCTION ("event_limit_room");
+	event_limit_init ();
+
+
+	/* Check that without a rate limit there's always room. */
+	TEST_FEATURE ("with no limit");
+	event_limit_rate = 0;
+
+	TEST_TRUE (event_limit_room (":1.42", 1000));
+
+
+	/* Check that an emitter without a bucket has room for its burst
+	 * and as many deferred again, but no more, and that asking
+	 * doesn't create a bucket or count anything.
+	 */
+	TEST_FEATURE ("with new emitter");
+	event_limit_rate = 1;
+	event_limit_burst = 2;
+	memset (&event_limit_stats, 0, sizeof (event_limit_stats));
+
+	TEST_TRUE (event_limit_room (":1.42", 4));
+	TEST_FALSE (event_limit_room (":1.42", 5));
+
+	TEST_HASH_EMPTY (event_buckets);
+	TEST_EQ (event_limit_stats.admitted, 0);
+	TEST_EQ (event_limit_stats.deferred, 0);
+	TEST_EQ (event_limit_stats.dropped, 0);
+
+
+	/* Check that events already admitted are taken into account. */
+	TEST_FEATURE ("with events admitted");
+	event1 = event_new (NULL, "test", NULL);
+	event2 = event_new (NULL, "test", NULL);
+
+	TEST_TRUE (event_limit_admit (event1, ":1.42"));
+	TEST_TRUE (event_limit_admit (event2, ":1.42"));
+
+	TEST_TRUE (event_limit_room (":1.42", 2));
+	TEST_FALSE (event_limit_room (":1.42", 3));
+
+	TEST_TRUE (event_limit_room (":1.43", 4));
+
+	nih_free (event1);
+	nih_free (event2);
+
+	NIH_HASH_FOREACH_SAFE (event_buckets, iter)
+		nih_free (iter);
+
+	event_limit_rate = 0;
+	event_limit_burst = EVENT_LIMIT_BURST;
+}
+
+
+void
+test_stats_to_string (void)
+{
+	char *str;
+
+	/* Check that the counters are given as a JSON object along with
+	 * the number of emitters being limited.
+	 */
+	TEST_FUNCTION ("event_limit_stats_to_string");
+	event_limit_init ();
+
+	event_limit_stats.admitted = 10;
+	event_limit_stats.deferred = 3;
+	event_limit_stats.dropped = 1;
+
+	TEST_ALLOC_FAIL {
+		str = event_limit_stats_to_string (NULL);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (str, NULL);
+			continue;
+		}
+
+		TEST_EQ_STR (str, "{ \"admitted\": 10, \"deferred\": 3, "
+			     "\"dropped\": 1, \"emitters\": 0 }");
+
+		nih_free (str);
+	}
+
+	memset (&event_limit_stats, 0, sizeof (event_limit_stats));
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	test_admit ();
+	test_room ();
+	test_stats_to_string ();
+
+	return 0;
+}
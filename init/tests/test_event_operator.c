@@ -388,6 +388,131 @@ test_operator_copy (void)
 	event_poll ();
 }
 
+void
+test_operator_share (void)
+{
+	EventOperator *oper = NULL, *oper1 = NULL, *oper2 = NULL;
+	EventOperator *share, *share1, *share2;
+	Event         *event;
+
+	TEST_FUNCTION ("event_operator_share");
+	event_init ();
+
+	/* Check that sharing a tree gives a single allocation with the
+	 * same structure and state, whose nodes point to the name and
+	 * compiled environment of the original nodes and hold a further
+	 * block on any matched event.
+	 */
+	TEST_FEATURE ("with children");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			oper = event_operator_new (NULL, EVENT_OR, NULL, NULL);
+
+			oper1 = event_operator_new (oper, EVENT_MATCH,
+						    "foo", NULL);
+			oper1->value = TRUE;
+			oper1->event = event_new (oper1, "foo", NULL);
+			event_block (oper1->event);
+			nih_tree_add (&oper->node, &oper1->node,
+				      NIH_TREE_LEFT);
+
+			oper2 = event_operator_new (oper, EVENT_MATCH,
+						    "bar", NULL);
+			NIH_MUST (nih_str_array_add (&oper2->env, oper2,
+						     NULL, "FOO=foo"));
+			nih_tree_add (&oper->node, &oper2->node,
+				      NIH_TREE_RIGHT);
+
+			event_operator_update (oper);
+		}
+
+		share = event_operator_share (NULL, oper);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (share, NULL);
+			TEST_EQ (oper1->event->blockers, 1);
+			nih_free (oper);
+			continue;
+		}
+
+		TEST_ALLOC_SIZE (share, sizeof (EventOperator) * 3);
+		TEST_EQ_P (share->node.parent, NULL);
+		TEST_EQ (share->type, EVENT_OR);
+		TEST_EQ (share->value, TRUE);
+		TEST_EQ_P (share->shape, oper);
+
+		share1 = (EventOperator *)share->node.left;
+		TEST_EQ_P (share1->node.parent, &share->node);
+		TEST_EQ (share1->type, EVENT_MATCH);
+		TEST_EQ (share1->value, TRUE);
+		TEST_EQ_P (share1->name, oper1->name);
+		TEST_EQ_P (share1->shape, oper1);
+		TEST_EQ_P (share1->event, oper1->event);
+		TEST_EQ (share1->event->blockers, 2);
+
+		share2 = (EventOperator *)share->node.right;
+		TEST_EQ_P (share2->node.parent, &share->node);
+		TEST_EQ (share2->type, EVENT_MATCH);
+		TEST_EQ (share2->value, FALSE);
+		TEST_EQ_P (share2->name, oper2->name);
+		TEST_EQ_P (share2->env, oper2->env);
+		TEST_NE_P (oper2->match, NULL);
+		TEST_EQ_P (share2->match, oper2->match);
+		TEST_EQ (share2->match_len, 1);
+		TEST_EQ_P (share2->event, NULL);
+
+		/* The original is kept while the shared tree exists */
+		TEST_FREE_TAG (oper);
+		nih_discard (oper);
+		TEST_NOT_FREE (oper);
+
+		TEST_EQ (oper1->event->blockers, 2);
+
+		nih_free (share);
+
+		TEST_FREE (oper);
+	}
+
+
+	/* Check that events matched by a shared tree change only its
+	 * state, and that freeing it releases them.
+	 */
+	TEST_FEATURE ("with matched event");
+	oper = event_operator_new (NULL, EVENT_AND, NULL, NULL);
+
+	oper1 = event_operator_new (oper, EVENT_MATCH, "foo", NULL);
+	nih_tree_add (&oper->node, &oper1->node, NIH_TREE_LEFT);
+
+	oper2 = event_operator_new (oper, EVENT_MATCH, "bar", NULL);
+	NIH_MUST (nih_str_array_add (&oper2->env, oper2, NULL, "FOO=foo"));
+	nih_tree_add (&oper->node, &oper2->node, NIH_TREE_RIGHT);
+
+	share = event_operator_share (NULL, oper);
+
+	event = event_new (NULL, "bar", NULL);
+	NIH_MUST (nih_str_array_add (&event->env, event, NULL, "FOO=foo"));
+
+	TEST_TRUE (event_operator_handle (share, event, NULL));
+
+	share2 = (EventOperator *)share->node.right;
+	TEST_EQ (share2->value, TRUE);
+	TEST_EQ_P (share2->event, event);
+	TEST_EQ (event->blockers, 1);
+
+	TEST_EQ (share->value, FALSE);
+	TEST_EQ (oper2->value, FALSE);
+	TEST_EQ_P (oper2->event, NULL);
+
+	nih_free (share);
+
+	TEST_EQ (event->blockers, 0);
+
+	nih_free (event);
+	nih_free (oper);
+
+	event_poll ();
+}
+
 void
 test_operator_destroy (void)
 {
@@ -525,12 +650,93 @@ test_operator_update (void)
 	nih_free (oper3);
 }
 
+void
+test_operator_compile (void)
+{
+	EventOperator *oper;
+	char          *env[7];
+	int            ret;
+
+	TEST_FUNCTION ("event_operator_compile");
+
+	/* Check that an operator without environment compiles to
+	 * nothing.
+	 */
+	TEST_FEATURE ("without environment");
+	oper = event_operator_new (NULL, EVENT_MATCH, "foo", NULL);
+
+	ret = event_operator_compile (oper);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ_P (oper->match, NULL);
+	TEST_EQ (oper->match_len, 0);
+
+
+	/* Check that each kind of environment entry is classified into
+	 * the appropriate kind of match.
+	 */
+	TEST_FEATURE ("with environment");
+	oper->env = env;
+	oper->env[0] = "foo";
+	oper->env[1] = "BAR=eth*";
+	oper->env[2] = "BAZ!=b?r";
+	oper->env[3] = "WIBBLE=$FOO";
+	oper->env[4] = "WOBBLE=*";
+	oper->env[5] = "WUBBLE=fo\\*";
+	oper->env[6] = NULL;
+
+	TEST_ALLOC_FAIL {
+		ret = event_operator_compile (oper);
+
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+		TEST_ALLOC_PARENT (oper->match, oper);
+		TEST_EQ (oper->match_len, 6);
+
+		TEST_EQ_P (oper->match[0].str, oper->env[0]);
+		TEST_EQ_P (oper->match[0].key, NULL);
+		TEST_FALSE (oper->match[0].negate);
+		TEST_EQ (oper->match[0].type, EVENT_MATCH_LITERAL);
+		TEST_EQ_STR (oper->match[0].value, "foo");
+		TEST_EQ (oper->match[0].valuelen, 3);
+
+		TEST_EQ_STRN (oper->match[1].key, "BAR");
+		TEST_EQ (oper->match[1].keylen, 3);
+		TEST_FALSE (oper->match[1].negate);
+		TEST_EQ (oper->match[1].type, EVENT_MATCH_PREFIX);
+		TEST_EQ_STR (oper->match[1].value, "eth*");
+		TEST_EQ (oper->match[1].valuelen, 3);
+
+		TEST_EQ_STRN (oper->match[2].key, "BAZ");
+		TEST_EQ (oper->match[2].keylen, 3);
+		TEST_TRUE (oper->match[2].negate);
+		TEST_EQ (oper->match[2].type, EVENT_MATCH_GLOB);
+		TEST_EQ_STR (oper->match[2].value, "b?r");
+
+		TEST_EQ (oper->match[3].type, EVENT_MATCH_EXPAND);
+		TEST_EQ_STR (oper->match[3].value, "$FOO");
+
+		TEST_EQ (oper->match[4].type, EVENT_MATCH_PREFIX);
+		TEST_EQ (oper->match[4].valuelen, 0);
+
+		TEST_EQ (oper->match[5].type, EVENT_MATCH_GLOB);
+	}
+
+	oper->env = NULL;
+	nih_free (oper);
+}
+
 void
 test_operator_match (void)
 {
 	EventOperator *oper;
 	Event         *event;
 	char          *env1[5], *env2[5], *env[4];
+	char           buf[16];
 
 	TEST_FUNCTION ("event_operator_match");
 	event = event_new (NULL, "foo", NULL);
@@ -564,6 +770,7 @@ test_operator_match (void)
 	oper->env[1] = "BILBO=bar";
 	oper->env[2] = "MERRY=baz";
 	oper->env[3] = NULL;
+	event_operator_env_changed (oper);
 
 	TEST_TRUE (event_operator_match (oper, event, NULL));
 
@@ -583,6 +790,7 @@ test_operator_match (void)
 	oper->env[1] = "BILBO=baz";
 	oper->env[2] = "MERRY=bar";
 	oper->env[3] = NULL;
+	event_operator_env_changed (oper);
 
 	TEST_FALSE (event_operator_match (oper, event, NULL));
 
@@ -602,6 +810,7 @@ test_operator_match (void)
 	oper->env[1] = "BILBO!=baz";
 	oper->env[2] = "MERRY=baz";
 	oper->env[3] = NULL;
+	event_operator_env_changed (oper);
 
 	TEST_TRUE (event_operator_match (oper, event, NULL));
 
@@ -621,6 +830,7 @@ test_operator_match (void)
 	oper->env[1] = "BILBO!=bar";
 	oper->env[2] = "MERRY=baz";
 	oper->env[3] = NULL;
+	event_operator_env_changed (oper);
 
 	TEST_FALSE (event_operator_match (oper, event, NULL));
 
@@ -637,6 +847,7 @@ test_operator_match (void)
 	oper->env[0] = "FRODO=foo";
 	oper->env[1] = "BILBO=bar";
 	oper->env[2] = NULL;
+	event_operator_env_changed (oper);
 
 	TEST_TRUE (event_operator_match (oper, event, NULL));
 
@@ -656,6 +867,7 @@ test_operator_match (void)
 	oper->env[1] = "bar";
 	oper->env[2] = "baz";
 	oper->env[3] = NULL;
+	event_operator_env_changed (oper);
 
 	TEST_TRUE (event_operator_match (oper, event, NULL));
 
@@ -675,6 +887,7 @@ test_operator_match (void)
 	oper->env[1] = "baz";
 	oper->env[2] = "bar";
 	oper->env[3] = NULL;
+	event_operator_env_changed (oper);
 
 	TEST_FALSE (event_operator_match (oper, event, NULL));
 
@@ -693,6 +906,7 @@ test_operator_match (void)
 	oper->env[0] = "foo";
 	oper->env[1] = "bar";
 	oper->env[2] = NULL;
+	event_operator_env_changed (oper);
 
 	TEST_TRUE (event_operator_match (oper, event, NULL));
 
@@ -709,6 +923,7 @@ test_operator_match (void)
 	oper->env[1] = "bar";
 	oper->env[2] = "baz";
 	oper->env[3] = NULL;
+	event_operator_env_changed (oper);
 
 	TEST_FALSE (event_operator_match (oper, event, NULL));
 
@@ -728,6 +943,7 @@ test_operator_match (void)
 	oper->env[1] = "FRODO=foo";
 	oper->env[2] = "MERRY=baz";
 	oper->env[3] = NULL;
+	event_operator_env_changed (oper);
 
 	TEST_TRUE (event_operator_match (oper, event, NULL));
 
@@ -748,6 +964,7 @@ test_operator_match (void)
 	oper->env[1] = "bar";
 	oper->env[2] = "PIPPIN=quux";
 	oper->env[3] = NULL;
+	event_operator_env_changed (oper);
 
 	TEST_TRUE (event_operator_match (oper, event, NULL));
 
@@ -762,6 +979,7 @@ test_operator_match (void)
 	oper->env = env2;
 	oper->env[0] = "MERRY=baz";
 	oper->env[1] = NULL;
+	event_operator_env_changed (oper);
 
 	TEST_FALSE (event_operator_match (oper, event, NULL));
 
@@ -776,6 +994,7 @@ test_operator_match (void)
 	oper->env = env2;
 	oper->env[0] = "BILBO=b?r";
 	oper->env[1] = NULL;
+	event_operator_env_changed (oper);
 
 	TEST_TRUE (event_operator_match (oper, event, NULL));
 
@@ -790,9 +1009,93 @@ test_operator_match (void)
 	oper->env = env2;
 	oper->env[0] = "f*";
 	oper->env[1] = NULL;
+	event_operator_env_changed (oper);
+
+	TEST_TRUE (event_operator_match (oper, event, NULL));
+
+
+	/* Check that a value ending in a lone glob matches by prefix. */
+	TEST_FEATURE ("with prefix glob in operator environment");
+	event->env = env1;
+	event->env[0] = "INTERFACE=eth0";
+	event->env[1] = NULL;
+
+	oper->env = env2;
+	oper->env[0] = "INTERFACE=eth*";
+	oper->env[1] = NULL;
+	event_operator_env_changed (oper);
 
 	TEST_TRUE (event_operator_match (oper, event, NULL));
 
+	event->env[0] = "INTERFACE=wlan0";
+
+	TEST_FALSE (event_operator_match (oper, event, NULL));
+
+	event->env[0] = "INTERFACE=et";
+
+	TEST_FALSE (event_operator_match (oper, event, NULL));
+
+
+	/* Check that an escaped glob character is matched literally. */
+	TEST_FEATURE ("with escaped glob in operator environment");
+	event->env = env1;
+	event->env[0] = "INTERFACE=eth*";
+	event->env[1] = NULL;
+
+	oper->env = env2;
+	oper->env[0] = "INTERFACE=eth\\*";
+	oper->env[1] = NULL;
+	event_operator_env_changed (oper);
+
+	TEST_TRUE (event_operator_match (oper, event, NULL));
+
+	event->env[0] = "INTERFACE=eth0";
+
+	TEST_FALSE (event_operator_match (oper, event, NULL));
+
+
+	/* Check that changing the operator environment after it has been
+	 * compiled is noticed.
+	 */
+	TEST_FEATURE ("with environment changed after match");
+	event->env = env1;
+	event->env[0] = "FRODO=foo";
+	event->env[1] = NULL;
+
+	oper->env = env2;
+	oper->env[0] = "FRODO=foo";
+	oper->env[1] = NULL;
+	event_operator_env_changed (oper);
+
+	TEST_TRUE (event_operator_match (oper, event, NULL));
+
+	oper->env[0] = "FRODO=bar";
+	event_operator_env_changed (oper);
+
+	TEST_FALSE (event_operator_match (oper, event, NULL));
+
+
+	/* Check that a string changed in place after the operator has been
+	 * matched is noticed, even though its address is the same.
+	 */
+	TEST_FEATURE ("with environment string reused after match");
+	event->env = env1;
+	event->env[0] = "FRODO=foo";
+	event->env[1] = NULL;
+
+	strcpy (buf, "FRODO=foo");
+	oper->env = env2;
+	oper->env[0] = buf;
+	oper->env[1] = NULL;
+	event_operator_env_changed (oper);
+
+	TEST_TRUE (event_operator_match (oper, event, NULL));
+
+	strcpy (buf, "FRODO=bar");
+	event_operator_env_changed (oper);
+
+	TEST_FALSE (event_operator_match (oper, event, NULL));
+
 
 	/* Check that the operator values may contain variable references
 	 * which will be expanded before match.
@@ -806,6 +1109,7 @@ test_operator_match (void)
 	oper->env = env2;
 	oper->env[0] = "$FOO";
 	oper->env[1] = NULL;
+	event_operator_env_changed (oper);
 
 	env[0] = "FOO=foo";
 	env[1] = NULL;
@@ -824,6 +1128,7 @@ test_operator_match (void)
 	oper->env = env2;
 	oper->env[0] = "$WIBBLE";
 	oper->env[1] = NULL;
+	event_operator_env_changed (oper);
 
 	env[0] = "FOO=foo";
 	env[1] = NULL;
@@ -836,6 +1141,106 @@ test_operator_match (void)
 }
 
 
+void
+test_operator_may_match (void)
+{
+	EventOperator *root, *oper1, *oper2, *shared;
+	Event         *event, *other;
+	char          *env1[3], *env2[3];
+
+	TEST_FUNCTION ("event_operator_may_match");
+	event = event_new (NULL, "foo", NULL);
+	event->env = env1;
+	event->env[0] = "FRODO=foo";
+	event->env[1] = "BILBO=bar";
+	event->env[2] = NULL;
+
+	root = event_operator_new (NULL, EVENT_OR, NULL, NULL);
+	oper1 = event_operator_new (root, EVENT_MATCH, "bar", NULL);
+	nih_tree_add (&root->node, &oper1->node, NIH_TREE_LEFT);
+	oper2 = event_operator_new (root, EVENT_MATCH, "foo", NULL);
+	nih_tree_add (&root->node, &oper2->node, NIH_TREE_RIGHT);
+
+
+	/* Check that a tree with no node for the event can't match it. */
+	TEST_FEATURE ("with different name");
+	other = event_new (NULL, "baz", NULL);
+
+	TEST_FALSE (event_operator_may_match (root, other));
+
+	nih_free (other);
+
+
+	/* Check that a node whose environment has yet to be compiled is
+	 * assumed to match, since compiling it would allocate.
+	 */
+	TEST_FEATURE ("with uncompiled environment");
+	oper2->env = env2;
+	oper2->env[0] = "FRODO=foo";
+	oper2->env[1] = "BILBO=baz";
+	oper2->env[2] = NULL;
+	event_operator_env_changed (oper2);
+
+	TEST_TRUE (event_operator_may_match (root, event));
+
+
+	/* Check that a compiled node whose environment doesn't match the
+	 * event can't match it.
+	 */
+	TEST_FEATURE ("with compiled environment that doesn't match");
+	TEST_EQ (event_operator_compile (oper2), 0);
+
+	TEST_FALSE (event_operator_may_match (root, event));
+
+
+	/* Check that a compiled node whose environment matches the event
+	 * may match it, whatever its value.
+	 */
+	TEST_FEATURE ("with compiled environment that matches");
+	oper2->env[1] = "BILBO=b*";
+	TEST_EQ (event_operator_compile (oper2), 0);
+	oper2->value = TRUE;
+
+	TEST_TRUE (event_operator_may_match (root, event));
+
+	oper2->value = FALSE;
+
+
+	/* Check that a node whose environment needs expanding is assumed
+	 * to match.
+	 */
+	TEST_FEATURE ("with environment needing expansion");
+	oper2->env[1] = "BILBO=$WIBBLE";
+	TEST_EQ (event_operator_compile (oper2), 0);
+
+	TEST_TRUE (event_operator_may_match (root, event));
+
+
+	/* Check that the nodes of a shared tree are checked against the
+	 * compiled environment of their shape.
+	 */
+	TEST_FEATURE ("with shared tree");
+	oper2->env[1] = "BILBO=baz";
+	TEST_EQ (event_operator_compile (oper2), 0);
+
+	shared = event_operator_share (NULL, root);
+	TEST_NE_P (shared, NULL);
+
+	TEST_FALSE (event_operator_may_match (shared, event));
+
+	oper2->env[1] = "BILBO=bar";
+	TEST_EQ (event_operator_compile (oper2), 0);
+
+	TEST_TRUE (event_operator_may_match (shared, event));
+
+	nih_free (shared);
+	nih_free (root);
+
+	event->env = NULL;
+	nih_free (event);
+}
+
+
 void
 test_operator_handle (void)
 {
@@ -975,6 +1380,34 @@ test_operator_handle (void)
 
 	TEST_EQ (event->blockers, 1);
 
+	event_operator_reset (oper1);
+
+
+	/* Check that each operator has been summarised with the names of
+	 * the events in the tree below it, and that an event named by
+	 * one branch of the tree leaves the other alone.
+	 */
+	TEST_FEATURE ("with summary of event names");
+	TEST_NE (oper3->names, 0);
+	TEST_EQ (oper2->names, oper3->names | oper4->names);
+	TEST_EQ (oper1->names, oper2->names | oper5->names);
+
+	oper2->value = TRUE;
+
+	event = event_new (NULL, "baz", NULL);
+	event->env = env2;
+	ret = event_operator_handle (oper1, event, env);
+
+	TEST_EQ (ret, TRUE);
+	TEST_EQ (oper1->value, TRUE);
+	TEST_EQ (oper5->value, TRUE);
+
+	if ((oper2->names & oper5->names) != oper5->names) {
+		TEST_EQ (oper2->value, TRUE);
+	}
+
+	oper2->value = FALSE;
+
 
 	event_operator_reset (oper1);
 
@@ -1323,6 +1756,65 @@ test_operator_reset (void)
 	event_poll ();
 }
 
+void
+test_operator_job (void)
+{
+	EventOperator *oper;
+	char         **env;
+
+	TEST_FUNCTION ("event_operator_job");
+
+	/* Check that the job is found from the first positional argument
+	 * of a job event, which may be a pattern.
+	 */
+	TEST_FEATURE ("with positional argument");
+	env = NIH_MUST (nih_str_array_new (NULL));
+	NIH_MUST (nih_str_array_add (&env, NULL, NULL, "foo*"));
+	NIH_MUST (nih_str_array_add (&env, NULL, NULL, "INSTANCE=bar"));
+
+	oper = event_operator_new (NULL, EVENT_MATCH, "started", env);
+	nih_discard (env);
+
+	TEST_EQ_STR (event_operator_job (oper), "foo*");
+
+	nih_free (oper);
+
+
+	/* Check that the job is found from the JOB variable. */
+	TEST_FEATURE ("with JOB variable");
+	env = NIH_MUST (nih_str_array_new (NULL));
+	NIH_MUST (nih_str_array_add (&env, NULL, NULL, "RESULT=ok"));
+	NIH_MUST (nih_str_array_add (&env, NULL, NULL, "JOB=foo"));
+
+	oper = event_operator_new (NULL, EVENT_MATCH, "stopped", env);
+	nih_discard (env);
+
+	TEST_EQ_STR (event_operator_job (oper), "foo");
+
+	nih_free (oper);
+
+
+	/* Check that no job is found for other events, or for a job
+	 * event that doesn't name one.
+	 */
+	TEST_FEATURE ("with other event");
+	env = NIH_MUST (nih_str_array_new (NULL));
+	NIH_MUST (nih_str_array_add (&env, NULL, NULL, "foo"));
+
+	oper = event_operator_new (NULL, EVENT_MATCH, "runlevel", env);
+	nih_discard (env);
+
+	TEST_EQ_P (event_operator_job (oper), NULL);
+
+	nih_free (oper);
+
+	oper = event_operator_new (NULL, EVENT_MATCH, "starting", NULL);
+
+	TEST_EQ_P (event_operator_job (oper), NULL);
+
+	nih_free (oper);
+}
+
 void
 test_operator_serialisation (void)
 {
@@ -1441,13 +1933,17 @@ main (int   argc,
 
 	test_operator_new ();
 	test_operator_copy ();
+	test_operator_share ();
 	test_operator_destroy ();
 	test_operator_update ();
+	test_operator_compile ();
 	test_operator_match ();
+	test_operator_may_match ();
 	test_operator_handle ();
 	test_operator_environment ();
 	test_operator_events ();
 	test_operator_reset ();
+	test_operator_job ();
 	test_operator_serialisation ();
 
 	return 0;
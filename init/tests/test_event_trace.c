@@ -0,0 +1,263 @@
+/* upstart
+ *
+ * test_event_trace.c - test suite for init/event_trace.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <nih/test.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/main.h>
+#include <nih/error.h>
+
+#include "event.h"
+#include "job_class.h"
+#include "job.h"
+#include "event_trace.h"
+#include "errors.h"
+
+
+/**
+ * write_trace:
+ * @filename: file to write,
+ * @contents: contents of file.
+ *
+ * Replaces @filename with @contents.
+ **/
+static void
+write_trace (const char *filename,
+	     const char *contents)
+{
+	FILE *file;
+
+	file = fopen (filename, "w");
+	assert (file != NULL);
+	assert (fputs (contents, file) >= 0);
+	assert0 (fclose (file));
+}
+
+
+void
+test_open (void)
+{
+	EventTraceRecord *record;
+	NihList          *records;
+	JobClass         *class;
+	Job              *job;
+	Event            *event;
+	char            **env;
+	char              filename[PATH_MAX];
+
+	TEST_FUNCTION ("event_trace_open");
+	TEST_FILENAME (filename);
+
+	class = job_class_new (NULL, "test", NULL);
+	job = job_new (class, "foo");
+
+	/* Check that events and job state changes are written to the
+	 * trace in order once it's flushed, and read back the same,
+	 * including their environment with characters that have to be
+	 * escaped.
+	 */
+	TEST_FEATURE ("with events and jobs");
+	TEST_EQ (event_trace_open (filename, FALSE), 0);
+
+	env = NIH_MUST (nih_str_array_new (NULL));
+	NIH_MUST (nih_str_array_add (&env, NULL, NULL, "FOO=BAR"));
+	NIH_MUST (nih_str_array_add (&env, NULL, NULL,
+				     "BAZ=tab\there\nnew\\line"));
+
+	event = event_new (NULL, "test", env);
+	event_trace_event (event);
+	nih_free (event);
+
+	event_trace_job (job, JOB_WAITING, JOB_STARTING);
+
+	event_trace_flush (NULL, NULL);
+
+	records = event_trace_load (NULL, filename);
+	TEST_NE_P (records, NULL);
+	TEST_LIST_NOT_EMPTY (records);
+
+	record = (EventTraceRecord *)records->next;
+	TEST_EQ (record->type, EVENT_TRACE_EVENT);
+	TEST_NE (record->time, 0);
+	TEST_EQ_STR (record->name, "test");
+	TEST_EQ_P (record->session, NULL);
+	TEST_NE_P (record->env, NULL);
+	TEST_EQ_STR (record->env[0], "FOO=BAR");
+	TEST_EQ_STR (record->env[1], "BAZ=tab\there\nnew\\line");
+	TEST_EQ_P (record->env[2], NULL);
+
+	record = (EventTraceRecord *)record->entry.next;
+	TEST_EQ (record->type, EVENT_TRACE_JOB);
+	TEST_EQ_STR (record->name, "test");
+	TEST_EQ_STR (record->instance, "foo");
+	TEST_EQ (record->old_state, JOB_WAITING);
+	TEST_EQ (record->state, JOB_STARTING);
+
+	TEST_EQ_P (record->entry.next, records);
+
+	nih_free (records);
+
+
+	/* Check that a trace continued over a re-exec is appended to,
+	 * without a second header.
+	 */
+	TEST_FEATURE ("with append");
+	event_trace_close ();
+
+	TEST_EQ (event_trace_open (filename, TRUE), 0);
+	event_trace_job (job, JOB_STARTING, JOB_PRE_STARTING);
+	event_trace_close ();
+
+	records = event_trace_load (NULL, filename);
+	TEST_NE_P (records, NULL);
+
+	record = (EventTraceRecord *)records->prev;
+	TEST_EQ (record->type, EVENT_TRACE_JOB);
+	TEST_EQ (record->old_state, JOB_STARTING);
+	TEST_EQ (record->state, JOB_PRE_STARTING);
+
+	record = (EventTraceRecord *)record->entry.prev;
+	TEST_EQ (record->type, EVENT_TRACE_JOB);
+	TEST_EQ (record->state, JOB_STARTING);
+
+	nih_free (records);
+
+
+	/* Check that a trace that isn't being continued is replaced. */
+	TEST_FEATURE ("with existing trace");
+	TEST_EQ (event_trace_open (filename, FALSE), 0);
+	event_trace_close ();
+
+	records = event_trace_load (NULL, filename);
+	TEST_NE_P (records, NULL);
+	TEST_LIST_EMPTY (records);
+
+	nih_free (records);
+
+
+	/* Check that nothing is written once the trace is closed. */
+	TEST_FEATURE ("with closed trace");
+	event_trace_job (job, JOB_PRE_STARTING, JOB_PRE_START);
+	event_trace_flush (NULL, NULL);
+
+	records = event_trace_load (NULL, filename);
+	TEST_NE_P (records, NULL);
+	TEST_LIST_EMPTY (records);
+
+	nih_free (records);
+
+	unlink (filename);
+	nih_free (class);
+}
+
+void
+test_load (void)
+{
+	EventTraceRecord *record;
+	NihList          *records;
+	NihError         *err;
+	char              filename[PATH_MAX];
+
+	TEST_FUNCTION ("event_trace_load");
+	TEST_FILENAME (filename);
+
+	/* Check that a trace that doesn't exist raises a system error. */
+	TEST_FEATURE ("with missing trace");
+	records = event_trace_load (NULL, filename);
+	TEST_EQ_P (records, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, ENOENT);
+	nih_free (err);
+
+
+	/* Check that a file without the header is rejected. */
+	TEST_FEATURE ("with missing header");
+	write_trace (filename, "E\t1\t\ttest\n");
+
+	records = event_trace_load (NULL, filename);
+	TEST_EQ_P (records, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, EVENT_TRACE_ILLEGAL);
+	nih_free (err);
+
+
+	/* Check that a record of an unknown state is rejected. */
+	TEST_FEATURE ("with illegal record");
+	write_trace (filename, EVENT_TRACE_HEADER "\n"
+		     "J\t1\ttest\t\twaiting\tunknown\n"
+		     "E\t2\t\ttest\n");
+
+	records = event_trace_load (NULL, filename);
+	TEST_EQ_P (records, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, EVENT_TRACE_ILLEGAL);
+	nih_free (err);
+
+
+	/* Check that a last record cut short is ignored, keeping the
+	 * records before it.
+	 */
+	TEST_FEATURE ("with truncated record");
+	write_trace (filename, EVENT_TRACE_HEADER "\n"
+		     "E\t1\t/chroot\ttest\tFOO=BAR\n"
+		     "J\t2\ttest\t\twaiting\t");
+
+	records = event_trace_load (NULL, filename);
+	TEST_NE_P (records, NULL);
+
+	record = (EventTraceRecord *)records->next;
+	TEST_EQ (record->type, EVENT_TRACE_EVENT);
+	TEST_EQ (record->time, 1);
+	TEST_EQ_STR (record->session, "/chroot");
+	TEST_EQ_STR (record->name, "test");
+
+	TEST_EQ_P (record->entry.next, records);
+
+	nih_free (records);
+
+	unlink (filename);
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	/* run tests in legacy (pre-session support) mode */
+	setenv ("UPSTART_NO_SESSIONS", "1", 1);
+
+	nih_main_init (argv[0]);
+
+	test_open ();
+	test_load ();
+
+	return 0;
+}
@@ -0,0 +1,177 @@
+/* upstart
+ *
+ * test_hash_table.c - test suite for init/hash_table.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <nih/test.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/main.h>
+
+#include "hash_table.h"
+
+
+/**
+ * add_entry:
+ * @hash: hash table to add to,
+ * @name: key of entry.
+ *
+ * Returns: new entry added to @hash with hash_table_add().
+ **/
+static NihListEntry *
+add_entry (NihHash    *hash,
+	   const char *name)
+{
+	NihListEntry *entry;
+
+	entry = NIH_MUST (nih_list_entry_new (hash));
+	entry->str = NIH_MUST (nih_strdup (entry, name));
+
+	hash_table_add (hash, &entry->entry);
+
+	return entry;
+}
+
+/**
+ * count_entries:
+ * @hash: hash table.
+ *
+ * Returns: number of entries in @hash.
+ **/
+static size_t
+count_entries (NihHash *hash)
+{
+	size_t len = 0;
+
+	NIH_HASH_FOREACH (hash, iter)
+		len++;
+
+	return len;
+}
+
+
+void
+test_add (void)
+{
+	NihHash      *hash;
+	NihListEntry *entry;
+	NihListEntry *first = NULL;
+	NihListEntry *second = NULL;
+	size_t        size;
+	char          name[16];
+
+	TEST_FUNCTION ("hash_table_add");
+
+	/* Check that a table with fewer entries than bins isn't grown. */
+	TEST_FEATURE ("with few entries");
+	hash = NIH_MUST (nih_hash_string_new (NULL, 0));
+	size = hash->size;
+
+	for (int i = 0; i < 4; i++) {
+		sprintf (name, "job%d", i);
+		add_entry (hash, name);
+	}
+
+	hash_table_grow_pending (NULL, NULL);
+
+	TEST_EQ (hash->size, size);
+	TEST_EQ (count_entries (hash), 4);
+
+	nih_free (hash);
+
+
+	/* Check that a table whose bins have filled up isn't grown while
+	 * entries are being added, but is once pending tables are grown,
+	 * with every entry still found and the order of entries with the
+	 * same key kept.
+	 */
+	TEST_FEATURE ("with many entries");
+	hash = NIH_MUST (nih_hash_string_new (NULL, 0));
+	size = hash->size;
+
+	for (int i = 0; i < 1000; i++) {
+		sprintf (name, "job%d", i);
+		entry = add_entry (hash, name);
+
+		if (i == 500) {
+			first = entry;
+			second = add_entry (hash, name);
+		}
+	}
+
+	TEST_EQ (hash->size, size);
+
+	hash_table_grow_pending (NULL, NULL);
+
+	TEST_GE (hash->size, 1001);
+	TEST_EQ (count_entries (hash), 1001);
+
+	for (int i = 0; i < 1000; i++) {
+		sprintf (name, "job%d", i);
+
+		entry = (NihListEntry *)nih_hash_lookup (hash, name);
+		TEST_NE_P (entry, NULL);
+		TEST_EQ_STR (entry->str, name);
+	}
+
+	TEST_EQ_P (nih_hash_lookup (hash, "job500"), &first->entry);
+	TEST_EQ_P (nih_hash_search (hash, "job500", &first->entry),
+		   &second->entry);
+
+
+	/* Check that a table that has already been grown isn't grown
+	 * again until it fills up.
+	 */
+	TEST_FEATURE ("with grown table");
+	size = hash->size;
+
+	TEST_FALSE (hash_table_grow (hash));
+	TEST_EQ (hash->size, size);
+
+
+	/* Check that a table freed while waiting to be grown is forgotten. */
+	TEST_FEATURE ("with freed table");
+	for (int i = 1000; i < 10000; i++) {
+		sprintf (name, "job%d", i);
+		add_entry (hash, name);
+	}
+
+	nih_free (hash);
+
+	hash_table_grow_pending (NULL, NULL);
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	/* run tests in legacy (pre-session support) mode */
+	setenv ("UPSTART_NO_SESSIONS", "1", 1);
+
+	nih_main_init (argv[0]);
+
+	test_add ();
+
+	return 0;
+}
@@ -50,6 +50,7 @@
 
 #include "dbus/upstart.h"
 
+#include "environ.h"
 #include "process.h"
 #include "job_process.h"
 #include "job_class.h"
@@ -60,6 +61,7 @@
 #include "conf.h"
 #include "control.h"
 #include "state.h"
+#include "metrics.h"
 #include "test_util_common.h"
 
 void
@@ -212,9 +214,9 @@ test_new (void)
 	}
 
 
-	/* Check that when a D-Bus connection is open, the new instance
-	 * is registered on that connection as an object and the InstanceAdded
-	 * signal is emitted.
+	/* Check that when a D-Bus connection is open, the InstanceAdded
+	 * signal is emitted on that connection for the new instance, but
+	 * that no object is registered for it.
 	 */
 	TEST_FEATURE ("with D-Bus connection");
 	dbus_error_init (&dbus_error);
@@ -249,10 +251,7 @@ test_new (void)
 	TEST_TRUE (dbus_connection_get_object_path_data (conn,
 							 job->path,
 							 (void **)&object));
-
-	TEST_ALLOC_SIZE (object, sizeof (NihDBusObject));
-	TEST_EQ_STR (object->path, job->path);
-	TEST_EQ_P (object->data, job);
+	TEST_EQ_P (object, NULL);
 
 	dbus_connection_flush (conn);
 
@@ -312,8 +311,9 @@ test_register (void)
 	assert (! dbus_error_is_set (&dbus_error));
 
 
-	/* Check that we can register an existing job instance on the bus
-	 * using its path, and have a InstanceAdded signal emitted.
+	/* Check that we can announce an existing job instance on the bus
+	 * by its path with an InstanceAdded signal, without an object
+	 * being registered for it.
 	 */
 	TEST_FEATURE ("with signal emission");
 	class = job_class_new (NULL, "test", NULL);
@@ -328,10 +328,7 @@ test_register (void)
 	TEST_TRUE (dbus_connection_get_object_path_data (conn,
 							 job->path,
 							 (void **)&object));
-
-	TEST_ALLOC_SIZE (object, sizeof (NihDBusObject));
-	TEST_EQ_STR (object->path, job->path);
-	TEST_EQ_P (object->data, job);
+	TEST_EQ_P (object, NULL);
 
 	dbus_connection_flush (conn);
 
@@ -352,8 +349,8 @@ test_register (void)
 	nih_free (class);
 
 
-	/* Check that we can suppress signal emission, but that the instance
-	 * is still registered.
+	/* Check that we can suppress signal emission, in which case nothing
+	 * is done.
 	 */
 	TEST_FEATURE ("without signal emission");
 	class = job_class_new (NULL, "test", NULL);
@@ -368,10 +365,7 @@ test_register (void)
 	TEST_TRUE (dbus_connection_get_object_path_data (conn,
 							 job->path,
 							 (void **)&object));
-
-	TEST_ALLOC_SIZE (object, sizeof (NihDBusObject));
-	TEST_EQ_STR (object->path, job->path);
-	TEST_EQ_P (object->data, job);
+	TEST_EQ_P (object, NULL);
 
 	message = dbus_message_new_signal ("/", "com.ubuntu.Upstart.Test",
 					   "TestPassed");
@@ -399,6 +393,191 @@ test_register (void)
 }
 
 
+/**
+ * call_instance:
+ * @conn: connection with the fallback registered,
+ * @client_conn: connection to call from,
+ * @message: method call to make.
+ *
+ * Send @message from @client_conn to @conn, dispatching it there, and
+ * wait for the reply.
+ *
+ * Returns: reply received by @client_conn.
+ **/
+static DBusMessage *
+call_instance (DBusConnection *conn,
+	       DBusConnection *client_conn,
+	       DBusMessage    *message)
+{
+	DBusMessage   *reply = NULL;
+	dbus_uint32_t  serial;
+
+	assert (dbus_connection_send (client_conn, message, &serial));
+	dbus_connection_flush (client_conn);
+
+	while (! reply) {
+		DBusMessage *msg;
+
+		dbus_connection_read_write_dispatch (conn, 100);
+		dbus_connection_flush (conn);
+
+		dbus_connection_read_write (client_conn, 100);
+		msg = dbus_connection_pop_message (client_conn);
+		if (! msg)
+			continue;
+
+		if (dbus_message_get_reply_serial (msg) == serial) {
+			reply = msg;
+		} else {
+			dbus_message_unref (msg);
+		}
+	}
+
+	return reply;
+}
+
+void
+test_register_fallback (void)
+{
+	pid_t            dbus_pid;
+	DBusConnection  *conn, *client_conn;
+	DBusMessage     *message, *reply;
+	DBusMessageIter  iter, subiter;
+	JobClass        *class;
+	Job             *job;
+	const char      *interface = DBUS_INTERFACE_UPSTART_INSTANCE;
+	const char      *property = "name";
+	const char      *str;
+	nih_local char  *path = NULL;
+
+	TEST_FUNCTION ("job_register_fallback");
+	job_class_init ();
+	control_init ();
+
+	TEST_DBUS (dbus_pid);
+	TEST_DBUS_OPEN (conn);
+	TEST_DBUS_OPEN (client_conn);
+
+	class = job_class_new (NULL, "test", NULL);
+	nih_hash_add (job_classes, &class->entry);
+
+	job = job_new (class, "fred");
+	path = NIH_MUST (nih_strdup (NULL, job->path));
+
+	job_register_fallback (conn);
+
+
+	/* Check that the instance is found by its path, and that a path
+	 * only beginning with it is not.
+	 */
+	TEST_FEATURE ("with path of instance");
+	TEST_EQ_P (job_find_by_path (path), job);
+	TEST_EQ_P (job_find_by_path (DBUS_PATH_UPSTART "/jobs/test"), NULL);
+	TEST_EQ_P (job_find_by_path (DBUS_PATH_UPSTART "/jobs/test/fre"), NULL);
+
+
+	/* Check that a property of the instance can be read through the
+	 * fallback, as if the instance had an object of its own.
+	 */
+	TEST_FEATURE ("with property");
+	message = dbus_message_new_method_call (dbus_bus_get_unique_name (conn),
+						path, DBUS_INTERFACE_PROPERTIES,
+						"Get");
+	assert (message != NULL);
+	assert (dbus_message_append_args (message,
+					  DBUS_TYPE_STRING, &interface,
+					  DBUS_TYPE_STRING, &property,
+					  DBUS_TYPE_INVALID));
+
+	reply = call_instance (conn, client_conn, message);
+	dbus_message_unref (message);
+
+	TEST_EQ (dbus_message_get_type (reply), DBUS_MESSAGE_TYPE_METHOD_RETURN);
+
+	dbus_message_iter_init (reply, &iter);
+	TEST_EQ (dbus_message_iter_get_arg_type (&iter), DBUS_TYPE_VARIANT);
+
+	dbus_message_iter_recurse (&iter, &subiter);
+	TEST_EQ (dbus_message_iter_get_arg_type (&subiter), DBUS_TYPE_STRING);
+
+	dbus_message_iter_get_basic (&subiter, &str);
+	TEST_EQ_STR (str, "fred");
+
+	dbus_message_unref (reply);
+
+
+	/* Check that a method of the instance can be called through the
+	 * fallback.
+	 */
+	TEST_FEATURE ("with method");
+	message = dbus_message_new_method_call (dbus_bus_get_unique_name (conn),
+						path,
+						DBUS_INTERFACE_UPSTART_INSTANCE,
+						"GetTimings");
+	assert (message != NULL);
+
+	reply = call_instance (conn, client_conn, message);
+	dbus_message_unref (message);
+
+	TEST_EQ (dbus_message_get_type (reply), DBUS_MESSAGE_TYPE_METHOD_RETURN);
+
+	dbus_message_unref (reply);
+
+
+	/* Check that the instance can be introspected through the
+	 * fallback.
+	 */
+	TEST_FEATURE ("with introspection");
+	message = dbus_message_new_method_call (dbus_bus_get_unique_name (conn),
+						path,
+						DBUS_INTERFACE_INTROSPECTABLE,
+						"Introspect");
+	assert (message != NULL);
+
+	reply = call_instance (conn, client_conn, message);
+	dbus_message_unref (message);
+
+	TEST_EQ (dbus_message_get_type (reply), DBUS_MESSAGE_TYPE_METHOD_RETURN);
+	TEST_TRUE (dbus_message_get_args (reply, NULL,
+					  DBUS_TYPE_STRING, &str,
+					  DBUS_TYPE_INVALID));
+	TEST_TRUE (strstr (str, "<interface name=\""
+			   DBUS_INTERFACE_UPSTART_INSTANCE "\">") != NULL);
+
+	dbus_message_unref (reply);
+
+
+	/* Check that once the instance has been freed, calls to its path
+	 * result in an error.
+	 */
+	TEST_FEATURE ("with freed instance");
+	nih_free (job);
+
+	TEST_EQ_P (job_find_by_path (path), NULL);
+
+	message = dbus_message_new_method_call (dbus_bus_get_unique_name (conn),
+						path,
+						DBUS_INTERFACE_UPSTART_INSTANCE,
+						"GetTimings");
+	assert (message != NULL);
+
+	reply = call_instance (conn, client_conn, message);
+	dbus_message_unref (message);
+
+	TEST_EQ (dbus_message_get_type (reply), DBUS_MESSAGE_TYPE_ERROR);
+
+	dbus_message_unref (reply);
+
+	nih_free (class);
+
+	TEST_DBUS_CLOSE (conn);
+	TEST_DBUS_CLOSE (client_conn);
+	TEST_DBUS_END (dbus_pid);
+
+	dbus_shutdown ();
+}
+
+
 void
 test_change_goal (void)
 {
@@ -533,7 +712,7 @@ test_change_goal (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_KILLED;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		job_change_goal (job, JOB_START);
 
@@ -558,7 +737,7 @@ test_change_goal (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		job_change_goal (job, JOB_START);
 
@@ -583,7 +762,7 @@ test_change_goal (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		job_change_goal (job, JOB_STOP);
 
@@ -653,7 +832,7 @@ test_change_goal (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_PRE_START;
-		job->pid[PROCESS_PRE_START] = 1;
+		job_process_set_pid (job, PROCESS_PRE_START, 1);
 
 		job_change_goal (job, JOB_STOP);
 
@@ -1066,7 +1245,7 @@ test_change_state (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SECURITY;
-		job->pid[PROCESS_PRE_START] = 0;
+		job_process_set_pid (job, PROCESS_PRE_START, 0);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -1133,7 +1312,7 @@ test_change_state (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SECURITY;
-		job->pid[PROCESS_MAIN] = 0;
+		job_process_set_pid (job, PROCESS_MAIN, 0);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -1209,7 +1388,7 @@ test_change_state (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SECURITY;
-		job->pid[PROCESS_PRE_START] = 0;
+		job_process_set_pid (job, PROCESS_PRE_START, 0);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -1297,7 +1476,7 @@ test_change_state (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_PRE_START;
-		job->pid[PROCESS_MAIN] = 0;
+		job_process_set_pid (job, PROCESS_MAIN, 0);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -1367,7 +1546,7 @@ test_change_state (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_PRE_START;
-		job->pid[PROCESS_MAIN] = 0;
+		job_process_set_pid (job, PROCESS_MAIN, 0);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -1449,7 +1628,7 @@ test_change_state (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_PRE_START;
-		job->pid[PROCESS_MAIN] = 0;
+		job_process_set_pid (job, PROCESS_MAIN, 0);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -1590,7 +1769,7 @@ test_change_state (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_PRE_START;
-		job->pid[PROCESS_MAIN] = 0;
+		job_process_set_pid (job, PROCESS_MAIN, 0);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -1679,7 +1858,7 @@ test_change_state (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_PRE_START;
-		job->pid[PROCESS_MAIN] = 0;
+		job_process_set_pid (job, PROCESS_MAIN, 0);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -1747,8 +1926,8 @@ test_change_state (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_POST_START] = 0;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_POST_START, 0);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -1815,7 +1994,7 @@ test_change_state (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -1879,7 +2058,7 @@ test_change_state (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -1951,7 +2130,7 @@ test_change_state (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_POST_START;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -2012,7 +2191,7 @@ test_change_state (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_POST_START;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -2080,8 +2259,8 @@ test_change_state (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_PRE_STOP] = 0;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_PRE_STOP, 0);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -2148,7 +2327,7 @@ test_change_state (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -2221,7 +2400,7 @@ test_change_state (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -2306,7 +2485,7 @@ test_change_state (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -2387,7 +2566,7 @@ test_change_state (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -3061,7 +3240,7 @@ test_change_state (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_STOPPING;
-		job->pid[PROCESS_POST_STOP] = 0;
+		job_process_set_pid (job, PROCESS_POST_STOP, 0);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -3125,7 +3304,7 @@ test_change_state (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_KILLED;
-		job->pid[PROCESS_POST_STOP] = 0;
+		job_process_set_pid (job, PROCESS_POST_STOP, 0);
 
 		job->blocker = NULL;
 		cause->failed = FALSE;
@@ -3792,6 +3971,7 @@ test_change_state (void)
 			source = conf_source_new (NULL, "/tmp", CONF_JOB_DIR);
 			file = conf_file_new (source, "/tmp/test");
 			file->job = job_class_new (NULL, "test", NULL);
+			conf_file_index (file);
 			replacement = file->job;
 
 			job = job_new (class, "");
@@ -3861,6 +4041,7 @@ test_change_state (void)
 			source = conf_source_new (NULL, "/tmp", CONF_JOB_DIR);
 			file = conf_file_new (source, "/tmp/test");
 			file->job = job_class_new (NULL, "test", NULL);
+			conf_file_index (file);
 			replacement = file->job;
 
 			job = job_new (class, "");
@@ -3938,6 +4119,7 @@ test_change_state (void)
 	source = conf_source_new (NULL, "/tmp", CONF_JOB_DIR);
 	file = conf_file_new (source, "/tmp/test");
 	file->job = job_class_new (NULL, "test", NULL);
+	conf_file_index (file);
 	replacement = file->job;
 
 	class->deleted = TRUE;
@@ -4003,6 +4185,159 @@ test_change_state (void)
 	event_poll ();
 }
 
+void
+test_recycle (void)
+{
+	JobClass      *class;
+	Job           *job, *other;
+	EventOperator *stop_on;
+	pid_t         *pid;
+	Job           *jobs[JOB_RECYCLE_MAX + 1];
+
+	TEST_FUNCTION ("job_recycle");
+	nih_error_init ();
+	event_init ();
+	metrics_reset ();
+
+	job_recycling = TRUE;
+
+	class = job_class_new (NULL, "test", NULL);
+	class->stop_on = event_operator_new (class, EVENT_MATCH,
+					     "wibble", NULL);
+
+
+	/* Check that an instance that has finished with nothing left
+	 * outstanding is kept by its class rather than being freed, with
+	 * its name dropped and no longer among the instances.
+	 */
+	TEST_FEATURE ("with finished instance");
+	job = job_new (class, "foo");
+	stop_on = job->stop_on;
+	pid = job->pid;
+
+	job->goal = JOB_STOP;
+	job->state = JOB_POST_STOP;
+
+	TEST_FREE_TAG (job);
+
+	job_change_state (job, JOB_WAITING);
+
+	TEST_NOT_FREE (job);
+	TEST_EQ (class->recycled_len, 1);
+	TEST_EQ_P (class->recycled.next, &job->entry);
+	TEST_EQ_P (job->name, NULL);
+	TEST_EQ_P (job->path, NULL);
+	TEST_EQ_P (nih_hash_lookup (class->instances, "foo"), NULL);
+	TEST_EQ (metrics_counters[METRICS_JOBS_RECYCLED], 1);
+
+	while (! NIH_LIST_EMPTY (events))
+		nih_free (events->next);
+
+
+	/* Check that the next instance of the class is given the kept
+	 * structure, with its arrays and stop on tree, set up afresh.
+	 */
+	TEST_FEATURE ("with recycled instance");
+	other = job_new (class, "bar");
+
+	TEST_EQ_P (other, job);
+	TEST_EQ (class->recycled_len, 0);
+	TEST_LIST_EMPTY (&class->recycled);
+	TEST_EQ_STR (job->name, "bar");
+	TEST_EQ_STR (job->path, DBUS_PATH_UPSTART "/jobs/test/bar");
+	TEST_EQ_P (job->stop_on, stop_on);
+	TEST_EQ_P (job->pid, pid);
+	TEST_EQ (job->goal, JOB_STOP);
+	TEST_EQ (job->state, JOB_WAITING);
+	TEST_EQ_P (job->env, NULL);
+	for (int i = 0; i < PROCESS_LAST; i++) {
+		TEST_EQ (job->pid[i], 0);
+		TEST_EQ_P (job->log[i], NULL);
+		TEST_EQ_P (job->process_data[i], NULL);
+	}
+	TEST_EQ_P (nih_hash_lookup (class->instances, "bar"), job);
+	TEST_EQ (metrics_counters[METRICS_JOBS_REUSED], 1);
+
+
+	/* Check that an instance with a process still running is freed
+	 * rather than kept.
+	 */
+	TEST_FEATURE ("with outstanding process");
+	job->goal = JOB_STOP;
+	job->state = JOB_POST_STOP;
+	job->pid[PROCESS_MAIN] = 1;
+
+	TEST_FREE_TAG (job);
+
+	job_change_state (job, JOB_WAITING);
+
+	TEST_FREE (job);
+	TEST_EQ (class->recycled_len, 0);
+
+	while (! NIH_LIST_EMPTY (events))
+		nih_free (events->next);
+
+
+	/* Check that no more than JOB_RECYCLE_MAX instances of a class
+	 * are kept.
+	 */
+	TEST_FEATURE ("with many finished instances");
+	for (int i = 0; i < JOB_RECYCLE_MAX + 1; i++) {
+		char name[16];
+
+		sprintf (name, "%d", i);
+		jobs[i] = job_new (class, name);
+	}
+
+	for (int i = 0; i < JOB_RECYCLE_MAX + 1; i++) {
+		job = jobs[i];
+		job->goal = JOB_STOP;
+		job->state = JOB_POST_STOP;
+
+		TEST_FREE_TAG (job);
+
+		job_change_state (job, JOB_WAITING);
+
+		if (i < JOB_RECYCLE_MAX) {
+			TEST_NOT_FREE (job);
+		} else {
+			TEST_FREE (job);
+		}
+	}
+
+	TEST_EQ (class->recycled_len, JOB_RECYCLE_MAX);
+
+	while (! NIH_LIST_EMPTY (events))
+		nih_free (events->next);
+
+
+	/* Check that finished instances are freed when recycling is
+	 * disabled.
+	 */
+	TEST_FEATURE ("with recycling disabled");
+	job_recycling = FALSE;
+
+	job = job_new (class, "foo");
+	TEST_EQ (class->recycled_len, JOB_RECYCLE_MAX - 1);
+
+	job->goal = JOB_STOP;
+	job->state = JOB_POST_STOP;
+
+	TEST_FREE_TAG (job);
+
+	job_change_state (job, JOB_WAITING);
+
+	TEST_FREE (job);
+	TEST_EQ (class->recycled_len, JOB_RECYCLE_MAX - 1);
+
+	while (! NIH_LIST_EMPTY (events))
+		nih_free (events->next);
+
+	nih_free (class);
+	metrics_reset ();
+}
+
+
 void
 test_next_state (void)
 {
@@ -4188,7 +4523,7 @@ test_next_state (void)
 	TEST_FEATURE ("with running job and a goal of stop");
 	job->goal = JOB_STOP;
 	job->state = JOB_RUNNING;
-	job->pid[PROCESS_MAIN] = 1;
+	job_process_set_pid (job, PROCESS_MAIN, 1);
 
 	TEST_EQ (job_next_state (job), JOB_PRE_STOPPING);
 
@@ -4199,7 +4534,7 @@ test_next_state (void)
 	TEST_FEATURE ("with pre-stopping job and a goal of stop");
 	job->goal = JOB_STOP;
 	job->state = JOB_PRE_STOPPING;
-	job->pid[PROCESS_MAIN] = 1;
+	job_process_set_pid (job, PROCESS_MAIN, 1);
 
 	TEST_EQ (job_next_state (job), JOB_PRE_STOP);
 
@@ -4211,7 +4546,7 @@ test_next_state (void)
 	TEST_FEATURE ("with dead running job and a goal of stop");
 	job->goal = JOB_STOP;
 	job->state = JOB_RUNNING;
-	job->pid[PROCESS_MAIN] = 0;
+	job_process_set_pid (job, PROCESS_MAIN, 0);
 
 	TEST_EQ (job_next_state (job), JOB_STOPPING);
 
@@ -5673,6 +6008,53 @@ test_emit_event (void)
 	}
 
 	nih_free (class);
+
+
+	/* Check that the job, instance and exported variables are shared
+	 * by each event the instance emits, and that the exported ones
+	 * are looked up again once the job environment has changed.
+	 */
+	TEST_FEATURE ("with exported variable and changed environment");
+	class = job_class_new (NULL, "test", NULL);
+	assert (nih_str_array_add (&(class->export), class, NULL, "FOO"));
+
+	job = job_new (class, "");
+	assert (nih_str_array_add (&(job->env), job, NULL, "FOO=BAR"));
+	job->goal = JOB_START;
+	job->state = JOB_RUNNING;
+
+	TEST_ALLOC_FAIL {
+		Event *other;
+
+		event = job_emit_event (job);
+		other = job_emit_event (job);
+
+		TEST_EQ_STR (event->name, "started");
+		TEST_EQ_STR (event->env[0], "JOB=test");
+		TEST_EQ_STR (event->env[1], "INSTANCE=");
+		TEST_EQ_STR (event->env[2], "FOO=BAR");
+		TEST_EQ_P (event->env[3], NULL);
+
+		TEST_EQ_P (other->env[0], event->env[0]);
+		TEST_EQ_P (other->env[1], event->env[1]);
+		TEST_EQ_P (other->env[2], event->env[2]);
+
+		nih_free (other);
+		nih_free (event);
+	}
+
+	assert (environ_add (&(job->env), job, NULL, TRUE, "FOO=BAZ"));
+	job_env_changed (job);
+
+	event = job_emit_event (job);
+
+	TEST_EQ_STR (event->env[0], "JOB=test");
+	TEST_EQ_STR (event->env[1], "INSTANCE=");
+	TEST_EQ_STR (event->env[2], "FOO=BAZ");
+	TEST_EQ_P (event->env[3], NULL);
+
+	nih_free (event);
+	nih_free (class);
 }
 
 
@@ -7066,6 +7448,85 @@ test_get_state (void)
 }
 
 
+void
+test_get_respawn_delay (void)
+{
+	NihDBusMessage *message = NULL;
+	JobClass       *class = NULL;
+	Job            *job = NULL;
+	uint64_t        respawn_delay;
+	int             ret;
+
+	/* Check that the respawn delay of the instance is returned. */
+	TEST_FUNCTION ("job_get_respawn_delay");
+	job_class_init ();
+
+	class = job_class_new (NULL, "test", NULL);
+	job = job_new (class, "");
+	job->respawn_delay = 4000;
+
+	message = nih_new (NULL, NihDBusMessage);
+	message->connection = NULL;
+	message->message = NULL;
+
+	respawn_delay = 0;
+
+	ret = job_get_respawn_delay (job, message, &respawn_delay);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ (respawn_delay, 4000);
+
+	nih_free (message);
+	nih_free (class);
+}
+
+void
+test_get_respawn_due (void)
+{
+	NihDBusMessage *message = NULL;
+	JobClass       *class = NULL;
+	Job            *job = NULL;
+	uint64_t        respawn_due;
+	int             ret;
+
+	TEST_FUNCTION ("job_get_respawn_due");
+	job_class_init ();
+
+	message = nih_new (NULL, NihDBusMessage);
+	message->connection = NULL;
+	message->message = NULL;
+
+	/* Check that zero is returned when no respawn is pending. */
+	TEST_FEATURE ("with no respawn pending");
+	class = job_class_new (NULL, "test", NULL);
+	job = job_new (class, "");
+
+	respawn_due = 1;
+
+	ret = job_get_respawn_due (job, message, &respawn_due);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ (respawn_due, 0);
+
+
+	/* Check that the due time of the respawn timer is returned when a
+	 * respawn is pending.
+	 */
+	TEST_FEATURE ("with respawn pending");
+	job_process_set_respawn_timer (job, 10000);
+
+	respawn_due = 0;
+
+	ret = job_get_respawn_due (job, message, &respawn_due);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ (respawn_due, job->respawn_timer->due);
+
+	nih_free (class);
+	nih_free (message);
+}
+
+
 void
 test_get_processes (void)
 {
@@ -7138,7 +7599,7 @@ test_get_processes (void)
 			job = job_new (class, "");
 			job->goal = JOB_START;
 			job->state = JOB_PRE_START;
-			job->pid[PROCESS_PRE_START] = 1014;
+			job_process_set_pid (job, PROCESS_PRE_START, 1014);
 
 			message = nih_new (NULL, NihDBusMessage);
 			message->connection = NULL;
@@ -7193,7 +7654,7 @@ test_get_processes (void)
 			job = job_new (class, "");
 			job->goal = JOB_START;
 			job->state = JOB_POST_START;
-			job->pid[PROCESS_POST_START] = 2137;
+			job_process_set_pid (job, PROCESS_POST_START, 2137);
 
 			message = nih_new (NULL, NihDBusMessage);
 			message->connection = NULL;
@@ -7247,7 +7708,7 @@ test_get_processes (void)
 			job = job_new (class, "");
 			job->goal = JOB_START;
 			job->state = JOB_RUNNING;
-			job->pid[PROCESS_MAIN] = 3648;
+			job_process_set_pid (job, PROCESS_MAIN, 3648);
 
 			message = nih_new (NULL, NihDBusMessage);
 			message->connection = NULL;
@@ -7304,8 +7765,8 @@ test_get_processes (void)
 			job = job_new (class, "");
 			job->goal = JOB_START;
 			job->state = JOB_POST_START;
-			job->pid[PROCESS_POST_START] = 2137;
-			job->pid[PROCESS_MAIN] = 3648;
+			job_process_set_pid (job, PROCESS_POST_START, 2137);
+			job_process_set_pid (job, PROCESS_MAIN, 3648);
 
 			message = nih_new (NULL, NihDBusMessage);
 			message->connection = NULL;
@@ -7368,8 +7829,8 @@ test_get_processes (void)
 			job = job_new (class, "");
 			job->goal = JOB_START;
 			job->state = JOB_PRE_STOP;
-			job->pid[PROCESS_MAIN] = 3648;
-			job->pid[PROCESS_PRE_STOP] = 7864;
+			job_process_set_pid (job, PROCESS_MAIN, 3648);
+			job_process_set_pid (job, PROCESS_PRE_STOP, 7864);
 
 			message = nih_new (NULL, NihDBusMessage);
 			message->connection = NULL;
@@ -7430,7 +7891,7 @@ test_get_processes (void)
 			job = job_new (class, "");
 			job->goal = JOB_START;
 			job->state = JOB_PRE_STOP;
-			job->pid[PROCESS_PRE_STOP] = 7864;
+			job_process_set_pid (job, PROCESS_PRE_STOP, 7864);
 
 			message = nih_new (NULL, NihDBusMessage);
 			message->connection = NULL;
@@ -7484,7 +7945,7 @@ test_get_processes (void)
 			job = job_new (class, "");
 			job->goal = JOB_START;
 			job->state = JOB_POST_STOP;
-			job->pid[PROCESS_POST_STOP] = 9764;
+			job_process_set_pid (job, PROCESS_POST_STOP, 9764);
 
 			message = nih_new (NULL, NihDBusMessage);
 			message->connection = NULL;
@@ -7525,6 +7986,236 @@ test_get_processes (void)
 	}
 }
 
+void
+test_get_timings (void)
+{
+	NihDBusMessage *message = NULL;
+	JobClass *      class = NULL;
+	Job *           job = NULL;
+	char **         names;
+	uint64_t *      times;
+	size_t          times_len;
+	uint64_t        created;
+	NihError *      error;
+	int             ret;
+
+	TEST_FUNCTION ("job_get_timings");
+	nih_error_init ();
+	event_init ();
+	job_class_init ();
+
+
+	/* Check that a new job has only the time it was created
+	 * returned.
+	 */
+	TEST_FEATURE ("with new job");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			class = job_class_new (NULL, "test", NULL);
+			job = job_new (class, "");
+
+			message = nih_new (NULL, NihDBusMessage);
+			message->connection = NULL;
+			message->message = NULL;
+		}
+
+		names = NULL;
+		times = NULL;
+		times_len = 0;
+
+		ret = job_get_timings (job, message, &names, &times,
+				       &times_len);
+
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
+
+			error = nih_error_get ();
+			TEST_EQ (error->number, ENOMEM);
+			nih_free (error);
+
+			nih_free (message);
+			nih_free (class);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_ALLOC_PARENT (names, message);
+		TEST_ALLOC_PARENT (times, message);
+
+		TEST_EQ (times_len, 1);
+		TEST_EQ_STR (names[0], "waiting");
+		TEST_EQ_P (names[1], NULL);
+		TEST_EQ (times[0], job->timings.state[JOB_WAITING]);
+		TEST_GT (times[0], 0);
+
+		nih_free (message);
+		nih_free (class);
+	}
+
+
+	/* Check that states are returned before processes, with the fork
+	 * and exec times of each process named after it.
+	 */
+	TEST_FEATURE ("with state and process times");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			class = job_class_new (NULL, "test", NULL);
+			job = job_new (class, "");
+			job->timings.state[JOB_WAITING] = 50;
+			job->timings.state[JOB_STARTING] = 100;
+			job->timings.state[JOB_RUNNING] = 300;
+			job->timings.fork[PROCESS_MAIN] = 200;
+			job->timings.exec[PROCESS_MAIN] = 250;
+
+			message = nih_new (NULL, NihDBusMessage);
+			message->connection = NULL;
+			message->message = NULL;
+		}
+
+		names = NULL;
+		times = NULL;
+		times_len = 0;
+
+		ret = job_get_timings (job, message, &names, &times,
+				       &times_len);
+
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
+
+			error = nih_error_get ();
+			TEST_EQ (error->number, ENOMEM);
+			nih_free (error);
+
+			nih_free (message);
+			nih_free (class);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_EQ (times_len, 5);
+		TEST_EQ_STR (names[0], "waiting");
+		TEST_EQ (times[0], 50);
+		TEST_EQ_STR (names[1], "starting");
+		TEST_EQ (times[1], 100);
+		TEST_EQ_STR (names[2], "running");
+		TEST_EQ (times[2], 300);
+		TEST_EQ_STR (names[3], "fork:main");
+		TEST_EQ (times[3], 200);
+		TEST_EQ_STR (names[4], "exec:main");
+		TEST_EQ (times[4], 250);
+		TEST_EQ_P (names[5], NULL);
+
+		nih_free (message);
+		nih_free (class);
+	}
+
+
+	/* Check that entering the starting state discards the trace of
+	 * the previous start but keeps the time the job was created.
+	 */
+	TEST_FEATURE ("with restart");
+	class = job_class_new (NULL, "test", NULL);
+	job = job_new (class, "");
+	created = job->timings.state[JOB_WAITING];
+
+	job->goal = JOB_START;
+	job->state = JOB_POST_STOP;
+	job->timings.state[JOB_RUNNING] = 300;
+	job->timings.fork[PROCESS_MAIN] = 200;
+	job->timings.exec[PROCESS_MAIN] = 250;
+
+	job_change_state (job, JOB_STARTING);
+
+	TEST_EQ (job->state, JOB_STARTING);
+	TEST_EQ (job->timings.state[JOB_WAITING], created);
+	TEST_GE (job->timings.state[JOB_STARTING], created);
+	TEST_EQ (job->timings.state[JOB_RUNNING], 0);
+	TEST_EQ (job->timings.fork[PROCESS_MAIN], 0);
+	TEST_EQ (job->timings.exec[PROCESS_MAIN], 0);
+
+	nih_free (job->blocker);
+	TEST_LIST_EMPTY (events);
+
+	nih_free (class);
+}
+
+
+void
+test_get_resources (void)
+{
+	NihDBusMessage *      message = NULL;
+	JobClass *            class = NULL;
+	Job *                 job = NULL;
+	JobResourcesElement **resources;
+	uint64_t              usage[JOB_RESOURCE_LAST];
+	NihError *            error;
+	int                   ret;
+
+	TEST_FUNCTION ("job_get_resources");
+	nih_error_init ();
+	job_class_init ();
+
+	class = job_class_new (NULL, "test", NULL);
+	job = job_new (class, "");
+
+	for (int i = 0; i < JOB_RESOURCE_LAST; i++)
+		usage[i] = i + 1;
+
+	job_resources_add (job->resources, usage);
+	job_resources_add (job->resources, usage);
+
+
+	/* Check that each resource is returned by name as a child of the
+	 * message, with the totals of every process accounted and the
+	 * largest resident set size.
+	 */
+	TEST_FEATURE ("with accounted processes");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			message = nih_new (NULL, NihDBusMessage);
+			message->connection = NULL;
+			message->message = NULL;
+		}
+
+		ret = job_get_resources (job, message, &resources);
+
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
+
+			error = nih_error_get ();
+			TEST_EQ (error->number, ENOMEM);
+			nih_free (error);
+
+			nih_free (message);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_ALLOC_PARENT (resources, message);
+		TEST_ALLOC_SIZE (resources, sizeof (JobResourcesElement *)
+				 * (JOB_RESOURCE_LAST + 1));
+
+		for (int i = 0; i < JOB_RESOURCE_LAST; i++) {
+			TEST_EQ_STR (resources[i]->item0, job_resource_name (i));
+
+			if (i == JOB_RESOURCE_MAX_RSS) {
+				TEST_EQ (resources[i]->item1, i + 1);
+			} else {
+				TEST_EQ (resources[i]->item1, (i + 1) * 2);
+			}
+		}
+
+		TEST_EQ_P (resources[JOB_RESOURCE_LAST], NULL);
+
+		nih_free (message);
+	}
+
+	nih_free (class);
+}
+
 void
 test_deserialise_ptrace (void)
 {
@@ -7553,6 +8244,7 @@ test_deserialise_ptrace (void)
 		TEST_NE_P (source, NULL);
 		file = conf_file_new (source, "/tmp/test.conf");
 		class = file->job = job_class_new (NULL, "test", NULL);
+		conf_file_index (file);
 		TEST_NE_P (class, NULL);
 		class->console = CONSOLE_OUTPUT;
 		class->expect = EXPECT_FORK;
@@ -7587,7 +8279,7 @@ test_deserialise_ptrace (void)
 		TEST_NE_P (job, NULL);
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 		job->trace_forks = 0;
 		job->trace_state = TRACE_NORMAL;
 
@@ -7631,6 +8323,8 @@ test_job_find (void)
 	TEST_NE_P (file, NULL);
 
 	class = file->job = job_class_new (NULL, "test", NULL);
+
+	conf_file_index (file);
 	TEST_NE_P (class, NULL);
 
 	job = job_new (class, "");
@@ -7691,6 +8385,8 @@ test_job_find (void)
 	TEST_NE_P (file, NULL);
 
 	class = file->job = job_class_new (NULL, "test", session);
+
+	conf_file_index (file);
 	TEST_NE_P (class, NULL);
 
 	job = job_new (class, "");
@@ -7815,6 +8511,8 @@ test_job_last_process (void)
 	TEST_NE_P (file, NULL);
 
 	class = file->job = job_class_new (NULL, "test", NULL);
+
+	conf_file_index (file);
 	TEST_NE_P (class, NULL);
 
 	job = job_new (class, "");
@@ -7967,8 +8665,10 @@ main (int   argc,
 
 	test_new ();
 	test_register ();
+	test_register_fallback ();
 	test_change_goal ();
 	test_change_state ();
+	test_recycle ();
 	test_next_state ();
 	test_failed ();
 	test_finished ();
@@ -7988,8 +8688,12 @@ main (int   argc,
 	test_get_name ();
 	test_get_goal ();
 	test_get_state ();
+	test_get_respawn_delay ();
+	test_get_respawn_due ();
 
 	test_get_processes ();
+	test_get_timings ();
+	test_get_resources ();
 
 	test_deserialise_ptrace ();
 
@@ -31,6 +31,7 @@
 #include <sys/resource.h>
 
 #include <time.h>
+#include <limits.h>
 #include <stdio.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -60,6 +61,7 @@
 #include "job.h"
 #include "conf.h"
 #include "control.h"
+#include "errors.h"
 
 
 void
@@ -122,6 +124,7 @@ test_new (void)
 
 		TEST_EQ (class->kill_timeout, 5);
 		TEST_EQ (class->kill_signal, SIGTERM);
+		TEST_EQ (class->kill_cgroup, FALSE);
 
 		TEST_EQ (class->reload_signal, SIGHUP);
 
@@ -136,11 +139,19 @@ test_new (void)
 
 		TEST_EQ (class->umask, 022);
 		TEST_EQ (class->nice, JOB_NICE_INVALID);
+		TEST_EQ (class->priority, 0);
 		TEST_EQ (class->oom_score_adj, 0);
+		TEST_EQ (class->sched_policy, JOB_SCHED_INVALID);
+		TEST_EQ (class->sched_priority, 0);
+		TEST_EQ (class->ioprio_class, JOB_IOPRIO_NONE);
+		TEST_EQ (class->ioprio_level, 0);
+		TEST_EQ (class->timer_slack, 0);
 
 		for (i = 0; i < RLIMIT_NLIMITS; i++)
 			TEST_EQ_P (class->limits[i], NULL);
 
+		TEST_EQ_P (class->placement, NULL);
+
 		TEST_EQ_P (class->chroot, NULL);
 		TEST_EQ_P (class->chdir, NULL);
 
@@ -191,16 +202,19 @@ test_consider (void)
 
 	file1 = conf_file_new (source2, "/tmp/bar/frodo");
 	class1 = file1->job = job_class_new (NULL, "frodo", NULL);
+	conf_file_index (file1);
 	class1->console = CONSOLE_NONE;
 
 	file2 = conf_file_new (source2, "/tmp/bar/bilbo");
 	class2 = file2->job = job_class_new (NULL, "bilbo", NULL);
+	conf_file_index (file2);
 	class2->console = CONSOLE_NONE;
 
 	source3 = conf_source_new (NULL, "/tmp/baz", CONF_JOB_DIR);
 
 	file3 = conf_file_new (source3, "/tmp/baz/frodo");
 	class3 = file3->job = job_class_new (NULL, "frodo", NULL);
+	conf_file_index (file3);
 	class3->console = CONSOLE_NONE;
 
 
@@ -494,16 +508,19 @@ test_reconsider (void)
 
 	file1 = conf_file_new (source2, "/tmp/bar/frodo");
 	class1 = file1->job = job_class_new (NULL, "frodo", NULL);
+	conf_file_index (file1);
 	class1->console = CONSOLE_NONE;
 
 	file2 = conf_file_new (source2, "/tmp/bar/bilbo");
 	class2 = file2->job = job_class_new (NULL, "bilbo", NULL);
+	conf_file_index (file2);
 	class2->console = CONSOLE_NONE;
 
 	source3 = conf_source_new (NULL, "/tmp/baz", CONF_JOB_DIR);
 
 	file3 = conf_file_new (source3, "/tmp/baz/frodo");
 	class3 = file3->job = job_class_new (NULL, "frodo", NULL);
+	conf_file_index (file3);
 	class3->console = CONSOLE_NONE;
 
 
@@ -964,6 +981,7 @@ test_environment (void)
 {
 	JobClass  *class;
 	char     **env;
+	char     **cache;
 	size_t     len;
 
 	TEST_FUNCTION ("job_class_environment");
@@ -981,6 +999,12 @@ test_environment (void)
 	job_class_environment_init ();
 
 	TEST_ALLOC_FAIL {
+		/* Build the environment afresh each time */
+		if (class->env_cache) {
+			nih_free (class->env_cache);
+			class->env_cache = NULL;
+		}
+
 		env = job_class_environment (NULL, class, &len);
 
 		if (test_alloc_failed) {
@@ -1001,6 +1025,39 @@ test_environment (void)
 		nih_free (env);
 	}
 
+
+	/* Check that once the environment has been built, further calls
+	 * return a copy of the cached environment, which survives a failure
+	 * to copy it.
+	 */
+	TEST_FEATURE ("with cached environment");
+	cache = class->env_cache;
+	TEST_NE_P (cache, NULL);
+
+	TEST_ALLOC_FAIL {
+		env = job_class_environment (NULL, class, &len);
+
+		TEST_EQ_P (class->env_cache, cache);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (env, NULL);
+			continue;
+		}
+
+		TEST_NE_P (env, NULL);
+		TEST_NE_P (env, cache);
+		TEST_EQ (len, 2);
+		TEST_ALLOC_SIZE (env, sizeof (char *) * 3);
+
+		TEST_ALLOC_PARENT (env[0], env);
+		TEST_EQ_STRN (env[0], "PATH=");
+		TEST_ALLOC_PARENT (env[1], env);
+		TEST_EQ_STRN (env[1], "TERM=");
+		TEST_EQ_P (env[2], NULL);
+
+		nih_free (env);
+	}
+
 	nih_free (class);
 
 
@@ -1016,6 +1073,12 @@ test_environment (void)
 	assert (nih_str_array_add (&(class->env), class, NULL, "BAR=BAZ"));
 
 	TEST_ALLOC_FAIL {
+		/* Build the environment afresh each time */
+		if (class->env_cache) {
+			nih_free (class->env_cache);
+			class->env_cache = NULL;
+		}
+
 		env = job_class_environment (NULL, class, &len);
 
 		if (test_alloc_failed) {
@@ -1040,6 +1103,42 @@ test_environment (void)
 		nih_free (env);
 	}
 
+
+	/* Check that a cached environment includes the configured
+	 * environment variables.
+	 */
+	TEST_FEATURE ("with cached configured environment");
+	cache = class->env_cache;
+	TEST_NE_P (cache, NULL);
+
+	TEST_ALLOC_FAIL {
+		env = job_class_environment (NULL, class, &len);
+
+		TEST_EQ_P (class->env_cache, cache);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (env, NULL);
+			continue;
+		}
+
+		TEST_NE_P (env, NULL);
+		TEST_NE_P (env, cache);
+		TEST_EQ (len, 4);
+		TEST_ALLOC_SIZE (env, sizeof (char *) * 5);
+
+		TEST_ALLOC_PARENT (env[0], env);
+		TEST_EQ_STRN (env[0], "PATH=");
+		TEST_ALLOC_PARENT (env[1], env);
+		TEST_EQ_STRN (env[1], "TERM=");
+		TEST_ALLOC_PARENT (env[2], env);
+		TEST_EQ_STR (env[2], "FOO=BAR");
+		TEST_ALLOC_PARENT (env[3], env);
+		TEST_EQ_STR (env[3], "BAR=BAZ");
+		TEST_EQ_P (env[4], NULL);
+
+		nih_free (env);
+	}
+
 	nih_free (class);
 
 
@@ -1054,15 +1153,57 @@ test_environment (void)
 	assert (nih_str_array_add (&(class->env), class, NULL, "BAR=BAZ"));
 	assert (nih_str_array_add (&(class->env), class, NULL, "TERM=elmo"));
 
+	TEST_ALLOC_FAIL {
+		/* Build the environment afresh each time */
+		if (class->env_cache) {
+			nih_free (class->env_cache);
+			class->env_cache = NULL;
+		}
+
+		env = job_class_environment (NULL, class, &len);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (env, NULL);
+			continue;
+		}
+
+		TEST_NE_P (env, NULL);
+		TEST_EQ (len, 4);
+		TEST_ALLOC_SIZE (env, sizeof (char *) * 5);
+
+		TEST_ALLOC_PARENT (env[0], env);
+		TEST_EQ_STRN (env[0], "PATH=");
+		TEST_ALLOC_PARENT (env[1], env);
+		TEST_EQ_STR (env[1], "TERM=elmo");
+		TEST_ALLOC_PARENT (env[2], env);
+		TEST_EQ_STR (env[2], "FOO=BAR");
+		TEST_ALLOC_PARENT (env[3], env);
+		TEST_EQ_STR (env[3], "BAR=BAZ");
+		TEST_EQ_P (env[4], NULL);
+
+		nih_free (env);
+	}
+
+
+	/* Check that a cached environment keeps the configuration
+	 * overriding built-ins.
+	 */
+	TEST_FEATURE ("with cached configuration overriding built-ins");
+	cache = class->env_cache;
+	TEST_NE_P (cache, NULL);
+
 	TEST_ALLOC_FAIL {
 		env = job_class_environment (NULL, class, &len);
 
+		TEST_EQ_P (class->env_cache, cache);
+
 		if (test_alloc_failed) {
 			TEST_EQ_P (env, NULL);
 			continue;
 		}
 
 		TEST_NE_P (env, NULL);
+		TEST_NE_P (env, cache);
 		TEST_EQ (len, 4);
 		TEST_ALLOC_SIZE (env, sizeof (char *) * 5);
 
@@ -1080,6 +1221,125 @@ test_environment (void)
 	}
 
 	nih_free (class);
+
+
+	/* Check that a change to the job environment is reflected in the
+	 * environment of a class whose environment has already been
+	 * built.
+	 */
+	TEST_FEATURE ("with job environment changed");
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+
+	class->env = nih_str_array_new (class);
+	assert (nih_str_array_add (&(class->env), class, NULL, "FOO=BAR"));
+
+	env = job_class_environment (NULL, class, &len);
+	TEST_NE_P (env, NULL);
+	TEST_EQ (len, 3);
+	nih_free (env);
+
+	assert0 (job_class_environment_set ("HELLO=world", TRUE));
+
+	env = job_class_environment (NULL, class, &len);
+	TEST_NE_P (env, NULL);
+	TEST_EQ (len, 4);
+	TEST_EQ_STRN (env[0], "PATH=");
+	TEST_EQ_STRN (env[1], "TERM=");
+	TEST_EQ_STR (env[2], "HELLO=world");
+	TEST_EQ_STR (env[3], "FOO=BAR");
+	TEST_EQ_P (env[4], NULL);
+	nih_free (env);
+
+	assert0 (job_class_environment_unset ("HELLO"));
+
+	env = job_class_environment (NULL, class, &len);
+	TEST_NE_P (env, NULL);
+	TEST_EQ (len, 3);
+	TEST_EQ_STR (env[2], "FOO=BAR");
+	TEST_EQ_P (env[3], NULL);
+	nih_free (env);
+
+	nih_free (class);
+}
+
+
+void
+test_instance_name (void)
+{
+	JobClass  *class;
+	char     **env;
+	char      *name;
+	NihError  *error;
+
+	TEST_FUNCTION ("job_class_instance_name");
+	job_class_environment_init ();
+
+	class = job_class_new (NULL, "test", NULL);
+	NIH_MUST (nih_str_array_add (&class->env, class, NULL, "PORT=80"));
+	NIH_MUST (nih_str_array_add (&class->env, class, NULL, "HOST=x"));
+
+	env = NIH_MUST (nih_str_array_new (class));
+	NIH_MUST (nih_str_array_add (&env, class, NULL, "PORT=8080"));
+	NIH_MUST (nih_str_array_add (&env, class, NULL, "PORT=8081"));
+
+
+	/* Check that a template without references is returned as it is.
+	 */
+	TEST_FEATURE ("with literal template");
+	class->instance = "fixed";
+
+	name = job_class_instance_name (NULL, class, env);
+
+	TEST_EQ_STR (name, "fixed");
+	TEST_NE_P (class->instance_parts, NULL);
+
+	nih_free (name);
+
+
+	/* Check that plain references are replaced by the last setting of
+	 * the environment given, or failing that of the class.
+	 */
+	TEST_FEATURE ("with plain references");
+	class->instance = "$HOST:${PORT}-$$";
+
+	name = job_class_instance_name (NULL, class, env);
+
+	TEST_EQ_STR (name, "x:8081-$$");
+	TEST_NE_P (class->instance_parts, NULL);
+
+	nih_free (name);
+
+
+	/* Check that a template using other expansions is expanded in
+	 * full.
+	 */
+	TEST_FEATURE ("with operator");
+	class->instance = "${ADDR:-any}:$PORT";
+
+	name = job_class_instance_name (NULL, class, env);
+
+	TEST_EQ_STR (name, "any:8081");
+	TEST_EQ_P (class->instance_parts, NULL);
+
+	nih_free (name);
+
+
+	/* Check that a reference to an unknown variable raises the same
+	 * error as full expansion would.
+	 */
+	TEST_FEATURE ("with unknown variable");
+	class->instance = "$ADDR";
+
+	name = job_class_instance_name (NULL, class, env);
+
+	TEST_EQ_P (name, NULL);
+
+	error = nih_error_get ();
+	TEST_EQ (error->number, ENVIRON_UNKNOWN_PARAM);
+	nih_free (error);
+
+	nih_free (class);
 }
 
 
@@ -1513,6 +1773,10 @@ test_start (void)
 	int              ret;
 	NihError        *error;
 	NihDBusError    *dbus_error;
+	ConfSource      *source;
+	FILE            *f;
+	char             dirname[PATH_MAX];
+	char             filename[PATH_MAX];
 
 	TEST_FUNCTION ("job_class_start");
 	nih_error_init ();
@@ -1994,6 +2258,161 @@ test_start (void)
 	nih_free (class);
 
 
+	/* Check that a job whose definition was dropped by lazy loading
+	 * is loaded before its instance is named and created, so that
+	 * both have the environment from its configuration.
+	 */
+	TEST_FEATURE ("with unloaded lazy job");
+	TEST_FILENAME (dirname);
+	mkdir (dirname, 0755);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo.conf");
+
+	f = fopen (filename, "w");
+	fprintf (f, "env FOO=bar\n");
+	fprintf (f, "instance $FOO\n");
+	fprintf (f, "console none\n");
+	fprintf (f, "exec /bin/true\n");
+	fclose (f);
+
+	conf_lazy_load = TRUE;
+
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+	assert (conf_source_reload (source) == 0);
+
+	class = (JobClass *)nih_hash_lookup (job_classes, "foo");
+	TEST_NE_P (class, NULL);
+	TEST_FALSE (class->loaded);
+
+	method = dbus_message_new_method_call (
+		dbus_bus_get_unique_name (conn),
+		class->path,
+		DBUS_INTERFACE_UPSTART_JOB,
+		"Start");
+
+	dbus_connection_send (client_conn, method, &serial);
+	dbus_connection_flush (client_conn);
+	dbus_message_unref (method);
+
+	TEST_DBUS_MESSAGE (conn, method);
+	assert (dbus_message_get_serial (method) == serial);
+
+	message = nih_new (NULL, NihDBusMessage);
+	message->connection = conn;
+	message->message = method;
+
+	TEST_FREE_TAG (message);
+
+	env = nih_str_array_new (message);
+
+	ret = job_class_start (class, message, env, FALSE);
+
+	TEST_EQ (ret, 0);
+
+	nih_discard (message);
+	TEST_FREE (message);
+	dbus_message_unref (method);
+
+	TEST_TRUE (class->loaded);
+
+	job = (Job *)nih_hash_lookup (class->instances, "bar");
+
+	TEST_NE_P (job, NULL);
+	TEST_EQ_STR (job->name, "bar");
+
+	TEST_EQ (job->goal, JOB_START);
+	TEST_EQ (job->state, JOB_STARTING);
+
+	TEST_NE_P (job->env, NULL);
+	TEST_EQ_STRN (job->env[0], "PATH=");
+	TEST_EQ_STRN (job->env[1], "TERM=");
+	TEST_EQ_STR (job->env[2], "FOO=bar");
+	TEST_EQ_P (job->env[3], NULL);
+
+	dbus_connection_flush (conn);
+
+	TEST_DBUS_MESSAGE (client_conn, reply);
+
+	TEST_EQ (dbus_message_get_type (reply),
+		 DBUS_MESSAGE_TYPE_METHOD_RETURN);
+	TEST_EQ (dbus_message_get_reply_serial (reply), serial);
+
+	dbus_message_unref (reply);
+
+	nih_free (job->blocker);
+	job->blocker = NULL;
+
+	nih_free (job);
+	nih_free (source);
+
+
+	/* Check that when the definition of a lazy job can't be loaded,
+	 * the error is returned and no instance is created.
+	 */
+	TEST_FEATURE ("with lazy job that cannot be loaded");
+	f = fopen (filename, "w");
+	fprintf (f, "env FOO=bar\n");
+	fprintf (f, "exec /bin/true\n");
+	fclose (f);
+
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+	assert (conf_source_reload (source) == 0);
+
+	class = (JobClass *)nih_hash_lookup (job_classes, "foo");
+	TEST_NE_P (class, NULL);
+	TEST_FALSE (class->loaded);
+
+	unlink (filename);
+
+	method = dbus_message_new_method_call (
+		dbus_bus_get_unique_name (conn),
+		class->path,
+		DBUS_INTERFACE_UPSTART_JOB,
+		"Start");
+
+	dbus_connection_send (client_conn, method, &serial);
+	dbus_connection_flush (client_conn);
+	dbus_message_unref (method);
+
+	TEST_DBUS_MESSAGE (conn, method);
+	assert (dbus_message_get_serial (method) == serial);
+
+	message = nih_new (NULL, NihDBusMessage);
+	message->connection = conn;
+	message->message = method;
+
+	TEST_FREE_TAG (message);
+
+	env = nih_str_array_new (message);
+
+	ret = job_class_start (class, message, env, FALSE);
+
+	TEST_LT (ret, 0);
+
+	nih_discard (message);
+	TEST_FREE (message);
+	dbus_message_unref (method);
+
+	error = nih_error_get ();
+	TEST_EQ (error->number, NIH_DBUS_ERROR);
+	TEST_ALLOC_SIZE (error, sizeof (NihDBusError));
+
+	dbus_error = (NihDBusError *)error;
+	TEST_EQ_STR (dbus_error->name, DBUS_ERROR_FAILED);
+
+	nih_free (dbus_error);
+
+	TEST_FALSE (class->loaded);
+	TEST_HASH_EMPTY (class->instances);
+
+	nih_free (source);
+
+	conf_lazy_load = FALSE;
+
+	rmdir (dirname);
+
+
 	/* Check that if the environment table is not valid, an error
 	 * is returned.
 	 */
@@ -3776,6 +4195,121 @@ test_get_emits (void)
 }
 
 
+void
+test_share (void)
+{
+	JobClass *class1;
+	JobClass *class2;
+	JobClass *classes[2];
+	char     *command;
+
+	/* Check that two job classes with identical commands, limits and
+	 * emits end up sharing a single copy of each, parented by both,
+	 * and that the copy survives the first class being freed.
+	 */
+	TEST_FUNCTION ("job_class_share");
+	job_class_init ();
+
+	classes[0] = class1 = job_class_new (NULL, "foo", NULL);
+	classes[1] = class2 = job_class_new (NULL, "foo", NULL);
+
+	for (int i = 0; i < 2; i++) {
+		JobClass *class = classes[i];
+
+		class->process[PROCESS_MAIN] = process_new (class->process);
+		class->process[PROCESS_MAIN]->command = nih_strdup (
+			class->process[PROCESS_MAIN], "/sbin/daemon -d");
+
+		class->limits[RLIMIT_CORE] = nih_new (class, struct rlimit);
+		class->limits[RLIMIT_CORE]->rlim_cur = 10;
+		class->limits[RLIMIT_CORE]->rlim_max = 20;
+
+		assert (nih_str_array_add (&class->emits, class, NULL, "wibble"));
+		assert (nih_str_array_add (&class->emits, class, NULL, "wobble"));
+	}
+
+	TEST_NE_P (class1->process[PROCESS_MAIN]->command,
+		   class2->process[PROCESS_MAIN]->command);
+
+	job_class_share (class1);
+	job_class_share (class2);
+
+	command = class1->process[PROCESS_MAIN]->command;
+	TEST_EQ_P (class2->process[PROCESS_MAIN]->command, command);
+	TEST_ALLOC_PARENT (command, class1->process[PROCESS_MAIN]);
+	TEST_ALLOC_PARENT (command, class2->process[PROCESS_MAIN]);
+
+	TEST_EQ_P (class2->limits[RLIMIT_CORE], class1->limits[RLIMIT_CORE]);
+	TEST_EQ_P (class2->emits, class1->emits);
+
+	nih_free (class1);
+
+	TEST_EQ_STR (class2->process[PROCESS_MAIN]->command, "/sbin/daemon -d");
+	TEST_EQ (class2->limits[RLIMIT_CORE]->rlim_max, 20);
+	TEST_EQ_STR (class2->emits[1], "wobble");
+
+	/* Check that a class loaded afterwards still finds the shared
+	 * copies held by the remaining class.
+	 */
+	class1 = job_class_new (NULL, "foo", NULL);
+	class1->process[PROCESS_MAIN] = process_new (class1->process);
+	class1->process[PROCESS_MAIN]->command = nih_strdup (
+		class1->process[PROCESS_MAIN], "/sbin/daemon -d");
+
+	job_class_share (class1);
+
+	TEST_EQ_P (class1->process[PROCESS_MAIN]->command,
+		   class2->process[PROCESS_MAIN]->command);
+
+	nih_free (class1);
+	nih_free (class2);
+}
+
+void
+test_get_index (void)
+{
+	JobClass *class1;
+	JobClass *class2;
+	JobClass *class3;
+	JobClass *other;
+
+	/* Check that registered job classes are indexed by name, however
+	 * they were added, both with and without an index built, and
+	 * that a class that isn't registered has no index.
+	 */
+	TEST_FUNCTION ("job_class_get_index");
+	job_class_init ();
+
+	class2 = job_class_new (NULL, "bar", NULL);
+	job_class_add_safe (class2);
+	class3 = job_class_new (NULL, "foo", NULL);
+	job_class_add_safe (class3);
+	class1 = job_class_new (NULL, "baz", NULL);
+	job_class_add_safe (class1);
+
+	other = job_class_new (NULL, "frodo", NULL);
+
+	TEST_EQ (job_class_get_index (class2), 0);
+	TEST_EQ (job_class_get_index (class1), 1);
+	TEST_EQ (job_class_get_index (class3), 2);
+	TEST_EQ (job_class_get_index (other), -1);
+
+	job_class_index_build ();
+
+	TEST_EQ (job_class_get_index (class2), 0);
+	TEST_EQ (job_class_get_index (class1), 1);
+	TEST_EQ (job_class_get_index (class3), 2);
+	TEST_EQ (job_class_get_index (other), -1);
+
+	job_class_index_clear ();
+
+	nih_free (class1);
+	nih_free (class2);
+	nih_free (class3);
+	nih_free (other);
+}
+
+
 int
 main (int   argc,
       char *argv[])
@@ -3789,7 +4323,10 @@ main (int   argc,
 	test_register ();
 	test_unregister ();
 	test_environment ();
+	test_share ();
+	test_get_index ();
 
+	test_instance_name ();
 	test_get_instance ();
 	test_get_instance_by_name ();
 	test_get_all_instances ();
@@ -29,6 +29,8 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <time.h>
 #include <stdio.h>
@@ -36,6 +38,7 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <utmp.h>
 #include <utmpx.h>
@@ -221,6 +224,8 @@ static char *argv0;
 static int get_available_pty_count (void) __attribute__((unused));
 static void close_all_files (void);
 
+extern int disable_clone_spawn;
+
 static int child_exit_status[PROCESS_LAST];
 static int child_exit_after;
 
@@ -940,8 +945,8 @@ test_start (void)
 
 
 	/* Check that a particularly long script is instead invoked by
-	 * using the /proc/self/fd feature, with the shell script fed to the
-	 * child process by an NihIo structure.
+	 * using the /proc/self/fd feature, with the shell script in a
+	 * memory file or fed to the child process by an NihIo structure.
 	 */
 	TEST_FEATURE ("with long script");
 	TEST_HASH_EMPTY (job_classes);
@@ -983,6 +988,121 @@ test_start (void)
 	}
 
 
+#ifdef HAVE_MEMFD_CREATE
+	/* Check that a long script is written to a memory file only once,
+	 * with later runs reading the same one and no NihIo needed to feed
+	 * it to the shell.
+	 */
+	TEST_FEATURE ("with long script run twice");
+	TEST_HASH_EMPTY (job_classes);
+
+	TEST_ALLOC_FAIL {
+		int script_fd;
+
+		TEST_ALLOC_SAFE {
+			class = job_class_new (NULL, "test", NULL);
+			class->console = CONSOLE_NONE;
+			class->process[PROCESS_MAIN] = process_new (class);
+			class->process[PROCESS_MAIN]->script = TRUE;
+			class->process[PROCESS_MAIN]->command = nih_sprintf (
+				class->process[PROCESS_MAIN],
+				"exec >> %s\necho hello\n", filename);
+
+			job = job_new (class, "");
+			job->goal = JOB_START;
+			job->state = JOB_SPAWNED;
+		}
+
+		job_process_start (job, PROCESS_MAIN);
+
+		script_fd = class->process[PROCESS_MAIN]->script_fd;
+		TEST_GT (script_fd, JOB_PROCESS_SCRIPT_FD);
+		TEST_EQ (job->process_data[PROCESS_MAIN]->shell_fd, -1);
+
+		TEST_WATCH_LOOP ();
+
+		waitpid (job->pid[PROCESS_MAIN], &status, 0);
+		TEST_TRUE (WIFEXITED (status));
+		TEST_EQ (WEXITSTATUS (status), 0);
+
+		TEST_ALLOC_SAFE {
+			job = job_new (class, "again");
+			job->goal = JOB_START;
+			job->state = JOB_SPAWNED;
+		}
+
+		job_process_start (job, PROCESS_MAIN);
+
+		TEST_EQ (class->process[PROCESS_MAIN]->script_fd, script_fd);
+
+		TEST_WATCH_LOOP ();
+
+		waitpid (job->pid[PROCESS_MAIN], &status, 0);
+		TEST_TRUE (WIFEXITED (status));
+		TEST_EQ (WEXITSTATUS (status), 0);
+
+		output = fopen (filename, "r");
+		TEST_FILE_EQ (output, "hello\n");
+		TEST_FILE_EQ (output, "hello\n");
+		TEST_FILE_END (output);
+		fclose (output);
+		unlink (filename);
+
+		nih_free (class);
+
+		TEST_LT (fcntl (script_fd, F_GETFD), 0);
+	}
+
+
+	/* Check that no more than JOB_PROCESS_SCRIPT_FDS_MAX memory files
+	 * are kept open, with the one run least recently closed to make
+	 * room for another.
+	 */
+	TEST_FEATURE ("with more long scripts than are kept open");
+	TEST_ALLOC_SAFE {
+		Process *procs[JOB_PROCESS_SCRIPT_FDS_MAX + 1];
+		int      first_fd;
+
+		for (int i = 0; i < JOB_PROCESS_SCRIPT_FDS_MAX; i++) {
+			procs[i] = process_new (NULL);
+			procs[i]->script = TRUE;
+			procs[i]->command = nih_sprintf (procs[i],
+							 "echo %d\necho\n", i);
+
+			TEST_GT (job_process_script_fd (procs[i],
+							procs[i]->command),
+				 JOB_PROCESS_SCRIPT_FD);
+		}
+
+		/* Run the first again, so that the second is now the
+		 * least recently run.
+		 */
+		first_fd = procs[0]->script_fd;
+		TEST_EQ (job_process_script_fd (procs[0], procs[0]->command),
+			 first_fd);
+
+		procs[JOB_PROCESS_SCRIPT_FDS_MAX] = process_new (NULL);
+		procs[JOB_PROCESS_SCRIPT_FDS_MAX]->script = TRUE;
+		procs[JOB_PROCESS_SCRIPT_FDS_MAX]->command = nih_strdup (
+			procs[JOB_PROCESS_SCRIPT_FDS_MAX], "echo\necho\n");
+
+		TEST_GT (job_process_script_fd (procs[JOB_PROCESS_SCRIPT_FDS_MAX],
+						procs[JOB_PROCESS_SCRIPT_FDS_MAX]->command),
+			 JOB_PROCESS_SCRIPT_FD);
+
+		TEST_EQ (procs[0]->script_fd, first_fd);
+		TEST_GE (fcntl (first_fd, F_GETFD), 0);
+		TEST_EQ (procs[1]->script_fd, -1);
+
+		for (int i = 2; i <= JOB_PROCESS_SCRIPT_FDS_MAX; i++)
+			TEST_NE (procs[i]->script_fd, -1);
+
+		for (int i = 0; i <= JOB_PROCESS_SCRIPT_FDS_MAX; i++)
+			nih_free (procs[i]);
+	}
+#endif /* HAVE_MEMFD_CREATE */
+
+
 	/* Check that if we're running a non-daemon job, the trace state
 	 * is reset and no process trace is established.
 	 */
@@ -1161,6 +1281,360 @@ test_start (void)
 	}
 
 
+	/* Check that if we're running a passive forking job, the trace
+	 * state is reset and the fork is followed from proc connector
+	 * events without the process being stopped; where those events
+	 * can't be received, a process trace is established instead.
+	 */
+	TEST_FEATURE ("with passive forking job");
+	TEST_HASH_EMPTY (job_classes);
+
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+	class->expect = EXPECT_FORK_PASSIVE;
+	class->process[PROCESS_MAIN] = process_new (class);
+	class->process[PROCESS_MAIN]->script = TRUE;
+	class->process[PROCESS_MAIN]->command = "sleep 5 &";
+
+	job = job_new (class, "");
+	job->goal = JOB_START;
+	job->state = JOB_SPAWNED;
+
+	job->trace_forks = 2;
+	job->trace_state = TRACE_NORMAL;
+
+	job_process_start (job, PROCESS_MAIN);
+
+	TEST_EQ (job->trace_forks, 0);
+
+	pid = job->pid[PROCESS_MAIN];
+	TEST_GT (pid, 0);
+
+	if (job->trace_state == TRACE_PASSIVE) {
+		assert0 (waitid (P_PID, pid, &info, WEXITED));
+		TEST_EQ (info.si_code, CLD_EXITED);
+		TEST_EQ (info.si_status, 0);
+
+		job_process_proc_poll ();
+
+		TEST_EQ (job->trace_forks, 1);
+		TEST_EQ (job->trace_state, TRACE_NONE);
+		TEST_EQ (job->state, JOB_RUNNING);
+
+		TEST_GT (job->pid[PROCESS_MAIN], 0);
+		TEST_NE (job->pid[PROCESS_MAIN], pid);
+
+		assert0 (kill (job->pid[PROCESS_MAIN], SIGKILL));
+	} else {
+		TEST_EQ (job->trace_state, TRACE_NEW);
+
+		assert0 (waitid (P_PID, pid, &info, WEXITED | WSTOPPED));
+		TEST_EQ (info.si_code, CLD_TRAPPED);
+		TEST_EQ (info.si_status, SIGTRAP);
+
+		assert0 (ptrace (PTRACE_DETACH, pid, NULL, 0));
+
+		assert0 (waitid (P_PID, pid, &info, WEXITED | WSTOPPED));
+		TEST_EQ (info.si_code, CLD_EXITED);
+		TEST_EQ (info.si_status, 0);
+	}
+
+	nih_free (class);
+
+
+	/* Check that if we're running a job that notifies us when it's
+	 * ready, a socket is opened for it and it remains spawned until
+	 * its main process sends READY=1; notifications from any other
+	 * process are ignored.
+	 */
+	TEST_FEATURE ("with notifying job");
+	TEST_HASH_EMPTY (job_classes);
+
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+	class->expect = EXPECT_NOTIFY;
+	class->process[PROCESS_MAIN] = process_new (class);
+	class->process[PROCESS_MAIN]->script = FALSE;
+	class->process[PROCESS_MAIN]->command = "sleep 5";
+
+	job = job_new (class, "");
+	job->goal = JOB_START;
+	job->state = JOB_SPAWNED;
+
+	job_process_start (job, PROCESS_MAIN);
+
+	TEST_EQ (job->trace_state, TRACE_NONE);
+	TEST_GE (job->notify_fd, 0);
+
+	pid = job->pid[PROCESS_MAIN];
+	TEST_GT (pid, 0);
+
+	{
+		struct sockaddr_un  addr;
+		socklen_t           addrlen = sizeof (addr);
+		const char         *msg = "STATUS=Started\nREADY=1\n";
+		pid_t               child;
+		int                 sock, fds[2];
+		char                c = 0;
+
+		assert0 (getsockname (job->notify_fd, (struct sockaddr *)&addr,
+				      &addrlen));
+		TEST_EQ (addr.sun_path[0], '\0');
+
+		sock = socket (AF_UNIX, SOCK_DGRAM, 0);
+		assert (sock >= 0);
+		assert0 (connect (sock, (struct sockaddr *)&addr, addrlen));
+
+		/* Stand in for the main process with a child that sends
+		 * its notification once we're ready.
+		 */
+		assert0 (pipe (fds));
+
+		child = fork ();
+		assert (child >= 0);
+		if (! child) {
+			close (fds[1]);
+			assert (read (fds[0], &c, 1) == 1);
+
+			_exit (send (sock, msg, strlen (msg), 0) < 0);
+		}
+		close (fds[0]);
+
+		assert0 (kill (pid, SIGKILL));
+		assert0 (waitid (P_PID, pid, &info, WEXITED));
+
+		job_process_set_pid (job, PROCESS_MAIN, child);
+
+		assert (send (sock, "READY=1", 7, 0) == 7);
+		job_process_notify_poll (job);
+
+		TEST_EQ (job->state, JOB_SPAWNED);
+
+		assert (write (fds[1], &c, 1) == 1);
+		assert0 (waitid (P_PID, child, &info, WEXITED));
+		TEST_EQ (info.si_code, CLD_EXITED);
+		TEST_EQ (info.si_status, 0);
+
+		job_process_notify_poll (job);
+
+		TEST_EQ (job->state, JOB_RUNNING);
+		TEST_EQ (job->pid[PROCESS_MAIN], child);
+		TEST_GE (job->notify_fd, 0);
+
+		close (fds[1]);
+		close (sock);
+	}
+
+	nih_free (class);
+
+
+	/* Check that a new main process given by MAINPID= is rejected if
+	 * it is init, already a process of a job, or neither a descendant
+	 * of the main process nor reparented to init.
+	 */
+	TEST_FEATURE ("with rejected main pid");
+	TEST_HASH_EMPTY (job_classes);
+
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+	class->expect = EXPECT_NOTIFY;
+	class->process[PROCESS_MAIN] = process_new (class);
+	class->process[PROCESS_MAIN]->script = FALSE;
+	class->process[PROCESS_MAIN]->command = "sleep 5";
+
+	job = job_new (class, "");
+	job->goal = JOB_START;
+	job->state = JOB_SPAWNED;
+
+	job_process_start (job, PROCESS_MAIN);
+
+	TEST_GE (job->notify_fd, 0);
+
+	pid = job->pid[PROCESS_MAIN];
+	TEST_GT (pid, 0);
+
+	{
+		struct sockaddr_un  addr;
+		socklen_t           addrlen = sizeof (addr);
+		pid_t               child, other, unrelated;
+		int                 sock, fds[2];
+		char                c = 0;
+
+		assert0 (getsockname (job->notify_fd, (struct sockaddr *)&addr,
+				      &addrlen));
+
+		sock = socket (AF_UNIX, SOCK_DGRAM, 0);
+		assert (sock >= 0);
+		assert0 (connect (sock, (struct sockaddr *)&addr, addrlen));
+
+		/* Our child, but already another process of the job */
+		other = fork ();
+		assert (other >= 0);
+		if (! other) {
+			pause ();
+			_exit (0);
+		}
+
+		unrelated = getppid ();
+
+		assert0 (pipe (fds));
+
+		child = fork ();
+		assert (child >= 0);
+		if (! child) {
+			char msg[64];
+
+			close (fds[1]);
+			assert (read (fds[0], &c, 1) == 1);
+
+			sprintf (msg, "MAINPID=1");
+			assert (send (sock, msg, strlen (msg), 0) > 0);
+
+			sprintf (msg, "MAINPID=%d", (int)getppid ());
+			assert (send (sock, msg, strlen (msg), 0) > 0);
+
+			sprintf (msg, "MAINPID=%d", (int)other);
+			assert (send (sock, msg, strlen (msg), 0) > 0);
+
+			sprintf (msg, "MAINPID=%d", (int)unrelated);
+			assert (send (sock, msg, strlen (msg), 0) > 0);
+
+			_exit (0);
+		}
+		close (fds[0]);
+
+		assert0 (kill (pid, SIGKILL));
+		assert0 (waitid (P_PID, pid, &info, WEXITED));
+
+		job_process_set_pid (job, PROCESS_MAIN, child);
+		job_process_set_pid (job, PROCESS_POST_START, other);
+
+		assert (write (fds[1], &c, 1) == 1);
+		assert0 (waitid (P_PID, child, &info, WEXITED));
+		TEST_EQ (info.si_code, CLD_EXITED);
+		TEST_EQ (info.si_status, 0);
+
+		job_process_notify_poll (job);
+
+		TEST_EQ (job->state, JOB_SPAWNED);
+		TEST_EQ (job->pid[PROCESS_MAIN], child);
+		TEST_EQ (job->pid[PROCESS_POST_START], other);
+
+		job_process_set_pid (job, PROCESS_POST_START, 0);
+
+		assert0 (kill (other, SIGKILL));
+		assert0 (waitid (P_PID, other, &info, WEXITED));
+
+		close (fds[1]);
+		close (sock);
+	}
+
+	nih_free (class);
+
+
+	/* Check that a descendant of the main process given by MAINPID=
+	 * becomes the new main process.
+	 */
+	TEST_FEATURE ("with accepted main pid");
+	TEST_HASH_EMPTY (job_classes);
+
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+	class->expect = EXPECT_NOTIFY;
+	class->process[PROCESS_MAIN] = process_new (class);
+	class->process[PROCESS_MAIN]->script = FALSE;
+	class->process[PROCESS_MAIN]->command = "sleep 5";
+
+	job = job_new (class, "");
+	job->goal = JOB_START;
+	job->state = JOB_SPAWNED;
+
+	job_process_start (job, PROCESS_MAIN);
+
+	TEST_GE (job->notify_fd, 0);
+
+	pid = job->pid[PROCESS_MAIN];
+	TEST_GT (pid, 0);
+
+	{
+		struct sockaddr_un  addr;
+		socklen_t           addrlen = sizeof (addr);
+		pid_t               child, grandchild;
+		int                 sock, fds[2], done[2];
+		char                c = 0;
+
+		assert0 (getsockname (job->notify_fd, (struct sockaddr *)&addr,
+				      &addrlen));
+
+		sock = socket (AF_UNIX, SOCK_DGRAM, 0);
+		assert (sock >= 0);
+		assert0 (connect (sock, (struct sockaddr *)&addr, addrlen));
+
+		assert0 (pipe (fds));
+		assert0 (pipe (done));
+
+		/* The child stays until we've handled its notification, so
+		 * that the process it names is still its descendant.
+		 */
+		child = fork ();
+		assert (child >= 0);
+		if (! child) {
+			char  msg[64];
+			pid_t forked;
+
+			close (fds[1]);
+			close (done[0]);
+			assert (read (fds[0], &c, 1) == 1);
+
+			forked = fork ();
+			assert (forked >= 0);
+			if (! forked) {
+				pause ();
+				_exit (0);
+			}
+
+			sprintf (msg, "MAINPID=%d\nREADY=1\n", (int)forked);
+			assert (send (sock, msg, strlen (msg), 0) > 0);
+
+			assert (write (done[1], &forked, sizeof (forked))
+				== sizeof (forked));
+			assert (read (fds[0], &c, 1) == 1);
+
+			kill (forked, SIGKILL);
+			_exit (0);
+		}
+		close (fds[0]);
+		close (done[1]);
+
+		assert0 (kill (pid, SIGKILL));
+		assert0 (waitid (P_PID, pid, &info, WEXITED));
+
+		job_process_set_pid (job, PROCESS_MAIN, child);
+
+		assert (write (fds[1], &c, 1) == 1);
+		assert (read (done[0], &grandchild, sizeof (grandchild))
+			== sizeof (grandchild));
+
+		job_process_notify_poll (job);
+
+		TEST_EQ (job->state, JOB_RUNNING);
+		TEST_EQ (job->pid[PROCESS_MAIN], grandchild);
+
+		job_process_set_pid (job, PROCESS_MAIN, 0);
+
+		assert (write (fds[1], &c, 1) == 1);
+		assert0 (waitid (P_PID, child, &info, WEXITED));
+		TEST_EQ (info.si_code, CLD_EXITED);
+		TEST_EQ (info.si_status, 0);
+
+		close (fds[1]);
+		close (done[0]);
+		close (sock);
+	}
+
+	nih_free (class);
+
+
 	/* Check that if we try and run a command that doesn't exist,
 	 * job_process_start() raises a ProcessError and the command doesn't
 	 * have any stored process id for it.
@@ -4341,6 +4815,51 @@ test_spawn (void)
 	nih_free (class);
 
 
+	/* Check that the process tree is the same when job processes are
+	 * always spawned with fork() rather than clone().
+	 */
+	TEST_FEATURE ("with fork engine");
+	TEST_HASH_EMPTY (job_classes);
+
+	sprintf (function, "%d", TEST_PIDS);
+
+	disable_clone_spawn = TRUE;
+
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+	job   = job_new (class, "");
+
+	pid = job_process_spawn_with_fd (job, args, NULL, FALSE, -1, PROCESS_MAIN, &job_process_fd);
+	TEST_GT (pid, 0);
+
+	disable_clone_spawn = FALSE;
+
+	waitpid (pid, NULL, 0);
+	output = fopen (filename, "r");
+
+	TEST_GT (pid, 0);
+	TEST_NE (pid, getpid ());
+
+	sprintf (buf, "pid: %d\n", pid);
+	TEST_FILE_EQ (output, buf);
+
+	sprintf (buf, "ppid: %d\n", getpid ());
+	TEST_FILE_EQ (output, buf);
+
+	sprintf (buf, "pgrp: %d\n", pid);
+	TEST_FILE_EQ (output, buf);
+
+	sprintf (buf, "sid: %d\n", pid);
+	TEST_FILE_EQ (output, buf);
+
+	TEST_FILE_END (output);
+
+	fclose (output);
+	assert0 (unlink (filename));
+
+	nih_free (class);
+
+
 	/* Check that a job spawned with no console has the file descriptors
 	 * bound to the /dev/null device.
 	 */
@@ -4467,6 +4986,10 @@ test_spawn (void)
 	pid = job_process_spawn_with_fd (job, args, env, FALSE, -1, PROCESS_MAIN, &job_process_fd);
 	TEST_GT (pid, 0);
 
+	/* Our own environment must be untouched by the child */
+	TEST_EQ_STR (getenv ("BAR"), "baz");
+	TEST_EQ_P (getenv ("FOO"), NULL);
+
 	waitpid (pid, NULL, 0);
 	output = fopen (filename, "r");
 
@@ -4790,10 +5313,10 @@ test_spawn (void)
 	args[2] = filebuf;
 	args[3] = NULL;
 
-	job->pid[PROCESS_MAIN] = job_process_spawn_with_fd (job, args, NULL,
-							    FALSE, -1, PROCESS_MAIN, &job_process_fd);
-	pid = job->pid[PROCESS_MAIN];
+	pid = job_process_spawn_with_fd (job, args, NULL,
+					 FALSE, -1, PROCESS_MAIN, &job_process_fd);
 	TEST_GT (pid, 0);
+	job_process_set_pid (job, PROCESS_MAIN, pid);
 
 	/* The main process is now running, but paused. It should have
 	 * produced some output so check that now.
@@ -4817,10 +5340,10 @@ test_spawn (void)
 	args[2] = filebuf;
 	args[3] = NULL;
 
-	job->pid[PROCESS_POST_START] = job_process_spawn_with_fd (job, args, NULL,
-								  FALSE, -1, PROCESS_POST_START, &job_process_fd);
-	pid = job->pid[PROCESS_POST_START];
+	pid = job_process_spawn_with_fd (job, args, NULL,
+					 FALSE, -1, PROCESS_POST_START, &job_process_fd);
 	TEST_GT (pid, 0);
+	job_process_set_pid (job, PROCESS_POST_START, pid);
 
 	/* wait for post-start process to end */
 	waitpid (pid, &status, 0);
@@ -5428,7 +5951,7 @@ test_kill (void)
 {
 	JobClass *      class;
 	Job *           job = NULL;
-	NihTimer *      timer;
+	WheelTimer *    timer;
 	struct timespec now;
 	pid_t           pid;
 	int             status;
@@ -5477,10 +6000,10 @@ test_kill (void)
 		assert0 (clock_gettime (CLOCK_MONOTONIC, &now));
 
 		TEST_NE_P (job->kill_timer, NULL);
-		TEST_ALLOC_SIZE (job->kill_timer, sizeof (NihTimer));
+		TEST_ALLOC_SIZE (job->kill_timer, sizeof (WheelTimer));
 		TEST_ALLOC_PARENT (job->kill_timer, job);
-		TEST_GE (job->kill_timer->due, now.tv_sec + 950);
-		TEST_LE (job->kill_timer->due, now.tv_sec + 1000);
+		TEST_GE (job->kill_timer->due, now.tv_sec * 1000 + 950000);
+		TEST_LE (job->kill_timer->due, now.tv_sec * 1000 + 1000000);
 
 		TEST_EQ (job->kill_process, PROCESS_MAIN);
 
@@ -5535,10 +6058,10 @@ test_kill (void)
 		assert0 (clock_gettime (CLOCK_MONOTONIC, &now));
 
 		TEST_NE_P (job->kill_timer, NULL);
-		TEST_ALLOC_SIZE (job->kill_timer, sizeof (NihTimer));
+		TEST_ALLOC_SIZE (job->kill_timer, sizeof (WheelTimer));
 		TEST_ALLOC_PARENT (job->kill_timer, job);
-		TEST_GE (job->kill_timer->due, now.tv_sec + 950);
-		TEST_LE (job->kill_timer->due, now.tv_sec + 1000);
+		TEST_GE (job->kill_timer->due, now.tv_sec * 1000 + 950000);
+		TEST_LE (job->kill_timer->due, now.tv_sec * 1000 + 1000000);
 
 		TEST_EQ (job->kill_process, PROCESS_MAIN);
 
@@ -5604,6 +6127,7 @@ test_handler (void)
 	source = conf_source_new (NULL, "/tmp", CONF_JOB_DIR);
 	file = conf_file_new (source, "/tmp/test");
 	file->job = class = job_class_new (NULL, "test", NULL);
+	conf_file_index (file);
 	TEST_NE_P (file->job, NULL);
 	class->process[PROCESS_MAIN] = process_new (class);
 	class->process[PROCESS_MAIN]->command = "echo";
@@ -5632,7 +6156,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -5648,6 +6172,8 @@ test_handler (void)
 		TEST_EQ (job->goal, JOB_START);
 		TEST_EQ (job->state, JOB_RUNNING);
 		TEST_EQ (job->pid[PROCESS_MAIN], 1);
+		TEST_EQ (job->resources[JOB_RESOURCE_PROCESSES], 0);
+		TEST_EQ (class->resources[JOB_RESOURCE_PROCESSES], 0);
 
 		TEST_EQ (event->blockers, 1);
 		TEST_EQ (event->failed, FALSE);
@@ -5670,9 +6196,12 @@ test_handler (void)
 	/* Check that we can handle the running task of the job terminating,
 	 * which should set the goal to stop and transition a state change
 	 * into the stopping state.  This should not be considered a failure.
+	 * The process should be accounted to the instance and its class.
 	 */
 	TEST_FEATURE ("with running process");
 	TEST_ALLOC_FAIL {
+		uint64_t reaped;
+
 		TEST_ALLOC_SAFE {
 			job = job_new (class, "");
 
@@ -5683,7 +6212,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -5694,11 +6223,15 @@ test_handler (void)
 		job->failed_process = PROCESS_INVALID;
 		job->exit_status = 0;
 
+		reaped = class->resources[JOB_RESOURCE_PROCESSES];
+
 		job_process_handler (NULL, 1, NIH_CHILD_EXITED, 0);
 
 		TEST_EQ (job->goal, JOB_STOP);
 		TEST_EQ (job->state, JOB_STOPPING);
 		TEST_EQ (job->pid[PROCESS_MAIN], 0);
+		TEST_EQ (job->resources[JOB_RESOURCE_PROCESSES], 1);
+		TEST_EQ (class->resources[JOB_RESOURCE_PROCESSES], reaped + 1);
 
 		TEST_EQ (event->blockers, 1);
 		TEST_EQ (event->failed, FALSE);
@@ -5736,7 +6269,7 @@ test_handler (void)
 	 */
 	TEST_FEATURE ("with kill timer");
 	TEST_ALLOC_FAIL {
-		NihTimer *timer = NULL;
+		WheelTimer *timer = NULL;
 
 		TEST_ALLOC_SAFE {
 			job = job_new (class, "");
@@ -5748,7 +6281,7 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_KILLED;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -5787,7 +6320,7 @@ test_handler (void)
 	 */
 	TEST_FEATURE ("with restarting process");
 	TEST_ALLOC_FAIL {
-		NihTimer *timer = NULL;
+		WheelTimer *timer = NULL;
 
 		TEST_ALLOC_SAFE {
 			job = job_new (class, "");
@@ -5799,7 +6332,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_KILLED;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -5883,8 +6416,8 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_PRE_START;
-		job->pid[PROCESS_MAIN] = 0;
-		job->pid[PROCESS_PRE_START] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 0);
+		job_process_set_pid (job, PROCESS_PRE_START, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -5948,7 +6481,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_PRE_START;
-		job->pid[PROCESS_PRE_START] = 1;
+		job_process_set_pid (job, PROCESS_PRE_START, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6023,7 +6556,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_PRE_START;
-		job->pid[PROCESS_PRE_START] = 1;
+		job_process_set_pid (job, PROCESS_PRE_START, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6102,7 +6635,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6190,7 +6723,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6280,7 +6813,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6337,6 +6870,147 @@ test_handler (void)
 	class->respawn = FALSE;
 
 
+	/* Check that if the job has a respawn backoff, a failed main
+	 * process is respawned after double the last delay; the job is left running until the timer
+	 * is run, at which point it moves into the stopping state without
+	 * changing the goal.
+	 */
+	TEST_FEATURE ("with respawn backoff of running process");
+	class->respawn = TRUE;
+	class->respawn_backoff_initial = 2;
+	class->respawn_backoff_max = 8;
+
+	TEST_ALLOC_FAIL {
+		WheelTimer *timer;
+
+		TEST_ALLOC_SAFE {
+			job = job_new (class, "");
+		}
+
+		job->goal = JOB_START;
+		job->state = JOB_RUNNING;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+
+		job->respawn_delay = 2000;
+		job->timings.fork[PROCESS_MAIN] = timer_wheel_now () * 1000
+			- 1000000;
+
+		job->blocker = NULL;
+		job->failed = FALSE;
+		job->failed_process = PROCESS_INVALID;
+		job->exit_status = 0;
+
+		TEST_DIVERT_STDERR (output) {
+			job_process_handler (NULL, 1, NIH_CHILD_EXITED, 1);
+		}
+		rewind (output);
+
+		TEST_EQ (job->goal, JOB_START);
+		TEST_EQ (job->state, JOB_RUNNING);
+		TEST_EQ (job->pid[PROCESS_MAIN], 0);
+		TEST_EQ (job->failed, FALSE);
+
+		TEST_EQ (job->respawn_delay, 4000);
+
+		TEST_NE_P (job->respawn_timer, NULL);
+		TEST_ALLOC_PARENT (job->respawn_timer, job);
+		TEST_EQ (job->respawn_timer->timeout, 4000);
+
+		TEST_FILE_EQ (output, ("test: test main process (1) "
+				       "terminated with status 1\n"));
+		TEST_FILE_EQ (output, ("test: test main process ended, "
+				       "respawning in 4000 ms\n"));
+		TEST_FILE_END (output);
+		TEST_FILE_RESET (output);
+
+		/* Run the respawn timer */
+		timer = job->respawn_timer;
+		timer->callback (timer->data, timer);
+		nih_free (timer);
+
+		TEST_EQ (job->goal, JOB_START);
+		TEST_EQ (job->state, JOB_STOPPING);
+		TEST_EQ_P (job->respawn_timer, NULL);
+		TEST_NE_P (job->blocker, NULL);
+
+		nih_free (job);
+	}
+
+	class->respawn = FALSE;
+	class->respawn_backoff_initial = 0;
+	class->respawn_backoff_max = 0;
+
+
+	/* Check that if the job has a respawn backoff, a failed main
+	 * process that ran for at least the maximum delay is respawned
+	 * after the initial delay again rather than double the last one.
+	 */
+	TEST_FEATURE ("with respawn backoff after stable running process");
+	class->respawn = TRUE;
+	class->respawn_backoff_initial = 2;
+	class->respawn_backoff_max = 8;
+
+	TEST_ALLOC_FAIL {
+		WheelTimer *timer;
+
+		TEST_ALLOC_SAFE {
+			job = job_new (class, "");
+		}
+
+		job->goal = JOB_START;
+		job->state = JOB_RUNNING;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+
+		job->respawn_delay = 8000;
+		job->timings.fork[PROCESS_MAIN] = timer_wheel_now () * 1000
+			- 10000000;
+
+		job->blocker = NULL;
+		job->failed = FALSE;
+		job->failed_process = PROCESS_INVALID;
+		job->exit_status = 0;
+
+		TEST_DIVERT_STDERR (output) {
+			job_process_handler (NULL, 1, NIH_CHILD_EXITED, 1);
+		}
+		rewind (output);
+
+		TEST_EQ (job->goal, JOB_START);
+		TEST_EQ (job->state, JOB_RUNNING);
+		TEST_EQ (job->pid[PROCESS_MAIN], 0);
+		TEST_EQ (job->failed, FALSE);
+
+		TEST_EQ (job->respawn_delay, 2000);
+
+		TEST_NE_P (job->respawn_timer, NULL);
+		TEST_ALLOC_PARENT (job->respawn_timer, job);
+		TEST_EQ (job->respawn_timer->timeout, 2000);
+
+		TEST_FILE_EQ (output, ("test: test main process (1) "
+				       "terminated with status 1\n"));
+		TEST_FILE_EQ (output, ("test: test main process ended, "
+				       "respawning in 2000 ms\n"));
+		TEST_FILE_END (output);
+		TEST_FILE_RESET (output);
+
+		/* Run the respawn timer */
+		timer = job->respawn_timer;
+		timer->callback (timer->data, timer);
+		nih_free (timer);
+
+		TEST_EQ (job->goal, JOB_START);
+		TEST_EQ (job->state, JOB_STOPPING);
+		TEST_EQ_P (job->respawn_timer, NULL);
+		TEST_NE_P (job->blocker, NULL);
+
+		nih_free (job);
+	}
+
+	class->respawn = FALSE;
+	class->respawn_backoff_initial = 0;
+	class->respawn_backoff_max = 0;
+
+
 	/* Check that we can catch a running task exiting with a "normal"
 	 * exit code, and even if it's marked respawn, set the goal to
 	 * stop and transition into the stopping state.
@@ -6357,7 +7031,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6427,7 +7101,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6508,7 +7182,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6576,7 +7250,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6647,7 +7321,7 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_KILLED;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6698,7 +7372,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6766,7 +7440,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6838,7 +7512,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6902,7 +7576,7 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_POST_STOP;
-		job->pid[PROCESS_POST_STOP] = 1;
+		job_process_set_pid (job, PROCESS_POST_STOP, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6947,7 +7621,7 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_POST_STOP;
-		job->pid[PROCESS_POST_STOP] = 1;
+		job_process_set_pid (job, PROCESS_POST_STOP, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7000,7 +7674,7 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_POST_STOP;
-		job->pid[PROCESS_POST_STOP] = 1;
+		job_process_set_pid (job, PROCESS_POST_STOP, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7055,8 +7729,8 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_POST_START;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_POST_START] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_POST_START, 2);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7120,7 +7794,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_POST_START;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7189,8 +7863,8 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_POST_START;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_POST_START] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_POST_START, 2);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7249,8 +7923,8 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_POST_START;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_POST_START] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_POST_START, 2);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7340,8 +8014,8 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_POST_START;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_POST_START] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_POST_START, 2);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7440,8 +8114,8 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_POST_START;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_POST_START] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_POST_START, 2);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7547,8 +8221,8 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_PRE_STOP;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_PRE_STOP] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_PRE_STOP, 2);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7625,7 +8299,7 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_PRE_STOP;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7693,8 +8367,8 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_PRE_STOP;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_PRE_STOP] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_PRE_STOP, 2);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7757,8 +8431,8 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_PRE_STOP;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_PRE_STOP] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_PRE_STOP, 2);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7867,8 +8541,8 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_PRE_STOP;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_PRE_STOP] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_PRE_STOP, 2);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7966,7 +8640,7 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_STOPPING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -8038,8 +8712,8 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_POST_START] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_POST_START, pid);
 
 		TEST_FREE_TAG (blocked);
 
@@ -8111,8 +8785,8 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_POST_START;
-		job->pid[PROCESS_MAIN] = pid;
-		job->pid[PROCESS_POST_START] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
+		job_process_set_pid (job, PROCESS_POST_START, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -8182,7 +8856,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_FREE_TAG (blocked);
 
@@ -8255,7 +8929,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_FREE_TAG (blocked);
 
@@ -8327,7 +9001,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_FREE_TAG (blocked);
 
@@ -8393,7 +9067,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_DIVERT_STDERR (output) {
 			job_process_handler (NULL, pid,
@@ -8440,7 +9114,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_DIVERT_STDERR (output) {
 			job_process_handler (NULL, pid,
@@ -8488,7 +9162,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_DIVERT_STDERR (output) {
 			job_process_handler (NULL, pid,
@@ -8537,7 +9211,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_DIVERT_STDERR (output) {
 			job_process_handler (NULL, pid,
@@ -8587,7 +9261,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_DIVERT_STDERR (output) {
 			job_process_handler (NULL, pid,
@@ -8662,7 +9336,7 @@ test_handler (void)
 		/* Now carry on with the test */
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_DIVERT_STDERR (output) {
 			job_process_handler (NULL, pid, NIH_CHILD_PTRACE,
@@ -8731,7 +9405,7 @@ test_handler (void)
 		/* Now carry on with the test */
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_DIVERT_STDERR (output) {
 			job_process_handler (NULL, pid, NIH_CHILD_PTRACE,
@@ -8790,7 +9464,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_DIVERT_STDERR (output) {
 			job_process_handler (NULL, pid, NIH_CHILD_PTRACE,
@@ -8845,7 +9519,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_DIVERT_STDERR (output) {
 			job_process_handler (NULL, pid, NIH_CHILD_PTRACE,
@@ -9188,20 +9862,20 @@ test_find (void)
 	nih_hash_add (job_classes, &class3->entry);
 
 	job1 = job_new (class1, "foo");
-	job1->pid[PROCESS_MAIN] = 10;
-	job1->pid[PROCESS_POST_START] = 15;
+	job_process_set_pid (job1, PROCESS_MAIN, 10);
+	job_process_set_pid (job1, PROCESS_POST_START, 15);
 
 	job2 = job_new (class1, "bar");
 
 	job3 = job_new (class2, "foo");
-	job3->pid[PROCESS_PRE_START] = 20;
+	job_process_set_pid (job3, PROCESS_PRE_START, 20);
 
 	job4 = job_new (class2, "bar");
-	job4->pid[PROCESS_MAIN] = 25;
-	job4->pid[PROCESS_PRE_STOP] = 30;
+	job_process_set_pid (job4, PROCESS_MAIN, 25);
+	job_process_set_pid (job4, PROCESS_PRE_STOP, 30);
 
 	job5 = job_new (class3, "");
-	job5->pid[PROCESS_POST_STOP] = 35;
+	job_process_set_pid (job5, PROCESS_POST_STOP, 35);
 
 
 	/* Check that we can find a job that exists by the pid of its
@@ -9261,6 +9935,38 @@ test_find (void)
 	TEST_EQ_P (ptr, NULL);
 
 
+	/* Check that a process whose pid changes, as happens when a
+	 * traced daemon forks, is only found by its new pid.
+	 */
+	TEST_FEATURE ("with changed pid");
+	job_process_set_pid (job4, PROCESS_MAIN, 40);
+
+	ptr = job_process_find (25, NULL);
+
+	TEST_EQ_P (ptr, NULL);
+
+	ptr = job_process_find (40, &process);
+
+	TEST_EQ_P (ptr, job4);
+	TEST_EQ (process, PROCESS_MAIN);
+
+
+	/* Check that a process whose pid has been cleared can no longer
+	 * be found, and that other processes of the same job still can.
+	 */
+	TEST_FEATURE ("with cleared pid");
+	job_process_set_pid (job1, PROCESS_MAIN, 0);
+
+	ptr = job_process_find (10, NULL);
+
+	TEST_EQ_P (ptr, NULL);
+
+	ptr = job_process_find (15, &process);
+
+	TEST_EQ_P (ptr, job1);
+	TEST_EQ (process, PROCESS_POST_START);
+
+
 	/* Check that we get NULL if there are jobs in the hash, but none
 	 * have pids.
 	 */
@@ -9337,7 +10043,7 @@ test_utmp (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -9402,7 +10108,7 @@ test_utmp (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -9470,7 +10176,7 @@ test_utmp (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 2);
 
 		TEST_FREE_TAG (blocked);
 
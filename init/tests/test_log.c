@@ -26,6 +26,10 @@
 #include <libgen.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <nih/test.h>
 #include <nih/timer.h>
 #include <nih/child.h>
@@ -35,6 +39,7 @@
 #include "test_util_common.h"
 
 extern int log_flushed;
+extern int log_offload_fd;
 
 /*
  * To help with understanding the TEST_ALLOC_FAIL peculiarities
@@ -84,6 +89,7 @@ test_log_new (void)
 	char             str2[] = "The end?";
 	char	         filename[1024];
 	char	         dirname[1024];
+	char	         subdir[1024];
 	char             buffer[1024];
 	ssize_t          ret;
 	ssize_t          bytes;
@@ -148,6 +154,11 @@ test_log_new (void)
 		TEST_EQ (log->io->watch->fd, pty_master);
 		TEST_EQ (log->uid, 0);
 		TEST_LT (log->fd, 0);
+		TEST_NE_P (log->io_watcher, NULL);
+		TEST_NE_P (log->io->watch->watcher, log->io_watcher);
+		TEST_EQ (log->splice_pipe[0], -1);
+		TEST_EQ (log->splice_pipe[1], -1);
+		TEST_FALSE (log->splice_disabled);
 		TEST_NE (log_unflushed_files, NULL);
 		TEST_TRUE (NIH_LIST_EMPTY (log_unflushed_files));
 
@@ -262,6 +273,12 @@ test_log_new (void)
 		TEST_EQ (ret, 1);
 		TEST_TRUE (NIH_LIST_EMPTY (log_unflushed_files));
 
+		/* Output may have been read in one piece or two */
+		TEST_EQ (log->bytes_written, strlen ("hello, world!\r\n"));
+		TEST_GT (log->writes, 0);
+		TEST_EQ (log->short_writes, 0);
+		TEST_EQ (log->enospc_dropped, 0);
+
 		nih_free (log);
 
 		TEST_EQ (stat (filename, &statbuf), 0);
@@ -574,6 +591,93 @@ test_log_new (void)
 
 	TEST_EQ (unlink (filename), 0);
 
+	/************************************************************/
+	TEST_FEATURE ("ensure oldest unflushed data dropped at size limit");
+
+	TEST_EQ (openpty (&pty_master, &pty_slave, NULL, NULL, NULL), 0);
+
+	TEST_GT (sprintf (subdir, "%s/limited", dirname), 0);
+	TEST_GT (sprintf (filename, "%s/test.log", subdir), 0);
+	log = log_new (NULL, filename, pty_master, 0);
+	TEST_NE_P (log, NULL);
+
+	log_set_limits (log, 0, 0, 8);
+
+	ret = write (pty_slave, str, strlen (str));
+	TEST_GT (ret, 0);
+	ret = write (pty_slave, "\n", 1);
+	TEST_EQ (ret, 1);
+
+	TEST_WATCH_UPDATE ();
+
+	/* Directory does not exist, so only the most recent output
+	 * should be buffered.
+	 */
+	TEST_LT (stat (filename, &statbuf), 0);
+	TEST_EQ (log->unflushed->len, 8);
+	TEST_EQ (memcmp (log->unflushed->buf, "world!\r\n", 8), 0);
+	TEST_EQ (log->dropped, 7);
+	TEST_EQ (log->dropped_pending, 7);
+
+	TEST_EQ (mkdir (subdir, 0755), 0);
+
+	ret = write (pty_slave, "foo\n", 4);
+	TEST_EQ (ret, 4);
+
+	TEST_WATCH_UPDATE ();
+
+	TEST_EQ (log->unflushed->len, 0);
+	TEST_EQ (log->dropped, 7);
+	TEST_EQ (log->dropped_pending, 0);
+
+	close (pty_slave);
+	nih_free (log);
+
+	output = fopen (filename, "r");
+	TEST_NE_P (output, NULL);
+
+	TEST_FILE_EQ (output, "[7 bytes of output dropped]\n");
+	TEST_FILE_EQ (output, "world!\r\n");
+	TEST_FILE_EQ (output, "foo\r\n");
+	TEST_FILE_END (output);
+	fclose (output);
+
+	TEST_EQ (unlink (filename), 0);
+	TEST_EQ (rmdir (subdir), 0);
+
+	/************************************************************/
+	TEST_FEATURE ("ensure output beyond rate limit dropped");
+
+	TEST_EQ (openpty (&pty_master, &pty_slave, NULL, NULL, NULL), 0);
+
+	TEST_GT (sprintf (filename, "%s/test.log", dirname), 0);
+	log = log_new (NULL, filename, pty_master, 0);
+	TEST_NE_P (log, NULL);
+
+	log_set_limits (log, 4, 0, 0);
+
+	ret = write (pty_slave, str, strlen (str));
+	TEST_GT (ret, 0);
+	ret = write (pty_slave, "\n", 1);
+	TEST_EQ (ret, 1);
+
+	TEST_WATCH_UPDATE ();
+
+	TEST_EQ (log->unflushed->len, 0);
+	TEST_EQ (log->dropped, strlen (str) + 2 - 4);
+
+	close (pty_slave);
+	nih_free (log);
+
+	output = fopen (filename, "r");
+	TEST_NE_P (output, NULL);
+
+	TEST_FILE_EQ (output, "hell");
+	TEST_FILE_END (output);
+	fclose (output);
+
+	TEST_EQ (unlink (filename), 0);
+
 	/************************************************************/
 	TEST_FEATURE ("ensure logger flushes cached data on request");
 
@@ -924,6 +1028,53 @@ test_log_new (void)
 	nih_free (log);
 	TEST_EQ (unlink (filename), 0);
 
+	/************************************************************/
+	TEST_FEATURE ("ensure new log written when file renamed with uid 0");
+
+	TEST_EQ (openpty (&pty_master, &pty_slave, NULL, NULL, NULL), 0);
+
+	TEST_GT (sprintf (filename, "%s/test.log", dirname), 0);
+	TEST_GT (sprintf (subdir, "%s/test.log.1", dirname), 0);
+
+	log = log_new (NULL, filename, pty_master, 0);
+	TEST_NE_P (log, NULL);
+
+	ret = write (pty_slave, str, strlen (str));
+	TEST_GT (ret, 0);
+	ret = write (pty_slave, "\n", 1);
+	TEST_EQ (ret, 1);
+
+	TEST_WATCH_UPDATE ();
+
+	TEST_TRUE (log->watched);
+
+	/* Rotate the file, as logrotate(8) would */
+	TEST_EQ (rename (filename, subdir), 0);
+
+	ret = write (pty_slave, str2, strlen (str2));
+	TEST_GT (ret, 0);
+	ret = write (pty_slave, "\n", 1);
+	TEST_EQ (ret, 1);
+
+	TEST_WATCH_UPDATE ();
+
+	output = fopen (subdir, "r");
+	TEST_NE_P (output, NULL);
+	TEST_FILE_EQ (output, "hello, world!\r\n");
+	TEST_FILE_END (output);
+	fclose (output);
+
+	output = fopen (filename, "r");
+	TEST_NE_P (output, NULL);
+	TEST_FILE_EQ (output, "The end?\r\n");
+	TEST_FILE_END (output);
+	fclose (output);
+
+	close (pty_slave);
+	nih_free (log);
+	TEST_EQ (unlink (filename), 0);
+	TEST_EQ (unlink (subdir), 0);
+
 	/************************************************************/
 	TEST_FEATURE ("writing 1 null with uid 0");
 
@@ -1446,6 +1597,417 @@ test_log_destroy (void)
 	TEST_FREE (log->unflushed);
 }
 
+/**
+ * test_splice_errno:
+ *
+ * When non-zero, splice(2) as called by log.c fails with this error
+ * rather than being made, as on kernels that don't support it.
+ **/
+static int test_splice_errno = 0;
+
+/**
+ * test_splice_calls:
+ *
+ * Number of times splice(2) has been called by log.c.
+ **/
+static int test_splice_calls = 0;
+
+ssize_t
+splice (int          fd_in,
+	loff_t      *off_in,
+	int          fd_out,
+	loff_t      *off_out,
+	size_t       len,
+	unsigned int flags)
+{
+	test_splice_calls++;
+
+	if (test_splice_errno) {
+		errno = test_splice_errno;
+		return -1;
+	}
+
+	return syscall (SYS_splice, fd_in, off_in, fd_out, off_out,
+			len, flags);
+}
+
+void
+test_log_splice (void)
+{
+	Log         *log;
+	char         filename[1024];
+	ssize_t      ret;
+	FILE        *output;
+	int          fd;
+	int          pty_master;
+	int          pty_slave;
+
+	TEST_FUNCTION ("log_splice");
+
+	TEST_FILENAME (filename);
+
+	/************************************************************/
+	/* Output is moved from the pty into the log file without passing
+	 * through the NihIo buffer, appended to what the file already
+	 * had.
+	 */
+	TEST_FEATURE ("with splice");
+
+	fd = open (filename, O_CREAT | O_EXCL | O_WRONLY, 0640);
+	TEST_NE (fd, -1);
+	TEST_EQ (write (fd, "existing\n", 9), 9);
+	close (fd);
+
+	TEST_EQ (openpty (&pty_master, &pty_slave, NULL, NULL, NULL), 0);
+
+	log = log_new (NULL, filename, pty_master, 0);
+	TEST_NE_P (log, NULL);
+
+	test_splice_calls = 0;
+
+	ret = write (pty_slave, "hello, world!\n", 14);
+	TEST_EQ (ret, 14);
+
+	TEST_WATCH_UPDATE ();
+
+	TEST_GT (test_splice_calls, 0);
+	TEST_FALSE (log->splice_disabled);
+	TEST_NE (log->splice_pipe[0], -1);
+	TEST_NE (log->splice_pipe[1], -1);
+	TEST_EQ (log->io->recv_buf->len, 0);
+	TEST_EQ (log->unflushed->len, 0);
+	TEST_EQ (log->bytes_written, 15);
+
+	output = fopen (filename, "r");
+	TEST_NE_P (output, NULL);
+
+	TEST_FILE_EQ (output, "existing\n");
+	TEST_FILE_EQ (output, "hello, world!\r\n");
+	TEST_FILE_END (output);
+	fclose (output);
+
+	close (pty_slave);
+	nih_free (log);
+
+	TEST_EQ (unlink (filename), 0);
+
+	/************************************************************/
+	/* When the kernel rejects splice(2) with EINVAL, the output is
+	 * read and written the standard way instead, and splicing isn't
+	 * tried again for the log.
+	 */
+	TEST_FEATURE ("with splice unsupported");
+
+	TEST_EQ (openpty (&pty_master, &pty_slave, NULL, NULL, NULL), 0);
+
+	log = log_new (NULL, filename, pty_master, 0);
+	TEST_NE_P (log, NULL);
+
+	test_splice_calls = 0;
+	test_splice_errno = EINVAL;
+
+	ret = write (pty_slave, "hello, world!\n", 14);
+	TEST_EQ (ret, 14);
+
+	TEST_WATCH_UPDATE ();
+
+	TEST_EQ (test_splice_calls, 1);
+	TEST_TRUE (log->splice_disabled);
+	TEST_EQ (log->unflushed->len, 0);
+
+	ret = write (pty_slave, "The end?\n", 9);
+	TEST_EQ (ret, 9);
+
+	TEST_WATCH_UPDATE ();
+
+	TEST_EQ (test_splice_calls, 1);
+
+	test_splice_errno = 0;
+
+	output = fopen (filename, "r");
+	TEST_NE_P (output, NULL);
+
+	TEST_FILE_EQ (output, "hello, world!\r\n");
+	TEST_FILE_EQ (output, "The end?\r\n");
+	TEST_FILE_END (output);
+	fclose (output);
+
+	close (pty_slave);
+	nih_free (log);
+
+	TEST_EQ (unlink (filename), 0);
+
+	/************************************************************/
+	/* Rate limiting must see the output, so it isn't spliced. */
+	TEST_FEATURE ("with rate limit");
+
+	TEST_EQ (openpty (&pty_master, &pty_slave, NULL, NULL, NULL), 0);
+
+	log = log_new (NULL, filename, pty_master, 0);
+	TEST_NE_P (log, NULL);
+
+	log_set_limits (log, 1024, 1024, 0);
+
+	test_splice_calls = 0;
+
+	ret = write (pty_slave, "hello, world!\n", 14);
+	TEST_EQ (ret, 14);
+
+	TEST_WATCH_UPDATE ();
+
+	TEST_EQ (test_splice_calls, 0);
+	TEST_EQ (log->splice_pipe[0], -1);
+
+	output = fopen (filename, "r");
+	TEST_NE_P (output, NULL);
+
+	TEST_FILE_EQ (output, "hello, world!\r\n");
+	TEST_FILE_END (output);
+	fclose (output);
+
+	close (pty_slave);
+	nih_free (log);
+
+	TEST_EQ (unlink (filename), 0);
+}
+
+void
+test_log_offload (void)
+{
+	char                filename[1024];
+	char                buf[sizeof (LogOffloadMessage) + PATH_MAX + 1];
+	char                control[CMSG_SPACE (sizeof (int))];
+	LogOffloadMessage   msg;
+	struct iovec        iov;
+	struct msghdr       hdr;
+	struct cmsghdr     *cmsg;
+	struct stat         sent_buf;
+	struct stat         received_buf;
+	FILE               *output;
+	ssize_t             len;
+	pid_t               pid;
+	int                 status;
+	int                 sv[2];
+	int                 fd;
+	int                 ret;
+	int                 pty_master;
+	int                 pty_slave;
+
+	TEST_FUNCTION ("log_offload_send");
+
+	/************************************************************/
+	TEST_FEATURE ("with no logger");
+
+	TEST_EQ (openpty (&pty_master, &pty_slave, NULL, NULL, NULL), 0);
+
+	TEST_EQ (log_offload_send ("/foo", pty_master, 0, 0, 0), -1);
+
+	/* Caller retains ownership of the fd */
+	TEST_NE (fcntl (pty_master, F_GETFD), -1);
+
+	/* Should be a no-op */
+	log_offload_flush ();
+	log_reopen ();
+
+	close (pty_master);
+	close (pty_slave);
+
+	/************************************************************/
+	TEST_FEATURE ("with logger");
+
+	TEST_EQ (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv), 0);
+	log_offload_fd = sv[0];
+
+	TEST_EQ (openpty (&pty_master, &pty_slave, NULL, NULL, NULL), 0);
+
+	TEST_EQ (log_offload_send ("/foo", pty_master, 10, 20, 30), 0);
+
+	/* Caller retains ownership of the fd */
+	TEST_NE (fcntl (pty_master, F_GETFD), -1);
+
+	iov.iov_base = buf;
+	iov.iov_len  = sizeof (buf);
+
+	memset (&hdr, '\0', sizeof (hdr));
+	hdr.msg_iov        = &iov;
+	hdr.msg_iovlen     = 1;
+	hdr.msg_control    = control;
+	hdr.msg_controllen = sizeof (control);
+
+	len = recvmsg (sv[1], &hdr, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+	TEST_EQ (len, sizeof (msg) + strlen ("/foo") + 1);
+
+	memcpy (&msg, buf, sizeof (msg));
+	TEST_EQ (msg.type, LOG_OFFLOAD_OPEN);
+	TEST_EQ (msg.rate, 10);
+	TEST_EQ (msg.burst, 20);
+	TEST_EQ (msg.size, 30);
+	TEST_EQ_STR (buf + sizeof (msg), "/foo");
+
+	/* The pty master should have been passed as SCM_RIGHTS, arriving
+	 * as a new fd for the same pty.
+	 */
+	cmsg = CMSG_FIRSTHDR (&hdr);
+	TEST_NE_P (cmsg, NULL);
+	TEST_EQ (cmsg->cmsg_level, SOL_SOCKET);
+	TEST_EQ (cmsg->cmsg_type, SCM_RIGHTS);
+	TEST_EQ (cmsg->cmsg_len, CMSG_LEN (sizeof (int)));
+	TEST_EQ_P (CMSG_NXTHDR (&hdr, cmsg), NULL);
+
+	memcpy (&fd, CMSG_DATA (cmsg), sizeof (int));
+	TEST_NE (fd, pty_master);
+
+	TEST_EQ (fstat (pty_master, &sent_buf), 0);
+	TEST_EQ (fstat (fd, &received_buf), 0);
+	TEST_EQ (received_buf.st_dev, sent_buf.st_dev);
+	TEST_EQ (received_buf.st_ino, sent_buf.st_ino);
+
+	close (fd);
+
+	/* Flushing and reopening are passed on without an fd */
+	log_offload_flush ();
+
+	len = recv (sv[1], buf, sizeof (buf), MSG_DONTWAIT);
+	TEST_EQ (len, sizeof (msg));
+
+	memcpy (&msg, buf, sizeof (msg));
+	TEST_EQ (msg.type, LOG_OFFLOAD_FLUSH);
+
+	log_reopen ();
+
+	len = recv (sv[1], buf, sizeof (buf), MSG_DONTWAIT);
+	TEST_EQ (len, sizeof (msg));
+
+	memcpy (&msg, buf, sizeof (msg));
+	TEST_EQ (msg.type, LOG_OFFLOAD_REOPEN);
+
+	/************************************************************/
+	/* While the logger isn't keeping up, the caller (init) must log
+	 * the job itself, but the logger is still used afterwards.
+	 */
+	TEST_FEATURE ("with busy logger");
+
+	/* Fill the socket with messages the logger hasn't read yet */
+	memset (buf, '\0', sizeof (buf));
+	while (send (sv[0], buf, sizeof (msg), MSG_DONTWAIT) > 0)
+		;
+
+	TEST_EQ (errno, EAGAIN);
+
+	TEST_EQ (log_offload_send ("/foo", pty_master, 0, 0, 0), -1);
+	TEST_EQ (log_offload_fd, sv[0]);
+
+	/* Receiving them makes room again */
+	while (recv (sv[1], buf, sizeof (buf), MSG_DONTWAIT) > 0)
+		;
+
+	TEST_EQ (log_offload_send ("/foo", pty_master, 0, 0, 0), 0);
+
+	/************************************************************/
+	/* Once the logger has gone, the caller logs every job itself
+	 * and the logger is not used again.
+	 */
+	TEST_FEATURE ("with logger gone");
+
+	/* Closing the socket closes any fds still queued on it */
+	close (sv[1]);
+
+	output = tmpfile ();
+	TEST_NE_P (output, NULL);
+
+	TEST_DIVERT_STDERR (output) {
+		TEST_EQ (log_offload_send ("/foo", pty_master, 0, 0, 0), -1);
+	}
+	rewind (output);
+
+	TEST_EQ (log_offload_fd, -1);
+	TEST_FILE_MATCH (output, "*Job output logger unavailable: *\n");
+	TEST_FILE_END (output);
+	fclose (output);
+
+	TEST_NE (fcntl (pty_master, F_GETFD), -1);
+	TEST_EQ (fcntl (sv[0], F_GETFD), -1);
+	TEST_EQ (errno, EBADF);
+
+	TEST_EQ (log_offload_send ("/foo", pty_master, 0, 0, 0), -1);
+
+	close (pty_master);
+	close (pty_slave);
+
+
+	TEST_FUNCTION ("log_offload_server");
+
+	/************************************************************/
+	/* The logger writes the output of the job whose pty master was
+	 * passed to it, and once both the job and init have closed their
+	 * ends, exits.
+	 */
+	TEST_FEATURE ("with job output");
+
+	TEST_FILENAME (filename);
+
+	TEST_EQ (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv), 0);
+
+	TEST_CHILD (pid) {
+		close (sv[0]);
+
+		exit (log_offload_server (sv[1]));
+	}
+
+	close (sv[1]);
+	log_offload_fd = sv[0];
+
+	TEST_EQ (openpty (&pty_master, &pty_slave, NULL, NULL, NULL), 0);
+
+	TEST_EQ (log_offload_send (filename, pty_master, 0, 0, 0), 0);
+
+	/* Only the logger's copy of the pty master is left open */
+	close (pty_master);
+
+	ret = write (pty_slave, "hello, world!\n", 14);
+	TEST_EQ (ret, 14);
+
+	close (pty_slave);
+
+	/* As init would on re-exec */
+	close (sv[0]);
+	log_offload_fd = -1;
+
+	waitpid (pid, &status, 0);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 0);
+
+	output = fopen (filename, "r");
+	TEST_NE_P (output, NULL);
+
+	TEST_FILE_EQ (output, "hello, world!\r\n");
+	TEST_FILE_END (output);
+	fclose (output);
+
+	TEST_EQ (unlink (filename), 0);
+
+	/************************************************************/
+	/* A logger that has nothing to log exits as soon as init closes
+	 * its end.
+	 */
+	TEST_FEATURE ("with no jobs");
+
+	TEST_EQ (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv), 0);
+
+	TEST_CHILD (pid) {
+		close (sv[0]);
+
+		exit (log_offload_server (sv[1]));
+	}
+
+	close (sv[1]);
+	close (sv[0]);
+
+	waitpid (pid, &status, 0);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 0);
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -1455,6 +2017,8 @@ main (int   argc,
 
 	test_log_new ();
 	test_log_destroy ();
+	test_log_splice ();
+	test_log_offload ();
 
 	return 0;
 }
@@ -0,0 +1,188 @@
+/* upstart
+ *
+ * test_log_store.c - test suite for init/log_store.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nih/test.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/error.h>
+
+#include "log_store.h"
+
+
+static char records[16][64];
+static int  records_read = 0;
+static int  records_max = 16;
+
+static int
+my_reader (void                 *data,
+	   const LogStoreRecord *record,
+	   const char           *buf)
+{
+	TEST_EQ (record->magic, LOG_STORE_RECORD_MAGIC);
+	TEST_LT (record->len, sizeof (records[0]));
+
+	sprintf (records[records_read++], "%d:%d:%.*s", record->pid,
+		 record->process, (int)record->len, buf);
+
+	return (records_read < records_max) ? 0 : -1;
+}
+
+
+void
+test_path (void)
+{
+	char *path;
+
+	TEST_FUNCTION ("log_store_path");
+
+	/* Check that a job without an instance is named for the job. */
+	TEST_FEATURE ("without instance");
+	path = log_store_path (NULL, "/var/log/upstart", "foo", NULL);
+
+	TEST_EQ_STR (path, "/var/log/upstart/foo.log");
+	nih_free (path);
+
+
+	/* Check that slashes in the job and instance names are remapped,
+	 * but not those of the directory.
+	 */
+	TEST_FEATURE ("with instance");
+	path = log_store_path (NULL, "/var/log/upstart", "foo/bar", "a/b");
+
+	TEST_EQ_STR (path, "/var/log/upstart/foo_bar-a_b.log");
+	nih_free (path);
+}
+
+
+void
+test_append (void)
+{
+	char            dirname[PATH_MAX];
+	nih_local char *log_path = NULL;
+	nih_local char *path = NULL;
+	LogStore       *store;
+	struct stat     statbuf;
+	uint64_t        until = 0;
+
+	TEST_FUNCTION ("log_store_append");
+	TEST_FILENAME (dirname);
+	TEST_EQ (mkdir (dirname, 0755), 0);
+
+	log_path = log_store_path (NULL, dirname, "test", NULL);
+	path = nih_sprintf (NULL, "%s%s", log_path, LOG_STORE_SEGMENT_EXT);
+
+	/* Check that records appended can be read back in order, with the
+	 * pid and process type of the store.
+	 */
+	TEST_FEATURE ("with new segment");
+	store = log_store_new (NULL, log_path, 2);
+	TEST_NE_P (store, NULL);
+	store->pid = 1234;
+
+	TEST_EQ (log_store_append (store, "hello\n", 6), 0);
+	TEST_EQ (log_store_append (store, "world\n", 6), 0);
+
+	TEST_EQ (stat (path, &statbuf), 0);
+	TEST_EQ (statbuf.st_size, (off_t)(strlen (LOG_STORE_MAGIC)
+					  + 2 * (sizeof (LogStoreRecord) + 8)));
+
+	records_read = 0;
+	TEST_EQ (log_store_read (log_path, 0, &until, my_reader, NULL), 1);
+
+	TEST_EQ (records_read, 2);
+	TEST_EQ_STR (records[0], "1234:2:hello\n");
+	TEST_EQ_STR (records[1], "1234:2:world\n");
+	TEST_GT (until, 0);
+
+
+	/* Check that only records no earlier than the time given are
+	 * read.
+	 */
+	TEST_FEATURE ("with since time");
+	TEST_EQ (log_store_append (store, "later\n", 6), 0);
+
+	records_read = 0;
+	TEST_EQ (log_store_read (log_path, until + 1, &until, my_reader,
+				 NULL), 1);
+
+	TEST_EQ (records_read, 1);
+	TEST_EQ_STR (records[0], "1234:2:later\n");
+
+	nih_free (store);
+
+
+	/* Check that a new store for the same path appends to the
+	 * segment, and that the reader may stop early.
+	 */
+	TEST_FEATURE ("with existing segment");
+	store = log_store_new (NULL, log_path, 0);
+	store->pid = 5678;
+
+	TEST_EQ (log_store_append (store, "again\n", 6), 0);
+	nih_free (store);
+
+	records_read = 0;
+	records_max = 3;
+	until = 0;
+	TEST_EQ (log_store_read (log_path, 0, &until, my_reader, NULL), 1);
+	records_max = 16;
+
+	TEST_EQ (records_read, 3);
+	TEST_EQ_STR (records[2], "1234:2:later\n");
+
+
+	/* Check that reading a store that was never written finds
+	 * nothing.
+	 */
+	TEST_FEATURE ("with no segment");
+	nih_free (log_path);
+	log_path = log_store_path (NULL, dirname, "none", NULL);
+
+	records_read = 0;
+	TEST_EQ (log_store_read (log_path, 0, &until, my_reader, NULL), 0);
+	TEST_EQ (records_read, 0);
+
+	nih_free (path);
+	path = log_store_path (NULL, dirname, "test", NULL);
+	nih_free (log_path);
+	log_path = nih_sprintf (NULL, "%s%s", path, LOG_STORE_SEGMENT_EXT);
+	TEST_EQ (unlink (log_path), 0);
+	nih_free (log_path);
+	log_path = nih_sprintf (NULL, "%s%s", path, LOG_STORE_INDEX_EXT);
+	TEST_EQ (unlink (log_path), 0);
+
+	TEST_EQ (rmdir (dirname), 0);
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	test_path ();
+	test_append ();
+
+	return 0;
+}
@@ -0,0 +1,318 @@
+/* upstart
+ *
+ * test_metrics.c - test suite for init/metrics.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <nih/test.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/main.h>
+
+#include "event.h"
+#include "metrics.h"
+
+
+void
+test_bucket (void)
+{
+	size_t last = 0;
+
+	TEST_FUNCTION ("metrics_bucket");
+
+	/* Check that small values have a bucket each. */
+	TEST_FEATURE ("with small values");
+	for (uint64_t i = 0; i < METRICS_SUB_BUCKETS; i++) {
+		TEST_EQ (metrics_bucket (i), i);
+		TEST_EQ (metrics_bucket_lower (i), i);
+	}
+
+
+	/* Check that each bucket follows the last without gaps, that the
+	 * lowest value of each is counted in it and that none is wider
+	 * than an eighth of its lowest value.
+	 */
+	TEST_FEATURE ("with larger values");
+	for (size_t i = METRICS_SUB_BUCKETS; i < METRICS_BUCKETS; i++) {
+		uint64_t lower = metrics_bucket_lower (i);
+		uint64_t width;
+
+		TEST_EQ (metrics_bucket (lower), i);
+		TEST_EQ (metrics_bucket (lower - 1), i - 1);
+
+		if (i < METRICS_BUCKETS - 1) {
+			width = metrics_bucket_lower (i + 1) - lower;
+			TEST_LE (width * METRICS_SUB_BUCKETS, lower);
+		}
+
+		last = i;
+	}
+	TEST_EQ (last, METRICS_BUCKETS - 1);
+
+
+	/* Check that values too large for a bucket of their own are
+	 * counted in the last.
+	 */
+	TEST_FEATURE ("with huge value");
+	TEST_EQ (metrics_bucket (UINT64_MAX), METRICS_BUCKETS - 1);
+}
+
+
+void
+test_percentile (void)
+{
+	MetricsHistogram *histogram;
+
+	TEST_FUNCTION ("metrics_percentile");
+	metrics_reset ();
+	histogram = &metrics_histograms[METRICS_SPAWN_LATENCY];
+
+	/* Check that an empty histogram has no percentiles. */
+	TEST_FEATURE ("with no values");
+	TEST_EQ (metrics_percentile (histogram, 50), 0);
+
+
+	/* Check that percentiles are within the precision of the buckets
+	 * of the values recorded, and never more than the largest.
+	 */
+	TEST_FEATURE ("with values");
+	for (uint64_t i = 1; i <= 1000; i++)
+		metrics_record (METRICS_SPAWN_LATENCY, i * 10);
+
+	TEST_EQ (histogram->count, 1000);
+	TEST_EQ (histogram->sum, 5005000);
+	TEST_EQ (histogram->max, 10000);
+
+	TEST_GE (metrics_percentile (histogram, 50), 5000);
+	TEST_LE (metrics_percentile (histogram, 50), 5000 + 5000 / 8);
+	TEST_GE (metrics_percentile (histogram, 99), 9900);
+	TEST_LE (metrics_percentile (histogram, 99), 10000);
+	TEST_EQ (metrics_percentile (histogram, 100), 10000);
+
+	metrics_reset ();
+}
+
+
+void
+test_to_string (void)
+{
+	Event *event;
+	char  *str;
+
+	TEST_FUNCTION ("metrics_to_string");
+	event_init ();
+	metrics_reset ();
+
+	/* Check that events are counted as they are queued, and the queue
+	 * depth as they are freed.
+	 */
+	TEST_FEATURE ("with queued event");
+	event = event_new (NULL, "test", NULL);
+	event_block (event);
+
+	TEST_EQ (metrics_counters[METRICS_EVENTS_EMITTED], 1);
+	TEST_EQ (metrics_counters[METRICS_EVENT_BLOCKERS], 1);
+	TEST_EQ (metrics_queue_depth, 1);
+	TEST_EQ (metrics_queue_peak, 1);
+
+	event_unblock (event);
+	nih_free (event);
+
+	TEST_EQ (metrics_queue_depth, 0);
+	TEST_EQ (metrics_queue_peak, 1);
+
+
+	/* Check that the snapshot groups the counters by what they count
+	 * and includes each histogram's non-empty buckets.
+	 */
+	TEST_FEATURE ("with snapshot");
+	metrics_record (METRICS_EVENT_LATENCY, 3);
+
+	TEST_ALLOC_FAIL {
+		str = metrics_to_string (NULL);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (str, NULL);
+			continue;
+		}
+
+		TEST_EQ_STRN (str, "{ \"events\": { \"emitted\": 1, "
+			      "\"handled\": 0, \"failed\": 0, \"blockers\": 1, "
+			      "\"queue_depth\": 0, \"queue_peak\": 1 }, "
+			      "\"jobs\": { \"started\": 0, ");
+		TEST_NE_P (strstr (str, "\"admission_queued\": 0, "
+				   "\"admission_peak\": 0 }, "
+				   "\"processes\": {"), NULL);
+		TEST_NE_P (strstr (str, "\"log\": { \"bytes\": 0, "
+				   "\"unflushed\": 0 }, \"alloc\": {"), NULL);
+		TEST_NE_P (strstr (str, "}, \"startup\": { \"ready\": 0, "
+				   "\"event\": 0, \"spawn\": 0 }, "
+				   "\"latency\": {"), NULL);
+		TEST_NE_P (strstr (str, "\"event\": { \"count\": 1, "
+				   "\"sum\": 3, \"max\": 3, \"p50\": 3, "
+				   "\"p90\": 3, \"p99\": 3, "
+				   "\"buckets\": [ [ 3, 1 ] ] }"), NULL);
+		TEST_EQ_STR (str + strlen (str) - 4, " } }");
+
+		nih_free (str);
+	}
+
+	metrics_reset ();
+}
+
+
+void
+test_stall (void)
+{
+	MetricsStall  stall;
+	MetricsStall  part;
+	FILE         *output;
+	char          name[METRICS_STALL_NAME_MAX + 16];
+
+	TEST_FUNCTION ("metrics_stall_end");
+	output = tmpfile ();
+	metrics_reset ();
+
+	/* Check that nothing is timed without a threshold. */
+	TEST_FEATURE ("without threshold");
+	metrics_stall_threshold = 0;
+
+	metrics_stall_begin (&stall, "test", "foo");
+	TEST_EQ (stall.started, 0);
+	metrics_stall_end (&stall);
+
+	TEST_EQ (metrics_stall_count, 0);
+	TEST_EQ (metrics_stalls_len, 0);
+
+
+	/* Check that a callback quicker than the threshold is not kept. */
+	TEST_FEATURE ("with quick callback");
+	metrics_stall_threshold = 1000;
+
+	metrics_stall_begin (&stall, "test", "foo");
+	TEST_NE (stall.started, 0);
+	metrics_stall_end (&stall);
+
+	TEST_EQ (metrics_stall_count, 0);
+	TEST_EQ (metrics_stalls_len, 0);
+
+
+	/* Check that a callback slower than the threshold is logged with
+	 * the name it was attributed to, and kept.
+	 */
+	TEST_FEATURE ("with slow callback");
+	metrics_stall_threshold = 1;
+
+	metrics_stall_begin (&stall, "test", NULL);
+	metrics_stall_name (&stall, "foo");
+	usleep (20000);
+
+	TEST_DIVERT_STDERR (output) {
+		metrics_stall_end (&stall);
+	}
+	rewind (output);
+
+	TEST_FILE_MATCH (output, "test: Main loop stalled for * ms in test for foo\n");
+	TEST_FILE_END (output);
+	TEST_FILE_RESET (output);
+
+	TEST_EQ (metrics_stall_count, 1);
+	TEST_EQ (metrics_stalls_len, 1);
+	TEST_EQ_STR (metrics_stalls[0].callback, "test");
+	TEST_EQ_STR (metrics_stalls[0].name, "foo");
+	TEST_GE (metrics_stalls[0].duration, 20000);
+
+
+	/* Check that a callback handling many objects is attributed to
+	 * the one that took longest, that names too long are truncated
+	 * and that the worst stall is kept first.
+	 */
+	TEST_FEATURE ("with attributed callback");
+	memset (name, 'x', sizeof (name) - 1);
+	name[sizeof (name) - 1] = '\0';
+
+	metrics_stall_begin (&stall, "test", NULL);
+
+	metrics_stall_begin (&part, "test", "bar");
+	metrics_stall_attribute (&stall, &part);
+
+	metrics_stall_begin (&part, "test", name);
+	usleep (40000);
+	metrics_stall_attribute (&stall, &part);
+
+	metrics_stall_begin (&part, "test", "baz");
+	metrics_stall_attribute (&stall, &part);
+
+	TEST_DIVERT_STDERR (output) {
+		metrics_stall_end (&stall);
+	}
+	rewind (output);
+	TEST_FILE_RESET (output);
+
+	TEST_EQ (metrics_stall_count, 2);
+	TEST_EQ (metrics_stalls_len, 2);
+	TEST_EQ (strlen (metrics_stalls[0].name), METRICS_STALL_NAME_MAX - 1);
+	TEST_EQ_STR (metrics_stalls[1].name, "foo");
+	TEST_GE (metrics_stalls[0].duration, 40000);
+
+
+	/* Check that only the worst stalls are kept. */
+	TEST_FEATURE ("with many stalls");
+	for (int i = 0; i < METRICS_STALLS; i++) {
+		metrics_stall_begin (&stall, "test", "quick");
+		usleep (1100);
+
+		TEST_DIVERT_STDERR (output) {
+			metrics_stall_end (&stall);
+		}
+		rewind (output);
+		TEST_FILE_RESET (output);
+	}
+
+	TEST_EQ (metrics_stall_count, METRICS_STALLS + 2);
+	TEST_EQ (metrics_stalls_len, METRICS_STALLS);
+	TEST_EQ (strlen (metrics_stalls[0].name), METRICS_STALL_NAME_MAX - 1);
+	TEST_EQ_STR (metrics_stalls[1].name, "foo");
+
+	metrics_stall_threshold = 0;
+	metrics_reset ();
+
+	fclose (output);
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	/* run tests in legacy (pre-session support) mode */
+	setenv ("UPSTART_NO_SESSIONS", "1", 1);
+
+	nih_main_init (argv[0]);
+	program_name = "test";
+
+	test_bucket ();
+	test_percentile ();
+	test_to_string ();
+	test_stall ();
+
+	return 0;
+}
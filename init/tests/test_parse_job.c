@@ -21,6 +21,7 @@
 
 #include <nih/test.h>
 
+#include <sched.h>
 #include <signal.h>
 #include <string.h>
 
@@ -111,6 +112,57 @@ test_parse_job (void)
 	}
 
 
+	/* Check that stanzas are found however they are laid out: after
+	 * comments and blank lines, indented, followed directly by a
+	 * comment, and at the end of the file without a newline.
+	 */
+	TEST_FEATURE ("with stanzas between comments and blank lines");
+	strcpy (buf, "# comment\n");
+	strcat (buf, "\n");
+	strcat (buf, "  \tdescription \"a job\"\n");
+	strcat (buf, "task# comment\n");
+	strcat (buf, "   \n");
+	strcat (buf, "exec /sbin/daemon\n");
+	strcat (buf, "author me");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+			 &pos, &lineno);
+
+	TEST_NE_P (job, NULL);
+	TEST_EQ (pos, strlen (buf));
+	TEST_EQ (lineno, 7);
+
+	TEST_EQ_STR (job->description, "a job");
+	TEST_EQ (job->task, TRUE);
+	TEST_EQ_STR (job->process[PROCESS_MAIN]->command, "/sbin/daemon");
+	TEST_EQ_STR (job->author, "me");
+
+	nih_free (job);
+
+
+	/* Check that an unknown stanza is still reported, on the line
+	 * it was found.
+	 */
+	TEST_FEATURE ("with unknown stanza");
+	strcpy (buf, "task\n");
+	strcat (buf, "\n");
+	strcat (buf, "frodo baggins\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+			 &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, NIH_CONFIG_UNKNOWN_STANZA);
+	TEST_EQ (lineno, 3);
+	nih_free (err);
+
+
 	/* Check that a job may have both exec and script missing.
 	 */
 	TEST_FEATURE ("with missing exec and script");
@@ -4328,6 +4380,105 @@ test_stanza_expect (void)
 	}
 
 
+	/* Check that expect daemon passive sets the job's expect member to
+	 * EXPECT_DAEMON_PASSIVE.
+	 */
+	TEST_FEATURE ("with daemon passive arguments");
+	strcpy (buf, "expect daemon passive\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 2);
+
+		TEST_ALLOC_SIZE (job, sizeof (JobClass));
+
+		TEST_EQ (job->expect, EXPECT_DAEMON_PASSIVE);
+
+		nih_free (job);
+	}
+
+
+	/* Check that expect fork passive sets the job's expect member to
+	 * EXPECT_FORK_PASSIVE.
+	 */
+	TEST_FEATURE ("with fork passive arguments");
+	strcpy (buf, "expect fork passive\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 2);
+
+		TEST_ALLOC_SIZE (job, sizeof (JobClass));
+
+		TEST_EQ (job->expect, EXPECT_FORK_PASSIVE);
+
+		nih_free (job);
+	}
+
+
+	/* Check that expect notify sets the job's expect member to
+	 * EXPECT_NOTIFY.
+	 */
+	TEST_FEATURE ("with notify argument");
+	strcpy (buf, "expect notify\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 2);
+
+		TEST_ALLOC_SIZE (job, sizeof (JobClass));
+
+		TEST_EQ (job->expect, EXPECT_NOTIFY);
+
+		nih_free (job);
+	}
+
+
 	/* Check that expect none sets the job's expect member to
 	 * EXPECT_NONE.
 	 */
@@ -4449,6 +4600,25 @@ test_stanza_expect (void)
 	TEST_EQ (pos, 14);
 	TEST_EQ (lineno, 1);
 	nih_free (err);
+
+
+	/* Check that passive may not be given to other expect
+	 * arguments.
+	 */
+	TEST_FEATURE ("with passive argument to stop");
+	strcpy (buf, "expect stop passive\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, NIH_CONFIG_UNEXPECTED_TOKEN);
+	TEST_EQ (pos, 12);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
 }
 
 void
@@ -4853,23 +5023,13 @@ test_stanza_respawn (void)
 	TEST_EQ (pos, 8);
 	TEST_EQ (lineno, 1);
 	nih_free (err);
-}
-
-void
-test_stanza_task (void)
-{
-	JobClass*job;
-	NihError *err;
-	size_t    pos, lineno;
-	char      buf[1024];
 
-	TEST_FUNCTION ("stanza_task");
 
-	/* Check that a task stanza without any arguments sets the job's
-	 * task flag.
+	/* Check that a respawn stanza with the backoff argument and initial
+	 * and maximum delays results in them being stored in the job.
 	 */
-	TEST_FEATURE ("with no arguments");
-	strcpy (buf, "task\n");
+	TEST_FEATURE ("with backoff and two arguments");
+	strcpy (buf, "respawn backoff 1 60\n");
 
 	TEST_ALLOC_FAIL {
 		pos = 0;
@@ -4892,16 +5052,19 @@ test_stanza_task (void)
 
 		TEST_ALLOC_SIZE (job, sizeof (JobClass));
 
-		TEST_TRUE (job->task);
+		TEST_EQ (job->respawn_backoff_initial, 1);
+		TEST_EQ (job->respawn_backoff_max, 60);
+		TEST_EQ (job->respawn_backoff_jitter, 0);
 
 		nih_free (job);
 	}
 
 
-	/* Check that multiple task stanzas are permitted. */
-	TEST_FEATURE ("with multiple stanzas");
-	strcpy (buf, "task\n");
-	strcat (buf, "task\n");
+	/* Check that a respawn stanza with the backoff argument, delays and
+	 * jitter results in them being stored in the job.
+	 */
+	TEST_FEATURE ("with backoff and jitter");
+	strcpy (buf, "respawn backoff 2 30 25\n");
 
 	TEST_ALLOC_FAIL {
 		pos = 0;
@@ -4920,21 +5083,99 @@ test_stanza_task (void)
 		}
 
 		TEST_EQ (pos, strlen (buf));
-		TEST_EQ (lineno, 3);
+		TEST_EQ (lineno, 2);
 
 		TEST_ALLOC_SIZE (job, sizeof (JobClass));
 
-		TEST_TRUE (job->task);
+		TEST_EQ (job->respawn_backoff_initial, 2);
+		TEST_EQ (job->respawn_backoff_max, 30);
+		TEST_EQ (job->respawn_backoff_jitter, 25);
 
 		nih_free (job);
 	}
 
 
-	/* Check that a task stanza with arguments results in a syntax
-	 * error.
+	/* Check that a respawn backoff stanza with a missing maximum delay
+	 * results in a syntax error.
 	 */
-	TEST_FEATURE ("with arguments");
-	strcpy (buf, "task foo\n");
+	TEST_FEATURE ("with backoff and missing second argument");
+	strcpy (buf, "respawn backoff 1\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, NIH_CONFIG_EXPECTED_TOKEN);
+	TEST_EQ (pos, 17);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that a respawn backoff stanza with a zero initial delay
+	 * results in a syntax error.
+	 */
+	TEST_FEATURE ("with backoff and zero initial delay");
+	strcpy (buf, "respawn backoff 0 60\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, PARSE_ILLEGAL_INTERVAL);
+	TEST_EQ (pos, 16);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that a respawn backoff stanza with a maximum less than the
+	 * initial delay results in a syntax error.
+	 */
+	TEST_FEATURE ("with backoff and maximum below initial delay");
+	strcpy (buf, "respawn backoff 10 5\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, PARSE_ILLEGAL_INTERVAL);
+	TEST_EQ (pos, 19);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that a respawn backoff stanza with a jitter over 100%
+	 * results in a syntax error.
+	 */
+	TEST_FEATURE ("with backoff and too-large jitter");
+	strcpy (buf, "respawn backoff 1 60 101\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, PARSE_ILLEGAL_JITTER);
+	TEST_EQ (pos, 21);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that a respawn backoff stanza with an extra argument
+	 * results in a syntax error.
+	 */
+	TEST_FEATURE ("with extra argument to backoff");
+	strcpy (buf, "respawn backoff 1 60 10 foo\n");
 
 	pos = 0;
 	lineno = 1;
@@ -4944,26 +5185,26 @@ test_stanza_task (void)
 
 	err = nih_error_get ();
 	TEST_EQ (err->number, NIH_CONFIG_UNEXPECTED_TOKEN);
-	TEST_EQ (pos, 5);
+	TEST_EQ (pos, 24);
 	TEST_EQ (lineno, 1);
 	nih_free (err);
 }
 
 void
-test_stanza_instance (void)
+test_stanza_task (void)
 {
 	JobClass*job;
 	NihError *err;
 	size_t    pos, lineno;
 	char      buf[1024];
 
-	TEST_FUNCTION ("stanza_instance");
+	TEST_FUNCTION ("stanza_task");
 
-	/* Check that an instance stanza with an argument sets both the
-	 * job's instance name.
+	/* Check that a task stanza without any arguments sets the job's
+	 * task flag.
 	 */
-	TEST_FEATURE ("with argument");
-	strcpy (buf, "instance $FOO\n");
+	TEST_FEATURE ("with no arguments");
+	strcpy (buf, "task\n");
 
 	TEST_ALLOC_FAIL {
 		pos = 0;
@@ -4986,18 +5227,16 @@ test_stanza_instance (void)
 
 		TEST_ALLOC_SIZE (job, sizeof (JobClass));
 
-		TEST_ALLOC_PARENT (job->instance, job);
-		TEST_EQ_STR (job->instance, "$FOO");
+		TEST_TRUE (job->task);
 
 		nih_free (job);
 	}
 
 
-	/* Check that the last of multiple instance stanzas is used.
-	 */
+	/* Check that multiple task stanzas are permitted. */
 	TEST_FEATURE ("with multiple stanzas");
-	strcpy (buf, "instance $FOO\n");
-	strcpy (buf, "instance $BAR\n");
+	strcpy (buf, "task\n");
+	strcat (buf, "task\n");
 
 	TEST_ALLOC_FAIL {
 		pos = 0;
@@ -5016,22 +5255,21 @@ test_stanza_instance (void)
 		}
 
 		TEST_EQ (pos, strlen (buf));
-		TEST_EQ (lineno, 2);
+		TEST_EQ (lineno, 3);
 
 		TEST_ALLOC_SIZE (job, sizeof (JobClass));
 
-		TEST_ALLOC_PARENT (job->instance, job);
-		TEST_EQ_STR (job->instance, "$BAR");
+		TEST_TRUE (job->task);
 
 		nih_free (job);
 	}
 
 
-	/* Check that extra arguments to the instance stanza results in
-	 * a syntax error.
+	/* Check that a task stanza with arguments results in a syntax
+	 * error.
 	 */
-	TEST_FEATURE ("with extra argument");
-	strcpy (buf, "instance $FOO foo\n");
+	TEST_FEATURE ("with arguments");
+	strcpy (buf, "task foo\n");
 
 	pos = 0;
 	lineno = 1;
@@ -5041,7 +5279,104 @@ test_stanza_instance (void)
 
 	err = nih_error_get ();
 	TEST_EQ (err->number, NIH_CONFIG_UNEXPECTED_TOKEN);
-	TEST_EQ (pos, 14);
+	TEST_EQ (pos, 5);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+}
+
+void
+test_stanza_instance (void)
+{
+	JobClass*job;
+	NihError *err;
+	size_t    pos, lineno;
+	char      buf[1024];
+
+	TEST_FUNCTION ("stanza_instance");
+
+	/* Check that an instance stanza with an argument sets both the
+	 * job's instance name.
+	 */
+	TEST_FEATURE ("with argument");
+	strcpy (buf, "instance $FOO\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 2);
+
+		TEST_ALLOC_SIZE (job, sizeof (JobClass));
+
+		TEST_ALLOC_PARENT (job->instance, job);
+		TEST_EQ_STR (job->instance, "$FOO");
+
+		nih_free (job);
+	}
+
+
+	/* Check that the last of multiple instance stanzas is used.
+	 */
+	TEST_FEATURE ("with multiple stanzas");
+	strcpy (buf, "instance $FOO\n");
+	strcpy (buf, "instance $BAR\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 2);
+
+		TEST_ALLOC_SIZE (job, sizeof (JobClass));
+
+		TEST_ALLOC_PARENT (job->instance, job);
+		TEST_EQ_STR (job->instance, "$BAR");
+
+		nih_free (job);
+	}
+
+
+	/* Check that extra arguments to the instance stanza results in
+	 * a syntax error.
+	 */
+	TEST_FEATURE ("with extra argument");
+	strcpy (buf, "instance $FOO foo\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, NIH_CONFIG_UNEXPECTED_TOKEN);
+	TEST_EQ (pos, 14);
 	TEST_EQ (lineno, 1);
 	nih_free (err);
 
@@ -5140,6 +5475,92 @@ test_stanza_kill (void)
 		nih_free (job);
 	}
 
+
+	/* Check that a kill stanza with the mode argument and cgroup
+	 * has the whole cgroup signalled.
+	 */
+	TEST_FEATURE ("with mode and cgroup argument");
+	strcpy (buf, "kill mode cgroup\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 2);
+
+		TEST_ALLOC_SIZE (job, sizeof (JobClass));
+
+		TEST_TRUE (job->kill_cgroup);
+
+		nih_free (job);
+	}
+
+
+	/* Check that the last of multiple kill mode stanzas is used,
+	 * and that process selects the process group again.
+	 */
+	TEST_FEATURE ("with multiple mode stanzas");
+	strcpy (buf, "kill mode cgroup\n");
+	strcat (buf, "kill mode process\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 3);
+
+		TEST_ALLOC_SIZE (job, sizeof (JobClass));
+
+		TEST_FALSE (job->kill_cgroup);
+
+		nih_free (job);
+	}
+
+
+	/* Check that a kill mode stanza with an unknown mode results in
+	 * a syntax error.
+	 */
+	TEST_FEATURE ("with mode and unknown argument");
+	strcpy (buf, "kill mode foo\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, NIH_CONFIG_UNKNOWN_STANZA);
+	TEST_EQ (pos, 10);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
 	/* Check that a kill stanza with the signal argument and numeric signal,
 	 * sets the right signal on the jobs class.
 	 */
@@ -6089,6 +6510,74 @@ test_stanza_console (void)
 		nih_free (job);
 	}
 
+
+	/* Check that console socket sets the job's console to
+	 * CONSOLE_SOCKET along with the path of the socket.
+	 */
+	TEST_FEATURE ("with socket argument");
+	strcpy (buf, "console socket /run/systemd/journal/stdout\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 2);
+
+		TEST_ALLOC_SIZE (job, sizeof (JobClass));
+
+		TEST_EQ (job->console, CONSOLE_SOCKET);
+		TEST_ALLOC_PARENT (job->console_socket, job);
+		TEST_EQ_STR (job->console_socket, "/run/systemd/journal/stdout");
+
+		nih_free (job);
+	}
+
+
+	/* Check that a later console stanza forgets the socket of an
+	 * earlier console socket stanza.
+	 */
+	TEST_FEATURE ("with socket replaced");
+	strcpy (buf, "console socket /run/log.sock\n");
+	strcat (buf, "console none\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 3);
+
+		TEST_EQ (job->console, CONSOLE_NONE);
+		TEST_EQ_P (job->console_socket, NULL);
+
+		nih_free (job);
+	}
+
 	/* Check that the last of multiple console stanzas is used.
 	 */
 	TEST_FEATURE ("with multiple stanzas");
@@ -6159,6 +6648,25 @@ test_stanza_console (void)
 	nih_free (err);
 
 
+	/* Check that console socket without a path raises a syntax
+	 * error.
+	 */
+	TEST_FEATURE ("with socket argument missing path");
+	strcpy (buf, "console socket\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, NIH_CONFIG_EXPECTED_TOKEN);
+	TEST_EQ (pos, 14);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
 	/* Check that a missing argument raises a syntax error.
 	 */
 	TEST_FEATURE ("with missing argument");
@@ -6178,20 +6686,20 @@ test_stanza_console (void)
 }
 
 void
-test_stanza_env (void)
+test_stanza_log_limit (void)
 {
-	JobClass*job;
+	JobClass *job;
 	NihError *err;
 	size_t    pos, lineno;
 	char      buf[1024];
 
-	TEST_FUNCTION ("stanza_env");
+	TEST_FUNCTION ("stanza_log_limit");
 
-	/* Check that a env stanza with an argument results in it
-	 * being stored in the job.
+	/* Check that a log-limit stanza with the rate argument and numeric
+	 * rate and burst results in it being stored in the job.
 	 */
-	TEST_FEATURE ("with single argument");
-	strcpy (buf, "env FOO=BAR\n");
+	TEST_FEATURE ("with rate and two arguments");
+	strcpy (buf, "log-limit rate 1024 4096\n");
 
 	TEST_ALLOC_FAIL {
 		pos = 0;
@@ -6214,19 +6722,284 @@ test_stanza_env (void)
 
 		TEST_ALLOC_SIZE (job, sizeof (JobClass));
 
-		TEST_ALLOC_PARENT (job->env, job);
-		TEST_ALLOC_SIZE (job->env, sizeof (char *) * 2);
-		TEST_EQ_STR (job->env[0], "FOO=BAR");
-		TEST_EQ_P (job->env[1], NULL);
+		TEST_EQ (job->log_limit_rate, 1024);
+		TEST_EQ (job->log_limit_burst, 4096);
+		TEST_EQ (job->log_limit_size, 0);
 
 		nih_free (job);
 	}
 
 
-	/* Check that repeated env stanzas are appended to those stored in
-	 * the job.
+	/* Check that a log-limit stanza with the rate argument can have
+	 * the single word unlimited after it.
 	 */
-	TEST_FEATURE ("with repeated stanzas");
+	TEST_FEATURE ("with rate and unlimited");
+	strcpy (buf, "log-limit rate 1024 4096\n");
+	strcat (buf, "log-limit rate unlimited\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 3);
+
+		TEST_ALLOC_SIZE (job, sizeof (JobClass));
+
+		TEST_EQ (job->log_limit_rate, 0);
+		TEST_EQ (job->log_limit_burst, 0);
+
+		nih_free (job);
+	}
+
+
+	/* Check that a log-limit stanza with the size argument and a
+	 * numeric size results in it being stored in the job.
+	 */
+	TEST_FEATURE ("with size and argument");
+	strcpy (buf, "log-limit size 65536\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 2);
+
+		TEST_ALLOC_SIZE (job, sizeof (JobClass));
+
+		TEST_EQ (job->log_limit_rate, 0);
+		TEST_EQ (job->log_limit_size, 65536);
+
+		nih_free (job);
+	}
+
+
+	/* Check that rate and size limits may be combined, and that the
+	 * size may be given as unlimited.
+	 */
+	TEST_FEATURE ("with rate and size unlimited");
+	strcpy (buf, "log-limit size 65536\n");
+	strcat (buf, "log-limit rate 10 0\n");
+	strcat (buf, "log-limit size unlimited\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 4);
+
+		TEST_ALLOC_SIZE (job, sizeof (JobClass));
+
+		TEST_EQ (job->log_limit_rate, 10);
+		TEST_EQ (job->log_limit_burst, 0);
+		TEST_EQ (job->log_limit_size, 0);
+
+		nih_free (job);
+	}
+
+
+	/* Check that a log-limit stanza with the rate argument but no
+	 * burst results in a syntax error.
+	 */
+	TEST_FEATURE ("with rate and missing second argument");
+	strcpy (buf, "log-limit rate 1024\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, NIH_CONFIG_EXPECTED_TOKEN);
+	TEST_EQ (pos, 19);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that a log-limit stanza with a zero rate results in a
+	 * syntax error.
+	 */
+	TEST_FEATURE ("with zero rate");
+	strcpy (buf, "log-limit rate 0 10\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, PARSE_ILLEGAL_LIMIT);
+	TEST_EQ (pos, 15);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that a log-limit stanza with a non-integer size results
+	 * in a syntax error.
+	 */
+	TEST_FEATURE ("with non-integer size argument");
+	strcpy (buf, "log-limit size foo\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, PARSE_ILLEGAL_LIMIT);
+	TEST_EQ (pos, 15);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that a log-limit stanza with a negative size results in
+	 * a syntax error rather than wrapping around to a huge limit.
+	 */
+	TEST_FEATURE ("with negative size argument");
+	strcpy (buf, "log-limit size -1\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, PARSE_ILLEGAL_LIMIT);
+	TEST_EQ (pos, 15);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that a log-limit stanza with a negative burst results in
+	 * a syntax error.
+	 */
+	TEST_FEATURE ("with negative burst argument");
+	strcpy (buf, "log-limit rate 1024 -1\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, PARSE_ILLEGAL_LIMIT);
+	TEST_EQ (pos, 20);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that a log-limit stanza with an unknown second-level
+	 * argument results in a syntax error.
+	 */
+	TEST_FEATURE ("with unknown argument");
+	strcpy (buf, "log-limit foo 10\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, NIH_CONFIG_UNKNOWN_STANZA);
+	TEST_EQ (pos, 10);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+}
+
+void
+test_stanza_env (void)
+{
+	JobClass*job;
+	NihError *err;
+	size_t    pos, lineno;
+	char      buf[1024];
+
+	TEST_FUNCTION ("stanza_env");
+
+	/* Check that a env stanza with an argument results in it
+	 * being stored in the job.
+	 */
+	TEST_FEATURE ("with single argument");
+	strcpy (buf, "env FOO=BAR\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 2);
+
+		TEST_ALLOC_SIZE (job, sizeof (JobClass));
+
+		TEST_ALLOC_PARENT (job->env, job);
+		TEST_ALLOC_SIZE (job->env, sizeof (char *) * 2);
+		TEST_EQ_STR (job->env[0], "FOO=BAR");
+		TEST_EQ_P (job->env[1], NULL);
+
+		nih_free (job);
+	}
+
+
+	/* Check that repeated env stanzas are appended to those stored in
+	 * the job.
+	 */
+	TEST_FEATURE ("with repeated stanzas");
 	strcpy (buf, "env FOO=BAR\n");
 	strcat (buf, "env BAZ=QUUX\n");
 	strcat (buf, "env FRODO=BILBO\n");
@@ -6867,7 +7640,774 @@ test_stanza_nice (void)
 	nih_free (err);
 }
 
-#define ADJ_TO_SCORE(x) ((x * 1000) / ((x < 0) ? 17 : 15))
+void
+test_stanza_priority (void)
+{
+	JobClass *job;
+	NihError *err;
+	size_t    pos, lineno;
+	char      buf[1024];
+
+	TEST_FUNCTION ("stanza_priority");
+
+	/* Check that a priority stanza results in it being stored in the
+	 * job.
+	 */
+	TEST_FEATURE ("with argument");
+	strcpy (buf, "priority -50\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 2);
+
+		TEST_ALLOC_SIZE (job, sizeof (JobClass));
+
+		TEST_EQ (job->priority, -50);
+
+		nih_free (job);
+	}
+
+
+	/* Check that a priority stanza without an argument results in a
+	 * syntax error.
+	 */
+	TEST_FEATURE ("with missing argument");
+	strcpy (buf, "priority\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, NIH_CONFIG_EXPECTED_TOKEN);
+	TEST_EQ (pos, 8);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that a priority stanza with an overly large argument
+	 * results in a syntax error.
+	 */
+	TEST_FEATURE ("with overly large argument");
+	strcpy (buf, "priority 101\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, PARSE_ILLEGAL_PRIORITY);
+	TEST_EQ (pos, 9);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that a priority stanza with a non-integer argument results
+	 * in a syntax error.
+	 */
+	TEST_FEATURE ("with non-integer argument");
+	strcpy (buf, "priority foo\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, PARSE_ILLEGAL_PRIORITY);
+	TEST_EQ (pos, 9);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+}
+
+void
+test_stanza_cpu_affinity (void)
+{
+	JobClass *job;
+	NihError *err;
+	size_t    pos, lineno;
+	char      buf[1024];
+
+	TEST_FUNCTION ("stanza_cpu_affinity");
+
+	/* Check that a cpu-affinity stanza with a list of processors and
+	 * ranges results in their bits being set in the job's placement,
+	 * leaving its memory policy alone.
+	 */
+	TEST_FEATURE ("with list");
+	strcpy (buf, "cpu-affinity 0-2,5,64\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 2);
+
+		TEST_NE_P (job->placement, NULL);
+		TEST_ALLOC_PARENT (job->placement, job);
+		TEST_EQ (job->placement->cpus[0], 0x27UL);
+		TEST_EQ (job->placement->cpus[64 / (8 * sizeof (unsigned long))]
+			 & (1UL << (64 % (8 * sizeof (unsigned long)))),
+			 1UL << (64 % (8 * sizeof (unsigned long))));
+		TEST_EQ (job->placement->numa_policy, JOB_NUMA_DEFAULT);
+
+		nih_free (job);
+	}
+
+
+	/* Check that the last of multiple cpu-affinity stanzas is used. */
+	TEST_FEATURE ("with multiple stanzas");
+	strcpy (buf, "cpu-affinity 0-3\n");
+	strcat (buf, "cpu-affinity 4\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_NE_P (job, NULL);
+	TEST_EQ (job->placement->cpus[0], 0x10UL);
+
+	nih_free (job);
+
+
+	/* Check that a cpu-affinity stanza naming a processor beyond the
+	 * most that may be named results in a syntax error.
+	 */
+	TEST_FEATURE ("with overly large argument");
+	strcpy (buf, "cpu-affinity 0-1024\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, PARSE_ILLEGAL_PLACEMENT);
+	TEST_EQ (pos, 13);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that a cpu-affinity stanza with a malformed list results
+	 * in a syntax error.
+	 */
+	TEST_FEATURE ("with malformed list");
+	strcpy (buf, "cpu-affinity 1,,2\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, PARSE_ILLEGAL_PLACEMENT);
+	TEST_EQ (pos, 13);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that a cpu-affinity stanza without an argument results in
+	 * a syntax error.
+	 */
+	TEST_FEATURE ("with missing argument");
+	strcpy (buf, "cpu-affinity\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, NIH_CONFIG_EXPECTED_TOKEN);
+	TEST_EQ (pos, 12);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+}
+
+void
+test_stanza_numa (void)
+{
+	JobClass *job;
+	NihError *err;
+	size_t    pos, lineno;
+	char      buf[1024];
+
+	TEST_FUNCTION ("stanza_numa_membind");
+
+	/* Check that a numa-membind stanza binds the job's memory to the
+	 * nodes listed.
+	 */
+	TEST_FEATURE ("with membind");
+	strcpy (buf, "numa-membind 1,3\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 2);
+
+		TEST_NE_P (job->placement, NULL);
+		TEST_EQ (job->placement->numa_policy, JOB_NUMA_BIND);
+		TEST_EQ (job->placement->numa_nodes[0], 0xaUL);
+		TEST_EQ (job->placement->cpus[0], 0UL);
+
+		nih_free (job);
+	}
+
+
+	/* Check that a numa-membind stanza without an argument results in
+	 * a syntax error.
+	 */
+	TEST_FEATURE ("with membind and missing argument");
+	strcpy (buf, "numa-membind\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, NIH_CONFIG_EXPECTED_TOKEN);
+	TEST_EQ (pos, 12);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	TEST_FUNCTION ("stanza_numa_interleave");
+
+	/* Check that a numa-interleave stanza without an argument
+	 * interleaves across every node, leaving the processors alone.
+	 */
+	TEST_FEATURE ("without argument");
+	strcpy (buf, "cpu-affinity 2\n");
+	strcat (buf, "numa-membind 0\n");
+	strcat (buf, "numa-interleave\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_NE_P (job, NULL);
+	TEST_EQ (pos, strlen (buf));
+	TEST_EQ (lineno, 4);
+
+	TEST_EQ (job->placement->numa_policy, JOB_NUMA_INTERLEAVE);
+	TEST_EQ (job->placement->numa_nodes[0], 0UL);
+	TEST_EQ (job->placement->cpus[0], 0x4UL);
+
+	nih_free (job);
+
+
+	/* Check that a numa-interleave stanza with a list interleaves
+	 * across the nodes listed.
+	 */
+	TEST_FEATURE ("with list");
+	strcpy (buf, "numa-interleave 0-1\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_NE_P (job, NULL);
+	TEST_EQ (job->placement->numa_policy, JOB_NUMA_INTERLEAVE);
+	TEST_EQ (job->placement->numa_nodes[0], 0x3UL);
+
+	nih_free (job);
+
+
+	/* Check that a numa-interleave stanza with a malformed list
+	 * results in a syntax error.
+	 */
+	TEST_FEATURE ("with malformed list");
+	strcpy (buf, "numa-interleave 1-\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, PARSE_ILLEGAL_PLACEMENT);
+	TEST_EQ (pos, 16);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+}
+
+#define ADJ_TO_SCORE(x) ((x * 1000) / ((x < 0) ? 17 : 15))
+
+void
+test_stanza_sched (void)
+{
+	JobClass *job;
+	NihError *err;
+	size_t    pos, lineno;
+	char      buf[1024];
+
+	TEST_FUNCTION ("stanza_sched");
+
+	/* Check that a sched stanza with a non-realtime policy results in
+	 * it being stored in the job with no priority.
+	 */
+	TEST_FEATURE ("with policy");
+	strcpy (buf, "sched batch\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 2);
+
+		TEST_ALLOC_SIZE (job, sizeof (JobClass));
+
+		TEST_EQ (job->sched_policy, SCHED_BATCH);
+		TEST_EQ (job->sched_priority, 0);
+
+		nih_free (job);
+	}
+
+
+	/* Check that a sched stanza with a realtime policy and priority
+	 * results in both being stored in the job.
+	 */
+	TEST_FEATURE ("with realtime policy");
+	strcpy (buf, "sched fifo 50\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 2);
+
+		TEST_ALLOC_SIZE (job, sizeof (JobClass));
+
+		TEST_EQ (job->sched_policy, SCHED_FIFO);
+		TEST_EQ (job->sched_priority, 50);
+
+		nih_free (job);
+	}
+
+
+	/* Check that a sched stanza without an argument results in a
+	 * syntax error.
+	 */
+	TEST_FEATURE ("with missing argument");
+	strcpy (buf, "sched\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, NIH_CONFIG_EXPECTED_TOKEN);
+	TEST_EQ (pos, 5);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that a sched stanza with an unknown policy results in a
+	 * syntax error.
+	 */
+	TEST_FEATURE ("with unknown policy");
+	strcpy (buf, "sched foo\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, PARSE_ILLEGAL_SCHED);
+	TEST_EQ (pos, 6);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that a sched stanza with a realtime policy but no
+	 * priority results in a syntax error.
+	 */
+	TEST_FEATURE ("with missing priority");
+	strcpy (buf, "sched rr\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, PARSE_ILLEGAL_SCHED);
+	TEST_EQ (pos, 6);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that a sched stanza with an overly large priority results
+	 * in a syntax error.
+	 */
+	TEST_FEATURE ("with overly large priority");
+	strcpy (buf, "sched fifo 100\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, PARSE_ILLEGAL_SCHED);
+	TEST_EQ (pos, 6);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+}
+
+void
+test_stanza_ioprio (void)
+{
+	JobClass *job;
+	NihError *err;
+	size_t    pos, lineno;
+	char      buf[1024];
+
+	TEST_FUNCTION ("stanza_ioprio");
+
+	/* Check that an ioprio stanza with the idle class results in it
+	 * being stored in the job.
+	 */
+	TEST_FEATURE ("with idle class");
+	strcpy (buf, "ioprio idle\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 2);
+
+		TEST_ALLOC_SIZE (job, sizeof (JobClass));
+
+		TEST_EQ (job->ioprio_class, JOB_IOPRIO_IDLE);
+		TEST_EQ (job->ioprio_level, 0);
+
+		nih_free (job);
+	}
+
+
+	/* Check that an ioprio stanza with a class but no level results
+	 * in the default level being stored in the job.
+	 */
+	TEST_FEATURE ("with class");
+	strcpy (buf, "ioprio best-effort\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 2);
+
+		TEST_ALLOC_SIZE (job, sizeof (JobClass));
+
+		TEST_EQ (job->ioprio_class, JOB_IOPRIO_BEST_EFFORT);
+		TEST_EQ (job->ioprio_level, JOB_IOPRIO_DEFAULT_LEVEL);
+
+		nih_free (job);
+	}
+
+
+	/* Check that an ioprio stanza with a class and level results in
+	 * both being stored in the job.
+	 */
+	TEST_FEATURE ("with class and level");
+	strcpy (buf, "ioprio realtime 0\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 2);
+
+		TEST_ALLOC_SIZE (job, sizeof (JobClass));
+
+		TEST_EQ (job->ioprio_class, JOB_IOPRIO_REALTIME);
+		TEST_EQ (job->ioprio_level, 0);
+
+		nih_free (job);
+	}
+
+
+	/* Check that an ioprio stanza without an argument results in a
+	 * syntax error.
+	 */
+	TEST_FEATURE ("with missing argument");
+	strcpy (buf, "ioprio\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, NIH_CONFIG_EXPECTED_TOKEN);
+	TEST_EQ (pos, 6);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that an ioprio stanza with an unknown class results in a
+	 * syntax error.
+	 */
+	TEST_FEATURE ("with unknown class");
+	strcpy (buf, "ioprio foo\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, PARSE_ILLEGAL_IOPRIO);
+	TEST_EQ (pos, 7);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that an ioprio stanza with an overly large level results
+	 * in a syntax error.
+	 */
+	TEST_FEATURE ("with overly large level");
+	strcpy (buf, "ioprio best-effort 8\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, PARSE_ILLEGAL_IOPRIO);
+	TEST_EQ (pos, 7);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+}
+
+void
+test_stanza_timer_slack (void)
+{
+	JobClass *job;
+	NihError *err;
+	size_t    pos, lineno;
+	char      buf[1024];
+
+	TEST_FUNCTION ("stanza_timer_slack");
+
+	/* Check that a timer-slack stanza results in it being stored in
+	 * the job.
+	 */
+	TEST_FEATURE ("with argument");
+	strcpy (buf, "timer-slack 50000\n");
+
+	TEST_ALLOC_FAIL {
+		pos = 0;
+		lineno = 1;
+		job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf),
+				 &pos, &lineno);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (job, NULL);
+
+			err = nih_error_get ();
+			TEST_EQ (err->number, ENOMEM);
+			nih_free (err);
+
+			continue;
+		}
+
+		TEST_EQ (pos, strlen (buf));
+		TEST_EQ (lineno, 2);
+
+		TEST_ALLOC_SIZE (job, sizeof (JobClass));
+
+		TEST_EQ (job->timer_slack, 50000);
+
+		nih_free (job);
+	}
+
+
+	/* Check that a timer-slack stanza without an argument results in
+	 * a syntax error.
+	 */
+	TEST_FEATURE ("with missing argument");
+	strcpy (buf, "timer-slack\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, NIH_CONFIG_EXPECTED_TOKEN);
+	TEST_EQ (pos, 11);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that a timer-slack stanza with a zero argument results in
+	 * a syntax error.
+	 */
+	TEST_FEATURE ("with zero argument");
+	strcpy (buf, "timer-slack 0\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, PARSE_ILLEGAL_TIMER_SLACK);
+	TEST_EQ (pos, 12);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+
+
+	/* Check that a timer-slack stanza with a negative argument results
+	 * in a syntax error.
+	 */
+	TEST_FEATURE ("with negative argument");
+	strcpy (buf, "timer-slack -1\n");
+
+	pos = 0;
+	lineno = 1;
+	job = parse_job (NULL, NULL, NULL, "test", buf, strlen (buf), &pos, &lineno);
+
+	TEST_EQ_P (job, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, PARSE_ILLEGAL_TIMER_SLACK);
+	TEST_EQ (pos, 12);
+	TEST_EQ (lineno, 1);
+	nih_free (err);
+}
 
 void
 test_stanza_oom (void)
@@ -9744,9 +11284,16 @@ main (int   argc,
 	test_stanza_normal ();
 
 	test_stanza_console ();
+	test_stanza_log_limit ();
 
 	test_stanza_umask ();
 	test_stanza_nice ();
+	test_stanza_priority ();
+	test_stanza_cpu_affinity ();
+	test_stanza_numa ();
+	test_stanza_sched ();
+	test_stanza_ioprio ();
+	test_stanza_timer_slack ();
 	test_stanza_oom ();
 	test_stanza_limit ();
 	test_stanza_chroot ();
@@ -0,0 +1,387 @@
+/* upstart
+ *
+ * test_quiesce.c - test suite for init/quiesce.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <nih/test.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/main.h>
+#include <nih/logging.h>
+
+#include "environ.h"
+#include "event.h"
+#include "events.h"
+#include "event_operator.h"
+#include "job_class.h"
+#include "job.h"
+#include "control.h"
+#include "timer_wheel.h"
+#include "quiesce.h"
+
+
+extern int quiesce_max_timeout;
+
+/**
+ * TEST_QUIESCE_WAIT:
+ *
+ * Milliseconds that test_quiesce_run() waits for a condition before
+ * giving up.
+ **/
+#define TEST_QUIESCE_WAIT 10000
+
+
+/**
+ * test_quiesce_class:
+ * @name: name of class,
+ * @after: name of job the class starts after, or NULL,
+ * @event: name of event the class starts on, or NULL.
+ *
+ * Create and register a job class with a single running instance, that
+ * starts on the started event of @after if given, or @event if given.
+ *
+ * Returns: new class.
+ **/
+static JobClass *
+test_quiesce_class (const char *name,
+		    const char *after,
+		    const char *event)
+{
+	JobClass  *class;
+	Job       *job;
+	char     **env = NULL;
+
+	class = NIH_MUST (job_class_new (NULL, name, NULL));
+
+	if (after) {
+		env = NIH_MUST (nih_str_array_new (class));
+		NIH_MUST (nih_str_array_add (&env, class, NULL, after));
+
+		class->start_on = NIH_MUST (event_operator_new (
+				class, EVENT_MATCH, JOB_STARTED_EVENT, env));
+	} else if (event) {
+		class->start_on = NIH_MUST (event_operator_new (
+				class, EVENT_MATCH, event, NULL));
+	}
+
+	nih_hash_add (job_classes, &class->entry);
+
+	job = NIH_MUST (job_new (class, ""));
+	job->goal = JOB_START;
+	job->state = JOB_RUNNING;
+
+	return class;
+}
+
+/**
+ * test_quiesce_job:
+ * @class: job class.
+ *
+ * Returns: the instance of @class, or NULL if it has gone.
+ **/
+static Job *
+test_quiesce_job (JobClass *class)
+{
+	return (Job *)nih_hash_lookup (class->instances, "");
+}
+
+/**
+ * test_quiesce_stopping:
+ * @class: job class.
+ *
+ * Returns: TRUE if the instance of @class has gone or is stopping.
+ **/
+static int
+test_quiesce_stopping (JobClass *class)
+{
+	Job *job;
+
+	job = test_quiesce_job (class);
+
+	return (! job) || (job->goal == JOB_STOP);
+}
+
+/**
+ * test_quiesce_run:
+ * @events: TRUE to handle events as well as timers,
+ * @class: job class to wait for.
+ *
+ * Run the timers, and if @events is TRUE the events, of the main loop
+ * until the instance of @class has gone or is stopping, or
+ * TEST_QUIESCE_WAIT has passed.
+ *
+ * Returns: milliseconds waited.
+ **/
+static uint64_t
+test_quiesce_run (int       events,
+		  JobClass *class)
+{
+	uint64_t start;
+
+	start = timer_wheel_now ();
+
+	while (! test_quiesce_stopping (class)) {
+		if (timer_wheel_now () - start > TEST_QUIESCE_WAIT)
+			break;
+
+		if (events)
+			event_poll ();
+
+		usleep (1000);
+		timer_wheel_poll ();
+	}
+
+	return timer_wheel_now () - start;
+}
+
+/**
+ * test_quiesce_runlevel:
+ * @runlevel: runlevel to change to.
+ *
+ * Call quiesce_runlevel() for a runlevel event for @runlevel.
+ **/
+static void
+test_quiesce_runlevel (const char *runlevel)
+{
+	Event  *event;
+	char  **env;
+
+	env = NIH_MUST (nih_str_array_new (NULL));
+	NIH_MUST (environ_set (&env, NULL, NULL, TRUE,
+			       "RUNLEVEL=%s", runlevel));
+
+	event = NIH_MUST (event_new (NULL, RUNLEVEL_EVENT, env));
+
+	quiesce_runlevel (event);
+
+	nih_free (event);
+}
+
+
+void
+test_runlevel (void)
+{
+	JobClass *a;
+	JobClass *b;
+	JobClass *rc;
+	pid_t     pid;
+	int       status;
+
+	TEST_FUNCTION ("quiesce_runlevel");
+
+	/* Each test runs in a child since a shutdown can't be undone */
+
+	/* Check that without fast shutdown, jobs are left to their own
+	 * stop on conditions.
+	 */
+	TEST_FEATURE ("without fast shutdown");
+	TEST_CHILD (pid) {
+		quiesce_fast_shutdown = FALSE;
+
+		a = test_quiesce_class ("a", NULL, NULL);
+
+		test_quiesce_runlevel ("0");
+
+		TEST_FALSE (quiesce_in_progress ());
+		TEST_EQ (test_quiesce_job (a)->goal, JOB_START);
+
+		exit (0);
+	}
+
+	waitpid (pid, &status, 0);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 0);
+
+
+	/* Check that a runlevel other than halt or reboot doesn't begin a
+	 * shutdown.
+	 */
+	TEST_FEATURE ("with other runlevel");
+	TEST_CHILD (pid) {
+		quiesce_fast_shutdown = TRUE;
+
+		a = test_quiesce_class ("a", NULL, NULL);
+
+		test_quiesce_runlevel ("2");
+
+		TEST_FALSE (quiesce_in_progress ());
+		TEST_EQ (test_quiesce_job (a)->goal, JOB_START);
+
+		exit (0);
+	}
+
+	waitpid (pid, &status, 0);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 0);
+
+
+	/* Check that with no jobs running, the shutdown is complete as
+	 * soon as it begins, with nothing left to wait for.
+	 */
+	TEST_FEATURE ("with no jobs");
+	TEST_CHILD (pid) {
+		quiesce_fast_shutdown = TRUE;
+
+		test_quiesce_runlevel ("0");
+
+		TEST_TRUE (quiesce_in_progress ());
+		TEST_EQ (timer_wheel_next_due (), UINT64_MAX);
+
+		exit (0);
+	}
+
+	waitpid (pid, &status, 0);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 0);
+
+
+	/* Check that jobs are stopped in waves, a job only once those
+	 * started after it have stopped, and that the jobs started by the
+	 * runlevel event are left running.
+	 */
+	TEST_FEATURE ("with dependent jobs");
+	TEST_CHILD (pid) {
+		quiesce_fast_shutdown = TRUE;
+
+		b = test_quiesce_class ("b", NULL, NULL);
+		a = test_quiesce_class ("a", "b", NULL);
+		rc = test_quiesce_class ("rc", NULL, RUNLEVEL_EVENT);
+
+		test_quiesce_runlevel ("6");
+
+		TEST_TRUE (quiesce_in_progress ());
+		TEST_EQ (test_quiesce_job (a)->goal, JOB_STOP);
+		TEST_EQ (test_quiesce_job (b)->goal, JOB_START);
+
+		test_quiesce_run (TRUE, b);
+
+		TEST_EQ_P (test_quiesce_job (a), NULL);
+		TEST_TRUE (test_quiesce_stopping (b));
+
+		event_poll ();
+
+		TEST_EQ_P (test_quiesce_job (b), NULL);
+		TEST_EQ (test_quiesce_job (rc)->goal, JOB_START);
+
+		exit (0);
+	}
+
+	waitpid (pid, &status, 0);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 0);
+
+
+	/* Check that a wave that takes longer than the kill timeout of its
+	 * jobs is left to finish on its own while the next begins.
+	 */
+	TEST_FEATURE ("with wave timed out");
+	TEST_CHILD (pid) {
+		uint64_t waited;
+
+		quiesce_fast_shutdown = TRUE;
+
+		b = test_quiesce_class ("b", NULL, NULL);
+		a = test_quiesce_class ("a", "b", NULL);
+		a->kill_timeout = 0;
+
+		test_quiesce_runlevel ("0");
+
+		TEST_EQ (test_quiesce_job (a)->goal, JOB_STOP);
+		TEST_EQ (test_quiesce_job (b)->goal, JOB_START);
+
+		/* Without the events being handled, a never stops */
+		waited = test_quiesce_run (FALSE, b);
+
+		TEST_GE (waited, QUIESCE_KILL_GRACE);
+		TEST_LT (waited, TEST_QUIESCE_WAIT);
+		TEST_EQ (test_quiesce_job (a)->state, JOB_STOPPING);
+		TEST_EQ (test_quiesce_job (b)->goal, JOB_STOP);
+
+		exit (0);
+	}
+
+	waitpid (pid, &status, 0);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 0);
+
+
+	/* Check that once the whole shutdown has taken longer than the
+	 * shutdown timeout, every job left is stopped at once, even while
+	 * the current wave may still take longer.
+	 */
+	TEST_FEATURE ("with shutdown timed out");
+	TEST_CHILD (pid) {
+		uint64_t waited;
+
+		quiesce_fast_shutdown = TRUE;
+		quiesce_max_timeout = 1;
+
+		b = test_quiesce_class ("b", NULL, NULL);
+		a = test_quiesce_class ("a", "b", NULL);
+		a->kill_timeout = 5;
+
+		test_quiesce_runlevel ("0");
+
+		TEST_EQ (test_quiesce_job (a)->goal, JOB_STOP);
+		TEST_EQ (test_quiesce_job (b)->goal, JOB_START);
+
+		waited = test_quiesce_run (FALSE, b);
+
+		TEST_GE (waited, 1000);
+		TEST_LT (waited, 5000);
+		TEST_EQ (test_quiesce_job (a)->state, JOB_STOPPING);
+		TEST_EQ (test_quiesce_job (b)->goal, JOB_STOP);
+
+		exit (0);
+	}
+
+	waitpid (pid, &status, 0);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 0);
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	/* run tests in legacy (pre-session support) mode */
+	setenv ("UPSTART_NO_SESSIONS", "1", 1);
+
+	nih_main_init (argv[0]);
+
+	nih_log_set_priority (NIH_LOG_FATAL);
+
+	event_init ();
+	job_class_init ();
+	control_init ();
+
+	test_runlevel ();
+
+	return 0;
+}
@@ -0,0 +1,174 @@
+/* upstart
+ *
+ * test_spawn_helper.c - test suite for init/spawn_helper.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <nih/test.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/error.h>
+#include <nih/main.h>
+
+#include "job_class.h"
+#include "job_process.h"
+#include "job.h"
+#include "spawn_helper.h"
+
+
+extern int disable_clone_spawn;
+
+static pid_t
+my_helper (void)
+{
+	int   sv[2];
+	pid_t pid;
+
+	assert0 (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv));
+
+	TEST_CHILD (pid) {
+		close (sv[0]);
+		exit (spawn_helper_server (sv[1]));
+	}
+
+	close (sv[1]);
+	spawn_helper_fd = sv[0];
+
+	return pid;
+}
+
+
+void
+test_spawn (void)
+{
+	JobClass *class;
+	Job      *job;
+	char     *args[3];
+	char      buf[64];
+	pid_t     helper;
+	pid_t     pid;
+	int       job_process_fd = -1;
+	int       status;
+
+	TEST_FUNCTION ("spawn_helper_spawn");
+	helper = my_helper ();
+	disable_clone_spawn = TRUE;
+
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+	job = job_new (class, "");
+
+	/* Check that a process spawned by the helper is our child rather
+	 * than the helper's, and that the error pipe is closed once it
+	 * has been exec'd.
+	 */
+	TEST_FEATURE ("with simple job");
+	TEST_TRUE (spawn_helper_wanted (job, PROCESS_MAIN, FALSE));
+
+	args[0] = "/bin/true";
+	args[1] = NULL;
+
+	pid = job_process_spawn_with_fd (job, args, NULL, FALSE, -1,
+					 PROCESS_MAIN, &job_process_fd);
+	TEST_GT (pid, 0);
+	TEST_NE (pid, helper);
+
+	TEST_EQ (read (job_process_fd, buf, sizeof (buf)), 0);
+	close (job_process_fd);
+
+	TEST_EQ (waitpid (pid, &status, 0), pid);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 0);
+
+	TEST_NE (spawn_helper_fd, -1);
+
+
+	/* Check that a failure to exec is reported over the error pipe
+	 * as it would be for a process we forked ourselves.
+	 */
+	TEST_FEATURE ("with failure to exec");
+	args[0] = "/nonexistent";
+
+	pid = job_process_spawn_with_fd (job, args, NULL, FALSE, -1,
+					 PROCESS_MAIN, &job_process_fd);
+	TEST_GT (pid, 0);
+
+	TEST_GT (read (job_process_fd, buf, sizeof (buf)), 0);
+	close (job_process_fd);
+
+	TEST_EQ (waitpid (pid, &status, 0), pid);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 255);
+
+
+	/* Check that a traced process is not passed to the helper. */
+	TEST_FEATURE ("with traced process");
+	TEST_FALSE (spawn_helper_wanted (job, PROCESS_MAIN, TRUE));
+
+
+	/* Check that should the helper go away, the process is forked by
+	 * us instead and the helper is not used again.
+	 */
+	TEST_FEATURE ("without helper");
+	kill (helper, SIGTERM);
+	waitpid (helper, NULL, 0);
+
+	args[0] = "/bin/true";
+
+	pid = job_process_spawn_with_fd (job, args, NULL, FALSE, -1,
+					 PROCESS_MAIN, &job_process_fd);
+	TEST_GT (pid, 0);
+
+	TEST_EQ (read (job_process_fd, buf, sizeof (buf)), 0);
+	close (job_process_fd);
+
+	TEST_EQ (waitpid (pid, &status, 0), pid);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 0);
+
+	TEST_EQ (spawn_helper_fd, -1);
+	TEST_FALSE (spawn_helper_wanted (job, PROCESS_MAIN, FALSE));
+
+	nih_free (class);
+	disable_clone_spawn = FALSE;
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	/* run tests in legacy (pre-session support) mode */
+	setenv ("UPSTART_NO_SESSIONS", "1", 1);
+
+	nih_main_init (argv[0]);
+
+	job_class_init ();
+	nih_error_init ();
+
+	test_spawn ();
+
+	return 0;
+}
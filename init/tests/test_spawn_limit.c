@@ -0,0 +1,266 @@
+/* upstart
+ *
+ * test_spawn_limit.c - test suite for init/spawn_limit.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <nih/test.h>
+
+#include <string.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/main.h>
+
+#include "event.h"
+#include "job_class.h"
+#include "job.h"
+#include "metrics.h"
+#include "spawn_limit.h"
+
+
+void
+test_admit (void)
+{
+	JobClass    *class;
+	JobClass    *urgent;
+	Job         *job1;
+	Job         *job2;
+	Job         *job3;
+	Job         *job4;
+	SpawnWaiter *waiter;
+
+	TEST_FUNCTION ("spawn_limit_admit");
+	event_init ();
+	spawn_limit_init ();
+
+	class = job_class_new (NULL, "test", NULL);
+	urgent = job_class_new (NULL, "urgent", NULL);
+	urgent->priority = 10;
+
+	job1 = job_new (class, "1");
+	job2 = job_new (class, "2");
+	job3 = job_new (class, "3");
+	job4 = job_new (urgent, "");
+
+
+	/* Check that without a limit every job is admitted without being
+	 * counted.
+	 */
+	TEST_FEATURE ("with no limit");
+	spawn_limit = 0;
+
+	TEST_TRUE (spawn_limit_admit (job1));
+	TEST_FALSE (job1->spawn_admitted);
+	TEST_EQ (spawn_limit_active, 0);
+	TEST_LIST_EMPTY (spawn_queue);
+
+
+	/* Check that jobs are admitted up to the limit, and that those
+	 * beyond it are queued with those of a higher priority ahead of
+	 * those queued before them.
+	 */
+	TEST_FEATURE ("with limit reached");
+	spawn_limit = 1;
+	spawn_limit_queue_peak = 0;
+
+	TEST_TRUE (spawn_limit_admit (job1));
+	TEST_TRUE (job1->spawn_admitted);
+	TEST_EQ (spawn_limit_active, 1);
+
+	TEST_TRUE (spawn_limit_admit (job1));
+	TEST_EQ (spawn_limit_active, 1);
+
+	TEST_FALSE (spawn_limit_admit (job2));
+	TEST_FALSE (spawn_limit_admit (job3));
+	TEST_FALSE (spawn_limit_admit (job4));
+	TEST_FALSE (job2->spawn_admitted);
+
+	TEST_EQ (spawn_limit_queued, 3);
+	TEST_EQ (spawn_limit_queue_peak, 3);
+
+	waiter = (SpawnWaiter *)spawn_queue->next;
+	TEST_EQ_P (waiter->job, job4);
+	waiter = (SpawnWaiter *)waiter->entry.next;
+	TEST_EQ_P (waiter->job, job2);
+	waiter = (SpawnWaiter *)waiter->entry.next;
+	TEST_EQ_P (waiter->job, job3);
+
+
+	/* Check that a job queued again keeps its place. */
+	TEST_FEATURE ("with job already queued");
+	TEST_FALSE (spawn_limit_admit (job2));
+
+	TEST_EQ (spawn_limit_queued, 3);
+
+
+	/* Check that a queued job can be removed from the queue, and that
+	 * one that isn't queued is left alone.
+	 */
+	TEST_FEATURE ("with cancel");
+	TEST_TRUE (spawn_limit_cancel (job3));
+	TEST_FALSE (spawn_limit_cancel (job3));
+	TEST_FALSE (spawn_limit_cancel (job1));
+
+	TEST_EQ (spawn_limit_queued, 2);
+	TEST_EQ (spawn_limit_queue_peak, 3);
+
+
+	/* Check that releasing an admitted job frees its slot without
+	 * admitting the next itself.
+	 */
+	TEST_FEATURE ("with release");
+	spawn_limit_release (job1);
+
+	TEST_FALSE (job1->spawn_admitted);
+	TEST_EQ (spawn_limit_active, 0);
+	TEST_EQ (spawn_limit_queued, 2);
+
+	spawn_limit_release (job1);
+	TEST_EQ (spawn_limit_active, 0);
+
+
+	/* Check that a job freed while queued is removed from the queue. */
+	TEST_FEATURE ("with queued job freed");
+	nih_free (job2);
+
+	TEST_EQ (spawn_limit_queued, 1);
+	TEST_EQ_P (((SpawnWaiter *)spawn_queue->next)->job, job4);
+
+	nih_free (job4);
+
+	TEST_LIST_EMPTY (spawn_queue);
+	TEST_EQ (spawn_limit_queued, 0);
+
+	nih_free (class);
+	nih_free (urgent);
+
+	spawn_limit = 0;
+}
+
+
+void
+test_poll (void)
+{
+	JobClass    *class;
+	Job         *job1;
+	Job         *job2;
+	Job         *job3;
+	SpawnWaiter *waiter;
+
+	TEST_FUNCTION ("spawn_limit_poll");
+	event_init ();
+	spawn_limit_init ();
+	metrics_reset ();
+
+	class = job_class_new (NULL, "test", NULL);
+	class->task = TRUE;
+
+	job1 = job_new (class, "1");
+	job2 = job_new (class, "2");
+	job3 = job_new (class, "3");
+
+
+	/* Check that once a slot is free, the next queued job is admitted
+	 * and moved on from the starting state, with the time it waited
+	 * recorded, while the rest stay queued.  The jobs are told to stop
+	 * meanwhile so that they don't spawn any processes; admitting that
+	 * releases them again.
+	 */
+	TEST_FEATURE ("with slot free");
+	spawn_limit = 1;
+
+	job1->spawn_admitted = TRUE;
+	spawn_limit_active = 1;
+
+	job2->goal = JOB_STOP;
+	job2->state = JOB_STARTING;
+	job3->goal = JOB_STOP;
+	job3->state = JOB_STARTING;
+
+	TEST_FALSE (spawn_limit_admit (job2));
+	TEST_FALSE (spawn_limit_admit (job3));
+
+	spawn_limit_poll (NULL, NULL);
+
+	TEST_EQ (job2->state, JOB_STARTING);
+	TEST_EQ (spawn_limit_queued, 2);
+
+	spawn_limit_release (job1);
+	spawn_limit_poll (NULL, NULL);
+
+	TEST_EQ (job2->state, JOB_STOPPING);
+	TEST_FALSE (job2->spawn_admitted);
+	TEST_EQ (job3->state, JOB_STOPPING);
+	TEST_EQ (spawn_limit_active, 0);
+	TEST_LIST_EMPTY (spawn_queue);
+
+	TEST_EQ (metrics_histograms[METRICS_ADMISSION_LATENCY].count, 2);
+
+
+	/* Check that a job which has waited for longer than the maximum
+	 * is admitted even though the limit is still reached, since the
+	 * job spawning may be waiting for it.
+	 */
+	TEST_FEATURE ("with wait exceeded");
+	spawn_limit_wait = 5;
+
+	job1->spawn_admitted = TRUE;
+	spawn_limit_active = 1;
+
+	job2->goal = JOB_STOP;
+	job2->state = JOB_STARTING;
+
+	TEST_FALSE (spawn_limit_admit (job2));
+
+	spawn_limit_poll (NULL, NULL);
+
+	TEST_EQ (job2->state, JOB_STARTING);
+	TEST_EQ (spawn_limit_queued, 1);
+
+	waiter = (SpawnWaiter *)spawn_queue->next;
+	waiter->queued -= 6 * 1000000;
+
+	spawn_limit_poll (NULL, NULL);
+
+	TEST_EQ (job2->state, JOB_STOPPING);
+	TEST_FALSE (job2->spawn_admitted);
+	TEST_TRUE (job1->spawn_admitted);
+	TEST_EQ (spawn_limit_active, 1);
+	TEST_LIST_EMPTY (spawn_queue);
+
+	spawn_limit_release (job1);
+	spawn_limit_wait = 30;
+
+	nih_free (class);
+
+	metrics_reset ();
+	spawn_limit = 0;
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	nih_main_init (argv[0]);
+
+	test_admit ();
+	test_poll ();
+
+	return 0;
+}
@@ -0,0 +1,176 @@
+/* upstart
+ *
+ * test_start_order.c - test suite for init/start_order.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <nih/test.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/main.h>
+
+#include "job_class.h"
+#include "parse_job.h"
+#include "start_order.h"
+
+
+/**
+ * add_class:
+ * @name: name of class,
+ * @start_on: start on condition of class.
+ *
+ * Parse a class named @name with the start on condition given and add
+ * it to the registered classes.
+ *
+ * Returns: new class.
+ **/
+static JobClass *
+add_class (const char *name,
+	   const char *start_on)
+{
+	nih_local char *buf = NULL;
+	JobClass       *class;
+	size_t          pos = 0, lineno = 1;
+
+	buf = NIH_MUST (nih_sprintf (NULL, "start on %s\n", start_on));
+
+	class = parse_job (NULL, NULL, NULL, name, buf, strlen (buf),
+			   &pos, &lineno);
+	assert (class != NULL);
+
+	job_class_add_safe (class);
+
+	return class;
+}
+
+/**
+ * first_class:
+ * @event: name of event.
+ *
+ * Returns: first class offered @event.
+ **/
+static JobClass *
+first_class (const char *event)
+{
+	JobClassEventIndex *index;
+
+	index = (JobClassEventIndex *)nih_hash_lookup (job_class_events,
+						       event);
+	assert (index != NULL);
+	assert (! NIH_LIST_EMPTY (&index->classes));
+
+	return (JobClass *)((NihListEntry *)index->classes.next)->data;
+}
+
+
+void
+test_update (void)
+{
+	JobClass   *a, *b, *c, *d, *e, *x, *y;
+	const char *path;
+	size_t      len;
+
+	TEST_FUNCTION ("start_order_update");
+	job_class_init ();
+
+	/* Check that no critical path is found when no job is started
+	 * by another.
+	 */
+	TEST_FEATURE ("without chains");
+	d = add_class ("d", "startup");
+
+	path = start_order_critical_path (&len);
+
+	TEST_EQ_P (path, NULL);
+	TEST_EQ (len, 0);
+
+
+	/* Check that the longest chain of jobs started by one another is
+	 * found, following patterns as well as names, and that the class
+	 * heading it is offered the event that starts it first.
+	 */
+	TEST_FEATURE ("with chains");
+	e = add_class ("e", "starting d");
+	a = add_class ("a", "startup");
+	b = add_class ("b", "started a");
+	c = add_class ("c", "stopped JOB=b*");
+
+	TEST_EQ_P (first_class ("startup"), d);
+
+	path = start_order_critical_path (&len);
+
+	TEST_EQ_STR (path, "a -> b -> c");
+	TEST_EQ (len, 3);
+
+	TEST_EQ_P (first_class ("startup"), a);
+
+
+	/* Check that the analysis isn't repeated until the classes have
+	 * changed.
+	 */
+	TEST_FEATURE ("with unchanged classes");
+	TEST_EQ_P (start_order_critical_path (NULL), path);
+
+
+	/* Check that a cycle of jobs starting one another is measured
+	 * without following it round, and that of chains of the same
+	 * length the first by name is reported.
+	 */
+	TEST_FEATURE ("with cycle");
+	x = add_class ("x", "started y or startup");
+	y = add_class ("y", "started x");
+
+	path = start_order_critical_path (&len);
+
+	TEST_EQ_STR (path, "a -> b -> c");
+	TEST_EQ (len, 3);
+
+	nih_free (a);
+	nih_free (b);
+	nih_free (c);
+	start_order_invalidate ();
+
+	path = start_order_critical_path (&len);
+
+	TEST_EQ_STR (path, "d -> e");
+	TEST_EQ (len, 2);
+
+	nih_free (d);
+	nih_free (e);
+	nih_free (x);
+	nih_free (y);
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	/* run tests in legacy (pre-session support) mode */
+	setenv ("UPSTART_NO_SESSIONS", "1", 1);
+
+	nih_main_init (argv[0]);
+
+	test_update ();
+
+	return 0;
+}
@@ -21,13 +21,16 @@
  */
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <limits.h>
 #include <errno.h>
 #include <pty.h>
+#include <sched.h>
 #include <libgen.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
 #include <nih/test.h>
 #include <nih/timer.h>
 #include <nih/child.h>
@@ -131,7 +134,7 @@ int process_diff (const Process *a, const Process *b)
 int event_diff (const Event *a, const Event *b, AlreadySeen seen)
 	__attribute__ ((warn_unused_result));
 
-int nih_timer_diff (const NihTimer *a, const NihTimer *b)
+int wheel_timer_diff (const WheelTimer *a, const WheelTimer *b)
 	__attribute__ ((warn_unused_result));
 
 int log_diff (const Log *a, const Log *b)
@@ -356,16 +359,16 @@ fail:
 }
 
 /**
- * nih_timer_diff:
- * @a: first NihTimer,
- * @b: second NihTimer.
+ * wheel_timer_diff:
+ * @a: first WheelTimer,
+ * @b: second WheelTimer.
  *
- * Compare two NihTimer objects for equivalence.
+ * Compare two WheelTimer objects for equivalence.
  *
  * Returns: 0 if @a and @b are identical, else 1.
  **/
 int
-nih_timer_diff (const NihTimer *a, const NihTimer *b)
+wheel_timer_diff (const WheelTimer *a, const WheelTimer *b)
 {
 	if ((a == b) && !a)
 		return 0;
@@ -437,6 +440,21 @@ log_diff (const Log *a, const Log *b)
 	if (obj_num_check (a, b, open_errno))
 		goto fail;
 
+	if (obj_num_check (a, b, limit_rate))
+		goto fail;
+
+	if (obj_num_check (a, b, limit_burst))
+		goto fail;
+
+	if (obj_num_check (a, b, limit_size))
+		goto fail;
+
+	if (obj_num_check (a, b, dropped))
+		goto fail;
+
+	if (obj_num_check (a, b, dropped_pending))
+		goto fail;
+
 	return 0;
 
 fail:
@@ -598,6 +616,9 @@ job_class_diff (const JobClass *a, const JobClass *b,
 	if (obj_num_check (a, b, kill_signal))
 		goto fail;
 
+	if (obj_num_check (a, b, kill_cgroup))
+		goto fail;
+
 	if (obj_num_check (a, b, reload_signal))
 		goto fail;
 
@@ -610,6 +631,15 @@ job_class_diff (const JobClass *a, const JobClass *b,
 	if (obj_num_check (a, b, respawn_interval))
 		goto fail;
 
+	if (obj_num_check (a, b, respawn_backoff_initial))
+		goto fail;
+
+	if (obj_num_check (a, b, respawn_backoff_max))
+		goto fail;
+
+	if (obj_num_check (a, b, respawn_backoff_jitter))
+		goto fail;
+
 	if (obj_num_check (a, b, normalexit_len))
 		goto fail;
 
@@ -623,15 +653,45 @@ job_class_diff (const JobClass *a, const JobClass *b,
 	if (obj_num_check (a, b, console))
 		goto fail;
 
+	if (obj_string_check (a, b, console_socket))
+		goto fail;
+
+	if (obj_num_check (a, b, log_limit_rate))
+		goto fail;
+
+	if (obj_num_check (a, b, log_limit_burst))
+		goto fail;
+
+	if (obj_num_check (a, b, log_limit_size))
+		goto fail;
+
 	if (obj_num_check (a, b, umask))
 		goto fail;
 
 	if (obj_num_check (a, b, nice))
 		goto fail;
 
+	if (obj_num_check (a, b, priority))
+		goto fail;
+
 	if (obj_num_check (a, b, oom_score_adj))
 		goto fail;
 
+	if (obj_num_check (a, b, sched_policy))
+		goto fail;
+
+	if (obj_num_check (a, b, sched_priority))
+		goto fail;
+
+	if (obj_num_check (a, b, ioprio_class))
+		goto fail;
+
+	if (obj_num_check (a, b, ioprio_level))
+		goto fail;
+
+	if (obj_num_check (a, b, timer_slack))
+		goto fail;
+
 	for (i = 0; i < RLIMIT_NLIMITS; i++) {
 		if (! a->limits[i] && ! b->limits[i])
 			continue;
@@ -639,6 +699,13 @@ job_class_diff (const JobClass *a, const JobClass *b,
 			goto fail;
 	}
 
+	if ((! a->placement) != (! b->placement))
+		goto fail;
+
+	if (a->placement && memcmp (a->placement, b->placement,
+				    sizeof (JobPlacement)))
+		goto fail;
+
 	if (obj_string_check (a, b, chroot))
 		goto fail;
 
@@ -663,6 +730,9 @@ job_class_diff (const JobClass *a, const JobClass *b,
 	if (obj_string_check (a, b, apparmor_switch))
 		goto fail;
 
+	if (memcmp (a->resources, b->resources, sizeof (a->resources)))
+		goto fail;
+
 	return 0;
 
 fail:
@@ -763,7 +833,7 @@ job_diff (const Job *a, const Job *b, AlreadySeen seen, int check_class)
 	if (blocking_diff (&a->blocking, &b->blocking, seen))
 		goto fail;
 
-	if (nih_timer_diff (a->kill_timer, b->kill_timer))
+	if (wheel_timer_diff (a->kill_timer, b->kill_timer))
 		goto fail;
 
 	if (obj_num_check (a, b, kill_process))
@@ -784,12 +854,21 @@ job_diff (const Job *a, const Job *b, AlreadySeen seen, int check_class)
 	if (obj_num_check (a, b, respawn_count))
 		goto fail;
 
+	if (obj_num_check (a, b, respawn_delay))
+		goto fail;
+
+	if (wheel_timer_diff (a->respawn_timer, b->respawn_timer))
+		goto fail;
+
 	if (obj_num_check (a, b, trace_forks))
 		goto fail;
 
 	if (obj_num_check (a, b, trace_state))
 		goto fail;
 
+	if (memcmp (a->resources, b->resources, sizeof (a->resources)))
+		goto fail;
+
 	for (i = 0; i < PROCESS_LAST; i++) {
 		if (! a->log[i] && ! b->log[i])
 			continue;
@@ -1312,6 +1391,7 @@ test_blocking (void)
 	file = conf_file_new (source, "/tmp/foo/bar.conf");
 	TEST_NE_P (file, NULL);
 	class = file->job = job_class_new (file, "bar", NULL);
+	conf_file_index (file);
 
 	TEST_NE_P (class, NULL);
 	TEST_HASH_EMPTY (job_classes);
@@ -1356,6 +1436,7 @@ test_blocking (void)
 	file = conf_file_new (source, "/tmp/foo/bar.conf");
 	TEST_NE_P (file, NULL);
 	class = file->job = job_class_new (file, "bar", NULL);
+	conf_file_index (file);
 
 	TEST_NE_P (class, NULL);
 	TEST_HASH_EMPTY (job_classes);
@@ -1424,6 +1505,7 @@ test_blocking (void)
 	TEST_NE_P (file, NULL);
 	/* Create class with NULL session */
 	class = file->job = job_class_new (NULL, "bar", NULL);
+	conf_file_index (file);
 
 	TEST_NE_P (class, NULL);
 	TEST_HASH_EMPTY (job_classes);
@@ -1537,6 +1619,7 @@ test_blocking (void)
 
 	/* Create class with non-NULL session, simulating a user job */
 	class = file->job = job_class_new (NULL, "bar", session);
+	conf_file_index (file);
 	TEST_NE_P (class, NULL);
 
 	TEST_HASH_EMPTY (job_classes);
@@ -1646,6 +1729,7 @@ test_blocking (void)
 	file = conf_file_new (source, "/tmp/foo/bar.conf");
 	TEST_NE_P (file, NULL);
 	class = file->job = job_class_new (NULL, "bar", NULL);
+	conf_file_index (file);
 
 	TEST_NE_P (class, NULL);
 	TEST_HASH_EMPTY (job_classes);
@@ -1729,6 +1813,7 @@ test_blocking (void)
 	file = conf_file_new (source, "/tmp/foo/bar.conf");
 	TEST_NE_P (file, NULL);
 	class = file->job = job_class_new (NULL, "bar", NULL);
+	conf_file_index (file);
 
 	TEST_NE_P (class, NULL);
 	TEST_HASH_EMPTY (job_classes);
@@ -1811,6 +1896,8 @@ test_event_serialise (void)
 	Session             *new_session;
 	size_t               len = 0;
 	nih_local char      *json_string = NULL;
+	NihIoBuffer         *buffer;
+	int                  fds[2];
 
 	event_init ();
 	session_init ();
@@ -2000,6 +2087,63 @@ test_event_serialise (void)
 	TEST_LIST_EMPTY (sessions);
 	TEST_LIST_EMPTY (events);
 
+	/*******************************/
+	TEST_FEATURE ("with env+session in binary format");
+
+	TEST_LIST_EMPTY (sessions);
+	TEST_LIST_EMPTY (events);
+	TEST_HASH_EMPTY (job_classes);
+
+	env = nih_str_array_new (NULL);
+	TEST_NE_P (env, NULL);
+	TEST_NE_P (environ_add (&env, NULL, &len, TRUE, "FOO=BAR"), NULL);
+
+	session = session_new (NULL, "/abc");
+	TEST_NE_P (session, NULL);
+	session->conf_path = NIH_MUST (nih_strdup (session, "/def/ghi"));
+
+	event = event_new (NULL, "foo", env);
+	TEST_NE_P (event, NULL);
+	event->session = session;
+
+	assert0 (state_to_binary (&buffer));
+	TEST_NE_P (buffer, NULL);
+	TEST_GT (buffer->len, sizeof (StateBinaryHeader));
+	assert0 (memcmp (buffer->buf, STATE_BINARY_MAGIC,
+			 sizeof (STATE_BINARY_MAGIC)));
+
+	nih_list_remove (&event->entry);
+	nih_list_remove (&session->entry);
+
+	job_class_environment_clear ();
+
+	assert0 (pipe (fds));
+	TEST_EQ (write (fds[1], buffer->buf, buffer->len), (ssize_t)buffer->len);
+	close (fds[1]);
+
+	assert0 (state_read_objects (fds[0]));
+	close (fds[0]);
+
+	TEST_LIST_NOT_EMPTY (sessions);
+	TEST_LIST_NOT_EMPTY (events);
+
+	new_event = (Event *)nih_list_remove (events->next);
+	assert0 (event_diff (event, new_event, ALREADY_SEEN_SET));
+
+	nih_free (event);
+	nih_free (session);
+	nih_free (buffer);
+
+	new_session = (Session *)nih_list_remove (sessions->next);
+	TEST_NE_P (new_session, NULL);
+	TEST_EQ_STR (new_session->chroot, "/abc");
+
+	nih_free (new_event);
+	nih_free (new_session);
+
+	TEST_LIST_EMPTY (sessions);
+	TEST_LIST_EMPTY (events);
+
 	/*******************************/
 
 	TEST_FEATURE ("with failed");
@@ -2055,6 +2199,14 @@ test_log_serialise (void)
 	int              wait_fd;
 	int              fd;
 	int              status;
+	int              fds[2];
+	ConfSource      *source;
+	ConfFile        *file;
+	JobClass        *class;
+	JobClass        *new_class;
+	Job             *job;
+	Job             *new_job;
+	NihIoBuffer     *buffer;
 
 	conf_init ();
 	nih_io_init ();
@@ -2166,6 +2318,178 @@ test_log_serialise (void)
 	TEST_TRUE (NIH_LIST_EMPTY (nih_io_watches));
 	TEST_EQ (unlink (filename), 0);
 
+	/*******************************/
+	TEST_FEATURE ("with unflushed data passed in file");
+
+	TEST_FILENAME (filename);
+
+	TEST_EQ (openpty (&pty_master, &pty_slave, NULL, NULL, NULL), 0);
+
+	fd = open (filename, O_CREAT | O_EXCL, 0);
+	TEST_NE (fd, -1);
+	close (fd);
+
+	log = log_new (NULL, filename, pty_master, 0);
+	TEST_NE_P (log, NULL);
+
+	TEST_CHILD_WAIT (pid, wait_fd) {
+
+		close (pty_master);
+
+		len = TEST_ARRAY_SIZE (test_data);
+
+		ret = write (pty_slave, test_data, len);
+		TEST_EQ ((size_t)ret, len);
+
+		TEST_CHILD_RELEASE (wait_fd);
+
+		pause ();
+	}
+
+	close (pty_slave);
+
+	TEST_WATCH_UPDATE ();
+
+	TEST_GT (log->unflushed->len, 0);
+
+	/* Serialise as for a stateful re-exec, which may pass the data
+	 * in a file rather than in the JSON.
+	 */
+	state_passing_fds = TRUE;
+	json = log_serialise (log);
+	state_passing_fds = FALSE;
+	TEST_NE_P (json, NULL);
+
+#ifdef HAVE_MEMFD_CREATE
+	ret = json_object_object_get_ex (json, "unflushed_fd", &json_unflushed);
+	TEST_EQ (ret, TRUE);
+	TEST_FALSE (json_object_object_get_ex (json, "unflushed", NULL));
+	TEST_EQ ((size_t)json_object_get_int64 (json_object_object_get (
+				json, "unflushed_len")), log->unflushed->len);
+#endif /* HAVE_MEMFD_CREATE */
+
+	new_log = log_deserialise (NULL, json);
+	TEST_NE_P (new_log, NULL);
+
+	assert0 (log_diff (log, new_log));
+
+	assert0 (kill (pid, SIGTERM));
+	TEST_EQ (waitpid (pid, &status, 0), pid);
+
+	TEST_EQ (chmod (filename, 0644), 0);
+
+	json_object_put (json);
+	nih_free (log);
+	nih_free (new_log);
+	TEST_TRUE (NIH_LIST_EMPTY (nih_io_watches));
+	TEST_EQ (unlink (filename), 0);
+
+	/*******************************/
+	/* Check that unflushed data survives a round trip through
+	 * binary state, where it is stored as a raw blob record.
+	 */
+	TEST_FEATURE ("with unflushed data in binary state");
+
+	TEST_FILENAME (filename);
+
+	TEST_LIST_EMPTY (conf_sources);
+	TEST_HASH_EMPTY (job_classes);
+
+	TEST_EQ (openpty (&pty_master, &pty_slave, NULL, NULL, NULL), 0);
+
+	fd = open (filename, O_CREAT | O_EXCL, 0);
+	TEST_NE (fd, -1);
+	close (fd);
+
+	source = conf_source_new (NULL, "/tmp/foo", CONF_JOB_DIR);
+	TEST_NE_P (source, NULL);
+
+	file = conf_file_new (source, "/tmp/foo/bar.conf");
+	TEST_NE_P (file, NULL);
+
+	class = file->job = job_class_new (NULL, "bar", NULL);
+
+	conf_file_index (file);
+	TEST_NE_P (class, NULL);
+	TEST_TRUE (job_class_consider (class));
+
+	job = job_new (class, "");
+	TEST_NE_P (job, NULL);
+
+	log = job->log[PROCESS_MAIN] = log_new (job->log, filename,
+						pty_master, 0);
+	TEST_NE_P (log, NULL);
+
+	TEST_CHILD_WAIT (pid, wait_fd) {
+
+		close (pty_master);
+
+		len = TEST_ARRAY_SIZE (test_data);
+
+		ret = write (pty_slave, test_data, len);
+		TEST_EQ ((size_t)ret, len);
+
+		TEST_CHILD_RELEASE (wait_fd);
+
+		pause ();
+	}
+
+	close (pty_slave);
+
+	TEST_WATCH_UPDATE ();
+
+	TEST_GT (log->unflushed->len, 0);
+
+	assert0 (state_to_binary (&buffer));
+	TEST_NE_P (buffer, NULL);
+
+	/* The data must appear as is, rather than hex-encoded */
+	TEST_NE_P (memmem (buffer->buf, buffer->len,
+			   log->unflushed->buf, log->unflushed->len), NULL);
+
+	nih_free (source);
+	TEST_LIST_EMPTY (conf_sources);
+
+	nih_list_remove (&class->entry);
+	nih_assert (class->deleted);
+	class->deleted = FALSE;
+	TEST_HASH_EMPTY (job_classes);
+
+	job_class_environment_clear ();
+
+	assert0 (pipe (fds));
+	TEST_EQ (write (fds[1], buffer->buf, buffer->len), (ssize_t)buffer->len);
+	close (fds[1]);
+	nih_free (buffer);
+
+	assert0 (state_read_objects (fds[0]));
+	close (fds[0]);
+
+	new_class = (JobClass *)nih_hash_lookup (job_classes, "bar");
+	TEST_NE_P (new_class, NULL);
+
+	new_job = (Job *)nih_hash_lookup (new_class->instances, "");
+	TEST_NE_P (new_job, NULL);
+	TEST_NE_P (new_job->log[PROCESS_MAIN], NULL);
+
+	assert0 (log_diff (log, new_job->log[PROCESS_MAIN]));
+
+	assert0 (kill (pid, SIGTERM));
+	TEST_EQ (waitpid (pid, &status, 0), pid);
+
+	TEST_EQ (chmod (filename, 0644), 0);
+
+	nih_free (class);
+
+	/* Freeing the recreated ConfSource frees new_class too */
+	TEST_LIST_NOT_EMPTY (conf_sources);
+	nih_free (conf_sources->next);
+
+	TEST_LIST_EMPTY (conf_sources);
+	TEST_HASH_EMPTY (job_classes);
+	TEST_TRUE (NIH_LIST_EMPTY (nih_io_watches));
+	TEST_EQ (unlink (filename), 0);
+
 	/*******************************/
 }
 
@@ -2196,6 +2520,8 @@ test_job_class_serialise (void)
 	TEST_NE_P (file, NULL);
 
 	class = file->job = job_class_new (NULL, "bar", NULL);
+
+	conf_file_index (file);
 	TEST_NE_P (class, NULL);
 	TEST_HASH_EMPTY (job_classes);
 	TEST_TRUE (job_class_consider (class));
@@ -2232,6 +2558,8 @@ test_job_class_serialise (void)
 	TEST_NE_P (file, NULL);
 
 	class = file->job = job_class_new (NULL, "bar", NULL);
+
+	conf_file_index (file);
 	TEST_NE_P (class, NULL);
 	TEST_HASH_EMPTY (job_classes);
 	TEST_TRUE (job_class_consider (class));
@@ -2241,6 +2569,18 @@ test_job_class_serialise (void)
 	TEST_NE_P (job1, NULL);
 	TEST_HASH_NOT_EMPTY (class->instances);
 
+	class->placement = nih_new (class, JobPlacement);
+	TEST_NE_P (class->placement, NULL);
+	memset (class->placement, 0, sizeof (JobPlacement));
+	TEST_EQ (job_class_placement_list ("0-3,8", class->placement->cpus), 0);
+	class->placement->numa_policy = JOB_NUMA_BIND;
+	TEST_EQ (job_class_placement_list ("1", class->placement->numa_nodes), 0);
+
+	class->sched_policy = SCHED_FIFO;
+	class->sched_priority = 10;
+	class->ioprio_class = JOB_IOPRIO_IDLE;
+	class->timer_slack = 50000;
+
 	class->process[PROCESS_MAIN] = process_new (class);
 	TEST_NE_P (class->process[PROCESS_MAIN], NULL);
 	class->process[PROCESS_MAIN]->command = "echo";
@@ -2281,6 +2621,8 @@ test_job_class_serialise (void)
 	TEST_NE_P (file, NULL);
 
 	class = file->job = job_class_new (NULL, "bar", NULL);
+
+	conf_file_index (file);
 	TEST_NE_P (class, NULL);
 	class->reload_signal = SIGUSR1;
 	TEST_HASH_EMPTY (job_classes);
@@ -4733,6 +5075,290 @@ conf_source_from_path (const char *path, ConfSourceType type, const Session *ses
 	return NULL;
 }
 
+void
+test_checkpoint (void)
+{
+	char             filename[PATH_MAX];
+	char            *restore_path;
+	Session         *session;
+	Session         *new_session;
+	Event           *event;
+	Event           *new_event;
+	siginfo_t        info;
+	int              fd;
+
+	TEST_FUNCTION ("state_checkpoint");
+
+	TEST_FILENAME (filename);
+	setenv (STATE_CHECKPOINT_ENV, filename, 1);
+	TEST_EQ_STR (state_checkpoint_path (), filename);
+
+	/*******************************/
+	/* Check that once state has changed, it is written to the
+	 * checkpoint by a child process and can be read back from it.
+	 */
+	TEST_FEATURE ("with changed state");
+
+	TEST_LIST_EMPTY (sessions);
+	TEST_LIST_EMPTY (events);
+	TEST_HASH_EMPTY (job_classes);
+
+	session = session_new (NULL, "/abc");
+	TEST_NE_P (session, NULL);
+	session->conf_path = NIH_MUST (nih_strdup (session, "/def/ghi"));
+
+	event = event_new (NULL, "foo", NULL);
+	TEST_NE_P (event, NULL);
+	event->session = session;
+
+	state_checkpoint_interval = 1000;
+	state_changed ();
+
+	assert0 (state_checkpoint ());
+
+	assert0 (waitid (P_ALL, 0, &info, WEXITED | WNOWAIT));
+	TEST_EQ (info.si_code, CLD_EXITED);
+	TEST_EQ (info.si_status, 0);
+	nih_child_poll ();
+
+	nih_list_remove (&event->entry);
+	nih_list_remove (&session->entry);
+
+	fd = open (filename, O_RDONLY);
+	TEST_GT (fd, 0);
+	assert0 (state_read_objects (fd));
+	close (fd);
+
+	new_event = (Event *)nih_list_remove (events->next);
+	assert0 (event_diff (event, new_event, ALREADY_SEEN_SET));
+
+	new_session = (Session *)nih_list_remove (sessions->next);
+	TEST_EQ_STR (new_session->chroot, "/abc");
+
+	nih_free (event);
+	nih_free (session);
+	nih_free (new_event);
+	nih_free (new_session);
+
+	/*******************************/
+	/* Check that no checkpoint is written without a change. */
+	TEST_FEATURE ("with unchanged state");
+
+	assert0 (unlink (filename));
+
+	assert0 (state_checkpoint ());
+	TEST_LT (waitid (P_ALL, 0, &info, WEXITED | WNOHANG), 0);
+	TEST_EQ (errno, ECHILD);
+
+	TEST_LT (access (filename, F_OK), 0);
+
+	/*******************************/
+	/* Check that a checkpoint claimed after a crash can only be
+	 * restored once, so that should the restored state crash us
+	 * again we don't loop.
+	 */
+	TEST_FEATURE ("with checkpoint claimed after crash");
+
+	restore_path = state_checkpoint_restore_path (NULL);
+	TEST_NE_P (restore_path, NULL);
+
+	fd = open (filename, O_CREAT | O_EXCL | O_WRONLY, 0600);
+	TEST_GT (fd, 0);
+	close (fd);
+
+	assert0 (state_checkpoint_claim (restore_path));
+	TEST_LT (access (filename, F_OK), 0);
+	assert0 (access (restore_path, F_OK));
+
+	fd = state_checkpoint_open ();
+	TEST_GT (fd, 0);
+	close (fd);
+
+	TEST_LT (access (restore_path, F_OK), 0);
+
+	TEST_LT (state_checkpoint_claim (restore_path), 0);
+	TEST_LT (state_checkpoint_open (), 0);
+
+	nih_free (restore_path);
+
+	state_checkpoint_interval = 0;
+	unsetenv (STATE_CHECKPOINT_ENV);
+
+	TEST_LIST_EMPTY (sessions);
+	TEST_LIST_EMPTY (events);
+	TEST_HASH_EMPTY (job_classes);
+}
+
+static char *snapshot_state = NULL;
+static int   snapshot_called = 0;
+
+static void
+my_snapshot_handler (void       *data,
+		     const char *state,
+		     size_t      len)
+{
+	snapshot_called++;
+
+	TEST_EQ_P (data, &snapshot_called);
+
+	snapshot_state = state ? NIH_MUST (nih_strndup (NULL, state, len)) : NULL;
+}
+
+void
+test_snapshot (void)
+{
+	NihIo *io;
+	Event *event;
+
+	TEST_FUNCTION ("state_snapshot");
+
+	/*******************************/
+	/* Check that state serialised by the child is passed to the
+	 * handler once it has all been read.
+	 */
+	TEST_FEATURE ("with event");
+
+	TEST_LIST_EMPTY (events);
+
+	event = event_new (NULL, "snapshot-event", NULL);
+	TEST_NE_P (event, NULL);
+
+	snapshot_called = 0;
+	io = state_snapshot (NULL, my_snapshot_handler, &snapshot_called);
+	TEST_NE_P (io, NULL);
+	TEST_FREE_TAG (io);
+
+	/* Changes made meanwhile are not seen by the child */
+	nih_free (event);
+
+	while (! snapshot_called)
+		TEST_WATCH_UPDATE ();
+
+	TEST_EQ (snapshot_called, 1);
+	TEST_NE_P (snapshot_state, NULL);
+	TEST_NE_P (strstr (snapshot_state, "\"snapshot-event\""), NULL);
+	TEST_FREE (io);
+
+	nih_free (snapshot_state);
+
+	TEST_LIST_EMPTY (events);
+}
+
+void
+test_to_string_filtered (void)
+{
+	nih_local char *json_string = NULL;
+	ConfSource     *source;
+	ConfFile       *file;
+	JobClass       *class;
+	Job            *job;
+	Event          *foo;
+	Event          *bar;
+	char           *kinds[3] = { NULL, NULL, NULL };
+	char           *names[2] = { NULL, NULL };
+	uint64_t        generation;
+	size_t          len;
+
+	TEST_FUNCTION ("state_to_string_filtered");
+
+	conf_init ();
+	event_init ();
+	job_class_init ();
+
+	TEST_LIST_EMPTY (events);
+	TEST_HASH_EMPTY (job_classes);
+
+	source = conf_source_new (NULL, "/tmp/foo", CONF_JOB_DIR);
+	TEST_NE_P (source, NULL);
+
+	file = conf_file_new (source, "/tmp/foo/filtered.conf");
+	TEST_NE_P (file, NULL);
+	class = file->job = job_class_new (file, "filtered", NULL);
+	conf_file_index (file);
+	TEST_NE_P (class, NULL);
+	TEST_TRUE (job_class_consider (class));
+
+	job = job_new (class, "");
+	TEST_NE_P (job, NULL);
+
+	foo = event_new (NULL, "foo-event", NULL);
+	TEST_NE_P (foo, NULL);
+	bar = event_new (NULL, "bar-event", NULL);
+	TEST_NE_P (bar, NULL);
+
+	/*******************************/
+	/* Check that only objects of the kinds asked for, with names
+	 * matching the globs, are serialised.
+	 */
+	TEST_FEATURE ("with kinds and names");
+	kinds[0] = "events";
+	names[0] = "foo-*";
+
+	assert0 (state_to_string_filtered (&json_string, &len,
+					   kinds, names, 0));
+	TEST_EQ (strlen (json_string), len);
+	TEST_NE_P (strstr (json_string, "\"foo-event\""), NULL);
+	TEST_EQ_P (strstr (json_string, "\"bar-event\""), NULL);
+	TEST_EQ_P (strstr (json_string, "\"job_classes\""), NULL);
+	TEST_EQ_P (strstr (json_string, "\"jobs\""), NULL);
+
+	nih_free (json_string);
+
+	/*******************************/
+	/* Check that jobs are matched by the name of their class, and
+	 * carry it.
+	 */
+	TEST_FEATURE ("with jobs");
+	kinds[0] = "jobs";
+	names[0] = "filt*";
+
+	assert0 (state_to_string_filtered (&json_string, &len,
+					   kinds, names, 0));
+	TEST_NE_P (strstr (json_string, "\"class\": \"filtered\""), NULL);
+	TEST_EQ_P (strstr (json_string, "\"events\""), NULL);
+
+	nih_free (json_string);
+
+	/*******************************/
+	/* Check that with a generation, only what changed after it is
+	 * serialised, and that a class counts as changed when one of its
+	 * instances has.
+	 */
+	TEST_FEATURE ("with generation");
+	generation = state_generation;
+
+	kinds[0] = NULL;
+	names[0] = NULL;
+
+	assert0 (state_to_string_filtered (&json_string, &len,
+					   kinds, names, generation));
+	TEST_EQ_P (strstr (json_string, "\"foo-event\""), NULL);
+	TEST_EQ_P (strstr (json_string, "\"filtered\""), NULL);
+
+	nih_free (json_string);
+
+	/* Not from waiting, which would start the job */
+	job->state = JOB_STARTING;
+	job_change_goal (job, JOB_START);
+	TEST_GT (state_generation, generation);
+
+	assert0 (state_to_string_filtered (&json_string, &len,
+					   kinds, names, generation));
+	TEST_EQ_P (strstr (json_string, "\"foo-event\""), NULL);
+	TEST_NE_P (strstr (json_string, "\"job_classes\": [ {"), NULL);
+	TEST_NE_P (strstr (json_string, "\"class\": \"filtered\""), NULL);
+
+	nih_free (json_string);
+	json_string = NULL;
+
+	nih_free (foo);
+	nih_free (bar);
+	nih_free (source);
+
+	TEST_LIST_EMPTY (events);
+	TEST_HASH_EMPTY (job_classes);
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -4757,6 +5383,9 @@ main (int   argc,
 	test_log_serialise ();
 	test_job_serialise ();
 	test_job_class_serialise ();
+	test_checkpoint ();
+	test_snapshot ();
+	test_to_string_filtered ();
 	test_upgrade ();
 
 	return 0;
@@ -0,0 +1,384 @@
+/* upstart
+ *
+ * test_status_page.c - test suite for init/status_page.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <nih/test.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/hash.h>
+#include <nih/main.h>
+#include <nih/error.h>
+
+#include "job_class.h"
+#include "job.h"
+#include "status_page.h"
+
+
+/**
+ * map_page:
+ * @path: status page to map,
+ * @size: set to the size of the mapping.
+ *
+ * Map the status page at @path read-only, as a reader would.
+ *
+ * Returns: header of the page.
+ **/
+static const UpstartStatusHeader *
+map_page (const char *path,
+	  size_t     *size)
+{
+	struct stat  statbuf;
+	void        *map;
+	int          fd;
+
+	fd = open (path, O_RDONLY);
+	assert (fd >= 0);
+	assert0 (fstat (fd, &statbuf));
+
+	map = mmap (NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	assert (map != MAP_FAILED);
+	close (fd);
+
+	*size = statbuf.st_size;
+
+	return map;
+}
+
+/**
+ * page_entry:
+ * @header: header of mapped page,
+ * @index: entry to return.
+ *
+ * Returns: entry @index of the page.
+ **/
+static const UpstartStatusEntry *
+page_entry (const UpstartStatusHeader *header,
+	    size_t                     index)
+{
+	return (const UpstartStatusEntry *)((const char *)header
+					    + header->header_size
+					    + index * header->entry_size);
+}
+
+
+void
+test_open (void)
+{
+	char                       dirname[PATH_MAX];
+	nih_local char            *path = NULL;
+	const UpstartStatusHeader *header, *old;
+	const UpstartStatusEntry  *entry;
+	JobClass                  *class;
+	Job                       *job;
+	size_t                     size, old_size;
+	struct stat                statbuf;
+	int                        ret;
+
+	TEST_FUNCTION ("status_page_open");
+	job_class_init ();
+
+	TEST_FILENAME (dirname);
+	path = NIH_MUST (nih_sprintf (NULL, "%s/status", dirname));
+
+	class = job_class_new (NULL, "test", NULL);
+	nih_hash_add (job_classes, &class->entry);
+
+	job = job_new (class, "foo");
+	job->goal = JOB_START;
+	job->state = JOB_RUNNING;
+
+
+	/* Check that the page is created along with its directory, that
+	 * its header describes its layout, and that instances existing
+	 * already are published in it.
+	 */
+	TEST_FEATURE ("with existing instance");
+	ret = status_page_open (path);
+
+	TEST_EQ (ret, 0);
+
+	assert0 (stat (dirname, &statbuf));
+	TEST_TRUE (S_ISDIR (statbuf.st_mode));
+
+	header = map_page (path, &size);
+
+	TEST_EQ (header->magic, UPSTART_STATUS_MAGIC);
+	TEST_EQ (header->version, UPSTART_STATUS_VERSION);
+	TEST_EQ (header->header_size, sizeof (UpstartStatusHeader));
+	TEST_EQ (header->entry_size, sizeof (UpstartStatusEntry));
+	TEST_EQ (header->entries, STATUS_PAGE_ENTRIES);
+	TEST_EQ (header->used, 1);
+	TEST_EQ (header->closed, 0);
+	TEST_EQ (header->overflow, 0);
+	TEST_EQ (size, (sizeof (UpstartStatusHeader)
+			+ STATUS_PAGE_ENTRIES * sizeof (UpstartStatusEntry)));
+
+	TEST_EQ (job->status_slot, 0);
+
+	entry = page_entry (header, 0);
+	TEST_EQ (entry->seq, 2);
+	TEST_EQ (entry->used, 1);
+	TEST_EQ_STR (entry->class, "test");
+	TEST_EQ_STR (entry->instance, "foo");
+	TEST_EQ_STR (entry->goal, "start");
+	TEST_EQ_STR (entry->state, "running");
+	TEST_GT (entry->changed, 0);
+
+	old = header;
+	old_size = size;
+
+
+	/* Check that opening the page again replaces it, marking the
+	 * earlier page closed so that its readers know to open the new one.
+	 */
+	TEST_FEATURE ("with earlier page");
+	ret = status_page_open (path);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ (old->closed, 1);
+
+	header = map_page (path, &size);
+
+	TEST_NE_P (header, old);
+	TEST_EQ (header->closed, 0);
+	TEST_EQ (header->used, 1);
+	TEST_EQ (job->status_slot, 0);
+
+	entry = page_entry (header, 0);
+	TEST_EQ_STR (entry->class, "test");
+	TEST_EQ_STR (entry->state, "running");
+
+	munmap ((void *)old, old_size);
+
+
+	/* Check that the runlevel is published in the page, packed with
+	 * the previous runlevel, and is written into a page opened later.
+	 */
+	TEST_FEATURE ("with runlevel");
+	TEST_EQ (header->runlevel, 0);
+
+	status_page_set_runlevel ('2', 'S');
+
+	TEST_EQ (header->runlevel, '2' | 'S' << 8);
+
+	ret = status_page_open (path);
+
+	TEST_EQ (ret, 0);
+
+	munmap ((void *)header, size);
+	header = map_page (path, &size);
+
+	TEST_EQ (header->runlevel, '2' | 'S' << 8);
+
+
+	/* Check that closing the page leaves it in place but forgets the
+	 * entries of the instances.
+	 */
+	TEST_FEATURE ("with close");
+	status_page_close ();
+
+	TEST_EQ (job->status_slot, -1);
+	TEST_EQ (access (path, F_OK), 0);
+
+	munmap ((void *)header, size);
+
+
+	/* Check that an error is raised when the page cannot be created. */
+	TEST_FEATURE ("with missing parent directory");
+	{
+		nih_local char *bad = NULL;
+		NihError       *err;
+
+		bad = NIH_MUST (nih_sprintf (NULL, "%s/missing/dir/status",
+					     dirname));
+
+		ret = status_page_open (bad);
+
+		TEST_LT (ret, 0);
+		TEST_EQ (job->status_slot, -1);
+
+		err = nih_error_get ();
+		TEST_EQ (err->number, ENOENT);
+		nih_free (err);
+	}
+
+	nih_free (class);
+
+	unlink (path);
+	rmdir (dirname);
+}
+
+
+void
+test_update (void)
+{
+	char                       dirname[PATH_MAX];
+	nih_local char            *path = NULL;
+	const UpstartStatusHeader *header;
+	const UpstartStatusEntry  *entry;
+	JobClass                  *class;
+	Job                       *job1, *job2, *job3;
+	Job                      **jobs;
+	size_t                     size;
+
+	TEST_FUNCTION ("status_page_update");
+	job_class_init ();
+
+	TEST_FILENAME (dirname);
+	path = NIH_MUST (nih_sprintf (NULL, "%s/status", dirname));
+
+	class = job_class_new (NULL, "test", NULL);
+	nih_hash_add (job_classes, &class->entry);
+
+	/* Check that an update before the page is published does
+	 * nothing.
+	 */
+	TEST_FEATURE ("without page");
+	job1 = job_new (class, "");
+	status_page_update (job1);
+
+	TEST_EQ (job1->status_slot, -1);
+
+	assert0 (status_page_open (path));
+	header = map_page (path, &size);
+
+	TEST_EQ (job1->status_slot, 0);
+
+
+	/* Check that a change is written into the entry of the instance,
+	 * with the sequence count incremented for each write.
+	 */
+	TEST_FEATURE ("with changed instance");
+	job1->goal = JOB_START;
+	job1->state = JOB_SPAWNED;
+	job1->pid[PROCESS_MAIN] = 1000;
+
+	status_page_update (job1);
+
+	entry = page_entry (header, 0);
+	TEST_EQ (entry->seq, 4);
+	TEST_EQ_STR (entry->instance, "");
+	TEST_EQ_STR (entry->goal, "start");
+	TEST_EQ_STR (entry->state, "spawned");
+	TEST_EQ (entry->pid, 1000);
+
+
+	/* Check that a new instance takes the next entry. */
+	TEST_FEATURE ("with new instance");
+	job2 = job_new (class, "bar");
+	status_page_update (job2);
+
+	TEST_EQ (job2->status_slot, 1);
+	TEST_EQ (header->used, 2);
+
+	entry = page_entry (header, 1);
+	TEST_EQ (entry->used, 1);
+	TEST_EQ_STR (entry->instance, "bar");
+	TEST_EQ_STR (entry->state, "waiting");
+
+
+	/* Check that an instance is removed from the page when it is
+	 * freed, and that its entry is taken by the next new instance.
+	 */
+	TEST_FEATURE ("with freed instance");
+	nih_free (job1);
+
+	entry = page_entry (header, 0);
+	TEST_EQ (entry->seq, 6);
+	TEST_EQ (entry->used, 0);
+	TEST_EQ_STR (entry->class, "");
+
+	job3 = job_new (class, "baz");
+	status_page_update (job3);
+
+	TEST_EQ (job3->status_slot, 0);
+	TEST_EQ (header->used, 2);
+
+	entry = page_entry (header, 0);
+	TEST_EQ (entry->seq, 8);
+	TEST_EQ (entry->used, 1);
+	TEST_EQ_STR (entry->instance, "baz");
+
+	nih_free (job2);
+	nih_free (job3);
+
+
+	/* Check that instances beyond the size of the page are counted
+	 * in its overflow until they are freed.
+	 */
+	TEST_FEATURE ("with full page");
+	jobs = NIH_MUST (nih_alloc (NULL, sizeof (Job *)
+				    * (STATUS_PAGE_ENTRIES + 2)));
+
+	for (size_t i = 0; i < STATUS_PAGE_ENTRIES + 2; i++) {
+		nih_local char *name = NULL;
+
+		name = NIH_MUST (nih_sprintf (NULL, "%zu", i));
+		jobs[i] = job_new (class, name);
+		status_page_update (jobs[i]);
+	}
+
+	TEST_EQ (header->used, STATUS_PAGE_ENTRIES);
+	TEST_EQ (header->overflow, 2);
+	TEST_EQ (jobs[STATUS_PAGE_ENTRIES]->status_slot, -2);
+
+	nih_free (jobs[STATUS_PAGE_ENTRIES]);
+	TEST_EQ (header->overflow, 1);
+
+	for (size_t i = 0; i < STATUS_PAGE_ENTRIES; i++)
+		nih_free (jobs[i]);
+	nih_free (jobs[STATUS_PAGE_ENTRIES + 1]);
+	nih_free (jobs);
+
+	TEST_EQ (header->overflow, 0);
+	TEST_EQ (page_entry (header, STATUS_PAGE_ENTRIES - 1)->used, 0);
+
+	status_page_close ();
+	munmap ((void *)header, size);
+
+	nih_free (class);
+
+	unlink (path);
+	rmdir (dirname);
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	/* run tests in legacy (pre-session support) mode */
+	setenv ("UPSTART_NO_SESSIONS", "1", 1);
+
+	nih_main_init (argv[0]);
+
+	test_open ();
+	test_update ();
+
+	return 0;
+}
@@ -0,0 +1,507 @@
+/* upstart
+ *
+ * test_subscription.c - test suite for init/subscription.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <nih/test.h>
+#include <nih-dbus/test_dbus.h>
+
+#include <stdlib.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/main.h>
+
+#include "dbus/upstart.h"
+
+#include "job_class.h"
+#include "job.h"
+#include "event.h"
+#include "control.h"
+#include "timer_wheel.h"
+#include "subscription.h"
+
+
+void
+test_new (void)
+{
+	pid_t           dbus_pid;
+	DBusConnection *conn;
+	Subscription   *subscription;
+
+	TEST_FUNCTION ("subscription_new");
+	subscription_init ();
+
+	TEST_DBUS (dbus_pid);
+	TEST_DBUS_OPEN (conn);
+
+	/* Check that a subscription can be created with its patterns
+	 * copied, that it's placed in the subscriptions list with nothing
+	 * pending, and that it can then be found by its connection.
+	 */
+	TEST_ALLOC_FAIL {
+		subscription = subscription_new (NULL, conn, NULL,
+						 "te*", "started", 100);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (subscription, NULL);
+			TEST_LIST_EMPTY (subscriptions);
+			continue;
+		}
+
+		TEST_ALLOC_SIZE (subscription, sizeof (Subscription));
+		TEST_LIST_NOT_EMPTY (&subscription->entry);
+
+		TEST_EQ_P (subscription->conn, conn);
+		TEST_EQ_P (subscription->session, NULL);
+		TEST_ALLOC_PARENT (subscription->job_pattern, subscription);
+		TEST_EQ_STR (subscription->job_pattern, "te*");
+		TEST_ALLOC_PARENT (subscription->event_pattern, subscription);
+		TEST_EQ_STR (subscription->event_pattern, "started");
+		TEST_EQ (subscription->window, 100);
+		TEST_HASH_EMPTY (subscription->jobs);
+		TEST_LIST_EMPTY (&subscription->events);
+		TEST_EQ_P (subscription->timer, NULL);
+
+		TEST_EQ_P (subscription_find (conn), subscription);
+
+		nih_free (subscription);
+
+		TEST_LIST_EMPTY (subscriptions);
+		TEST_EQ_P (subscription_find (conn), NULL);
+	}
+
+	TEST_DBUS_CLOSE (conn);
+	TEST_DBUS_END (dbus_pid);
+
+	dbus_shutdown ();
+}
+
+
+void
+test_notify_job (void)
+{
+	pid_t            dbus_pid;
+	DBusConnection  *conn;
+	Subscription    *subscription;
+	SubscriptionJob *update;
+	JobClass        *class, *other;
+	Job             *job, *other_job;
+
+	TEST_FUNCTION ("subscription_notify_job");
+	subscription_init ();
+	timer_wheel_init ();
+
+	TEST_DBUS (dbus_pid);
+	TEST_DBUS_OPEN (conn);
+
+	class = job_class_new (NULL, "test", NULL);
+	other = job_class_new (NULL, "other", NULL);
+
+	subscription = subscription_new (NULL, conn, NULL, "te*", "", 100);
+
+
+	/* Check that a change to a matching instance is recorded with its
+	 * goal and state and a timer set for the window, and that further
+	 * changes replace the goal and state of the same entry.
+	 */
+	TEST_FEATURE ("with matching job");
+	job = job_new (class, "foo");
+	job->goal = JOB_START;
+	job->state = JOB_STARTING;
+
+	subscription_notify_job (job);
+
+	update = (SubscriptionJob *)nih_hash_lookup (subscription->jobs,
+						     job->path);
+	TEST_NE_P (update, NULL);
+	TEST_EQ_STR (update->job, "test");
+	TEST_EQ_STR (update->instance, "foo");
+	TEST_EQ (update->goal, JOB_START);
+	TEST_EQ (update->state, JOB_STARTING);
+
+	TEST_NE_P (subscription->timer, NULL);
+	TEST_EQ (subscription->timer->timeout, 100);
+
+	job->state = JOB_RUNNING;
+	subscription_notify_job (job);
+
+	TEST_EQ_P (nih_hash_lookup (subscription->jobs, job->path), update);
+	TEST_EQ (update->state, JOB_RUNNING);
+
+	/* Check that the entry outlives the instance */
+	nih_free (job);
+
+	TEST_EQ_STR (update->instance, "foo");
+
+
+	/* Check that a change to an instance of a job not matching the
+	 * pattern is ignored.
+	 */
+	TEST_FEATURE ("with non-matching job");
+	other_job = job_new (other, "");
+	other_job->goal = JOB_START;
+	other_job->state = JOB_STARTING;
+
+	subscription_notify_job (other_job);
+
+	TEST_EQ_P (nih_hash_lookup (subscription->jobs, other_job->path), NULL);
+
+	nih_free (other_job);
+
+	nih_free (subscription);
+	nih_free (other);
+	nih_free (class);
+
+	TEST_DBUS_CLOSE (conn);
+	TEST_DBUS_END (dbus_pid);
+
+	dbus_shutdown ();
+}
+
+
+void
+test_notify_event (void)
+{
+	pid_t              dbus_pid;
+	DBusConnection    *conn;
+	Subscription      *subscription;
+	SubscriptionEvent *update;
+	Event             *event1, *event2, *event3;
+	char             **env;
+
+	TEST_FUNCTION ("subscription_notify_event");
+	subscription_init ();
+	event_init ();
+	timer_wheel_init ();
+
+	TEST_DBUS (dbus_pid);
+	TEST_DBUS_OPEN (conn);
+
+	subscription = subscription_new (NULL, conn, NULL, "", "start*", 100);
+
+
+	/* Check that matching events are recorded in order with a copy of
+	 * their environment, and that others are ignored.
+	 */
+	TEST_FEATURE ("with matching events");
+	env = nih_str_array_new (NULL);
+	NIH_MUST (nih_str_array_add (&env, NULL, NULL, "JOB=test"));
+
+	event1 = event_new (NULL, "starting", env);
+	event2 = event_new (NULL, "stopping", NULL);
+	event3 = event_new (NULL, "started", NULL);
+
+	subscription_notify_event (event1);
+	subscription_notify_event (event2);
+	subscription_notify_event (event3);
+
+	TEST_LIST_NOT_EMPTY (&subscription->events);
+
+	update = (SubscriptionEvent *)subscription->events.next;
+	TEST_EQ_STR (update->name, "starting");
+	TEST_ALLOC_PARENT (update->env, update);
+	TEST_EQ_STR (update->env[0], "JOB=test");
+	TEST_EQ_P (update->env[1], NULL);
+
+	update = (SubscriptionEvent *)update->entry.next;
+	TEST_EQ_STR (update->name, "started");
+	TEST_EQ_P (update->env[0], NULL);
+
+	TEST_EQ_P (update->entry.next, &subscription->events);
+
+	TEST_NE_P (subscription->timer, NULL);
+
+	nih_free (event1);
+	nih_free (event2);
+	nih_free (event3);
+
+	nih_free (subscription);
+
+	TEST_DBUS_CLOSE (conn);
+	TEST_DBUS_END (dbus_pid);
+
+	dbus_shutdown ();
+}
+
+
+void
+test_flush (void)
+{
+	pid_t            dbus_pid;
+	DBusConnection  *conn, *client_conn;
+	DBusError        dbus_error;
+	DBusMessage     *message;
+	DBusMessageIter  iter;
+	DBusMessageIter  arrayiter;
+	DBusMessageIter  structiter;
+	DBusMessageIter  subiter;
+	Subscription    *subscription;
+	JobClass        *class;
+	Job             *job;
+	Event           *event;
+	const char      *str_value;
+	uint32_t         u32_value;
+
+	TEST_FUNCTION ("subscription_flush");
+	subscription_init ();
+	event_init ();
+	timer_wheel_init ();
+
+	dbus_error_init (&dbus_error);
+
+	TEST_DBUS (dbus_pid);
+	TEST_DBUS_OPEN (conn);
+	TEST_DBUS_OPEN (client_conn);
+
+	dbus_bus_add_match (client_conn, "type='signal'", &dbus_error);
+	assert (! dbus_error_is_set (&dbus_error));
+
+	class = job_class_new (NULL, "test", NULL);
+
+
+	/* Check that pending updates are sent in a single StateBatch
+	 * signal, with only the latest state of each instance, and are
+	 * then cleared along with the timer.
+	 */
+	TEST_FEATURE ("with pending updates");
+	subscription = subscription_new (NULL, conn, NULL, "test", "*", 100);
+
+	job = job_new (class, "");
+	job->goal = JOB_START;
+	job->state = JOB_STARTING;
+	subscription_notify_job (job);
+
+	job->state = JOB_RUNNING;
+	subscription_notify_job (job);
+
+	event = event_new (NULL, "started", NULL);
+	subscription_notify_event (event);
+
+	subscription_flush (subscription);
+
+	TEST_HASH_EMPTY (subscription->jobs);
+	TEST_LIST_EMPTY (&subscription->events);
+	TEST_EQ_P (subscription->timer, NULL);
+
+	dbus_connection_flush (conn);
+
+	TEST_DBUS_MESSAGE (client_conn, message);
+	TEST_TRUE (dbus_message_is_signal (message, DBUS_INTERFACE_UPSTART,
+					   "StateBatch"));
+	TEST_EQ_STR (dbus_message_get_path (message), DBUS_PATH_UPSTART);
+
+	dbus_message_iter_init (message, &iter);
+
+	TEST_EQ (dbus_message_iter_get_arg_type (&iter), DBUS_TYPE_ARRAY);
+	dbus_message_iter_recurse (&iter, &arrayiter);
+
+	TEST_EQ (dbus_message_iter_get_arg_type (&arrayiter), DBUS_TYPE_STRUCT);
+	dbus_message_iter_recurse (&arrayiter, &structiter);
+
+	dbus_message_iter_get_basic (&structiter, &str_value);
+	TEST_EQ_STR (str_value, "test");
+	dbus_message_iter_next (&structiter);
+
+	dbus_message_iter_get_basic (&structiter, &str_value);
+	TEST_EQ_STR (str_value, "");
+	dbus_message_iter_next (&structiter);
+
+	dbus_message_iter_get_basic (&structiter, &str_value);
+	TEST_EQ_STR (str_value, "start");
+	dbus_message_iter_next (&structiter);
+
+	dbus_message_iter_get_basic (&structiter, &str_value);
+	TEST_EQ_STR (str_value, "running");
+
+	dbus_message_iter_next (&arrayiter);
+	TEST_EQ (dbus_message_iter_get_arg_type (&arrayiter), DBUS_TYPE_INVALID);
+
+	dbus_message_iter_next (&iter);
+
+	TEST_EQ (dbus_message_iter_get_arg_type (&iter), DBUS_TYPE_ARRAY);
+	dbus_message_iter_recurse (&iter, &arrayiter);
+
+	TEST_EQ (dbus_message_iter_get_arg_type (&arrayiter), DBUS_TYPE_STRUCT);
+	dbus_message_iter_recurse (&arrayiter, &structiter);
+
+	dbus_message_iter_get_basic (&structiter, &str_value);
+	TEST_EQ_STR (str_value, "started");
+	dbus_message_iter_next (&structiter);
+
+	TEST_EQ (dbus_message_iter_get_arg_type (&structiter), DBUS_TYPE_ARRAY);
+	dbus_message_iter_recurse (&structiter, &subiter);
+	TEST_EQ (dbus_message_iter_get_arg_type (&subiter), DBUS_TYPE_INVALID);
+
+	dbus_message_iter_next (&arrayiter);
+	TEST_EQ (dbus_message_iter_get_arg_type (&arrayiter), DBUS_TYPE_INVALID);
+
+	dbus_message_iter_next (&iter);
+
+	TEST_EQ (dbus_message_iter_get_arg_type (&iter), DBUS_TYPE_UINT32);
+	dbus_message_iter_get_basic (&iter, &u32_value);
+	TEST_EQ (u32_value, 0);
+
+	dbus_message_unref (message);
+
+	nih_free (event);
+	nih_free (job);
+
+
+	/* Check that nothing is sent when no updates are pending. */
+	TEST_FEATURE ("with nothing pending");
+	subscription_flush (subscription);
+
+	dbus_connection_flush (conn);
+
+	nih_free (subscription);
+
+	/* The next signal seen must be our marker, not a batch */
+	NIH_ZERO (control_emit_restarted (conn, DBUS_PATH_UPSTART));
+	dbus_connection_flush (conn);
+
+	TEST_DBUS_MESSAGE (client_conn, message);
+	TEST_TRUE (dbus_message_is_signal (message, DBUS_INTERFACE_UPSTART,
+					   "Restarted"));
+	dbus_message_unref (message);
+
+
+	/* Check that only the latest events are kept when more are
+	 * emitted than may be pending, and that the number dropped is sent
+	 * with them and then reset.
+	 */
+	TEST_FEATURE ("with too many events");
+	subscription = subscription_new (NULL, conn, NULL, "", "*", 100);
+
+	event = event_new (NULL, "wibble", NULL);
+	for (int i = 0; i < SUBSCRIPTION_MAX_EVENTS + 2; i++)
+		subscription_notify_event (event);
+
+	TEST_EQ (subscription->events_len, SUBSCRIPTION_MAX_EVENTS);
+	TEST_EQ (subscription->dropped, 2);
+
+	subscription_flush (subscription);
+
+	TEST_EQ (subscription->events_len, 0);
+	TEST_EQ (subscription->dropped, 0);
+
+	dbus_connection_flush (conn);
+
+	TEST_DBUS_MESSAGE (client_conn, message);
+	TEST_TRUE (dbus_message_is_signal (message, DBUS_INTERFACE_UPSTART,
+					   "StateBatch"));
+
+	dbus_message_iter_init (message, &iter);
+	dbus_message_iter_next (&iter);
+	dbus_message_iter_next (&iter);
+
+	TEST_EQ (dbus_message_iter_get_arg_type (&iter), DBUS_TYPE_UINT32);
+	dbus_message_iter_get_basic (&iter, &u32_value);
+	TEST_EQ (u32_value, 2);
+
+	dbus_message_unref (message);
+
+	nih_free (event);
+	nih_free (subscription);
+
+
+	/* Check that the timer sends the batch once the window has
+	 * passed.
+	 */
+	TEST_FEATURE ("with window passed");
+	subscription = subscription_new (NULL, conn, NULL, "test", "", 1000);
+
+	job = job_new (class, "");
+	job->goal = JOB_START;
+	job->state = JOB_STARTING;
+	subscription_notify_job (job);
+
+	TEST_NE_P (subscription->timer, NULL);
+	timer_wheel_adjust (subscription->timer, timer_wheel_now ());
+	timer_wheel_poll ();
+
+	TEST_EQ_P (subscription->timer, NULL);
+	TEST_HASH_EMPTY (subscription->jobs);
+
+	dbus_connection_flush (conn);
+
+	TEST_DBUS_MESSAGE (client_conn, message);
+	TEST_TRUE (dbus_message_is_signal (message, DBUS_INTERFACE_UPSTART,
+					   "StateBatch"));
+	dbus_message_unref (message);
+
+	nih_free (job);
+	nih_free (subscription);
+
+	nih_free (class);
+
+	TEST_DBUS_CLOSE (conn);
+	TEST_DBUS_CLOSE (client_conn);
+	TEST_DBUS_END (dbus_pid);
+
+	dbus_shutdown ();
+}
+
+
+void
+test_disconnected (void)
+{
+	pid_t           dbus_pid;
+	DBusConnection *conn;
+	Subscription   *subscription;
+
+	TEST_FUNCTION ("subscription_disconnected");
+	subscription_init ();
+
+	TEST_DBUS (dbus_pid);
+	TEST_DBUS_OPEN (conn);
+
+	/* Check that the subscription for a dropped connection is freed. */
+	subscription = subscription_new (NULL, conn, NULL, "*", "*", 0);
+	TEST_FREE_TAG (subscription);
+
+	subscription_disconnected (conn);
+
+	TEST_FREE (subscription);
+	TEST_LIST_EMPTY (subscriptions);
+
+	TEST_DBUS_CLOSE (conn);
+	TEST_DBUS_END (dbus_pid);
+
+	dbus_shutdown ();
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	/* run tests in legacy (pre-session support) mode */
+	setenv ("UPSTART_NO_SESSIONS", "1", 1);
+
+	nih_main_init (argv[0]);
+
+	test_new ();
+	test_notify_job ();
+	test_notify_event ();
+	test_flush ();
+	test_disconnected ();
+
+	return 0;
+}
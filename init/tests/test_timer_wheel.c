@@ -0,0 +1,218 @@
+/* upstart
+ *
+ * test_timer_wheel.c - test suite for init/timer_wheel.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdint.h>
+
+#include <nih/test.h>
+#include <nih/alloc.h>
+#include <nih/list.h>
+
+#include "timer_wheel.h"
+
+
+static int         callback_called = 0;
+static void       *last_data = NULL;
+static WheelTimer *last_timer = NULL;
+static WheelTimer *added_timer = NULL;
+
+static void
+my_callback (void       *data,
+	     WheelTimer *timer)
+{
+	/* Record order of calls in the data pointer's int */
+	if (data)
+		*(int *)data = ++callback_called;
+	else
+		callback_called++;
+
+	last_data = data;
+	last_timer = timer;
+}
+
+static void
+my_add_callback (void       *data,
+		 WheelTimer *timer)
+{
+	callback_called++;
+
+	added_timer = NIH_MUST (timer_wheel_add (NULL, 0, my_callback, NULL));
+}
+
+
+void
+test_add (void)
+{
+	WheelTimer *timer;
+	uint64_t    now;
+
+	TEST_FUNCTION ("timer_wheel_add");
+	timer_wheel_init ();
+
+	/* Check that a timer can be added to the wheel, with the timeout
+	 * and due time filled in, and that the wheel then reports the timer
+	 * as the next due.
+	 */
+	TEST_ALLOC_FAIL {
+		now = timer_wheel_now ();
+		timer = timer_wheel_add (NULL, 10000, my_callback, &timer);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (timer, NULL);
+			continue;
+		}
+
+		TEST_ALLOC_SIZE (timer, sizeof (WheelTimer));
+		TEST_EQ (timer->timeout, 10000);
+		TEST_GE (timer->due, now + 10000);
+		TEST_LE (timer->due, timer_wheel_now () + 10000);
+		TEST_EQ_P (timer->callback, my_callback);
+		TEST_EQ_P (timer->data, &timer);
+
+		TEST_GE (timer_wheel_next_due (), now);
+		TEST_LE (timer_wheel_next_due (), timer->due);
+
+		nih_free (timer);
+	}
+
+
+	/* Check that freeing the only timer leaves the wheel with nothing
+	 * due.
+	 */
+	TEST_FEATURE ("with freed timer");
+	timer = timer_wheel_add (NULL, 10000, my_callback, &timer);
+	nih_free (timer);
+
+	TEST_EQ (timer_wheel_next_due (), UINT64_MAX);
+}
+
+
+void
+test_poll (void)
+{
+	WheelTimer *timer1;
+	WheelTimer *timer2;
+	WheelTimer *timer3;
+	int         order1 = 0;
+	int         order2 = 0;
+	int         order3 = 0;
+
+	TEST_FUNCTION ("timer_wheel_poll");
+	timer_wheel_init ();
+
+	/* Check that timers which are due are run in order of their due
+	 * time and freed, while those not yet due are left alone.
+	 */
+	TEST_FEATURE ("with due timers");
+	callback_called = 0;
+
+	timer1 = timer_wheel_add (NULL, 10000, my_callback, &order1);
+	timer2 = timer_wheel_add (NULL, 20000, my_callback, &order2);
+	timer3 = timer_wheel_add (NULL, 100000000, my_callback, &order3);
+
+	TEST_FREE_TAG (timer1);
+	TEST_FREE_TAG (timer2);
+	TEST_FREE_TAG (timer3);
+
+	timer_wheel_adjust (timer2, timer_wheel_now () - 10);
+	timer_wheel_adjust (timer1, timer_wheel_now () - 5);
+
+	timer_wheel_poll ();
+
+	TEST_EQ (callback_called, 2);
+	TEST_EQ (order2, 1);
+	TEST_EQ (order1, 2);
+	TEST_EQ (order3, 0);
+
+	TEST_FREE (timer1);
+	TEST_FREE (timer2);
+	TEST_NOT_FREE (timer3);
+
+	nih_free (timer3);
+
+	TEST_EQ (timer_wheel_next_due (), UINT64_MAX);
+
+
+	/* Check that a timer too far away for the lower levels of the
+	 * wheel is run once it's made due.
+	 */
+	TEST_FEATURE ("with distant timer");
+	callback_called = 0;
+	last_data = NULL;
+
+	timer1 = timer_wheel_add (NULL, UINT64_C (1) << 40, my_callback, &order1);
+	TEST_FREE_TAG (timer1);
+
+	timer_wheel_poll ();
+
+	TEST_EQ (callback_called, 0);
+	TEST_NOT_FREE (timer1);
+
+	timer_wheel_adjust (timer1, timer_wheel_now ());
+	timer_wheel_poll ();
+
+	TEST_EQ (callback_called, 1);
+	TEST_EQ_P (last_data, &order1);
+	TEST_EQ_P (last_timer, timer1);
+	TEST_FREE (timer1);
+
+
+	/* Check that a timer added by a callback isn't run by the same
+	 * poll, but is run by the next one.
+	 */
+	TEST_FEATURE ("with timer added by callback");
+	callback_called = 0;
+	added_timer = NULL;
+
+	timer1 = timer_wheel_add (NULL, 0, my_add_callback, NULL);
+	TEST_FREE_TAG (timer1);
+
+	timer_wheel_adjust (timer1, timer_wheel_now () - 1);
+	timer_wheel_poll ();
+
+	TEST_EQ (callback_called, 1);
+	TEST_FREE (timer1);
+	TEST_NE_P (added_timer, NULL);
+
+	do {
+		timer_wheel_poll ();
+	} while (callback_called < 2);
+
+	TEST_EQ (callback_called, 2);
+	TEST_EQ_P (last_timer, added_timer);
+	TEST_EQ (timer_wheel_next_due (), UINT64_MAX);
+
+
+	/* Check that polling an empty wheel does nothing. */
+	TEST_FEATURE ("with no timers");
+	callback_called = 0;
+
+	timer_wheel_poll ();
+
+	TEST_EQ (callback_called, 0);
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	test_add ();
+	test_poll ();
+
+	return 0;
+}
@@ -0,0 +1,618 @@
+/* upstart
+ *
+ * timer_wheel.c - hierarchical timer wheel
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <sys/timerfd.h>
+
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/list.h>
+#include <nih/io.h>
+#include <nih/timer.h>
+#include <nih/logging.h>
+
+#include "timer_wheel.h"
+
+
+/**
+ * TIMER_WHEEL_MASK:
+ *
+ * Mask of the bits of the due time indexing a single level.
+ **/
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/**
+ * TIMER_WHEEL_UNIT:
+ * @level: wheel level.
+ *
+ * Milliseconds covered by each slot of @level.
+ **/
+#define TIMER_WHEEL_UNIT(level) ((uint64_t)1 << (TIMER_WHEEL_BITS * (level)))
+
+/**
+ * TIMER_WHEEL_SLOT:
+ * @level: wheel level,
+ * @slot: slot within @level.
+ *
+ * List of timers in @slot of @level.
+ **/
+#define TIMER_WHEEL_SLOT(level, slot) \
+	(&timer_wheel[(level) * TIMER_WHEEL_SLOTS + (slot)])
+
+
+/* Prototypes for static functions */
+static int      timer_wheel_destroy  (WheelTimer *timer);
+static void     timer_wheel_insert   (WheelTimer *timer);
+static void     timer_wheel_unlink   (WheelTimer *timer);
+static void     timer_wheel_cascade  (int level, int slot);
+static uint64_t timer_wheel_next_tick (uint64_t from)
+	__attribute__ ((warn_unused_result));
+static void     timer_wheel_arm      (void);
+static void     timer_wheel_watcher  (void *data, NihIoWatch *watch,
+				      NihIoEvents events);
+static void     timer_wheel_fallback_poll (void *data, NihTimer *timer);
+
+
+/**
+ * timer_wheel:
+ *
+ * Slots of every level of the wheel, each a list of WheelTimer objects;
+ * a timer is placed in the lowest level whose span covers the time until
+ * it's due, in the slot indexed by its due time, and moved down a level
+ * when the wheel reaches the start of that slot.
+ **/
+static NihList *timer_wheel = NULL;
+
+/**
+ * timer_wheel_occupied:
+ *
+ * Bitmap for each level of the slots holding timers, so the next one due
+ * can be found without looking at every slot.
+ **/
+static uint64_t timer_wheel_occupied[TIMER_WHEEL_LEVELS];
+
+/**
+ * timer_wheel_tick:
+ *
+ * Next millisecond to be processed by timer_wheel_poll(); every timer
+ * due before this has been run.
+ **/
+static uint64_t timer_wheel_tick = 0;
+
+/**
+ * timer_wheel_pending:
+ *
+ * Number of timers in the wheel.
+ **/
+static size_t timer_wheel_pending = 0;
+
+/**
+ * timer_wheel_fd:
+ *
+ * timerfd armed for the next time the wheel needs to be polled, or -1
+ * if one couldn't be created.
+ **/
+static int timer_wheel_fd = -1;
+
+/**
+ * timer_wheel_armed:
+ *
+ * Time @timer_wheel_fd is armed for, or zero if disarmed.
+ **/
+static uint64_t timer_wheel_armed = 0;
+
+/**
+ * timer_wheel_watch:
+ *
+ * Watch on @timer_wheel_fd, present only while timers are pending.
+ **/
+static NihIoWatch *timer_wheel_watch = NULL;
+
+/**
+ * timer_wheel_fallback:
+ *
+ * Periodic timer polling the wheel once a second while timers are
+ * pending when @timer_wheel_fd couldn't be created.
+ **/
+static NihTimer *timer_wheel_fallback = NULL;
+
+
+/**
+ * timer_wheel_init:
+ *
+ * Initialise the wheel.
+ **/
+void
+timer_wheel_init (void)
+{
+	if (timer_wheel)
+		return;
+
+	timer_wheel = NIH_MUST (nih_alloc (NULL, sizeof (NihList)
+					   * TIMER_WHEEL_LEVELS
+					   * TIMER_WHEEL_SLOTS));
+
+	for (int i = 0; i < TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS; i++)
+		nih_list_init (&timer_wheel[i]);
+
+	memset (timer_wheel_occupied, 0, sizeof (timer_wheel_occupied));
+
+	timer_wheel_tick = timer_wheel_now ();
+
+	timer_wheel_fd = timerfd_create (CLOCK_MONOTONIC,
+					 TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_wheel_fd < 0)
+		nih_warn ("%s: %s", _("Unable to create timer"),
+			  strerror (errno));
+}
+
+/**
+ * timer_wheel_now:
+ *
+ * Returns: current time on CLOCK_MONOTONIC in milliseconds.
+ **/
+uint64_t
+timer_wheel_now (void)
+{
+	struct timespec now;
+
+	nih_assert (clock_gettime (CLOCK_MONOTONIC, &now) == 0);
+
+	return ((uint64_t)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+/**
+ * timer_wheel_add:
+ * @parent: parent object for new timer,
+ * @timeout: milliseconds to wait,
+ * @callback: function to call,
+ * @data: pointer to pass to @callback.
+ *
+ * Arranges for @callback to be called with @data @timeout milliseconds
+ * from now.
+ *
+ * The timer is allocated using nih_alloc() and stored in the wheel;
+ * freeing it with nih_free() cancels it.  After @callback has been
+ * called the timer is freed.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned timer.  When all parents
+ * of the returned timer are freed, the returned timer will also be
+ * freed.
+ *
+ * Returns: new WheelTimer or NULL if insufficient memory.
+ **/
+WheelTimer *
+timer_wheel_add (const void   *parent,
+		 uint64_t      timeout,
+		 WheelTimerCb  callback,
+		 void         *data)
+{
+	WheelTimer *timer;
+	uint64_t    now;
+
+	nih_assert (callback != NULL);
+
+	timer_wheel_init ();
+
+	timer = nih_new (parent, WheelTimer);
+	if (! timer)
+		return NULL;
+
+	nih_list_init (&timer->entry);
+	nih_alloc_set_destructor (timer, timer_wheel_destroy);
+
+	now = timer_wheel_now ();
+
+	timer->timeout = timeout;
+	timer->due = now + timeout;
+
+	timer->callback = callback;
+	timer->data = data;
+
+	timer->level = -1;
+	timer->slot = -1;
+
+	/* Catch up with time that's passed while the wheel was idle, so
+	 * the timer isn't placed relative to a stale tick.
+	 */
+	if ((! timer_wheel_pending) && (timer_wheel_tick < now))
+		timer_wheel_tick = now;
+
+	timer_wheel_insert (timer);
+	timer_wheel_arm ();
+
+	return timer;
+}
+
+/**
+ * timer_wheel_adjust:
+ * @timer: timer to adjust,
+ * @due: new due time.
+ *
+ * Changes the time that @timer is due to @due, a time on CLOCK_MONOTONIC
+ * in milliseconds; if that's in the past, the timer is run the next time
+ * the wheel is polled.
+ **/
+void
+timer_wheel_adjust (WheelTimer *timer,
+		    uint64_t    due)
+{
+	nih_assert (timer != NULL);
+	nih_assert (timer->level >= 0);
+
+	timer_wheel_unlink (timer);
+
+	timer->due = due;
+
+	timer_wheel_insert (timer);
+	timer_wheel_arm ();
+}
+
+/**
+ * timer_wheel_destroy:
+ * @timer: timer being freed.
+ *
+ * Destructor function for a WheelTimer object, removing it from the
+ * wheel.
+ *
+ * Returns: zero.
+ **/
+static int
+timer_wheel_destroy (WheelTimer *timer)
+{
+	nih_assert (timer != NULL);
+
+	timer_wheel_unlink (timer);
+	timer_wheel_arm ();
+
+	return 0;
+}
+
+/**
+ * timer_wheel_insert:
+ * @timer: timer to insert.
+ *
+ * Places @timer in the wheel according to its due time, treating a time
+ * already processed as the next one to be.
+ **/
+static void
+timer_wheel_insert (WheelTimer *timer)
+{
+	uint64_t due;
+	uint64_t delta;
+	int      level = 0;
+	int      slot;
+
+	nih_assert (timer != NULL);
+	nih_assert (timer->level < 0);
+
+	due = (timer->due > timer_wheel_tick) ? timer->due : timer_wheel_tick;
+	delta = due - timer_wheel_tick;
+
+	while ((level < TIMER_WHEEL_LEVELS - 1)
+	       && (delta >= TIMER_WHEEL_UNIT (level + 1)))
+		level++;
+
+	slot = (due >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+	nih_list_add (TIMER_WHEEL_SLOT (level, slot), &timer->entry);
+	timer_wheel_occupied[level] |= ((uint64_t)1 << slot);
+
+	timer->level = level;
+	timer->slot = slot;
+
+	timer_wheel_pending++;
+}
+
+/**
+ * timer_wheel_unlink:
+ * @timer: timer to remove.
+ *
+ * Removes @timer from the wheel, or from whatever list it's in while
+ * being run.
+ **/
+static void
+timer_wheel_unlink (WheelTimer *timer)
+{
+	nih_assert (timer != NULL);
+
+	if (NIH_LIST_EMPTY (&timer->entry))
+		return;
+
+	nih_list_remove (&timer->entry);
+
+	if (timer->level < 0)
+		return;
+
+	if (NIH_LIST_EMPTY (TIMER_WHEEL_SLOT (timer->level, timer->slot)))
+		timer_wheel_occupied[timer->level] &= ~((uint64_t)1 << timer->slot);
+
+	timer->level = -1;
+	timer->slot = -1;
+
+	nih_assert (timer_wheel_pending > 0);
+	timer_wheel_pending--;
+}
+
+/**
+ * timer_wheel_cascade:
+ * @level: wheel level,
+ * @slot: slot within @level.
+ *
+ * Called when the wheel reaches the start of @slot in @level to place
+ * its timers in the lower levels.
+ **/
+static void
+timer_wheel_cascade (int level,
+		     int slot)
+{
+	NihList moving;
+
+	nih_assert (level > 0);
+
+	nih_list_init (&moving);
+
+	NIH_LIST_FOREACH_SAFE (TIMER_WHEEL_SLOT (level, slot), iter) {
+		WheelTimer *timer = (WheelTimer *)iter;
+
+		timer_wheel_unlink (timer);
+		nih_list_add (&moving, &timer->entry);
+	}
+
+	while (! NIH_LIST_EMPTY (&moving)) {
+		WheelTimer *timer = (WheelTimer *)moving.next;
+
+		nih_list_remove (&timer->entry);
+		timer_wheel_insert (timer);
+	}
+}
+
+/**
+ * timer_wheel_next_tick:
+ * @from: earliest time to consider.
+ *
+ * Finds the earliest time from @from at which timer_wheel_poll() has
+ * anything to do, which is either a slot of timers at the bottom level
+ * becoming due or the start of a slot of a higher level that needs to be
+ * cascaded.
+ *
+ * Returns: time found, or UINT64_MAX if the wheel is empty.
+ **/
+static uint64_t
+timer_wheel_next_tick (uint64_t from)
+{
+	uint64_t next = UINT64_MAX;
+
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		uint64_t unit = TIMER_WHEEL_UNIT (level);
+		uint64_t start;
+		uint64_t bits;
+		int      index;
+
+		if (! timer_wheel_occupied[level])
+			continue;
+
+		/* Earliest slot boundary of this level at or after @from,
+		 * then rotate the bitmap so that its slot is bit zero.
+		 */
+		start = ((from + unit - 1) / unit) * unit;
+		index = (start >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+		bits = timer_wheel_occupied[level];
+		if (index)
+			bits = (bits >> index) | (bits << (TIMER_WHEEL_SLOTS - index));
+
+		start += (uint64_t)__builtin_ctzll (bits) * unit;
+		if (start < next)
+			next = start;
+	}
+
+	return next;
+}
+
+/**
+ * timer_wheel_next_due:
+ *
+ * Returns: time on CLOCK_MONOTONIC in milliseconds that the wheel next
+ * needs to be polled, or UINT64_MAX if no timers are pending.
+ **/
+uint64_t
+timer_wheel_next_due (void)
+{
+	if (! timer_wheel_pending)
+		return UINT64_MAX;
+
+	return timer_wheel_next_tick (timer_wheel_tick);
+}
+
+/**
+ * timer_wheel_poll:
+ *
+ * Runs the callbacks of all timers that are due, moving the wheel on to
+ * the current time.
+ **/
+void
+timer_wheel_poll (void)
+{
+	uint64_t now;
+
+	if (! timer_wheel)
+		return;
+
+	now = timer_wheel_now ();
+
+	while (timer_wheel_pending && (timer_wheel_tick <= now)) {
+		uint64_t tick = timer_wheel_tick;
+		NihList  expired;
+
+		for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+			if (tick & (TIMER_WHEEL_UNIT (level) - 1))
+				continue;
+
+			timer_wheel_cascade (
+				level,
+				(tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+		}
+
+		nih_list_init (&expired);
+
+		NIH_LIST_FOREACH_SAFE (TIMER_WHEEL_SLOT (0, tick & TIMER_WHEEL_MASK), iter) {
+			WheelTimer *timer = (WheelTimer *)iter;
+
+			timer_wheel_unlink (timer);
+			nih_list_add (&expired, &timer->entry);
+		}
+
+		/* Timers added by the callbacks are due no earlier than
+		 * the next tick, since this one has been emptied.
+		 */
+		timer_wheel_tick = tick + 1;
+
+		while (! NIH_LIST_EMPTY (&expired)) {
+			WheelTimer *timer = (WheelTimer *)expired.next;
+
+			nih_list_remove (&timer->entry);
+
+			timer->callback (timer->data, timer);
+			nih_free (timer);
+		}
+
+		tick = timer_wheel_next_tick (timer_wheel_tick);
+		if (tick > now)
+			tick = now + 1;
+
+		if (tick > timer_wheel_tick)
+			timer_wheel_tick = tick;
+	}
+
+	if (timer_wheel_tick <= now)
+		timer_wheel_tick = now + 1;
+
+	timer_wheel_arm ();
+}
+
+/**
+ * timer_wheel_arm:
+ *
+ * Arranges for timer_wheel_poll() to be called from the main loop when
+ * the next timer is due, or stops it being called if none are pending.
+ **/
+static void
+timer_wheel_arm (void)
+{
+	struct itimerspec spec;
+	uint64_t          due;
+
+	due = timer_wheel_next_due ();
+
+	if (timer_wheel_fd < 0) {
+		if (timer_wheel_pending && (! timer_wheel_fallback)) {
+			timer_wheel_fallback = NIH_MUST (nih_timer_add_periodic (
+					NULL, 1, timer_wheel_fallback_poll, NULL));
+		} else if ((! timer_wheel_pending) && timer_wheel_fallback) {
+			nih_free (timer_wheel_fallback);
+			timer_wheel_fallback = NULL;
+		}
+
+		return;
+	}
+
+	if (timer_wheel_pending && (! timer_wheel_watch)) {
+		timer_wheel_watch = NIH_MUST (nih_io_add_watch (
+				NULL, timer_wheel_fd, NIH_IO_READ,
+				timer_wheel_watcher, NULL));
+	} else if ((! timer_wheel_pending) && timer_wheel_watch) {
+		nih_free (timer_wheel_watch);
+		timer_wheel_watch = NULL;
+	}
+
+	if (due == UINT64_MAX)
+		due = 0;
+
+	if (due == timer_wheel_armed)
+		return;
+
+	/* A zero time disarms the timerfd, so never ask for that */
+	memset (&spec, 0, sizeof (spec));
+	if (due) {
+		spec.it_value.tv_sec = due / 1000;
+		spec.it_value.tv_nsec = (due % 1000) * 1000000;
+
+		if ((! spec.it_value.tv_sec) && (! spec.it_value.tv_nsec))
+			spec.it_value.tv_nsec = 1;
+	}
+
+	if (timerfd_settime (timer_wheel_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+		nih_warn ("%s: %s", _("Unable to set timer"), strerror (errno));
+		return;
+	}
+
+	timer_wheel_armed = due;
+}
+
+/**
+ * timer_wheel_watcher:
+ * @data: not used,
+ * @watch: NihIoWatch for which an event occurred,
+ * @events: events that occurred.
+ *
+ * Called when the timerfd expires to poll the wheel.
+ **/
+static void
+timer_wheel_watcher (void        *data,
+		     NihIoWatch  *watch,
+		     NihIoEvents  events)
+{
+	uint64_t expirations;
+
+	nih_assert (watch != NULL);
+
+	while (read (timer_wheel_fd, &expirations, sizeof (expirations)) < 0) {
+		if (errno != EINTR)
+			break;
+	}
+
+	/* The timerfd is now disarmed */
+	timer_wheel_armed = 0;
+
+	timer_wheel_poll ();
+}
+
+/**
+ * timer_wheel_fallback_poll:
+ * @data: not used,
+ * @timer: timer that caused us to be called.
+ *
+ * Polls the wheel when no timerfd could be created.
+ **/
+static void
+timer_wheel_fallback_poll (void     *data,
+			   NihTimer *timer)
+{
+	timer_wheel_poll ();
+}
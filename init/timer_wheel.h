@@ -0,0 +1,106 @@
+/* upstart
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INIT_TIMER_WHEEL_H
+#define INIT_TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#include <nih/macros.h>
+#include <nih/list.h>
+
+
+/**
+ * TIMER_WHEEL_BITS:
+ *
+ * Number of bits of the due time indexing each level of the wheel.
+ **/
+#define TIMER_WHEEL_BITS 6
+
+/**
+ * TIMER_WHEEL_SLOTS:
+ *
+ * Number of slots in each level of the wheel.
+ **/
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+/**
+ * TIMER_WHEEL_LEVELS:
+ *
+ * Number of levels in the wheel; timers further away than the levels
+ * cover, about 795 days at millisecond resolution, are held in the top
+ * level and cascaded around it until they come into range.
+ **/
+#define TIMER_WHEEL_LEVELS 6
+
+
+typedef struct wheel_timer WheelTimer;
+
+/**
+ * WheelTimerCb:
+ * @data: data pointer given when registered,
+ * @timer: timer that triggered.
+ *
+ * A timer callback is called when @timer becomes due; @timer is freed
+ * once the callback returns, so it must not be freed by the callback.
+ **/
+typedef void (*WheelTimerCb) (void *data, WheelTimer *timer);
+
+/**
+ * WheelTimer:
+ * @entry: list header,
+ * @timeout: milliseconds after being added that the timer was due,
+ * @due: time on CLOCK_MONOTONIC in milliseconds that the timer is due,
+ * @callback: function called when due,
+ * @data: pointer passed to @callback,
+ * @level: wheel level the timer is in, or -1 if not in the wheel,
+ * @slot: slot within @level that the timer is in.
+ *
+ * A timer registered with timer_wheel_add(); freeing the timer cancels
+ * it, which like adding it takes constant time.
+ **/
+struct wheel_timer {
+	NihList       entry;
+
+	uint64_t      timeout;
+	uint64_t      due;
+
+	WheelTimerCb  callback;
+	void         *data;
+
+	int           level;
+	int           slot;
+};
+
+
+NIH_BEGIN_EXTERN
+
+void        timer_wheel_init   (void);
+
+uint64_t    timer_wheel_now    (void);
+
+WheelTimer *timer_wheel_add    (const void *parent, uint64_t timeout,
+				WheelTimerCb callback, void *data)
+	__attribute__ ((warn_unused_result, malloc));
+void        timer_wheel_adjust (WheelTimer *timer, uint64_t due);
+
+uint64_t    timer_wheel_next_due (void)
+	__attribute__ ((warn_unused_result));
+void        timer_wheel_poll   (void);
+
+NIH_END_EXTERN
+
+#endif /* INIT_TIMER_WHEEL_H */
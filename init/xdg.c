@@ -342,3 +342,27 @@ get_user_log_dir (void)
 	}
 	return NULL;
 }
+
+/**
+ * get_user_cache_file:
+ * @name: name of file.
+ *
+ * Constructs an XDG compliant path to the file @name within the same
+ * cache directory in the user's home directory as get_user_log_dir(),
+ * creating that directory.
+ *
+ * Returns: newly-allocated path, or NULL on error.
+ **/
+char *
+get_user_cache_file (const char *name)
+{
+	nih_local char *dir = NULL;
+
+	nih_assert (name != NULL);
+
+	dir = get_user_log_dir ();
+	if (! dir)
+		return NULL;
+
+	return nih_sprintf (NULL, "%s/%s", dir, name);
+}
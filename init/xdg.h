@@ -57,6 +57,9 @@ char **   get_user_upstart_dirs  (void)
 char *    get_user_log_dir       (void)
 	__attribute__ ((warn_unused_result));
 
+char *    get_user_cache_file    (const char *name)
+	__attribute__ ((warn_unused_result));
+
 char *    get_session_dir        (void)
 	__attribute__ ((warn_unused_result));
 
@@ -19,6 +19,9 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <sys/stat.h>
+
+#include <poll.h>
 #include <unistd.h>
 #include <fnmatch.h>
 
@@ -159,6 +162,205 @@ test_libupstart (void)
         assert0 (rmdir (xdg_runtime_dir));
 }
 
+/**
+ * ClientReply:
+ * @called: TRUE once the handler has been called,
+ * @error: copy of the error passed to the handler.
+ *
+ * Records the reply to an operation queued on an UpstartClient.
+ **/
+typedef struct client_reply {
+	int   called;
+	char *error;
+} ClientReply;
+
+static void
+client_reply_handler (void          *data,
+		      UpstartClient *client,
+		      const char    *error)
+{
+	ClientReply *reply = data;
+
+	reply->called = TRUE;
+	reply->error = error ? NIH_MUST (nih_strdup (NULL, error)) : NULL;
+}
+
+/**
+ * client_wait:
+ * @client: client,
+ * @job: job to wait for, or NULL,
+ * @state: state to wait for @job to reach.
+ *
+ * Process the replies and signals received by @client until it has no
+ * operations outstanding and, if @job is not NULL, the cached state of
+ * @job is @state; for at most five seconds.
+ *
+ * Returns: TRUE on success, FALSE on timeout.
+ **/
+static int
+client_wait (UpstartClient *client,
+	     const char    *job,
+	     const char    *state)
+{
+	struct pollfd fds;
+
+	fds.fd = upstart_client_get_fd (client);
+	fds.events = POLLIN;
+	assert (fds.fd >= 0);
+
+	for (int i = 0; i < 50; i++) {
+		const UpstartClientJob *cached;
+
+		assert0 (upstart_client_process (client));
+
+		cached = job ? upstart_client_lookup (client, job, "") : NULL;
+		if ((! upstart_client_pending (client))
+		    && ((! job) || (cached && (! strcmp (cached->state, state)))))
+			return TRUE;
+
+		poll (&fds, 1, 100);
+	}
+
+	return FALSE;
+}
+
+void
+test_client (void)
+{
+	UpstartClient           *client;
+	const UpstartClientJob  *cached;
+	ClientReply              subscribe, states, start, stop, emit, bad;
+	char                     xdg_runtime_dir[PATH_MAX];
+	char                     confdir[PATH_MAX];
+	nih_local char          *orig_xdg_runtime_dir = NULL;
+	nih_local char          *session_file = NULL;
+	nih_local char          *path = NULL;
+	pid_t                    upstart_pid;
+	int                      ret;
+
+	TEST_GROUP ("upstart_client");
+
+	TEST_FILENAME (xdg_runtime_dir);
+	TEST_EQ (mkdir (xdg_runtime_dir, 0755), 0);
+
+	TEST_FILENAME (confdir);
+	TEST_EQ (mkdir (confdir, 0755), 0);
+
+	CREATE_FILE (confdir, "sleeper.conf", "exec sleep 999");
+
+	orig_xdg_runtime_dir = getenv ("XDG_RUNTIME_DIR");
+	if (orig_xdg_runtime_dir)
+		orig_xdg_runtime_dir = NIH_MUST (nih_strdup (NULL, orig_xdg_runtime_dir));
+
+	assert0 (setenv ("XDG_RUNTIME_DIR", xdg_runtime_dir, 1));
+
+	start_upstart_common (&upstart_pid, TRUE, FALSE, confdir, NULL, NULL);
+	TEST_TRUE (set_upstart_session (upstart_pid));
+
+	client = upstart_client_new (NULL, NULL);
+	TEST_NE_P (client, NULL);
+
+	memset (&subscribe, 0, sizeof (subscribe));
+	memset (&states, 0, sizeof (states));
+	memset (&start, 0, sizeof (start));
+	memset (&stop, 0, sizeof (stop));
+	memset (&emit, 0, sizeof (emit));
+	memset (&bad, 0, sizeof (bad));
+
+
+	/* Check that operations are only queued until flushed, and are
+	 * then all sent together, with the cache filled by the reply to
+	 * the state request and kept up to date by the subscription.
+	 */
+	TEST_FEATURE ("with batch of operations");
+	assert0 (upstart_client_subscribe (client, "*", 10,
+					   client_reply_handler, &subscribe));
+	assert0 (upstart_client_get_state (client, NULL,
+					   client_reply_handler, &states));
+	assert0 (upstart_client_start (client, "sleeper", NULL, TRUE,
+				       client_reply_handler, &start));
+	assert0 (upstart_client_emit (client, "wibble", NULL, FALSE,
+				      client_reply_handler, &emit));
+
+	TEST_EQ (upstart_client_pending (client), 4);
+	TEST_FALSE (states.called);
+
+	ret = upstart_client_flush (client);
+	TEST_EQ (ret, 4);
+
+	TEST_TRUE (client_wait (client, "sleeper", "running"));
+
+	TEST_TRUE (subscribe.called);
+	TEST_EQ_P (subscribe.error, NULL);
+	TEST_TRUE (states.called);
+	TEST_EQ_P (states.error, NULL);
+	TEST_TRUE (start.called);
+	TEST_EQ_P (start.error, NULL);
+	TEST_TRUE (emit.called);
+	TEST_EQ_P (emit.error, NULL);
+
+	cached = upstart_client_lookup (client, "sleeper", "");
+	TEST_NE_P (cached, NULL);
+	TEST_EQ_STR (cached->goal, "start");
+	TEST_EQ_STR (cached->state, "running");
+
+
+	/* Check that a change is seen in the cache through the
+	 * subscription alone.
+	 */
+	TEST_FEATURE ("with change to subscribed job");
+	assert0 (upstart_client_stop (client, "sleeper", NULL, TRUE,
+				      client_reply_handler, &stop));
+	TEST_EQ (upstart_client_flush (client), 1);
+
+	TEST_TRUE (client_wait (client, "sleeper", "waiting"));
+	TEST_TRUE (stop.called);
+	TEST_EQ_P (stop.error, NULL);
+
+	cached = upstart_client_lookup (client, "sleeper", "");
+	TEST_NE_P (cached, NULL);
+	TEST_EQ_STR (cached->goal, "stop");
+
+
+	/* Check that the error returned for an operation is passed to its
+	 * handler.
+	 */
+	TEST_FEATURE ("with unknown job");
+	assert0 (upstart_client_start (client, "no-such-job", NULL, TRUE,
+				       client_reply_handler, &bad));
+	TEST_EQ (upstart_client_flush (client), 1);
+
+	TEST_TRUE (client_wait (client, NULL, NULL));
+	TEST_TRUE (bad.called);
+	TEST_NE_P (bad.error, NULL);
+
+	TEST_EQ_P (upstart_client_lookup (client, "no-such-job", ""), NULL);
+
+	nih_free (client);
+	nih_free (bad.error);
+
+	STOP_UPSTART (upstart_pid);
+
+	if (orig_xdg_runtime_dir) {
+		setenv ("XDG_RUNTIME_DIR", orig_xdg_runtime_dir, 1);
+	} else {
+		assert0 (unsetenv ("XDG_RUNTIME_DIR"));
+	}
+	assert0 (unsetenv ("UPSTART_SESSION"));
+
+	session_file = get_session_file (xdg_runtime_dir, upstart_pid);
+	unlink (session_file);
+
+	path = NIH_MUST (nih_sprintf (NULL, "%s/upstart/sessions", xdg_runtime_dir));
+	assert0 (rmdir (path));
+	path = NIH_MUST (nih_sprintf (NULL, "%s/upstart", xdg_runtime_dir));
+	assert0 (rmdir (path));
+	assert0 (rmdir (xdg_runtime_dir));
+
+	DELETE_FILE (confdir, "sleeper.conf");
+	assert0 (rmdir (confdir));
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -170,6 +372,7 @@ main (int   argc,
 			"\n\n", __FILE__);
 	} else {
 		test_libupstart ();
+		test_client ();
 	}
 
 	return 0;
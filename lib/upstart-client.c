@@ -0,0 +1,1021 @@
+/* upstart
+ *
+ * upstart-client.c - asynchronous, batched requests of the init daemon
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <dbus/dbus.h>
+
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include <nih-dbus/dbus_error.h>
+#include <nih-dbus/dbus_util.h>
+
+#include "dbus/upstart.h"
+
+#include "upstart-client.h"
+
+
+/**
+ * UpstartClientOpType:
+ *
+ * What is done with the reply to an operation, besides calling its
+ * handler.
+ **/
+typedef enum upstart_client_op_type {
+	UPSTART_CLIENT_OP_CALL,
+	UPSTART_CLIENT_OP_STATES,
+} UpstartClientOpType;
+
+/**
+ * UpstartClientOp:
+ * @entry: list header,
+ * @client: client the operation was queued on,
+ * @type: what is done with the reply,
+ * @pattern: job pattern of a state request,
+ * @message: method call, until sent,
+ * @pending: pending reply, once sent,
+ * @handler: function called with the reply,
+ * @data: data pointer to pass to @handler.
+ *
+ * An operation queued by one of the upstart_client_*() request functions,
+ * in the queue of the client until upstart_client_flush() sends it and
+ * then in its pending list until the reply is received.
+ **/
+typedef struct upstart_client_op {
+	NihList               entry;
+	UpstartClient        *client;
+	UpstartClientOpType   type;
+	char                 *pattern;
+	DBusMessage          *message;
+	DBusPendingCall      *pending;
+	UpstartClientHandler  handler;
+	void                 *data;
+} UpstartClientOp;
+
+/**
+ * UpstartClient:
+ * @conn: private connection to the init daemon,
+ * @queue: operations not yet sent,
+ * @pending: operations sent and awaiting replies,
+ * @jobs: cache of job instances,
+ * @generation: number of state requests replied to,
+ * @disconnected: TRUE once @conn has been disconnected.
+ **/
+struct upstart_client {
+	DBusConnection *conn;
+	NihList         queue;
+	NihList         pending;
+	NihHash        *jobs;
+	uint64_t        generation;
+	int             disconnected;
+};
+
+
+/* Prototypes for static functions */
+static int               upstart_client_destroy    (UpstartClient *client);
+static UpstartClientOp * upstart_client_op_new     (UpstartClient *client,
+						    UpstartClientOpType type,
+						    const char *path,
+						    const char *interface,
+						    const char *method,
+						    UpstartClientHandler handler,
+						    void *data)
+	__attribute__ ((warn_unused_result));
+static int               upstart_client_op_destroy (UpstartClientOp *op);
+static int               upstart_client_job_call   (UpstartClient *client,
+						    const char *job,
+						    const char *method,
+						    char * const *env, int wait,
+						    UpstartClientHandler handler,
+						    void *data)
+	__attribute__ ((warn_unused_result));
+static void              upstart_client_reply      (DBusPendingCall *pending,
+						    void *data);
+static DBusHandlerResult upstart_client_filter     (DBusConnection *conn,
+						    DBusMessage *message,
+						    void *data);
+static int               upstart_client_read_jobs  (UpstartClient *client,
+						    DBusMessageIter *iter,
+						    int states)
+	__attribute__ ((warn_unused_result));
+static void              upstart_client_cache      (UpstartClient *client,
+						    const char *job,
+						    const char *instance,
+						    const char *goal,
+						    const char *state);
+
+
+/**
+ * upstart_client_new:
+ * @parent: parent object for new client,
+ * @address: D-Bus address of the init daemon, or NULL.
+ *
+ * Open a private connection to the init daemon at @address; if NULL, the
+ * Session Init named by UPSTART_SESSION in the environment, or otherwise
+ * the init daemon of the system.
+ *
+ * Requests are queued on the returned client by the upstart_client_*()
+ * request functions and sent together by upstart_client_flush(); their
+ * replies and the StateBatch signals are read whenever
+ * upstart_client_process() is called, which should be whenever the file
+ * descriptor returned by upstart_client_get_fd() is readable, so that
+ * the client can be driven from any main loop.  No D-Bus main loop
+ * integration is required.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned client.  When all parents
+ * of the returned client are freed, the returned client will also be
+ * freed, and the connection closed without calling the handlers of any
+ * operations still outstanding.
+ *
+ * Returns: newly allocated UpstartClient or NULL on raised error.
+ **/
+UpstartClient *
+upstart_client_new (const void *parent,
+		    const char *address)
+{
+	UpstartClient *client;
+	DBusError      dbus_error;
+
+	if (! address)
+		address = getenv ("UPSTART_SESSION");
+	if (! address)
+		address = DBUS_ADDRESS_UPSTART;
+
+	client = nih_new (parent, UpstartClient);
+	if (! client)
+		nih_return_no_memory_error (NULL);
+
+	nih_list_init (&client->queue);
+	nih_list_init (&client->pending);
+	client->generation = 0;
+	client->disconnected = FALSE;
+	client->conn = NULL;
+
+	client->jobs = nih_hash_string_new (client, 0);
+	if (! client->jobs) {
+		nih_free (client);
+		nih_return_no_memory_error (NULL);
+	}
+
+	dbus_error_init (&dbus_error);
+
+	client->conn = dbus_connection_open_private (address, &dbus_error);
+	if (! client->conn) {
+		nih_dbus_error_raise (dbus_error.name, dbus_error.message);
+		dbus_error_free (&dbus_error);
+		nih_free (client);
+		return NULL;
+	}
+
+	dbus_connection_set_exit_on_disconnect (client->conn, FALSE);
+
+	if (! dbus_connection_add_filter (client->conn, upstart_client_filter,
+					  client, NULL)) {
+		dbus_connection_close (client->conn);
+		dbus_connection_unref (client->conn);
+		nih_free (client);
+		nih_return_no_memory_error (NULL);
+	}
+
+	nih_alloc_set_destructor (client, upstart_client_destroy);
+
+	return client;
+}
+
+/**
+ * upstart_client_destroy:
+ * @client: client being destroyed.
+ *
+ * Discard the operations still outstanding on @client, without calling
+ * their handlers, and close its connection.
+ *
+ * Returns: zero.
+ **/
+static int
+upstart_client_destroy (UpstartClient *client)
+{
+	nih_assert (client != NULL);
+
+	NIH_LIST_FOREACH_SAFE (&client->queue, iter)
+		nih_free (iter);
+	NIH_LIST_FOREACH_SAFE (&client->pending, iter)
+		nih_free (iter);
+
+	dbus_connection_remove_filter (client->conn, upstart_client_filter,
+				       client);
+	dbus_connection_close (client->conn);
+	dbus_connection_unref (client->conn);
+
+	return 0;
+}
+
+
+/**
+ * upstart_client_get_fd:
+ * @client: client.
+ *
+ * Returns: file descriptor of the connection of @client, which should be
+ * watched for input with poll() or epoll and upstart_client_process()
+ * called whenever it is readable, or negative value on raised error.
+ **/
+int
+upstart_client_get_fd (UpstartClient *client)
+{
+	int fd;
+
+	nih_assert (client != NULL);
+
+	if (! dbus_connection_get_unix_fd (client->conn, &fd)) {
+		nih_dbus_error_raise (DBUS_ERROR_DISCONNECTED,
+				      "Connection has no file descriptor");
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * upstart_client_process:
+ * @client: client.
+ *
+ * Read whatever has arrived on the connection of @client without
+ * blocking, calling the handlers of the operations replied to and
+ * updating the cache from any StateBatch signals.
+ *
+ * Returns: zero on success, negative value on raised error once the
+ * connection has been lost.
+ **/
+int
+upstart_client_process (UpstartClient *client)
+{
+	nih_assert (client != NULL);
+
+	if (! client->disconnected)
+		dbus_connection_read_write (client->conn, 0);
+
+	while (dbus_connection_dispatch (client->conn)
+	       == DBUS_DISPATCH_DATA_REMAINS)
+		;
+
+	if (client->disconnected) {
+		nih_dbus_error_raise (DBUS_ERROR_DISCONNECTED,
+				      "Disconnected from the init daemon");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * upstart_client_op_new:
+ * @client: client to queue operation on,
+ * @type: what is done with the reply,
+ * @path: object path to call,
+ * @interface: interface of method,
+ * @method: name of method,
+ * @handler: function to call with the reply, or NULL,
+ * @data: data pointer to pass to @handler.
+ *
+ * Queue a call of @method on @client, to which the caller appends the
+ * arguments.
+ *
+ * Returns: newly allocated UpstartClientOp or NULL on raised error.
+ **/
+static UpstartClientOp *
+upstart_client_op_new (UpstartClient        *client,
+		       UpstartClientOpType   type,
+		       const char           *path,
+		       const char           *interface,
+		       const char           *method,
+		       UpstartClientHandler  handler,
+		       void                 *data)
+{
+	UpstartClientOp *op;
+
+	nih_assert (client != NULL);
+	nih_assert (path != NULL);
+	nih_assert (interface != NULL);
+	nih_assert (method != NULL);
+
+	op = nih_new (client, UpstartClientOp);
+	if (! op)
+		nih_return_no_memory_error (NULL);
+
+	nih_list_init (&op->entry);
+
+	op->client = client;
+	op->type = type;
+	op->pattern = NULL;
+	op->pending = NULL;
+	op->handler = handler;
+	op->data = data;
+
+	op->message = dbus_message_new_method_call (NULL, path, interface,
+						    method);
+	if (! op->message) {
+		nih_free (op);
+		nih_return_no_memory_error (NULL);
+	}
+
+	nih_alloc_set_destructor (op, upstart_client_op_destroy);
+
+	nih_list_add (&client->queue, &op->entry);
+
+	return op;
+}
+
+/**
+ * upstart_client_op_destroy:
+ * @op: operation being destroyed.
+ *
+ * Remove @op from its list, discarding the reply should it still be
+ * awaited.
+ *
+ * Returns: zero.
+ **/
+static int
+upstart_client_op_destroy (UpstartClientOp *op)
+{
+	nih_assert (op != NULL);
+
+	nih_list_destroy (&op->entry);
+
+	if (op->message)
+		dbus_message_unref (op->message);
+
+	if (op->pending) {
+		dbus_pending_call_cancel (op->pending);
+		dbus_pending_call_unref (op->pending);
+	}
+
+	return 0;
+}
+
+/**
+ * upstart_client_job_call:
+ * @client: client to queue operation on,
+ * @job: name of job,
+ * @method: method of job to call,
+ * @env: NULL-terminated environment, or NULL,
+ * @wait: whether the reply should wait for the goal to be reached,
+ * @handler: function to call with the reply, or NULL,
+ * @data: data pointer to pass to @handler.
+ *
+ * Queue a call of @method on @job, taking the environment and wait
+ * arguments as the Start, Stop and Restart methods do.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+upstart_client_job_call (UpstartClient        *client,
+			 const char           *job,
+			 const char           *method,
+			 char * const         *env,
+			 int                   wait,
+			 UpstartClientHandler  handler,
+			 void                 *data)
+{
+	nih_local char  *path = NULL;
+	UpstartClientOp *op;
+	char            *empty[] = { NULL };
+	dbus_bool_t      dbus_wait = wait ? TRUE : FALSE;
+	int              env_len = 0;
+
+	nih_assert (client != NULL);
+	nih_assert (job != NULL);
+	nih_assert (method != NULL);
+
+	if (! env)
+		env = empty;
+	while (env[env_len])
+		env_len++;
+
+	path = nih_dbus_path (NULL, DBUS_PATH_UPSTART, "jobs", job, NULL);
+	if (! path)
+		nih_return_no_memory_error (-1);
+
+	op = upstart_client_op_new (client, UPSTART_CLIENT_OP_CALL, path,
+				    DBUS_INTERFACE_UPSTART_JOB, method,
+				    handler, data);
+	if (! op)
+		return -1;
+
+	if (! dbus_message_append_args (op->message,
+					DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+					&env, env_len,
+					DBUS_TYPE_BOOLEAN, &dbus_wait,
+					DBUS_TYPE_INVALID)) {
+		nih_free (op);
+		nih_return_no_memory_error (-1);
+	}
+
+	return 0;
+}
+
+/**
+ * upstart_client_start:
+ * @client: client to queue operation on,
+ * @job: name of job,
+ * @env: NULL-terminated environment, or NULL,
+ * @wait: whether the reply should wait for the instance to start,
+ * @handler: function to call with the reply, or NULL,
+ * @data: data pointer to pass to @handler.
+ *
+ * Queue the start of an instance of @job, sent by the next call of
+ * upstart_client_flush().
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+upstart_client_start (UpstartClient        *client,
+		      const char           *job,
+		      char * const         *env,
+		      int                   wait,
+		      UpstartClientHandler  handler,
+		      void                 *data)
+{
+	return upstart_client_job_call (client, job, "Start", env, wait,
+					handler, data);
+}
+
+/**
+ * upstart_client_stop:
+ * @client: client to queue operation on,
+ * @job: name of job,
+ * @env: NULL-terminated environment, or NULL,
+ * @wait: whether the reply should wait for the instance to stop,
+ * @handler: function to call with the reply, or NULL,
+ * @data: data pointer to pass to @handler.
+ *
+ * Queue the stop of the instance of @job selected by @env, sent by the
+ * next call of upstart_client_flush().
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+upstart_client_stop (UpstartClient        *client,
+		     const char           *job,
+		     char * const         *env,
+		     int                   wait,
+		     UpstartClientHandler  handler,
+		     void                 *data)
+{
+	return upstart_client_job_call (client, job, "Stop", env, wait,
+					handler, data);
+}
+
+/**
+ * upstart_client_restart:
+ * @client: client to queue operation on,
+ * @job: name of job,
+ * @env: NULL-terminated environment, or NULL,
+ * @wait: whether the reply should wait for the instance to restart,
+ * @handler: function to call with the reply, or NULL,
+ * @data: data pointer to pass to @handler.
+ *
+ * Queue the restart of the instance of @job selected by @env, sent by
+ * the next call of upstart_client_flush().
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+upstart_client_restart (UpstartClient        *client,
+			const char           *job,
+			char * const         *env,
+			int                   wait,
+			UpstartClientHandler  handler,
+			void                 *data)
+{
+	return upstart_client_job_call (client, job, "Restart", env, wait,
+					handler, data);
+}
+
+/**
+ * upstart_client_emit:
+ * @client: client to queue operation on,
+ * @name: name of event,
+ * @env: NULL-terminated environment of event, or NULL,
+ * @wait: whether the reply should wait for the event to finish,
+ * @handler: function to call with the reply, or NULL,
+ * @data: data pointer to pass to @handler.
+ *
+ * Queue the emission of the event @name, sent by the next call of
+ * upstart_client_flush().
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+upstart_client_emit (UpstartClient        *client,
+		     const char           *name,
+		     char * const         *env,
+		     int                   wait,
+		     UpstartClientHandler  handler,
+		     void                 *data)
+{
+	UpstartClientOp *op;
+	char            *empty[] = { NULL };
+	dbus_bool_t      dbus_wait = wait ? TRUE : FALSE;
+	int              env_len = 0;
+
+	nih_assert (client != NULL);
+	nih_assert (name != NULL);
+
+	if (! env)
+		env = empty;
+	while (env[env_len])
+		env_len++;
+
+	op = upstart_client_op_new (client, UPSTART_CLIENT_OP_CALL,
+				    DBUS_PATH_UPSTART, DBUS_INTERFACE_UPSTART,
+				    "EmitEvent", handler, data);
+	if (! op)
+		return -1;
+
+	if (! dbus_message_append_args (op->message,
+					DBUS_TYPE_STRING, &name,
+					DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+					&env, env_len,
+					DBUS_TYPE_BOOLEAN, &dbus_wait,
+					DBUS_TYPE_INVALID)) {
+		nih_free (op);
+		nih_return_no_memory_error (-1);
+	}
+
+	return 0;
+}
+
+/**
+ * upstart_client_get_state:
+ * @client: client to queue operation on,
+ * @pattern: glob pattern of job names, or NULL for all jobs,
+ * @handler: function to call with the reply, or NULL,
+ * @data: data pointer to pass to @handler.
+ *
+ * Queue a request for the goal and state of every instance of the jobs
+ * matching @pattern, sent by the next call of upstart_client_flush().
+ * The reply replaces the cache of those jobs, so that
+ * upstart_client_lookup() may be used once @handler is called.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+upstart_client_get_state (UpstartClient        *client,
+			  const char           *pattern,
+			  UpstartClientHandler  handler,
+			  void                 *data)
+{
+	UpstartClientOp *op;
+
+	nih_assert (client != NULL);
+
+	if (! pattern)
+		pattern = "";
+
+	op = upstart_client_op_new (client, UPSTART_CLIENT_OP_STATES,
+				    DBUS_PATH_UPSTART, DBUS_INTERFACE_UPSTART,
+				    "GetAllJobStates", handler, data);
+	if (! op)
+		return -1;
+
+	op->pattern = nih_strdup (op, pattern);
+	if ((! op->pattern)
+	    || (! dbus_message_append_args (op->message,
+					    DBUS_TYPE_STRING, &pattern,
+					    DBUS_TYPE_INVALID))) {
+		nih_free (op);
+		nih_return_no_memory_error (-1);
+	}
+
+	return 0;
+}
+
+/**
+ * upstart_client_subscribe:
+ * @client: client to queue operation on,
+ * @pattern: glob pattern of job names,
+ * @window: milliseconds over which the init daemon batches changes,
+ * @handler: function to call with the reply, or NULL,
+ * @data: data pointer to pass to @handler.
+ *
+ * Queue a subscription to the changes of the instances of the jobs
+ * matching @pattern, sent by the next call of upstart_client_flush().
+ * The init daemon then sends them in StateBatch signals, at most one
+ * every @window milliseconds, which update the cache as they are read
+ * by upstart_client_process().
+ *
+ * To populate the cache, this is best followed by a call of
+ * upstart_client_get_state() with the same pattern; since the requests
+ * are answered in order, no change is missed between them.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+upstart_client_subscribe (UpstartClient        *client,
+			  const char           *pattern,
+			  uint32_t              window,
+			  UpstartClientHandler  handler,
+			  void                 *data)
+{
+	UpstartClientOp *op;
+	const char      *event_pattern = "";
+	dbus_uint32_t    dbus_window = window;
+
+	nih_assert (client != NULL);
+	nih_assert (pattern != NULL);
+
+	op = upstart_client_op_new (client, UPSTART_CLIENT_OP_CALL,
+				    DBUS_PATH_UPSTART, DBUS_INTERFACE_UPSTART,
+				    "Subscribe", handler, data);
+	if (! op)
+		return -1;
+
+	if (! dbus_message_append_args (op->message,
+					DBUS_TYPE_STRING, &pattern,
+					DBUS_TYPE_STRING, &event_pattern,
+					DBUS_TYPE_UINT32, &dbus_window,
+					DBUS_TYPE_INVALID)) {
+		nih_free (op);
+		nih_return_no_memory_error (-1);
+	}
+
+	return 0;
+}
+
+
+/**
+ * upstart_client_flush:
+ * @client: client.
+ *
+ * Send every operation queued on @client, in the order in which they
+ * were queued, writing them all to the connection at once.  Their
+ * handlers are called by upstart_client_process() as the replies
+ * arrive.
+ *
+ * Returns: number of operations sent, or negative value on raised error.
+ **/
+int
+upstart_client_flush (UpstartClient *client)
+{
+	int sent = 0;
+
+	nih_assert (client != NULL);
+
+	NIH_LIST_FOREACH_SAFE (&client->queue, iter) {
+		UpstartClientOp *op = (UpstartClientOp *)iter;
+
+		if (! dbus_connection_send_with_reply (client->conn,
+						       op->message,
+						       &op->pending,
+						       UPSTART_CLIENT_TIMEOUT))
+			nih_return_no_memory_error (-1);
+
+		if (! op->pending) {
+			nih_dbus_error_raise (DBUS_ERROR_DISCONNECTED,
+					      "Disconnected from the init daemon");
+			return -1;
+		}
+
+		if (! dbus_pending_call_set_notify (op->pending,
+						    upstart_client_reply,
+						    op, NULL))
+			nih_return_no_memory_error (-1);
+
+		dbus_message_unref (op->message);
+		op->message = NULL;
+
+		nih_list_add (&client->pending, &op->entry);
+		sent++;
+	}
+
+	dbus_connection_flush (client->conn);
+
+	return sent;
+}
+
+/**
+ * upstart_client_pending:
+ * @client: client.
+ *
+ * Returns: number of operations queued on @client whose replies have not
+ * yet been received, including those not yet sent.
+ **/
+size_t
+upstart_client_pending (UpstartClient *client)
+{
+	size_t len = 0;
+
+	nih_assert (client != NULL);
+
+	NIH_LIST_FOREACH (&client->queue, iter)
+		len++;
+	NIH_LIST_FOREACH (&client->pending, iter)
+		len++;
+
+	return len;
+}
+
+
+/**
+ * upstart_client_reply:
+ * @pending: pending call replied to,
+ * @data: operation.
+ *
+ * Called when the reply to an operation is received; the cache is
+ * replaced for state requests, and the handler of the operation called
+ * with any error returned before the operation is freed.
+ **/
+static void
+upstart_client_reply (DBusPendingCall *pending,
+		      void            *data)
+{
+	UpstartClientOp *op = data;
+	DBusMessage     *reply;
+	DBusError        dbus_error;
+
+	nih_assert (pending != NULL);
+	nih_assert (op != NULL);
+	nih_assert (op->pending == pending);
+
+	dbus_error_init (&dbus_error);
+
+	reply = dbus_pending_call_steal_reply (pending);
+
+	dbus_pending_call_unref (op->pending);
+	op->pending = NULL;
+
+	if (! reply) {
+		dbus_set_error_const (&dbus_error, DBUS_ERROR_NO_REPLY,
+				      "No reply received");
+	} else if (dbus_set_error_from_message (&dbus_error, reply)) {
+		;
+	} else if (op->type == UPSTART_CLIENT_OP_STATES) {
+		DBusMessageIter args;
+
+		/* The reply holds every instance of the jobs matching the
+		 * pattern, so those cached but not in the reply are gone.
+		 */
+		op->client->generation++;
+
+		dbus_message_iter_init (reply, &args);
+		if (upstart_client_read_jobs (op->client, &args, TRUE) < 0) {
+			dbus_set_error_const (&dbus_error,
+					      DBUS_ERROR_INVALID_ARGS,
+					      "Invalid job states");
+		} else {
+			NIH_HASH_FOREACH_SAFE (op->client->jobs, iter) {
+				UpstartClientJob *job = (UpstartClientJob *)iter;
+
+				if (job->generation == op->client->generation)
+					continue;
+
+				if ((! *op->pattern)
+				    || (! fnmatch (op->pattern, job->job, 0)))
+					nih_free (job);
+			}
+		}
+	}
+
+	if (op->handler)
+		op->handler (op->data, op->client,
+			     dbus_error_is_set (&dbus_error)
+			     ? dbus_error.message : NULL);
+
+	dbus_error_free (&dbus_error);
+	if (reply)
+		dbus_message_unref (reply);
+
+	nih_free (op);
+}
+
+/**
+ * upstart_client_filter:
+ * @conn: connection,
+ * @message: message received,
+ * @data: client.
+ *
+ * Update the cache of the client from StateBatch signals, and note when
+ * the connection is lost.
+ *
+ * Returns: DBUS_HANDLER_RESULT_HANDLED for those signals, otherwise
+ * DBUS_HANDLER_RESULT_NOT_YET_HANDLED.
+ **/
+static DBusHandlerResult
+upstart_client_filter (DBusConnection *conn,
+		       DBusMessage    *message,
+		       void           *data)
+{
+	UpstartClient   *client = data;
+	DBusMessageIter  iter;
+
+	nih_assert (conn != NULL);
+	nih_assert (message != NULL);
+	nih_assert (client != NULL);
+
+	if (dbus_message_is_signal (message, DBUS_INTERFACE_LOCAL,
+				    "Disconnected")) {
+		client->disconnected = TRUE;
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	if (! dbus_message_is_signal (message, DBUS_INTERFACE_UPSTART,
+				      "StateBatch"))
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	dbus_message_iter_init (message, &iter);
+	if (upstart_client_read_jobs (client, &iter, FALSE) < 0)
+		nih_warn ("Invalid StateBatch signal received");
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/**
+ * upstart_client_read_jobs:
+ * @client: client,
+ * @iter: iterator at array of job instances,
+ * @states: TRUE for the reply to GetAllJobStates, FALSE for the jobs of
+ *  a StateBatch signal.
+ *
+ * Cache each of the job instances in the array at @iter, which has
+ * elements of type (ssssasai) if @states is TRUE or otherwise (ssss);
+ * the first four members being the job, instance, goal and state in
+ * either case.
+ *
+ * Returns: zero on success, negative value if the array is invalid.
+ **/
+static int
+upstart_client_read_jobs (UpstartClient   *client,
+			  DBusMessageIter *iter,
+			  int              states)
+{
+	DBusMessageIter array;
+
+	nih_assert (client != NULL);
+	nih_assert (iter != NULL);
+
+	if ((dbus_message_iter_get_arg_type (iter) != DBUS_TYPE_ARRAY)
+	    || (dbus_message_iter_get_element_type (iter) != DBUS_TYPE_STRUCT))
+		return -1;
+
+	dbus_message_iter_recurse (iter, &array);
+
+	while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_STRUCT) {
+		DBusMessageIter  item;
+		const char      *member[4];
+
+		dbus_message_iter_recurse (&array, &item);
+
+		for (int i = 0; i < 4; i++) {
+			if (dbus_message_iter_get_arg_type (&item)
+			    != DBUS_TYPE_STRING)
+				return -1;
+
+			dbus_message_iter_get_basic (&item, &member[i]);
+			dbus_message_iter_next (&item);
+		}
+
+		if (states && (dbus_message_iter_get_arg_type (&item)
+			       != DBUS_TYPE_ARRAY))
+			return -1;
+
+		upstart_client_cache (client, member[0], member[1],
+				      member[2], member[3]);
+
+		dbus_message_iter_next (&array);
+	}
+
+	return 0;
+}
+
+/**
+ * upstart_client_cache:
+ * @client: client,
+ * @job: name of job,
+ * @instance: name of instance,
+ * @goal: goal of instance,
+ * @state: state of instance.
+ *
+ * Record the goal and state of an instance in the cache of @client.
+ * Allocation failures leave the instance out of the cache, so that it
+ * is requested of the init daemon again rather than reported wrongly.
+ **/
+static void
+upstart_client_cache (UpstartClient *client,
+		      const char    *job,
+		      const char    *instance,
+		      const char    *goal,
+		      const char    *state)
+{
+	nih_local char   *key = NULL;
+	UpstartClientJob *cached;
+
+	nih_assert (client != NULL);
+	nih_assert (job != NULL);
+	nih_assert (instance != NULL);
+	nih_assert (goal != NULL);
+	nih_assert (state != NULL);
+
+	key = nih_sprintf (NULL, "%s\t%s", job, instance);
+	if (! key)
+		return;
+
+	cached = (UpstartClientJob *)nih_hash_lookup (client->jobs, key);
+	if (! cached) {
+		cached = nih_new (client->jobs, UpstartClientJob);
+		if (! cached)
+			return;
+
+		nih_list_init (&cached->entry);
+		nih_alloc_set_destructor (cached, nih_list_destroy);
+
+		cached->key = nih_strdup (cached, key);
+		cached->job = nih_strdup (cached, job);
+		cached->instance = nih_strdup (cached, instance);
+		cached->goal = NULL;
+		cached->state = NULL;
+
+		if ((! cached->key) || (! cached->job)
+		    || (! cached->instance)) {
+			nih_free (cached);
+			return;
+		}
+
+		nih_hash_add (client->jobs, &cached->entry);
+	}
+
+	cached->generation = client->generation;
+
+	if ((! cached->goal) || strcmp (cached->goal, goal)) {
+		if (cached->goal)
+			nih_unref (cached->goal, cached);
+		cached->goal = nih_strdup (cached, goal);
+	}
+
+	if ((! cached->state) || strcmp (cached->state, state)) {
+		if (cached->state)
+			nih_unref (cached->state, cached);
+		cached->state = nih_strdup (cached, state);
+	}
+
+	if ((! cached->goal) || (! cached->state))
+		nih_free (cached);
+}
+
+/**
+ * upstart_client_lookup:
+ * @client: client,
+ * @job: name of job,
+ * @instance: name of instance, empty for a singleton job.
+ *
+ * Look up the last known goal and state of an instance in the cache of
+ * @client, without making any request of the init daemon.  The cache is
+ * only kept up to date for jobs covered by upstart_client_subscribe().
+ *
+ * Returns: cached instance, or NULL if not known.
+ **/
+const UpstartClientJob *
+upstart_client_lookup (UpstartClient *client,
+		       const char    *job,
+		       const char    *instance)
+{
+	nih_local char *key = NULL;
+
+	nih_assert (client != NULL);
+	nih_assert (job != NULL);
+	nih_assert (instance != NULL);
+
+	key = nih_sprintf (NULL, "%s\t%s", job, instance);
+	if (! key)
+		return NULL;
+
+	return (const UpstartClientJob *)nih_hash_lookup (client->jobs, key);
+}
@@ -0,0 +1,139 @@
+/* upstart
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef LIB_UPSTART_CLIENT_H
+#define LIB_UPSTART_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nih/macros.h>
+#include <nih/list.h>
+
+
+/**
+ * UPSTART_CLIENT_TIMEOUT:
+ *
+ * Milliseconds to wait for a reply to each operation once sent, or -1
+ * for the D-Bus default.
+ **/
+#define UPSTART_CLIENT_TIMEOUT -1
+
+
+/**
+ * UpstartClient:
+ *
+ * A connection to the init daemon opened by upstart_client_new().
+ **/
+typedef struct upstart_client UpstartClient;
+
+/**
+ * UpstartClientHandler:
+ * @data: data pointer given when the operation was queued,
+ * @client: client the operation was queued on,
+ * @error: message of the D-Bus error returned, or NULL on success.
+ *
+ * Function called once the reply to a queued operation is received.
+ * It must not free @client.
+ **/
+typedef void (*UpstartClientHandler) (void *data, UpstartClient *client,
+				      const char *error);
+
+/**
+ * UpstartClientJob:
+ * @entry: list header,
+ * @key: key of the instance in the cache,
+ * @job: name of the job,
+ * @instance: name of the instance, empty for a singleton job,
+ * @goal: name of the goal of the instance,
+ * @state: name of the state of the instance,
+ * @generation: state request the instance was last seen in.
+ *
+ * The last known goal and state of a job instance, cached from the
+ * replies to upstart_client_get_state() and the StateBatch signals sent
+ * after upstart_client_subscribe().
+ **/
+typedef struct upstart_client_job {
+	NihList   entry;
+	char     *key;
+	char     *job;
+	char     *instance;
+	char     *goal;
+	char     *state;
+	uint64_t  generation;
+} UpstartClientJob;
+
+
+NIH_BEGIN_EXTERN
+
+UpstartClient *         upstart_client_new       (const void *parent,
+						  const char *address)
+	__attribute__ ((warn_unused_result, malloc));
+
+int                     upstart_client_get_fd    (UpstartClient *client)
+	__attribute__ ((warn_unused_result));
+int                     upstart_client_process   (UpstartClient *client)
+	__attribute__ ((warn_unused_result));
+
+int                     upstart_client_start     (UpstartClient *client,
+						  const char *job,
+						  char * const *env, int wait,
+						  UpstartClientHandler handler,
+						  void *data)
+	__attribute__ ((warn_unused_result));
+int                     upstart_client_stop      (UpstartClient *client,
+						  const char *job,
+						  char * const *env, int wait,
+						  UpstartClientHandler handler,
+						  void *data)
+	__attribute__ ((warn_unused_result));
+int                     upstart_client_restart   (UpstartClient *client,
+						  const char *job,
+						  char * const *env, int wait,
+						  UpstartClientHandler handler,
+						  void *data)
+	__attribute__ ((warn_unused_result));
+int                     upstart_client_emit      (UpstartClient *client,
+						  const char *name,
+						  char * const *env, int wait,
+						  UpstartClientHandler handler,
+						  void *data)
+	__attribute__ ((warn_unused_result));
+int                     upstart_client_get_state (UpstartClient *client,
+						  const char *pattern,
+						  UpstartClientHandler handler,
+						  void *data)
+	__attribute__ ((warn_unused_result));
+int                     upstart_client_subscribe (UpstartClient *client,
+						  const char *pattern,
+						  uint32_t window,
+						  UpstartClientHandler handler,
+						  void *data)
+	__attribute__ ((warn_unused_result));
+
+int                     upstart_client_flush     (UpstartClient *client)
+	__attribute__ ((warn_unused_result));
+size_t                  upstart_client_pending   (UpstartClient *client)
+	__attribute__ ((warn_unused_result));
+
+const UpstartClientJob *upstart_client_lookup    (UpstartClient *client,
+						  const char *job,
+						  const char *instance)
+	__attribute__ ((warn_unused_result));
+
+NIH_END_EXTERN
+
+#endif /* LIB_UPSTART_CLIENT_H */
@@ -0,0 +1,289 @@
+/* upstart
+ *
+ * upstart-status.c - read job states from the init daemon's status page
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include "upstart-status.h"
+
+
+/**
+ * UPSTART_STATUS_RETRIES:
+ *
+ * Number of times upstart_status_get() tries to read an entry while it
+ * is being written before giving up.
+ **/
+#define UPSTART_STATUS_RETRIES 1000
+
+
+/**
+ * UpstartStatus:
+ * @map: mapping of the page,
+ * @size: size of @map,
+ * @header: header of the page,
+ * @entries: entries of the page.
+ *
+ * A status page mapped read-only into our address space.
+ **/
+struct upstart_status {
+	void                      *map;
+	size_t                     size;
+	const UpstartStatusHeader *header;
+	const char                *entries;
+};
+
+
+/* Prototypes for static functions */
+static int upstart_status_destroy (UpstartStatus *status);
+
+
+/**
+ * upstart_status_open:
+ * @parent: parent object for new status page,
+ * @path: path of status page, or NULL for UPSTART_STATUS_FILE.
+ *
+ * Map the status page published by the init daemon at @path, so that
+ * the states of its job instances can be read with upstart_status_get()
+ * without any request to the init daemon.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned page.  When all parents
+ * of the returned page are freed, the returned page will also be
+ * freed, and unmapped.
+ *
+ * Returns: newly allocated UpstartStatus or NULL on raised error.
+ **/
+UpstartStatus *
+upstart_status_open (const void *parent,
+		     const char *path)
+{
+	UpstartStatus             *status;
+	const UpstartStatusHeader *header;
+	struct stat                statbuf;
+	void                      *map;
+	int                        fd;
+
+	fd = open (path ? path : UPSTART_STATUS_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		nih_return_system_error (NULL);
+
+	if (fstat (fd, &statbuf) < 0) {
+		close (fd);
+		nih_return_system_error (NULL);
+	}
+
+	if ((size_t)statbuf.st_size < sizeof (UpstartStatusHeader)) {
+		close (fd);
+		errno = EINVAL;
+		nih_return_system_error (NULL);
+	}
+
+	map = mmap (NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED)
+		nih_return_system_error (NULL);
+
+	/* Only a page whose layout we know, and which is as large as its
+	 * header says it is, can be read.
+	 */
+	header = map;
+	if ((header->magic != UPSTART_STATUS_MAGIC)
+	    || (header->version != UPSTART_STATUS_VERSION)
+	    || (header->header_size < sizeof (UpstartStatusHeader))
+	    || (header->entry_size < sizeof (UpstartStatusEntry))
+	    || ((size_t)statbuf.st_size < header->header_size
+		+ (size_t)header->entries * header->entry_size)) {
+		munmap (map, statbuf.st_size);
+		errno = EINVAL;
+		nih_return_system_error (NULL);
+	}
+
+	status = nih_new (parent, UpstartStatus);
+	if (! status) {
+		munmap (map, statbuf.st_size);
+		nih_return_no_memory_error (NULL);
+	}
+
+	status->map = map;
+	status->size = statbuf.st_size;
+	status->header = header;
+	status->entries = (const char *)map + header->header_size;
+
+	nih_alloc_set_destructor (status, upstart_status_destroy);
+
+	return status;
+}
+
+/**
+ * upstart_status_destroy:
+ * @status: status page being destroyed.
+ *
+ * Unmap @status when it is freed.
+ *
+ * Returns: zero.
+ **/
+static int
+upstart_status_destroy (UpstartStatus *status)
+{
+	nih_assert (status != NULL);
+
+	munmap (status->map, status->size);
+
+	return 0;
+}
+
+/**
+ * upstart_status_closed:
+ * @status: status page.
+ *
+ * Determine whether @status has been replaced by the init daemon, such
+ * as when it re-executes itself, in which case it will no longer be
+ * updated and should be freed and opened again.
+ *
+ * Returns: TRUE if @status has been replaced, FALSE otherwise.
+ **/
+int
+upstart_status_closed (const UpstartStatus *status)
+{
+	nih_assert (status != NULL);
+
+	return __atomic_load_n (&status->header->closed, __ATOMIC_ACQUIRE)
+		? TRUE : FALSE;
+}
+
+/**
+ * upstart_status_len:
+ * @status: status page.
+ *
+ * Returns: number of entries of @status that may hold job instances,
+ * each of which may be read with upstart_status_get().
+ **/
+size_t
+upstart_status_len (const UpstartStatus *status)
+{
+	uint32_t used;
+
+	nih_assert (status != NULL);
+
+	used = __atomic_load_n (&status->header->used, __ATOMIC_ACQUIRE);
+
+	return used < status->header->entries ? used : status->header->entries;
+}
+
+/**
+ * upstart_status_get:
+ * @status: status page,
+ * @index: entry to read, below upstart_status_len(),
+ * @entry: entry to copy into.
+ *
+ * Copy the entry at @index of @status into @entry, retrying should the
+ * init daemon be writing it at the time so that the copy is consistent.
+ * The init daemon never waits for readers.
+ *
+ * Returns: TRUE if a job instance was copied into @entry, FALSE if the
+ * entry is not in use or negative value on raised error.
+ **/
+int
+upstart_status_get (const UpstartStatus *status,
+		    size_t               index,
+		    UpstartStatusEntry  *entry)
+{
+	const UpstartStatusEntry *src;
+
+	nih_assert (status != NULL);
+	nih_assert (entry != NULL);
+	nih_assert (index < status->header->entries);
+
+	src = (const UpstartStatusEntry *)(status->entries
+					   + index * status->header->entry_size);
+
+	for (int i = 0; i < UPSTART_STATUS_RETRIES; i++) {
+		uint32_t seq;
+
+		seq = __atomic_load_n (&src->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield ();
+			continue;
+		}
+
+		memcpy (entry, src, sizeof (UpstartStatusEntry));
+
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+		if (__atomic_load_n (&src->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		/* Terminate the names in case they were truncated */
+		entry->goal[sizeof (entry->goal) - 1] = '\0';
+		entry->state[sizeof (entry->state) - 1] = '\0';
+		entry->class[sizeof (entry->class) - 1] = '\0';
+		entry->instance[sizeof (entry->instance) - 1] = '\0';
+
+		return entry->used ? TRUE : FALSE;
+	}
+
+	errno = EAGAIN;
+	nih_return_system_error (-1);
+}
+
+/**
+ * upstart_status_runlevel:
+ * @status: status page,
+ * @prevlevel: pointer to store previous runlevel in.
+ *
+ * Read the runlevel most recently entered by the init daemon from
+ * @status, as it would otherwise be read from the utmp file.  If
+ * @prevlevel is not NULL, the previous runlevel will be stored in that
+ * variable.
+ *
+ * Returns: runlevel, or zero if the init daemon has not published one
+ * in @status, in which case the utmp file should be read instead.
+ **/
+int
+upstart_status_runlevel (const UpstartStatus *status,
+			 int                 *prevlevel)
+{
+	uint32_t runlevel;
+
+	nih_assert (status != NULL);
+
+	runlevel = __atomic_load_n (&status->header->runlevel,
+				    __ATOMIC_ACQUIRE);
+	if (! runlevel)
+		return 0;
+
+	if (prevlevel)
+		*prevlevel = (runlevel >> 8) & 0xff ?: 'N';
+
+	return runlevel & 0xff ?: 'N';
+}
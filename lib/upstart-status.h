@@ -0,0 +1,146 @@
+/* upstart
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef LIB_UPSTART_STATUS_H
+#define LIB_UPSTART_STATUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nih/macros.h>
+
+
+/**
+ * UPSTART_STATUS_FILE:
+ *
+ * File the init daemon publishes the status page in, when enabled.
+ **/
+#ifndef UPSTART_STATUS_FILE
+#define UPSTART_STATUS_FILE "/run/upstart/status"
+#endif
+
+/**
+ * UPSTART_STATUS_MAGIC:
+ *
+ * Value of the magic member of a status page header ("USTP").
+ **/
+#define UPSTART_STATUS_MAGIC 0x50545355
+
+/**
+ * UPSTART_STATUS_VERSION:
+ *
+ * Version of the layout of the status page; incremented whenever it is
+ * changed incompatibly.
+ **/
+#define UPSTART_STATUS_VERSION 1
+
+/**
+ * UPSTART_STATUS_NAME_MAX:
+ *
+ * Size of the class and instance name members of a status page entry,
+ * longer names are truncated.
+ **/
+#define UPSTART_STATUS_NAME_MAX 128
+
+
+/**
+ * UpstartStatusHeader:
+ * @magic: UPSTART_STATUS_MAGIC,
+ * @version: UPSTART_STATUS_VERSION,
+ * @header_size: size of this header, which the entries follow,
+ * @entry_size: size of each entry,
+ * @entries: number of entries in the page,
+ * @used: number of entries that have ever been in use, those after
+ *  these need not be read,
+ * @closed: non-zero once the page has been replaced by another and
+ *  should be opened again,
+ * @overflow: number of instances not published for lack of entries,
+ * @runlevel: current runlevel in the low byte and previous runlevel in
+ *  the next, or zero before the first runlevel event.
+ *
+ * Header at the start of the status page, written before the page is
+ * published and never changed afterwards other than @used, @closed,
+ * @overflow and @runlevel.
+ **/
+typedef struct upstart_status_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t entry_size;
+	uint32_t entries;
+	uint32_t used;
+	uint32_t closed;
+	uint32_t overflow;
+	uint32_t runlevel;
+	uint32_t reserved[7];
+} UpstartStatusHeader;
+
+/**
+ * UpstartStatusEntry:
+ * @seq: sequence count, odd while the entry is being written,
+ * @used: non-zero if the entry holds a job instance,
+ * @pid: process id of the main process, or zero,
+ * @changed: time the goal or state last changed, in microseconds since
+ *  the epoch,
+ * @goal: name of the goal of the instance,
+ * @state: name of the state of the instance,
+ * @class: name of the class of the instance,
+ * @instance: name of the instance, empty for a singleton job.
+ *
+ * One job instance published in the status page.  The init daemon
+ * increments @seq before and after writing the entry; it must be read
+ * by copying it and then checking that @seq was even and has not
+ * changed, as upstart_status_get() does.
+ **/
+typedef struct upstart_status_entry {
+	uint32_t seq;
+	uint32_t used;
+	int32_t  pid;
+	uint32_t reserved;
+	uint64_t changed;
+	char     goal[8];
+	char     state[16];
+	char     class[UPSTART_STATUS_NAME_MAX];
+	char     instance[UPSTART_STATUS_NAME_MAX];
+} UpstartStatusEntry;
+
+/**
+ * UpstartStatus:
+ *
+ * A status page opened by upstart_status_open().
+ **/
+typedef struct upstart_status UpstartStatus;
+
+
+NIH_BEGIN_EXTERN
+
+UpstartStatus *upstart_status_open     (const void *parent,
+					const char *path)
+	__attribute__ ((warn_unused_result, malloc));
+int            upstart_status_closed   (const UpstartStatus *status)
+	__attribute__ ((warn_unused_result));
+size_t         upstart_status_len      (const UpstartStatus *status)
+	__attribute__ ((warn_unused_result));
+int            upstart_status_get      (const UpstartStatus *status,
+					size_t index, UpstartStatusEntry *entry)
+	__attribute__ ((warn_unused_result));
+int            upstart_status_runlevel (const UpstartStatus *status,
+					int *prevlevel)
+	__attribute__ ((warn_unused_result));
+
+NIH_END_EXTERN
+
+#endif /* LIB_UPSTART_STATUS_H */
@@ -24,6 +24,8 @@
 
 NIH_BEGIN_EXTERN
 
+#include "upstart-client.h"
+#include "upstart-status.h"
 #include "upstart/upstart-dbus.h"
 #include "upstart/com.ubuntu.Upstart.h"
 #include "upstart/com.ubuntu.Upstart.Instance.h"
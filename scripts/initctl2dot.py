@@ -21,7 +21,7 @@
 #---------------------------------------------------------------------
 
 #---------------------------------------------------------------------
-# Script to take output of "initctl show-config -e" and convert it into
+# Script to take the condition graph of Upstart and convert it into
 # a Graphviz DOT language (".dot") file for procesing with dot(1), etc.
 #
 # Notes:
@@ -29,6 +29,10 @@
 # - Slightly laborious logic used to satisfy graphviz requirement that
 #   all nodes be defined before being referenced.
 #
+# - The graph is requested from init with a single GetConditionGraph
+#   D-Bus call, falling back to the output of "initctl show-config -e"
+#   for an init without that method.
+#
 # Usage:
 #
 #   initctl show-config -e > initctl.out
@@ -57,6 +61,9 @@ from argparse import ArgumentParser
 options = None
 jobs = {}
 events = {}
+
+# runtime edges as tuples of (event, job, instance, waiting)
+blocked = []
 script_name = os.path.basename(sys.argv[0])
 
 cmd = None
@@ -82,6 +89,7 @@ sanitise_table = str.maketrans({
 default_color_emits = 'green'
 default_color_start_on = 'blue'
 default_color_stop_on = 'red'
+default_color_blocked = 'orange'
 default_color_event = 'thistle'
 default_color_job = '#DCDCDC'  # "Gainsboro"
 default_color_text = 'black'
@@ -89,6 +97,12 @@ default_color_bg = 'white'
 
 default_outfile = 'upstart.dot'
 
+# standard events emitted for jobs, whose job name is an argument
+job_events = ('starting', 'started', 'stopping', 'stopped')
+
+upstart_object_path = '/com/ubuntu/Upstart'
+upstart_interface = 'com.ubuntu.Upstart0_6'
+
 
 def header(ofh):
     ofh.write("""digraph upstart {{
@@ -122,6 +136,12 @@ def footer(ofh):
     else:
         details += "from '%s' on host %s)." % (cmd, os.uname()[1])
 
+    if options.runtime:
+        blocked_details = "Blocked now denoted by dashed %s lines.\\n" % \
+                          options.color_blocked
+    else:
+        blocked_details = ""
+
     ofh.write("  overlap=false;\n"
               "  label=\"Generated on {datenow} by {script_name} {details}\\n"
               "Boxes of color {options.color_job} denote jobs.\\n"
@@ -130,9 +150,11 @@ def footer(ofh):
               "Emits denoted by {options.color_emits} lines.\\n"
               "Start on denoted by {options.color_start_on} lines.\\n"
               "Stop on denoted by {options.color_stop_on} lines.\\n"
+              "{blocked_details}"
               "\";\n"
               "}}\n".format(options=options, datenow=datetime.datetime.now(),
-                            script_name=script_name, details=details))
+                            script_name=script_name, details=details,
+                            blocked_details=blocked_details))
 
 
 # Map punctuation to symbols palatable to graphviz
@@ -201,6 +223,10 @@ def show_events(ofh):
             for j in jobs[job]['stop on']['job']:
                 if j in jobs and 'emits' in jobs[j]:
                     events_to_show += jobs[j]['emits']
+
+        for (event, job, instance, waiting) in blocked:
+            if job in restrictions_list and event not in events_to_show:
+                events_to_show.append(event)
     else:
         events_to_show = events
 
@@ -292,6 +318,21 @@ def show_job_emits_edge(ofh, from_job, to_event):
               mk_event_node_name(to_event), options.color_emits)
 
 
+# An edge drawn from whichever of the job and event is holding up the
+# other, labelled with the instance.
+def show_blocked_edge(ofh, event, job, instance, waiting):
+    if waiting == 'event':
+        from_node = "%s:job" % mk_job_node_name(job)
+        to_node = mk_event_node_name(event)
+    else:
+        from_node = mk_event_node_name(event)
+        to_node = "%s:job" % mk_job_node_name(job)
+
+    ofh.write("  %s -> %s [color=\"%s\", style=\"dashed\", "
+              "label=\"%s\"];\n" % (from_node, to_node,
+                                     options.color_blocked, instance))
+
+
 def show_edges(ofh):
     glob_jobs = {}
 
@@ -345,6 +386,10 @@ def show_edges(ofh):
         for ge in glob_jobs[g]:
             show_job_emits_edge(ofh, g, ge)
 
+    for (event, job, instance, waiting) in blocked:
+        if job in jobs_list:
+            show_blocked_edge(ofh, event, job, instance, waiting)
+
     if not restrictions_list:
         return
 
@@ -362,11 +407,105 @@ def show_edges(ofh):
                     show_job_emits_edge(ofh, k, e)
 
 
+def new_job_record(job):
+    jobs[job] = {
+        'start on': {'job': {}, 'event': {}},
+        'stop on': {'job': {}, 'event': {}},
+        'emits': {},
+    }
+
+
+# Return the job name in the arguments of the standard job event
+# @event, as "initctl show-config -e" finds it, or None.
+def get_job_name(event, args):
+    if event not in job_events:
+        return None
+
+    for i, arg in enumerate(args):
+        if arg.startswith('JOB='):
+            return arg[len('JOB='):]
+        if i == 0 and '=' not in arg:
+            return arg
+
+    return None
+
+
+def add_condition(job, condition, tokens):
+    if tokens[0] in ('/AND', '/OR'):
+        return
+
+    _event = encode_dollar(job, tokens[0])
+    _job = get_job_name(tokens[0], tokens[1:])
+    if _job:
+        if condition == 'start on':
+            jobs[job][condition]['job'][_job] = _event
+        else:
+            jobs[job][condition]['job'][_job] = 1
+    else:
+        jobs[job][condition]['event'][_event] = 1
+        events[_event] = 1
+
+
+# Request the whole graph from init in a single call.
+#
+# Returns: True on success, False if it could not be requested.
+def read_graph():
+    global cmd
+
+    try:
+        import dbus
+    except ImportError:
+        return False
+
+    try:
+        if use_system:
+            bus = dbus.SystemBus()
+            proxy = bus.get_object('com.ubuntu.Upstart', upstart_object_path)
+        else:
+            bus = dbus.connection.Connection(upstart_session)
+            proxy = bus.get_object(object_path=upstart_object_path)
+
+        graph_jobs, graph_blocked = proxy.GetConditionGraph(
+            dbus.Boolean(options.runtime), dbus_interface=upstart_interface)
+    except dbus.exceptions.DBusException:
+        return False
+
+    cmd = "GetConditionGraph"
+
+    for (name, start_on, stop_on, emits) in graph_jobs:
+        job = str(name)
+        new_job_record(job)
+
+        for tokens in start_on:
+            add_condition(job, 'start on', [str(t) for t in tokens])
+
+        for tokens in stop_on:
+            add_condition(job, 'stop on', [str(t) for t in tokens])
+
+        for event in emits:
+            event = encode_dollar(job, str(event))
+            events[event] = 1
+            jobs[job]['emits'][event] = 1
+
+    for (event, job, instance, waiting) in graph_blocked:
+        event = str(event)
+        events[event] = 1
+        blocked.append((event, str(job), str(instance), str(waiting)))
+
+    return True
+
+
 def read_data():
     global cmd
     global upstart_session
     global use_system
 
+    if not options.infile and read_graph():
+        return
+
+    if options.runtime and not options.infile:
+        sys.stderr.write("WARNING: init cannot return blocked edges\n")
+
     if options.infile:
         try:
             ifh = open(options.infile, 'r')
@@ -416,30 +555,8 @@ def read_data():
             if len(tokens) != 1:
                 sys.exit("ERROR: invalid line: %s" % line.lstrip())
 
-            job_record = {}
-
-            start_on = {}
-            start_on_jobs = {}
-            start_on_events = {}
-
-            stop_on = {}
-            stop_on_jobs = {}
-            stop_on_events = {}
-
-            emits = {}
-
-            start_on['job'] = start_on_jobs
-            start_on['event'] = start_on_events
-
-            stop_on['job'] = stop_on_jobs
-            stop_on['event'] = stop_on_events
-
-            job_record['start on'] = start_on
-            job_record['stop on'] = stop_on
-            job_record['emits'] = emits
-
             job = (tokens)[0]
-            jobs[job] = job_record
+            new_job_record(job)
 
 
 def main():
@@ -465,6 +582,13 @@ def main():
                         help="File to read output from. If not specified"
                         ", initctl will be run automatically.")
 
+    parser.add_argument("--runtime",
+                        dest="runtime",
+                        default=False,
+                        action='store_true',
+                        help="Also show the jobs and events blocked now "
+                             "(not with --infile).")
+
     parser.add_argument("-o", "--outfile",
                         dest="outfile",
                         help="File to write output to (default=%s)" %
@@ -485,6 +609,12 @@ def main():
                         help="Specify color for 'stop on' lines "
                              "(default=%s)." % default_color_stop_on)
 
+    parser.add_argument("--color-blocked",
+                        dest="color_blocked",
+                        help="Specify color for lines of jobs and events "
+                             "blocked now (default=%s)." %
+                             default_color_blocked)
+
     parser.add_argument("--color-event",
                         dest="color_event",
                         help="Specify color for event boxes (default=%s)." %
@@ -530,6 +660,7 @@ def main():
     parser.set_defaults(color_emits=default_color_emits,
                         color_start_on=default_color_start_on,
                         color_stop_on=default_color_stop_on,
+                        color_blocked=default_color_blocked,
                         color_event=default_color_event,
                         color_job=default_color_job,
                         color_job_text=default_color_text,
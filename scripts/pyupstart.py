@@ -25,6 +25,7 @@ import dbus.service
 import dbus.mainloop.glib
 import time
 import json
+import functools
 from datetime import datetime, timedelta
 from gi.repository import GLib
 
@@ -79,6 +80,10 @@ FILE_WAIT_SECS = 5
 # Maximum number of seconds to wait for Upstart to create a logfile
 LOGFILE_WAIT_SECS = 5
 
+# Lowest rate, in jobs per second, at which bulk operations are
+# expected to complete; their timeouts are extended accordingly.
+BULK_JOBS_PER_SEC = 50
+
 #---------------------------------------------------------------------
 
 def get_init():
@@ -160,6 +165,15 @@ def secs_to_milli(secs):
     return secs * 1000
 
 
+def bulk_timeout(count):
+    """
+    Determine how long to wait for a bulk operation on @count jobs.
+
+    Returns: seconds.
+    """
+    return JOB_WAIT_SECS + count // BULK_JOBS_PER_SEC
+
+
 def wait_for_file(path, timeout=FILE_WAIT_SECS):
     """
     Wait for a specified file to exist.
@@ -186,6 +200,91 @@ class InotifyHandler(pyinotify.ProcessEvent):
         pass
 
 
+class Timings:
+    """
+    Timings of a bulk operation: the time taken by the operation as a
+    whole, and the latency of each of the jobs it operated on.
+    """
+
+    def __init__(self, name):
+        """
+        @name: name of the operation.
+        """
+        self.name = name
+        self.latencies = []
+        self.errors = []
+        self.start = time.monotonic()
+        self.end = None
+
+    def add(self, latency):
+        """
+        Record that one job completed.
+
+        @latency: seconds taken for the job.
+        """
+        self.latencies.append(latency)
+
+    def fail(self, error):
+        """
+        Record that one job failed.
+
+        @error: description of the failure.
+        """
+        self.errors.append(error)
+
+    def finish(self):
+        """
+        Record that the operation has completed.
+        """
+        self.end = time.monotonic()
+
+    def elapsed(self):
+        """
+        Returns: seconds taken by the operation.
+        """
+        return (self.end if self.end else time.monotonic()) - self.start
+
+    def throughput(self):
+        """
+        Returns: jobs completed per second.
+        """
+        elapsed = self.elapsed()
+        return len(self.latencies) / elapsed if elapsed > 0 else 0.0
+
+    def percentile(self, percent):
+        """
+        @percent: percentile to return, from 0 to 100.
+
+        Returns: latency at @percent in seconds, or None if no job
+        completed.
+        """
+        if not self.latencies:
+            return None
+
+        latencies = sorted(self.latencies)
+        index = int(round((len(latencies) - 1) * percent / 100.0))
+        return latencies[index]
+
+    def report(self):
+        """
+        Returns: single line summary of the timings.
+        """
+        line = '{}: {} jobs in {:.3f}s ({:.1f}/s)'.format(
+            self.name, len(self.latencies), self.elapsed(),
+            self.throughput())
+
+        if self.latencies:
+            line += '; latency ms min {:.1f} p50 {:.1f} p95 {:.1f} ' \
+                    'p99 {:.1f} max {:.1f}'.format(
+                        *[self.percentile(p) * 1000
+                          for p in (0, 50, 95, 99, 100)])
+
+        if self.errors:
+            line += '; {} failed'.format(len(self.errors))
+
+        return line
+
+
 class UpstartException(Exception):
     """
     An Upstart Exception.
@@ -253,7 +352,8 @@ class Upstart:
         """
         self.connect(force=True)
 
-    def polling_connect(self, timeout=REEXEC_WAIT_SECS, force=False):
+    def polling_connect(self, timeout=REEXEC_WAIT_SECS, force=False,
+                        interval=1):
         """
         Attempt to connect to Upstart repeatedly for up to @timeout
         seconds.
@@ -263,14 +363,17 @@ class Upstart:
 
         @timeout: seconds to wait for successful connection.
         @force: if True, force a reconnection.
+        @interval: seconds to wait between attempts.
         """
-        for i in range(timeout):
+        until = time.monotonic() + timeout
+
+        while time.monotonic() < until:
             try:
                 self.connect(force=force)
                 self.version()
                 return
             except dbus.exceptions.DBusException:
-                time.sleep(1)
+                time.sleep(interval)
 
         raise UpstartException(
             'Failed to reconnect to Upstart after %d seconds' % timeout)
@@ -392,6 +495,25 @@ class Upstart:
         """
         return json.loads(self.get_state_json())
 
+    def get_state_filtered_json(self, kinds=None, names=None, since=0):
+        """
+        Obtain only the events, job classes and jobs of @kinds whose
+        names match any of the @names globs and that changed after
+        generation @since, in JSON format.
+        """
+        return self.proxy.GetStateFiltered(
+            dbus.Array(kinds or [], signature='s'),
+            dbus.Array(names or [], signature='s'),
+            dbus.UInt64(since))
+
+    def get_state_filtered(self, kinds=None, names=None, since=0):
+        """
+        As get_state_filtered_json() but converted to Python dictionary
+        format; its 'generation' is the value to pass as @since to see
+        only later changes.
+        """
+        return json.loads(self.get_state_filtered_json(kinds, names, since))
+
     def get_sessions(self):
         """
         Returns dictionary of session details.
@@ -521,6 +643,274 @@ class Upstart:
         self.jobs.append(self.new_job)
         return self.new_job
 
+    def jobs_create(self, jobs, retain=False, timeout=None):
+        """
+        Create many Job Configuration Files at once.
+
+        @jobs: list of (name, body) tuples, as for job_create().
+        @retain: if True, don't remove the Job Configuration Files when
+         the objects are cleaned up.
+        @timeout: seconds to wait for Upstart to register all the jobs,
+         or None to allow for BULK_JOBS_PER_SEC.
+
+        Unlike job_create(), all the files are written before waiting
+        for the 'JobAdded' signals, which are then awaited together.
+        The latency of each job is from its file being written to its
+        signal being received.
+
+        Notes:
+          - Raises an UpstartException() if any job is not registered
+            within @timeout seconds.
+
+        Returns: tuple of list of Job objects and Timings.
+        """
+
+        if timeout is None:
+            timeout = bulk_timeout(len(jobs))
+
+        mainloop = GLib.MainLoop()
+        timings = Timings('create')
+        created = []
+        pending = {}
+
+        def job_added_cb(path):
+            written = pending.pop(path, None)
+            if written is None:
+                return
+
+            timings.add(time.monotonic() - written)
+
+            if not pending:
+                mainloop.quit()
+
+        def idle_create_jobs_cb():
+            for name, body in jobs:
+                job = Job(self, self.test_dir, self.test_dir_name,
+                    name, body=body, retain=retain)
+                pending[job.object_path] = time.monotonic()
+                created.append(job)
+
+            if not pending:
+                mainloop.quit()
+
+            # deregister
+            return False
+
+        match = self.connection.add_signal_receiver(
+            job_added_cb,
+            dbus_interface=INTERFACE_NAME,
+            path=OBJECT_PATH,
+            signal_name='JobAdded')
+
+        GLib.idle_add(idle_create_jobs_cb)
+        self._bulk_run(mainloop, timeout)
+
+        match.remove()
+        timings.finish()
+
+        self.jobs.extend(created)
+
+        if pending:
+            raise UpstartException(
+                '{} of {} jobs not registered after {} seconds'.format(
+                    len(pending), len(jobs), timeout))
+
+        return created, timings
+
+    def jobs_start(self, jobs, env=None, timeout=None):
+        """
+        Start many jobs at once, waiting for all of them to start.
+
+        @jobs: list of Job objects.
+        @env: optional environment for each job.
+        @timeout: seconds to wait for all the jobs to start, or None to
+         allow for BULK_JOBS_PER_SEC.
+
+        The latency of each job is from its Start() method call being
+        sent to its reply being received.
+
+        Returns: Timings.
+        """
+
+        if env is None:
+            env = []
+
+        calls = [(job.interface.Start, (dbus.Array(env, 's'), True),
+                  job._add_instance)
+                 for job in jobs]
+
+        return self._bulk_call('start', calls, timeout)
+
+    def jobs_stop(self, jobs, timeout=None):
+        """
+        Stop all instances of many jobs at once, waiting for all of them
+        to stop.
+
+        @jobs: list of Job objects.
+        @timeout: seconds to wait for all the instances to stop, or None
+         to allow for BULK_JOBS_PER_SEC.
+
+        Returns: Timings.
+        """
+
+        calls = [(job._get_dbus_instance(name).Stop, (True,), None)
+                 for job in jobs
+                 for name in job.instance_names]
+
+        return self._bulk_call('stop', calls, timeout)
+
+    def events_wait(self, name, jobs, trigger, timeout=None):
+        """
+        Wait for an event to be emitted for each of many jobs.
+
+        @name: name of the event, such as 'started'.
+        @jobs: list of Job objects the event is expected for.
+        @trigger: function called once the 'EventEmitted' signal is being
+         watched for, to set off the events.
+        @timeout: seconds to wait for all the events, or None to allow
+         for BULK_JOBS_PER_SEC.
+
+        The latency of each job is from @trigger being called to the
+        event for it being received, so measures a cascade of jobs
+        started in turn by each other's events.
+
+        Notes:
+          - Raises an UpstartException() if any event is not emitted
+            within @timeout seconds.
+
+        Returns: Timings.
+        """
+
+        if timeout is None:
+            timeout = bulk_timeout(len(jobs))
+
+        mainloop = GLib.MainLoop()
+        timings = Timings(name)
+        pending = set('JOB={}/{}'.format(job.subdir_name, job.name)
+                      for job in jobs)
+
+        def event_emitted_cb(event, env):
+            if event != name or not pending:
+                return
+
+            for var in env:
+                if var in pending:
+                    pending.remove(var)
+                    timings.add(time.monotonic() - timings.start)
+                    break
+
+            if not pending:
+                mainloop.quit()
+
+        def idle_trigger_cb():
+            timings.start = time.monotonic()
+            trigger()
+
+            # deregister
+            return False
+
+        match = self.connection.add_signal_receiver(
+            event_emitted_cb,
+            dbus_interface=INTERFACE_NAME,
+            path=OBJECT_PATH,
+            signal_name='EventEmitted')
+
+        GLib.idle_add(idle_trigger_cb)
+        self._bulk_run(mainloop, timeout)
+
+        match.remove()
+        timings.finish()
+
+        if pending:
+            raise UpstartException(
+                '{} of {} {} events not emitted after {} seconds'.format(
+                    len(pending), len(jobs), name, timeout))
+
+        return timings
+
+    def _bulk_call(self, name, calls, timeout):
+        """
+        Make many D-Bus method calls asynchronously and wait for all of
+        their replies.
+
+        @name: name of the operation.
+        @calls: list of (method, args, reply_cb) tuples; @reply_cb is
+         called with the return value of @method, unless None.
+        @timeout: seconds to wait for all the replies, or None to allow
+         for BULK_JOBS_PER_SEC.
+
+        Notes:
+          - Raises an UpstartException() if any call fails or is not
+            replied to within @timeout seconds.
+
+        Returns: Timings.
+        """
+
+        if timeout is None:
+            timeout = bulk_timeout(len(calls))
+
+        mainloop = GLib.MainLoop()
+        timings = Timings(name)
+        pending = len(calls)
+
+        def done():
+            nonlocal pending
+
+            pending -= 1
+            if not pending:
+                mainloop.quit()
+
+        def reply(sent, reply_cb, *args):
+            timings.add(time.monotonic() - sent)
+            if reply_cb:
+                reply_cb(*args)
+            done()
+
+        def error(exception):
+            timings.fail(str(exception))
+            done()
+
+        for method, args, reply_cb in calls:
+            method(*args,
+                   reply_handler=functools.partial(
+                       reply, time.monotonic(), reply_cb),
+                   error_handler=error,
+                   timeout=timeout)
+
+        if pending:
+            self._bulk_run(mainloop, timeout)
+
+        timings.finish()
+
+        if pending or timings.errors:
+            raise UpstartException(
+                '{} of {} {} calls failed or unanswered: {}'.format(
+                    pending + len(timings.errors), len(calls), name,
+                    timings.errors[:1]))
+
+        return timings
+
+    def _bulk_run(self, mainloop, timeout):
+        """
+        Run @mainloop until it is quit, or for at most @timeout seconds.
+        """
+        expired = False
+
+        def timeout_cb():
+            nonlocal expired
+
+            expired = True
+            mainloop.quit()
+
+            # deregister
+            return False
+
+        source = GLib.timeout_add(secs_to_milli(timeout), timeout_cb)
+        mainloop.run()
+
+        if not expired:
+            GLib.source_remove(source)
+
 
 class Job:
     """
@@ -640,6 +1030,16 @@ class Job:
             env = []
         instance_path = self.interface.Start(dbus.Array(env, 's'), wait)
 
+        return self._add_instance(instance_path)
+
+    def _add_instance(self, instance_path):
+        """
+        Record a newly started instance of the job.
+
+        @instance_path: D-Bus object path of the instance.
+
+        Returns: JobInstance.
+        """
         instance_name = instance_path.replace("%s/" % self.object_path, '')
 
         # store the D-Bus encoded instance name ('_' for single-instance jobs)
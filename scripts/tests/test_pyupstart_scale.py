@@ -0,0 +1,242 @@
+#!/usr/bin/python3
+# -*- coding: utf-8 -*-
+#---------------------------------------------------------------------
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2, as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#---------------------------------------------------------------------
+
+#---------------------------------------------------------------------
+# Description: Scale tests for the pyupstart module, run against
+#              Session Inits with thousands of jobs.
+#
+# Notes: Skipped unless UPSTART_TEST_SCALE is set.  The number of jobs
+#        and sessions may be changed with UPSTART_TEST_SCALE_JOBS and
+#        UPSTART_TEST_SCALE_SESSIONS.  Throughput and latency of each
+#        operation are reported on stdout.
+#---------------------------------------------------------------------
+
+import os
+import sys
+
+base_dir = os.path.abspath(os.path.dirname(__file__))
+module_dir = os.path.normpath(os.path.realpath(base_dir + os.sep + '..'))
+
+# Tell Python where the uninstalled module lives in the source tree
+sys.path.append(module_dir)
+from pyupstart import *
+
+import unittest
+
+SCALE_ENV = 'UPSTART_TEST_SCALE'
+
+# Number of jobs each test creates
+SCALE_JOBS = int(os.environ.get('UPSTART_TEST_SCALE_JOBS', 2000))
+
+# Number of Session Inits the fan-out test starts
+SCALE_SESSIONS = int(os.environ.get('UPSTART_TEST_SCALE_SESSIONS', 20))
+
+# Number of jobs started directly by the boot event in the cascade
+# test; each of the rest is started by the job this many before it.
+CASCADE_WIDTH = 50
+
+# Body of every job; a service that produces no output and so needs no
+# log file.
+SLEEPER = 'exec sleep 999'
+
+
+@unittest.skipUnless(os.environ.get(SCALE_ENV),
+                     '{} not set'.format(SCALE_ENV))
+class TestScale(unittest.TestCase):
+
+    def setUp(self):
+        # As for the session-level tests, a Session Init requires
+        # XDG_RUNTIME_DIR.
+        xdg_runtime_dir = os.environ.get('XDG_RUNTIME_DIR', None)
+        if not xdg_runtime_dir or not os.path.exists(xdg_runtime_dir):
+            tmp_xdg_runtime_dir = tempfile.mkdtemp(prefix='tmp-xdg-runtime-dir')
+            os.environ['XDG_RUNTIME_DIR'] = tmp_xdg_runtime_dir
+            print('INFO: User has no XDG_RUNTIME_DIR so created one: {}'.format(tmp_xdg_runtime_dir))
+
+        self.sessions = []
+        self.logger = logging.getLogger(self.__class__.__name__)
+        for cmd in get_init(), get_initctl():
+            if not os.path.exists(cmd):
+                raise UpstartException('Command %s not found' % cmd)
+
+    def tearDown(self):
+        for session in self.sessions:
+            session.destroy()
+
+    def report(self, *timings):
+        for timing in timings:
+            print('SCALE: {}'.format(timing.report()))
+
+    def start_session_init(self):
+        """
+        Start a Session Init, which is stopped by tearDown().
+
+        Returns: SessionInit.
+        """
+        session = SessionInit(extra=['--no-startup-event'])
+        self.sessions.append(session)
+        return session
+
+    def running_count(self, upstart):
+        """
+        Returns: number of test jobs of @upstart with a running instance.
+        """
+        states = upstart.proxy.GetAllJobStates(
+            '{}/*'.format(upstart.test_dir_name))
+        return len([s for s in states if str(s[3]) == 'running'])
+
+    def test_bulk_start_stop(self):
+        upstart = self.start_session_init()
+
+        jobs, create = upstart.jobs_create(
+            [('sleeper-{}'.format(i), SLEEPER) for i in range(SCALE_JOBS)])
+        self.assertEqual(len(jobs), SCALE_JOBS)
+
+        start = upstart.jobs_start(jobs)
+        self.assertEqual(self.running_count(upstart), SCALE_JOBS)
+
+        stop = upstart.jobs_stop(jobs)
+        self.assertEqual(self.running_count(upstart), 0)
+
+        self.report(create, start, stop)
+
+    def test_boot_cascade(self):
+        upstart = self.start_session_init()
+
+        # Jobs started by the boot event, followed by chains of jobs
+        # each started by the one before it; so a cascade of
+        # SCALE_JOBS / CASCADE_WIDTH jobs deep, as at boot.
+        specs = []
+        for i in range(SCALE_JOBS):
+            if i < CASCADE_WIDTH:
+                start_on = 'start on scale-boot'
+            else:
+                start_on = 'start on started {}/cascade-{}'.format(
+                    upstart.test_dir_name, i - CASCADE_WIDTH)
+
+            specs.append(('cascade-{}'.format(i), [start_on, SLEEPER]))
+
+        jobs, create = upstart.jobs_create(specs)
+
+        boot = upstart.events_wait(
+            'started', jobs,
+            lambda: upstart.emit('scale-boot', wait=False))
+        self.assertEqual(self.running_count(upstart), SCALE_JOBS)
+
+        # Instances were started by events rather than by us.
+        for job in jobs:
+            job.get_instance()
+
+        stop = upstart.jobs_stop(jobs)
+
+        self.report(create, boot, stop)
+
+    def test_reexec_large_state(self):
+        upstart = self.start_session_init()
+
+        jobs, create = upstart.jobs_create(
+            [('sleeper-{}'.format(i), SLEEPER) for i in range(SCALE_JOBS)],
+            retain=True)
+        start = upstart.jobs_start(jobs)
+
+        state = Timings('get-state')
+        json_state = upstart.get_state_json()
+        state.add(state.elapsed())
+        state.finish()
+
+        print('SCALE: state is {} bytes'.format(len(json_state)))
+
+        # Re-exec severs the connection, so the call fails.
+        reexec = Timings('re-exec')
+        with self.assertRaises(dbus.exceptions.DBusException):
+            upstart.reexec()
+        upstart.polling_connect(timeout=bulk_timeout(SCALE_JOBS),
+                                force=True, interval=0.01)
+        reexec.add(reexec.elapsed())
+        reexec.finish()
+
+        self.assertEqual(self.running_count(upstart), SCALE_JOBS)
+
+        # The job objects are bound to the severed connection, so
+        # recreate them to stop the jobs (and, since they were retained,
+        # to remove their files).
+        jobs = [upstart.job_recreate(job.name, job.conffile) for job in jobs]
+        for job in jobs:
+            job.get_instance()
+            job.retain = False
+
+        stop = upstart.jobs_stop(jobs)
+        self.assertEqual(self.running_count(upstart), 0)
+
+        self.report(create, start, state, reexec, stop)
+
+    def test_session_fanout(self):
+        per_session = max(1, SCALE_JOBS // SCALE_SESSIONS)
+
+        sessions = Timings('session-start')
+        for i in range(SCALE_SESSIONS):
+            started = time.monotonic()
+            self.start_session_init()
+            sessions.add(time.monotonic() - started)
+        sessions.finish()
+
+        create = Timings('create')
+        start = Timings('start')
+        for upstart in self.sessions:
+            jobs, timings = upstart.jobs_create(
+                [('sleeper-{}'.format(i), SLEEPER)
+                 for i in range(per_session)])
+            create.latencies.extend(timings.latencies)
+
+            timings = upstart.jobs_start(jobs)
+            start.latencies.extend(timings.latencies)
+
+            self.assertEqual(self.running_count(upstart), per_session)
+        create.finish()
+        start.finish()
+
+        self.report(sessions, create, start)
+
+
+def main():
+    kwargs = {}
+    format =             \
+        '%(asctime)s:'   \
+        '%(filename)s:'  \
+        '%(name)s:'      \
+        '%(funcName)s:'  \
+        '%(levelname)s:' \
+        '%(message)s'
+
+    kwargs['format'] = format
+
+    # Only problems, so as not to bury the results
+    kwargs['level'] = logging.WARNING
+
+    logging.basicConfig(**kwargs)
+
+    unittest.main(
+        testRunner=unittest.TextTestRunner(
+            stream=sys.stdout,
+            verbosity=2
+        )
+    )
+
+    sys.exit(0)
+
+if __name__ == '__main__':
+    main()
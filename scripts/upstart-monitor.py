@@ -43,6 +43,8 @@ import gettext
 from gettext import gettext as _
 import argparse
 import signal
+import fnmatch
+import collections
 import dbus
 import dbus.mainloop.glib
 from datetime import datetime
@@ -99,6 +101,16 @@ DEFAULT_LOGO_SIZE_HEIGHT = 150
 
 DEFAULT_OUTPUT_FILE = 'upstart-events.txt'
 
+# glob of event names to show
+DEFAULT_EVENTS = '*'
+
+# milliseconds over which Upstart batches events, and between updates of
+# the display
+DEFAULT_WINDOW = 100
+
+# most events held between updates of the display
+DEFAULT_BUFFER = 1000
+
 # key=type : value=description
 destinations = \
 {
@@ -180,17 +192,119 @@ def format_event(*args):
     return event, env
 
 
-def cmdline_event_handler(*args):
+class EventRing:
+    """
+    Bounded buffer of the events received but not yet displayed, so that
+    a burst of them costs no more than the buffer; once it's full the
+    oldest are dropped and counted, as are those Upstart drops itself.
+    """
+
+    def __init__(self, size):
+        self.events = collections.deque(maxlen=size)
+        self.dropped = 0
+
+    def add(self, *args):
+        """
+        Add an event, given as for format_event().
+        """
+        if len(self.events) == self.events.maxlen:
+            self.dropped += 1
+
+        now = datetime.now().strftime("%F %T.%f")
+        self.events.append((now,) + format_event(*args))
+
+    def drop(self, count):
+        """
+        Count events dropped before they reached us.
+        """
+        self.dropped += count
+
+    def drain(self):
+        """
+        Returns: list of (time, event, env) tuples buffered and the number
+        of events dropped since the last call.
+        """
+        events = list(self.events)
+        dropped = self.dropped
+
+        self.events.clear()
+        self.dropped = 0
+
+        return events, dropped
+
+
+def register_handlers(ring):
+    """
+    Have the events chosen by the user added to @ring.
+
+    Over a private socket, Upstart is asked to only send those events,
+    batched over the window; on a bus, or should Upstart not support
+    subscriptions, every EventEmitted signal is received and filtered
+    here instead.
+    """
+    global bus
+    global cmdline_args
+
+    pattern = cmdline_args.events
+
+    def batch_handler(jobs, events, dropped=0):
+        for event, env in events:
+            ring.add(event, env)
+        ring.drop(dropped)
+
+    def emitted_handler(event, env):
+        if fnmatch.fnmatchcase(event, pattern):
+            ring.add(event, env)
+
+    if cmdline_args.destination.endswith('-socket'):
+        bus.add_signal_receiver(batch_handler,
+            dbus_interface='com.ubuntu.Upstart0_6',
+            signal_name='StateBatch')
+
+        upstart = bus.get_object(None, '/com/ubuntu/Upstart')
+
+        try:
+            upstart.Subscribe('', pattern, dbus.UInt32(cmdline_args.window),
+                dbus_interface='com.ubuntu.Upstart0_6')
+            return
+        except dbus.exceptions.DBusException as e:
+            if e.get_dbus_name() not in (
+                    'org.freedesktop.DBus.Error.UnknownMethod',
+                    'org.freedesktop.DBus.Error.NotSupported'):
+                raise
+
+    bus.add_signal_receiver(emitted_handler,
+        dbus_interface='com.ubuntu.Upstart0_6',
+        signal_name='EventEmitted')
+
+
+def dropped_message(dropped):
+    """
+    Returns: text shown in place of @dropped events.
+    """
+    return "(%d %s)" % (dropped, _('events dropped'))
+
+
+def cmdline_display(ring):
     """
-    format event data for command-line display
+    Format the events buffered in @ring for command-line display.
     """
     global cmdline_args
 
-    event, env = format_event(*args)
-    now = datetime.now().strftime("%F %T.%f")
-    event_str = "%s %s" % (event, env) if env else event
     sep = cmdline_args.separator if cmdline_args.separator else "\t"
-    print("%s%s%s" % (now, sep, event_str))
+
+    events, dropped = ring.drain()
+
+    if dropped:
+        now = datetime.now().strftime("%F %T.%f")
+        print("%s%s%s" % (now, sep, dropped_message(dropped)))
+
+    for now, event, env in events:
+        event_str = "%s %s" % (event, env) if env else event
+        print("%s%s%s" % (now, sep, event_str))
+
+    # keep calling
+    return True
 
 
 class UpstartEventsGui(Gtk.Window):
@@ -200,27 +314,37 @@ class UpstartEventsGui(Gtk.Window):
     global bus
     global cmdline_args
 
-    def add_row(self, event, event_env):
+    def add_row(self, now, event_str):
         """
         Add new row to view.
         """
         self.data_index += 1
-        now = datetime.now().strftime("%F %T.%f")
-        event_str = "%s %s" % (event, event_env) if event_env else event
 
         row = [self.data_index, now, event_str]
         self.liststore.append(row)
 
 
-    def event_handler(self, *args):
+    def display_cb(self):
         """
-        Upstart has emitted an event so create a new row in the view.
+        Create a new row in the view for each event buffered since the
+        last call, rather than one as each arrives.
         """
-        event, env = format_event(*args)
-        self.add_row(event, env)
+        events, dropped = self.ring.drain()
+
+        if dropped:
+            now = datetime.now().strftime("%F %T.%f")
+            self.add_row(now, dropped_message(dropped))
+
+        for now, event, env in events:
+            event_str = "%s %s" % (event, env) if env else event
+            self.add_row(now, event_str)
 
-        # New data arrived since last save (if any).
-        self.need_save = True
+        if events or dropped:
+            # New data arrived since last save (if any).
+            self.need_save = True
+
+        # keep calling
+        return True
 
 
     def register_cb(self):
@@ -228,10 +352,8 @@ class UpstartEventsGui(Gtk.Window):
         Callback to register a D-Bus callback whenever Upstart emits an
         event.
         """
-        # register a D-Bus handler
-        bus.add_signal_receiver(self.event_handler,
-        dbus_interface='com.ubuntu.Upstart0_6',
-        signal_name="EventEmitted")
+        register_handlers(self.ring)
+        GLib.timeout_add(cmdline_args.window, self.display_cb)
 
         # deregister this callback
         return False
@@ -511,6 +633,8 @@ class UpstartEventsGui(Gtk.Window):
 
         self.data_index = 0
 
+        self.ring = EventRing(cmdline_args.buffer)
+
         self.set_default_size(DEFAULT_WIN_SIZE_WIDTH, DEFAULT_WIN_SIZE_HEIGHT)
         self.set_resizable(True)
 
@@ -610,6 +734,43 @@ class UpstartEventsGui(Gtk.Window):
         self.liststore[path][1] = text
 
 
+def show_job_states():
+    """
+    Display the current state of every job using a single D-Bus call.
+
+    Returns: True if the states were displayed, False if the connected
+    Upstart does not support querying them in bulk.
+    """
+    global bus
+    global cmdline_args
+
+    name = None
+    if cmdline_args.destination.endswith('-bus'):
+        name = 'com.ubuntu.Upstart'
+
+    upstart = bus.get_object(name, '/com/ubuntu/Upstart')
+
+    try:
+        states = upstart.GetAllJobStates('',
+            dbus_interface='com.ubuntu.Upstart0_6')
+    except dbus.exceptions.DBusException as e:
+        if e.get_dbus_name() == 'org.freedesktop.DBus.Error.UnknownMethod':
+            return False
+        raise
+
+    sep = cmdline_args.separator if cmdline_args.separator else "\t"
+
+    for job, instance, goal, state, procs, pids in states:
+        name = "%s (%s)" % (job, instance) if instance else job
+        processes = ' '.join('%s:%d' % (p, pid) for p, pid in zip(procs, pids))
+        fields = [name, '%s/%s' % (goal, state)]
+        if processes:
+            fields.append(processes)
+        print('# %s' % sep.join(str(f) for f in fields))
+
+    return True
+
+
 def main():
     """
     Parse arguments and run either the command-line or the GUI monitor.
@@ -629,12 +790,36 @@ def main():
     parser.add_argument('-s', '--separator',
             help=_('field separator to use for command-line output'))
 
+    parser.add_argument('-j', '--jobs',
+            action='store_true',
+            help=_('show the state of all jobs on startup in command-line mode'))
+
     parser.add_argument('-d', '--destination',
             choices=destinations.keys(),
             help=_('connect to Upstart via specified D-Bus route'))
 
+    parser.add_argument('-e', '--events',
+            default=DEFAULT_EVENTS,
+            help=_('only show events whose names match the glob (default=%s)') % DEFAULT_EVENTS)
+
+    parser.add_argument('-w', '--window',
+            type=int,
+            default=DEFAULT_WINDOW,
+            help=_('milliseconds between updates of the display (default=%d)') % DEFAULT_WINDOW)
+
+    parser.add_argument('-b', '--buffer',
+            type=int,
+            default=DEFAULT_BUFFER,
+            help=_('most events held between updates, after which the oldest are dropped (default=%d)') % DEFAULT_BUFFER)
+
     cmdline_args = parser.parse_args()
 
+    if cmdline_args.window < 1:
+        parser.error(_('window must be at least 1 ms'))
+
+    if cmdline_args.buffer < 1:
+        parser.error(_('buffer must hold at least one event'))
+
     # allow interrupt
     signal.signal(signal.SIGINT, signal.SIG_DFL)
 
@@ -665,14 +850,16 @@ def main():
     # dynamically load GUI elements so we can fall back to the
     # command-line version if we cannot display a GUI
     if cli == True:
-        # register a D-Bus handler
-        bus.add_signal_receiver(cmdline_event_handler, dbus_interface='com.ubuntu.Upstart0_6',
-            signal_name='EventEmitted')
+        ring = EventRing(cmdline_args.buffer)
+        register_handlers(ring)
+        GLib.timeout_add(cmdline_args.window, cmdline_display, ring)
         loop = GLib.MainLoop()
         print('# Upstart Event Monitor (%s)' % _('console mode'))
         print('#')
         print('# %s %s' % (_('Connected to'), destinations[cmdline_args.destination]))
         print('#')
+        if cmdline_args.jobs and show_job_states():
+            print('#')
         print('# %s' % _('Columns: time, event and environment'))
         print('')
         loop.run()
@@ -26,8 +26,13 @@
 
 #include <sys/types.h>
 
+#include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <fnmatch.h>
 #include <pwd.h>
@@ -59,6 +64,9 @@
 
 #include "init/events.h"
 #include "init/xdg.h"
+#include "init/paths.h"
+#include "init/log_store.h"
+#include "rc.h"
 #include "initctl.h"
 
 
@@ -68,9 +76,48 @@ NihDBusProxy *upstart_open (const void *parent)
 char *        job_status   (const void *parent,
 			    NihDBusProxy *job_class, NihDBusProxy *job)
 	__attribute__ ((warn_unused_result));
+static char * job_state_status (const void *parent,
+			       const UpstartGetAllJobStatesStatesElement *state)
+	__attribute__ ((warn_unused_result, malloc));
 char *        job_usage    (const void *parent,
 			    NihDBusProxy *job_class)
 	__attribute__ ((warn_unused_result));
+char *        job_timings  (const void *parent, NihDBusProxy *job)
+	__attribute__ ((warn_unused_result));
+char *        job_resources (const void *parent,
+			     NihDBusProxy *job_class, NihDBusProxy *job)
+	__attribute__ ((warn_unused_result));
+int           job_timing_summary (const void *parent,
+			    NihDBusProxy *job_class, NihDBusProxy *job,
+			    JobTiming **timing)
+	__attribute__ ((warn_unused_result));
+char **       batch_split  (const void *parent, const char *line)
+	__attribute__ ((warn_unused_result));
+
+/* Prototypes for JSON output */
+static int    output_json        (const char *command)
+	__attribute__ ((warn_unused_result));
+static char * json_string        (const void *parent, const char *str)
+	__attribute__ ((warn_unused_result, malloc));
+static char * job_state_json     (const void *parent,
+				  const UpstartGetAllJobStatesStatesElement *state)
+	__attribute__ ((warn_unused_result, malloc));
+static char * job_condition_json (const void *parent,
+				  char ** const *condition)
+	__attribute__ ((warn_unused_result, malloc));
+static char * job_class_json     (const void *parent,
+				  const JobClassProperties *props)
+	__attribute__ ((warn_unused_result, malloc));
+
+/* Prototypes for rc script runs */
+static NihList *rc_scripts_read   (const void *parent)
+	__attribute__ ((warn_unused_result));
+static char *   rc_script_status  (const void *parent,
+				   const RcScript *script, int json)
+	__attribute__ ((warn_unused_result, malloc));
+static void     rc_list           (int json);
+static char *   rc_trace_splice   (const void *parent, const char *trace)
+	__attribute__ ((warn_unused_result, malloc));
 
 /* Prototypes for static functions */
 static void   start_reply_handler (char **job_path, NihDBusMessage *message,
@@ -78,6 +125,22 @@ static void   start_reply_handler (char **job_path, NihDBusMessage *message,
 static void   reply_handler       (int *ret, NihDBusMessage *message);
 static void   error_handler       (void *data, NihDBusMessage *message);
 
+static int    job_call_wanted     (char * const *args);
+static int    job_call_all        (JobCallType type, char * const *args);
+static void   job_call_add        (NihList *calls, const char *name);
+static int    job_call_begin      (NihDBusProxy *upstart, JobCall *call,
+				   JobCallType type, char * const *env);
+static int    job_call_report     (JobCall *call, int tab);
+static void   job_call_reply_handler (JobCall *call, NihDBusMessage *message);
+static void   job_call_start_reply_handler (JobCall *call,
+					    NihDBusMessage *message,
+					    const char *instance);
+static void   job_call_error_handler (JobCall *call, NihDBusMessage *message);
+
+static size_t *job_timings_sort   (const uint64_t *times, size_t len)
+	__attribute__ ((warn_unused_result));
+static int    job_timing_cmp      (const void *a, const void *b);
+
 static void   job_class_condition_handler (void *data,
 		NihDBusMessage *message,
 		char ** const *value);
@@ -94,6 +157,9 @@ static void   job_class_show_emits (const void *parent,
 static void   job_class_show_conditions (NihDBusProxy *job_class_proxy,
 		const char *job_class_name);
 
+static void   job_class_show_scheduling (const void *parent,
+		NihDBusProxy *job_class_proxy);
+
 static void   eval_expr_tree (const char *expr, NihList **stack);
 
 static int    check_condition (const char *job_class,
@@ -125,14 +191,20 @@ int restart_action                       (NihCommand *command, char * const *arg
 int reload_action                        (NihCommand *command, char * const *args);
 int status_action                        (NihCommand *command, char * const *args);
 int list_action                          (NihCommand *command, char * const *args);
+int critical_path_action                 (NihCommand *command, char * const *args);
+int boot_trace_action                    (NihCommand *command, char * const *args);
 int emit_action                          (NihCommand *command, char * const *args);
+int events_action                        (NihCommand *command, char * const *args);
 int reload_configuration_action          (NihCommand *command, char * const *args);
 int version_action                       (NihCommand *command, char * const *args);
+int stats_action                         (NihCommand *command, char * const *args);
 int log_priority_action                  (NihCommand *command, char * const *args);
 int show_config_action                   (NihCommand *command, char * const *args);
 int check_config_action                  (NihCommand *command, char * const *args);
 int usage_action                         (NihCommand *command, char * const *args);
 int notify_disk_writeable_action         (NihCommand *command, char * const *args);
+int reopen_logs_action                   (NihCommand *command, char * const *args);
+int log_action                           (NihCommand *command, char * const *args);
 int notify_dbus_address_action           (NihCommand *command, char * const *args);
 int notify_cgroup_manager_address_action (NihCommand *command, char * const *args);
 int get_env_action                       (NihCommand *command, char * const *args);
@@ -141,6 +213,8 @@ int list_env_action                      (NihCommand *command, char * const *arg
 int unset_env_action                     (NihCommand *command, char * const *args);
 int reset_env_action                     (NihCommand *command, char * const *args);
 int list_sessions_action                 (NihCommand *command, char * const *args);
+int batch_action                         (NihCommand *command, char * const *args);
+int shell_action                         (NihCommand *command, char * const *args);
 
 /**
  * use_dbus:
@@ -189,6 +263,41 @@ const char *dest_address = DBUS_ADDRESS_UPSTART;
  **/
 int no_wait = FALSE;
 
+/**
+ * max_parallel:
+ *
+ * Most calls to have in progress at once when several jobs are named to
+ * the start, stop or restart commands, or zero for no limit.
+ **/
+int max_parallel = 0;
+
+/**
+ * output_format:
+ *
+ * Format that the start, stop and restart commands report the result
+ * of each job in: NULL or "text" for its status, "tab" for its name,
+ * "ok" or "failed" and its status or error separated by tabs.  The
+ * status, list and show-config commands accept "json" instead for one
+ * object per line.
+ **/
+char *output_format = NULL;
+
+/**
+ * show_timings:
+ *
+ * If TRUE, the status command also outputs the start-up latency trace
+ * of the job.
+ **/
+int show_timings = FALSE;
+
+/**
+ * show_resources:
+ *
+ * If TRUE, the status command also outputs the resources used by the
+ * processes of the instance and of every instance of the job.
+ **/
+int show_resources = FALSE;
+
 /**
  * enumerate_events:
  *
@@ -239,6 +348,61 @@ CheckConfigData check_config_data;
  **/
 int apply_globally = FALSE;
 
+/**
+ * logs_dir:
+ *
+ * Directory the log command reads job output from, or NULL for the
+ * same default as the init daemon.
+ **/
+char *logs_dir = NULL;
+
+/**
+ * logs_since:
+ *
+ * If non-zero, the log command only outputs what jobs wrote in the last
+ * this many seconds.
+ **/
+int logs_since = 0;
+
+/**
+ * logs_follow:
+ *
+ * If TRUE, the log command continues to output job output as it is
+ * written.
+ **/
+int logs_follow = FALSE;
+
+/**
+ * events_name:
+ *
+ * If not NULL, the events command only outputs events of this name.
+ **/
+char *events_name = NULL;
+
+/**
+ * events_since:
+ *
+ * If non-zero, the events command only outputs events emitted in the
+ * last this many seconds.
+ **/
+int events_since = 0;
+
+/**
+ * batch_json:
+ *
+ * If TRUE, the batch and shell commands output the result of each
+ * command as a line of JSON.
+ **/
+int batch_json = FALSE;
+
+/**
+ * batch_connection:
+ *
+ * Connection to the init daemon shared by the commands run by the batch
+ * and shell commands, or NULL when not running them.
+ **/
+static DBusConnection *batch_connection = NULL;
+
 /**
  * NihOption setter function to handle selection of appropriate D-Bus
  * bus.
@@ -315,6 +479,8 @@ error:
  * Opens a connection to the init daemon and returns a proxy to the manager
  * object.  If @dest_name is not NULL, a connection is instead opened to
  * the system bus and the proxy linked to the well-known name given.
+ * While the batch or shell command is running commands, the proxy
+ * instead uses the connection it opened.
  *
  * Error messages are output to standard error.
  *
@@ -333,6 +499,26 @@ upstart_open (const void *parent)
 	NihDBusProxy *  upstart;
 	char * user_addr;
 
+	/* Commands run by batch share its connection */
+	if (batch_connection) {
+		upstart = nih_dbus_proxy_new (parent, batch_connection,
+					      dest_name, DBUS_PATH_UPSTART,
+					      NULL, NULL);
+		if (! upstart) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_error ("%s", err->message);
+			nih_free (err);
+
+			return NULL;
+		}
+
+		upstart->auto_start = FALSE;
+
+		return upstart;
+	}
+
 	user_addr = getenv ("UPSTART_SESSION");
 
 	if (user_addr && user_addr[0] && dbus_bus_type < 0) {
@@ -534,206 +720,1020 @@ job_status (const void *  parent,
 }
 
 /**
- * job_usage:
- * @parent: parent object,
- * @job_class_proxy: D-Bus proxy for job class,
- * @job_class_name: Name of job class.
+ * job_state_status:
+ * @parent: parent object for new string,
+ * @state: entry from GetAllJobStates reply.
+ *
+ * Constructs a string defining the status of the instance described by
+ * @state in the same form as job_status(), without needing any further
+ * calls to the remote objects.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned string.  When all parents
+ * of the returned string are freed, the returned string will also be
+ * freed.
  *
- * Display usage of job class.
- * 
  * Returns: newly allocated string or NULL on raised error.
  **/
-char *
-job_usage (const void *parent, NihDBusProxy *job_class_proxy)
+static char *
+job_state_status (const void *                               parent,
+		  const UpstartGetAllJobStatesStatesElement *state)
 {
-	char             *usage = NULL;
+	char *str = NULL;
 
-	nih_assert (job_class_proxy);
+	nih_assert (state != NULL);
 
-	if (job_class_get_usage_sync (parent, job_class_proxy, &usage) < 0) {
-		return NULL;
+	if (*state->item1) {
+		str = nih_sprintf (parent, "%s (%s) %s/%s",
+				   state->item0, state->item1,
+				   state->item2, state->item3);
+	} else {
+		str = nih_sprintf (parent, "%s %s/%s",
+				   state->item0, state->item2, state->item3);
 	}
+	if (! str)
+		nih_return_no_memory_error (NULL);
 
-	return usage;
+	/* As with job_status(), the first process is the one shown
+	 * alongside the state with a prefix if it's not one of the
+	 * standard processes, and any others get a line each.
+	 */
+	for (size_t i = 0; state->item4[i] && (i < state->item5_len); i++) {
+		const char *name = state->item4[i];
+		int32_t     pid = state->item5[i];
+		char *      ret;
+
+		if (i) {
+			ret = nih_strcat_sprintf (&str, parent, "\n\t%s process %d",
+						  name, pid);
+		} else if (strcmp (name, "main")
+			   && strcmp (name, "pre-start")
+			   && strcmp (name, "post-stop")) {
+			ret = nih_strcat_sprintf (&str, parent, ", (%s) process %d",
+						  name, pid);
+		} else {
+			ret = nih_strcat_sprintf (&str, parent, ", process %d",
+						  pid);
+		}
+
+		if (! ret) {
+			nih_error_raise_no_memory ();
+			nih_free (str);
+			return NULL;
+		}
+	}
+
+	return str;
 }
 
 /**
- * start_action:
- * @command: NihCommand invoked,
- * @args: command-line arguments.
+ * output_json:
+ * @command: name of command.
  *
- * This function is called for the "start" command.
+ * Checks the output_format requested of the status, list or show-config
+ * command.
  *
- * Returns: command exit status.
+ * Returns: TRUE for JSON output, FALSE for text or -1 if the format
+ * is not known.
  **/
-int
-start_action (NihCommand *  command,
-	      char * const *args)
+static int
+output_json (const char *command)
 {
-	nih_local NihDBusProxy *upstart = NULL;
-	const char *            upstart_job = NULL;
-	const char *            upstart_instance = NULL;
-	nih_local char *        job_class_path = NULL;
-	nih_local NihDBusProxy *job_class = NULL;
-	nih_local char *        job_path = NULL;
-	nih_local NihDBusProxy *job = NULL;
-	DBusPendingCall *       pending_call;
-	int                     ret = 1;
-	NihError *              err;
-
 	nih_assert (command != NULL);
-	nih_assert (args != NULL);
-
-	if (args[0]) {
-		upstart_job = args[0];
-	} else {
-		upstart_job = getenv ("UPSTART_JOB");
-		upstart_instance = getenv ("UPSTART_INSTANCE");
-
-		if (! (upstart_job && upstart_instance)) {
-			fprintf (stderr, _("%s: missing job name\n"), program_name);
-			nih_main_suggest_help ();
-			return 1;
-		}
-	}
 
-	upstart = upstart_open (NULL);
-	if (! upstart)
-		return 1;
+	if ((! output_format) || (! strcmp (output_format, "text")))
+		return FALSE;
 
-	/* Obtain a proxy to the job */
-	if (upstart_get_job_by_name_sync (NULL, upstart, upstart_job,
-					  &job_class_path) < 0)
-		goto error;
+	if (! strcmp (output_format, "json"))
+		return TRUE;
 
-	job_class = nih_dbus_proxy_new (NULL, upstart->connection,
-					upstart->name, job_class_path,
-					NULL, NULL);
-	if (! job_class)
-		goto error;
+	fprintf (stderr, _("%s: %s: unknown output format: %s\n"),
+		 program_name, command, output_format);
+	nih_main_suggest_help ();
 
-	job_class->auto_start = FALSE;
+	return -1;
+}
 
-	/* When called from a job handler, we directly change the goal
-	 * so we need the instance.  These calls are always made without
-	 * waiting, since otherwise we'd block the job we're called from.
-	 */
-	if (upstart_instance) {
-		if (job_class_get_instance_by_name_sync (NULL, job_class,
-							 upstart_instance,
-							 &job_path) < 0)
-			goto error;
+/**
+ * json_string:
+ * @parent: parent object for new string,
+ * @str: string to quote.
+ *
+ * Returns: newly allocated JSON string literal for @str.
+ **/
+static char *
+json_string (const void *parent,
+	     const char *str)
+{
+	char *json;
 
-		job = nih_dbus_proxy_new (NULL, upstart->connection,
-					  upstart->name, job_path,
-					  NULL, NULL);
-		if (! job)
-			goto error;
+	nih_assert (str != NULL);
 
-		job->auto_start = FALSE;
+	json = NIH_MUST (nih_strdup (parent, "\""));
 
-		pending_call = job_start (job, FALSE,
-					  (JobStartReply)reply_handler,
-					  error_handler, &ret,
-					  NIH_DBUS_TIMEOUT_NEVER);
-		if (! pending_call)
-			goto error;
-	} else {
-		/* job_path is nih_local, so whatever gets filled in will
-		 * be automatically freed.
-		 */
-		pending_call = job_class_start (job_class, &args[1], (! no_wait),
-						(JobClassStartReply)start_reply_handler,
-						error_handler, &job_path,
-						NIH_DBUS_TIMEOUT_NEVER);
-		if (! pending_call)
-			goto error;
+	for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+		if ((*p == '"') || (*p == '\\')) {
+			NIH_MUST (nih_strcat_sprintf (&json, parent, "\\%c", *p));
+		} else if (*p == '\n') {
+			NIH_MUST (nih_strcat (&json, parent, "\\n"));
+		} else if (*p == '\t') {
+			NIH_MUST (nih_strcat (&json, parent, "\\t"));
+		} else if (*p < 0x20) {
+			NIH_MUST (nih_strcat_sprintf (&json, parent, "\\u%04x", *p));
+		} else {
+			NIH_MUST (nih_strncat (&json, parent, (const char *)p, 1));
+		}
 	}
 
-	dbus_pending_call_block (pending_call);
-	dbus_pending_call_unref (pending_call);
+	NIH_MUST (nih_strcat (&json, parent, "\""));
 
-	/* Make sure we got a valid job path, and in the case of the instance
-	 * path, no error message.  Then display the current job status.
-	 */
-	if (job_path && ((job == NULL) || (ret == 0))) {
-		nih_local char *status = NULL;
+	return json;
+}
 
-		if (! job) {
-			job = NIH_SHOULD (nih_dbus_proxy_new (
-						  NULL, upstart->connection,
-						  upstart->name, job_path,
-						  NULL, NULL));
-			if (! job)
-				goto error;
+/**
+ * job_state_json:
+ * @parent: parent object for new string,
+ * @state: entry from GetAllJobStates reply.
+ *
+ * Constructs a single line JSON object describing the instance in
+ * @state, with its processes keyed by name.
+ *
+ * Returns: newly allocated string.
+ **/
+static char *
+job_state_json (const void *                               parent,
+		const UpstartGetAllJobStatesStatesElement *state)
+{
+	nih_local char *job = NULL;
+	nih_local char *instance = NULL;
+	char           *json;
 
-			job->auto_start = FALSE;
-		}
+	nih_assert (state != NULL);
 
-		status = NIH_SHOULD (job_status (NULL, job_class, job));
-		if (! status)
-			goto error;
+	job = json_string (NULL, state->item0);
+	instance = json_string (NULL, state->item1);
 
-		nih_message ("%s", status);
+	json = NIH_MUST (nih_sprintf (parent, "{ \"job\": %s, \"instance\": %s, "
+				      "\"goal\": \"%s\", \"state\": \"%s\", "
+				      "\"processes\": {",
+				      job, instance, state->item2, state->item3));
 
-		ret = 0;
-	} else {
-		ret = 1;
-	}
+	for (size_t i = 0; state->item4[i] && (i < state->item5_len); i++) {
+		nih_local char *name = NULL;
 
-	return ret;
+		name = json_string (NULL, state->item4[i]);
+		NIH_MUST (nih_strcat_sprintf (&json, parent, "%s %s: %d",
+					      i ? "," : "", name,
+					      state->item5[i]));
+	}
 
-error:
-	err = nih_error_get ();
-	nih_error ("%s", err->message);
-	nih_free (err);
+	NIH_MUST (nih_strcat (&json, parent, " } }"));
 
-	return 1;
+	return json;
 }
 
-
 /**
- * stop_action:
- * @command: NihCommand invoked,
- * @args: command-line arguments.
+ * rc_scripts_read:
+ * @parent: parent object for new list.
  *
- * This function is called for the "stop" command.
+ * Reads the state of the last run of rc scripts written by upstart-rc,
+ * if there's been one; these only exist for the system init daemon.
  *
- * Returns: command exit status.
+ * Returns: newly allocated list of RcScript or NULL if there are none.
  **/
-int
-stop_action (NihCommand *  command,
-	     char * const *args)
+static NihList *
+rc_scripts_read (const void *parent)
 {
-	nih_local NihDBusProxy *upstart = NULL;
-	const char *            upstart_job = NULL;
-	const char *            upstart_instance = NULL;
-	nih_local char *        job_class_path = NULL;
-	nih_local NihDBusProxy *job_class = NULL;
-	nih_local char *        job_path = NULL;
-	nih_local NihDBusProxy *job = NULL;
-	DBusPendingCall *       pending_call;
-	int                     ret = 1;
-	NihError *              err;
+	NihList    *scripts;
+	const char *path;
 
-	nih_assert (command != NULL);
-	nih_assert (args != NULL);
+	if (user_mode)
+		return NULL;
 
-	if (args[0]) {
-		upstart_job = args[0];
-	} else {
-		upstart_job = getenv ("UPSTART_JOB");
-		upstart_instance = getenv ("UPSTART_INSTANCE");
+	path = getenv (RC_STATE_ENV);
+	if (! path)
+		path = RC_STATE_FILE;
 
-		if (! (upstart_job && upstart_instance)) {
-			fprintf (stderr, _("%s: missing job name\n"), program_name);
-			nih_main_suggest_help ();
-			return 1;
-		}
-	}
+	scripts = rc_state_read (parent, path);
+	if (! scripts)
+		nih_free (nih_error_get ());
 
-	upstart = upstart_open (NULL);
-	if (! upstart)
+	return scripts;
+}
+
+/**
+ * rc_script_status:
+ * @parent: parent object for new string,
+ * @script: script from the last rc run,
+ * @json: TRUE for a JSON object.
+ *
+ * Constructs a string describing @script as a pseudo-job named after it
+ * in the "rc/" namespace, its action standing for the goal, in the same
+ * form as job_state_status() or job_state_json().
+ *
+ * Returns: newly allocated string.
+ **/
+static char *
+rc_script_status (const void *    parent,
+		  const RcScript *script,
+		  int             json)
+{
+	nih_local char *name = NULL;
+	nih_local char *job = NULL;
+	char           *str;
+
+	nih_assert (script != NULL);
+
+	name = NIH_MUST (nih_sprintf (NULL, "rc/%s", script->name));
+
+	if (! json) {
+		str = NIH_MUST (nih_sprintf (parent, "%s %s/%s", name,
+					     script->action,
+					     rc_state_name (script->state)));
+		if (script->state == RC_RUNNING)
+			NIH_MUST (nih_strcat_sprintf (&str, parent,
+						      ", process %d",
+						      (int)script->pid));
+
+		return str;
+	}
+
+	job = json_string (NULL, name);
+
+	str = NIH_MUST (nih_sprintf (parent, "{ \"job\": %s, \"instance\": \"\", "
+				     "\"goal\": \"%s\", \"state\": \"%s\", "
+				     "\"processes\": {",
+				     job, script->action,
+				     rc_state_name (script->state)));
+	if (script->state == RC_RUNNING)
+		NIH_MUST (nih_strcat_sprintf (&str, parent, " \"main\": %d",
+					      (int)script->pid));
+
+	NIH_MUST (nih_strcat (&str, parent, " } }"));
+
+	return str;
+}
+
+/**
+ * rc_list:
+ * @json: TRUE for JSON output.
+ *
+ * Outputs the status of each script of the last rc run after the jobs
+ * of the list command.
+ **/
+static void
+rc_list (int json)
+{
+	nih_local NihList *scripts = NULL;
+
+	scripts = rc_scripts_read (NULL);
+	if (! scripts)
+		return;
+
+	NIH_LIST_FOREACH (scripts, iter) {
+		nih_local char *status = NULL;
+
+		status = rc_script_status (NULL, (RcScript *)iter, json);
+		nih_message ("%s", status);
+	}
+}
+
+/**
+ * rc_trace_splice:
+ * @parent: parent object for new string,
+ * @trace: boot trace from the init daemon.
+ *
+ * Adds a complete event for each rc script that has been started in the
+ * last run to @trace, on a process of their own with a thread for each
+ * script; their times are on the same clock as the init daemon's.  The
+ * events are inserted at the start of the "traceEvents" array, leaving
+ * @trace as it is if it doesn't have one.
+ *
+ * Returns: newly allocated string.
+ **/
+static char *
+rc_trace_splice (const void *parent,
+		 const char *trace)
+{
+	nih_local NihList *scripts = NULL;
+	nih_local char *   events = NULL;
+	const char *       array;
+	int                tid = 0;
+
+	nih_assert (trace != NULL);
+
+	array = strstr (trace, "\"traceEvents\": [");
+	scripts = rc_scripts_read (NULL);
+	if ((! array) || (! scripts))
+		return NIH_MUST (nih_strdup (parent, trace));
+
+	array += strlen ("\"traceEvents\": [");
+
+	events = NIH_MUST (nih_sprintf (NULL, " { \"name\": \"process_name\", "
+					"\"ph\": \"M\", \"pid\": %d, "
+					"\"tid\": 0, \"args\": "
+					"{ \"name\": \"rc\" } },",
+					RC_TRACE_PID));
+
+	NIH_LIST_FOREACH (scripts, iter) {
+		RcScript *      script = (RcScript *)iter;
+		nih_local char *name = NULL;
+		uint64_t        finished;
+
+		if (! script->started)
+			continue;
+
+		finished = script->finished ?: script->started;
+		name = json_string (NULL, script->name);
+		tid++;
+
+		NIH_MUST (nih_strcat_sprintf (&events, NULL,
+					      " { \"name\": \"thread_name\", "
+					      "\"ph\": \"M\", \"pid\": %d, "
+					      "\"tid\": %d, \"args\": "
+					      "{ \"name\": %s } },"
+					      " { \"name\": %s, \"cat\": \"rc\", "
+					      "\"ph\": \"X\", \"ts\": %" PRIu64 ", "
+					      "\"dur\": %" PRIu64 ", \"pid\": %d, "
+					      "\"tid\": %d, \"args\": "
+					      "{ \"action\": \"%s\", "
+					      "\"state\": \"%s\" } },",
+					      RC_TRACE_PID, tid, name, name,
+					      script->started,
+					      finished - script->started,
+					      RC_TRACE_PID, tid, script->action,
+					      rc_state_name (script->state)));
+	}
+
+	/* Drop the last separator if the array was empty to begin with */
+	while (*array == ' ')
+		array++;
+	if (*array == ']')
+		events[strlen (events) - 1] = ' ';
+
+	return NIH_MUST (nih_sprintf (parent, "%.*s%s%s",
+				      (int)(array - trace), trace, events,
+				      array));
+}
+
+/**
+ * job_condition_json:
+ * @parent: parent object for new string,
+ * @condition: start on or stop on condition in reverse polish notation.
+ *
+ * Converts @condition into the same bracketed form that show-config
+ * prints, as a JSON string literal.
+ *
+ * Returns: newly allocated string, "null" if there is no condition.
+ **/
+static char *
+job_condition_json (const void *   parent,
+		    char ** const *condition)
+{
+	nih_local char **stack = NULL;
+	size_t           len = 0;
+	size_t           depth = 0;
+
+	for (char ** const *variant = condition;
+	     variant && *variant && **variant; variant++)
+		len++;
+
+	if (! len)
+		return NIH_MUST (nih_strdup (parent, "null"));
+
+	stack = NIH_MUST (nih_alloc (NULL, sizeof (char *) * len));
+
+	for (char ** const *variant = condition;
+	     variant && *variant && **variant; variant++) {
+		const char *token = **variant;
+		char       *expr;
+
+		if (IS_OPERATOR (token)) {
+			if (depth < 2)
+				continue;
+
+			expr = NIH_MUST (nih_sprintf (stack, "(%s %s %s)",
+						      stack[depth - 2],
+						      IS_OP_AND (token) ? "and" : "or",
+						      stack[depth - 1]));
+			stack[depth - 2] = expr;
+			depth--;
+		} else {
+			expr = NIH_MUST (nih_strdup (stack, token));
+
+			for (char **arg = *variant + 1; *arg && **arg; arg++)
+				NIH_MUST (nih_strcat_sprintf (&expr, stack,
+							      " %s", *arg));
+
+			stack[depth++] = expr;
+		}
+	}
+
+	if (! depth)
+		return NIH_MUST (nih_strdup (parent, "null"));
+
+	return json_string (parent, stack[depth - 1]);
+}
+
+/**
+ * job_class_json:
+ * @parent: parent object for new string,
+ * @props: properties of job class.
+ *
+ * Constructs a single line JSON object describing the job configuration
+ * in @props, as show-config does in text.
+ *
+ * Returns: newly allocated string.
+ **/
+static char *
+job_class_json (const void *              parent,
+		const JobClassProperties *props)
+{
+	nih_local char *name = NULL;
+	nih_local char *description = NULL;
+	nih_local char *author = NULL;
+	nih_local char *version = NULL;
+	nih_local char *usage = NULL;
+	nih_local char *start_on = NULL;
+	nih_local char *stop_on = NULL;
+	char           *json;
+
+	nih_assert (props != NULL);
+
+	name = json_string (NULL, props->name);
+	description = json_string (NULL, props->description);
+	author = json_string (NULL, props->author);
+	version = json_string (NULL, props->version);
+	usage = json_string (NULL, props->usage);
+	start_on = job_condition_json (NULL, props->start_on);
+	stop_on = job_condition_json (NULL, props->stop_on);
+
+	json = NIH_MUST (nih_sprintf (parent, "{ \"name\": %s, "
+				      "\"description\": %s, \"author\": %s, "
+				      "\"version\": %s, \"usage\": %s, "
+				      "\"start_on\": %s, \"stop_on\": %s, "
+				      "\"emits\": [",
+				      name, description, author, version,
+				      usage, start_on, stop_on));
+
+	for (char **emits = props->emits; emits && *emits; emits++) {
+		nih_local char *event = NULL;
+
+		event = json_string (NULL, *emits);
+		NIH_MUST (nih_strcat_sprintf (&json, parent, "%s %s",
+					      (emits == props->emits) ? "" : ",",
+					      event));
+	}
+
+	NIH_MUST (nih_strcat (&json, parent, " ], \"scheduling\": ["));
+
+	for (char **stanza = props->scheduling; stanza && *stanza; stanza++) {
+		nih_local char *value = NULL;
+
+		value = json_string (NULL, *stanza);
+		NIH_MUST (nih_strcat_sprintf (&json, parent, "%s %s",
+					      (stanza == props->scheduling) ? "" : ",",
+					      value));
+	}
+
+	NIH_MUST (nih_strcat (&json, parent, " ] }"));
+
+	return json;
+}
+
+/**
+ * job_timings_sort:
+ * @times: array of times,
+ * @len: number of elements in @times.
+ *
+ * Returns: newly allocated array of indexes into @times in ascending
+ * order of time, or NULL on insufficient memory.
+ **/
+static size_t *
+job_timings_sort (const uint64_t *times,
+		  size_t          len)
+{
+	size_t *order;
+
+	nih_assert (times != NULL);
+
+	order = nih_alloc (NULL, sizeof (size_t) * (len + 1));
+	if (! order)
+		return NULL;
+
+	/* Only a handful of transitions are recorded, so a simple
+	 * insertion sort will do.
+	 */
+	for (size_t i = 0; i < len; i++) {
+		size_t j = i;
+
+		while (j && times[order[j - 1]] > times[i]) {
+			order[j] = order[j - 1];
+			j--;
+		}
+
+		order[j] = i;
+	}
+
+	return order;
+}
+
+/**
+ * job_timings:
+ * @parent: parent object for new string,
+ * @job: proxy for remote instance object.
+ *
+ * Queries the start-up latency trace of the instance @job and constructs
+ * a string containing a line for each state entered and process forked
+ * or exec'd, in the order they happened, giving the time since boot and
+ * the time spent until the next one.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned string.  When all parents
+ * of the returned string are freed, the returned string will also be
+ * freed.
+ *
+ * Returns: newly allocated string or NULL on raised error.
+ **/
+char *
+job_timings (const void *  parent,
+	     NihDBusProxy *job)
+{
+	nih_local char **   names = NULL;
+	nih_local uint64_t *times = NULL;
+	nih_local size_t *  order = NULL;
+	size_t              len = 0;
+	char *              str;
+
+	nih_assert (job != NULL);
+
+	if (job_get_timings_sync (NULL, job, &names, &times, &len) < 0)
+		return NULL;
+
+	str = nih_strdup (parent, "");
+	if (! str)
+		nih_return_no_memory_error (NULL);
+
+	if (! len)
+		return str;
+
+	order = job_timings_sort (times, len);
+	if (! order) {
+		nih_error_raise_no_memory ();
+		nih_free (str);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		uint64_t time = times[order[i]];
+
+		if (! nih_strcat_sprintf (&str, parent, "\t%-20s %10.3fs",
+					  names[order[i]], time / 1000000.0)) {
+			nih_error_raise_no_memory ();
+			nih_free (str);
+			return NULL;
+		}
+
+		if ((i + 1 < len)
+		    && (! nih_strcat_sprintf (&str, parent, " +%.3fms",
+					      (times[order[i + 1]] - time) / 1000.0))) {
+			nih_error_raise_no_memory ();
+			nih_free (str);
+			return NULL;
+		}
+
+		if ((i + 1 < len) && (! nih_strcat (&str, parent, "\n"))) {
+			nih_error_raise_no_memory ();
+			nih_free (str);
+			return NULL;
+		}
+	}
+
+	return str;
+}
+
+/**
+ * job_resource_value:
+ * @parent: parent object for new string,
+ * @name: name of resource,
+ * @value: value of resource.
+ *
+ * Formats @value in the units of the resource @name.
+ *
+ * Returns: newly allocated string or NULL on insufficient memory.
+ **/
+static char *
+job_resource_value (const void *parent,
+		    const char *name,
+		    uint64_t    value)
+{
+	nih_assert (name != NULL);
+
+	if ((! strcmp (name, "user_time")) || (! strcmp (name, "system_time")))
+		return nih_sprintf (parent, "%.3fs", value / 1000000.0);
+
+	if (! strcmp (name, "max_rss"))
+		return nih_sprintf (parent, "%" PRIu64 "kB", value);
+
+	return nih_sprintf (parent, "%" PRIu64, value);
+}
+
+/**
+ * job_resources:
+ * @parent: parent object for new string,
+ * @job_class: proxy for remote job class object,
+ * @job: proxy for remote instance object.
+ *
+ * Queries the resources used by the processes of the instance @job and
+ * of every instance of @job_class, and constructs a string containing a
+ * line for each giving the value for the instance followed by that for
+ * the job.
+ *
+ * @job may be NULL in which case only the values for the job are
+ * given.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned string.  When all parents
+ * of the returned string are freed, the returned string will also be
+ * freed.
+ *
+ * Returns: newly allocated string or NULL on raised error.
+ **/
+char *
+job_resources (const void *  parent,
+	       NihDBusProxy *job_class,
+	       NihDBusProxy *job)
+{
+	nih_local JobClassResourcesElement **class_resources = NULL;
+	nih_local JobResourcesElement **     resources = NULL;
+	char *                               str;
+
+	nih_assert (job_class != NULL);
+
+	if (job_class_get_resources_sync (NULL, job_class,
+					  &class_resources) < 0)
+		return NULL;
+
+	if (job && (job_get_resources_sync (NULL, job, &resources) < 0))
+		return NULL;
+
+	str = nih_sprintf (parent, "\t%-20s %14s %14s", "resource",
+			   "instance", "job");
+	if (! str)
+		nih_return_no_memory_error (NULL);
+
+	for (JobClassResourcesElement **r = class_resources; r && *r; r++) {
+		nih_local char *instance_value = NULL;
+		nih_local char *class_value = NULL;
+
+		/* Resources are named, so that those of a newer daemon
+		 * simply appear; the instance has the same ones.
+		 */
+		for (JobResourcesElement **i = resources; i && *i; i++) {
+			if (strcmp ((*i)->item0, (*r)->item0))
+				continue;
+
+			instance_value = job_resource_value (NULL,
+							     (*i)->item0,
+							     (*i)->item1);
+			if (! instance_value)
+				goto error;
+
+			break;
+		}
+
+		class_value = job_resource_value (NULL, (*r)->item0,
+						  (*r)->item1);
+		if (! class_value)
+			goto error;
+
+		if (! nih_strcat_sprintf (&str, parent, "\n\t%-20s %14s %14s",
+					  (*r)->item0,
+					  instance_value ? instance_value : "-",
+					  class_value))
+			goto error;
+	}
+
+	return str;
+
+error:
+	nih_error_raise_no_memory ();
+	nih_free (str);
+	return NULL;
+}
+
+/**
+ * job_timing_summary:
+ * @parent: parent object for new structure,
+ * @job_class: proxy for remote job class object,
+ * @job: proxy for remote instance object,
+ * @timing: pointer for new structure.
+ *
+ * Queries the start-up latency trace of the instance @job and summarises
+ * it into a JobTiming structure stored in @timing, which is set to NULL
+ * if the instance has not reached the running state since it was last
+ * started.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+job_timing_summary (const void *  parent,
+		    NihDBusProxy *job_class,
+		    NihDBusProxy *job,
+		    JobTiming **  timing)
+{
+	nih_local char *    job_class_name = NULL;
+	nih_local char *    instance = NULL;
+	nih_local char **   names = NULL;
+	nih_local uint64_t *times = NULL;
+	nih_local size_t *  order = NULL;
+	size_t              len = 0;
+	ssize_t             starting = -1;
+	ssize_t             running = -1;
+	JobTiming *         new_timing;
+
+	nih_assert (job_class != NULL);
+	nih_assert (job != NULL);
+	nih_assert (timing != NULL);
+
+	*timing = NULL;
+
+	if (job_get_timings_sync (NULL, job, &names, &times, &len) < 0)
+		return -1;
+
+	order = job_timings_sort (times, len);
+	if (! order)
+		nih_return_no_memory_error (-1);
+
+	for (size_t i = 0; i < len; i++) {
+		if (! strcmp (names[order[i]], "starting")) {
+			starting = i;
+		} else if (! strcmp (names[order[i]], "running")) {
+			running = i;
+		}
+	}
+
+	if ((starting < 0) || (running < starting))
+		return 0;
+
+	if (job_class_get_name_sync (NULL, job_class, &job_class_name) < 0)
+		return -1;
+
+	if (job_get_name_sync (NULL, job, &instance) < 0)
+		return -1;
+
+	new_timing = nih_new (parent, JobTiming);
+	if (! new_timing)
+		nih_return_no_memory_error (-1);
+
+	if (*instance) {
+		new_timing->name = nih_sprintf (new_timing, "%s (%s)",
+						job_class_name, instance);
+	} else {
+		new_timing->name = nih_strdup (new_timing, job_class_name);
+	}
+
+	if (! new_timing->name) {
+		nih_free (new_timing);
+		nih_return_no_memory_error (-1);
+	}
+
+	new_timing->starting = times[order[starting]];
+	new_timing->running = times[order[running]];
+	new_timing->slowest = NULL;
+	new_timing->slowest_time = 0;
+
+	for (ssize_t i = starting; i < running; i++) {
+		uint64_t spent = times[order[i + 1]] - times[order[i]];
+
+		if (new_timing->slowest && (spent <= new_timing->slowest_time))
+			continue;
+
+		new_timing->slowest = names[order[i]];
+		new_timing->slowest_time = spent;
+	}
+
+	if (new_timing->slowest) {
+		new_timing->slowest = nih_strdup (new_timing,
+						  new_timing->slowest);
+		if (! new_timing->slowest) {
+			nih_free (new_timing);
+			nih_return_no_memory_error (-1);
+		}
+	}
+
+	*timing = new_timing;
+
+	return 0;
+}
+
+/**
+ * job_usage:
+ * @parent: parent object,
+ * @job_class_proxy: D-Bus proxy for job class,
+ * @job_class_name: Name of job class.
+ *
+ * Display usage of job class.
+ * 
+ * Returns: newly allocated string or NULL on raised error.
+ **/
+char *
+job_usage (const void *parent, NihDBusProxy *job_class_proxy)
+{
+	char             *usage = NULL;
+
+	nih_assert (job_class_proxy);
+
+	if (job_class_get_usage_sync (parent, job_class_proxy, &usage) < 0) {
+		return NULL;
+	}
+
+	return usage;
+}
+
+/**
+ * start_action:
+ * @command: NihCommand invoked,
+ * @args: command-line arguments.
+ *
+ * This function is called for the "start" command.
+ *
+ * Returns: command exit status.
+ **/
+int
+start_action (NihCommand *  command,
+	      char * const *args)
+{
+	nih_local NihDBusProxy *upstart = NULL;
+	const char *            upstart_job = NULL;
+	const char *            upstart_instance = NULL;
+	nih_local char *        job_class_path = NULL;
+	nih_local NihDBusProxy *job_class = NULL;
+	nih_local char *        job_path = NULL;
+	nih_local NihDBusProxy *job = NULL;
+	DBusPendingCall *       pending_call;
+	int                     ret = 1;
+	NihError *              err;
+
+	nih_assert (command != NULL);
+	nih_assert (args != NULL);
+
+	if (job_call_wanted (args))
+		return job_call_all (JOB_CALL_START, args);
+
+	if (args[0]) {
+		upstart_job = args[0];
+	} else {
+		upstart_job = getenv ("UPSTART_JOB");
+		upstart_instance = getenv ("UPSTART_INSTANCE");
+
+		if (! (upstart_job && upstart_instance)) {
+			fprintf (stderr, _("%s: missing job name\n"), program_name);
+			nih_main_suggest_help ();
+			return 1;
+		}
+	}
+
+	upstart = upstart_open (NULL);
+	if (! upstart)
+		return 1;
+
+	/* Obtain a proxy to the job */
+	if (upstart_get_job_by_name_sync (NULL, upstart, upstart_job,
+					  &job_class_path) < 0)
+		goto error;
+
+	job_class = nih_dbus_proxy_new (NULL, upstart->connection,
+					upstart->name, job_class_path,
+					NULL, NULL);
+	if (! job_class)
+		goto error;
+
+	job_class->auto_start = FALSE;
+
+	/* When called from a job handler, we directly change the goal
+	 * so we need the instance.  These calls are always made without
+	 * waiting, since otherwise we'd block the job we're called from.
+	 */
+	if (upstart_instance) {
+		if (job_class_get_instance_by_name_sync (NULL, job_class,
+							 upstart_instance,
+							 &job_path) < 0)
+			goto error;
+
+		job = nih_dbus_proxy_new (NULL, upstart->connection,
+					  upstart->name, job_path,
+					  NULL, NULL);
+		if (! job)
+			goto error;
+
+		job->auto_start = FALSE;
+
+		pending_call = job_start (job, FALSE,
+					  (JobStartReply)reply_handler,
+					  error_handler, &ret,
+					  NIH_DBUS_TIMEOUT_NEVER);
+		if (! pending_call)
+			goto error;
+	} else {
+		/* job_path is nih_local, so whatever gets filled in will
+		 * be automatically freed.
+		 */
+		pending_call = job_class_start (job_class, &args[1], (! no_wait),
+						(JobClassStartReply)start_reply_handler,
+						error_handler, &job_path,
+						NIH_DBUS_TIMEOUT_NEVER);
+		if (! pending_call)
+			goto error;
+	}
+
+	dbus_pending_call_block (pending_call);
+	dbus_pending_call_unref (pending_call);
+
+	/* Make sure we got a valid job path, and in the case of the instance
+	 * path, no error message.  Then display the current job status.
+	 */
+	if (job_path && ((job == NULL) || (ret == 0))) {
+		nih_local char *status = NULL;
+
+		if (! job) {
+			job = NIH_SHOULD (nih_dbus_proxy_new (
+						  NULL, upstart->connection,
+						  upstart->name, job_path,
+						  NULL, NULL));
+			if (! job)
+				goto error;
+
+			job->auto_start = FALSE;
+		}
+
+		status = NIH_SHOULD (job_status (NULL, job_class, job));
+		if (! status)
+			goto error;
+
+		nih_message ("%s", status);
+
+		ret = 0;
+	} else {
+		ret = 1;
+	}
+
+	return ret;
+
+error:
+	err = nih_error_get ();
+	nih_error ("%s", err->message);
+	nih_free (err);
+
+	return 1;
+}
+
+
+/**
+ * stop_action:
+ * @command: NihCommand invoked,
+ * @args: command-line arguments.
+ *
+ * This function is called for the "stop" command.
+ *
+ * Returns: command exit status.
+ **/
+int
+stop_action (NihCommand *  command,
+	     char * const *args)
+{
+	nih_local NihDBusProxy *upstart = NULL;
+	const char *            upstart_job = NULL;
+	const char *            upstart_instance = NULL;
+	nih_local char *        job_class_path = NULL;
+	nih_local NihDBusProxy *job_class = NULL;
+	nih_local char *        job_path = NULL;
+	nih_local NihDBusProxy *job = NULL;
+	DBusPendingCall *       pending_call;
+	int                     ret = 1;
+	NihError *              err;
+
+	nih_assert (command != NULL);
+	nih_assert (args != NULL);
+
+	if (job_call_wanted (args))
+		return job_call_all (JOB_CALL_STOP, args);
+
+	if (args[0]) {
+		upstart_job = args[0];
+	} else {
+		upstart_job = getenv ("UPSTART_JOB");
+		upstart_instance = getenv ("UPSTART_INSTANCE");
+
+		if (! (upstart_job && upstart_instance)) {
+			fprintf (stderr, _("%s: missing job name\n"), program_name);
+			nih_main_suggest_help ();
+			return 1;
+		}
+	}
+
+	upstart = upstart_open (NULL);
+	if (! upstart)
 		return 1;
 
 	/* Obtain a proxy to the job */
@@ -847,6 +1847,9 @@ restart_action (NihCommand *  command,
 	nih_assert (command != NULL);
 	nih_assert (args != NULL);
 
+	if (job_call_wanted (args))
+		return job_call_all (JOB_CALL_RESTART, args);
+
 	if (args[0]) {
 		upstart_job = args[0];
 	} else {
@@ -1093,13 +2096,27 @@ status_action (NihCommand *  command,
 	nih_local NihDBusProxy *job_class = NULL;
 	nih_local char *        job_path = NULL;
 	nih_local NihDBusProxy *job = NULL;
+	nih_local UpstartGetAllJobStatesStatesElement **states = NULL;
 	nih_local char *        status = NULL;
 	NihError *              err;
 	NihDBusError *          dbus_err;
+	int                     json;
 
 	nih_assert (command != NULL);
 	nih_assert (args != NULL);
 
+	json = output_json ("status");
+	if (json < 0)
+		return 1;
+
+	if (json && (show_timings || show_resources || (args[0] && args[1]))) {
+		fprintf (stderr, _("%s: --format json cannot be combined with "
+				   "--timings, --resources or KEY=VALUE\n"),
+			 program_name);
+		nih_main_suggest_help ();
+		return 1;
+	}
+
 	if (args[0]) {
 		upstart_job = args[0];
 	} else {
@@ -1117,6 +2134,72 @@ status_action (NihCommand *  command,
 	if (! upstart)
 		return 1;
 
+	/* JSON output describes every instance of the job, or just the
+	 * named one, from a single call; should it find none, looking up
+	 * the job raises the error if it doesn't exist.
+	 */
+	if (json) {
+		int found = FALSE;
+
+		if (upstart_get_all_job_states_sync (NULL, upstart, upstart_job,
+						     &states) < 0)
+			goto error;
+
+		for (UpstartGetAllJobStatesStatesElement **state = states;
+		     state && *state; state++) {
+			nih_local char *object = NULL;
+
+			if (strcmp ((*state)->item0, upstart_job)
+			    || (upstart_instance
+				&& strcmp ((*state)->item1, upstart_instance)))
+				continue;
+
+			object = job_state_json (NULL, *state);
+			nih_message ("%s", object);
+			found = TRUE;
+		}
+
+		if ((! found)
+		    && (upstart_get_job_by_name_sync (NULL, upstart, upstart_job,
+						      &job_class_path) < 0))
+			goto error;
+
+		return 0;
+	}
+
+	/* Where the instance is known by name, its status can be obtained
+	 * in a single call; otherwise, or if the job or instance doesn't
+	 * seem to exist, use the individual objects which expand the
+	 * instance name and raise the appropriate errors.
+	 */
+	if (! (show_timings || show_resources || args[1])) {
+		if (upstart_get_all_job_states_sync (NULL, upstart, upstart_job,
+						     &states) == 0) {
+			for (UpstartGetAllJobStatesStatesElement **state = states;
+			     state && *state; state++) {
+				if (strcmp ((*state)->item0, upstart_job)
+				    || strcmp ((*state)->item1,
+					       upstart_instance ? upstart_instance : ""))
+					continue;
+
+				status = job_state_status (NULL, *state);
+				if (! status)
+					goto error;
+
+				nih_message ("%s", status);
+
+				return 0;
+			}
+		} else {
+			dbus_err = (NihDBusError *)nih_error_get ();
+			if ((dbus_err->number != NIH_DBUS_ERROR)
+			    || strcmp (dbus_err->name, DBUS_ERROR_UNKNOWN_METHOD))
+				goto error;
+
+			nih_free (dbus_err);
+		}
+	}
+
 	/* Obtain a proxy to the job */
 	if (upstart_get_job_by_name_sync (NULL, upstart, upstart_job,
 					  &job_class_path) < 0)
@@ -1170,6 +2253,27 @@ status_action (NihCommand *  command,
 
 	nih_message ("%s", status);
 
+	if (show_timings && job) {
+		nih_local char *timings = NULL;
+
+		timings = job_timings (NULL, job);
+		if (! timings)
+			goto error;
+
+		if (*timings)
+			nih_message ("%s", timings);
+	}
+
+	if (show_resources) {
+		nih_local char *resources = NULL;
+
+		resources = job_resources (NULL, job_class, job);
+		if (! resources)
+			goto error;
+
+		nih_message ("%s", resources);
+	}
+
 	return 0;
 
 error:
@@ -1195,17 +2299,56 @@ list_action (NihCommand *  command,
 	     char * const *args)
 {
 	nih_local NihDBusProxy *upstart = NULL;
+	nih_local UpstartGetAllJobStatesStatesElement **states = NULL;
 	nih_local char **       job_class_paths = NULL;
 	NihError *              err;
 	NihDBusError *          dbus_err;
+	int                     json;
 
 	nih_assert (command != NULL);
 	nih_assert (args != NULL);
 
+	json = output_json ("list");
+	if (json < 0)
+		return 1;
+
 	upstart = upstart_open (NULL);
 	if (! upstart)
 		return 1;
 
+	/* Obtain the status of every job in a single call, falling back
+	 * to querying each job and instance in turn if this init daemon
+	 * predates the method; JSON output requires it.
+	 */
+	if (upstart_get_all_job_states_sync (NULL, upstart, "", &states) == 0) {
+		for (UpstartGetAllJobStatesStatesElement **state = states;
+		     state && *state; state++) {
+			nih_local char *status = NULL;
+
+			if (json) {
+				status = job_state_json (NULL, *state);
+			} else {
+				status = job_state_status (NULL, *state);
+				if (! status)
+					goto error;
+			}
+
+			nih_message ("%s", status);
+		}
+
+		rc_list (json);
+
+		return 0;
+	}
+
+	dbus_err = (NihDBusError *)nih_error_get ();
+	if (json
+	    || (dbus_err->number != NIH_DBUS_ERROR)
+	    || strcmp (dbus_err->name, DBUS_ERROR_UNKNOWN_METHOD))
+		goto error;
+
+	nih_free (dbus_err);
+
 	/* Obtain a list of jobs */
 	if (upstart_get_all_jobs_sync (NULL, upstart, &job_class_paths) < 0)
 		goto error;
@@ -1244,27 +2387,157 @@ list_action (NihCommand *  command,
 		if (! *job_paths) {
 			nih_local char *status = NULL;
 
-			status = job_status (NULL, job_class, NULL);
-			if (! status) {
-				dbus_err = (NihDBusError *)nih_error_get ();
-				if ((dbus_err->number != NIH_DBUS_ERROR)
-				    || strcmp (dbus_err->name, DBUS_ERROR_UNKNOWN_METHOD))
-					goto error;
+			status = job_status (NULL, job_class, NULL);
+			if (! status) {
+				dbus_err = (NihDBusError *)nih_error_get ();
+				if ((dbus_err->number != NIH_DBUS_ERROR)
+				    || strcmp (dbus_err->name, DBUS_ERROR_UNKNOWN_METHOD))
+					goto error;
+
+				nih_free (dbus_err);
+				continue;
+			}
+
+			nih_message ("%s", status);
+		}
+
+		/* Otherwise iterate the instances and output the status
+		 * of each.
+		 */
+		for (char **job_path = job_paths; job_path && *job_path;
+		     job_path++) {
+			nih_local NihDBusProxy *job = NULL;
+			nih_local char *        status = NULL;
+
+			job = nih_dbus_proxy_new (NULL, upstart->connection,
+						  upstart->name, *job_path,
+						  NULL, NULL);
+			if (! job)
+				goto error;
+
+			job->auto_start = FALSE;
+
+			status = job_status (NULL, job_class, job);
+			if (! status) {
+				dbus_err = (NihDBusError *)nih_error_get ();
+				if ((dbus_err->number != NIH_DBUS_ERROR)
+				    || strcmp (dbus_err->name, DBUS_ERROR_UNKNOWN_METHOD))
+					goto error;
+
+				nih_free (dbus_err);
+				continue;
+			}
+
+			nih_message ("%s", status);
+		}
+	}
+
+	rc_list (json);
+
+	return 0;
+
+error:
+	err = nih_error_get ();
+	nih_error ("%s", err->message);
+	nih_free (err);
+
+	return 1;
+}
+
+/**
+ * job_timing_cmp:
+ * @a: pointer to first JobTiming pointer,
+ * @b: pointer to second JobTiming pointer.
+ *
+ * qsort() comparison function to order JobTiming structures by the time
+ * they reached the running state.
+ *
+ * Returns: negative, zero or positive value as @a is before, at the same
+ * time as or after @b.
+ **/
+static int
+job_timing_cmp (const void *a,
+		const void *b)
+{
+	const JobTiming *timing_a = *(const JobTiming * const *)a;
+	const JobTiming *timing_b = *(const JobTiming * const *)b;
+
+	if (timing_a->running < timing_b->running) {
+		return -1;
+	} else if (timing_a->running > timing_b->running) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+/**
+ * critical_path_action:
+ * @command: NihCommand invoked,
+ * @args: command-line arguments.
+ *
+ * This function is called for the "critical-path" command.
+ *
+ * Works backwards from the instance that reached the running state last,
+ * each time stepping to the instance that reached the running state most
+ * recently before the current one started, and outputs that chain along
+ * with where each instance spent most of its start-up time.
+ *
+ * Returns: command exit status.
+ **/
+int
+critical_path_action (NihCommand *  command,
+		      char * const *args)
+{
+	nih_local NihDBusProxy *upstart = NULL;
+	nih_local char **       job_class_paths = NULL;
+	nih_local JobTiming **  timings = NULL;
+	nih_local JobTiming **  path = NULL;
+	size_t                  num_timings = 0;
+	size_t                  num_path = 0;
+	NihError *              err;
+	NihDBusError *          dbus_err;
+
+	nih_assert (command != NULL);
+	nih_assert (args != NULL);
+
+	upstart = upstart_open (NULL);
+	if (! upstart)
+		return 1;
+
+	if (upstart_get_all_jobs_sync (NULL, upstart, &job_class_paths) < 0)
+		goto error;
+
+	for (char **job_class_path = job_class_paths;
+	     job_class_path && *job_class_path; job_class_path++) {
+		nih_local NihDBusProxy *job_class = NULL;
+		nih_local char **       job_paths = NULL;
+
+		job_class = nih_dbus_proxy_new (NULL, upstart->connection,
+						upstart->name, *job_class_path,
+						NULL, NULL);
+		if (! job_class)
+			goto error;
+
+		job_class->auto_start = FALSE;
 
-				nih_free (dbus_err);
-				continue;
-			}
+		/* Catch the job going away between calls */
+		if (job_class_get_all_instances_sync (NULL, job_class,
+						      &job_paths) < 0) {
+			dbus_err = (NihDBusError *)nih_error_get ();
+			if ((dbus_err->number != NIH_DBUS_ERROR)
+			    || strcmp (dbus_err->name, DBUS_ERROR_UNKNOWN_METHOD))
+				goto error;
 
-			nih_message ("%s", status);
+			nih_free (dbus_err);
+			continue;
 		}
 
-		/* Otherwise iterate the instances and output the status
-		 * of each.
-		 */
 		for (char **job_path = job_paths; job_path && *job_path;
 		     job_path++) {
 			nih_local NihDBusProxy *job = NULL;
-			nih_local char *        status = NULL;
+			JobTiming *             timing = NULL;
+			JobTiming **            tmp;
 
 			job = nih_dbus_proxy_new (NULL, upstart->connection,
 						  upstart->name, *job_path,
@@ -1274,8 +2547,8 @@ list_action (NihCommand *  command,
 
 			job->auto_start = FALSE;
 
-			status = job_status (NULL, job_class, job);
-			if (! status) {
+			if (job_timing_summary (NULL, job_class, job,
+						&timing) < 0) {
 				dbus_err = (NihDBusError *)nih_error_get ();
 				if ((dbus_err->number != NIH_DBUS_ERROR)
 				    || strcmp (dbus_err->name, DBUS_ERROR_UNKNOWN_METHOD))
@@ -1285,10 +2558,99 @@ list_action (NihCommand *  command,
 				continue;
 			}
 
-			nih_message ("%s", status);
+			if (! timing)
+				continue;
+
+			tmp = nih_realloc (timings, NULL, sizeof (JobTiming *)
+					   * (num_timings + 1));
+			if (! tmp) {
+				nih_free (timing);
+				nih_error_raise_no_memory ();
+				goto error;
+			}
+
+			timings = tmp;
+			timings[num_timings++] = timing;
+			nih_ref (timing, timings);
+			nih_unref (timing, NULL);
 		}
 	}
 
+	if (! num_timings)
+		return 0;
+
+	qsort (timings, num_timings, sizeof (JobTiming *), job_timing_cmp);
+
+	path = nih_alloc (NULL, sizeof (JobTiming *) * num_timings);
+	if (! path) {
+		nih_error_raise_no_memory ();
+		goto error;
+	}
+
+	/* Walk back from the last instance to reach the running state */
+	for (ssize_t i = num_timings - 1; i >= 0; ) {
+		JobTiming *timing = timings[i];
+
+		path[num_path++] = timing;
+
+		while ((--i >= 0) && (timings[i]->running > timing->starting))
+			;
+	}
+
+	while (num_path--) {
+		JobTiming *timing = path[num_path];
+
+		nih_message ("%10.3fs %-30s +%.3fms",
+			     timing->running / 1000000.0, timing->name,
+			     (timing->running - timing->starting) / 1000.0);
+
+		if (timing->slowest)
+			nih_message ("%11s %s +%.3fms", "",
+				     timing->slowest,
+				     timing->slowest_time / 1000.0);
+	}
+
+	return 0;
+
+error:
+	err = nih_error_get ();
+	nih_error ("%s", err->message);
+	nih_free (err);
+
+	return 1;
+}
+
+/**
+ * boot_trace_action:
+ * @command: NihCommand invoked,
+ * @args: command-line arguments.
+ *
+ * This function is called for the "boot-trace" command.
+ *
+ * Returns: command exit status.
+ **/
+int
+boot_trace_action (NihCommand *  command,
+		   char * const *args)
+{
+	nih_local NihDBusProxy *upstart = NULL;
+	nih_local char *        trace = NULL;
+	nih_local char *        spliced = NULL;
+	NihError *              err;
+
+	nih_assert (command != NULL);
+	nih_assert (args != NULL);
+
+	upstart = upstart_open (NULL);
+	if (! upstart)
+		return 1;
+
+	if (upstart_get_boot_trace_sync (NULL, upstart, &trace) < 0)
+		goto error;
+
+	spliced = rc_trace_splice (NULL, trace);
+	nih_message ("%s", spliced);
+
 	return 0;
 
 error:
@@ -1316,10 +2678,15 @@ show_config_action (NihCommand *  command,
 	nih_local char         **job_class_paths = NULL;
 	const char              *upstart_job_class = NULL;
 	NihError                *err;
+	int                      json;
 
 	nih_assert (command != NULL);
 	nih_assert (args != NULL);
 
+	json = output_json ("show-config");
+	if (json < 0)
+		return 1;
+
 	upstart = upstart_open (NULL);
 	if (! upstart)
 		return 1;
@@ -1352,6 +2719,24 @@ show_config_action (NihCommand *  command,
 
 		job_class->auto_start = FALSE;
 
+		/* Obtain every property of the job in a single call, and
+		 * write it out straight away so that output starts before
+		 * the last job has been asked.
+		 */
+		if (json) {
+			nih_local JobClassProperties *props = NULL;
+			nih_local char *              object = NULL;
+
+			if (job_class_get_all_sync (NULL, job_class, &props) < 0)
+				goto error;
+
+			object = job_class_json (NULL, props);
+			nih_message ("%s", object);
+			fflush (stdout);
+
+			continue;
+		}
+
 		if (job_class_get_name_sync (NULL, job_class, &job_class_name) < 0)
 			goto error;
 
@@ -1361,6 +2746,9 @@ show_config_action (NihCommand *  command,
 		job_class_show_emits (NULL, job_class, job_class_name);
 		job_class_show_conditions (job_class, job_class_name);
 
+		if (! check_config_mode)
+			job_class_show_scheduling (NULL, job_class);
+
 		/* Add any jobs *without* "start on"/"stop on" conditions
 		 * to ensure we have a complete list of jobs for check-config to work with.
 		 */
@@ -1769,6 +3157,94 @@ error:
 	return 1;
 }
 
+/**
+ * events_action:
+ * @command: NihCommand invoked,
+ * @args: command-line arguments.
+ *
+ * This function is called for the "events" command.
+ *
+ * Returns: command exit status.
+ **/
+int
+events_action (NihCommand *command,
+	       char * const *args)
+{
+	nih_local NihDBusProxy                         *upstart = NULL;
+	nih_local UpstartGetEventHistoryEventsElement **events = NULL;
+	NihError                                       *err;
+
+	nih_assert (command != NULL);
+	nih_assert (args != NULL);
+
+	if (events_since < 0) {
+		fprintf (stderr, _("%s: invalid number of seconds\n"),
+			 program_name);
+		nih_main_suggest_help ();
+		return 1;
+	}
+
+	upstart = upstart_open (NULL);
+	if (! upstart)
+		return 1;
+
+	if (upstart_get_event_history_sync (NULL, upstart,
+					    events_name ? events_name : "",
+					    (uint32_t)events_since,
+					    &events) < 0)
+		goto error;
+
+	for (UpstartGetEventHistoryEventsElement **event = events;
+	     event && *event; event++) {
+		const UpstartGetEventHistoryEventsElement *e = *event;
+		char                                       when[32];
+		struct tm                                  tm;
+		time_t                                     secs;
+		const char                                *progress;
+		uint64_t                                   took;
+
+		secs = (time_t)(e->item3 / 1000000);
+		if (! localtime_r (&secs, &tm)
+		    || ! strftime (when, sizeof (when), "%Y-%m-%d %H:%M:%S", &tm))
+			strcpy (when, "?");
+
+		if (e->item5) {
+			progress = e->item6 ? _("failed") : _("finished");
+			took = e->item5;
+		} else if (e->item4) {
+			progress = _("handling");
+			took = e->item4;
+		} else {
+			progress = _("pending");
+			took = 0;
+		}
+
+		nih_message ("%s.%03u %s %s %" PRIu64 ".%03ums env %016" PRIx64 "%s%s",
+			     when, (unsigned)((e->item3 / 1000) % 1000),
+			     e->item0, progress,
+			     took / 1000, (unsigned)(took % 1000), e->item2,
+			     *e->item1 ? _(" session ") : "", e->item1);
+
+		for (char **job = e->item7; job && *job; job++)
+			nih_message (_("\tstarted %s"), *job);
+
+		for (char **job = e->item8; job && *job; job++)
+			nih_message (_("\tstopped %s"), *job);
+
+		if (e->item9)
+			nih_message (_("\tand %u more jobs"), e->item9);
+	}
+
+	return 0;
+
+error:
+	err = nih_error_get ();
+	nih_error ("%s", err->message);
+	nih_free (err);
+
+	return 1;
+}
+
 
 /**
  * reload_configuration_action:
@@ -1846,6 +3322,45 @@ error:
 	return 1;
 }
 
+/**
+ * stats_action:
+ * @command: NihCommand invoked,
+ * @args: command-line arguments.
+ *
+ * This function is called for the "stats" command.
+ *
+ * Returns: command exit status.
+ **/
+int
+stats_action (NihCommand *  command,
+	      char * const *args)
+{
+	nih_local NihDBusProxy *upstart = NULL;
+	nih_local char *        snapshot = NULL;
+	NihError *              err;
+
+	nih_assert (command != NULL);
+	nih_assert (args != NULL);
+
+	upstart = upstart_open (NULL);
+	if (! upstart)
+		return 1;
+
+	if (upstart_metrics_get_snapshot_sync (NULL, upstart, &snapshot) < 0)
+		goto error;
+
+	nih_message ("%s", snapshot);
+
+	return 0;
+
+error:
+	err = nih_error_get ();
+	nih_error ("%s", err->message);
+	nih_free (err);
+
+	return 1;
+}
+
 
 /**
  * log_priority_action:
@@ -1934,71 +3449,214 @@ check_config_action (NihCommand *command,
 		NihList *entry;
 		job_class = args[0];
 
-		entry = nih_hash_lookup (check_config_data.job_class_hash, job_class);
+		entry = nih_hash_lookup (check_config_data.job_class_hash, job_class);
+
+		if (! entry) {
+			nih_error ("%s: %s", _("Invalid job class"), job_class);
+			return 1;
+		}
+	}
+
+	NIH_HASH_FOREACH (check_config_data.job_class_hash, iter) {
+		JobCondition *j = (JobCondition *)iter;
+		int job_class_displayed = FALSE;
+
+		if (job_class && strcmp (job_class, j->job_class) != 0) {
+			/* user specified a job on the command-line,
+			 * so only show that one.
+			 */
+			continue;
+		}
+
+		ret += check_condition (j->job_class, "start on", j->start_on,
+				&job_class_displayed);
+
+		ret += check_condition (j->job_class, "stop on" , j->stop_on,
+				&job_class_displayed);
+	}
+
+	nih_free (check_config_data.job_class_hash);
+	nih_free (check_config_data.event_hash);
+	if (check_config_data.ignored_events_hash)
+		nih_free (check_config_data.ignored_events_hash);
+
+	return ret ? 1 : 0;
+}
+
+/**
+ * notify_disk_writeable_action:
+ * @command: NihCommand invoked,
+ * @args: command-line arguments.
+ *
+ * This function is called for the "notify-disk-writeable" command.
+ *
+ * Returns: command exit status.
+ **/
+int
+notify_disk_writeable_action (NihCommand *command,
+		char * const *args)
+{
+	nih_local NihDBusProxy *upstart = NULL;
+	NihError *              err;
+
+	nih_assert (command != NULL);
+	nih_assert (args != NULL);
+
+	upstart = upstart_open (NULL);
+	if (! upstart)
+		return 1;
+
+	if (upstart_notify_disk_writeable_sync (NULL, upstart) < 0)
+		goto error;
+
+	return 0;
+
+error:
+	err = nih_error_get ();
+	nih_error ("%s", err->message);
+	nih_free (err);
+
+	return 1;
+}
+
+
+/**
+ * reopen_logs_action:
+ * @command: NihCommand invoked,
+ * @args: command-line arguments.
+ *
+ * This function is called for the "reopen-logs" command.
+ *
+ * Returns: command exit status.
+ **/
+int
+reopen_logs_action (NihCommand *command,
+		char * const *args)
+{
+	nih_local NihDBusProxy *upstart = NULL;
+	NihError *              err;
+
+	nih_assert (command != NULL);
+	nih_assert (args != NULL);
+
+	upstart = upstart_open (NULL);
+	if (! upstart)
+		return 1;
+
+	if (upstart_reopen_logs_sync (NULL, upstart) < 0)
+		goto error;
 
-		if (! entry) {
-			nih_error ("%s: %s", _("Invalid job class"), job_class);
-			return 1;
-		}
-	}
+	return 0;
 
-	NIH_HASH_FOREACH (check_config_data.job_class_hash, iter) {
-		JobCondition *j = (JobCondition *)iter;
-		int job_class_displayed = FALSE;
+error:
+	err = nih_error_get ();
+	nih_error ("%s", err->message);
+	nih_free (err);
 
-		if (job_class && strcmp (job_class, j->job_class) != 0) {
-			/* user specified a job on the command-line,
-			 * so only show that one.
-			 */
-			continue;
-		}
+	return 1;
+}
 
-		ret += check_condition (j->job_class, "start on", j->start_on,
-				&job_class_displayed);
 
-		ret += check_condition (j->job_class, "stop on" , j->stop_on,
-				&job_class_displayed);
-	}
+/**
+ * log_output:
+ * @data: not used,
+ * @record: record read,
+ * @buf: output of @record.
+ *
+ * Called for each record of job output read by log_action() to write it
+ * to standard output.
+ *
+ * Returns: zero to continue reading, negative value on error.
+ **/
+static int
+log_output (void                 *data,
+	    const LogStoreRecord *record,
+	    const char           *buf)
+{
+	nih_assert (record != NULL);
+	nih_assert (buf != NULL);
 
-	nih_free (check_config_data.job_class_hash);
-	nih_free (check_config_data.event_hash);
-	if (check_config_data.ignored_events_hash)
-		nih_free (check_config_data.ignored_events_hash);
+	if (fwrite (buf, 1, record->len, stdout) != record->len)
+		return -1;
 
-	return ret ? 1 : 0;
+	return 0;
 }
 
 /**
- * notify_disk_writeable_action:
+ * log_action:
  * @command: NihCommand invoked,
  * @args: command-line arguments.
  *
- * This function is called for the "notify-disk-writeable" command.
+ * This function is called for the "log" command.
  *
  * Returns: command exit status.
  **/
 int
-notify_disk_writeable_action (NihCommand *command,
-		char * const *args)
+log_action (NihCommand *command,
+	    char * const *args)
 {
-	nih_local NihDBusProxy *upstart = NULL;
-	NihError *              err;
+	nih_local char *path = NULL;
+	const char     *dir;
+	uint64_t        since = 0;
+	uint64_t        until = 0;
+	NihError       *err;
+	int             ret;
 
 	nih_assert (command != NULL);
 	nih_assert (args != NULL);
 
-	upstart = upstart_open (NULL);
-	if (! upstart)
+	if (! args[0]) {
+		fprintf (stderr, _("%s: missing job name\n"), program_name);
+		nih_main_suggest_help ();
 		return 1;
+	}
 
-	if (upstart_notify_disk_writeable_sync (NULL, upstart) < 0)
+	if (logs_dir) {
+		dir = logs_dir;
+	} else if (getenv (LOGDIR_ENV)) {
+		dir = getenv (LOGDIR_ENV);
+	} else {
+		dir = JOB_LOGDIR;
+	}
+
+	path = NIH_MUST (log_store_path (NULL, dir, args[0], args[1]));
+
+	if (logs_since > 0) {
+		struct timespec now;
+
+		nih_assert (clock_gettime (CLOCK_REALTIME, &now) == 0);
+
+		if (now.tv_sec > logs_since)
+			since = (uint64_t)(now.tv_sec - logs_since) * 1000000000;
+	}
+
+	ret = log_store_read (path, since, &until, log_output, NULL);
+	if (ret < 0)
 		goto error;
 
+	if (! ret && ! logs_follow) {
+		fprintf (stderr, _("%s: no structured log for job\n"),
+			 program_name);
+		return 1;
+	}
+
+	/* Read only records written since those already output */
+	while (logs_follow) {
+		fflush (stdout);
+		sleep (1);
+
+		if (until >= since)
+			since = until + 1;
+
+		if (log_store_read (path, since, &until, log_output, NULL) < 0)
+			goto error;
+	}
+
 	return 0;
 
 error:
 	err = nih_error_get ();
-	nih_error ("%s", err->message);
+	nih_error ("%s: %s", path, err->message);
 	nih_free (err);
 
 	return 1;
@@ -2229,16 +3887,401 @@ reply_handler (int *           ret,
 }
 
 static void
-error_handler (void *          data,
-	       NihDBusMessage *message)
+error_handler (void *          data,
+	       NihDBusMessage *message)
+{
+	NihError *err;
+
+	nih_assert (message != NULL);
+
+	err = nih_error_get ();
+	nih_error ("%s", err->message);
+	nih_free (err);
+}
+
+/**
+ * job_call_wanted:
+ * @args: command-line arguments.
+ *
+ * Decide whether the start, stop or restart command given @args should
+ * use job_call_all() rather than its usual single-job path: when more
+ * than one job or a glob is named, or --max-parallel or --format is
+ * given.
+ *
+ * Returns: TRUE if so, FALSE otherwise.
+ **/
+static int
+job_call_wanted (char * const *args)
+{
+	nih_assert (args != NULL);
+
+	if (! args[0])
+		return FALSE;
+
+	if (max_parallel || output_format)
+		return TRUE;
+
+	if (strpbrk (args[0], "*?["))
+		return TRUE;
+
+	return (args[1] && ! strchr (args[1], '='));
+}
+
+/**
+ * job_call_all:
+ * @type: method to call,
+ * @args: command-line arguments.
+ *
+ * Start, stop or restart each of the jobs named by the leading
+ * arguments of @args, which may be globs, passing the environment
+ * variables that follow to each.  The calls are made over one
+ * connection and up to max_parallel are in progress at once, with the
+ * result of each reported as it completes.
+ *
+ * Returns: command exit status, non-zero if any job failed.
+ **/
+static int
+job_call_all (JobCallType   type,
+	      char * const *args)
+{
+	nih_local NihDBusProxy *upstart = NULL;
+	nih_local NihList *     calls = NULL;
+	char * const *          env;
+	NihList *               next;
+	size_t                  running = 0;
+	int                     tab = FALSE;
+	int                     ret = 0;
+	NihError *              err;
+
+	nih_assert (args != NULL);
+
+	if (output_format && strcmp (output_format, "text")) {
+		if (strcmp (output_format, "tab")) {
+			fprintf (stderr, _("%s: invalid output format: %s\n"),
+				 program_name, output_format);
+			nih_main_suggest_help ();
+			return 1;
+		}
+
+		tab = TRUE;
+	}
+
+	if (max_parallel < 0) {
+		fprintf (stderr, _("%s: invalid parallel limit: %d\n"),
+			 program_name, max_parallel);
+		nih_main_suggest_help ();
+		return 1;
+	}
+
+	for (env = args; *env && ! strchr (*env, '='); env++)
+		;
+
+	upstart = upstart_open (NULL);
+	if (! upstart)
+		return 1;
+
+	calls = NIH_MUST (nih_list_new (NULL));
+
+	/* Expand globs with a single call that matches against every
+	 * job class, taking each class once however many instances it
+	 * has.
+	 */
+	for (char * const *arg = args; arg < env; arg++) {
+		nih_local UpstartGetAllJobStatesStatesElement **states = NULL;
+		int                                            found = FALSE;
+
+		if (! strpbrk (*arg, "*?[")) {
+			job_call_add (calls, *arg);
+			continue;
+		}
+
+		if (upstart_get_all_job_states_sync (NULL, upstart, *arg,
+						     &states) < 0)
+			goto error;
+
+		for (UpstartGetAllJobStatesStatesElement **state = states;
+		     state && *state; state++) {
+			job_call_add (calls, (*state)->item0);
+			found = TRUE;
+		}
+
+		if (! found) {
+			nih_error (_("%s: no matching jobs"), *arg);
+			ret = 1;
+		}
+	}
+
+	next = calls->next;
+	while (! NIH_LIST_EMPTY (calls)) {
+		while ((next != calls)
+		       && ((! max_parallel) || (running < (size_t)max_parallel))) {
+			if (job_call_begin (upstart, (JobCall *)next,
+					    type, env) == 0)
+				running++;
+
+			next = next->next;
+		}
+
+		/* Calls are only done once begun, so none of those freed
+		 * here can be the next to begin.
+		 */
+		NIH_LIST_FOREACH_SAFE (calls, iter) {
+			JobCall *call = (JobCall *)iter;
+
+			if (! call->done)
+				continue;
+
+			if (call->pending_call) {
+				dbus_pending_call_unref (call->pending_call);
+				call->pending_call = NULL;
+				running--;
+			}
+
+			if (job_call_report (call, tab) < 0)
+				ret = 1;
+
+			nih_free (call);
+		}
+
+		if (running
+		    && (! dbus_connection_read_write_dispatch (upstart->connection,
+							       -1))) {
+			nih_error (_("Disconnected from init daemon"));
+			return 1;
+		}
+	}
+
+	return ret;
+
+error:
+	err = nih_error_get ();
+	nih_error ("%s", err->message);
+	nih_free (err);
+
+	return 1;
+}
+
+/**
+ * job_call_add:
+ * @calls: list of calls,
+ * @name: name of job class.
+ *
+ * Append a call for the job class @name to @calls, unless there is one
+ * already.
+ **/
+static void
+job_call_add (NihList *   calls,
+	      const char *name)
+{
+	JobCall *call;
+
+	nih_assert (calls != NULL);
+	nih_assert (name != NULL);
+
+	NIH_LIST_FOREACH (calls, iter) {
+		call = (JobCall *)iter;
+
+		if (! strcmp (call->name, name))
+			return;
+	}
+
+	call = NIH_MUST (nih_new (calls, JobCall));
+
+	nih_list_init (&call->entry);
+	nih_alloc_set_destructor (call, nih_list_destroy);
+
+	call->name = NIH_MUST (nih_strdup (call, name));
+	call->job_class = NULL;
+	call->pending_call = NULL;
+	call->job_path = NULL;
+	call->done = FALSE;
+	call->error = NULL;
+
+	nih_list_add (calls, &call->entry);
+}
+
+/**
+ * job_call_begin:
+ * @upstart: proxy for init daemon,
+ * @call: call to make,
+ * @type: method to call,
+ * @env: environment variables to pass.
+ *
+ * Look up the job class of @call and begin the call of @type on it,
+ * without waiting for it to return.  On failure @call is marked done
+ * with the error that occurred.
+ *
+ * Returns: zero if the call is in progress, negative value otherwise.
+ **/
+static int
+job_call_begin (NihDBusProxy *upstart,
+		JobCall *     call,
+		JobCallType   type,
+		char * const *env)
+{
+	nih_local char *job_class_path = NULL;
+	NihError *      err;
+
+	nih_assert (upstart != NULL);
+	nih_assert (call != NULL);
+	nih_assert (env != NULL);
+
+	if (upstart_get_job_by_name_sync (NULL, upstart, call->name,
+					  &job_class_path) < 0)
+		goto error;
+
+	call->job_class = nih_dbus_proxy_new (call, upstart->connection,
+					      upstart->name, job_class_path,
+					      NULL, NULL);
+	if (! call->job_class)
+		goto error;
+
+	call->job_class->auto_start = FALSE;
+
+	switch (type) {
+	case JOB_CALL_START:
+		call->pending_call = job_class_start (
+			call->job_class, env, (! no_wait),
+			(JobClassStartReply)job_call_start_reply_handler,
+			(NihDBusErrorHandler)job_call_error_handler, call,
+			NIH_DBUS_TIMEOUT_NEVER);
+		break;
+	case JOB_CALL_STOP:
+		call->pending_call = job_class_stop (
+			call->job_class, env, (! no_wait),
+			(JobClassStopReply)job_call_reply_handler,
+			(NihDBusErrorHandler)job_call_error_handler, call,
+			NIH_DBUS_TIMEOUT_NEVER);
+		break;
+	case JOB_CALL_RESTART:
+		call->pending_call = job_class_restart (
+			call->job_class, env, (! no_wait),
+			(JobClassRestartReply)job_call_start_reply_handler,
+			(NihDBusErrorHandler)job_call_error_handler, call,
+			NIH_DBUS_TIMEOUT_NEVER);
+		break;
+	default:
+		nih_assert_not_reached ();
+	}
+
+	if (! call->pending_call)
+		goto error;
+
+	return 0;
+
+error:
+	err = nih_error_get ();
+	call->error = NIH_MUST (nih_strdup (call, err->message));
+	nih_free (err);
+
+	call->done = TRUE;
+
+	return -1;
+}
+
+/**
+ * job_call_report:
+ * @call: completed call,
+ * @tab: TRUE for tab-separated output.
+ *
+ * Output the result of @call: the status of the job, or the error the
+ * call failed with.
+ *
+ * Returns: zero if the call succeeded, negative value otherwise.
+ **/
+static int
+job_call_report (JobCall *call,
+		 int      tab)
+{
+	nih_local NihDBusProxy *job = NULL;
+	nih_local char *        status = NULL;
+	NihError *              err;
+
+	nih_assert (call != NULL);
+	nih_assert (call->done);
+
+	if (! call->error) {
+		/* Stopping doesn't return an instance, so the status of
+		 * the class is given instead.
+		 */
+		if (call->job_path) {
+			job = NIH_SHOULD (nih_dbus_proxy_new (
+						  NULL, call->job_class->connection,
+						  call->job_class->name,
+						  call->job_path, NULL, NULL));
+			if (job)
+				job->auto_start = FALSE;
+		}
+
+		if (job || (! call->job_path))
+			status = NIH_SHOULD (job_status (NULL, call->job_class,
+							 job));
+
+		if (! status) {
+			err = nih_error_get ();
+			call->error = NIH_MUST (nih_strdup (call, err->message));
+			nih_free (err);
+		}
+	}
+
+	if (call->error) {
+		if (tab) {
+			printf ("%s\tfailed\t%s\n", call->name, call->error);
+			fflush (stdout);
+		} else {
+			nih_error ("%s: %s", call->name, call->error);
+		}
+
+		return -1;
+	}
+
+	if (tab) {
+		printf ("%s\tok\t%s\n", call->name, status);
+		fflush (stdout);
+	} else {
+		nih_message ("%s", status);
+	}
+
+	return 0;
+}
+
+static void
+job_call_reply_handler (JobCall *       call,
+			NihDBusMessage *message)
+{
+	nih_assert (call != NULL);
+	nih_assert (message != NULL);
+
+	call->done = TRUE;
+}
+
+static void
+job_call_start_reply_handler (JobCall *       call,
+			      NihDBusMessage *message,
+			      const char *    instance)
+{
+	nih_assert (call != NULL);
+	nih_assert (message != NULL);
+	nih_assert (instance != NULL);
+
+	call->job_path = NIH_MUST (nih_strdup (call, instance));
+	call->done = TRUE;
+}
+
+static void
+job_call_error_handler (JobCall *       call,
+			NihDBusMessage *message)
 {
 	NihError *err;
 
+	nih_assert (call != NULL);
 	nih_assert (message != NULL);
 
 	err = nih_error_get ();
-	nih_error ("%s", err->message);
+	call->error = NIH_MUST (nih_strdup (call, err->message));
 	nih_free (err);
+
+	call->done = TRUE;
 }
 
 /**
@@ -2527,6 +4570,37 @@ error:
 	nih_free (err);
 }
 
+/**
+ * job_class_show_scheduling:
+ * @parent: parent object,
+ * @job_class_proxy: D-Bus proxy for job class.
+ *
+ * Display the sched, ioprio and timer-slack stanzas of the job class
+ * to user.
+ **/
+void
+job_class_show_scheduling (const void *parent, NihDBusProxy *job_class_proxy)
+{
+	NihError         *err;
+	nih_local char **scheduling = NULL;
+
+	nih_assert (job_class_proxy);
+
+	if (job_class_get_scheduling_sync (parent, job_class_proxy,
+					   &scheduling) < 0)
+		goto error;
+
+	for (char **p = scheduling; p && *p; p++)
+		nih_message ("  %s", *p);
+
+	return;
+
+error:
+	err = nih_error_get ();
+	nih_error ("%s", err->message);
+	nih_free (err);
+}
+
 /**
  * job_class_condition_handler:
  * @data: data passed via job_class_get_start_on() or job_class_get_stop_on(),
@@ -2929,6 +5003,76 @@ get_job_details (void)
 }
 
 
+/**
+ * batch_split:
+ * @parent: parent object for new array,
+ * @line: line to split.
+ *
+ * Split @line, read by the batch or shell command, into the arguments
+ * of a command.  Arguments are separated by whitespace, which may be
+ * included in one by quoting it with single or double quotes or
+ * escaping it with a backslash outside single quotes; anything from an
+ * argument starting with '#' is a comment.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned array.  When all parents
+ * of the returned array are freed, the returned array will also be
+ * freed.
+ *
+ * Returns: newly allocated NULL-terminated array of arguments, or NULL
+ * if @line ends inside quotes.
+ **/
+char **
+batch_split (const void *parent,
+	     const char *line)
+{
+	char **     args;
+	size_t      len = 0;
+	const char *p = line;
+
+	nih_assert (line != NULL);
+
+	args = NIH_MUST (nih_str_array_new (parent));
+
+	for (;;) {
+		nih_local char *arg = NULL;
+		char            quote = '\0';
+
+		while (isspace ((unsigned char)*p))
+			p++;
+
+		if ((! *p) || (*p == '#'))
+			break;
+
+		arg = NIH_MUST (nih_strdup (NULL, ""));
+
+		while (*p && (quote || ! isspace ((unsigned char)*p))) {
+			if (quote && (*p == quote)) {
+				quote = '\0';
+			} else if ((! quote) && ((*p == '\'') || (*p == '"'))) {
+				quote = *p;
+			} else {
+				if ((*p == '\\') && (quote != '\'') && p[1])
+					p++;
+
+				NIH_MUST (nih_strncat (&arg, NULL, p, 1));
+			}
+
+			p++;
+		}
+
+		if (quote) {
+			nih_free (args);
+			return NULL;
+		}
+
+		NIH_MUST (nih_str_array_add (&args, parent, &len, arg));
+	}
+
+	return args;
+}
+
+
 #ifndef TEST
 /**
  * options:
@@ -2957,6 +5101,10 @@ static NihOption options[] = {
 NihOption start_options[] = {
 	{ 'n', "no-wait", N_("do not wait for job to start before exiting"),
 	  NULL, NULL, &no_wait, NULL },
+	{ 0, "max-parallel", N_("start at most N jobs at once"),
+	  NULL, "N", &max_parallel, nih_option_int },
+	{ 0, "format", N_("report results as FORMAT (text or tab)"),
+	  NULL, "FORMAT", &output_format, NULL },
 
 	NIH_OPTION_LAST
 };
@@ -2969,6 +5117,10 @@ NihOption start_options[] = {
 NihOption stop_options[] = {
 	{ 'n', "no-wait", N_("do not wait for job to stop before exiting"),
 	  NULL, NULL, &no_wait, NULL },
+	{ 0, "max-parallel", N_("stop at most N jobs at once"),
+	  NULL, "N", &max_parallel, nih_option_int },
+	{ 0, "format", N_("report results as FORMAT (text or tab)"),
+	  NULL, "FORMAT", &output_format, NULL },
 
 	NIH_OPTION_LAST
 };
@@ -2981,6 +5133,10 @@ NihOption stop_options[] = {
 NihOption restart_options[] = {
 	{ 'n', "no-wait", N_("do not wait for job to restart before exiting"),
 	  NULL, NULL, &no_wait, NULL },
+	{ 0, "max-parallel", N_("restart at most N jobs at once"),
+	  NULL, "N", &max_parallel, nih_option_int },
+	{ 0, "format", N_("report results as FORMAT (text or tab)"),
+	  NULL, "FORMAT", &output_format, NULL },
 
 	NIH_OPTION_LAST
 };
@@ -3000,6 +5156,13 @@ NihOption reload_options[] = {
  * Command-line options accepted for the status command.
  **/
 NihOption status_options[] = {
+	{ 0, "timings", N_("show when each state was entered"),
+	  NULL, NULL, &show_timings, NULL },
+	{ 0, "resources", N_("show the resources used by the job's processes"),
+	  NULL, NULL, &show_resources, NULL },
+	{ 0, "format", N_("output format: text or json"),
+	  NULL, "FORMAT", &output_format, NULL },
+
 	NIH_OPTION_LAST
 };
 
@@ -3009,6 +5172,27 @@ NihOption status_options[] = {
  * Command-line options accepted for the list command.
  **/
 NihOption list_options[] = {
+	{ 0, "format", N_("output format: text or json"),
+	  NULL, "FORMAT", &output_format, NULL },
+
+	NIH_OPTION_LAST
+};
+
+/**
+ * critical_path_options:
+ *
+ * Command-line options accepted for the critical-path command.
+ **/
+NihOption critical_path_options[] = {
+	NIH_OPTION_LAST
+};
+
+/**
+ * boot_trace_options:
+ *
+ * Command-line options accepted for the boot-trace command.
+ **/
+NihOption boot_trace_options[] = {
 	NIH_OPTION_LAST
 };
 
@@ -3024,6 +5208,20 @@ NihOption emit_options[] = {
 	NIH_OPTION_LAST
 };
 
+/**
+ * events_options:
+ *
+ * Command-line options accepted for the events command.
+ **/
+NihOption events_options[] = {
+	{ 0, "name", N_("only output events with this name"),
+	  NULL, "NAME", &events_name, NULL },
+	{ 0, "since", N_("only output events emitted in the last SECONDS"),
+	  NULL, "SECONDS", &events_since, nih_option_int },
+
+	NIH_OPTION_LAST
+};
+
 /**
  * reload_configuration_options:
  *
@@ -3042,6 +5240,15 @@ NihOption version_options[] = {
 	NIH_OPTION_LAST
 };
 
+/**
+ * stats_options:
+ *
+ * Command-line options accepted for the stats command.
+ **/
+NihOption stats_options[] = {
+	NIH_OPTION_LAST
+};
+
 /**
  * log_priority_options:
  *
@@ -3062,6 +5269,8 @@ NihOption show_config_options[] = {
 		N_("enumerate list of events and jobs causing job "
 		   "created from job config to start/stop"),
 	  NULL, NULL, &enumerate_events, NULL },
+	{ 0, "format", N_("output format: text or json"),
+	  NULL, "FORMAT", &output_format, NULL },
 
 	NIH_OPTION_LAST
 };
@@ -3136,6 +5345,21 @@ NihOption reset_env_options[] = {
 	NIH_OPTION_LAST
 };
 
+/**
+ * log_options:
+ *
+ * Command-line options accepted for the log command.
+ **/
+NihOption log_options[] = {
+	{ 'f', "follow", N_("output job output as it is written"),
+	  NULL, NULL, &logs_follow, NULL },
+	{ 0, "logdir", N_("directory job output logs are written to"),
+	  NULL, "DIR", &logs_dir, NULL },
+	{ 0, "since", N_("only output what was written in the last SECONDS"),
+	  NULL, "SECONDS", &logs_since, nih_option_int },
+	NIH_OPTION_LAST
+};
+
 /**
  * usage_options:
  *
@@ -3145,6 +5369,18 @@ NihOption usage_options[] = {
 	NIH_OPTION_LAST
 };
 
+/**
+ * batch_options:
+ *
+ * Command-line options accepted for the batch and shell commands.
+ **/
+NihOption batch_options[] = {
+	{ 0, "json", N_("output the result of each command as a line of JSON"),
+	  NULL, NULL, &batch_json, NULL },
+
+	NIH_OPTION_LAST
+};
+
 /**
  * job_group:
  *
@@ -3172,7 +5408,7 @@ static NihCommandGroup env_group = { N_("Environment") };
  * Commands accepts as the first non-option argument, or program name.
  **/
 static NihCommand commands[] = {
-	{ "start", N_("JOB [KEY=VALUE]..."),
+	{ "start", N_("JOB... [KEY=VALUE]..."),
 	  N_("Start job."),
 	  N_("JOB is the name of the job that is to be started, this may "
 	     "be followed by zero or more environment variables to be "
@@ -3181,10 +5417,14 @@ static NihCommand commands[] = {
 	     "The environment may also serve to distinguish between job "
 	     "instances, and thus decide whether a new instance will be "
 	     "started or an error returned if an existing instance is "
-	     "already running."),
+	     "already running.\n"
+	     "\n"
+	     "More than one JOB may be named, or a glob matching several, "
+	     "in which case each is started at the same time and its result "
+	     "reported as it completes."),
 	  &job_commands, start_options, start_action },
 
-	{ "stop", N_("JOB [KEY=VALUE]..."),
+	{ "stop", N_("JOB... [KEY=VALUE]..."),
 	  N_("Stop job."),
 	  N_("JOB is the name of the job that is to be stopped, this may "
 	     "be followed by zero or more environment variables to be "
@@ -3192,10 +5432,14 @@ static NihCommand commands[] = {
 	     "\n"
 	     "The environment also serves to distinguish between job "
 	     "instances, and thus decide which of multiple instances will "
-	     "be stopped."),
+	     "be stopped.\n"
+	     "\n"
+	     "More than one JOB may be named, or a glob matching several, "
+	     "in which case each is stopped at the same time and its result "
+	     "reported as it completes."),
 	  &job_commands, stop_options, stop_action },
 
-	{ "restart", N_("JOB [KEY=VALUE]..."),
+	{ "restart", N_("JOB... [KEY=VALUE]..."),
 	  N_("Restart job."),
 	  N_("JOB is the name of the job that is to be restarted, this may "
 	     "be followed by zero or more environment variables to be "
@@ -3203,7 +5447,11 @@ static NihCommand commands[] = {
 	     "\n"
 	     "The environment also serves to distinguish between job "
 	     "instances, and thus decide which of multiple instances will "
-	     "be restarted."),
+	     "be restarted.\n"
+	     "\n"
+	     "More than one JOB may be named, or a glob matching several, "
+	     "in which case each is restarted at the same time and its result "
+	     "reported as it completes."),
 	  &job_commands, restart_options, restart_action },
 
 	{ "reload", N_("JOB [KEY=VALUE]..."),
@@ -3220,11 +5468,38 @@ static NihCommand commands[] = {
 	     "distguish between job instances.\n" ),
 	  &job_commands, status_options, status_action },
 
+	{ "log", N_("JOB [INSTANCE]"),
+	  N_("Show output of job."),
+	  N_("JOB is the name of the job whose output is to be shown, "
+	     "this may be followed by the name of an instance of the "
+	     "job.\n"
+	     "\n"
+	     "Output is read from the structured log the init daemon "
+	     "writes when started with --log-store, oldest first."),
+	  &job_commands, log_options, log_action },
+
 	{ "list", NULL,
 	  N_("List known jobs."),
 	  N_("The known jobs and their current status will be output."),
 	  &job_commands, list_options, list_action },
 
+	{ "critical-path", NULL,
+	  N_("Show the chain of jobs that delayed start-up the most."),
+	  N_("Starting from the job that reached the running state last, "
+	     "the job that became running most recently before it started "
+	     "is followed back until none remain.  For each job the time it "
+	     "became running, how long it took from starting and where most "
+	     "of that time was spent is output."),
+	  &job_commands, critical_path_options, critical_path_action },
+
+	{ "boot-trace", NULL,
+	  N_("Output the recorded blocking between jobs and events."),
+	  N_("Outputs, in the Trace Event Format understood by "
+	     "chrome://tracing and similar viewers, each time a job waited "
+	     "for an event or an event waited for a job since boot, and for "
+	     "how long."),
+	  &job_commands, boot_trace_options, boot_trace_action },
+
 	{ "emit", N_("EVENT [KEY=VALUE]..."),
 	  N_("Emit an event."),
 	  N_("EVENT is the name of an event the init daemon should emit, "
@@ -3232,6 +5507,14 @@ static NihCommand commands[] = {
 	     "to be included in the event.\n"),
 	  &event_commands, emit_options, emit_action },
 
+	{ "events", NULL,
+	  N_("Show recent events."),
+	  N_("Outputs the recent events the init daemon keeps a history "
+	     "of, oldest first: when each was emitted, how long it "
+	     "took to be handled and whether it failed, a digest of its "
+	     "environment, and the jobs it started and stopped."),
+	  &event_commands, events_options, events_action },
+
 	{ "reload-configuration", NULL,
 	  N_("Reload the configuration of the init daemon."),
 	  NULL,
@@ -3240,6 +5523,14 @@ static NihCommand commands[] = {
 	  N_("Request the version of the init daemon."),
 	  NULL,
 	  NULL, version_options, version_action },
+	{ "stats", NULL,
+	  N_("Output counters and latencies of the init daemon."),
+	  N_("Outputs, as JSON, the events emitted, handled and failed, "
+	     "jobs started, failed and respawned, processes spawned and "
+	     "reaped, job output logged, latency histograms in "
+	     "microseconds and the worst stalls of its main loop kept "
+	     "since the init daemon started."),
+	  NULL, stats_options, stats_action },
 	{ "log-priority", N_("[PRIORITY]"),
 	  N_("Change the minimum priority of log messages from the init "
 	     "daemon."),
@@ -3318,15 +5609,364 @@ static NihCommand commands[] = {
 			  "disk is writeable are flushed to disk."),
 	  NULL, NULL, notify_disk_writeable_action },
 
+	{ "reopen-logs", NULL,
+	  N_("Inform Upstart that job logs have been rotated."),
+	  N_("Run after rotating job logs to ensure further output "
+			  "from jobs is written to the new log files."),
+	  NULL, NULL, reopen_logs_action },
+
 	{ "list-sessions", NULL,
 	  N_("List all sessions."),
 	  N_("Displays list of running Session Init sessions"),
 	  NULL, NULL, list_sessions_action },
 
+	{ "batch", N_("[FILE]"),
+	  N_("Run commands from a file."),
+	  N_("Each line of FILE, or standard input if FILE is not given or "
+	     "is '-', is run as an initctl command, all over the same "
+	     "connection to the init daemon.  Arguments may be quoted as "
+	     "for the shell, and lines starting with '#' are ignored."),
+	  NULL, batch_options, batch_action },
+
+	{ "shell", NULL,
+	  N_("Run commands interactively."),
+	  N_("Prompts for and runs initctl commands, as batch does, until "
+	     "the end of input."),
+	  NULL, batch_options, shell_action },
+
 	NIH_COMMAND_LAST
 };
 
 
+/**
+ * batch_options_save:
+ * @parent: parent object for new array.
+ *
+ * Record the values of the options of initctl and its commands, to be
+ * returned to by batch_options_restore() after each command run by the
+ * batch and shell commands.  Only options that set a flag, string or
+ * integer are recorded, since the values set by other setters can't be
+ * known.
+ *
+ * Returns: newly allocated array terminated by an entry with a NULL
+ * option.
+ **/
+static BatchOption *
+batch_options_save (const void *parent)
+{
+	BatchOption *saved;
+	size_t       len = 0;
+
+	saved = NIH_MUST (nih_new (parent, BatchOption));
+
+	for (NihCommand *command = commands; ; command++) {
+		NihOption *opts = command->command ? command->options : options;
+
+		for (NihOption *opt = opts; opt && opt->long_option; opt++) {
+			if ((! opt->value)
+			    || (opt->setter && (opt->setter != nih_option_int)))
+				continue;
+
+			saved = NIH_MUST (nih_realloc (saved, parent,
+						       sizeof (BatchOption) * (len + 2)));
+
+			saved[len].option = opt;
+			if (opt->arg_name && ! opt->setter) {
+				saved[len].saved.str = *(char **)opt->value;
+			} else {
+				saved[len].saved.flag = *(int *)opt->value;
+			}
+			len++;
+		}
+
+		if (! command->command)
+			break;
+	}
+
+	saved[len].option = NULL;
+
+	return saved;
+}
+
+/**
+ * batch_options_restore:
+ * @saved: values from batch_options_save().
+ *
+ * Return the options of initctl and its commands to the values in @saved.
+ **/
+static void
+batch_options_restore (const BatchOption *saved)
+{
+	nih_assert (saved != NULL);
+
+	for (const BatchOption *entry = saved; entry->option; entry++) {
+		NihOption *opt = entry->option;
+
+		if (opt->arg_name && ! opt->setter) {
+			*(char **)opt->value = entry->saved.str;
+		} else {
+			*(int *)opt->value = entry->saved.flag;
+		}
+	}
+}
+
+/**
+ * batch_read_output:
+ * @parent: parent object for new string,
+ * @file: temporary file output was captured in.
+ *
+ * Returns: newly allocated string of everything written to @file, without
+ * a final newline.
+ **/
+static char *
+batch_read_output (const void *parent,
+		   FILE *      file)
+{
+	char *  buf = NULL;
+	size_t  size = 0;
+	ssize_t len;
+	char *  output;
+
+	nih_assert (file != NULL);
+
+	rewind (file);
+
+	len = getdelim (&buf, &size, '\0', file);
+	if (len > 0 && buf[len - 1] == '\n')
+		buf[--len] = '\0';
+
+	output = NIH_MUST (nih_strndup (parent, buf ? buf : "",
+					len > 0 ? len : 0));
+	free (buf);
+
+	return output;
+}
+
+/**
+ * batch_run:
+ * @line: line read,
+ * @saved: option values from batch_options_save().
+ *
+ * Run the command on @line with the connection of the batch or shell
+ * command.  When batch_json is TRUE, what the command writes to standard
+ * output and standard error is captured, and output with its exit status
+ * as a line of JSON.
+ *
+ * Returns: exit status of the command, or -1 if @line is empty.
+ **/
+static int
+batch_run (const char *       line,
+	   const BatchOption *saved)
+{
+	nih_local char **args = NULL;
+	nih_local char **argv = NULL;
+	size_t           argc = 0;
+	FILE *           out = NULL;
+	FILE *           err = NULL;
+	int              saved_out = -1;
+	int              saved_err = -1;
+	int              ret;
+
+	nih_assert (line != NULL);
+	nih_assert (saved != NULL);
+
+	args = batch_split (NULL, line);
+	if (args && ! args[0])
+		return -1;
+
+	if (args && ((! strcmp (args[0], "batch"))
+		     || (! strcmp (args[0], "shell")))) {
+		nih_free (args);
+		args = NULL;
+	}
+
+	argv = NIH_MUST (nih_str_array_new (NULL));
+	NIH_MUST (nih_str_array_add (&argv, NULL, &argc, program_name));
+	if (args)
+		NIH_MUST (nih_str_array_append (&argv, NULL, &argc, args));
+
+	if (batch_json) {
+		out = tmpfile ();
+		err = tmpfile ();
+		if ((! out) || (! err)) {
+			nih_error ("%s: %s", _("Unable to capture output"),
+				   strerror (errno));
+			if (out)
+				fclose (out);
+			if (err)
+				fclose (err);
+			return 1;
+		}
+
+		fflush (stdout);
+		fflush (stderr);
+
+		saved_out = dup (STDOUT_FILENO);
+		saved_err = dup (STDERR_FILENO);
+		dup2 (fileno (out), STDOUT_FILENO);
+		dup2 (fileno (err), STDERR_FILENO);
+	}
+
+	if (args) {
+		ret = nih_command_parser (NULL, argc, argv, options, commands);
+		if (ret < 0)
+			ret = 1;
+	} else {
+		fprintf (stderr, _("%s: invalid command: %s\n"),
+			 program_name, line);
+		ret = 1;
+	}
+
+	batch_options_restore (saved);
+
+	if (batch_json) {
+		nih_local char *command = NULL;
+		nih_local char *output = NULL;
+		nih_local char *error = NULL;
+
+		fflush (stdout);
+		fflush (stderr);
+
+		dup2 (saved_out, STDOUT_FILENO);
+		dup2 (saved_err, STDERR_FILENO);
+		close (saved_out);
+		close (saved_err);
+
+		command = json_string (NULL, line);
+		output = batch_read_output (NULL, out);
+		error = batch_read_output (NULL, err);
+
+		fclose (out);
+		fclose (err);
+
+		printf ("{ \"command\": %s, \"status\": %d, \"output\": %s, "
+			"\"error\": %s }\n", command, ret,
+			json_string (output, output),
+			json_string (error, error));
+	}
+
+	fflush (stdout);
+
+	return ret;
+}
+
+/**
+ * batch_loop:
+ * @input: file to read commands from,
+ * @prompt: prompt to output before reading each line, or NULL.
+ *
+ * Run each command read from @input over a single connection to the init
+ * daemon, until the end of @input.
+ *
+ * Returns: zero if every command succeeded, one otherwise.
+ **/
+static int
+batch_loop (FILE *      input,
+	    const char *prompt)
+{
+	nih_local NihDBusProxy *upstart = NULL;
+	nih_local BatchOption * saved = NULL;
+	char *                  line = NULL;
+	size_t                  size = 0;
+	ssize_t                 len;
+	int                     ret = 0;
+
+	nih_assert (input != NULL);
+
+	if (batch_connection) {
+		fprintf (stderr, _("%s: batch commands may not be nested\n"),
+			 program_name);
+		return 1;
+	}
+
+	upstart = upstart_open (NULL);
+	if (! upstart)
+		return 1;
+
+	batch_connection = upstart->connection;
+	saved = batch_options_save (NULL);
+
+	for (;;) {
+		if (prompt) {
+			fputs (prompt, stdout);
+			fflush (stdout);
+		}
+
+		len = getline (&line, &size, input);
+		if (len < 0)
+			break;
+
+		if (len && (line[len - 1] == '\n'))
+			line[len - 1] = '\0';
+
+		if (batch_run (line, saved) > 0)
+			ret = 1;
+	}
+
+	if (prompt)
+		putchar ('\n');
+
+	free (line);
+	batch_connection = NULL;
+
+	return ret;
+}
+
+/**
+ * batch_action:
+ * @command: NihCommand invoked,
+ * @args: command-line arguments.
+ *
+ * This function is called for the "batch" command.
+ *
+ * Returns: command exit status.
+ **/
+int
+batch_action (NihCommand *  command,
+	      char * const *args)
+{
+	FILE *input = stdin;
+	int   ret;
+
+	nih_assert (command != NULL);
+	nih_assert (args != NULL);
+
+	if (args[0] && strcmp (args[0], "-")) {
+		input = fopen (args[0], "r");
+		if (! input) {
+			nih_error ("%s: %s", args[0], strerror (errno));
+			return 1;
+		}
+	}
+
+	ret = batch_loop (input, NULL);
+
+	if (input != stdin)
+		fclose (input);
+
+	return ret;
+}
+
+/**
+ * shell_action:
+ * @command: NihCommand invoked,
+ * @args: command-line arguments.
+ *
+ * This function is called for the "shell" command.
+ *
+ * Returns: command exit status.
+ **/
+int
+shell_action (NihCommand *  command,
+	      char * const *args)
+{
+	nih_assert (command != NULL);
+	nih_assert (args != NULL);
+
+	return batch_loop (stdin, isatty (STDIN_FILENO) ? "initctl> " : NULL);
+}
+
+
 
 
 
@@ -365,6 +365,27 @@ typedef struct check_config_data {
 } CheckConfigData;
 
 
+/**
+ * JobTiming:
+ *
+ * @name: job and instance name as displayed by the status command,
+ * @starting: time the instance entered the starting state,
+ * @running: time the instance entered the running state,
+ * @slowest: transition after which the longest time was spent,
+ * @slowest_time: time spent after @slowest.
+ *
+ * Start-up latency summary of a single job instance, all times are in
+ * microseconds on CLOCK_MONOTONIC.
+ **/
+typedef struct job_timing {
+	char        *name;
+	uint64_t     starting;
+	uint64_t     running;
+	char        *slowest;
+	uint64_t     slowest_time;
+} JobTiming;
+
+
 /**
  * ConditionHandlerData:
  *
@@ -381,6 +402,63 @@ typedef struct condition_handler_data {
 } ConditionHandlerData;
 
 
+/**
+ * JobCallType:
+ *
+ * Method a JobCall invokes on its job class.
+ **/
+typedef enum job_call_type {
+	JOB_CALL_START,
+	JOB_CALL_STOP,
+	JOB_CALL_RESTART,
+} JobCallType;
+
+/**
+ * JobCall:
+ *
+ * @entry: list header,
+ * @name: name of job class,
+ * @job_class: proxy for @name, or NULL before the call is made,
+ * @pending_call: call in progress, or NULL,
+ * @job_path: path of the instance started or restarted,
+ * @done: TRUE once the call has returned or failed,
+ * @error: message the call failed with, or NULL.
+ *
+ * Call to start, stop or restart one of several jobs named to the
+ * start, stop and restart commands, so that the calls for each may be
+ * in progress at the same time.
+ **/
+typedef struct job_call {
+	NihList          entry;
+	char            *name;
+	NihDBusProxy    *job_class;
+	DBusPendingCall *pending_call;
+	char            *job_path;
+	int              done;
+	char            *error;
+} JobCall;
+
+
+/**
+ * BatchOption:
+ *
+ * @option: option of initctl or one of its commands,
+ * @saved: value of @option before the batch command ran any commands.
+ *
+ * Used by the batch and shell commands to return the options given to
+ * each command they run to their defaults before the next, since the
+ * variables options set are otherwise left set for the rest of the
+ * batch.
+ **/
+typedef struct batch_option {
+	NihOption *option;
+	union {
+		int   flag;
+		char *str;
+	} saved;
+} BatchOption;
+
+
 /**
  * ExprNode:
  *
@@ -0,0 +1,1207 @@
+/* upstart
+ *
+ * rc.c - System V rc script ordering
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/file.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include "rc.h"
+
+
+/**
+ * RC_FACILITY_DEPTH:
+ *
+ * Number of $facility names that may be nested in the insserv
+ * configuration before we stop following them.
+ **/
+#define RC_FACILITY_DEPTH 8
+
+/**
+ * RC_WHITESPACE:
+ *
+ * Characters separating words in LSB headers and our own files.
+ **/
+#define RC_WHITESPACE " \t\r\n"
+
+
+/**
+ * RcFacility:
+ * @entry: hash table entry,
+ * @name: name of facility, including the leading '$',
+ * @names: scripts and facilities it stands for.
+ *
+ * A virtual facility read from the insserv configuration.
+ **/
+typedef struct rc_facility {
+	NihList   entry;
+	char     *name;
+	char    **names;
+} RcFacility;
+
+
+/* Prototypes for static functions */
+static int  rc_words_add      (char ***array, const void *parent,
+			       const char *str, size_t len)
+	__attribute__ ((warn_unused_result));
+static char *rc_words_join    (const void *parent, char * const *array)
+	__attribute__ ((warn_unused_result));
+static int  rc_header_lsb     (const RcScript *script);
+static int  rc_header_wants_all (const RcScript *script);
+static void rc_script_before  (RcScript *script, RcScript *next);
+static void rc_script_require (NihList *scripts, RcScript *script,
+			       const char *facility, int stop,
+			       NihHash *facilities, int depth);
+static size_t rc_fields_split (char *line, char **fields, size_t max);
+static int  rc_file_replace   (const char *path, const char *contents)
+	__attribute__ ((warn_unused_result));
+
+
+/**
+ * rc_now:
+ *
+ * Returns: current time on CLOCK_MONOTONIC in microseconds.
+ **/
+uint64_t
+rc_now (void)
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	return ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+
+/**
+ * rc_state_name:
+ * @state: state to convert.
+ *
+ * Returns: string representation of @state, or NULL if not known.
+ **/
+const char *
+rc_state_name (RcState state)
+{
+	switch (state) {
+	case RC_WAITING:
+		return N_("waiting");
+	case RC_RUNNING:
+		return N_("running");
+	case RC_DONE:
+		return N_("done");
+	case RC_FAILED:
+		return N_("failed");
+	default:
+		return NULL;
+	}
+}
+
+/**
+ * rc_state_from_name:
+ * @name: string to convert.
+ *
+ * Returns: RcState matching @name, or -1 if not known.
+ **/
+int
+rc_state_from_name (const char *name)
+{
+	nih_assert (name != NULL);
+
+	if (! strcmp (name, "waiting")) {
+		return RC_WAITING;
+	} else if (! strcmp (name, "running")) {
+		return RC_RUNNING;
+	} else if (! strcmp (name, "done")) {
+		return RC_DONE;
+	} else if (! strcmp (name, "failed")) {
+		return RC_FAILED;
+	} else {
+		return -1;
+	}
+}
+
+
+/**
+ * rc_script_new:
+ * @parent: parent object for new script,
+ * @path: path of rc link, may be NULL,
+ * @prefix: 'S' or 'K',
+ * @seq: sequence number,
+ * @name: name of script,
+ * @action: argument to run the script with.
+ *
+ * Allocates and returns a new RcScript waiting to be run, without any
+ * header or dependencies.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned script.  When all parents
+ * of the returned script are freed, the returned script will also be
+ * freed.
+ *
+ * Returns: newly allocated RcScript or NULL if insufficient memory.
+ **/
+RcScript *
+rc_script_new (const void *parent,
+	       const char *path,
+	       char        prefix,
+	       int         seq,
+	       const char *name,
+	       const char *action)
+{
+	RcScript *script;
+
+	nih_assert (name != NULL);
+	nih_assert (action != NULL);
+
+	script = nih_new (parent, RcScript);
+	if (! script)
+		return NULL;
+
+	nih_list_init (&script->entry);
+	nih_alloc_set_destructor (script, nih_list_destroy);
+
+	script->name = nih_strdup (script, name);
+	if (! script->name)
+		goto error;
+
+	script->path = NULL;
+	if (path) {
+		script->path = nih_strdup (script, path);
+		if (! script->path)
+			goto error;
+	}
+
+	script->action = nih_strdup (script, action);
+	if (! script->action)
+		goto error;
+
+	script->prefix = prefix;
+	script->seq = seq;
+	script->header = NULL;
+
+	script->dependents = NULL;
+	script->dependents_len = 0;
+	script->waiting = 0;
+
+	script->state = RC_WAITING;
+	script->pid = 0;
+	script->started = 0;
+	script->finished = 0;
+	script->status = 0;
+
+	return script;
+
+error:
+	nih_free (script);
+	return NULL;
+}
+
+
+/**
+ * rc_words_add:
+ * @array: pointer to array to add to,
+ * @parent: parent object of @array,
+ * @str: words to add,
+ * @len: length of @str.
+ *
+ * Adds each whitespace-separated word of the first @len characters of
+ * @str to @array.
+ *
+ * Returns: zero on success, negative value if insufficient memory.
+ **/
+static int
+rc_words_add (char      ***array,
+	      const void  *parent,
+	      const char  *str,
+	      size_t       len)
+{
+	size_t pos = 0;
+
+	nih_assert (array != NULL);
+	nih_assert (str != NULL);
+
+	while (pos < len) {
+		nih_local char *word = NULL;
+		size_t          wlen;
+
+		if (strchr (RC_WHITESPACE, str[pos])) {
+			pos++;
+			continue;
+		}
+
+		for (wlen = 0; (pos + wlen < len)
+			     && (! strchr (RC_WHITESPACE, str[pos + wlen])); wlen++)
+			;
+
+		word = nih_strndup (NULL, str + pos, wlen);
+		if (! word)
+			return -1;
+
+		if (! nih_str_array_add (array, parent, NULL, word))
+			return -1;
+
+		pos += wlen;
+	}
+
+	return 0;
+}
+
+/**
+ * rc_words_join:
+ * @parent: parent object for new string,
+ * @array: NULL-terminated array of words.
+ *
+ * Returns: newly allocated string of the words in @array separated by
+ * spaces, or NULL if insufficient memory.
+ **/
+static char *
+rc_words_join (const void  *parent,
+	       char * const *array)
+{
+	char *str;
+
+	str = nih_strdup (parent, "");
+	if (! str)
+		return NULL;
+
+	for (char * const *word = array; word && *word; word++) {
+		if (! nih_strcat_sprintf (&str, parent, "%s%s",
+					  word == array ? "" : " ", *word)) {
+			nih_free (str);
+			return NULL;
+		}
+	}
+
+	return str;
+}
+
+
+/**
+ * rc_header_parse:
+ * @parent: parent object for new header,
+ * @key: identity of the script file,
+ * @buf: contents of the script,
+ * @len: length of @buf.
+ *
+ * Parses the LSB "### BEGIN INIT INFO" block of the script in @buf,
+ * if it has one.  Facilities the script must start or stop after are
+ * collected from both the Required- and Should- fields, since the only
+ * difference between them is how a missing facility is treated and we
+ * ignore those.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned header.  When all parents
+ * of the returned header are freed, the returned header will also be
+ * freed.
+ *
+ * Returns: newly allocated RcHeader or NULL if insufficient memory.
+ **/
+RcHeader *
+rc_header_parse (const void *parent,
+		 const char *key,
+		 const char *buf,
+		 size_t      len)
+{
+	RcHeader *header;
+	size_t    pos = 0;
+	int       inside = FALSE;
+
+	nih_assert (key != NULL);
+	nih_assert (buf != NULL);
+
+	header = nih_new (parent, RcHeader);
+	if (! header)
+		return NULL;
+
+	nih_list_init (&header->entry);
+	nih_alloc_set_destructor (header, nih_list_destroy);
+
+	header->key = nih_strdup (header, key);
+	header->lsb = FALSE;
+	header->provides = nih_str_array_new (header);
+	header->start_requires = nih_str_array_new (header);
+	header->stop_requires = nih_str_array_new (header);
+	header->used = FALSE;
+
+	if ((! header->key) || (! header->provides)
+	    || (! header->start_requires) || (! header->stop_requires))
+		goto error;
+
+	while (pos < len) {
+		const char *line = buf + pos;
+		const char *end;
+		const char *colon;
+		size_t      llen;
+		char     ***array = NULL;
+
+		end = memchr (line, '\n', len - pos);
+		llen = end ? (size_t)(end - line) : len - pos;
+		pos += llen + 1;
+
+		if (! inside) {
+			if ((llen >= 19)
+			    && (! strncmp (line, "### BEGIN INIT INFO", 19))) {
+				inside = TRUE;
+				header->lsb = TRUE;
+			}
+			continue;
+		}
+
+		if ((llen >= 17) && (! strncmp (line, "### END INIT INFO", 17)))
+			break;
+
+		if ((! llen) || (line[0] != '#'))
+			continue;
+
+		while (llen && ((line[0] == '#') || (line[0] == ' ')
+				|| (line[0] == '\t'))) {
+			line++;
+			llen--;
+		}
+
+		colon = memchr (line, ':', llen);
+		if (! colon)
+			continue;
+
+#define RC_FIELD(_name) (((size_t)(colon - line) == strlen (_name))	\
+			 && (! strncasecmp (line, _name, strlen (_name))))
+		if (RC_FIELD ("Provides")) {
+			array = &header->provides;
+		} else if (RC_FIELD ("Required-Start")
+			   || RC_FIELD ("Should-Start")) {
+			array = &header->start_requires;
+		} else if (RC_FIELD ("Required-Stop")
+			   || RC_FIELD ("Should-Stop")) {
+			array = &header->stop_requires;
+		}
+#undef RC_FIELD
+
+		if (! array)
+			continue;
+
+		colon++;
+		if (rc_words_add (array, header, colon,
+				  llen - (colon - line)) < 0)
+			goto error;
+	}
+
+	return header;
+
+error:
+	nih_free (header);
+	return NULL;
+}
+
+/**
+ * rc_header_load:
+ * @parent: parent object for new header,
+ * @path: path of script,
+ * @cache: cache of headers, may be NULL.
+ *
+ * Returns the header of the script at @path, taken from @cache when the
+ * script hasn't changed since it was cached so that unchanged scripts
+ * aren't read and parsed on every runlevel change.  Headers that are
+ * parsed are added to @cache, which is then their parent instead of
+ * @parent; either way the header is marked as used so that only the
+ * headers of scripts that still exist are written back.
+ *
+ * Returns: RcHeader or NULL on raised error.
+ **/
+RcHeader *
+rc_header_load (const void *parent,
+		const char *path,
+		NihHash    *cache)
+{
+	nih_local char *key = NULL;
+	nih_local char *buf = NULL;
+	RcHeader       *header;
+	struct stat     statbuf;
+	size_t          len;
+
+	nih_assert (path != NULL);
+
+	if (stat (path, &statbuf) < 0)
+		nih_return_system_error (NULL);
+
+	key = NIH_MUST (nih_sprintf (NULL, "%ju:%ju:%jd:%jd.%09ld",
+				     (uintmax_t)statbuf.st_dev,
+				     (uintmax_t)statbuf.st_ino,
+				     (intmax_t)statbuf.st_size,
+				     (intmax_t)statbuf.st_mtim.tv_sec,
+				     (long)statbuf.st_mtim.tv_nsec));
+
+	if (cache) {
+		header = (RcHeader *)nih_hash_lookup (cache, key);
+		if (header) {
+			header->used = TRUE;
+			return header;
+		}
+	}
+
+	buf = nih_file_read (NULL, path, &len);
+	if (! buf)
+		return NULL;
+
+	header = NIH_MUST (rc_header_parse (cache ? (void *)cache : parent,
+					    key, buf, len));
+	header->used = TRUE;
+
+	if (cache)
+		nih_hash_add (cache, &header->entry);
+
+	return header;
+}
+
+
+/**
+ * rc_scripts_find:
+ * @scripts: list to add to,
+ * @dir: rc directory,
+ * @prefix: 'S' or 'K',
+ * @action: argument to run the scripts with.
+ *
+ * Adds a new RcScript to @scripts for each link in @dir named with
+ * @prefix and a two-digit sequence number, ordered by sequence number
+ * and then name as the serial rc script would run them.  Links that
+ * aren't to executable files, other than ".sh" scripts, are ignored.
+ *
+ * A missing @dir is treated as having no scripts.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+rc_scripts_find (NihList    *scripts,
+		 const char *dir,
+		 char        prefix,
+		 const char *action)
+{
+	DIR           *dirp;
+	struct dirent *ent;
+
+	nih_assert (scripts != NULL);
+	nih_assert (dir != NULL);
+	nih_assert (action != NULL);
+
+	dirp = opendir (dir);
+	if (! dirp) {
+		if (errno == ENOENT)
+			return 0;
+
+		nih_return_system_error (-1);
+	}
+
+	while ((ent = readdir (dirp)) != NULL) {
+		nih_local char *path = NULL;
+		RcScript       *script;
+		struct stat     statbuf;
+		size_t          len;
+
+		if ((ent->d_name[0] != prefix)
+		    || (! isdigit (ent->d_name[1]))
+		    || (! isdigit (ent->d_name[2]))
+		    || (! ent->d_name[3]))
+			continue;
+
+		path = NIH_MUST (nih_sprintf (NULL, "%s/%s", dir, ent->d_name));
+		if ((stat (path, &statbuf) < 0) || (! S_ISREG (statbuf.st_mode)))
+			continue;
+
+		len = strlen (ent->d_name);
+		if ((! (statbuf.st_mode & S_IXUSR))
+		    && ((len < 3) || strcmp (ent->d_name + len - 3, ".sh")))
+			continue;
+
+		script = NIH_MUST (rc_script_new (scripts, path, prefix,
+						  ((ent->d_name[1] - '0') * 10
+						   + (ent->d_name[2] - '0')),
+						  ent->d_name + 3, action));
+
+		/* Insert in front of the first script of the same phase
+		 * that sorts after it, otherwise at the end.
+		 */
+		NIH_LIST_FOREACH (scripts, iter) {
+			RcScript *other = (RcScript *)iter;
+
+			if ((other == script) || (other->prefix != prefix))
+				continue;
+
+			if ((other->seq > script->seq)
+			    || ((other->seq == script->seq)
+				&& (strcmp (other->name, script->name) > 0))) {
+				nih_list_add (&other->entry, &script->entry);
+				break;
+			}
+		}
+
+		if (NIH_LIST_EMPTY (&script->entry))
+			nih_list_add (scripts, &script->entry);
+	}
+
+	closedir (dirp);
+
+	return 0;
+}
+
+
+/**
+ * rc_script_provides:
+ * @script: script to check,
+ * @facility: name of facility.
+ *
+ * Scripts provide the facilities named in their header, and their own
+ * name so that scripts without a header can still be depended on.
+ *
+ * Returns: TRUE if @script provides @facility, FALSE otherwise.
+ **/
+int
+rc_script_provides (const RcScript *script,
+		    const char     *facility)
+{
+	nih_assert (script != NULL);
+	nih_assert (facility != NULL);
+
+	if (! strcmp (script->name, facility))
+		return TRUE;
+
+	if (! script->header)
+		return FALSE;
+
+	for (char **name = script->header->provides; name && *name; name++)
+		if (! strcmp (*name, facility))
+			return TRUE;
+
+	return FALSE;
+}
+
+/**
+ * rc_header_lsb:
+ * @script: script to check.
+ *
+ * Returns: TRUE if @script has an LSB header, FALSE otherwise.
+ **/
+static int
+rc_header_lsb (const RcScript *script)
+{
+	nih_assert (script != NULL);
+
+	return script->header && script->header->lsb;
+}
+
+/**
+ * rc_header_wants_all:
+ * @script: script to check.
+ *
+ * Returns: TRUE if @script asks to be run after all others with the
+ * "$all" facility, FALSE otherwise.
+ **/
+static int
+rc_header_wants_all (const RcScript *script)
+{
+	char **requires;
+
+	nih_assert (script != NULL);
+
+	if (! rc_header_lsb (script))
+		return FALSE;
+
+	requires = (strcmp (script->action, "stop")
+		    ? script->header->start_requires
+		    : script->header->stop_requires);
+
+	for (char **name = requires; name && *name; name++)
+		if (! strcmp (*name, "$all"))
+			return TRUE;
+
+	return FALSE;
+}
+
+/**
+ * rc_script_before:
+ * @script: script to run first,
+ * @next: script to run after it.
+ *
+ * Records that @next must wait for @script to finish.
+ **/
+static void
+rc_script_before (RcScript *script,
+		  RcScript *next)
+{
+	nih_assert (script != NULL);
+	nih_assert (next != NULL);
+
+	if (script == next)
+		return;
+
+	for (size_t i = 0; i < script->dependents_len; i++)
+		if (script->dependents[i] == next)
+			return;
+
+	script->dependents = NIH_MUST (nih_realloc (
+					       script->dependents, script,
+					       sizeof (RcScript *)
+					       * (script->dependents_len + 1)));
+	script->dependents[script->dependents_len++] = next;
+
+	next->waiting++;
+}
+
+/**
+ * rc_script_require:
+ * @scripts: scripts in run,
+ * @script: script with requirement,
+ * @facility: facility required,
+ * @stop: TRUE if @script is being stopped,
+ * @facilities: virtual facilities, may be NULL,
+ * @depth: number of virtual facilities followed so far.
+ *
+ * Orders @script after each script of the same phase that provides
+ * @facility when starting, or before them when stopping so that what it
+ * needs is still running when it stops.  Virtual $facility names are
+ * followed through @facilities; facilities that nothing in the run
+ * provides are ignored.
+ **/
+static void
+rc_script_require (NihList    *scripts,
+		   RcScript   *script,
+		   const char *facility,
+		   int         stop,
+		   NihHash    *facilities,
+		   int         depth)
+{
+	nih_assert (scripts != NULL);
+	nih_assert (script != NULL);
+	nih_assert (facility != NULL);
+
+	if (facility[0] == '+')
+		facility++;
+
+	if ((facility[0] == '$') && facilities && (depth < RC_FACILITY_DEPTH)) {
+		RcFacility *virtual;
+
+		virtual = (RcFacility *)nih_hash_lookup (facilities, facility);
+		for (char **name = virtual ? virtual->names : NULL;
+		     name && *name; name++)
+			rc_script_require (scripts, script, *name, stop,
+					   facilities, depth + 1);
+	}
+
+	NIH_LIST_FOREACH (scripts, iter) {
+		RcScript *other = (RcScript *)iter;
+
+		if ((other == script) || (other->prefix != script->prefix))
+			continue;
+
+		if (! rc_script_provides (other, facility))
+			continue;
+
+		if (stop) {
+			rc_script_before (script, other);
+		} else {
+			rc_script_before (other, script);
+		}
+	}
+}
+
+/**
+ * rc_scripts_order:
+ * @scripts: scripts in run,
+ * @facilities: virtual facilities, may be NULL.
+ *
+ * Works out which scripts of each phase in @scripts must wait for
+ * which others, setting their dependents and waiting counts.  Scripts
+ * with an LSB header wait only for the facilities they name; scripts
+ * without one are barriers that wait for everything with a lower
+ * sequence number, and make everything with a higher one wait for them,
+ * as the serial rc script would have run them.
+ *
+ * The resulting graph is not checked for loops, those are broken when
+ * the scripts are run.
+ **/
+void
+rc_scripts_order (NihList *scripts,
+		  NihHash *facilities)
+{
+	nih_assert (scripts != NULL);
+
+	NIH_LIST_FOREACH (scripts, iter) {
+		RcScript *script = (RcScript *)iter;
+		char    **requires;
+		int       stop;
+
+		if (! rc_header_lsb (script)) {
+			NIH_LIST_FOREACH (scripts, jter) {
+				RcScript *other = (RcScript *)jter;
+
+				if (other->prefix != script->prefix)
+					continue;
+
+				if (other->seq < script->seq) {
+					rc_script_before (other, script);
+				} else if ((other->seq > script->seq)
+					   && rc_header_lsb (other)) {
+					rc_script_before (script, other);
+				}
+			}
+
+			continue;
+		}
+
+		stop = ! strcmp (script->action, "stop");
+		requires = (stop ? script->header->stop_requires
+			    : script->header->start_requires);
+
+		for (char **name = requires; name && *name; name++) {
+			if (strcmp (*name, "$all")) {
+				rc_script_require (scripts, script, *name, stop,
+						   facilities, 0);
+				continue;
+			}
+
+			NIH_LIST_FOREACH (scripts, jter) {
+				RcScript *other = (RcScript *)jter;
+
+				if ((other->prefix != script->prefix)
+				    || rc_header_wants_all (other))
+					continue;
+
+				rc_script_before (other, script);
+			}
+		}
+	}
+}
+
+
+/**
+ * rc_facilities_read:
+ * @parent: parent object for new hash table,
+ * @path: path of insserv configuration.
+ *
+ * Reads the virtual $facility names defined in the insserv configuration
+ * at @path, each line naming a facility followed by the scripts and
+ * other facilities it stands for; optional names, marked with a leading
+ * '+', are treated the same as others.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned hash table.  When all parents
+ * of the returned hash table are freed, the returned hash table will
+ * also be freed.
+ *
+ * Returns: newly allocated hash table of facilities or NULL on raised
+ * error.
+ **/
+NihHash *
+rc_facilities_read (const void *parent,
+		    const char *path)
+{
+	nih_local char *buf = NULL;
+	NihHash        *facilities;
+	size_t          len;
+	size_t          pos = 0;
+
+	nih_assert (path != NULL);
+
+	buf = nih_file_read (NULL, path, &len);
+	if (! buf)
+		return NULL;
+
+	facilities = NIH_MUST (nih_hash_string_new (parent, 0));
+
+	while (pos < len) {
+		nih_local char **words = NULL;
+		const char      *line = buf + pos;
+		const char      *end;
+		RcFacility      *facility;
+		size_t           llen;
+
+		end = memchr (line, '\n', len - pos);
+		llen = end ? (size_t)(end - line) : len - pos;
+		pos += llen + 1;
+
+		words = NIH_MUST (nih_str_array_new (NULL));
+		NIH_ZERO (rc_words_add (&words, NULL, line, llen));
+
+		if ((! words[0]) || (words[0][0] != '$'))
+			continue;
+
+		facility = NIH_MUST (nih_new (facilities, RcFacility));
+		nih_list_init (&facility->entry);
+		nih_alloc_set_destructor (facility, nih_list_destroy);
+
+		facility->name = NIH_MUST (nih_strdup (facility, words[0]));
+		facility->names = NIH_MUST (nih_str_array_new (facility));
+
+		for (char **word = words + 1; *word; word++)
+			NIH_MUST (nih_str_array_add (&facility->names, facility,
+						     NULL, *word[0] == '+'
+						     ? *word + 1 : *word));
+
+		nih_hash_add (facilities, &facility->entry);
+	}
+
+	return facilities;
+}
+
+
+/**
+ * rc_cache_read:
+ * @parent: parent object for new hash table,
+ * @path: path of cache file.
+ *
+ * Reads the headers cached in @path by rc_cache_write().
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned hash table.  When all parents
+ * of the returned hash table are freed, the returned hash table will
+ * also be freed.
+ *
+ * Returns: newly allocated hash table of headers or NULL on raised error.
+ **/
+NihHash *
+rc_cache_read (const void *parent,
+	       const char *path)
+{
+	nih_local char *buf = NULL;
+	NihHash        *cache;
+	size_t          len;
+	size_t          pos;
+
+	nih_assert (path != NULL);
+
+	buf = nih_file_read (NULL, path, &len);
+	if (! buf)
+		return NULL;
+
+	pos = strlen (RC_CACHE_HEADER);
+	if ((len <= pos) || strncmp (buf, RC_CACHE_HEADER, pos)
+	    || (buf[pos] != '\n'))
+		nih_return_error (NULL, EINVAL, _("Illegal cache file"));
+	pos++;
+
+	cache = NIH_MUST (nih_hash_string_new (parent, 0));
+
+	while (pos < len) {
+		nih_local char *line = NULL;
+		char           *fields[5];
+		const char     *end;
+		RcHeader       *header;
+		size_t          llen;
+
+		end = memchr (buf + pos, '\n', len - pos);
+		if (! end)
+			break;
+
+		llen = end - (buf + pos);
+		line = NIH_MUST (nih_strndup (NULL, buf + pos, llen));
+		pos += llen + 1;
+
+		if (rc_fields_split (line, fields, 5) != 5)
+			continue;
+
+		header = NIH_MUST (rc_header_parse (cache, fields[0], "", 0));
+		header->lsb = (fields[1][0] == '1');
+
+		NIH_ZERO (rc_words_add (&header->provides, header,
+					fields[2], strlen (fields[2])));
+		NIH_ZERO (rc_words_add (&header->start_requires, header,
+					fields[3], strlen (fields[3])));
+		NIH_ZERO (rc_words_add (&header->stop_requires, header,
+					fields[4], strlen (fields[4])));
+
+		nih_hash_add (cache, &header->entry);
+	}
+
+	return cache;
+}
+
+/**
+ * rc_cache_write:
+ * @cache: cache of headers,
+ * @path: path of cache file.
+ *
+ * Replaces @path with the headers in @cache that were used in this run,
+ * so that those of scripts that have since been removed or changed
+ * aren't kept forever.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+rc_cache_write (NihHash    *cache,
+		const char *path)
+{
+	nih_local char *contents = NULL;
+
+	nih_assert (cache != NULL);
+	nih_assert (path != NULL);
+
+	contents = NIH_MUST (nih_strdup (NULL, RC_CACHE_HEADER "\n"));
+
+	NIH_HASH_FOREACH (cache, iter) {
+		RcHeader       *header = (RcHeader *)iter;
+		nih_local char *provides = NULL;
+		nih_local char *start_requires = NULL;
+		nih_local char *stop_requires = NULL;
+
+		if (! header->used)
+			continue;
+
+		provides = NIH_MUST (rc_words_join (NULL, header->provides));
+		start_requires = NIH_MUST (rc_words_join (
+						   NULL, header->start_requires));
+		stop_requires = NIH_MUST (rc_words_join (
+						  NULL, header->stop_requires));
+
+		NIH_MUST (nih_strcat_sprintf (&contents, NULL,
+					      "%s\t%d\t%s\t%s\t%s\n",
+					      header->key, header->lsb ? 1 : 0,
+					      provides, start_requires,
+					      stop_requires));
+	}
+
+	return rc_file_replace (path, contents);
+}
+
+
+/**
+ * rc_state_write:
+ * @scripts: scripts in run,
+ * @path: path of state file.
+ *
+ * Replaces @path with the state of each script in @scripts.  The file
+ * is written to a temporary name and renamed over the old one, so that
+ * initctl never sees it half-written.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+rc_state_write (NihList    *scripts,
+		const char *path)
+{
+	nih_local char *contents = NULL;
+
+	nih_assert (scripts != NULL);
+	nih_assert (path != NULL);
+
+	contents = NIH_MUST (nih_strdup (NULL, RC_STATE_HEADER "\n"));
+
+	NIH_LIST_FOREACH (scripts, iter) {
+		RcScript *script = (RcScript *)iter;
+
+		NIH_MUST (nih_strcat_sprintf (&contents, NULL,
+					      "%s\t%c\t%s\t%s\t%d\t%" PRIu64
+					      "\t%" PRIu64 "\t%d\n",
+					      script->name, script->prefix,
+					      script->action,
+					      rc_state_name (script->state),
+					      (int)script->pid,
+					      script->started, script->finished,
+					      script->status));
+	}
+
+	return rc_file_replace (path, contents);
+}
+
+/**
+ * rc_state_read:
+ * @parent: parent object for new list,
+ * @path: path of state file.
+ *
+ * Reads the state of each script of the last run written to @path by
+ * rc_state_write(); the scripts returned have no path, header or
+ * dependencies.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned list.  When all parents
+ * of the returned list are freed, the returned list will also be freed.
+ *
+ * Returns: newly allocated list of RcScript or NULL on raised error.
+ **/
+NihList *
+rc_state_read (const void *parent,
+	       const char *path)
+{
+	nih_local char *buf = NULL;
+	NihList        *scripts;
+	size_t          len;
+	size_t          pos;
+
+	nih_assert (path != NULL);
+
+	buf = nih_file_read (NULL, path, &len);
+	if (! buf)
+		return NULL;
+
+	pos = strlen (RC_STATE_HEADER);
+	if ((len <= pos) || strncmp (buf, RC_STATE_HEADER, pos)
+	    || (buf[pos] != '\n'))
+		nih_return_error (NULL, EINVAL, _("Illegal state file"));
+	pos++;
+
+	scripts = NIH_MUST (nih_list_new (parent));
+
+	while (pos < len) {
+		nih_local char *line = NULL;
+		char           *fields[8];
+		const char     *end;
+		RcScript       *script;
+		int             state;
+		size_t          llen;
+
+		end = memchr (buf + pos, '\n', len - pos);
+		if (! end)
+			break;
+
+		llen = end - (buf + pos);
+		line = NIH_MUST (nih_strndup (NULL, buf + pos, llen));
+		pos += llen + 1;
+
+		if (rc_fields_split (line, fields, 8) != 8)
+			continue;
+
+		state = rc_state_from_name (fields[3]);
+		if (state < 0)
+			continue;
+
+		script = NIH_MUST (rc_script_new (scripts, NULL, fields[1][0],
+						  0, fields[0], fields[2]));
+		script->state = state;
+		script->pid = atoi (fields[4]);
+		script->started = strtoull (fields[5], NULL, 10);
+		script->finished = strtoull (fields[6], NULL, 10);
+		script->status = atoi (fields[7]);
+
+		nih_list_add (scripts, &script->entry);
+	}
+
+	return scripts;
+}
+
+
+/**
+ * rc_fields_split:
+ * @line: line to split,
+ * @fields: array to fill,
+ * @max: size of @fields.
+ *
+ * Splits @line in place at each tab, filling @fields with up to @max
+ * fields; unlike nih_str_split() empty fields are kept.
+ *
+ * Returns: number of fields in @line, which may be more than @max.
+ **/
+static size_t
+rc_fields_split (char   *line,
+		 char  **fields,
+		 size_t  max)
+{
+	size_t len = 0;
+	char  *field;
+
+	nih_assert (line != NULL);
+	nih_assert (fields != NULL);
+
+	while ((field = strsep (&line, "\t")) != NULL) {
+		if (len < max)
+			fields[len] = field;
+		len++;
+	}
+
+	return len;
+}
+
+/**
+ * rc_file_replace:
+ * @path: path of file,
+ * @contents: new contents.
+ *
+ * Atomically replaces @path with @contents, creating its directory if
+ * needed.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+rc_file_replace (const char *path,
+		 const char *contents)
+{
+	nih_local char *dir = NULL;
+	nih_local char *tmp = NULL;
+	size_t          len;
+	size_t          done = 0;
+	int             fd;
+
+	nih_assert (path != NULL);
+	nih_assert (contents != NULL);
+
+	dir = NIH_MUST (nih_strdup (NULL, path));
+	if ((mkdir (dirname (dir), 0755) < 0) && (errno != EEXIST))
+		nih_return_system_error (-1);
+
+	tmp = NIH_MUST (nih_sprintf (NULL, "%s.tmp", path));
+
+	fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		nih_return_system_error (-1);
+
+	len = strlen (contents);
+	while (done < len) {
+		ssize_t ret;
+
+		ret = write (fd, contents + done, len - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			nih_error_raise_system ();
+			close (fd);
+			unlink (tmp);
+			return -1;
+		}
+
+		done += ret;
+	}
+
+	if ((close (fd) < 0) || (rename (tmp, path) < 0)) {
+		nih_error_raise_system ();
+		unlink (tmp);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,201 @@
+/* upstart
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef UTIL_RC_H
+#define UTIL_RC_H
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+#include <nih/macros.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+
+
+/**
+ * RC_STATE_FILE:
+ *
+ * File the state of each rc script run is written to, so that initctl
+ * can show them alongside jobs.
+ **/
+#define RC_STATE_FILE "/run/upstart/rc.state"
+
+/**
+ * RC_STATE_ENV:
+ *
+ * Environment variable that overrides RC_STATE_FILE.
+ **/
+#define RC_STATE_ENV "UPSTART_RC_STATE"
+
+/**
+ * RC_STATE_HEADER:
+ *
+ * First line of the state file, naming its format and version.
+ **/
+#define RC_STATE_HEADER "upstart-rc-state 1"
+
+/**
+ * RC_CACHE_FILE:
+ *
+ * File the LSB headers of rc scripts are cached in between runs.
+ **/
+#define RC_CACHE_FILE "/var/cache/upstart/rc.cache"
+
+/**
+ * RC_CACHE_HEADER:
+ *
+ * First line of the cache file, naming its format and version.
+ **/
+#define RC_CACHE_HEADER "upstart-rc-cache 1"
+
+/**
+ * RC_TRACE_PID:
+ *
+ * Process id rc scripts are shown under in the boot trace, clear of
+ * those the init daemon uses for jobs and events.
+ **/
+#define RC_TRACE_PID 100
+
+/**
+ * RC_FACILITIES_FILE:
+ *
+ * insserv configuration file defining the $facility names scripts may
+ * depend on.
+ **/
+#define RC_FACILITIES_FILE "/etc/insserv.conf"
+
+
+/**
+ * RcState:
+ *
+ * State of each rc script in a run.
+ **/
+typedef enum rc_state {
+	RC_WAITING,
+	RC_RUNNING,
+	RC_DONE,
+	RC_FAILED,
+} RcState;
+
+
+/**
+ * RcHeader:
+ * @entry: hash table entry,
+ * @key: identity of the script file it was read from,
+ * @lsb: TRUE if the script had an LSB header,
+ * @provides: facilities the script provides,
+ * @start_requires: facilities the script must start after,
+ * @stop_requires: facilities the script must stop before,
+ * @used: TRUE if the header was used in this run.
+ *
+ * The dependency information read from the "### BEGIN INIT INFO" block
+ * of an rc script, or from the cache of them; Should- facilities are
+ * merged into the Required- ones, since facilities that aren't provided
+ * by any script in the run are ignored either way.
+ **/
+typedef struct rc_header {
+	NihList   entry;
+	char     *key;
+	int       lsb;
+	char    **provides;
+	char    **start_requires;
+	char    **stop_requires;
+	int       used;
+} RcHeader;
+
+/**
+ * RcScript:
+ * @entry: list header,
+ * @name: name of script, without prefix and sequence number,
+ * @path: path of rc link,
+ * @prefix: 'S' or 'K',
+ * @seq: sequence number,
+ * @action: argument the script is run with,
+ * @header: dependency information,
+ * @dependents: scripts that must wait for this one,
+ * @dependents_len: number of @dependents,
+ * @waiting: number of scripts this one is still waiting for,
+ * @state: state of script,
+ * @pid: process id while running,
+ * @started: time the script was started,
+ * @finished: time the script finished,
+ * @status: exit status, as returned by waitpid().
+ *
+ * Each rc link run in a runlevel change; times are on CLOCK_MONOTONIC
+ * in microseconds, so they line up with the boot trace.
+ **/
+typedef struct rc_script {
+	NihList            entry;
+	char              *name;
+	char              *path;
+	char               prefix;
+	int                seq;
+	char              *action;
+	RcHeader          *header;
+	struct rc_script **dependents;
+	size_t             dependents_len;
+	size_t             waiting;
+	RcState            state;
+	pid_t              pid;
+	uint64_t           started;
+	uint64_t           finished;
+	int                status;
+} RcScript;
+
+
+NIH_BEGIN_EXTERN
+
+uint64_t    rc_now             (void);
+
+const char *rc_state_name      (RcState state);
+int         rc_state_from_name (const char *name);
+
+RcScript *  rc_script_new      (const void *parent, const char *path,
+				char prefix, int seq, const char *name,
+				const char *action)
+	__attribute__ ((warn_unused_result));
+
+RcHeader *  rc_header_parse    (const void *parent, const char *key,
+				const char *buf, size_t len)
+	__attribute__ ((warn_unused_result));
+RcHeader *  rc_header_load     (const void *parent, const char *path,
+				NihHash *cache)
+	__attribute__ ((warn_unused_result));
+
+int         rc_scripts_find    (NihList *scripts, const char *dir,
+				char prefix, const char *action)
+	__attribute__ ((warn_unused_result));
+int         rc_script_provides (const RcScript *script,
+				const char *facility);
+void        rc_scripts_order   (NihList *scripts, NihHash *facilities);
+
+NihHash *   rc_facilities_read (const void *parent, const char *path)
+	__attribute__ ((warn_unused_result));
+
+NihHash *   rc_cache_read      (const void *parent, const char *path)
+	__attribute__ ((warn_unused_result));
+int         rc_cache_write     (NihHash *cache, const char *path)
+	__attribute__ ((warn_unused_result));
+
+int         rc_state_write     (NihList *scripts, const char *path)
+	__attribute__ ((warn_unused_result));
+NihList *   rc_state_read      (const void *parent, const char *path)
+	__attribute__ ((warn_unused_result));
+
+NIH_END_EXTERN
+
+#endif /* UTIL_RC_H */
@@ -29,6 +29,7 @@
 #include <sys/param.h>
 
 #include <pwd.h>
+#include <poll.h>
 #include <time.h>
 #include <utmpx.h>
 #include <fcntl.h>
@@ -89,6 +90,21 @@
 #define RUN_INITCTL "/run/initctl"
 #endif
 
+/**
+ * WALL_TIMEOUT:
+ *
+ * Milliseconds wall() may spend writing to terminals; those that have not
+ * taken the whole message by then are skipped.
+ **/
+#define WALL_TIMEOUT 2000
+
+/**
+ * WALL_MAX_TERMINALS:
+ *
+ * Number of terminals wall() writes to at once.
+ **/
+#define WALL_MAX_TERMINALS 256
+
 /* Prototypes for option functions */
 static int runlevel_option (NihOption *option, const char *arg);
 
@@ -101,6 +117,9 @@ static void  timer_callback    (const char *message);
 static char *warning_message   (const char *message)
 	__attribute__ ((warn_unused_result));
 static void  wall              (const char *message);
+static int   wall_user         (const struct utmpx *ent);
+static int   wall_open         (const struct utmpx *ent);
+static long  wall_now          (void);
 static void  sysvinit_shutdown (void);
 
 
@@ -669,26 +688,108 @@ alarm_handler (int signum)
 {
 }
 
+/**
+ * wall_user:
+ * @ent: utmp entry.
+ *
+ * Entries without a name, or not of a user process, are ignored.
+ *
+ * Returns: TRUE if @ent is of a logged in user.
+ **/
+static int
+wall_user (const struct utmpx *ent)
+{
+	nih_assert (ent != NULL);
+
+	return ((ent->ut_type == USER_PROCESS) && strlen (ent->ut_user));
+}
+
+/**
+ * wall_open:
+ * @ent: utmp entry.
+ *
+ * Opens the terminal of @ent for writing without blocking.
+ *
+ * Returns: open file descriptor, or -1 if the terminal could not be
+ * opened.
+ **/
+static int
+wall_open (const struct utmpx *ent)
+{
+	char dev[PATH_MAX + 1];
+	int  fd;
+
+	nih_assert (ent != NULL);
+
+	/* Construct the device path */
+	if (strncmp (ent->ut_line, DEV "/", 5)) {
+		snprintf (dev, sizeof (dev),
+			  "%s/%s", DEV, ent->ut_line);
+	} else {
+		snprintf (dev, sizeof (dev), "%s", ent->ut_line);
+	}
+
+	fd = open (dev, O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (! isatty (fd)) {
+		close (fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * wall_now:
+ *
+ * Returns: current time on CLOCK_MONOTONIC in milliseconds.
+ **/
+static long
+wall_now (void)
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	return ((long)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
 /**
  * wall:
  * @message: message to send.
  *
  * Send a message to all logged in users; based largely on the code from
  * bsdutils.  This is done in a child process to stop anything blocking.
+ *
+ * Terminals are opened and written without blocking, up to
+ * WALL_MAX_TERMINALS at once, so that one that isn't taking output
+ * doesn't hold up the others; all are given WALL_TIMEOUT between them
+ * to take the message, and those that haven't by then are skipped and
+ * counted in a warning.
  **/
 static void
 wall (const char *message)
 {
-	struct sigaction act;
-	struct utmpx *   ent;
-	pid_t            pid;
-	time_t           now;
-	struct tm *      tm;
-	char *           user;
-	char *           tty;
-	char             hostname[MAXHOSTNAMELEN];
-	char *           banner1;
-	char *           banner2;
+	struct utmpx * ent;
+	pid_t          pid;
+	time_t         now;
+	struct tm *    tm;
+	char *         user;
+	char *         tty;
+	char           hostname[MAXHOSTNAMELEN];
+	char *         banner1;
+	char *         banner2;
+	char *         text;
+	size_t         len;
+	struct pollfd  terms[WALL_MAX_TERMINALS];
+	size_t         written[WALL_MAX_TERMINALS];
+	nfds_t         nterms = 0;
+	int            more = TRUE;
+	long           deadline;
+	int            total = 0;
+	int            skipped = 0;
 
 	pid = fork ();
 	if (pid < 0) {
@@ -699,12 +800,6 @@ wall (const char *message)
 		return;
 	}
 
-	/* Break syscalls with SIGALRM */
-	act.sa_handler = alarm_handler;
-	act.sa_flags = 0;
-	sigemptyset (&act.sa_mask);
-	sigaction (SIGALRM, &act, NULL);
-
 
 	/* Get username for banner */
 	user = getlogin ();
@@ -742,46 +837,117 @@ wall (const char *message)
 	banner2 = nih_sprintf (NULL, _("(%s) at %d:%02d ..."),
 			       tty, tm->tm_hour, tm->tm_min);
 
+	/* The banner and message are written together, as much at a time
+	 * as each terminal will take.
+	 */
+	text = NIH_MUST (nih_sprintf (NULL, "\007\r\n%s\r\n\t%s\r\n\r\n%s",
+				      banner1, banner2, message));
+	len = strlen (text);
+
+
+	/* Iterate entries in the utmp file, writing to as many terminals
+	 * at once as we may as each is ready to take more of the message.
+	 */
+	deadline = wall_now () + WALL_TIMEOUT;
 
-	/* Iterate entries in the utmp file */
 	setutxent ();
-	while ((ent = getutxent ()) != NULL) {
-		char dev[PATH_MAX + 1];
-		int  fd;
+	while (more || nterms) {
+		int timeout;
 
-		/* Ignore entries without a name, or not a user process */
-		if ((ent->ut_type != USER_PROCESS)
-		    || (! strlen (ent->ut_user)))
-			continue;
+		while (more && (nterms < WALL_MAX_TERMINALS)) {
+			int fd;
 
-		/* Construct the device path */
-		if (strncmp (ent->ut_line, DEV "/", 5)) {
-			snprintf (dev, sizeof (dev),
-				  "%s/%s", DEV, ent->ut_line);
-		} else {
-			snprintf (dev, sizeof (dev), "%s", ent->ut_line);
+			ent = getutxent ();
+			if (! ent) {
+				more = FALSE;
+				break;
+			}
+
+			if (! wall_user (ent))
+				continue;
+
+			total++;
+
+			fd = wall_open (ent);
+			if (fd < 0) {
+				skipped++;
+				continue;
+			}
+
+			terms[nterms].fd = fd;
+			terms[nterms].events = POLLOUT;
+			terms[nterms].revents = 0;
+			written[nterms] = 0;
+			nterms++;
+		}
+
+		if (! nterms)
+			break;
+
+		timeout = deadline - wall_now ();
+		if (timeout <= 0)
+			break;
+
+		if (poll (terms, nterms, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			break;
 		}
 
-		alarm (2);
-		fd = open (dev, O_WRONLY | O_NDELAY | O_NOCTTY);
-		if ((fd >= 0) && isatty (fd)) {
-			FILE *term;
-
-			term = fdopen (fd, "w");
-			if (term) {
-				fprintf (term, "\007\r\n%s\r\n\t%s\r\n\r\n",
-					 banner1, banner2);
-				fputs (message, term);
-				fflush (term);
-				fclose (term);
+		for (nfds_t i = 0; i < nterms; ) {
+			ssize_t ret = 0;
+
+			if (terms[i].revents & POLLOUT) {
+				ret = write (terms[i].fd, text + written[i],
+					     len - written[i]);
+				if (ret > 0)
+					written[i] += ret;
+			}
+
+			if (written[i] < len) {
+				if (! (terms[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+				    && ((ret >= 0) || (errno == EAGAIN)
+					|| (errno == EINTR))) {
+					i++;
+					continue;
+				}
+
+				skipped++;
 			}
+
+			close (terms[i].fd);
+
+			nterms--;
+			terms[i] = terms[nterms];
+			written[i] = written[nterms];
 		}
-		alarm (0);
+	}
+
+	/* Whatever is left when we run out of time is skipped, including
+	 * the terminals not yet opened.
+	 */
+	for (nfds_t i = 0; i < nterms; i++) {
+		close (terms[i].fd);
+		skipped++;
+	}
+
+	while (more && ((ent = getutxent ()) != NULL)) {
+		if (! wall_user (ent))
+			continue;
+
+		total++;
+		skipped++;
 	}
 	endutxent ();
 
+	if (skipped)
+		nih_warn (_("Unable to warn users on %d of %d terminals"),
+			  skipped, total);
+
 	nih_free (banner1);
 	nih_free (banner2);
+	nih_free (text);
 
 	exit (0);
 }
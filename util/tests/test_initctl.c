@@ -53,6 +53,8 @@
 
 #include "com.ubuntu.Upstart.h"
 
+#include "rc.h"
+
 #include "test_util_common.h"
 
 extern int use_dbus;
@@ -61,12 +63,15 @@ extern int dbus_bus_type;
 extern char *dest_name;
 extern const char *dest_address;
 extern int no_wait;
+extern char *output_format;
 
 extern NihDBusProxy *upstart_open (const void *parent)
 	__attribute__ ((warn_unused_result));
 extern char *        job_status   (const void *parent,
 				   NihDBusProxy *job_class, NihDBusProxy *job)
 	__attribute__ ((warn_unused_result));
+extern char **       batch_split  (const void *parent, const char *line)
+	__attribute__ ((warn_unused_result));
 
 extern int start_action                (NihCommand *command, char * const *args);
 extern int stop_action                 (NihCommand *command, char * const *args);
@@ -97,6 +102,388 @@ my_connect_handler (DBusServer *    server,
 	return TRUE;
 }
 
+/**
+ * append_job_state:
+ * @arrayiter: iterator for the GetAllJobStates reply array,
+ * @job: job name,
+ * @instance: instance name,
+ * @goal: goal of instance,
+ * @state: state of instance,
+ * @process: name of process or NULL,
+ * @pid: pid of @process.
+ *
+ * Append an entry for a GetAllJobStates reply to @arrayiter, with a
+ * single process if @process is not NULL.
+ **/
+static void
+append_job_state (DBusMessageIter *arrayiter,
+		  const char *     job,
+		  const char *     instance,
+		  const char *     goal,
+		  const char *     state,
+		  const char *     process,
+		  int32_t          pid)
+{
+	DBusMessageIter structiter;
+	DBusMessageIter subiter;
+
+	dbus_message_iter_open_container (arrayiter, DBUS_TYPE_STRUCT,
+					  NULL, &structiter);
+
+	dbus_message_iter_append_basic (&structiter, DBUS_TYPE_STRING, &job);
+	dbus_message_iter_append_basic (&structiter, DBUS_TYPE_STRING, &instance);
+	dbus_message_iter_append_basic (&structiter, DBUS_TYPE_STRING, &goal);
+	dbus_message_iter_append_basic (&structiter, DBUS_TYPE_STRING, &state);
+
+	dbus_message_iter_open_container (&structiter, DBUS_TYPE_ARRAY,
+					  DBUS_TYPE_STRING_AS_STRING, &subiter);
+	if (process)
+		dbus_message_iter_append_basic (&subiter, DBUS_TYPE_STRING,
+						&process);
+	dbus_message_iter_close_container (&structiter, &subiter);
+
+	dbus_message_iter_open_container (&structiter, DBUS_TYPE_ARRAY,
+					  DBUS_TYPE_INT32_AS_STRING, &subiter);
+	if (process)
+		dbus_message_iter_append_basic (&subiter, DBUS_TYPE_INT32,
+						&pid);
+	dbus_message_iter_close_container (&structiter, &subiter);
+
+	dbus_message_iter_close_container (arrayiter, &structiter);
+}
+
+/**
+ * reject_get_all_job_states:
+ * @server_conn: connection to the client,
+ * @pattern: expected pattern argument.
+ *
+ * Expect the GetAllJobStates method call on the manager object with
+ * @pattern and reply as an older init daemon without the method would,
+ * so that the client falls back to querying each object in turn.
+ **/
+static void
+reject_get_all_job_states (DBusConnection *server_conn,
+			   const char *    pattern)
+{
+	DBusMessage *method_call;
+	DBusMessage *reply = NULL;
+	const char * pattern_value;
+
+	TEST_DBUS_MESSAGE (server_conn, method_call);
+
+	TEST_TRUE (dbus_message_is_method_call (method_call,
+						DBUS_INTERFACE_UPSTART,
+						"GetAllJobStates"));
+
+	TEST_EQ_STR (dbus_message_get_path (method_call), DBUS_PATH_UPSTART);
+
+	TEST_TRUE (dbus_message_get_args (method_call, NULL,
+					  DBUS_TYPE_STRING, &pattern_value,
+					  DBUS_TYPE_INVALID));
+
+	TEST_EQ_STR (pattern_value, pattern);
+
+	TEST_ALLOC_SAFE {
+		reply = dbus_message_new_error (method_call,
+						DBUS_ERROR_UNKNOWN_METHOD,
+						"Unknown method");
+	}
+
+	dbus_connection_send (server_conn, reply, NULL);
+	dbus_connection_flush (server_conn);
+
+	dbus_message_unref (method_call);
+	dbus_message_unref (reply);
+}
+
+/**
+ * expect_get_job_by_name:
+ * @server_conn: connection to the client,
+ * @name: expected job name.
+ *
+ * Expect the GetJobByName method call on the manager object for @name
+ * and reply with the path of the job.
+ **/
+static void
+expect_get_job_by_name (DBusConnection *server_conn,
+			const char *    name)
+{
+	DBusMessage *    method_call;
+	DBusMessage *    reply = NULL;
+	const char *     name_value;
+	nih_local char * path = NULL;
+
+	TEST_DBUS_MESSAGE (server_conn, method_call);
+
+	TEST_TRUE (dbus_message_is_method_call (method_call,
+						DBUS_INTERFACE_UPSTART,
+						"GetJobByName"));
+
+	TEST_EQ_STR (dbus_message_get_path (method_call), DBUS_PATH_UPSTART);
+
+	TEST_TRUE (dbus_message_get_args (method_call, NULL,
+					  DBUS_TYPE_STRING, &name_value,
+					  DBUS_TYPE_INVALID));
+
+	TEST_EQ_STR (name_value, name);
+
+	TEST_ALLOC_SAFE {
+		path = nih_sprintf (NULL, "%s/jobs/%s", DBUS_PATH_UPSTART, name);
+
+		reply = dbus_message_new_method_return (method_call);
+
+		dbus_message_append_args (reply,
+					  DBUS_TYPE_OBJECT_PATH, &path,
+					  DBUS_TYPE_INVALID);
+	}
+
+	dbus_connection_send (server_conn, reply, NULL);
+	dbus_connection_flush (server_conn);
+
+	dbus_message_unref (method_call);
+	dbus_message_unref (reply);
+}
+
+/**
+ * expect_start:
+ * @server_conn: connection to the client,
+ * @name: expected job name.
+ *
+ * Expect the Start method call on the job object for @name with no
+ * environment, waiting for the job, and reply with the path of the
+ * instance without a name.
+ **/
+static void
+expect_start (DBusConnection *server_conn,
+	      const char *    name)
+{
+	DBusMessage *    method_call;
+	DBusMessage *    reply = NULL;
+	char **          args_value;
+	int              args_elements;
+	int              wait_value;
+	nih_local char * path = NULL;
+
+	TEST_DBUS_MESSAGE (server_conn, method_call);
+
+	TEST_TRUE (dbus_message_is_method_call (method_call,
+						DBUS_INTERFACE_UPSTART_JOB,
+						"Start"));
+
+	TEST_ALLOC_SAFE {
+		path = nih_sprintf (NULL, "%s/jobs/%s", DBUS_PATH_UPSTART, name);
+	}
+
+	TEST_EQ_STR (dbus_message_get_path (method_call), path);
+
+	TEST_TRUE (dbus_message_get_args (method_call, NULL,
+					  DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &args_value, &args_elements,
+					  DBUS_TYPE_BOOLEAN, &wait_value,
+					  DBUS_TYPE_INVALID));
+
+	TEST_EQ (args_elements, 0);
+	dbus_free_string_array (args_value);
+
+	TEST_TRUE (wait_value);
+
+	TEST_ALLOC_SAFE {
+		NIH_MUST (nih_strcat (&path, NULL, "/_"));
+
+		reply = dbus_message_new_method_return (method_call);
+
+		dbus_message_append_args (reply,
+					  DBUS_TYPE_OBJECT_PATH, &path,
+					  DBUS_TYPE_INVALID);
+	}
+
+	dbus_connection_send (server_conn, reply, NULL);
+	dbus_connection_flush (server_conn);
+
+	dbus_message_unref (method_call);
+	dbus_message_unref (reply);
+}
+
+/**
+ * append_property:
+ * @arrayiter: iterator for the GetAll reply array,
+ * @name: name of property,
+ * @value: string value of property.
+ *
+ * Append a dictionary entry for the string property @name to @arrayiter.
+ **/
+static void
+append_property (DBusMessageIter *arrayiter,
+		 const char *     name,
+		 const char *     value)
+{
+	DBusMessageIter dictiter;
+	DBusMessageIter subiter;
+
+	dbus_message_iter_open_container (arrayiter, DBUS_TYPE_DICT_ENTRY,
+					  NULL, &dictiter);
+
+	dbus_message_iter_append_basic (&dictiter, DBUS_TYPE_STRING, &name);
+
+	dbus_message_iter_open_container (&dictiter, DBUS_TYPE_VARIANT,
+					  DBUS_TYPE_STRING_AS_STRING, &subiter);
+	dbus_message_iter_append_basic (&subiter, DBUS_TYPE_STRING, &value);
+	dbus_message_iter_close_container (&dictiter, &subiter);
+
+	dbus_message_iter_close_container (arrayiter, &dictiter);
+}
+
+/**
+ * expect_job_status:
+ * @server_conn: connection to the client,
+ * @name: expected job name,
+ * @pid: pid of main process.
+ *
+ * Expect the Get call for the name of the job @name and the GetAll call
+ * for the properties of its instance without a name, replying that it
+ * is running with @pid as its main process.
+ **/
+static void
+expect_job_status (DBusConnection *server_conn,
+		   const char *    name,
+		   int32_t         pid)
+{
+	DBusMessage *    method_call;
+	DBusMessage *    reply = NULL;
+	const char *     interface;
+	const char *     property;
+	const char *     str_value;
+	DBusMessageIter  iter;
+	DBusMessageIter  subiter;
+	DBusMessageIter  arrayiter;
+	DBusMessageIter  dictiter;
+	DBusMessageIter  prociter;
+	DBusMessageIter  structiter;
+	nih_local char * path = NULL;
+
+	TEST_ALLOC_SAFE {
+		path = nih_sprintf (NULL, "%s/jobs/%s", DBUS_PATH_UPSTART, name);
+	}
+
+	/* Expect the Get call for the job name, reply with the name. */
+	TEST_DBUS_MESSAGE (server_conn, method_call);
+
+	TEST_TRUE (dbus_message_is_method_call (method_call,
+						DBUS_INTERFACE_PROPERTIES,
+						"Get"));
+
+	TEST_EQ_STR (dbus_message_get_path (method_call), path);
+
+	TEST_TRUE (dbus_message_get_args (method_call, NULL,
+					  DBUS_TYPE_STRING, &interface,
+					  DBUS_TYPE_STRING, &property,
+					  DBUS_TYPE_INVALID));
+
+	TEST_EQ_STR (interface, DBUS_INTERFACE_UPSTART_JOB);
+	TEST_EQ_STR (property, "name");
+
+	TEST_ALLOC_SAFE {
+		reply = dbus_message_new_method_return (method_call);
+
+		dbus_message_iter_init_append (reply, &iter);
+
+		dbus_message_iter_open_container (&iter, DBUS_TYPE_VARIANT,
+						  DBUS_TYPE_STRING_AS_STRING,
+						  &subiter);
+		dbus_message_iter_append_basic (&subiter, DBUS_TYPE_STRING,
+						&name);
+		dbus_message_iter_close_container (&iter, &subiter);
+	}
+
+	dbus_connection_send (server_conn, reply, NULL);
+	dbus_connection_flush (server_conn);
+
+	dbus_message_unref (method_call);
+	dbus_message_unref (reply);
+
+	/* Expect the GetAll call for the instance properties, reply with
+	 * the properties.
+	 */
+	TEST_DBUS_MESSAGE (server_conn, method_call);
+
+	TEST_TRUE (dbus_message_is_method_call (method_call,
+						DBUS_INTERFACE_PROPERTIES,
+						"GetAll"));
+
+	TEST_ALLOC_SAFE {
+		NIH_MUST (nih_strcat (&path, NULL, "/_"));
+	}
+
+	TEST_EQ_STR (dbus_message_get_path (method_call), path);
+
+	TEST_TRUE (dbus_message_get_args (method_call, NULL,
+					  DBUS_TYPE_STRING, &interface,
+					  DBUS_TYPE_INVALID));
+
+	TEST_EQ_STR (interface, DBUS_INTERFACE_UPSTART_INSTANCE);
+
+	TEST_ALLOC_SAFE {
+		reply = dbus_message_new_method_return (method_call);
+
+		dbus_message_iter_init_append (reply, &iter);
+
+		dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+						  (DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+						   DBUS_TYPE_STRING_AS_STRING
+						   DBUS_TYPE_VARIANT_AS_STRING
+						   DBUS_DICT_ENTRY_END_CHAR_AS_STRING),
+						  &arrayiter);
+
+		append_property (&arrayiter, "name", "");
+		append_property (&arrayiter, "goal", "start");
+		append_property (&arrayiter, "state", "running");
+
+		/* Processes */
+		dbus_message_iter_open_container (&arrayiter, DBUS_TYPE_DICT_ENTRY,
+						  NULL, &dictiter);
+
+		str_value = "processes";
+		dbus_message_iter_append_basic (&dictiter, DBUS_TYPE_STRING,
+						&str_value);
+
+		dbus_message_iter_open_container (&dictiter, DBUS_TYPE_VARIANT,
+						  (DBUS_TYPE_ARRAY_AS_STRING
+						   DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+						   DBUS_TYPE_STRING_AS_STRING
+						   DBUS_TYPE_INT32_AS_STRING
+						   DBUS_STRUCT_END_CHAR_AS_STRING),
+						  &subiter);
+
+		dbus_message_iter_open_container (&subiter, DBUS_TYPE_ARRAY,
+						  (DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+						   DBUS_TYPE_STRING_AS_STRING
+						   DBUS_TYPE_INT32_AS_STRING
+						   DBUS_STRUCT_END_CHAR_AS_STRING),
+						  &prociter);
+
+		dbus_message_iter_open_container (&prociter, DBUS_TYPE_STRUCT,
+						  NULL, &structiter);
+
+		str_value = "main";
+		dbus_message_iter_append_basic (&structiter, DBUS_TYPE_STRING,
+						&str_value);
+		dbus_message_iter_append_basic (&structiter, DBUS_TYPE_INT32,
+						&pid);
+
+		dbus_message_iter_close_container (&prociter, &structiter);
+		dbus_message_iter_close_container (&subiter, &prociter);
+		dbus_message_iter_close_container (&dictiter, &subiter);
+		dbus_message_iter_close_container (&arrayiter, &dictiter);
+
+		dbus_message_iter_close_container (&iter, &arrayiter);
+	}
+
+	dbus_connection_send (server_conn, reply, NULL);
+	dbus_connection_flush (server_conn);
+
+	dbus_message_unref (method_call);
+	dbus_message_unref (reply);
+}
+
 void
 test_upstart_open (void)
 {
@@ -5058,6 +5445,258 @@ test_start_action (void)
 	}
 
 
+	/* Check that the start action with a glob that matches no jobs
+	 * outputs an error without calling anything else.
+	 */
+	TEST_FEATURE ("with glob matching no jobs");
+	TEST_CHILD (server_pid) {
+		const char *pattern_value;
+
+		/* Expect the GetAllJobStates method call on the manager
+		 * object with the glob as the pattern, reply with no
+		 * instances.
+		 */
+		TEST_DBUS_MESSAGE (server_conn, method_call);
+
+		TEST_TRUE (dbus_message_is_method_call (method_call,
+							DBUS_INTERFACE_UPSTART,
+							"GetAllJobStates"));
+
+		TEST_EQ_STR (dbus_message_get_path (method_call),
+						    DBUS_PATH_UPSTART);
+
+		TEST_TRUE (dbus_message_get_args (method_call, NULL,
+						  DBUS_TYPE_STRING, &pattern_value,
+						  DBUS_TYPE_INVALID));
+
+		TEST_EQ_STR (pattern_value, "x*");
+
+		reply = dbus_message_new_method_return (method_call);
+
+		dbus_message_iter_init_append (reply, &iter);
+
+		dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+						  "(ssssasai)",
+						  &arrayiter);
+		dbus_message_iter_close_container (&iter, &arrayiter);
+
+		dbus_connection_send (server_conn, reply, NULL);
+		dbus_connection_flush (server_conn);
+
+		dbus_message_unref (method_call);
+		dbus_message_unref (reply);
+
+		TEST_DBUS_CLOSE (server_conn);
+
+		dbus_shutdown ();
+
+		exit (0);
+	}
+
+	memset (&command, 0, sizeof command);
+
+	args[0] = "x*";
+	args[1] = NULL;
+
+	TEST_DIVERT_STDOUT (output) {
+		TEST_DIVERT_STDERR (errors) {
+			ret = start_action (&command, args);
+		}
+	}
+	rewind (output);
+	rewind (errors);
+
+	TEST_EQ (ret, 1);
+
+	TEST_FILE_END (output);
+	TEST_FILE_RESET (output);
+
+	TEST_FILE_EQ (errors, "test: x*: no matching jobs\n");
+	TEST_FILE_END (errors);
+	TEST_FILE_RESET (errors);
+
+	waitpid (server_pid, &status, 0);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 0);
+
+
+	/* Check that the start action with a glob that matches a single
+	 * job starts it and outputs its status.
+	 */
+	TEST_FEATURE ("with glob matching one job");
+	TEST_CHILD (server_pid) {
+		const char *pattern_value;
+
+		/* Expect the GetAllJobStates method call on the manager
+		 * object with the glob as the pattern, reply with the
+		 * instance of the one job.
+		 */
+		TEST_DBUS_MESSAGE (server_conn, method_call);
+
+		TEST_TRUE (dbus_message_is_method_call (method_call,
+							DBUS_INTERFACE_UPSTART,
+							"GetAllJobStates"));
+
+		TEST_EQ_STR (dbus_message_get_path (method_call),
+						    DBUS_PATH_UPSTART);
+
+		TEST_TRUE (dbus_message_get_args (method_call, NULL,
+						  DBUS_TYPE_STRING, &pattern_value,
+						  DBUS_TYPE_INVALID));
+
+		TEST_EQ_STR (pattern_value, "te*");
+
+		reply = dbus_message_new_method_return (method_call);
+
+		dbus_message_iter_init_append (reply, &iter);
+
+		dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+						  "(ssssasai)",
+						  &arrayiter);
+
+		append_job_state (&arrayiter, "test", "",
+				  "stop", "waiting", NULL, 0);
+
+		dbus_message_iter_close_container (&iter, &arrayiter);
+
+		dbus_connection_send (server_conn, reply, NULL);
+		dbus_connection_flush (server_conn);
+
+		dbus_message_unref (method_call);
+		dbus_message_unref (reply);
+
+		expect_get_job_by_name (server_conn, "test");
+		expect_start (server_conn, "test");
+		expect_job_status (server_conn, "test", 3648);
+
+		TEST_DBUS_CLOSE (server_conn);
+
+		dbus_shutdown ();
+
+		exit (0);
+	}
+
+	memset (&command, 0, sizeof command);
+
+	args[0] = "te*";
+	args[1] = NULL;
+
+	TEST_DIVERT_STDOUT (output) {
+		TEST_DIVERT_STDERR (errors) {
+			ret = start_action (&command, args);
+		}
+	}
+	rewind (output);
+	rewind (errors);
+
+	TEST_EQ (ret, 0);
+
+	TEST_FILE_EQ (output, "test start/running, process 3648\n");
+	TEST_FILE_END (output);
+	TEST_FILE_RESET (output);
+
+	TEST_FILE_END (errors);
+	TEST_FILE_RESET (errors);
+
+	waitpid (server_pid, &status, 0);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 0);
+
+
+	/* Check that the start action with a glob that matches several
+	 * jobs starts each of them once, however many instances they
+	 * have, and outputs the status of each.
+	 */
+	TEST_FEATURE ("with glob matching several jobs");
+	TEST_CHILD (server_pid) {
+		const char *pattern_value;
+
+		/* Expect the GetAllJobStates method call on the manager
+		 * object with the glob as the pattern, reply with the
+		 * instances of both jobs.
+		 */
+		TEST_DBUS_MESSAGE (server_conn, method_call);
+
+		TEST_TRUE (dbus_message_is_method_call (method_call,
+							DBUS_INTERFACE_UPSTART,
+							"GetAllJobStates"));
+
+		TEST_EQ_STR (dbus_message_get_path (method_call),
+						    DBUS_PATH_UPSTART);
+
+		TEST_TRUE (dbus_message_get_args (method_call, NULL,
+						  DBUS_TYPE_STRING, &pattern_value,
+						  DBUS_TYPE_INVALID));
+
+		TEST_EQ_STR (pattern_value, "te*");
+
+		reply = dbus_message_new_method_return (method_call);
+
+		dbus_message_iter_init_append (reply, &iter);
+
+		dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+						  "(ssssasai)",
+						  &arrayiter);
+
+		append_job_state (&arrayiter, "test", "foo",
+				  "start", "running", "main", 6312);
+		append_job_state (&arrayiter, "test", "bar",
+				  "start", "running", "main", 6313);
+		append_job_state (&arrayiter, "tea", "",
+				  "stop", "waiting", NULL, 0);
+
+		dbus_message_iter_close_container (&iter, &arrayiter);
+
+		dbus_connection_send (server_conn, reply, NULL);
+		dbus_connection_flush (server_conn);
+
+		dbus_message_unref (method_call);
+		dbus_message_unref (reply);
+
+		/* Both calls are begun before either is reported */
+		expect_get_job_by_name (server_conn, "test");
+		expect_start (server_conn, "test");
+		expect_get_job_by_name (server_conn, "tea");
+		expect_start (server_conn, "tea");
+
+		expect_job_status (server_conn, "test", 3648);
+		expect_job_status (server_conn, "tea", 3649);
+
+		TEST_DBUS_CLOSE (server_conn);
+
+		dbus_shutdown ();
+
+		exit (0);
+	}
+
+	memset (&command, 0, sizeof command);
+
+	args[0] = "te*";
+	args[1] = NULL;
+
+	TEST_DIVERT_STDOUT (output) {
+		TEST_DIVERT_STDERR (errors) {
+			ret = start_action (&command, args);
+		}
+	}
+	rewind (output);
+	rewind (errors);
+
+	TEST_EQ (ret, 0);
+
+	TEST_FILE_EQ (output, "test start/running, process 3648\n");
+	TEST_FILE_EQ (output, "tea start/running, process 3649\n");
+	TEST_FILE_END (output);
+	TEST_FILE_RESET (output);
+
+	TEST_FILE_END (errors);
+	TEST_FILE_RESET (errors);
+
+	waitpid (server_pid, &status, 0);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 0);
+
+
 	/* Check that a missing argument results in an error being output
 	 * to stderr along with a suggestion of help.
 	 */
@@ -9470,6 +10109,9 @@ test_status_action (void)
 	TEST_FEATURE ("with single argument");
 	TEST_ALLOC_FAIL {
 		TEST_CHILD (server_pid) {
+			/* Reject the bulk query as an older init would */
+			reject_get_all_job_states (server_conn, "test");
+
 			/* Expect the GetJobByName method call on the
 			 * manager object, make sure the job name is passed
 			 * and reply with a path.
@@ -9778,39 +10420,49 @@ test_status_action (void)
 	}
 
 
-	/* Check that additional arguments to the status action are passed
-	 * as entries in the environment to GetInstance.
+	/* Check that the status action with a single argument uses the
+	 * GetAllJobStates method where the init daemon has it, picking out
+	 * the instance without a name from the reply.
 	 */
-	TEST_FEATURE ("with multiple arguments");
+	TEST_FEATURE ("with bulk reply");
 	TEST_ALLOC_FAIL {
 		TEST_CHILD (server_pid) {
-			/* Expect the GetJobByName method call on the
-			 * manager object, make sure the job name is passed
-			 * and reply with a path.
+			const char *pattern_value;
+
+			/* Expect the GetAllJobStates method call on the
+			 * manager object with the job name as the pattern,
+			 * reply with its instances.
 			 */
 			TEST_DBUS_MESSAGE (server_conn, method_call);
 
 			TEST_TRUE (dbus_message_is_method_call (method_call,
 								DBUS_INTERFACE_UPSTART,
-								"GetJobByName"));
+								"GetAllJobStates"));
 
 			TEST_EQ_STR (dbus_message_get_path (method_call),
 							    DBUS_PATH_UPSTART);
 
 			TEST_TRUE (dbus_message_get_args (method_call, NULL,
-							  DBUS_TYPE_STRING, &name_value,
+							  DBUS_TYPE_STRING, &pattern_value,
 							  DBUS_TYPE_INVALID));
 
-			TEST_EQ_STR (name_value, "test");
+			TEST_EQ_STR (pattern_value, "test");
 
 			TEST_ALLOC_SAFE {
 				reply = dbus_message_new_method_return (method_call);
 
-				str_value = DBUS_PATH_UPSTART "/jobs/test";
+				dbus_message_iter_init_append (reply, &iter);
 
-				dbus_message_append_args (reply,
-							  DBUS_TYPE_OBJECT_PATH, &str_value,
-							  DBUS_TYPE_INVALID);
+				dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+								  "(ssssasai)",
+								  &arrayiter);
+
+				append_job_state (&arrayiter, "test", "foo",
+						  "stop", "pre-stop", "pre-stop", 6312);
+				append_job_state (&arrayiter, "test", "",
+						  "start", "running", "main", 3648);
+
+				dbus_message_iter_close_container (&iter, &arrayiter);
 			}
 
 			dbus_connection_send (server_conn, reply, NULL);
@@ -9819,14 +10471,369 @@ test_status_action (void)
 			dbus_message_unref (method_call);
 			dbus_message_unref (reply);
 
-			/* Expect the GetInstance method call on the
-			 * job object, make sure the environment args are
-			 * passed and reply with a path.
-			 */
-			TEST_DBUS_MESSAGE (server_conn, method_call);
+			TEST_DBUS_CLOSE (server_conn);
 
-			TEST_TRUE (dbus_message_is_method_call (method_call,
-								DBUS_INTERFACE_UPSTART_JOB,
+			dbus_shutdown ();
+
+			exit (0);
+		}
+
+		memset (&command, 0, sizeof command);
+
+		args[0] = "test";
+		args[1] = NULL;
+
+		TEST_DIVERT_STDOUT (output) {
+			TEST_DIVERT_STDERR (errors) {
+				ret = status_action (&command, args);
+			}
+		}
+		rewind (output);
+		rewind (errors);
+
+		if (test_alloc_failed
+		    && (ret != 0)) {
+			TEST_FILE_END (output);
+			TEST_FILE_RESET (output);
+
+			TEST_FILE_EQ (errors, "test: Cannot allocate memory\n");
+			TEST_FILE_END (errors);
+			TEST_FILE_RESET (errors);
+
+			kill (server_pid, SIGTERM);
+			waitpid (server_pid, NULL, 0);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_FILE_EQ (output, "test start/running, process 3648\n");
+		TEST_FILE_END (output);
+		TEST_FILE_RESET (output);
+
+		TEST_FILE_END (errors);
+		TEST_FILE_RESET (errors);
+
+		waitpid (server_pid, &status, 0);
+		TEST_TRUE (WIFEXITED (status));
+		TEST_EQ (WEXITSTATUS (status), 0);
+	}
+
+
+	/* Check that the status action with JSON output requested prints
+	 * an object for every instance of the job from the GetAllJobStates
+	 * reply, one per line, quoting names as needed.
+	 */
+	TEST_FEATURE ("with json output");
+	TEST_CHILD (server_pid) {
+		const char *pattern_value;
+
+		/* Expect the GetAllJobStates method call on the manager
+		 * object with the job name as the pattern, reply with its
+		 * instances and those of another job.
+		 */
+		TEST_DBUS_MESSAGE (server_conn, method_call);
+
+		TEST_TRUE (dbus_message_is_method_call (method_call,
+							DBUS_INTERFACE_UPSTART,
+							"GetAllJobStates"));
+
+		TEST_EQ_STR (dbus_message_get_path (method_call),
+						    DBUS_PATH_UPSTART);
+
+		TEST_TRUE (dbus_message_get_args (method_call, NULL,
+						  DBUS_TYPE_STRING, &pattern_value,
+						  DBUS_TYPE_INVALID));
+
+		TEST_EQ_STR (pattern_value, "test");
+
+		reply = dbus_message_new_method_return (method_call);
+
+		dbus_message_iter_init_append (reply, &iter);
+
+		dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+						  "(ssssasai)",
+						  &arrayiter);
+
+		append_job_state (&arrayiter, "test", "foo \"1\"",
+				  "stop", "pre-stop", "pre-stop", 6312);
+		append_job_state (&arrayiter, "testing", "",
+				  "start", "running", "main", 1234);
+		append_job_state (&arrayiter, "test", "",
+				  "stop", "waiting", NULL, 0);
+
+		dbus_message_iter_close_container (&iter, &arrayiter);
+
+		dbus_connection_send (server_conn, reply, NULL);
+		dbus_connection_flush (server_conn);
+
+		dbus_message_unref (method_call);
+		dbus_message_unref (reply);
+
+		TEST_DBUS_CLOSE (server_conn);
+
+		dbus_shutdown ();
+
+		exit (0);
+	}
+
+	memset (&command, 0, sizeof command);
+
+	args[0] = "test";
+	args[1] = NULL;
+
+	output_format = "json";
+
+	TEST_DIVERT_STDOUT (output) {
+		TEST_DIVERT_STDERR (errors) {
+			ret = status_action (&command, args);
+		}
+	}
+	rewind (output);
+	rewind (errors);
+
+	output_format = NULL;
+
+	TEST_EQ (ret, 0);
+
+	TEST_FILE_EQ (output, ("{ \"job\": \"test\", \"instance\": \"foo \\\"1\\\"\", "
+			       "\"goal\": \"stop\", \"state\": \"pre-stop\", "
+			       "\"processes\": { \"pre-stop\": 6312 } }\n"));
+	TEST_FILE_EQ (output, ("{ \"job\": \"test\", \"instance\": \"\", "
+			       "\"goal\": \"stop\", \"state\": \"waiting\", "
+			       "\"processes\": { } }\n"));
+	TEST_FILE_END (output);
+	TEST_FILE_RESET (output);
+
+	TEST_FILE_END (errors);
+	TEST_FILE_RESET (errors);
+
+	waitpid (server_pid, &status, 0);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 0);
+
+
+	/* Check that the status action with JSON output requested looks
+	 * up the job when the GetAllJobStates reply has no instances of
+	 * it, so that an unknown job is reported as an error.
+	 */
+	TEST_FEATURE ("with json output and unknown job");
+	TEST_CHILD (server_pid) {
+		const char *pattern_value;
+
+		/* Expect the GetAllJobStates method call on the manager
+		 * object with the job name as the pattern, reply with no
+		 * instances.
+		 */
+		TEST_DBUS_MESSAGE (server_conn, method_call);
+
+		TEST_TRUE (dbus_message_is_method_call (method_call,
+							DBUS_INTERFACE_UPSTART,
+							"GetAllJobStates"));
+
+		TEST_TRUE (dbus_message_get_args (method_call, NULL,
+						  DBUS_TYPE_STRING, &pattern_value,
+						  DBUS_TYPE_INVALID));
+
+		TEST_EQ_STR (pattern_value, "test");
+
+		reply = dbus_message_new_method_return (method_call);
+
+		dbus_message_iter_init_append (reply, &iter);
+
+		dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+						  "(ssssasai)",
+						  &arrayiter);
+		dbus_message_iter_close_container (&iter, &arrayiter);
+
+		dbus_connection_send (server_conn, reply, NULL);
+		dbus_connection_flush (server_conn);
+
+		dbus_message_unref (method_call);
+		dbus_message_unref (reply);
+
+		/* Expect the GetJobByName method call on the manager
+		 * object, reply with an error.
+		 */
+		TEST_DBUS_MESSAGE (server_conn, method_call);
+
+		TEST_TRUE (dbus_message_is_method_call (method_call,
+							DBUS_INTERFACE_UPSTART,
+							"GetJobByName"));
+
+		TEST_TRUE (dbus_message_get_args (method_call, NULL,
+						  DBUS_TYPE_STRING, &name_value,
+						  DBUS_TYPE_INVALID));
+
+		TEST_EQ_STR (name_value, "test");
+
+		reply = dbus_message_new_error (method_call,
+						DBUS_INTERFACE_UPSTART ".Error.UnknownJob",
+						"Unknown job: test");
+
+		dbus_connection_send (server_conn, reply, NULL);
+		dbus_connection_flush (server_conn);
+
+		dbus_message_unref (method_call);
+		dbus_message_unref (reply);
+
+		TEST_DBUS_CLOSE (server_conn);
+
+		dbus_shutdown ();
+
+		exit (0);
+	}
+
+	memset (&command, 0, sizeof command);
+
+	args[0] = "test";
+	args[1] = NULL;
+
+	output_format = "json";
+
+	TEST_DIVERT_STDOUT (output) {
+		TEST_DIVERT_STDERR (errors) {
+			ret = status_action (&command, args);
+		}
+	}
+	rewind (output);
+	rewind (errors);
+
+	output_format = NULL;
+
+	TEST_GT (ret, 0);
+
+	TEST_FILE_END (output);
+	TEST_FILE_RESET (output);
+
+	TEST_FILE_EQ (errors, "test: Unknown job: test\n");
+	TEST_FILE_END (errors);
+	TEST_FILE_RESET (errors);
+
+	waitpid (server_pid, &status, 0);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 0);
+
+
+	/* Check that JSON output can't be combined with environment
+	 * arguments, since there's no single call that would take them.
+	 */
+	TEST_FEATURE ("with json output and environment");
+	TEST_ALLOC_FAIL {
+		memset (&command, 0, sizeof command);
+
+		args[0] = "test";
+		args[1] = "FOO=bar";
+		args[2] = NULL;
+
+		output_format = "json";
+
+		TEST_DIVERT_STDOUT (output) {
+			TEST_DIVERT_STDERR (errors) {
+				ret = status_action (&command, args);
+			}
+		}
+		rewind (output);
+		rewind (errors);
+
+		output_format = NULL;
+
+		TEST_GT (ret, 0);
+
+		TEST_FILE_END (output);
+		TEST_FILE_RESET (output);
+
+		TEST_FILE_EQ (errors, ("test: --format json cannot be combined with "
+				       "--timings, --resources or KEY=VALUE\n"));
+		TEST_FILE_EQ (errors, "Try `test --help' for more information.\n");
+		TEST_FILE_END (errors);
+		TEST_FILE_RESET (errors);
+	}
+
+
+	/* Check that an unknown output format results in an error being
+	 * output to stderr along with a suggestion of help.
+	 */
+	TEST_FEATURE ("with unknown output format");
+	TEST_ALLOC_FAIL {
+		memset (&command, 0, sizeof command);
+
+		args[0] = "test";
+		args[1] = NULL;
+
+		output_format = "xml";
+
+		TEST_DIVERT_STDOUT (output) {
+			TEST_DIVERT_STDERR (errors) {
+				ret = status_action (&command, args);
+			}
+		}
+		rewind (output);
+		rewind (errors);
+
+		output_format = NULL;
+
+		TEST_GT (ret, 0);
+
+		TEST_FILE_END (output);
+		TEST_FILE_RESET (output);
+
+		TEST_FILE_EQ (errors, "test: status: unknown output format: xml\n");
+		TEST_FILE_EQ (errors, "Try `test --help' for more information.\n");
+		TEST_FILE_END (errors);
+		TEST_FILE_RESET (errors);
+	}
+
+
+	/* Check that additional arguments to the status action are passed
+	 * as entries in the environment to GetInstance.
+	 */
+	TEST_FEATURE ("with multiple arguments");
+	TEST_ALLOC_FAIL {
+		TEST_CHILD (server_pid) {
+			/* Expect the GetJobByName method call on the
+			 * manager object, make sure the job name is passed
+			 * and reply with a path.
+			 */
+			TEST_DBUS_MESSAGE (server_conn, method_call);
+
+			TEST_TRUE (dbus_message_is_method_call (method_call,
+								DBUS_INTERFACE_UPSTART,
+								"GetJobByName"));
+
+			TEST_EQ_STR (dbus_message_get_path (method_call),
+							    DBUS_PATH_UPSTART);
+
+			TEST_TRUE (dbus_message_get_args (method_call, NULL,
+							  DBUS_TYPE_STRING, &name_value,
+							  DBUS_TYPE_INVALID));
+
+			TEST_EQ_STR (name_value, "test");
+
+			TEST_ALLOC_SAFE {
+				reply = dbus_message_new_method_return (method_call);
+
+				str_value = DBUS_PATH_UPSTART "/jobs/test";
+
+				dbus_message_append_args (reply,
+							  DBUS_TYPE_OBJECT_PATH, &str_value,
+							  DBUS_TYPE_INVALID);
+			}
+
+			dbus_connection_send (server_conn, reply, NULL);
+			dbus_connection_flush (server_conn);
+
+			dbus_message_unref (method_call);
+			dbus_message_unref (reply);
+
+			/* Expect the GetInstance method call on the
+			 * job object, make sure the environment args are
+			 * passed and reply with a path.
+			 */
+			TEST_DBUS_MESSAGE (server_conn, method_call);
+
+			TEST_TRUE (dbus_message_is_method_call (method_call,
+								DBUS_INTERFACE_UPSTART_JOB,
 								"GetInstance"));
 
 			TEST_EQ_STR (dbus_message_get_path (method_call),
@@ -10108,6 +11115,9 @@ test_status_action (void)
 
 	TEST_ALLOC_FAIL {
 		TEST_CHILD (server_pid) {
+			/* Reject the bulk query as an older init would */
+			reject_get_all_job_states (server_conn, "test");
+
 			/* Expect the GetJobByName method call on the
 			 * manager object, make sure the job name is passed
 			 * and reply with a path.
@@ -10424,6 +11434,9 @@ test_status_action (void)
 	TEST_FEATURE ("with unknown instance");
 	TEST_ALLOC_FAIL {
 		TEST_CHILD (server_pid) {
+			/* Reject the bulk query as an older init would */
+			reject_get_all_job_states (server_conn, "test");
+
 			/* Expect the GetJobByName method call on the
 			 * manager object, make sure the job name is passed
 			 * and reply with a path.
@@ -10589,6 +11602,9 @@ test_status_action (void)
 	TEST_FEATURE ("with error reply to GetJobByName");
 	TEST_ALLOC_FAIL {
 		TEST_CHILD (server_pid) {
+			/* Reject the bulk query as an older init would */
+			reject_get_all_job_states (server_conn, "test");
+
 			/* Expect the GetJobByName method call on the
 			 * manager object, make sure the job name is passed
 			 * and reply with an error.
@@ -10661,6 +11677,9 @@ test_status_action (void)
 	TEST_FEATURE ("with error reply to GetInstance");
 	TEST_ALLOC_FAIL {
 		TEST_CHILD (server_pid) {
+			/* Reject the bulk query as an older init would */
+			reject_get_all_job_states (server_conn, "test");
+
 			/* Expect the GetJobByName method call on the
 			 * manager object, make sure the job name is passed
 			 * and reply with a path.
@@ -10769,6 +11788,9 @@ test_status_action (void)
 	TEST_FEATURE ("with error reply to status query");
 	TEST_ALLOC_FAIL {
 		TEST_CHILD (server_pid) {
+			/* Reject the bulk query as an older init would */
+			reject_get_all_job_states (server_conn, "test");
+
 			/* Expect the GetJobByName method call on the
 			 * manager object, make sure the job name is passed
 			 * and reply with a path.
@@ -13713,6 +14735,9 @@ test_list_action (void)
 	TEST_FEATURE ("with valid reply");
 	TEST_ALLOC_FAIL {
 		TEST_CHILD (server_pid) {
+			/* Reject the bulk query as an older init would */
+			reject_get_all_job_states (server_conn, "");
+
 			/* Expect the GetAllJobs method call on the
 			 * manager object, reply with a list of interesting
 			 * paths.
@@ -14537,6 +15562,253 @@ test_list_action (void)
 	}
 
 
+	/* Check that the list action uses the GetAllJobStates method where
+	 * the init daemon has it, printing the status of each job and
+	 * instance from the single reply in the same form as it would
+	 * otherwise.
+	 */
+	TEST_FEATURE ("with bulk reply");
+	TEST_ALLOC_FAIL {
+		TEST_CHILD (server_pid) {
+			const char *pattern_value;
+
+			/* Expect the GetAllJobStates method call on the
+			 * manager object with an empty pattern, reply with
+			 * our jobs.
+			 */
+			TEST_DBUS_MESSAGE (server_conn, method_call);
+
+			TEST_TRUE (dbus_message_is_method_call (method_call,
+								DBUS_INTERFACE_UPSTART,
+								"GetAllJobStates"));
+
+			TEST_EQ_STR (dbus_message_get_path (method_call),
+							    DBUS_PATH_UPSTART);
+
+			TEST_TRUE (dbus_message_get_args (method_call, NULL,
+							  DBUS_TYPE_STRING, &pattern_value,
+							  DBUS_TYPE_INVALID));
+
+			TEST_EQ_STR (pattern_value, "");
+
+			TEST_ALLOC_SAFE {
+				reply = dbus_message_new_method_return (method_call);
+
+				dbus_message_iter_init_append (reply, &iter);
+
+				dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+								  "(ssssasai)",
+								  &arrayiter);
+
+				append_job_state (&arrayiter, "frodo", "",
+						  "stop", "waiting", NULL, 0);
+				append_job_state (&arrayiter, "bilbo", "",
+						  "start", "running", "main", 3648);
+				append_job_state (&arrayiter, "drogo", "bar",
+						  "start", "post-stop", "post-stop", 7465);
+				append_job_state (&arrayiter, "merry", "",
+						  "start", "running", "post-start", 9210);
+
+				dbus_message_iter_close_container (&iter, &arrayiter);
+			}
+
+			dbus_connection_send (server_conn, reply, NULL);
+			dbus_connection_flush (server_conn);
+
+			dbus_message_unref (method_call);
+			dbus_message_unref (reply);
+
+			TEST_DBUS_CLOSE (server_conn);
+
+			dbus_shutdown ();
+
+			exit (0);
+		}
+
+		memset (&command, 0, sizeof command);
+
+		args[0] = NULL;
+
+		TEST_DIVERT_STDOUT (output) {
+			TEST_DIVERT_STDERR (errors) {
+				ret = list_action (&command, args);
+			}
+		}
+		rewind (output);
+		rewind (errors);
+
+		if (test_alloc_failed
+		    && (ret != 0)) {
+			/* May have had some output */
+			TEST_FILE_RESET (output);
+
+			TEST_FILE_EQ (errors, "test: Cannot allocate memory\n");
+			TEST_FILE_END (errors);
+			TEST_FILE_RESET (errors);
+
+			kill (server_pid, SIGTERM);
+			waitpid (server_pid, NULL, 0);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_FILE_EQ (output, "frodo stop/waiting\n");
+		TEST_FILE_EQ (output, "bilbo start/running, process 3648\n");
+		TEST_FILE_EQ (output, "drogo (bar) start/post-stop, process 7465\n");
+		TEST_FILE_EQ (output, "merry start/running, (post-start) process 9210\n");
+		TEST_FILE_END (output);
+		TEST_FILE_RESET (output);
+
+		TEST_FILE_END (errors);
+		TEST_FILE_RESET (errors);
+
+		waitpid (server_pid, &status, 0);
+		TEST_TRUE (WIFEXITED (status));
+		TEST_EQ (WEXITSTATUS (status), 0);
+	}
+
+
+	/* Check that the list action with JSON output requested prints
+	 * an object for every job and instance from the GetAllJobStates
+	 * reply, one per line.
+	 */
+	TEST_FEATURE ("with json output");
+	TEST_CHILD (server_pid) {
+		const char *pattern_value;
+
+		/* Expect the GetAllJobStates method call on the manager
+		 * object with an empty pattern, reply with our jobs.
+		 */
+		TEST_DBUS_MESSAGE (server_conn, method_call);
+
+		TEST_TRUE (dbus_message_is_method_call (method_call,
+							DBUS_INTERFACE_UPSTART,
+							"GetAllJobStates"));
+
+		TEST_EQ_STR (dbus_message_get_path (method_call),
+						    DBUS_PATH_UPSTART);
+
+		TEST_TRUE (dbus_message_get_args (method_call, NULL,
+						  DBUS_TYPE_STRING, &pattern_value,
+						  DBUS_TYPE_INVALID));
+
+		TEST_EQ_STR (pattern_value, "");
+
+		reply = dbus_message_new_method_return (method_call);
+
+		dbus_message_iter_init_append (reply, &iter);
+
+		dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+						  "(ssssasai)",
+						  &arrayiter);
+
+		append_job_state (&arrayiter, "frodo", "",
+				  "stop", "waiting", NULL, 0);
+		append_job_state (&arrayiter, "bilbo", "",
+				  "start", "running", "main", 3648);
+		append_job_state (&arrayiter, "drogo", "bar\tbaz",
+				  "start", "post-stop", "post-stop", 7465);
+
+		dbus_message_iter_close_container (&iter, &arrayiter);
+
+		dbus_connection_send (server_conn, reply, NULL);
+		dbus_connection_flush (server_conn);
+
+		dbus_message_unref (method_call);
+		dbus_message_unref (reply);
+
+		TEST_DBUS_CLOSE (server_conn);
+
+		dbus_shutdown ();
+
+		exit (0);
+	}
+
+	memset (&command, 0, sizeof command);
+
+	args[0] = NULL;
+
+	output_format = "json";
+
+	TEST_DIVERT_STDOUT (output) {
+		TEST_DIVERT_STDERR (errors) {
+			ret = list_action (&command, args);
+		}
+	}
+	rewind (output);
+	rewind (errors);
+
+	output_format = NULL;
+
+	TEST_EQ (ret, 0);
+
+	TEST_FILE_EQ (output, ("{ \"job\": \"frodo\", \"instance\": \"\", "
+			       "\"goal\": \"stop\", \"state\": \"waiting\", "
+			       "\"processes\": { } }\n"));
+	TEST_FILE_EQ (output, ("{ \"job\": \"bilbo\", \"instance\": \"\", "
+			       "\"goal\": \"start\", \"state\": \"running\", "
+			       "\"processes\": { \"main\": 3648 } }\n"));
+	TEST_FILE_EQ (output, ("{ \"job\": \"drogo\", \"instance\": \"bar\\tbaz\", "
+			       "\"goal\": \"start\", \"state\": \"post-stop\", "
+			       "\"processes\": { \"post-stop\": 7465 } }\n"));
+	TEST_FILE_END (output);
+	TEST_FILE_RESET (output);
+
+	TEST_FILE_END (errors);
+	TEST_FILE_RESET (errors);
+
+	waitpid (server_pid, &status, 0);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 0);
+
+
+	/* Check that the list action with JSON output requested doesn't
+	 * fall back to querying each job in turn when the init daemon
+	 * lacks the GetAllJobStates method, but reports the error.
+	 */
+	TEST_FEATURE ("with json output and no bulk method");
+	TEST_CHILD (server_pid) {
+		/* Reject the bulk query as an older init would */
+		reject_get_all_job_states (server_conn, "");
+
+		TEST_DBUS_CLOSE (server_conn);
+
+		dbus_shutdown ();
+
+		exit (0);
+	}
+
+	memset (&command, 0, sizeof command);
+
+	args[0] = NULL;
+
+	output_format = "json";
+
+	TEST_DIVERT_STDOUT (output) {
+		TEST_DIVERT_STDERR (errors) {
+			ret = list_action (&command, args);
+		}
+	}
+	rewind (output);
+	rewind (errors);
+
+	output_format = NULL;
+
+	TEST_GT (ret, 0);
+
+	TEST_FILE_END (output);
+	TEST_FILE_RESET (output);
+
+	TEST_FILE_EQ (errors, "test: Unknown method\n");
+	TEST_FILE_END (errors);
+	TEST_FILE_RESET (errors);
+
+	waitpid (server_pid, &status, 0);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 0);
+
+
 	/* Check that an error reply from the GetAllInstances command
 	 * is assumed to mean that the job went away, and thus the job
 	 * is simply not printed rather than causing the function to end,
@@ -14544,6 +15816,9 @@ test_list_action (void)
 	TEST_FEATURE ("with error reply to GetAllInstances");
 	TEST_ALLOC_FAIL {
 		TEST_CHILD (server_pid) {
+			/* Reject the bulk query as an older init would */
+			reject_get_all_job_states (server_conn, "");
+
 			/* Expect the GetAllJobs method call on the
 			 * manager object, reply with a list of interesting
 			 * paths.
@@ -14887,6 +16162,9 @@ test_list_action (void)
 	TEST_FEATURE ("with error reply to GetAllJobs");
 	TEST_ALLOC_FAIL {
 		TEST_CHILD (server_pid) {
+			/* Reject the bulk query as an older init would */
+			reject_get_all_job_states (server_conn, "");
+
 			/* Expect the GetAllJobs method call on the
 			 * manager object, reply with an error.
 			 */
@@ -18146,6 +19424,59 @@ test_job_env (void)
         TEST_EQ (rmdir (logdir), 0);
 }
 
+void
+test_batch_split (void)
+{
+	char **args;
+
+	TEST_FUNCTION ("batch_split");
+
+	/* Check that arguments are separated by whitespace, and that a
+	 * comment ends the line.
+	 */
+	TEST_FEATURE ("with plain arguments");
+	args = batch_split (NULL, "  start  foo\tBAR=baz # comment");
+
+	TEST_NE_P (args, NULL);
+	TEST_EQ_STR (args[0], "start");
+	TEST_EQ_STR (args[1], "foo");
+	TEST_EQ_STR (args[2], "BAR=baz");
+	TEST_EQ_P (args[3], NULL);
+	nih_free (args);
+
+
+	/* Check that quotes and backslashes keep whitespace within an
+	 * argument, and that backslashes are literal in single quotes.
+	 */
+	TEST_FEATURE ("with quoted arguments");
+	args = batch_split (NULL, "set-env 'A=b c' \"D=\\\"e\\\"\" F=g\\ h '\\'");
+
+	TEST_NE_P (args, NULL);
+	TEST_EQ_STR (args[0], "set-env");
+	TEST_EQ_STR (args[1], "A=b c");
+	TEST_EQ_STR (args[2], "D=\"e\"");
+	TEST_EQ_STR (args[3], "F=g h");
+	TEST_EQ_STR (args[4], "\\");
+	TEST_EQ_P (args[5], NULL);
+	nih_free (args);
+
+
+	/* Check that an empty line gives no arguments. */
+	TEST_FEATURE ("with empty line");
+	args = batch_split (NULL, "   ");
+
+	TEST_NE_P (args, NULL);
+	TEST_EQ_P (args[0], NULL);
+	nih_free (args);
+
+
+	/* Check that a line ending inside quotes is rejected. */
+	TEST_FEATURE ("with unterminated quotes");
+	args = batch_split (NULL, "emit \"foo");
+
+	TEST_EQ_P (args, NULL);
+}
+
 void
 test_dbus_connection (void)
 {
@@ -18402,8 +19733,12 @@ main (int   argc,
 	nih_main_loop_init ();
 	program_name = "test";
 
+	/* Keep the scripts of any real rc run out of the list output */
+	setenv (RC_STATE_ENV, "/nonexistent/rc.state", 1);
+
 	test_common_setup ();
 
+	test_batch_split ();
 	test_upstart_open ();
 	test_job_status ();
 
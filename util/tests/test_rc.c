@@ -0,0 +1,404 @@
+/* upstart
+ *
+ * test_rc.c - test suite for util/rc.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <nih/test.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/main.h>
+#include <nih/error.h>
+
+#include "rc.h"
+
+
+/**
+ * add_script:
+ * @scripts: list to add to,
+ * @name: name of script,
+ * @seq: sequence number,
+ * @action: action to run with,
+ * @header: script header.
+ *
+ * Returns: new script added to @scripts with the header parsed from
+ * @header.
+ **/
+static RcScript *
+add_script (NihList    *scripts,
+	    const char *name,
+	    int         seq,
+	    const char *action,
+	    const char *header)
+{
+	RcScript *script;
+
+	script = NIH_MUST (rc_script_new (scripts, NULL, 'S', seq, name,
+					  action));
+	script->header = NIH_MUST (rc_header_parse (script, name, header,
+						    strlen (header)));
+	nih_list_add (scripts, &script->entry);
+
+	return script;
+}
+
+/**
+ * waits_for:
+ * @script: script that may wait,
+ * @other: script it may wait for.
+ *
+ * Returns: TRUE if @script must wait for @other.
+ **/
+static int
+waits_for (RcScript *script,
+	   RcScript *other)
+{
+	for (size_t i = 0; i < other->dependents_len; i++)
+		if (other->dependents[i] == script)
+			return TRUE;
+
+	return FALSE;
+}
+
+
+void
+test_header_parse (void)
+{
+	RcHeader *header;
+	char     *buf;
+
+	TEST_FUNCTION ("rc_header_parse");
+
+	/* Check that the fields of an LSB header are parsed, with the
+	 * Should- fields merged into the Required- ones and other fields
+	 * and lines outside the block ignored.
+	 */
+	TEST_FEATURE ("with LSB header");
+	buf = ("#!/bin/sh\n"
+	       "# Provides: not-this\n"
+	       "### BEGIN INIT INFO\n"
+	       "# Provides:          foo bar\n"
+	       "# Required-Start:    $local_fs\n"
+	       "# Should-Start:      baz\n"
+	       "# Required-Stop:     $local_fs\n"
+	       "# Default-Start:     2 3 4 5\n"
+	       "# Short-Description: foo\n"
+	       "### END INIT INFO\n"
+	       "# Required-Start: not-this\n");
+
+	header = rc_header_parse (NULL, "key", buf, strlen (buf));
+
+	TEST_NE_P (header, NULL);
+	TEST_EQ_STR (header->key, "key");
+	TEST_TRUE (header->lsb);
+	TEST_FALSE (header->used);
+
+	TEST_EQ_STR (header->provides[0], "foo");
+	TEST_EQ_STR (header->provides[1], "bar");
+	TEST_EQ_P (header->provides[2], NULL);
+
+	TEST_EQ_STR (header->start_requires[0], "$local_fs");
+	TEST_EQ_STR (header->start_requires[1], "baz");
+	TEST_EQ_P (header->start_requires[2], NULL);
+
+	TEST_EQ_STR (header->stop_requires[0], "$local_fs");
+	TEST_EQ_P (header->stop_requires[1], NULL);
+
+	nih_free (header);
+
+
+	/* Check that a script without an LSB header is marked as such. */
+	TEST_FEATURE ("without LSB header");
+	buf = "#!/bin/sh\n# Provides: foo\n";
+
+	header = rc_header_parse (NULL, "key", buf, strlen (buf));
+
+	TEST_NE_P (header, NULL);
+	TEST_FALSE (header->lsb);
+	TEST_EQ_P (header->provides[0], NULL);
+	TEST_EQ_P (header->start_requires[0], NULL);
+
+	nih_free (header);
+}
+
+
+void
+test_scripts_order (void)
+{
+	NihList  *scripts;
+	NihHash  *facilities;
+	RcScript *mountall;
+	RcScript *network;
+	RcScript *foo;
+	RcScript *legacy;
+	RcScript *bar;
+	RcScript *last;
+	char      filename[PATH_MAX];
+	FILE     *file;
+
+	TEST_FUNCTION ("rc_scripts_order");
+	TEST_FILENAME (filename);
+
+	file = fopen (filename, "w");
+	assert (file != NULL);
+	fprintf (file, "# insserv facilities\n");
+	fprintf (file, "$local_fs +mountall\n");
+	fprintf (file, "$remote_fs $local_fs\n");
+	assert0 (fclose (file));
+
+	facilities = rc_facilities_read (NULL, filename);
+	TEST_NE_P (facilities, NULL);
+
+	unlink (filename);
+
+	/* Check that scripts only wait for the scripts providing what
+	 * they require, following virtual facilities, and that those
+	 * without an LSB header wait for everything before them and hold
+	 * up everything after them.
+	 */
+	TEST_FEATURE ("with start action");
+	scripts = nih_list_new (NULL);
+
+	mountall = add_script (scripts, "mountall", 10, "start",
+			       "### BEGIN INIT INFO\n"
+			       "# Provides: mountall\n"
+			       "### END INIT INFO\n");
+	network = add_script (scripts, "networking", 10, "start",
+			      "### BEGIN INIT INFO\n"
+			      "# Provides: networking $network\n"
+			      "### END INIT INFO\n");
+	foo = add_script (scripts, "foo", 20, "start",
+			  "### BEGIN INIT INFO\n"
+			  "# Required-Start: $remote_fs\n"
+			  "# Should-Start: missing\n"
+			  "### END INIT INFO\n");
+	legacy = add_script (scripts, "legacy", 30, "start", "#!/bin/sh\n");
+	bar = add_script (scripts, "bar", 40, "start",
+			  "### BEGIN INIT INFO\n"
+			  "# Required-Start: $network\n"
+			  "### END INIT INFO\n");
+	last = add_script (scripts, "last", 50, "start",
+			   "### BEGIN INIT INFO\n"
+			   "# Required-Start: $all\n"
+			   "### END INIT INFO\n");
+
+	rc_scripts_order (scripts, facilities);
+
+	TEST_EQ (mountall->waiting, 0);
+	TEST_EQ (network->waiting, 0);
+
+	TEST_TRUE (waits_for (foo, mountall));
+	TEST_FALSE (waits_for (foo, network));
+	TEST_EQ (foo->waiting, 1);
+
+	TEST_TRUE (waits_for (legacy, mountall));
+	TEST_TRUE (waits_for (legacy, network));
+	TEST_TRUE (waits_for (legacy, foo));
+	TEST_EQ (legacy->waiting, 3);
+
+	TEST_TRUE (waits_for (bar, legacy));
+	TEST_TRUE (waits_for (bar, network));
+	TEST_EQ (bar->waiting, 2);
+
+	TEST_EQ (last->waiting, 5);
+
+	nih_free (scripts);
+
+
+	/* Check that stopping reverses the order, so that a script stops
+	 * before what it requires.
+	 */
+	TEST_FEATURE ("with stop action");
+	scripts = nih_list_new (NULL);
+
+	mountall = add_script (scripts, "mountall", 10, "stop",
+			       "### BEGIN INIT INFO\n"
+			       "# Provides: mountall\n"
+			       "### END INIT INFO\n");
+	foo = add_script (scripts, "foo", 20, "stop",
+			  "### BEGIN INIT INFO\n"
+			  "# Required-Stop: $local_fs\n"
+			  "### END INIT INFO\n");
+
+	rc_scripts_order (scripts, facilities);
+
+	TEST_TRUE (waits_for (mountall, foo));
+	TEST_EQ (mountall->waiting, 1);
+	TEST_EQ (foo->waiting, 0);
+
+	nih_free (scripts);
+
+	nih_free (facilities);
+}
+
+
+void
+test_state_write (void)
+{
+	NihList  *scripts;
+	NihList  *state;
+	RcScript *script;
+	NihError *err;
+	char      filename[PATH_MAX];
+	FILE     *file;
+
+	TEST_FUNCTION ("rc_state_write");
+	TEST_FILENAME (filename);
+
+	/* Check that the state of each script is written and read back,
+	 * in order.
+	 */
+	TEST_FEATURE ("with scripts");
+	scripts = nih_list_new (NULL);
+
+	script = NIH_MUST (rc_script_new (scripts, "/etc/rc2.d/K01foo", 'K',
+					  1, "foo", "stop"));
+	script->state = RC_DONE;
+	script->started = 100;
+	script->finished = 250;
+	nih_list_add (scripts, &script->entry);
+
+	script = NIH_MUST (rc_script_new (scripts, "/etc/rc2.d/S02bar", 'S',
+					  2, "bar", "start"));
+	script->state = RC_RUNNING;
+	script->pid = 1234;
+	script->started = 300;
+	nih_list_add (scripts, &script->entry);
+
+	TEST_EQ (rc_state_write (scripts, filename), 0);
+
+	state = rc_state_read (NULL, filename);
+	TEST_NE_P (state, NULL);
+
+	script = (RcScript *)state->next;
+	TEST_EQ_STR (script->name, "foo");
+	TEST_EQ (script->prefix, 'K');
+	TEST_EQ_STR (script->action, "stop");
+	TEST_EQ (script->state, RC_DONE);
+	TEST_EQ (script->started, 100);
+	TEST_EQ (script->finished, 250);
+
+	script = (RcScript *)script->entry.next;
+	TEST_EQ_STR (script->name, "bar");
+	TEST_EQ (script->state, RC_RUNNING);
+	TEST_EQ (script->pid, 1234);
+	TEST_EQ (script->finished, 0);
+
+	TEST_EQ_P (script->entry.next, state);
+
+	nih_free (state);
+	nih_free (scripts);
+
+
+	/* Check that a file without the header is rejected. */
+	TEST_FEATURE ("with missing header");
+	file = fopen (filename, "w");
+	assert (file != NULL);
+	fprintf (file, "foo\tS\tstart\tdone\t0\t1\t2\t0\n");
+	assert0 (fclose (file));
+
+	state = rc_state_read (NULL, filename);
+	TEST_EQ_P (state, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, EINVAL);
+	nih_free (err);
+
+	unlink (filename);
+}
+
+
+void
+test_cache_write (void)
+{
+	NihHash  *cache;
+	NihHash  *read;
+	RcHeader *header;
+	char     *buf;
+	char      filename[PATH_MAX];
+
+	TEST_FUNCTION ("rc_cache_write");
+	TEST_FILENAME (filename);
+
+	/* Check that only the headers used in this run are written, and
+	 * that they're read back the same.
+	 */
+	TEST_FEATURE ("with used and unused headers");
+	cache = NIH_MUST (nih_hash_string_new (NULL, 0));
+
+	buf = ("### BEGIN INIT INFO\n"
+	       "# Provides: foo\n"
+	       "# Required-Start: $local_fs bar\n"
+	       "### END INIT INFO\n");
+	header = NIH_MUST (rc_header_parse (cache, "1:2:3:4.5", buf,
+					    strlen (buf)));
+	header->used = TRUE;
+	nih_hash_add (cache, &header->entry);
+
+	header = NIH_MUST (rc_header_parse (cache, "6:7:8:9.0", "", 0));
+	nih_hash_add (cache, &header->entry);
+
+	TEST_EQ (rc_cache_write (cache, filename), 0);
+
+	read = rc_cache_read (NULL, filename);
+	TEST_NE_P (read, NULL);
+
+	TEST_EQ_P (nih_hash_lookup (read, "6:7:8:9.0"), NULL);
+
+	header = (RcHeader *)nih_hash_lookup (read, "1:2:3:4.5");
+	TEST_NE_P (header, NULL);
+	TEST_TRUE (header->lsb);
+	TEST_FALSE (header->used);
+	TEST_EQ_STR (header->provides[0], "foo");
+	TEST_EQ_P (header->provides[1], NULL);
+	TEST_EQ_STR (header->start_requires[0], "$local_fs");
+	TEST_EQ_STR (header->start_requires[1], "bar");
+	TEST_EQ_P (header->start_requires[2], NULL);
+	TEST_EQ_P (header->stop_requires[0], NULL);
+
+	nih_free (read);
+	nih_free (cache);
+
+	unlink (filename);
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	nih_main_init (argv[0]);
+
+	test_header_parse ();
+	test_scripts_order ();
+	test_state_write ();
+	test_cache_write ();
+
+	return 0;
+}
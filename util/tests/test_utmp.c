@@ -22,10 +22,13 @@
 #include <nih/test.h>
 
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <sys/utsname.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <signal.h>
 #include <utmpx.h>
 #include <limits.h>
 #include <string.h>
@@ -625,6 +628,10 @@ test_write_runlevel (void)
 	struct utmpx   record;
 	struct utsname uts;
 	struct timeval tv;
+	struct flock   lock;
+	FILE *         wtmp;
+	pid_t          pid;
+	int            wait_fd;
 	int            ret;
 	NihError *     err;
 
@@ -1260,6 +1267,103 @@ test_write_runlevel (void)
 	}
 
 
+
+	/* Check that a partial record at the end of the wtmp file, such
+	 * as left by a writer that was interrupted, is dropped before the
+	 * new records are appended so that they are not misaligned.
+	 */
+	TEST_FEATURE ("with partial record in wtmp file");
+	TEST_ALLOC_FAIL {
+		unlink (utmp_file);
+		fclose (fopen (utmp_file, "w"));
+
+		unlink (wtmp_file);
+		wtmp = fopen (wtmp_file, "w");
+		memset (&record, 0, sizeof record);
+		fwrite (&record, sizeof record / 2, 1, wtmp);
+		fclose (wtmp);
+
+		ret = utmp_write_runlevel (utmp_file, wtmp_file, '2', 'S');
+
+		TEST_EQ (ret, 0);
+
+		utmpxname (wtmp_file);
+
+		utmp = getutxent ();
+		TEST_NE_P (utmp, NULL);
+
+		TEST_EQ (utmp->ut_type, BOOT_TIME);
+		TEST_EQ_STR (utmp->ut_user, "reboot");
+
+		utmp = getutxent ();
+		TEST_NE_P (utmp, NULL);
+
+		TEST_EQ (utmp->ut_type, RUN_LVL);
+		TEST_EQ (utmp->ut_pid, '2' + 'S' * 256);
+		TEST_EQ_STR (utmp->ut_user, "runlevel");
+
+		utmp = getutxent ();
+		TEST_EQ_P (utmp, NULL);
+	}
+
+
+	/* Check that when another process holds the lock on the wtmp
+	 * file, we give up on writing to it rather than waiting forever,
+	 * and still write to the utmp file.
+	 */
+	TEST_FEATURE ("with wtmp file locked");
+	unlink (utmp_file);
+	fclose (fopen (utmp_file, "w"));
+
+	unlink (wtmp_file);
+	fclose (fopen (wtmp_file, "w"));
+
+	TEST_CHILD_WAIT (pid, wait_fd) {
+		int fd;
+
+		fd = open (wtmp_file, O_WRONLY);
+		assert (fd >= 0);
+
+		memset (&lock, 0, sizeof lock);
+		lock.l_type = F_WRLCK;
+		lock.l_whence = SEEK_SET;
+		assert (fcntl (fd, F_SETLK, &lock) == 0);
+
+		TEST_CHILD_RELEASE (wait_fd);
+
+		pause ();
+		exit (0);
+	}
+
+	ret = utmp_write_runlevel (utmp_file, wtmp_file, '2', 'S');
+
+	kill (pid, SIGTERM);
+	waitpid (pid, NULL, 0);
+
+	TEST_EQ (ret, 0);
+
+	utmpxname (utmp_file);
+
+	utmp = getutxent ();
+	TEST_NE_P (utmp, NULL);
+
+	TEST_EQ (utmp->ut_type, BOOT_TIME);
+
+	utmp = getutxent ();
+	TEST_NE_P (utmp, NULL);
+
+	TEST_EQ (utmp->ut_type, RUN_LVL);
+	TEST_EQ (utmp->ut_pid, '2' + 'S' * 256);
+
+	utmp = getutxent ();
+	TEST_EQ_P (utmp, NULL);
+
+	utmpxname (wtmp_file);
+
+	utmp = getutxent ();
+	TEST_EQ_P (utmp, NULL);
+
+
 	unlink (utmp_file);
 	unlink (wtmp_file);
 }
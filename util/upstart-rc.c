@@ -0,0 +1,501 @@
+/* upstart
+ *
+ * upstart-rc.c - run System V rc scripts in parallel
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/main.h>
+#include <nih/option.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include "rc.h"
+
+
+/**
+ * RC_JOBS_PER_CPU:
+ *
+ * Number of scripts run at once for each online CPU unless --jobs is
+ * given; most scripts spend their time waiting rather than computing.
+ **/
+#define RC_JOBS_PER_CPU 2
+
+
+/* Prototypes for static functions */
+static void rc_state_save  (NihList *scripts);
+static void rc_spawn       (RcScript *script);
+static void rc_finished    (RcScript *script);
+static void rc_run_phase   (NihList *scripts, char prefix);
+static int  rc_link_exists (const char *dir, char prefix, const char *name);
+
+
+/**
+ * jobs:
+ *
+ * Maximum number of scripts to run at once, zero for RC_JOBS_PER_CPU
+ * for each online CPU.
+ **/
+static int jobs = 0;
+
+/**
+ * rc_root:
+ *
+ * Directory containing the rcN.d directories.
+ **/
+static char *rc_root = "/etc";
+
+/**
+ * facilities_file:
+ *
+ * insserv configuration defining virtual facilities.
+ **/
+static char *facilities_file = RC_FACILITIES_FILE;
+
+/**
+ * cache_file:
+ *
+ * File the headers of scripts are cached in.
+ **/
+static char *cache_file = RC_CACHE_FILE;
+
+/**
+ * no_cache:
+ *
+ * TRUE if every script's header should be read afresh.
+ **/
+static int no_cache = FALSE;
+
+/**
+ * state_file:
+ *
+ * File the state of the run is written to for initctl.
+ **/
+static const char *state_file = RC_STATE_FILE;
+
+
+/**
+ * rc_state_save:
+ * @scripts: scripts in run.
+ *
+ * Writes the state of @scripts to state_file, failure to do so is only
+ * a warning since it doesn't stop the scripts being run.
+ **/
+static void
+rc_state_save (NihList *scripts)
+{
+	nih_assert (scripts != NULL);
+
+	if (rc_state_write (scripts, state_file) < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_warn ("%s: %s", state_file, err->message);
+		nih_free (err);
+	}
+}
+
+/**
+ * rc_spawn:
+ * @script: script to run.
+ *
+ * Starts @script with its action; ".sh" scripts, which the serial rc
+ * script sources rather than runs, are run by the shell since they
+ * needn't be executable.
+ **/
+static void
+rc_spawn (RcScript *script)
+{
+	size_t len;
+	pid_t  pid;
+
+	nih_assert (script != NULL);
+	nih_assert (script->path != NULL);
+
+	script->started = rc_now ();
+
+	pid = fork ();
+	if (pid < 0) {
+		nih_warn (_("Failed to run %s: %s"), script->path,
+			  strerror (errno));
+
+		script->state = RC_FAILED;
+		script->finished = script->started;
+		rc_finished (script);
+		return;
+	} else if (pid == 0) {
+		len = strlen (script->path);
+		if ((len > 3) && (! strcmp (script->path + len - 3, ".sh"))) {
+			execl ("/bin/sh", "sh", script->path, script->action,
+			       NULL);
+		} else {
+			execl (script->path, script->path, script->action,
+			       NULL);
+		}
+
+		nih_error (_("Failed to run %s: %s"), script->path,
+			   strerror (errno));
+		_exit (255);
+	}
+
+	script->state = RC_RUNNING;
+	script->pid = pid;
+}
+
+/**
+ * rc_finished:
+ * @script: script that finished.
+ *
+ * Releases the scripts that were waiting for @script.
+ **/
+static void
+rc_finished (RcScript *script)
+{
+	nih_assert (script != NULL);
+
+	script->pid = 0;
+
+	for (size_t i = 0; i < script->dependents_len; i++)
+		if (script->dependents[i]->waiting)
+			script->dependents[i]->waiting--;
+}
+
+/**
+ * rc_run_phase:
+ * @scripts: scripts in run,
+ * @prefix: phase to run.
+ *
+ * Runs the scripts in @scripts with @prefix, each as soon as all those
+ * it waits for have finished and no more than jobs at once.  If every
+ * remaining script is waiting and none are running, the dependencies
+ * have a loop; it's broken by running the first of them anyway, which
+ * is the one the serial rc script would have run next.
+ **/
+static void
+rc_run_phase (NihList *scripts,
+	      char     prefix)
+{
+	size_t remaining = 0;
+	size_t running = 0;
+
+	nih_assert (scripts != NULL);
+
+	NIH_LIST_FOREACH (scripts, iter) {
+		RcScript *script = (RcScript *)iter;
+
+		if ((script->prefix == prefix)
+		    && (script->state == RC_WAITING))
+			remaining++;
+	}
+
+	while (remaining || running) {
+		RcScript *script = NULL;
+		int       status;
+		pid_t     pid;
+
+		NIH_LIST_FOREACH (scripts, iter) {
+			RcScript *ready = (RcScript *)iter;
+
+			if (running >= (size_t)jobs)
+				break;
+
+			if ((ready->prefix != prefix)
+			    || (ready->state != RC_WAITING)
+			    || ready->waiting)
+				continue;
+
+			rc_spawn (ready);
+			remaining--;
+
+			if (ready->state == RC_RUNNING)
+				running++;
+		}
+
+		if (remaining && (! running)) {
+			NIH_LIST_FOREACH (scripts, iter) {
+				RcScript *waiting = (RcScript *)iter;
+
+				if ((waiting->prefix == prefix)
+				    && (waiting->state == RC_WAITING)) {
+					nih_warn (_("%s: dependency loop, "
+						    "running anyway"),
+						  waiting->name);
+					waiting->waiting = 0;
+					break;
+				}
+			}
+
+			continue;
+		}
+
+		rc_state_save (scripts);
+
+		if (! running)
+			break;
+
+		pid = waitpid (-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+
+			nih_warn (_("Failed to wait for scripts: %s"),
+				  strerror (errno));
+			break;
+		}
+
+		NIH_LIST_FOREACH (scripts, iter) {
+			RcScript *child = (RcScript *)iter;
+
+			if ((child->state == RC_RUNNING) && (child->pid == pid)) {
+				script = child;
+				break;
+			}
+		}
+
+		if (! script)
+			continue;
+
+		script->finished = rc_now ();
+		script->status = status;
+		script->state = ((WIFEXITED (status)
+				  && (! WEXITSTATUS (status)))
+				 ? RC_DONE : RC_FAILED);
+
+		rc_finished (script);
+		running--;
+	}
+
+	rc_state_save (scripts);
+}
+
+/**
+ * rc_link_exists:
+ * @dir: rc directory,
+ * @prefix: 'S' or 'K',
+ * @name: name of script.
+ *
+ * Returns: TRUE if @dir has a link for @name with @prefix and any
+ * sequence number, FALSE otherwise.
+ **/
+static int
+rc_link_exists (const char *dir,
+		char        prefix,
+		const char *name)
+{
+	nih_local NihList *scripts = NULL;
+
+	nih_assert (dir != NULL);
+	nih_assert (name != NULL);
+
+	scripts = NIH_MUST (nih_list_new (NULL));
+	if (rc_scripts_find (scripts, dir, prefix, "start") < 0) {
+		nih_free (nih_error_get ());
+		return FALSE;
+	}
+
+	NIH_LIST_FOREACH (scripts, iter) {
+		RcScript *script = (RcScript *)iter;
+
+		if (! strcmp (script->name, name))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+
+/**
+ * options:
+ *
+ * Command-line options accepted.
+ **/
+static NihOption options[] = {
+	{ 'j', "jobs", N_("maximum number of scripts to run at once"),
+	  NULL, "N", &jobs, nih_option_int },
+	{ 0, "rc-root", N_("directory containing the rcN.d directories"),
+	  NULL, "DIR", &rc_root, NULL },
+	{ 0, "facilities", N_("insserv configuration defining facilities"),
+	  NULL, "FILE", &facilities_file, NULL },
+	{ 0, "cache", N_("file to cache script headers in"),
+	  NULL, "FILE", &cache_file, NULL },
+	{ 0, "no-cache", N_("read every script's header afresh"),
+	  NULL, NULL, &no_cache, NULL },
+
+	NIH_OPTION_LAST
+};
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	char               **args;
+	nih_local NihList   *scripts = NULL;
+	nih_local NihHash   *cache = NULL;
+	nih_local NihHash   *facilities = NULL;
+	nih_local char      *dir = NULL;
+	nih_local char      *prevdir = NULL;
+	const char          *env;
+	char                 runlevel;
+	char                 prevlevel;
+	char                 level[2];
+	const char          *action;
+
+	nih_main_init (argv[0]);
+
+	nih_option_set_usage (_("RUNLEVEL"));
+	nih_option_set_synopsis (_("Run System V rc scripts in parallel."));
+	nih_option_set_help (
+		_("Stops the services of the previous runlevel, given in "
+		  "PREVLEVEL, and starts those of RUNLEVEL in the order their "
+		  "LSB headers require, running independent scripts at the "
+		  "same time.\n"));
+
+	args = nih_option_parser (NULL, argc, argv, options, FALSE);
+	if (! args)
+		exit (1);
+
+	if ((! args[0]) || args[1]
+	    || (! strchr ("0123456Ss", args[0][0])) || args[0][1]) {
+		fprintf (stderr, _("%s: expected runlevel\n"), program_name);
+		nih_main_suggest_help ();
+		exit (1);
+	}
+
+	runlevel = args[0][0];
+	if (runlevel == 's')
+		runlevel = 'S';
+
+	env = getenv ("PREVLEVEL");
+	prevlevel = (env && env[0]) ? env[0] : 'N';
+
+	/* Scripts expect these to be set, as the serial rc script does */
+	level[0] = prevlevel;
+	level[1] = '\0';
+	setenv ("RUNLEVEL", args[0], TRUE);
+	setenv ("PREVLEVEL", level, TRUE);
+
+	env = getenv (RC_STATE_ENV);
+	if (env)
+		state_file = env;
+
+	if (jobs <= 0) {
+		long cpus;
+
+		cpus = sysconf (_SC_NPROCESSORS_ONLN);
+		jobs = (cpus > 0 ? cpus : 1) * RC_JOBS_PER_CPU;
+	}
+
+	if (! no_cache)
+		cache = rc_cache_read (NULL, cache_file);
+	if (! cache) {
+		if (! no_cache)
+			nih_free (nih_error_get ());
+
+		cache = NIH_MUST (nih_hash_string_new (NULL, 0));
+	}
+
+	facilities = rc_facilities_read (NULL, facilities_file);
+	if (! facilities)
+		nih_free (nih_error_get ());
+
+	dir = NIH_MUST (nih_sprintf (NULL, "%s/rc%c.d", rc_root, runlevel));
+	prevdir = NIH_MUST (nih_sprintf (NULL, "%s/rc%c.d", rc_root,
+					 prevlevel));
+
+	action = strchr ("06", runlevel) ? "stop" : "start";
+
+	scripts = NIH_MUST (nih_list_new (NULL));
+
+	/* Stopping services is skipped at boot, when there's nothing
+	 * to stop; once we've been in a runlevel, the kill scripts of
+	 * the new one are run first.
+	 */
+	if ((prevlevel != 'N')
+	    && (rc_scripts_find (scripts, dir, 'K', "stop") < 0)) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_error ("%s: %s", dir, err->message);
+		nih_free (err);
+		exit (1);
+	}
+
+	if (rc_scripts_find (scripts, dir, 'S', action) < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_error ("%s: %s", dir, err->message);
+		nih_free (err);
+		exit (1);
+	}
+
+	NIH_LIST_FOREACH_SAFE (scripts, iter) {
+		RcScript *script = (RcScript *)iter;
+
+		/* Services that were started in the previous runlevel and
+		 * aren't stopped in this one are still running.
+		 */
+		if ((script->prefix == 'S') && (prevlevel != 'N')
+		    && rc_link_exists (prevdir, 'S', script->name)
+		    && (! rc_link_exists (dir, 'K', script->name))) {
+			nih_free (script);
+			continue;
+		}
+
+		script->header = rc_header_load (script, script->path, cache);
+		if (! script->header) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_warn ("%s: %s", script->path, err->message);
+			nih_free (err);
+		}
+	}
+
+	rc_scripts_order (scripts, facilities);
+	rc_state_save (scripts);
+
+	rc_run_phase (scripts, 'K');
+	rc_run_phase (scripts, 'S');
+
+	if ((! no_cache) && (rc_cache_write (cache, cache_file) < 0)) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_warn ("%s: %s", cache_file, err->message);
+		nih_free (err);
+	}
+
+	return 0;
+}
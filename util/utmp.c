@@ -24,18 +24,24 @@
 #endif /* HAVE_CONFIG_H */
 
 
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/utsname.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <utmpx.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <nih/macros.h>
 #include <nih/alloc.h>
 #include <nih/logging.h>
 #include <nih/error.h>
 
+#include "lib/upstart-status.h"
+
 #include "utmp.h"
 
 
@@ -45,7 +51,9 @@ static void utmp_entry      (struct utmpx *utmp, short type, pid_t pid,
 			     const char *user);
 static int  utmp_write      (const char *utmp_file, const struct utmpx *utmp)
 	__attribute__ ((warn_unused_result));
-static void wtmp_write      (const char *wtmp_file, const struct utmpx *utmp);
+static void wtmp_write      (const char *wtmp_file, const struct utmpx *utmp,
+			     size_t n);
+static int  status_read_runlevel (int *prevlevel);
 
 
 /**
@@ -56,6 +64,23 @@ static void wtmp_write      (const char *wtmp_file, const struct utmpx *utmp);
  **/
 #define SHUTDOWN_TIME 254
 
+/**
+ * WTMP_LOCK_TIMEOUT:
+ *
+ * Number of seconds to wait for the lock on the wtmp file before giving
+ * up on writing to it, as glibc does, so that a process holding the lock
+ * cannot hang us.
+ **/
+#define WTMP_LOCK_TIMEOUT 10
+
+/**
+ * WTMP_LOCK_INTERVAL:
+ *
+ * Number of microseconds to wait between attempts to take the lock on
+ * the wtmp file.
+ **/
+#define WTMP_LOCK_INTERVAL 100000
+
 
 /**
  * utmp_read_runlevel:
@@ -113,9 +138,10 @@ utmp_read_runlevel (const char *utmp_file,
  * @prevlevel: pointer to store previous runlevel in.
  *
  * If the RUNLEVEL and PREVLEVEL environment variables are set, returns
- * the current and previous runlevels from those otherwise calls
- * utmp_read_runlevel() to read the most recent runlevel entry from
- * @utmp_file.
+ * the current and previous runlevels from those.  Otherwise, when
+ * @utmp_file is NULL, returns those published by the init daemon in its
+ * status page if it has one, or else calls utmp_read_runlevel() to read
+ * the most recent runlevel entry from @utmp_file.
  *
  * Returns: runlevel on success, negative value on raised error.
  **/
@@ -136,9 +162,42 @@ utmp_get_runlevel (const char *utmp_file,
 		return renv[0] ?: 'N';
 	}
 
+	if (! utmp_file) {
+		int runlevel;
+
+		runlevel = status_read_runlevel (prevlevel);
+		if (runlevel > 0)
+			return runlevel;
+	}
+
 	return utmp_read_runlevel (utmp_file, prevlevel);
 }
 
+/**
+ * status_read_runlevel:
+ * @prevlevel: pointer to store previous runlevel in.
+ *
+ * Read the current runlevel from the status page of the init daemon, so
+ * that the utmp file need not be read.  If @prevlevel is not NULL, the
+ * previous runlevel will be stored in that variable.
+ *
+ * Returns: runlevel, or zero if there is no status page or the init
+ * daemon has not published the runlevel in it.
+ **/
+static int
+status_read_runlevel (int *prevlevel)
+{
+	nih_local UpstartStatus *status = NULL;
+
+	status = upstart_status_open (NULL, NULL);
+	if (! status) {
+		nih_free (nih_error_get ());
+		return 0;
+	}
+
+	return upstart_status_runlevel (status, prevlevel);
+}
+
 
 /**
  * utmp_write_runlevel:
@@ -151,6 +210,9 @@ utmp_get_runlevel (const char *utmp_file,
  * or /var/run/utmp if @utmp_file is NULL, and to @wtmp_file, or /var/log/wtmp
  * if @wtmp_file is NULL.
  *
+ * Each file is opened only once, with the boot time record for a missed
+ * reboot written along with the runlevel change record.
+ *
  * Errors writing to the wtmp file are ignored.
  *
  * Returns: zero on success, negative value on raised error.
@@ -161,10 +223,11 @@ utmp_write_runlevel (const char *utmp_file,
 		     int         runlevel,
 		     int         prevlevel)
 {
-	struct utmpx reboot;
-	struct utmpx utmp;
-	int          savedlevel;
-	int          ret;
+	struct utmpx  records[2];
+	struct utmpx  lvl;
+	struct utmpx *saved;
+	int           savedlevel;
+	int           ret = 0;
 
 	nih_assert (runlevel > 0);
 	nih_assert (prevlevel >= 0);
@@ -172,39 +235,54 @@ utmp_write_runlevel (const char *utmp_file,
 	if (prevlevel == 'N')
 		prevlevel = 0;
 
-	utmp_entry (&reboot, BOOT_TIME, 0, NULL, NULL, NULL);
+	utmp_entry (&records[0], BOOT_TIME, 0, NULL, NULL, NULL);
+	utmp_entry (&records[1], RUN_LVL, runlevel + prevlevel * 256,
+		    NULL, NULL, NULL);
+
+	memset (&lvl, 0, sizeof lvl);
+	lvl.ut_type = RUN_LVL;
 
 	/* Check for the previous runlevel entry in utmp, if it doesn't
 	 * match then we assume a missed reboot so write the boot time
-	 * record out first.
+	 * record out first; both are written while the file is open.
+	 * Each write starts from the beginning of the file so that it
+	 * replaces any existing record of the same type.
 	 */
-	savedlevel = utmp_read_runlevel (utmp_file, NULL);
-	if (savedlevel != prevlevel) {
-		if (savedlevel < 0)
-			nih_free (nih_error_get ());
+	utmpxname (utmp_file ?: _PATH_UTMPX);
+	setutxent ();
 
-		if (utmp_write (utmp_file, &reboot) < 0)
-			nih_free (nih_error_get ());
+	saved = getutxid (&lvl);
+	if (saved) {
+		savedlevel = saved->ut_pid % 256 ?: 'N';
+	} else {
+		savedlevel = -1;
 	}
 
-	/* Check for the previous runlevel entry in wtmp, if it doesn't
-	 * match then we assume a missed reboot so write the boot time
-	 * record out first.
-	 */
-	savedlevel = utmp_read_runlevel (wtmp_file, NULL);
 	if (savedlevel != prevlevel) {
-		if (savedlevel < 0)
-			nih_free (nih_error_get ());
+		setutxent ();
+		pututxline (&records[0]);
+	}
 
-		wtmp_write (wtmp_file, &reboot);
+	setutxent ();
+	if (! pututxline (&records[1])) {
+		nih_error_raise_system ();
+		ret = -1;
 	}
 
-	/* Write the runlevel change record */
-	utmp_entry (&utmp, RUN_LVL, runlevel + prevlevel * 256,
-		    NULL, NULL, NULL);
+	endutxent ();
 
-	ret = utmp_write (utmp_file, &utmp);
-	wtmp_write (wtmp_file, &utmp);
+	/* Check for the previous runlevel entry in wtmp likewise, then
+	 * append both records at once.
+	 */
+	savedlevel = utmp_read_runlevel (wtmp_file ?: _PATH_WTMPX, NULL);
+	if (savedlevel < 0)
+		nih_free (nih_error_get ());
+
+	if (savedlevel != prevlevel) {
+		wtmp_write (wtmp_file, records, 2);
+	} else {
+		wtmp_write (wtmp_file, &records[1], 1);
+	}
 
 	return ret;
 }
@@ -233,7 +311,7 @@ utmp_write_shutdown (const char *utmp_file,
 	utmp_entry (&utmp, SHUTDOWN_TIME, 0, NULL, NULL, NULL);
 
 	ret = utmp_write (utmp_file, &utmp);
-	wtmp_write (wtmp_file, &utmp);
+	wtmp_write (wtmp_file, &utmp, 1);
 
 	return ret;
 }
@@ -349,16 +427,82 @@ utmp_write (const char *        utmp_file,
 /**
  * wtmp_write:
  * @wtmp_file: wtmp file to write to,
- * @utmp: utmp entry to write.
+ * @utmp: utmp entries to write,
+ * @n: number of entries in @utmp.
  *
- * Write the utmp entry @utmp to @wtmp_file, or /var/log/wtmp if @utmp_file
- * is NULL.
+ * Append the @n utmp entries @utmp to @wtmp_file, or /var/log/wtmp if
+ * @wtmp_file is NULL, with a single write while the file is locked.
+ * Any partial record already at the end of the file is truncated away
+ * first, and should the write be incomplete, the file is truncated to
+ * its previous length so that it never holds a partial record.
+ *
+ * Should the lock not be taken within WTMP_LOCK_TIMEOUT seconds, the
+ * entries are not written.
+ *
+ * Errors are ignored.
  **/
 static void
 wtmp_write (const char *        wtmp_file,
-	    const struct utmpx *utmp)
+	    const struct utmpx *utmp,
+	    size_t              n)
 {
+	struct flock lock;
+	struct stat  statbuf;
+	off_t        offset;
+	size_t       len;
+	int          fd;
+	int          tries;
+
 	nih_assert (utmp != NULL);
+	nih_assert (n > 0);
+
+	fd = open (wtmp_file ?: _PATH_WTMPX, O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	memset (&lock, 0, sizeof lock);
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+
+	tries = WTMP_LOCK_TIMEOUT * (1000000 / WTMP_LOCK_INTERVAL);
+	while (fcntl (fd, F_SETLK, &lock) < 0) {
+		if (((errno != EACCES) && (errno != EAGAIN)
+		     && (errno != EINTR))
+		    || (--tries <= 0)) {
+			nih_debug ("Unable to lock %s",
+				   wtmp_file ?: _PATH_WTMPX);
+			close (fd);
+			return;
+		}
+
+		usleep (WTMP_LOCK_INTERVAL);
+	}
+
+	len = n * sizeof (struct utmpx);
+
+	/* Drop any partial record left by an earlier writer, otherwise
+	 * every record we append would be misaligned.
+	 */
+	offset = -1;
+	if (fstat (fd, &statbuf) == 0) {
+		offset = statbuf.st_size - statbuf.st_size % sizeof (struct utmpx);
+		if ((offset != statbuf.st_size)
+		    && (ftruncate (fd, offset) < 0))
+			offset = -1;
+	}
+
+	if (offset >= 0) {
+		ssize_t ret;
+
+		ret = write (fd, utmp, len);
+		if ((ret > 0) && ((size_t)ret != len)
+		    && (ftruncate (fd, offset) < 0))
+			nih_debug ("Partial record left in %s",
+				   wtmp_file ?: _PATH_WTMPX);
+	}
+
+	lock.l_type = F_UNLCK;
+	fcntl (fd, F_SETLK, &lock);
 
-	updwtmpx (wtmp_file ?: _PATH_WTMPX, utmp);
+	close (fd);
 }